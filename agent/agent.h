@@ -99,6 +99,10 @@ struct
      upon this timeout value.  */
   unsigned long pinentry_timeout;
 
+  /* If not 0 an idle Pinentry is kept for this many seconds so that
+     it can be reused for the next request.  */
+  unsigned long pinentry_keep_alive;
+
   /* The default and maximum TTL of cache entries. */
   unsigned long def_cache_ttl;     /* Default. */
   unsigned long def_cache_ttl_ssh; /* for SSH. */
@@ -138,6 +142,10 @@ struct
      for signing operations.  */
   int ignore_cache_for_signing;
 
+  /* If this global option is true, unprotected keys are cached as
+     long as their passphrase is cached.  */
+  int cache_unprotected_keys;
+
   /* If this global option is true, the user is allowed to
      interactively mark certificate in trustlist.txt as trusted. */
   int allow_mark_trusted;
@@ -180,6 +188,15 @@ struct
   /* The value of the option --s2k-count.  If this option is not given
    * or 0 an auto-calibrated value is used.  */
   unsigned long s2k_count;
+
+  /* If true the calibrated S2K count is stored in the homedir and
+   * reused as long as the hardware did not change.  */
+  int s2k_calibration_cache;
+
+  /* The number of RSA keys of RSA_POOL_BITS to pre-generate in the
+   * background.  0 disables the pool.  */
+  unsigned int rsa_pool_size;
+  unsigned int rsa_pool_bits;
 } opt;
 
 
@@ -378,10 +395,13 @@ void agent_exit (int rc)
 void agent_set_progress_cb (void (*cb)(ctrl_t ctrl, const char *what,
                                        int printchar, int current, int total),
                             ctrl_t ctrl);
+int agent_release_lock (void);
+void agent_reacquire_lock (void);
 gpg_error_t agent_copy_startup_env (ctrl_t ctrl);
 const char *get_agent_socket_name (void);
 const char *get_agent_ssh_socket_name (void);
 int get_agent_active_connection_count (void);
+char *get_agent_connection_pool_stats (void);
 #ifdef HAVE_W32_SYSTEM
 void *get_agent_scd_notify_event (void);
 #endif
@@ -398,6 +418,20 @@ gpg_error_t agent_print_status (ctrl_t ctrl, const char *keyword,
      GPGRT_ATTR_PRINTF(3,4);
 void bump_key_eventcounter (void);
 void bump_card_eventcounter (void);
+void get_eventcounters (unsigned int *r_key, unsigned int *r_card,
+                        unsigned int *r_maybe_key_change);
+enum agent_stats_ops
+  {
+    STATS_PKSIGN,
+    STATS_PKDECRYPT,
+    STATS_GET_PASSPHRASE,
+    STATS_PINENTRY,
+    STATS_SCDAEMON,
+    STATS_LAST_OP
+  };
+void agent_stats_update (enum agent_stats_ops op,
+                         const struct timespec *started);
+void agent_stats_cache (int hit);
 void start_command_handler (ctrl_t, gnupg_fd_t, gnupg_fd_t);
 gpg_error_t pinentry_loopback (ctrl_t, const char *keyword,
                                unsigned char **buffer, size_t *size,
@@ -425,6 +459,13 @@ gpg_error_t ssh_search_control_file (ssh_control_file_t cf,
 void start_command_handler_ssh (ctrl_t, gnupg_fd_t);
 
 /*-- findkey.c --*/
+void initialize_module_findkey (void);
+void agent_ukey_cache_housekeeping (int all);
+void agent_pkey_cache_flush (void);
+void agent_keydir_set_watched (int yes);
+void agent_keydir_changed (void);
+gpg_error_t agent_list_keygrips (unsigned char **r_grips,
+                                 unsigned int *r_count);
 gpg_error_t agent_modify_description (const char *in, const char *comment,
                                       const gcry_sexp_t key, char **result);
 int agent_write_private_key (const unsigned char *grip,
@@ -458,6 +499,7 @@ gpg_error_t agent_delete_key (ctrl_t ctrl, const char *desc_text,
 void initialize_module_call_pinentry (void);
 void agent_query_dump_state (void);
 void agent_reset_query (ctrl_t ctrl);
+void agent_pinentry_housekeeping (void);
 int pinentry_active_p (ctrl_t ctrl, int waitseconds);
 gpg_error_t agent_askpin (ctrl_t ctrl,
                           const char *desc_text, const char *prompt_text,
@@ -485,7 +527,16 @@ void agent_flush_cache (int pincache_only);
 int agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
                      const char *data, int ttl);
 char *agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode);
+int agent_cache_has_item (const char *key, cache_mode_t cache_mode,
+                          int restricted);
 void agent_store_cache_hit (const char *key);
+int agent_get_kek_cache (const char *passphrase, int hashalgo, int s2kmode,
+                         const unsigned char *s2ksalt, unsigned long s2kcount,
+                         unsigned char *key, size_t keylen);
+void agent_put_kek_cache (const char *passphrase, int hashalgo, int s2kmode,
+                          const unsigned char *s2ksalt,
+                          unsigned long s2kcount,
+                          const unsigned char *key, size_t keylen);
 
 
 /*-- pksign.c --*/
@@ -497,6 +548,10 @@ gpg_error_t agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
 gpg_error_t agent_pksign (ctrl_t ctrl, const char *cache_nonce,
                           const char *desc_text,
                           membuf_t *outbuf, cache_mode_t cache_mode);
+gpg_error_t agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce,
+                                const char *desc_text,
+                                const unsigned char *hashes, size_t nhashes,
+                                membuf_t *outbuf, cache_mode_t cache_mode);
 
 /*-- pkdecrypt.c --*/
 int agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
@@ -508,6 +563,7 @@ int check_passphrase_constraints (ctrl_t ctrl, const char *pw,
 				  char **failed_constraint);
 gpg_error_t agent_ask_new_passphrase (ctrl_t ctrl, const char *prompt,
                                       char **r_passphrase);
+void agent_rsa_pool_refill (void);
 int agent_genkey (ctrl_t ctrl, const char *cache_nonce,
                   const char *keyparam, size_t keyparmlen,
                   int no_protection, const char *override_passphrase,
@@ -518,6 +574,9 @@ gpg_error_t agent_protect_and_store (ctrl_t ctrl, gcry_sexp_t s_skey,
 /*-- protect.c --*/
 void set_s2k_calibration_time (unsigned int milliseconds);
 unsigned long get_calibrated_s2k_count (void);
+int load_s2k_calibration (void);
+unsigned long compute_s2k_calibration (void);
+void set_calibrated_s2k_count (unsigned long count);
 unsigned long get_standard_s2k_count (void);
 unsigned char get_standard_s2k_count_rfc4880 (void);
 unsigned long get_standard_s2k_time (void);
@@ -577,6 +636,7 @@ gpg_error_t divert_writekey (ctrl_t ctrl, int force, const char *serialno,
 /*-- call-scd.c --*/
 void initialize_module_call_scd (void);
 void agent_scd_dump_state (void);
+char *agent_scd_pool_stats (void);
 int agent_scd_check_running (void);
 int agent_reset_scd (ctrl_t ctrl);
 int agent_card_learn (ctrl_t ctrl,
@@ -56,23 +56,72 @@ struct secret_data_s {
 /* The cache object.  */
 typedef struct cache_item_s *ITEM;
 struct cache_item_s {
-  ITEM next;
+  ITEM next;        /* Next item in the same bucket.  */
   time_t created;
   time_t accessed;  /* Not updated for CACHE_MODE_DATA */
   int ttl;  /* max. lifetime given in seconds, -1 one means infinite */
   struct secret_data_s *pw;
   cache_mode_t cache_mode;
   int restricted;  /* The value of ctrl->restricted is part of the key.  */
+  time_t deadline;  /* Time housekeeping needs to look at this item.  */
+  int heapidx;      /* Index into EXPIRY_HEAP or -1 if not on the heap.  */
   char key[1];
 };
 
+/* Number of buckets for the hash array.  All items with the same key
+ * are in the same bucket; the newest items come first.  */
+#define NO_OF_CACHE_BUCKETS 1021
+
 /* The cache himself.  */
-static ITEM thecache;
+static ITEM cachebuckets[NO_OF_CACHE_BUCKETS];
+
+/* A binary min-heap of all items which will eventually be expired or
+ * removed.  The heap is ordered by the DEADLINE of the items so that
+ * housekeeping only needs to look at the items due.  */
+static ITEM *expiry_heap;
+static int expiry_heap_used;
+static int expiry_heap_size;
+
+/* The values of the max-cache-ttl options used to compute the
+ * deadlines.  If they change the heap is rebuilt.  */
+static unsigned long heap_max_cache_ttl;
+static unsigned long heap_max_cache_ttl_ssh;
+
+/* Set if an item could not be put onto the heap.  */
+static int heap_needs_rebuild;
 
 /* NULL or the last cache key stored by agent_store_cache_hit.  */
 static char *last_stored_cache_key;
 
 
+/* The maximum number of items in the KEK cache.  If this is reached
+ * the least recently used item is removed.  */
+#define KEK_CACHE_MAX 64
+
+/* An item of the cache of keys derived from a passphrase by the S2K.
+ * Unprotecting a key runs the deliberately slow S2K even if the
+ * passphrase is cached; this cache stores the result.  An item is
+ * looked up by an HMAC over the S2K parameters and the passphrase
+ * and can thus only be used by a caller knowing the passphrase.  The
+ * derived key is stored encrypted like the passphrases and expires
+ * according to the TTLs of CACHE_MODE_NORMAL.  */
+struct kek_item_s
+{
+  struct kek_item_s *next;
+  unsigned char tag[32];       /* The HMAC-SHA256 to look up the item.  */
+  time_t created;
+  time_t accessed;
+  struct secret_data_s *kek;   /* The hex encoded key.  */
+};
+typedef struct kek_item_s *kek_item_t;
+
+/* The list of derived keys, the most recently used first.  */
+static kek_item_t kek_cache;
+
+/* The random key used for the HMAC or NULL if not yet created.  */
+static unsigned char *kek_tag_key;
+
+
 /* This function must be called once to initialize this module. It
    has to be done before a second thread is spawned.  */
 void
@@ -194,78 +243,306 @@ new_data (const char *string, struct secret_data_s **r_data)
 
 
 
-/* Check whether there are items to expire.  */
-static void
-housekeeping (void)
+/* The hash function we use for the cache keys.  */
+static inline unsigned int
+hash_key (const char *key)
 {
-  ITEM r, rprev;
-  time_t current = gnupg_get_time ();
+  const unsigned char *s = (const unsigned char*)key;
+  u32 hashval = 0;
+  u32 carry;
 
-  /* First expire the actual data */
-  for (r=thecache; r; r = r->next)
+  for (; *s; s++)
     {
-      if (r->cache_mode == CACHE_MODE_PIN)
-        ; /* Don't let it expire - scdaemon explicitly flushes them.  */
-      else if (r->pw && r->ttl >= 0 && r->accessed + r->ttl < current)
+      hashval = (hashval << 4) + *s;
+      if ((carry = (hashval & 0xf0000000)))
         {
-          if (DBG_CACHE)
-            log_debug ("  expired '%s'.%d (%ds after last access)\n",
-                       r->key, r->restricted, r->ttl);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = current;
+          hashval ^= (carry >> 24);
+          hashval ^= carry;
         }
     }
 
-  /* Second, make sure that we also remove them based on the created
-   * stamp so that the user has to enter it from time to time.  We
-   * don't do this for data items which are used to storage secrets in
-   * meory and are not user entered passphrases etc.  */
-  for (r=thecache; r; r = r->next)
+  return hashval % NO_OF_CACHE_BUCKETS;
+}
+
+
+/* Return the time at which housekeeping needs to act on item R or
+ * (time_t)(-1) if this will never happen.  This must match the rules
+ * implemented by housekeeping_item.  */
+static time_t
+compute_deadline (ITEM r)
+{
+  time_t deadline = (time_t)(-1);
+  time_t t;
+  unsigned long maxttl;
+
+  if (r->pw)
     {
-      unsigned long maxttl;
+      if (r->cache_mode != CACHE_MODE_PIN && r->ttl >= 0)
+        deadline = r->accessed + r->ttl + 1;
 
       switch (r->cache_mode)
         {
         case CACHE_MODE_DATA:
         case CACHE_MODE_PIN:
-          continue;  /* No MAX TTL here.  */
+          return deadline;  /* No MAX TTL here.  */
         case CACHE_MODE_SSH: maxttl = opt.max_cache_ttl_ssh; break;
         default: maxttl = opt.max_cache_ttl; break;
         }
-      if (r->pw && r->created + maxttl < current)
+      t = r->created + maxttl + 1;
+      if (deadline == (time_t)(-1) || t < deadline)
+        deadline = t;
+    }
+  else if (r->ttl >= 0)
+    deadline = r->accessed + 60*30 + 1;
+
+  return deadline;
+}
+
+
+static void
+heap_swap (int a, int b)
+{
+  ITEM tmp = expiry_heap[a];
+
+  expiry_heap[a] = expiry_heap[b];
+  expiry_heap[b] = tmp;
+  expiry_heap[a]->heapidx = a;
+  expiry_heap[b]->heapidx = b;
+}
+
+
+/* Restore the heap property for the item at heap index IDX.  */
+static void
+heap_fixup (int idx)
+{
+  int child;
+
+  while (idx > 0
+         && expiry_heap[idx]->deadline < expiry_heap[(idx-1)/2]->deadline)
+    {
+      heap_swap (idx, (idx-1)/2);
+      idx = (idx-1)/2;
+    }
+
+  for (;;)
+    {
+      child = 2*idx + 1;
+      if (child >= expiry_heap_used)
+        break;
+      if (child + 1 < expiry_heap_used
+          && expiry_heap[child+1]->deadline < expiry_heap[child]->deadline)
+        child++;
+      if (expiry_heap[idx]->deadline <= expiry_heap[child]->deadline)
+        break;
+      heap_swap (idx, child);
+      idx = child;
+    }
+}
+
+
+static void
+heap_remove (ITEM r)
+{
+  int idx = r->heapidx;
+
+  if (idx < 0)
+    return;
+  r->heapidx = -1;
+  expiry_heap_used--;
+  if (idx != expiry_heap_used)
+    {
+      expiry_heap[idx] = expiry_heap[expiry_heap_used];
+      expiry_heap[idx]->heapidx = idx;
+      heap_fixup (idx);
+    }
+}
+
+
+/* Recompute the deadline of item R and move it to the right place on
+ * the expiry heap.  This needs to be called after any change to the
+ * item.  */
+static void
+update_deadline (ITEM r)
+{
+  r->deadline = compute_deadline (r);
+  if (r->deadline == (time_t)(-1))
+    {
+      heap_remove (r);
+      return;
+    }
+
+  if (r->heapidx < 0)
+    {
+      if (expiry_heap_used == expiry_heap_size)
         {
-          if (DBG_CACHE)
-            log_debug ("  expired '%s'.%d (%lus after creation)\n",
-                       r->key, r->restricted, opt.max_cache_ttl);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = current;
+          int newsize = expiry_heap_size? 2*expiry_heap_size : 64;
+          ITEM *tmp = xtryrealloc (expiry_heap, newsize * sizeof *tmp);
+
+          if (!tmp)
+            {
+              /* Keep the item out of the heap; it will be considered
+               * again by a full rebuild.  */
+              log_error ("error enlarging cache heap: %s\n",
+                         gpg_strerror (gpg_error_from_syserror ()));
+              heap_needs_rebuild = 1;
+              return;
+            }
+          expiry_heap = tmp;
+          expiry_heap_size = newsize;
         }
+      r->heapidx = expiry_heap_used++;
+      expiry_heap[r->heapidx] = r;
+    }
+  heap_fixup (r->heapidx);
+}
+
+
+/* Recompute the deadlines of all items.  This is required if the
+ * max-cache-ttl options have changed.  */
+static void
+rebuild_heap (void)
+{
+  ITEM r;
+  int bidx;
+
+  heap_max_cache_ttl = opt.max_cache_ttl;
+  heap_max_cache_ttl_ssh = opt.max_cache_ttl_ssh;
+  heap_needs_rebuild = 0;
+  for (bidx=0; bidx < NO_OF_CACHE_BUCKETS; bidx++)
+    for (r = cachebuckets[bidx]; r; r = r->next)
+      update_deadline (r);
+}
+
+
+/* Remove the item R from the cache and release it.  */
+static void
+remove_item (ITEM r)
+{
+  ITEM *rp;
+
+  for (rp = &cachebuckets[hash_key (r->key)]; *rp; rp = &(*rp)->next)
+    if (*rp == r)
+      {
+        *rp = r->next;
+        break;
+      }
+  heap_remove (r);
+  release_data (r->pw);
+  xfree (r);
+}
+
+
+/* Apply the expiration rules to item R.  Returns true if R has been
+ * removed from the cache.  */
+static int
+housekeeping_item (ITEM r, time_t current)
+{
+  unsigned long maxttl;
+
+  /* First expire the actual data */
+  if (r->cache_mode == CACHE_MODE_PIN)
+    ; /* Don't let it expire - scdaemon explicitly flushes them.  */
+  else if (r->pw && r->ttl >= 0 && r->accessed + r->ttl < current)
+    {
+      if (DBG_CACHE)
+        log_debug ("  expired '%s'.%d (%ds after last access)\n",
+                   r->key, r->restricted, r->ttl);
+      release_data (r->pw);
+      r->pw = NULL;
+      r->accessed = current;
+    }
+
+  /* Second, make sure that we also remove them based on the created
+   * stamp so that the user has to enter it from time to time.  We
+   * don't do this for data items which are used to storage secrets in
+   * meory and are not user entered passphrases etc.  */
+  switch (r->cache_mode)
+    {
+    case CACHE_MODE_DATA:
+    case CACHE_MODE_PIN:
+      maxttl = 0;
+      break;
+    case CACHE_MODE_SSH: maxttl = opt.max_cache_ttl_ssh; break;
+    default: maxttl = opt.max_cache_ttl; break;
+    }
+  if (r->cache_mode == CACHE_MODE_DATA || r->cache_mode == CACHE_MODE_PIN)
+    ; /* No MAX TTL here.  */
+  else if (r->pw && r->created + maxttl < current)
+    {
+      if (DBG_CACHE)
+        log_debug ("  expired '%s'.%d (%lus after creation)\n",
+                   r->key, r->restricted, opt.max_cache_ttl);
+      release_data (r->pw);
+      r->pw = NULL;
+      r->accessed = current;
     }
 
   /* Third, make sure that we don't have too many items in the list.
    * Expire old and unused entries after 30 minutes.  */
-  for (rprev=NULL, r=thecache; r; )
+  if (!r->pw && r->ttl >= 0 && r->accessed + 60*30 < current)
     {
-      if (!r->pw && r->ttl >= 0 && r->accessed + 60*30 < current)
+      if (DBG_CACHE)
+        log_debug ("  removed '%s'.%d (mode %d) (slot not used for 30m)\n",
+                   r->key, r->restricted, r->cache_mode);
+      remove_item (r);
+      return 1;
+    }
+
+  update_deadline (r);
+  return 0;
+}
+
+
+/* Check whether there are items to expire.  Only the items whose
+ * deadline has been reached are looked at.  */
+static void
+housekeeping (void)
+{
+  time_t current = gnupg_get_time ();
+  ITEM r;
+
+  if (heap_needs_rebuild
+      || heap_max_cache_ttl != opt.max_cache_ttl
+      || heap_max_cache_ttl_ssh != opt.max_cache_ttl_ssh)
+    rebuild_heap ();
+
+  while (expiry_heap_used && expiry_heap[0]->deadline <= current)
+    {
+      r = expiry_heap[0];
+      if (!housekeeping_item (r, current) && r->deadline <= current)
         {
-          ITEM r2 = r->next;
-          if (DBG_CACHE)
-            log_debug ("  removed '%s'.%d (mode %d) (slot not used for 30m)\n",
-                       r->key, r->restricted, r->cache_mode);
-          xfree (r);
-          if (!rprev)
-            thecache = r2;
-          else
-            rprev->next = r2;
-          r = r2;
+          /* Not expected: the rules did not change the item.  Take it
+           * off the heap to avoid an endless loop.  */
+          heap_remove (r);
         }
-      else
+    }
+}
+
+
+/* Remove all expired items from the KEK cache; with FLUSH_ALL set
+ * all items are removed.  The caller must hold CACHE_LOCK.  */
+static void
+kek_housekeeping (int flush_all)
+{
+  time_t current = gnupg_get_time ();
+  kek_item_t item, prev, next;
+
+  for (prev = NULL, item = kek_cache; item; item = next)
+    {
+      next = item->next;
+      if (!flush_all
+          && item->accessed + opt.def_cache_ttl >= current
+          && item->created + opt.max_cache_ttl >= current)
         {
-          rprev = r;
-          r = r->next;
+          prev = item;
+          continue;
         }
+      if (prev)
+        prev->next = next;
+      else
+        kek_cache = next;
+      release_data (item->kek);
+      xfree (item);
     }
 }
 
@@ -283,6 +560,7 @@ agent_cache_housekeeping (void)
     log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
 
   housekeeping ();
+  kek_housekeeping (0);
 
   res = npth_mutex_unlock (&cache_lock);
   if (res)
@@ -295,6 +573,7 @@ agent_flush_cache (int pincache_only)
 {
   ITEM r;
   int res;
+  int bidx;
 
   if (DBG_CACHE)
     log_debug ("agent_flush_cache%s\n", pincache_only?" (pincache only)":"");
@@ -303,19 +582,23 @@ agent_flush_cache (int pincache_only)
   if (res)
     log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
 
-  for (r=thecache; r; r = r->next)
-    {
-      if (pincache_only && r->cache_mode != CACHE_MODE_PIN)
-        continue;
-      if (r->pw)
-        {
-          if (DBG_CACHE)
-            log_debug ("  flushing '%s'.%d\n", r->key, r->restricted);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = 0;
-        }
-    }
+  for (bidx=0; bidx < NO_OF_CACHE_BUCKETS; bidx++)
+    for (r = cachebuckets[bidx]; r; r = r->next)
+      {
+        if (pincache_only && r->cache_mode != CACHE_MODE_PIN)
+          continue;
+        if (r->pw)
+          {
+            if (DBG_CACHE)
+              log_debug ("  flushing '%s'.%d\n", r->key, r->restricted);
+            release_data (r->pw);
+            r->pw = NULL;
+            r->accessed = 0;
+            update_deadline (r);
+          }
+      }
+  if (!pincache_only)
+    kek_housekeeping (1);
 
   res = npth_mutex_unlock (&cache_lock);
   if (res)
@@ -373,7 +656,7 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
   if ((!ttl && data) || cache_mode == CACHE_MODE_IGNORE)
     goto out;
 
-  for (r=thecache; r; r = r->next)
+  for (r = cachebuckets[hash_key (key)]; r; r = r->next)
     {
       if (cache_mode == CACHE_MODE_PIN && data)
         {
@@ -411,6 +694,7 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
           if (err)
             log_error ("error replacing cache item: %s\n", gpg_strerror (err));
         }
+      update_deadline (r);
     }
   else if (data) /* Insert.  */
     {
@@ -424,13 +708,17 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
           r->created = r->accessed = gnupg_get_time ();
           r->ttl = ttl;
           r->cache_mode = cache_mode;
+          r->heapidx = -1;
           err = new_data (data, &r->pw);
           if (err)
             xfree (r);
           else
             {
-              r->next = thecache;
-              thecache = r;
+              unsigned int bidx = hash_key (key);
+
+              r->next = cachebuckets[bidx];
+              cachebuckets[bidx] = r;
+              update_deadline (r);
             }
         }
       if (err)
@@ -480,7 +768,7 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
                last_stored? " (stored cache key)":"");
   housekeeping ();
 
-  for (r=thecache; r; r = r->next)
+  for (r = cachebuckets[hash_key (key)]; r; r = r->next)
     {
       if (cache_mode == CACHE_MODE_PIN)
         yes = (r->pw && !strcmp (r->key, key));
@@ -500,7 +788,10 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
            * below.  Note also that we don't update the accessed time
            * for data items.  */
           if (r->cache_mode != CACHE_MODE_DATA)
-            r->accessed = gnupg_get_time ();
+            {
+              r->accessed = gnupg_get_time ();
+              update_deadline (r);
+            }
           if (DBG_CACHE)
             log_debug ("... hit\n");
           if (r->pw->totallen < 32)
@@ -527,6 +818,7 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
     }
   if (DBG_CACHE && value == NULL)
     log_debug ("... miss\n");
+  agent_stats_cache (!!value);
 
  out:
   res = npth_mutex_unlock (&cache_lock);
@@ -537,6 +829,39 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
 }
 
 
+/* Return true if an item for KEY, CACHE_MODE, and RESTRICTED is in
+   the cache.  In contrast to agent_get_cache this does not decrypt
+   the item and does not update its access time.  */
+int
+agent_cache_has_item (const char *key, cache_mode_t cache_mode,
+                      int restricted)
+{
+  ITEM r;
+  int res;
+  int found = 0;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  housekeeping ();
+  for (r = cachebuckets[hash_key (key)]; r; r = r->next)
+    if (r->pw && r->restricted == restricted
+        && cache_mode_equal (r->cache_mode, cache_mode)
+        && !strcmp (r->key, key))
+      {
+        found = 1;
+        break;
+      }
+
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+
+  return found;
+}
+
+
 /* Store the key for the last successful cache hit.  That value is
    used by agent_get_cache if the requested KEY is given as NULL.
    NULL may be used to remove that key. */
@@ -569,3 +894,186 @@ agent_store_cache_hit (const char *key)
 
   xfree (old);
 }
+
+
+/* Compute the HMAC to look up the key of length KEYLEN derived from
+ * PASSPHRASE using the S2K parameters HASHALGO, S2KMODE, S2KSALT,
+ * and S2KCOUNT and store it at the 32 byte buffer TAG.  The caller
+ * must hold CACHE_LOCK.  */
+static gpg_error_t
+kek_tag (const char *passphrase, int hashalgo, int s2kmode,
+         const unsigned char *s2ksalt, unsigned long s2kcount,
+         size_t keylen, unsigned char *tag)
+{
+  gpg_error_t err;
+  gcry_md_hd_t md;
+  unsigned char buf[2+8+4+4];
+
+  if (!kek_tag_key)
+    {
+      kek_tag_key = gcry_random_bytes_secure (32, GCRY_STRONG_RANDOM);
+      if (!kek_tag_key)
+        return gpg_error_from_syserror ();
+    }
+
+  err = gcry_md_open (&md, GCRY_MD_SHA256,
+                      GCRY_MD_FLAG_HMAC | GCRY_MD_FLAG_SECURE);
+  if (err)
+    return err;
+  err = gcry_md_setkey (md, kek_tag_key, 32);
+  if (err)
+    {
+      gcry_md_close (md);
+      return err;
+    }
+  buf[0] = hashalgo;
+  buf[1] = s2kmode;
+  memcpy (buf+2, s2ksalt, 8);
+  buf[10] = s2kcount >> 24;
+  buf[11] = s2kcount >> 16;
+  buf[12] = s2kcount >> 8;
+  buf[13] = s2kcount;
+  buf[14] = keylen >> 24;
+  buf[15] = keylen >> 16;
+  buf[16] = keylen >> 8;
+  buf[17] = keylen;
+  gcry_md_write (md, buf, sizeof buf);
+  gcry_md_write (md, passphrase, strlen (passphrase));
+  memcpy (tag, gcry_md_read (md, 0), 32);
+  gcry_md_close (md);
+  return 0;
+}
+
+
+/* Look up the key of length KEYLEN derived from PASSPHRASE using the
+ * S2K parameters HASHALGO, S2KMODE, S2KSALT, and S2KCOUNT in the KEK
+ * cache.  On a hit the key is stored at KEY and true is returned.  */
+int
+agent_get_kek_cache (const char *passphrase, int hashalgo, int s2kmode,
+                     const unsigned char *s2ksalt, unsigned long s2kcount,
+                     unsigned char *key, size_t keylen)
+{
+  unsigned char tag[32];
+  kek_item_t item, prev;
+  char *value = NULL;
+  int hit = 0;
+  int res;
+
+  if (!kek_cache)
+    return 0;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  kek_housekeeping (0);
+  if (kek_tag (passphrase, hashalgo, s2kmode, s2ksalt, s2kcount, keylen, tag))
+    goto out;
+  for (prev = NULL, item = kek_cache; item; prev = item, item = item->next)
+    if (!memcmp (item->tag, tag, 32))
+      break;
+  if (!item)
+    goto out;
+
+  if (item->kek->totallen >= 32
+      && !init_encryption ()
+      && (value = xtrymalloc_secure (item->kek->totallen - 8))
+      && !gcry_cipher_decrypt (encryption_handle,
+                               value, item->kek->totallen - 8,
+                               item->kek->data, item->kek->totallen)
+      && strlen (value) == 2*keylen
+      && hex2bin (value, key, keylen) == 2*keylen)
+    {
+      hit = 1;
+      item->accessed = gnupg_get_time ();
+      if (prev)  /* Move to the front.  */
+        {
+          prev->next = item->next;
+          item->next = kek_cache;
+          kek_cache = item;
+        }
+    }
+  if (value)
+    {
+      wipememory (value, item->kek->totallen - 8);
+      xfree (value);
+    }
+
+ out:
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+
+  if (DBG_CACHE)
+    log_debug ("agent_get_kek_cache ... %s\n", hit? "hit":"miss");
+  return hit;
+}
+
+
+/* Store the KEY of length KEYLEN derived from PASSPHRASE using the
+ * S2K parameters HASHALGO, S2KMODE, S2KSALT, and S2KCOUNT in the KEK
+ * cache.  Errors are ignored because the cache is only an
+ * optimization.  */
+void
+agent_put_kek_cache (const char *passphrase, int hashalgo, int s2kmode,
+                     const unsigned char *s2ksalt, unsigned long s2kcount,
+                     const unsigned char *key, size_t keylen)
+{
+  kek_item_t item, prev, tmp;
+  char *hexkey;
+  unsigned int count;
+  int res;
+
+  if (!opt.def_cache_ttl || !opt.max_cache_ttl)
+    return;
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    return;
+  hexkey = xtrymalloc_secure (2*keylen + 1);
+  if (!hexkey)
+    {
+      xfree (item);
+      return;
+    }
+  bin2hex (key, keylen, hexkey);
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  if (kek_tag (passphrase, hashalgo, s2kmode, s2ksalt, s2kcount, keylen,
+               item->tag)
+      || new_data (hexkey, &item->kek))
+    {
+      xfree (item);
+      goto out;
+    }
+  item->created = item->accessed = gnupg_get_time ();
+
+  /* Insert the item at the front, remove an older item with the same
+   * tag and limit the size of the cache.  */
+  item->next = kek_cache;
+  kek_cache = item;
+  for (count=1, prev=item; (tmp = prev->next); )
+    {
+      if (!memcmp (tmp->tag, item->tag, 32) || count >= KEK_CACHE_MAX)
+        {
+          prev->next = tmp->next;
+          release_data (tmp->kek);
+          xfree (tmp);
+        }
+      else
+        {
+          count++;
+          prev = tmp;
+        }
+    }
+
+ out:
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+  wipememory (hexkey, 2*keylen);
+  xfree (hexkey);
+}
@@ -55,6 +55,21 @@
 /* The assuan context of the current pinentry. */
 static assuan_context_t entry_ctx;
 
+/* A string describing the program and environment of the current
+ * pinentry; used to decide whether it may be reused.  */
+static char *entry_envkey;
+
+/* Set if the current pinentry must not be kept for reuse.  */
+static int entry_no_reuse;
+
+/* With --pinentry-keep-alive the pinentry is not terminated after a
+ * request but kept here for reuse; IDLE_SINCE is the time it was put
+ * here and IDLE_ENVKEY the ENTRY_ENVKEY it was started with.  These
+ * variables are only accessed while holding ENTRY_LOCK.  */
+static assuan_context_t idle_ctx;
+static time_t idle_since;
+static char *idle_envkey;
+
 /* A list of features of the current pinentry.  */
 static struct
 {
@@ -69,6 +84,10 @@ static struct
 /* A mutex used to serialize access to the pinentry. */
 static npth_mutex_t entry_lock;
 
+/* The time the current holder of ENTRY_LOCK started to wait for it.
+ * Only valid while the lock is held.  */
+static struct timespec entry_started;
+
 /* The thread ID of the popup working thread. */
 static npth_t  popup_tid;
 
@@ -119,6 +138,10 @@ agent_query_dump_state (void)
 {
   log_info ("agent_query_dump_state: entry_ctx=%p pid=%ld popup_tid=%p\n",
             entry_ctx, (long)assuan_get_pid (entry_ctx), (void*)popup_tid);
+  if (idle_ctx)
+    log_info ("agent_query_dump_state: idle_ctx=%p pid=%ld since=%lu\n",
+              idle_ctx, (long)assuan_get_pid (idle_ctx),
+              (unsigned long)idle_since);
 }
 
 /* Called to make sure that a popup window owned by the current
@@ -141,6 +164,7 @@ static gpg_error_t
 unlock_pinentry (ctrl_t ctrl, gpg_error_t rc)
 {
   assuan_context_t ctx = entry_ctx;
+  int keep;
   int err;
 
   if (rc)
@@ -178,6 +202,26 @@ unlock_pinentry (ctrl_t ctrl, gpg_error_t rc)
   if (--ctrl->pinentry_active == 0)
     {
       entry_ctx = NULL;
+
+      /* Keep the pinentry for the next request unless it has been
+       * killed or the error indicates a problem with the pinentry
+       * itself.  */
+      keep = (opt.pinentry_keep_alive && entry_envkey && !entry_no_reuse
+              && !idle_ctx
+              && (!rc || (gpg_err_source (rc) != GPG_ERR_SOURCE_PINENTRY
+                          && gpg_err_code (rc) != GPG_ERR_NO_PIN_ENTRY)));
+      if (keep)
+        {
+          idle_ctx = ctx;
+          idle_envkey = entry_envkey;
+          idle_since = gnupg_get_time ();
+          ctx = NULL;
+        }
+      else
+        xfree (entry_envkey);
+      entry_envkey = NULL;
+
+      agent_stats_update (STATS_PINENTRY, &entry_started);
       err = npth_mutex_unlock (&entry_lock);
       if (err)
         {
@@ -185,12 +229,81 @@ unlock_pinentry (ctrl_t ctrl, gpg_error_t rc)
           if (!rc)
             rc = gpg_error_from_errno (err);
         }
-      assuan_release (ctx);
+      if (ctx)
+        assuan_release (ctx);
     }
   return rc;
 }
 
 
+/* Terminate the idle pinentry.  The caller must hold ENTRY_LOCK.  */
+static void
+release_idle_pinentry (void)
+{
+  if (idle_ctx)
+    {
+      if (DBG_IPC)
+        log_debug ("terminating the idle PIN Entry\n");
+      assuan_release (idle_ctx);
+      idle_ctx = NULL;
+    }
+  xfree (idle_envkey);
+  idle_envkey = NULL;
+}
+
+
+/* Called by the ticker to terminate an idle pinentry once the time
+ * given by --pinentry-keep-alive has elapsed.  */
+void
+agent_pinentry_housekeeping (void)
+{
+  int err;
+
+  if (!idle_ctx)
+    return;
+  if (npth_mutex_trylock (&entry_lock))
+    return;  /* The pinentry is in use.  */
+
+  if (idle_ctx && (!opt.pinentry_keep_alive
+                   || idle_since + opt.pinentry_keep_alive
+                      <= gnupg_get_time ()))
+    release_idle_pinentry ();
+
+  err = npth_mutex_unlock (&entry_lock);
+  if (err)
+    log_error ("failed to release the entry lock: %s\n", strerror (err));
+}
+
+
+/* Return a malloced string describing the program FULL_PGMNAME and
+ * the environment in which a pinentry would be started for CTRL or
+ * NULL on a memory error.  Two requests with the same string can use
+ * the same pinentry process.  */
+static char *
+make_entry_envkey (ctrl_t ctrl, const char *full_pgmname)
+{
+  membuf_t mb;
+  int iterator = 0;
+  const char *name, *value;
+
+  init_membuf (&mb, 256);
+  put_membuf_str (&mb, full_pgmname);
+  put_membuf (&mb, opt.keep_display? "\n1" : "\n0", 2);
+  while ((name = session_env_list_stdenvnames (&iterator, NULL)))
+    {
+      value = session_env_getenv (ctrl->session_env, name);
+      if (!value)
+        continue;
+      put_membuf (&mb, "\n", 1);
+      put_membuf_str (&mb, name);
+      put_membuf (&mb, "=", 1);
+      put_membuf_str (&mb, value);
+    }
+  put_membuf (&mb, "", 1);
+  return get_membuf (&mb, NULL);
+}
+
+
 /* Helper for at_fork_cb which can also be called by the parent to
  * show shich envvars will be set.  */
 static void
@@ -299,7 +412,9 @@ start_pinentry (ctrl_t ctrl)
   unsigned long pinentry_pid;
   const char *value;
   struct timespec abstime;
+  struct timespec started;
   char *flavor_version;
+  char *envkey;
   int err;
 
   if (ctrl->pinentry_active)
@@ -311,6 +426,7 @@ start_pinentry (ctrl_t ctrl)
     }
 
   npth_clock_gettime (&abstime);
+  started = abstime;
   abstime.tv_sec += LOCK_TIMEOUT;
   err = npth_mutex_timedlock (&entry_lock, &abstime);
   if (err)
@@ -323,13 +439,11 @@ start_pinentry (ctrl_t ctrl)
                  gpg_strerror (rc));
       return rc;
     }
+  entry_started = started;
 
   if (entry_ctx)
     return 0;
 
-  if (opt.verbose)
-    log_info ("starting a new PIN Entry\n");
-
 #ifdef HAVE_W32_SYSTEM
   fflush (stdout);
   fflush (stderr);
@@ -357,6 +471,35 @@ start_pinentry (ctrl_t ctrl)
   else
     pgmname++;
 
+  envkey = make_entry_envkey (ctrl, full_pgmname);
+  if (idle_ctx)
+    {
+      /* Reuse the idle pinentry if it has been started for the same
+       * environment.  The RESET also tells us whether it is still
+       * alive.  */
+      if (opt.pinentry_keep_alive && envkey && !strcmp (envkey, idle_envkey)
+          && idle_since + opt.pinentry_keep_alive > gnupg_get_time ()
+          && !assuan_transact (idle_ctx, "RESET",
+                               NULL, NULL, NULL, NULL, NULL, NULL))
+        {
+          if (opt.verbose)
+            log_info ("reusing the PIN Entry\n");
+          ctx = idle_ctx;
+          idle_ctx = NULL;
+          xfree (idle_envkey);
+          idle_envkey = NULL;
+          entry_envkey = envkey;
+          entry_no_reuse = 0;
+          ctrl->pinentry_active = 1;
+          entry_ctx = ctx;
+          goto setup_options;
+        }
+      release_idle_pinentry ();
+    }
+
+  if (opt.verbose)
+    log_info ("starting a new PIN Entry\n");
+
   /* OS X needs the entire file name in argv[0], so that it can locate
      the resource bundle.  For other systems we stick to the usual
      convention of supplying only the name of the program.  */
@@ -389,11 +532,14 @@ start_pinentry (ctrl_t ctrl)
   if (rc)
     {
       log_error ("can't allocate assuan context: %s\n", gpg_strerror (rc));
+      xfree (envkey);
       return rc;
     }
 
   ctrl->pinentry_active = 1;
   entry_ctx = ctx;
+  entry_envkey = envkey;
+  entry_no_reuse = 0;
 
   /* We don't want to log the pinentry communication to make the logs
      easier to read.  We might want to add a new debug option to enable
@@ -422,6 +568,7 @@ start_pinentry (ctrl_t ctrl)
   if (opt.debug_pinentry)
     atfork_core (ctrl, 1);
 
+ setup_options:
   value = session_env_getenv (ctrl->session_env, "PINENTRY_USER_DATA");
   if (value != NULL)
     {
@@ -1622,6 +1769,9 @@ agent_popup_message_stop (ctrl_t ctrl)
       return;
     }
 
+  /* The pinentry may get killed; thus don't keep it.  */
+  entry_no_reuse = 1;
+
   pid = assuan_get_pid (entry_ctx);
   if (pid == (pid_t)(-1))
     ; /* No pid available can't send a kill. */
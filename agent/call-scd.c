@@ -57,6 +57,8 @@ struct scd_local_s
                              used with this connection. */
   unsigned int in_use: 1; /* CTX is in use.  */
   unsigned int invalid:1; /* CTX is invalid, should be released.  */
+  struct timespec started;  /* Time start_scd was called for the
+                               current use of CTX.  */
 };
 
 
@@ -109,6 +111,38 @@ static assuan_context_t primary_scd_ctx;
    any connection. */
 static int primary_scd_ctx_reusable;
 
+/* The maximum number of reset secondary connections which are kept
+   for reuse by new client connections.  */
+#define SCD_POOL_MAX_IDLE 8
+
+/* The maximum number of requests running at the same time on the
+   SCdaemon.  Further requests are queued in their order of arrival.  */
+#define SCD_POOL_MAX_ACTIVE 16
+
+/* The idle secondary connections.  Protected by START_SCD_LOCK.  */
+static assuan_context_t scd_pool[SCD_POOL_MAX_IDLE];
+static unsigned int scd_pool_nidle;
+
+/* The number of running requests and the tickets used to serve
+   queued requests in FIFO order.  A request takes the next ticket
+   and waits on SCD_POOL_COND until its number is served.  Protected
+   by START_SCD_LOCK.  */
+static unsigned int scd_pool_nactive;
+static unsigned long scd_pool_next_ticket;
+static unsigned long scd_pool_serving;
+static npth_cond_t scd_pool_cond;
+
+/* Statistics shown by GETINFO scd_pool.  */
+static struct
+{
+  unsigned long requests;  /* Number of requests.  */
+  unsigned long waits;     /* Number of requests which had to wait.  */
+  unsigned long wait_ms;   /* Total wait time in milliseconds.  */
+  unsigned long max_wait_ms; /* Longest wait time in milliseconds.  */
+  unsigned long reused;    /* Connections taken from the pool.  */
+  unsigned long connects;  /* New secondary connections.  */
+} scd_pool_stats;
+
 
 
 /* Local prototypes.  */
@@ -131,6 +165,9 @@ initialize_module_call_scd (void)
       err = npth_mutex_init (&start_scd_lock, NULL);
       if (err)
         log_fatal ("error initializing mutex: %s\n", strerror (err));
+      err = npth_cond_init (&scd_pool_cond, NULL);
+      if (err)
+        log_fatal ("error initializing condition: %s\n", strerror (err));
       initialized = 1;
     }
 }
@@ -147,6 +184,74 @@ agent_scd_dump_state (void)
             primary_scd_ctx_reusable);
   if (socket_name)
     log_info ("agent_scd_dump_state: socket='%s'\n", socket_name);
+  log_info ("agent_scd_dump_state: idle=%u active=%u queued=%lu\n",
+            scd_pool_nidle, scd_pool_nactive,
+            scd_pool_next_ticket - scd_pool_serving);
+}
+
+
+/* Return a malloced string with the statistics of the connection
+   pool or NULL on a memory error.  */
+char *
+agent_scd_pool_stats (void)
+{
+  return xtryasprintf ("idle=%u active=%u queued=%lu requests=%lu"
+                       " waits=%lu wait_ms=%lu max_wait_ms=%lu"
+                       " reused=%lu connects=%lu",
+                       scd_pool_nidle, scd_pool_nactive,
+                       scd_pool_next_ticket - scd_pool_serving,
+                       scd_pool_stats.requests, scd_pool_stats.waits,
+                       scd_pool_stats.wait_ms, scd_pool_stats.max_wait_ms,
+                       scd_pool_stats.reused, scd_pool_stats.connects);
+}
+
+
+/* Wait until the caller may run a request on the SCdaemon.  Requests
+   are served in their order of arrival; at most SCD_POOL_MAX_ACTIVE
+   of them run at the same time.  The caller must hold
+   START_SCD_LOCK.  */
+static void
+acquire_request_slot (void)
+{
+  unsigned long ticket;
+  struct timespec start, now;
+  unsigned long ms;
+
+  scd_pool_stats.requests++;
+  ticket = scd_pool_next_ticket++;
+  if (ticket != scd_pool_serving || scd_pool_nactive >= SCD_POOL_MAX_ACTIVE)
+    {
+      scd_pool_stats.waits++;
+      npth_clock_gettime (&start);
+      do
+        npth_cond_wait (&scd_pool_cond, &start_scd_lock);
+      while (ticket != scd_pool_serving
+             || scd_pool_nactive >= SCD_POOL_MAX_ACTIVE);
+      npth_clock_gettime (&now);
+      ms = ((now.tv_sec - start.tv_sec) * 1000
+            + (now.tv_nsec - start.tv_nsec) / 1000000);
+      scd_pool_stats.wait_ms += ms;
+      if (ms > scd_pool_stats.max_wait_ms)
+        scd_pool_stats.max_wait_ms = ms;
+      if (DBG_IPC)
+        log_debug ("request to SCdaemon waited %lu ms\n", ms);
+    }
+  scd_pool_serving++;
+  scd_pool_nactive++;
+  /* Let the next request check whether it may run.  */
+  npth_cond_broadcast (&scd_pool_cond);
+}
+
+
+/* Counterpart to acquire_request_slot.  The caller must hold
+   START_SCD_LOCK.  */
+static void
+release_request_slot (void)
+{
+  if (!scd_pool_nactive)
+    BUG ();
+  scd_pool_nactive--;
+  npth_cond_broadcast (&scd_pool_cond);
 }
 
 
@@ -161,8 +266,9 @@ static int
 unlock_scd (ctrl_t ctrl, int rc)
 {
   int err;
+  int in_use = ctrl->scd_local->in_use;
 
-  if (ctrl->scd_local->in_use == 0)
+  if (!in_use)
     {
       log_error ("unlock_scd: CTX is not in use\n");
       if (!rc)
@@ -174,6 +280,11 @@ unlock_scd (ctrl_t ctrl, int rc)
       log_error ("failed to acquire the start_scd lock: %s\n", strerror (err));
       return gpg_error (GPG_ERR_INTERNAL);
     }
+  if (in_use)
+    {
+      release_request_slot ();
+      agent_stats_update (STATS_SCDAEMON, &ctrl->scd_local->started);
+    }
   ctrl->scd_local->in_use = 0;
   if (ctrl->scd_local->invalid)
     {
@@ -268,6 +379,9 @@ wait_child_thread (void *arg)
             }
         }
 
+      while (scd_pool_nidle)
+        assuan_release (scd_pool[--scd_pool_nidle]);
+
       primary_scd_ctx = NULL;
       primary_scd_ctx_reusable = 0;
 
@@ -300,22 +414,21 @@ start_scd (ctrl_t ctrl)
   int i;
   int rc;
   char *abs_homedir = NULL;
+  struct timespec started;
 
   if (opt.disable_scdaemon)
     return gpg_error (GPG_ERR_NOT_SUPPORTED);
 
-  if (ctrl->scd_local && ctrl->scd_local->ctx)
-    {
-      ctrl->scd_local->in_use = 1;
-      return 0; /* Okay, the context is fine.  */
-    }
-
   if (ctrl->scd_local && ctrl->scd_local->in_use)
     {
+      if (ctrl->scd_local->ctx)
+        return 0; /* Okay, the context is fine.  */
       log_error ("start_scd: CTX is in use\n");
       return gpg_error (GPG_ERR_INTERNAL);
     }
 
+  npth_clock_gettime (&started);
+
   /* We need to serialize the access to scd_local_list and primary_scd_ctx. */
   rc = npth_mutex_lock (&start_scd_lock);
   if (rc)
@@ -325,6 +438,20 @@ start_scd (ctrl_t ctrl)
       return gpg_error (GPG_ERR_INTERNAL);
     }
 
+  /* Wait for our turn; this releases the lock while waiting.  The
+     slot is given back by unlock_scd.  */
+  acquire_request_slot ();
+
+  if (ctrl->scd_local && ctrl->scd_local->ctx)
+    {
+      ctrl->scd_local->in_use = 1;
+      ctrl->scd_local->started = started;
+      rc = npth_mutex_unlock (&start_scd_lock);
+      if (rc)
+        log_error ("failed to release the start_scd lock: %s\n", strerror (rc));
+      return 0; /* Okay, the context is fine.  */
+    }
+
   /* If this is the first call for this session, setup the local data
      structure. */
   if (!ctrl->scd_local)
@@ -333,6 +460,7 @@ start_scd (ctrl_t ctrl)
       if (!ctrl->scd_local)
         {
           err = gpg_error_from_syserror ();
+          release_request_slot ();
           rc = npth_mutex_unlock (&start_scd_lock);
           if (rc)
             log_error ("failed to release the start_scd lock: %s\n", strerror (rc));
@@ -343,6 +471,7 @@ start_scd (ctrl_t ctrl)
     }
 
   ctrl->scd_local->in_use = 1;
+  ctrl->scd_local->started = started;
 
   /* Check whether the pipe server has already been started and in
      this case either reuse a lingering pipe connection or establish a
@@ -351,11 +480,23 @@ start_scd (ctrl_t ctrl)
     {
       ctx = primary_scd_ctx;
       primary_scd_ctx_reusable = 0;
+      scd_pool_stats.reused++;
       if (opt.verbose)
         log_info ("new connection to SCdaemon established (reusing)\n");
       goto leave;
     }
 
+  /* Take a reset secondary connection from the pool.  This saves the
+     connect and the setup of a new session in the SCdaemon.  */
+  if (socket_name && scd_pool_nidle)
+    {
+      ctx = scd_pool[--scd_pool_nidle];
+      scd_pool_stats.reused++;
+      if (opt.verbose)
+        log_info ("new connection to SCdaemon established (pooled)\n");
+      goto leave;
+    }
+
   rc = assuan_new (&ctx);
   if (rc)
     {
@@ -375,6 +516,7 @@ start_scd (ctrl_t ctrl)
           goto leave;
         }
 
+      scd_pool_stats.connects++;
       if (opt.verbose)
         log_info ("new connection to SCdaemon established\n");
       goto leave;
@@ -585,8 +727,8 @@ agent_reset_scd (ctrl_t ctrl)
                      primary connection as a kind of virtual EOF; we don't
                      have another way to tell it that the next command
                      should be viewed as if a new connection has been
-                     made.  For the non-primary connections this is not
-                     needed as we simply close the socket.  We don't check
+                     made.  For the non-primary connections this is only
+                     needed if we keep them in the pool.  We don't check
                      for an error here because the RESTART may fail for
                      example if the scdaemon has already been terminated.
                      Anyway, we need to set the reusable flag to make sure
@@ -595,6 +737,16 @@ agent_reset_scd (ctrl_t ctrl)
                                    NULL, NULL, NULL, NULL, NULL, NULL);
                   primary_scd_ctx_reusable = 1;
                 }
+              else if (!ctrl->scd_local->invalid
+                       && scd_pool_nidle < SCD_POOL_MAX_IDLE
+                       && !assuan_transact (ctrl->scd_local->ctx, "RESTART",
+                                            NULL, NULL, NULL, NULL,
+                                            NULL, NULL))
+                {
+                  /* The RESTART makes the session look like a new
+                     connection; keep it for the next client.  */
+                  scd_pool[scd_pool_nidle++] = ctrl->scd_local->ctx;
+                }
               else
                 assuan_release (ctrl->scd_local->ctx);
               ctrl->scd_local->ctx = NULL;
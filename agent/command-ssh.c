@@ -227,6 +227,66 @@ struct ssh_control_file_s
 };
 
 
+/* An item of the in-memory index of the sshcontrol file.  */
+struct control_index_item_s
+{
+  int lnr;             /* The line number of the item.  */
+  int disabled;        /* The item is disabled.  */
+  int ttl;             /* The TTL of the item.   */
+  int confirm;         /* The confirm flag is set.  */
+  char hexgrip[40+1];  /* The hexgrip of the item (uppercase).  */
+};
+typedef struct control_index_item_s *control_index_item_t;
+
+/* The parsed sshcontrol file.  The index is valid as long as the
+ * modification time, the size and the inode of the file do not
+ * change.  Because a connection may switch threads while using the
+ * index it is reference counted.  */
+struct control_index_s
+{
+  unsigned int refcount;
+  unsigned int seqno; /* Unique number of this index.  */
+  char *fname;        /* Name of the file.  */
+  time_t mtime;       /* Modification time of the parsed file.  */
+  off_t size;         /* Size of the parsed file.  */
+  ino_t ino;          /* Inode of the parsed file.  */
+  unsigned int nitems;
+  control_index_item_t items;     /* The items in file order.  */
+  unsigned int nsorted;
+  control_index_item_t *sorted;   /* Unique items sorted by hexgrip.  */
+};
+typedef struct control_index_s *control_index_t;
+
+/* The current index of the sshcontrol file or NULL.  */
+static control_index_t the_control_index;
+
+/* The counter used to assign a sequence number to a new index.  */
+static unsigned int control_index_seqno;
+
+
+/* The state used to decide whether the cached answer to a
+ * REQUEST_IDENTITIES is still valid.  */
+struct identity_cache_state_s
+{
+  unsigned int key_eventno;       /* The key event counter.  */
+  unsigned int card_eventno;      /* The card event counter.  */
+  unsigned int maybe_key_change;  /* The possible key change counter.  */
+  unsigned int control_seqno;     /* The seqno of the sshcontrol index.  */
+  time_t keydir_mtime;            /* The mtime of the private key dir.  */
+  int no_scdaemon;                /* The value of opt.disable_scdaemon.  */
+};
+
+/* The cached answer to the last REQUEST_IDENTITIES.  */
+static struct
+{
+  int valid;
+  struct identity_cache_state_s state;
+  u32 count;            /* The number of keys.  */
+  void *blobs;          /* The serialized public key blobs.  */
+  size_t bloblen;       /* The length of BLOBS.  */
+} identity_cache;
+
+
 /* Prototypes.  */
 static gpg_error_t ssh_handler_request_identities (ctrl_t ctrl,
 						   estream_t request,
@@ -1060,6 +1120,182 @@ search_control_file (ssh_control_file_t cf, const char *hexgrip,
 
 
 
+/* Release a reference to the control file index IDX.  */
+static void
+release_control_index (control_index_t idx)
+{
+  if (!idx)
+    return;
+  log_assert (idx->refcount);
+  if (--idx->refcount)
+    return;
+  xfree (idx->sorted);
+  xfree (idx->items);
+  xfree (idx->fname);
+  xfree (idx);
+}
+
+
+/* qsort helper to sort the control index by hexgrip and line number.  */
+static int
+compare_control_index_items (const void *a, const void *b)
+{
+  const control_index_item_t *pa = a;
+  const control_index_item_t *pb = b;
+  int res;
+
+  res = strcmp ((*pa)->hexgrip, (*pb)->hexgrip);
+  if (!res)
+    res = (*pa)->lnr - (*pb)->lnr;
+  return res;
+}
+
+
+/* Return the index of the sshcontrol file at R_IDX.  The file is only
+ * parsed again if it has been changed since the last call.  The
+ * caller must release the returned index using
+ * release_control_index.  As with search_control_file parsing stops
+ * at the first invalid line.  */
+static gpg_error_t
+get_control_index (control_index_t *r_idx)
+{
+  gpg_error_t err;
+  control_index_t idx = NULL;
+  ssh_control_file_t cf = NULL;
+  struct stat sb;
+  char *fname;
+  unsigned int nalloced, n;
+  control_index_item_t item;
+
+  *r_idx = NULL;
+
+  fname = make_filename_try (gnupg_homedir (), SSH_CONTROL_FILE_NAME, NULL);
+  if (!fname)
+    return gpg_error_from_syserror ();
+  if (the_control_index
+      && !strcmp (the_control_index->fname, fname)
+      && !stat (fname, &sb)
+      && sb.st_mtime == the_control_index->mtime
+      && sb.st_size == the_control_index->size
+      && sb.st_ino == the_control_index->ino)
+    {
+      xfree (fname);
+      the_control_index->refcount++;
+      *r_idx = the_control_index;
+      return 0;
+    }
+  xfree (fname);
+
+  err = open_control_file (&cf, 0);
+  if (err)
+    goto leave;
+  if (fstat (fileno (cf->fp), &sb))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  idx = xtrycalloc (1, sizeof *idx);
+  if (!idx)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  idx->refcount = 1;
+  idx->seqno = ++control_index_seqno;
+  idx->fname = cf->fname;
+  cf->fname = NULL;
+  idx->mtime = sb.st_mtime;
+  idx->size = sb.st_size;
+  idx->ino = sb.st_ino;
+
+  nalloced = 0;
+  while (!read_control_file_item (cf))
+    {
+      if (!cf->item.valid)
+        continue; /* Should not happen.  */
+      if (idx->nitems == nalloced)
+        {
+          control_index_item_t tmp;
+
+          nalloced = nalloced? 2 * nalloced : 32;
+          tmp = xtryrealloc (idx->items, nalloced * sizeof *tmp);
+          if (!tmp)
+            {
+              err = gpg_error_from_syserror ();
+              goto leave;
+            }
+          idx->items = tmp;
+        }
+      item = idx->items + idx->nitems++;
+      item->lnr = cf->lnr;
+      item->disabled = cf->item.disabled;
+      item->ttl = cf->item.ttl;
+      item->confirm = cf->item.confirm;
+      strcpy (item->hexgrip, cf->item.hexgrip);
+    }
+
+  if (idx->nitems)
+    {
+      idx->sorted = xtrycalloc (idx->nitems, sizeof *idx->sorted);
+      if (!idx->sorted)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      for (n=0; n < idx->nitems; n++)
+        idx->sorted[n] = idx->items + n;
+      qsort (idx->sorted, idx->nitems, sizeof *idx->sorted,
+             compare_control_index_items);
+      /* Only the first entry for a keygrip is used.  */
+      for (n=0; n < idx->nitems; n++)
+        if (!idx->nsorted
+            || strcmp (idx->sorted[idx->nsorted-1]->hexgrip,
+                       idx->sorted[n]->hexgrip))
+          idx->sorted[idx->nsorted++] = idx->sorted[n];
+    }
+
+  release_control_index (the_control_index);
+  the_control_index = idx;
+  idx->refcount++;
+  *r_idx = idx;
+  idx = NULL;
+
+ leave:
+  release_control_index (idx);
+  close_control_file (cf);
+  return err;
+}
+
+
+/* Return the item for HEXGRIP from the control file index IDX or
+ * NULL if there is no such item.  */
+static control_index_item_t
+search_control_index (control_index_t idx, const char *hexgrip)
+{
+  unsigned int lo, hi, mid;
+  int res;
+
+  log_assert (strlen (hexgrip) == 40 );
+
+  lo = 0;
+  hi = idx->nsorted;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      res = strcmp (idx->sorted[mid]->hexgrip, hexgrip);
+      if (!res)
+        return idx->sorted[mid];
+      if (res < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return NULL;
+}
+
+
+
 /* Add an entry to the control file to mark the key with the keygrip
    HEXGRIP as usable for SSH; i.e. it will be returned when ssh asks
    for it.  FMTFPR is the fingerprint string.  This function is in
@@ -1118,48 +1354,54 @@ add_control_entry (ctrl_t ctrl, ssh_key_type_spec_t *spec,
 }
 
 
-/* Scan the sshcontrol file and return the TTL.  */
+/* Look up the sshcontrol file and return the TTL.  */
 static int
 ttl_from_sshcontrol (const char *hexgrip)
 {
-  ssh_control_file_t cf;
-  int disabled, ttl;
+  control_index_t idx;
+  control_index_item_t item;
+  int ttl;
 
   if (!hexgrip || strlen (hexgrip) != 40)
     return 0;  /* Wrong input: Use global default.  */
 
-  if (open_control_file (&cf, 0))
+  if (get_control_index (&idx))
     return 0; /* Error: Use the global default TTL.  */
 
-  if (search_control_file (cf, hexgrip, &disabled, &ttl, NULL)
-      || disabled)
+  item = search_control_index (idx, hexgrip);
+  if (!item || item->disabled)
     ttl = 0;  /* Use the global default if not found or disabled.  */
+  else
+    ttl = item->ttl;
 
-  close_control_file (cf);
+  release_control_index (idx);
 
   return ttl;
 }
 
 
-/* Scan the sshcontrol file and return the confirm flag.  */
+/* Look up the sshcontrol file and return the confirm flag.  */
 static int
 confirm_flag_from_sshcontrol (const char *hexgrip)
 {
-  ssh_control_file_t cf;
-  int disabled, confirm;
+  control_index_t idx;
+  control_index_item_t item;
+  int confirm;
 
   if (!hexgrip || strlen (hexgrip) != 40)
     return 1;  /* Wrong input: Better ask for confirmation.  */
 
-  if (open_control_file (&cf, 0))
+  if (get_control_index (&idx))
     return 1; /* Error: Better ask for confirmation.  */
 
-  if (search_control_file (cf, hexgrip, &disabled, NULL, &confirm)
-      || disabled)
+  item = search_control_index (idx, hexgrip);
+  if (!item || item->disabled)
     confirm = 0;  /* If not found or disabled, there is no reason to
                      ask for confirmation.  */
+  else
+    confirm = item->confirm;
 
-  close_control_file (cf);
+  release_control_index (idx);
 
   return confirm;
 }
@@ -2472,20 +2714,56 @@ ssh_handler_request_identities (ctrl_t ctrl,
                                 estream_t request, estream_t response)
 {
   u32 key_counter;
-  estream_t key_blobs;
+  estream_t key_blobs = NULL;
   gcry_sexp_t key_public;
   gpg_error_t err;
-  int ret;
-  ssh_control_file_t cf = NULL;
+  control_index_t idx = NULL;
+  control_index_item_t item;
+  unsigned int n;
   gpg_error_t ret_err;
+  struct identity_cache_state_s state;
+  struct stat sb;
+  char *keydir;
+  void *blobs;
+  size_t bloblen;
 
   (void)request;
 
-  /* Prepare buffer stream.  */
-
   key_public = NULL;
   key_counter = 0;
 
+  /* Get the current state and check whether we can use the cached
+   * answer.  Note that the event counters are taken before the
+   * sshcontrol file is looked at so that a change while we build the
+   * answer simply invalidates the cache.  */
+  memset (&state, 0, sizeof state);
+  get_eventcounters (&state.key_eventno, &state.card_eventno,
+                     &state.maybe_key_change);
+  state.no_scdaemon = !!opt.disable_scdaemon;
+  keydir = make_filename_try (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR, NULL);
+  if (!keydir)
+    {
+      err = gpg_error_from_syserror ();
+      goto out;
+    }
+  if (!stat (keydir, &sb))
+    state.keydir_mtime = sb.st_mtime;
+  xfree (keydir);
+
+  err = get_control_index (&idx);
+  if (err)
+    goto out;
+  state.control_seqno = idx->seqno;
+
+  if (identity_cache.valid
+      && !memcmp (&identity_cache.state, &state, sizeof state))
+    {
+      if (DBG_IPC)
+        log_debug ("ssh request identities: using cached answer\n");
+      goto out;
+    }
+
+  /* Prepare buffer stream.  */
   key_blobs = es_fopenmem (0, "r+b");
   if (! key_blobs)
     {
@@ -2547,26 +2825,21 @@ ssh_handler_request_identities (ctrl_t ctrl,
 
  scd_out:
   /* Then look at all the registered and non-disabled keys. */
-  err = open_control_file (&cf, 0);
-  if (err)
-    goto out;
-
-  while (!read_control_file_item (cf))
+  for (n=0; n < idx->nitems; n++)
     {
       unsigned char grip[20];
 
-      if (!cf->item.valid)
-        continue; /* Should not happen.  */
-      if (cf->item.disabled)
+      item = idx->items + n;
+      if (item->disabled)
         continue;
-      log_assert (strlen (cf->item.hexgrip) == 40);
-      hex2bin (cf->item.hexgrip, grip, sizeof (grip));
+      log_assert (strlen (item->hexgrip) == 40);
+      hex2bin (item->hexgrip, grip, sizeof (grip));
 
       err = agent_public_key_from_file (ctrl, grip, &key_public);
       if (err)
         {
           log_error ("%s:%d: key '%s' skipped: %s\n",
-                     cf->fname, cf->lnr, cf->item.hexgrip,
+                     idx->fname, item->lnr, item->hexgrip,
                      gpg_strerror (err));
           continue;
         }
@@ -2579,14 +2852,23 @@ ssh_handler_request_identities (ctrl_t ctrl,
 
       key_counter++;
     }
-  err = 0;
 
-  ret = es_fseek (key_blobs, 0, SEEK_SET);
-  if (ret)
+  if (es_fclose_snatch (key_blobs, &blobs, &bloblen))
     {
       err = gpg_error_from_syserror ();
       goto out;
     }
+  key_blobs = NULL;
+
+  /* Replace the cached answer.  There is no context switch between
+   * here and sending the response.  */
+  xfree (identity_cache.blobs);
+  identity_cache.blobs = blobs;
+  identity_cache.bloblen = bloblen;
+  identity_cache.count = key_counter;
+  identity_cache.state = state;
+  identity_cache.valid = 1;
+  err = 0;
 
  out:
   /* Send response.  */
@@ -2597,9 +2879,11 @@ ssh_handler_request_identities (ctrl_t ctrl,
     {
       ret_err = stream_write_byte (response, SSH_RESPONSE_IDENTITIES_ANSWER);
       if (!ret_err)
-        ret_err = stream_write_uint32 (response, key_counter);
-      if (!ret_err)
-        ret_err = stream_copy (response, key_blobs);
+        ret_err = stream_write_uint32 (response, identity_cache.count);
+      if (!ret_err && identity_cache.bloblen
+          && es_write (response, identity_cache.blobs,
+                       identity_cache.bloblen, NULL))
+        ret_err = gpg_error_from_syserror ();
     }
   else
     {
@@ -2609,7 +2893,7 @@ ssh_handler_request_identities (ctrl_t ctrl,
     }
 
   es_fclose (key_blobs);
-  close_control_file (cf);
+  release_control_index (idx);
 
   return ret_err;
 }
@@ -33,6 +33,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <npth.h>
 
 #include "agent.h"
 #include <assuan.h>
@@ -41,6 +42,7 @@
 #include "../common/ssh-utils.h"
 #include "../common/asshelp.h"
 #include "../common/server-help.h"
+#include "../common/asynclog.h"
 
 
 /* Maximum allowed size of the inquired ciphertext.  */
@@ -51,6 +53,8 @@
 #define MAXLEN_KEYDATA 8192
 /* Maximum length of a secret to store under one key.  */
 #define MAXLEN_PUT_SECRET 4096
+/* Maximum allowed size of the hashes for PKSIGN_MULTI.  */
+#define MAXLEN_HASHES (1024 * MAX_DIGEST_LEN)
 /* The size of the import/export KEK key (in bytes).  */
 #define KEYWRAP_KEYSIZE (128/8)
 
@@ -493,6 +497,122 @@ bump_card_eventcounter (void)
 }
 
 
+/* Return the current values of the key and the card event counter
+ * and the internal counter for possible key changes.  This allows
+ * other modules to check whether cached data is still fresh.  This
+ * function is assured not to do any context switches.  */
+void
+get_eventcounters (unsigned int *r_key, unsigned int *r_card,
+                   unsigned int *r_maybe_key_change)
+{
+  *r_key = eventcounter.key;
+  *r_card = eventcounter.card;
+  *r_maybe_key_change = eventcounter.maybe_key_change;
+}
+
+
+/* The number of buckets of the latency histograms.  Bucket N counts
+ * the operations which took less than 10^N milliseconds; the last
+ * bucket counts all slower operations.  */
+#define STATS_BUCKETS 6
+
+/* Counters and latency histograms for the operations listed in enum
+ * agent_stats_ops.  They are reported by "GETINFO stats".  No lock
+ * is required because the update functions do not context switch.  */
+static struct
+{
+  struct
+  {
+    unsigned long count;      /* Number of operations.  */
+    unsigned long total_ms;   /* Total time of all operations.  */
+    unsigned long max_ms;     /* Time of the slowest operation.  */
+    unsigned long hist[STATS_BUCKETS];
+  } op[STATS_LAST_OP];
+  unsigned long cache_hits;
+  unsigned long cache_misses;
+} stats;
+
+/* The names of the operations as used by "GETINFO stats".  */
+static const char *stats_names[STATS_LAST_OP] =
+  { "pksign", "pkdecrypt", "get_passphrase", "pinentry", "scdaemon" };
+
+
+/* Account for one operation OP which was started at STARTED.  This
+ * function is assured not to do any context switches.  */
+void
+agent_stats_update (enum agent_stats_ops op, const struct timespec *started)
+{
+  struct timespec now;
+  unsigned long ms, limit;
+  int i;
+
+  if (op < 0 || op >= STATS_LAST_OP)
+    return;
+
+  npth_clock_gettime (&now);
+  if (now.tv_sec < started->tv_sec)
+    ms = 0;  /* Clock went backwards.  */
+  else
+    ms = ((now.tv_sec - started->tv_sec) * 1000
+          + (now.tv_nsec - started->tv_nsec) / 1000000);
+
+  stats.op[op].count++;
+  stats.op[op].total_ms += ms;
+  if (ms > stats.op[op].max_ms)
+    stats.op[op].max_ms = ms;
+  for (i=0, limit=1; i < STATS_BUCKETS - 1 && ms >= limit; i++)
+    limit *= 10;
+  stats.op[op].hist[i]++;
+}
+
+
+/* Account for a lookup in the passphrase cache; HIT is true if the
+ * item was found.  This function is assured not to do any context
+ * switches.  */
+void
+agent_stats_cache (int hit)
+{
+  if (hit)
+    stats.cache_hits++;
+  else
+    stats.cache_misses++;
+}
+
+
+/* Send the statistics as data lines to CTX.  */
+static gpg_error_t
+send_stats (assuan_context_t ctx)
+{
+  gpg_error_t err = 0;
+  char *buf;
+  int op;
+
+  for (op=0; op <= STATS_LAST_OP && !err; op++)
+    {
+      if (op == STATS_LAST_OP)
+        buf = xtryasprintf ("cache hits=%lu misses=%lu",
+                            stats.cache_hits, stats.cache_misses);
+      else
+        buf = xtryasprintf ("%s n=%lu total_ms=%lu max_ms=%lu"
+                            " hist=%lu,%lu,%lu,%lu,%lu,%lu",
+                            stats_names[op], stats.op[op].count,
+                            stats.op[op].total_ms, stats.op[op].max_ms,
+                            stats.op[op].hist[0], stats.op[op].hist[1],
+                            stats.op[op].hist[2], stats.op[op].hist[3],
+                            stats.op[op].hist[4], stats.op[op].hist[5]);
+      if (!buf)
+        return gpg_error_from_syserror ();
+      err = assuan_send_data (ctx, buf, strlen (buf));
+      if (!err)
+        err = assuan_send_data (ctx, "\n", 1);
+      if (!err)
+        err = assuan_send_data (ctx, NULL, 0);
+      xfree (buf);
+    }
+  return err;
+}
+
+
 
 
 static const char hlp_istrusted[] =
@@ -600,14 +720,28 @@ cmd_marktrusted (assuan_context_t ctx, char *line)
 
 static const char hlp_havekey[] =
   "HAVEKEY <hexstrings_with_keygrips>\n"
+  "HAVEKEY --list\n"
   "\n"
   "Return success if at least one of the secret keys with the given\n"
-  "keygrips is available.";
+  "keygrips is available.  With --list the keygrips of all available\n"
+  "secret keys are returned as data lines with 20 bytes for each\n"
+  "keygrip.";
 static gpg_error_t
 cmd_havekey (assuan_context_t ctx, char *line)
 {
   gpg_error_t err;
   unsigned char buf[20];
+  unsigned char *grips;
+  unsigned int ngrips;
+
+  if (has_option (line, "--list"))
+    {
+      err = agent_list_keygrips (&grips, &ngrips);
+      if (!err && ngrips)
+        err = assuan_send_data (ctx, grips, 20 * ngrips);
+      xfree (grips);
+      return leave_cmd (ctx, err);
+    }
 
   do
     {
@@ -798,6 +932,7 @@ cmd_pksign (assuan_context_t ctx, char *line)
   membuf_t outbuf;
   char *cache_nonce = NULL;
   char *p;
+  struct timespec started;
 
   line = skip_options (line);
 
@@ -814,13 +949,86 @@ cmd_pksign (assuan_context_t ctx, char *line)
 
   init_membuf (&outbuf, 512);
 
+  npth_clock_gettime (&started);
   err = agent_pksign (ctrl, cache_nonce, ctrl->server_local->keydesc,
                       &outbuf, cache_mode);
+  agent_stats_update (STATS_PKSIGN, &started);
+  if (err)
+    clear_outbuf (&outbuf);
+  else
+    err = write_and_clear_outbuf (ctx, &outbuf);
+
+  xfree (cache_nonce);
+  xfree (ctrl->server_local->keydesc);
+  ctrl->server_local->keydesc = NULL;
+  return leave_cmd (ctx, err);
+}
+
+
+static const char hlp_pksign_multi[] =
+  "PKSIGN_MULTI [<options>] [<cache_nonce>]\n"
+  "\n"
+  "Sign a list of hashes with the key set by SIGKEY.  The hash algorithm\n"
+  "and the length of the hashes are taken from a preceding SETHASH\n"
+  "command whose hash value is ignored.  The hashes are requested with\n"
+  "the inquiry HASHES which must return their concatenation.  The\n"
+  "signatures are returned as one data block with the canonical encoded\n"
+  "S-expressions in the order of the hashes.  The key is unprotected\n"
+  "only once.";
+static gpg_error_t
+cmd_pksign_multi (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+  cache_mode_t cache_mode = CACHE_MODE_NORMAL;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  membuf_t outbuf;
+  char *cache_nonce = NULL;
+  unsigned char *value = NULL;
+  size_t valuelen;
+  char *p;
+
+  line = skip_options (line);
+
+  for (p=line; *p && *p != ' ' && *p != '\t'; p++)
+    ;
+  *p = '\0';
+  if (*line)
+    cache_nonce = xtrystrdup (line);
+
+  if (!ctrl->digest.valuelen)
+    {
+      err = set_error (GPG_ERR_MISSING_VALUE, "no SETHASH given");
+      goto leave;
+    }
+
+  if (opt.ignore_cache_for_signing)
+    cache_mode = CACHE_MODE_IGNORE;
+  else if (!ctrl->server_local->use_cache_for_signing)
+    cache_mode = CACHE_MODE_IGNORE;
+
+  err = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u", MAXLEN_HASHES);
+  if (!err)
+    err = assuan_inquire (ctx, "HASHES", &value, &valuelen, MAXLEN_HASHES);
+  if (err)
+    goto leave;
+  if (!valuelen || (valuelen % ctrl->digest.valuelen))
+    {
+      err = set_error (GPG_ERR_INV_LENGTH, "invalid length of the hashes");
+      goto leave;
+    }
+
+  init_membuf (&outbuf, 512);
+
+  err = agent_pksign_multi (ctrl, cache_nonce, ctrl->server_local->keydesc,
+                            value, valuelen / ctrl->digest.valuelen,
+                            &outbuf, cache_mode);
   if (err)
     clear_outbuf (&outbuf);
   else
     err = write_and_clear_outbuf (ctx, &outbuf);
 
+ leave:
+  xfree (value);
   xfree (cache_nonce);
   xfree (ctrl->server_local->keydesc);
   ctrl->server_local->keydesc = NULL;
@@ -842,6 +1050,7 @@ cmd_pkdecrypt (assuan_context_t ctx, char *line)
   size_t valuelen;
   membuf_t outbuf;
   int padding;
+  struct timespec started;
 
   (void)line;
 
@@ -855,8 +1064,10 @@ cmd_pkdecrypt (assuan_context_t ctx, char *line)
 
   init_membuf (&outbuf, 512);
 
+  npth_clock_gettime (&started);
   rc = agent_pkdecrypt (ctrl, ctrl->server_local->keydesc,
                         value, valuelen, &outbuf, &padding);
+  agent_stats_update (STATS_PKDECRYPT, &started);
   xfree (value);
   if (rc)
     clear_outbuf (&outbuf);
@@ -1285,7 +1496,8 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
   ctrl_t ctrl = assuan_get_pointer (ctx);
   int err;
   unsigned char grip[20];
-  DIR *dir = NULL;
+  unsigned char *grips = NULL;
+  unsigned int ngrips, gripidx;
   int list_mode;
   int opt_data, opt_ssh_fpr, opt_with_ssh;
   ssh_control_file_t cf = NULL;
@@ -1368,35 +1580,14 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
     }
   else if (list_mode)
     {
-      char *dirname;
-      struct dirent *dir_entry;
-
-      dirname = make_filename_try (gnupg_homedir (),
-                                   GNUPG_PRIVATE_KEYS_DIR, NULL);
-      if (!dirname)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
-      dir = opendir (dirname);
-      if (!dir)
-        {
-          err = gpg_error_from_syserror ();
-          xfree (dirname);
-          goto leave;
-        }
-      xfree (dirname);
+      err = agent_list_keygrips (&grips, &ngrips);
+      if (err)
+        goto leave;
 
-      while ( (dir_entry = readdir (dir)) )
+      for (gripidx = 0; gripidx < ngrips; gripidx++)
         {
-          if (strlen (dir_entry->d_name) != 44
-              || strcmp (dir_entry->d_name + 40, ".key"))
-            continue;
-          strncpy (hexgrip, dir_entry->d_name, 40);
-          hexgrip[40] = 0;
-
-          if ( hex2bin (hexgrip, grip, 20) < 0 )
-            continue; /* Bad hex string.  */
+          memcpy (grip, grips + 20 * gripidx, 20);
+          bin2hex (grip, 20, hexgrip);
 
           disabled = ttl = confirm = is_ssh = 0;
           if (opt_with_ssh)
@@ -1448,8 +1639,7 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
 
  leave:
   ssh_close_control_file (cf);
-  if (dir)
-    closedir (dir);
+  xfree (grips);
   if (err && gpg_err_code (err) != GPG_ERR_NOT_FOUND)
     leave_cmd (ctx, err);
   return err;
@@ -1524,10 +1714,12 @@ cmd_get_passphrase (assuan_context_t ctx, char *line)
   int opt_data, opt_check, opt_no_ask, opt_qualbar;
   int opt_repeat = 0;
   char *entry_errtext = NULL;
+  struct timespec started;
 
   if (ctrl->restricted)
     return leave_cmd (ctx, gpg_error (GPG_ERR_FORBIDDEN));
 
+  npth_clock_gettime (&started);
   opt_data = has_option (line, "--data");
   opt_check = has_option (line, "--check");
   opt_no_ask = has_option (line, "--no-ask");
@@ -1658,6 +1850,7 @@ cmd_get_passphrase (assuan_context_t ctx, char *line)
         }
     }
 
+  agent_stats_update (STATS_GET_PASSPHRASE, &started);
   return leave_cmd (ctx, rc);
 }
 
@@ -3100,6 +3293,7 @@ static const char hlp_getinfo[] =
   "  socket_name     - Return the name of the socket.\n"
   "  ssh_socket_name - Return the name of the ssh socket.\n"
   "  scd_running     - Return OK if the SCdaemon is already running.\n"
+  "  scd_pool        - Return statistics of the SCdaemon connections.\n"
   "  s2k_time        - Return the time in milliseconds required for S2K.\n"
   "  s2k_count       - Return the standard S2K count.\n"
   "  s2k_count_cal   - Return the calibrated S2K count.\n"
@@ -3108,6 +3302,9 @@ static const char hlp_getinfo[] =
   "  std_startup_env - List the standard startup environment.\n"
   "  getenv NAME     - Return value of envvar NAME.\n"
   "  connections     - Return number of active connections.\n"
+  "  connection_pool - Return statistics of the connection threads.\n"
+  "  log_writer      - Return statistics of the log writer.\n"
+  "  stats           - Return counters and latency histograms.\n"
   "  jent_active     - Returns OK if Libgcrypt's JENT is active.\n"
   "  restricted      - Returns OK if the connection is in restricted mode.\n"
   "  cmd_has_option CMD OPT\n"
@@ -3200,6 +3397,18 @@ cmd_getinfo (assuan_context_t ctx, char *line)
     {
       rc = agent_scd_check_running ()? 0 : gpg_error (GPG_ERR_FALSE);
     }
+  else if (!strcmp (line, "scd_pool"))
+    {
+      char *buf = agent_scd_pool_stats ();
+
+      if (!buf)
+        rc = gpg_error_from_syserror ();
+      else
+        {
+          rc = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
   else if (!strcmp (line, "std_env_names"))
     {
       int iterator;
@@ -3268,6 +3477,34 @@ cmd_getinfo (assuan_context_t ctx, char *line)
                 get_agent_active_connection_count ());
       rc = assuan_send_data (ctx, numbuf, strlen (numbuf));
     }
+  else if (!strcmp (line, "connection_pool"))
+    {
+      char *buf = get_agent_connection_pool_stats ();
+
+      if (!buf)
+        rc = gpg_error_from_syserror ();
+      else
+        {
+          rc = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
+  else if (!strcmp (line, "log_writer"))
+    {
+      char *buf = asynclog_stats ();
+
+      if (!buf)
+        rc = gpg_error_from_syserror ();
+      else
+        {
+          rc = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
+  else if (!strcmp (line, "stats"))
+    {
+      rc = send_stats (ctx);
+    }
   else if (!strcmp (line, "jent_active"))
     {
 #if GCRYPT_VERSION_NUMBER >= 0x010800
@@ -3522,6 +3759,7 @@ register_commands (assuan_context_t ctx)
     { "SETKEYDESC",     cmd_setkeydesc,hlp_setkeydesc },
     { "SETHASH",        cmd_sethash,   hlp_sethash },
     { "PKSIGN",         cmd_pksign,    hlp_pksign },
+    { "PKSIGN_MULTI",   cmd_pksign_multi, hlp_pksign_multi },
     { "PKDECRYPT",      cmd_pkdecrypt, hlp_pkdecrypt },
     { "GENKEY",         cmd_genkey,    hlp_genkey },
     { "READKEY",        cmd_readkey,   hlp_readkey },
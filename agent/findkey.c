@@ -28,6 +28,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <npth.h> /* (we use pth_sleep) */
 
 #include "agent.h"
@@ -50,6 +51,653 @@ struct try_unprotect_arg_s
 };
 
 
+/* An item of the cache of unprotected keys.  With option
+ * --cache-unprotected-keys the result of unprotecting a key is kept
+ * here so that the S2K and the parsing of the key file need not be
+ * done for each operation.  An item is only used as long as the
+ * passphrase for the key is still in the passphrase cache and is thus
+ * subject to the same TTLs.  */
+struct ukey_item_s
+{
+  struct ukey_item_s *next;
+  unsigned char grip[20];
+  cache_mode_t cache_mode;  /* The cache mode used to unprotect.  */
+  int restricted;           /* The value of ctrl->restricted.  */
+  time_t mtime;             /* Modification time of the key file.  */
+  off_t size;               /* Size of the key file.  */
+  size_t keylen;            /* Length of KEY.  */
+  unsigned char *key;       /* The canonical encoded unprotected key
+                               in secure memory.  */
+};
+typedef struct ukey_item_s *ukey_item_t;
+
+/* The list of cached unprotected keys and its lock.  */
+static ukey_item_t ukey_cache;
+static npth_mutex_t ukey_cache_lock;
+
+
+/* An item of the cache of public keys and key infos.  Operations
+ * like KEYINFO --list or the ssh key listing only need the public
+ * part or the type of a key; this cache avoids reading and parsing
+ * the key files again.  An item is only used as long as the size and
+ * the modification time of the key file are unchanged.  */
+struct pkey_item_s
+{
+  struct pkey_item_s *next;
+  unsigned char grip[20];
+  time_t mtime;               /* Modification time of the key file.  */
+  off_t size;                 /* Size of the key file.  */
+  unsigned char *pubkey;      /* The canonical encoded public key or NULL. */
+  size_t pubkeylen;           /* Length of PUBKEY.  */
+  unsigned int have_info:1;   /* KEYTYPE and SHADOW_INFO are valid.  */
+  int keytype;                /* The PRIVATE_KEY_ type of the key.  */
+  unsigned char *shadow_info; /* The canonical shadow info or NULL.  */
+};
+typedef struct pkey_item_s *pkey_item_t;
+
+/* The maximum number of items in the public key cache.  If this is
+ * reached the cache is flushed.  */
+#define PKEY_CACHE_MAX 8192
+
+/* The hash table with the cached public keys indexed by the first
+ * byte of the keygrip, the number of items, and its lock.  */
+static pkey_item_t pkey_cache[256];
+static unsigned int pkey_cache_count;
+static npth_mutex_t pkey_cache_lock;
+
+
+/* The inventory of the keygrips in the private key directory.  It
+ * is only used while the directory is watched for changes (see
+ * agent_keydir_set_watched); otherwise the directory is scanned for
+ * each listing.  */
+static struct
+{
+  int watched;           /* The directory is being watched.  */
+  int valid;             /* GRIPS reflects the directory.  */
+  unsigned int count;    /* The number of keygrips.  */
+  unsigned int size;     /* The allocated number of keygrips.  */
+  unsigned char *grips;  /* COUNT keygrips of 20 bytes each.  */
+} keygrip_inventory;
+
+
+/* This function must be called once to initialize this module.  It
+ * has to be done before a second thread is spawned.  */
+void
+initialize_module_findkey (void)
+{
+  int err;
+
+  err = npth_mutex_init (&ukey_cache_lock, NULL);
+  if (!err)
+    err = npth_mutex_init (&pkey_cache_lock, NULL);
+  if (err)
+    log_fatal ("error initializing findkey module: %s\n", strerror (err));
+}
+
+
+static void
+lock_ukey_cache (void)
+{
+  int res;
+
+  res = npth_mutex_lock (&ukey_cache_lock);
+  if (res)
+    log_fatal ("failed to acquire ukey cache mutex: %s\n", strerror (res));
+}
+
+
+static void
+unlock_ukey_cache (void)
+{
+  int res;
+
+  res = npth_mutex_unlock (&ukey_cache_lock);
+  if (res)
+    log_fatal ("failed to release ukey cache mutex: %s\n", strerror (res));
+}
+
+
+static void
+release_ukey_item (ukey_item_t item)
+{
+  if (!item)
+    return;
+  wipememory (item->key, item->keylen);
+  xfree (item->key);
+  xfree (item);
+}
+
+
+/* Get the modification time and the size of the key file for GRIP.
+ * Returns true on success.  */
+static int
+stat_key_file (const unsigned char *grip, time_t *r_mtime, off_t *r_size)
+{
+  char *fname;
+  char hexgrip[40+4+1];
+  struct stat st;
+  int okay;
+
+  bin2hex (grip, 20, hexgrip);
+  strcpy (hexgrip+40, ".key");
+  fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
+                         hexgrip, NULL);
+  okay = !stat (fname, &st);
+  xfree (fname);
+  if (okay)
+    {
+      *r_mtime = st.st_mtime;
+      *r_size = st.st_size;
+    }
+  return okay;
+}
+
+
+/* Remove all cached unprotected keys for GRIP.  With GRIP given as
+ * NULL all items are removed.  */
+static void
+flush_ukey_cache (const unsigned char *grip)
+{
+  ukey_item_t item, prev, next;
+
+  lock_ukey_cache ();
+  for (prev = NULL, item = ukey_cache; item; item = next)
+    {
+      next = item->next;
+      if (grip && memcmp (item->grip, grip, 20))
+        {
+          prev = item;
+          continue;
+        }
+      if (prev)
+        prev->next = next;
+      else
+        ukey_cache = next;
+      release_ukey_item (item);
+    }
+  unlock_ukey_cache ();
+}
+
+
+/* Put a copy of the unprotected canonical encoded KEY for GRIP into
+ * the cache.  Errors are ignored because the cache is only an
+ * optimization.  */
+static void
+put_ukey_cache (ctrl_t ctrl, const unsigned char *grip,
+                cache_mode_t cache_mode, const unsigned char *key)
+{
+  ukey_item_t item;
+  size_t keylen;
+
+  if (!opt.cache_unprotected_keys
+      || !(cache_mode == CACHE_MODE_NORMAL || cache_mode == CACHE_MODE_SSH))
+    return;
+
+  keylen = gcry_sexp_canon_len (key, 0, NULL, NULL);
+  if (!keylen)
+    return;
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    return;
+  if (!stat_key_file (grip, &item->mtime, &item->size)
+      || !(item->key = xtrymalloc_secure (keylen)))
+    {
+      xfree (item);
+      return;
+    }
+  memcpy (item->key, key, keylen);
+  item->keylen = keylen;
+  memcpy (item->grip, grip, 20);
+  item->cache_mode = cache_mode;
+  item->restricted = ctrl->restricted;
+
+  flush_ukey_cache (grip);
+  lock_ukey_cache ();
+  item->next = ukey_cache;
+  ukey_cache = item;
+  unlock_ukey_cache ();
+}
+
+
+/* Try to get the unprotected key for GRIP from the cache and store
+ * it as an S-expression at R_KEY.  Returns true on a cache hit.  */
+static int
+get_ukey_cache (ctrl_t ctrl, const unsigned char *grip,
+                cache_mode_t cache_mode, gcry_sexp_t *r_key)
+{
+  ukey_item_t item;
+  char hexgrip[40+1];
+  char *pw;
+  time_t mtime;
+  off_t size;
+  int hit = 0;
+
+  *r_key = NULL;
+  if (!opt.cache_unprotected_keys || !ukey_cache
+      || !(cache_mode == CACHE_MODE_NORMAL || cache_mode == CACHE_MODE_SSH))
+    return 0;
+
+  /* The cached key is only valid as long as the passphrase is cached.
+   * Asking for it also updates its access time.  */
+  bin2hex (grip, 20, hexgrip);
+  pw = agent_get_cache (ctrl, hexgrip, cache_mode);
+  if (!pw)
+    {
+      flush_ukey_cache (grip);
+      return 0;
+    }
+  wipememory (pw, strlen (pw));
+  xfree (pw);
+
+  if (!stat_key_file (grip, &mtime, &size))
+    return 0;
+
+  lock_ukey_cache ();
+  for (item = ukey_cache; item; item = item->next)
+    if (!memcmp (item->grip, grip, 20)
+        && item->cache_mode == cache_mode
+        && item->restricted == ctrl->restricted)
+      break;
+  if (item && item->mtime == mtime && item->size == size)
+    hit = !gcry_sexp_sscan (r_key, NULL, (char*)item->key, item->keylen);
+  unlock_ukey_cache ();
+
+  if (item && !hit)
+    flush_ukey_cache (grip);  /* The key file has been changed.  */
+  else if (hit && cache_mode == CACHE_MODE_NORMAL)
+    agent_store_cache_hit (hexgrip);
+  if (hit && DBG_CACHE)
+    log_debug ("unprotected key %s taken from the cache\n", hexgrip);
+  return hit;
+}
+
+
+static void
+lock_pkey_cache (void)
+{
+  int res;
+
+  res = npth_mutex_lock (&pkey_cache_lock);
+  if (res)
+    log_fatal ("failed to acquire pkey cache mutex: %s\n", strerror (res));
+}
+
+
+static void
+unlock_pkey_cache (void)
+{
+  int res;
+
+  res = npth_mutex_unlock (&pkey_cache_lock);
+  if (res)
+    log_fatal ("failed to release pkey cache mutex: %s\n", strerror (res));
+}
+
+
+static void
+release_pkey_item (pkey_item_t item)
+{
+  if (!item)
+    return;
+  xfree (item->pubkey);
+  xfree (item->shadow_info);
+  xfree (item);
+}
+
+
+/* Remove the cached public key data for GRIP.  With GRIP given as
+ * NULL all items are removed.  The caller must hold the lock.  */
+static void
+flush_pkey_cache_locked (const unsigned char *grip)
+{
+  pkey_item_t item, prev, next;
+  int i;
+
+  for (i=0; i < DIM (pkey_cache); i++)
+    {
+      if (grip && i != *grip)
+        continue;
+      for (prev = NULL, item = pkey_cache[i]; item; item = next)
+        {
+          next = item->next;
+          if (grip && memcmp (item->grip, grip, 20))
+            {
+              prev = item;
+              continue;
+            }
+          if (prev)
+            prev->next = next;
+          else
+            pkey_cache[i] = next;
+          release_pkey_item (item);
+          pkey_cache_count--;
+        }
+    }
+}
+
+
+/* Remove the cached public key data for GRIP.  With GRIP given as
+ * NULL all items are removed.  */
+static void
+flush_pkey_cache (const unsigned char *grip)
+{
+  lock_pkey_cache ();
+  flush_pkey_cache_locked (grip);
+  unlock_pkey_cache ();
+}
+
+
+/* Flush the entire public key cache.  */
+void
+agent_pkey_cache_flush (void)
+{
+  flush_pkey_cache (NULL);
+}
+
+
+/* Return the item for GRIP if it matches MTIME and SIZE.  A stale
+ * item is removed.  With CREATE set a new item is created if there is
+ * none.  The caller must hold the lock.  */
+static pkey_item_t
+find_pkey_item (const unsigned char *grip, time_t mtime, off_t size,
+                int create)
+{
+  pkey_item_t item;
+
+  for (item = pkey_cache[*grip]; item; item = item->next)
+    if (!memcmp (item->grip, grip, 20))
+      break;
+  if (item && (item->mtime != mtime || item->size != size))
+    {
+      flush_pkey_cache_locked (grip);  /* The key file has been changed. */
+      item = NULL;
+    }
+  if (item || !create)
+    return item;
+
+  if (pkey_cache_count >= PKEY_CACHE_MAX)
+    flush_pkey_cache_locked (NULL);
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    return NULL;
+  memcpy (item->grip, grip, 20);
+  item->mtime = mtime;
+  item->size = size;
+  item->next = pkey_cache[*grip];
+  pkey_cache[*grip] = item;
+  pkey_cache_count++;
+  return item;
+}
+
+
+/* Try to get the public key for GRIP from the cache and store it as
+ * an S-expression at R_KEY.  Returns true on a cache hit.  MTIME and
+ * SIZE describe the current key file.  */
+static int
+get_pkey_cache (const unsigned char *grip, time_t mtime, off_t size,
+                gcry_sexp_t *r_key)
+{
+  pkey_item_t item;
+  int hit = 0;
+
+  *r_key = NULL;
+  lock_pkey_cache ();
+  item = find_pkey_item (grip, mtime, size, 0);
+  if (item && item->pubkey)
+    hit = !gcry_sexp_sscan (r_key, NULL,
+                            (char*)item->pubkey, item->pubkeylen);
+  unlock_pkey_cache ();
+  return hit;
+}
+
+
+/* Put a copy of the public KEY for GRIP into the cache.  MTIME and
+ * SIZE describe the key file as it was before it has been read.
+ * Errors are ignored because the cache is only an optimization.  */
+static void
+put_pkey_cache (const unsigned char *grip, time_t mtime, off_t size,
+                gcry_sexp_t key)
+{
+  pkey_item_t item;
+  unsigned char *buf;
+  size_t len;
+
+  if (make_canon_sexp (key, &buf, &len))
+    return;
+
+  lock_pkey_cache ();
+  item = find_pkey_item (grip, mtime, size, 1);
+  if (item)
+    {
+      xfree (item->pubkey);
+      item->pubkey = buf;
+      item->pubkeylen = len;
+      buf = NULL;
+    }
+  unlock_pkey_cache ();
+  xfree (buf);
+}
+
+
+/* Try to get the key info for GRIP from the cache.  Returns true on
+ * a cache hit.  */
+static int
+get_pkey_cache_info (const unsigned char *grip, time_t mtime, off_t size,
+                     int *r_keytype, unsigned char **r_shadow_info)
+{
+  pkey_item_t item;
+  size_t n;
+  int hit = 0;
+
+  lock_pkey_cache ();
+  item = find_pkey_item (grip, mtime, size, 0);
+  if (item && item->have_info)
+    {
+      hit = 1;
+      if (r_keytype)
+        *r_keytype = item->keytype;
+      if (r_shadow_info && item->shadow_info)
+        {
+          n = gcry_sexp_canon_len (item->shadow_info, 0, NULL, NULL);
+          *r_shadow_info = xtrymalloc (n);
+          if (*r_shadow_info)
+            memcpy (*r_shadow_info, item->shadow_info, n);
+          else
+            hit = 0;
+        }
+    }
+  unlock_pkey_cache ();
+  return hit;
+}
+
+
+/* Put the key info for GRIP into the cache.  SHADOW_INFO is the
+ * canonical encoded shadow info or NULL.  */
+static void
+put_pkey_cache_info (const unsigned char *grip, time_t mtime, off_t size,
+                     int keytype, const unsigned char *shadow_info)
+{
+  pkey_item_t item;
+  unsigned char *buf = NULL;
+  size_t n;
+
+  if (shadow_info)
+    {
+      n = gcry_sexp_canon_len (shadow_info, 0, NULL, NULL);
+      if (!n || !(buf = xtrymalloc (n)))
+        return;
+      memcpy (buf, shadow_info, n);
+    }
+
+  lock_pkey_cache ();
+  item = find_pkey_item (grip, mtime, size, 1);
+  if (item)
+    {
+      xfree (item->shadow_info);
+      item->shadow_info = buf;
+      item->keytype = keytype;
+      item->have_info = 1;
+      buf = NULL;
+    }
+  unlock_pkey_cache ();
+  xfree (buf);
+}
+
+
+/* This is called by the main loop to tell whether the private key
+ * directory is watched for changes.  */
+void
+agent_keydir_set_watched (int yes)
+{
+  keygrip_inventory.watched = yes;
+  keygrip_inventory.valid = 0;
+}
+
+
+/* This is called whenever a file in the private key directory has
+ * been created, removed, or renamed.  This function is assured not to
+ * do any context switches.  */
+void
+agent_keydir_changed (void)
+{
+  keygrip_inventory.valid = 0;
+}
+
+
+/* Scan the private key directory and store the keygrips of all keys
+ * in the inventory.  */
+static gpg_error_t
+scan_keydir (void)
+{
+  gpg_error_t err;
+  char *dirname;
+  DIR *dir;
+  struct dirent *dir_entry;
+  unsigned char grip[20];
+  char hexgrip[41];
+
+  keygrip_inventory.valid = 0;
+  keygrip_inventory.count = 0;
+
+  dirname = make_filename_try (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR, NULL);
+  if (!dirname)
+    return gpg_error_from_syserror ();
+  dir = opendir (dirname);
+  if (!dir)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (dirname);
+      return err;
+    }
+  xfree (dirname);
+
+  err = 0;
+  while ((dir_entry = readdir (dir)))
+    {
+      if (strlen (dir_entry->d_name) != 44
+          || strcmp (dir_entry->d_name + 40, ".key"))
+        continue;
+      strncpy (hexgrip, dir_entry->d_name, 40);
+      hexgrip[40] = 0;
+      if (hex2bin (hexgrip, grip, 20) < 0)
+        continue; /* Bad hex string.  */
+
+      if (keygrip_inventory.count == keygrip_inventory.size)
+        {
+          unsigned int newsize = keygrip_inventory.size
+                                 ? 2 * keygrip_inventory.size : 64;
+          unsigned char *tmp;
+
+          tmp = xtryrealloc (keygrip_inventory.grips, newsize * 20);
+          if (!tmp)
+            {
+              err = gpg_error_from_syserror ();
+              break;
+            }
+          keygrip_inventory.grips = tmp;
+          keygrip_inventory.size = newsize;
+        }
+      memcpy (keygrip_inventory.grips + 20 * keygrip_inventory.count,
+              grip, 20);
+      keygrip_inventory.count++;
+    }
+  closedir (dir);
+
+  if (!err)
+    keygrip_inventory.valid = 1;
+  return err;
+}
+
+
+/* Return the keygrips of all keys in the private key directory as an
+ * allocated array at R_GRIPS with 20 bytes for each keygrip and the
+ * number of keys at R_COUNT.  If the directory is watched for changes
+ * this does not require any system call.  */
+gpg_error_t
+agent_list_keygrips (unsigned char **r_grips, unsigned int *r_count)
+{
+  gpg_error_t err;
+
+  *r_grips = NULL;
+  *r_count = 0;
+
+  if (!keygrip_inventory.watched || !keygrip_inventory.valid)
+    {
+      err = scan_keydir ();
+      if (err)
+        return err;
+    }
+
+  if (keygrip_inventory.count)
+    {
+      *r_grips = xtrymalloc (20 * keygrip_inventory.count);
+      if (!*r_grips)
+        return gpg_error_from_syserror ();
+      memcpy (*r_grips, keygrip_inventory.grips, 20 * keygrip_inventory.count);
+    }
+  *r_count = keygrip_inventory.count;
+  return 0;
+}
+
+
+/* Remove all cached unprotected keys whose passphrase has expired
+ * or has been cleared.  With ALL set the entire cache is flushed.
+ * This is called from the ticker.  */
+void
+agent_ukey_cache_housekeeping (int all)
+{
+  ukey_item_t item, prev, next;
+  char hexgrip[40+1];
+
+  if (all)
+    {
+      flush_ukey_cache (NULL);
+      return;
+    }
+
+  lock_ukey_cache ();
+  for (prev = NULL, item = ukey_cache; item; item = next)
+    {
+      next = item->next;
+      bin2hex (item->grip, 20, hexgrip);
+      if (agent_cache_has_item (hexgrip, item->cache_mode, item->restricted))
+        {
+          prev = item;
+          continue;
+        }
+      if (DBG_CACHE)
+        log_debug ("unprotected key %s expired\n", hexgrip);
+      if (prev)
+        prev->next = next;
+      else
+        ukey_cache = next;
+      release_ukey_item (item);
+    }
+  unlock_ukey_cache ();
+}
+
+
 /* Repalce all linefeeds in STRING by "%0A" and return a new malloced
  * string.  May return NULL on memory error.  */
 static char *
@@ -210,6 +858,10 @@ agent_write_private_key (const unsigned char *grip,
   estream_t fp;
   char hexgrip[40+4+1];
 
+  flush_ukey_cache (grip);
+  flush_pkey_cache (grip);
+  agent_keydir_changed ();
+
   bin2hex (grip, 20, hexgrip);
   strcpy (hexgrip+40, ".key");
 
@@ -933,6 +1585,10 @@ remove_key_file (const unsigned char *grip)
   char *fname;
   char hexgrip[40+4+1];
 
+  flush_ukey_cache (grip);
+  flush_pkey_cache (grip);
+  agent_keydir_changed ();
+
   bin2hex (grip, 20, hexgrip);
   strcpy (hexgrip+40, ".key");
   fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
@@ -979,6 +1635,10 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
   if (r_passphrase)
     *r_passphrase = NULL;
 
+  /* A caller asking for the passphrase needs the real thing.  */
+  if (!r_passphrase && get_ukey_cache (ctrl, grip, cache_mode, result))
+    return 0;
+
   err = read_key_file (grip, &s_skey, &keymeta);
   if (err)
     {
@@ -1066,6 +1726,8 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
 	    if (err)
 	      log_error ("failed to unprotect the secret key: %s\n",
 			 gpg_strerror (err));
+            else
+              put_ukey_cache (ctrl, grip, cache_mode, buf);
 	  }
 
 	xfree (desc_text_final);
@@ -1350,10 +2012,8 @@ agent_raw_key_from_file (ctrl_t ctrl, const unsigned char *grip,
    at RESULT.  This function extracts the public key from the private
    key database.  On failure an error code is returned and NULL stored
    at RESULT. */
-gpg_error_t
-agent_public_key_from_file (ctrl_t ctrl,
-                            const unsigned char *grip,
-                            gcry_sexp_t *result)
+static gpg_error_t
+public_key_from_file (const unsigned char *grip, gcry_sexp_t *result)
 {
   gpg_error_t err;
   int i, idx;
@@ -1374,8 +2034,6 @@ agent_public_key_from_file (ctrl_t ctrl,
   gcry_sexp_t list = NULL;
   const char *s;
 
-  (void)ctrl;
-
   *result = NULL;
 
   err = read_key_file (grip, &s_skey, NULL);
@@ -1480,6 +2138,34 @@ agent_public_key_from_file (ctrl_t ctrl,
 }
 
 
+/* Return the public key for GRIP as an S-expression at RESULT.  The
+ * public key is taken from the cache if the key file has not been
+ * changed.  */
+gpg_error_t
+agent_public_key_from_file (ctrl_t ctrl,
+                            const unsigned char *grip,
+                            gcry_sexp_t *result)
+{
+  gpg_error_t err;
+  time_t mtime;
+  off_t size;
+  int cacheable;
+
+  (void)ctrl;
+
+  *result = NULL;
+
+  cacheable = stat_key_file (grip, &mtime, &size);
+  if (cacheable && get_pkey_cache (grip, mtime, size, result))
+    return 0;
+
+  err = public_key_from_file (grip, result);
+  if (!err && cacheable)
+    put_pkey_cache (grip, mtime, size, *result);
+  return err;
+}
+
+
 
 /* Check whether the secret key identified by GRIP is available.
    Returns 0 is the key is available.  */
@@ -1514,6 +2200,10 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
   unsigned char *buf;
   size_t len;
   int keytype;
+  time_t mtime;
+  off_t size;
+  int cacheable;
+  const unsigned char *shadow_info = NULL;
 
   (void)ctrl;
 
@@ -1522,6 +2212,11 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
   if (r_shadow_info)
     *r_shadow_info = NULL;
 
+  cacheable = stat_key_file (grip, &mtime, &size);
+  if (cacheable
+      && get_pkey_cache_info (grip, mtime, size, r_keytype, r_shadow_info))
+    return 0;
+
   {
     gcry_sexp_t sexp;
 
@@ -1550,13 +2245,21 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
          from such a key. */
       break;
     case PRIVATE_KEY_SHADOWED:
-      if (r_shadow_info)
+      if (r_shadow_info || cacheable)
         {
           const unsigned char *s;
           size_t n;
 
           err = agent_get_shadow_info (buf, &s);
           if (!err)
+            shadow_info = s;
+          else if (!r_shadow_info)
+            {
+              /* Not requested by the caller; only don't cache it.  */
+              err = 0;
+              cacheable = 0;
+            }
+          if (!err && r_shadow_info)
             {
               n = gcry_sexp_canon_len (s, 0, NULL, NULL);
               log_assert (n);
@@ -1575,6 +2278,8 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
 
   if (!err && r_keytype)
     *r_keytype = keytype;
+  if (!err && cacheable)
+    put_pkey_cache_info (grip, mtime, size, keytype, shadow_info);
 
   xfree (buf);
   return err;
@@ -24,12 +24,203 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <npth.h>
 
 #include "agent.h"
 #include "../common/i18n.h"
 #include "../common/exechelp.h"
 #include "../common/sysutils.h"
 
+
+/* The maximum number of keys in the RSA key pool.  */
+#define MAX_RSA_POOL 64
+#define RSA_POOL_SIZE (opt.rsa_pool_size < MAX_RSA_POOL? \
+                       opt.rsa_pool_size : MAX_RSA_POOL)
+
+/* The pool of pre-generated RSA keys; see agent_rsa_pool_refill.  The
+ * pool is only accessed with the nPth lock held and thus needs no
+ * mutex.  The secret parts of the keys are stored by Libgcrypt in
+ * secure memory.  */
+static struct
+{
+  gcry_sexp_t keys[MAX_RSA_POOL];
+  unsigned int nbits[MAX_RSA_POOL];
+  unsigned int nkeys;
+  int refilling;   /* The refill thread is running.  */
+} rsa_pool;
+
+
+/* Release all keys in the pool which do not match the options.  */
+static void
+rsa_pool_trim (void)
+{
+  unsigned int i, n;
+
+  for (i = n = 0; i < rsa_pool.nkeys; i++)
+    if (n < RSA_POOL_SIZE && rsa_pool.nbits[i] == opt.rsa_pool_bits)
+      {
+        rsa_pool.keys[n] = rsa_pool.keys[i];
+        rsa_pool.nbits[n] = rsa_pool.nbits[i];
+        n++;
+      }
+    else
+      gcry_sexp_release (rsa_pool.keys[i]);
+  rsa_pool.nkeys = n;
+}
+
+
+/* The thread to fill the RSA key pool.  The keys are generated one
+ * by one without holding the nPth lock; thus the thread merely keeps
+ * one otherwise idle core busy and does not delay other requests.  */
+static void *
+rsa_pool_thread (void *arg)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_keyparam, s_key;
+  unsigned int nbits;
+  int unprotected;
+
+  (void)arg;
+
+  while (rsa_pool.nkeys < RSA_POOL_SIZE)
+    {
+      nbits = opt.rsa_pool_bits;
+      err = gcry_sexp_build (&s_keyparam, NULL,
+                             "(genkey(rsa(nbits %u)))", nbits);
+      if (err)
+        break;
+
+      unprotected = agent_release_lock ();
+      if (!unprotected)
+        npth_unprotect ();
+      err = gcry_pk_genkey (&s_key, s_keyparam);
+      if (unprotected)
+        agent_reacquire_lock ();
+      else
+        npth_protect ();
+      gcry_sexp_release (s_keyparam);
+      if (err)
+        {
+          log_error ("RSA key pool: key generation failed: %s\n",
+                     gpg_strerror (err));
+          break;
+        }
+
+      /* The options may have changed meanwhile.  */
+      rsa_pool_trim ();
+      if (rsa_pool.nkeys >= RSA_POOL_SIZE || nbits != opt.rsa_pool_bits)
+        {
+          gcry_sexp_release (s_key);
+          continue;
+        }
+      rsa_pool.keys[rsa_pool.nkeys] = s_key;
+      rsa_pool.nbits[rsa_pool.nkeys] = nbits;
+      rsa_pool.nkeys++;
+      if (DBG_CRYPTO)
+        log_debug ("RSA key pool: %u of %u keys\n",
+                   rsa_pool.nkeys, RSA_POOL_SIZE);
+    }
+
+  rsa_pool.refilling = 0;
+  return NULL;
+}
+
+
+/* Make sure that the RSA key pool is filled as requested by the
+ * options --rsa-key-pool and --rsa-key-pool-bits.  This starts a
+ * background thread if keys are missing.  This function is cheap and
+ * called by the ticker and after a key has been taken from the pool.  */
+void
+agent_rsa_pool_refill (void)
+{
+  npth_attr_t tattr;
+  npth_t thread;
+  int ret;
+
+  rsa_pool_trim ();
+  if (rsa_pool.refilling || rsa_pool.nkeys >= RSA_POOL_SIZE)
+    return;
+
+  if (npth_attr_init (&tattr))
+    return;
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  rsa_pool.refilling = 1;
+  ret = npth_create (&thread, &tattr, rsa_pool_thread, NULL);
+  if (ret)
+    {
+      log_error ("error spawning RSA key pool thread: %s\n", strerror (ret));
+      rsa_pool.refilling = 0;
+    }
+  npth_attr_destroy (&tattr);
+}
+
+
+/* Return a key from the RSA key pool if KEYPARAM asks for a plain RSA
+ * key of the pool's size.  Returns NULL if the key needs to be
+ * generated.  */
+static gcry_sexp_t
+rsa_pool_get (gcry_sexp_t keyparam)
+{
+  gcry_sexp_t l, l2;
+  gcry_sexp_t s_key = NULL;
+  unsigned int nbits;
+  unsigned int i;
+  char *s;
+  int n;
+
+  if (!rsa_pool.nkeys)
+    return NULL;
+
+  /* We accept only "(genkey(rsa(nbits N)))" and the same with a
+   * "(transient-key)" flag; other parameters, for example a custom
+   * exponent, need a fresh key.  */
+  l = gcry_sexp_find_token (keyparam, "genkey", 0);
+  if (!l || gcry_sexp_length (l) != 2)
+    goto leave;
+  l2 = gcry_sexp_find_token (l, "rsa", 0);
+  gcry_sexp_release (l);
+  l = l2;
+  if (!l)
+    goto leave;
+  n = gcry_sexp_length (l);
+  if (n == 3)
+    {
+      l2 = gcry_sexp_find_token (l, "transient-key", 0);
+      if (!l2)
+        goto leave;
+      gcry_sexp_release (l2);
+    }
+  else if (n != 2)
+    goto leave;
+  l2 = gcry_sexp_find_token (l, "nbits", 0);
+  if (!l2)
+    goto leave;
+  s = gcry_sexp_nth_string (l2, 1);
+  gcry_sexp_release (l2);
+  if (!s)
+    goto leave;
+  nbits = strtoul (s, NULL, 10);
+  xfree (s);
+
+  for (i = rsa_pool.nkeys; i > 0; i--)
+    if (rsa_pool.nbits[i-1] == nbits)
+      {
+        s_key = rsa_pool.keys[i-1];
+        rsa_pool.keys[i-1] = rsa_pool.keys[rsa_pool.nkeys-1];
+        rsa_pool.nbits[i-1] = rsa_pool.nbits[rsa_pool.nkeys-1];
+        rsa_pool.nkeys--;
+        if (DBG_CRYPTO)
+          log_debug ("RSA key pool: using a %u bit key\n", nbits);
+        agent_rsa_pool_refill ();
+        break;
+      }
+
+ leave:
+  gcry_sexp_release (l);
+  return s_key;
+}
+
+
 static int
 store_key (gcry_sexp_t private, const char *passphrase, int force,
 	unsigned long s2k_count)
@@ -433,6 +624,7 @@ agent_genkey (ctrl_t ctrl, const char *cache_nonce,
   char *passphrase_buffer = NULL;
   const char *passphrase;
   int rc;
+  int unprotected;
   size_t len;
   char *buf;
 
@@ -467,7 +659,19 @@ agent_genkey (ctrl_t ctrl, const char *cache_nonce,
       passphrase = passphrase_buffer;
     }
 
-  rc = gcry_pk_genkey (&s_key, s_keyparam );
+  /* The generation of an RSA key may take quite some time.  Let the
+   * other connections run meanwhile so that a client can generate
+   * several keys at the same time.  */
+  s_key = rsa_pool_get (s_keyparam);
+  if (s_key)
+    rc = 0;
+  else
+    {
+      unprotected = agent_release_lock ();
+      rc = gcry_pk_genkey (&s_key, s_keyparam );
+      if (unprotected)
+        agent_reacquire_lock ();
+    }
   gcry_sexp_release (s_keyparam);
   if (rc)
     {
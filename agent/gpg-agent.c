@@ -60,6 +60,8 @@
 #include "../common/exechelp.h"
 #include "../common/asshelp.h"
 #include "../common/init.h"
+#include "../common/workpool.h"
+#include "../common/asynclog.h"
 
 
 enum cmd_and_opt_values
@@ -95,6 +97,7 @@ enum cmd_and_opt_values
   oPinentryTouchFile,
   oPinentryInvisibleChar,
   oPinentryTimeout,
+  oPinentryKeepAlive,
   oDisplay,
   oTTYname,
   oTTYtype,
@@ -121,6 +124,7 @@ enum cmd_and_opt_values
   oFakedSystemTime,
 
   oIgnoreCacheForSigning,
+  oCacheUnprotectedKeys,
   oAllowMarkTrusted,
   oNoAllowMarkTrusted,
   oAllowPresetPassphrase,
@@ -137,8 +141,13 @@ enum cmd_and_opt_values
   oDisableCheckOwnSocket,
   oS2KCount,
   oS2KCalibration,
+  oS2KCalibrationCache,
+  oRSAKeyPool,
+  oRSAKeyPoolBits,
   oAutoExpandSecmem,
   oListenBacklog,
+  oConnectionThreads,
+  oLogBufferSize,
 
   oWriteEnvFile,
 
@@ -222,6 +231,8 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oDisableExtendedKeyFormat, "disable-extended-key-format", "@"),
   ARGPARSE_s_n (oEnableExtendedKeyFormat, "enable-extended-key-format", "@"),
   ARGPARSE_s_i (oListenBacklog, "listen-backlog", "@"),
+  ARGPARSE_s_u (oConnectionThreads, "connection-threads", "@"),
+  ARGPARSE_s_u (oLogBufferSize, "log-buffer-size", "@"),
   ARGPARSE_op_u (oAutoExpandSecmem, "auto-expand-secmem", "@"),
   ARGPARSE_s_s (oFakedSystemTime, "faked-system-time", "@"),
 
@@ -238,6 +249,7 @@ static gpgrt_opt_t opts[] = {
                 /* */     N_("|N|set maximum SSH key lifetime to N seconds")),
   ARGPARSE_s_n (oIgnoreCacheForSigning, "ignore-cache-for-signing",
                 /* */    N_("do not use the PIN cache when signing")),
+  ARGPARSE_s_n (oCacheUnprotectedKeys, "cache-unprotected-keys", "@"),
   ARGPARSE_s_n (oNoAllowExternalCache,  "no-allow-external-cache",
                 /* */    N_("disallow the use of an external password cache")),
   ARGPARSE_s_n (oNoAllowMarkTrusted, "no-allow-mark-trusted",
@@ -247,6 +259,9 @@ static gpgrt_opt_t opts[] = {
                 /* */                    N_("allow presetting passphrase")),
   ARGPARSE_s_u (oS2KCount, "s2k-count", "@"),
   ARGPARSE_s_u (oS2KCalibration, "s2k-calibration", "@"),
+  ARGPARSE_s_n (oS2KCalibrationCache, "s2k-calibration-cache", "@"),
+  ARGPARSE_s_u (oRSAKeyPool, "rsa-key-pool", "@"),
+  ARGPARSE_s_u (oRSAKeyPoolBits, "rsa-key-pool-bits", "@"),
 
   ARGPARSE_header ("Passphrase policy",
                    N_("Options enforcing a passphrase policy")),
@@ -280,6 +295,8 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_s (oPinentryInvisibleChar, "pinentry-invisible-char", "@"),
   ARGPARSE_s_u (oPinentryTimeout, "pinentry-timeout",
                 N_("|N|set the Pinentry timeout to N seconds")),
+  ARGPARSE_s_u (oPinentryKeepAlive, "pinentry-keep-alive",
+                N_("|N|keep an idle Pinentry for N seconds")),
   ARGPARSE_s_n (oAllowEmacsPinentry,  "allow-emacs-pinentry",
                 N_("allow passphrase to be prompted through Emacs")),
 
@@ -318,6 +335,7 @@ static struct debug_flags_s debug_flags [] =
 #define MIN_PASSPHRASE_LEN    (8)
 #define MIN_PASSPHRASE_NONALPHA (1)
 #define MAX_PASSPHRASE_DAYS   (0)
+#define DEFAULT_RSA_POOL_BITS (3072)
 
 /* The timer tick used for housekeeping stuff.  Note that on Windows
  * we use a SetWaitableTimer seems to signal earlier than about 2
@@ -408,6 +426,20 @@ static assuan_sock_nonce_t socket_nonce_ssh;
  * Let's try this as default.  Change at runtime with --listen-backlog.  */
 static int listen_backlog = 64;
 
+/* The maximum number of threads handling connections.  With 0 a new
+ * thread is started for each connection.  Otherwise accepted
+ * connections are queued and served by a pool of at most this many
+ * threads.  Change at startup with --connection-threads.  */
+static unsigned int connection_threads;
+
+/* The pool used with --connection-threads.  */
+static workpool_t connection_pool;
+
+/* The size in KiB of the buffer used to write the log file by a
+ * thread.  With 0 the log is written synchronously.  Change at
+ * startup with --log-buffer-size.  */
+static unsigned int log_buffer_size;
+
 /* Default values for options passed to the pinentry. */
 static char *default_display;
 static char *default_ttyname;
@@ -470,6 +502,13 @@ struct progress_dispatch_s
 };
 struct progress_dispatch_s *progress_dispatch_list;
 
+/* A thread local value which is set while the thread runs a lengthy
+ * computation without holding the nPth lock; see agent_release_lock.  */
+static npth_key_t my_tlskey_unprotected;
+
+/* Set if MY_TLSKEY_UNPROTECTED could be created.  */
+static int unprotect_supported;
+
 
 
 
@@ -845,6 +884,7 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       xfree (opt.pinentry_invisible_char);
       opt.pinentry_invisible_char = NULL;
       opt.pinentry_timeout = 0;
+      opt.pinentry_keep_alive = 0;
       opt.scdaemon_program = NULL;
       opt.def_cache_ttl = DEFAULT_CACHE_TTL;
       opt.def_cache_ttl_ssh = DEFAULT_CACHE_TTL_SSH;
@@ -858,6 +898,7 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       opt.enable_passphrase_history = 0;
       opt.enable_extended_key_format = 1;
       opt.ignore_cache_for_signing = 0;
+      opt.cache_unprotected_keys = 0;
       opt.allow_mark_trusted = 1;
       opt.allow_external_cache = 1;
       opt.allow_loopback_pinentry = 1;
@@ -868,6 +909,9 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       opt.ssh_fingerprint_digest = GCRY_MD_MD5;
       opt.s2k_count = 0;
       set_s2k_calibration_time (0);  /* Set to default.  */
+      opt.s2k_calibration_cache = 0;
+      opt.rsa_pool_size = 0;
+      opt.rsa_pool_bits = DEFAULT_RSA_POOL_BITS;
       return 1;
     }
 
@@ -889,7 +933,9 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       if (!current_logfile || !pargs->r.ret_str
           || strcmp (current_logfile, pargs->r.ret_str))
         {
-          log_set_file (pargs->r.ret_str);
+          if (!asynclog_is_active ()
+              || asynclog_start (pargs->r.ret_str, log_buffer_size * 1024))
+            log_set_file (pargs->r.ret_str);
           xfree (current_logfile);
           current_logfile = xtrystrdup (pargs->r.ret_str);
         }
@@ -905,6 +951,9 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       opt.pinentry_invisible_char = xtrystrdup (pargs->r.ret_str); break;
       break;
     case oPinentryTimeout: opt.pinentry_timeout = pargs->r.ret_ulong; break;
+    case oPinentryKeepAlive:
+      opt.pinentry_keep_alive = pargs->r.ret_ulong;
+      break;
     case oScdaemonProgram: opt.scdaemon_program = pargs->r.ret_str; break;
     case oDisableScdaemon: opt.disable_scdaemon = 1; break;
     case oDisableCheckOwnSocket: disable_check_own_socket = 1; break;
@@ -940,6 +989,7 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       break;
 
     case oIgnoreCacheForSigning: opt.ignore_cache_for_signing = 1; break;
+    case oCacheUnprotectedKeys: opt.cache_unprotected_keys = 1; break;
 
     case oAllowMarkTrusted: opt.allow_mark_trusted = 1; break;
     case oNoAllowMarkTrusted: opt.allow_mark_trusted = 0; break;
@@ -971,6 +1021,20 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       set_s2k_calibration_time (pargs->r.ret_ulong);
       break;
 
+    case oS2KCalibrationCache: opt.s2k_calibration_cache = 1; break;
+
+    case oRSAKeyPool:
+      opt.rsa_pool_size = pargs->r.ret_ulong;
+      break;
+
+    case oRSAKeyPoolBits:
+      if (pargs->r.ret_ulong < 1024 || pargs->r.ret_ulong > 16384)
+        log_error (_("invalid value for option '%s'\n"),
+                   "--rsa-key-pool-bits");
+      else
+        opt.rsa_pool_bits = pargs->r.ret_ulong;
+      break;
+
     case oNoop: break;
 
     default:
@@ -991,6 +1055,24 @@ finalize_rereadable_options (void)
 }
 
 
+/* The system call clamp.  This is npth_unprotect and npth_protect
+ * except for threads which have already released the lock by
+ * agent_release_lock.  */
+static void
+agent_pre_syscall (void)
+{
+  if (!unprotect_supported || !npth_getspecific (my_tlskey_unprotected))
+    npth_unprotect ();
+}
+
+static void
+agent_post_syscall (void)
+{
+  if (!unprotect_supported || !npth_getspecific (my_tlskey_unprotected))
+    npth_protect ();
+}
+
+
 static void
 thread_init_once (void)
 {
@@ -1000,8 +1082,15 @@ thread_init_once (void)
     {
       npth_initialized++;
       npth_init ();
+      /* Our Windows implementation does not yet feature the NPth TLS
+         functions.  */
+#ifndef HAVE_W32_SYSTEM
+      if (!npth_key_create (&my_tlskey_unprotected, NULL)
+          && !npth_setspecific (my_tlskey_unprotected, NULL))
+        unprotect_supported = 1;
+#endif /*!HAVE_W32_SYSTEM*/
     }
-  gpgrt_set_syscall_clamp (npth_unprotect, npth_protect);
+  gpgrt_set_syscall_clamp (agent_pre_syscall, agent_post_syscall);
   /* Now that we have set the syscall clamp we need to tell Libgcrypt
    * that it should get them from libgpg-error.  Note that Libgcrypt
    * has already been initialized but at that point nPth was not
@@ -1022,6 +1111,7 @@ initialize_modules (void)
   initialize_module_call_pinentry ();
   initialize_module_call_scd ();
   initialize_module_trustlist ();
+  initialize_module_findkey ();
 }
 
 
@@ -1275,6 +1365,14 @@ main (int argc, char **argv)
           listen_backlog = pargs.r.ret_int;
           break;
 
+        case oConnectionThreads:
+          connection_threads = pargs.r.ret_ulong;
+          break;
+
+        case oLogBufferSize:
+          log_buffer_size = pargs.r.ret_ulong;
+          break;
+
         case oDebugQuickRandom:
           /* Only used by the first stage command line parser.  */
           break;
@@ -1461,6 +1559,8 @@ main (int argc, char **argv)
                  GC_OPT_FLAG_NONE|GC_OPT_FLAG_RUNTIME);
       es_printf ("pinentry-timeout:%lu:0:\n",
                  GC_OPT_FLAG_DEFAULT|GC_OPT_FLAG_RUNTIME);
+      es_printf ("pinentry-keep-alive:%lu:0:\n",
+                 GC_OPT_FLAG_DEFAULT|GC_OPT_FLAG_RUNTIME);
       es_printf ("grab:%lu:\n",
                  GC_OPT_FLAG_NONE|GC_OPT_FLAG_RUNTIME);
 
@@ -1851,9 +1951,17 @@ agent_libgcrypt_progress_cb (void *data, const char *what, int printchar,
 {
   struct progress_dispatch_s *dispatch;
   npth_t mytid = npth_self ();
+  int unprotected;
 
   (void)data;
 
+  /* Take the lock again if we are called from a computation started
+   * by agent_release_lock; the callbacks write to the client.  */
+  unprotected = (unprotect_supported
+                 && npth_getspecific (my_tlskey_unprotected));
+  if (unprotected)
+    agent_reacquire_lock ();
+
   for (dispatch = progress_dispatch_list; dispatch; dispatch = dispatch->next)
     if (dispatch->ctrl && dispatch->tid == mytid)
       break;
@@ -1876,6 +1984,35 @@ agent_libgcrypt_progress_cb (void *data, const char *what, int printchar,
 #endif
     }
 #endif
+
+  if (unprotected)
+    agent_release_lock ();
+}
+
+
+/* Release the nPth lock so that other threads can run while the
+ * current thread does a lengthy computation like the generation of a
+ * key.  Returns true if the lock has been released; in this case
+ * agent_reacquire_lock must be called after the computation.  The code
+ * between these calls may only use thread-safe functions; the
+ * progress callbacks of Libgcrypt are taken care of.  */
+int
+agent_release_lock (void)
+{
+  if (!unprotect_supported
+      || npth_setspecific (my_tlskey_unprotected, &unprotect_supported))
+    return 0;
+  npth_unprotect ();
+  return 1;
+}
+
+
+/* Take the nPth lock again after agent_release_lock.  */
+void
+agent_reacquire_lock (void)
+{
+  npth_protect ();
+  npth_setspecific (my_tlskey_unprotected, NULL);
 }
 
 
@@ -2100,6 +2237,17 @@ get_agent_active_connection_count (void)
 }
 
 
+/* Return a malloced string with the statistics of the connection
+ * thread pool or NULL on a memory error.  */
+char *
+get_agent_connection_pool_stats (void)
+{
+  if (!connection_pool)
+    return xtrystrdup ("max_threads=0");
+  return workpool_stats (connection_pool);
+}
+
+
 /* Under W32, this function returns the handle of the scdaemon
    notification event.  Calling it the first time creates that
    event.  */
@@ -2416,6 +2564,11 @@ handle_tick (void)
 
   /* Need to check for expired cache entries.  */
   agent_cache_housekeeping ();
+  agent_ukey_cache_housekeeping (0);
+  agent_pinentry_housekeeping ();
+
+  /* Start the refill of the RSA key pool if needed.  */
+  agent_rsa_pool_refill ();
 
   /* Check whether the homedir is still available.  */
   if (!shutdown_pending
@@ -2437,6 +2590,8 @@ agent_sighup_action (void)
             "re-reading configuration and flushing cache\n");
 
   agent_flush_cache (0);
+  agent_ukey_cache_housekeeping (1);
+  agent_pkey_cache_flush ();
   reread_configuration ();
   agent_reload_trustlist ();
   /* We flush the module name cache so that after installing a
@@ -2744,6 +2899,22 @@ do_start_connection_thread (ctrl_t ctrl)
 }
 
 
+/* The thread used to calibrate the S2K count at startup.  */
+static void *
+s2k_calibration_thread (void *arg)
+{
+  unsigned long count;
+
+  (void)arg;
+
+  npth_unprotect ();
+  count = compute_s2k_calibration ();
+  npth_protect ();
+  set_calibrated_s2k_count (count);
+  return NULL;
+}
+
+
 /* This is the standard connection thread's main function.  */
 static void *
 start_connection_thread_std (void *arg)
@@ -2850,15 +3021,17 @@ handle_connections (gnupg_fd_t listen_fd,
 #endif
   int sock_inotify_fd = -1;
   int home_inotify_fd = -1;
+  int keydir_inotify_fd = -1;
   struct {
     const char *name;
     void *(*func) (void *arg);
+    int prio;
     gnupg_fd_t l_fd;
   } listentbl[] = {
-    { "std",     start_connection_thread_std   },
-    { "extra",   start_connection_thread_extra },
-    { "browser", start_connection_thread_browser },
-    { "ssh",    start_connection_thread_ssh   }
+    { "std",     start_connection_thread_std,     0 },
+    { "extra",   start_connection_thread_extra,   1 },
+    { "browser", start_connection_thread_browser, 2 },
+    { "ssh",    start_connection_thread_ssh,      0 }
   };
 
 
@@ -2868,6 +3041,30 @@ handle_connections (gnupg_fd_t listen_fd,
 	       strerror (ret));
   npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
 
+  if (connection_threads
+      && (err = workpool_new (&connection_pool, "connections",
+                              connection_threads, 0)))
+    log_fatal ("error creating connection pool: %s\n", gpg_strerror (err));
+
+  /* The log writer thread must be started after forking.  */
+  if (log_buffer_size && current_logfile
+      && (err = asynclog_start (current_logfile, log_buffer_size * 1024))
+      && gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED)
+    log_error ("error starting the log writer: %s\n", gpg_strerror (err));
+
+  /* Without a stored S2K count for this system we calibrate now in
+   * the background so that the first operation does not need to
+   * wait for it.  */
+  if (opt.s2k_calibration_cache && !opt.s2k_count && !load_s2k_calibration ())
+    {
+      npth_t thread;
+
+      ret = npth_create (&thread, &tattr, s2k_calibration_thread, NULL);
+      if (ret)
+        log_error ("error spawning S2K calibration thread: %s\n",
+                   strerror (ret));
+    }
+
 #ifndef HAVE_W32_SYSTEM
   npth_sigev_init ();
   npth_sigev_add (SIGHUP);
@@ -2908,6 +3105,18 @@ handle_connections (gnupg_fd_t listen_fd,
   else
     have_homedir_inotify = 1;
 
+  /* Watch the private key directory so that the list of keys need
+   * not be read for each KEYINFO --list.  */
+  {
+    char *keydir = make_filename (gnupg_homedir (),
+                                  GNUPG_PRIVATE_KEYS_DIR, NULL);
+    err = gnupg_inotify_watch_dir (&keydir_inotify_fd, keydir);
+    if (err && gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED)
+      log_info ("error watching '%s': %s\n", keydir, gpg_strerror (err));
+    xfree (keydir);
+    agent_keydir_set_watched (keydir_inotify_fd != -1);
+  }
+
   /* On Windows we need to fire up a separate thread to listen for
      requests from Putty (an SSH client), so we can replace Putty's
      Pageant (its ssh-agent implementation). */
@@ -2961,6 +3170,12 @@ handle_connections (gnupg_fd_t listen_fd,
       if (home_inotify_fd > nfd)
         nfd = home_inotify_fd;
     }
+  if (keydir_inotify_fd != -1)
+    {
+      FD_SET (keydir_inotify_fd, &fdset);
+      if (keydir_inotify_fd > nfd)
+        nfd = keydir_inotify_fd;
+    }
 
   listentbl[0].l_fd = listen_fd;
   listentbl[1].l_fd = listen_fd_extra;
@@ -3068,6 +3283,20 @@ handle_connections (gnupg_fd_t listen_fd,
           log_info ("homedir has been removed - shutting down\n");
         }
 
+      if (keydir_inotify_fd != -1
+          && FD_ISSET (keydir_inotify_fd, &read_fdset))
+        {
+          agent_keydir_changed ();
+          if (gnupg_inotify_read_events (keydir_inotify_fd))
+            {
+              /* The directory itself is gone; fall back to scanning.  */
+              FD_CLR (keydir_inotify_fd, &fdset);
+              close (keydir_inotify_fd);
+              keydir_inotify_fd = -1;
+              agent_keydir_set_watched (0);
+            }
+        }
+
       if (!shutdown_pending)
         {
           int idx;
@@ -3105,8 +3334,16 @@ handle_connections (gnupg_fd_t listen_fd,
               else
                 {
                   ctrl->thread_startup.fd = fd;
-                  ret = npth_create (&thread, &tattr,
-                                     listentbl[idx].func, ctrl);
+                  if (connection_pool)
+                    {
+                      err = workpool_submit (connection_pool,
+                                             listentbl[idx].func, ctrl,
+                                             listentbl[idx].prio);
+                      ret = err? gpg_err_code_to_errno (err) : 0;
+                    }
+                  else
+                    ret = npth_create (&thread, &tattr,
+                                       listentbl[idx].func, ctrl);
                   if (ret)
                     {
                       log_error ("error spawning connection handler for %s:"
@@ -3123,6 +3360,8 @@ handle_connections (gnupg_fd_t listen_fd,
     close (sock_inotify_fd);
   if (home_inotify_fd != -1)
     close (home_inotify_fd);
+  if (keydir_inotify_fd != -1)
+    close (keydir_inotify_fd);
   cleanup ();
   log_info (_("%s %s stopped\n"), gpgrt_strusage(11), gpgrt_strusage(13));
   npth_attr_destroy (&tattr);
@@ -273,6 +273,100 @@ do_encode_raw_pkcs1 (const byte *md, size_t mdlen, unsigned int nbits,
 
 
 
+/* Create the signature over the DATALEN bytes of DATA with the secret
+ * key S_SKEY using the digest algorithm set in CTRL and store it at
+ * R_SIG.  */
+static gpg_error_t
+sign_with_skey (ctrl_t ctrl, gcry_sexp_t s_skey,
+                const unsigned char *data, int datalen, gcry_sexp_t *r_sig)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_hash = NULL;
+  gcry_sexp_t s_sig = NULL;
+  int dsaalgo = 0;
+
+  *r_sig = NULL;
+
+  /* Put the hash into a sexp */
+  if (agent_is_eddsa_key (s_skey))
+    err = do_encode_eddsa (data, datalen,
+                           &s_hash);
+  else if (ctrl->digest.algo == MD_USER_TLS_MD5SHA1)
+    err = do_encode_raw_pkcs1 (data, datalen,
+                               gcry_pk_get_nbits (s_skey),
+                               &s_hash);
+  else if ( (dsaalgo = agent_is_dsa_key (s_skey)) )
+    err = do_encode_dsa (data, datalen,
+                         dsaalgo, s_skey,
+                         &s_hash);
+  else
+    err = do_encode_md (data, datalen,
+                        ctrl->digest.algo,
+                        &s_hash,
+                        ctrl->digest.raw_value);
+  if (err)
+    goto leave;
+
+  if (DBG_CRYPTO)
+    {
+      gcry_log_debugsxp ("skey", s_skey);
+      gcry_log_debugsxp ("hash", s_hash);
+    }
+
+  /* sign */
+  err = gcry_pk_sign (&s_sig, s_hash, s_skey);
+  if (err)
+    {
+      log_error ("signing failed: %s\n", gpg_strerror (err));
+      goto leave;
+    }
+
+  if (DBG_CRYPTO)
+    gcry_log_debugsxp ("rslt", s_sig);
+
+  /* Check that the signature verification worked and nothing is
+   * fooling us.  Libgcrypt 1.7 does this for RSA internally.  */
+  if (dsaalgo == 0 && GCRYPT_VERSION_NUMBER < 0x010700)
+    {
+      err = gcry_pk_verify (s_sig, s_hash, s_skey);
+      if (err)
+        {
+          log_error (_("checking created signature failed: %s\n"),
+                     gpg_strerror (err));
+          goto leave;
+        }
+    }
+
+  *r_sig = s_sig;
+  s_sig = NULL;
+
+ leave:
+  gcry_sexp_release (s_sig);
+  gcry_sexp_release (s_hash);
+  return err;
+}
+
+
+/* Append the signature S_SIG in canonical format to OUTBUF.  */
+static gpg_error_t
+put_signature (membuf_t *outbuf, gcry_sexp_t s_sig)
+{
+  char *buf;
+  size_t len;
+
+  len = gcry_sexp_sprint (s_sig, GCRYSEXP_FMT_CANON, NULL, 0);
+  log_assert (len);
+  buf = xtrymalloc (len);
+  if (!buf)
+    return gpg_error_from_syserror ();
+  len = gcry_sexp_sprint (s_sig, GCRYSEXP_FMT_CANON, buf, len);
+  log_assert (len);
+  put_membuf (outbuf, buf, len);
+  xfree (buf);
+  return 0;
+}
+
+
 /* SIGN whatever information we have accumulated in CTRL and return
  * the signature S-expression.  LOOKUP is an optional function to
  * provide a way for lower layers to ask for the caching TTL.  If a
@@ -496,50 +590,9 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
   else
     {
       /* No smartcard, but a private key (in S_SKEY). */
-      int dsaalgo = 0;
-
-      /* Put the hash into a sexp */
-      if (agent_is_eddsa_key (s_skey))
-        err = do_encode_eddsa (data, datalen,
-                               &s_hash);
-      else if (ctrl->digest.algo == MD_USER_TLS_MD5SHA1)
-        err = do_encode_raw_pkcs1 (data, datalen,
-                                   gcry_pk_get_nbits (s_skey),
-                                   &s_hash);
-      else if ( (dsaalgo = agent_is_dsa_key (s_skey)) )
-        err = do_encode_dsa (data, datalen,
-                             dsaalgo, s_skey,
-                             &s_hash);
-      else
-        err = do_encode_md (data, datalen,
-                            ctrl->digest.algo,
-                            &s_hash,
-                            ctrl->digest.raw_value);
+      err = sign_with_skey (ctrl, s_skey, data, datalen, &s_sig);
       if (err)
         goto leave;
-
-      if (dsaalgo == 0 && GCRYPT_VERSION_NUMBER < 0x010700)
-        {
-          /* It's RSA and Libgcrypt < 1.7 */
-          check_signature = 1;
-        }
-
-      if (DBG_CRYPTO)
-        {
-          gcry_log_debugsxp ("skey", s_skey);
-          gcry_log_debugsxp ("hash", s_hash);
-        }
-
-      /* sign */
-      err = gcry_pk_sign (&s_sig, s_hash, s_skey);
-      if (err)
-        {
-          log_error ("signing failed: %s\n", gpg_strerror (err));
-          goto leave;
-        }
-
-      if (DBG_CRYPTO)
-        gcry_log_debugsxp ("rslt", s_sig);
     }
 
   /* Check that the signature verification worked and nothing is
@@ -595,29 +648,77 @@ agent_pksign (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
 {
   gpg_error_t err;
   gcry_sexp_t s_sig = NULL;
-  char *buf = NULL;
-  size_t len = 0;
 
   err = agent_pksign_do (ctrl, cache_nonce, desc_text, &s_sig, cache_mode,
                          NULL, NULL, 0);
-  if (err)
-    goto leave;
+  if (!err)
+    err = put_signature (outbuf, s_sig);
 
-  len = gcry_sexp_sprint (s_sig, GCRYSEXP_FMT_CANON, NULL, 0);
-  log_assert (len);
-  buf = xtrymalloc (len);
-  if (!buf)
+  gcry_sexp_release (s_sig);
+  return err;
+}
+
+
+/* Sign each of the NHASHES hashes in HASHES with the key set in CTRL
+ * and append the signatures in canonical format to OUTBUF.  Each
+ * hash has the length and the algorithm set in CTRL by SETHASH.  In
+ * contrast to calling agent_pksign for each hash, the secret key is
+ * read and unprotected only once and kept in secure memory until all
+ * signatures have been created.  */
+gpg_error_t
+agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce,
+                    const char *desc_text,
+                    const unsigned char *hashes, size_t nhashes,
+                    membuf_t *outbuf, cache_mode_t cache_mode)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_skey = NULL;
+  gcry_sexp_t s_sig = NULL;
+  unsigned char *shadow_info = NULL;
+  size_t hashlen = ctrl->digest.valuelen;
+  size_t i;
+
+  if (!ctrl->have_keygrip)
+    return gpg_error (GPG_ERR_NO_SECKEY);
+
+  err = agent_key_from_file (ctrl, cache_nonce, desc_text, ctrl->keygrip,
+                             &shadow_info, cache_mode, NULL,
+                             &s_skey, NULL);
+  if (shadow_info || gpg_err_code (err) == GPG_ERR_NO_SECKEY)
     {
-      err = gpg_error_from_syserror ();
+      /* The key is on a smartcard which caches the PIN itself; thus
+       * we use the regular code for each hash.  */
+      err = 0;
+      for (i=0; !err && i < nhashes; i++)
+        {
+          err = agent_pksign_do (ctrl, cache_nonce, desc_text, &s_sig,
+                                 cache_mode, NULL,
+                                 hashes + i * hashlen, hashlen);
+          if (!err)
+            err = put_signature (outbuf, s_sig);
+          gcry_sexp_release (s_sig);
+          s_sig = NULL;
+        }
+      goto leave;
+    }
+  else if (err)
+    {
+      log_error ("failed to read the secret key\n");
       goto leave;
     }
-  len = gcry_sexp_sprint (s_sig, GCRYSEXP_FMT_CANON, buf, len);
-  log_assert (len);
-  put_membuf (outbuf, buf, len);
 
- leave:
-  gcry_sexp_release (s_sig);
-  xfree (buf);
+  for (i=0; !err && i < nhashes; i++)
+    {
+      err = sign_with_skey (ctrl, s_skey, hashes + i * hashlen, hashlen,
+                            &s_sig);
+      if (!err)
+        err = put_signature (outbuf, s_sig);
+      gcry_sexp_release (s_sig);
+      s_sig = NULL;
+    }
 
+ leave:
+  gcry_sexp_release (s_skey);
+  xfree (shadow_info);
   return err;
 }
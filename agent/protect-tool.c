@@ -800,6 +800,51 @@ agent_askpin (ctrl_t ctrl,
   return err;
 }
 
+/* Replacement for the function in gpg-agent.c.  There is no nPth
+ * lock to release.  */
+int
+agent_release_lock (void)
+{
+  return 0;
+}
+
+void
+agent_reacquire_lock (void)
+{
+}
+
+
+/* Replacement for the functions in cache.c.  There is no cache.  */
+int
+agent_get_kek_cache (const char *passphrase, int hashalgo, int s2kmode,
+                     const unsigned char *s2ksalt, unsigned long s2kcount,
+                     unsigned char *key, size_t keylen)
+{
+  (void)passphrase;
+  (void)hashalgo;
+  (void)s2kmode;
+  (void)s2ksalt;
+  (void)s2kcount;
+  (void)key;
+  (void)keylen;
+  return 0;
+}
+
+void
+agent_put_kek_cache (const char *passphrase, int hashalgo, int s2kmode,
+                     const unsigned char *s2ksalt, unsigned long s2kcount,
+                     const unsigned char *key, size_t keylen)
+{
+  (void)passphrase;
+  (void)hashalgo;
+  (void)s2kmode;
+  (void)s2ksalt;
+  (void)s2kcount;
+  (void)key;
+  (void)keylen;
+}
+
+
 /* Replacement for the function in findkey.c.  Here we write the key
  * to stdout. */
 int
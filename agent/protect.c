@@ -35,6 +35,7 @@
 # include <windows.h>
 #else
 # include <sys/times.h>
+# include <sys/utsname.h>
 #endif
 
 #include "agent.h"
@@ -75,6 +76,10 @@ static const struct {
 static unsigned int s2k_calibration_time = AGENT_S2K_CALIBRATION;
 static unsigned long s2k_calibrated_count;
 
+/* The name of the file in the homedir used to persist the calibrated
+ * count if --s2k-calibration-cache is used.  */
+#define S2K_CALIBRATION_FILE "s2k-calibration.txt"
+
 
 /* A helper object for time measurement.  */
 struct calibrate_time_s
@@ -200,6 +205,154 @@ calibrate_s2k_count (void)
 }
 
 
+/* Compute a fingerprint of the hardware and the crypto library which
+ * are used for the S2K and of the calibration time.  A calibrated
+ * count is only valid for the same fingerprint.  The fingerprint is
+ * stored as hex string at HEXFPR which needs to have a size of 41
+ * bytes.  Returns false on error.  */
+static int
+s2k_calibration_fpr (char *hexfpr)
+{
+  gcry_md_hd_t md;
+  char line[256];
+#ifdef HAVE_W32_SYSTEM
+  SYSTEM_INFO si;
+#else
+  struct utsname utsbuf;
+  estream_t fp;
+#endif
+
+  if (gcry_md_open (&md, GCRY_MD_SHA1, 0))
+    return 0;
+
+  snprintf (line, sizeof line, "%s %u\n",
+            gcry_check_version (NULL), s2k_calibration_time);
+  gcry_md_write (md, line, strlen (line));
+#ifdef HAVE_W32_SYSTEM
+  GetSystemInfo (&si);
+  snprintf (line, sizeof line, "%lu %u %u %lu\n",
+            (unsigned long)si.dwProcessorType,
+            (unsigned int)si.wProcessorLevel,
+            (unsigned int)si.wProcessorRevision,
+            (unsigned long)si.dwNumberOfProcessors);
+  gcry_md_write (md, line, strlen (line));
+#else
+  if (!uname (&utsbuf))
+    {
+      gcry_md_write (md, utsbuf.sysname, strlen (utsbuf.sysname));
+      gcry_md_write (md, utsbuf.machine, strlen (utsbuf.machine));
+    }
+  /* On Linux we also take the description of the first processor
+   * but skip the fields which change at runtime.  */
+  fp = es_fopen ("/proc/cpuinfo", "r");
+  if (fp)
+    {
+      while (es_fgets (line, sizeof line, fp) && *line != '\n')
+        if (strncmp (line, "cpu MHz", 7) && strncmp (line, "bogomips", 8))
+          gcry_md_write (md, line, strlen (line));
+      es_fclose (fp);
+    }
+#endif
+
+  bin2hex (gcry_md_read (md, GCRY_MD_SHA1), 20, hexfpr);
+  gcry_md_close (md);
+  return 1;
+}
+
+
+/* Try to load the calibrated count from the homedir.  Returns true
+ * if a valid count for this system has been found, which is then
+ * used.  */
+int
+load_s2k_calibration (void)
+{
+  char *fname;
+  estream_t fp;
+  char line[256];
+  char hexfpr[41];
+  char *p;
+  unsigned long count = 0;
+
+  if (!opt.s2k_calibration_cache || !s2k_calibration_fpr (hexfpr))
+    return 0;
+
+  fname = make_filename (gnupg_homedir (), S2K_CALIBRATION_FILE, NULL);
+  fp = es_fopen (fname, "r");
+  xfree (fname);
+  if (!fp)
+    return 0;
+  while (es_fgets (line, sizeof line, fp))
+    {
+      if (*line == '#')
+        continue;
+      if (strlen (line) > 41 && !strncmp (line, hexfpr, 40)
+          && line[40] == ' ')
+        {
+          count = strtoul (line + 41, &p, 10);
+          if (*p && *p != '\n')
+            count = 0;
+        }
+      break;
+    }
+  es_fclose (fp);
+
+  if (count < 65536)
+    return 0;
+
+  if (opt.verbose)
+    log_info ("S2K calibration: using stored count %lu\n", count);
+  s2k_calibrated_count = count;
+  return 1;
+}
+
+
+/* Store COUNT in the homedir.  Errors are only logged.  */
+static void
+store_s2k_calibration (unsigned long count)
+{
+  char *fname;
+  estream_t fp;
+  char hexfpr[41];
+
+  if (!opt.s2k_calibration_cache || !s2k_calibration_fpr (hexfpr))
+    return;
+
+  fname = make_filename (gnupg_homedir (), S2K_CALIBRATION_FILE, NULL);
+  fp = es_fopen (fname, "w,mode=-rw");
+  if (!fp)
+    {
+      log_error ("can't create '%s': %s\n",
+                 fname, gpg_strerror (gpg_error_from_syserror ()));
+      xfree (fname);
+      return;
+    }
+  es_fprintf (fp, "# Calibrated S2K count - written by gpg-agent.\n"
+              "%s %lu\n", hexfpr, count);
+  if (es_fclose (fp))
+    log_error ("error writing '%s': %s\n",
+               fname, gpg_strerror (gpg_error_from_syserror ()));
+  xfree (fname);
+}
+
+
+/* Run the calibration and return the count.  This does not change
+ * any state and may thus be called without holding the npth lock.  */
+unsigned long
+compute_s2k_calibration (void)
+{
+  return calibrate_s2k_count ();
+}
+
+
+/* Set the calibrated count to COUNT and persist it if requested.  */
+void
+set_calibrated_s2k_count (unsigned long count)
+{
+  s2k_calibrated_count = count;
+  store_s2k_calibration (count);
+}
+
+
 /* Set the calibration time.  This may be called early at startup or
  * at any time.  Thus it should one set variables.  */
 void
@@ -219,8 +372,8 @@ set_s2k_calibration_time (unsigned int milliseconds)
 unsigned long
 get_calibrated_s2k_count (void)
 {
-  if (!s2k_calibrated_count)
-    s2k_calibrated_count = calibrate_s2k_count ();
+  if (!s2k_calibrated_count && !load_s2k_calibration ())
+    set_calibrated_s2k_count (calibrate_s2k_count ());
 
   /* Enforce a lower limit.  */
   return s2k_calibrated_count < 65536 ? 65536 : s2k_calibrated_count;
@@ -1443,6 +1596,11 @@ agent_private_key_type (const unsigned char *privatekey)
    provide an HASHALGO, a valid S2KMODE (see rfc-2440) and depending on
    that mode an S2KSALT of 8 random bytes and an S2KCOUNT.
 
+   The calibrated S2K takes a noticeable time; thus the result of the
+   iterated and salted S2K is cached and the nPth lock is released so
+   that other connections, for example other imports, can run
+   meanwhile.
+
    Returns an error code on failure.  */
 static int
 hash_passphrase (const char *passphrase, int hashalgo,
@@ -1451,17 +1609,32 @@ hash_passphrase (const char *passphrase, int hashalgo,
                  unsigned long s2kcount,
                  unsigned char *key, size_t keylen)
 {
+  gpg_error_t err;
+  int unprotected;
+
   /* The key derive function does not support a zero length string for
      the passphrase in the S2K modes.  Return a better suited error
      code than GPG_ERR_INV_DATA.  */
   if (!passphrase || !*passphrase)
     return gpg_error (GPG_ERR_NO_PASSPHRASE);
-  return gcry_kdf_derive (passphrase, strlen (passphrase),
-                          s2kmode == 3? GCRY_KDF_ITERSALTED_S2K :
-                          s2kmode == 1? GCRY_KDF_SALTED_S2K :
-                          s2kmode == 0? GCRY_KDF_SIMPLE_S2K : GCRY_KDF_NONE,
-                          hashalgo, s2ksalt, 8, s2kcount,
-                          keylen, key);
+  if (s2kmode == 3
+      && agent_get_kek_cache (passphrase, hashalgo, s2kmode, s2ksalt,
+                              s2kcount, key, keylen))
+    return 0;
+
+  unprotected = agent_release_lock ();
+  err = gcry_kdf_derive (passphrase, strlen (passphrase),
+                         s2kmode == 3? GCRY_KDF_ITERSALTED_S2K :
+                         s2kmode == 1? GCRY_KDF_SALTED_S2K :
+                         s2kmode == 0? GCRY_KDF_SIMPLE_S2K : GCRY_KDF_NONE,
+                         hashalgo, s2ksalt, 8, s2kcount,
+                         keylen, key);
+  if (unprotected)
+    agent_reacquire_lock ();
+  if (!err && s2kmode == 3)
+    agent_put_kek_cache (passphrase, hashalgo, s2kmode, s2ksalt, s2kcount,
+                         key, keylen);
+  return err;
 }
 
 
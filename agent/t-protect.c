@@ -349,3 +349,47 @@ convert_from_openpgp_native (gcry_sexp_t s_pgp, const char *passphrase,
   (void)r_key;
   return gpg_error (GPG_ERR_BUG);
 }
+
+/* Stub function.  */
+int
+agent_release_lock (void)
+{
+  return 0;
+}
+
+/* Stub function.  */
+void
+agent_reacquire_lock (void)
+{
+}
+
+/* Stub function.  */
+int
+agent_get_kek_cache (const char *passphrase, int hashalgo, int s2kmode,
+                     const unsigned char *s2ksalt, unsigned long s2kcount,
+                     unsigned char *key, size_t keylen)
+{
+  (void)passphrase;
+  (void)hashalgo;
+  (void)s2kmode;
+  (void)s2ksalt;
+  (void)s2kcount;
+  (void)key;
+  (void)keylen;
+  return 0;
+}
+
+/* Stub function.  */
+void
+agent_put_kek_cache (const char *passphrase, int hashalgo, int s2kmode,
+                     const unsigned char *s2ksalt, unsigned long s2kcount,
+                     const unsigned char *key, size_t keylen)
+{
+  (void)passphrase;
+  (void)hashalgo;
+  (void)s2kmode;
+  (void)s2ksalt;
+  (void)s2kcount;
+  (void)key;
+  (void)keylen;
+}
@@ -52,6 +52,12 @@ typedef struct trustitem_s trustitem_t;
 /* Malloced table and its allocated size with all trust items. */
 static trustitem_t *trusttable;
 static size_t trusttablesize;
+/* A malloced hash table with indices into TRUSTTABLE and its size
+   minus one; the size is a power of two.  Empty slots are -1.  It is
+   keyed by the first four bytes of the fingerprint and is NULL if the
+   trusttable is empty.  */
+static int *trusthash;
+static size_t trusthashmask;
 /* A mutex used to protect the table. */
 static npth_mutex_t trusttable_lock;
 
@@ -124,6 +130,73 @@ clear_trusttable (void)
   xfree (trusttable);
   trusttable = NULL;
   trusttablesize = 0;
+  xfree (trusthash);
+  trusthash = NULL;
+  trusthashmask = 0;
+}
+
+
+/* Return the first hash slot for the fingerprint FPR.  */
+static inline size_t
+trusthash_slot (const unsigned char *fpr)
+{
+  return (((size_t)fpr[0] << 24) | (fpr[1] << 16) | (fpr[2] << 8) | fpr[3]);
+}
+
+
+/* Build the hash table for the trusttable.  Only the first entry for
+   a fingerprint is indexed as that was the one found by the former
+   linear search.  The trusttable is assumed to be locked.  */
+static gpg_error_t
+build_trusthash (void)
+{
+  size_t size, idx, slot;
+
+  xfree (trusthash);
+  trusthash = NULL;
+  trusthashmask = 0;
+  if (!trusttablesize)
+    return 0;
+
+  for (size = 16; size < 2 * trusttablesize; size <<= 1)
+    ;
+  trusthash = xtrymalloc (size * sizeof *trusthash);
+  if (!trusthash)
+    return gpg_error_from_syserror ();
+  for (slot = 0; slot < size; slot++)
+    trusthash[slot] = -1;
+  trusthashmask = size - 1;
+
+  for (idx = 0; idx < trusttablesize; idx++)
+    {
+      for (slot = trusthash_slot (trusttable[idx].fpr) & trusthashmask;
+           trusthash[slot] != -1;
+           slot = (slot + 1) & trusthashmask)
+        if (!memcmp (trusttable[trusthash[slot]].fpr,
+                     trusttable[idx].fpr, 20))
+          break;
+      if (trusthash[slot] == -1)
+        trusthash[slot] = idx;
+    }
+  return 0;
+}
+
+
+/* Return the item for the binary fingerprint FPR or NULL.  The
+   trusttable is assumed to be locked.  */
+static trustitem_t *
+lookup_trusttable (const unsigned char *fpr)
+{
+  size_t slot;
+
+  if (!trusthash)
+    return NULL;
+  for (slot = trusthash_slot (fpr) & trusthashmask;
+       trusthash[slot] != -1;
+       slot = (slot + 1) & trusthashmask)
+    if (!memcmp (trusttable[trusthash[slot]].fpr, fpr, 20))
+      return trusttable + trusthash[slot];
+  return NULL;
 }
 
 
@@ -380,7 +453,6 @@ read_trustfiles (void)
       return err;
     }
 
-  /* Fixme: we should drop duplicates and sort the table. */
   ti = xtryrealloc (table, (tableidx?tableidx:1) * sizeof *table);
   if (!ti)
     {
@@ -389,11 +461,14 @@ read_trustfiles (void)
       return err;
     }
 
-  /* Replace the trusttable.  */
+  /* Replace the trusttable and index it.  */
   xfree (trusttable);
   trusttable = ti;
   trusttablesize = tableidx;
-  return 0;
+  err = build_trusthash ();
+  if (err)
+    clear_trusttable ();
+  return err;
 }
 
 
@@ -407,8 +482,8 @@ istrusted_internal (ctrl_t ctrl, const char *fpr, int *r_disabled,
   gpg_error_t err = 0;
   int locked = already_locked;
   trustitem_t *ti;
-  size_t len;
   unsigned char fprbin[20];
+  int disabled;
 
   if (r_disabled)
     *r_disabled = 0;
@@ -435,35 +510,34 @@ istrusted_internal (ctrl_t ctrl, const char *fpr, int *r_disabled,
         }
     }
 
-  if (trusttable)
+  ti = lookup_trusttable (fprbin);
+  if (ti)
     {
-      for (ti=trusttable, len = trusttablesize; len; ti++, len--)
-        if (!memcmp (ti->fpr, fprbin, 20))
-          {
-            if (ti->flags.disabled && r_disabled)
-              *r_disabled = 1;
-
-            /* Print status messages only if we have not been called
-               in a locked state.  */
-            if (already_locked)
-              ;
-            else if (ti->flags.relax)
-              {
-                unlock_trusttable ();
-                locked = 0;
-                err = agent_write_status (ctrl, "TRUSTLISTFLAG", "relax", NULL);
-              }
-            else if (ti->flags.cm)
-              {
-                unlock_trusttable ();
-                locked = 0;
-                err = agent_write_status (ctrl, "TRUSTLISTFLAG", "cm", NULL);
-              }
-
-            if (!err)
-              err = ti->flags.disabled? gpg_error (GPG_ERR_NOT_TRUSTED) : 0;
-            goto leave;
-          }
+      /* Note that TI may not be used after unlocking.  */
+      disabled = ti->flags.disabled;
+      if (disabled && r_disabled)
+        *r_disabled = 1;
+
+      /* Print status messages only if we have not been called
+         in a locked state.  */
+      if (already_locked)
+        ;
+      else if (ti->flags.relax)
+        {
+          unlock_trusttable ();
+          locked = 0;
+          err = agent_write_status (ctrl, "TRUSTLISTFLAG", "relax", NULL);
+        }
+      else if (ti->flags.cm)
+        {
+          unlock_trusttable ();
+          locked = 0;
+          err = agent_write_status (ctrl, "TRUSTLISTFLAG", "cm", NULL);
+        }
+
+      if (!err)
+        err = disabled? gpg_error (GPG_ERR_NOT_TRUSTED) : 0;
+      goto leave;
     }
   err = gpg_error (GPG_ERR_NOT_TRUSTED);
 
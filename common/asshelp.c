@@ -315,6 +315,13 @@ unlock_spawning (lock_spawn_t *lock, const char *name)
  * the usual verbose flag.  CTX is the assuan context.  CONNECT_FLAGS
  * are the assuan connect flags.  DID_SUCCESS_MSG will be set to 1 if
  * a success messages has been printed.
+ *
+ * On Unix the daemons create and listen on their socket before they
+ * fork and the caller has already waited for the parent process to
+ * exit.  Thus the exit of that process is the readiness notification
+ * and the first connect attempt is done right away; the sleeps are
+ * only needed if that fails, for example on Windows where we do not
+ * wait for the process.
  */
 static gpg_error_t
 wait_for_sock (int secs, int module_name_id, const char *sockname,
@@ -352,8 +359,6 @@ wait_for_sock (int secs, int module_name_id, const char *sockname,
               lastalert = secsleft;
             }
         }
-      gnupg_usleep (next_sleep_us);
-      elapsed_us += next_sleep_us;
       err = assuan_socket_connect (ctx, sockname, 0, connect_flags);
       if (!err)
         {
@@ -368,6 +373,8 @@ wait_for_sock (int secs, int module_name_id, const char *sockname,
             }
           break;
         }
+      gnupg_usleep (next_sleep_us);
+      elapsed_us += next_sleep_us;
       next_sleep_us *= 2;
       if (next_sleep_us > 1000000)
         next_sleep_us = 1000000;
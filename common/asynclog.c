@@ -0,0 +1,435 @@
+/* asynclog.c - Asynchronous log writer
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The log functions of libgpg-error write synchronously to the log
+ * file or socket; a slow consumer like a stopped watchgnupg thus
+ * stalls all threads which want to log something.  With the writer
+ * implemented here the log stream copies the messages into a ring
+ * buffer and a thread writes them out.  If the buffer is full
+ * messages are dropped and counted; the number is written to the log
+ * once there is room again.  The writer is stopped by closing the log
+ * stream, i.e. when a new log file is set.  */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <npth.h>
+#ifndef HAVE_W32_SYSTEM
+# include <sys/socket.h>
+# include <sys/un.h>
+#endif
+
+#include "util.h"
+#include "logging.h"
+#include "asynclog.h"
+
+
+/* The object describing an active log writer.  */
+struct asynclog_s
+{
+  char *name;                 /* The log file name as given.  */
+  char *sockname;             /* The socket name or NULL for a file.  */
+  int fd;                     /* The file or socket; -1 if not open.  */
+  npth_t thread;
+  npth_mutex_t lock;
+  npth_cond_t cond;
+  char *ring;                 /* The ring buffer.  */
+  size_t size;                /* Size of RING.  */
+  size_t head;                /* Offset of the oldest byte in RING.  */
+  size_t used;                /* Number of bytes in RING.  */
+  size_t inflight;            /* Bytes at HEAD being written.  */
+  size_t peak_used;           /* Peak of USED.  */
+  unsigned long messages;     /* Number of messages queued.  */
+  unsigned long dropped;      /* Number of messages dropped.  */
+  unsigned long reported;     /* Number of dropped messages reported.  */
+  int stop;                   /* Request to terminate the thread.  */
+};
+typedef struct asynclog_s *asynclog_t;
+
+
+/* The active log writer or NULL.  Only one log stream exists.  */
+static asynclog_t current;
+
+
+
+#ifndef HAVE_W32_SYSTEM
+
+/* Open the file or socket of LOG if not yet done.  Returns true on
+ * success.  */
+static int
+open_sink (asynclog_t log, int use_npth)
+{
+  struct sockaddr_un addr;
+
+  if (log->fd != -1)
+    return 1;
+
+  if (!log->sockname)
+    {
+      log->fd = open (log->name, O_WRONLY | O_APPEND | O_CREAT, 0666);
+      return log->fd != -1;
+    }
+
+  log->fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (log->fd == -1)
+    return 0;
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, log->sockname, sizeof addr.sun_path - 1);
+  if (use_npth? npth_connect (log->fd, (struct sockaddr *)&addr, sizeof addr)
+      /**/    : connect (log->fd, (struct sockaddr *)&addr, sizeof addr))
+    {
+      close (log->fd);
+      log->fd = -1;
+      return 0;
+    }
+  return 1;
+}
+
+
+/* Write (BUFFER,LENGTH) to the sink of LOG.  Returns the number of
+ * bytes written; 0 on error after closing the sink.  */
+static size_t
+write_sink (asynclog_t log, const char *buffer, size_t length, int use_npth)
+{
+  ssize_t n;
+
+  if (!open_sink (log, use_npth))
+    return 0;
+  do
+    n = use_npth? npth_write (log->fd, buffer, length)
+      /**/      : write (log->fd, buffer, length);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    {
+      close (log->fd);
+      log->fd = -1;
+      return 0;
+    }
+  return n;
+}
+
+
+/* The thread writing out the ring buffer of LOG.  */
+static void *
+asynclog_thread (void *arg)
+{
+  asynclog_t log = arg;
+  char note[80];
+  size_t notelen, chunk, nwritten;
+
+  npth_mutex_lock (&log->lock);
+  for (;;)
+    {
+      while (!log->used && !log->stop)
+        npth_cond_wait (&log->cond, &log->lock);
+      if (!log->used)
+        break;
+
+      notelen = 0;
+      if (log->dropped != log->reported)
+        {
+          snprintf (note, sizeof note,
+                    "[%lu log messages dropped]\n",
+                    log->dropped - log->reported);
+          notelen = strlen (note);
+          log->reported = log->dropped;
+        }
+      chunk = log->used;
+      if (chunk > log->size - log->head)
+        chunk = log->size - log->head;
+      log->inflight = chunk;
+      npth_mutex_unlock (&log->lock);
+
+      /* On error wait a second and try again; in the meantime the
+       * ring fills up and further messages are counted as dropped.
+       * The ring data stays valid because only this thread frees
+       * space.  */
+      nwritten = write_sink (log, log->ring + log->head, chunk, 1);
+      if (notelen)
+        write_sink (log, note, notelen, 1);
+      if (!nwritten)
+        npth_sleep (1);
+
+      npth_mutex_lock (&log->lock);
+      log->head = (log->head + nwritten) % log->size;
+      log->used -= nwritten;
+      log->inflight = 0;
+    }
+  npth_mutex_unlock (&log->lock);
+
+  return NULL;
+}
+
+
+/* Write whatever is still in the ring buffer of the current writer.
+ * This is called at process termination when the thread may not run
+ * anymore.  */
+static void
+asynclog_atexit (void)
+{
+  asynclog_t log = current;
+  size_t off, chunk, n;
+
+  if (!log)
+    return;
+
+  off = (log->head + log->inflight) % log->size;
+  chunk = log->used - log->inflight;
+  while (chunk)
+    {
+      n = chunk;
+      if (n > log->size - off)
+        n = log->size - off;
+      n = write_sink (log, log->ring + off, n, 0);
+      if (!n)
+        break;
+      off = (off + n) % log->size;
+      chunk -= n;
+    }
+}
+
+
+/* The write function of the log stream.  The message is either
+ * copied as a whole into the ring buffer or dropped; the function
+ * never blocks on I/O.  */
+static gpgrt_ssize_t
+asynclog_cookie_write (void *cookie, const void *buffer, size_t size)
+{
+  asynclog_t log = cookie;
+  size_t tail, n;
+
+  if (!buffer || !size)
+    return 0;  /* Flush request.  */
+
+  npth_mutex_lock (&log->lock);
+  if (size > log->size - log->used)
+    log->dropped++;
+  else
+    {
+      tail = (log->head + log->used) % log->size;
+      n = size;
+      if (n > log->size - tail)
+        n = log->size - tail;
+      memcpy (log->ring + tail, buffer, n);
+      memcpy (log->ring, (const char *)buffer + n, size - n);
+      log->used += size;
+      if (log->used > log->peak_used)
+        log->peak_used = log->used;
+      log->messages++;
+      npth_cond_signal (&log->cond);
+    }
+  npth_mutex_unlock (&log->lock);
+
+  return (gpgrt_ssize_t)size;
+}
+
+
+/* The close function of the log stream.  Write out the buffer and
+ * release the writer.  */
+static int
+asynclog_cookie_close (void *cookie)
+{
+  asynclog_t log = cookie;
+
+  npth_mutex_lock (&log->lock);
+  log->stop = 1;
+  npth_cond_signal (&log->cond);
+  npth_mutex_unlock (&log->lock);
+  npth_join (log->thread, NULL);
+  if (current == log)
+    current = NULL;
+
+  if (log->fd != -1)
+    close (log->fd);
+  npth_cond_destroy (&log->cond);
+  npth_mutex_destroy (&log->lock);
+  xfree (log->ring);
+  xfree (log->sockname);
+  xfree (log->name);
+  xfree (log);
+  return 0;
+}
+
+
+static es_cookie_io_functions_t asynclog_cookie_functions =
+  {
+    NULL,
+    asynclog_cookie_write,
+    NULL,
+    asynclog_cookie_close
+  };
+
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Log to the file or socket NAME using a ring buffer of SIZE bytes
+ * which is written out by a thread.  Only plain files and
+ * "socket://" with an explicit socket name are supported; for other
+ * names GPG_ERR_NOT_SUPPORTED is returned and the caller should use
+ * log_set_file.  A running writer for another name is stopped.  */
+gpg_error_t
+asynclog_start (const char *name, size_t size)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)name;
+  (void)size;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+#else
+  static int atexit_registered;
+  gpg_error_t err;
+  asynclog_t log;
+  npth_attr_t tattr;
+  estream_t fp;
+  int ret;
+
+  if (!name || !*name || !strcmp (name, "-") || !size)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  if (!strncmp (name, "socket://", 9))
+    {
+      if (!name[9])
+        return gpg_error (GPG_ERR_NOT_SUPPORTED);  /* Default socket.  */
+    }
+  else if (strstr (name, "://"))
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  log = xtrycalloc (1, sizeof *log);
+  if (!log)
+    return gpg_error_from_syserror ();
+  log->fd = -1;
+  log->size = size;
+  log->name = xtrystrdup (name);
+  if (!log->name)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (!strncmp (name, "socket://", 9)
+      && !(log->sockname = xtrystrdup (name + 9)))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  log->ring = xtrymalloc (size);
+  if (!log->ring)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Open the file right away so that errors are reported to the
+   * caller.  A socket is connected by the thread.  */
+  if (!log->sockname && !open_sink (log, 0))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  ret = npth_mutex_init (&log->lock, NULL);
+  if (ret)
+    {
+      err = gpg_error_from_errno (ret);
+      goto leave;
+    }
+  ret = npth_cond_init (&log->cond, NULL);
+  if (ret)
+    {
+      err = gpg_error_from_errno (ret);
+      npth_mutex_destroy (&log->lock);
+      goto leave;
+    }
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  ret = npth_create (&log->thread, &tattr, asynclog_thread, log);
+  npth_attr_destroy (&tattr);
+  if (ret)
+    {
+      err = gpg_error_from_errno (ret);
+      npth_cond_destroy (&log->cond);
+      npth_mutex_destroy (&log->lock);
+      goto leave;
+    }
+
+  /* From now on the close function of the stream releases LOG.  */
+  fp = es_fopencookie (log, "w", asynclog_cookie_functions);
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      asynclog_cookie_close (log);
+      return err;
+    }
+  es_setvbuf (fp, NULL, _IOLBF, 0);
+
+  if (!atexit_registered)
+    {
+      atexit_registered = 1;
+      atexit (asynclog_atexit);
+    }
+
+  /* Setting the stream closes the old log stream and thus stops the
+   * previous writer.  */
+  current = log;
+  log_set_stream (fp);
+  return 0;
+
+ leave:
+  if (log->fd != -1)
+    close (log->fd);
+  xfree (log->ring);
+  xfree (log->sockname);
+  xfree (log->name);
+  xfree (log);
+  return err;
+#endif /*!HAVE_W32_SYSTEM*/
+}
+
+
+/* Return true if a log writer is active.  */
+int
+asynclog_is_active (void)
+{
+  return !!current;
+}
+
+
+/* Return a malloced string with the statistics of the current writer
+ * or NULL on a memory error.  */
+char *
+asynclog_stats (void)
+{
+  asynclog_t log = current;
+  char *result;
+
+  if (!log)
+    return xtrystrdup ("inactive");
+
+  npth_mutex_lock (&log->lock);
+  result = xtryasprintf ("size=%zu used=%zu peak_used=%zu"
+                         " messages=%lu dropped=%lu",
+                         log->size, log->used, log->peak_used,
+                         log->messages, log->dropped);
+  npth_mutex_unlock (&log->lock);
+  return result;
+}
@@ -0,0 +1,38 @@
+/* asynclog.h - Definitions for the asynchronous log writer
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GNUPG_COMMON_ASYNCLOG_H
+#define GNUPG_COMMON_ASYNCLOG_H
+
+#include <gpg-error.h>
+
+/* Log to the file or "socket://" NAME through a buffer of SIZE bytes
+ * which is written by a thread.  Returns GPG_ERR_NOT_SUPPORTED for
+ * other kinds of log targets; the caller should then use log_set_file
+ * as usual.  */
+gpg_error_t asynclog_start (const char *name, size_t size);
+
+/* Return true if the log writer is active.  */
+int asynclog_is_active (void);
+
+/* Return a malloced string with statistics of the log writer.  */
+char *asynclog_stats (void);
+
+
+#endif /*GNUPG_COMMON_ASYNCLOG_H*/
@@ -27,6 +27,7 @@
 
 #include "i18n.h"
 #include "util.h"
+#include "radix64.h"
 
 
 /* The reverse base-64 list used for base-64 decoding. */
@@ -191,6 +192,19 @@ b64dec_proc (struct b64state *state, void *buffer, size_t length,
               }
             else if (ds == s_b64_0)
               {
+                size_t used;
+
+                /* Fast path for complete groups.  Note that D
+                   never passes S.  */
+                used = radix64_decode_groups ((unsigned char *)d,
+                                              (unsigned char *)s, length);
+                if (used)
+                  {
+                    d += used / 4 * 3;
+                    s += used - 1;
+                    length -= used - 1;
+                    break;
+                  }
                 val = c << 2;
                 ds = s_b64_1;
               }
@@ -29,6 +29,7 @@
 
 #include "i18n.h"
 #include "util.h"
+#include "radix64.h"
 
 #define B64ENC_DID_HEADER   1
 #define B64ENC_DID_TRAILER  2
@@ -138,6 +139,64 @@ static const u32 crc_table[256] = {
   0x56d11cce, 0x56575035, 0x575bc9c3, 0x57dd8538
 };
 
+/* Tables for the slice-by-8 update of the CRC.  The CRC is kept left
+   aligned in a 32 bit word, so that the bytes can be xor-ed in, in
+   their natural big endian order.  CRC_SLICE[K][B] is the CRC of the
+   byte B followed by K zero bytes.  The tables are derived from
+   CRC_TABLE on first use.  */
+static u32 crc_slice[8][256];
+static int crc_slice_initialized;
+
+
+static void
+init_crc_slice (void)
+{
+  int i, k;
+  u32 c;
+
+  for (i=0; i < 256; i++)
+    crc_slice[0][i] = (crc_table[i] & 0x00ffffff) << 8;
+  for (i=0; i < 256; i++)
+    for (k=1; k < 8; k++)
+      {
+        c = crc_slice[k-1][i];
+        crc_slice[k][i] = (c << 8) ^ crc_slice[0][c >> 24];
+      }
+
+  crc_slice_initialized = 1;
+}
+
+
+/* Update the 24 bit OpenPGP CRC value CRC with the LENGTH bytes at P
+   and return the new value.  */
+static u32
+crc24_update (u32 crc, const unsigned char *p, size_t length)
+{
+  u32 c, x;
+
+  if (!crc_slice_initialized)
+    init_crc_slice ();
+
+  c = (crc & 0x00ffffff) << 8;
+  for (; length >= 8; length -= 8, p += 8)
+    {
+      x = c ^ (((u32)p[0] << 24) | ((u32)p[1] << 16)
+               | ((u32)p[2] << 8) | p[3]);
+      c = (crc_slice[7][x >> 24]
+           ^ crc_slice[6][(x >> 16) & 0xff]
+           ^ crc_slice[5][(x >> 8) & 0xff]
+           ^ crc_slice[4][x & 0xff]
+           ^ crc_slice[3][p[4]]
+           ^ crc_slice[2][p[5]]
+           ^ crc_slice[1][p[6]]
+           ^ crc_slice[0][p[7]]);
+    }
+  for (; length; length--, p++)
+    c = (c << 8) ^ crc_slice[0][(c >> 24) ^ *p];
+
+  return c >> 8;
+}
+
 
 static gpg_error_t
 enc_start (struct b64state *state, FILE *fp, estream_t stream,
@@ -197,6 +256,18 @@ my_fputs (const char *string, struct b64state *state)
 }
 
 
+/* Write the LENGTH bytes at BUFFER to the stream.  Returns true on
+   error.  */
+static int
+my_fwrite (const void *buffer, size_t length, struct b64state *state)
+{
+  if (state->stream)
+    return es_fwrite (buffer, length, 1, state->stream) != 1;
+  else
+    return fwrite (buffer, length, 1, state->fp) != 1;
+}
+
+
 /* Write NBYTES from BUFFER to the Base 64 stream identified by
    STATE. With BUFFER and NBYTES being 0, merely do a fflush on the
    stream. */
@@ -204,8 +275,12 @@ gpg_error_t
 b64enc_write (struct b64state *state, const void *buffer, size_t nbytes)
 {
   unsigned char radbuf[4];
+  char line[64 + 1];
   int idx, quad_count;
   const unsigned char *p;
+  size_t ngroups, n;
+  u32 crc;
+  int usecrc;
 
   if (state->lasterr)
     return state->lasterr;
@@ -238,53 +313,52 @@ b64enc_write (struct b64state *state, const void *buffer, size_t nbytes)
   quad_count = state->quad_count;
   assert (idx < 4);
   memcpy (radbuf, state->radbuf, idx);
+  usecrc = !!(state->flags & B64ENC_USE_PGPCRC);
+  crc = state->crc;
 
-  if ( (state->flags & B64ENC_USE_PGPCRC) )
+  /* Each round writes the characters up to the end of the current
+     line.  The CRC is computed over the same bytes right before they
+     are encoded.  */
+  for (p=buffer; nbytes; )
     {
-      size_t n;
-      u32 crc = state->crc;
-
-      for (p=buffer, n=nbytes; n; p++, n-- )
-        crc = ((u32)crc << 8) ^ crc_table[((crc >> 16)&0xff) ^ *p];
-      state->crc = (crc & 0x00ffffff);
-    }
+      if (idx || nbytes < 3)
+        {
+          /* Slow path for an incomplete group.  */
+          if (usecrc)
+            crc = crc24_update (crc, p, 1);
+          radbuf[idx++] = *p++;
+          nbytes--;
+          if (idx < 3)
+            continue;
+          idx = 0;
+          ngroups = 1;
+          radix64_encode_groups (line, radbuf, 1);
+        }
+      else
+        {
+          ngroups = (64/4) - quad_count;
+          if (ngroups > nbytes / 3)
+            ngroups = nbytes / 3;
+          if (usecrc)
+            crc = crc24_update (crc, p, ngroups * 3);
+          radix64_encode_groups (line, p, ngroups);
+          p += ngroups * 3;
+          nbytes -= ngroups * 3;
+        }
 
-  for (p=buffer; nbytes; p++, nbytes--)
-    {
-      radbuf[idx++] = *p;
-      if (idx > 2)
+      n = ngroups * 4;
+      quad_count += ngroups;
+      if (quad_count >= (64/4))
         {
-          char tmp[4];
-
-          tmp[0] = bintoasc[(*radbuf >> 2) & 077];
-          tmp[1] = bintoasc[(((*radbuf<<4)&060)|((radbuf[1] >> 4)&017))&077];
-          tmp[2] = bintoasc[(((radbuf[1]<<2)&074)|((radbuf[2]>>6)&03))&077];
-          tmp[3] = bintoasc[radbuf[2]&077];
-          if (state->stream)
-            {
-              for (idx=0; idx < 4; idx++)
-                es_putc (tmp[idx], state->stream);
-              idx = 0;
-              if (es_ferror (state->stream))
-                goto write_error;
-            }
-          else
-            {
-              for (idx=0; idx < 4; idx++)
-                putc (tmp[idx], state->fp);
-              idx = 0;
-              if (ferror (state->fp))
-                goto write_error;
-            }
-          if (++quad_count >= (64/4))
-            {
-              quad_count = 0;
-              if (!(state->flags & B64ENC_NO_LINEFEEDS)
-                  && my_fputs ("\n", state) == EOF)
-                goto write_error;
-            }
+          quad_count = 0;
+          if (!(state->flags & B64ENC_NO_LINEFEEDS))
+            line[n++] = '\n';
         }
+      if (my_fwrite (line, n, state))
+        goto write_error;
     }
+  state->crc = (crc & 0x00ffffff);
+
   memcpy (state->radbuf, radbuf, idx);
   state->idx = idx;
   state->quad_count = quad_count;
@@ -29,6 +29,7 @@
  */
 
 #include <config.h>
+#include <string.h>
 #include <gcrypt.h>
 
 #include "openpgpdefs.h"
@@ -40,6 +41,19 @@
 static int initialized;
 static int module;
 
+/* The number of curve OIDs for which the de-vs verdict is cached.  */
+#define CURVE_CACHE_SIZE 8
+
+/* A cache of the de-vs verdict for the curve OIDs seen so far.  This
+ * avoids converting the OID to a string for each key.  */
+static struct
+{
+  unsigned char oid[16];
+  unsigned int oidlen;
+  int compliant;
+} curve_cache[CURVE_CACHE_SIZE];
+static int curve_cache_used;
+
 /* Initializes the module.  Must be called with the current
  * GNUPG_MODULE_NAME.  Checks a few invariants, and tunes the policies
  * for the given module.  */
@@ -88,6 +102,59 @@ gnupg_initialize_compliance (int gnupg_module_name)
   initialized = 1;
 }
 
+/* Return true if CURVENAME is a curve allowed in de-vs mode.  */
+static int
+de_vs_curve_p (const char *curvename)
+{
+  return (curvename
+          && (!strcmp (curvename, "brainpoolP256r1")
+              || !strcmp (curvename, "brainpoolP384r1")
+              || !strcmp (curvename, "brainpoolP512r1")));
+}
+
+
+/* Return true if the curve with the OpenPGP OID given by the opaque
+ * MPI A is allowed in de-vs mode.  The verdict is cached by OID.  */
+static int
+de_vs_curve_oid_p (gcry_mpi_t a)
+{
+  const unsigned char *oid = NULL;
+  unsigned int nbits, oidlen = 0;
+  char *curve;
+  const char *curvename;
+  int i, result;
+
+  if (a && gcry_mpi_get_flag (a, GCRYMPI_FLAG_OPAQUE))
+    {
+      oid = gcry_mpi_get_opaque (a, &nbits);
+      oidlen = (nbits + 7) / 8;
+      if (oidlen > sizeof curve_cache[0].oid)
+        oid = NULL;
+    }
+  if (oid)
+    for (i=0; i < curve_cache_used; i++)
+      if (curve_cache[i].oidlen == oidlen
+          && !memcmp (curve_cache[i].oid, oid, oidlen))
+        return curve_cache[i].compliant;
+
+  curve = NULL;
+  curvename = openpgp_oidmpi_to_curve (a, 0);
+  if (!curvename)
+    curvename = curve = openpgp_oid_to_str (a);
+  result = de_vs_curve_p (curvename);
+  xfree (curve);
+
+  if (oid && curve_cache_used < CURVE_CACHE_SIZE)
+    {
+      memcpy (curve_cache[curve_cache_used].oid, oid, oidlen);
+      curve_cache[curve_cache_used].oidlen = oidlen;
+      curve_cache[curve_cache_used].compliant = result;
+      curve_cache_used++;
+    }
+  return result;
+}
+
+
 /* Return true if ALGO with a key of KEYLENGTH is compliant to the
  * given COMPLIANCE mode.  If KEY is not NULL, various bits of
  * information will be extracted from it.  If CURVENAME is not NULL, it
@@ -136,8 +203,6 @@ gnupg_pk_is_compliant (enum gnupg_compliance_mode compliance, int algo,
 
   if (compliance == CO_DE_VS)
     {
-      char *curve = NULL;
-
       switch (algotype)
         {
         case is_elg:
@@ -161,26 +226,19 @@ gnupg_pk_is_compliant (enum gnupg_compliance_mode compliance, int algo,
 	  break;
 
         case is_ecc:
-          if (!curvename && key)
-            {
-              curve = openpgp_oid_to_str (key[0]);
-              curvename = openpgp_oid_to_curve (curve, 0);
-              if (!curvename)
-                curvename = curve;
-            }
-
-          result = (curvename
-                    && (algo == PUBKEY_ALGO_ECDH
-                        || algo == PUBKEY_ALGO_ECDSA)
-                    && (!strcmp (curvename, "brainpoolP256r1")
-                        || !strcmp (curvename, "brainpoolP384r1")
-                        || !strcmp (curvename, "brainpoolP512r1")));
+          if (algo != PUBKEY_ALGO_ECDH && algo != PUBKEY_ALGO_ECDSA)
+            result = 0;
+          else if (curvename)
+            result = de_vs_curve_p (curvename);
+          else if (key)
+            result = de_vs_curve_oid_p (key[0]);
+          else
+            result = 0;
           break;
 
         default:
           result = 0;
         }
-      xfree (curve);
     }
   else
     {
@@ -251,46 +309,22 @@ gnupg_pk_is_allowed (enum gnupg_compliance_mode compliance,
             result = 1;
           else if (use == PK_USE_ENCRYPTION)
             {
-              char *curve = NULL;
-
-              if (!curvename && key)
-                {
-                  curve = openpgp_oid_to_str (key[0]);
-                  curvename = openpgp_oid_to_curve (curve, 0);
-                  if (!curvename)
-                    curvename = curve;
-                }
-
-              result = (curvename
-                        && (!strcmp (curvename, "brainpoolP256r1")
-                            || !strcmp (curvename, "brainpoolP384r1")
-                            || !strcmp (curvename, "brainpoolP512r1")));
-
-              xfree (curve);
+              if (curvename)
+                result = de_vs_curve_p (curvename);
+              else if (key)
+                result = de_vs_curve_oid_p (key[0]);
             }
           break;
 
 	case PUBKEY_ALGO_ECDSA:
           if (use == PK_USE_VERIFICATION)
             result = 1;
-          else
+          else if (use == PK_USE_SIGNING)
             {
-              char *curve = NULL;
-
-              if (! curvename && key)
-	      {
-		curve = openpgp_oid_to_str (key[0]);
-		curvename = openpgp_oid_to_curve (curve, 0);
-		if (!curvename)
-		  curvename = curve;
-	      }
-
-              result = (use == PK_USE_SIGNING
-                         && curvename
-                         && (!strcmp (curvename, "brainpoolP256r1")
-                             || !strcmp (curvename, "brainpoolP384r1")
-                             || !strcmp (curvename, "brainpoolP512r1")));
-              xfree (curve);
+              if (curvename)
+                result = de_vs_curve_p (curvename);
+              else if (key)
+                result = de_vs_curve_oid_p (key[0]);
             }
           break;
 
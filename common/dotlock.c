@@ -171,6 +171,28 @@
 
    If nothing has been stored dotlock_get_fd returns -1.
 
+   Readers which only need to keep writers out may use a shared lock.
+   This requires that the handle has been created with the flag
+   DOTLOCK_RWLOCK:
+
+     h = dotlock_create (fname, DOTLOCK_RWLOCK);
+     ...
+     if (dotlock_take_shared (h, -1))
+       error ("error taking shared lock: %s\n", strerror (errno));
+
+   The shared lock is released with dotlock_release.  The flag makes
+   the module maintain an additional file with the suffix ".rwlock"
+   on which POSIX record locks are used: Shared lock holders own a
+   read lock and exclusive lock holders a write lock in addition to
+   the regular lock file.  Waiting for an exclusive lock is then done
+   by the kernel and thus the waiter is woken up as soon as the lock
+   has been released.  Processes not using the flag (e.g. older
+   versions) still see the regular lock file and are thus properly
+   excluded by exclusive locks; they do not respect shared locks,
+   though.  Note that record locks are owned by the process and not
+   by the handle.  If record locks are not available (Windows, or the
+   file can't be created) shared locks fall back to exclusive locks.
+
 
 
    How to build:
@@ -211,6 +233,10 @@
 
      HAVE_W32CE_SYSTEM   - Currently only used by GnuPG.
 
+     HAVE_INOTIFY_INIT   - Define if inotify is available.  It is used
+                           to wake up waiters as soon as a lock file
+                           has been removed.
+
    Note that there is a test program t-dotlock which has compile
    instructions at its end.  At least for SMBFS and CIFS it is
    important that 64 bit versions of stat are used; most programming
@@ -293,9 +319,13 @@
 # include <sys/types.h>
 # include <sys/stat.h>
 # include <sys/utsname.h>
+# ifdef HAVE_INOTIFY_INIT
+#  include <sys/inotify.h>
+# endif
 #endif
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #ifdef HAVE_SIGNAL_H
@@ -398,8 +428,10 @@ struct dotlock_handle
   unsigned int locked:1;     /* Lock status.                          */
   unsigned int disable:1;    /* If true, locking is disabled.         */
   unsigned int use_o_excl:1; /* Use open (O_EXCL) for locking.        */
+  unsigned int shared:1;     /* The lock is a shared lock.            */
 
   int extra_fd;              /* A place for the caller to store an FD.  */
+  int rwfd;                  /* FD of the ".rwlock" file or -1.       */
 
 #ifdef HAVE_DOSISH_SYSTEM
   HANDLE lockhd;       /* The W32 handle of the lock file.      */
@@ -483,6 +515,50 @@ dotlock_disable (void)
 
 
 #ifdef HAVE_POSIX_SYSTEM
+/* Set a record lock of TYPE (F_RDLCK, F_WRLCK or F_UNLCK) on the
+   ".rwlock" file of H.  TIMEOUT has the same semantics as with
+   dotlock_take.  Returns 0 on success and -1 with ERRNO set on
+   error.  */
+static int
+set_rwlock (dotlock_t h, short type, long timeout)
+{
+  struct flock fl;
+  struct timeval tv;
+  int cmd, rc;
+
+  memset (&fl, 0, sizeof fl);
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 0;  /* Lock the entire file.  */
+  cmd = (type != F_UNLCK && timeout < 0)? F_SETLKW : F_SETLK;
+
+  for (;;)
+    {
+      do
+        rc = fcntl (h->rwfd, cmd, &fl);
+      while (rc == -1 && errno == EINTR);
+      if (!rc)
+        return 0;
+      if (errno != EACCES && errno != EAGAIN)
+        return -1;
+      if (!timeout)
+        {
+          my_set_errno (EACCES);
+          return -1;
+        }
+
+      /* A positive timeout: Poll in 50ms steps.  */
+      if (timeout < 50)
+        timeout = 50;
+      timeout -= 50;
+      tv.tv_sec = 0;
+      tv.tv_usec = 50 * 1000;
+      select (0, NULL, NULL, NULL, &tv);
+    }
+}
+
+
 static int
 maybe_deadlock (dotlock_t h)
 {
@@ -642,7 +718,8 @@ use_hardlinks_p (const char *tname)
 /* Locking core for Unix.  It used a temporary file and the link
    system call to make locking an atomic operation. */
 static dotlock_t
-dotlock_create_unix (dotlock_t h, const char *file_to_lock)
+dotlock_create_unix (dotlock_t h, const char *file_to_lock,
+                     unsigned int flags)
 {
   int  fd = -1;
   char pidstr[16];
@@ -761,6 +838,26 @@ dotlock_create_unix (dotlock_t h, const char *file_to_lock)
   if (h->use_o_excl)
     my_debug_1 ("locking for '%s' done via O_EXCL\n", h->lockname);
 
+  if ((flags & DOTLOCK_RWLOCK))
+    {
+      /* Failing to create the file is not an error; shared locks are
+         then simply mapped to exclusive locks.  */
+      char *rwname = xtrymalloc (strlen (file_to_lock) + 8);
+
+      if (rwname)
+        {
+          strcpy (stpcpy (rwname, file_to_lock), EXTSEP_S "rwlock");
+          do
+            h->rwfd = open (rwname, O_RDWR|O_CREAT,
+                            S_IRUSR|S_IRGRP|S_IROTH|S_IWUSR );
+          while (h->rwfd == -1 && errno == EINTR);
+          if (h->rwfd == -1)
+            my_debug_1 ("shared locks for '%s' not available\n",
+                        h->lockname);
+          xfree (rwname);
+        }
+    }
+
   return h;
 
  write_failed:
@@ -861,7 +958,8 @@ dotlock_create_w32 (dotlock_t h, const char *file_to_lock)
    POSIX systems a temporary file ".#lk.<hostname>.pid[.threadid] is
    used.
 
-   FLAGS must be 0.
+   FLAGS is either 0 or DOTLOCK_RWLOCK to allow the use of
+   dotlock_take_shared.
 
    The function returns an new handle which needs to be released using
    destroy_dotlock but gets also released at the termination of the
@@ -883,7 +981,7 @@ dotlock_create (const char *file_to_lock, unsigned int flags)
   if ( !file_to_lock )
     return NULL;  /* Only initialization was requested.  */
 
-  if (flags)
+  if ((flags & ~DOTLOCK_RWLOCK))
     {
       my_set_errno (EINVAL);
       return NULL;
@@ -893,6 +991,7 @@ dotlock_create (const char *file_to_lock, unsigned int flags)
   if (!h)
     return NULL;
   h->extra_fd = -1;
+  h->rwfd = -1;
 
   if (never_lock)
     {
@@ -907,7 +1006,7 @@ dotlock_create (const char *file_to_lock, unsigned int flags)
 #ifdef HAVE_DOSISH_SYSTEM
   return dotlock_create_w32 (h, file_to_lock);
 #else /*!HAVE_DOSISH_SYSTEM */
-  return dotlock_create_unix (h, file_to_lock);
+  return dotlock_create_unix (h, file_to_lock, flags);
 #endif /*!HAVE_DOSISH_SYSTEM*/
 }
 
@@ -936,11 +1035,13 @@ dotlock_get_fd (dotlock_t h)
 static void
 dotlock_destroy_unix (dotlock_t h)
 {
-  if (h->locked && h->lockname)
+  if (h->locked && !h->shared && h->lockname)
     unlink (h->lockname);
   if (h->tname && !h->use_o_excl)
     unlink (h->tname);
   xfree (h->tname);
+  if (h->rwfd != -1)
+    close (h->rwfd);  /* This also releases the record lock.  */
 }
 #endif /*HAVE_POSIX_SYSTEM*/
 
@@ -1001,11 +1102,105 @@ dotlock_destroy (dotlock_t h)
 
 
 #ifdef HAVE_POSIX_SYSTEM
-/* Unix specific code of make_dotlock.  Returns 0 on success and -1 on
-   error.  */
+/* Return a random value in the range 0 to N.  This is only used to
+   spread the retries of processes waiting for the same lock and thus
+   a simple LCG is sufficient.  */
+static unsigned int
+jitter (unsigned int n)
+{
+  static unsigned int state;
+
+  if (!state)
+    state = ((unsigned int)getpid () << 16) ^ (unsigned int)time (NULL);
+  state = state * 1103515245 + 12345;
+  return n? ((state >> 16) % (n + 1)) : 0;
+}
+
+
+#ifdef HAVE_INOTIFY_INIT
+/* Return an inotify file descriptor watching the directory of the
+   lock file of H for removals or -1 if this is not possible.  */
 static int
-dotlock_take_unix (dotlock_t h, long timeout)
+watch_lockdir (dotlock_t h)
+{
+  char *dname, *p;
+  int fd;
+
+  dname = xtrymalloc (strlen (h->lockname) + 2);
+  if (!dname)
+    return -1;
+  strcpy (dname, h->lockname);
+  p = strrchr (dname, DIRSEP_C);
+  if (p)
+    *p = 0;
+  else
+    strcpy (dname, EXTSEP_S);
+
+  fd = inotify_init ();
+  if (fd != -1 && inotify_add_watch (fd, dname, IN_DELETE|IN_MOVED_FROM) == -1)
+    {
+      close (fd);
+      fd = -1;
+    }
+  xfree (dname);
+  return fd;
+}
+
+
+/* Wait up to WTIME milliseconds for an event on the inotify file
+   FD indicating the removal of the lock file of H.  */
+static void
+wait_for_lockdir (dotlock_t h, int fd, int wtime)
+{
+  union {
+    struct inotify_event ev;
+    char _buf[sizeof (struct inotify_event) + 255 + 1];
+  } buf;
+  struct inotify_event *evp;
+  struct timeval tv;
+  fd_set rfds;
+  const char *name;
+  int n;
+
+  name = strrchr (h->lockname, DIRSEP_C);
+  name = name? name + 1 : h->lockname;
+
+  for (;;)
+    {
+      tv.tv_sec = wtime / 1000;
+      tv.tv_usec = (wtime % 1000) * 1000;
+      FD_ZERO (&rfds);
+      FD_SET (fd, &rfds);
+      if (select (fd + 1, &rfds, NULL, NULL, &tv) <= 0)
+        return;  /* Timeout or error.  */
+
+      n = read (fd, &buf, sizeof buf);
+      if (n < (int)sizeof (struct inotify_event))
+        return;
+      for (evp = &buf.ev;
+           (char *)evp + sizeof *evp <= (char *)&buf + n
+             && (char *)evp + sizeof *evp + evp->len <= (char *)&buf + n;
+           evp = (void *)((char *)evp + sizeof *evp + evp->len))
+        if (evp->len && !strcmp (evp->name, name))
+          return;
+
+      /* Some other file has been removed; we continue to wait for
+         the remaining time which we approximate by halving.  */
+      wtime /= 2;
+      if (!wtime)
+        return;
+    }
+}
+#endif /*HAVE_INOTIFY_INIT*/
+
+
+/* Core of dotlock_take_unix.  If a wait is required an inotify file
+   descriptor is stored at R_NOTIFY_FD which needs to be closed by the
+   caller.  */
+static int
+take_lockfile (dotlock_t h, long timeout, int *r_notify_fd)
 {
+  int notify_tried = 0;
   int wtime = 0;
   int sumtime = 0;
   int pid;
@@ -1122,13 +1317,31 @@ dotlock_take_unix (dotlock_t h, long timeout)
     lastpid = pid;
   ownerchanged = (pid != lastpid);
 
+#ifdef HAVE_INOTIFY_INIT
+  if (timeout && !notify_tried)
+    {
+      /* Watch for the removal of the lock file.  Because the lock
+         might have been released before the watch was set up we need
+         to check again right away.  */
+      notify_tried = 1;
+      *r_notify_fd = watch_lockdir (h);
+      if (*r_notify_fd != -1)
+        goto again;
+    }
+#else
+  (void)notify_tried;
+#endif /*HAVE_INOTIFY_INIT*/
+
   if (timeout)
     {
       struct timeval tv;
 
       /* Wait until lock has been released.  We use increasing retry
          intervals of 50ms, 100ms, 200ms, 400ms, 800ms, 2s, 4s and 8s
-         but reset it if the lock owner meanwhile changed.  */
+         but reset it if the lock owner meanwhile changed.  If the
+         removal of the lock file can be watched these are only upper
+         bounds; they are then still required for stale lock files
+         and for file systems without notifications.  */
       if (!wtime || ownerchanged)
         wtime = 50;
       else if (wtime < 800)
@@ -1154,8 +1367,22 @@ dotlock_take_unix (dotlock_t h, long timeout)
         }
 
 
-      tv.tv_sec = wtime / 1000;
-      tv.tv_usec = (wtime % 1000) * 1000;
+#ifdef HAVE_INOTIFY_INIT
+      if (*r_notify_fd != -1)
+        {
+          wait_for_lockdir (h, *r_notify_fd, wtime);
+          goto again;
+        }
+#endif /*HAVE_INOTIFY_INIT*/
+
+      /* Without notifications add a jitter of up to 25% so that
+         several waiters do not retry in lockstep.  */
+      {
+        int w = wtime - wtime/4 + jitter (wtime/4);
+
+        tv.tv_sec = w / 1000;
+        tv.tv_usec = (w % 1000) * 1000;
+      }
       select (0, NULL, NULL, NULL, &tv);
       goto again;
     }
@@ -1163,6 +1390,25 @@ dotlock_take_unix (dotlock_t h, long timeout)
   my_set_errno (EACCES);
   return -1;
 }
+
+
+/* Unix specific code of make_dotlock.  Returns 0 on success and -1 on
+   error.  */
+static int
+dotlock_take_unix (dotlock_t h, long timeout)
+{
+  int notify_fd = -1;
+  int ret, saveerrno;
+
+  ret = take_lockfile (h, timeout, &notify_fd);
+  if (notify_fd != -1)
+    {
+      saveerrno = errno;
+      close (notify_fd);
+      my_set_errno (saveerrno);
+    }
+  return ret;
+}
 #endif /*HAVE_POSIX_SYSTEM*/
 
 
@@ -1248,13 +1494,62 @@ dotlock_take (dotlock_t h, long timeout)
 #ifdef HAVE_DOSISH_SYSTEM
   ret = dotlock_take_w32 (h, timeout);
 #else /*!HAVE_DOSISH_SYSTEM*/
-  ret = dotlock_take_unix (h, timeout);
+  if (h->rwfd != -1)
+    {
+      /* First wait for the shared lock holders and other writers
+         using record locks; then take the lock file to exclude
+         processes which don't know about the record lock.  */
+      if (set_rwlock (h, F_WRLCK, timeout))
+        return -1;
+      ret = dotlock_take_unix (h, timeout);
+      if (ret)
+        {
+          int saveerrno = errno;
+          set_rwlock (h, F_UNLCK, 0);
+          my_set_errno (saveerrno);
+        }
+    }
+  else
+    ret = dotlock_take_unix (h, timeout);
 #endif /*!HAVE_DOSISH_SYSTEM*/
 
   return ret;
 }
 
 
+/* Take a shared lock on H.  Several processes may hold a shared lock
+   at the same time but no exclusive lock is granted as long as a
+   shared lock is held.  If H has not been created with the flag
+   DOTLOCK_RWLOCK or record locks are not supported this is the same
+   as dotlock_take.  TIMEOUT has the same semantics as with
+   dotlock_take.  Returns: 0 on success  */
+int
+dotlock_take_shared (dotlock_t h, long timeout)
+{
+  if ( h->disable )
+    return 0; /* Locks are completely disabled.  Return success. */
+
+  if ( h->locked )
+    {
+      my_debug_1 ("Oops, '%s' is already locked\n", h->lockname);
+      return 0;
+    }
+
+#ifdef HAVE_POSIX_SYSTEM
+  if (h->rwfd != -1)
+    {
+      if (set_rwlock (h, F_RDLCK, timeout))
+        return -1;
+      h->locked = 1;
+      h->shared = 1;
+      return 0;
+    }
+#endif /*HAVE_POSIX_SYSTEM*/
+
+  return dotlock_take (h, timeout);
+}
+
+
 
 #ifdef HAVE_POSIX_SYSTEM
 /* Unix specific code of release_dotlock.  */
@@ -1344,11 +1639,19 @@ dotlock_release (dotlock_t h)
 #ifdef HAVE_DOSISH_SYSTEM
   ret = dotlock_release_w32 (h);
 #else
-  ret = dotlock_release_unix (h);
+  if (h->shared)
+    ret = 0;
+  else
+    ret = dotlock_release_unix (h);
+  if (!ret && h->rwfd != -1)
+    ret = set_rwlock (h, F_UNLCK, 0);
 #endif
 
   if (!ret)
-    h->locked = 0;
+    {
+      h->locked = 0;
+      h->shared = 0;
+    }
   return ret;
 }
 
@@ -183,6 +183,31 @@ get_max_fds (void)
 }
 
 
+/* Close the file descriptors from FIRST to LAST or, if LAST is -1,
+ * all descriptors starting at FIRST using a single system call.
+ * Returns -1 if this is not possible and the caller needs to close
+ * them one by one.  */
+static int
+close_fd_range (int first, int last)
+{
+#ifdef HAVE_CLOSE_RANGE
+  if (!close_range (first, last < 0? ~0U : (unsigned int)last, 0))
+    return 0;
+  /* Fall back on ENOSYS with an old kernel.  */
+#endif
+#ifdef HAVE_CLOSEFROM
+  if (last < 0)
+    {
+      closefrom (first);
+      return 0;
+    }
+#endif
+  (void)first;
+  (void)last;
+  return -1;
+}
+
+
 /* Close all file descriptors starting with descriptor FIRST.  If
    EXCEPT is not NULL, it is expected to be a list of file descriptors
    which shall not be closed.  This list shall be sorted in ascending
@@ -190,9 +215,29 @@ get_max_fds (void)
 void
 close_all_fds (int first, int *except)
 {
-  int max_fd = get_max_fds ();
+  int max_fd;
   int fd, i, except_start;
 
+  /* Try to close the gaps between the exceptions with close_range
+   * so that we don't need a close call for each possible descriptor.
+   * This matters with the huge limits often used in containers.  */
+  fd = first;
+  for (i=0; except && except[i] != -1; i++)
+    {
+      if (except[i] < fd)
+        continue;
+      if (except[i] > fd && close_fd_range (fd, except[i] - 1))
+        goto slow;
+      fd = except[i] + 1;
+    }
+  if (!close_fd_range (fd, -1))
+    {
+      gpg_err_set_errno (0);
+      return;
+    }
+
+ slow:
+  max_fd = get_max_fds ();
   if (except)
     {
       except_start = 0;
@@ -35,6 +35,10 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#ifndef HAVE_W32_SYSTEM
+# include <fcntl.h>
+# include <unistd.h>
+#endif
 #include <gpg-error.h>
 
 #include <assuan.h>
@@ -47,6 +51,10 @@
 #include "util.h"
 #include "exectool.h"
 
+/* Flag to enable debug output.  */
+static int exectool_debug;
+
+
 typedef struct
 {
   const char *pgmname;
@@ -195,21 +203,43 @@ read_and_log_stderr (read_and_log_buffer_t *state, es_poll_t *fderr)
 
 
 
+/* The initial size of the buffers used to copy data to and from the
+ * child.  This matches the default pipe size of Linux so that a full
+ * pipe is moved with one syscall.  Each time a read fills the buffer
+ * it is doubled up to COPY_BUFFER_MAX.  */
+#define COPY_BUFFER_SIZE 65536
+#define COPY_BUFFER_MAX  (1024 * 1024)
+
+/* The size we request for the pipes to the child.  A larger pipe
+ * means fewer context switches between us and the child.  */
+#define PIPE_SIZE (1024 * 1024)
+
+
 /* A buffer to copy from one stream to another.  */
 struct copy_buffer
 {
-  char buffer[4096];
+  char *buffer;
+  size_t size;         /* Allocated size of BUFFER.  */
   char *writep;
   size_t nread;
+  int use_splice;      /* Move the data with splice(2).  */
+  int eof;             /* Splice saw the end of the source.  */
+  unsigned long long nbytes;  /* Number of bytes copied.  */
+  unsigned long ncalls;       /* Number of reads or splices.  */
 };
 
 
 /* Initialize a copy buffer.  */
-static void
+static gpg_error_t
 copy_buffer_init (struct copy_buffer *c)
 {
+  memset (c, 0, sizeof *c);
+  c->size = COPY_BUFFER_SIZE;
+  c->buffer = xtrymalloc (c->size);
+  if (!c->buffer)
+    return my_error_from_syserror ();
   c->writep = c->buffer;
-  c->nread = 0;
+  return 0;
 }
 
 
@@ -219,12 +249,98 @@ copy_buffer_shred (struct copy_buffer *c)
 {
   if (c == NULL)
     return;
-  wipememory (c->buffer, sizeof c->buffer);
+  if (c->buffer)
+    {
+      wipememory (c->buffer, c->size);
+      xfree (c->buffer);
+    }
+  c->buffer = NULL;
   c->writep = NULL;
   c->nread = ~0U;
 }
 
 
+/* Double the size of the empty copy buffer C.  On error the old
+ * buffer is kept.  */
+static void
+copy_buffer_grow (struct copy_buffer *c)
+{
+  char *newbuf;
+
+  log_assert (!c->nread);
+  newbuf = xtrymalloc (2 * c->size);
+  if (!newbuf)
+    return;
+  wipememory (c->buffer, c->size);
+  xfree (c->buffer);
+  c->buffer = newbuf;
+  c->writep = newbuf;
+  c->size *= 2;
+}
+
+
+/* Decide whether the data from SOURCE may be moved to SINK using
+ * splice(2).  This requires that both are backed by file descriptors
+ * and that SOURCE is unbuffered; the latter is the case for the pipes
+ * we create for the child as long as we have not read from them.  */
+static void
+copy_buffer_enable_splice (struct copy_buffer *c,
+                           estream_t source, estream_t sink)
+{
+#ifdef HAVE_SPLICE
+  if (source && sink && es_fileno (source) != -1 && es_fileno (sink) != -1
+      && !es_fflush (sink))
+    c->use_splice = 1;
+#else
+  (void)c;
+  (void)source;
+  (void)sink;
+#endif
+}
+
+
+/* Move data from SOURCE to SINK using splice(2).  If this is not
+ * possible the use_splice flag of C is cleared and the caller falls
+ * back to a buffered copy.  */
+static gpg_error_t
+copy_buffer_splice (struct copy_buffer *c, estream_t source, estream_t sink)
+{
+#ifdef HAVE_SPLICE
+  ssize_t n;
+
+  n = splice (es_fileno (source), NULL, es_fileno (sink), NULL,
+              COPY_BUFFER_MAX, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n < 0)
+    {
+      if (errno != EAGAIN && errno != EINVAL && errno != ENOSYS
+          && errno != EXDEV)
+        return my_error_from_syserror ();
+      /* The sink is not suitable or it is a full pipe which we can't
+       * poll for; the buffered copy handles both.  */
+      c->use_splice = 0;
+      return 0;
+    }
+
+  c->ncalls++;
+  if (!n)
+    {
+      /* Tell estream about the new file position.  This fails for
+       * pipes; that is not a problem.  */
+      es_fseeko (sink, 0, SEEK_CUR);
+      c->eof = 1;
+    }
+  else
+    c->nbytes += n;
+  return 0;
+#else
+  (void)source;
+  (void)sink;
+  c->use_splice = 0;
+  return 0;
+#endif
+}
+
+
 /* Copy data from SOURCE to SINK using copy buffer C.  */
 static gpg_error_t
 copy_buffer_do_copy (struct copy_buffer *c, estream_t source, estream_t sink)
@@ -232,10 +348,18 @@ copy_buffer_do_copy (struct copy_buffer *c, estream_t source, estream_t sink)
   gpg_error_t err;
   size_t nwritten = 0;
 
+  if (c->use_splice)
+    {
+      err = copy_buffer_splice (c, source, sink);
+      if (err || c->use_splice)
+        return err;
+      /* Fall back to a buffered copy.  */
+    }
+
   if (c->nread == 0)
     {
       c->writep = c->buffer;
-      if (es_read (source, c->buffer, sizeof c->buffer, &c->nread))
+      if (es_read (source, c->buffer, c->size, &c->nread))
         {
           err = my_error_from_syserror ();
           if (gpg_err_code (err) == GPG_ERR_EAGAIN)
@@ -244,7 +368,9 @@ copy_buffer_do_copy (struct copy_buffer *c, estream_t source, estream_t sink)
           return err;
         }
 
-      log_assert (c->nread <= sizeof c->buffer);
+      log_assert (c->nread <= c->size);
+      c->ncalls++;
+      c->nbytes += c->nread;
     }
 
   if (c->nread == 0)
@@ -259,7 +385,10 @@ copy_buffer_do_copy (struct copy_buffer *c, estream_t source, estream_t sink)
   log_assert (nwritten <= c->nread);
   c->writep += nwritten;
   c->nread -= nwritten;
-  log_assert (c->writep - c->buffer <= sizeof c->buffer);
+  log_assert (c->writep - c->buffer <= c->size);
+  if (!c->nread && c->writep - c->buffer == c->size
+      && c->size < COPY_BUFFER_MAX)
+    copy_buffer_grow (c);  /* There is more data; read larger chunks.  */
 
   if (err)
     {
@@ -289,7 +418,7 @@ copy_buffer_flush (struct copy_buffer *c, estream_t sink)
   log_assert (nwritten <= c->nread);
   c->writep += nwritten;
   c->nread -= nwritten;
-  log_assert (c->writep - c->buffer <= sizeof c->buffer);
+  log_assert (c->writep - c->buffer <= c->size);
 
   if (err)
     return err;
@@ -302,6 +431,42 @@ copy_buffer_flush (struct copy_buffer *c, estream_t sink)
 
 
 
+/* Try to enlarge the pipe STREAM.  Errors are ignored because this is
+ * only an optimization; for example the kernel may limit the size.  */
+static void
+enlarge_pipe (estream_t stream)
+{
+#if defined(F_SETPIPE_SZ) && !defined(HAVE_W32_SYSTEM)
+  if (stream)
+    fcntl (es_fileno (stream), F_SETPIPE_SZ, PIPE_SIZE);
+#else
+  (void)stream;
+#endif
+}
+
+
+/* Print the counters of the copy buffer C for the stream NAME.  */
+static void
+copy_buffer_log_stats (struct copy_buffer *c, const char *pgmname,
+                       const char *name)
+{
+  if (!c->ncalls)
+    return;
+  log_debug ("%s: %s: %llu bytes in %lu %s (avg %llu, buffer %zu)\n",
+             pgmname, name, c->nbytes, c->ncalls,
+             c->use_splice? "splices" : "reads",
+             c->nbytes / c->ncalls, c->size);
+}
+
+
+/* Enable or disable debug output.  */
+void
+gnupg_exec_tool_set_debug (int value)
+{
+  exectool_debug = value;
+}
+
+
 /* Run the program PGMNAME with the command line arguments given in
  * the NULL terminates array ARGV.  If INPUT is not NULL it will be
  * fed to stdin of the process.  stderr is logged using log_info and
@@ -344,29 +509,35 @@ gnupg_exec_tool_stream (const char *pgmname, const char *argv[],
    * diagnostics.  */
   quiet = (argv && argv[0] && !strcmp (argv[0], "--quiet"));
 
-  cpbuf_in = xtrymalloc (sizeof *cpbuf_in);
+  cpbuf_in = xtrycalloc (1, sizeof *cpbuf_in);
   if (cpbuf_in == NULL)
     {
       err = my_error_from_syserror ();
       goto leave;
     }
-  copy_buffer_init (cpbuf_in);
+  err = copy_buffer_init (cpbuf_in);
+  if (err)
+    goto leave;
 
-  cpbuf_out = xtrymalloc (sizeof *cpbuf_out);
+  cpbuf_out = xtrycalloc (1, sizeof *cpbuf_out);
   if (cpbuf_out == NULL)
     {
       err = my_error_from_syserror ();
       goto leave;
     }
-  copy_buffer_init (cpbuf_out);
+  err = copy_buffer_init (cpbuf_out);
+  if (err)
+    goto leave;
 
-  cpbuf_extra = xtrymalloc (sizeof *cpbuf_extra);
+  cpbuf_extra = xtrycalloc (1, sizeof *cpbuf_extra);
   if (cpbuf_extra == NULL)
     {
       err = my_error_from_syserror ();
       goto leave;
     }
-  copy_buffer_init (cpbuf_extra);
+  err = copy_buffer_init (cpbuf_extra);
+  if (err)
+    goto leave;
 
   fderrstate.pgmname = pgmname;
   fderrstate.quiet = quiet;
@@ -426,6 +597,14 @@ gnupg_exec_tool_stream (const char *pgmname, const char *argv[],
       goto leave;
     }
 
+  enlarge_pipe (infp);
+  enlarge_pipe (outfp);
+
+  /* We have not yet read from OUTFP and thus the child's output can
+   * be spliced directly into OUTPUT.  The caller's INPUT stream may
+   * have buffered data and is thus always copied.  */
+  copy_buffer_enable_splice (cpbuf_out, outfp, output);
+
   fds[0].stream = infp;
   fds[0].want_write = 1;
   if (!input)
@@ -522,7 +701,7 @@ gnupg_exec_tool_stream (const char *pgmname, const char *argv[],
               goto leave;
             }
 
-          if (es_feof (fds[1].stream))
+          if (cpbuf_out->eof || es_feof (fds[1].stream))
             {
               err = copy_buffer_flush (cpbuf_out, output);
               if (err)
@@ -541,6 +720,12 @@ gnupg_exec_tool_stream (const char *pgmname, const char *argv[],
     }
 
   read_and_log_stderr (&fderrstate, NULL); /* Flush.  */
+  if (exectool_debug)
+    {
+      copy_buffer_log_stats (cpbuf_in, pgmname, "stdin");
+      copy_buffer_log_stats (cpbuf_extra, pgmname, "extra");
+      copy_buffer_log_stats (cpbuf_out, pgmname, "stdout");
+    }
   es_fclose (infp); infp = NULL;
   es_fclose (extrafp); extrafp = NULL;
   es_fclose (outfp); outfp = NULL;
@@ -66,4 +66,7 @@ gpg_error_t gnupg_exec_tool_stream (const char *pgmname, const char *argv[],
                                     exec_tool_status_cb_t status_cb,
                                     void *status_cb_value);
 
+/* Enable or disable debug output of the above functions.  */
+void gnupg_exec_tool_set_debug (int value);
+
 #endif /* GNUPG_COMMON_EXECTOOL_H */
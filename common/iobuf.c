@@ -40,6 +40,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#if defined(HAVE_MMAP) && !defined(HAVE_W32_SYSTEM)
+# include <sys/mman.h>
+# define USE_TEMP_SPILL 1
+#endif
 #ifdef HAVE_W32_SYSTEM
 # ifdef HAVE_WINSOCK2_H
 #  include <winsock2.h>
@@ -62,16 +66,34 @@
 /* The standard size of the internal buffers.  */
 #define DEFAULT_IOBUF_BUFFER_SIZE  (64*1024)
 
+/* The range for the size of the buffers of input files.  Unless a
+   size has been set with iobuf_set_buffer_size, the buffer is sized
+   according to the length of the file (see adapt_buffer_size).  */
+#define MIN_IOBUF_BUFFER_SIZE      (4*1024)
+#define MAX_IOBUF_BUFFER_SIZE      (8*1024*1024)
+
 /* To avoid a potential DoS with compression packets we better limit
    the number of filters in a chain.  */
 #define MAX_NESTING_FILTER 64
 
+/* The default size above which the buffer of a temp iobuf is moved
+   to a temporary file.  */
+#define DEFAULT_TEMP_SPILL_SIZE    (64*1024*1024)
+
 /*-- End configurable part.  --*/
 
 /* The size of the iobuffers.  This can be changed using the
  * iobuf_set_buffer_size function.  */
 static unsigned int iobuf_buffer_size = DEFAULT_IOBUF_BUFFER_SIZE;
 
+/* Set if the buffer size has been set by iobuf_set_buffer_size.  In
+ * this case the size is not adapted to the file length.  */
+static int iobuf_buffer_size_fixed;
+
+/* The size above which temp iobufs use a temporary file or 0 to
+ * always keep them in memory.  See iobuf_set_temp_spill_size.  */
+static size_t temp_spill_size = DEFAULT_TEMP_SPILL_SIZE;
+
 
 #ifdef HAVE_W32_SYSTEM
 # ifdef HAVE_W32CE_SYSTEM
@@ -498,13 +520,26 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
 
 #else
 
-	  int n;
+	  int n, saved_errno;
+          void (*pre_syscall) (void);
+          void (*post_syscall) (void);
+
+          /* Let other threads run while we are blocked in read; this
+           * is for example used by gpg to fetch keys while hashing
+           * the signed data.  */
+          gpgrt_get_syscall_clamp (&pre_syscall, &post_syscall);
 
 	  nbytes = 0;
         read_more:
           do
             {
+              if (pre_syscall)
+                pre_syscall ();
               n = read (f, buf + nbytes, size - nbytes);
+              saved_errno = errno;
+              if (post_syscall)
+                post_syscall ();
+              errno = saved_errno;
             }
           while (n == -1 && errno == EINTR);
           if (n > 0)
@@ -1005,7 +1040,7 @@ block_filter (void *opaque, int control, iobuf_t chain, byte * buffer,
 		    }
 		  if ((n = nbytes) > blen)
 		    n = blen;
-		  if (n && iobuf_write (chain, p, n))
+		  if (n && iobuf_write_handoff (chain, p, n))
 		    rc = gpg_error_from_syserror ();
 		  p += n;
 		  nbytes -= n;
@@ -1107,6 +1142,14 @@ block_filter (void *opaque, int control, iobuf_t chain, byte * buffer,
 }
 
 
+/* Return the size of the internal buffer of A.  */
+size_t
+iobuf_get_buffer_size (iobuf_t a)
+{
+  return a->d.size;
+}
+
+
 /* Change the default size for all IOBUFs to KILOBYTE.  This needs to
  * be called before any iobufs are used and can only be used once.
  * Returns the current value.  Using 0 has no effect except for
@@ -1114,9 +1157,7 @@ block_filter (void *opaque, int control, iobuf_t chain, byte * buffer,
 unsigned int
 iobuf_set_buffer_size (unsigned int kilobyte)
 {
-  static int used;
-
-  if (!used && kilobyte)
+  if (!iobuf_buffer_size_fixed && kilobyte)
     {
       if (kilobyte < 4)
         kilobyte = 4;
@@ -1124,12 +1165,151 @@ iobuf_set_buffer_size (unsigned int kilobyte)
         kilobyte = 16*1024;
 
       iobuf_buffer_size = kilobyte * 1024;
-      used = 1;
+      iobuf_buffer_size_fixed = 1;
     }
   return iobuf_buffer_size / 1024;
 }
 
 
+unsigned int
+iobuf_set_temp_spill_size (unsigned int kilobyte)
+{
+  if (kilobyte != (unsigned int)(-1))
+    temp_spill_size = (size_t)kilobyte * 1024;
+  return temp_spill_size / 1024;
+}
+
+
+#ifdef USE_TEMP_SPILL
+/* Grow the buffer of the temp iobuf A to NEWSIZE by mapping a
+ * temporary file.  On the first call the data is copied from the
+ * memory buffer to the file; later calls only extend the file and
+ * map it again, which does not copy the data.  Returns 0 on success
+ * in which case A->D.BUF and A->D.SIZE are updated.  */
+static gpg_error_t
+spill_temp_buffer (iobuf_t a, size_t newsize)
+{
+  gpg_error_t err;
+  FILE *fp;
+  int fd;
+  void *p;
+
+  if (a->spilled)
+    fd = a->spill_fd;
+  else
+    {
+      fp = gnupg_tmpfile ();
+      if (!fp)
+        return gpg_error_from_syserror ();
+      fd = dup (fileno (fp));
+      err = fd == -1? gpg_error_from_syserror () : 0;
+      fclose (fp);
+      if (err)
+        return err;
+    }
+
+  if (ftruncate (fd, newsize)
+      || (p = mmap (NULL, newsize, PROT_READ|PROT_WRITE, MAP_SHARED,
+                    fd, 0)) == MAP_FAILED)
+    {
+      err = gpg_error_from_syserror ();
+      if (!a->spilled)
+        close (fd);
+      return err;
+    }
+
+  if (a->spilled)
+    munmap (a->d.buf, a->d.size);
+  else
+    {
+      memcpy (p, a->d.buf, a->d.len);
+      memset (a->d.buf, 0, a->d.size);
+      xfree (a->d.buf);
+      a->spill_fd = fd;
+      a->spilled = 1;
+      if (DBG_IOBUF)
+        log_debug ("iobuf-%d.%d: temp buffer moved to a file\n",
+                   a->no, a->subno);
+    }
+  a->d.buf = p;
+  a->d.size = newsize;
+  return 0;
+}
+#endif /*USE_TEMP_SPILL*/
+
+
+/* Release the buffer of A.  */
+static void
+release_buffer (iobuf_t a)
+{
+#ifdef USE_TEMP_SPILL
+  if (a->spilled)
+    {
+      /* The file is not wiped because that would only write all
+       * pages again; closing the unlinked file releases it.  */
+      munmap (a->d.buf, a->d.size);
+      close (a->spill_fd);
+      a->spilled = 0;
+      a->d.buf = NULL;
+      return;
+    }
+#endif /*USE_TEMP_SPILL*/
+  if (a->d.buf)
+    {
+      memset (a->d.buf, 0, a->d.size);	/* erase the buffer */
+      xfree (a->d.buf);
+    }
+}
+
+
+/* Adjust the buffer size of the just opened input pipeline A to the
+ * length of the underlying file.  Small files get a buffer just large
+ * enough to hold them, which saves memory for the many short lived
+ * pipelines of a server.  Large files get a buffer of up to
+ * MAX_IOBUF_BUFFER_SIZE to cut down the number of read calls.  Filters
+ * pushed later inherit the size.  Nothing is done if the length is
+ * not known (e.g. for a pipe) or a fixed size has been requested.  */
+static void
+adapt_buffer_size (iobuf_t a)
+{
+  off_t length;
+  int overflow;
+  size_t size;
+
+  if (iobuf_buffer_size_fixed || a->use != IOBUF_INPUT || a->d.len)
+    return;
+
+  length = iobuf_get_filelength (a, &overflow);
+  if (overflow)
+    size = MAX_IOBUF_BUFFER_SIZE;
+  else if (length <= 0)
+    return;
+  else if (length < iobuf_buffer_size)
+    {
+      for (size = MIN_IOBUF_BUFFER_SIZE; (off_t)size < length; size <<= 1)
+        ;
+    }
+  else
+    {
+      /* Use about one read per 128th of the file.  */
+      for (size = iobuf_buffer_size;
+           size < MAX_IOBUF_BUFFER_SIZE && (off_t)size * 128 <= length;
+           size <<= 1)
+        ;
+    }
+
+  if (size == a->d.size)
+    return;
+
+  if (DBG_IOBUF)
+    log_debug ("iobuf-%d.%d: buffer size %lu for %llu bytes\n",
+               a->no, a->subno, (ulong)size, (unsigned long long)length);
+  xfree (a->d.buf);
+  a->d.buf = xmalloc (size);
+  a->d.size = size;
+}
+
+
 #define MAX_IOBUF_DESC 32
 /*
  * Fill the buffer by the description of iobuf A.
@@ -1225,11 +1405,7 @@ iobuf_close (iobuf_t a)
 	rc = rc2;
 
       xfree (a->real_fname);
-      if (a->d.buf)
-	{
-	  memset (a->d.buf, 0, a->d.size);	/* erase the buffer */
-	  xfree (a->d.buf);
-	}
+      release_buffer (a);
       xfree (a);
     }
   return rc;
@@ -1363,6 +1539,12 @@ do_open (const char *fname, int special_filenames,
 	fp = direct_open (fname, opentype, mode700);
       if (fp == GNUPG_INVALID_FD)
 	return NULL;
+#if defined(HAVE_POSIX_FADVISE) && !defined(HAVE_W32_SYSTEM)
+      /* Input files are read from start to end; tell the kernel so
+       * that it reads further ahead.  Errors are not relevant.  */
+      if (use == IOBUF_INPUT)
+        posix_fadvise (FD2INT (fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
     }
 
   a = iobuf_alloc (use, iobuf_buffer_size);
@@ -1378,6 +1560,7 @@ do_open (const char *fname, int special_filenames,
   if (DBG_IOBUF)
     log_debug ("iobuf-%d.%d: open '%s' desc=%s fd=%d\n",
 	       a->no, a->subno, fname, iobuf_desc (a, desc), FD2INT (fcx->fp));
+  adapt_buffer_size (a);
 
   return a;
 }
@@ -1425,6 +1608,7 @@ do_iobuf_fdopen (int fd, const char *mode, int keep_open)
     log_debug ("iobuf-%d.%d: fdopen%s '%s'\n",
                a->no, a->subno, keep_open? "_nc":"", fcx->fname);
   iobuf_ioctl (a, IOBUF_IOCTL_NO_CACHE, 1, NULL);
+  adapt_buffer_size (a);
   return a;
 }
 
@@ -1665,6 +1849,7 @@ iobuf_push_filter2 (iobuf_t a,
   a->filter_ov = NULL;
   a->filter_ov_owner = 0;
   a->filter_eof = 0;
+  a->spilled = 0;  /* The mapped buffer belongs to B.  */
   if (a->use == IOBUF_OUTPUT_TEMP)
     /* A TEMP filter buffers any data sent to it; it does not forward
        any data down the pipeline.  If we add a new filter to the
@@ -1833,7 +2018,10 @@ underflow (iobuf_t a, int clear_pending_eof)
 
 /****************
  * read underflow: read TARGET bytes into the buffer and return
- * the first byte or -1 on EOF.
+ * the first byte or -1 on EOF.  If the caller provided an external
+ * buffer (A->E_D) and the internal buffer is empty, the data is
+ * instead stored in the external buffer; in this case A->E_D.USED
+ * is set to the number of bytes read and 0 is returned.
  */
 static int
 underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
@@ -1917,6 +2105,20 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	/* There is no space for more data.  Don't bother calling
 	   A->FILTER.  */
 	rc = 0;
+      else if (!a->d.len && a->e_d.buf && a->e_d.len >= len)
+        /* Nothing is buffered and the caller wants at least as much
+           as we could buffer: let the filter fill the caller's
+           buffer directly.  */
+        {
+          len = a->e_d.len;
+          if (DBG_IOBUF)
+            log_debug ("iobuf-%d.%d: underflow: using external buffer"
+                       " (%lu bytes)\n", a->no, a->subno, (ulong) len);
+          rc = a->filter (a->filter_ov, IOBUFCTRL_UNDERFLOW, a->chain,
+                          a->e_d.buf, &len);
+          a->e_d.used = len;
+          len = 0;
+        }
       else
 	rc = a->filter (a->filter_ov, IOBUFCTRL_UNDERFLOW, a->chain,
 			&a->d.buf[a->d.len], &len);
@@ -1947,7 +2149,8 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	  a->filter = NULL;
 	  a->filter_eof = 1;
 
-	  if (clear_pending_eof && a->d.len == 0 && a->chain)
+	  if (clear_pending_eof && a->d.len == 0 && !a->e_d.used
+              && a->chain)
 	    /* We don't need to keep this filter around at all:
 
 	         - we got an EOF
@@ -1969,7 +2172,7 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 
 	      return -1;
 	    }
-	  else if (a->d.len == 0)
+	  else if (a->d.len == 0 && !a->e_d.used)
 	    /* We can't unlink this filter (it is the only one in the
 	       pipeline), but we can immediately return EOF.  */
 	    return -1;
@@ -1979,12 +2182,16 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	{
 	  a->error = rc;
 
-	  if (a->d.len == 0)
+	  if (a->d.len == 0 && !a->e_d.used)
 	    /* There is no buffered data.  Immediately return EOF.  */
 	    return -1;
 	}
     }
 
+  if (a->e_d.used)
+    /* The data went to the external buffer.  */
+    return 0;
+
   assert (a->d.start <= a->d.len);
   if (a->d.start < a->d.len)
     return a->d.buf[a->d.start++];
@@ -1994,16 +2201,64 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 }
 
 
+/* Pass the BUFLEN bytes at BUF to the filter of the output
+   pipeline A.  BUF is either A's internal buffer or a buffer handed
+   over by iobuf_write_handoff.  */
 static int
-filter_flush (iobuf_t a)
+filter_flush_buffer (iobuf_t a, byte *buf, size_t buflen)
 {
   size_t len;
   int rc;
 
+  if (!a->filter)
+    log_bug ("filter_flush: no filter\n");
+  len = buflen;
+  rc = a->filter (a->filter_ov, IOBUFCTRL_FLUSH, a->chain, buf, &len);
+  if (!rc && len != buflen)
+    {
+      log_info ("filter_flush did not write all!\n");
+      rc = GPG_ERR_INTERNAL;
+    }
+  else if (rc)
+    a->error = rc;
+
+  return rc;
+}
+
+
+static int
+filter_flush (iobuf_t a)
+{
+  int rc;
+
   if (a->use == IOBUF_OUTPUT_TEMP)
     {				/* increase the temp buffer */
       size_t newsize = a->d.size + iobuf_buffer_size;
 
+#ifdef USE_TEMP_SPILL
+      if (a->spilled || (temp_spill_size && newsize > temp_spill_size))
+        {
+          /* Grow a mapped buffer in larger steps to save system
+           * calls.  If the file can't be used we fall back to
+           * memory unless the data is already in a file.  */
+          if (a->spilled)
+            newsize = a->d.size + a->d.size / 2;
+          rc = spill_temp_buffer (a, newsize);
+          if (!rc)
+            return 0;
+          if (a->spilled)
+            {
+              log_error ("error growing the temp iobuf: %s\n",
+                         gpg_strerror (rc));
+              a->error = rc;
+              return rc;
+            }
+          if (DBG_IOBUF)
+            log_debug ("error moving temp iobuf to a file: %s\n",
+                       gpg_strerror (rc));
+        }
+#endif /*USE_TEMP_SPILL*/
+
       if (DBG_IOBUF)
 	log_debug ("increasing temp iobuf from %lu to %lu\n",
 		   (ulong) a->d.size, (ulong) newsize);
@@ -2014,17 +2269,7 @@ filter_flush (iobuf_t a)
     }
   else if (a->use != IOBUF_OUTPUT)
     log_bug ("flush on non-output iobuf\n");
-  else if (!a->filter)
-    log_bug ("filter_flush: no filter\n");
-  len = a->d.len;
-  rc = a->filter (a->filter_ov, IOBUFCTRL_FLUSH, a->chain, a->d.buf, &len);
-  if (!rc && len != a->d.len)
-    {
-      log_info ("filter_flush did not write all!\n");
-      rc = GPG_ERR_INTERNAL;
-    }
-  else if (rc)
-    a->error = rc;
+  rc = filter_flush_buffer (a, a->d.buf, a->d.len);
   a->d.len = 0;
 
   return rc;
@@ -2069,6 +2314,7 @@ iobuf_read (iobuf_t a, void *buffer, unsigned int buflen)
 {
   unsigned char *buf = (unsigned char *)buffer;
   int c, n;
+  size_t used;
 
   if (a->use == IOBUF_OUTPUT || a->use == IOBUF_OUTPUT_TEMP)
     {
@@ -2116,9 +2362,27 @@ iobuf_read (iobuf_t a, void *buffer, unsigned int buflen)
       if (n < buflen)
 	/* Draining the internal buffer didn't fill BUFFER.  Call
 	   underflow to read more data into the filter's internal
-	   buffer.  */
+	   buffer or, if the rest of BUFFER can take a full buffer's
+	   worth of data, directly into BUFFER.  */
 	{
-	  if ((c = underflow (a, 1)) == -1)
+          if (buf && buflen - n >= a->d.size)
+            {
+              a->e_d.buf = buf;
+              a->e_d.len = buflen - n;
+            }
+          a->e_d.used = 0;
+	  c = underflow (a, 1);
+          used = a->e_d.used;
+          a->e_d.buf = NULL;
+          a->e_d.len = 0;
+          a->e_d.used = 0;
+          if (used)
+            {
+              n += used;
+              buf += used;
+              continue;
+            }
+	  if (c == -1)
 	    /* EOF.  If we managed to read something, don't return EOF
 	       now.  */
 	    {
@@ -2236,6 +2500,43 @@ iobuf_write (iobuf_t a, const void *buffer, unsigned int buflen)
 }
 
 
+int
+iobuf_write_handoff (iobuf_t a, void *buffer, unsigned int buflen)
+{
+  byte *buf = buffer;
+  unsigned int size;
+  int rc;
+
+  if (a->use != IOBUF_OUTPUT)
+    return iobuf_write (a, buffer, buflen);
+
+  /* Top up a partially filled internal buffer first to keep the
+     order of the data.  */
+  if (a->d.len)
+    {
+      size = a->d.size - a->d.len;
+      if (size > buflen)
+        size = buflen;
+      memcpy (a->d.buf + a->d.len, buf, size);
+      buflen -= size;
+      buf += size;
+      a->d.len += size;
+      if (!buflen)
+        return 0;
+      rc = filter_flush (a);
+      if (rc)
+        return rc;
+    }
+
+  /* Hand BUF over to the filter if there is at least a full buffer's
+     worth of data.  The rest is buffered as usual.  */
+  if (buflen >= a->d.size)
+    return filter_flush_buffer (a, buf, buflen);
+
+  return iobuf_write (a, buf, buflen);
+}
+
+
 int
 iobuf_writestr (iobuf_t a, const char *buf)
 {
@@ -2291,8 +2592,9 @@ size_t
 iobuf_copy (iobuf_t dest, iobuf_t source)
 {
   char *temp;
-  /* Use a 32 KB buffer.  */
-  const size_t temp_size = 32 * 1024;
+  /* Use a buffer of the size of the pipeline buffers so that the data
+     can be read and written without going through them.  */
+  const size_t temp_size = iobuf_buffer_size;
 
   size_t nread;
   size_t nwrote = 0;
@@ -2316,7 +2618,9 @@ iobuf_copy (iobuf_t dest, iobuf_t source)
       if (nread > max_read)
         max_read = nread;
 
-      err = iobuf_write (dest, temp, nread);
+      /* TEMP is our scratch buffer, thus it is fine if the filters
+         work on it in place.  */
+      err = iobuf_write_handoff (dest, temp, nread);
       if (err)
         break;
       nwrote += nread;
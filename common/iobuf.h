@@ -202,6 +202,20 @@ struct iobuf_struct
     byte *buf;
   } d;
 
+  /* An external buffer handed over by the caller of iobuf_read.  If
+     the internal buffer D is empty and the caller wants at least a
+     full buffer's worth of data, the filter is asked to fill this
+     buffer directly instead of D, which saves a copy per stage.  */
+  struct
+  {
+    /* The caller's buffer or NULL if none is available.  */
+    byte *buf;
+    /* The number of bytes available in BUF.  */
+    size_t len;
+    /* The number of bytes the filter actually stored in BUF.  */
+    size_t used;
+  } e_d;
+
   /* When FILTER is called to read some data, it may read some data
      and then return EOF.  We can't return the EOF immediately.
      Instead, we note that we observed the EOF and when the buffer is
@@ -247,6 +261,12 @@ struct iobuf_struct
      This amount of nesting typically indicates corrupted data or an
      active denial of service attack.  */
   int subno;
+
+  /* Set if the buffer of this IOBUF_OUTPUT_TEMP filter is a mapping
+     of the unlinked temporary file SPILL_FD instead of allocated
+     memory.  See iobuf_set_temp_spill_size.  */
+  unsigned int spilled:1;
+  int spill_fd;
 };
 
 extern int iobuf_debug_mode;
@@ -254,10 +274,23 @@ extern int iobuf_debug_mode;
 
 /* Change the default size for all IOBUFs to KILOBYTE.  This needs to
  * be called before any iobufs are used and can only be used once.
- * Returns the current value.  Using 0 has no effect except for
- * returning the current value.  */
+ * Once called, the buffers of input files are no longer sized
+ * according to the file length.  Returns the current value.  Using 0
+ * has no effect except for returning the current value.  */
 unsigned int iobuf_set_buffer_size (unsigned int kilobyte);
 
+/* Return the size of the internal buffer of A.  An iobuf_read of at
+ * least this size lets the filters store the data directly in the
+ * caller's buffer instead of copying it from the internal buffer.  */
+size_t iobuf_get_buffer_size (iobuf_t a);
+
+/* Set the size in kilobyte above which the buffer of a temp iobuf
+ * (iobuf_temp) is moved to a mapped and unlinked temporary file so
+ * that the data can be paged out instead of taking up memory.  0
+ * disables this.  Returns the current value; using -1 has no effect
+ * except for returning the current value.  */
+unsigned int iobuf_set_temp_spill_size (unsigned int kilobyte);
+
 /* Returns whether the specified filename corresponds to a pipe.  In
    particular, this function checks if FNAME is "-" and, if special
    filenames are enabled (see check_special_filename), whether
@@ -531,6 +564,15 @@ int iobuf_writebyte (iobuf_t a, unsigned c);
    and an error code otherwise.  */
 int iobuf_write (iobuf_t a, const void *buf, unsigned buflen);
 
+/* Write a sequence of bytes to the pipeline like iobuf_write but
+   allow the filter to work directly on BUF instead of copying the
+   data to the internal buffer first.  This is used by filters to
+   hand their scratch buffers down the pipeline.  Because filters
+   may transform the data in place (e.g. encrypt it), the content
+   of BUF is undefined on return.  Returns 0 on success and an error
+   code otherwise.  */
+int iobuf_write_handoff (iobuf_t a, void *buf, unsigned buflen);
+
 /* Write a string (not including the NUL terminator) to the pipeline.
    Returns 0 on success and an error code otherwise.  */
 int iobuf_writestr (iobuf_t a, const char *buf);
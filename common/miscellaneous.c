@@ -198,15 +198,17 @@ do_print_utf8_buffer (estream_t stream,
   if (i < length)
     {
       int delim = delimiters? *delimiters : 0;
+      char tmpbuf[256];
       char *buf;
       int ret;
 
       /*(utf8 conversion already does the control character quoting). */
-      buf = utf8_to_native (p, length, delim);
+      buf = utf8_to_native_buf (p, length, delim, tmpbuf, sizeof tmpbuf);
       if (bytes_written)
         *bytes_written = strlen (buf);
       ret = es_fputs (buf, stream);
-      xfree (buf);
+      if (buf != tmpbuf)
+        xfree (buf);
       return ret == EOF? ret : (int)i;
     }
   else
@@ -60,7 +60,8 @@ struct name_value_entry
   char *name;
 
   /* The value as stored in the file.  We store it when we parse
-     a file so that we can reproduce it.  */
+     a file so that we can reproduce it.  An item may hold several
+     lines; each line is terminated by a LF.  */
   strlist_t raw_value;
 
   /* The decoded value.  */
@@ -238,9 +239,11 @@ assert_raw_value (nve_t entry)
 /* Computes the length of the value encoded as continuation.  If
    *SWALLOW_WS is set, all whitespace at the beginning of S is
    swallowed.  If START is given, a pointer to the beginning of the
-   value is stored there.  */
+   value is stored there.  The line S has a length of N and is not
+   necessarily terminated by a nul.  */
 static size_t
-continuation_length (const char *s, int *swallow_ws, const char **start)
+continuation_length (const char *s, size_t n, int *swallow_ws,
+                     const char **start)
 {
   size_t len;
 
@@ -248,19 +251,25 @@ continuation_length (const char *s, int *swallow_ws, const char **start)
     {
       /* The previous line was a blank line and we inserted a newline.
 	 Swallow all whitespace at the beginning of this line.  */
-      while (ascii_isspace (*s))
-	s++;
+      while (n && ascii_isspace (*s))
+	{
+	  s++;
+	  n--;
+	}
     }
   else
     {
       /* Iff a continuation starts with more than one space, it
 	 encodes a space.  */
-      if (ascii_isspace (*s))
-	s++;
+      if (n && ascii_isspace (*s))
+	{
+	  s++;
+	  n--;
+	}
     }
 
   /* Strip whitespace at the end.  */
-  len = strlen (s);
+  len = n;
   while (len > 0 && ascii_isspace (s[len-1]))
     len--;
 
@@ -281,13 +290,31 @@ continuation_length (const char *s, int *swallow_ws, const char **start)
 }
 
 
+/* Return the length of the line at S without the LF and store the
+   start of the next line at R_NEXT.  */
+static size_t
+raw_line_length (const char *s, const char **r_next)
+{
+  const char *nl = strchr (s, '\n');
+
+  if (nl)
+    {
+      *r_next = nl + 1;
+      return nl - s;
+    }
+  *r_next = s + strlen (s);
+  return *r_next - s;
+}
+
+
 /* Makes sure that ENTRY has a VALUE.  */
 static gpg_error_t
 assert_value (nve_t entry)
 {
-  size_t len;
+  size_t len, n;
   int swallow_ws;
   strlist_t s;
+  const char *line, *next;
   char *p;
 
   if (entry->value)
@@ -296,7 +323,11 @@ assert_value (nve_t entry)
   len = 0;
   swallow_ws = 0;
   for (s = entry->raw_value; s; s = s->next)
-    len += continuation_length (s->d, &swallow_ws, NULL);
+    for (line = s->d; *line; line = next)
+      {
+        n = raw_line_length (line, &next);
+        len += continuation_length (line, n, &swallow_ws, NULL);
+      }
 
   /* Add one for the terminating zero.  */
   len += 1;
@@ -307,13 +338,16 @@ assert_value (nve_t entry)
 
   swallow_ws = 0;
   for (s = entry->raw_value; s; s = s->next)
-    {
-      const char *start;
-      size_t l = continuation_length (s->d, &swallow_ws, &start);
+    for (line = s->d; *line; line = next)
+      {
+        const char *start;
+        size_t l;
 
-      memcpy (p, start, l);
-      p += l;
-    }
+        n = raw_line_length (line, &next);
+        l = continuation_length (line, n, &swallow_ws, &start);
+        memcpy (p, start, l);
+        p += l;
+      }
 
   *p++ = 0;
   assert (p - entry->value == len);
@@ -682,16 +716,105 @@ nvc_set_private_key (nvc_t pk, gcry_sexp_t sexp)
 
 /* Parsing and serialization.  */
 
+/* Read all of STREAM into a newly allocated buffer which is stored
+   at R_BUFFER with its length at R_LENGTH.  The buffer is terminated
+   by a nul which is not counted.  If WIPE is set intermediate copies
+   are wiped.  */
+static gpg_error_t
+read_whole_stream (estream_t stream, int wipe,
+                   char **r_buffer, size_t *r_length)
+{
+  char *buffer, *tmp;
+  size_t size, length, nread;
+
+  *r_buffer = NULL;
+  *r_length = 0;
+  size = 4096;
+  length = 0;
+  buffer = xtrymalloc (size);
+  if (!buffer)
+    return my_error_from_syserror ();
+
+  for (;;)
+    {
+      if (es_read (stream, buffer + length, size - length - 1, &nread))
+        {
+          gpg_error_t err = my_error_from_syserror ();
+
+          if (wipe)
+            wipememory (buffer, length);
+          xfree (buffer);
+          return err;
+        }
+      if (!nread)
+        break;
+      length += nread;
+      if (length + 1 < size)
+        continue;
+
+      /* Grow the buffer.  We do not use realloc so that we are able
+         to wipe the old buffer.  */
+      tmp = xtrymalloc (2 * size);
+      if (!tmp)
+        {
+          gpg_error_t err = my_error_from_syserror ();
+
+          if (wipe)
+            wipememory (buffer, length);
+          xfree (buffer);
+          return err;
+        }
+      memcpy (tmp, buffer, length);
+      if (wipe)
+        wipememory (buffer, length);
+      xfree (buffer);
+      buffer = tmp;
+      size *= 2;
+    }
+
+  buffer[length] = 0;
+  *r_buffer = buffer;
+  *r_length = length;
+  return 0;
+}
+
+
+/* Add an entry with NAME to RESULT using the LEN bytes at RAW as its
+   raw value.  NAME is consumed.  The raw value is stored as one
+   strlist item.  */
+static gpg_error_t
+add_parsed_entry (nvc_t result, char *name, const char *raw, size_t len)
+{
+  strlist_t sl;
+
+  sl = xtrymalloc (sizeof *sl + len);
+  if (!sl)
+    {
+      xfree (name);
+      return my_error_from_syserror ();
+    }
+  sl->next = NULL;
+  sl->flags = 0;
+  memcpy (sl->d, raw, len);
+  sl->d[len] = 0;
+  return _nvc_add (result, name, NULL, sl, 1);
+}
+
+
+/* The parser for nvc_parse and nvc_parse_private_key.  The stream is
+   read in one go and parsed in that buffer.  All lines belonging to
+   an entry are contiguous in the file; thus the raw value of an entry
+   is copied with a single allocation instead of one per line.  */
 static gpg_error_t
 do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
               int for_private_key)
 {
   gpg_error_t err = 0;
-  gpgrt_ssize_t len;
-  char *buf = NULL;
-  size_t buf_len = 0;
+  char *buffer = NULL;
+  size_t buflen;
+  const char *line, *next, *end, *p;
+  const char *raw = NULL;  /* Start of the current raw value.  */
   char *name = NULL;
-  strlist_t raw_value = NULL;
 
   *result = for_private_key? nvc_new_private_key () : nvc_new ();
   if (*result == NULL)
@@ -699,88 +822,77 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
 
   if (errlinep)
     *errlinep = 0;
-  while ((len = es_read_line (stream, &buf, &buf_len, NULL)) > 0)
+
+  err = read_whole_stream (stream, for_private_key, &buffer, &buflen);
+  if (err)
+    goto leave;
+
+  end = buffer + buflen;
+  for (line = buffer; line < end; line = next)
     {
-      char *p;
+      next = memchr (line, '\n', end - line);
+      next = next? next + 1 : end;
+
       if (errlinep)
 	*errlinep += 1;
 
       /* Skip any whitespace.  */
-      for (p = buf; *p && ascii_isspace (*p); p++)
+      for (p = line; p < next && *p != '\n' && ascii_isspace (*p); p++)
 	/* Do nothing.  */;
 
-      if (name && (spacep (buf) || *p == 0))
-	{
-	  /* A continuation.  */
-	  if (append_to_strlist_try (&raw_value, buf) == NULL)
-	    {
-	      err = my_error_from_syserror ();
-	      goto leave;
-	    }
-	  continue;
-	}
+      if (raw && name && (spacep (line) || p == next || *p == '\n'))
+	continue;  /* A continuation.  */
 
       /* No continuation.  Add the current entry if any.  */
-      if (raw_value)
+      if (raw)
 	{
-	  err = _nvc_add (*result, name, NULL, raw_value, 1);
+	  err = add_parsed_entry (*result, name, raw, line - raw);
+	  name = NULL;
 	  if (err)
 	    goto leave;
 	}
 
       /* And prepare for the next one.  */
-      name = NULL;
-      raw_value = NULL;
+      raw = line;
 
-      if (*p != 0 && *p != '#')
+      if (p < next && *p != '\n' && *p != '#')
 	{
-	  char *colon, *value, tmp;
+	  const char *colon;
 
-	  colon = strchr (buf, ':');
+	  colon = memchr (p, ':', next - p);
 	  if (colon == NULL)
 	    {
 	      err = my_error (GPG_ERR_INV_VALUE);
 	      goto leave;
 	    }
 
-	  value = colon + 1;
-	  tmp = *value;
-	  *value = 0;
-	  name = xtrystrdup (p);
-	  *value = tmp;
-
+	  name = xtrymalloc (colon + 1 - p + 1);
 	  if (name == NULL)
 	    {
 	      err = my_error_from_syserror ();
 	      goto leave;
 	    }
-
-	  if (append_to_strlist_try (&raw_value, value) == NULL)
-	    {
-	      err = my_error_from_syserror ();
-	      goto leave;
-	    }
-	  continue;
-	}
-
-      if (append_to_strlist_try (&raw_value, buf) == NULL)
-	{
-	  err = my_error_from_syserror ();
-	  goto leave;
+	  memcpy (name, p, colon + 1 - p);
+	  name[colon + 1 - p] = 0;
+	  raw = colon + 1;
 	}
     }
-  if (len < 0)
-    {
-      err = gpg_error_from_syserror ();
-      goto leave;
-    }
 
   /* Add the final entry.  */
-  if (raw_value)
-    err = _nvc_add (*result, name, NULL, raw_value, 1);
+  if (raw)
+    {
+      err = add_parsed_entry (*result, name, raw, end - raw);
+      name = NULL;
+    }
 
  leave:
-  gpgrt_free (buf);
+  xfree (name);
+  if (buffer)
+    {
+      if (for_private_key)
+        wipememory (buffer, buflen);
+      xfree (buffer);
+    }
   if (err)
     {
       nvc_release (*result);
@@ -37,29 +37,44 @@
 #include "util.h"
 #include "openpgpdefs.h"
 
-/* A table with all our supported OpenPGP curves.  */
+/* A table with all our supported OpenPGP curves.  OIDBUF is the OID
+ * in the OpenPGP format, i.e. the DER encoding prefixed with its
+ * length; it allows to map an OID to a curve without first
+ * formatting it as a string.  */
 static struct {
   const char *name;   /* Standard name.  */
   const char *oidstr; /* IETF formatted OID.  */
+  const char *oidbuf; /* OpenPGP formatted OID.  */
   unsigned int nbits; /* Nominal bit length of the curve.  */
   const char *alias;  /* NULL or alternative name of the curve.  */
   int pubkey_algo;    /* Required OpenPGP algo or 0 for ECDSA/ECDH.  */
 } oidtable[] = {
 
-  { "Curve25519", "1.3.6.1.4.1.3029.1.5.1", 255, "cv25519", PUBKEY_ALGO_ECDH },
-  { "Ed25519",    "1.3.6.1.4.1.11591.15.1", 255, "ed25519", PUBKEY_ALGO_EDDSA },
-
-  { "NIST P-256",      "1.2.840.10045.3.1.7",    256, "nistp256" },
-  { "NIST P-384",      "1.3.132.0.34",           384, "nistp384" },
-  { "NIST P-521",      "1.3.132.0.35",           521, "nistp521" },
-
-  { "brainpoolP256r1", "1.3.36.3.3.2.8.1.1.7",   256 },
-  { "brainpoolP384r1", "1.3.36.3.3.2.8.1.1.11",  384 },
-  { "brainpoolP512r1", "1.3.36.3.3.2.8.1.1.13",  512 },
-
-  { "secp256k1",       "1.3.132.0.10",           256 },
-
-  { NULL, NULL, 0}
+  { "Curve25519", "1.3.6.1.4.1.3029.1.5.1",
+    "\x0a\x2b\x06\x01\x04\x01\x97\x55\x01\x05\x01",
+    255, "cv25519", PUBKEY_ALGO_ECDH },
+  { "Ed25519",    "1.3.6.1.4.1.11591.15.1",
+    "\x09\x2b\x06\x01\x04\x01\xda\x47\x0f\x01",
+    255, "ed25519", PUBKEY_ALGO_EDDSA },
+
+  { "NIST P-256",      "1.2.840.10045.3.1.7",
+    "\x08\x2a\x86\x48\xce\x3d\x03\x01\x07",       256, "nistp256" },
+  { "NIST P-384",      "1.3.132.0.34",
+    "\x05\x2b\x81\x04\x00\x22",                   384, "nistp384" },
+  { "NIST P-521",      "1.3.132.0.35",
+    "\x05\x2b\x81\x04\x00\x23",                   521, "nistp521" },
+
+  { "brainpoolP256r1", "1.3.36.3.3.2.8.1.1.7",
+    "\x09\x2b\x24\x03\x03\x02\x08\x01\x01\x07", 256 },
+  { "brainpoolP384r1", "1.3.36.3.3.2.8.1.1.11",
+    "\x09\x2b\x24\x03\x03\x02\x08\x01\x01\x0b", 384 },
+  { "brainpoolP512r1", "1.3.36.3.3.2.8.1.1.13",
+    "\x09\x2b\x24\x03\x03\x02\x08\x01\x01\x0d", 512 },
+
+  { "secp256k1",       "1.3.132.0.10",
+    "\x05\x2b\x81\x04\x00\x0a",                   256 },
+
+  { NULL, NULL, NULL, 0}
 };
 
 
@@ -199,6 +214,27 @@ openpgp_oid_from_str (const char *string, gcry_mpi_t *r_mpi)
 }
 
 
+/* Return the index of the OpenPGP formatted OID (BUF,LEN) in
+ * OIDTABLE or -1 if it is not a known curve.  Because the first byte
+ * is the length most entries are rejected by the first compare.  */
+static int
+oidbuf_to_index (const void *buf, size_t len)
+{
+  const unsigned char *s = buf;
+  int i;
+
+  if (!s || !len || s[0] != len - 1)
+    return -1;
+
+  for (i=0; oidtable[i].name; i++)
+    if (*oidtable[i].oidbuf == *s
+        && !memcmp (oidtable[i].oidbuf + 1, s + 1, len - 1))
+      return i;
+
+  return -1;
+}
+
+
 /* Return a malloced string representation of the OID in the buffer
  * (BUF,LEN).  In case of an error NULL is returned and ERRNO is set.
  * As per OpenPGP spec the first byte of the buffer is the length of
@@ -210,6 +246,12 @@ openpgp_oidbuf_to_str (const unsigned char *buf, size_t len)
   int n = 0;
   unsigned long val, valmask;
 
+  /* The OIDs of the known curves need not be formatted.  */
+  n = oidbuf_to_index (buf, len);
+  if (n >= 0)
+    return xtrystrdup (oidtable[n].oidstr);
+  n = 0;
+
   valmask = (unsigned long)0xfe << (8 * (sizeof (valmask) - 1));
   /* The first bytes gives the length; check consistency.  */
 
@@ -416,6 +458,39 @@ openpgp_oid_to_curve (const char *oidstr, int canon)
 }
 
 
+/* Map the OpenPGP formatted OID in the buffer (BUF,LEN) to the
+ * Libgcrypt curve name.  This is the same as openpgp_oid_to_curve but
+ * does not require to convert the OID to a string first.  Returns
+ * NULL for unknown curves.  */
+const char *
+openpgp_oidbuf_to_curve (const void *buf, size_t len, int canon)
+{
+  int i;
+
+  i = oidbuf_to_index (buf, len);
+  if (i < 0)
+    return NULL;
+
+  return !canon && oidtable[i].alias? oidtable[i].alias : oidtable[i].name;
+}
+
+
+/* Map the OID in the opaque MPI A to the Libgcrypt curve name.
+ * Returns NULL for unknown curves or if A is not an OID.  */
+const char *
+openpgp_oidmpi_to_curve (gcry_mpi_t a, int canon)
+{
+  const unsigned char *buf;
+  unsigned int nbits;
+
+  if (!a || !gcry_mpi_get_flag (a, GCRYMPI_FLAG_OPAQUE))
+    return NULL;
+
+  buf = gcry_mpi_get_opaque (a, &nbits);
+  return openpgp_oidbuf_to_curve (buf, (nbits+7)/8, canon);
+}
+
+
 /* Map an OpenPGP OID, name or alias to the Libgcrypt curve name.
  * Returns NULL for unknown curve names.  Unless CANON is set we
  * prefer an alias name here which is more suitable for printing.  */
@@ -36,6 +36,47 @@
 #include "util.h"
 
 
+/* Macros to check all bytes of the unsigned long W at once.  The
+ * tests are exact; WORD_HAS_LESS requires C <= 128.  */
+#define WORD_ONES            (~0UL / 0xff)
+#define WORD_HIGHS           (WORD_ONES << 7)
+#define WORD_HAS_LESS(w,c)   (((w) - WORD_ONES * (c)) & ~(w) & WORD_HIGHS)
+#define WORD_HAS_ZERO(w)     WORD_HAS_LESS ((w), 1)
+#define WORD_HAS_BYTE(w,c)   WORD_HAS_ZERO ((w) ^ (WORD_ONES * (c)))
+
+
+/* Return the number of bytes at the start of (DATA,DATALEN) which
+ * percent_data_escape copies verbatim.  The data is checked a word at
+ * a time so that the plain runs, which are the common case for
+ * binary data, can be copied in one go.  */
+static size_t
+data_escape_plain_length (int plus_escape,
+                          const unsigned char *data, size_t datalen)
+{
+  unsigned long w;
+  size_t n = 0;
+
+  for (; n + sizeof w <= datalen; n += sizeof w)
+    {
+      memcpy (&w, data + n, sizeof w);
+      if (plus_escape)
+        {
+          if (WORD_HAS_LESS (w, ' ' + 1)
+              || WORD_HAS_BYTE (w, '%') || WORD_HAS_BYTE (w, '+'))
+            break;
+        }
+      else if (WORD_HAS_ZERO (w) || WORD_HAS_BYTE (w, '%'))
+        break;
+    }
+  for (; n < datalen; n++)
+    if (!data[n] || data[n] == '%'
+        || (plus_escape && (data[n] <= ' ' || data[n] == '+')))
+      break;
+
+  return n;
+}
+
+
 /* Create a newly alloced string from STRING with all spaces and
  * control characters converted to plus signs or %xx sequences.  The
  * function returns the new string or NULL in case of a malloc
@@ -100,7 +141,7 @@ percent_data_escape (int plus_escape, const char *prefix,
 {
   char *buffer, *p;
   const unsigned char *s;
-  size_t n;
+  size_t n, k;
   size_t length = 1;
 
   if (prefix)
@@ -116,10 +157,16 @@ percent_data_escape (int plus_escape, const char *prefix,
 
   for (s=data, n=datalen; n; s++, n--)
     {
-      if (!*s || *s == '%' || (plus_escape && (*s < ' ' || *s == '+')))
-        length += 3;
-      else
+      k = data_escape_plain_length (plus_escape, s, n);
+      length += k;
+      s += k;
+      n -= k;
+      if (!n)
+        break;
+      if (plus_escape && *s == ' ')
         length++;
+      else
+        length += 3;
     }
 
   buffer = p = xtrymalloc (length);
@@ -142,6 +189,13 @@ percent_data_escape (int plus_escape, const char *prefix,
 
   for (s=data, n=datalen; n; s++, n--)
     {
+      k = data_escape_plain_length (plus_escape, s, n);
+      memcpy (p, s, k);
+      p += k;
+      s += k;
+      n -= k;
+      if (!n)
+        break;
       if (!*s)
         {
           memcpy (p, "%00", 3);
@@ -179,9 +233,18 @@ do_unescape (unsigned char *buffer, const unsigned char *string,
              int withplus, int nulrepl)
 {
   unsigned char *p = buffer;
+  size_t n;
 
   while (*string)
     {
+      /* Copy the run up to the next escape character at once.  */
+      n = strcspn ((const char *)string, withplus? "%+" : "%");
+      memcpy (p, string, n);
+      p += n;
+      string += n;
+      if (!*string)
+        break;
+
       if (*string == '%' && string[1] && string[2])
         {
           string++;
@@ -208,9 +271,16 @@ static size_t
 count_unescape (const unsigned char *string)
 {
   size_t n = 0;
+  size_t k;
 
   while (*string)
     {
+      k = strcspn ((const char *)string, "%");
+      n += k;
+      string += k;
+      if (!*string)
+        break;
+
       if (*string == '%' && string[1] && string[2])
         {
           string++;
@@ -269,10 +339,19 @@ static size_t
 do_unescape_inplace (char *string, int withplus, int nulrepl)
 {
   unsigned char *p, *p0;
+  size_t n;
 
   p = p0 = string;
   while (*string)
     {
+      n = strcspn (string, withplus? "%+" : "%");
+      if (p != (unsigned char *)string)
+        memmove (p, string, n);
+      p += n;
+      string += n;
+      if (!*string)
+        break;
+
       if (*string == '%' && string[1] && string[2])
         {
           string++;
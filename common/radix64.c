@@ -0,0 +1,146 @@
+/* radix64.c - Block oriented radix-64 codec
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* These functions convert whole groups of radix-64 characters: The
+ * encoder looks up 12 bits at once and the decoder merges the lookups
+ * of 4 characters so that a single test detects an invalid
+ * character.  Two groups are processed per iteration which gives the
+ * compiler enough independent operations to keep the CPU busy.  */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "radix64.h"
+
+
+static const char bintoasc[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                 "abcdefghijklmnopqrstuvwxyz"
+                                 "0123456789+/";
+
+/* The two characters for each 12 bit value.  */
+static char enc_table[4096][2];
+
+/* The value of a character shifted to its position in a group of
+ * 4 characters; a value with the high byte set marks an invalid
+ * character.  */
+static u32 dec_table[4][256];
+
+static int tables_initialized;
+
+
+static void
+init_tables (void)
+{
+  int i, j;
+
+  for (i=0; i < 4096; i++)
+    {
+      enc_table[i][0] = bintoasc[i >> 6];
+      enc_table[i][1] = bintoasc[i & 077];
+    }
+
+  memset (dec_table, 0xff, sizeof dec_table);
+  for (i=0; i < 64; i++)
+    for (j=0; j < 4; j++)
+      dec_table[j][(unsigned char)bintoasc[i]] = (u32)i << ((3 - j) * 6);
+
+  tables_initialized = 1;
+}
+
+
+void
+radix64_encode_groups (char *out, const unsigned char *in, size_t ngroups)
+{
+  u32 a, b;
+
+  if (!tables_initialized)
+    init_tables ();
+
+  for (; ngroups >= 2; ngroups -= 2, in += 6, out += 8)
+    {
+      a = ((u32)in[0] << 16) | ((u32)in[1] << 8) | in[2];
+      b = ((u32)in[3] << 16) | ((u32)in[4] << 8) | in[5];
+      memcpy (out + 0, enc_table[a >> 12], 2);
+      memcpy (out + 2, enc_table[a & 0xfff], 2);
+      memcpy (out + 4, enc_table[b >> 12], 2);
+      memcpy (out + 6, enc_table[b & 0xfff], 2);
+    }
+  if (ngroups)
+    {
+      a = ((u32)in[0] << 16) | ((u32)in[1] << 8) | in[2];
+      memcpy (out + 0, enc_table[a >> 12], 2);
+      memcpy (out + 2, enc_table[a & 0xfff], 2);
+    }
+}
+
+
+size_t
+radix64_decode_groups (unsigned char *out, const unsigned char *in,
+                       size_t inlen)
+{
+  const unsigned char *start = in;
+  u32 a, b;
+
+  if (!tables_initialized)
+    init_tables ();
+
+  /* Note that all input of an iteration is read before the output
+   * is written; this allows for in-place decoding.  */
+  for (; inlen >= 8; inlen -= 8, in += 8, out += 6)
+    {
+      a = (dec_table[0][in[0]] | dec_table[1][in[1]]
+           | dec_table[2][in[2]] | dec_table[3][in[3]]);
+      b = (dec_table[0][in[4]] | dec_table[1][in[5]]
+           | dec_table[2][in[6]] | dec_table[3][in[7]]);
+      if (((a | b) & 0xff000000))
+        break;
+      out[0] = a >> 16;
+      out[1] = a >> 8;
+      out[2] = a;
+      out[3] = b >> 16;
+      out[4] = b >> 8;
+      out[5] = b;
+    }
+  if (inlen >= 4)
+    {
+      a = (dec_table[0][in[0]] | dec_table[1][in[1]]
+           | dec_table[2][in[2]] | dec_table[3][in[3]]);
+      if (!(a & 0xff000000))
+        {
+          out[0] = a >> 16;
+          out[1] = a >> 8;
+          out[2] = a;
+          in += 4;
+        }
+    }
+
+  return in - start;
+}
@@ -0,0 +1,46 @@
+/* radix64.h - Block oriented radix-64 codec
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GNUPG_COMMON_RADIX64_H
+#define GNUPG_COMMON_RADIX64_H
+
+/* Encode the NGROUPS groups of 3 bytes at IN into the 4*NGROUPS
+   radix-64 characters at OUT.  No terminating Nul is written.  */
+void radix64_encode_groups (char *out, const unsigned char *in,
+                            size_t ngroups);
+
+/* Decode the longest prefix of the INLEN characters at IN which
+   consists of complete groups of 4 radix-64 characters without
+   padding.  The decoded bytes are stored at OUT, which may be the
+   same as IN.  Returns the number of characters consumed; 3/4 of
+   this number of bytes have been stored.  */
+size_t radix64_decode_groups (unsigned char *out, const unsigned char *in,
+                              size_t inlen);
+
+#endif /*GNUPG_COMMON_RADIX64_H*/
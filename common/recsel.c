@@ -33,6 +33,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <ctype.h>
 
 #include "util.h"
 #include "recsel.h"
@@ -65,7 +66,11 @@ struct recsel_expr_s
   unsigned int disjun:1;/* Start of a disjunction.  */
   unsigned int xcase:1; /* String match is case sensitive.  */
   const char *value;    /* (Points into NAME.)  */
+  size_t valuelen;      /* strlen of VALUE.  */
   long numvalue;        /* strtol of VALUE.  */
+  unsigned char *pattern; /* For SELECT_SUB the VALUE; uppercased
+                           * unless XCASE is set.  */
+  size_t *skip;         /* For SELECT_SUB the Horspool shift table.  */
   char name[1];         /* Name of the property.  */
 };
 
@@ -85,34 +90,79 @@ my_error (gpg_err_code_t ec)
 }
 
 
-/* This is a case-sensitive version of our memistr.  I wonder why no
- * standard function memstr exists but I better do not use the name
- * memstr to avoid future conflicts.
- *
- * FIXME: Move this to a stringhelp.c
- */
-static const char *
-my_memstr (const void *buffer, size_t buflen, const char *sub)
+/* Prepare the expression SE for recsel_select.  Because a selector
+ * is usually applied to a large number of records everything which
+ * depends only on the expression is done here: For a substring match
+ * the value is case-folded once and a shift table for the
+ * Boyer-Moore-Horspool algorithm is built.  */
+static gpg_error_t
+compile_expr (recsel_expr_t se)
 {
-  const unsigned char *buf = buffer;
-  const unsigned char *t = (const unsigned char *)buf;
-  const unsigned char *s = (const unsigned char *)sub;
-  size_t n = buflen;
+  const unsigned char *v = (const unsigned char *)se->value;
+  size_t n, m;
 
-  for ( ; n ; t++, n-- )
-    {
-      if (*t == *s)
+  se->valuelen = strlen (se->value);
+  se->numvalue = strtol (se->value, NULL, 0);
+  if (se->op != SELECT_SUB)
+    return 0;
+
+  m = se->valuelen;
+  se->pattern = xtrymalloc (m + 1);
+  if (!se->pattern)
+    return my_error_from_syserror ();
+  for (n=0; n < m; n++)
+    se->pattern[n] = se->xcase? v[n] : toupper (v[n]);
+  se->pattern[m] = 0;
+
+  se->skip = xtrymalloc (256 * sizeof *se->skip);
+  if (!se->skip)
+    return my_error_from_syserror ();
+  for (n=0; n < 256; n++)
+    se->skip[n] = m;
+  for (n=0; n + 1 < m; n++)
+    se->skip[se->pattern[n]] = m - 1 - n;
+
+  return 0;
+}
+
+
+/* Return true if the compiled substring of SE is found in the
+ * BUFFER of length BUFLEN.  This is a Boyer-Moore-Horspool search;
+ * unless XCASE is set the buffer is uppercased on the fly as done by
+ * memistr.  */
+static int
+match_sub (recsel_expr_t se, const void *buffer, size_t buflen)
+{
+  const unsigned char *buf = buffer;
+  const unsigned char *pat = se->pattern;
+  size_t m = se->valuelen;
+  size_t pos, i;
+  int c;
+
+  if (!m)
+    return 1;
+  if (m > buflen)
+    return 0;
+
+  for (pos = 0; pos <= buflen - m; pos += se->skip[c])
+    {
+      c = se->xcase? buf[pos + m - 1] : toupper (buf[pos + m - 1]);
+      if (c != pat[m - 1])
+        continue;
+      if (se->xcase)
         {
-          for (buf = t++, buflen = n--, s++; n && *t ==*s; t++, s++, n--)
+          if (!memcmp (buf + pos, pat, m - 1))
+            return 1;
+        }
+      else
+        {
+          for (i = 0; i + 1 < m && toupper (buf[pos + i]) == pat[i]; i++)
             ;
-          if (!*s)
-            return (const char*)buf;
-          t = (const unsigned char *)buf;
-          s = (const unsigned char *)sub ;
-          n = buflen;
-	}
-    }
-  return NULL;
+          if (i + 1 >= m)
+            return 1;
+        }
+    }
+  return 0;
 }
 
 
@@ -196,6 +246,7 @@ find_next_lc (char *string)
 gpg_error_t
 recsel_parse_expr (recsel_expr_t *selector, const char *expression)
 {
+  gpg_error_t err;
   recsel_expr_t se_head = NULL;
   recsel_expr_t se, se2;
   char *expr_buffer;
@@ -252,6 +303,8 @@ recsel_parse_expr (recsel_expr_t *selector, const char *expression)
     return my_error_from_syserror ();
   strcpy (se->name, expr);
   se->next = NULL;
+  se->pattern = NULL;
+  se->skip = NULL;
   se->not = 0;
   se->disjun = disjun;
   se->xcase = xcase;
@@ -435,7 +488,13 @@ recsel_parse_expr (recsel_expr_t *selector, const char *expression)
       return my_error (GPG_ERR_MISSING_VALUE);
     }
 
-  se->numvalue = strtol (se->value, NULL, 0);
+  err = compile_expr (se);
+  if (err)
+    {
+      recsel_release (se_head);
+      xfree (expr_buffer);
+      return err;
+    }
 
   if (next_lc)
     {
@@ -465,6 +524,8 @@ recsel_release (recsel_expr_t a)
   while (a)
     {
       recsel_expr_t tmp = a->next;
+      xfree (a->pattern);
+      xfree (a->skip);
       xfree (a);
       a = tmp;
     }
@@ -514,7 +575,7 @@ recsel_select (recsel_expr_t selector,
   recsel_expr_t se;
   const char *value;
   size_t selen, valuelen;
-  long numvalue;
+  long numvalue = 0;
   int result = 1;
 
   se = selector;
@@ -532,8 +593,20 @@ recsel_select (recsel_expr_t selector,
       else /* Field has a value.  */
         {
           valuelen = strlen (value);
-          numvalue = strtol (value, NULL, 0);
-          selen = strlen (se->value);
+          switch (se->op)
+            {
+            case SELECT_ISTRUE:
+            case SELECT_EQ:
+            case SELECT_GT:
+            case SELECT_GE:
+            case SELECT_LT:
+            case SELECT_LE:
+              numvalue = strtol (value, NULL, 0);
+              break;
+            default:
+              break;
+            }
+          selen = se->valuelen;
 
           switch (se->op)
             {
@@ -544,10 +617,7 @@ recsel_select (recsel_expr_t selector,
                 result = (valuelen==selen && !memicmp (value,se->value,selen));
               break;
             case SELECT_SUB:
-              if (se->xcase)
-                result = !!my_memstr (value, valuelen, se->value);
-              else
-                result = !!memistr (value, valuelen, se->value);
+              result = match_sub (se, value, valuelen);
               break;
             case SELECT_NONEMPTY:
               result = !!valuelen;
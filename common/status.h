@@ -84,6 +84,7 @@ enum
     STATUS_END_DECRYPTION,
     STATUS_BEGIN_ENCRYPTION,
     STATUS_END_ENCRYPTION,
+    STATUS_COMPRESSION_SKIPPED,
     STATUS_BEGIN_SIGNING,
 
     STATUS_DELETE_PROBLEM,
@@ -1302,6 +1302,88 @@ gnupg_inotify_has_name (int fd, const char *name)
 }
 
 
+/* Store a new inotify file handle for the directory DIRNAME at R_FD
+ * or return an error code.  The handle reports files created,
+ * deleted, or renamed in that directory as well as the removal of the
+ * directory itself.  */
+gpg_error_t
+gnupg_inotify_watch_dir (int *r_fd, const char *dirname)
+{
+#if HAVE_INOTIFY_INIT
+  gpg_error_t err;
+  int fd;
+
+  *r_fd = -1;
+
+  if (!dirname)
+    return my_error (GPG_ERR_INV_VALUE);
+
+  fd = inotify_init ();
+  if (fd == -1)
+    return my_error_from_syserror ();
+
+  if (inotify_add_watch (fd, dirname,
+                         (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO
+                          |IN_CLOSE_WRITE|IN_DELETE_SELF|IN_MOVE_SELF
+                          |IN_EXCL_UNLINK)) == -1)
+    {
+      err = my_error_from_syserror ();
+      close (fd);
+      return err;
+    }
+
+  *r_fd = fd;
+  return 0;
+#else /*!HAVE_INOTIFY_INIT*/
+
+  (void)dirname;
+  *r_fd = -1;
+  return my_error (GPG_ERR_NOT_SUPPORTED);
+
+#endif /*!HAVE_INOTIFY_INIT*/
+}
+
+
+/* Read all pending events from the inotify handle FD as created by
+ * gnupg_inotify_watch_dir.  Returns 0 if only files in the directory
+ * changed, 2 if the directory was removed or renamed, and 3 if it was
+ * unmounted.  In the latter cases the watch has become useless.  */
+int
+gnupg_inotify_read_events (int fd)
+{
+#if USE_NPTH && HAVE_INOTIFY_INIT
+  union {
+    struct inotify_event ev;
+    char _buf[16 * (sizeof (struct inotify_event) + 255 + 1)];
+  } buf;
+  struct inotify_event *evp;
+  int n;
+  int result = 0;
+
+  n = npth_read (fd, &buf, sizeof buf);
+  evp = &buf.ev;
+  while (n >= sizeof (struct inotify_event))
+    {
+      if ((evp->mask & IN_UNMOUNT))
+        result = 3;
+      else if ((evp->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED))
+               && !result)
+        result = 2;
+      n -= sizeof (*evp) + evp->len;
+      evp = (struct inotify_event *)(void *)
+        ((char *)evp + sizeof (*evp) + evp->len);
+    }
+  return result;
+
+#else /*!(USE_NPTH && HAVE_INOTIFY_INIT)*/
+
+  (void)fd;
+  return 0;
+
+#endif  /*!(USE_NPTH && HAVE_INOTIFY_INIT)*/
+}
+
+
 /* Return a malloc'ed string that is the path to the passed
  * unix-domain socket (or return NULL if this is not a valid
  * unix-domain socket).  We use a plain int here because it is only
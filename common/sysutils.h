@@ -79,6 +79,8 @@ int gnupg_fd_valid (int fd);
 gpg_error_t gnupg_inotify_watch_delete_self (int *r_fd, const char *fname);
 gpg_error_t gnupg_inotify_watch_socket (int *r_fd, const char *socket_name);
 int gnupg_inotify_has_name (int fd, const char *name);
+gpg_error_t gnupg_inotify_watch_dir (int *r_fd, const char *dirname);
+int gnupg_inotify_read_events (int fd);
 
 
 #ifdef HAVE_W32_SYSTEM
@@ -428,6 +428,56 @@ run_modification_tests (void)
 }
 
 
+/* Check a value spanning many lines and an entry at the end of the
+   file without a final LF.  */
+void
+run_long_value_test (void)
+{
+  gpg_error_t err;
+  estream_t source;
+  nvc_t pk;
+  nve_t e;
+  char *buf, *p;
+  const char *value;
+  size_t len;
+  int i;
+
+  len = 8 + 500 * 32 + 32;
+  buf = xmalloc (len);
+  p = stpcpy (buf, "Long: x\n");
+  for (i = 0; i < 500; i++)
+    p = stpcpy (p, "  abcdefghijklmnopqrstuvwxyz01\n");
+  p = stpcpy (p, "Last: value");
+
+  source = es_mopen (buf, strlen (buf), strlen (buf),
+                     0, dummy_realloc, dummy_free, "r");
+  assert (source);
+  if (private_key_mode)
+    err = nvc_parse_private_key (&pk, NULL, source);
+  else
+    err = nvc_parse (&pk, NULL, source);
+  assert (err == 0);
+  es_fclose (source);
+
+  e = nvc_lookup (pk, "Long:");
+  assert (e);
+  value = nve_value (e);
+  assert (value);
+  assert (strlen (value) == 1 + 500 * 29);
+  assert (!strncmp (value, "x abcdefghijklmnopqrstuvwxyz01 ", 31));
+
+  e = nvc_lookup (pk, "Last:");
+  assert (e);
+  assert (!strcmp (nve_value (e), "value"));
+
+  p = nvc_to_string (pk);
+  assert (!strcmp (p, buf));
+  xfree (p);
+  nvc_release (pk);
+  xfree (buf);
+}
+
+
 void
 convert (const char *fname)
 {
@@ -595,9 +645,11 @@ main (int argc, char **argv)
     case TEST:
       run_tests ();
       run_modification_tests ();
+      run_long_value_test ();
       private_key_mode = 1;
       run_tests ();
       run_modification_tests ();
+      run_long_value_test ();
       break;
 
     case CONVERT:
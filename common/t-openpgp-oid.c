@@ -155,6 +155,43 @@ test_openpgp_oid_to_str (void)
 }
 
 
+/* Check that the binary lookup agrees with the string lookup.  */
+static void
+test_openpgp_oidbuf_to_curve (void)
+{
+  static const char *names[] = {
+    "Curve25519", "Ed25519", "NIST P-256", "NIST P-384", "NIST P-521",
+    "brainpoolP256r1", "brainpoolP384r1", "brainpoolP512r1", "secp256k1",
+    NULL };
+  gpg_error_t err;
+  gcry_mpi_t a;
+  const char *oidstr;
+  int idx, canon;
+
+  for (idx=0; names[idx]; idx++)
+    {
+      oidstr = openpgp_curve_to_oid (names[idx], NULL, NULL);
+      if (!oidstr)
+        fail (idx, 0);
+      err = openpgp_oid_from_str (oidstr, &a);
+      if (err)
+        fail (idx, err);
+      for (canon=0; canon < 2; canon++)
+        if (openpgp_oidmpi_to_curve (a, canon)
+            != openpgp_oid_to_curve (oidstr, canon))
+          fail (idx, 0);
+      gcry_mpi_release (a);
+    }
+
+  err = openpgp_oid_from_str ("1.3.132.0.36", &a);
+  if (err)
+    fail (idx, err);
+  if (openpgp_oidmpi_to_curve (a, 0))
+    fail (idx, 0);
+  gcry_mpi_release (a);
+}
+
+
 static void
 test_openpgp_oid_is_ed25519 (void)
 {
@@ -307,6 +344,7 @@ main (int argc, char **argv)
 
   test_openpgp_oid_from_str ();
   test_openpgp_oid_to_str ();
+  test_openpgp_oidbuf_to_curve ();
   test_openpgp_oid_is_ed25519 ();
   test_openpgp_enum_curves ();
   test_get_keyalgo_string ();
@@ -307,6 +307,51 @@ test_percent_data_escape_plus (void)
 }
 
 
+/* Test long data so that the word wise scanning of plain runs is
+ * used with escape characters at all offsets.  */
+static void
+test_percent_data_escape_long (void)
+{
+  static const char specials[] = { 0, '%', '+', ' ', '\n', 'a' };
+  unsigned char data[100];
+  char *buf, *p;
+  size_t len, n, expect;
+  int plus, pos, i;
+
+  for (plus=0; plus < 2; plus++)
+    for (pos=0; pos < sizeof data; pos++)
+      for (i=0; i < sizeof specials; i++)
+        {
+          memset (data, 'x', sizeof data);
+          data[pos] = specials[i];
+          data[sizeof data - 1 - pos/2] = specials[(i+1) % sizeof specials];
+          buf = percent_data_escape (plus, NULL, data, sizeof data);
+          if (!buf)
+            {
+              fprintf (stderr, "out of core: %s\n", strerror (errno));
+              exit (2);
+            }
+          /* Compute the expected length byte by byte.  */
+          for (expect=n=0; n < sizeof data; n++)
+            if (!data[n] || data[n] == '%'
+                || (plus && (data[n] < ' ' || data[n] == '+')))
+              expect += 3;
+            else
+              expect++;
+          if (strlen (buf) != expect)
+            fail (pos);
+          for (p=buf; *p; p++)
+            if (plus && (*p == ' ' || *p == '\n'))
+              fail (pos);
+          len = plus? percent_plus_unescape_inplace (buf, 0)
+            /**/  : percent_unescape_inplace (buf, 0);
+          if (len != sizeof data || memcmp (buf, data, sizeof data))
+            fail (pos);
+          xfree (buf);
+        }
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -317,5 +362,6 @@ main (int argc, char **argv)
   test_percent_plus_escape ();
   test_percent_data_escape ();
   test_percent_data_escape_plus ();
+  test_percent_data_escape_long ();
   return 0;
 }
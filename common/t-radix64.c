@@ -0,0 +1,139 @@
+/* t-radix64.c - Module tests for radix64.c
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "radix64.h"
+#include "t-support.h"
+
+#define PGM "t-radix64"
+
+
+static void
+test_encode (void)
+{
+  static struct {
+    const char *data;
+    const char *expected;
+  } tests[] = {
+    /* From RFC-4648.  */
+    { "foo", "Zm9v" },
+    { "foobar", "Zm9vYmFy" },
+    { "foobarfoo", "Zm9vYmFyZm9v" },
+    { "\xff\xfe\xfd\x01\x02\x03", "//79AQID" }
+  };
+  int tidx;
+  char output[64];
+  size_t n;
+
+  for (tidx = 0; tidx < DIM(tests); tidx++)
+    {
+      n = strlen (tests[tidx].data);
+      radix64_encode_groups (output, (const unsigned char *)tests[tidx].data,
+                             n / 3);
+      output[n / 3 * 4] = 0;
+      if (strcmp (output, tests[tidx].expected))
+        fail (tidx);
+    }
+}
+
+
+static void
+test_decode (void)
+{
+  static struct {
+    const char *data;
+    size_t used;
+    const char *expected;
+  } tests[] = {
+    { "Zm9v", 4, "foo" },
+    { "Zm9vYmFy", 8, "foobar" },
+    { "Zm9vYmFyZm9v", 12, "foobarfoo" },
+    { "Zm9vYmF", 4, "foo" },
+    { "Zm9vYmFyZm9\n", 8, "foobar" },
+    { "Zm9vYm==", 4, "foo" },
+    { "Zm9vYm-yZm9v", 4, "foo" },
+    { "\nZm9v", 0, "" },
+    { "", 0, "" }
+  };
+  int tidx;
+  unsigned char output[64];
+  size_t used;
+
+  for (tidx = 0; tidx < DIM(tests); tidx++)
+    {
+      used = radix64_decode_groups (output,
+                                    (const unsigned char *)tests[tidx].data,
+                                    strlen (tests[tidx].data));
+      if (used != tests[tidx].used
+          || memcmp (output, tests[tidx].expected, used / 4 * 3))
+        fail (tidx);
+    }
+}
+
+
+/* Check that encoding and in-place decoding are inverse for all
+   lengths.  */
+static void
+test_roundtrip (void)
+{
+  unsigned char data[300];
+  unsigned char buffer[400];
+  size_t ngroups, used;
+  int i;
+
+  for (i=0; i < DIM (data); i++)
+    data[i] = (i * 151 + 17) & 0xff;
+
+  for (ngroups = 0; ngroups <= DIM (data) / 3; ngroups++)
+    {
+      radix64_encode_groups ((char *)buffer, data, ngroups);
+      used = radix64_decode_groups (buffer, buffer, ngroups * 4);
+      if (used != ngroups * 4 || memcmp (buffer, data, ngroups * 3))
+        fail ((int)ngroups);
+    }
+}
+
+
+int
+main (int argc, char **argv)
+{
+  (void)argc;
+  (void)argv;
+
+  test_encode ();
+  test_decode ();
+  test_roundtrip ();
+
+  return !!errcount;
+}
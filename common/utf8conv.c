@@ -38,6 +38,7 @@
 #include <langinfo.h>
 #endif
 #include <errno.h>
+#include <stdint.h>
 
 #if HAVE_W32_SYSTEM
 # /* Tell libgpg-error to provide the iconv macros.  */
@@ -310,6 +311,106 @@ is_native_utf8 (void)
 }
 
 
+/* Helpers to check 8 bytes at once.  HASZERO is true if one byte of
+   X is zero; HASLESS is true if one byte is less than N, provided
+   that no byte of X has its high bit set.  */
+#define ONES_64  0x0101010101010101ULL
+#define HIGHS_64 0x8080808080808080ULL
+#define HASZERO_64(x)   (((x) - ONES_64) & ~(x) & HIGHS_64)
+#define HASLESS_64(x,n) (((x) - ONES_64 * (n)) & ~(x) & HIGHS_64)
+
+
+/* Return true if the 8 bytes in X are ASCII characters which
+   utf8_to_native does not quote for DELIM.  */
+static inline int
+plain_word_p (uint64_t x, int delim)
+{
+  if ((x & HIGHS_64))
+    return 0;
+  if (delim == -1)
+    return 1;
+  if (HASLESS_64 (x, 0x20) || HASZERO_64 (x ^ (ONES_64 * 0x7f)))
+    return 0;
+  if (delim
+      && (HASZERO_64 (x ^ (ONES_64 * (unsigned char)delim))
+          || HASZERO_64 (x ^ (ONES_64 * '\\'))))
+    return 0;
+  return 1;
+}
+
+
+/* Return true if the LENGTH bytes at STRING would be returned
+   unchanged by utf8_to_native with DELIM.  This is the case for
+   ASCII characters which need no quoting and, if the native charset
+   is utf-8, also for valid utf-8 sequences.  The common case of
+   plain ASCII is checked 8 bytes at a time.  */
+static int
+utf8_unchanged_p (const unsigned char *s, size_t length, int delim)
+{
+  uint64_t x;
+  size_t n, i;
+
+  while (length)
+    {
+      if (length >= 8)
+        {
+          memcpy (&x, s, 8);
+          if (plain_word_p (x, delim))
+            {
+              s += 8;
+              length -= 8;
+              continue;
+            }
+        }
+      if (*s < 0x80)
+        {
+          if (delim != -1
+              && (*s < 0x20 || *s == 0x7f || *s == delim
+                  || (delim && *s == '\\')))
+            return 0;
+          s++;
+          length--;
+          continue;
+        }
+      if (!no_translation)
+        return 0;
+
+      /* Check the utf-8 sequence the same way as do_utf8_to_native.  */
+      if ((*s & 0xe0) == 0xc0)
+        n = 1;
+      else if ((*s & 0xf0) == 0xe0)
+        n = 2;
+      else if ((*s & 0xf8) == 0xf0)
+        n = 3;
+      else if ((*s & 0xfc) == 0xf8)
+        n = 4;
+      else if ((*s & 0xfe) == 0xfc)
+        n = 5;
+      else
+        return 0;
+      if (length <= n)
+        return 0;  /* Truncated sequence.  */
+      for (i=1; i <= n; i++)
+        if ((s[i] & 0xc0) != 0x80)
+          return 0;
+      s += n + 1;
+      length -= n + 1;
+    }
+  return 1;
+}
+
+
+/* Return true if the string S consists only of ASCII characters.  */
+static int
+ascii_string_p (const unsigned char *s)
+{
+  for (; *s; s++)
+    if ((*s & 0x80))
+      return 0;
+  return 1;
+}
+
+
 /* Convert string, which is in native encoding to UTF8 and return a
    new allocated UTF-8 string.  This function terminates the process
    on memory shortage.  */
@@ -322,9 +423,10 @@ native_to_utf8 (const char *orig_string)
   unsigned char *p;
   size_t length = 0;
 
-  if (no_translation)
+  if (no_translation || ascii_string_p (string))
     {
-      /* Already utf-8 encoded. */
+      /* Already utf-8 encoded or plain ASCII which is the same in
+         all supported charsets.  */
       buffer = xstrdup (orig_string);
     }
   else if (!use_iconv)
@@ -685,6 +787,35 @@ do_utf8_to_native (const char *string, size_t length, int delim,
 char *
 utf8_to_native (const char *string, size_t length, int delim)
 {
+  char *buffer;
+
+  if (utf8_unchanged_p ((const unsigned char *)string, length, delim))
+    {
+      buffer = xmalloc (length + 1);
+      memcpy (buffer, string, length);
+      buffer[length] = 0;
+      return buffer;
+    }
+  return do_utf8_to_native (string, length, delim, use_iconv);
+}
+
+
+/* This is a variant of utf8_to_native which stores the result in
+   the caller supplied BUFFER of BUFSIZE bytes if no conversion is
+   required and the result fits.  BUFFER is then returned.  Otherwise
+   a newly allocated string is returned; the caller must thus release
+   the result if it is not BUFFER.  */
+char *
+utf8_to_native_buf (const char *string, size_t length, int delim,
+                    char *buffer, size_t bufsize)
+{
+  if (length < bufsize
+      && utf8_unchanged_p ((const unsigned char *)string, length, delim))
+    {
+      memcpy (buffer, string, length);
+      buffer[length] = 0;
+      return buffer;
+    }
   return do_utf8_to_native (string, length, delim, use_iconv);
 }
 
@@ -37,6 +37,8 @@ int is_native_utf8 (void);
 
 char *native_to_utf8 (const char *string);
 char *utf8_to_native (const char *string, size_t length, int delim);
+char *utf8_to_native_buf (const char *string, size_t length, int delim,
+                          char *buffer, size_t bufsize);
 
 
 /* Silly wrappers, required for W32 portability.  */
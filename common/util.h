@@ -234,6 +234,8 @@ int openpgp_oid_is_cv25519 (gcry_mpi_t a);
 const char *openpgp_curve_to_oid (const char *name,
                                   unsigned int *r_nbits, int *r_algo);
 const char *openpgp_oid_to_curve (const char *oid, int canon);
+const char *openpgp_oidbuf_to_curve (const void *buf, size_t len, int canon);
+const char *openpgp_oidmpi_to_curve (gcry_mpi_t a, int canon);
 const char *openpgp_oid_or_name_to_curve (const char *oidname, int canon);
 const char *openpgp_enum_curves (int *idxp);
 const char *openpgp_is_curve_supported (const char *name,
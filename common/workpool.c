@@ -0,0 +1,248 @@
+/* workpool.c - A pool of worker threads
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The daemons used to start a new thread for each accepted
+ * connection.  A pool limits the number of threads: jobs are queued
+ * by priority and run by up to MAX_THREADS threads which are started
+ * on demand and then reused.  If the queue is full new jobs are
+ * rejected so that the caller can close the connection instead of
+ * piling up work.  A pool lives as long as the process.  */
+
+#include <config.h>
+
+#include <errno.h>
+#include <sys/types.h>
+#include <npth.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+#include "logging.h"
+#include "workpool.h"
+
+
+/* A queued job.  */
+struct workpool_job_s
+{
+  struct workpool_job_s *next;
+  void *(*func) (void *arg);
+  void *arg;
+  struct timespec queued;     /* Time the job was queued.  */
+};
+typedef struct workpool_job_s *workpool_job_t;
+
+
+/* The object describing a pool.  */
+struct workpool_s
+{
+  char *name;                 /* Name used for diagnostics.  */
+  npth_mutex_t lock;
+  npth_cond_t cond;
+  npth_attr_t tattr;
+  workpool_job_t head[WORKPOOL_PRIORITIES];
+  workpool_job_t *tail[WORKPOOL_PRIORITIES];
+  unsigned int max_threads;   /* Maximum number of threads.  */
+  unsigned int max_queued;    /* Maximum number of queued jobs.  */
+  unsigned int nthreads;      /* Number of threads.  */
+  unsigned int nidle;         /* Number of idle threads.  */
+  unsigned int queued;        /* Number of queued jobs.  */
+  unsigned int peak_queued;   /* Peak number of queued jobs.  */
+  unsigned long served;       /* Number of dequeued jobs.  */
+  unsigned long rejected;     /* Number of rejected jobs.  */
+  unsigned long wait_ms;      /* Total time spent in the queue.  */
+  unsigned long max_wait_ms;  /* Longest time spent in the queue.  */
+};
+
+
+
+/* Create a new pool named NAME with up to MAX_THREADS threads and
+ * store it at R_POOL.  If MAX_QUEUED is not 0 jobs are rejected once
+ * that many are waiting; with 0 a limit based on MAX_THREADS is
+ * used.  */
+gpg_error_t
+workpool_new (workpool_t *r_pool, const char *name,
+              unsigned int max_threads, unsigned int max_queued)
+{
+  gpg_error_t err;
+  workpool_t pool;
+  int i, ret;
+
+  *r_pool = NULL;
+  if (!max_threads)
+    return gpg_error (GPG_ERR_INV_VALUE);
+
+  pool = xtrycalloc (1, sizeof *pool);
+  if (!pool)
+    return gpg_error_from_syserror ();
+  pool->name = xtrystrdup (name? name : "workpool");
+  if (!pool->name)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (pool);
+      return err;
+    }
+  pool->max_threads = max_threads;
+  pool->max_queued = max_queued? max_queued
+                               : max_threads * WORKPOOL_QUEUE_FACTOR;
+  for (i=0; i < WORKPOOL_PRIORITIES; i++)
+    pool->tail[i] = &pool->head[i];
+
+  ret = npth_mutex_init (&pool->lock, NULL);
+  if (!ret)
+    ret = npth_cond_init (&pool->cond, NULL);
+  if (!ret)
+    ret = npth_attr_init (&pool->tattr);
+  if (ret)
+    {
+      err = gpg_error_from_errno (ret);
+      log_error ("error initializing pool '%s': %s\n",
+                 pool->name, gpg_strerror (err));
+      xfree (pool->name);
+      xfree (pool);
+      return err;
+    }
+  npth_attr_setdetachstate (&pool->tattr, NPTH_CREATE_DETACHED);
+
+  *r_pool = pool;
+  return 0;
+}
+
+
+/* The main function of a pool thread.  */
+static void *
+workpool_thread (void *arg)
+{
+  workpool_t pool = arg;
+  workpool_job_t job;
+  struct timespec now;
+  unsigned long ms;
+  int prio;
+
+  for (;;)
+    {
+      npth_mutex_lock (&pool->lock);
+      for (;;)
+        {
+          for (prio=0; prio < WORKPOOL_PRIORITIES; prio++)
+            if (pool->head[prio])
+              break;
+          if (prio < WORKPOOL_PRIORITIES)
+            break;
+          pool->nidle++;
+          npth_cond_wait (&pool->cond, &pool->lock);
+          pool->nidle--;
+        }
+      job = pool->head[prio];
+      pool->head[prio] = job->next;
+      if (!pool->head[prio])
+        pool->tail[prio] = &pool->head[prio];
+      pool->queued--;
+      pool->served++;
+      npth_clock_gettime (&now);
+      ms = ((now.tv_sec - job->queued.tv_sec) * 1000
+            + (now.tv_nsec - job->queued.tv_nsec) / 1000000);
+      pool->wait_ms += ms;
+      if (ms > pool->max_wait_ms)
+        pool->max_wait_ms = ms;
+      npth_mutex_unlock (&pool->lock);
+
+      job->func (job->arg);
+      xfree (job);
+    }
+
+  return NULL; /*NOTREACHED*/
+}
+
+
+/* Queue FUNC with argument ARG for execution by a thread of POOL.
+ * PRIO is the priority of the job; 0 is the highest.  A new thread
+ * is started if no thread is idle and the limit has not yet been
+ * reached.  Returns GPG_ERR_EAGAIN if the queue is full.  On error
+ * the caller still owns ARG.  */
+gpg_error_t
+workpool_submit (workpool_t pool, void *(*func) (void *arg), void *arg,
+                 int prio)
+{
+  gpg_error_t err;
+  workpool_job_t job;
+  npth_t thread;
+  int ret;
+
+  if (prio < 0)
+    prio = 0;
+  else if (prio >= WORKPOOL_PRIORITIES)
+    prio = WORKPOOL_PRIORITIES - 1;
+
+  job = xtrycalloc (1, sizeof *job);
+  if (!job)
+    return gpg_error_from_syserror ();
+  job->func = func;
+  job->arg = arg;
+  npth_clock_gettime (&job->queued);
+
+  npth_mutex_lock (&pool->lock);
+  if (pool->queued >= pool->max_queued)
+    {
+      pool->rejected++;
+      npth_mutex_unlock (&pool->lock);
+      xfree (job);
+      return gpg_error (GPG_ERR_EAGAIN);
+    }
+  if (pool->nidle <= pool->queued && pool->nthreads < pool->max_threads)
+    {
+      ret = npth_create (&thread, &pool->tattr, workpool_thread, pool);
+      if (ret && !pool->nthreads)
+        {
+          err = gpg_error_from_errno (ret);
+          npth_mutex_unlock (&pool->lock);
+          xfree (job);
+          return err;
+        }
+      else if (ret)
+        log_error ("error spawning a thread for pool '%s': %s\n",
+                   pool->name, strerror (ret));
+      else
+        pool->nthreads++;
+    }
+  *pool->tail[prio] = job;
+  pool->tail[prio] = &job->next;
+  pool->queued++;
+  if (pool->queued > pool->peak_queued)
+    pool->peak_queued = pool->queued;
+  npth_cond_signal (&pool->cond);
+  npth_mutex_unlock (&pool->lock);
+  return 0;
+}
+
+
+/* Return a malloced string with the statistics of POOL or NULL on a
+ * memory error.  */
+char *
+workpool_stats (workpool_t pool)
+{
+  return xtryasprintf ("max_threads=%u threads=%u idle=%u queued=%u"
+                       " max_queued=%u peak_queued=%u served=%lu"
+                       " rejected=%lu wait_ms=%lu max_wait_ms=%lu",
+                       pool->max_threads, pool->nthreads, pool->nidle,
+                       pool->queued, pool->max_queued, pool->peak_queued,
+                       pool->served, pool->rejected,
+                       pool->wait_ms, pool->max_wait_ms);
+}
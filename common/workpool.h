@@ -0,0 +1,50 @@
+/* workpool.h - Definitions for a pool of worker threads
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GNUPG_COMMON_WORKPOOL_H
+#define GNUPG_COMMON_WORKPOOL_H
+
+#include <gpg-error.h>
+
+/* The number of priorities supported by a pool.  0 is the highest
+ * priority.  */
+#define WORKPOOL_PRIORITIES 3
+
+/* The number of queued jobs allowed for each thread of a pool if no
+ * explicit limit is given.  */
+#define WORKPOOL_QUEUE_FACTOR 16
+
+struct workpool_s;
+typedef struct workpool_s *workpool_t;
+
+/* Create a new pool with up to MAX_THREADS threads.  If MAX_QUEUED
+ * is not 0, workpool_submit rejects jobs once that many are waiting;
+ * with 0, MAX_THREADS * WORKPOOL_QUEUE_FACTOR is used.  */
+gpg_error_t workpool_new (workpool_t *r_pool, const char *name,
+                          unsigned int max_threads, unsigned int max_queued);
+
+/* Run FUNC with ARG in one of the threads of POOL.  */
+gpg_error_t workpool_submit (workpool_t pool, void *(*func) (void *arg),
+                             void *arg, int prio);
+
+/* Return a malloced string with statistics of POOL.  */
+char *workpool_stats (workpool_t pool);
+
+
+#endif /*GNUPG_COMMON_WORKPOOL_H*/
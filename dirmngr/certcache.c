@@ -30,11 +30,17 @@
 #include "dirmngr.h"
 #include "misc.h"
 #include "../common/ksba-io-support.h"
+#include "../common/tlv.h"
+#include "../common/membuf.h"
 #include "crlfetch.h"
 #include "certcache.h"
 
 #define MAX_NONPERM_CACHED_CERTS 1000
 
+/* The number of slots of the secondary indices on the subject, the
+ * issuer+serial and the subjectKeyIdentifier.  Must be a power of 2.  */
+#define CERT_INDEX_SIZE 1024
+
 /* Constants used to classify search patterns.  */
 enum pattern_class
   {
@@ -60,12 +66,30 @@ enum pattern_class
 struct cert_item_s
 {
   struct cert_item_s *next; /* Next item with the same hash value. */
-  ksba_cert_t cert;         /* The KSBA cert object or NULL is this is
-                               not a valid item.  */
+  ksba_cert_t cert;         /* The KSBA cert object or NULL if this is
+                               not a valid item or not yet parsed.  */
+  unsigned char *image;     /* The malloced DER image of a lazily
+                               loaded certificate which has not yet
+                               been parsed or NULL.  */
+  size_t imagelen;          /* The length of IMAGE.  */
   unsigned char fpr[20];    /* The fingerprint of this object. */
   char *issuer_dn;          /* The malloced issuer DN.  */
   ksba_sexp_t sn;           /* The malloced serial number  */
   char *subject_dn;         /* The malloced subject DN - maybe NULL.  */
+  ksba_sexp_t ski;          /* The malloced subjectKeyIdentifier
+                               - maybe NULL.  */
+
+  /* Links and hash values for the secondary indices.  */
+  struct cert_item_s *next_subject;
+  struct cert_item_s *next_issuer;
+  struct cert_item_s *next_ski;
+  unsigned int subject_hash;
+  unsigned int issuer_hash;
+  unsigned int ski_hash;
+
+  /* If this field is set the item is linked into the secondary
+   * indices.  */
+  unsigned int indexed:1;
 
   /* If this field is set the certificate has been taken from some
    * configuration and shall not be flushed from the cache.  */
@@ -77,10 +101,20 @@ struct cert_item_s
 };
 typedef struct cert_item_s *cert_item_t;
 
+/* True if the cache item CI holds a certificate.  */
+#define ITEM_IN_USE(ci) ((ci)->cert || (ci)->image)
+
 /* The actual cert cache consisting of 256 slots for items indexed by
    the first byte of the fingerprint.  */
 static cert_item_t cert_cache[256];
 
+/* Secondary indices to speed up the lookup by subject DN, by issuer
+ * DN and serial number, and by subjectKeyIdentifier.  They only hold
+ * items with a valid certificate.  */
+static cert_item_t subject_index[CERT_INDEX_SIZE];
+static cert_item_t issuer_index[CERT_INDEX_SIZE];
+static cert_item_t ski_index[CERT_INDEX_SIZE];
+
 /* This is the global cache_lock variable. In general locking is not
    needed but it would take extra efforts to make sure that no
    indirect use of npth functions is done, so we simply lock it
@@ -195,6 +229,125 @@ hexsn_to_sexp (const char *hexsn)
 }
 
 
+/* Continue the FNV-1a hash H over the LENGTH bytes at BUFFER.  */
+static unsigned int
+hash_buffer (unsigned int h, const void *buffer, size_t length)
+{
+  const unsigned char *p = buffer;
+
+  for (; length; length--, p++)
+    {
+      h ^= *p;
+      h *= 16777619;
+    }
+  return h;
+}
+
+#define HASH_INIT 2166136261U
+
+
+/* Return the hash value for the DN string DN.  */
+static unsigned int
+hash_dn (const char *dn)
+{
+  return hash_buffer (HASH_INIT, dn, strlen (dn));
+}
+
+
+/* Return the hash value for the canonical S-expression SEXP.  H is
+ * the initial value.  */
+static unsigned int
+hash_sexp (unsigned int h, ksba_const_sexp_t sexp)
+{
+  return hash_buffer (h, sexp, gcry_sexp_canon_len (sexp, 0, NULL, NULL));
+}
+
+
+/* Return the hash value for ISSUER_DN and SERIALNO.  */
+static unsigned int
+hash_issuer_sn (const char *issuer_dn, ksba_const_sexp_t serialno)
+{
+  return hash_sexp (hash_dn (issuer_dn), serialno);
+}
+
+
+/* Add the valid item CI to the secondary indices.  The cache must be
+ * locked for writing.  */
+static void
+index_cache_slot (cert_item_t ci)
+{
+  unsigned int idx;
+
+  if (ci->subject_dn)
+    {
+      ci->subject_hash = hash_dn (ci->subject_dn);
+      idx = ci->subject_hash % CERT_INDEX_SIZE;
+      ci->next_subject = subject_index[idx];
+      subject_index[idx] = ci;
+    }
+
+  ci->issuer_hash = hash_issuer_sn (ci->issuer_dn, ci->sn);
+  idx = ci->issuer_hash % CERT_INDEX_SIZE;
+  ci->next_issuer = issuer_index[idx];
+  issuer_index[idx] = ci;
+
+  if (ci->ski)
+    {
+      ci->ski_hash = hash_sexp (HASH_INIT, ci->ski);
+      idx = ci->ski_hash % CERT_INDEX_SIZE;
+      ci->next_ski = ski_index[idx];
+      ski_index[idx] = ci;
+    }
+
+  ci->indexed = 1;
+}
+
+
+/* Remove the item CI from the secondary indices.  The cache must be
+ * locked for writing.  */
+static void
+unindex_cache_slot (cert_item_t ci)
+{
+  cert_item_t *pp;
+
+  if (!ci->indexed)
+    return;
+
+  if (ci->subject_dn)
+    {
+      for (pp = &subject_index[ci->subject_hash % CERT_INDEX_SIZE];
+           *pp; pp = &(*pp)->next_subject)
+        if (*pp == ci)
+          {
+            *pp = ci->next_subject;
+            break;
+          }
+    }
+
+  for (pp = &issuer_index[ci->issuer_hash % CERT_INDEX_SIZE];
+       *pp; pp = &(*pp)->next_issuer)
+    if (*pp == ci)
+      {
+        *pp = ci->next_issuer;
+        break;
+      }
+
+  if (ci->ski)
+    {
+      for (pp = &ski_index[ci->ski_hash % CERT_INDEX_SIZE];
+           *pp; pp = &(*pp)->next_ski)
+        if (*pp == ci)
+          {
+            *pp = ci->next_ski;
+            break;
+          }
+    }
+
+  ci->next_subject = ci->next_issuer = ci->next_ski = NULL;
+  ci->indexed = 0;
+}
+
+
 /* Compute the fingerprint of the certificate CERT and put it into
    the 20 bytes large buffer DIGEST.  Return address of this buffer.  */
 unsigned char *
@@ -231,15 +384,22 @@ clean_cache_slot (cert_item_t ci)
 {
   ksba_cert_t cert;
 
-  if (!ci->cert)
+  if (!ITEM_IN_USE (ci))
     return; /* Already cleaned.  */
 
+  unindex_cache_slot (ci);
+
   ksba_free (ci->sn);
   ci->sn = NULL;
   ksba_free (ci->issuer_dn);
   ci->issuer_dn = NULL;
   ksba_free (ci->subject_dn);
   ci->subject_dn = NULL;
+  ksba_free (ci->ski);
+  ci->ski = NULL;
+  xfree (ci->image);
+  ci->image = NULL;
+  ci->imagelen = 0;
   cert = ci->cert;
   ci->cert = NULL;
 
@@ -250,6 +410,36 @@ clean_cache_slot (cert_item_t ci)
 }
 
 
+/* Return an unused cache slot for a certificate with the fingerprint
+ * FPR at R_CI.  Returns GPG_ERR_DUP_VALUE if such a certificate is
+ * already cached.  The cache must be locked for writing.  */
+static gpg_error_t
+get_free_slot (const unsigned char *fpr, cert_item_t *r_ci)
+{
+  cert_item_t ci;
+
+  *r_ci = NULL;
+  for (ci=cert_cache[*fpr]; ci; ci = ci->next)
+    if (ITEM_IN_USE (ci) && !memcmp (ci->fpr, fpr, 20))
+      return gpg_error (GPG_ERR_DUP_VALUE);
+  /* Try to reuse an existing entry.  */
+  for (ci=cert_cache[*fpr]; ci; ci = ci->next)
+    if (!ITEM_IN_USE (ci))
+      break;
+  if (!ci)
+    { /* No: Create a new entry.  */
+      ci = xtrycalloc (1, sizeof *ci);
+      if (!ci)
+        return gpg_error_from_errno (errno);
+      ci->next = cert_cache[*fpr];
+      cert_cache[*fpr] = ci;
+    }
+
+  *r_ci = ci;
+  return 0;
+}
+
+
 /* Put the certificate CERT into the cache.  It is assumed that the
  * cache is locked while this function is called.
  *
@@ -267,6 +457,7 @@ static gpg_error_t
 put_cert (ksba_cert_t cert, int permanent, unsigned int trustclass,
           void *fpr_buffer)
 {
+  gpg_error_t err;
   unsigned char help_fpr_buffer[20], *fpr;
   cert_item_t ci;
 
@@ -300,7 +491,7 @@ put_cert (ksba_cert_t cert, int permanent, unsigned int trustclass,
         {
           ci_mark = NULL;
           for (ci = cert_cache[i]; ci; ci = ci->next)
-            if (ci->cert && !ci->permanent)
+            if (ITEM_IN_USE (ci) && !ci->permanent)
               ci_mark = ci;
           if (ci_mark)
             {
@@ -317,21 +508,9 @@ put_cert (ksba_cert_t cert, int permanent, unsigned int trustclass,
     }
 
   cert_compute_fpr (cert, fpr);
-  for (ci=cert_cache[*fpr]; ci; ci = ci->next)
-    if (ci->cert && !memcmp (ci->fpr, fpr, 20))
-      return gpg_error (GPG_ERR_DUP_VALUE);
-  /* Try to reuse an existing entry.  */
-  for (ci=cert_cache[*fpr]; ci; ci = ci->next)
-    if (!ci->cert)
-      break;
-  if (!ci)
-    { /* No: Create a new entry.  */
-      ci = xtrycalloc (1, sizeof *ci);
-      if (!ci)
-        return gpg_error_from_errno (errno);
-      ci->next = cert_cache[*fpr];
-      cert_cache[*fpr] = ci;
-    }
+  err = get_free_slot (fpr, &ci);
+  if (err)
+    return err;
 
   ksba_cert_ref (cert);
   ci->cert = cert;
@@ -344,8 +523,11 @@ put_cert (ksba_cert_t cert, int permanent, unsigned int trustclass,
       return gpg_error (GPG_ERR_INV_CERT_OBJ);
     }
   ci->subject_dn = ksba_cert_get_subject (cert, 0);
+  if (ksba_cert_get_subj_key_id (cert, NULL, &ci->ski))
+    ci->ski = NULL;
   ci->permanent = !!permanent;
   ci->trustclasses = trustclass;
+  index_cache_slot (ci);
 
   if (permanent)
     any_cert_of_class |= trustclass;
@@ -356,6 +538,346 @@ put_cert (ksba_cert_t cert, int permanent, unsigned int trustclass,
 }
 
 
+/* Parse the next TLV object from the buffer at (*BUF,*BUFLEN) and
+ * advance the buffer over it.  The class and tag are stored at
+ * R_CLASS and R_TAG, the value at (R_VAL,R_VALLEN) and, if R_OBJ is
+ * not NULL, the entire object including the header at
+ * (R_OBJ,R_OBJLEN).  */
+static gpg_error_t
+get_tlv (unsigned char const **buf, size_t *buflen, int *r_class, int *r_tag,
+         unsigned char const **r_val, size_t *r_vallen,
+         unsigned char const **r_obj, size_t *r_objlen)
+{
+  gpg_error_t err;
+  const unsigned char *start = *buf;
+  int cons, ndef;
+  size_t len, nhdr;
+
+  err = parse_ber_header (buf, buflen, r_class, r_tag, &cons, &ndef,
+                          &len, &nhdr);
+  if (!err && (ndef || len > *buflen))
+    err = gpg_error (GPG_ERR_INV_CERT_OBJ);
+  if (err)
+    return err;
+  *r_val = *buf;
+  *r_vallen = len;
+  if (r_obj)
+    {
+      *r_obj = start;
+      *r_objlen = nhdr + len;
+    }
+  *buf += len;
+  *buflen -= len;
+  return 0;
+}
+
+
+/* Return a malloced canonical S-expression with the LENGTH bytes at
+ * BUFFER as its only octet string or NULL on memory error.  This is
+ * the format in which libksba returns serial numbers and keyIds.  */
+static ksba_sexp_t
+make_octet_sexp (const void *buffer, size_t length)
+{
+  char numbuf[20];
+  char *result, *p;
+
+  snprintf (numbuf, sizeof numbuf, "(%u:", (unsigned int)length);
+  result = xtrymalloc (strlen (numbuf) + length + 2);
+  if (!result)
+    return NULL;
+  p = stpcpy (result, numbuf);
+  memcpy (p, buffer, length);
+  p[length] = ')';
+  p[length+1] = 0;
+  return result;
+}
+
+
+/* Extract the issuer DN, the serial number, the subject DN and the
+ * subjectKeyIdentifier from the DER encoded certificate IMAGE of
+ * IMAGELEN bytes without building a KSBA certificate object.  The
+ * subject and the SKI may be stored as NULL if not available.  The
+ * caller needs to release the returned values also on error.  */
+static gpg_error_t
+parse_cert_image (const unsigned char *image, size_t imagelen,
+                  char **r_issuer, ksba_sexp_t *r_sn,
+                  char **r_subject, ksba_sexp_t *r_ski)
+{
+  gpg_error_t err;
+  const unsigned char *p, *val, *obj, *ext;
+  size_t n, vallen, objlen, extlen;
+  int class, tag;
+
+  *r_issuer = NULL;
+  *r_sn = NULL;
+  *r_subject = NULL;
+  *r_ski = NULL;
+
+  /* Certificate ::= SEQUENCE { tbsCertificate TBSCertificate, ... } */
+  p = image;
+  n = imagelen;
+  err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+  if (err || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE)
+    goto bad;
+  p = val;
+  n = vallen;
+  err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+  if (err || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE)
+    goto bad;
+  p = val;
+  n = vallen;
+
+  /* version [0] EXPLICIT Version DEFAULT v1 */
+  err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+  if (!err && class == CLASS_CONTEXT && tag == 0)
+    err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+  /* serialNumber CertificateSerialNumber */
+  if (err || class != CLASS_UNIVERSAL || tag != TAG_INTEGER || !vallen)
+    goto bad;
+  *r_sn = make_octet_sexp (val, vallen);
+  if (!*r_sn)
+    return gpg_error_from_syserror ();
+
+  /* signature AlgorithmIdentifier */
+  err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+  if (err || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE)
+    goto bad;
+
+  /* issuer Name */
+  err = get_tlv (&p, &n, &class, &tag, &val, &vallen, &obj, &objlen);
+  if (err || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE)
+    goto bad;
+  err = ksba_dn_der2str (obj, objlen, r_issuer);
+  if (err)
+    return err;
+
+  /* validity Validity */
+  err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+  if (err || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE)
+    goto bad;
+
+  /* subject Name */
+  err = get_tlv (&p, &n, &class, &tag, &val, &vallen, &obj, &objlen);
+  if (err || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE)
+    goto bad;
+  if (vallen)
+    {
+      err = ksba_dn_der2str (obj, objlen, r_subject);
+      if (err)
+        return err;
+    }
+
+  /* subjectPublicKeyInfo SubjectPublicKeyInfo */
+  err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+  if (err || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE)
+    goto bad;
+
+  /* Skip the unique identifiers and look at the extensions.  */
+  while (n)
+    {
+      err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+      if (err)
+        goto bad;
+      if (class == CLASS_CONTEXT && tag == 3)
+        break;
+    }
+  if (!n && !(class == CLASS_CONTEXT && tag == 3))
+    return 0;  /* No extensions.  */
+
+  /* extensions [3] EXPLICIT Extensions
+   * Extensions ::= SEQUENCE OF Extension  */
+  p = val;
+  n = vallen;
+  err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+  if (err || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE)
+    goto bad;
+  ext = val;
+  extlen = vallen;
+  while (extlen)
+    {
+      /* Extension ::= SEQUENCE { extnID OBJECT IDENTIFIER,
+       *   critical BOOLEAN DEFAULT FALSE, extnValue OCTET STRING } */
+      err = get_tlv (&ext, &extlen, &class, &tag, &val, &vallen, NULL, NULL);
+      if (err || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE)
+        goto bad;
+      p = val;
+      n = vallen;
+      err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+      if (err || class != CLASS_UNIVERSAL || tag != TAG_OBJECT_ID)
+        goto bad;
+      /* Look for subjectKeyIdentifier (2.5.29.14).  */
+      if (vallen != 3 || memcmp (val, "\x55\x1d\x0e", 3))
+        continue;
+      err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+      if (!err && class == CLASS_UNIVERSAL && tag == TAG_BOOLEAN)
+        err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+      if (err || class != CLASS_UNIVERSAL || tag != TAG_OCTET_STRING)
+        goto bad;
+      /* SubjectKeyIdentifier ::= KeyIdentifier ::= OCTET STRING */
+      p = val;
+      n = vallen;
+      err = get_tlv (&p, &n, &class, &tag, &val, &vallen, NULL, NULL);
+      if (err || class != CLASS_UNIVERSAL || tag != TAG_OCTET_STRING)
+        goto bad;
+      *r_ski = make_octet_sexp (val, vallen);
+      if (!*r_ski)
+        return gpg_error_from_syserror ();
+      break;
+    }
+
+  return 0;
+
+ bad:
+  return gpg_error (GPG_ERR_INV_CERT_OBJ);
+}
+
+
+/* Put the DER encoded certificate IMAGE of length IMAGELEN as a
+ * permanent certificate into the cache without parsing it into a
+ * KSBA object; this is done on the first use of the certificate.
+ * TRUSTCLASS and FPR_BUFFER are as for put_cert.  It is assumed that
+ * the cache is locked while this function is called.  */
+static gpg_error_t
+put_cert_image (const void *image, size_t imagelen, unsigned int trustclass,
+                void *fpr_buffer)
+{
+  gpg_error_t err;
+  unsigned char help_fpr_buffer[20], *fpr;
+  char *issuer_dn, *subject_dn;
+  ksba_sexp_t sn, ski;
+  cert_item_t ci;
+
+  fpr = fpr_buffer? fpr_buffer : &help_fpr_buffer;
+
+  gcry_md_hash_buffer (GCRY_MD_SHA1, fpr, image, imagelen);
+
+  err = parse_cert_image (image, imagelen, &issuer_dn, &sn, &subject_dn, &ski);
+  if (!err)
+    err = get_free_slot (fpr, &ci);
+  if (err)
+    {
+      ksba_free (issuer_dn);
+      ksba_free (sn);
+      ksba_free (subject_dn);
+      ksba_free (ski);
+      return err;
+    }
+
+  ci->image = xtrymalloc (imagelen);
+  if (!ci->image)
+    {
+      err = gpg_error_from_syserror ();
+      ksba_free (issuer_dn);
+      ksba_free (sn);
+      ksba_free (subject_dn);
+      ksba_free (ski);
+      return err;
+    }
+  memcpy (ci->image, image, imagelen);
+  ci->imagelen = imagelen;
+  memcpy (ci->fpr, fpr, 20);
+  ci->issuer_dn = issuer_dn;
+  ci->sn = sn;
+  ci->subject_dn = subject_dn;
+  ci->ski = ski;
+  ci->permanent = 1;
+  ci->trustclasses = trustclass;
+  index_cache_slot (ci);
+
+  any_cert_of_class |= trustclass;
+
+  return 0;
+}
+
+
+/* Read the next DER encoded certificate from READER into a malloced
+ * buffer stored at R_IMAGE and its length at R_IMAGELEN.  The reader
+ * is expected to return EOF at the end of the certificate as done
+ * by the PEM reader.  Returns GPG_ERR_EOF if no more data is
+ * available.  */
+static gpg_error_t
+read_cert_image (ksba_reader_t reader,
+                 unsigned char **r_image, size_t *r_imagelen)
+{
+  gpg_error_t err;
+  membuf_t mb;
+  char buffer[4096];
+  size_t nread, len, nhdr;
+  const unsigned char *p;
+  unsigned char *image;
+  size_t imagelen, n;
+  int class, tag, cons, ndef;
+
+  *r_image = NULL;
+  *r_imagelen = 0;
+
+  init_membuf (&mb, 4096);
+  while (!(err = ksba_reader_read (reader, buffer, sizeof buffer, &nread)))
+    put_membuf (&mb, buffer, nread);
+  if (gpg_err_code (err) != GPG_ERR_EOF)
+    {
+      xfree (get_membuf (&mb, NULL));
+      return err;
+    }
+  image = get_membuf (&mb, &imagelen);
+  if (!image)
+    return gpg_error_from_syserror ();
+  if (!imagelen)
+    {
+      xfree (image);
+      return gpg_error (GPG_ERR_EOF);
+    }
+
+  /* Strip any trailing garbage.  */
+  p = image;
+  n = imagelen;
+  if (parse_ber_header (&p, &n, &class, &tag, &cons, &ndef, &len, &nhdr)
+      || ndef || len > n)
+    {
+      xfree (image);
+      return gpg_error (GPG_ERR_INV_CERT_OBJ);
+    }
+
+  *r_image = image;
+  *r_imagelen = nhdr + len;
+  return 0;
+}
+
+
+/* Return the certificate of the cache item CI with an additional
+ * reference.  A lazily loaded certificate is parsed now.  Because
+ * this does not involve any npth function, this may be called while
+ * holding only a read lock.  Returns NULL on error.  */
+static ksba_cert_t
+get_item_cert (cert_item_t ci)
+{
+  gpg_error_t err;
+  ksba_cert_t cert;
+
+  if (!ci->cert)
+    {
+      err = ksba_cert_new (&cert);
+      if (!err)
+        err = ksba_cert_init_from_mem (cert, ci->image, ci->imagelen);
+      if (err)
+        {
+          log_error (_("can't parse certificate '%s': %s\n"),
+                     ci->subject_dn? ci->subject_dn : "[?]",
+                     gpg_strerror (err));
+          ksba_cert_release (cert);
+          return NULL;
+        }
+      ci->cert = cert;
+      xfree (ci->image);
+      ci->image = NULL;
+      ci->imagelen = 0;
+    }
+
+  ksba_cert_ref (ci->cert);
+  return ci->cert;
+}
+
+
 /* Load certificates from the directory DIRNAME.  All certificates
    matching the pattern "*.crt" or "*.der"  are loaded.  We assume that
    certificates are DER encoded and not PEM encapsulated.  The cache
@@ -371,6 +893,7 @@ load_certs_from_dir (const char *dirname, unsigned int trustclass)
   estream_t fp;
   ksba_reader_t reader;
   ksba_cert_t cert;
+  unsigned char fpr[20];
   char *fname = NULL;
 
   dir = opendir (dirname);
@@ -405,12 +928,28 @@ load_certs_from_dir (const char *dirname, unsigned int trustclass)
           continue;
         }
 
-      err = ksba_cert_new (&cert);
-      if (!err)
-        err = ksba_cert_read_der (cert, reader);
+      cert = NULL;
+      if (opt.lazy_load_certs)
+        {
+          unsigned char *image;
+          size_t imagelen;
+
+          err = read_cert_image (reader, &image, &imagelen);
+          if (!err)
+            {
+              err = put_cert_image (image, imagelen, trustclass, fpr);
+              xfree (image);
+            }
+        }
+      else
+        {
+          err = ksba_cert_new (&cert);
+          if (!err)
+            err = ksba_cert_read_der (cert, reader);
+        }
       ksba_reader_release (reader);
       es_fclose (fp);
-      if (err)
+      if (err && gpg_err_code (err) != GPG_ERR_DUP_VALUE)
         {
           log_error (_("can't parse certificate '%s': %s\n"),
                      fname, gpg_strerror (err));
@@ -418,7 +957,8 @@ load_certs_from_dir (const char *dirname, unsigned int trustclass)
           continue;
         }
 
-      err = put_cert (cert, 1, trustclass, NULL);
+      if (cert)
+        err = put_cert (cert, 1, trustclass, fpr);
       if (gpg_err_code (err) == GPG_ERR_DUP_VALUE)
         log_info (_("certificate '%s' already cached\n"), fname);
       else if (!err)
@@ -432,12 +972,15 @@ load_certs_from_dir (const char *dirname, unsigned int trustclass)
             log_info (_("certificate '%s' loaded\n"), fname);
           if (opt.verbose)
             {
-              p = get_fingerprint_hexstring_colon (cert);
-              log_info (_("  SHA1 fingerprint = %s\n"), p);
-              xfree (p);
+              char hexfpr[3*20+1];
 
-              cert_log_name (_("   issuer ="), cert);
-              cert_log_subject (_("  subject ="), cert);
+              log_info (_("  SHA1 fingerprint = %s\n"),
+                        bin2hexcolon (fpr, 20, hexfpr));
+              if (cert)
+                {
+                  cert_log_name (_("   issuer ="), cert);
+                  cert_log_subject (_("  subject ="), cert);
+                }
             }
         }
       else
@@ -494,26 +1037,58 @@ load_certs_from_file (const char *fname, unsigned int trustclasses,
     {
       ksba_cert_release (cert);
       cert = NULL;
-      err = ksba_cert_new (&cert);
-      if (!err)
-        err = ksba_cert_read_der (cert, reader);
-      if (err)
+      if (opt.lazy_load_certs)
         {
-          if (gpg_err_code (err) == GPG_ERR_EOF)
-            err = 0;
+          unsigned char *image;
+          size_t imagelen;
+
+          err = read_cert_image (reader, &image, &imagelen);
+          if (!err)
+            {
+              err = put_cert_image (image, imagelen, trustclasses, NULL);
+              xfree (image);
+              if (gpg_err_code (err) == GPG_ERR_INV_CERT_OBJ)
+                {
+                  log_error (_("can't parse certificate '%s': %s\n"),
+                             fname, gpg_strerror (err));
+                  goto leave;
+                }
+            }
+          else if (gpg_err_code (err) == GPG_ERR_EOF)
+            {
+              err = 0;
+              goto leave;
+            }
           else
-            log_error (_("can't parse certificate '%s': %s\n"),
-                       fname, gpg_strerror (err));
-          goto leave;
+            {
+              log_error (_("can't parse certificate '%s': %s\n"),
+                         fname, gpg_strerror (err));
+              goto leave;
+            }
         }
+      else
+        {
+          err = ksba_cert_new (&cert);
+          if (!err)
+            err = ksba_cert_read_der (cert, reader);
+          if (err)
+            {
+              if (gpg_err_code (err) == GPG_ERR_EOF)
+                err = 0;
+              else
+                log_error (_("can't parse certificate '%s': %s\n"),
+                           fname, gpg_strerror (err));
+              goto leave;
+            }
 
-      err = put_cert (cert, 1, trustclasses, NULL);
+          err = put_cert (cert, 1, trustclasses, NULL);
+        }
       if (gpg_err_code (err) == GPG_ERR_DUP_VALUE)
         log_info (_("certificate '%s' already cached\n"), fname);
       else if (err)
         log_error (_("error loading certificate '%s': %s\n"),
                    fname, gpg_strerror (err));
-      else if (opt.verbose > 1)
+      else if (opt.verbose > 1 && cert)
         {
           char *p;
 
@@ -605,19 +1180,34 @@ load_certs_from_w32_store (const char *storename)
         {
           ksba_cert_release (cert);
           cert = NULL;
-          err = ksba_cert_new (&cert);
-          if (!err)
-            err = ksba_cert_init_from_mem (cert,
-                                           w32cert->pbCertEncoded,
-                                           w32cert->cbCertEncoded);
-          if (err)
+          if (opt.lazy_load_certs)
             {
-              log_error (_("can't parse certificate '%s': %s\n"),
-                         storename, gpg_strerror (err));
-              break;
+              err = put_cert_image (w32cert->pbCertEncoded,
+                                    w32cert->cbCertEncoded,
+                                    CERTTRUST_CLASS_SYSTEM, NULL);
+              if (gpg_err_code (err) == GPG_ERR_INV_CERT_OBJ)
+                {
+                  log_error (_("can't parse certificate '%s': %s\n"),
+                             storename, gpg_strerror (err));
+                  break;
+                }
             }
+          else
+            {
+              err = ksba_cert_new (&cert);
+              if (!err)
+                err = ksba_cert_init_from_mem (cert,
+                                               w32cert->pbCertEncoded,
+                                               w32cert->cbCertEncoded);
+              if (err)
+                {
+                  log_error (_("can't parse certificate '%s': %s\n"),
+                             storename, gpg_strerror (err));
+                  break;
+                }
 
-          err = put_cert (cert, 1, CERTTRUST_CLASS_SYSTEM, NULL);
+              err = put_cert (cert, 1, CERTTRUST_CLASS_SYSTEM, NULL);
+            }
           if (!err)
             count++;
           if (gpg_err_code (err) == GPG_ERR_DUP_VALUE)
@@ -628,7 +1218,7 @@ load_certs_from_w32_store (const char *storename)
           else if (err)
             log_error (_("error loading certificate '%s': %s\n"),
                        storename, gpg_strerror (err));
-          else if (opt.verbose > 1)
+          else if (opt.verbose > 1 && cert)
             {
               char *p;
 
@@ -764,6 +1354,11 @@ cert_cache_deinit (int full)
             }
           cert_cache[i] = NULL;
         }
+      /* The indices are empty now because clean_cache_slot removed
+       * all items from them; clear them anyway for robustness.  */
+      memset (subject_index, 0, sizeof subject_index);
+      memset (issuer_index, 0, sizeof issuer_index);
+      memset (ski_index, 0, sizeof ski_index);
     }
 
   http_register_cfg_ca (NULL);
@@ -791,7 +1386,7 @@ cert_cache_print_stats (void)
   acquire_cache_read_lock ();
   for (idx = 0; idx < 256; idx++)
     for (ci=cert_cache[idx]; ci; ci = ci->next)
-      if (ci->cert)
+      if (ITEM_IN_USE (ci))
         {
           if (ci->permanent)
             n_permanent++;
@@ -885,17 +1480,20 @@ ksba_cert_t
 get_cert_byfpr (const unsigned char *fpr)
 {
   cert_item_t ci;
+  ksba_cert_t cert;
 
   acquire_cache_read_lock ();
   for (ci=cert_cache[*fpr]; ci; ci = ci->next)
-    if (ci->cert && !memcmp (ci->fpr, fpr, 20))
+    if (ITEM_IN_USE (ci) && !memcmp (ci->fpr, fpr, 20))
       {
-        ksba_cert_ref (ci->cert);
+        cert = get_item_cert (ci);
         release_cache_lock ();
-        return ci->cert;
+        dirmngr_stats_cache (DIRMNGR_CACHE_CERT, 1);
+        return cert;
       }
 
   release_cache_lock ();
+  dirmngr_stats_cache (DIRMNGR_CACHE_CERT, 0);
   return NULL;
 }
 
@@ -945,22 +1543,21 @@ get_cert_byhexfpr (const char *string)
 ksba_cert_t
 get_cert_bysn (const char *issuer_dn, ksba_sexp_t serialno)
 {
-  /* Simple and inefficient implementation.   fixme! */
   cert_item_t ci;
-  int i;
+  ksba_cert_t cert;
+  unsigned int h;
 
+  h = hash_issuer_sn (issuer_dn, serialno);
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && !strcmp (ci->issuer_dn, issuer_dn)
-            && !compare_serialno (ci->sn, serialno))
-          {
-            ksba_cert_ref (ci->cert);
-            release_cache_lock ();
-            return ci->cert;
-          }
-    }
+  for (ci=issuer_index[h % CERT_INDEX_SIZE]; ci; ci = ci->next_issuer)
+    if (ITEM_IN_USE (ci) && ci->issuer_hash == h
+        && !strcmp (ci->issuer_dn, issuer_dn)
+        && !compare_serialno (ci->sn, serialno))
+      {
+        cert = get_item_cert (ci);
+        release_cache_lock ();
+        return cert;
+      }
 
   release_cache_lock ();
   return NULL;
@@ -974,18 +1571,19 @@ get_cert_byissuer (const char *issuer_dn, unsigned int seq)
 {
   /* Simple and very inefficient implementation and API.  fixme! */
   cert_item_t ci;
+  ksba_cert_t cert;
   int i;
 
   acquire_cache_read_lock ();
   for (i=0; i < 256; i++)
     {
       for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && !strcmp (ci->issuer_dn, issuer_dn))
+        if (ITEM_IN_USE (ci) && !strcmp (ci->issuer_dn, issuer_dn))
           if (!seq--)
             {
-              ksba_cert_ref (ci->cert);
+              cert = get_item_cert (ci);
               release_cache_lock ();
-              return ci->cert;
+              return cert;
             }
     }
 
@@ -999,26 +1597,24 @@ get_cert_byissuer (const char *issuer_dn, unsigned int seq)
 ksba_cert_t
 get_cert_bysubject (const char *subject_dn, unsigned int seq)
 {
-  /* Simple and very inefficient implementation and API.  fixme! */
   cert_item_t ci;
-  int i;
+  ksba_cert_t cert;
+  unsigned int h;
 
   if (!subject_dn)
     return NULL;
 
+  h = hash_dn (subject_dn);
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && ci->subject_dn
-            && !strcmp (ci->subject_dn, subject_dn))
-          if (!seq--)
-            {
-              ksba_cert_ref (ci->cert);
-              release_cache_lock ();
-              return ci->cert;
-            }
-    }
+  for (ci=subject_index[h % CERT_INDEX_SIZE]; ci; ci = ci->next_subject)
+    if (ITEM_IN_USE (ci) && ci->subject_hash == h
+        && !strcmp (ci->subject_dn, subject_dn))
+      if (!seq--)
+        {
+          cert = get_item_cert (ci);
+          release_cache_lock ();
+          return cert;
+        }
 
   release_cache_lock ();
   return NULL;
@@ -1458,24 +2054,24 @@ find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
     {
       cert_item_t ci;
       cert_ref_t cr;
-      int i;
+      unsigned int h;
 
       /* For efficiency reasons we won't use get_cert_bysubject here. */
+      h = hash_dn (subject_dn);
       acquire_cache_read_lock ();
-      for (i=0; i < 256; i++)
-        for (ci=cert_cache[i]; ci; ci = ci->next)
-          if (ci->cert && ci->subject_dn
-              && !strcmp (ci->subject_dn, subject_dn))
-            for (cr=ctrl->ocsp_certs; cr; cr = cr->next)
-              if (!memcmp (ci->fpr, cr->fpr, 20))
-                {
-                  ksba_cert_ref (ci->cert);
-                  release_cache_lock ();
-                  if (DBG_LOOKUP)
-                    log_debug ("%s: certificate found in the cache"
-                               " via ocsp_certs\n", __func__);
-                  return ci->cert; /* We use this certificate. */
-                }
+      for (ci=subject_index[h % CERT_INDEX_SIZE]; ci; ci = ci->next_subject)
+        if (ITEM_IN_USE (ci) && ci->subject_hash == h
+            && !strcmp (ci->subject_dn, subject_dn))
+          for (cr=ctrl->ocsp_certs; cr; cr = cr->next)
+            if (!memcmp (ci->fpr, cr->fpr, 20))
+              {
+                cert = get_item_cert (ci);
+                release_cache_lock ();
+                if (DBG_LOOKUP)
+                  log_debug ("%s: certificate found in the cache"
+                             " via ocsp_certs\n", __func__);
+                return cert; /* We use this certificate. */
+              }
       release_cache_lock ();
       if (DBG_LOOKUP)
         log_debug ("find_cert_bysubject: certificate not in ocsp_certs\n");
@@ -1505,27 +2101,22 @@ find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
    * by keyid.  */
   if (!subject_dn && keyid)
     {
-      int i;
       cert_item_t ci;
-      ksba_sexp_t ski;
+      unsigned int h;
 
+      h = hash_sexp (HASH_INIT, keyid);
       acquire_cache_read_lock ();
-      for (i=0; i < 256; i++)
-        for (ci=cert_cache[i]; ci; ci = ci->next)
-          if (ci->cert && !ksba_cert_get_subj_key_id (ci->cert, NULL, &ski))
-            {
-              if (!cmp_simple_canon_sexp (keyid, ski))
-                {
-                  ksba_free (ski);
-                  ksba_cert_ref (ci->cert);
-                  release_cache_lock ();
-                  if (DBG_LOOKUP)
-                    log_debug ("%s: certificate found in the cache"
-                               " via ski\n", __func__);
-                  return ci->cert;
-                }
-              ksba_free (ski);
-            }
+      for (ci=ski_index[h % CERT_INDEX_SIZE]; ci; ci = ci->next_ski)
+        if (ITEM_IN_USE (ci) && ci->ski_hash == h
+            && !cmp_simple_canon_sexp (keyid, ci->ski))
+          {
+            cert = get_item_cert (ci);
+            release_cache_lock ();
+            if (DBG_LOOKUP)
+              log_debug ("%s: certificate found in the cache"
+                         " via ski\n", __func__);
+            return cert;
+          }
       release_cache_lock ();
     }
 
@@ -1652,7 +2243,7 @@ is_trusted_cert (ksba_cert_t cert, unsigned int trustclasses)
 
   acquire_cache_read_lock ();
   for (ci=cert_cache[*fpr]; ci; ci = ci->next)
-    if (ci->cert && !memcmp (ci->fpr, fpr, 20))
+    if (ITEM_IN_USE (ci) && !memcmp (ci->fpr, fpr, 20))
       {
         if ((ci->trustclasses & trustclasses))
           {
@@ -62,19 +62,24 @@
         Field 4: URL used to retrieve the corresponding CRL.
         Field 5: 15 character ISO timestamp with THIS_UPDATE.
         Field 6: 15 character ISO timestamp with NEXT_UPDATE.
-        Field 7: Hexadecimal encoded MD-5 hash of the DB file to detect
-                 accidental modified (i.e. deleted and created) cache files.
+        Field 7: Hexadecimal encoded MD-5 hash identifying the DB file
+                 to detect accidental modified (i.e. deleted and
+                 created) cache files.  See crltable.c for what is
+                 covered by the hash.
         Field 8: optional CRL number as a hex string.
         Field 9:  AuthorityKeyID.issuer, each Name separated by 0x01
         Field 10: AuthorityKeyID.serial
         Field 11: Hex fingerprint of trust anchor if field 1 is 'u'.
+        Field 12: Optional URL to retrieve delta CRLs from.  If the
+                  entry has been updated by a delta CRL, fields 5, 6
+                  and 8 are those of the delta CRL.
 
    2. Layout of the standard CRL Cache DB file:
 
-      We use records of variable length with this structure
+      The DB file is a table sorted by the serial numbers of the
+      revoked certificates as described in crltable.c.  The value
+      stored with each serial number has this structure
 
-      n  bytes  Serialnumber (binary) used as key
-                thus there is no need to store the length explicitly with DB2.
       1  byte   Reason for revocation
                 (currently the KSBA reason flags are used)
       15 bytes  ISO date of revocation (e.g. 19980815T142000)
@@ -112,19 +117,28 @@
 #include "crlcache.h"
 #include "crlfetch.h"
 #include "misc.h"
-#include "cdb.h"
+#include "../common/tlv.h"
+#include "crltable.h"
 
 /* Change this whenever the format changes */
 #define DBDIR_D "crls.d"
 #define DBDIRFILE "DIR.txt"
-#define DBDIRVERSION 1
+#define DBDIRVERSION 2
 
 /* The number of DB files we may have open at one time.  We need to
    limit this because there is no guarantee that the number of issuers
-   has a upper limit.  We are currently using mmap, so it is a good
-   idea anyway to limit the number of opened cache files. */
+   has a upper limit.  We are using mmap, so it is a good idea anyway
+   to limit the number of opened cache files. */
 #define MAX_OPEN_DB_FILES 5
 
+/* CRLs which have been used during the last CRL_PREFETCH_USED
+   seconds are refreshed in the background if their nextUpdate is less
+   than CRL_PREFETCH_LEAD seconds ahead.  A failed or unproductive
+   attempt is repeated after CRL_PREFETCH_RETRY seconds.  */
+#define CRL_PREFETCH_USED  (86400)
+#define CRL_PREFETCH_LEAD  (3600)
+#define CRL_PREFETCH_RETRY (30 * 60)
+
 #ifndef O_BINARY
 # define O_BINARY 0
 #endif
@@ -132,6 +146,8 @@
 static const char oidstr_crlNumber[] = "2.5.29.20";
 /* static const char oidstr_issuingDistributionPoint[] = "2.5.29.28"; */
 static const char oidstr_authorityKeyIdentifier[] = "2.5.29.35";
+static const char oidstr_deltaCRLIndicator[] = "2.5.29.27";
+static const char oidstr_freshestCRL[] = "2.5.29.46";
 
 
 /* Definition of one cached item. */
@@ -155,13 +171,16 @@ struct crl_cache_entry_s
   char *crl_number;
   char *authority_issuer;
   char *authority_serialno;
+  char *delta_url;    /* Malloced URL for delta CRLs or NULL.  */
 
-  struct cdb *cdb;             /* The cache file handle or NULL if not open. */
+  crltable_t db;               /* The cache file handle or NULL if not open. */
 
-  unsigned int cdb_use_count;  /* Current use count. */
-  unsigned int cdb_lru_count;  /* Used for LRU purposes. */
+  unsigned int db_use_count;   /* Current use count. */
+  unsigned int db_lru_count;   /* Used for LRU purposes. */
   int dbfile_checked;          /* Set to true if the dbfile_hash value has
                                   been checked one. */
+  time_t last_used;            /* Time of the last lookup or 0.  */
+  time_t last_prefetch;        /* Time of the last background refresh or 0.  */
 };
 
 
@@ -367,16 +386,10 @@ release_one_cache_entry (crl_cache_entry_t entry)
 {
   if (entry)
     {
-      if (entry->cdb)
-        {
-          int fd = cdb_fileno (entry->cdb);
-          cdb_free (entry->cdb);
-          xfree (entry->cdb);
-          if (close (fd))
-            log_error (_("error closing cache file: %s\n"), strerror(errno));
-        }
+      crltable_close (entry->db);
       xfree (entry->release_ptr);
       xfree (entry->check_trust_anchor);
+      xfree (entry->delta_url);
       xfree (entry);
     }
 }
@@ -613,6 +626,10 @@ open_dir (crl_cache_t *r_cache)
                   if (*p)
                     entry->check_trust_anchor = xtrystrdup (p);
                   break;
+                case 12:
+                  if (*p)
+                    entry->delta_url = xtrystrdup (unpercent_string (p));
+                  break;
                 default:
                   if (*p)
                     log_info (_("extra field detected in crl record of "
@@ -765,6 +782,9 @@ write_dir_line_crl (estream_t fp, crl_cache_entry_t e)
   es_putc (':', fp);
   if (e->check_trust_anchor && e->user_trust_req)
     es_fputs (e->check_trust_anchor, fp);
+  es_putc (':', fp);
+  if (e->delta_url)
+    write_percented_string (e->delta_url, fp);
   es_putc ('\n', fp);
 }
 
@@ -987,109 +1007,30 @@ make_db_file_name (const char *issuer_hash)
 }
 
 
-/* Hash the file FNAME and return the MD5 digest in MD5BUFFER. The
-   caller must allocate MD%buffer wityh at least 16 bytes. Returns 0
-   on success. */
-static int
-hash_dbfile (const char *fname, unsigned char *md5buffer)
-{
-  estream_t fp;
-  char *buffer;
-  size_t n;
-  gcry_md_hd_t md5;
-  gpg_error_t err;
-
-  buffer = xtrymalloc (65536);
-  fp = buffer? es_fopen (fname, "rb") : NULL;
-  if (!fp)
-    {
-      log_error (_("can't hash '%s': %s\n"), fname, strerror (errno));
-      xfree (buffer);
-      return -1;
-    }
-
-  err = gcry_md_open (&md5, GCRY_MD_MD5, 0);
-  if (err)
-    {
-      log_error (_("error setting up MD5 hash context: %s\n"),
-                 gpg_strerror (err));
-      xfree (buffer);
-      es_fclose (fp);
-      return -1;
-    }
-
-  /* We better hash some information about the cache file layout in. */
-  sprintf (buffer, "%.100s/%.100s:%d", DBDIR_D, DBDIRFILE, DBDIRVERSION);
-  gcry_md_write (md5, buffer, strlen (buffer));
-
-  for (;;)
-    {
-      n = es_fread (buffer, 1, 65536, fp);
-      if (n < 65536 && es_ferror (fp))
-        {
-          log_error (_("error hashing '%s': %s\n"), fname, strerror (errno));
-          xfree (buffer);
-          es_fclose (fp);
-          gcry_md_close (md5);
-          return -1;
-        }
-      if (!n)
-        break;
-      gcry_md_write (md5, buffer, n);
-    }
-  es_fclose (fp);
-  xfree (buffer);
-  gcry_md_final (md5);
-
-  memcpy (md5buffer, gcry_md_read (md5, GCRY_MD_MD5), 16);
-  gcry_md_close (md5);
-  return 0;
-}
-
-/* Compare the file FNAME against the dexified MD5 hash MD5HASH and
-   return 0 if they match. */
-static int
-check_dbfile (const char *fname, const char *md5hexvalue)
-{
-  unsigned char buffer1[16], buffer2[16];
-
-  if (strlen (md5hexvalue) != 32)
-    {
-      log_error (_("invalid formatted checksum for '%s'\n"), fname);
-      return -1;
-    }
-  unhexify (buffer1, md5hexvalue);
-
-  if (hash_dbfile (fname, buffer2))
-    return -1;
-
-  return memcmp (buffer1, buffer2, 16);
-}
-
-
 /* Open the cache file for ENTRY.  This function implements a caching
    strategy and might close unused cache files. It is required to use
    unlock_db_file after using the file. */
-static struct cdb *
+static crltable_t
 lock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
 {
+  gpg_error_t err;
   char *fname;
-  int fd;
   int open_count;
   crl_cache_entry_t e;
+  unsigned char md5buf[16];
 
-  if (entry->cdb)
+  if (entry->db)
     {
-      entry->cdb_use_count++;
-      return entry->cdb;
+      entry->db_use_count++;
+      return entry->db;
     }
 
   for (open_count = 0, e = cache->entries; e; e = e->next)
     {
-      if (e->cdb)
+      if (e->db)
         open_count++;
-/*       log_debug ("CACHE: cdb=%p use_count=%u lru_count=%u\n", */
-/*                  e->cdb,e->cdb_use_count,e->cdb_lru_count); */
+/*       log_debug ("CACHE: db=%p use_count=%u lru_count=%u\n", */
+/*                  e->db,e->db_use_count,e->db_lru_count); */
     }
 
   /* If there are too many file open, find the least recent used DB
@@ -1101,9 +1042,9 @@ lock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
       unsigned int last_lru = (unsigned int)(-1);
 
       for (e = cache->entries; e; e = e->next)
-        if (e->cdb && !e->cdb_use_count && e->cdb_lru_count < last_lru)
+        if (e->db && !e->db_use_count && e->db_lru_count < last_lru)
           {
-            last_lru = e->cdb_lru_count;
+            last_lru = e->db_lru_count;
             last_e = e;
           }
       if (!last_e)
@@ -1112,14 +1053,10 @@ lock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
           return NULL;
         }
 
-/*       log_debug ("CACHE: closing file at cdb=%p\n", last_e->cdb); */
+/*       log_debug ("CACHE: closing file at db=%p\n", last_e->db); */
 
-      fd = cdb_fileno (last_e->cdb);
-      cdb_free (last_e->cdb);
-      xfree (last_e->cdb);
-      last_e->cdb = NULL;
-      if (close (fd))
-        log_error (_("error closing cache file: %s\n"), strerror(errno));
+      crltable_close (last_e->db);
+      last_e->db = NULL;
       open_count--;
     }
 
@@ -1128,65 +1065,55 @@ lock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
   if (opt.verbose)
     log_info (_("opening cache file '%s'\n"), fname );
 
-  if (!entry->dbfile_checked)
-    {
-      if (!check_dbfile (fname, entry->dbfile_hash))
-        entry->dbfile_checked = 1;
-      /* Note, in case of an error we don't print an error here but
-         let require the caller to do that check. */
-    }
-
-  entry->cdb = xtrycalloc (1, sizeof *entry->cdb);
-  if (!entry->cdb)
-    {
-      xfree (fname);
-      return NULL;
-    }
-  fd = open (fname, O_RDONLY | O_BINARY);
-  if (fd == -1)
+  err = crltable_open (fname, &entry->db, md5buf);
+  if (err)
     {
       log_error (_("error opening cache file '%s': %s\n"),
-                 fname, strerror (errno));
-      xfree (entry->cdb);
-      entry->cdb = NULL;
+                 fname, gpg_strerror (err));
       xfree (fname);
       return NULL;
     }
-  if (cdb_init (entry->cdb, fd))
+  xfree (fname);
+
+  /* Only the header and the page checksums are hashed; the data
+     pages are verified against their checksums when used.  */
+  if (!entry->dbfile_checked)
     {
-      log_error (_("error initializing cache file '%s' for reading: %s\n"),
-                 fname, strerror (errno));
-      xfree (entry->cdb);
-      entry->cdb = NULL;
-      close (fd);
-      xfree (fname);
-      return NULL;
+      unsigned char expected[16];
+
+      if (strlen (entry->dbfile_hash) == 32)
+        {
+          unhexify (expected, entry->dbfile_hash);
+          if (!memcmp (expected, md5buf, 16))
+            entry->dbfile_checked = 1;
+        }
+      /* Note, in case of an error we don't print an error here but
+         let require the caller to do that check. */
     }
-  xfree (fname);
 
-  entry->cdb_use_count = 1;
-  entry->cdb_lru_count = 0;
+  entry->db_use_count = 1;
+  entry->db_lru_count = 0;
 
-  return entry->cdb;
+  return entry->db;
 }
 
 /* Unlock a cache file, so that it can be reused. */
 static void
 unlock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
 {
-  if (!entry->cdb)
+  if (!entry->db)
     log_error (_("calling unlock_db_file on a closed file\n"));
-  else if (!entry->cdb_use_count)
+  else if (!entry->db_use_count)
     log_error (_("calling unlock_db_file on an unlocked file\n"));
   else
     {
-      entry->cdb_use_count--;
-      entry->cdb_lru_count++;
+      entry->db_use_count--;
+      entry->db_lru_count++;
     }
 
   /* If the entry was marked for deletion in the meantime do it now.
      We do this for the sake of Pth thread safeness. */
-  if (!entry->cdb_use_count && entry->deleted)
+  if (!entry->db_use_count && entry->deleted)
     {
       crl_cache_entry_t eprev, enext;
 
@@ -1277,11 +1204,11 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
 {
   crl_cache_t cache = get_current_cache ();
   crl_cache_result_t retval;
-  struct cdb *cdb;
-  int rc;
+  crltable_t db;
+  gpg_error_t err;
+  const unsigned char *record;
   crl_cache_entry_t entry;
   gnupg_isotime_t current_time;
-  size_t n;
 
   (void)ctrl;
 
@@ -1291,6 +1218,7 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
       log_info (_("no CRL available for issuer id %s\n"), issuer_hash );
       return CRL_CACHE_DONTKNOW;
     }
+  entry->last_used = gnupg_get_time ();
 
   gnupg_get_isotime (current_time);
   if (strcmp (entry->next_update, current_time) < 0 )
@@ -1331,8 +1259,8 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
       return CRL_CACHE_CANTUSE;
     }
 
-  cdb = lock_db_file (cache, entry);
-  if (!cdb)
+  db = lock_db_file (cache, entry);
+  if (!db)
     return CRL_CACHE_DONTKNOW; /* Hmmm, not the best error code. */
 
   if (!entry->dbfile_checked)
@@ -1343,32 +1271,20 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
       return CRL_CACHE_DONTKNOW;
     }
 
-  rc = cdb_find (cdb, sn, snlen);
-  if (rc == 1)
+  err = crltable_find (db, sn, snlen, &record);
+  if (!err)
     {
-      n = cdb_datalen (cdb);
-      if (n != 16)
-        {
-          log_error (_("WARNING: invalid cache record length for S/N "));
-          log_printf ("0x");
-          log_printhex (sn, snlen, "");
-        }
-      else if (opt.verbose)
+      if (opt.verbose)
         {
-          unsigned char record[16];
           char *tmp = hexify_data (sn, snlen, 1);
 
-          if (cdb_read (cdb, record, n, cdb_datapos (cdb)))
-            log_error (_("problem reading cache record for S/N %s: %s\n"),
-                       tmp, strerror (errno));
-          else
-            log_info (_("S/N %s is not valid; reason=%02X  date=%.15s\n"),
-                      tmp, *record, record+1);
+          log_info (_("S/N %s is not valid; reason=%02X  date=%.15s\n"),
+                    tmp, *record, record+1);
           xfree (tmp);
         }
       retval = CRL_CACHE_INVALID;
     }
-  else if (!rc)
+  else if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
     {
       if (opt.verbose)
         {
@@ -1382,7 +1298,13 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
   else
     {
       log_error (_("error getting data from cache file: %s\n"),
-                 strerror (errno));
+                 gpg_strerror (err));
+      if (gpg_err_code (err) == GPG_ERR_CHECKSUM)
+        {
+          log_error (_("cached CRL for issuer id %s tampered; "
+                       "we need to update\n"), issuer_hash);
+          entry->dbfile_checked = 0;
+        }
       retval = CRL_CACHE_DONTKNOW;
     }
 
@@ -1442,6 +1364,7 @@ crl_cache_isvalid (ctrl_t ctrl, const char *issuer_hash, const char *serialno,
   n = unhexify (snbuf, serialno);
 
   result = cache_isvalid (ctrl, issuer_hash, snbuf, n, force_refresh);
+  dirmngr_stats_cache (DIRMNGR_CACHE_CRL, result != CRL_CACHE_DONTKNOW);
 
   if (snbuf != snbuf_buffer)
     xfree (snbuf);
@@ -1508,6 +1431,7 @@ crl_cache_cert_isvalid (ctrl_t ctrl, ksba_cert_t cert,
 
   /* Check the cache.  */
   result = cache_isvalid (ctrl, issuerhash_hex, sn, snlen, force_refresh);
+  dirmngr_stats_cache (DIRMNGR_CACHE_CRL, result != CRL_CACHE_DONTKNOW);
   switch (result)
     {
     case CRL_CACHE_VALID:
@@ -1678,7 +1602,7 @@ abort_sig_check (ksba_crl_t crl, gcry_md_hd_t md)
 */
 static int
 crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
-                  struct cdb_make *cdb, const char *fname,
+                  crltable_make_t db, const char *fname,
                   char **r_crlissuer,
                   ksba_isotime_t thisupdate, ksba_isotime_t nextupdate,
                   char **r_trust_anchor)
@@ -1742,7 +1666,6 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
             const unsigned char *p;
             ksba_isotime_t rdate;
             ksba_crl_reason_t reason;
-            int rc;
             unsigned char record[1+15];
 
             err = ksba_crl_get_item (crl, &serial, rdate, &reason);
@@ -1759,13 +1682,18 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
               BUG ();
             record[0] = (reason & 0xff);
             memcpy (record+1, rdate, 15);
-            rc = cdb_make_add (cdb, p, n, record, 1+15);
-            if (rc)
+            /* "removeFromCRL" is used by delta CRLs to tell that a
+               certificate is not anymore revoked.  */
+            if ((reason & KSBA_CRLREASON_REMOVE_FROM_CRL))
+              err = crltable_make_del (db, p, n);
+            else
+              err = crltable_make_add (db, p, n, record);
+            if (err)
               {
-                err = gpg_error_from_errno (errno);
                 log_error (_("error inserting item into "
                              "temporary cache file: %s\n"),
-                           strerror (errno));
+                           gpg_strerror (err));
+                ksba_free (serial);
                 goto failure;
               }
 
@@ -1957,10 +1885,219 @@ get_auth_key_id (ksba_crl_t crl, char **serialno)
 }
 
 
+/* Return the BaseCRLNumber of the deltaCRLIndicator extension as an
+   allocated hex string.  Returns NULL if the CRL is not a delta CRL
+   or on error.  */
+static char *
+get_delta_crl_base (ksba_crl_t crl)
+{
+  gpg_error_t err;
+  int idx, crit;
+  const char *oid;
+  unsigned char const *der;
+  size_t derlen, len, nhdr;
+  int class, tag, cons, ndef;
+
+  for (idx=0; !(err=ksba_crl_get_extension (crl, idx, &oid, &crit,
+                                              &der, &derlen)); idx++)
+    if (!strcmp (oid, oidstr_deltaCRLIndicator))
+      break;
+  if (err)
+    return NULL;
+
+  err = parse_ber_header (&der, &derlen, &class, &tag, &cons, &ndef,
+                          &len, &nhdr);
+  if (err || class != CLASS_UNIVERSAL || tag != TAG_INTEGER || cons || ndef
+      || !len || len > derlen)
+    {
+      log_error ("invalid deltaCRLIndicator in CRL\n");
+      return xtrystrdup ("");  /* Make sure that it is not used.  */
+    }
+  return hexify_data (der, len, 0);
+}
+
+
+/* Return the first http or ldap URL of the freshestCRL extension as
+   an allocated string.  This is the location of the delta CRLs for
+   this CRL.  Returns NULL if there is none.  */
+static char *
+get_delta_crl_url (ksba_crl_t crl)
+{
+  gpg_error_t err;
+  int idx, crit;
+  const char *oid;
+  unsigned char const *der, *dp, *names;
+  size_t derlen, dplen, nameslen, len, nhdr;
+  int class, tag, cons, ndef;
+
+  for (idx=0; !(err=ksba_crl_get_extension (crl, idx, &oid, &crit,
+                                              &der, &derlen)); idx++)
+    if (!strcmp (oid, oidstr_freshestCRL))
+      break;
+  if (err)
+    return NULL;
+
+  /* CRLDistributionPoints ::= SEQUENCE OF DistributionPoint */
+  if (parse_ber_header (&der, &derlen, &class, &tag, &cons, &ndef,
+                        &len, &nhdr)
+      || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE || !cons || ndef
+      || len > derlen)
+    return NULL;
+  derlen = len;
+  while (derlen)
+    {
+      /* DistributionPoint ::= SEQUENCE {
+       *     distributionPoint [0] DistributionPointName OPTIONAL, ... } */
+      if (parse_ber_header (&der, &derlen, &class, &tag, &cons, &ndef,
+                            &len, &nhdr)
+          || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE || !cons || ndef
+          || len > derlen)
+        return NULL;
+      dp = der;
+      dplen = len;
+      der += len;
+      derlen -= len;
+
+      if (parse_ber_header (&dp, &dplen, &class, &tag, &cons, &ndef,
+                            &len, &nhdr)
+          || class != CLASS_CONTEXT || tag != 0 || !cons || ndef
+          || len > dplen)
+        continue;
+      /* DistributionPointName ::= CHOICE {
+       *     fullName [0] GeneralNames, ... } */
+      dplen = len;
+      if (parse_ber_header (&dp, &dplen, &class, &tag, &cons, &ndef,
+                            &len, &nhdr)
+          || class != CLASS_CONTEXT || tag != 0 || !cons || ndef
+          || len > dplen)
+        continue;
+      names = dp;
+      nameslen = len;
+      while (nameslen)
+        {
+          if (parse_ber_header (&names, &nameslen, &class, &tag, &cons,
+                                &ndef, &len, &nhdr)
+              || ndef || len > nameslen)
+            break;
+          /* uniformResourceIdentifier [6] IA5String */
+          if (class == CLASS_CONTEXT && tag == 6 && !cons
+              && ((len > 5 && !memcmp (names, "http:", 5))
+                  || (len > 6 && !memcmp (names, "https:", 6))
+                  || (len > 5 && !memcmp (names, "ldap:", 5))
+                  || (len > 6 && !memcmp (names, "ldaps:", 6))))
+            {
+              char *url = xtrymalloc (len + 1);
+              if (url)
+                {
+                  memcpy (url, names, len);
+                  url[len] = 0;
+                }
+              return url;
+            }
+          names += len;
+          nameslen -= len;
+        }
+    }
+
+  return NULL;
+}
+
+
+/* Compare the hex encoded numbers A and B.  Returns a negative value
+   if A is smaller than B, 0 if they are equal and a positive value if
+   A is larger than B.  */
+static int
+compare_hex_numbers (const char *a, const char *b)
+{
+  size_t alen, blen;
+
+  while (*a == '0')
+    a++;
+  while (*b == '0')
+    b++;
+  alen = strlen (a);
+  blen = strlen (b);
+  if (alen != blen)
+    return alen < blen? -1 : 1;
+  return ascii_strcasecmp (a, b);
+}
+
+
+/* Prepare the application of the delta CRL CRL retrieved from URL to
+   the cached CRL of the issuer ISSUER_HASH.  BASE_NUMBER is the
+   BaseCRLNumber from the delta CRL.  The items of the cached CRL are
+   imported into DB, where the items of the delta CRL have already
+   been stored.  On success the URL of the full CRL is stored at R_URL
+   and the URL for delta CRLs at R_DELTA_URL.  */
+static gpg_error_t
+apply_delta_crl (crl_cache_t cache, ksba_crl_t crl, crltable_make_t db,
+                 const char *issuer_hash, const char *base_number,
+                 const char *url, char **r_url, char **r_delta_url)
+{
+  gpg_error_t err;
+  crl_cache_entry_t e;
+  crltable_t tbl;
+  char *number;
+
+  *r_url = *r_delta_url = NULL;
+
+  e = find_entry (cache->entries, issuer_hash);
+  if (!e || e->invalid)
+    {
+      log_info ("no usable CRL to apply the delta CRL to\n");
+      return gpg_error (GPG_ERR_NO_CRL_KNOWN);
+    }
+  if (!e->crl_number || !*base_number
+      || compare_hex_numbers (e->crl_number, base_number) < 0)
+    {
+      log_info ("delta CRL does not match the cached CRL\n");
+      return gpg_error (GPG_ERR_NO_CRL_KNOWN);
+    }
+  number = get_crl_number (crl);
+  if (!number || compare_hex_numbers (number, e->crl_number) <= 0)
+    {
+      log_info ("delta CRL is not newer than the cached CRL\n");
+      xfree (number);
+      return gpg_error (GPG_ERR_NO_CRL_KNOWN);
+    }
+  xfree (number);
+
+  tbl = lock_db_file (cache, e);
+  if (!tbl)
+    return gpg_error (GPG_ERR_NO_CRL_KNOWN);
+  if (!e->dbfile_checked)
+    {
+      log_error (_("cached CRL for issuer id %s tampered; we need to update\n")
+                 , issuer_hash);
+      unlock_db_file (cache, e);
+      return gpg_error (GPG_ERR_NO_CRL_KNOWN);
+    }
+  err = crltable_make_import (db, tbl);
+  unlock_db_file (cache, e);
+  if (err)
+    return err;
+
+  *r_url = xtrystrdup (e->url);
+  *r_delta_url = xtrystrdup (e->delta_url? e->delta_url : url);
+  if (!*r_url || !*r_delta_url)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (*r_url);
+      xfree (*r_delta_url);
+      *r_url = *r_delta_url = NULL;
+      return err;
+    }
+  if (opt.verbose)
+    log_info ("applying delta CRL to the CRL from '%s'\n", *r_url);
+  return 0;
+}
+
+
 
 /* Insert the CRL retrieved using URL into the cache specified by
    CACHE.  The CRL itself will be read from the stream FP and is
-   expected in binary format.
+   expected in binary format.  A delta CRL is merged with the cached
+   CRL of its issuer; it is an error if there is no matching one.
 
    Called by:
       crl_cache_load
@@ -1981,8 +2118,8 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
   ksba_crl_t crl;
   char *fname = NULL;
   char *newfname = NULL;
-  struct cdb_make cdb;
-  int fd_cdb = -1;
+  crltable_make_t db = NULL;
+  int fd_db = -1;
   char *issuer = NULL;
   char *issuer_hash = NULL;
   ksba_isotime_t thisupdate, nextupdate;
@@ -1995,6 +2132,9 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
   const char *oid;
   int critical;
   char *trust_anchor = NULL;
+  char *delta_base = NULL;
+  char *base_url = NULL;
+  char *delta_url = NULL;
 
   /* FIXME: We should acquire a mutex for the URL, so that we don't
      simultaneously enter the same CRL twice.  However this needs to be
@@ -2056,55 +2196,65 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
       }
   }
 
-  fd_cdb = open (fname, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
-  if (fd_cdb == -1)
+  fd_db = open (fname, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+  if (fd_db == -1)
     {
       err = gpg_error_from_errno (errno);
       log_error (_("error creating temporary cache file '%s': %s\n"),
                  fname, strerror (errno));
       goto leave;
     }
-  cdb_make_start(&cdb, fd_cdb);
+  err = crltable_make_start (&db);
+  if (err)
+    goto leave;
 
-  err = crl_parse_insert (ctrl, crl, &cdb, fname,
+  err = crl_parse_insert (ctrl, crl, db, fname,
                           &issuer, thisupdate, nextupdate, &trust_anchor);
   if (err)
     {
       log_error (_("crl_parse_insert failed: %s\n"), gpg_strerror (err));
-      /* Error in cleanup ignored.  */
-      cdb_make_finish (&cdb);
       goto leave;
     }
 
-  /* Finish the database. */
-  if (cdb_make_finish (&cdb))
-    {
-      err = gpg_error_from_errno (errno);
-      log_error (_("error finishing temporary cache file '%s': %s\n"),
-                 fname, strerror (errno));
-      goto leave;
-    }
-  if (close (fd_cdb))
+  /* Create an hex encoded SHA-1 hash of the issuer DN to be
+     used as the key for the cache. */
+  issuer_hash = hashify_data (issuer, strlen (issuer));
+
+  /* A delta CRL only lists the changes since a full CRL; we merge it
+     with the cached CRL.  A full CRL may tell us where to get delta
+     CRLs for it.  */
+  delta_base = get_delta_crl_base (crl);
+  if (delta_base)
     {
-      err = gpg_error_from_errno (errno);
-      log_error (_("error closing temporary cache file '%s': %s\n"),
-                 fname, strerror (errno));
-      goto leave;
+      err = apply_delta_crl (cache, crl, db, issuer_hash, delta_base, url,
+                             &base_url, &delta_url);
+      if (err)
+        goto leave;
     }
-  fd_cdb = -1;
-
+  else
+    delta_url = get_delta_crl_url (crl);
 
-  /* Create a checksum. */
+  /* Finish the database and create a checksum. */
   {
     unsigned char md5buf[16];
 
-    if (hash_dbfile (fname, md5buf))
+    err = crltable_make_finish (db, fd_db, md5buf);
+    if (err)
       {
-        err = gpg_error (GPG_ERR_CHECKSUM);
+        log_error (_("error finishing temporary cache file '%s': %s\n"),
+                   fname, gpg_strerror (err));
         goto leave;
       }
     checksum = hexify_data (md5buf, 16, 0);
   }
+  if (close (fd_db))
+    {
+      err = gpg_error_from_errno (errno);
+      log_error (_("error closing temporary cache file '%s': %s\n"),
+                 fname, strerror (errno));
+      goto leave;
+    }
+  fd_db = -1;
 
 
   /* Check whether that new CRL is still not expired. */
@@ -2130,7 +2280,8 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
     {
       if (!critical
           || !strcmp (oid, oidstr_authorityKeyIdentifier)
-          || !strcmp (oid, oidstr_crlNumber) )
+          || !strcmp (oid, oidstr_crlNumber)
+          || !strcmp (oid, oidstr_deltaCRLIndicator))
         continue;
       log_error (_("unknown critical CRL extension %s\n"), oid);
       if (!err2)
@@ -2147,11 +2298,10 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
     }
 
 
-  /* Create an hex encoded SHA-1 hash of the issuer DN to be
-     used as the key for the cache. */
-  issuer_hash = hashify_data (issuer, strlen (issuer));
-
-  /* Create an ENTRY. */
+  /* Create an ENTRY.  For a delta CRL we keep the URL of the full
+     CRL.  */
+  if (base_url)
+    url = base_url;
   entry = xtrycalloc (1, sizeof *entry);
   if (!entry)
     {
@@ -2183,12 +2333,21 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
   entry->user_trust_req = !!trust_anchor;
   entry->check_trust_anchor = trust_anchor;
   trust_anchor = NULL;
+  entry->delta_url = delta_url;
+  delta_url = NULL;
 
   /* Check whether we already have an entry for this issuer and mark
      it as deleted. We better use a loop, just in case duplicates got
      somehow into the list. */
   for (e = cache->entries; (e=find_entry (e, entry->issuer_hash)); e = e->next)
-    e->deleted = 1;
+    {
+      e->deleted = 1;
+      /* Keep the usage info for the background refresh.  */
+      if (e->last_used > entry->last_used)
+        entry->last_used = e->last_used;
+      if (e->last_prefetch > entry->last_prefetch)
+        entry->last_prefetch = e->last_prefetch;
+    }
 
   /* Rename the temporary DB to the real name. */
   newfname = make_db_file_name (entry->issuer_hash);
@@ -2203,16 +2362,11 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
       {
         any = 0;
         for (e = cache->entries; e; e = e->next)
-          if (!e->cdb_use_count && e->cdb
+          if (!e->db_use_count && e->db
               && !strcmp (e->issuer_hash, entry->issuer_hash))
             {
-              int fd = cdb_fileno (e->cdb);
-              cdb_free (e->cdb);
-              xfree (e->cdb);
-              e->cdb = NULL;
-              if (close (fd))
-                log_error (_("error closing cache file: %s\n"),
-                           strerror(errno));
+              crltable_close (e->db);
+              e->db = NULL;
               any = 1;
               break;
             }
@@ -2247,8 +2401,9 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
 
  leave:
   release_one_cache_entry (entry);
-  if (fd_cdb != -1)
-    close (fd_cdb);
+  crltable_make_release (db);
+  if (fd_db != -1)
+    close (fd_db);
   if (fname)
     {
       gnupg_remove (fname);
@@ -2260,6 +2415,9 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
   xfree (issuer_hash);
   xfree (checksum);
   xfree (trust_anchor);
+  xfree (delta_base);
+  xfree (base_url);
+  xfree (delta_url);
   return err ? err : err2;
 }
 
@@ -2269,10 +2427,9 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
 static gpg_error_t
 list_one_crl_entry (crl_cache_t cache, crl_cache_entry_t e, estream_t fp)
 {
-  struct cdb_find cdbfp;
-  struct cdb *cdb;
-  int rc;
-  int warn = 0;
+  crltable_t db;
+  gpg_error_t err;
+  unsigned int idx;
   const unsigned char *s;
 
   es_fputs ("--------------------------------------------------------\n", fp );
@@ -2297,6 +2454,7 @@ list_one_crl_entry (crl_cache_t cache, crl_cache_entry_t e, estream_t fp)
   es_fprintf (fp, " Trust Check:\t%s\n",
               !e->user_trust_req? "[system]" :
               e->check_trust_anchor? e->check_trust_anchor:"[missing]");
+  es_fprintf (fp, " Delta CRLs :\t%s\n", e->delta_url? e->delta_url:"none");
 
   if ((e->invalid & 1))
     es_fprintf (fp, _(" ERROR: The CRL will not be used "
@@ -2307,8 +2465,8 @@ list_one_crl_entry (crl_cache_t cache, crl_cache_entry_t e, estream_t fp)
   if ((e->invalid & ~3))
     es_fprintf (fp, _(" ERROR: The CRL will not be used\n"));
 
-  cdb = lock_db_file (cache, e);
-  if (!cdb)
+  db = lock_db_file (cache, e);
+  if (!db)
     return gpg_error (GPG_ERR_GENERAL);
 
   if (!e->dbfile_checked)
@@ -2316,42 +2474,23 @@ list_one_crl_entry (crl_cache_t cache, crl_cache_entry_t e, estream_t fp)
 
   es_putc ('\n', fp);
 
-  rc = cdb_findinit (&cdbfp, cdb, NULL, 0);
-  while (!rc && (rc=cdb_findnext (&cdbfp)) > 0 )
+  for (idx = 0; ; idx++)
     {
-      unsigned char keyrecord[256];
-      unsigned char record[16];
+      const unsigned char *keyrecord;
+      const unsigned char *record;
       int reason;
       int any = 0;
-      cdbi_t n;
-      cdbi_t i;
-
-      rc = 0;
-      n = cdb_datalen (cdb);
-      if (n != 16)
-        {
-          log_error (_(" WARNING: invalid cache record length\n"));
-          warn = 1;
-          continue;
-        }
+      size_t n;
+      size_t i;
 
-      if (cdb_read (cdb, record, n, cdb_datapos (cdb)))
+      err = crltable_get (db, idx, &keyrecord, &n, &record);
+      if (gpg_err_code (err) == GPG_ERR_EOF)
         {
-          log_error (_("problem reading cache record: %s\n"),
-                     strerror (errno));
-          warn = 1;
-          continue;
-        }
-
-      n = cdb_keylen (cdb);
-      if (n > sizeof keyrecord)
-        n = sizeof keyrecord;
-      if (cdb_read (cdb, keyrecord, n, cdb_keypos (cdb)))
-        {
-          log_error (_("problem reading cache key: %s\n"), strerror (errno));
-          warn = 1;
-          continue;
+          err = 0;
+          break;
         }
+      if (err)
+        break;
 
       reason = *record;
       es_fputs ("  ", fp);
@@ -2378,14 +2517,15 @@ list_one_crl_entry (crl_cache_t cache, crl_cache_entry_t e, estream_t fp)
 
       es_fprintf (fp, ") rdate: %.15s\n", record+1);
     }
-  if (rc)
-    log_error (_("error reading cache entry from db: %s\n"), strerror (rc));
+  if (err)
+    log_error (_("error reading cache entry from db: %s\n"),
+               gpg_strerror (err));
 
   unlock_db_file (cache, e);
   es_fprintf (fp, _("End CRL dump\n") );
   es_putc ('\n', fp);
 
-  return (rc||warn)? gpg_error (GPG_ERR_GENERAL) : 0;
+  return err? gpg_error (GPG_ERR_GENERAL) : 0;
 }
 
 
@@ -2434,6 +2574,96 @@ crl_cache_load (ctrl_t ctrl, const char *filename)
 }
 
 
+/* Fetch the CRL from URL and store it in the cache.  */
+static gpg_error_t
+fetch_and_insert_crl (ctrl_t ctrl, const char *url)
+{
+  gpg_error_t err;
+  ksba_reader_t reader;
+
+  err = crl_fetch (ctrl, url, &reader);
+  if (err)
+    {
+      log_info (_("fetching CRL from '%s' failed: %s\n"),
+                url, gpg_strerror (err));
+      return err;
+    }
+  err = crl_cache_insert (ctrl, url, reader);
+  if (err)
+    log_info (_("processing CRL from '%s' failed: %s\n"),
+              url, gpg_strerror (err));
+  crl_close_reader (reader);
+  return err;
+}
+
+
+/* Refresh the CRLs which are about to expire.  This is called by the
+   housekeeping thread with CURTIME being the current time so that
+   only few validations need to wait for a CRL download.  Only CRLs
+   which have recently been used are considered.  */
+void
+crl_cache_housekeeping (ctrl_t ctrl, time_t curtime)
+{
+  crl_cache_t cache;
+  crl_cache_entry_t e;
+  gnupg_isotime_t threshold;
+  strlist_t urls = NULL;
+  strlist_t sl;
+
+  if (!current_cache)
+    return;
+  cache = current_cache;
+
+  epoch2isotime (threshold, curtime + CRL_PREFETCH_LEAD);
+  if (!*threshold)
+    return;
+
+  /* First collect the URLs so that we don't need to care about
+   * changes of the cache while we are fetching.  */
+  for (e = cache->entries; e; e = e->next)
+    {
+      if (e->deleted || !e->url || !strstr (e->url, "://")
+          || !e->last_used || e->last_used + CRL_PREFETCH_USED < curtime
+          || (e->last_prefetch
+              && e->last_prefetch + CRL_PREFETCH_RETRY > curtime)
+          || strcmp (e->next_update, threshold) > 0)
+        continue;
+      e->last_prefetch = curtime;
+      /* The list is built in reverse order; thus we add the URL of
+       * the full CRL first and flag it if it shall only be used after
+       * a failure of the delta CRL.  */
+      sl = add_to_strlist_try (&urls, e->url);
+      if (sl && e->delta_url && !e->invalid)
+        {
+          sl->flags = 1;
+          sl = add_to_strlist_try (&urls, e->delta_url);
+        }
+      if (!sl)
+        {
+          log_error ("error refreshing CRLs: %s\n",
+                     gpg_strerror (gpg_error_from_syserror ()));
+          break;
+        }
+    }
+
+  for (sl = urls; sl; sl = sl->next)
+    {
+      unsigned long started;
+      gpg_error_t err;
+
+      if (opt.verbose)
+        log_info ("refreshing CRL from '%s'\n", sl->d);
+      started = dirmngr_stats_clock ();
+      err = fetch_and_insert_crl (ctrl, sl->d);
+      dirmngr_stats_update (DIRMNGR_STATS_CRL, started, err);
+      if (!err && sl->next && sl->next->flags)
+        sl = sl->next; /* Delta CRL applied; skip the full CRL.  */
+    }
+
+  free_strlist (urls);
+}
+
+
 /* Locate the corresponding CRL for the certificate CERT, read and
    verify the CRL and store it in the cache.  */
 gpg_error_t
@@ -2448,6 +2678,34 @@ crl_cache_reload_crl (ctrl_t ctrl, ksba_cert_t cert)
   char *issuername_uri = NULL;
   int any_dist_point = 0;
   int seq;
+  unsigned long started = dirmngr_stats_clock ();
+
+  /* If delta CRLs are published for the CRL we have cached, try to
+     update it that way first.  */
+  issuer = ksba_cert_get_issuer (cert, 0);
+  if (issuer)
+    {
+      char *issuer_hash = hashify_data (issuer, strlen (issuer));
+      crl_cache_entry_t e;
+      char *delta_url = NULL;
+
+      e = issuer_hash? find_entry (get_current_cache ()->entries,
+                                   issuer_hash) : NULL;
+      if (e && e->delta_url && !e->invalid)
+        delta_url = xtrystrdup (e->delta_url);
+      xfree (issuer_hash);
+      ksba_free (issuer);
+      issuer = NULL;
+      if (delta_url)
+        {
+          if (opt.verbose)
+            log_info ("fetching delta CRL from '%s'\n", delta_url);
+          err = fetch_and_insert_crl (ctrl, delta_url);
+          xfree (delta_url);
+          if (!err)
+            goto leave;
+        }
+    }
 
   /* Loop over all distribution points, get the CRLs and put them into
      the cache. */
@@ -2587,5 +2845,6 @@ crl_cache_reload_crl (ctrl_t ctrl, ksba_cert_t cert)
   ksba_name_release (distpoint);
   ksba_name_release (issuername);
   ksba_free (issuer);
+  dirmngr_stats_update (DIRMNGR_STATS_CRL, started, err);
   return err;
 }
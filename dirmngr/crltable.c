@@ -0,0 +1,677 @@
+/* crltable.c - Sorted table of revoked serial numbers
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* A CRL table is a file with the revoked serial numbers of one CRL,
+   sorted so that a lookup is a binary search in the memory mapped
+   file.  The file consists of pages of CRLTABLE_PAGESIZE bytes:
+
+   Page 0 is the header:
+
+      8 bytes  Magic "GnuPGCRL"
+      1 byte   Version of the format, currently 1.
+      1 byte   KEYWIDTH: the length of the longest serial number.
+      2 bytes  RECSIZE: the length of a record; that is
+               1 + KEYWIDTH + CRLTABLE_VALUELEN.
+      4 bytes  The page size.
+      4 bytes  The number of records.
+      4 bytes  NPAGES: the number of data pages.
+
+      The rest of the page is zero.  All integers are big endian.
+
+   The header is followed by a table with the CRC-32 of each data
+   page (4 bytes each), padded with zeroes to a page boundary.
+
+   The data pages follow the checksum table.  Each holds
+   CRLTABLE_PAGESIZE / RECSIZE records with this structure:
+
+      1 byte   Length of the serial number.
+      n bytes  Serial number, right-padded with zeroes to KEYWIDTH.
+      16 bytes The value (the reason and the 15 byte ISO revocation
+               date; see crlcache.c).
+
+   Records do not cross page boundaries; the unused tail of a page is
+   zero.  Records are sorted by memcmp over the first 1 + KEYWIDTH
+   bytes; a serial number thus occurs at most once.
+
+   The MD5 hash over the header and the checksum table identifies the
+   file; it is stored in crlcache's DIR file.  Given that this covers
+   the checksums of all data pages, a data page is verified when it
+   is first accessed and there is no need to hash the whole file when
+   it is opened.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_W32_SYSTEM
+# include <windows.h>
+#else
+# include <sys/mman.h>
+# ifndef MAP_FAILED
+#  define MAP_FAILED ((void*)-1)
+# endif
+#endif
+
+#include "dirmngr.h"
+#include "../common/host2net.h"
+#include "crltable.h"
+
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
+#define CRLTABLE_MAGIC   "GnuPGCRL"
+#define CRLTABLE_VERSION 1
+#define CRLTABLE_PAGESIZE 4096
+
+
+/* Flags of records collected in a crltable_make_t.  */
+#define MKFLAG_DELETE   1  /* Remove the serial number from the table. */
+#define MKFLAG_IMPORTED 2  /* Taken from another table.  */
+
+/* The object used to create a table.  The records are collected in
+   BUFFER in the form FLAGS || LENGTH || SERIALNO || VALUE and are
+   sorted only by crltable_make_finish.  */
+struct crltable_make_s
+{
+  unsigned char *buffer;
+  size_t buflen;
+  size_t bufsize;
+  unsigned int nrecords;
+  unsigned int keywidth;   /* Length of the longest serial number. */
+};
+
+
+/* The object used to read a table.  */
+struct crltable_s
+{
+  int fd;
+#ifdef HAVE_W32_SYSTEM
+  HANDLE mapping;
+#endif
+  const unsigned char *mem;   /* The mapped file.  */
+  size_t memlen;
+  unsigned int keywidth;
+  unsigned int recsize;
+  unsigned int recsperpage;
+  unsigned int nrecords;
+  unsigned int npages;
+  const unsigned char *checksums;  /* Points into MEM.  */
+  const unsigned char *data;       /* Ditto.  */
+  unsigned char *checked;          /* Bit vector with verified pages. */
+  unsigned char key[1 + CRLTABLE_MAXSNLEN];  /* Buffer for lookups.  */
+};
+
+
+static void
+u32tobuf (unsigned char *buffer, u32 value)
+{
+  buffer[0] = value >> 24;
+  buffer[1] = value >> 16;
+  buffer[2] = value >>  8;
+  buffer[3] = value;
+}
+
+
+/* Write LENGTH bytes from BUFFER to FD.  */
+static gpg_error_t
+write_all (int fd, const void *buffer, size_t length)
+{
+  const unsigned char *p = buffer;
+  ssize_t n;
+
+  while (length)
+    {
+      n = write (fd, p, length);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return gpg_error_from_syserror ();
+        }
+      p += n;
+      length -= n;
+    }
+  return 0;
+}
+
+
+/* Create a new object to build a table and store it at R_MK.  */
+gpg_error_t
+crltable_make_start (crltable_make_t *r_mk)
+{
+  *r_mk = xtrycalloc (1, sizeof **r_mk);
+  if (!*r_mk)
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* Release the object MK.  */
+void
+crltable_make_release (crltable_make_t mk)
+{
+  if (!mk)
+    return;
+  xfree (mk->buffer);
+  xfree (mk);
+}
+
+
+/* Append a record to MK.  VALUE may be NULL for MKFLAG_DELETE.  */
+static gpg_error_t
+add_record (crltable_make_t mk, int flags, const void *sn, size_t snlen,
+            const unsigned char *value)
+{
+  size_t needed = 2 + snlen + CRLTABLE_VALUELEN;
+
+  if (snlen > CRLTABLE_MAXSNLEN)
+    return gpg_error (GPG_ERR_TOO_LARGE);
+  if (mk->nrecords == (unsigned int)(-1))
+    return gpg_error (GPG_ERR_TOO_LARGE);
+
+  if (mk->buflen + needed > mk->bufsize)
+    {
+      size_t newsize = mk->bufsize? 2 * mk->bufsize : 65536;
+      unsigned char *p;
+
+      while (newsize < mk->buflen + needed)
+        newsize *= 2;
+      p = xtryrealloc (mk->buffer, newsize);
+      if (!p)
+        return gpg_error_from_syserror ();
+      mk->buffer = p;
+      mk->bufsize = newsize;
+    }
+
+  mk->buffer[mk->buflen] = flags;
+  mk->buffer[mk->buflen + 1] = snlen;
+  memcpy (mk->buffer + mk->buflen + 2, sn, snlen);
+  if (value)
+    memcpy (mk->buffer + mk->buflen + 2 + snlen, value, CRLTABLE_VALUELEN);
+  else
+    memset (mk->buffer + mk->buflen + 2 + snlen, 0, CRLTABLE_VALUELEN);
+  mk->buflen += needed;
+  mk->nrecords++;
+  if (snlen > mk->keywidth)
+    mk->keywidth = snlen;
+  return 0;
+}
+
+
+/* Add the serial number SN of length SNLEN together with the
+   CRLTABLE_VALUELEN bytes at VALUE to MK.  If the serial number has
+   already been added, the latest one is used.  */
+gpg_error_t
+crltable_make_add (crltable_make_t mk, const void *sn, size_t snlen,
+                   const unsigned char *value)
+{
+  return add_record (mk, 0, sn, snlen, value);
+}
+
+
+/* Make sure that the serial number SN of length SNLEN will not be
+   listed in the table created from MK.  Records added or deleted
+   later override this.  */
+gpg_error_t
+crltable_make_del (crltable_make_t mk, const void *sn, size_t snlen)
+{
+  return add_record (mk, MKFLAG_DELETE, sn, snlen, NULL);
+}
+
+
+/* Add all records of the table TBL to MK.  These records have a lower
+   precedence than those given to crltable_make_add or
+   crltable_make_del, regardless of the order of the calls.  This is
+   used to apply a delta CRL to a cached CRL.  */
+gpg_error_t
+crltable_make_import (crltable_make_t mk, crltable_t tbl)
+{
+  gpg_error_t err;
+  const unsigned char *sn, *value;
+  size_t snlen;
+  unsigned int idx;
+
+  for (idx = 0; !(err = crltable_get (tbl, idx, &sn, &snlen, &value)); idx++)
+    {
+      err = add_record (mk, MKFLAG_IMPORTED, sn, snlen, value);
+      if (err)
+        return err;
+    }
+  return gpg_err_code (err) == GPG_ERR_EOF? 0 : err;
+}
+
+
+/* The length of the sort key for compare_records.  This is set right
+   before calling qsort; qsort does not yield to other threads.  The
+   sort key consists of the record's key, a precedence byte and the
+   sequence number so that the sort is stable.  */
+static size_t sort_keylen;
+
+static int
+compare_records (const void *a, const void *b)
+{
+  return memcmp (a, b, sort_keylen);
+}
+
+
+/* Sort the records collected in MK and write the table to the file
+   FD which must be open for writing at offset 0.  On success the MD5
+   hash identifying the table is stored at R_MD5 which must provide
+   16 bytes.  MK may be released after this call.  */
+gpg_error_t
+crltable_make_finish (crltable_make_t mk, int fd, unsigned char *r_md5)
+{
+  gpg_error_t err;
+  unsigned char *records = NULL;
+  unsigned char *header = NULL;
+  unsigned char *checksums = NULL;
+  unsigned char *page = NULL;
+  size_t recsize, keylen, chksumslen, off;
+  unsigned int recsperpage, npages, nrecords, i, pageno;
+  gcry_md_hd_t md5 = NULL;
+  const unsigned char *s;
+  unsigned char *d;
+  size_t wrecsize;
+
+  keylen = 1 + mk->keywidth;
+  recsize = keylen + CRLTABLE_VALUELEN;
+  recsperpage = CRLTABLE_PAGESIZE / recsize;
+
+  /* Convert the collected records into fixed length working records
+   * of the form KEY || PRECEDENCE || SEQNO || FLAGS || VALUE.  */
+  wrecsize = keylen + 1 + 4 + 1 + CRLTABLE_VALUELEN;
+  if (mk->nrecords)
+    {
+      records = xtrycalloc (mk->nrecords, wrecsize);
+      if (!records)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+  for (s = mk->buffer, d = records, i = 0; i < mk->nrecords; i++)
+    {
+      d[0] = s[1];
+      memcpy (d + 1, s + 2, s[1]);
+      d[keylen] = (s[0] & MKFLAG_IMPORTED)? 0 : 1;
+      u32tobuf (d + keylen + 1, i);
+      d[keylen + 5] = s[0];
+      memcpy (d + keylen + 6, s + 2 + s[1], CRLTABLE_VALUELEN);
+      s += 2 + s[1] + CRLTABLE_VALUELEN;
+      d += wrecsize;
+    }
+  xfree (mk->buffer);
+  mk->buffer = NULL;
+  mk->buflen = mk->bufsize = 0;
+
+  sort_keylen = keylen + 5;
+  if (mk->nrecords > 1)
+    qsort (records, mk->nrecords, wrecsize, compare_records);
+
+  /* Keep only the last record of each key, drop deleted ones, and
+   * compact them into the final record format.  */
+  nrecords = 0;
+  for (i = 0; i < mk->nrecords; i++)
+    {
+      s = records + i * wrecsize;
+      if (i + 1 < mk->nrecords && !memcmp (s, s + wrecsize, keylen))
+        continue;  /* Superseded by the next one.  */
+      if ((s[keylen + 5] & MKFLAG_DELETE))
+        continue;
+      d = records + nrecords * recsize;
+      memmove (d, s, keylen);
+      memmove (d + keylen, s + keylen + 6, CRLTABLE_VALUELEN);
+      nrecords++;
+    }
+
+  npages = (nrecords + recsperpage - 1) / recsperpage;
+  chksumslen = ((npages * 4 + CRLTABLE_PAGESIZE - 1)
+                / CRLTABLE_PAGESIZE) * CRLTABLE_PAGESIZE;
+
+  header = xtrycalloc (1, CRLTABLE_PAGESIZE);
+  checksums = chksumslen? xtrycalloc (1, chksumslen) : NULL;
+  page = xtrymalloc (CRLTABLE_PAGESIZE);
+  if (!header || (chksumslen && !checksums) || !page)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  memcpy (header, CRLTABLE_MAGIC, 8);
+  header[8] = CRLTABLE_VERSION;
+  header[9] = mk->keywidth;
+  header[10] = recsize >> 8;
+  header[11] = recsize;
+  u32tobuf (header + 12, CRLTABLE_PAGESIZE);
+  u32tobuf (header + 16, nrecords);
+  u32tobuf (header + 20, npages);
+
+  /* Write the data pages behind the space reserved for the header and
+   * the checksum table.  */
+  if (lseek (fd, CRLTABLE_PAGESIZE + chksumslen, SEEK_SET) == (off_t)(-1))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (pageno = 0, off = 0; pageno < npages; pageno++)
+    {
+      unsigned int n = nrecords - pageno * recsperpage;
+
+      if (n > recsperpage)
+        n = recsperpage;
+      memset (page, 0, CRLTABLE_PAGESIZE);
+      memcpy (page, records + off, n * recsize);
+      off += n * recsize;
+      gcry_md_hash_buffer (GCRY_MD_CRC32, checksums + 4 * pageno,
+                           page, CRLTABLE_PAGESIZE);
+      err = write_all (fd, page, CRLTABLE_PAGESIZE);
+      if (err)
+        goto leave;
+    }
+
+  /* Now write the header and the checksums.  */
+  if (lseek (fd, 0, SEEK_SET) == (off_t)(-1))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  err = write_all (fd, header, CRLTABLE_PAGESIZE);
+  if (!err && chksumslen)
+    err = write_all (fd, checksums, chksumslen);
+  if (err)
+    goto leave;
+
+  err = gcry_md_open (&md5, GCRY_MD_MD5, 0);
+  if (err)
+    goto leave;
+  gcry_md_write (md5, header, CRLTABLE_PAGESIZE);
+  if (chksumslen)
+    gcry_md_write (md5, checksums, chksumslen);
+  memcpy (r_md5, gcry_md_read (md5, GCRY_MD_MD5), 16);
+
+ leave:
+  gcry_md_close (md5);
+  xfree (page);
+  xfree (checksums);
+  xfree (header);
+  xfree (records);
+  return err;
+}
+
+
+/* Release the table TBL.  This also closes the file.  */
+void
+crltable_close (crltable_t tbl)
+{
+  if (!tbl)
+    return;
+  if (tbl->mem)
+    {
+#ifdef HAVE_W32_SYSTEM
+      UnmapViewOfFile ((void*)tbl->mem);
+      CloseHandle (tbl->mapping);
+#else
+      munmap ((void*)tbl->mem, tbl->memlen);
+#endif
+    }
+  if (tbl->fd != -1 && close (tbl->fd))
+    log_error (_("error closing cache file: %s\n"), strerror (errno));
+  xfree (tbl->checked);
+  xfree (tbl);
+}
+
+
+/* Map the table file FNAME into memory and store a handle at R_TBL.
+   Only the header is checked; the MD5 hash identifying the table is
+   stored at R_MD5 which must provide 16 bytes.  It is up to the
+   caller to compare that to the expected value.  */
+gpg_error_t
+crltable_open (const char *fname, crltable_t *r_tbl, unsigned char *r_md5)
+{
+  gpg_error_t err;
+  crltable_t tbl;
+  struct stat st;
+  const unsigned char *h;
+  size_t chksumslen;
+  unsigned int pagesize;
+
+  *r_tbl = NULL;
+
+  tbl = xtrycalloc (1, sizeof *tbl);
+  if (!tbl)
+    return gpg_error_from_syserror ();
+
+  tbl->fd = open (fname, O_RDONLY | O_BINARY);
+  if (tbl->fd == -1)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fstat (tbl->fd, &st))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (st.st_size < CRLTABLE_PAGESIZE
+      || (st.st_size % CRLTABLE_PAGESIZE)
+      || (unsigned long long)st.st_size > (size_t)(-1))
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      goto leave;
+    }
+  tbl->memlen = st.st_size;
+
+#ifdef HAVE_W32_SYSTEM
+  {
+    HANDLE hfile = (HANDLE) _get_osfhandle (tbl->fd);
+
+    if (hfile == (HANDLE) -1)
+      {
+        err = gpg_error (GPG_ERR_EIO);
+        goto leave;
+      }
+    tbl->mapping = CreateFileMapping (hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!tbl->mapping)
+      {
+        err = gpg_error (GPG_ERR_EIO);
+        goto leave;
+      }
+    tbl->mem = MapViewOfFile (tbl->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!tbl->mem)
+      {
+        CloseHandle (tbl->mapping);
+        err = gpg_error (GPG_ERR_EIO);
+        goto leave;
+      }
+  }
+#else
+  tbl->mem = mmap (NULL, tbl->memlen, PROT_READ, MAP_SHARED, tbl->fd, 0);
+  if (tbl->mem == MAP_FAILED)
+    {
+      tbl->mem = NULL;
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+#endif
+
+  h = tbl->mem;
+  if (memcmp (h, CRLTABLE_MAGIC, 8))
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      goto leave;
+    }
+  if (h[8] != CRLTABLE_VERSION)
+    {
+      err = gpg_error (GPG_ERR_UNKNOWN_VERSION);
+      goto leave;
+    }
+  tbl->keywidth = h[9];
+  tbl->recsize = buf16_to_uint (h + 10);
+  pagesize = buf32_to_uint (h + 12);
+  tbl->nrecords = buf32_to_uint (h + 16);
+  tbl->npages = buf32_to_uint (h + 20);
+  if (pagesize != CRLTABLE_PAGESIZE
+      || tbl->recsize != 1 + tbl->keywidth + CRLTABLE_VALUELEN)
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      goto leave;
+    }
+  tbl->recsperpage = CRLTABLE_PAGESIZE / tbl->recsize;
+  chksumslen = ((tbl->npages * (size_t)4 + CRLTABLE_PAGESIZE - 1)
+                / CRLTABLE_PAGESIZE) * CRLTABLE_PAGESIZE;
+  if (tbl->memlen != (CRLTABLE_PAGESIZE + chksumslen
+                      + tbl->npages * (size_t)CRLTABLE_PAGESIZE)
+      || tbl->nrecords > tbl->npages * (size_t)tbl->recsperpage
+      || (tbl->npages
+          && tbl->nrecords <= (tbl->npages - 1) * (size_t)tbl->recsperpage))
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      goto leave;
+    }
+  tbl->checksums = tbl->mem + CRLTABLE_PAGESIZE;
+  tbl->data = tbl->checksums + chksumslen;
+
+  tbl->checked = xtrycalloc (1, (tbl->npages + 7) / 8 + 1);
+  if (!tbl->checked)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  {
+    gcry_md_hd_t md5;
+
+    err = gcry_md_open (&md5, GCRY_MD_MD5, 0);
+    if (err)
+      goto leave;
+    gcry_md_write (md5, tbl->mem, CRLTABLE_PAGESIZE + chksumslen);
+    memcpy (r_md5, gcry_md_read (md5, GCRY_MD_MD5), 16);
+    gcry_md_close (md5);
+  }
+
+ leave:
+  if (err)
+    crltable_close (tbl);
+  else
+    *r_tbl = tbl;
+  return err;
+}
+
+
+/* Return a pointer to record IDX of TBL at R_REC.  The page holding
+   the record is verified on first access.  */
+static gpg_error_t
+get_record (crltable_t tbl, unsigned int idx, const unsigned char **r_rec)
+{
+  unsigned int pageno = idx / tbl->recsperpage;
+  const unsigned char *page = tbl->data + pageno * (size_t)CRLTABLE_PAGESIZE;
+
+  if (!(tbl->checked[pageno / 8] & (1 << (pageno % 8))))
+    {
+      unsigned char crc[4];
+
+      gcry_md_hash_buffer (GCRY_MD_CRC32, crc, page, CRLTABLE_PAGESIZE);
+      if (memcmp (crc, tbl->checksums + 4 * pageno, 4))
+        {
+          log_error ("checksum mismatch in page %u of CRL table\n", pageno);
+          return gpg_error (GPG_ERR_CHECKSUM);
+        }
+      tbl->checked[pageno / 8] |= (1 << (pageno % 8));
+    }
+
+  *r_rec = page + (idx % tbl->recsperpage) * tbl->recsize;
+  return 0;
+}
+
+
+/* Look up the serial number SN of length SNLEN in TBL.  If it is
+   listed, a pointer to its CRLTABLE_VALUELEN bytes of value is stored
+   at R_VALUE and 0 is returned.  GPG_ERR_NOT_FOUND is returned if
+   the serial number is not listed.  */
+gpg_error_t
+crltable_find (crltable_t tbl, const void *sn, size_t snlen,
+               const unsigned char **r_value)
+{
+  gpg_error_t err;
+  size_t keylen = 1 + tbl->keywidth;
+  unsigned int lo, hi, mid;
+  const unsigned char *rec;
+  int cmp;
+
+  *r_value = NULL;
+  if (snlen > tbl->keywidth)
+    return gpg_error (GPG_ERR_NOT_FOUND); /* Longer than all entries.  */
+
+  memset (tbl->key, 0, keylen);
+  tbl->key[0] = snlen;
+  memcpy (tbl->key + 1, sn, snlen);
+
+  lo = 0;
+  hi = tbl->nrecords;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      err = get_record (tbl, mid, &rec);
+      if (err)
+        return err;
+      cmp = memcmp (tbl->key, rec, keylen);
+      if (!cmp)
+        {
+          *r_value = rec + keylen;
+          return 0;
+        }
+      if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return gpg_error (GPG_ERR_NOT_FOUND);
+}
+
+
+/* Return the serial number and the value of record IDX of TBL.  The
+   returned pointers are valid until TBL is closed.  Returns
+   GPG_ERR_EOF if there is no such record.  */
+gpg_error_t
+crltable_get (crltable_t tbl, unsigned int idx,
+              const unsigned char **r_sn, size_t *r_snlen,
+              const unsigned char **r_value)
+{
+  gpg_error_t err;
+  const unsigned char *rec;
+
+  if (idx >= tbl->nrecords)
+    return gpg_error (GPG_ERR_EOF);
+  err = get_record (tbl, idx, &rec);
+  if (err)
+    return err;
+  if (rec[0] > tbl->keywidth)
+    return gpg_error (GPG_ERR_INV_OBJ);
+  *r_sn = rec + 1;
+  *r_snlen = rec[0];
+  *r_value = rec + 1 + tbl->keywidth;
+  return 0;
+}
@@ -0,0 +1,59 @@
+/* crltable.h - Sorted table of revoked serial numbers
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRLTABLE_H
+#define CRLTABLE_H
+
+/* The length of the value stored along with each serial number: One
+   byte with the reason and the 15 byte ISO time of the revocation. */
+#define CRLTABLE_VALUELEN 16
+
+/* The maximum length of a serial number.  */
+#define CRLTABLE_MAXSNLEN 255
+
+/* Handle for reading a table.  */
+struct crltable_s;
+typedef struct crltable_s *crltable_t;
+
+/* Handle for creating a table.  */
+struct crltable_make_s;
+typedef struct crltable_make_s *crltable_make_t;
+
+
+gpg_error_t crltable_make_start (crltable_make_t *r_mk);
+gpg_error_t crltable_make_add (crltable_make_t mk,
+                               const void *sn, size_t snlen,
+                               const unsigned char *value);
+gpg_error_t crltable_make_del (crltable_make_t mk,
+                               const void *sn, size_t snlen);
+gpg_error_t crltable_make_import (crltable_make_t mk, crltable_t tbl);
+gpg_error_t crltable_make_finish (crltable_make_t mk, int fd,
+                                  unsigned char *r_md5);
+void crltable_make_release (crltable_make_t mk);
+
+gpg_error_t crltable_open (const char *fname, crltable_t *r_tbl,
+                           unsigned char *r_md5);
+void crltable_close (crltable_t tbl);
+gpg_error_t crltable_find (crltable_t tbl, const void *sn, size_t snlen,
+                           const unsigned char **r_value);
+gpg_error_t crltable_get (crltable_t tbl, unsigned int idx,
+                          const unsigned char **r_sn, size_t *r_snlen,
+                          const unsigned char **r_value);
+
+#endif /*CRLTABLE_H*/
@@ -35,5 +35,35 @@ gpg_error_t dirmngr_status_printf (ctrl_t ctrl, const char *keyword,
                                    const char *format,
                                    ...) GPGRT_ATTR_PRINTF(3,4);
 
+/* The operations accounted for by dirmngr_stats_update.  */
+enum dirmngr_stats_ops
+  {
+    DIRMNGR_STATS_HKP,
+    DIRMNGR_STATS_WKD,
+    DIRMNGR_STATS_LDAP,
+    DIRMNGR_STATS_HTTP,
+    DIRMNGR_STATS_OCSP,
+    DIRMNGR_STATS_CRL,
+    DIRMNGR_STATS_DNS,
+    DIRMNGR_STATS_TLS,
+    DIRMNGR_STATS_LAST_OP
+  };
+
+/* The caches accounted for by dirmngr_stats_cache.  */
+enum dirmngr_stats_caches
+  {
+    DIRMNGR_CACHE_KS,
+    DIRMNGR_CACHE_CERT,
+    DIRMNGR_CACHE_CRL,
+    DIRMNGR_CACHE_DNS,
+    DIRMNGR_CACHE_OCSP,
+    DIRMNGR_CACHE_LAST
+  };
+
+unsigned long dirmngr_stats_clock (void);
+void dirmngr_stats_update (enum dirmngr_stats_ops op, unsigned long started,
+                           gpg_error_t err);
+void dirmngr_stats_cache (enum dirmngr_stats_caches cache, int hit);
+
 
 #endif /* DIRMNGR_STATUS_H */
@@ -63,6 +63,7 @@
 #include "certcache.h"
 #include "crlcache.h"
 #include "crlfetch.h"
+#include "ocsp.h"
 #include "misc.h"
 #if USE_LDAP
 # include "ldapserver.h"
@@ -70,11 +71,15 @@
 #include "../common/asshelp.h"
 #if USE_LDAP
 # include "ldap-wrapper.h"
+# include "ldap-pool.h"
 #endif
 #include "../common/init.h"
+#include "../common/workpool.h"
+#include "../common/asynclog.h"
 #include "../common/gc-opt-flags.h"
 #include "dns-stuff.h"
 #include "http-common.h"
+#include "ks-action.h"
 
 #ifndef ENAMETOOLONG
 # define ENAMETOOLONG EINVAL
@@ -126,6 +131,7 @@ enum cmd_and_opt_values {
   oLDAPFile,
   oLDAPTimeout,
   oLDAPAddServers,
+  oLDAPInProcess,
   oOCSPResponder,
   oOCSPSigner,
   oOCSPMaxClockSkew,
@@ -141,6 +147,8 @@ enum cmd_and_opt_values {
   oLDAPWrapperProgram,
   oHTTPWrapperProgram,
   oIgnoreCertExtension,
+  oLazyLoadCerts,
+  oPersistTlsSessions,
   oUseTor,
   oNoUseTor,
   oKeyServer,
@@ -151,7 +159,13 @@ enum cmd_and_opt_values {
   oResolverTimeout,
   oConnectTimeout,
   oConnectQuickTimeout,
+  oKeyserverJobs,
+  oKeyserverCacheSize,
+  oKeyserverCacheTTL,
+  oKeyserverCacheNegTTL,
   oListenBacklog,
+  oConnectionThreads,
+  oLogBufferSize,
   aTest
 };
 
@@ -208,11 +222,15 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oAllowVersionCheck, "allow-version-check",
                 N_("allow online software version check")),
   ARGPARSE_s_i (oListenBacklog, "listen-backlog", "@"),
+  ARGPARSE_s_u (oConnectionThreads, "connection-threads", "@"),
+  ARGPARSE_s_u (oLogBufferSize, "log-buffer-size", "@"),
   ARGPARSE_s_i (oMaxReplies, "max-replies",
                 N_("|N|do not return more than N items in one query")),
   ARGPARSE_s_u (oFakedSystemTime, "faked-system-time", "@"), /*(epoch time)*/
   ARGPARSE_s_n (oDisableCheckOwnSocket, "disable-check-own-socket", "@"),
   ARGPARSE_s_s (oIgnoreCertExtension,"ignore-cert-extension", "@"),
+  ARGPARSE_s_n (oLazyLoadCerts, "lazy-load-certs", "@"),
+  ARGPARSE_s_n (oPersistTlsSessions, "persist-tls-sessions", "@"),
 
 
   ARGPARSE_header ("Network", N_("Network related options")),
@@ -227,6 +245,10 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_s (oNameServer, "nameserver", "@"),
   ARGPARSE_s_i (oConnectTimeout, "connect-timeout", "@"),
   ARGPARSE_s_i (oConnectQuickTimeout, "connect-quick-timeout", "@"),
+  ARGPARSE_s_i (oKeyserverJobs, "keyserver-jobs", "@"),
+  ARGPARSE_s_i (oKeyserverCacheSize, "keyserver-cache-size", "@"),
+  ARGPARSE_s_i (oKeyserverCacheTTL, "keyserver-cache-ttl", "@"),
+  ARGPARSE_s_i (oKeyserverCacheNegTTL, "keyserver-cache-negative-ttl", "@"),
 
 
   ARGPARSE_header ("Keyserver", N_("Configuration for Keyservers")),
@@ -264,6 +286,7 @@ static gpgrt_opt_t opts[] = {
                    " points to serverlist")),
   ARGPARSE_s_i (oLDAPTimeout, "ldaptimeout",
                 N_("|N|set LDAP timeout to N seconds")),
+  ARGPARSE_s_n (oLDAPInProcess, "ldap-in-process", "@"),
 
 
   ARGPARSE_header ("OCSP", N_("Configuration for OCSP")),
@@ -322,6 +345,13 @@ static struct debug_flags_s debug_flags [] =
 #define DEFAULT_CONNECT_TIMEOUT       (15*1000)  /* 15 seconds */
 #define DEFAULT_CONNECT_QUICK_TIMEOUT ( 2*1000)  /*  2 seconds */
 
+#define DEFAULT_KS_CACHE_SIZE          64  /* entries */
+#define DEFAULT_KS_CACHE_TTL          300  /* seconds */
+#define DEFAULT_KS_CACHE_NEGATIVE_TTL  60  /* seconds */
+
+/* The name of the file used with --persist-tls-sessions.  */
+#define TLS_SESSIONS_FILE "tls-sessions.dat"
+
 /* For the cleanup handler we need to keep track of the socket's name.  */
 static const char *socket_name;
 /* If the socket has been redirected, this is the name of the
@@ -336,6 +366,18 @@ static assuan_sock_nonce_t socket_nonce;
  * Change at runtime with --listen-backlog.  */
 static int listen_backlog = 64;
 
+/* The maximum number of threads handling connections or 0 to start a
+ * thread for each connection.  Change with --connection-threads.  */
+static unsigned int connection_threads;
+
+/* The pool used with --connection-threads.  */
+static workpool_t connection_pool;
+
+/* The size in KiB of the buffer used to write the log file by a
+ * thread or 0 to write it synchronously.  Change with
+ * --log-buffer-size.  */
+static unsigned int log_buffer_size;
+
 /* Only if this flag has been set will we remove the socket file.  */
 static int cleanup_socket;
 
@@ -405,6 +447,7 @@ static npth_key_t my_tlskey_current_fd;
 
 /* Prototypes. */
 static void cleanup (void);
+static void persist_tls_sessions (int save);
 #if USE_LDAP
 static ldap_server_t parse_ldapserver_file (const char* filename);
 #endif /*USE_LDAP*/
@@ -655,6 +698,9 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
           opt.ocsp_signer = tmp;
         }
       FREE_STRLIST (opt.ignored_cert_extensions);
+      opt.lazy_load_certs = 0;
+      opt.persist_tls_sessions = 0;
+      opt.ldap_in_process = 0;
       http_register_tls_ca (NULL);
       FREE_STRLIST (hkp_cacert_filenames);
       FREE_STRLIST (opt.keyserver);
@@ -666,6 +712,10 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       set_dns_timeout (0);
       opt.connect_timeout = 0;
       opt.connect_quick_timeout = 0;
+      opt.keyserver_jobs = 0;
+      opt.ks_cache_size = DEFAULT_KS_CACHE_SIZE;
+      opt.ks_cache_ttl = DEFAULT_KS_CACHE_TTL;
+      opt.ks_cache_negative_ttl = DEFAULT_KS_CACHE_NEGATIVE_TTL;
       return 1;
     }
 
@@ -686,7 +736,9 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       if (!current_logfile || !pargs->r.ret_str
           || strcmp (current_logfile, pargs->r.ret_str))
         {
-          log_set_file (pargs->r.ret_str);
+          if (!asynclog_is_active ()
+              || asynclog_start (pargs->r.ret_str, log_buffer_size * 1024))
+            log_set_file (pargs->r.ret_str);
           xfree (current_logfile);
           current_logfile = xtrystrdup (pargs->r.ret_str);
         }
@@ -743,6 +795,10 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       add_to_strlist (&opt.ignored_cert_extensions, pargs->r.ret_str);
       break;
 
+    case oLazyLoadCerts: opt.lazy_load_certs = 1; break;
+    case oPersistTlsSessions: opt.persist_tls_sessions = 1; break;
+    case oLDAPInProcess: opt.ldap_in_process = 1; break;
+
     case oUseTor:
       tor_mode = TOR_MODE_FORCE;
       break;
@@ -775,6 +831,20 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       opt.connect_quick_timeout = pargs->r.ret_ulong * 1000;
       break;
 
+    case oKeyserverJobs:
+      opt.keyserver_jobs = pargs->r.ret_int;
+      break;
+
+    case oKeyserverCacheSize:
+      opt.ks_cache_size = pargs->r.ret_int < 0? 0 : pargs->r.ret_int;
+      break;
+    case oKeyserverCacheTTL:
+      opt.ks_cache_ttl = pargs->r.ret_int < 0? 0 : pargs->r.ret_int;
+      break;
+    case oKeyserverCacheNegTTL:
+      opt.ks_cache_negative_ttl = pargs->r.ret_int < 0? 0 : pargs->r.ret_int;
+      break;
+
     default:
       return 0; /* Not handled. */
     }
@@ -1045,6 +1115,14 @@ main (int argc, char **argv)
           listen_backlog = pargs.r.ret_int;
           break;
 
+        case oConnectionThreads:
+          connection_threads = pargs.r.ret_ulong;
+          break;
+
+        case oLogBufferSize:
+          log_buffer_size = pargs.r.ret_ulong;
+          break;
+
         default:
           if (configname)
             pargs.err = ARGPARSE_PRINT_WARNING;
@@ -1171,6 +1249,9 @@ main (int argc, char **argv)
       cert_cache_init (hkp_cacert_filenames);
       crl_cache_init ();
       ks_hkp_init ();
+      ocsp_init ();
+      domaininfo_load ();
+      persist_tls_sessions (0);
       http_register_netactivity_cb (netactivity_action);
       start_command_handler (ASSUAN_INVALID_FD, 0);
       shutdown_reaper ();
@@ -1207,6 +1288,9 @@ main (int argc, char **argv)
       cert_cache_init (hkp_cacert_filenames);
       crl_cache_init ();
       ks_hkp_init ();
+      ocsp_init ();
+      domaininfo_load ();
+      persist_tls_sessions (0);
       http_register_netactivity_cb (netactivity_action);
       handle_connections (3);
       shutdown_reaper ();
@@ -1429,6 +1513,9 @@ main (int argc, char **argv)
       cert_cache_init (hkp_cacert_filenames);
       crl_cache_init ();
       ks_hkp_init ();
+      ocsp_init ();
+      domaininfo_load ();
+      persist_tls_sessions (0);
       http_register_netactivity_cb (netactivity_action);
       handle_connections (fd);
       shutdown_reaper ();
@@ -1452,6 +1539,7 @@ main (int argc, char **argv)
       cert_cache_init (hkp_cacert_filenames);
       crl_cache_init ();
       ks_hkp_init ();
+      ocsp_init ();
       if (!argc)
         rc = crl_cache_load (&ctrlbuf, NULL);
       else
@@ -1476,6 +1564,7 @@ main (int argc, char **argv)
       cert_cache_init (hkp_cacert_filenames);
       crl_cache_init ();
       ks_hkp_init ();
+      ocsp_init ();
       rc = crl_fetch (&ctrlbuf, argv[0], &reader);
       if (rc)
         log_error (_("fetching CRL from '%s' failed: %s\n"),
@@ -1575,14 +1664,37 @@ main (int argc, char **argv)
 }
 
 
+/* Load the TLS sessions from or, with SAVE set, save them to the
+ * file TLS_SESSIONS_FILE in the cache directory if this has been
+ * requested.  */
+static void
+persist_tls_sessions (int save)
+{
+  char *fname;
+
+  if (!opt.persist_tls_sessions)
+    return;
+
+  fname = make_filename (opt.homedir_cache, TLS_SESSIONS_FILE, NULL);
+  if (save)
+    http_tls_resume_save (fname);
+  else
+    http_tls_resume_load (fname);
+  xfree (fname);
+}
+
+
 static void
 cleanup (void)
 {
+  domaininfo_save ();
+  persist_tls_sessions (1);
   crl_cache_deinit ();
   cert_cache_deinit (1);
   reload_dns_stuff (1);
 
 #if USE_LDAP
+  ldap_pool_flush ();
   ldapserver_list_free (opt.ldapservers);
 #endif /*USE_LDAP*/
   opt.ldapservers = NULL;
@@ -1897,6 +2009,10 @@ dirmngr_sighup_action (void)
   crl_cache_init ();
   reload_dns_stuff (0);
   ks_hkp_reload ();
+  ks_action_cache_flush ();
+#if USE_LDAP
+  ldap_pool_flush ();
+#endif
 }
 
 
@@ -1925,6 +2041,7 @@ handle_signal (int signo)
     case SIGUSR1:
       cert_cache_print_stats ();
       domaininfo_print_stats ();
+      ks_action_cache_print_stats (NULL);
       break;
 
     case SIGUSR2:
@@ -1986,6 +2103,12 @@ housekeeping_thread (void *arg)
 
   dns_stuff_housekeeping ();
   ks_hkp_housekeeping (curtime);
+#if USE_LDAP
+  ldap_pool_housekeeping ();
+#endif
+  domaininfo_save ();
+  persist_tls_sessions (1);
+  crl_cache_housekeeping (&ctrlbuf, curtime);
   if (network_activity_seen)
     {
       network_activity_seen = 0;
@@ -2188,6 +2311,28 @@ handle_connections (assuan_fd_t listen_fd)
   npth_attr_init (&tattr);
   npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
 
+  if (connection_threads)
+    {
+      gpg_error_t err;
+
+      err = workpool_new (&connection_pool, "connections",
+                          connection_threads, 0);
+      if (err)
+        log_fatal ("error creating connection pool: %s\n",
+                   gpg_strerror (err));
+    }
+
+  /* The log writer thread must be started after forking.  */
+  if (log_buffer_size && current_logfile)
+    {
+      gpg_error_t err;
+
+      err = asynclog_start (current_logfile, log_buffer_size * 1024);
+      if (err && gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED)
+        log_error ("error starting the log writer: %s\n",
+                   gpg_strerror (err));
+    }
+
 #ifndef HAVE_W32_SYSTEM /* FIXME */
   npth_sigev_init ();
   npth_sigev_add (SIGHUP);
@@ -2341,18 +2486,35 @@ handle_connections (assuan_fd_t listen_fd)
 
               memset (&argval, 0, sizeof argval);
               argval.afd = fd;
-              snprintf (threadname, sizeof threadname,
-                        "conn fd=%d", FD2INT(fd));
 
-              ret = npth_create (&thread, &tattr,
-                                 start_connection_thread, argval.aptr);
-	      if (ret)
+              if (connection_pool)
                 {
-                  log_error ("error spawning connection handler: %s\n",
-                             strerror (ret) );
-                  assuan_sock_close (fd);
+                  gpg_error_t err;
+
+                  err = workpool_submit (connection_pool,
+                                         start_connection_thread,
+                                         argval.aptr, 0);
+                  if (err)
+                    {
+                      log_error ("error queuing connection: %s\n",
+                                 gpg_strerror (err));
+                      assuan_sock_close (fd);
+                    }
+                }
+              else
+                {
+                  snprintf (threadname, sizeof threadname,
+                            "conn fd=%d", FD2INT(fd));
+                  ret = npth_create (&thread, &tattr,
+                                     start_connection_thread, argval.aptr);
+                  if (ret)
+                    {
+                      log_error ("error spawning connection handler: %s\n",
+                                 strerror (ret) );
+                      assuan_sock_close (fd);
+                    }
+                  npth_setname_np (thread, threadname);
                 }
-	      npth_setname_np (thread, threadname);
             }
 	}
     }
@@ -2368,6 +2530,18 @@ handle_connections (assuan_fd_t listen_fd)
   log_info ("%s %s stopped\n", gpgrt_strusage(11), gpgrt_strusage(13));
 }
 
+
+/* Return a malloced string with the statistics of the connection
+ * thread pool or NULL on a memory error.  */
+char *
+dirmngr_get_connection_pool_stats (void)
+{
+  if (!connection_pool)
+    return xtrystrdup ("max_threads=0");
+  return workpool_stats (connection_pool);
+}
+
+
 const char*
 dirmngr_get_current_socket_name (void)
 {
@@ -103,6 +103,10 @@ struct
 
   unsigned int connect_timeout;       /* Timeout for connect.  */
   unsigned int connect_quick_timeout; /* Shorter timeout for connect.  */
+  int keyserver_jobs;     /* Number of concurrent keyserver requests.  */
+  unsigned int ks_cache_size;  /* Max. number of cached KS_GET responses.  */
+  unsigned int ks_cache_ttl;   /* Seconds a response is cached.  */
+  unsigned int ks_cache_negative_ttl; /* Ditto for "not found" results.  */
 
   int disable_http;       /* Do not use HTTP at all.  */
   int disable_ldap;       /* Do not use LDAP at all.  */
@@ -122,10 +126,16 @@ struct
      OID per string.  */
   strlist_t ignored_cert_extensions;
 
+  int lazy_load_certs; /* Parse permanently loaded certificates only
+                          on their first use.  */
+  int persist_tls_sessions; /* Keep TLS sessions across restarts.  */
+
   int allow_ocsp;     /* Allow using OCSP. */
 
   int max_replies;
   unsigned int ldaptimeout;
+  int ldap_in_process; /* Run LDAP queries in-process using the
+                          ldap-pool.  */
 
   ldap_server_t ldapservers;
   int add_new_ldapservers;
@@ -206,6 +216,10 @@ struct server_control_s
   unsigned int timeout; /* Timeout for connect calls in ms.  */
 
   unsigned int http_no_crl:1;  /* Do not check CRLs for https.  */
+
+  /* If not NULL status lines are written to this stream instead of
+   * being sent to the client.  Used by worker threads.  */
+  estream_t status_capture;
 };
 
 
@@ -215,6 +229,7 @@ void dirmngr_init_default_ctrl (ctrl_t ctrl);
 void dirmngr_deinit_default_ctrl (ctrl_t ctrl);
 void dirmngr_sighup_action (void);
 const char* dirmngr_get_current_socket_name (void);
+char *dirmngr_get_connection_pool_stats (void);
 int dirmngr_use_tor (void);
 
 /*-- Various housekeeping functions.  --*/
@@ -255,6 +270,8 @@ void domaininfo_set_no_name (const char *domain);
 void domaininfo_set_wkd_supported (const char *domain);
 void domaininfo_set_wkd_not_supported (const char *domain);
 void domaininfo_set_wkd_not_found (const char *domain);
+void domaininfo_load (void);
+void domaininfo_save (void);
 
 /*-- workqueue.c --*/
 typedef const char *(*wqtask_t)(ctrl_t ctrl, const char *args);
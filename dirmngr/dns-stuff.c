@@ -117,6 +117,14 @@
 
 #define RESOLV_CONF_NAME "/etc/resolv.conf"
 
+/* The cache of DNS responses.  TTLs which are not known are replaced
+ * by the default and all TTLs are capped to the maximum.  Negative
+ * responses are kept for a fixed time.  */
+#define DNS_CACHE_MAX_ITEMS   512
+#define DNS_CACHE_DEFAULT_TTL 300
+#define DNS_CACHE_MAX_TTL     3600
+#define DNS_CACHE_NEGATIVE_TTL 60
+
 /* Two flags to enable verbose and debug mode.  */
 static int opt_verbose;
 static int opt_debug;
@@ -149,6 +157,44 @@ static char tor_nameserver[40+20];
 static char tor_socks_user[30];
 static char tor_socks_password[20];
 
+/* The kinds of items in the DNS cache.  */
+enum dns_cache_kinds
+  {
+    DNS_CACHE_ADDR,   /* Result of resolve_dns_name.  */
+    DNS_CACHE_SRV,    /* Result of get_dns_srv.  */
+    DNS_CACHE_CERT    /* Result of get_dns_cert.  */
+  };
+
+/* An item of the DNS cache.  The cache is a simple list with the most
+ * recently inserted items first.  Note that there is no need for a
+ * lock because none of the cache functions call an npth function.  */
+struct dns_cache_item_s
+{
+  struct dns_cache_item_s *next;
+  enum dns_cache_kinds kind;
+  time_t expires;          /* The item is not valid after this time.  */
+  int arg1, arg2, arg3;    /* Additional parameters of the query.  */
+  gpg_error_t err;         /* The error for a negative response.  */
+
+  dns_addrinfo_t ai;       /* DNS_CACHE_ADDR: The addresses.  */
+  char *cname;             /*   The canonical name or NULL.  */
+
+  struct srventry *srvs;   /* DNS_CACHE_SRV: The unsorted records.  */
+  unsigned int srvcount;
+
+  void *key;               /* DNS_CACHE_CERT: The key or NULL.  */
+  size_t keylen;
+  unsigned char *fpr;      /*   The fingerprint or NULL.  */
+  size_t fprlen;
+  char *url;               /*   The URL or NULL.  */
+
+  char name[1];            /* The queried name.  */
+};
+typedef struct dns_cache_item_s *dns_cache_item_t;
+
+static dns_cache_item_t dns_cache;
+static unsigned int dns_cache_count;
+
 /* To avoid checking the interface too often we cache the result.  */
 static struct
 {
@@ -185,6 +231,8 @@ static int libdns_tor_port;
 void
 enable_standard_resolver (int yes)
 {
+  if (standard_resolver != yes)
+    flush_dns_cache ();
   standard_resolver = yes;
 }
 
@@ -202,6 +250,8 @@ standard_resolver_p (void)
 void
 enable_recursive_resolver (int yes)
 {
+  if (recursive_resolver != yes)
+    flush_dns_cache ();
   recursive_resolver = yes;
 #ifdef USE_LIBDNS
   libdns_reinit_pending = 1;
@@ -235,7 +285,10 @@ enable_dns_tormode (int new_circuit)
       gpgrt_snprintf (tor_socks_password, sizeof tor_socks_password,
                       "p%u", counter);
       counter++;
+      flush_dns_cache ();
     }
+  if (!tor_mode)
+    flush_dns_cache ();
   tor_mode = 1;
 }
 
@@ -244,6 +297,8 @@ enable_dns_tormode (int new_circuit)
 void
 disable_dns_tormode (void)
 {
+  if (tor_mode)
+    flush_dns_cache ();
   tor_mode = 0;
 }
 
@@ -262,6 +317,8 @@ set_dns_verbose (int verbose, int debug)
 void
 set_dns_disable_ipv4 (int yes)
 {
+  if (opt_disable_ipv4 != !!yes)
+    flush_dns_cache ();
   opt_disable_ipv4 = !!yes;
 }
 
@@ -271,6 +328,8 @@ set_dns_disable_ipv4 (int yes)
 void
 set_dns_disable_ipv6 (int yes)
 {
+  if (opt_disable_ipv6 != !!yes)
+    flush_dns_cache ();
   opt_disable_ipv6 = !!yes;
 }
 
@@ -300,6 +359,8 @@ set_dns_nameserver (const char *ipaddr)
   strncpy (tor_nameserver, ipaddr? ipaddr : DEFAULT_NAMESERVER,
            sizeof tor_nameserver -1);
   tor_nameserver[sizeof tor_nameserver -1] = 0;
+  if (tor_mode)
+    flush_dns_cache ();
 #ifdef USE_LIBDNS
   libdns_reinit_pending = 1;
   libdns_tor_port = 0;  /* Start again with the default port.  */
@@ -320,6 +381,197 @@ free_dns_addrinfo (dns_addrinfo_t ai)
 }
 
 
+/* Return a copy of the addressinfo list AI or NULL on memory error.
+ * The order of the items is kept.  */
+static dns_addrinfo_t
+copy_dns_addrinfo (dns_addrinfo_t ai)
+{
+  dns_addrinfo_t head = NULL;
+  dns_addrinfo_t *tail = &head;
+
+  for (; ai; ai = ai->next)
+    {
+      *tail = xtrymalloc (sizeof **tail);
+      if (!*tail)
+        {
+          free_dns_addrinfo (head);
+          return NULL;
+        }
+      memcpy (*tail, ai, sizeof **tail);
+      (*tail)->next = NULL;
+      tail = &(*tail)->next;
+    }
+  return head;
+}
+
+
+/* Release the DNS cache item ITEM.  */
+static void
+release_dns_cache_item (dns_cache_item_t item)
+{
+  if (!item)
+    return;
+  free_dns_addrinfo (item->ai);
+  xfree (item->cname);
+  xfree (item->srvs);
+  xfree (item->key);
+  xfree (item->fpr);
+  xfree (item->url);
+  xfree (item);
+}
+
+
+/* Remove all items from the DNS cache.  */
+void
+flush_dns_cache (void)
+{
+  dns_cache_item_t item;
+
+  while ((item = dns_cache))
+    {
+      dns_cache = item->next;
+      release_dns_cache_item (item);
+    }
+  dns_cache_count = 0;
+}
+
+
+/* Remove all expired items from the DNS cache.  If FORCE is set and
+ * the cache is still full, the oldest item is also removed.  */
+static void
+expire_dns_cache (int force)
+{
+  dns_cache_item_t item, *pp, *oldest;
+  time_t now = gnupg_get_time ();
+
+  oldest = NULL;
+  for (pp = &dns_cache; (item = *pp); )
+    if (item->expires <= now)
+      {
+        *pp = item->next;
+        release_dns_cache_item (item);
+        dns_cache_count--;
+      }
+    else
+      {
+        oldest = pp;
+        pp = &item->next;
+      }
+
+  if (force && dns_cache_count >= DNS_CACHE_MAX_ITEMS && oldest)
+    {
+      item = *oldest;
+      *oldest = item->next;
+      release_dns_cache_item (item);
+      dns_cache_count--;
+    }
+}
+
+
+/* Return the valid cache item for a query of KIND with NAME and the
+ * additional parameters ARG1 to ARG3 or NULL if not cached.  */
+static dns_cache_item_t
+find_dns_cache_item (enum dns_cache_kinds kind, const char *name,
+                     int arg1, int arg2, int arg3)
+{
+  dns_cache_item_t item;
+  time_t now = gnupg_get_time ();
+
+  for (item = dns_cache; item; item = item->next)
+    if (item->kind == kind && item->arg1 == arg1 && item->arg2 == arg2
+        && item->arg3 == arg3 && item->expires > now
+        && !ascii_strcasecmp (item->name, name))
+      {
+        if (opt_debug)
+          log_debug ("dns: cache hit for '%s'%s\n", name,
+                     item->err? " (negative)":"");
+        dirmngr_stats_cache (DIRMNGR_CACHE_DNS, 1);
+        return item;
+      }
+  dirmngr_stats_cache (DIRMNGR_CACHE_DNS, 0);
+  return NULL;
+}
+
+
+/* Return true if ERR is a DNS response which may be cached.  */
+static int
+dns_cache_error_p (gpg_error_t err)
+{
+  switch (gpg_err_code (err))
+    {
+    case 0:
+    case GPG_ERR_NO_NAME:
+    case GPG_ERR_NOT_FOUND:
+    case GPG_ERR_NO_DATA:
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+
+/* Create a new cache item for a query of KIND with NAME and ARG1 to
+ * ARG3 which returned ERR and after adding the result data, insert
+ * it using insert_dns_cache_item.  Returns NULL if the result shall
+ * not be cached or on memory error.  */
+static dns_cache_item_t
+new_dns_cache_item (enum dns_cache_kinds kind, const char *name,
+                    int arg1, int arg2, int arg3, gpg_error_t err)
+{
+  dns_cache_item_t item;
+
+  if (!dns_cache_error_p (err))
+    return NULL;
+
+  item = xtrycalloc (1, sizeof *item + strlen (name));
+  if (!item)
+    return NULL;
+  strcpy (item->name, name);
+  item->kind = kind;
+  item->arg1 = arg1;
+  item->arg2 = arg2;
+  item->arg3 = arg3;
+  item->err = err;
+  return item;
+}
+
+
+/* Insert the new ITEM into the cache.  It expires after TTL seconds
+ * where a TTL of 0 means that the TTL is not known.  Negative
+ * responses use a fixed TTL.  This functions takes ownership of
+ * ITEM.  */
+static void
+insert_dns_cache_item (dns_cache_item_t item, unsigned int ttl)
+{
+  dns_cache_item_t old, *pp;
+
+  if (item->err || !ttl)
+    ttl = item->err? DNS_CACHE_NEGATIVE_TTL : DNS_CACHE_DEFAULT_TTL;
+  else if (ttl > DNS_CACHE_MAX_TTL)
+    ttl = DNS_CACHE_MAX_TTL;
+  item->expires = gnupg_get_time () + ttl;
+
+  /* Replace an item for the same query which might have been
+   * inserted by another thread meanwhile.  */
+  for (pp = &dns_cache; (old = *pp); pp = &old->next)
+    if (old->kind == item->kind && old->arg1 == item->arg1
+        && old->arg2 == item->arg2 && old->arg3 == item->arg3
+        && !ascii_strcasecmp (old->name, item->name))
+      {
+        *pp = old->next;
+        release_dns_cache_item (old);
+        dns_cache_count--;
+        break;
+      }
+
+  if (dns_cache_count >= DNS_CACHE_MAX_ITEMS)
+    expire_dns_cache (1);
+  item->next = dns_cache;
+  dns_cache = item;
+  dns_cache_count++;
+}
+
+
 #ifndef HAVE_W32_SYSTEM
 /* Return H_ERRNO mapped to a gpg-error code.  Will never return 0. */
 static gpg_error_t
@@ -696,8 +948,10 @@ reload_dns_stuff (int force)
   (void)force;
 #endif
 
-  /* We also flush the IPv4/v6 support flag cache.  */
+  /* We also flush the IPv4/v6 support flag cache and the DNS
+   * cache.  */
   cached_inet_support.valid = 0;
+  flush_dns_cache ();
 }
 
 
@@ -710,6 +964,8 @@ dns_stuff_housekeeping (void)
    * later than 10 minutes after it changed.  This way the user does
    * not need a reload.  */
   cached_inet_support.valid = 0;
+
+  expire_dns_cache (0);
 }
 
 
@@ -1099,7 +1355,39 @@ resolve_dns_name (ctrl_t ctrl, const char *name, unsigned short port,
                   dns_addrinfo_t *r_ai, char **r_canonname)
 {
   gpg_error_t err;
+  dns_cache_item_t item;
+  int use_cache;
+  int arg3 = want_socktype * 2 + !!r_canonname;
+  unsigned long started;
 
+  use_cache = !is_ip_address (name);
+  if (use_cache
+      && (item = find_dns_cache_item (DNS_CACHE_ADDR, name, port,
+                                      want_family, arg3)))
+    {
+      *r_ai = NULL;
+      if (r_canonname)
+        *r_canonname = NULL;
+      if (item->err)
+        return item->err;
+      *r_ai = copy_dns_addrinfo (item->ai);
+      if (!*r_ai && item->ai)
+        return gpg_error_from_syserror ();
+      if (r_canonname && item->cname)
+        {
+          *r_canonname = xtrystrdup (item->cname);
+          if (!*r_canonname)
+            {
+              err = gpg_error_from_syserror ();
+              free_dns_addrinfo (*r_ai);
+              *r_ai = NULL;
+              return err;
+            }
+        }
+      return 0;
+    }
+
+  started = dirmngr_stats_clock ();
 #ifdef USE_LIBDNS
   if (!standard_resolver)
     {
@@ -1113,8 +1401,28 @@ resolve_dns_name (ctrl_t ctrl, const char *name, unsigned short port,
 #endif /*USE_LIBDNS*/
     err = resolve_name_standard (ctrl, name, port, want_family, want_socktype,
                                  r_ai, r_canonname);
+  if (use_cache)
+    dirmngr_stats_update (DIRMNGR_STATS_DNS, started, err);
   if (opt_debug)
     log_debug ("dns: resolve_dns_name(%s): %s\n", name, gpg_strerror (err));
+
+  /* The resolvers do not tell us the TTL; thus we use the default.  */
+  if (use_cache
+      && (item = new_dns_cache_item (DNS_CACHE_ADDR, name, port,
+                                     want_family, arg3, err)))
+    {
+      if (!err)
+        {
+          item->ai = copy_dns_addrinfo (*r_ai);
+          if (r_canonname && *r_canonname)
+            item->cname = xtrystrdup (*r_canonname);
+        }
+      if ((!err && !item->ai) || (r_canonname && *r_canonname && !item->cname))
+        release_dns_cache_item (item);
+      else
+        insert_dns_cache_item (item, 0);
+    }
+
   return err;
 }
 
@@ -1431,7 +1739,8 @@ is_onion_address (const char *name)
 static gpg_error_t
 get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
                      void **r_key, size_t *r_keylen,
-                     unsigned char **r_fpr, size_t *r_fprlen, char **r_url)
+                     unsigned char **r_fpr, size_t *r_fprlen, char **r_url,
+                     unsigned int *r_ttl)
 {
   gpg_error_t err;
   struct dns_resolver *res = NULL;
@@ -1497,6 +1806,9 @@ get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
       unsigned short len = rr.rd.len;
       u16 subtype;
 
+      /* A TTL of 0 would mean that we use the default.  */
+      *r_ttl = rr.ttl? rr.ttl : 1;
+
        if (!len)
         {
           /* Definitely too short - skip.  */
@@ -1820,6 +2132,9 @@ get_dns_cert (ctrl_t ctrl, const char *name, int want_certtype,
               unsigned char **r_fpr, size_t *r_fprlen, char **r_url)
 {
   gpg_error_t err;
+  dns_cache_item_t item;
+  unsigned int ttl = 0;
+  unsigned long started;
 
   if (r_key)
     *r_key = NULL;
@@ -1829,22 +2144,103 @@ get_dns_cert (ctrl_t ctrl, const char *name, int want_certtype,
   *r_fprlen = 0;
   *r_url = NULL;
 
+  item = find_dns_cache_item (DNS_CACHE_CERT, name, want_certtype,
+                              !!r_key, 0);
+  if (item)
+    {
+      if (item->err)
+        return item->err;
+      if (item->key && r_key)
+        {
+          *r_key = xtrymalloc (item->keylen);
+          if (!*r_key)
+            return gpg_error_from_syserror ();
+          memcpy (*r_key, item->key, item->keylen);
+          if (r_keylen)
+            *r_keylen = item->keylen;
+        }
+      if (item->fpr)
+        {
+          *r_fpr = xtrymalloc (item->fprlen);
+          if (!*r_fpr)
+            goto nomem;
+          memcpy (*r_fpr, item->fpr, item->fprlen);
+          *r_fprlen = item->fprlen;
+        }
+      if (item->url)
+        {
+          *r_url = xtrystrdup (item->url);
+          if (!*r_url)
+            goto nomem;
+        }
+      return 0;
+
+    nomem:
+      err = gpg_error_from_syserror ();
+      if (r_key)
+        {
+          xfree (*r_key);
+          *r_key = NULL;
+        }
+      xfree (*r_fpr);
+      *r_fpr = NULL;
+      return err;
+    }
+
+  started = dirmngr_stats_clock ();
 #ifdef USE_LIBDNS
   if (!standard_resolver)
     {
       err = get_dns_cert_libdns (ctrl, name, want_certtype, r_key, r_keylen,
-                                 r_fpr, r_fprlen, r_url);
+                                 r_fpr, r_fprlen, r_url, &ttl);
       if (err && libdns_switch_port_p (err))
         err = get_dns_cert_libdns (ctrl, name, want_certtype, r_key, r_keylen,
-                                   r_fpr, r_fprlen, r_url);
+                                   r_fpr, r_fprlen, r_url, &ttl);
     }
   else
 #endif /*USE_LIBDNS*/
     err = get_dns_cert_standard (name, want_certtype, r_key, r_keylen,
                                  r_fpr, r_fprlen, r_url);
+  dirmngr_stats_update (DIRMNGR_STATS_DNS, started, err);
 
   if (opt_debug)
     log_debug ("dns: get_dns_cert(%s): %s\n", name, gpg_strerror (err));
+
+  if ((item = new_dns_cache_item (DNS_CACHE_CERT, name, want_certtype,
+                                  !!r_key, 0, err)))
+    {
+      int nomem = 0;
+
+      if (!err && r_key && *r_key)
+        {
+          item->key = xtrymalloc (*r_keylen);
+          if (item->key)
+            {
+              memcpy (item->key, *r_key, *r_keylen);
+              item->keylen = *r_keylen;
+            }
+          else
+            nomem = 1;
+        }
+      if (!err && *r_fpr)
+        {
+          item->fpr = xtrymalloc (*r_fprlen);
+          if (item->fpr)
+            {
+              memcpy (item->fpr, *r_fpr, *r_fprlen);
+              item->fprlen = *r_fprlen;
+            }
+          else
+            nomem = 1;
+        }
+      if (!err && *r_url && !(item->url = xtrystrdup (*r_url)))
+        nomem = 1;
+      if (nomem)
+        release_dns_cache_item (item);
+      else
+        insert_dns_cache_item (item, ttl);
+    }
+
   return err;
 }
 
@@ -1868,7 +2264,8 @@ priosort(const void *a,const void *b)
 #ifdef USE_LIBDNS
 static gpg_error_t
 getsrv_libdns (ctrl_t ctrl,
-               const char *name, struct srventry **list, unsigned int *r_count)
+               const char *name, struct srventry **list, unsigned int *r_count,
+               unsigned int *r_ttl)
 {
   gpg_error_t err;
   struct dns_resolver *res = NULL;
@@ -1930,6 +2327,10 @@ getsrv_libdns (ctrl_t ctrl,
       if (err)
         goto leave;
 
+      /* Use the lowest TTL of all records.  */
+      if (!srvcount || rr.ttl < *r_ttl)
+        *r_ttl = rr.ttl? rr.ttl : 1;
+
       newlist = xtryrealloc (*list, (srvcount+1)*sizeof(struct srventry));
       if (!newlist)
         {
@@ -2105,6 +2506,8 @@ get_dns_srv (ctrl_t ctrl,
   gpg_error_t err;
   char *namebuffer = NULL;
   unsigned int srvcount;
+  dns_cache_item_t item;
+  unsigned int ttl = 0;
   int i;
 
   *list = NULL;
@@ -2125,16 +2528,52 @@ get_dns_srv (ctrl_t ctrl,
     }
 
 
-#ifdef USE_LIBDNS
-  if (!standard_resolver)
+  if ((item = find_dns_cache_item (DNS_CACHE_SRV, name, 0, 0, 0)))
     {
-      err = getsrv_libdns (ctrl, name, list, &srvcount);
-      if (err && libdns_switch_port_p (err))
-        err = getsrv_libdns (ctrl, name, list, &srvcount);
+      err = item->err;
+      if (!err && item->srvcount)
+        {
+          *list = xtrymalloc (item->srvcount * sizeof **list);
+          if (!*list)
+            err = gpg_error_from_syserror ();
+          else
+            {
+              memcpy (*list, item->srvs, item->srvcount * sizeof **list);
+              srvcount = item->srvcount;
+            }
+        }
     }
   else
+    {
+      unsigned long started = dirmngr_stats_clock ();
+
+#ifdef USE_LIBDNS
+      if (!standard_resolver)
+        {
+          err = getsrv_libdns (ctrl, name, list, &srvcount, &ttl);
+          if (err && libdns_switch_port_p (err))
+            err = getsrv_libdns (ctrl, name, list, &srvcount, &ttl);
+        }
+      else
 #endif /*USE_LIBDNS*/
-    err = getsrv_standard (name, list, &srvcount);
+        err = getsrv_standard (name, list, &srvcount);
+      dirmngr_stats_update (DIRMNGR_STATS_DNS, started, err);
+
+      if ((item = new_dns_cache_item (DNS_CACHE_SRV, name, 0, 0, 0, err)))
+        {
+          if (!err && srvcount)
+            item->srvs = xtrymalloc (srvcount * sizeof **list);
+          if (!err && srvcount && !item->srvs)
+            release_dns_cache_item (item);
+          else
+            {
+              if (item->srvs)
+                memcpy (item->srvs, *list, srvcount * sizeof **list);
+              item->srvcount = srvcount;
+              insert_dns_cache_item (item, ttl);
+            }
+        }
+    }
 
   if (err)
     {
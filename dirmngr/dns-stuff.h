@@ -137,6 +137,9 @@ void reload_dns_stuff (int force);
 /* Housekeeping for this module.  */
 void dns_stuff_housekeeping (void);
 
+/* Remove all cached DNS responses.  */
+void flush_dns_cache (void);
+
 void free_dns_addrinfo (dns_addrinfo_t ai);
 
 /* Function similar to getaddrinfo.  */
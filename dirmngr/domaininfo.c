@@ -22,8 +22,10 @@
 #include <config.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include "dirmngr.h"
+#include "../common/mbox-util.h"
 
 
 /* Number of bucket for the hash array and limit for the length of a
@@ -38,6 +40,17 @@
 #define NO_OF_DOMAINBUCKETS  103
 #define MAX_DOMAINBUCKET_LEN  20
 
+/* The time in seconds an item is valid after its last update.  This
+ * depends on the state of the domain.  */
+#define TTL_WKD_SUPPORTED      (7*86400)
+#define TTL_WKD_NOT_SUPPORTED  (86400)
+#define TTL_WKD_NOT_FOUND      (86400)
+#define TTL_NO_NAME            (3600)
+
+/* The name of the file in the cache directory to keep the items
+ * across restarts of dirmngr.  */
+#define DOMAININFO_FILE "domaininfo.txt"
+
 
 /* Object to keep track of a domain name.  */
 struct domaininfo_s
@@ -48,6 +61,7 @@ struct domaininfo_s
   unsigned int wkd_supported:1;      /* One WKD entry was found.          */
   unsigned int wkd_not_supported:1;  /* Definitely does not support WKD.  */
   unsigned int keepmark:1;           /* Private to insert_or_update().    */
+  time_t expires;                    /* The item is invalid after this.   */
   char name[1];
 };
 typedef struct domaininfo_s *domaininfo_t;
@@ -55,6 +69,9 @@ typedef struct domaininfo_s *domaininfo_t;
 /* And the hashed array.  */
 static domaininfo_t domainbuckets[NO_OF_DOMAINBUCKETS];
 
+/* Set if the hashed array has been changed since the last save.  */
+static int domainbuckets_dirty;
+
 
 /* The hash function we use.  Must not call a system function.  */
 static inline u32
@@ -126,15 +143,54 @@ int
 domaininfo_is_wkd_not_supported (const char *domain)
 {
   domaininfo_t di;
+  time_t now = gnupg_get_time ();
 
   for (di = domainbuckets[hash_domain (domain)]; di; di = di->next)
     if (!strcmp (di->name, domain))
-      return !!di->wkd_not_supported;
+      return di->expires > now && di->wkd_not_supported;
 
   return 0;  /* We don't know.  */
 }
 
 
+/* Set the expiration time of DI according to its state.  May not do
+ * any syscalls.  */
+static void
+set_expires (domaininfo_t di, time_t now)
+{
+  if (di->wkd_supported)
+    di->expires = now + TTL_WKD_SUPPORTED;
+  else if (di->no_name)
+    di->expires = now + TTL_NO_NAME;
+  else if (di->wkd_not_supported)
+    di->expires = now + TTL_WKD_NOT_SUPPORTED;
+  else
+    di->expires = now + TTL_WKD_NOT_FOUND;
+}
+
+
+/* Helper for insert_or_update to update the existing item DI.  An
+ * expired item is updated as if it were new.  May not do any
+ * syscalls.  */
+static void
+update_item (domaininfo_t di, time_t now,
+             void (*callback)(domaininfo_t di, int insert_mode))
+{
+  if (di->expires <= now)
+    {
+      di->no_name = 0;
+      di->wkd_not_found = 0;
+      di->wkd_supported = 0;
+      di->wkd_not_supported = 0;
+      callback (di, 1);
+    }
+  else
+    callback (di, 0);
+  set_expires (di, now);
+  domainbuckets_dirty = 1;
+}
+
+
 /* Core update function.  DOMAIN is expected to be lowercase.
  * CALLBACK is called to update the existing or the newly inserted
  * item.  */
@@ -150,12 +206,13 @@ insert_or_update (const char *domain,
   int ndropped = 0;
   u32 hash;
   int count;
+  time_t now = gnupg_get_time ();
 
   hash = hash_domain (domain);
   for (di = domainbuckets[hash]; di; di = di->next)
     if (!strcmp (di->name, domain))
       {
-        callback (di, 0);  /* Update */
+        update_item (di, now, callback);
         return;
       }
 
@@ -169,7 +226,7 @@ insert_or_update (const char *domain,
   for (count=0, di = domainbuckets[hash]; di; di = di->next, count++)
     if (!strcmp (di->name, domain))
       {
-        callback (di, 0);  /* Update */
+        update_item (di, now, callback);
         xfree (di_new);
         return;
       }
@@ -210,7 +267,8 @@ insert_or_update (const char *domain,
         {
           di = array[idx];
           di->keepmark = 0; /* Clear flag here on the first pass.  */
-          if (di->wkd_supported && count < MAX_DOMAINBUCKET_LEN/2)
+          if (di->wkd_supported && di->expires > now
+              && count < MAX_DOMAINBUCKET_LEN/2)
             {
               di->keepmark = 1;
               count++;
@@ -221,7 +279,7 @@ insert_or_update (const char *domain,
       for (idx=0; idx < narray; idx++)
         {
           di = array[idx];
-          if (!di->keepmark
+          if (!di->keepmark && di->expires > now
               && di->wkd_not_supported && count < MAX_DOMAINBUCKET_LEN/2)
             {
               di->keepmark = 1;
@@ -262,9 +320,11 @@ insert_or_update (const char *domain,
 
   /* Insert */
   callback (di_new, 1);
+  set_expires (di_new, now);
   di = di_new;
   di->next = domainbuckets[hash];
   domainbuckets[hash] = di;
+  domainbuckets_dirty = 1;
 
   if (opt.verbose && (nkept || ndropped))
     log_info ("domaininfo: bucket=%lu kept=%d purged=%d\n",
@@ -376,3 +436,201 @@ domaininfo_set_wkd_not_found (const char *domain)
 {
   insert_or_update (domain, set_wkd_not_found_cb);
 }
+
+
+
+/* Load the items from the file DOMAININFO_FILE in the cache
+ * directory.  This is called once at startup.  Each line of the file
+ * has the flags, the expiration time and the domain name.  */
+void
+domaininfo_load (void)
+{
+  char *fname;
+  estream_t fp;
+  char line[300];
+  char *fields[3];
+  unsigned int lineno = 0;
+  int nitems = 0;
+  time_t now = gnupg_get_time ();
+  time_t expires;
+  domaininfo_t di;
+  const char *s;
+  size_t n;
+  u32 hash;
+  int count;
+
+  fname = make_filename (opt.homedir_cache, DOMAININFO_FILE, NULL);
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info ("domaininfo: error opening '%s': %s\n",
+                  fname, gpg_strerror (gpg_error_from_syserror ()));
+      xfree (fname);
+      return;
+    }
+
+  while (es_fgets (line, sizeof line, fp))
+    {
+      lineno++;
+      n = strlen (line);
+      if (!n || line[n-1] != '\n')
+        {
+          log_info ("domaininfo: %s:%u: line too long - ignoring the rest\n",
+                    fname, lineno);
+          break;
+        }
+      trim_spaces (line);
+      if (!*line || *line == '#')
+        continue;
+      if (split_fields (line, fields, DIM (fields)) != DIM (fields)
+          || !is_valid_domain_name (fields[2]))
+        {
+          log_info ("domaininfo: %s:%u: invalid line ignored\n",
+                    fname, lineno);
+          continue;
+        }
+      expires = (time_t)strtoul (fields[1], NULL, 10);
+      if (expires <= now)
+        continue;
+      if (expires > now + TTL_WKD_SUPPORTED)
+        expires = now + TTL_WKD_SUPPORTED;  /* Clock has been set back.  */
+      ascii_strlwr (fields[2]);
+
+      hash = hash_domain (fields[2]);
+      for (count=0, di = domainbuckets[hash]; di; di = di->next, count++)
+        if (!strcmp (di->name, fields[2]))
+          break;
+      if (di || count >= MAX_DOMAINBUCKET_LEN)
+        continue;
+
+      di = xtrycalloc (1, sizeof *di + strlen (fields[2]));
+      if (!di)
+        {
+          log_error ("domaininfo: error allocating item: %s\n",
+                     gpg_strerror (gpg_error_from_syserror ()));
+          break;
+        }
+      strcpy (di->name, fields[2]);
+      for (s = fields[0]; *s; s++)
+        switch (*s)
+          {
+          case 'n': di->no_name = 1; break;
+          case 'f': di->wkd_not_found = 1; break;
+          case 's': di->wkd_supported = 1; break;
+          case 'u': di->wkd_not_supported = 1; break;
+          default: break;
+          }
+      di->expires = expires;
+      di->next = domainbuckets[hash];
+      domainbuckets[hash] = di;
+      nitems++;
+    }
+  if (es_ferror (fp))
+    log_info ("domaininfo: error reading '%s': %s\n",
+              fname, gpg_strerror (gpg_error_from_syserror ()));
+  es_fclose (fp);
+
+  if (opt.verbose)
+    log_info ("domaininfo: %d items loaded from '%s'\n", nitems, fname);
+  xfree (fname);
+  domainbuckets_dirty = 0;
+}
+
+
+/* Write the valid items to the file DOMAININFO_FILE in the cache
+ * directory if they have been changed since the last call.  */
+void
+domaininfo_save (void)
+{
+  gpg_error_t err;
+  char *fname = NULL;
+  char *tmpfname = NULL;
+  char *buffer;
+  size_t size, len;
+  estream_t fp;
+  domaininfo_t di;
+  time_t now;
+  int bidx;
+  char flags[5];
+  char *p;
+
+  if (!domainbuckets_dirty)
+    return;
+  domainbuckets_dirty = 0;
+  now = gnupg_get_time ();
+
+  /* Collect the lines in a buffer.  Because the malloc is a system
+   * call we need to check the size again while filling the
+   * buffer.  */
+  size = 0;
+  for (bidx = 0; bidx < NO_OF_DOMAINBUCKETS; bidx++)
+    for (di = domainbuckets[bidx]; di; di = di->next)
+      if (di->expires > now)
+        size += 4 + 1 + 20 + 1 + strlen (di->name) + 1;
+  buffer = xtrymalloc (size + 1);
+  if (!buffer)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  len = 0;
+  for (bidx = 0; bidx < NO_OF_DOMAINBUCKETS; bidx++)
+    for (di = domainbuckets[bidx]; di; di = di->next)
+      {
+        if (di->expires <= now)
+          continue;
+        if (len + 4 + 1 + 20 + 1 + strlen (di->name) + 1 > size)
+          goto collected;  /* The table has grown in the meantime.  */
+        p = flags;
+        if (di->no_name)
+          *p++ = 'n';
+        if (di->wkd_not_found)
+          *p++ = 'f';
+        if (di->wkd_supported)
+          *p++ = 's';
+        if (di->wkd_not_supported)
+          *p++ = 'u';
+        if (p == flags)
+          *p++ = '-';
+        *p = 0;
+        len += snprintf (buffer + len, size + 1 - len, "%s %lu %s\n",
+                         flags, (unsigned long)di->expires, di->name);
+      }
+ collected:
+
+  fname = make_filename (opt.homedir_cache, DOMAININFO_FILE, NULL);
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  fp = es_fopen (tmpfname, "w");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  es_fputs ("# " DOMAININFO_FILE " - WKD information about domains\n"
+            "# This file is rewritten by dirmngr; do not edit.\n", fp);
+  es_write (fp, buffer, len, NULL);
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+
+ leave:
+  if (err)
+    {
+      log_error ("domaininfo: error writing '%s': %s\n",
+                 fname? fname : DOMAININFO_FILE, gpg_strerror (err));
+      domainbuckets_dirty = 1;  /* Try again later.  */
+    }
+  xfree (buffer);
+  xfree (tmpfname);
+  xfree (fname);
+}
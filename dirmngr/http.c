@@ -182,6 +182,9 @@ struct my_socket_s
 };
 typedef struct my_socket_s *my_socket_t;
 
+static void put_pooled_conn (char *key, my_socket_t sock, int use_tls,
+                             http_session_t session);
+
 
 /* Cookie function structure and cookie object.  */
 static es_cookie_io_functions_t cookie_functions =
@@ -208,6 +211,10 @@ struct cookie_s
      the content length.  */
   uint64_t content_length;
   unsigned int content_length_valid:1;
+
+  /* If not NULL the connection may be put into the connection pool
+     under this key after the response has been read completely.  */
+  char *pool_key;
 };
 typedef struct cookie_s *cookie_t;
 
@@ -302,9 +309,33 @@ struct http_context_s
   size_t buffer_size;
   unsigned int flags;
   header_t headers;      /* Received headers. */
+  char *pool_key;        /* Key into the connection pool or NULL.  */
 };
 
 
+/* An idle connection kept for reuse with HTTP_FLAG_KEEPALIVE.  */
+struct pool_item_s
+{
+  struct pool_item_s *next;
+  char *key;               /* The host, port, and flags.  */
+  my_socket_t sock;        /* The connected socket.  */
+  http_session_t session;  /* The session with the TLS state or NULL.  */
+  int use_tls;             /* The connection uses TLS.  */
+  time_t expires;          /* Do not use the connection after this.  */
+};
+typedef struct pool_item_s *pool_item_t;
+
+/* The maximum number of idle connections and the number of seconds
+ * we keep an idle connection.  Servers usually close idle
+ * connections after a few seconds; thus we better use a short time
+ * to avoid sending a request over an already closed connection.  */
+#define POOL_MAX_ITEMS    8
+#define POOL_IDLE_TIMEOUT 10
+
+/* The list of idle connections.  */
+static pool_item_t conn_pool;
+
+
 /* Two flags to enable verbose and debug mode.  Although currently not
  * set-able a value > 1 for OPT_DEBUG enables debugging of the session
  * reference counting.  */
@@ -323,6 +354,34 @@ static strlist_t cfg_ca_certlist;
 /* The global callback for net activity.  */
 static void (*netactivity_cb)(void);
 
+#if HTTP_USE_GNUTLS
+/* Data to resume a TLS session with a server.  */
+struct tls_resume_s
+{
+  struct tls_resume_s *next;
+  char *key;               /* The same key as used by the pool.  */
+  gnutls_datum_t data;     /* The session data.  */
+  time_t created;          /* The time the data was stored.  */
+};
+typedef struct tls_resume_s *tls_resume_t;
+
+/* The maximum number of TLS sessions we remember.  */
+#define TLS_RESUME_MAX_ITEMS 16
+
+/* The maximum age in seconds of a TLS session loaded from a file.
+ * Most servers do not accept older tickets anyway.  */
+#define TLS_RESUME_MAX_AGE (24*60*60)
+
+/* The maximum length of a line in the file with the TLS sessions.  */
+#define TLS_RESUME_MAX_LINE 16384
+
+/* The list of TLS sessions which may be resumed.  */
+static tls_resume_t tls_resume_list;
+
+/* Set if TLS_RESUME_LIST has changed since it was last saved.  */
+static int tls_resume_dirty;
+#endif /*HTTP_USE_GNUTLS*/
+
 
 
 #if defined(HAVE_W32_SYSTEM) && !defined(HTTP_NO_WSASTARTUP)
@@ -1223,6 +1282,7 @@ http_close (http_t hd, int keep_read_stream)
       hd->headers = tmp;
     }
   xfree (hd->buffer);
+  xfree (hd->pool_key);
   xfree (hd);
 }
 
@@ -1743,6 +1803,439 @@ is_hostname_port (const char *string)
 }
 
 
+#ifdef HTTP_USE_GNUTLS
+static void send_gnutls_bye (void *opaque);
+#endif
+
+/* Close the connection with SOCK and SESSION and release KEY.  */
+static void
+close_pooled_conn (char *key, my_socket_t sock, int use_tls,
+                   http_session_t session)
+{
+  if (opt_debug)
+    log_debug ("http.c:pool: closing connection '%s'\n", key);
+#if HTTP_USE_GNUTLS
+  if (use_tls && session && session->tls_session)
+    my_socket_unref (sock, send_gnutls_bye, session->tls_session);
+  else
+#endif /*HTTP_USE_GNUTLS*/
+    my_socket_unref (sock, NULL, NULL);
+  http_session_unref (session);
+  xfree (key);
+}
+
+
+/* Close the pooled connection ITEM and release it.  */
+static void
+release_pool_item (pool_item_t item)
+{
+  if (!item)
+    return;
+
+  close_pooled_conn (item->key, item->sock, item->use_tls, item->session);
+  xfree (item);
+}
+
+
+/* Remove all connections from the pool which are idle for too
+ * long.  Closing a TLS connection may block; thus we first detach
+ * the expired items so that other threads see a consistent pool.  */
+static void
+expire_pooled_conns (void)
+{
+  pool_item_t item, prev, next;
+  pool_item_t expired = NULL;
+  time_t now = gnupg_get_time ();
+
+  for (prev = NULL, item = conn_pool; item; item = next)
+    {
+      next = item->next;
+      if (item->expires > now)
+        {
+          prev = item;
+          continue;
+        }
+      if (prev)
+        prev->next = next;
+      else
+        conn_pool = next;
+      item->next = expired;
+      expired = item;
+    }
+
+  for (item = expired; item; item = next)
+    {
+      next = item->next;
+      release_pool_item (item);
+    }
+}
+
+
+/* Put the connection with SOCK and SESSION into the pool under KEY.
+ * This function takes ownership of KEY and of the references to SOCK
+ * and SESSION.  */
+static void
+put_pooled_conn (char *key, my_socket_t sock, int use_tls,
+                 http_session_t session)
+{
+  pool_item_t item, prev;
+  int count;
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    {
+      close_pooled_conn (key, sock, use_tls, session);
+      return;
+    }
+  item->key = key;
+  item->sock = sock;
+  item->session = session;
+  item->use_tls = use_tls;
+  item->expires = gnupg_get_time () + POOL_IDLE_TIMEOUT;
+
+  expire_pooled_conns ();
+  item->next = conn_pool;
+  conn_pool = item;
+  if (opt_debug)
+    log_debug ("http.c:pool: keeping connection '%s'\n", key);
+
+  /* Drop the oldest connection if there are too many.  */
+  for (count = 0, prev = NULL, item = conn_pool; item;
+       prev = item, item = item->next)
+    if (++count > POOL_MAX_ITEMS)
+      {
+        prev->next = NULL;
+        while (item)
+          {
+            pool_item_t tmp = item->next;
+            release_pool_item (item);
+            item = tmp;
+          }
+        break;
+      }
+}
+
+
+/* Return true if the idle connection SO has neither been closed by
+ * the server nor has unexpected data.  */
+static int
+pooled_conn_is_idle (my_socket_t so)
+{
+  fd_set rfds;
+  struct timeval tv;
+
+  FD_ZERO (&rfds);
+  FD_SET (FD2INT (so->fd), &rfds);
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  return !my_select (FD2INT (so->fd) + 1, &rfds, NULL, NULL, &tv);
+}
+
+
+/* Try to take a connection for HD->POOL_KEY from the pool.  On
+ * success the socket and for TLS the session of the pooled connection
+ * are stored in HD and true is returned.  */
+static int
+take_pooled_conn (http_t hd)
+{
+  pool_item_t item, prev;
+
+  expire_pooled_conns ();
+  for (prev = NULL, item = conn_pool; item; prev = item, item = item->next)
+    if (!strcmp (item->key, hd->pool_key))
+      break;
+  if (!item)
+    return 0;
+  if (prev)
+    prev->next = item->next;
+  else
+    conn_pool = item->next;
+
+  if (!pooled_conn_is_idle (item->sock))
+    {
+      release_pool_item (item);
+      return take_pooled_conn (hd);  /* Try the next one.  */
+    }
+
+  if (opt_debug)
+    log_debug ("http.c:pool: reusing connection '%s'\n", item->key);
+  hd->sock = item->sock;
+  if (item->use_tls)
+    {
+      /* The TLS state lives in the session; thus we need to use the
+       * session of the pooled connection.  It has been created with
+       * the same flags.  */
+      http_session_unref (hd->session);
+      hd->session = item->session;
+    }
+  else
+    http_session_unref (item->session);
+  xfree (item->key);
+  xfree (item);
+  return 1;
+}
+
+
+/* Return the key into the connection pool for a request of HD to
+ * SERVER at PORT using SERVERNAME for TLS.  Returns NULL on
+ * error.  */
+static char *
+make_pool_key (http_t hd, const char *servername,
+               const char *server, unsigned short port)
+{
+  return xtryasprintf ("%s|%s|%hu|%u|%u",
+                       hd->uri->use_tls? servername : "",
+                       server, port,
+                       (hd->flags & (HTTP_FLAG_FORCE_TOR
+                                     | HTTP_FLAG_IGNORE_IPv4
+                                     | HTTP_FLAG_IGNORE_IPv6)),
+                       (hd->uri->use_tls && hd->session)?
+                       hd->session->flags : 0);
+}
+
+
+#if HTTP_USE_GNUTLS
+/* Set the data to resume an earlier TLS session for HD->POOL_KEY.  */
+static void
+restore_tls_resume (http_t hd)
+{
+  tls_resume_t r;
+  int rc;
+
+  for (r = tls_resume_list; r; r = r->next)
+    if (!strcmp (r->key, hd->pool_key))
+      break;
+  if (!r)
+    return;
+
+  rc = gnutls_session_set_data (hd->session->tls_session,
+                                r->data.data, r->data.size);
+  if (rc < 0)
+    log_info ("gnutls_session_set_data failed: %s\n", gnutls_strerror (rc));
+}
+
+
+/* Remember the TLS session of HD so that the next connection to the
+ * same server can resume it.  */
+static void
+save_tls_resume (http_t hd)
+{
+  tls_resume_t r, prev;
+  gnutls_datum_t data;
+  int count, rc;
+
+  rc = gnutls_session_get_data2 (hd->session->tls_session, &data);
+  if (rc < 0)
+    return;
+
+  for (prev = NULL, r = tls_resume_list; r; prev = r, r = r->next)
+    if (!strcmp (r->key, hd->pool_key))
+      break;
+  if (r)
+    {
+      if (prev)
+        prev->next = r->next;
+      else
+        tls_resume_list = r->next;
+      gnutls_free (r->data.data);
+    }
+  else
+    {
+      r = xtrycalloc (1, sizeof *r);
+      if (!r || !(r->key = xtrystrdup (hd->pool_key)))
+        {
+          xfree (r);
+          gnutls_free (data.data);
+          return;
+        }
+    }
+  r->data = data;
+  r->created = gnupg_get_time ();
+  r->next = tls_resume_list;
+  tls_resume_list = r;
+  tls_resume_dirty = 1;
+
+  /* Forget the oldest sessions.  */
+  for (count = 0, prev = NULL, r = tls_resume_list; r;
+       prev = r, r = r->next)
+    if (++count > TLS_RESUME_MAX_ITEMS)
+      {
+        prev->next = NULL;
+        while (r)
+          {
+            tls_resume_t tmp = r->next;
+            gnutls_free (r->data.data);
+            xfree (r->key);
+            xfree (r);
+            r = tmp;
+          }
+        break;
+      }
+}
+#endif /*HTTP_USE_GNUTLS*/
+
+
+/* Load the TLS sessions saved by http_tls_resume_save from FNAME so
+ * that connections made after a restart can resume them.  Each line
+ * of the file has the creation time, the key and the hex encoded
+ * session data.  */
+void
+http_tls_resume_load (const char *fname)
+{
+#if HTTP_USE_GNUTLS
+  estream_t fp;
+  char *line = NULL;
+  size_t linelen = 0;
+  size_t maxlen;
+  ssize_t len;
+  char *fields[3];
+  time_t now = gnupg_get_time ();
+  time_t created;
+  tls_resume_t r, *tail;
+  int count = 0;
+  size_t n;
+
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info ("error opening '%s': %s\n",
+                  fname, gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+
+  for (tail = &tls_resume_list; *tail; tail = &(*tail)->next)
+    count++;
+  maxlen = TLS_RESUME_MAX_LINE;
+  while (count < TLS_RESUME_MAX_ITEMS
+         && (len = es_read_line (fp, &line, &linelen, &maxlen)) > 0)
+    {
+      if (!maxlen)
+        break;  /* Line too long.  */
+      maxlen = TLS_RESUME_MAX_LINE;
+      trim_spaces (line);
+      if (!*line || *line == '#')
+        continue;
+      if (split_fields (line, fields, DIM (fields)) != DIM (fields))
+        continue;
+      created = (time_t)strtoul (fields[0], NULL, 10);
+      if (created > now || now - created > TLS_RESUME_MAX_AGE)
+        continue;
+      n = strlen (fields[2]);
+      if (!n || (n % 2))
+        continue;
+
+      r = xtrycalloc (1, sizeof *r);
+      if (!r)
+        break;
+      r->key = xtrystrdup (fields[1]);
+      r->data.data = gnutls_malloc (n / 2);
+      if (!r->key || !r->data.data
+          || hex2bin (fields[2], r->data.data, n / 2) < 0)
+        {
+          gnutls_free (r->data.data);
+          xfree (r->key);
+          xfree (r);
+          continue;
+        }
+      r->data.size = n / 2;
+      r->created = created;
+      *tail = r;
+      tail = &r->next;
+      count++;
+    }
+  if (es_ferror (fp))
+    log_info ("error reading '%s': %s\n",
+              fname, gpg_strerror (gpg_error_from_syserror ()));
+  es_fclose (fp);
+  xfree (line);
+  if (opt_verbose)
+    log_info ("%d TLS sessions loaded from '%s'\n", count, fname);
+#else
+  (void)fname;
+#endif /*!HTTP_USE_GNUTLS*/
+}
+
+
+/* Write the TLS sessions to FNAME if they have been changed since
+ * the last call.  The file is only readable by the user because the
+ * session data is as sensitive as the session keys.  */
+void
+http_tls_resume_save (const char *fname)
+{
+#if HTTP_USE_GNUTLS
+  gpg_error_t err;
+  char *tmpfname = NULL;
+  char *buffer = NULL;
+  size_t size, len;
+  estream_t fp;
+  tls_resume_t r;
+  time_t now;
+
+  if (!tls_resume_dirty)
+    return;
+  tls_resume_dirty = 0;
+  now = gnupg_get_time ();
+
+  /* Collect the lines first so that the list can't change while we
+   * write the file.  */
+  size = 0;
+  for (r = tls_resume_list; r; r = r->next)
+    size += 20 + 1 + strlen (r->key) + 1 + 2 * r->data.size + 1;
+  buffer = xtrymalloc (size + 1);
+  if (!buffer)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  len = 0;
+  for (r = tls_resume_list; r; r = r->next)
+    {
+      if (now - r->created > TLS_RESUME_MAX_AGE)
+        continue;
+      len += snprintf (buffer + len, size + 1 - len, "%lu %s ",
+                       (unsigned long)r->created, r->key);
+      bin2hex (r->data.data, r->data.size, buffer + len);
+      len += 2 * r->data.size;
+      buffer[len++] = '\n';
+    }
+
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  fp = es_fopen (tmpfname, "w,mode=-rw");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  es_fputs ("# TLS sessions of dirmngr; do not edit.\n", fp);
+  es_write (fp, buffer, len, NULL);
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+
+ leave:
+  if (err)
+    {
+      log_error ("error writing '%s': %s\n", fname, gpg_strerror (err));
+      tls_resume_dirty = 1;  /* Try again later.  */
+    }
+  xfree (buffer);
+  xfree (tmpfname);
+#else
+  (void)fname;
+#endif /*!HTTP_USE_GNUTLS*/
+}
+
+
 /*
  * Send a HTTP request to the server
  * Returns 0 if the request was successful
@@ -1761,6 +2254,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
   char *authstr = NULL;
   assuan_fd_t sock;
   int have_http_proxy = 0;
+  int reused = 0;
 
   if (hd->uri->use_tls && !hd->session)
     {
@@ -1893,8 +2387,19 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
     }
   else
     {
-      err = connect_server (ctrl,
-                            server, port, hd->flags, srvtag, timeout, &sock);
+      /* Only direct connections are kept for reuse.  */
+      if ((hd->flags & HTTP_FLAG_KEEPALIVE)
+          && !(hd->flags & HTTP_FLAG_SHUTDOWN)
+          && (hd->req_type == HTTP_REQ_GET || hd->req_type == HTTP_REQ_POST))
+        {
+          hd->pool_key = make_pool_key (hd, httphost? httphost : server,
+                                        server, port);
+          if (hd->pool_key)
+            reused = take_pooled_conn (hd);
+        }
+      if (!reused)
+        err = connect_server (ctrl,
+                              server, port, hd->flags, srvtag, timeout, &sock);
     }
 
   if (err)
@@ -1902,11 +2407,15 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
       xfree (proxy_authstr);
       return err;
     }
-  hd->sock = my_socket_new (sock);
-  if (!hd->sock)
+  if (!reused)
     {
-      xfree (proxy_authstr);
-      return gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+      hd->sock = my_socket_new (sock);
+      if (!hd->sock)
+        {
+          xfree (proxy_authstr);
+          return gpg_err_make (default_errsource,
+                               gpg_err_code_from_syserror ());
+        }
     }
 
   if (have_http_proxy && hd->uri->use_tls)
@@ -1997,9 +2506,10 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
     }
 
 #if HTTP_USE_NTBTLS
-  if (hd->uri->use_tls)
+  if (hd->uri->use_tls && !reused)
     {
       estream_t in, out;
+      unsigned long started;
 
       my_socket_ref (hd->sock);
 
@@ -2054,6 +2564,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
             }
         }
 
+      started = dirmngr_stats_clock ();
       while ((err = ntbtls_handshake (hd->session->tls_session)))
         {
           switch (err)
@@ -2061,10 +2572,12 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
             default:
               log_info ("TLS handshake failed: %s <%s>\n",
                         gpg_strerror (err), gpg_strsource (err));
+              dirmngr_stats_update (DIRMNGR_STATS_TLS, started, err);
               xfree (proxy_authstr);
               return err;
             }
         }
+      dirmngr_stats_update (DIRMNGR_STATS_TLS, started, 0);
 
       hd->session->verify.done = 0;
 
@@ -2102,9 +2615,10 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
 
 #elif HTTP_USE_GNUTLS
 
-  if (hd->uri->use_tls)
+  if (hd->uri->use_tls && !reused)
     {
       int rc;
+      unsigned long started;
 
       my_socket_ref (hd->sock);
       gnutls_transport_set_ptr (hd->session->tls_session, hd->sock);
@@ -2112,13 +2626,19 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
                                           my_gnutls_read);
       gnutls_transport_set_push_function (hd->session->tls_session,
                                           my_gnutls_write);
+      if (hd->pool_key)
+        restore_tls_resume (hd);
 
+      started = dirmngr_stats_clock ();
     handshake_again:
       do
         {
           rc = gnutls_handshake (hd->session->tls_session);
         }
       while (rc == GNUTLS_E_INTERRUPTED || rc == GNUTLS_E_AGAIN);
+      if (rc != GNUTLS_E_WARNING_ALERT_RECEIVED)
+        dirmngr_stats_update (DIRMNGR_STATS_TLS, started,
+                              rc < 0? gpg_error (GPG_ERR_NETWORK) : 0);
       if (rc < 0)
         {
           if (rc == GNUTLS_E_WARNING_ALERT_RECEIVED
@@ -2222,14 +2742,15 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
         snprintf (portstr, sizeof portstr, ":%u", port);
 
       request = es_bsprintf
-        ("%s %s%s HTTP/1.0\r\nHost: %s%s\r\n%s",
+        ("%s %s%s HTTP/1.0\r\nHost: %s%s\r\n%s%s",
          hd->req_type == HTTP_REQ_GET ? "GET" :
          hd->req_type == HTTP_REQ_HEAD ? "HEAD" :
          hd->req_type == HTTP_REQ_POST ? "POST" : "OOPS",
          *p == '/' ? "" : "/", p,
          httphost? httphost : server,
          portstr,
-         authstr? authstr:"");
+         authstr? authstr:"",
+         hd->pool_key? "Connection: keep-alive\r\n" : "");
     }
   xfree (p);
   if (!request)
@@ -2504,6 +3025,7 @@ parse_response (http_t hd)
   size_t maxlen, len;
   cookie_t cookie = hd->read_cookie;
   const char *s;
+  int is_http_1_1;
 
   /* Delete old header lines.  */
   while (hd->headers)
@@ -2544,6 +3066,7 @@ parse_response (http_t hd)
     }
   if (!p2)
     return 0; /* Also assume http 0.9. */
+  is_http_1_1 = !strcmp (p, "1.1");
   p = p2;
   /* TODO: Add HTTP version number check. */
   if ((p2 = strpbrk (p, " \t")))
@@ -2595,6 +3118,23 @@ parse_response (http_t hd)
         }
     }
 
+  /* We can only reuse the connection if we know where the body
+   * ends.  HTTP/1.1 servers keep the connection by default; we asked
+   * for it using the HTTP/1.0 way to avoid a chunked response.  */
+  if (hd->pool_key && cookie->content_length_valid
+      && hd->status_code >= 200 && hd->status_code != 204
+      && hd->status_code != 304)
+    {
+      s = http_get_header (hd, "Connection");
+      if (s? !ascii_strcasecmp (s, "keep-alive") : is_http_1_1)
+        cookie->pool_key = xtrystrdup (hd->pool_key);
+    }
+#if HTTP_USE_GNUTLS
+  if (hd->pool_key && cookie->use_tls && hd->session
+      && hd->session->tls_session)
+    save_tls_resume (hd);
+#endif /*HTTP_USE_GNUTLS*/
+
   return 0;
 }
 
@@ -2887,12 +3427,198 @@ connect_with_timeout (assuan_fd_t sock,
 }
 
 
+#ifndef HAVE_W32_SYSTEM
+/* The delay in milliseconds before the next address is tried while
+ * the connection attempts to the previous ones are still pending.
+ * This is the "Connection Attempt Delay" of RFC 8305.  */
+#define CONNECT_ATTEMPT_DELAY 250
+
+/* The maximum number of addresses tried for one host.  */
+#define MAX_PARALLEL_CONNECTS 16
+
+/* Return the current time in milliseconds.  */
+static unsigned long
+get_msec (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+
+/* Connect to one of the NADDRS addresses at ADDRS in the way of RFC
+ * 8305 ("Happy Eyeballs"): The next address is tried after
+ * CONNECT_ATTEMPT_DELAY milliseconds or as soon as all pending
+ * attempts failed; the first established connection wins and all
+ * other attempts are canceled.  TIMEOUT is the timeout for each
+ * attempt in milliseconds; 0 uses the system's default.  On success
+ * the socket is stored in blocking mode at R_SOCK.  On error the
+ * error of the last failed attempt is returned.  */
+static gpg_error_t
+connect_parallel (dns_addrinfo_t *addrs, int naddrs, unsigned int timeout,
+                  assuan_fd_t *r_sock)
+{
+  struct {
+    assuan_fd_t sock;        /* ASSUAN_INVALID_FD if not pending.  */
+    int oflags;              /* The original socket flags.  */
+    unsigned long started;   /* Start time of the attempt.  */
+  } att[MAX_PARALLEL_CONNECTS];
+  gpg_error_t err, last_err;
+  int natt = 0;              /* Number of started attempts.  */
+  int npending = 0;          /* Number of pending attempts.  */
+  unsigned long now, wait;
+  unsigned long last_start = 0;
+  fd_set wset;
+  struct timeval tval;
+  int i, n, maxfd, syserr;
+  socklen_t slen;
+  assuan_fd_t sock;
+
+  *r_sock = ASSUAN_INVALID_FD;
+  last_err = gpg_err_make (default_errsource, GPG_ERR_ENETUNREACH);
+  if (naddrs > MAX_PARALLEL_CONNECTS)
+    naddrs = MAX_PARALLEL_CONNECTS;
+
+  for (;;)
+    {
+      now = get_msec ();
+
+      /* Start the next attempt if it is due.  */
+      if (natt < naddrs
+          && (!npending || now - last_start >= CONNECT_ATTEMPT_DELAY))
+        {
+          dns_addrinfo_t ai = addrs[natt];
+
+          i = natt++;
+          att[i].sock = ASSUAN_INVALID_FD;
+          att[i].started = last_start = now;
+          sock = my_sock_new_for_addr (ai->addr, ai->socktype, ai->protocol);
+          if (sock == ASSUAN_INVALID_FD)
+            {
+              err = gpg_err_make (default_errsource,
+                                  gpg_err_code_from_syserror ());
+              log_error ("error creating socket: %s\n", gpg_strerror (err));
+              last_err = err;
+              continue;
+            }
+          att[i].oflags = fcntl (sock, F_GETFL, 0);
+          if (fcntl (sock, F_SETFL, att[i].oflags | O_NONBLOCK))
+            {
+              last_err = gpg_err_make (default_errsource,
+                                       gpg_err_code_from_syserror ());
+              assuan_sock_close (sock);
+              continue;
+            }
+          if (!assuan_sock_connect (sock, (struct sockaddr *)ai->addr,
+                                    ai->addrlen))
+            {
+              /* Immediate connect.  */
+              fcntl (sock, F_SETFL, att[i].oflags);
+              *r_sock = sock;
+              err = 0;
+              goto leave;
+            }
+          err = gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+          if (gpg_err_code (err) != GPG_ERR_EINPROGRESS)
+            {
+              last_err = err;
+              assuan_sock_close (sock);
+              continue;
+            }
+          att[i].sock = sock;
+          npending++;
+          continue;
+        }
+
+      if (!npending)
+        break;  /* All attempts failed.  */
+
+      /* Wait for a pending attempt, its timeout or the next start.  */
+      FD_ZERO (&wset);
+      maxfd = -1;
+      wait = (unsigned long)(-1);
+      for (i=0; i < natt; i++)
+        {
+          if (att[i].sock == ASSUAN_INVALID_FD)
+            continue;
+          if (timeout && now - att[i].started >= timeout)
+            {
+              assuan_sock_close (att[i].sock);
+              att[i].sock = ASSUAN_INVALID_FD;
+              npending--;
+              last_err = gpg_err_make (default_errsource, GPG_ERR_ETIMEDOUT);
+              continue;
+            }
+          FD_SET (FD2INT (att[i].sock), &wset);
+          if (FD2INT (att[i].sock) > maxfd)
+            maxfd = FD2INT (att[i].sock);
+          if (timeout && att[i].started + timeout - now < wait)
+            wait = att[i].started + timeout - now;
+        }
+      if (!npending)
+        continue;
+      if (natt < naddrs && last_start + CONNECT_ATTEMPT_DELAY - now < wait)
+        wait = last_start + CONNECT_ATTEMPT_DELAY - now;
+
+      tval.tv_sec = wait / 1000;
+      tval.tv_usec = (wait % 1000) * 1000;
+      n = my_select (maxfd+1, NULL, &wset, NULL,
+                     wait == (unsigned long)(-1)? NULL : &tval);
+      if (n < 0)
+        {
+          err = gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+          if (gpg_err_code (err) == GPG_ERR_EINTR)
+            continue;
+          goto leave;
+        }
+
+      for (i=0; n > 0 && i < natt; i++)
+        {
+          if (att[i].sock == ASSUAN_INVALID_FD
+              || !FD_ISSET (FD2INT (att[i].sock), &wset))
+            continue;
+          slen = sizeof (syserr);
+          if (getsockopt (FD2INT (att[i].sock), SOL_SOCKET, SO_ERROR,
+                          (void*)&syserr, &slen) < 0)
+            err = gpg_err_make (default_errsource,
+                                gpg_err_code_from_syserror ());
+          else if (syserr)
+            err = gpg_err_make (default_errsource,
+                                gpg_err_code_from_errno (syserr));
+          else
+            {
+              /* Connected.  */
+              fcntl (att[i].sock, F_SETFL, att[i].oflags);
+              *r_sock = att[i].sock;
+              att[i].sock = ASSUAN_INVALID_FD;
+              err = 0;
+              goto leave;
+            }
+          last_err = err;
+          assuan_sock_close (att[i].sock);
+          att[i].sock = ASSUAN_INVALID_FD;
+          npending--;
+        }
+    }
+  err = last_err;
+
+ leave:
+  for (i=0; i < natt; i++)
+    if (att[i].sock != ASSUAN_INVALID_FD)
+      assuan_sock_close (att[i].sock);
+  return err;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
 /* Actually connect to a server.  On success 0 is returned and the
  * file descriptor for the socket is stored at R_SOCK; on error an
  * error code is returned and ASSUAN_INVALID_FD is stored at R_SOCK.
  * TIMEOUT is the connect timeout in milliseconds.  Note that the
  * function tries to connect to all known addresses and the timeout is
- * for each one. */
+ * for each one.  Except for Windows and Tor the addresses of a host
+ * are tried in parallel with IPv6 and IPv4 interleaved. */
 static gpg_error_t
 connect_server (ctrl_t ctrl, const char *server, unsigned short port,
                 unsigned int flags, const char *srvtag, unsigned int timeout,
@@ -2991,6 +3717,66 @@ connect_server (ctrl_t ctrl, const char *server, unsigned short port,
         }
       hostfound = 1;
 
+#ifndef HAVE_W32_SYSTEM
+      {
+        dns_addrinfo_t cand[MAX_PARALLEL_CONNECTS];
+        dns_addrinfo_t v6 = NULL, v4 = NULL;
+        int ncand = 0;
+        int no_parallel = 0;
+        int want_v6 = 0;
+
+        /* Interleave the address families as recommended by RFC 8305
+         * starting with the family of the first address.  */
+        for (ai = aibuf; ai; ai = ai->next)
+          if ((ai->family == AF_INET6
+               && !(flags & HTTP_FLAG_IGNORE_IPv6) && v6_valid)
+              || (ai->family == AF_INET
+                  && !(flags & HTTP_FLAG_IGNORE_IPv4) && v4_valid))
+            {
+              if (use_socks (ai->addr))
+                no_parallel = 1;
+              if (!v6 && !v4)
+                want_v6 = (ai->family == AF_INET6);
+              if (ai->family == AF_INET6 && !v6)
+                v6 = ai;
+              else if (ai->family == AF_INET && !v4)
+                v4 = ai;
+            }
+        while (!no_parallel && (v6 || v4) && ncand < MAX_PARALLEL_CONNECTS)
+          {
+            int fam = (want_v6 && v6) || !v4? AF_INET6 : AF_INET;
+
+            ai = fam == AF_INET6? v6 : v4;
+            cand[ncand++] = ai;
+            for (ai = ai->next; ai; ai = ai->next)
+              if (ai->family == fam)
+                break;
+            if (fam == AF_INET6)
+              v6 = ai;
+            else
+              v4 = ai;
+            want_v6 = !want_v6;
+          }
+
+        if (!no_parallel && ncand > 1)
+          {
+            anyhostaddr = 1;
+            if (sock != ASSUAN_INVALID_FD)
+              assuan_sock_close (sock);
+            err = connect_parallel (cand, ncand, timeout, &sock);
+            if (err)
+              last_err = err;
+            else
+              {
+                connected = 1;
+                notify_netactivity ();
+              }
+            free_dns_addrinfo (aibuf);
+            continue;
+          }
+      }
+#endif /*!HAVE_W32_SYSTEM*/
+
       for (ai = aibuf; ai && !connected; ai = ai->next)
         {
           if (ai->family == AF_INET
@@ -3354,6 +4140,17 @@ cookie_close (void *cookie)
   if (!c)
     return 0;
 
+  /* Keep the connection if the entire response has been read.  */
+  if (c->pool_key && c->sock && c->content_length_valid
+      && !c->content_length
+      && (!c->use_tls || (c->session && c->session->tls_session)))
+    {
+      put_pooled_conn (c->pool_key, c->sock, c->use_tls, c->session);
+      xfree (c);
+      return 0;
+    }
+  xfree (c->pool_key);
+
 #if HTTP_USE_NTBTLS
   if (c->use_tls && c->session && c->session->tls_session)
     {
@@ -94,7 +94,8 @@ enum
     HTTP_FLAG_TRUST_DEF   = 256, /* Use the CAs configured for HKP.  */
     HTTP_FLAG_TRUST_SYS   = 512, /* Also use the system defined CAs. */
     HTTP_FLAG_TRUST_CFG  = 1024, /* Also use configured CAs.         */
-    HTTP_FLAG_NO_CRL     = 2048  /* Do not consult CRLs for https.   */
+    HTTP_FLAG_NO_CRL     = 2048, /* Do not consult CRLs for https.   */
+    HTTP_FLAG_KEEPALIVE  = 4096  /* Try to reuse the connection.     */
   };
 
 
@@ -133,6 +134,8 @@ void http_register_tls_callback (gpg_error_t (*cb)(http_t,http_session_t,int));
 void http_register_tls_ca (const char *fname);
 void http_register_cfg_ca (const char *fname);
 void http_register_netactivity_cb (void (*cb)(void));
+void http_tls_resume_load (const char *fname);
+void http_tls_resume_save (const char *fname);
 
 
 gpg_error_t http_session_new (http_session_t *r_session,
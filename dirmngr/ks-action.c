@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "dirmngr.h"
 #include "misc.h"
@@ -173,7 +174,13 @@ ks_action_search (ctrl_t ctrl, uri_item_t keyservers,
           any_server = 1;
 #if USE_LDAP
 	  if (is_ldap)
-	    err = ks_ldap_search (ctrl, uri->parsed_uri, patterns->d, &infp);
+            {
+              unsigned long started = dirmngr_stats_clock ();
+
+              err = ks_ldap_search (ctrl, uri->parsed_uri, patterns->d,
+                                    &infp);
+              dirmngr_stats_update (DIRMNGR_STATS_LDAP, started, err);
+            }
 	  else
 #endif
 	    {
@@ -207,6 +214,729 @@ ks_action_search (ctrl_t ctrl, uri_item_t keyservers,
 }
 
 
+/* Send the status lines captured in the stream FP to the client.  */
+void
+ks_action_replay_status (ctrl_t ctrl, estream_t fp)
+{
+  char line[1024];
+  char *p;
+
+  es_rewind (fp);
+  while (es_fgets (line, sizeof line, fp))
+    {
+      trim_trailing_spaces (line);
+      if ((p = strchr (line, ' ')))
+        *p++ = 0;
+      if (*line)
+        dirmngr_status_printf (ctrl, line, "%s", p? p : "");
+    }
+}
+
+
+/* The maximum number of bytes held by the response cache and the
+ * maximum size of a single response to be cached.  */
+#define KS_CACHE_MAX_BYTES  (4*1024*1024)
+#define KS_CACHE_MAX_ITEM   (512*1024)
+
+/* A cached response of a GET request.  The list is ordered with the
+ * most recently used item first.  Note that there is no need for a
+ * lock because none of the functions accessing the list call an npth
+ * function.  */
+struct ks_cache_item_s
+{
+  struct ks_cache_item_s *next;
+  time_t expires;         /* The time the item expires.  */
+  gpg_error_t err;        /* 0 or GPG_ERR_NO_DATA for a negative item.  */
+  void *data;             /* The response.  */
+  size_t datalen;
+  void *status;           /* The status lines.  */
+  size_t statuslen;
+  char key[1];            /* The request key.  */
+};
+static struct ks_cache_item_s *ks_cache;
+static unsigned int ks_cache_nitems;
+static size_t ks_cache_nbytes;
+
+/* Statistics for the response cache.  */
+static struct {
+  unsigned long hits;
+  unsigned long neghits;
+  unsigned long misses;
+  unsigned long stores;
+  unsigned long evictions;
+} ks_cache_stats;
+
+
+/* Return a malloced key for a GET request of PATTERN from the
+ * keyserver URI.  Key IDs and fingerprints are normalized so that
+ * different spellings map to the same key.  Returns NULL on error
+ * with ERRNO set.  */
+static char *
+make_request_key (parsed_uri_t uri, const char *pattern)
+{
+  const char *s;
+  char *key, *p;
+  int is_hex;
+
+  s = pattern;
+  if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    s += 2;
+  is_hex = (*s && strspn (s, "0123456789abcdefABCDEF") == strlen (s));
+  if (!is_hex)
+    s = pattern;
+  key = strconcat (uri->original, " ", s, NULL);
+  if (!key)
+    return NULL;
+  if (is_hex)
+    for (p = key + strlen (uri->original) + 1; *p; p++)
+      *p = ascii_toupper (*p);
+  return key;
+}
+
+
+static void
+ks_cache_release_item (struct ks_cache_item_s *item)
+{
+  if (!item)
+    return;
+  ks_cache_nbytes -= item->datalen + item->statuslen;
+  ks_cache_nitems--;
+  xfree (item->data);
+  xfree (item->status);
+  xfree (item);
+}
+
+
+/* Remove all expired items and then the least recently used items
+ * until the cache is within its limits.  */
+static void
+ks_cache_shrink (void)
+{
+  struct ks_cache_item_s *item, *prev, *next;
+  time_t now = gnupg_get_time ();
+  unsigned int n;
+
+  for (n=0, prev = NULL, item = ks_cache; item; item = next)
+    {
+      next = item->next;
+      if (item->expires <= now || n >= opt.ks_cache_size)
+        {
+          if (prev)
+            prev->next = next;
+          else
+            ks_cache = next;
+          ks_cache_release_item (item);
+          ks_cache_stats.evictions++;
+        }
+      else
+        {
+          prev = item;
+          n++;
+        }
+    }
+
+  while (ks_cache && ks_cache_nbytes > KS_CACHE_MAX_BYTES)
+    {
+      for (prev = NULL, item = ks_cache; item->next; item = item->next)
+        prev = item;
+      if (prev)
+        prev->next = NULL;
+      else
+        ks_cache = NULL;
+      ks_cache_release_item (item);
+      ks_cache_stats.evictions++;
+    }
+}
+
+
+/* Look up the response for the request KEY in the cache.  If found,
+ * return true and store the error of the request at R_ERR, a stream
+ * with the response at R_FP or NULL for a negative item, and a
+ * stream with the status lines at R_STATUSFP.  */
+static int
+ks_cache_lookup (const char *key, gpg_error_t *r_err,
+                 estream_t *r_fp, estream_t *r_statusfp)
+{
+  struct ks_cache_item_s *item, *prev;
+  time_t now = gnupg_get_time ();
+
+  *r_err = 0;
+  *r_fp = NULL;
+  *r_statusfp = NULL;
+  if (!opt.ks_cache_size)
+    return 0;
+
+  for (prev = NULL, item = ks_cache; item; prev = item, item = item->next)
+    if (!strcmp (item->key, key))
+      break;
+  if (!item || item->expires <= now)
+    {
+      ks_cache_stats.misses++;
+      dirmngr_stats_cache (DIRMNGR_CACHE_KS, 0);
+      return 0;
+    }
+
+  /* We copy the data so that the item may be removed while the
+   * caller uses the streams.  */
+  if (!item->err)
+    {
+      *r_fp = es_fopenmem_init (0, "rb", item->data, item->datalen);
+      if (!*r_fp)
+        {
+          ks_cache_stats.misses++;
+          dirmngr_stats_cache (DIRMNGR_CACHE_KS, 0);
+          return 0;
+        }
+    }
+  if (item->status)
+    *r_statusfp = es_fopenmem_init (0, "rb", item->status, item->statuslen);
+
+  /* Move the item to the front.  */
+  if (prev)
+    {
+      prev->next = item->next;
+      item->next = ks_cache;
+      ks_cache = item;
+    }
+
+  *r_err = item->err;
+  if (item->err)
+    ks_cache_stats.neghits++;
+  else
+    ks_cache_stats.hits++;
+  dirmngr_stats_cache (DIRMNGR_CACHE_KS, 1);
+  if (DBG_LOOKUP)
+    log_debug ("ks-action: using cached response for '%s'\n", key);
+  return 1;
+}
+
+
+/* Store the response of the request KEY as given by ERR, DATA and
+ * STATUS in the cache.  Only successful requests and requests which
+ * did not find a key are cached.  */
+static void
+ks_cache_put (const char *key, gpg_error_t err,
+              const void *data, size_t datalen,
+              const void *status, size_t statuslen)
+{
+  struct ks_cache_item_s *item, *prev;
+  unsigned int ttl;
+
+  if (!err)
+    ttl = opt.ks_cache_ttl;
+  else if (gpg_err_code (err) == GPG_ERR_NO_DATA)
+    {
+      ttl = opt.ks_cache_negative_ttl;
+      datalen = 0;
+    }
+  else
+    ttl = 0;
+  if (!ttl || !opt.ks_cache_size || datalen + statuslen > KS_CACHE_MAX_ITEM)
+    return;
+
+  /* Remove an old item for the same KEY.  */
+  for (prev = NULL, item = ks_cache; item; prev = item, item = item->next)
+    if (!strcmp (item->key, key))
+      {
+        if (prev)
+          prev->next = item->next;
+        else
+          ks_cache = item->next;
+        ks_cache_release_item (item);
+        break;
+      }
+
+  item = xtrycalloc (1, sizeof *item + strlen (key));
+  if (!item)
+    return;
+  strcpy (item->key, key);
+  if (datalen)
+    {
+      item->data = xtrymalloc (datalen);
+      if (!item->data)
+        {
+          xfree (item);
+          return;
+        }
+      memcpy (item->data, data, datalen);
+    }
+  item->datalen = datalen;
+  if (statuslen && (item->status = xtrymalloc (statuslen)))
+    {
+      memcpy (item->status, status, statuslen);
+      item->statuslen = statuslen;
+    }
+  item->err = err? gpg_error (GPG_ERR_NO_DATA) : 0;
+  item->expires = gnupg_get_time () + ttl;
+
+  item->next = ks_cache;
+  ks_cache = item;
+  ks_cache_nitems++;
+  ks_cache_nbytes += item->datalen + item->statuslen;
+  ks_cache_stats.stores++;
+
+  ks_cache_shrink ();
+}
+
+
+/* Remove all items from the response cache.  This is called after a
+ * KS_PUT and when the configuration has been re-read.  */
+void
+ks_action_cache_flush (void)
+{
+  struct ks_cache_item_s *item, *next;
+
+  for (item = ks_cache, ks_cache = NULL; item; item = next)
+    {
+      next = item->next;
+      ks_cache_release_item (item);
+    }
+}
+
+
+/* Print the statistics of the response cache.  If CTRL is not NULL
+ * they are sent as status lines to the client, otherwise they are
+ * written to the log.  */
+void
+ks_action_cache_print_stats (ctrl_t ctrl)
+{
+  char *buf;
+
+  buf = xtryasprintf ("ks-cache: items=%u bytes=%lu hits=%lu neghits=%lu"
+                      " misses=%lu stores=%lu evictions=%lu",
+                      ks_cache_nitems, (unsigned long)ks_cache_nbytes,
+                      ks_cache_stats.hits, ks_cache_stats.neghits,
+                      ks_cache_stats.misses, ks_cache_stats.stores,
+                      ks_cache_stats.evictions);
+  if (!buf)
+    return;
+  if (ctrl)
+    dirmngr_status_help (ctrl, buf);
+  else
+    log_info ("%s\n", buf);
+  xfree (buf);
+}
+
+
+/* A GET request which is currently running.  When several clients
+ * ask for the same key at the same time only the first request is
+ * sent to the keyserver; the others wait for it and then take a copy
+ * of its response and status lines.  A flight is removed from the
+ * list as soon as its response is available; the response cache
+ * above is used for later requests.  The list is keyed by the request
+ * key and is protected by KS_FLIGHTS_LOCK.  */
+struct ks_flight_s
+{
+  struct ks_flight_s *next;
+  unsigned int refcount;  /* Number of requests using this object.  */
+  unsigned int done:1;    /* The response is available.  */
+  unsigned int fatal:1;   /* ERR is not just a missing key.  */
+  gpg_error_t err;        /* The error returned by the request.  */
+  void *data;             /* The response; allocated by estream.  */
+  size_t datalen;
+  void *status;           /* The status lines; allocated by estream.  */
+  size_t statuslen;
+  char key[1];            /* The request key.  */
+};
+static struct ks_flight_s *ks_flights;
+static npth_mutex_t ks_flights_lock = NPTH_MUTEX_INITIALIZER;
+static npth_cond_t ks_flights_cond = NPTH_COND_INITIALIZER;
+
+
+/* Do the actual request for ks_get_shared.  The response is stored
+ * in FL.  */
+static void
+ks_get_shared_fetch (ctrl_t ctrl, parsed_uri_t uri, int is_hkp_s,
+                     int is_ldap, const char *pattern,
+                     struct ks_flight_s *fl)
+{
+  gpg_error_t err;
+  estream_t infp = NULL;
+  estream_t memfp = NULL;
+  estream_t statusfp, saved_capture;
+
+  /* Capture the status lines so that they can be replayed to all
+   * requests sharing this one.  */
+  statusfp = es_fopenmem (0, "w+");
+  if (!statusfp)
+    {
+      fl->err = gpg_error_from_syserror ();
+      fl->fatal = 1;
+      return;
+    }
+  saved_capture = ctrl->status_capture;
+  ctrl->status_capture = statusfp;
+
+  (void)is_ldap;
+#if USE_LDAP
+  if (is_ldap)
+    {
+      unsigned long started = dirmngr_stats_clock ();
+
+      err = ks_ldap_get (ctrl, uri, pattern, &infp);
+      dirmngr_stats_update (DIRMNGR_STATS_LDAP, started, err);
+    }
+  else
+#endif
+  if (is_hkp_s)
+    err = ks_hkp_get (ctrl, uri, pattern, &infp);
+  else
+    err = ks_http_fetch (ctrl, uri->original, KS_HTTP_FETCH_NOCACHE, &infp);
+
+  ctrl->status_capture = saved_capture;
+  fl->err = err;
+
+  if (!err)
+    {
+      /* Reading from the keyserver should never fail, thus we mark
+       * all errors from here on as fatal.  */
+      memfp = es_fopenmem (0, "w+b");
+      if (!memfp)
+        err = gpg_error_from_syserror ();
+      else
+        err = copy_stream (infp, memfp);
+      es_fclose (infp);
+      if (!err && es_fclose_snatch (memfp, &fl->data, &fl->datalen))
+        err = gpg_error_from_syserror ();
+      else if (err)
+        es_fclose (memfp);
+      memfp = NULL;
+      if (err)
+        {
+          fl->err = err;
+          fl->fatal = 1;
+        }
+    }
+
+  if (es_fclose_snatch (statusfp, &fl->status, &fl->statuslen))
+    {
+      fl->status = NULL;
+      fl->statuslen = 0;
+    }
+}
+
+
+/* Get the keys for PATTERN from the keyserver URI and return a
+ * memory stream with the response at R_FP.  Identical requests which
+ * are running at the same time share one request to the keyserver.
+ * IS_HKP_S and IS_LDAP select the engine; HTTP is used if both are
+ * false.  R_FATAL is set if the error is not just a missing key.  */
+static gpg_error_t
+ks_get_shared (ctrl_t ctrl, parsed_uri_t uri, int is_hkp_s, int is_ldap,
+               const char *pattern, estream_t *r_fp, int *r_fatal)
+{
+  gpg_error_t err;
+  struct ks_flight_s *fl;
+  estream_t fp;
+  char *key;
+
+  *r_fp = NULL;
+  *r_fatal = 0;
+
+  key = make_request_key (uri, pattern);
+  if (!key)
+    {
+      *r_fatal = 1;
+      return gpg_error_from_syserror ();
+    }
+
+  if (ks_cache_lookup (key, &err, r_fp, &fp))
+    {
+      xfree (key);
+      if (fp)
+        {
+          ks_action_replay_status (ctrl, fp);
+          es_fclose (fp);
+        }
+      return err;
+    }
+
+  npth_mutex_lock (&ks_flights_lock);
+  for (fl = ks_flights; fl; fl = fl->next)
+    if (!strcmp (fl->key, key))
+      break;
+  if (fl)
+    {
+      /* Join the running request.  */
+      fl->refcount++;
+      if (DBG_LOOKUP)
+        log_debug ("ks-action: waiting for running request '%s'\n", key);
+      while (!fl->done)
+        npth_cond_wait (&ks_flights_cond, &ks_flights_lock);
+      npth_mutex_unlock (&ks_flights_lock);
+    }
+  else
+    {
+      fl = xtrycalloc (1, sizeof *fl + strlen (key));
+      if (!fl)
+        {
+          err = gpg_error_from_syserror ();
+          npth_mutex_unlock (&ks_flights_lock);
+          xfree (key);
+          *r_fatal = 1;
+          return err;
+        }
+      strcpy (fl->key, key);
+      fl->refcount = 1;
+      fl->next = ks_flights;
+      ks_flights = fl;
+      npth_mutex_unlock (&ks_flights_lock);
+
+      ks_get_shared_fetch (ctrl, uri, is_hkp_s, is_ldap, pattern, fl);
+      if (!fl->fatal)
+        ks_cache_put (key, fl->err, fl->data, fl->datalen,
+                      fl->status, fl->statuslen);
+
+      npth_mutex_lock (&ks_flights_lock);
+      fl->done = 1;
+      if (ks_flights == fl)
+        ks_flights = fl->next;
+      else
+        {
+          struct ks_flight_s *prev;
+
+          for (prev = ks_flights; prev && prev->next != fl; prev = prev->next)
+            ;
+          if (prev)
+            prev->next = fl->next;
+        }
+      fl->next = NULL;
+      npth_cond_broadcast (&ks_flights_cond);
+      npth_mutex_unlock (&ks_flights_lock);
+    }
+  xfree (key);
+
+  /* FL is done and won't change anymore; our reference keeps it.  */
+  if (fl->status)
+    {
+      fp = es_fopenmem_init (0, "rb", fl->status, fl->statuslen);
+      if (fp)
+        {
+          ks_action_replay_status (ctrl, fp);
+          es_fclose (fp);
+        }
+    }
+  err = fl->err;
+  *r_fatal = fl->fatal;
+  if (!err)
+    {
+      *r_fp = es_fopenmem_init (0, "rb", fl->data, fl->datalen);
+      if (!*r_fp)
+        {
+          err = gpg_error_from_syserror ();
+          *r_fatal = 1;
+        }
+    }
+
+  npth_mutex_lock (&ks_flights_lock);
+  if (!--fl->refcount)
+    {
+      es_free (fl->data);
+      es_free (fl->status);
+      xfree (fl);
+    }
+  npth_mutex_unlock (&ks_flights_lock);
+
+  return err;
+}
+
+
+/* The result of one request done by a ks_get_worker thread.  */
+struct ks_get_result_s
+{
+  struct ks_get_result_s *next;
+  gpg_error_t err;     /* The error returned by the request.  */
+  int fatal;           /* ERR is not just a missing key.  */
+  estream_t data;      /* The fetched keys or NULL.  */
+  estream_t status;    /* The captured status lines or NULL.  */
+};
+
+/* The state shared by ks_get_parallel and its worker threads.  All
+ * fields are protected by LOCK.  */
+struct ks_get_parallel_s
+{
+  npth_mutex_t lock;
+  npth_cond_t cond;             /* Signaled when a worker is done.  */
+  ctrl_t ctrl;                  /* The caller's control object.  */
+  parsed_uri_t uri;             /* The keyserver.  */
+  int is_hkp_s;                 /* Use HKP and not plain HTTP.  */
+  strlist_t next;               /* The next pattern to request.  */
+  int stop;                     /* Do not start new requests.  */
+  int nrunning;                 /* Number of running workers.  */
+  struct ks_get_result_s *results;  /* Results not yet written.  */
+};
+
+
+/* Fetch the keys for PATTERN and store them in RES.  This is run by
+ * a worker thread; thus a private control object is used which
+ * captures the status lines.  */
+static void
+ks_get_one (struct ks_get_parallel_s *parm, const char *pattern,
+            struct ks_get_result_s *res)
+{
+  struct server_control_s wctrl;
+
+  memset (&wctrl, 0, sizeof wctrl);
+  wctrl.magic = parm->ctrl->magic;
+  wctrl.no_server = parm->ctrl->no_server;
+  wctrl.timeout = parm->ctrl->timeout;
+  wctrl.http_proxy = parm->ctrl->http_proxy;
+  wctrl.http_no_crl = parm->ctrl->http_no_crl;
+
+  res->status = es_fopenmem (0, "w+");
+  if (!res->status)
+    {
+      res->err = gpg_error_from_syserror ();
+      res->fatal = 1;
+      return;
+    }
+  wctrl.status_capture = res->status;
+
+  res->err = ks_get_shared (&wctrl, parm->uri, parm->is_hkp_s, 0, pattern,
+                            &res->data, &res->fatal);
+}
+
+
+/* The thread function for ks_get_parallel.  */
+static void *
+ks_get_worker (void *arg)
+{
+  struct ks_get_parallel_s *parm = arg;
+  struct ks_get_result_s *res;
+  strlist_t sl;
+
+  npth_mutex_lock (&parm->lock);
+  while (!parm->stop && parm->next)
+    {
+      sl = parm->next;
+      parm->next = sl->next;
+      npth_mutex_unlock (&parm->lock);
+
+      res = xtrycalloc (1, sizeof *res);
+      if (res)
+        ks_get_one (parm, sl->d, res);
+
+      npth_mutex_lock (&parm->lock);
+      if (!res)
+        {
+          parm->stop = 1;
+          break;
+        }
+      res->next = parm->results;
+      parm->results = res;
+      npth_cond_signal (&parm->cond);
+    }
+  parm->nrunning--;
+  npth_cond_signal (&parm->cond);
+  npth_mutex_unlock (&parm->lock);
+  return NULL;
+}
+
+
+/* Send the status lines captured for RES to the client.  */
+static void
+ks_get_replay_status (ctrl_t ctrl, struct ks_get_result_s *res)
+{
+  if (res->status)
+    ks_action_replay_status (ctrl, res->status);
+}
+
+
+/* Get the keys for all PATTERNS from the HKP or HTTP keyserver URI
+ * using up to opt.KEYSERVER_JOBS concurrent requests.  The keys are
+ * written to OUTFP as soon as a request has been completed.  The
+ * error of a failed request is stored at R_FIRST_ERR and R_ANY_DATA
+ * is set if keys have been written.  */
+static gpg_error_t
+ks_get_parallel (ctrl_t ctrl, parsed_uri_t uri, int is_hkp_s,
+                 strlist_t patterns, estream_t outfp,
+                 gpg_error_t *r_first_err, int *r_any_data)
+{
+  gpg_error_t err = 0;
+  struct ks_get_parallel_s parm;
+  struct ks_get_result_s *res;
+  npth_attr_t tattr;
+  npth_t thread;
+  strlist_t sl;
+  int i, rc;
+
+  memset (&parm, 0, sizeof parm);
+  parm.ctrl = ctrl;
+  parm.uri = uri;
+  parm.is_hkp_s = is_hkp_s;
+  parm.next = patterns;
+  rc = npth_mutex_init (&parm.lock, NULL);
+  if (rc)
+    return gpg_error_from_errno (rc);
+  rc = npth_cond_init (&parm.cond, NULL);
+  if (rc)
+    {
+      npth_mutex_destroy (&parm.lock);
+      return gpg_error_from_errno (rc);
+    }
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  npth_mutex_lock (&parm.lock);
+  for (i=0, sl = patterns; i < opt.keyserver_jobs && sl; i++, sl = sl->next)
+    {
+      rc = npth_create (&thread, &tattr, ks_get_worker, &parm);
+      if (rc)
+        {
+          log_error ("error spawning keyserver worker: %s\n", strerror (rc));
+          break;
+        }
+      parm.nrunning++;
+    }
+  npth_attr_destroy (&tattr);
+  if (!parm.nrunning)
+    {
+      err = gpg_error_from_errno (rc);
+      goto leave;
+    }
+
+  while (parm.nrunning || parm.results)
+    {
+      if (!parm.results)
+        {
+          npth_cond_wait (&parm.cond, &parm.lock);
+          continue;
+        }
+      res = parm.results;
+      parm.results = res->next;
+      npth_mutex_unlock (&parm.lock);
+
+      ks_get_replay_status (ctrl, res);
+      if (err)
+        ;
+      else if (res->fatal)
+        err = res->err;
+      else if (res->err)
+        *r_first_err = res->err;
+      else
+        {
+          es_rewind (res->data);
+          err = copy_stream (res->data, outfp);
+          if (!err)
+            *r_any_data = 1;
+        }
+      es_fclose (res->data);
+      es_fclose (res->status);
+      xfree (res);
+
+      npth_mutex_lock (&parm.lock);
+      if (err)
+        parm.stop = 1;
+    }
+
+ leave:
+  npth_mutex_unlock (&parm.lock);
+  npth_cond_destroy (&parm.cond);
+  npth_mutex_destroy (&parm.lock);
+  return err;
+}
+
+
 /* Get the requested keys (matching PATTERNS) using all configured
    keyservers and write the result to the provided output stream.  */
 gpg_error_t
@@ -217,6 +947,7 @@ ks_action_get (ctrl_t ctrl, uri_item_t keyservers,
   gpg_error_t first_err = 0;
   int any_server = 0;
   int any_data = 0;
+  int fatal;
   strlist_t sl;
   uri_item_t uri;
   estream_t infp;
@@ -244,26 +975,21 @@ ks_action_get (ctrl_t ctrl, uri_item_t keyservers,
 		 || strcmp (uri->parsed_uri->scheme, "ldapi") == 0);
 #endif
 
-      if (is_hkp_s || is_http_s || is_ldap)
+      if ((is_hkp_s || is_http_s) && opt.keyserver_jobs > 1
+          && patterns->next)
+        {
+          any_server = 1;
+          err = ks_get_parallel (ctrl, uri->parsed_uri, is_hkp_s, patterns,
+                                 outfp, &first_err, &any_data);
+        }
+      else if (is_hkp_s || is_http_s || is_ldap)
         {
           any_server = 1;
           for (sl = patterns; !err && sl; sl = sl->next)
             {
-#if USE_LDAP
-	      if (is_ldap)
-		err = ks_ldap_get (ctrl, uri->parsed_uri, sl->d, &infp);
-	      else
-#endif
-              if (is_hkp_s)
-                err = ks_hkp_get (ctrl, uri->parsed_uri, sl->d, &infp);
-              else if (is_http_s)
-                err = ks_http_fetch (ctrl, uri->parsed_uri->original,
-                                     KS_HTTP_FETCH_NOCACHE,
-                                     &infp);
-              else
-                BUG ();
-
-              if (err)
+              err = ks_get_shared (ctrl, uri->parsed_uri, is_hkp_s, is_ldap,
+                                   sl->d, &infp, &fatal);
+              if (err && !fatal)
                 {
                   /* It is possible that a server does not carry a
                      key, thus we only save the error and continue
@@ -273,11 +999,9 @@ ks_action_get (ctrl_t ctrl, uri_item_t keyservers,
                   first_err = err;
                   err = 0;
                 }
-              else
+              else if (!err)
                 {
                   err = copy_stream (infp, outfp);
-                  /* Reading from the keyserver should never fail, thus
-                     return this error.  */
                   if (!err)
                     any_data = 1;
                   es_fclose (infp);
@@ -389,8 +1113,13 @@ ks_action_put (ctrl_t ctrl, uri_item_t keyservers,
           any_server = 1;
 #if USE_LDAP
 	  if (is_ldap)
-	    err = ks_ldap_put (ctrl, uri->parsed_uri, data, datalen,
-			       info, infolen);
+            {
+              unsigned long started = dirmngr_stats_clock ();
+
+              err = ks_ldap_put (ctrl, uri->parsed_uri, data, datalen,
+                                 info, infolen);
+              dirmngr_stats_update (DIRMNGR_STATS_LDAP, started, err);
+            }
 	  else
 #endif
 	    {
@@ -404,6 +1133,10 @@ ks_action_put (ctrl_t ctrl, uri_item_t keyservers,
         }
     }
 
+  /* The keyservers may now return a different key.  */
+  if (any_server)
+    ks_action_cache_flush ();
+
   if (!any_server)
     err = gpg_error (GPG_ERR_NO_KEYSERVER);
   else if (!err && first_err)
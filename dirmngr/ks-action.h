@@ -31,6 +31,9 @@ gpg_error_t ks_action_fetch (ctrl_t ctrl, const char *url, estream_t outfp);
 gpg_error_t ks_action_put (ctrl_t ctrl, uri_item_t keyservers,
 			   void *data, size_t datalen,
 			   void *info, size_t infolen);
+void ks_action_replay_status (ctrl_t ctrl, estream_t fp);
+void ks_action_cache_flush (void);
+void ks_action_cache_print_stats (ctrl_t ctrl);
 
 
 #endif /*DIRMNGR_KS_ACTION_H*/
@@ -441,6 +441,167 @@ hostinfo_sort_pool (hostinfo_t hi)
   qsort (hi->pool, hi->pool_len, sizeof *hi->pool, sort_hostpool);
 }
 
+/* A DNS lookup run by run_dns_jobs.  */
+struct dns_job_s
+{
+  struct dns_job_parm_s *parm;  /* The shared state.  */
+  ctrl_t ctrl;
+  const char *name;             /* The name to look up.  */
+  int family;                   /* The address family for RESOLVE_DNS_NAME.  */
+  const char *srvtag;           /* If set do an SRV lookup instead and
+                                 * resolve the targets.  */
+
+  /* The results.  */
+  gpg_error_t err;
+  dns_addrinfo_t aibuf;         /* The addresses.  */
+  char *cname;                  /* The canonical name or NULL.  */
+  struct srventry *srvs;        /* The SRV records.  */
+  unsigned int srvscount;
+  struct dns_job_s *targets;    /* Array with the lookups for the SRV
+                                 * targets; SRVSCOUNT items.  */
+};
+
+/* The state shared by run_dns_jobs and its worker threads.  */
+struct dns_job_parm_s
+{
+  npth_mutex_t lock;
+  npth_cond_t cond;             /* Signaled when a worker is done.  */
+  int nrunning;                 /* Number of running workers.  */
+};
+
+
+static void run_dns_jobs (struct dns_job_s *jobs, int njobs);
+
+/* Run the lookup described by JOB.  */
+static void
+do_dns_job (struct dns_job_s *job)
+{
+  unsigned int i;
+
+  if (!job->srvtag)
+    {
+      job->err = resolve_dns_name (job->ctrl, job->name, 0, job->family,
+                                   SOCK_STREAM, &job->aibuf, &job->cname);
+      return;
+    }
+
+  job->err = get_dns_srv (job->ctrl, job->name, job->srvtag, NULL,
+                          &job->srvs, &job->srvscount);
+  if (job->err || !job->srvscount)
+    return;
+
+  /* Resolve all targets at once.  */
+  job->targets = xtrycalloc (job->srvscount, sizeof *job->targets);
+  if (!job->targets)
+    {
+      job->err = gpg_error_from_syserror ();
+      return;
+    }
+  for (i=0; i < job->srvscount; i++)
+    {
+      job->targets[i].ctrl = job->ctrl;
+      job->targets[i].name = job->srvs[i].target;
+      job->targets[i].family = AF_UNSPEC;
+    }
+  run_dns_jobs (job->targets, job->srvscount);
+}
+
+
+/* The thread function for run_dns_jobs.  */
+static void *
+dns_job_worker (void *arg)
+{
+  struct dns_job_s *job = arg;
+  struct dns_job_parm_s *parm = job->parm;
+
+  do_dns_job (job);
+
+  npth_mutex_lock (&parm->lock);
+  parm->nrunning--;
+  npth_cond_signal (&parm->cond);
+  npth_mutex_unlock (&parm->lock);
+  return NULL;
+}
+
+
+/* Run the NJOBS lookups of the array JOBS concurrently and wait
+ * until all of them are finished.  Thus the time this takes is that
+ * of the slowest lookup and not the sum.  If a thread can't be
+ * created the lookup is done by the caller.  */
+static void
+run_dns_jobs (struct dns_job_s *jobs, int njobs)
+{
+  struct dns_job_parm_s parm;
+  npth_attr_t tattr;
+  npth_t thread;
+  int i, rc;
+
+  if (njobs == 1 || npth_mutex_init (&parm.lock, NULL))
+    {
+      for (i=0; i < njobs; i++)
+        do_dns_job (jobs + i);
+      return;
+    }
+  if (npth_cond_init (&parm.cond, NULL))
+    {
+      npth_mutex_destroy (&parm.lock);
+      for (i=0; i < njobs; i++)
+        do_dns_job (jobs + i);
+      return;
+    }
+  parm.nrunning = 0;
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  /* The first lookup is done by the caller.  */
+  npth_mutex_lock (&parm.lock);
+  for (i=1; i < njobs; i++)
+    {
+      jobs[i].parm = &parm;
+      rc = npth_create (&thread, &tattr, dns_job_worker, jobs + i);
+      if (rc)
+        {
+          log_error ("error spawning DNS worker: %s\n", strerror (rc));
+          npth_mutex_unlock (&parm.lock);
+          do_dns_job (jobs + i);
+          npth_mutex_lock (&parm.lock);
+        }
+      else
+        parm.nrunning++;
+    }
+  npth_attr_destroy (&tattr);
+  npth_mutex_unlock (&parm.lock);
+
+  do_dns_job (jobs);
+
+  npth_mutex_lock (&parm.lock);
+  while (parm.nrunning)
+    npth_cond_wait (&parm.cond, &parm.lock);
+  npth_mutex_unlock (&parm.lock);
+
+  npth_cond_destroy (&parm.cond);
+  npth_mutex_destroy (&parm.lock);
+}
+
+
+/* Release the results of the NJOBS lookups in JOBS.  */
+static void
+release_dns_jobs (struct dns_job_s *jobs, int njobs)
+{
+  int i;
+
+  for (i=0; i < njobs; i++)
+    {
+      free_dns_addrinfo (jobs[i].aibuf);
+      xfree (jobs[i].cname);
+      if (jobs[i].targets)
+        release_dns_jobs (jobs[i].targets, jobs[i].srvscount);
+      xfree (jobs[i].targets);
+      xfree (jobs[i].srvs);
+    }
+}
+
+
 /* Map the host name NAME to the actual to be used host name.  This
  * allows us to manage round robin DNS names.  We use our own strategy
  * to choose one of the hosts.  For example we skip those hosts which
@@ -468,6 +629,10 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
   int is_pool;
   int new_hosts = 0;
   char *cname;
+  struct dns_job_s jobs[3];
+  struct dns_job_s *srvjob, *ajob;
+  int njobs, najobs = 0;
+  int i;
 
   *r_host = NULL;
   if (r_httpflags)
@@ -497,52 +662,95 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
 
   is_pool = hi->pool != NULL;
 
+  /* Prepare the SRV lookup and the lookups of the A and AAAA records
+   * so that all of them can be run at the same time.  */
+  njobs = 0;
+  srvjob = ajob = NULL;
+  memset (jobs, 0, sizeof jobs);
   if (srvtag && !is_ip_address (name)
       && ! hi->onion
       && ! (hi->did_srv_lookup & 1 << protocol))
     {
-      struct srventry *srvs;
-      unsigned int srvscount;
+      srvjob = jobs + njobs++;
+      srvjob->name = name;
+      srvjob->srvtag = srvtag;
+    }
+  if (! hi->did_a_lookup
+      && ! hi->onion)
+    {
+      ajob = jobs + njobs;
+      if (!opt.disable_ipv4)
+        jobs[njobs++].family = AF_INET;
+      if (!opt.disable_ipv6)
+        jobs[njobs++].family = AF_INET6;
+      najobs = jobs + njobs - ajob;
+      if (!najobs)
+        ajob = NULL;
+      for (i=0; i < najobs; i++)
+        ajob[i].name = name;
+    }
+  for (i=0; i < njobs; i++)
+    jobs[i].ctrl = ctrl;
+  run_dns_jobs (jobs, njobs);
 
+  if (srvjob)
+    {
       /* Check for SRV records.  */
-      err = get_dns_srv (ctrl, name, srvtag, NULL, &srvs, &srvscount);
+      err = srvjob->err;
       if (err)
         {
           if (gpg_err_code (err) == GPG_ERR_ECONNREFUSED)
             tor_not_running_p (ctrl);
+          release_dns_jobs (jobs, njobs);
           return err;
         }
 
-      if (srvscount > 0)
+      if (srvjob->srvscount > 0)
         {
-          int i;
           if (! is_pool)
-            is_pool = srvscount > 1;
+            is_pool = srvjob->srvscount > 1;
 
-          for (i = 0; i < srvscount; i++)
+          for (i = 0; i < srvjob->srvscount; i++)
             {
-              err = resolve_dns_name (ctrl, srvs[i].target, 0,
-                                      AF_UNSPEC, SOCK_STREAM,
-                                      &ai, &cname);
-              if (err)
+              if (srvjob->targets[i].err || !srvjob->targets[i].aibuf)
                 continue;
               dirmngr_tick (ctrl);
-              add_host (ctrl, name, is_pool, ai, protocol, srvs[i].port);
+              add_host (ctrl, name, is_pool, srvjob->targets[i].aibuf,
+                        protocol, srvjob->srvs[i].port);
               new_hosts = 1;
             }
-
-          xfree (srvs);
         }
 
       hi->did_srv_lookup |= 1 << protocol;
     }
 
-  if (! hi->did_a_lookup
-      && ! hi->onion)
+  if (ajob)
     {
       /* Find all A records for this entry and put them into the pool
-         list - if any.  */
-      err = resolve_dns_name (ctrl, name, 0, 0, SOCK_STREAM, &aibuf, &cname);
+         list - if any.  The lookup succeeded if one of the A or AAAA
+         lookups succeeded; we merge their results.  */
+      err = ajob[0].err;
+      aibuf = NULL;
+      cname = NULL;
+      for (i=0; i < najobs; i++)
+        if (!ajob[i].err)
+          {
+            err = 0;
+            if (!aibuf)
+              aibuf = ajob[i].aibuf;
+            else
+              {
+                for (ai = aibuf; ai->next; ai = ai->next)
+                  ;
+                ai->next = ajob[i].aibuf;
+              }
+            ajob[i].aibuf = NULL;
+            if (!cname)
+              {
+                cname = ajob[i].cname;
+                ajob[i].cname = NULL;
+              }
+          }
       if (err)
         {
           log_error ("resolving '%s' failed: %s\n", name, gpg_strerror (err));
@@ -582,6 +790,7 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
       xfree (cname);
       free_dns_addrinfo (aibuf);
     }
+  release_dns_jobs (jobs, njobs);
   if (new_hosts)
     hostinfo_sort_pool (hi);
 
@@ -1209,8 +1418,10 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
   estream_t fp = NULL;
   char *request_buffer = NULL;
   parsed_uri_t uri = NULL;
+  unsigned long started;
 
   *r_fp = NULL;
+  started = dirmngr_stats_clock ();
 
   err = http_parse_uri (&uri, request, 0);
   if (err)
@@ -1238,6 +1449,7 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
                    httphost,
                    /* fixme: AUTH */ NULL,
                    (httpflags
+                    |HTTP_FLAG_KEEPALIVE
                     |(opt.honor_http_proxy? HTTP_FLAG_TRY_PROXY:0)
                     |(dirmngr_use_tor ()? HTTP_FLAG_FORCE_TOR:0)
                     |(opt.disable_ipv4? HTTP_FLAG_IGNORE_IPv4 : 0)
@@ -1352,6 +1564,7 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
   http_session_release (session);
   xfree (request_buffer);
   http_release_parsed_uri (uri);
+  dirmngr_stats_update (DIRMNGR_STATS_HKP, started, err);
   return err;
 }
 
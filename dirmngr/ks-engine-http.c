@@ -79,7 +79,9 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
   char *request_buffer = NULL;
   parsed_uri_t uri = NULL;
   parsed_uri_t helpuri = NULL;
+  unsigned long started;
 
+  started = dirmngr_stats_clock ();
   err = http_parse_uri (&uri, url, 0);
   if (err)
     goto leave;
@@ -111,7 +113,8 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
                    url,
                    /* httphost */ NULL,
                    /* fixme: AUTH */ NULL,
-                   ((opt.honor_http_proxy? HTTP_FLAG_TRY_PROXY:0)
+                   (HTTP_FLAG_KEEPALIVE
+                    | (opt.honor_http_proxy? HTTP_FLAG_TRY_PROXY:0)
                     | (DBG_LOOKUP? HTTP_FLAG_LOG_RESP:0)
                     | (dirmngr_use_tor ()? HTTP_FLAG_FORCE_TOR:0)
                     | (opt.disable_ipv4? HTTP_FLAG_IGNORE_IPv4 : 0)
@@ -221,5 +224,6 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
   xfree (request_buffer);
   http_release_parsed_uri (uri);
   http_release_parsed_uri (helpuri);
+  dirmngr_stats_update (DIRMNGR_STATS_HTTP, started, err);
   return err;
 }
@@ -48,6 +48,7 @@
 #include "../common/userids.h"
 #include "ks-engine.h"
 #include "ldap-parse-uri.h"
+#include "ldap-pool.h"
 
 #ifndef HAVE_TIMEGM
 time_t timegm(struct tm *tm);
@@ -404,6 +405,14 @@ keyspec_to_ldap_filter (const char *keyspec, char **filter, int only_exact)
 
 
 
+/* Return the ldap-pool flags for a connection to URI.  */
+static unsigned int
+uri_pool_flags (parsed_uri_t uri)
+{
+  return LDAP_POOL_KEYSERVER | (uri->use_tls? LDAP_POOL_STARTTLS : 0);
+}
+
+
 /* Connect to an LDAP server and interrogate it.
 
      - uri describes the server to connect to and various options
@@ -426,9 +435,12 @@ keyspec_to_ldap_filter (const char *keyspec, char **filter, int only_exact)
 
    The values are returned in the passed variables.  If you pass NULL,
    then the value won't be returned.  It is the caller's
-   responsibility to release *LDAP_CONNP with ldap_unbind and xfree
+   responsibility to release *LDAP_CONNP with my_ldap_release and xfree
    *BASEDNP and *PGPKEYATTRP.
 
+   With --ldap-in-process a bound connection is taken from the
+   ldap-pool if possible.
+
    If this function successfully interrogated the server, it returns
    0.  If there was an LDAP error, it returns the LDAP error code.  If
    an error occurred, *basednp, etc., are undefined (and don't need to
@@ -455,6 +467,9 @@ my_ldap_connect (parsed_uri_t uri, LDAP **ldap_connp,
   char *pgpkeyattr = "pgpKey";
   int real_ldap = 0;
 
+  if (!uri->auth)
+    password = NULL;
+
   log_debug ("my_ldap_connect(%s:%d/%s????%s%s%s%s%s)\n",
 	     uri->host, uri->port,
 	     uri->path ?: "",
@@ -474,6 +489,14 @@ my_ldap_connect (parsed_uri_t uri, LDAP **ldap_connp,
 #endif
     }
 
+  if (opt.ldap_in_process)
+    {
+      ldap_conn = ldap_pool_get (uri->host, uri->port, uri_pool_flags (uri),
+                                 user, password, NULL);
+      if (ldap_conn)
+        goto bound;
+    }
+
   ldap_conn = ldap_init (uri->host, uri->port);
   if (! ldap_conn)
     {
@@ -565,6 +588,7 @@ my_ldap_connect (parsed_uri_t uri, LDAP **ldap_connp,
 	}
     }
 
+ bound:
   if (uri->path && *uri->path)
     /* User specified base DN.  */
     {
@@ -746,6 +770,28 @@ my_ldap_connect (parsed_uri_t uri, LDAP **ldap_connp,
   return err;
 }
 
+/* Release the connection LDAP_CONN returned by my_ldap_connect for
+   URI.  With --ldap-in-process and if FAILED is not set, the
+   connection is put back into the pool for the next query.  */
+static void
+my_ldap_release (parsed_uri_t uri, LDAP *ldap_conn, int failed)
+{
+  struct uri_tuple_s *password_param;
+
+  if (!ldap_conn)
+    return;
+
+  if (opt.ldap_in_process && !failed)
+    {
+      password_param = uri->auth? uri_query_lookup (uri, "password") : NULL;
+      ldap_pool_put (ldap_conn, uri->host, uri->port, uri_pool_flags (uri),
+                     uri->auth, password_param? password_param->value : NULL,
+                     NULL, NULL);
+    }
+  else
+    ldap_unbind (ldap_conn);
+}
+
 /* Extract keys from an LDAP reply and write them out to the output
    stream OUTPUT in a format GnuPG can import (either the OpenPGP
    binary format or armored format).  */
@@ -1004,8 +1050,7 @@ ks_ldap_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
   xfree (pgpkeyattr);
   xfree (basedn);
 
-  if (ldap_conn)
-    ldap_unbind (ldap_conn);
+  my_ldap_release (uri, ldap_conn, !!err);
 
   xfree (filter);
 
@@ -1291,8 +1336,7 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 
   xfree (basedn);
 
-  if (ldap_conn)
-    ldap_unbind (ldap_conn);
+  my_ldap_release (uri, ldap_conn, !!err);
 
   xfree (filter);
 
@@ -2071,8 +2115,7 @@ ks_ldap_put (ctrl_t ctrl, parsed_uri_t uri,
   if (dump)
     es_fclose (dump);
 
-  if (ldap_conn)
-    ldap_unbind (ldap_conn);
+  my_ldap_release (uri, ldap_conn, !!err);
 
   xfree (basedn);
   xfree (pgpkeyattr);
@@ -0,0 +1,708 @@
+/* ldap-fetch.c - Run an LDAP URL query
+ * Copyright (C) 2004 g10 Code GmbH
+ * Copyright (C) 2010 Free Software Foundation, Inc.
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* This module runs an LDAP query given by an URL and prints the
+ * result in the format described in ldap-wrapper.c.  It is used by
+ * the dirmngr_ldap helper and, if built with npth, also directly by
+ * dirmngr for its in-process LDAP mode.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifdef HAVE_W32_SYSTEM
+# include <winsock2.h>
+# include <winldap.h>
+# include <winber.h>
+# include "ldap-url.h"
+#else
+  /* For OpenLDAP, to enable the API that we're using. */
+# define LDAP_DEPRECATED 1
+# include <ldap.h>
+#endif
+
+#ifdef WITHOUT_NPTH /* Give the Makefile a chance to build without Pth.  */
+# undef USE_NPTH
+#endif
+
+#include <gpg-error.h>
+#include "../common/logging.h"
+#include "../common/stringhelp.h"
+#include "../common/mischelp.h"
+#include "../common/strlist.h"
+#include "../common/i18n.h"
+#include "../common/util.h"
+
+#ifdef USE_NPTH
+# include <npth.h>
+# include "ldap-pool.h"
+#else
+/* There is no need for the npth_unprotect and leave functions in a
+ * standalone program; thus we redefine them to nops.  */
+static void npth_unprotect (void) { }
+static void npth_protect (void) { }
+#endif
+
+#include "ldap-fetch.h"
+
+
+/* Multi-entry queries use the paged results control of RFC 2696 so
+ * that each page is printed as soon as it arrives and the memory use
+ * is bounded by the page size.  The control is not critical; servers
+ * not supporting it return all entries at once.  */
+#if !defined(HAVE_W32_SYSTEM) && defined(LDAP_CONTROL_PAGEDRESULTS)
+# define USE_PAGED_RESULTS 1
+#endif
+
+/* The number of entries requested per page.  */
+#define LDAP_PAGE_SIZE 500
+
+
+#if defined(HAVE_W32_SYSTEM) && !defined(USE_NPTH)
+static DWORD CALLBACK
+alarm_thread (void *arg)
+{
+  HANDLE timer = arg;
+
+  WaitForSingleObject (timer, INFINITE);
+  _exit (10);
+
+  return 0;
+}
+#endif
+
+
+/* Arm the alarm based timeout which terminates the process.  This
+ * is only possible in the standalone program; a daemon relies on the
+ * timeouts of the LDAP library.  */
+static void
+set_timeout (ldap_fetch_opt_t myopt)
+{
+#ifdef USE_NPTH
+  (void)myopt;
+#else
+  if (myopt->alarm_timeout)
+    {
+#ifdef HAVE_W32_SYSTEM
+      static HANDLE timer;
+      LARGE_INTEGER due_time;
+
+      /* A negative value is a relative time.  */
+      due_time.QuadPart = (unsigned long long)-10000000 * myopt->alarm_timeout;
+
+      if (!timer)
+        {
+          SECURITY_ATTRIBUTES sec_attr;
+          DWORD tid;
+
+          memset (&sec_attr, 0, sizeof sec_attr);
+          sec_attr.nLength = sizeof sec_attr;
+          sec_attr.bInheritHandle = FALSE;
+
+          /* Create a manual resettable timer.  */
+          timer = CreateWaitableTimer (NULL, TRUE, NULL);
+          /* Initially set the timer.  */
+          SetWaitableTimer (timer, &due_time, 0, NULL, NULL, 0);
+
+          if (CreateThread (&sec_attr, 0, alarm_thread, timer, 0, &tid))
+            log_error ("failed to create alarm thread\n");
+        }
+      else /* Retrigger the timer.  */
+        SetWaitableTimer (timer, &due_time, 0, NULL, NULL, 0);
+#else
+      alarm (myopt->alarm_timeout);
+#endif
+    }
+#endif /*!USE_NPTH*/
+}
+
+
+/* Helper for fetch_ldap().  */
+static int
+print_ldap_entries (ldap_fetch_opt_t myopt, LDAP *ld, LDAPMessage *msg, char *want_attr)
+{
+  LDAPMessage *item;
+  int any = 0;
+
+  for (npth_unprotect (), item = ldap_first_entry (ld, msg), npth_protect ();
+       item;
+       npth_unprotect (), item = ldap_next_entry (ld, item), npth_protect ())
+    {
+      BerElement *berctx;
+      char *attr;
+
+      if (myopt->verbose > 1)
+        log_info (_("scanning result for attribute '%s'\n"),
+                  want_attr? want_attr : "[all]");
+
+      if (myopt->multi)
+        { /*  Write item marker. */
+          if (es_fwrite ("I\0\0\0\0", 5, 1, myopt->outstream) != 1)
+            {
+              log_error (_("error writing to stdout: %s\n"),
+                         strerror (errno));
+              return -1;
+            }
+        }
+
+
+      for (npth_unprotect (), attr = ldap_first_attribute (ld, item, &berctx),
+             npth_protect ();
+           attr;
+           npth_unprotect (), attr = ldap_next_attribute (ld, item, berctx),
+             npth_protect ())
+        {
+          struct berval **values;
+          int idx;
+
+          if (myopt->verbose > 1)
+            log_info (_("          available attribute '%s'\n"), attr);
+
+          set_timeout (myopt);
+
+          /* I case we want only one attribute we do a case
+             insensitive compare without the optional extension
+             (i.e. ";binary").  Case insensitive is not really correct
+             but the best we can do.  */
+          if (want_attr)
+            {
+              char *cp1, *cp2;
+              int cmpres;
+
+              cp1 = strchr (want_attr, ';');
+              if (cp1)
+                *cp1 = 0;
+              cp2 = strchr (attr, ';');
+              if (cp2)
+                *cp2 = 0;
+              cmpres = ascii_strcasecmp (want_attr, attr);
+              if (cp1)
+                *cp1 = ';';
+              if (cp2)
+                *cp2 = ';';
+              if (cmpres)
+                {
+                  ldap_memfree (attr);
+                  continue; /* Not found:  Try next attribute.  */
+                }
+            }
+
+          npth_unprotect ();
+          values = ldap_get_values_len (ld, item, attr);
+          npth_protect ();
+
+          if (!values)
+            {
+              if (myopt->verbose)
+                log_info (_("attribute '%s' not found\n"), attr);
+              ldap_memfree (attr);
+              continue;
+            }
+
+          if (myopt->verbose)
+            {
+              log_info (_("found attribute '%s'\n"), attr);
+              if (myopt->verbose > 1)
+                for (idx=0; values[idx]; idx++)
+                  log_info ("         length[%d]=%d\n",
+                            idx, (int)values[0]->bv_len);
+
+            }
+
+          if (myopt->multi)
+            { /*  Write attribute marker. */
+              unsigned char tmp[5];
+              size_t n = strlen (attr);
+
+              tmp[0] = 'A';
+              tmp[1] = (n >> 24);
+              tmp[2] = (n >> 16);
+              tmp[3] = (n >> 8);
+              tmp[4] = (n);
+              if (es_fwrite (tmp, 5, 1, myopt->outstream) != 1
+                  || es_fwrite (attr, n, 1, myopt->outstream) != 1)
+                {
+                  log_error (_("error writing to stdout: %s\n"),
+                             strerror (errno));
+                  ldap_value_free_len (values);
+                  ldap_memfree (attr);
+                  ber_free (berctx, 0);
+                  return -1;
+                }
+            }
+
+          for (idx=0; values[idx]; idx++)
+            {
+              if (myopt->multi)
+                { /* Write value marker.  */
+                  unsigned char tmp[5];
+                  size_t n = values[0]->bv_len;
+
+                  tmp[0] = 'V';
+                  tmp[1] = (n >> 24);
+                  tmp[2] = (n >> 16);
+                  tmp[3] = (n >> 8);
+                  tmp[4] = (n);
+
+                  if (es_fwrite (tmp, 5, 1, myopt->outstream) != 1)
+                    {
+                      log_error (_("error writing to stdout: %s\n"),
+                                 strerror (errno));
+                      ldap_value_free_len (values);
+                      ldap_memfree (attr);
+                      ber_free (berctx, 0);
+                      return -1;
+                    }
+                }
+
+	      if (es_fwrite (values[0]->bv_val, values[0]->bv_len,
+                             1, myopt->outstream) != 1)
+                {
+                  log_error (_("error writing to stdout: %s\n"),
+                             strerror (errno));
+                  ldap_value_free_len (values);
+                  ldap_memfree (attr);
+                  ber_free (berctx, 0);
+                  return -1;
+                }
+
+              any = 1;
+              if (!myopt->multi)
+                break; /* Print only the first value.  */
+            }
+          ldap_value_free_len (values);
+          ldap_memfree (attr);
+          if (want_attr || !myopt->multi)
+            break; /* We only want to return the first attribute.  */
+        }
+      ber_free (berctx, 0);
+    }
+
+  if (myopt->verbose > 1 && any)
+    log_info ("result has been printed\n");
+
+  return any? 0 : 1;
+}
+
+
+#ifdef USE_PAGED_RESULTS
+/* Helper for fetch_ldap().  Run the search for one page.  *COOKIE is
+ * NULL for the first page; on return it is set to the cookie for the
+ * next page or to NULL if this was the last page.  */
+static int
+search_page (ldap_fetch_opt_t myopt, LDAP *ld, char *dn, int scope,
+             char *filter, char **attrs, struct berval **cookie,
+             LDAPMessage **r_msg)
+{
+  LDAPControl *pagectrl = NULL;
+  LDAPControl *serverctrls[2];
+  LDAPControl **resctrls = NULL;
+  LDAPControl *respctrl;
+  struct berval newcookie;
+  ber_int_t count;
+  int rc, errcode;
+
+  *r_msg = NULL;
+  npth_unprotect ();
+  rc = ldap_create_page_control (ld, LDAP_PAGE_SIZE, *cookie, 0, &pagectrl);
+  if (!rc)
+    {
+      serverctrls[0] = pagectrl;
+      serverctrls[1] = NULL;
+      rc = ldap_search_ext_s (ld, dn, scope, filter, attrs, 0,
+                              serverctrls, NULL, &myopt->timeout, 0, r_msg);
+    }
+  if (*cookie)
+    {
+      ber_bvfree (*cookie);
+      *cookie = NULL;
+    }
+  if ((!rc || rc == LDAP_SIZELIMIT_EXCEEDED) && *r_msg
+      && !ldap_parse_result (ld, *r_msg, &errcode, NULL, NULL, NULL,
+                             &resctrls, 0))
+    {
+      respctrl = ldap_control_find (LDAP_CONTROL_PAGEDRESULTS, resctrls, NULL);
+      memset (&newcookie, 0, sizeof newcookie);
+      if (respctrl
+          && !ldap_parse_pageresponse_control (ld, respctrl,
+                                               &count, &newcookie))
+        {
+          if (newcookie.bv_len)
+            *cookie = ber_bvdup (&newcookie);
+          ber_memfree (newcookie.bv_val);
+        }
+      ldap_controls_free (resctrls);
+    }
+  ldap_control_free (pagectrl);
+  npth_protect ();
+
+  return rc;
+}
+#endif /*USE_PAGED_RESULTS*/
+
+
+
+/* Connect to HOST at PORT, using TLS if USETLS is set, and bind.  On
+   success the connection is stored at R_LD and 0 is returned.  */
+static int
+connect_ldap (ldap_fetch_opt_t myopt, char *host, int port, int usetls,
+              LDAP **r_ld)
+{
+  LDAP *ld;
+  int ret;
+
+  *r_ld = NULL;
+
+#if HAVE_W32_SYSTEM
+  if (1)
+    {
+      npth_unprotect ();
+      ld = ldap_sslinit (host, port, usetls);
+      npth_protect ();
+      if (!ld)
+        {
+          ret = LdapGetLastError ();
+          log_error (_("LDAP init to '%s:%d' failed: %s\n"),
+                     host, port, ldap_err2string (ret));
+          return -1;
+        }
+    }
+#else /*!W32*/
+  if (usetls)
+    {
+      char *uri;
+
+      uri = xtryasprintf ("ldaps://%s:%d", host, port);
+      if (!uri)
+        {
+          log_error (_("error allocating memory: %s\n"),
+                     gpg_strerror (gpg_error_from_syserror ()));
+          return -1;
+        }
+      npth_unprotect ();
+      ret = ldap_initialize (&ld, uri);
+      npth_protect ();
+      if (ret)
+        {
+          log_error (_("LDAP init to '%s' failed: %s\n"),
+                     uri, ldap_err2string (ret));
+          xfree (uri);
+          return -1;
+        }
+      else if (myopt->verbose)
+        log_info (_("LDAP init to '%s' done\n"), uri);
+      xfree (uri);
+    }
+  else
+    {
+      /* Keep the old way so to avoid regressions.  Eventually we
+       * should really consider the supplied scheme and use only
+       * ldap_initialize.  */
+      npth_unprotect ();
+      ld = ldap_init (host, port);
+      npth_protect ();
+      if (!ld)
+        {
+          log_error (_("LDAP init to '%s:%d' failed: %s\n"),
+                     host, port, strerror (errno));
+          return -1;
+        }
+    }
+#endif /*!W32*/
+
+  npth_unprotect ();
+  ret = ldap_simple_bind_s (ld, myopt->user, myopt->pass);
+  npth_protect ();
+#ifdef LDAP_VERSION3
+  if (ret == LDAP_PROTOCOL_ERROR)
+    {
+      /* Protocol error could mean that the server only supports v3. */
+      int version = LDAP_VERSION3;
+      if (myopt->verbose)
+        log_info ("protocol error; retrying bind with v3 protocol\n");
+      npth_unprotect ();
+      ldap_set_option (ld, LDAP_OPT_PROTOCOL_VERSION, &version);
+      ret = ldap_simple_bind_s (ld, myopt->user, myopt->pass);
+      npth_protect ();
+    }
+#endif
+  if (ret)
+    {
+      log_error (_("binding to '%s:%d' failed: %s\n"),
+                 host, port, ldap_err2string (ret));
+      npth_unprotect ();
+      ldap_unbind (ld);
+      npth_protect ();
+      return -1;
+    }
+
+  *r_ld = ld;
+  return 0;
+}
+
+
+/* Release the connection LD to HOST at PORT.  If the pool is enabled
+   and FAILED is not set, the connection is put back into the pool
+   instead of closing it.  */
+static void
+release_ldap (ldap_fetch_opt_t myopt, LDAP *ld, const char *host, int port,
+              int usetls, int failed)
+{
+#ifdef USE_NPTH
+  if (myopt->use_pool && !failed)
+    {
+      ldap_pool_put (ld, host, port, usetls? LDAP_POOL_TLS : 0,
+                     myopt->user, myopt->pass, NULL, NULL);
+      return;
+    }
+#else
+  (void)myopt;
+  (void)host;
+  (void)port;
+  (void)usetls;
+  (void)failed;
+#endif
+
+  npth_unprotect ();
+  ldap_unbind (ld);
+  npth_protect ();
+}
+
+
+/* Helper for the URL based LDAP query. */
+static int
+fetch_ldap (ldap_fetch_opt_t myopt, const char *url, const LDAPURLDesc *ludp)
+{
+  LDAP *ld;
+  LDAPMessage *msg = NULL;
+  int rc = 0;
+  char *host, *dn, *filter, *attrs[2], *attr, **attrlist;
+  int port;
+  int usetls;
+  int pooled;
+  int npages = 0;
+  int any = 0;
+#ifdef USE_PAGED_RESULTS
+  struct berval *cookie = NULL;
+#endif
+
+  host     = myopt->host?   myopt->host   : ludp->lud_host;
+  port     = myopt->port?   myopt->port   : ludp->lud_port;
+  dn       = myopt->dn?     myopt->dn     : ludp->lud_dn;
+  filter   = myopt->filter? myopt->filter : ludp->lud_filter;
+  attrs[0] = myopt->attr?   myopt->attr   : ludp->lud_attrs? ludp->lud_attrs[0]:NULL;
+  attrs[1] = NULL;
+  attr = attrs[0];
+
+  if (!port && myopt->force_tls)
+    port = 636;
+  else if (!port)
+    port = (ludp->lud_scheme && !strcmp (ludp->lud_scheme, "ldaps"))? 636:389;
+
+  if (myopt->verbose)
+    {
+      log_info (_("processing url '%s'\n"), url);
+      if (myopt->force_tls)
+        log_info ("forcing tls\n");
+      else
+        log_info ("not forcing tls\n");
+
+      if (myopt->user)
+        log_info (_("          user '%s'\n"), myopt->user);
+      if (myopt->pass)
+        log_info (_("          pass '%s'\n"), *myopt->pass?"*****":"");
+      if (host)
+        log_info (_("          host '%s'\n"), host);
+      log_info (_("          port %d\n"), port);
+      if (dn)
+        log_info (_("            DN '%s'\n"), dn);
+      if (filter)
+        log_info (_("        filter '%s'\n"), filter);
+      if (myopt->multi && !myopt->attr && ludp->lud_attrs)
+        {
+          int i;
+          for (i=0; ludp->lud_attrs[i]; i++)
+            log_info (_("          attr '%s'\n"), ludp->lud_attrs[i]);
+        }
+      else if (attr)
+        log_info (_("          attr '%s'\n"), attr);
+    }
+
+
+  if (!host || !*host)
+    {
+      log_error (_("no host name in '%s'\n"), url);
+      return -1;
+    }
+  if (!myopt->multi && !attr)
+    {
+      log_error (_("no attribute given for query '%s'\n"), url);
+      return -1;
+    }
+
+  if (!myopt->multi && !myopt->attr
+      && ludp->lud_attrs && ludp->lud_attrs[0] && ludp->lud_attrs[1])
+    log_info (_("WARNING: using first attribute only\n"));
+
+  set_timeout (myopt);
+
+  usetls = (myopt->force_tls
+            || (ludp->lud_scheme && !strcmp (ludp->lud_scheme, "ldaps")));
+  ld = NULL;
+#ifdef USE_NPTH
+  if (myopt->use_pool)
+    ld = ldap_pool_get (host, port, usetls? LDAP_POOL_TLS : 0,
+                        myopt->user, myopt->pass, NULL);
+#endif
+  pooled = !!ld;
+  if (!ld && connect_ldap (myopt, host, port, usetls, &ld))
+    return -1;
+
+  attrlist = (myopt->multi && !myopt->attr && ludp->lud_attrs?
+              ludp->lud_attrs : attrs);
+
+  set_timeout (myopt);
+ again:
+#ifdef USE_PAGED_RESULTS
+  if (myopt->multi)
+    rc = search_page (myopt, ld, dn, ludp->lud_scope, filter, attrlist,
+                      &cookie, &msg);
+  else
+#endif
+    {
+      npth_unprotect ();
+      rc = ldap_search_st (ld, dn, ludp->lud_scope, filter, attrlist, 0,
+                           &myopt->timeout, &msg);
+      npth_protect ();
+    }
+  if (rc == LDAP_SERVER_DOWN && pooled && !npages)
+    {
+      /* The server closed the pooled connection in the meantime.  */
+      if (myopt->verbose)
+        log_info ("pooled connection to '%s:%d' is gone - reconnecting\n",
+                  host, port);
+      ldap_msgfree (msg);
+      msg = NULL;
+      release_ldap (myopt, ld, host, port, usetls, 1);
+      pooled = 0;
+      if (connect_ldap (myopt, host, port, usetls, &ld))
+        return -1;
+      goto again;
+    }
+  if (rc == LDAP_SIZELIMIT_EXCEEDED && myopt->multi)
+    {
+      if (es_fwrite ("E\0\0\0\x09truncated", 14, 1, myopt->outstream) != 1)
+        {
+          log_error (_("error writing to stdout: %s\n"), strerror (errno));
+          ldap_msgfree (msg);
+          rc = -1;
+          goto leave;
+        }
+    }
+  else if (rc)
+    {
+      log_error (_("searching '%s' failed: %s\n"),
+                 url, ldap_err2string (rc));
+      if (rc != LDAP_NO_SUCH_OBJECT)
+        {
+          /* The result needs to be released regardless of the
+             return value.  */
+          ldap_msgfree (msg);
+#ifdef USE_PAGED_RESULTS
+          if (cookie)
+            ber_bvfree (cookie);
+#endif
+          release_ldap (myopt, ld, host, port, usetls, 1);
+          return -1;
+        }
+    }
+
+  rc = print_ldap_entries (myopt, ld, msg, myopt->multi? NULL:attr);
+  ldap_msgfree (msg);
+  msg = NULL;
+  if (rc < 0)
+    goto leave;
+  if (!rc)
+    any = 1;
+  npages++;
+
+#ifdef USE_PAGED_RESULTS
+  if (cookie)
+    {
+      if (myopt->verbose > 1)
+        log_info ("requesting page %d\n", npages + 1);
+      if (es_fflush (myopt->outstream))
+        {
+          log_error (_("error writing to stdout: %s\n"), strerror (errno));
+          rc = -1;
+          goto leave;
+        }
+      set_timeout (myopt);
+      goto again;
+    }
+#endif
+  rc = any? 0 : -1;
+
+ leave:
+#ifdef USE_PAGED_RESULTS
+  if (cookie)
+    ber_bvfree (cookie);
+#endif
+  release_ldap (myopt, ld, host, port, usetls, 0);
+  return rc;
+}
+
+
+
+
+/* Main processing.  Take the URL and run the LDAP query. The result
+   is printed to MYOPT->OUTSTREAM, errors are logged to the log
+   stream. */
+int
+ldap_fetch_url (ldap_fetch_opt_t myopt, const char *url)
+{
+  int rc;
+  LDAPURLDesc *ludp = NULL;
+
+
+  if (!ldap_is_ldap_url (url))
+    {
+      log_error (_("'%s' is not an LDAP URL\n"), url);
+      return -1;
+    }
+
+  if (ldap_url_parse (url, &ludp))
+    {
+      log_error (_("'%s' is an invalid LDAP URL\n"), url);
+      return -1;
+    }
+
+  rc = fetch_ldap (myopt, url, ludp);
+
+  ldap_free_urldesc (ludp);
+  return rc;
+}
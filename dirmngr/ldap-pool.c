@@ -0,0 +1,294 @@
+/* ldap-pool.c - Pool of bound LDAP connections
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Binding to an LDAP server for each query is costly: It requires a
+ * TCP connection, often a TLS handshake, and the bind itself.  This
+ * module keeps connections which have been used for a query and are
+ * still bound.  They are keyed by host, port, connection flags, user
+ * and password.  The pool only holds idle connections: A connection
+ * taken from the pool is owned by the caller until it puts it back.
+ * Connections which have not been used for LDAP_POOL_IDLE_TIME
+ * seconds are closed by the housekeeping.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <npth.h>
+
+#ifdef HAVE_W32_SYSTEM
+# include <winsock2.h>
+# include <winldap.h>
+#else
+  /* For OpenLDAP, to enable the API that we're using. */
+# define LDAP_DEPRECATED 1
+# include <ldap.h>
+#endif
+
+#include "dirmngr.h"
+#include "ldap-pool.h"
+
+
+/* The maximum number of idle connections in the pool and the maximum
+ * number of idle connections for one key.  */
+#define LDAP_POOL_MAX_ITEMS   64
+#define LDAP_POOL_MAX_PER_KEY  4
+
+/* The number of seconds an idle connection is kept open.  This is
+ * below the idle timeout of most servers.  */
+#define LDAP_POOL_IDLE_TIME   60
+
+
+/* An idle connection.  Note that there is no need for a lock because
+ * none of the functions accessing the list call an npth function.  */
+struct pool_item_s
+{
+  struct pool_item_s *next;
+  LDAP *ld;                /* The bound connection.  */
+  void *data;              /* Data of the user of the connection.  */
+  void (*data_release) (void *data);
+  time_t stamp;            /* The time the connection was put back.  */
+  char *host;
+  int port;
+  unsigned int flags;      /* LDAP_POOL_* flags.  */
+  char *user;              /* The user or NULL.  */
+  char *pass;              /* The password or NULL.  */
+};
+typedef struct pool_item_s *pool_item_t;
+
+static pool_item_t pool_items;
+static unsigned int pool_nitems;
+
+
+
+/* Return true if the strings A and B are both NULL or equal.  */
+static int
+str_equal_p (const char *a, const char *b)
+{
+  if (!a || !b)
+    return !a && !b;
+  return !strcmp (a, b);
+}
+
+
+static int
+match_item_p (pool_item_t item, const char *host, int port,
+              unsigned int flags, const char *user, const char *pass)
+{
+  return (item->port == port
+          && item->flags == flags
+          && !ascii_strcasecmp (item->host, host)
+          && str_equal_p (item->user, user)
+          && str_equal_p (item->pass, pass));
+}
+
+
+/* Close the connection of ITEM and release ITEM.  */
+static void
+release_item (pool_item_t item)
+{
+  if (!item)
+    return;
+  if (item->ld)
+    {
+      npth_unprotect ();
+      ldap_unbind (item->ld);
+      npth_protect ();
+    }
+  if (item->data && item->data_release)
+    item->data_release (item->data);
+  xfree (item->host);
+  xfree (item->user);
+  if (item->pass)
+    {
+      wipememory (item->pass, strlen (item->pass));
+      xfree (item->pass);
+    }
+  xfree (item);
+}
+
+
+/* Close the connection LD and release DATA.  */
+static void
+close_connection (LDAP *ld, void *data, void (*data_release) (void *data))
+{
+  npth_unprotect ();
+  ldap_unbind (ld);
+  npth_protect ();
+  if (data && data_release)
+    data_release (data);
+}
+
+
+/* Take an idle connection for HOST, PORT, FLAGS, USER and PASS from
+ * the pool and return it.  Returns NULL if there is none; the caller
+ * then needs to connect and bind on its own.  If R_DATA is not NULL
+ * the data stored along with the connection is returned there; it is
+ * owned by the caller.  */
+LDAP *
+ldap_pool_get (const char *host, int port, unsigned int flags,
+               const char *user, const char *pass, void **r_data)
+{
+  pool_item_t item, prev;
+  time_t now = gnupg_get_time ();
+  LDAP *ld;
+
+  if (r_data)
+    *r_data = NULL;
+  if (!host)
+    return NULL;
+
+  for (prev = NULL, item = pool_items; item; prev = item, item = item->next)
+    if (match_item_p (item, host, port, flags, user, pass)
+        && item->stamp + LDAP_POOL_IDLE_TIME > now)
+      break;
+  if (!item)
+    return NULL;
+
+  if (prev)
+    prev->next = item->next;
+  else
+    pool_items = item->next;
+  pool_nitems--;
+
+  ld = item->ld;
+  item->ld = NULL;
+  if (r_data)
+    {
+      *r_data = item->data;
+      item->data = NULL;
+    }
+  release_item (item);
+
+  if (DBG_LOOKUP)
+    log_debug ("ldap-pool: reusing connection to %s:%d\n", host, port);
+  return ld;
+}
+
+
+/* Put the bound connection LD for HOST, PORT, FLAGS, USER and PASS
+ * back into the pool.  DATA is stored along with the connection and
+ * returned by the next ldap_pool_get; DATA_RELEASE is used to release
+ * it if the connection is closed.  This function takes ownership of
+ * LD and DATA; if the pool is full the connection is closed.  */
+void
+ldap_pool_put (LDAP *ld, const char *host, int port, unsigned int flags,
+               const char *user, const char *pass,
+               void *data, void (*data_release) (void *data))
+{
+  pool_item_t item;
+  unsigned int count = 0;
+
+  if (!ld)
+    return;
+  if (!host)
+    {
+      close_connection (ld, data, data_release);
+      return;
+    }
+
+  for (item = pool_items; item; item = item->next)
+    if (match_item_p (item, host, port, flags, user, pass))
+      count++;
+  if (count >= LDAP_POOL_MAX_PER_KEY || pool_nitems >= LDAP_POOL_MAX_ITEMS)
+    {
+      close_connection (ld, data, data_release);
+      return;
+    }
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item
+      || !(item->host = xtrystrdup (host))
+      || (user && !(item->user = xtrystrdup (user)))
+      || (pass && !(item->pass = xtrystrdup (pass))))
+    {
+      log_error ("ldap-pool: error allocating memory: %s\n",
+                 gpg_strerror (gpg_error_from_syserror ()));
+      release_item (item);
+      close_connection (ld, data, data_release);
+      return;
+    }
+  item->ld = ld;
+  item->data = data;
+  item->data_release = data_release;
+  item->port = port;
+  item->flags = flags;
+  item->stamp = gnupg_get_time ();
+
+  item->next = pool_items;
+  pool_items = item;
+  pool_nitems++;
+}
+
+
+/* Close all pooled connections.  */
+void
+ldap_pool_flush (void)
+{
+  pool_item_t item, next;
+
+  item = pool_items;
+  pool_items = NULL;
+  pool_nitems = 0;
+  for (; item; item = next)
+    {
+      next = item->next;
+      release_item (item);
+    }
+}
+
+
+/* Close the connections which are idle for too long.  */
+void
+ldap_pool_housekeeping (void)
+{
+  pool_item_t item, next, prev, expired;
+  time_t now = gnupg_get_time ();
+
+  expired = NULL;
+  for (prev = NULL, item = pool_items; item; item = next)
+    {
+      next = item->next;
+      if (item->stamp + LDAP_POOL_IDLE_TIME <= now || item->stamp > now)
+        {
+          if (prev)
+            prev->next = next;
+          else
+            pool_items = next;
+          pool_nitems--;
+          item->next = expired;
+          expired = item;
+        }
+      else
+        prev = item;
+    }
+
+  /* The unbind releases the CPU; thus we close the connections only
+   * after they have been removed from the list.  */
+  for (item = expired; item; item = next)
+    {
+      next = item->next;
+      if (DBG_LOOKUP)
+        log_debug ("ldap-pool: closing idle connection to %s:%d\n",
+                   item->host, item->port);
+      release_item (item);
+    }
+}
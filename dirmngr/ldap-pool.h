@@ -0,0 +1,42 @@
+/* ldap-pool.h - Pool of bound LDAP connections
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DIRMNGR_LDAP_POOL_H
+#define DIRMNGR_LDAP_POOL_H
+
+/* Flags which are part of the key of a pooled connection.  */
+#define LDAP_POOL_TLS        1  /* Connected using ldaps.  */
+#define LDAP_POOL_STARTTLS   2  /* Connected using STARTTLS.  */
+#define LDAP_POOL_KEYSERVER  4  /* Connection of the keyserver engine.  */
+
+/* The LDAP type of OpenLDAP and Windows is a typedef for this
+ * structure; we use it so that this file does not require ldap.h.  */
+struct ldap;
+
+struct ldap *ldap_pool_get (const char *host, int port, unsigned int flags,
+                            const char *user, const char *pass,
+                            void **r_data);
+void ldap_pool_put (struct ldap *ld, const char *host, int port,
+                    unsigned int flags,
+                    const char *user, const char *pass,
+                    void *data, void (*data_release) (void *data));
+void ldap_pool_flush (void);
+void ldap_pool_housekeeping (void);
+
+#endif /*DIRMNGR_LDAP_POOL_H*/
@@ -45,6 +45,14 @@
  * limited (32 processes including the kernel processes) and thus we
  * don't use the process approach but implement a different wrapper in
  * ldap-wrapper-ce.c.
+ *
+ * For sites with a high rate of LDAP queries the fork/exec overhead
+ * and a new bind for each query are not acceptable.  With the option
+ * --ldap-in-process the query code of the wrapper (ldap-fetch.c) is
+ * thus run directly in the calling thread using a bound connection
+ * from the ldap-pool.  The output is collected in a memory stream
+ * which makes up the returned reader.  In this mode the above
+ * reasons apply and the LDAP library needs to be thread-safe.
  */
 
 
@@ -59,10 +67,20 @@
 #include <time.h>
 #include <npth.h>
 
+#ifdef HAVE_W32_SYSTEM
+# include <winsock2.h>
+# include <winldap.h>
+#else
+  /* For OpenLDAP, to enable the API that we're using. */
+# define LDAP_DEPRECATED 1
+# include <ldap.h>
+#endif
+
 #include "dirmngr.h"
 #include "../common/exechelp.h"
 #include "misc.h"
 #include "ldap-wrapper.h"
+#include "ldap-fetch.h"
 
 
 #ifdef HAVE_W32_SYSTEM
@@ -118,6 +136,19 @@ static npth_cond_t  reaper_run_cond  = NPTH_COND_INITIALIZER;
 /* We need to know whether we are shutting down the process.  */
 static int shutting_down;
 
+/* The context of a reader returned by the in-process mode.  */
+struct inproc_context_s
+{
+  struct inproc_context_s *next;
+  ksba_reader_t reader;  /* The ksba reader object.  */
+  estream_t fp;          /* The memory stream with the output.  */
+};
+
+/* The list of readers returned by the in-process mode.  There is no
+ * need for a lock because the code accessing the list does not call
+ * an npth function.  */
+static struct inproc_context_s *inproc_list;
+
 
 
 /* Close the estream fp and set it to NULL.  */
@@ -592,10 +623,23 @@ void
 ldap_wrapper_release_context (ksba_reader_t reader)
 {
   struct wrapper_context_s *ctx;
+  struct inproc_context_s *ictx, *iprev;
 
   if (!reader )
     return;
 
+  for (iprev = NULL, ictx = inproc_list; ictx; iprev = ictx, ictx = ictx->next)
+    if (ictx->reader == reader)
+      {
+        if (iprev)
+          iprev->next = ictx->next;
+        else
+          inproc_list = ictx->next;
+        es_fclose (ictx->fp);
+        xfree (ictx);
+        return;
+      }
+
   lock_reaper_list ();
   {
     for (ctx=reaper_list; ctx; ctx=ctx->next)
@@ -781,6 +825,172 @@ reader_callback (void *cb_value, char *buffer, size_t count,  size_t *nread)
 }
 
 
+/* This is the callback used by the in-process mode to feed the ksba
+ * reader with the collected output.  */
+static int
+inproc_reader_callback (void *cb_value, char *buffer, size_t count,
+                        size_t *nread)
+{
+  struct inproc_context_s *ctx = cb_value;
+
+  if (!buffer && !count && !nread)
+    return -1; /* Rewind is not supported. */
+
+  if (es_read (ctx->fp, buffer, count, nread))
+    {
+      log_error ("%s: error reading: %s\n",
+                 __func__, gpg_strerror (gpg_error_from_syserror ()));
+      *nread = 0;
+      return -1;
+    }
+  if (!*nread)
+    return -1; /* EOF. */
+  return 0;
+}
+
+
+/* The in-process version of ldap_wrapper.  ARGV uses the same
+ * options as the wrapper program.  The query is run in the calling
+ * thread and its output is returned as a new reader at READER.  */
+static gpg_error_t
+inproc_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
+{
+  gpg_error_t err;
+  struct ldap_fetch_opt_s myoptbuf;
+  ldap_fetch_opt_t myopt = &myoptbuf;
+  struct inproc_context_s *ctx;
+  char *proxybuf = NULL;
+  char *p;
+  int any_err = 0;
+  int i;
+
+  (void)ctrl;
+
+  memset (&myoptbuf, 0, sizeof myoptbuf);
+  myopt->timeout.tv_sec = opt.ldaptimeout? opt.ldaptimeout : 15;
+  myopt->use_pool = 1;
+
+  for (i = 0; argv[i] && *argv[i] == '-'; i++)
+    {
+      const char *a = argv[i];
+
+      if (!strcmp (a, "-v"))
+        myopt->verbose = 1;
+      else if (!strcmp (a, "-vv"))
+        myopt->verbose = 2;
+      else if (!strcmp (a, "--multi"))
+        myopt->multi = 1;
+      else if (!strcmp (a, "--tls"))
+        myopt->force_tls = 1;
+      else if (!strcmp (a, "--log-with-pid")
+               || !strcmp (a, "--only-search-timeout"))
+        ; /* Not used in this mode.  */
+      else if (!argv[i+1])
+        break;
+      else if (!strcmp (a, "--timeout"))
+        myopt->timeout.tv_sec = atoi (argv[++i]);
+      else if (!strcmp (a, "--proxy"))
+        myopt->proxy = (char*)argv[++i];
+      else if (!strcmp (a, "--host"))
+        myopt->host = (char*)argv[++i];
+      else if (!strcmp (a, "--port"))
+        myopt->port = atoi (argv[++i]);
+      else if (!strcmp (a, "--user"))
+        myopt->user = (char*)argv[++i];
+      else if (!strcmp (a, "--pass"))
+        myopt->pass = (char*)argv[++i];
+      else if (!strcmp (a, "--dn"))
+        myopt->dn = (char*)argv[++i];
+      else if (!strcmp (a, "--filter"))
+        myopt->filter = (char*)argv[++i];
+      else if (!strcmp (a, "--attr"))
+        myopt->attr = (char*)argv[++i];
+      else
+        break;
+    }
+  if (argv[i] && *argv[i] == '-')
+    {
+      log_error ("%s: invalid option '%s'\n", __func__, argv[i]);
+      return gpg_error (GPG_ERR_INV_ARG);
+    }
+
+  if (myopt->proxy)
+    {
+      proxybuf = xtrystrdup (myopt->proxy);
+      if (!proxybuf)
+        return gpg_error_from_syserror ();
+      myopt->host = proxybuf;
+      p = strchr (myopt->host, ':');
+      if (p)
+        {
+          *p++ = 0;
+          myopt->port = atoi (p);
+        }
+      if (!myopt->port)
+        myopt->port = 389;  /* make sure ports gets overridden.  */
+    }
+  if (myopt->port < 0 || myopt->port > 65535)
+    {
+      log_error (_("invalid port number %d\n"), myopt->port);
+      xfree (proxybuf);
+      return gpg_error (GPG_ERR_INV_ARG);
+    }
+
+  ctx = xtrycalloc (1, sizeof *ctx);
+  if (!ctx)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (proxybuf);
+      return err;
+    }
+  ctx->fp = myopt->outstream = es_fopenmem (0, "w+b");
+  if (!ctx->fp)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (ctx);
+      xfree (proxybuf);
+      return err;
+    }
+
+  for (; argv[i]; i++)
+    if (ldap_fetch_url (myopt, argv[i]))
+      any_err = 1;
+  xfree (proxybuf);
+
+  if (DBG_EXTPROG)
+    log_debug ("ldap in-process query done (%s, %ld bytes)\n",
+               any_err? "with errors":"okay", (long)es_ftell (ctx->fp));
+
+  /* An empty output is an error for the caller; see ldap_wrapper.  */
+  if (!es_ftell (ctx->fp))
+    {
+      es_fclose (ctx->fp);
+      xfree (ctx);
+      return gpg_error (GPG_ERR_NO_DATA);
+    }
+  es_rewind (ctx->fp);
+
+  err = ksba_reader_new (reader);
+  if (!err)
+    err = ksba_reader_set_cb (*reader, inproc_reader_callback, ctx);
+  if (err)
+    {
+      log_error (_("error initializing reader object: %s\n"),
+                 gpg_strerror (err));
+      es_fclose (ctx->fp);
+      xfree (ctx);
+      ksba_reader_release (*reader);
+      *reader = NULL;
+      return err;
+    }
+
+  ctx->reader = *reader;
+  ctx->next = inproc_list;
+  inproc_list = ctx;
+  return 0;
+}
+
+
 /* Fork and exec the LDAP wrapper and return a new libksba reader
    object at READER.  ARGV is a NULL terminated list of arguments for
    the wrapper.  The function returns 0 on success or an error code.
@@ -793,7 +1003,10 @@ reader_callback (void *cb_value, char *buffer, size_t count,  size_t *nread)
    systems where it can't be avoided, we don't want to go into the
    hassle of passing the password via stdin; it's just too complicated
    and an LDAP password used for public directory lookups should not
-   be that confidential.  */
+   be that confidential.
+
+   With the option --ldap-in-process no process is spawned; see
+   inproc_wrapper.  */
 gpg_error_t
 ldap_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
 {
@@ -806,6 +1019,11 @@ ldap_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
   const char *pgmname;
   estream_t outfp, errfp;
 
+  *reader = NULL;
+
+  if (opt.ldap_in_process)
+    return inproc_wrapper (ctrl, reader, argv);
+
   /* It would be too simple to connect stderr just to our logging
      stream.  The problem is that if we are running multi-threaded
      everything gets intermixed.  Clearly we don't want this.  So the
@@ -816,8 +1034,6 @@ ldap_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
      general reaping thread, that thread can do the logging too. */
   ldap_reaper_launch_thread ();
 
-  *reader = NULL;
-
   /* Files: We need to prepare stdin and stdout.  We get stderr from
      the function.  */
   if (!opt.ldap_wrapper_program || !*opt.ldap_wrapper_program)
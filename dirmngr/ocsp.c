@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "dirmngr.h"
 #include "misc.h"
@@ -34,6 +35,11 @@
 /* The maximum size we allow as a response from an OCSP reponder. */
 #define MAX_RESPONSE_SIZE 65536
 
+/* The name of the file used to persist the OCSP cache in the cache
+   directory and the maximum number of items we keep.  */
+#define OCSP_CACHE_FILE "ocsp-cache.txt"
+#define OCSP_CACHE_MAX_ITEMS 1024
+
 
 static const char oidstr_ocsp[] = "1.3.6.1.5.5.7.48.1";
 
@@ -47,6 +53,30 @@ static const char oidstr_ocsp[] = "1.3.6.1.5.5.7.48.1";
 /* static const char oidstr_certHash[] = "1.3.36.8.3.13"; */
 
 
+/* An item of the OCSP cache.  We only store the outcome of responses
+   which passed all our checks; the cache is thus a cache of verified
+   status values and not of the raw responses.  */
+struct ocsp_cache_item_s
+{
+  struct ocsp_cache_item_s *next;
+  ksba_status_t status;            /* KSBA_STATUS_GOOD or _REVOKED.  */
+  ksba_isotime_t next_update;      /* The item expires at this time.  */
+  ksba_isotime_t revocation_time;  /* Only used for revoked certs.  */
+  ksba_crl_reason_t reason;        /* Ditto.  */
+  char key[1];  /* The hex encoded SHA-1 hash of the issuer's public
+                   key, a colon and the hex encoded serial number of
+                   the certificate, a colon and a 'd' if the
+                   default responder was used.  */
+};
+typedef struct ocsp_cache_item_s *ocsp_cache_item_t;
+
+/* The OCSP cache, the flag telling whether it has been loaded from
+   disk and the mutex to protect it.  */
+static ocsp_cache_item_t ocsp_cache;
+static int ocsp_cache_loaded;
+static npth_mutex_t ocsp_cache_lock;
+
+
 
 
 /* Read from FP and return a newly allocated buffer in R_BUFFER with the
@@ -182,7 +212,8 @@ do_ocsp_request (ctrl_t ctrl, ksba_ocsp_t ocsp,
 
  once_more:
   err = http_open (ctrl, &http, HTTP_REQ_POST, url, NULL, NULL,
-                   ((opt.honor_http_proxy? HTTP_FLAG_TRY_PROXY:0)
+                   (HTTP_FLAG_KEEPALIVE
+                    | (opt.honor_http_proxy? HTTP_FLAG_TRY_PROXY:0)
                     | (dirmngr_use_tor ()? HTTP_FLAG_FORCE_TOR:0)
                     | (opt.disable_ipv4? HTTP_FLAG_IGNORE_IPv4 : 0)
                     | (opt.disable_ipv6? HTTP_FLAG_IGNORE_IPv6 : 0)),
@@ -586,10 +617,405 @@ check_signature (ctrl_t ctrl,
 }
 
 
+/* Initialize the OCSP module.  */
+void
+ocsp_init (void)
+{
+  int err;
+
+  err = npth_mutex_init (&ocsp_cache_lock, NULL);
+  if (err)
+    log_fatal ("error initializing mutex: %s\n", strerror (err));
+}
+
+
+static void
+lock_ocsp_cache (void)
+{
+  int res = npth_mutex_lock (&ocsp_cache_lock);
+  if (res)
+    log_fatal ("failed to acquire OCSP cache lock: %s\n", strerror (res));
+}
+
+
+static void
+unlock_ocsp_cache (void)
+{
+  int res = npth_mutex_unlock (&ocsp_cache_lock);
+  if (res)
+    log_fatal ("failed to release OCSP cache lock: %s\n", strerror (res));
+}
+
+
+/* Build the cache key for CERT issued by ISSUER_CERT and store it at
+   R_KEY.  USE_DEFAULT is set if the default responder will be asked;
+   we keep those results separate because the configured signer is
+   trusted in a different way.  */
+static gpg_error_t
+make_ocsp_cache_key (ksba_cert_t cert, ksba_cert_t issuer_cert,
+                     int use_default, char **r_key)
+{
+  gpg_error_t err;
+  ksba_sexp_t pubkey;
+  ksba_sexp_t serial = NULL;
+  char *serialhex = NULL;
+  unsigned char keyhash[20];
+  char keyhashhex[41];
+  size_t n;
+
+  *r_key = NULL;
+
+  pubkey = ksba_cert_get_public_key (issuer_cert);
+  n = pubkey? gcry_sexp_canon_len (pubkey, 0, NULL, NULL) : 0;
+  if (!n)
+    {
+      err = gpg_error (GPG_ERR_INV_SEXP);
+      goto leave;
+    }
+  gcry_md_hash_buffer (GCRY_MD_SHA1, keyhash, pubkey, n);
+  bin2hex (keyhash, 20, keyhashhex);
+
+  serial = ksba_cert_get_serial (cert);
+  serialhex = serial? serial_hex (serial) : NULL;
+  if (!serialhex)
+    {
+      err = gpg_error (GPG_ERR_INV_CERT_OBJ);
+      goto leave;
+    }
+
+  *r_key = xtryasprintf ("%s:%s:%s", keyhashhex, serialhex,
+                         use_default? "d":"");
+  err = *r_key? 0 : gpg_error_from_syserror ();
+
+ leave:
+  xfree (serialhex);
+  ksba_free (serial);
+  ksba_free (pubkey);
+  return err;
+}
+
+
+/* Remove all items from the cache which expired at CURRENT_TIME.
+   Must be called with the lock held.  */
+static void
+expire_ocsp_cache (const ksba_isotime_t current_time)
+{
+  ocsp_cache_item_t item, prev, next;
+
+  for (prev = NULL, item = ocsp_cache; item; item = next)
+    {
+      next = item->next;
+      if (strcmp (item->next_update, current_time) < 0)
+        {
+          if (prev)
+            prev->next = next;
+          else
+            ocsp_cache = next;
+          xfree (item);
+        }
+      else
+        prev = item;
+    }
+}
+
+
+/* Create a new cache item and prepend it to the cache.  Must be
+   called with the lock held.  */
+static gpg_error_t
+insert_ocsp_cache_item (const char *key, ksba_status_t status,
+                        const ksba_isotime_t next_update,
+                        const ksba_isotime_t revocation_time,
+                        ksba_crl_reason_t reason)
+{
+  ocsp_cache_item_t item, prev;
+  int count;
+
+  /* Replace an existing item for this key.  */
+  for (prev = NULL, item = ocsp_cache; item; prev = item, item = item->next)
+    if (!strcmp (item->key, key))
+      {
+        if (prev)
+          prev->next = item->next;
+        else
+          ocsp_cache = item->next;
+        xfree (item);
+        break;
+      }
+
+  item = xtrycalloc (1, sizeof *item + strlen (key));
+  if (!item)
+    return gpg_error_from_syserror ();
+  strcpy (item->key, key);
+  item->status = status;
+  gnupg_copy_time (item->next_update, next_update);
+  if (status == KSBA_STATUS_REVOKED && revocation_time)
+    gnupg_copy_time (item->revocation_time, revocation_time);
+  item->reason = reason;
+  item->next = ocsp_cache;
+  ocsp_cache = item;
+
+  /* Truncate the list; the oldest items are at the end.  */
+  for (count = 1, item = ocsp_cache; item->next; item = item->next)
+    if (++count > OCSP_CACHE_MAX_ITEMS)
+      {
+        ocsp_cache_item_t tmp;
+
+        while ((tmp = item->next))
+          {
+            item->next = tmp->next;
+            xfree (tmp);
+          }
+        break;
+      }
+
+  return 0;
+}
+
+
+/* Read the cache file into the memory cache.  Must be called with
+   the lock held.  Errors are not fatal; we then start with an empty
+   cache.  */
+static void
+load_ocsp_cache (void)
+{
+  char *fname;
+  estream_t fp;
+  char *line = NULL;
+  size_t maxlen = 0;
+  ssize_t len;
+  char *fields[5];
+  ksba_isotime_t current_time;
+  ksba_status_t status;
+  int nfields;
+  int lnr = 0;
+
+  ocsp_cache_loaded = 1;
+
+  fname = make_filename (opt.homedir_cache, OCSP_CACHE_FILE, NULL);
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_error (_("can't open '%s': %s\n"), fname, strerror (errno));
+      xfree (fname);
+      return;
+    }
+
+  gnupg_get_isotime (current_time);
+  while ((len = es_read_line (fp, &line, &maxlen, NULL)) > 0)
+    {
+      lnr++;
+      trim_spaces (line);
+      if (!*line || *line == '#')
+        continue;
+      /* Format: KEY STATUS NEXT_UPDATE [REVOCATION_TIME REASON] */
+      nfields = split_fields (line, fields, DIM (fields));
+      if (nfields < 3
+          || strlen (fields[1]) != 1
+          || !isotime_p (fields[2]))
+        {
+          log_info ("%s:%d: invalid line in OCSP cache ignored\n",
+                    fname, lnr);
+          continue;
+        }
+      if (*fields[1] == 'g')
+        status = KSBA_STATUS_GOOD;
+      else if (*fields[1] == 'r')
+        status = KSBA_STATUS_REVOKED;
+      else
+        continue;
+      if (strcmp (fields[2], current_time) < 0)
+        continue; /* Expired.  */
+      if (insert_ocsp_cache_item (fields[0], status, fields[2],
+                                  (status == KSBA_STATUS_REVOKED
+                                   && nfields > 3 && isotime_p (fields[3]))?
+                                  fields[3] : NULL,
+                                  nfields > 4? atoi (fields[4]) : 0))
+        break;
+    }
+  if (len < 0)
+    log_error (_("error reading '%s': %s\n"), fname,
+               gpg_strerror (gpg_error_from_syserror ()));
+  es_free (line);
+  es_fclose (fp);
+  if (opt.verbose)
+    log_info ("OCSP cache loaded from '%s'\n", fname);
+  xfree (fname);
+}
+
+
+/* Write the memory cache to the cache file.  Must be called with the
+   lock held.  */
+static void
+store_ocsp_cache (void)
+{
+  char *fname, *tmpfname;
+  estream_t fp;
+  ocsp_cache_item_t item;
+
+  fname = make_filename (opt.homedir_cache, OCSP_CACHE_FILE, NULL);
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    {
+      log_error ("error storing the OCSP cache: %s\n",
+                 gpg_strerror (gpg_error_from_syserror ()));
+      xfree (fname);
+      return;
+    }
+
+  fp = es_fopen (tmpfname, "w");
+  if (!fp)
+    {
+      log_error (_("error creating '%s': %s\n"), tmpfname, strerror (errno));
+      goto leave;
+    }
+  es_fputs ("# Dirmngr OCSP cache - DO NOT EDIT\n", fp);
+  /* Write the oldest items first so that they end up at the end of
+     the list when reading them back.  */
+  {
+    ocsp_cache_item_t *array;
+    int n, i;
+
+    for (n=0, item = ocsp_cache; item; item = item->next)
+      n++;
+    array = n? xtrycalloc (n, sizeof *array) : NULL;
+    if (n && !array)
+      {
+        log_error ("error storing the OCSP cache: %s\n",
+                   gpg_strerror (gpg_error_from_syserror ()));
+        es_fclose (fp);
+        gnupg_remove (tmpfname);
+        goto leave;
+      }
+    for (i=0, item = ocsp_cache; item; item = item->next)
+      array[i++] = item;
+    while (i--)
+      {
+        item = array[i];
+        if (item->status == KSBA_STATUS_REVOKED)
+          es_fprintf (fp, "%s r %s %s %d\n", item->key, item->next_update,
+                      *item->revocation_time? item->revocation_time
+                      /**/                  : "-",
+                      (int)item->reason);
+        else
+          es_fprintf (fp, "%s g %s\n", item->key, item->next_update);
+      }
+    xfree (array);
+  }
+  if (es_fclose (fp))
+    {
+      log_error (_("error writing '%s': %s\n"), tmpfname, strerror (errno));
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+
+#ifdef HAVE_W32_SYSTEM
+  /* No atomic mv on W32 systems.  */
+  gnupg_remove (fname);
+#endif
+  if (rename (tmpfname, fname))
+    {
+      log_error (_("error renaming '%s' to '%s': %s\n"),
+                 tmpfname, fname, strerror (errno));
+      gnupg_remove (tmpfname);
+    }
+
+ leave:
+  xfree (tmpfname);
+  xfree (fname);
+}
+
+
+/* Look up KEY in the OCSP cache.  On success the cached status is
+   stored at R_STATUS and, for revoked certificates, the revocation
+   time and reason at REVOCATION_TIME and R_REASON.  Returns true if
+   a valid item was found.  */
+static int
+get_ocsp_cache (const char *key, ksba_status_t *r_status,
+                ksba_isotime_t next_update, ksba_isotime_t revocation_time,
+                ksba_crl_reason_t *r_reason)
+{
+  ocsp_cache_item_t item;
+  ksba_isotime_t current_time;
+  int found = 0;
+
+  gnupg_get_isotime (current_time);
+
+  lock_ocsp_cache ();
+  if (!ocsp_cache_loaded)
+    load_ocsp_cache ();
+  expire_ocsp_cache (current_time);
+  for (item = ocsp_cache; item; item = item->next)
+    if (!strcmp (item->key, key))
+      {
+        *r_status = item->status;
+        gnupg_copy_time (next_update, item->next_update);
+        if (*item->revocation_time)
+          gnupg_copy_time (revocation_time, item->revocation_time);
+        else
+          *revocation_time = 0;
+        *r_reason = item->reason;
+        found = 1;
+        break;
+      }
+  unlock_ocsp_cache ();
+  dirmngr_stats_cache (DIRMNGR_CACHE_OCSP, found);
+
+  return found;
+}
+
+
+/* Store the verified STATUS for KEY in the OCSP cache.  The item
+   expires at NEXT_UPDATE.  */
+static void
+put_ocsp_cache (const char *key, ksba_status_t status,
+                const ksba_isotime_t next_update,
+                const ksba_isotime_t revocation_time,
+                ksba_crl_reason_t reason)
+{
+  ksba_isotime_t current_time;
+  gpg_error_t err;
+
+  gnupg_get_isotime (current_time);
+
+  lock_ocsp_cache ();
+  if (!ocsp_cache_loaded)
+    load_ocsp_cache ();
+  expire_ocsp_cache (current_time);
+  err = insert_ocsp_cache_item (key, status, next_update,
+                                revocation_time, reason);
+  if (err)
+    log_error ("error caching the OCSP status: %s\n", gpg_strerror (err));
+  else
+    store_ocsp_cache ();
+  unlock_ocsp_cache ();
+}
+
+
+/* Invalidate the cached validation status of the revoked CERT.  */
+static void
+clear_validated_at (ksba_cert_t cert)
+{
+  gpg_error_t err;
+  time_t validated_at = 0; /* That is: No cached validation available. */
+
+  err = ksba_cert_set_user_data (cert, "validated_at",
+                                 &validated_at, sizeof (validated_at));
+  if (err)
+    log_error ("set_user_data(validated_at) failed: %s\n",
+               gpg_strerror (err));
+  /* The certificate is anyway revoked, and that is a more important
+     message than the failure of our cache; thus we don't return an
+     error.  */
+}
+
+
 /* Check whether the certificate either given by fingerprint CERT_FPR
    or directly through the CERT object is valid by running an OCSP
    transaction.  With FORCE_DEFAULT_RESPONDER set only the configured
-   default responder is used. */
+   default responder is used.  Verified responses are kept in a cache
+   until their nextUpdate time so that only the first check of a
+   certificate requires a network round trip. */
 gpg_error_t
 ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
               int force_default_responder)
@@ -611,6 +1037,9 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   char *oid;
   ksba_name_t name;
   fingerprint_list_t default_signer = NULL;
+  char *cache_key = NULL;
+  int time_conflict = 0;
+  unsigned long started;
 
   /* Get the certificate.  */
   if (cert)
@@ -707,9 +1136,33 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
         log_info (_("using OCSP responder '%s'\n"), url);
     }
 
+  /* Check whether we already have a current answer.  */
+  err = make_ocsp_cache_key (cert, issuer_cert, !!default_signer, &cache_key);
+  if (err)
+    {
+      log_info ("OCSP cache not used: %s\n", gpg_strerror (err));
+      err = 0;
+    }
+  else if (get_ocsp_cache (cache_key, &status, next_update,
+                           revocation_time, &reason))
+    {
+      if (opt.verbose)
+        log_info ("using cached OCSP status: %s  (next=%s)\n",
+                  status == KSBA_STATUS_REVOKED? _("revoked"): _("good"),
+                  next_update);
+      if (status == KSBA_STATUS_REVOKED)
+        {
+          clear_validated_at (cert);
+          err = gpg_error (GPG_ERR_CERT_REVOKED);
+        }
+      goto leave;
+    }
+
   /* Ask the OCSP responder. */
+  started = dirmngr_stats_clock ();
   err = do_ocsp_request (ctrl, ocsp, url, cert, issuer_cert,
                          &sigval, produced_at, &md);
+  dirmngr_stats_update (DIRMNGR_STATS_OCSP, started, err);
   if (err)
     goto leave;
 
@@ -769,19 +1222,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   /* In case the certificate has been revoked, we better invalidate
      our cached validation status. */
   if (status == KSBA_STATUS_REVOKED)
-    {
-      time_t validated_at = 0; /* That is: No cached validation available. */
-      err = ksba_cert_set_user_data (cert, "validated_at",
-                                     &validated_at, sizeof (validated_at));
-      if (err)
-        {
-          log_error ("set_user_data(validated_at) failed: %s\n",
-                     gpg_strerror (err));
-          err = 0; /* The certificate is anyway revoked, and that is a
-                      more important message than the failure of our
-                      cache. */
-        }
-    }
+    clear_validated_at (cert);
 
 
   if (opt.verbose)
@@ -830,6 +1271,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
     {
       log_error (_("OCSP responder returned a status in the future\n"));
       log_info ("used now: %s  this_update: %s\n", current_time, this_update);
+      time_conflict = 1;
       if (!err)
         err = gpg_error (GPG_ERR_TIME_CONFLICT);
     }
@@ -843,6 +1285,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
       log_error (_("OCSP responder returned a non-current status\n"));
       log_info ("used now: %s  this_update: %s\n",
                 current_time, this_update);
+      time_conflict = 1;
       if (!err)
         err = gpg_error (GPG_ERR_TIME_CONFLICT);
     }
@@ -858,11 +1301,19 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
           log_error (_("OCSP responder returned an too old status\n"));
           log_info ("used now: %s  next_update: %s\n",
                     current_time, next_update);
+          time_conflict = 1;
           if (!err)
             err = gpg_error (GPG_ERR_TIME_CONFLICT);
         }
     }
 
+  /* Cache the status.  Responses without a nextUpdate indicate that
+     newer information is always available and thus are not cached. */
+  if (cache_key && !time_conflict && *next_update
+      && strcmp (next_update, current_time) > 0
+      && (status == KSBA_STATUS_GOOD || status == KSBA_STATUS_REVOKED))
+    put_ocsp_cache (cache_key, status, next_update, revocation_time, reason);
+
 
  leave:
   gcry_md_close (md);
@@ -872,6 +1323,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   ksba_cert_release (cert);
   ksba_ocsp_release (ocsp);
   xfree (url_buffer);
+  xfree (cache_key);
   return err;
 }
 
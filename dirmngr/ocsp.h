@@ -22,6 +22,9 @@
 #ifndef OCSP_H
 #define OCSP_H
 
+/* Initialize the OCSP module. */
+void ocsp_init (void);
+
 gpg_error_t ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
                           int force_default_responder);
 
@@ -32,6 +32,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <npth.h>
 
 #include "dirmngr.h"
 #include <assuan.h>
@@ -57,6 +58,7 @@
 #include "../common/mbox-util.h"
 #include "../common/zb32.h"
 #include "../common/server-help.h"
+#include "../common/asynclog.h"
 
 /* To avoid DoS attacks we limit the size of a certificate to
    something reasonable.  The DoS was actually only an issue back when
@@ -829,58 +831,133 @@ cmd_dns_cert (assuan_context_t ctx, char *line)
 
 
 
-/* Core of cmd_wkd_get and task_check_wkd_support.  If CTX is NULL
- * this function will not write anything to the assuan output.  */
-static gpg_error_t
-proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
+/* To avoid that concurrent WKD queries for the same domain all run
+ * into the same timeouts, only one query per domain is done at a
+ * time.  A query which had to wait takes the result of the query it
+ * waited for if that query used the same URI.  */
+struct wkd_inflight_s
 {
-  gpg_error_t err = 0;
-  char *mbox = NULL;
-  char *domainbuf = NULL;
-  char *domain;     /* Points to mbox or domainbuf.  This is used to
-                     * connect to the host.  */
-  char *domain_orig;/* Points to mbox.  This is the used for the
-                     * query; i.e. the domain part of the
-                     * addrspec.  */
-  char sha1buf[20];
-  char *uri = NULL;
-  char *encodedhash = NULL;
-  int opt_submission_addr;
-  int opt_policy_flags;
-  int is_wkd_query;   /* True if this is a real WKD query.  */
-  int no_log = 0;
-  char portstr[20] = { 0 };
-  int subdomain_mode = 0;
+  struct wkd_inflight_s *next;
+  unsigned int refcount;  /* Number of queries using this object.  */
+  unsigned int busy:1;    /* A query for the domain is running.     */
+  char *uri;              /* URI of the last finished query or NULL. */
+  gpg_error_t err;        /* Its result.  */
+  void *data;             /* Its response (malloced by estream).  */
+  size_t datalen;
+  char domain[1];
+};
+typedef struct wkd_inflight_s *wkd_inflight_t;
 
-  opt_submission_addr = has_option (line, "--submission-address");
-  opt_policy_flags = has_option (line, "--policy-flags");
-  if (has_option (line, "--quick"))
-    ctrl->timeout = opt.connect_quick_timeout;
-  line = skip_options (line);
-  is_wkd_query = !(opt_policy_flags || opt_submission_addr);
+static wkd_inflight_t wkd_inflight_list;
+static npth_mutex_t wkd_inflight_lock = NPTH_MUTEX_INITIALIZER;
+static npth_cond_t  wkd_inflight_cond = NPTH_COND_INITIALIZER;
 
-  mbox = mailbox_from_userid (line, 0);
-  if (!mbox || !(domain = strchr (mbox, '@')))
+
+/* Start a WKD query for DOMAIN.  This waits until no other query for
+ * DOMAIN is running.  R_WAITED is set if the function had to wait.
+ * Returns an object to be released by wkd_inflight_leave or NULL on
+ * error.  */
+static wkd_inflight_t
+wkd_inflight_enter (const char *domain, int *r_waited)
+{
+  wkd_inflight_t item, item_new;
+
+  *r_waited = 0;
+  item_new = xtrycalloc (1, sizeof *item_new + strlen (domain));
+  if (!item_new)
+    return NULL;
+  strcpy (item_new->domain, domain);
+
+  npth_mutex_lock (&wkd_inflight_lock);
+  for (item = wkd_inflight_list; item; item = item->next)
+    if (!strcmp (item->domain, domain))
+      break;
+  if (item)
+    xfree (item_new);
+  else
     {
-      err = set_error (GPG_ERR_INV_USER_ID, "no mailbox in user id");
-      goto leave;
+      item = item_new;
+      item->next = wkd_inflight_list;
+      wkd_inflight_list = item;
     }
-  *domain++ = 0;
-  domain_orig = domain;
+  item->refcount++;
+  while (item->busy)
+    {
+      *r_waited = 1;
+      npth_cond_wait (&wkd_inflight_cond, &wkd_inflight_lock);
+    }
+  item->busy = 1;
+  npth_mutex_unlock (&wkd_inflight_lock);
 
+  return item;
+}
 
-  /* Let's check whether we already know that the domain does not
-   * support WKD.  */
-  if (is_wkd_query)
+
+/* Finish the WKD query which started with ITEM.  If URI is not NULL
+ * the query fetched URI with the result ERR and the response DATA of
+ * DATALEN bytes; ownership of DATA is transferred to this
+ * function.  */
+static void
+wkd_inflight_leave (wkd_inflight_t item, const char *uri, gpg_error_t err,
+                    void *data, size_t datalen)
+{
+  wkd_inflight_t *itemp;
+  char *uricopy = NULL;
+
+  if (uri && !(uricopy = xtrystrdup (uri)))
     {
-      if (domaininfo_is_wkd_not_supported (domain_orig))
-        {
-          err = gpg_error (GPG_ERR_NO_DATA);
-          dirmngr_status_printf (ctrl, "NOTE", "wkd_cached_result %u", err);
-          goto leave;
-        }
+      es_free (data);
+      data = NULL;
+    }
+
+  npth_mutex_lock (&wkd_inflight_lock);
+  if (uricopy)
+    {
+      xfree (item->uri);
+      es_free (item->data);
+      item->uri = uricopy;
+      item->err = err;
+      item->data = data;
+      item->datalen = datalen;
     }
+  item->busy = 0;
+  if (!--item->refcount)
+    {
+      for (itemp = &wkd_inflight_list; *itemp; itemp = &(*itemp)->next)
+        if (*itemp == item)
+          {
+            *itemp = item->next;
+            break;
+          }
+      xfree (item->uri);
+      es_free (item->data);
+      xfree (item);
+    }
+  npth_cond_broadcast (&wkd_inflight_cond);
+  npth_mutex_unlock (&wkd_inflight_lock);
+}
+
+
+/* The host to query for the WKD of a domain.  */
+struct wkd_host_s
+{
+  char *domainbuf;     /* Malloced host name or NULL for the domain.  */
+  char portstr[20];    /* Empty or ":PORT".  */
+  int subdomain_mode;  /* The "openpgpkey" subdomain is used.  */
+};
+
+
+/* Find the host to query for the WKD of DOMAIN_ORIG and store it at
+ * HOST.  The caller needs to xfree HOST->DOMAINBUF.  Helper for
+ * proc_wkd_get and proc_wkd_get_batch.  */
+static gpg_error_t
+wkd_resolve_host (ctrl_t ctrl, const char *domain_orig,
+                  struct wkd_host_s *host)
+{
+  gpg_error_t err;
+  const char *domain = domain_orig;
 
+  memset (host, 0, sizeof *host);
 
   /* First try the new "openpgp" subdomain.  We check that the domain
    * is valid because it is later used as an unescaped filename part
@@ -889,33 +966,33 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
     {
       dns_addrinfo_t aibuf;
 
-      domainbuf = strconcat ( "openpgpkey.", domain_orig, NULL);
-      if (!domainbuf)
+      host->domainbuf = strconcat ( "openpgpkey.", domain_orig, NULL);
+      if (!host->domainbuf)
         {
           err = gpg_error_from_syserror ();
-          goto leave;
+          return err;
         }
 
       /* FIXME: We should put a cache into dns-stuff because the same
        * query (with a different port and socket type, though) will be
        * done later by http function.  */
-      err = resolve_dns_name (ctrl, domainbuf, 0, 0, 0, &aibuf, NULL);
+      err = resolve_dns_name (ctrl, host->domainbuf, 0, 0, 0, &aibuf, NULL);
       if (err)
         {
           err = 0;
-          xfree (domainbuf);
-          domainbuf = NULL;
+          xfree (host->domainbuf);
+          host->domainbuf = NULL;
         }
       else /* Got a subdomain. */
         {
           free_dns_addrinfo (aibuf);
-          subdomain_mode = 1;
-          domain = domainbuf;
+          host->subdomain_mode = 1;
+          domain = host->domainbuf;
         }
     }
 
   /* Check for SRV records unless we have a subdomain. */
-  if (!subdomain_mode)
+  if (!host->subdomain_mode)
     {
       struct srventry *srvs;
       unsigned int srvscount;
@@ -924,7 +1001,7 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
 
       err = get_dns_srv (ctrl, domain, "openpgpkey", NULL, &srvs, &srvscount);
       if (err)
-        goto leave;
+        return err;
 
       /* Check for rogue DNS names.  */
       for (i = 0; i < srvscount; i++)
@@ -934,7 +1011,7 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
               err = gpg_error (GPG_ERR_DNS_ADDRESS);
               log_error ("rogue openpgpkey SRV record for '%s'\n", domain);
               xfree (srvs);
-              goto leave;
+              return err;
             }
         }
 
@@ -954,39 +1031,181 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
                   && !ascii_strcasecmp (srvs[i].target, domain)))
             {
               /* found.  */
-              domainbuf = xtrystrdup (srvs[i].target);
-              if (!domainbuf)
+              host->domainbuf = xtrystrdup (srvs[i].target);
+              if (!host->domainbuf)
                 {
                   err = gpg_error_from_syserror ();
                   xfree (srvs);
-                  goto leave;
+                  return err;
                 }
-              domain = domainbuf;
+              domain = host->domainbuf;
               if (srvs[i].port)
-                snprintf (portstr, sizeof portstr, ":%hu", srvs[i].port);
+                snprintf (host->portstr, sizeof host->portstr,
+                          ":%hu", srvs[i].port);
               break;
             }
         }
       xfree (srvs);
     }
 
-  /* Prepare the hash of the local part.  */
+  return 0;
+}
+
+
+/* Return a malloced string with the URI of the key for the local
+ * part MBOX of an address in DOMAIN_ORIG as served by HOST.  Returns
+ * NULL on error with ERRNO set.  */
+static char *
+wkd_key_uri (const char *mbox, const char *domain_orig,
+             struct wkd_host_s *host)
+{
+  char sha1buf[20];
+  char *encodedhash;
+  char *escapedmbox;
+  char *uri;
+
   gcry_md_hash_buffer (GCRY_MD_SHA1, sha1buf, mbox, strlen (mbox));
   encodedhash = zb32_encode (sha1buf, 8*20);
   if (!encodedhash)
+    return NULL;
+  escapedmbox = http_escape_string (mbox, "%;?&=");
+  if (!escapedmbox)
     {
-      err = gpg_error_from_syserror ();
+      xfree (encodedhash);
+      return NULL;
+    }
+  uri = strconcat ("https://",
+                   host->domainbuf? host->domainbuf : domain_orig,
+                   host->portstr,
+                   "/.well-known/openpgpkey/",
+                   host->subdomain_mode? domain_orig : "",
+                   host->subdomain_mode? "/" : "",
+                   "hu/",
+                   encodedhash,
+                   "?l=",
+                   escapedmbox,
+                   NULL);
+  xfree (escapedmbox);
+  xfree (encodedhash);
+  return uri;
+}
+
+
+/* Register the result ERR of a WKD query for DOMAIN_ORIG.  */
+static void
+wkd_register_result (ctrl_t ctrl, const char *domain_orig, gpg_error_t err,
+                     int is_wkd_query, int opt_policy_flags)
+{
+  switch (gpg_err_code (err))
+    {
+    case 0:
+      domaininfo_set_wkd_supported (domain_orig);
+      break;
+
+    case GPG_ERR_NO_NAME:
+      /* There is no such domain.  */
+      domaininfo_set_no_name (domain_orig);
+      break;
+
+    case GPG_ERR_NO_DATA:
+      if (is_wkd_query && ctrl->server_local)
+        {
+          /* Mark that and schedule a check.  */
+          domaininfo_set_wkd_not_found (domain_orig);
+          workqueue_add_task (task_check_wkd_support, domain_orig,
+                              ctrl->server_local->session_id, 1);
+        }
+      else if (opt_policy_flags) /* No policy file - no support.  */
+        domaininfo_set_wkd_not_supported (domain_orig);
+      break;
+
+    default:
+      /* Don't register other errors.  */
+      break;
+    }
+}
+
+
+/* Core of cmd_wkd_get and task_check_wkd_support.  If CTX is NULL
+ * this function will not write anything to the assuan output.  */
+static gpg_error_t
+proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
+{
+  gpg_error_t err = 0;
+  char *mbox = NULL;
+  struct wkd_host_s host = { NULL };
+  char *domain;     /* Points to mbox or host.domainbuf.  This is
+                     * used to connect to the host.  */
+  char *domain_orig;/* Points to mbox.  This is the used for the
+                     * query; i.e. the domain part of the
+                     * addrspec.  */
+  char *uri = NULL;
+  int opt_submission_addr;
+  int opt_policy_flags;
+  int is_wkd_query;   /* True if this is a real WKD query.  */
+  int no_log = 0;
+  wkd_inflight_t inflight = NULL;
+  int inflight_waited = 0;
+
+  opt_submission_addr = has_option (line, "--submission-address");
+  opt_policy_flags = has_option (line, "--policy-flags");
+  if (has_option (line, "--quick"))
+    ctrl->timeout = opt.connect_quick_timeout;
+  line = skip_options (line);
+  is_wkd_query = !(opt_policy_flags || opt_submission_addr);
+
+  mbox = mailbox_from_userid (line, 0);
+  if (!mbox || !(domain = strchr (mbox, '@')))
+    {
+      err = set_error (GPG_ERR_INV_USER_ID, "no mailbox in user id");
       goto leave;
     }
+  *domain++ = 0;
+  domain_orig = domain;
+
+
+  /* Let's check whether we already know that the domain does not
+   * support WKD.  */
+  if (is_wkd_query)
+    {
+      if (domaininfo_is_wkd_not_supported (domain_orig))
+        {
+          err = gpg_error (GPG_ERR_NO_DATA);
+          dirmngr_status_printf (ctrl, "NOTE", "wkd_cached_result %u", err);
+          goto leave;
+        }
+
+      /* Wait for a concurrent query for the same domain; we may then
+       * know more about the domain.  */
+      inflight = wkd_inflight_enter (domain_orig, &inflight_waited);
+      if (!inflight)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      if (inflight_waited && domaininfo_is_wkd_not_supported (domain_orig))
+        {
+          err = gpg_error (GPG_ERR_NO_DATA);
+          dirmngr_status_printf (ctrl, "NOTE", "wkd_cached_result %u", err);
+          goto leave;
+        }
+    }
+
+
+  err = wkd_resolve_host (ctrl, domain_orig, &host);
+  if (err)
+    goto leave;
+  if (host.domainbuf)
+    domain = host.domainbuf;
 
   if (opt_submission_addr)
     {
       uri = strconcat ("https://",
                        domain,
-                       portstr,
+                       host.portstr,
                        "/.well-known/openpgpkey/",
-                       subdomain_mode? domain_orig : "",
-                       subdomain_mode? "/" : "",
+                       host.subdomain_mode? domain_orig : "",
+                       host.subdomain_mode? "/" : "",
                        "submission-address",
                        NULL);
     }
@@ -994,40 +1213,23 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
     {
       uri = strconcat ("https://",
                        domain,
-                       portstr,
+                       host.portstr,
                        "/.well-known/openpgpkey/",
-                       subdomain_mode? domain_orig : "",
-                       subdomain_mode? "/" : "",
+                       host.subdomain_mode? domain_orig : "",
+                       host.subdomain_mode? "/" : "",
                        "policy",
                        NULL);
     }
   else
     {
-      char *escapedmbox;
-
-      escapedmbox = http_escape_string (mbox, "%;?&=");
-      if (escapedmbox)
-        {
-          uri = strconcat ("https://",
-                           domain,
-                           portstr,
-                           "/.well-known/openpgpkey/",
-                           subdomain_mode? domain_orig : "",
-                           subdomain_mode? "/" : "",
-                           "hu/",
-                           encodedhash,
-                           "?l=",
-                           escapedmbox,
-                           NULL);
-          xfree (escapedmbox);
-          no_log = 1;
-          if (uri)
-            {
-              err = dirmngr_status_printf (ctrl, "SOURCE", "https://%s%s",
-                                           domain, portstr);
-              if (err)
-                goto leave;
-            }
+      uri = wkd_key_uri (mbox, domain_orig, &host);
+      no_log = 1;
+      if (uri)
+        {
+          err = dirmngr_status_printf (ctrl, "SOURCE", "https://%s%s",
+                                       domain, host.portstr);
+          if (err)
+            goto leave;
         }
     }
   if (!uri)
@@ -1053,63 +1255,500 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
             ctrl->server_local->inhibit_data_logging_now = 0;
             ctrl->server_local->inhibit_data_logging_count = 0;
           }
-        err = ks_action_fetch (ctrl, uri, outfp);
+        if (inflight && inflight_waited && inflight->uri
+            && !strcmp (inflight->uri, uri))
+          {
+            /* The query we waited for was the same; take its result.
+             * That query has also registered the result.  */
+            err = inflight->err;
+            if (!err && outfp && inflight->datalen
+                && es_write (outfp, inflight->data, inflight->datalen, NULL))
+              err = gpg_error_from_syserror ();
+            es_fclose (outfp);
+            if (ctrl->server_local)
+              ctrl->server_local->inhibit_data_logging = 0;
+            goto leave;
+          }
+        else if (inflight)
+          {
+            /* Keep a copy of the response for waiting queries.  */
+            estream_t memfp;
+            void *data = NULL;
+            size_t datalen = 0;
+            gpg_error_t writeerr = 0;
+
+            memfp = es_fopenmem (0, "w+b");
+            if (!memfp)
+              err = gpg_error_from_syserror ();
+            else
+              {
+                err = ks_action_fetch (ctrl, uri, memfp);
+                if (es_fclose_snatch (memfp, &data, &datalen))
+                  {
+                    if (!err)
+                      err = gpg_error_from_syserror ();
+                    data = NULL;
+                    datalen = 0;
+                  }
+              }
+            if (!err && outfp && datalen
+                && es_write (outfp, data, datalen, NULL))
+              writeerr = gpg_error_from_syserror ();
+            wkd_inflight_leave (inflight, uri, err, data, datalen);
+            inflight = NULL;
+            if (writeerr)
+              err = writeerr;
+          }
+        else
+          err = ks_action_fetch (ctrl, uri, outfp);
         es_fclose (outfp);
         if (ctrl->server_local)
           ctrl->server_local->inhibit_data_logging = 0;
 
         /* Register the result under the domain name of MBOX. */
-        switch (gpg_err_code (err))
-          {
-          case 0:
-            domaininfo_set_wkd_supported (domain_orig);
-            break;
-
-          case GPG_ERR_NO_NAME:
-            /* There is no such domain.  */
-            domaininfo_set_no_name (domain_orig);
-            break;
-
-          case GPG_ERR_NO_DATA:
-            if (is_wkd_query && ctrl->server_local)
-              {
-                /* Mark that and schedule a check.  */
-                domaininfo_set_wkd_not_found (domain_orig);
-                workqueue_add_task (task_check_wkd_support, domain_orig,
-                                    ctrl->server_local->session_id, 1);
-              }
-            else if (opt_policy_flags) /* No policy file - no support.  */
-              domaininfo_set_wkd_not_supported (domain_orig);
-            break;
-
-          default:
-            /* Don't register other errors.  */
-            break;
-          }
+        wkd_register_result (ctrl, domain_orig, err,
+                             is_wkd_query, opt_policy_flags);
       }
   }
 
  leave:
+  if (inflight)
+    wkd_inflight_leave (inflight, NULL, 0, NULL, 0);
   xfree (uri);
-  xfree (encodedhash);
   xfree (mbox);
-  xfree (domainbuf);
+  xfree (host.domainbuf);
+  return err;
+}
+
+
+/* The maximum length of the address list for WKD_GET --batch.  */
+#define MAX_WKD_BATCH_LENGTH (256*1024)
+
+/* A domain of a WKD_GET --batch request.  */
+struct wkd_batch_domain_s
+{
+  struct wkd_batch_domain_s *next;
+  const char *name;         /* The domain; points into an item's mbox.  */
+  int state;                /* 0 = not checked, 1 = being checked,
+                             * 2 = ready.  */
+  gpg_error_t err;          /* If set the result for all addresses.  */
+  struct wkd_host_s host;   /* The host serving the domain.  */
+};
+
+/* An address of a WKD_GET --batch request.  */
+struct wkd_batch_item_s
+{
+  struct wkd_batch_item_s *next;       /* The next item in the list.  */
+  struct wkd_batch_item_s *next_done;  /* The next completed item.  */
+  int idx;                  /* Position of the address in the list.  */
+  char *mbox;               /* The local part or NULL if invalid.  */
+  struct wkd_batch_domain_s *domain;
+  gpg_error_t err;          /* The result of the lookup.  */
+  estream_t data;           /* The fetched key or NULL.  */
+  estream_t status;         /* The captured status lines or NULL.  */
+};
+
+/* The state shared by proc_wkd_get_batch and its worker threads.
+ * The fields are protected by LOCK.  */
+struct wkd_batch_s
+{
+  npth_mutex_t lock;
+  npth_cond_t cond;         /* Signaled when an item or domain is done.  */
+  ctrl_t ctrl;              /* The caller's control object.  */
+  struct wkd_batch_item_s *next;   /* The next item to look up.  */
+  struct wkd_batch_item_s *done;   /* Completed items not yet sent.  */
+  int nrunning;             /* Number of running workers.  */
+  int stop;                 /* Do not start new lookups.  */
+};
+
+
+/* Check the domain DOM of a batch and store the result in DOM.  This
+ * resolves the host and reads the policy file; without a policy file
+ * the domain does not support WKD and no keys are requested.  */
+static void
+wkd_batch_check_domain (ctrl_t ctrl, struct wkd_batch_domain_s *dom)
+{
+  gpg_error_t err;
+  char *uri;
+  estream_t fp;
+
+  if (domaininfo_is_wkd_not_supported (dom->name))
+    {
+      dirmngr_status_printf (ctrl, "NOTE", "wkd_cached_result %u",
+                             gpg_error (GPG_ERR_NO_DATA));
+      dom->err = gpg_error (GPG_ERR_NO_DATA);
+      return;
+    }
+
+  dom->err = wkd_resolve_host (ctrl, dom->name, &dom->host);
+  if (dom->err)
+    return;
+
+  uri = strconcat ("https://",
+                   dom->host.domainbuf? dom->host.domainbuf : dom->name,
+                   dom->host.portstr,
+                   "/.well-known/openpgpkey/",
+                   dom->host.subdomain_mode? dom->name : "",
+                   dom->host.subdomain_mode? "/" : "",
+                   "policy",
+                   NULL);
+  if (!uri)
+    {
+      dom->err = gpg_error_from_syserror ();
+      return;
+    }
+  fp = es_fopenmem (0, "w+b");
+  if (!fp)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      err = ks_action_fetch (ctrl, uri, fp);
+      es_fclose (fp);
+    }
+  xfree (uri);
+
+  wkd_register_result (ctrl, dom->name, err, 0, 1);
+  switch (gpg_err_code (err))
+    {
+    case GPG_ERR_NO_DATA:
+    case GPG_ERR_NO_NAME:
+      dom->err = err;
+      break;
+    default:
+      /* Other errors are left to the key requests.  */
+      break;
+    }
+}
+
+
+/* Look up the key for ITEM of batch PARM.  This is run by a worker
+ * thread; thus a private control object is used which captures the
+ * status lines.  */
+static void
+wkd_batch_get_one (struct wkd_batch_s *parm, struct wkd_batch_item_s *item)
+{
+  struct server_control_s wctrl;
+  struct wkd_batch_domain_s *dom = item->domain;
+  char *uri;
+
+  if (!dom)
+    {
+      item->err = gpg_error (GPG_ERR_INV_USER_ID);
+      return;
+    }
+
+  memset (&wctrl, 0, sizeof wctrl);
+  wctrl.magic = parm->ctrl->magic;
+  wctrl.no_server = parm->ctrl->no_server;
+  wctrl.timeout = parm->ctrl->timeout;
+  wctrl.http_proxy = parm->ctrl->http_proxy;
+  wctrl.http_no_crl = parm->ctrl->http_no_crl;
+
+  item->status = es_fopenmem (0, "w+");
+  if (!item->status)
+    {
+      item->err = gpg_error_from_syserror ();
+      return;
+    }
+  wctrl.status_capture = item->status;
+
+  /* The first worker for a domain checks it; the others wait.  */
+  npth_mutex_lock (&parm->lock);
+  while (dom->state == 1)
+    npth_cond_wait (&parm->cond, &parm->lock);
+  if (!dom->state)
+    {
+      dom->state = 1;
+      npth_mutex_unlock (&parm->lock);
+      wkd_batch_check_domain (&wctrl, dom);
+      npth_mutex_lock (&parm->lock);
+      dom->state = 2;
+      npth_cond_broadcast (&parm->cond);
+    }
+  npth_mutex_unlock (&parm->lock);
+  if (dom->err)
+    {
+      item->err = dom->err;
+      return;
+    }
+
+  uri = wkd_key_uri (item->mbox, dom->name, &dom->host);
+  if (!uri)
+    {
+      item->err = gpg_error_from_syserror ();
+      return;
+    }
+  item->data = es_fopenmem (0, "w+b");
+  if (!item->data)
+    item->err = gpg_error_from_syserror ();
+  else
+    item->err = ks_action_fetch (&wctrl, uri, item->data);
+  xfree (uri);
+}
+
+
+/* The thread function for proc_wkd_get_batch.  */
+static void *
+wkd_batch_worker (void *arg)
+{
+  struct wkd_batch_s *parm = arg;
+  struct wkd_batch_item_s *item;
+
+  npth_mutex_lock (&parm->lock);
+  while (!parm->stop && parm->next)
+    {
+      item = parm->next;
+      parm->next = item->next;
+      npth_mutex_unlock (&parm->lock);
+
+      wkd_batch_get_one (parm, item);
+
+      npth_mutex_lock (&parm->lock);
+      item->next_done = parm->done;
+      parm->done = item;
+      npth_cond_broadcast (&parm->cond);
+    }
+  parm->nrunning--;
+  npth_cond_broadcast (&parm->cond);
+  npth_mutex_unlock (&parm->lock);
+  return NULL;
+}
+
+
+/* Parse the address list (VALUE,VALUELEN) into R_ITEMS and
+ * R_DOMAINS.  */
+static gpg_error_t
+wkd_batch_parse (char *value, size_t valuelen,
+                 struct wkd_batch_item_s **r_items,
+                 struct wkd_batch_domain_s **r_domains)
+{
+  struct wkd_batch_item_s *item, **tail = r_items;
+  struct wkd_batch_domain_s *dom;
+  char *line, *endp, *end, *p;
+  int idx = 0;
+
+  end = value + valuelen;
+  for (line = value; line < end; line = endp + 1)
+    {
+      endp = memchr (line, '\n', end - line);
+      if (!endp)
+        endp = end;
+      *endp = 0;
+      trim_spaces (line);
+      if (!*line)
+        continue;
+
+      item = xtrycalloc (1, sizeof *item);
+      if (!item)
+        return gpg_error_from_syserror ();
+      item->idx = idx++;
+      *tail = item;
+      tail = &item->next;
+
+      item->mbox = mailbox_from_userid (line, 0);
+      if (!item->mbox || !(p = strchr (item->mbox, '@')))
+        continue;  /* Reported as invalid user id.  */
+      *p++ = 0;
+
+      /* Group the addresses by domain.  */
+      for (dom = *r_domains; dom; dom = dom->next)
+        if (!ascii_strcasecmp (dom->name, p))
+          break;
+      if (!dom)
+        {
+          dom = xtrycalloc (1, sizeof *dom);
+          if (!dom)
+            return gpg_error_from_syserror ();
+          dom->name = p;
+          dom->next = *r_domains;
+          *r_domains = dom;
+        }
+      item->domain = dom;
+    }
+
+  return *r_items? 0 : gpg_error (GPG_ERR_NO_USER_ID);
+}
+
+
+/* Send the result of ITEM to the client.  */
+static gpg_error_t
+wkd_batch_send_result (ctrl_t ctrl, assuan_context_t ctx,
+                       struct wkd_batch_item_s *item)
+{
+  gpg_error_t err = 0;
+  estream_t outfp;
+
+  if (item->status)
+    ks_action_replay_status (ctrl, item->status);
+
+  if (!item->err && item->data)
+    {
+      outfp = es_fopencookie (ctx, "w", data_line_cookie_functions);
+      if (!outfp)
+        return set_error (GPG_ERR_ASS_GENERAL,
+                          "error setting up a data stream");
+      ctrl->server_local->inhibit_data_logging = 1;
+      ctrl->server_local->inhibit_data_logging_now = 0;
+      ctrl->server_local->inhibit_data_logging_count = 0;
+      es_rewind (item->data);
+      err = copy_stream (item->data, outfp);
+      /* Closing flushes the D lines before the status line.  */
+      if (es_fclose (outfp) && !err)
+        err = gpg_error_from_syserror ();
+      ctrl->server_local->inhibit_data_logging = 0;
+      if (err)
+        return err;
+    }
+
+  return dirmngr_status_printf (ctrl, "WKD_RESULT", "%d %u",
+                                item->idx, item->err);
+}
+
+
+/* Helper for cmd_wkd_get to implement the --batch option.  */
+static gpg_error_t
+proc_wkd_get_batch (ctrl_t ctrl, assuan_context_t ctx)
+{
+  gpg_error_t err;
+  unsigned char *value = NULL;
+  size_t valuelen;
+  struct wkd_batch_s parm;
+  struct wkd_batch_item_s *items = NULL;
+  struct wkd_batch_domain_s *domains = NULL;
+  struct wkd_batch_item_s *item;
+  struct wkd_batch_domain_s *dom;
+  npth_attr_t tattr;
+  npth_t thread;
+  int i, rc;
+
+  err = assuan_inquire (ctx, "MBOXES", &value, &valuelen,
+                        MAX_WKD_BATCH_LENGTH);
+  if (err)
+    {
+      log_error (_("assuan_inquire failed: %s\n"), gpg_strerror (err));
+      return err;
+    }
+  err = wkd_batch_parse ((char *)value, valuelen, &items, &domains);
+  if (err)
+    goto leave;
+
+  memset (&parm, 0, sizeof parm);
+  parm.ctrl = ctrl;
+  parm.next = items;
+  rc = npth_mutex_init (&parm.lock, NULL);
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      goto leave;
+    }
+  rc = npth_cond_init (&parm.cond, NULL);
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      npth_mutex_destroy (&parm.lock);
+      goto leave;
+    }
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  npth_mutex_lock (&parm.lock);
+  for (i=0, item = items; item && (!i || i < opt.keyserver_jobs);
+       i++, item = item->next)
+    {
+      rc = npth_create (&thread, &tattr, wkd_batch_worker, &parm);
+      if (rc)
+        {
+          log_error ("error spawning WKD worker: %s\n", strerror (rc));
+          break;
+        }
+      parm.nrunning++;
+    }
+  npth_attr_destroy (&tattr);
+  if (!parm.nrunning)
+    err = gpg_error_from_errno (rc);
+
+  while (parm.nrunning || parm.done)
+    {
+      if (!parm.done)
+        {
+          npth_cond_wait (&parm.cond, &parm.lock);
+          continue;
+        }
+      item = parm.done;
+      parm.done = item->next_done;
+      npth_mutex_unlock (&parm.lock);
+
+      if (!err)
+        err = wkd_batch_send_result (ctrl, ctx, item);
+
+      npth_mutex_lock (&parm.lock);
+      if (err)
+        parm.stop = 1;
+    }
+  npth_mutex_unlock (&parm.lock);
+  npth_cond_destroy (&parm.cond);
+  npth_mutex_destroy (&parm.lock);
+
+ leave:
+  while ((item = items))
+    {
+      items = item->next;
+      es_fclose (item->data);
+      es_fclose (item->status);
+      xfree (item->mbox);
+      xfree (item);
+    }
+  while ((dom = domains))
+    {
+      domains = dom->next;
+      xfree (dom->host.domainbuf);
+      xfree (dom);
+    }
+  xfree (value);
   return err;
 }
 
 
 static const char hlp_wkd_get[] =
   "WKD_GET [--submission-address|--policy-flags] <user_id>\n"
+  "WKD_GET --batch\n"
   "\n"
   "Return the key or other info for <user_id>\n"
-  "from the Web Key Directory.";
+  "from the Web Key Directory.\n"
+  "\n"
+  "With the option --batch no user id is given.  Instead the addresses\n"
+  "are inquired using\n"
+  "\n"
+  "   INQUIRE MBOXES\n"
+  "\n"
+  "and the caller is expected to return one address per line.  The\n"
+  "lookups are done concurrently as configured by --keyserver-jobs\n"
+  "and the policy file of each domain is read only once.  For each\n"
+  "address the key, if any, is returned as data followed by a status\n"
+  "line\n"
+  "\n"
+  "   WKD_RESULT <index> <error_code>\n"
+  "\n"
+  "where INDEX is the position of the address in the list, not\n"
+  "counting empty lines.  The results are returned in the order the\n"
+  "lookups complete.";
 static gpg_error_t
 cmd_wkd_get (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
   gpg_error_t err;
+  unsigned long started;
 
-  err = proc_wkd_get (ctrl, ctx, line);
+  started = dirmngr_stats_clock ();
+  if (has_option (line, "--batch"))
+    {
+      if (has_option (line, "--quick"))
+        ctrl->timeout = opt.connect_quick_timeout;
+      err = proc_wkd_get_batch (ctrl, ctx);
+    }
+  else
+    err = proc_wkd_get (ctrl, ctx, line);
+  dirmngr_stats_update (DIRMNGR_STATS_WKD, started, err);
 
   return leave_cmd (ctx, err);
 }
@@ -1173,6 +1812,104 @@ cmd_ldapserver (assuan_context_t ctx, char *line)
 }
 
 
+/* Helper for cmd_isvalid to check the certificate CERT.  */
+static gpg_error_t
+isvalid_cert (ctrl_t ctrl, ksba_cert_t cert, int ocsp_mode, int only_ocsp,
+              int force_default_responder)
+{
+  gpg_error_t err;
+
+  if (ocsp_mode)
+    {
+      if (!opt.allow_ocsp)
+        err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      else
+        err = ocsp_isvalid (ctrl, cert, NULL, force_default_responder);
+
+      if (!(gpg_err_code (err) == GPG_ERR_CONFIGURATION
+            && gpg_err_source (err) == GPG_ERR_SOURCE_DIRMNGR))
+        return err;
+
+      /* No default responder configured - fallback to CRL.  */
+      if (!only_ocsp)
+        log_info ("falling back to CRL check\n");
+    }
+
+  if (only_ocsp)
+    return gpg_error (GPG_ERR_NO_CRL_KNOWN);
+
+  err = crl_cache_cert_isvalid (ctrl, cert, ctrl->force_crl_refresh);
+  if (gpg_err_code (err) == GPG_ERR_NO_CRL_KNOWN)
+    {
+      err = crl_cache_reload_crl (ctrl, cert);
+      if (!err)
+        err = crl_cache_cert_isvalid (ctrl, cert, 0);
+    }
+  return err;
+}
+
+
+/* Helper for cmd_isvalid to implement the --batch option.  */
+static gpg_error_t
+isvalid_batch (ctrl_t ctrl, int ocsp_mode, int only_ocsp,
+               int force_default_responder)
+{
+  gpg_error_t err;
+  unsigned char *value = NULL;
+  size_t valuelen;
+  certlist_t certlist = NULL;
+  certlist_t cl;
+  estream_t fp;
+  int idx;
+
+  err = assuan_inquire (ctrl->server_local->assuan_ctx, "CERTLIST",
+                        &value, &valuelen, MAX_CERTLIST_LENGTH);
+  if (err)
+    {
+      log_error (_("assuan_inquire failed: %s\n"), gpg_strerror (err));
+      return err;
+    }
+
+  if (!valuelen) /* No data returned; return a comprehensible error. */
+    err = gpg_error (GPG_ERR_MISSING_CERT);
+  else
+    {
+      fp = es_fopenmem_init (0, "rb", value, valuelen);
+      if (!fp)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = read_certlist_from_stream (&certlist, fp);
+          es_fclose (fp);
+          if (!err && !certlist)
+            err = gpg_error (GPG_ERR_MISSING_CERT);
+        }
+    }
+  xfree (value);
+  if (err)
+    goto leave;
+
+  /* The list usually holds the entire chain.  Putting all of them
+   * into the cache lets the checks find the issuer certificates
+   * without inquiring them one by one.  */
+  for (cl = certlist; cl; cl = cl->next)
+    cache_cert_silent (cl->cert, NULL);
+
+  for (idx = 0, cl = certlist; cl; cl = cl->next, idx++)
+    {
+      err = isvalid_cert (ctrl, cl->cert, ocsp_mode, only_ocsp,
+                          force_default_responder);
+      err = dirmngr_status_printf (ctrl, "ISVALID", "%d %u", idx, err);
+      if (err)
+        goto leave;
+    }
+
+ leave:
+  release_certlist (certlist);
+  return err;
+}
+
+
 static const char hlp_isvalid[] =
   "ISVALID [--only-ocsp] [--force-default-responder]"
   " <certificate_id> [<certificate_fpr>]\n"
@@ -1196,7 +1933,22 @@ static const char hlp_isvalid[] =
   "\n"
   "If the option --force-default-responder is given, only the default\n"
   "OCSP responder will be used and any other methods of obtaining an\n"
-  "OCSP responder URL won't be used.";
+  "OCSP responder URL won't be used.\n"
+  "\n"
+  "With the option --batch no certificate ID is given.  Instead the\n"
+  "certificates to check are inquired using\n"
+  "\n"
+  "   INQUIRE CERTLIST\n"
+  "\n"
+  "and the caller is expected to return a concatenation of DER encoded\n"
+  "certificates.  All of them are also used to locate the issuer\n"
+  "certificates.  The result for each certificate is returned by a\n"
+  "status line\n"
+  "\n"
+  "   ISVALID <index> <error_code>\n"
+  "\n"
+  "where INDEX is the position of the certificate in the list.  The\n"
+  "option --ocsp requests an OCSP check for all certificates.";
 static gpg_error_t
 cmd_isvalid (assuan_context_t ctx, char *line)
 {
@@ -1210,6 +1962,10 @@ cmd_isvalid (assuan_context_t ctx, char *line)
 
   only_ocsp = has_option (line, "--only-ocsp");
   force_default_responder = has_option (line, "--force-default-responder");
+  if (has_option (line, "--batch"))
+    return leave_cmd (ctx, isvalid_batch (ctrl, has_option (line, "--ocsp"),
+                                          only_ocsp,
+                                          force_default_responder));
   line = skip_options (line);
 
   /* We need to work on a copy of the line because that same Assuan
@@ -2598,6 +3354,134 @@ cmd_loadswdb (assuan_context_t ctx, char *line)
 
 
 
+/* The number of buckets of the latency histograms.  Bucket N counts
+ * the operations which took less than 10^N milliseconds; the last
+ * bucket counts all slower operations.  */
+#define STATS_BUCKETS 6
+
+/* Counters and latency histograms for the operations listed in enum
+ * dirmngr_stats_ops and hit counters for the caches listed in enum
+ * dirmngr_stats_caches.  They are reported by "GETINFO metrics".  No
+ * lock is required because the update functions do not context
+ * switch.  */
+static struct
+{
+  struct
+  {
+    unsigned long count;      /* Number of operations.  */
+    unsigned long errors;     /* Number of failed operations.  */
+    unsigned long total_ms;   /* Total time of all operations.  */
+    unsigned long max_ms;     /* Time of the slowest operation.  */
+    unsigned long hist[STATS_BUCKETS];
+  } op[DIRMNGR_STATS_LAST_OP];
+  struct
+  {
+    unsigned long hits;
+    unsigned long misses;
+  } cache[DIRMNGR_CACHE_LAST];
+} stats;
+
+/* The names used by "GETINFO metrics".  */
+static const char *stats_op_names[DIRMNGR_STATS_LAST_OP] =
+  { "hkp", "wkd", "ldap", "http", "ocsp", "crl", "dns", "tls" };
+static const char *stats_cache_names[DIRMNGR_CACHE_LAST] =
+  { "ks", "cert", "crl", "dns", "ocsp" };
+
+
+/* Return a monotonic time in milliseconds to be passed to
+ * dirmngr_stats_update.  */
+unsigned long
+dirmngr_stats_clock (void)
+{
+  struct timespec now;
+
+  npth_clock_gettime (&now);
+  return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+}
+
+
+/* Account for one operation OP which was started at STARTED as
+ * returned by dirmngr_stats_clock and finished with ERR.  This
+ * function is assured not to do any context switches.  */
+void
+dirmngr_stats_update (enum dirmngr_stats_ops op, unsigned long started,
+                      gpg_error_t err)
+{
+  unsigned long ms, now, limit;
+  int i;
+
+  if (op < 0 || op >= DIRMNGR_STATS_LAST_OP)
+    return;
+
+  now = dirmngr_stats_clock ();
+  ms = now > started? now - started : 0;
+  stats.op[op].count++;
+  if (err)
+    stats.op[op].errors++;
+  stats.op[op].total_ms += ms;
+  if (ms > stats.op[op].max_ms)
+    stats.op[op].max_ms = ms;
+  for (i=0, limit=1; i < STATS_BUCKETS - 1 && ms >= limit; i++)
+    limit *= 10;
+  stats.op[op].hist[i]++;
+}
+
+
+/* Account for a lookup in CACHE; HIT is true if the item was found.
+ * This function is assured not to do any context switches.  */
+void
+dirmngr_stats_cache (enum dirmngr_stats_caches cache, int hit)
+{
+  if (cache < 0 || cache >= DIRMNGR_CACHE_LAST)
+    return;
+
+  if (hit)
+    stats.cache[cache].hits++;
+  else
+    stats.cache[cache].misses++;
+}
+
+
+/* Send the metrics as data lines to CTX.  */
+static gpg_error_t
+send_metrics (assuan_context_t ctx)
+{
+  gpg_error_t err = 0;
+  char *buf;
+  int i;
+
+  for (i=0; i < DIRMNGR_STATS_LAST_OP + DIRMNGR_CACHE_LAST && !err; i++)
+    {
+      if (i < DIRMNGR_STATS_LAST_OP)
+        buf = xtryasprintf ("%s n=%lu errors=%lu total_ms=%lu max_ms=%lu"
+                            " hist=%lu,%lu,%lu,%lu,%lu,%lu",
+                            stats_op_names[i], stats.op[i].count,
+                            stats.op[i].errors, stats.op[i].total_ms,
+                            stats.op[i].max_ms,
+                            stats.op[i].hist[0], stats.op[i].hist[1],
+                            stats.op[i].hist[2], stats.op[i].hist[3],
+                            stats.op[i].hist[4], stats.op[i].hist[5]);
+      else
+        {
+          int n = i - DIRMNGR_STATS_LAST_OP;
+
+          buf = xtryasprintf ("cache %s hits=%lu misses=%lu",
+                              stats_cache_names[n],
+                              stats.cache[n].hits, stats.cache[n].misses);
+        }
+      if (!buf)
+        return gpg_error_from_syserror ();
+      err = assuan_send_data (ctx, buf, strlen (buf));
+      if (!err)
+        err = assuan_send_data (ctx, "\n", 1);
+      if (!err)
+        err = assuan_send_data (ctx, NULL, 0);
+      xfree (buf);
+    }
+  return err;
+}
+
+
 static const char hlp_getinfo[] =
   "GETINFO <what>\n"
   "\n"
@@ -2611,6 +3495,10 @@ static const char hlp_getinfo[] =
   "socket_name - Return the name of the socket.\n"
   "session_id  - Return the current session_id.\n"
   "workqueue   - Inspect the work queue\n"
+  "ks_cache    - Show statistics of the keyserver response cache\n"
+  "connection_pool - Return statistics of the connection threads\n"
+  "log_writer  - Return statistics of the log writer\n"
+  "metrics     - Return request counters, latencies and cache hits\n"
   "getenv NAME - Return value of envvar NAME\n";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
@@ -2679,6 +3567,39 @@ cmd_getinfo (assuan_context_t ctx, char *line)
       workqueue_dump_queue (ctrl);
       err = 0;
     }
+  else if (!strcmp (line, "ks_cache"))
+    {
+      ks_action_cache_print_stats (ctrl);
+      err = 0;
+    }
+  else if (!strcmp (line, "connection_pool"))
+    {
+      char *buf = dirmngr_get_connection_pool_stats ();
+
+      if (!buf)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
+  else if (!strcmp (line, "log_writer"))
+    {
+      char *buf = asynclog_stats ();
+
+      if (!buf)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
+  else if (!strcmp (line, "metrics"))
+    {
+      err = send_metrics (ctx);
+    }
   else if (!strncmp (line, "getenv", 6)
            && (line[6] == ' ' || line[6] == '\t' || !line[6]))
     {
@@ -2992,7 +3913,19 @@ dirmngr_status (ctrl_t ctrl, const char *keyword, ...)
 
   va_start (arg_ptr, keyword);
 
-  if (ctrl->server_local && (ctx = ctrl->server_local->assuan_ctx))
+  if (ctrl->status_capture)
+    {
+      const char *text;
+
+      es_fputs (keyword, ctrl->status_capture);
+      while ((text = va_arg (arg_ptr, const char *)))
+        {
+          es_putc (' ', ctrl->status_capture);
+          es_fputs (text, ctrl->status_capture);
+        }
+      es_putc ('\n', ctrl->status_capture);
+    }
+  else if (ctrl->server_local && (ctx = ctrl->server_local->assuan_ctx))
     {
       err = vprint_assuan_status_strings (ctx, keyword, arg_ptr);
     }
@@ -3062,6 +3995,17 @@ dirmngr_status_printf (ctrl_t ctrl, const char *keyword,
   va_list arg_ptr;
   assuan_context_t ctx;
 
+  if (ctrl && ctrl->status_capture)
+    {
+      es_fputs (keyword, ctrl->status_capture);
+      es_putc (' ', ctrl->status_capture);
+      va_start (arg_ptr, format);
+      es_vfprintf (ctrl->status_capture, format, arg_ptr);
+      va_end (arg_ptr);
+      es_putc ('\n', ctrl->status_capture);
+      return 0;
+    }
+
   if (!ctrl || !ctrl->server_local || !(ctx = ctrl->server_local->assuan_ctx))
     return 0;
 
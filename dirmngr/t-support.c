@@ -41,3 +41,31 @@ dirmngr_status_printf (ctrl_t ctrl, const char *keyword,
 
   return 0;
 }
+
+
+/* Stub for testing. See server.c for the real implementation.  */
+unsigned long
+dirmngr_stats_clock (void)
+{
+  return 0;
+}
+
+
+/* Stub for testing. See server.c for the real implementation.  */
+void
+dirmngr_stats_update (enum dirmngr_stats_ops op, unsigned long started,
+                      gpg_error_t err)
+{
+  (void)op;
+  (void)started;
+  (void)err;
+}
+
+
+/* Stub for testing. See server.c for the real implementation.  */
+void
+dirmngr_stats_cache (enum dirmngr_stats_caches cache, int hit)
+{
+  (void)cache;
+  (void)hit;
+}
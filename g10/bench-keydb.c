@@ -0,0 +1,347 @@
+/* bench-keydb.c - Benchmark for key lookups at scale.
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* This program creates synthetic keyrings and measures keydb_search
+ * on them.  The keys are not signed and are thus only useful for this
+ * benchmark.  Key number N is an Ed25519 key with a public point
+ * derived from N and the user id "Bench User N <benchN@example.org>";
+ * thus the queries can be regenerated without reading the keyring.
+ *
+ * To create a legacy keyring with 100000 keys and to run the
+ * searches:
+ *
+ *   ./bench-keydb --generate pubring.gpg 100000
+ *   ./bench-keydb --keyring ./pubring.gpg 100000
+ *
+ * A keybox can be created from the generated file using
+ * "kbxutil --import-openpgp pubring.gpg >pubring.kbx" or by
+ * inserting the keys with --load into a new pubring.kbx.  To measure
+ * the keyboxd, run with --keyboxd and GNUPGHOME set to a fresh
+ * directory; use --load once to store the keys.  Each result is
+ * printed as a colon delimited line
+ *
+ *   bench-keydb:OP:KEYS:COUNT:FOUND:MS:USEC
+ *
+ * with OP being one of load, fpr, keyid, mail or substr, COUNT the
+ * number of operations, FOUND the number of keys found, MS the total
+ * time and USEC the time of one operation.  */
+
+#include "test.c"
+
+#include <sys/time.h>
+
+#include "keydb.h"
+#include "options.h"
+#include "../common/openpgpdefs.h"
+
+/* The OID of Ed25519.  */
+#define BENCH_CURVE_OID "1.3.6.1.4.1.11591.15.1"
+
+/* The creation time of key number 0.  */
+#define BENCH_TIMESTAMP 1600000000
+
+
+/* Return the current time in milliseconds.  */
+static unsigned long
+get_msec (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+
+/* Return a pseudo random key number less than NKEYS.  The sequence
+ * is the same for each run.  */
+static unsigned int
+next_index (unsigned int nkeys)
+{
+  static unsigned long state = 42;
+
+  state = state * 6364136223846793005UL + 1442695040888963407UL;
+  return (unsigned int)(state >> 16) % nkeys;
+}
+
+
+/* Create the keyblock for key number IDX.  */
+static kbnode_t
+make_keyblock (unsigned int idx)
+{
+  char seed[40];
+  unsigned char q[33];
+  PACKET *pkt;
+  PKT_public_key *pk;
+  PKT_user_id *uid;
+  kbnode_t keyblock;
+  char *name;
+
+  snprintf (seed, sizeof seed, "bench-keydb:%u", idx);
+  q[0] = 0x40;  /* Native point format.  */
+  gcry_md_hash_buffer (GCRY_MD_SHA256, q + 1, seed, strlen (seed));
+
+  pk = xcalloc (1, sizeof *pk);
+  pk->version = 4;
+  pk->timestamp = BENCH_TIMESTAMP + idx;
+  pk->pubkey_algo = PUBKEY_ALGO_EDDSA;
+  if (openpgp_oid_from_str (BENCH_CURVE_OID, &pk->pkey[0]))
+    ABORT ("error converting the curve OID");
+  if (gcry_mpi_scan (&pk->pkey[1], GCRYMPI_FMT_USG, q, sizeof q, NULL))
+    ABORT ("error converting the public point");
+  pkt = xcalloc (1, sizeof *pkt);
+  pkt->pkttype = PKT_PUBLIC_KEY;
+  pkt->pkt.public_key = pk;
+  keyblock = new_kbnode (pkt);
+
+  name = xasprintf ("Bench User %u <bench%u@example.org>", idx, idx);
+  uid = xcalloc (1, sizeof *uid + strlen (name));
+  uid->ref = 1;
+  uid->len = strlen (name);
+  strcpy (uid->name, name);
+  xfree (name);
+  pkt = xcalloc (1, sizeof *pkt);
+  pkt->pkttype = PKT_USER_ID;
+  pkt->pkt.user_id = uid;
+  add_kbnode (keyblock, new_kbnode (pkt));
+
+  return keyblock;
+}
+
+
+/* Return the query string of type OP for key number IDX.  */
+static char *
+make_query (const char *op, unsigned int idx)
+{
+  kbnode_t keyblock;
+  PKT_public_key *pk;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+  u32 kid[2];
+  char *result;
+
+  if (!strcmp (op, "mail"))
+    return xasprintf ("<bench%u@example.org>", idx);
+  if (!strcmp (op, "substr"))
+    return xasprintf ("User %u <", idx);
+
+  keyblock = make_keyblock (idx);
+  pk = keyblock->pkt->pkt.public_key;
+  if (!strcmp (op, "fpr"))
+    {
+      char hexfpr[2*MAX_FINGERPRINT_LEN+1];
+
+      fingerprint_from_pk (pk, fpr, &fprlen);
+      bin2hex (fpr, fprlen, hexfpr);
+      result = xasprintf ("0x%s", hexfpr);
+    }
+  else
+    {
+      keyid_from_pk (pk, kid);
+      result = xasprintf ("0x%08lX%08lX", (ulong)kid[0], (ulong)kid[1]);
+    }
+  release_kbnode (keyblock);
+  return result;
+}
+
+
+static void
+report (const char *op, unsigned int nkeys, unsigned int count,
+        unsigned int found, unsigned long ms)
+{
+  printf ("bench-keydb:%s:%u:%u:%u:%lu:%lu\n", op, nkeys, count, found, ms,
+          count? (ms * 1000) / count : 0);
+  fflush (stdout);
+}
+
+
+/* Write NKEYS keys to the file FNAME.  */
+static void
+generate (const char *fname, unsigned int nkeys)
+{
+  iobuf_t out;
+  kbnode_t keyblock, node;
+  unsigned int idx;
+
+  out = iobuf_create (fname, 0);
+  if (!out)
+    ABORT ("error creating the output file");
+  for (idx = 0; idx < nkeys; idx++)
+    {
+      keyblock = make_keyblock (idx);
+      for (node = keyblock; node; node = node->next)
+        if (build_packet (out, node->pkt))
+          ABORT ("error writing a packet");
+      release_kbnode (keyblock);
+    }
+  if (iobuf_close (out))
+    ABORT ("error closing the output file");
+}
+
+
+/* Insert NKEYS keys using HD.  */
+static void
+load (KEYDB_HANDLE hd, unsigned int nkeys)
+{
+  kbnode_t keyblock;
+  unsigned int idx;
+  unsigned long start;
+
+  start = get_msec ();
+  for (idx = 0; idx < nkeys; idx++)
+    {
+      keyblock = make_keyblock (idx);
+      if (keydb_insert_keyblock (hd, keyblock))
+        ABORT ("error inserting a key");
+      release_kbnode (keyblock);
+    }
+  report ("load", nkeys, nkeys, nkeys, get_msec () - start);
+}
+
+
+/* Run NSEARCHES searches of type OP using HD.  */
+static void
+search (KEYDB_HANDLE hd, const char *op, unsigned int nkeys,
+        unsigned int nsearches)
+{
+  KEYDB_SEARCH_DESC *descs;
+  char **queries;
+  unsigned int n, found;
+  unsigned long start;
+  gpg_error_t err;
+
+  /* Prepare the queries first so that only the searches are timed.
+   * The descriptors point into the query strings.  */
+  descs = xcalloc (nsearches, sizeof *descs);
+  queries = xcalloc (nsearches, sizeof *queries);
+  for (n = 0; n < nsearches; n++)
+    {
+      queries[n] = make_query (op, next_index (nkeys));
+      if (classify_user_id (queries[n], descs + n, 1))
+        ABORT ("error classifying a query");
+    }
+
+  found = 0;
+  start = get_msec ();
+  for (n = 0; n < nsearches; n++)
+    {
+      keydb_search_reset (hd);
+      err = keydb_search (hd, descs + n, 1, NULL);
+      if (!err)
+        found++;
+      else if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+        ABORT ("error searching a key");
+    }
+  report (op, nkeys, nsearches, found, get_msec () - start);
+  for (n = 0; n < nsearches; n++)
+    xfree (queries[n]);
+  xfree (queries);
+  xfree (descs);
+}
+
+
+static void
+do_test (int argc, char *argv[])
+{
+  static const char *ops[] = { "fpr", "keyid", "mail", "substr" };
+  const char *genfile = NULL;
+  const char *keyring = NULL;
+  int use_keyboxd = 0;
+  int do_load = 0;
+  int no_cache = 0;
+  unsigned int nsearches = 1000;
+  unsigned int nkeys;
+  unsigned int flags;
+  ctrl_t ctrl;
+  KEYDB_HANDLE hd;
+  char *fname;
+  unsigned int i;
+
+  if (argc)
+    {
+      argc--; argv++;
+    }
+  while (argc && !strncmp (*argv, "--", 2))
+    {
+      if (!strcmp (*argv, "--generate") && argc > 1)
+        {
+          genfile = argv[1];
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--keyring") && argc > 1)
+        {
+          keyring = argv[1];
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--searches") && argc > 1)
+        {
+          nsearches = strtoul (argv[1], NULL, 10);
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--keyboxd"))
+        use_keyboxd = 1;
+      else if (!strcmp (*argv, "--load"))
+        do_load = 1;
+      else if (!strcmp (*argv, "--no-cache"))
+        no_cache = 1;
+      else
+        break;
+      argc--; argv++;
+    }
+  if (argc != 1 || !(nkeys = strtoul (*argv, NULL, 10))
+      || (!genfile && !keyring && !use_keyboxd))
+    {
+      fputs ("usage: bench-keydb --generate FILE NKEYS\n"
+             "       bench-keydb {--keyring FILE|--keyboxd} [--load]"
+             " [--no-cache]\n"
+             "                   [--searches N] NKEYS\n", stderr);
+      exit (2);
+    }
+
+  if (genfile)
+    {
+      generate (genfile, nkeys);
+      return;
+    }
+
+  ctrl = xcalloc (1, sizeof *ctrl);
+  if (use_keyboxd)
+    opt.use_keyboxd = 1;
+  else
+    {
+      fname = make_absfilename (keyring, NULL);
+      flags = do_load? 0 : KEYDB_RESOURCE_FLAG_READONLY;
+      if (keydb_add_resource (fname, flags))
+        ABORT ("error registering the keyring");
+      xfree (fname);
+    }
+
+  hd = keydb_new (ctrl);
+  if (!hd)
+    ABORT ("error creating a keydb handle");
+  if (no_cache)
+    keydb_disable_caching (hd);
+
+  if (do_load)
+    load (hd, nkeys);
+  for (i = 0; i < DIM (ops); i++)
+    search (hd, ops[i], nkeys, nsearches);
+
+  keydb_release (hd);
+  xfree (ctrl);
+}
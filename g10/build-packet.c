@@ -32,6 +32,7 @@
 #include "../common/i18n.h"
 #include "options.h"
 #include "../common/host2net.h"
+#include "timing.h"
 
 static gpg_error_t do_ring_trust (iobuf_t out, PKT_ring_trust *rt);
 static int do_user_id( IOBUF out, int ctb, PKT_user_id *uid );
@@ -881,7 +882,11 @@ do_plaintext( IOBUF out, int ctb, PKT_plaintext *pt )
 
     if (pt->buf)
       {
+        timing_span_t span;
+
+        timing_begin (&span, "copy_plaintext");
         nbytes = iobuf_copy (out, pt->buf);
+        timing_end (&span);
         if(ctb_new_format_p (ctb) && !pt->len)
           /* Turn off partial body length mode.  */
           iobuf_set_partial_body_length_mode (out, 0);
@@ -1015,6 +1020,7 @@ delete_sig_subpkt (subpktarea_t *area, sigsubpkttype_t reqtype )
 
     if( !area )
 	return 0;
+    area->indexed = 0;
     buflen = area->len;
     buffer = area->data;
     for(;;) {
@@ -1205,6 +1211,7 @@ build_sig_subpkt (PKT_signature *sig, sigsubpkttype_t type,
         /*log_debug ("allocating area for type %d\n", type );*/
     }
     newarea->len = n;
+    newarea->indexed = 0;
 
     p = newarea->data + n0;
     if (nlen == 5) {
@@ -43,6 +43,7 @@
 #include "../common/shareddefs.h"
 #include "../common/host2net.h"
 #include "../common/ttyio.h"
+#include <npth.h>
 
 #define CONTROL_D ('D' - 'A' + 1)
 
@@ -50,6 +51,16 @@
 static assuan_context_t agent_ctx = NULL;
 static int did_early_card_test;
 
+/* The sorted keygrips of all secret keys as fetched by
+   agent_begin_keygrip_cache.  While ACTIVE is set the probe functions
+   use this table instead of asking the agent for each key.  */
+static struct
+{
+  int active;
+  unsigned char *grips;  /* COUNT keygrips of 20 bytes each.  */
+  size_t count;
+} keygrip_cache;
+
 struct confirm_parm_s
 {
   char *desc;
@@ -260,104 +271,115 @@ warn_version_mismatch (assuan_context_t ctx, const char *servername, int mode)
 
 #define FLAG_FOR_CARD_SUPPRESS_ERRORS 2
 
-/* Try to connect to the agent via socket or fork it off and work by
-   pipes.  Handle the server's initial greeting */
+/* Connect to the agent via socket or fork it off and work by pipes.
+   Handle the server's initial greeting and send our options.  The
+   new context is stored at R_CTX even on error.  */
 static int
-start_agent (ctrl_t ctrl, int flag_for_card)
+connect_agent (assuan_context_t *r_ctx)
 {
   int rc;
 
-  (void)ctrl;  /* Not yet used.  */
-
-  /* Fixme: We need a context for each thread or serialize the access
-     to the agent. */
-  if (agent_ctx)
-    rc = 0;
-  else
+  rc = start_new_gpg_agent (r_ctx,
+                            GPG_ERR_SOURCE_DEFAULT,
+                            opt.agent_program,
+                            opt.lc_ctype, opt.lc_messages,
+                            opt.session_env,
+                            opt.autostart, opt.verbose, DBG_IPC,
+                            NULL, NULL);
+  if (!opt.autostart && gpg_err_code (rc) == GPG_ERR_NO_AGENT)
     {
-      rc = start_new_gpg_agent (&agent_ctx,
-                                GPG_ERR_SOURCE_DEFAULT,
-                                opt.agent_program,
-                                opt.lc_ctype, opt.lc_messages,
-                                opt.session_env,
-                                opt.autostart, opt.verbose, DBG_IPC,
-                                NULL, NULL);
-      if (!opt.autostart && gpg_err_code (rc) == GPG_ERR_NO_AGENT)
-        {
-          static int shown;
+      static int shown;
 
-          if (!shown)
-            {
-              shown = 1;
-              log_info (_("no gpg-agent running in this session\n"));
-            }
+      if (!shown)
+        {
+          shown = 1;
+          log_info (_("no gpg-agent running in this session\n"));
         }
-      else if (!rc
-               && !(rc = warn_version_mismatch (agent_ctx, GPG_AGENT_NAME, 0)))
+    }
+  else if (!rc
+           && !(rc = warn_version_mismatch (*r_ctx, GPG_AGENT_NAME, 0)))
+    {
+      /* Tell the agent that we support Pinentry notifications.
+         No error checking so that it will work also with older
+         agents.  */
+      assuan_transact (*r_ctx, "OPTION allow-pinentry-notify",
+                       NULL, NULL, NULL, NULL, NULL, NULL);
+      /* Tell the agent about what version we are aware.  This is
+         here used to indirectly enable GPG_ERR_FULLY_CANCELED.  */
+      assuan_transact (*r_ctx, "OPTION agent-awareness=2.1.0",
+                       NULL, NULL, NULL, NULL, NULL, NULL);
+      /* Pass on the pinentry mode.  */
+      if (opt.pinentry_mode)
         {
-          /* Tell the agent that we support Pinentry notifications.
-             No error checking so that it will work also with older
-             agents.  */
-          assuan_transact (agent_ctx, "OPTION allow-pinentry-notify",
+          char *tmp = xasprintf ("OPTION pinentry-mode=%s",
+                                 str_pinentry_mode (opt.pinentry_mode));
+          rc = assuan_transact (*r_ctx, tmp,
                            NULL, NULL, NULL, NULL, NULL, NULL);
-          /* Tell the agent about what version we are aware.  This is
-             here used to indirectly enable GPG_ERR_FULLY_CANCELED.  */
-          assuan_transact (agent_ctx, "OPTION agent-awareness=2.1.0",
-                           NULL, NULL, NULL, NULL, NULL, NULL);
-          /* Pass on the pinentry mode.  */
-          if (opt.pinentry_mode)
+          xfree (tmp);
+          if (rc)
             {
-              char *tmp = xasprintf ("OPTION pinentry-mode=%s",
-                                     str_pinentry_mode (opt.pinentry_mode));
-              rc = assuan_transact (agent_ctx, tmp,
-                               NULL, NULL, NULL, NULL, NULL, NULL);
-              xfree (tmp);
-              if (rc)
-                {
-                  log_error ("setting pinentry mode '%s' failed: %s\n",
-                             str_pinentry_mode (opt.pinentry_mode),
-                             gpg_strerror (rc));
-                  write_status_error ("set_pinentry_mode", rc);
-                }
+              log_error ("setting pinentry mode '%s' failed: %s\n",
+                         str_pinentry_mode (opt.pinentry_mode),
+                         gpg_strerror (rc));
+              write_status_error ("set_pinentry_mode", rc);
             }
+        }
 
-          /* Pass on the request origin.  */
-          if (opt.request_origin)
+      /* Pass on the request origin.  */
+      if (opt.request_origin)
+        {
+          char *tmp = xasprintf ("OPTION pretend-request-origin=%s",
+                                 str_request_origin (opt.request_origin));
+          rc = assuan_transact (*r_ctx, tmp,
+                           NULL, NULL, NULL, NULL, NULL, NULL);
+          xfree (tmp);
+          if (rc)
             {
-              char *tmp = xasprintf ("OPTION pretend-request-origin=%s",
-                                     str_request_origin (opt.request_origin));
-              rc = assuan_transact (agent_ctx, tmp,
-                               NULL, NULL, NULL, NULL, NULL, NULL);
-              xfree (tmp);
-              if (rc)
-                {
-                  log_error ("setting request origin '%s' failed: %s\n",
-                             str_request_origin (opt.request_origin),
-                             gpg_strerror (rc));
-                  write_status_error ("set_request_origin", rc);
-                }
+              log_error ("setting request origin '%s' failed: %s\n",
+                         str_request_origin (opt.request_origin),
+                         gpg_strerror (rc));
+              write_status_error ("set_request_origin", rc);
             }
+        }
 
-          /* In DE_VS mode under Windows we require that the JENT RNG
-           * is active.  */
+      /* In DE_VS mode under Windows we require that the JENT RNG
+       * is active.  */
 #ifdef HAVE_W32_SYSTEM
-          if (!rc && opt.compliance == CO_DE_VS)
+      if (!rc && opt.compliance == CO_DE_VS)
+        {
+          if (assuan_transact (*r_ctx, "GETINFO jent_active",
+                               NULL, NULL, NULL, NULL, NULL, NULL))
             {
-              if (assuan_transact (agent_ctx, "GETINFO jent_active",
-                                   NULL, NULL, NULL, NULL, NULL, NULL))
-                {
-                  rc = gpg_error (GPG_ERR_FORBIDDEN);
-                  log_error (_("%s is not compliant with %s mode\n"),
-                             GPG_AGENT_NAME,
-                             gnupg_compliance_option_string (opt.compliance));
-                  write_status_error ("random-compliance", rc);
-                }
+              rc = gpg_error (GPG_ERR_FORBIDDEN);
+              log_error (_("%s is not compliant with %s mode\n"),
+                         GPG_AGENT_NAME,
+                         gnupg_compliance_option_string (opt.compliance));
+              write_status_error ("random-compliance", rc);
             }
-#endif /*HAVE_W32_SYSTEM*/
-
         }
+#endif /*HAVE_W32_SYSTEM*/
     }
 
+  return rc;
+}
+
+
+/* Try to connect to the agent via socket or fork it off and work by
+   pipes.  Handle the server's initial greeting */
+static int
+start_agent (ctrl_t ctrl, int flag_for_card)
+{
+  int rc;
+
+  (void)ctrl;  /* Not yet used.  */
+
+  /* Fixme: We need a context for each thread or serialize the access
+     to the agent. */
+  if (agent_ctx)
+    rc = 0;
+  else
+    rc = connect_agent (&agent_ctx);
+
   if (!rc && flag_for_card && !did_early_card_test)
     {
       /* Request the serial number of the card for an early test.  */
@@ -2103,6 +2125,85 @@ keyinfo_status_cb (void *opaque, const char *line)
 }
 
 
+/* Helper for qsort and bsearch of keygrip_cache.  */
+static int
+cmp_keygrips (const void *a, const void *b)
+{
+  return memcmp (a, b, KEYGRIP_LEN);
+}
+
+
+/* Ask the agent for the keygrips of all its secret keys and use
+   them in the probe functions until agent_end_keygrip_cache is
+   called.  This avoids a round trip for each key while listing a
+   large keyring.  On error, for example with an older agent which
+   does not support "HAVEKEY --list", the agent is asked for each key
+   as before.  */
+void
+agent_begin_keygrip_cache (ctrl_t ctrl)
+{
+  gpg_error_t err;
+  membuf_t data;
+  unsigned char *buf;
+  size_t len;
+
+  agent_end_keygrip_cache ();
+
+  err = start_agent (ctrl, 0);
+  if (err)
+    return;
+
+  init_membuf (&data, 1024);
+  err = assuan_transact (agent_ctx, "HAVEKEY --list",
+                         put_membuf_cb, &data,
+                         NULL, NULL, NULL, NULL);
+  if (err)
+    {
+      xfree (get_membuf (&data, &len));
+      if (DBG_IPC)
+        log_debug ("no keygrip cache: %s\n", gpg_strerror (err));
+      return;
+    }
+  buf = get_membuf (&data, &len);
+  if (!buf)
+    return;  /* Out of core.  */
+  if ((len % KEYGRIP_LEN))
+    {
+      log_error ("invalid keygrip list returned by the agent\n");
+      xfree (buf);
+      return;
+    }
+
+  keygrip_cache.grips = buf;
+  keygrip_cache.count = len / KEYGRIP_LEN;
+  if (keygrip_cache.count > 1)
+    qsort (keygrip_cache.grips, keygrip_cache.count, KEYGRIP_LEN,
+           cmp_keygrips);
+  keygrip_cache.active = 1;
+}
+
+
+/* Stop using the keygrips fetched by agent_begin_keygrip_cache.  */
+void
+agent_end_keygrip_cache (void)
+{
+  xfree (keygrip_cache.grips);
+  keygrip_cache.grips = NULL;
+  keygrip_cache.count = 0;
+  keygrip_cache.active = 0;
+}
+
+
+/* Return true if GRIP is in the active keygrip cache.  */
+static int
+keygrip_cache_has (const unsigned char *grip)
+{
+  return (keygrip_cache.count
+          && bsearch (grip, keygrip_cache.grips, keygrip_cache.count,
+                      KEYGRIP_LEN, cmp_keygrips));
+}
+
+
 /* Ask the agent whether a secret key for the given public key is
    available.  Returns 0 if not available.  Bigger value is preferred.  */
 int
@@ -2116,6 +2217,14 @@ agent_probe_secret_key (ctrl_t ctrl, PKT_public_key *pk)
 
   memset (&keyinfo, 0, sizeof keyinfo);
 
+  if (keygrip_cache.active)
+    {
+      unsigned char grip[KEYGRIP_LEN];
+
+      if (keygrip_from_pk (pk, grip) || !keygrip_cache_has (grip))
+        return 0;
+    }
+
   err = start_agent (ctrl, 0);
   if (err)
     return err;
@@ -2157,6 +2266,23 @@ agent_probe_any_secret_key (ctrl_t ctrl, kbnode_t keyblock)
   int nkeys;
   unsigned char grip[KEYGRIP_LEN];
 
+  if (keygrip_cache.active)
+    {
+      for (kbctx=NULL; (node = walk_kbnode (keyblock, &kbctx, 0)); )
+        if (node->pkt->pkttype == PKT_PUBLIC_KEY
+            || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+            || node->pkt->pkttype == PKT_SECRET_KEY
+            || node->pkt->pkttype == PKT_SECRET_SUBKEY)
+          {
+            err = keygrip_from_pk (node->pkt->pkt.public_key, grip);
+            if (err)
+              return err;
+            if (keygrip_cache_has (grip))
+              return 0;
+          }
+      return gpg_error (GPG_ERR_NO_SECKEY);
+    }
+
   err = start_agent (ctrl, 0);
   if (err)
     return err;
@@ -2217,13 +2343,23 @@ agent_get_keyinfo (ctrl_t ctrl, const char *hexkeygrip,
 
   *r_serialno = NULL;
 
+  if (!hexkeygrip || strlen (hexkeygrip) != 40)
+    return gpg_error (GPG_ERR_INV_VALUE);
+
+  if (keygrip_cache.active)
+    {
+      unsigned char grip[KEYGRIP_LEN];
+
+      if (hex2bin (hexkeygrip, grip, KEYGRIP_LEN) < 0)
+        return gpg_error (GPG_ERR_INV_VALUE);
+      if (!keygrip_cache_has (grip))
+        return gpg_error (GPG_ERR_NOT_FOUND);
+    }
+
   err = start_agent (ctrl, 0);
   if (err)
     return err;
 
-  if (!hexkeygrip || strlen (hexkeygrip) != 40)
-    return gpg_error (GPG_ERR_INV_VALUE);
-
   snprintf (line, DIM(line), "KEYINFO %s", hexkeygrip);
 
   err = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL,
@@ -2306,16 +2442,12 @@ inq_genkey_parms (void *opaque, const char *line)
 }
 
 
-/* Call the agent to generate a new key.  KEYPARMS is the usual
-   S-expression giving the parameters of the key.  gpg-agent passes it
-   gcry_pk_genkey.  If NO_PROTECTION is true the agent is advised not
-   to protect the generated key.  If NO_PROTECTION is not set and
-   PASSPHRASE is not NULL the agent is requested to protect the key
-   with that passphrase instead of asking for one.  */
-gpg_error_t
-agent_genkey (ctrl_t ctrl, char **cache_nonce_addr, char **passwd_nonce_addr,
-              const char *keyparms, int no_protection,
-              const char *passphrase, gcry_sexp_t *r_pubkey)
+/* The core of agent_genkey using the connection CTX.  */
+static gpg_error_t
+do_genkey (ctrl_t ctrl, assuan_context_t ctx,
+           char **cache_nonce_addr, char **passwd_nonce_addr,
+           const char *keyparms, int no_protection,
+           const char *passphrase, gcry_sexp_t *r_pubkey)
 {
   gpg_error_t err;
   struct genkey_parm_s gk_parm;
@@ -2328,18 +2460,13 @@ agent_genkey (ctrl_t ctrl, char **cache_nonce_addr, char **passwd_nonce_addr,
 
   memset (&dfltparm, 0, sizeof dfltparm);
   dfltparm.ctrl = ctrl;
-
-  *r_pubkey = NULL;
-  err = start_agent (ctrl, 0);
-  if (err)
-    return err;
-  dfltparm.ctx = agent_ctx;
+  dfltparm.ctx = ctx;
 
   if (passwd_nonce_addr && *passwd_nonce_addr)
     ; /* A RESET would flush the passwd nonce cache.  */
   else
     {
-      err = assuan_transact (agent_ctx, "RESET",
+      err = assuan_transact (ctx, "RESET",
                              NULL, NULL, NULL, NULL, NULL, NULL);
       if (err)
         return err;
@@ -2359,7 +2486,7 @@ agent_genkey (ctrl_t ctrl, char **cache_nonce_addr, char **passwd_nonce_addr,
             cache_nonce_addr && *cache_nonce_addr? *cache_nonce_addr:"");
   cn_parm.cache_nonce_addr = cache_nonce_addr;
   cn_parm.passwd_nonce_addr = NULL;
-  err = assuan_transact (agent_ctx, line,
+  err = assuan_transact (ctx, line,
                          put_membuf_cb, &data,
                          inq_genkey_parms, &gk_parm,
                          cache_nonce_status_cb, &cn_parm);
@@ -2381,6 +2508,154 @@ agent_genkey (ctrl_t ctrl, char **cache_nonce_addr, char **passwd_nonce_addr,
 }
 
 
+/* Call the agent to generate a new key.  KEYPARMS is the usual
+   S-expression giving the parameters of the key.  gpg-agent passes it
+   gcry_pk_genkey.  If NO_PROTECTION is true the agent is advised not
+   to protect the generated key.  If NO_PROTECTION is not set and
+   PASSPHRASE is not NULL the agent is requested to protect the key
+   with that passphrase instead of asking for one.  */
+gpg_error_t
+agent_genkey (ctrl_t ctrl, char **cache_nonce_addr, char **passwd_nonce_addr,
+              const char *keyparms, int no_protection,
+              const char *passphrase, gcry_sexp_t *r_pubkey)
+{
+  gpg_error_t err;
+
+  *r_pubkey = NULL;
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+
+  return do_genkey (ctrl, agent_ctx, cache_nonce_addr, passwd_nonce_addr,
+                    keyparms, no_protection, passphrase, r_pubkey);
+}
+
+
+/* An object to run agent_genkey in the background.  */
+struct agent_genkey_job_s
+{
+  npth_t thread;
+  assuan_context_t ctx;  /* The connection used by this job.  */
+  char *keyparms;
+  char *passphrase;
+  int no_protection;
+  gpg_error_t err;       /* The result of the key generation.  */
+  gcry_sexp_t pubkey;    /* The generated public key.  */
+};
+
+
+static void
+release_genkey_job (agent_genkey_job_t job)
+{
+  if (!job)
+    return;
+  assuan_release (job->ctx);
+  xfree (job->keyparms);
+  if (job->passphrase)
+    {
+      wipememory (job->passphrase, strlen (job->passphrase));
+      xfree (job->passphrase);
+    }
+  gcry_sexp_release (job->pubkey);
+  xfree (job);
+}
+
+
+/* The thread started by agent_genkey_start.  */
+static void *
+genkey_job_thread (void *arg)
+{
+  agent_genkey_job_t job = arg;
+
+  job->err = do_genkey (NULL, job->ctx, NULL, NULL,
+                        job->keyparms, job->no_protection, job->passphrase,
+                        &job->pubkey);
+  return NULL;
+}
+
+
+/* Start the generation of a key in the background.  The arguments
+ * are the same as for agent_genkey; no cache nonce is used, thus the
+ * key may only be protected if PASSPHRASE is given.  A separate
+ * connection to the agent is used so that other requests, including
+ * another key generation, can be sent meanwhile.  On success a job
+ * object is stored at R_JOB which must be passed to
+ * agent_genkey_finish.  */
+gpg_error_t
+agent_genkey_start (const char *keyparms, int no_protection,
+                    const char *passphrase, agent_genkey_job_t *r_job)
+{
+  gpg_error_t err;
+  agent_genkey_job_t job;
+  npth_attr_t tattr;
+  int rc;
+
+  *r_job = NULL;
+  job = xtrycalloc (1, sizeof *job);
+  if (!job)
+    return gpg_error_from_syserror ();
+  job->no_protection = no_protection;
+  job->keyparms = xtrystrdup (keyparms);
+  if (!job->keyparms
+      || (passphrase && !(job->passphrase = xtrystrdup (passphrase))))
+    {
+      err = gpg_error_from_syserror ();
+      release_genkey_job (job);
+      return err;
+    }
+
+  err = connect_agent (&job->ctx);
+  if (err)
+    {
+      release_genkey_job (job);
+      return err;
+    }
+
+  rc = npth_attr_init (&tattr);
+  if (!rc)
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+      rc = npth_create (&job->thread, &tattr, genkey_job_thread, job);
+      npth_attr_destroy (&tattr);
+    }
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      log_error ("error spawning worker thread: %s\n", strerror (rc));
+      release_genkey_job (job);
+      return err;
+    }
+
+  *r_job = job;
+  return 0;
+}
+
+
+/* Wait for the key generation JOB started by agent_genkey_start and
+ * release JOB.  On success the public key is stored at R_PUBKEY.  If
+ * R_PUBKEY is NULL the result is discarded.  */
+gpg_error_t
+agent_genkey_finish (agent_genkey_job_t job, gcry_sexp_t *r_pubkey)
+{
+  gpg_error_t err;
+
+  if (r_pubkey)
+    *r_pubkey = NULL;
+  if (!job)
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  npth_join (job->thread, NULL);
+  err = job->err;
+  if (!err && r_pubkey)
+    {
+      *r_pubkey = job->pubkey;
+      job->pubkey = NULL;
+    }
+  release_genkey_job (job);
+  return err;
+}
+
+
 
 /* Call the agent to read the public key part for a given keygrip.
  * Values from FROMCARD:
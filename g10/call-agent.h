@@ -19,6 +19,9 @@
 #ifndef GNUPG_G10_CALL_AGENT_H
 #define GNUPG_G10_CALL_AGENT_H
 
+/* An object for a key generation running in the background.  */
+typedef struct agent_genkey_job_s *agent_genkey_job_t;
+
 struct key_attr {
   int algo;              /* Algorithm identifier.  */
   union {
@@ -183,6 +186,11 @@ gpg_error_t agent_probe_any_secret_key (ctrl_t ctrl, kbnode_t keyblock);
 gpg_error_t agent_get_keyinfo (ctrl_t ctrl, const char *hexkeygrip,
                                char **r_serialno, int *r_cleartext);
 
+/* Fetch the keygrips of all secret keys for use by the above three
+   functions and release them again.  */
+void agent_begin_keygrip_cache (ctrl_t ctrl);
+void agent_end_keygrip_cache (void);
+
 /* Generate a new key.  */
 gpg_error_t agent_genkey (ctrl_t ctrl,
                           char **cache_nonce_addr, char **passwd_nonce_addr,
@@ -190,6 +198,13 @@ gpg_error_t agent_genkey (ctrl_t ctrl,
                           const char *passphrase,
                           gcry_sexp_t *r_pubkey);
 
+/* Generate a new key in the background.  */
+gpg_error_t agent_genkey_start (const char *keyparms, int no_protection,
+                                const char *passphrase,
+                                agent_genkey_job_t *r_job);
+gpg_error_t agent_genkey_finish (agent_genkey_job_t job,
+                                 gcry_sexp_t *r_pubkey);
+
 /* Read a public key.  FROMCARD may be 0, 1, or 2. */
 gpg_error_t agent_readkey (ctrl_t ctrl, int fromcard, const char *hexkeygrip,
                            unsigned char **r_pubkey);
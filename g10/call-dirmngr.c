@@ -28,6 +28,7 @@
 #ifdef HAVE_LOCALE_H
 # include <locale.h>
 #endif
+#include <npth.h>
 
 #include "gpg.h"
 #include <assuan.h>
@@ -38,6 +39,7 @@
 #include "../common/asshelp.h"
 #include "../common/keyserver.h"
 #include "../common/status.h"
+#include "../common/exechelp.h"
 #include "call-dirmngr.h"
 
 
@@ -76,6 +78,20 @@ struct ks_get_parm_s
 };
 
 
+/* Object used by gpg_dirmngr_ks_get_start to run the KS_GET command
+   in a thread which writes the data into a pipe.  */
+struct ks_get_job_s
+{
+  npth_t thread;
+  ctrl_t ctrl;
+  assuan_context_t ctx;
+  char *line;                      /* The KS_GET command.  */
+  estream_t outfp;                 /* Write end of the pipe.  */
+  struct ks_status_parm_s stparm;
+  gpg_error_t err;                 /* The result of the command.  */
+};
+
+
 /* Parameter structure used with the KS_PUT command.  */
 struct ks_put_parm_s
 {
@@ -659,45 +675,24 @@ ks_get_data_cb (void *opaque, const void *data, size_t datalen)
 }
 
 
-/* Run the KS_GET command using the patterns in the array PATTERN.  On
-   success an estream object is returned to retrieve the keys.  On
-   error an error code is returned and NULL stored at R_FP.
-
-   The pattern may only use search specification which a keyserver can
-   use to retrieve keys.  Because we know the format of the pattern we
-   don't need to escape the patterns before sending them to the
-   server.
-
-   If QUICK is set the dirmngr is advised to use a shorter timeout.
-
-   If R_SOURCE is not NULL the source of the data is stored as a
-   malloced string there.  If a source is not known NULL is stored.
-   Note that this may even be returned after an error.
-
-   If there are too many patterns the function returns an error.  That
-   could be fixed by issuing several search commands or by
-   implementing a different interface.  However with long keyids we
-   are able to ask for (1000-10-1)/(2+8+1) = 90 keys at once.  */
-gpg_error_t
-gpg_dirmngr_ks_get (ctrl_t ctrl, char **pattern,
-                    keyserver_spec_t override_keyserver, int quick,
-                    estream_t *r_fp, char **r_source)
+/* Helper for gpg_dirmngr_ks_get and gpg_dirmngr_ks_get_start.
+   Open a context, send an override keyserver and build the KS_GET
+   command line.  On success the context is stored at R_CTX and the
+   malloced line at R_LINE.  */
+static gpg_error_t
+ks_get_prepare (ctrl_t ctrl, char **pattern,
+                keyserver_spec_t override_keyserver, int quick,
+                assuan_context_t *r_ctx, char **r_line)
 {
   gpg_error_t err;
   assuan_context_t ctx;
-  struct ks_status_parm_s stparm;
-  struct ks_get_parm_s parm;
   char *line = NULL;
   size_t linelen;
   membuf_t mb;
   int idx;
 
-  memset (&stparm, 0, sizeof stparm);
-  memset (&parm, 0, sizeof parm);
-
-  *r_fp = NULL;
-  if (r_source)
-    *r_source = NULL;
+  *r_ctx = NULL;
+  *r_line = NULL;
 
   err = open_context (ctrl, &ctx);
   if (err)
@@ -745,6 +740,60 @@ gpg_dirmngr_ks_get (ctrl_t ctrl, char **pattern,
       goto leave;
     }
 
+  *r_ctx = ctx;
+  ctx = NULL;
+  *r_line = line;
+  line = NULL;
+
+ leave:
+  xfree (line);
+  close_context (ctrl, ctx);
+  return err;
+}
+
+
+/* Run the KS_GET command using the patterns in the array PATTERN.  On
+   success an estream object is returned to retrieve the keys.  On
+   error an error code is returned and NULL stored at R_FP.
+
+   The pattern may only use search specification which a keyserver can
+   use to retrieve keys.  Because we know the format of the pattern we
+   don't need to escape the patterns before sending them to the
+   server.
+
+   If QUICK is set the dirmngr is advised to use a shorter timeout.
+
+   If R_SOURCE is not NULL the source of the data is stored as a
+   malloced string there.  If a source is not known NULL is stored.
+   Note that this may even be returned after an error.
+
+   If there are too many patterns the function returns an error.  That
+   could be fixed by issuing several search commands or by
+   implementing a different interface.  However with long keyids we
+   are able to ask for (1000-10-1)/(2+8+1) = 90 keys at once.  */
+gpg_error_t
+gpg_dirmngr_ks_get (ctrl_t ctrl, char **pattern,
+                    keyserver_spec_t override_keyserver, int quick,
+                    estream_t *r_fp, char **r_source)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+  struct ks_status_parm_s stparm;
+  struct ks_get_parm_s parm;
+  char *line = NULL;
+
+  memset (&stparm, 0, sizeof stparm);
+  memset (&parm, 0, sizeof parm);
+
+  *r_fp = NULL;
+  if (r_source)
+    *r_source = NULL;
+
+  err = ks_get_prepare (ctrl, pattern, override_keyserver, quick,
+                        &ctx, &line);
+  if (err)
+    return err;
+
   parm.memfp = es_fopenmem (0, "rwb");
   if (!parm.memfp)
     {
@@ -775,6 +824,159 @@ gpg_dirmngr_ks_get (ctrl_t ctrl, char **pattern,
 }
 
 
+/* The thread running the KS_GET command of a job.  Closing the write
+   end of the pipe signals EOF to the reader.  */
+static void *
+ks_get_job_thread (void *arg)
+{
+  ks_get_job_t job = arg;
+  struct ks_get_parm_s parm;
+
+  memset (&parm, 0, sizeof parm);
+  parm.memfp = job->outfp;
+  job->err = assuan_transact (job->ctx, job->line, ks_get_data_cb, &parm,
+                              NULL, NULL, ks_status_cb, &job->stparm);
+  es_fclose (job->outfp);
+  job->outfp = NULL;
+  return NULL;
+}
+
+
+/* Release a job after its thread has terminated.  */
+static void
+release_ks_get_job (ks_get_job_t job)
+{
+  if (!job)
+    return;
+  es_fclose (job->outfp);
+  xfree (job->stparm.source);
+  xfree (job->line);
+  close_context (job->ctrl, job->ctx);
+  xfree (job);
+}
+
+
+/* Same as gpg_dirmngr_ks_get but the keys are not buffered.  Instead
+   the command is run by a thread and the stream returned at R_FP
+   delivers the data while it arrives from the dirmngr.  The function
+   returns when the first data has been received or the command has
+   finished without returning data.  On success the job is stored at
+   R_JOB and the caller must use gpg_dirmngr_ks_get_finish to close
+   R_FP and to get the final result of the command.  The source is
+   stored at R_SOURCE as with gpg_dirmngr_ks_get; it is returned
+   before the data by the dirmngr.  */
+gpg_error_t
+gpg_dirmngr_ks_get_start (ctrl_t ctrl, char **pattern,
+                          keyserver_spec_t override_keyserver, int quick,
+                          estream_t *r_fp, char **r_source,
+                          ks_get_job_t *r_job)
+{
+  gpg_error_t err;
+  ks_get_job_t job;
+  npth_attr_t tattr;
+  estream_t infp = NULL;
+  int filedes[2];
+  int ret, c;
+
+  *r_fp = NULL;
+  *r_job = NULL;
+  if (r_source)
+    *r_source = NULL;
+
+  job = xtrycalloc (1, sizeof *job);
+  if (!job)
+    return gpg_error_from_syserror ();
+  job->ctrl = ctrl;
+
+  err = ks_get_prepare (ctrl, pattern, override_keyserver, quick,
+                        &job->ctx, &job->line);
+  if (err)
+    goto leave;
+
+  err = gnupg_create_pipe (filedes);
+  if (err)
+    goto leave;
+  infp = es_fdopen (filedes[0], "rb");
+  if (!infp)
+    {
+      err = gpg_error_from_syserror ();
+      close (filedes[0]);
+      close (filedes[1]);
+      goto leave;
+    }
+  job->outfp = es_fdopen (filedes[1], "wb");
+  if (!job->outfp)
+    {
+      err = gpg_error_from_syserror ();
+      close (filedes[1]);
+      goto leave;
+    }
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  ret = npth_create (&job->thread, &tattr, ks_get_job_thread, job);
+  npth_attr_destroy (&tattr);
+  if (ret)
+    {
+      err = gpg_error_from_errno (ret);
+      log_error ("error spawning keyserver thread: %s\n", strerror (ret));
+      goto leave;
+    }
+
+  /* Wait for the first byte so that errors like no data are returned
+     right here like gpg_dirmngr_ks_get does.  */
+  c = es_getc (infp);
+  if (c == EOF)
+    {
+      npth_join (job->thread, NULL);
+      if (r_source && job->stparm.source)
+        {
+          *r_source = job->stparm.source;
+          job->stparm.source = NULL;
+        }
+      err = job->err? job->err : gpg_error (GPG_ERR_NO_DATA);
+      goto leave;
+    }
+  es_ungetc (c, infp);
+
+  if (r_source && job->stparm.source)
+    *r_source = xtrystrdup (job->stparm.source);
+  *r_fp = infp;
+  infp = NULL;
+  *r_job = job;
+  job = NULL;
+
+ leave:
+  es_fclose (infp);
+  release_ks_get_job (job);
+  return err;
+}
+
+
+/* Finish the job JOB started by gpg_dirmngr_ks_get_start.  FP is the
+   stream returned by that function; any data not yet read is
+   skipped.  Returns the result of the KS_GET command.  */
+gpg_error_t
+gpg_dirmngr_ks_get_finish (ks_get_job_t job, estream_t fp)
+{
+  gpg_error_t err;
+  char buffer[4096];
+  size_t nread;
+
+  if (!job)
+    return 0;
+
+  /* Drain the pipe so that the thread does not block.  */
+  while (!es_read (fp, buffer, sizeof buffer, &nread) && nread)
+    ;
+  es_fclose (fp);
+  npth_join (job->thread, NULL);
+  err = job->err;
+  release_ks_get_job (job);
+  return err;
+}
+
+
 /* Run the KS_FETCH and pass URL as argument.  On success an estream
    object is returned to retrieve the keys.  On error an error code is
    returned and NULL stored at R_FP.
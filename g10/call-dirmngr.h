@@ -19,6 +19,8 @@
 #ifndef GNUPG_G10_CALL_DIRMNGR_H
 #define GNUPG_G10_CALL_DIRMNGR_H
 
+typedef struct ks_get_job_s *ks_get_job_t;
+
 void gpg_dirmngr_deinit_session_data (ctrl_t ctrl);
 
 gpg_error_t gpg_dirmngr_ks_list (ctrl_t ctrl, char **r_keyserver);
@@ -28,6 +30,11 @@ gpg_error_t gpg_dirmngr_ks_search (ctrl_t ctrl, const char *searchstr,
 gpg_error_t gpg_dirmngr_ks_get (ctrl_t ctrl, char *pattern[],
                                 keyserver_spec_t override_keyserver, int quick,
                                 estream_t *r_fp, char **r_source);
+gpg_error_t gpg_dirmngr_ks_get_start (ctrl_t ctrl, char *pattern[],
+                                      keyserver_spec_t override_keyserver,
+                                      int quick, estream_t *r_fp,
+                                      char **r_source, ks_get_job_t *r_job);
+gpg_error_t gpg_dirmngr_ks_get_finish (ks_get_job_t job, estream_t fp);
 gpg_error_t gpg_dirmngr_ks_fetch (ctrl_t ctrl,
                                   const char *url, estream_t *r_fp);
 gpg_error_t gpg_dirmngr_ks_put (ctrl_t ctrl, void *data, size_t datalen,
@@ -28,6 +28,12 @@
 #ifdef HAVE_LOCALE_H
 # include <locale.h>
 #endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 #include <npth.h>
 
 #include "gpg.h"
@@ -43,6 +49,17 @@
 #include "keydb.h"
 
 #include "keydb-private.h"  /* For struct keydb_handle_s */
+#include "timing.h"
+
+
+/* An item to queue keyblocks received via the datastream during a
+ * batch search.  */
+struct batch_item_s
+{
+  struct batch_item_s *next;
+  kbnode_t keyblock;  /* The received keyblock or NULL.  */
+  gpg_error_t err;    /* The parsing error if KEYBLOCK is NULL.  */
+};
 
 
 /* Data used to keep track of keybox daemon sessions.  This allows us
@@ -70,10 +87,30 @@ struct keyboxd_local_s
     /* The found keyblock or the parsing error.   */
     kbnode_t found_keyblock;
     gpg_error_t found_err;
+
+    /* If set the received keyblocks are queued at BATCH_ITEMS
+     * instead of storing them at FOUND_KEYBLOCK.  BATCH_COUNT is the
+     * number of received keyblocks; FOUND_ERR is set if one of them
+     * could not be queued.  */
+    int batch_mode;
+    struct batch_item_s *batch_items;
+    struct batch_item_s **batch_tail;
+    unsigned int batch_count;
   } datastream;
 
+  /* This object is used if a shared memory segment is used to convey
+   * the keyblocks.  */
+  struct {
+    /* The memory file or -1 if not used.  */
+    int fd;
+
+    /* The read-only mapping of the file with SIZE bytes or NULL.  */
+    unsigned char *base;
+    size_t size;
+  } shm;
+
   /* I/O buffer with the last search result or NULL.  Used if
-   * D-lines are used to convey the keyblocks. */
+   * D-lines or the shared memory are used to convey the keyblocks. */
   iobuf_t search_result;
 
   /* This flag set while an operation is running on this context.  */
@@ -85,6 +122,9 @@ struct keyboxd_local_s
 
   /* Flag indicating that a search reset is required.  */
   unsigned int need_search_reset : 1;
+
+  /* The bulk-store value last sent to the keyboxd.  */
+  unsigned int bulk_store;
 };
 
 
@@ -129,6 +169,12 @@ gpg_keyboxd_deinit_session_data (ctrl_t ctrl)
         {
           es_fclose (kbl->datastream.fp);
           kbl->datastream.fp = NULL;
+#ifdef HAVE_MMAP
+          if (kbl->shm.base)
+            munmap (kbl->shm.base, kbl->shm.size);
+#endif
+          if (kbl->shm.fd != -1)
+            close (kbl->shm.fd);
           assuan_release (kbl->ctx);
           kbl->ctx = NULL;
         }
@@ -220,6 +266,109 @@ create_new_context (ctrl_t ctrl, assuan_context_t *r_ctx)
 
 
 
+/* Setup a shared memory segment for receiving data from the keyboxd.
+ * This avoids the copying of the data through a pipe or the assuan
+ * connection.  Returns true if the segment is used.  */
+static int
+prepare_shm (keyboxd_local_t kbl)
+{
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_MMAP) && defined(F_ADD_SEALS)
+  gpg_error_t err;
+  int fd;
+
+  /* Do not send an fd which would never be taken by the server.  */
+  if (assuan_transact (kbl->ctx, "GETINFO shm",
+                       NULL, NULL, NULL, NULL, NULL, NULL))
+    return 0;
+
+  fd = memfd_create ("gpg-keyboxd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return 0;
+  /* The keyboxd requires that we can't shrink the file.  */
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK))
+    {
+      close (fd);
+      return 0;
+    }
+
+  err = assuan_sendfd (kbl->ctx, INT2FD (fd));
+  if (err)
+    {
+      close (fd);
+      return 0;
+    }
+  err = assuan_transact (kbl->ctx, "SHMOUTPUT FD",
+                         NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    {
+      log_info ("keyboxd does not accept our memory file: %s <%s>\n",
+                gpg_strerror (err), gpg_strsource (err));
+      close (fd);
+      return 0;
+    }
+
+  kbl->shm.fd = fd;
+  return 1;
+#else
+  (void)kbl;
+  return 0;
+#endif
+}
+
+
+/* Return an I/O buffer with the data announced by the SHMDATA status
+ * line with the arguments ARGS.  */
+static gpg_error_t
+shm_get_iobuf (keyboxd_local_t kbl, const char *args, iobuf_t *r_iobuf)
+{
+#ifdef HAVE_MMAP
+  gpg_error_t err;
+  unsigned long long off, len = 0;
+  char *endp;
+  struct stat st;
+  void *p;
+
+  *r_iobuf = NULL;
+
+  gpg_err_set_errno (0);
+  off = strtoull (args, &endp, 10);
+  if (!errno && endp != args)
+    len = strtoull ((args = endp), &endp, 10);
+  if (errno || endp == args)
+    return gpg_error (GPG_ERR_INV_RESPONSE);
+
+  if (off > kbl->shm.size || len > kbl->shm.size - off)
+    {
+      /* The keyboxd has enlarged the file.  */
+      if (fstat (kbl->shm.fd, &st))
+        return gpg_error_from_syserror ();
+      if (off > st.st_size || len > st.st_size - off)
+        return gpg_error (GPG_ERR_INV_RESPONSE);
+      p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, kbl->shm.fd, 0);
+      if (p == MAP_FAILED)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error mapping shared memory: %s\n", gpg_strerror (err));
+          return err;
+        }
+      if (kbl->shm.base)
+        munmap (kbl->shm.base, kbl->shm.size);
+      kbl->shm.base = p;
+      kbl->shm.size = st.st_size;
+    }
+
+  *r_iobuf = iobuf_temp_with_content ((const char *)kbl->shm.base + off,
+                                      len);
+  return 0;
+#else
+  (void)kbl;
+  (void)args;
+  *r_iobuf = NULL;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+#endif
+}
+
+
 /* Setup the pipe used for receiving data from the keyboxd.  Store the
  * info on KBL.  */
 static gpg_error_t
@@ -288,6 +437,29 @@ prepare_data_pipe (keyboxd_local_t kbl)
 }
 
 
+/* Tell the keyboxd of the context KBL to combine up to N stores into
+ * one transaction; N = 0 commits all pending stores.  */
+static gpg_error_t
+send_bulk_store_option (keyboxd_local_t kbl, unsigned int n)
+{
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+
+  snprintf (line, sizeof line, "OPTION bulk-store=%u", n);
+  err = assuan_transact (kbl->ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err && gpg_err_code (err) == GPG_ERR_UNKNOWN_OPTION)
+    {
+      /* An older keyboxd; the stores are just not combined.  */
+      if (opt.verbose)
+        log_info ("keyboxd does not support bulk stores\n");
+      err = 0;
+    }
+  if (!err)
+    kbl->bulk_store = n;
+  return err;
+}
+
+
 /* Get a context for accessing keyboxd.  If no context is available a
  * new one is created and if necessary keyboxd is started.  R_KBL
  * receives a pointer to the local context object.  */
@@ -311,10 +483,21 @@ open_context (ctrl_t ctrl, keyboxd_local_t *r_kbl)
           /* But first do the per session init if not yet done.  */
           if (!kbl->per_session_init_done)
             {
-              err = prepare_data_pipe (kbl);
+              if (!prepare_shm (kbl))
+                {
+                  err = prepare_data_pipe (kbl);
+                  if (err)
+                    return err;
+                }
+              kbl->per_session_init_done = 1;
+            }
+
+          /* Sync the bulk mode with the one requested for CTRL.  */
+          if (kbl->bulk_store != ctrl->keyboxd_bulk_store)
+            {
+              err = send_bulk_store_option (kbl, ctrl->keyboxd_bulk_store);
               if (err)
                 return err;
-              kbl->per_session_init_done = 1;
             }
 
           kbl->is_active = 1;
@@ -328,6 +511,7 @@ open_context (ctrl_t ctrl, keyboxd_local_t *r_kbl)
       kbl = xtrycalloc (1, sizeof *kbl);
       if (!kbl)
         return gpg_error_from_syserror ();
+      kbl->shm.fd = -1;
 
       rc = npth_mutex_init (&kbl->datastream.mutex, NULL);
       if (rc)
@@ -366,6 +550,103 @@ open_context (ctrl_t ctrl, keyboxd_local_t *r_kbl)
 
 
 
+/* Switch the keyboxd into bulk mode so that up to N stores are
+ * combined into one transaction.  N = 0 switches back to the standard
+ * mode and commits all pending stores.  The mode is applied lazily
+ * to the contexts of CTRL; only switching it off is done immediately
+ * for all contexts not in use.  This has no effect without
+ * --use-keyboxd.  */
+gpg_error_t
+keydb_set_bulk_mode (ctrl_t ctrl, unsigned int n)
+{
+  gpg_error_t err = 0;
+  gpg_error_t tmperr;
+  keyboxd_local_t kbl;
+
+  ctrl->keyboxd_bulk_store = n;
+  if (!opt.use_keyboxd || n)
+    return 0;
+
+  for (kbl = ctrl->keyboxd_local; kbl; kbl = kbl->next)
+    if (!kbl->is_active && kbl->bulk_store)
+      {
+        tmperr = send_bulk_store_option (kbl, 0);
+        if (tmperr)
+          {
+            log_error ("error committing bulk stores: %s\n",
+                       gpg_strerror (tmperr));
+            if (!err)
+              err = tmperr;
+          }
+      }
+
+  return err;
+}
+
+
+
+/* Flush the key caches if the data of the keyboxd has changed since
+ * the last call.  The keyboxd returns a string with "GETINFO
+ * generation" which changes with each store or delete by any client.
+ * A long running gpg, like with --server, calls this before its
+ * commands and can thus keep its caches as long as nobody changes the
+ * keys.  If the keyboxd does not support this, the caches are always
+ * flushed.  This has no effect without --use-keyboxd.  */
+gpg_error_t
+keydb_check_generation (ctrl_t ctrl)
+{
+  static char *last_generation;
+  gpg_error_t err;
+  keyboxd_local_t kbl;
+  membuf_t data;
+  char *generation;
+
+  if (!opt.use_keyboxd)
+    return 0;
+
+  err = open_context (ctrl, &kbl);
+  if (err)
+    return err;
+  init_membuf (&data, 64);
+  err = assuan_transact (kbl->ctx, "GETINFO generation",
+                         put_membuf_cb, &data,
+                         NULL, NULL, NULL, NULL);
+  kbl->is_active = 0;
+  put_membuf (&data, "", 1);
+  generation = get_membuf (&data, NULL);
+  if (gpg_err_code (err) == GPG_ERR_ASS_PARAMETER)
+    {
+      /* An old keyboxd - we can't tell.  */
+      xfree (generation);
+      xfree (last_generation);
+      last_generation = NULL;
+      getkey_flush_caches ();
+      return 0;
+    }
+  if (!err && !generation)
+    err = gpg_error_from_syserror ();
+  if (err)
+    {
+      xfree (generation);
+      return err;
+    }
+
+  if (last_generation && !strcmp (generation, last_generation))
+    xfree (generation);
+  else
+    {
+      if (DBG_CACHE && last_generation)
+        log_debug ("keyboxd data changed (%s -> %s); flushing caches\n",
+                   last_generation, generation);
+      getkey_flush_caches ();
+      xfree (last_generation);
+      last_generation = generation;
+    }
+  return 0;
+}
+
+
+
 /* Create a new database handle.  A database handle is similar to a
  * file handle: it contains a local file position.  This is used when
  * searching: subsequent searches resume where the previous search
@@ -471,12 +752,14 @@ keydb_get_keyblock_do_parse (iobuf_t iobuf, int pk_no, int uid_no,
   kbnode_t node, *tail;
   int in_cert, save_mode;
   int pk_count, uid_count;
+  timing_span_t span;
 
   *r_keyblock = NULL;
 
   pkt = xtrymalloc (sizeof *pkt);
   if (!pkt)
     return gpg_error_from_syserror ();
+  timing_begin (&span, "parse_keyblock");
   init_packet (pkt);
   init_parse_packet (&parsectx, iobuf);
   save_mode = set_packet_list_mode (0);
@@ -592,6 +875,7 @@ keydb_get_keyblock_do_parse (iobuf_t iobuf, int pk_no, int uid_no,
   free_packet (pkt, &parsectx);
   deinit_parse_packet (&parsectx);
   xfree (pkt);
+  timing_end (&span);
   return err;
 }
 
@@ -640,7 +924,29 @@ datastream_thread (void *arg)
       pk_no = uid_no = 0;  /* FIXME: Get this from the keyboxd.  */
       err = keydb_get_keyblock_do_parse (iobuf, pk_no, uid_no, &keyblock);
       iobuf_close (iobuf);
-      if (!err)
+      if (kbl->datastream.batch_mode)
+        {
+          struct batch_item_s *item;
+
+          item = xtrycalloc (1, sizeof *item);
+          if (!item)
+            {
+              /* Mark the entire batch as failed but still count the
+               * item so that the caller is not left waiting.  */
+              kbl->datastream.found_err = gpg_error_from_syserror ();
+              release_kbnode (keyblock);
+              kbl->datastream.batch_count++;
+            }
+          else
+            {
+              item->keyblock = err? NULL : keyblock;
+              item->err = err;
+              *kbl->datastream.batch_tail = item;
+              kbl->datastream.batch_tail = &item->next;
+              kbl->datastream.batch_count++;
+            }
+        }
+      else if (!err)
         {
           /* log_debug ("parsing datastream succeeded\n"); */
 
@@ -699,15 +1005,17 @@ keydb_get_keyblock (KEYDB_HANDLE hd, kbnode_t *ret_kb)
   if (DBG_CLOCK)
     log_clock ("%s enter", __func__);
 
+  hd->kb_digest_valid = 0;
   if (!hd->use_keyboxd)
     {
-      err = internal_keydb_get_keyblock (hd, ret_kb);
+      err = internal_keydb_get_keyblock (hd, 0, ret_kb);
       goto leave;
     }
 
   if (hd->kbl->search_result)
     {
       pk_no = uid_no = 0;  /*FIXME: Get this from the keyboxd.  */
+      internal_keydb_set_digest (hd, hd->kbl->search_result);
       err = keydb_get_keyblock_do_parse (hd->kbl->search_result,
                                          pk_no, uid_no, ret_kb);
       /* In contrast to the old code we close the iobuf here and thus
@@ -734,6 +1042,48 @@ keydb_get_keyblock (KEYDB_HANDLE hd, kbnode_t *ret_kb)
 }
 
 
+/* Same as keydb_get_keyblock but for callers which need only the
+ * primary key and the subkeys.  The user ID and signature packets,
+ * which in large keyblocks are mostly third-party signatures, may
+ * then be skipped without parsing them.  A caller which later needs
+ * them has to use keydb_get_keyblock.  With the keyboxd and with
+ * keyrings the entire keyblock is returned.  */
+gpg_error_t
+keydb_get_keyblock_keys (KEYDB_HANDLE hd, kbnode_t *ret_kb)
+{
+  if (!hd)
+    {
+      *ret_kb = NULL;
+      return gpg_error (GPG_ERR_INV_ARG);
+    }
+
+  if (!hd->use_keyboxd)
+    {
+      *ret_kb = NULL;
+      hd->kb_digest_valid = 0;
+      return internal_keydb_get_keyblock (hd, 1, ret_kb);
+    }
+
+  return keydb_get_keyblock (hd, ret_kb);
+}
+
+
+/* Store the SHA-256 hash of the image of the keyblock last returned
+ * by keydb_get_keyblock at R_DIGEST which must provide space for
+ * KEYDB_DIGEST_LEN bytes.  Returns GPG_ERR_NOT_FOUND if the hash is
+ * not known; this is for example the case for keyrings.  */
+gpg_error_t
+keydb_get_keyblock_digest (KEYDB_HANDLE hd, unsigned char *r_digest)
+{
+  if (!hd)
+    return gpg_error (GPG_ERR_INV_ARG);
+  if (!hd->kb_digest_valid)
+    return gpg_error (GPG_ERR_NOT_FOUND);
+  memcpy (r_digest, hd->kb_digest, KEYDB_DIGEST_LEN);
+  return 0;
+}
+
+
 
 /* Communication object for STORE commands.  */
 struct store_parm_s
@@ -791,6 +1141,7 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
   if (!hd)
     return gpg_error (GPG_ERR_INV_ARG);
 
+  getkey_flush_merge_cache ();
   if (!hd->use_keyboxd)
     {
       err = internal_keydb_update_keyblock (ctrl, hd, kb);
@@ -842,6 +1193,7 @@ keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
   if (!hd)
     return gpg_error (GPG_ERR_INV_ARG);
 
+  getkey_flush_merge_cache ();
   if (!hd->use_keyboxd)
     {
       err = internal_keydb_insert_keyblock (hd, kb);
@@ -887,6 +1239,7 @@ keydb_delete_keyblock (KEYDB_HANDLE hd)
   if (!hd)
     return gpg_error (GPG_ERR_INV_ARG);
 
+  getkey_flush_merge_cache ();
   if (!hd->use_keyboxd)
     {
       err = internal_keydb_delete_keyblock (hd);
@@ -977,11 +1330,112 @@ search_status_cb (void *opaque, const char *line)
             err = gpg_error (GPG_ERR_INV_VALUE);
         }
     }
+  else if ((s = has_leading_keyword (line, "SHMDATA")))
+    {
+      if (hd->kbl->shm.fd == -1 || hd->kbl->search_result)
+        err = gpg_error (GPG_ERR_UNEXPECTED);
+      else
+        err = shm_get_iobuf (hd->kbl, s, &hd->kbl->search_result);
+    }
 
   return err;
 }
 
 
+/* Format the search description DESC as an assuan command to the
+ * keyboxd.  PREFIX is the command with its options, e.g. "SEARCH".
+ * The result is stored at the buffer LINE of size LINESIZE.  */
+static gpg_error_t
+format_search_line (char *line, size_t linesize, const char *prefix,
+                    KEYDB_SEARCH_DESC *desc)
+{
+  switch (desc->mode)
+    {
+    case KEYDB_SEARCH_MODE_EXACT:
+      snprintf (line, linesize, "%s =%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_SUBSTR:
+      snprintf (line, linesize, "%s *%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_MAIL:
+      snprintf (line, linesize, "%s <%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_MAILSUB:
+      snprintf (line, linesize, "%s @%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_MAILEND:
+      snprintf (line, linesize, "%s .%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_WORDS:
+      snprintf (line, linesize, "%s +%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_SHORT_KID:
+      snprintf (line, linesize, "%s 0x%08lX", prefix,
+                (ulong)desc->u.kid[1]);
+      break;
+
+    case KEYDB_SEARCH_MODE_LONG_KID:
+      snprintf (line, linesize, "%s 0x%08lX%08lX", prefix,
+                (ulong)desc->u.kid[0], (ulong)desc->u.kid[1]);
+      break;
+
+    case KEYDB_SEARCH_MODE_FPR:
+      {
+        unsigned char hexfpr[MAX_FINGERPRINT_LEN * 2 + 1];
+        log_assert (desc->fprlen <= MAX_FINGERPRINT_LEN);
+        bin2hex (desc->u.fpr, desc->fprlen, hexfpr);
+        snprintf (line, linesize, "%s 0x%s", prefix, hexfpr);
+      }
+      break;
+
+    case KEYDB_SEARCH_MODE_ISSUER:
+      snprintf (line, linesize, "%s #/%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_ISSUER_SN:
+    case KEYDB_SEARCH_MODE_SN:
+      snprintf (line, linesize, "%s #%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_SUBJECT:
+      snprintf (line, linesize, "%s /%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_KEYGRIP:
+      {
+        unsigned char hexgrip[KEYGRIP_LEN * 2 + 1];
+        bin2hex (desc->u.grip, KEYGRIP_LEN, hexgrip);
+        snprintf (line, linesize, "%s &%s", prefix, hexgrip);
+      }
+      break;
+
+    case KEYDB_SEARCH_MODE_UBID:
+      {
+        unsigned char hexubid[UBID_LEN * 2 + 1];
+        bin2hex (desc->u.ubid, UBID_LEN, hexubid);
+        snprintf (line, linesize, "%s ^%s", prefix, hexubid);
+      }
+      break;
+
+    case KEYDB_SEARCH_MODE_FIRST:
+      snprintf (line, linesize, "%s", prefix);
+      break;
+
+    default:
+      return gpg_error (GPG_ERR_INV_ARG);
+    }
+
+  return 0;
+
+}
+
+
 /* Search the database for keys matching the search description.  If
  * the DB contains any legacy keys, these are silently ignored.
  *
@@ -1007,6 +1461,7 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   gpg_error_t err;
   int i;
   char line[ASSUAN_LINELENGTH];
+  timing_span_t span;
 
 
   if (!hd)
@@ -1017,6 +1472,7 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
 
   if (DBG_CLOCK)
     log_clock ("%s enter", __func__);
+  timing_begin (&span, "keydb_search");
 
   if (DBG_LOOKUP)
     {
@@ -1070,92 +1526,16 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
     }
 
   /* FIXME: Implement --multi */
-  switch (desc->mode)
+  if (desc->mode == KEYDB_SEARCH_MODE_NEXT)
     {
-    case KEYDB_SEARCH_MODE_EXACT:
-      snprintf (line, sizeof line, "SEARCH =%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_SUBSTR:
-      snprintf (line, sizeof line, "SEARCH *%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_MAIL:
-      snprintf (line, sizeof line, "SEARCH <%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_MAILSUB:
-      snprintf (line, sizeof line, "SEARCH @%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_MAILEND:
-      snprintf (line, sizeof line, "SEARCH .%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_WORDS:
-      snprintf (line, sizeof line, "SEARCH +%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_SHORT_KID:
-      snprintf (line, sizeof line, "SEARCH 0x%08lX",
-                (ulong)desc->u.kid[1]);
-      break;
-
-    case KEYDB_SEARCH_MODE_LONG_KID:
-      snprintf (line, sizeof line, "SEARCH 0x%08lX%08lX",
-                (ulong)desc->u.kid[0], (ulong)desc->u.kid[1]);
-      break;
-
-    case KEYDB_SEARCH_MODE_FPR:
-      {
-        unsigned char hexfpr[MAX_FINGERPRINT_LEN * 2 + 1];
-        log_assert (desc[0].fprlen <= MAX_FINGERPRINT_LEN);
-        bin2hex (desc[0].u.fpr, desc[0].fprlen, hexfpr);
-        snprintf (line, sizeof line, "SEARCH 0x%s", hexfpr);
-      }
-      break;
-
-    case KEYDB_SEARCH_MODE_ISSUER:
-      snprintf (line, sizeof line, "SEARCH #/%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_ISSUER_SN:
-    case KEYDB_SEARCH_MODE_SN:
-      snprintf (line, sizeof line, "SEARCH #%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_SUBJECT:
-      snprintf (line, sizeof line, "SEARCH /%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_KEYGRIP:
-      {
-        unsigned char hexgrip[KEYGRIP_LEN * 2 + 1];
-        bin2hex (desc[0].u.grip, KEYGRIP_LEN, hexgrip);
-        snprintf (line, sizeof line, "SEARCH &%s", hexgrip);
-      }
-      break;
-
-    case KEYDB_SEARCH_MODE_UBID:
-      {
-        unsigned char hexubid[UBID_LEN * 2 + 1];
-        bin2hex (desc[0].u.ubid, UBID_LEN, hexubid);
-        snprintf (line, sizeof line, "SEARCH ^%s", hexubid);
-      }
-      break;
-
-    case KEYDB_SEARCH_MODE_FIRST:
-      snprintf (line, sizeof line, "SEARCH");
-      break;
-
-    case KEYDB_SEARCH_MODE_NEXT:
       log_debug ("%s: mode next - we should not get to here!\n", __func__);
       snprintf (line, sizeof line, "NEXT");
-      break;
-
-    default:
-      err = gpg_error (GPG_ERR_INV_ARG);
-      goto leave;
+    }
+  else
+    {
+      err = format_search_line (line, sizeof line, "SEARCH", desc);
+      if (err)
+        goto leave;
     }
 
  do_search:
@@ -1196,6 +1576,16 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
           unlock_datastream (hd->kbl);
         }
     }
+  else if (hd->kbl->shm.fd != -1)
+    {
+      /* The status callback takes the data from the shared memory.  */
+      err = assuan_transact (hd->kbl->ctx, line,
+                             NULL, NULL,
+                             NULL, NULL,
+                             search_status_cb, hd);
+      if (!err && !hd->kbl->search_result)
+        err = gpg_error (GPG_ERR_NO_DATA);
+    }
   else /* Slower D-line version if fd-passing was not successful.  */
     {
       membuf_t data;
@@ -1228,7 +1618,358 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   /*   log_printhex (hd->last_ubid, 20, "found UBID:"); */
 
  leave:
+  timing_end (&span);
   if (DBG_CLOCK)
     log_clock ("%s leave (%sfound)", __func__, err? "not ":"");
   return err;
 }
+
+
+
+/* Communication object for batch searches.  */
+struct batch_parm_s
+{
+  KEYDB_HANDLE hd;
+  size_t ndesc;
+
+  /* The user callback and its first arg.  */
+  gpg_error_t (*cb) (void *opaque, size_t descidx, kbnode_t keyblock);
+  void *cb_value;
+
+  /* The first error returned by the callback or a parser.  Once this
+   * is set no more results are delivered.  */
+  gpg_error_t err;
+
+  /* The query indices from the PUBKEY_INFO lines in the order they
+   * were received.  Only used with the datastream.  */
+  size_t *indices;
+  size_t nindices;
+  size_t indicessize;
+
+  /* Collected D-lines of the current keyblock and its query index.
+   * Only used if no datastream is available.  */
+  membuf_t data;
+  int have_blob;
+  size_t descidx;
+};
+
+
+/* Deliver KEYBLOCK or the parse error ERR for the query DESCIDX to
+ * the user callback.  The callback takes ownership of KEYBLOCK.  */
+static void
+batch_deliver (struct batch_parm_s *parm, size_t descidx,
+               kbnode_t keyblock, gpg_error_t err)
+{
+  if (!parm->err && err)
+    parm->err = err;
+  if (parm->err)
+    {
+      release_kbnode (keyblock);
+      return;
+    }
+
+  parm->err = parm->cb (parm->cb_value, descidx, keyblock);
+}
+
+
+/* Parse the keyblock collected from the D-lines and deliver it.  */
+static void
+batch_flush_blob (struct batch_parm_s *parm)
+{
+  gpg_error_t err;
+  void *buffer;
+  size_t len;
+  iobuf_t iobuf;
+  kbnode_t keyblock = NULL;
+
+  if (!parm->have_blob)
+    return;
+  parm->have_blob = 0;
+
+  buffer = get_membuf (&parm->data, &len);
+  if (!buffer)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      iobuf = iobuf_temp_with_content (buffer, len);
+      xfree (buffer);
+      err = keydb_get_keyblock_do_parse (iobuf, 0, 0, &keyblock);
+      iobuf_close (iobuf);
+    }
+  init_membuf (&parm->data, 8192);
+  batch_deliver (parm, parm->descidx, keyblock, err);
+}
+
+
+/* Data callback for SEARCH --batch.  */
+static gpg_error_t
+batch_data_cb (void *opaque, const void *buffer, size_t length)
+{
+  struct batch_parm_s *parm = opaque;
+
+  if (buffer)
+    put_membuf (&parm->data, buffer, length);
+  return 0;
+}
+
+
+/* Status callback for SEARCH --batch.  Note that we never return an
+ * error from here because that would get us out of sync with the
+ * keyboxd; errors are instead stored at PARM->ERR.  */
+static gpg_error_t
+batch_status_cb (void *opaque, const char *line)
+{
+  struct batch_parm_s *parm = opaque;
+  const char *s;
+  unsigned long idx;
+  char *endp;
+
+  if ((s = has_leading_keyword (line, "SHMDATA")))
+    {
+      gpg_error_t err;
+      iobuf_t iobuf;
+      kbnode_t keyblock = NULL;
+
+      if (!parm->have_blob || parm->hd->kbl->shm.fd == -1)
+        err = gpg_error (GPG_ERR_UNEXPECTED);
+      else
+        err = shm_get_iobuf (parm->hd->kbl, s, &iobuf);
+      if (!err)
+        {
+          err = keydb_get_keyblock_do_parse (iobuf, 0, 0, &keyblock);
+          iobuf_close (iobuf);
+        }
+      parm->have_blob = 0;
+      batch_deliver (parm, parm->descidx, keyblock, err);
+      return 0;
+    }
+
+  if (!(s = has_leading_keyword (line, "PUBKEY_INFO")))
+    return 0;
+
+  batch_flush_blob (parm);
+
+  if (atoi (s) != PUBKEY_TYPE_OPGP)
+    {
+      if (!parm->err)
+        parm->err = gpg_error (GPG_ERR_WRONG_BLOB_TYPE);
+      idx = 0;
+    }
+  else
+    {
+      /* Skip the type and the UBID.  */
+      while (*s && !spacep (s))
+        s++;
+      while (spacep (s))
+        s++;
+      while (*s && !spacep (s))
+        s++;
+      gpg_err_set_errno (0);
+      idx = strtoul (s, &endp, 10);
+      if (errno || endp == s || idx >= parm->ndesc)
+        {
+          if (!parm->err)
+            parm->err = gpg_error (GPG_ERR_INV_RESPONSE);
+          idx = 0;
+        }
+    }
+
+  if (parm->hd->kbl->datastream.fp)
+    {
+      if (parm->nindices == parm->indicessize)
+        {
+          size_t *tmp;
+
+          tmp = xtryreallocarray (parm->indices, parm->indicessize,
+                                  parm->indicessize + 64, sizeof *tmp);
+          if (!tmp)
+            {
+              /* Nothing will be delivered anymore and thus it is
+               * okay not to track this keyblock.  */
+              if (!parm->err)
+                parm->err = gpg_error_from_syserror ();
+              return 0;
+            }
+          parm->indices = tmp;
+          parm->indicessize += 64;
+        }
+      parm->indices[parm->nindices++] = idx;
+    }
+  else
+    {
+      parm->have_blob = 1;
+      parm->descidx = idx;
+    }
+
+  return 0;
+}
+
+
+/* Search the database for all keys matching any of the NDESC search
+ * descriptions at DESC.  In contrast to keydb_search each description
+ * is a separate query and all keys matching it are delivered by
+ * calling CB with CB_VALUE as first argument, the index of the
+ * description, and the keyblock.  The callback takes ownership of
+ * the keyblock.  The keys are delivered in the order of the queries
+ * and within a query in database order.  If the callback returns an error no further keys are delivered and that
+ * error is returned.
+ *
+ * With the keyboxd all queries are sent in one request; otherwise
+ * each query is run using the regular search functions.  The search
+ * position is reset by this function.  */
+gpg_error_t
+keydb_search_batch (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc, size_t ndesc,
+                    gpg_error_t (*cb) (void *opaque, size_t descidx,
+                                       kbnode_t keyblock),
+                    void *cb_value)
+{
+  gpg_error_t err;
+  struct batch_parm_s parm;
+  char line[ASSUAN_LINELENGTH];
+  size_t idx;
+
+  if (!hd || !cb)
+    return gpg_error (GPG_ERR_INV_ARG);
+  if (!ndesc)
+    return 0;
+
+  if (DBG_CLOCK)
+    log_clock ("%s enter", __func__);
+
+  memset (&parm, 0, sizeof parm);
+  parm.hd = hd;
+  parm.ndesc = ndesc;
+  parm.cb = cb;
+  parm.cb_value = cb_value;
+
+  if (!hd->use_keyboxd)
+    {
+      KEYDB_SEARCH_DESC query;
+      kbnode_t keyblock;
+
+      for (idx = 0; idx < ndesc && !parm.err; idx++)
+        {
+          err = keydb_search_reset (hd);
+          if (err)
+            goto leave;
+          query = desc[idx];
+          while (!parm.err && !(err = keydb_search (hd, &query, 1, NULL)))
+            {
+              if (query.mode == KEYDB_SEARCH_MODE_FIRST)
+                query.mode = KEYDB_SEARCH_MODE_NEXT;
+              err = keydb_get_keyblock (hd, &keyblock);
+              batch_deliver (&parm, idx, err? NULL : keyblock, err);
+            }
+          if (err && gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+            goto leave;
+        }
+      err = 0;
+      goto leave;
+    }
+
+  /* Clear the result objects of a previous regular search.  */
+  if (hd->kbl->search_result)
+    {
+      iobuf_close (hd->kbl->search_result);
+      hd->kbl->search_result = NULL;
+    }
+  if (hd->kbl->datastream.found_keyblock)
+    {
+      release_kbnode (hd->kbl->datastream.found_keyblock);
+      hd->kbl->datastream.found_keyblock = NULL;
+    }
+  /* After a batch the keyboxd has no search position.  */
+  hd->kbl->need_search_reset = 1;
+  hd->last_ubid_valid = 0;
+
+  /* Send all but the last query with --more.  */
+  for (idx = 0; idx + 1 < ndesc; idx++)
+    {
+      err = format_search_line (line, sizeof line, "SEARCH --more",
+                                &desc[idx]);
+      if (!err)
+        err = assuan_transact (hd->kbl->ctx, line,
+                               NULL, NULL, NULL, NULL, NULL, NULL);
+      if (err)
+        goto leave;
+    }
+  err = format_search_line (line, sizeof line, "SEARCH --batch", &desc[idx]);
+  if (err)
+    goto leave;
+
+  if (hd->kbl->datastream.fp)
+    {
+      struct batch_item_s *item, *itemnext;
+      int rc;
+
+      hd->kbl->datastream.batch_mode = 1;
+      hd->kbl->datastream.batch_items = NULL;
+      hd->kbl->datastream.batch_tail = &hd->kbl->datastream.batch_items;
+      hd->kbl->datastream.batch_count = 0;
+      hd->kbl->datastream.found_err = 0;
+
+      err = assuan_transact (hd->kbl->ctx, line,
+                             NULL, NULL,
+                             NULL, NULL,
+                             batch_status_cb, &parm);
+      if (!err)
+        {
+          /* Wait until the datastream got all announced keyblocks.  */
+          lock_datastream (hd->kbl);
+          while (hd->kbl->datastream.batch_count < parm.nindices)
+            {
+              rc = npth_cond_wait (&hd->kbl->datastream.cond,
+                                   &hd->kbl->datastream.mutex);
+              if (rc)
+                {
+                  err = gpg_error_from_errno (rc);
+                  log_error ("%s: waiting on condition failed: %s\n",
+                             __func__, gpg_strerror (err));
+                  break;
+                }
+            }
+          unlock_datastream (hd->kbl);
+        }
+      /* Fixme: On unexpected errors we need a way to cancel the data
+       * stream.  See keydb_search.  */
+      hd->kbl->datastream.batch_mode = 0;
+      if (!err && hd->kbl->datastream.found_err)
+        err = hd->kbl->datastream.found_err;
+      hd->kbl->datastream.found_err = 0;
+
+      for (idx = 0, item = hd->kbl->datastream.batch_items;
+           item; item = itemnext, idx++)
+        {
+          itemnext = item->next;
+          if (!err && idx < parm.nindices)
+            batch_deliver (&parm, parm.indices[idx],
+                           item->keyblock, item->err);
+          else
+            release_kbnode (item->keyblock);
+          xfree (item);
+        }
+      hd->kbl->datastream.batch_items = NULL;
+      hd->kbl->datastream.batch_tail = NULL;
+    }
+  else /* Slower D-line version if fd-passing was not successful.  */
+    {
+      init_membuf (&parm.data, 8192);
+      err = assuan_transact (hd->kbl->ctx, line,
+                             batch_data_cb, &parm,
+                             NULL, NULL,
+                             batch_status_cb, &parm);
+      if (!err)
+        batch_flush_blob (&parm);
+      xfree (get_membuf (&parm.data, NULL));
+    }
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    err = 0;
+
+ leave:
+  if (!err)
+    err = parm.err;
+  xfree (parm.indices);
+  if (DBG_CLOCK)
+    log_clock ("%s leave%s", __func__, err? " (failed)":"");
+  return err;
+}
@@ -38,6 +38,33 @@
  * be a multiple of the OCB blocksize (16 byte).  */
 #define AEAD_ENC_BUFFER_SIZE (64*1024)
 
+/* The smallest chunk size for which we use parallel encryption.  With
+ * smaller chunks the overhead of the threads would eat up the gain.  */
+#define AEAD_PARALLEL_MIN_CHUNKSIZE (64*1024)
+
+
+/* A chunk slot for the parallel encryption.  */
+struct aead_chunk_s
+{
+  gcry_cipher_hd_t hd;    /* A cipher handle used only for this slot.  */
+  uint64_t chunkindex;    /* The index of the chunk in this slot.  */
+  unsigned char *data;    /* Buffer for a full chunk.  */
+  size_t datalen;         /* Used length of DATA.  */
+  unsigned char tag[16];  /* The computed authentication tag.  */
+  gpg_error_t err;        /* The result of the encryption.  */
+};
+
+/* The state of the parallel encryption.  Full chunks are collected
+ * until all slots are filled; they are then encrypted concurrently
+ * and written out in their original order.  */
+struct aead_parallel_s
+{
+  cipher_filter_context_t *cfx;
+  int nslots;   /* Allocated number of slots.  */
+  int used;     /* Number of slots with a full chunk.  */
+  struct aead_chunk_s slots[1];
+};
+
 
 /* Wrapper around iobuf_write to make sure that a proper error code is
  * always returned.  */
@@ -55,12 +82,29 @@ my_iobuf_write (iobuf_t a, const void *buffer, size_t buflen)
 }
 
 
-/* Set the nonce and the additional data for the current chunk.  If
- * FINAL is set the final AEAD chunk is processed.  This also reset
- * the encryption machinery so that the handle can be used for a new
- * chunk.  */
+/* Same as my_iobuf_write but hand BUFFER over to the next filter.
+ * The content of BUFFER is undefined on return.  */
+static gpg_error_t
+my_iobuf_write_handoff (iobuf_t a, void *buffer, size_t buflen)
+{
+  if (iobuf_write_handoff (a, buffer, buflen))
+    {
+      gpg_error_t err = iobuf_error (a);
+      if (!err || !gpg_err_code (err)) /* (The latter should never happen) */
+        err = gpg_error (GPG_ERR_EIO);
+      return err;
+    }
+  return 0;
+}
+
+
+/* Set the nonce and the additional data for the chunk CHUNKINDEX
+ * into the cipher handle HD.  If FINAL is set the final AEAD chunk is
+ * processed.  This also reset the encryption machinery so that the
+ * handle can be used for a new chunk.  */
 static gpg_error_t
-set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
+set_nonce_and_ad (cipher_filter_context_t *cfx, gcry_cipher_hd_t hd,
+                  uint64_t chunkindex, int final)
 {
   gpg_error_t err;
   unsigned char nonce[16];
@@ -83,18 +127,18 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
       BUG ();
     }
 
-  nonce[i++] ^= cfx->chunkindex >> 56;
-  nonce[i++] ^= cfx->chunkindex >> 48;
-  nonce[i++] ^= cfx->chunkindex >> 40;
-  nonce[i++] ^= cfx->chunkindex >> 32;
-  nonce[i++] ^= cfx->chunkindex >> 24;
-  nonce[i++] ^= cfx->chunkindex >> 16;
-  nonce[i++] ^= cfx->chunkindex >>  8;
-  nonce[i++] ^= cfx->chunkindex;
+  nonce[i++] ^= chunkindex >> 56;
+  nonce[i++] ^= chunkindex >> 48;
+  nonce[i++] ^= chunkindex >> 40;
+  nonce[i++] ^= chunkindex >> 32;
+  nonce[i++] ^= chunkindex >> 24;
+  nonce[i++] ^= chunkindex >> 16;
+  nonce[i++] ^= chunkindex >>  8;
+  nonce[i++] ^= chunkindex;
 
   if (DBG_CRYPTO)
     log_printhex (nonce, 15, "nonce:");
-  err = gcry_cipher_setiv (cfx->cipher_hd, nonce, i);
+  err = gcry_cipher_setiv (hd, nonce, i);
   if (err)
     return err;
 
@@ -103,14 +147,14 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
   ad[2] = cfx->dek->algo;
   ad[3] = cfx->dek->use_aead;
   ad[4] = cfx->chunkbyte;
-  ad[5] = cfx->chunkindex >> 56;
-  ad[6] = cfx->chunkindex >> 48;
-  ad[7] = cfx->chunkindex >> 40;
-  ad[8] = cfx->chunkindex >> 32;
-  ad[9] = cfx->chunkindex >> 24;
-  ad[10]= cfx->chunkindex >> 16;
-  ad[11]= cfx->chunkindex >>  8;
-  ad[12]= cfx->chunkindex;
+  ad[5] = chunkindex >> 56;
+  ad[6] = chunkindex >> 48;
+  ad[7] = chunkindex >> 40;
+  ad[8] = chunkindex >> 32;
+  ad[9] = chunkindex >> 24;
+  ad[10]= chunkindex >> 16;
+  ad[11]= chunkindex >>  8;
+  ad[12]= chunkindex;
   if (final)
     {
       ad[13] = cfx->total >> 56;
@@ -124,7 +168,82 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
     }
   if (DBG_CRYPTO)
     log_printhex (ad, final? 21 : 13, "authdata:");
-  return gcry_cipher_authenticate (cfx->cipher_hd, ad, final? 21 : 13);
+  return gcry_cipher_authenticate (hd, ad, final? 21 : 13);
+}
+
+
+/* Release the parallel encryption state P.  */
+static void
+release_parallel (struct aead_parallel_s *p)
+{
+  int i;
+
+  if (!p)
+    return;
+  for (i=0; i < p->nslots; i++)
+    {
+      gcry_cipher_close (p->slots[i].hd);
+      xfree (p->slots[i].data);
+    }
+  xfree (p);
+}
+
+
+/* Prepare CFX for the parallel encryption if this has been requested.
+ * On error we fall back to the standard encryption.  */
+static void
+setup_parallel (cipher_filter_context_t *cfx,
+                enum gcry_cipher_modes ciphermode)
+{
+  gpg_error_t err;
+  struct aead_parallel_s *p;
+  int i;
+
+  if (opt.aead_jobs < 2 || cfx->chunksize < AEAD_PARALLEL_MIN_CHUNKSIZE)
+    return;
+  if (cfx->chunksize > (size_t)(-1) / opt.aead_jobs)
+    {
+      err = gpg_error (GPG_ERR_TOO_LARGE);
+      goto leave;
+    }
+
+  p = xtrycalloc (1, sizeof *p + (opt.aead_jobs - 1) * sizeof *p->slots);
+  if (!p)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  p->cfx = cfx;
+  p->nslots = opt.aead_jobs;
+  for (i=0; i < p->nslots; i++)
+    {
+      p->slots[i].data = xtrymalloc (cfx->chunksize);
+      if (!p->slots[i].data)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      err = openpgp_cipher_open (&p->slots[i].hd, cfx->dek->algo,
+                                 ciphermode, GCRY_CIPHER_SECURE);
+      if (!err)
+        err = gcry_cipher_setkey (p->slots[i].hd,
+                                  cfx->dek->key, cfx->dek->keylen);
+      if (err)
+        break;
+    }
+  if (err)
+    {
+      release_parallel (p);
+      goto leave;
+    }
+
+  if (DBG_FILTER)
+    log_debug ("using %d threads for the AEAD encryption\n", p->nslots);
+  cfx->parallel = p;
+
+ leave:
+  if (err)
+    log_info ("parallel AEAD encryption disabled: %s\n", gpg_strerror (err));
 }
 
 
@@ -200,6 +319,8 @@ write_header (cipher_filter_context_t *cfx, iobuf_t a)
   if (err)
     return err;
 
+  setup_parallel (cfx, ciphermode);
+
   cfx->wrote_header = 1;
 
  leave:
@@ -235,7 +356,7 @@ write_final_chunk (cipher_filter_context_t *cfx, iobuf_t a)
   gpg_error_t err;
   char dummy[1];
 
-  err = set_nonce_and_ad (cfx, 1);
+  err = set_nonce_and_ad (cfx, cfx->cipher_hd, cfx->chunkindex, 1);
   if (err)
     goto leave;
 
@@ -253,6 +374,103 @@ write_final_chunk (cipher_filter_context_t *cfx, iobuf_t a)
 }
 
 
+/* Encrypt the chunk in slot IDX of the parallel encryption state
+ * OPAQUE.  This is called by run_parallel and thus must not touch
+ * anything but the slot.  */
+static void
+encrypt_chunk_job (void *opaque, int idx)
+{
+  struct aead_parallel_s *p = opaque;
+  struct aead_chunk_s *slot = p->slots + idx;
+
+  slot->err = set_nonce_and_ad (p->cfx, slot->hd, slot->chunkindex, 0);
+  if (slot->err)
+    return;
+  gcry_cipher_final (slot->hd);
+  slot->err = gcry_cipher_encrypt (slot->hd, slot->data, slot->datalen,
+                                   NULL, 0);
+  if (!slot->err)
+    slot->err = gcry_cipher_gettag (slot->hd, slot->tag, 16);
+}
+
+
+/* Encrypt all used slots of the parallel encryption and write them
+ * in order to stream A.  */
+static gpg_error_t
+flush_parallel (cipher_filter_context_t *cfx, iobuf_t a)
+{
+  struct aead_parallel_s *p = cfx->parallel;
+  struct aead_chunk_s *slot;
+  gpg_error_t err = 0;
+  int i;
+
+  for (i=0; i < p->used; i++)
+    p->slots[i].chunkindex = cfx->chunkindex + i;
+
+  if (DBG_FILTER)
+    log_debug ("encrypting %d chunks starting at chunk %ju\n",
+               p->used, (uintmax_t)cfx->chunkindex);
+  run_parallel (p->nslots, p->used, encrypt_chunk_job, p);
+
+  for (i=0; i < p->used; i++)
+    {
+      slot = p->slots + i;
+      err = slot->err;
+      if (err)
+        {
+          log_error ("encrypting chunk %ju failed: %s\n",
+                     (uintmax_t)slot->chunkindex, gpg_strerror (err));
+          break;
+        }
+      err = my_iobuf_write_handoff (a, slot->data, slot->datalen);
+      if (!err)
+        err = my_iobuf_write (a, slot->tag, 16);
+      if (err)
+        break;
+      cfx->total += slot->datalen;
+      cfx->chunkindex++;
+      slot->datalen = 0;
+    }
+  p->used = 0;
+
+  return err;
+}
+
+
+/* The flush sub-function of cipher_filter_aead for the parallel
+ * encryption.  */
+static gpg_error_t
+do_flush_parallel (cipher_filter_context_t *cfx, iobuf_t a,
+                   byte *buf, size_t size)
+{
+  struct aead_parallel_s *p = cfx->parallel;
+  struct aead_chunk_s *slot;
+  gpg_error_t err = 0;
+  size_t n;
+
+  while (size)
+    {
+      slot = p->slots + p->used;
+      n = cfx->chunksize - slot->datalen;
+      if (n > size)
+        n = size;
+      memcpy (slot->data + slot->datalen, buf, n);
+      slot->datalen += n;
+      buf  += n;
+      size -= n;
+
+      if (slot->datalen == cfx->chunksize && ++p->used == p->nslots)
+        {
+          err = flush_parallel (cfx, a);
+          if (err)
+            break;
+        }
+    }
+
+  return err;
+}
+
+
 /* The core of the flush sub-function of cipher_filter_aead.   */
 static gpg_error_t
 do_flush (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
@@ -261,6 +479,9 @@ do_flush (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
   int finalize = 0;
   size_t n;
 
+  if (cfx->parallel)
+    return do_flush_parallel (cfx, a, buf, size);
+
   /* Put the data into a buffer, flush and encrypt as needed.  */
   if (DBG_FILTER)
     log_debug ("flushing %zu bytes (cur buflen=%zu)\n", size, cfx->buflen);
@@ -298,7 +519,7 @@ do_flush (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
             {
               if (DBG_FILTER)
                 log_debug ("start encrypting a new chunk\n");
-              err = set_nonce_and_ad (cfx, 0);
+              err = set_nonce_and_ad (cfx, cfx->cipher_hd, cfx->chunkindex, 0);
               if (err)
                 goto leave;
             }
@@ -324,7 +545,7 @@ do_flush (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
             goto leave;
           if (finalize && DBG_FILTER)
             log_printhex (cfx->buffer, cfx->buflen, "ciphr(1):");
-          err = my_iobuf_write (a, cfx->buffer, cfx->buflen);
+          err = my_iobuf_write_handoff (a, cfx->buffer, cfx->buflen);
           if (err)
             goto leave;
           cfx->chunklen += cfx->buflen;
@@ -362,7 +583,19 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
   if (DBG_FILTER)
     log_debug ("do_free: buflen=%zu\n", cfx->buflen);
 
-  if (cfx->buflen)
+  if (cfx->parallel)
+    {
+      /* Encrypt the remaining full chunks and the last partial one.  */
+      if (cfx->parallel->slots[cfx->parallel->used].datalen)
+        cfx->parallel->used++;
+      if (cfx->parallel->used)
+        {
+          err = flush_parallel (cfx, a);
+          if (err)
+            goto leave;
+        }
+    }
+  else if (cfx->buflen)
     {
       if (DBG_FILTER)
         log_debug ("encrypting last %zu bytes of the last chunk\n",cfx->buflen);
@@ -371,7 +604,7 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
         {
           if (DBG_FILTER)
             log_debug ("start encrypting a new chunk\n");
-          err = set_nonce_and_ad (cfx, 0);
+          err = set_nonce_and_ad (cfx, cfx->cipher_hd, cfx->chunkindex, 0);
           if (err)
             goto leave;
         }
@@ -381,7 +614,7 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
                                  NULL, 0);
       if (err)
         goto leave;
-      err = my_iobuf_write (a, cfx->buffer, cfx->buflen);
+      err = my_iobuf_write_handoff (a, cfx->buffer, cfx->buflen);
       if (err)
         goto leave;
       /* log_printhex (cfx->buffer, cfx->buflen, "wrote:"); */
@@ -405,6 +638,8 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
   err = write_final_chunk (cfx, a);
 
  leave:
+  release_parallel (cfx->parallel);
+  cfx->parallel = NULL;
   xfree (cfx->buffer);
   cfx->buffer = NULL;
   gcry_cipher_close (cfx->cipher_hd);
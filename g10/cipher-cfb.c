@@ -150,7 +150,7 @@ cipher_filter_cfb (void *opaque, int control,
             }
         }
 
-      rc = iobuf_write (a, buf, size);
+      rc = iobuf_write_handoff (a, buf, size);
     }
   else if (control == IOBUFCTRL_FREE)
     {
@@ -0,0 +1,278 @@
+/* compress-zstd.c - zstd compress filter
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The zstd compression algorithm is not part of OpenPGP.  It uses an
+ * algorithm id from the private range and is thus only useful if
+ * both sides use this implementation.  The compressed packet carries
+ * a single zstd frame.  */
+
+#include <config.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include <zstd.h>
+
+#include "packet.h"
+#include "filter.h"
+#include "main.h"
+#include "options.h"
+
+
+/* The state of the zstd filter kept in the OPAQUE field of the
+ * compress filter context.  */
+struct zstd_state_s
+{
+  ZSTD_CCtx *cctx;    /* Used for compression.  */
+  ZSTD_DCtx *dctx;    /* Used for decompression.  */
+  ZSTD_inBuffer in;   /* Pending input of the decompression.  */
+  int eofseen;        /* EOF seen on the input of the decompression.  */
+};
+
+
+static void
+init_compress (compress_filter_context_t *zfx, struct zstd_state_s *st)
+{
+  int level;
+  size_t rc;
+
+  if (opt.compress_level >= 1 && opt.compress_level <= 9)
+    level = opt.compress_level;
+  else if (opt.compress_level == -1)
+    level = ZSTD_CLEVEL_DEFAULT;
+  else
+    {
+      log_error ("invalid compression level; using default level\n");
+      level = ZSTD_CLEVEL_DEFAULT;
+    }
+
+  st->cctx = ZSTD_createCCtx ();
+  if (!st->cctx)
+    log_fatal ("zstd problem: %s\n", "out of core");
+  rc = ZSTD_CCtx_setParameter (st->cctx, ZSTD_c_compressionLevel, level);
+  if (ZSTD_isError (rc))
+    log_fatal ("zstd problem: %s\n", ZSTD_getErrorName (rc));
+  ZSTD_CCtx_setParameter (st->cctx, ZSTD_c_checksumFlag, 1);
+  /* Let the library compress on its own threads if it has been built
+   * with support for them; otherwise this fails and we stay
+   * single-threaded.  */
+  if (opt.compress_jobs > 1)
+    {
+      rc = ZSTD_CCtx_setParameter (st->cctx, ZSTD_c_nbWorkers,
+                                   opt.compress_jobs);
+      if (ZSTD_isError (rc) && opt.verbose)
+        log_info ("parallel compression disabled: %s\n",
+                  ZSTD_getErrorName (rc));
+    }
+
+  zfx->outbufsize = ZSTD_CStreamOutSize ();
+  zfx->outbuf = xmalloc (zfx->outbufsize);
+}
+
+
+/* Compress SIZE bytes from BUF and write the output to A.  With MODE
+ * ZSTD_e_end the frame is finished.  */
+static int
+do_compress (compress_filter_context_t *zfx, struct zstd_state_s *st,
+             ZSTD_EndDirective mode, const byte *buf, size_t size, IOBUF a)
+{
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  size_t remaining;
+  int rc;
+
+  in.src = buf;
+  in.size = size;
+  in.pos = 0;
+  do
+    {
+      out.dst = zfx->outbuf;
+      out.size = zfx->outbufsize;
+      out.pos = 0;
+      if (DBG_FILTER)
+        log_debug ("enter zstd compress: avail_in=%u, mode=%d\n",
+                   (unsigned)(in.size - in.pos), (int)mode);
+      remaining = ZSTD_compressStream2 (st->cctx, &out, &in, mode);
+      if (ZSTD_isError (remaining))
+        log_fatal ("zstd compress problem: %s\n",
+                   ZSTD_getErrorName (remaining));
+      if (DBG_FILTER)
+        log_debug ("leave zstd compress: avail_in=%u, n=%u, remaining=%u\n",
+                   (unsigned)(in.size - in.pos), (unsigned)out.pos,
+                   (unsigned)remaining);
+
+      if (out.pos && (rc = iobuf_write_handoff (a, zfx->outbuf, out.pos)))
+        {
+          log_debug ("zstd compress: iobuf_write failed\n");
+          return rc;
+        }
+    }
+  while (mode == ZSTD_e_end? remaining != 0 : in.pos < in.size);
+
+  return 0;
+}
+
+
+static void
+init_uncompress (compress_filter_context_t *zfx, struct zstd_state_s *st)
+{
+  st->dctx = ZSTD_createDCtx ();
+  if (!st->dctx)
+    log_fatal ("zstd problem: %s\n", "out of core");
+
+  zfx->inbufsize = ZSTD_DStreamInSize ();
+  zfx->inbuf = xmalloc (zfx->inbufsize);
+  st->in.src = zfx->inbuf;
+  st->in.size = 0;
+  st->in.pos = 0;
+}
+
+
+static int
+do_uncompress (compress_filter_context_t *zfx, struct zstd_state_s *st,
+               IOBUF a, byte *buf, size_t size, size_t *ret_len)
+{
+  ZSTD_outBuffer out;
+  size_t ret;
+  int nread;
+  int rc = 0;
+
+  out.dst = buf;
+  out.size = size;
+  out.pos = 0;
+  do
+    {
+      if (st->in.pos == st->in.size && !st->eofseen)
+        {
+          nread = iobuf_read (a, zfx->inbuf, zfx->inbufsize);
+          if (nread == -1)
+            {
+              st->eofseen = 1;
+              nread = 0;
+            }
+          st->in.src = zfx->inbuf;
+          st->in.size = nread;
+          st->in.pos = 0;
+        }
+
+      if (DBG_FILTER)
+        log_debug ("enter zstd decompress: avail_in=%u, avail_out=%u\n",
+                   (unsigned)(st->in.size - st->in.pos),
+                   (unsigned)(out.size - out.pos));
+      ret = ZSTD_decompressStream (st->dctx, &out, &st->in);
+      if (DBG_FILTER)
+        log_debug ("leave zstd decompress: avail_in=%u, avail_out=%u,"
+                   " ret=%u\n", (unsigned)(st->in.size - st->in.pos),
+                   (unsigned)(out.size - out.pos), (unsigned)ret);
+      if (ZSTD_isError (ret))
+        {
+          log_error ("zstd decompress problem: %s\n", ZSTD_getErrorName (ret));
+          rc = GPG_ERR_BAD_DATA;
+          break;
+        }
+      if (!ret)
+        {
+          rc = -1; /* The frame is complete: eof.  */
+          break;
+        }
+      if (st->eofseen && st->in.pos == st->in.size && out.pos < out.size)
+        {
+          log_error ("unexpected EOF in zstd stream\n");
+          rc = GPG_ERR_BAD_DATA;
+          break;
+        }
+    }
+  while (out.pos < out.size);
+
+  *ret_len = out.pos;
+  if (DBG_FILTER)
+    log_debug ("do_uncompress: returning %u bytes\n", (unsigned)*ret_len);
+  return rc;
+}
+
+
+int
+compress_filter_zstd (void *opaque, int control,
+                      IOBUF a, byte *buf, size_t *ret_len)
+{
+  size_t size = *ret_len;
+  compress_filter_context_t *zfx = opaque;
+  struct zstd_state_s *st = zfx->opaque;
+  int rc = 0;
+
+  if (control == IOBUFCTRL_UNDERFLOW)
+    {
+      if (!zfx->status)
+        {
+          st = zfx->opaque = xmalloc_clear (sizeof *st);
+          init_uncompress (zfx, st);
+          zfx->status = 1;
+        }
+
+      rc = do_uncompress (zfx, st, a, buf, size, ret_len);
+    }
+  else if (control == IOBUFCTRL_FLUSH)
+    {
+      if (!zfx->status)
+        {
+          PACKET pkt;
+          PKT_compressed cd;
+
+          if (zfx->algo != COMPRESS_ALGO_ZSTD)
+            BUG ();
+          memset (&cd, 0, sizeof cd);
+          cd.len = 0;
+          cd.algorithm = zfx->algo;
+          init_packet (&pkt);
+          pkt.pkttype = PKT_COMPRESSED;
+          pkt.pkt.compressed = &cd;
+          if (build_packet (a, &pkt))
+            log_bug ("build_packet(PKT_COMPRESSED) failed\n");
+          st = zfx->opaque = xmalloc_clear (sizeof *st);
+          init_compress (zfx, st);
+          zfx->status = 2;
+        }
+
+      rc = do_compress (zfx, st, ZSTD_e_continue, buf, size, a);
+    }
+  else if (control == IOBUFCTRL_FREE)
+    {
+      if (zfx->status == 1)
+        {
+          ZSTD_freeDCtx (st->dctx);
+          xfree (st);
+          zfx->opaque = NULL;
+          xfree (zfx->outbuf); zfx->outbuf = NULL;
+        }
+      else if (zfx->status == 2)
+        {
+          rc = do_compress (zfx, st, ZSTD_e_end, NULL, 0, a);
+          ZSTD_freeCCtx (st->cctx);
+          xfree (st);
+          zfx->opaque = NULL;
+          xfree (zfx->outbuf); zfx->outbuf = NULL;
+        }
+      if (zfx->release)
+        zfx->release (zfx);
+    }
+  else if (control == IOBUFCTRL_DESC)
+    mem2str (buf, "compress_filter", *ret_len);
+  return rc;
+}
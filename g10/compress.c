@@ -43,6 +43,8 @@
 #include "filter.h"
 #include "main.h"
 #include "options.h"
+#include "../common/status.h"
+#include "../common/i18n.h"
 
 
 #ifdef __riscos__
@@ -55,8 +57,24 @@
 
 int compress_filter_bz2( void *opaque, int control,
 			 IOBUF a, byte *buf, size_t *ret_len);
+int compress_filter_zstd (void *opaque, int control,
+                          IOBUF a, byte *buf, size_t *ret_len);
 
 #ifdef HAVE_ZIP
+/* Return the compression level to use for ZIP and ZLIB.  */
+static int
+zip_compress_level (void)
+{
+  if (opt.compress_level >= 1 && opt.compress_level <= 9)
+    return opt.compress_level;
+  else if (opt.compress_level == -1)
+    return Z_DEFAULT_COMPRESSION;
+
+  log_error ("invalid compression level; using default level\n");
+  return Z_DEFAULT_COMPRESSION;
+}
+
+
 static void
 init_compress( compress_filter_context_t *zfx, z_stream *zs )
 {
@@ -70,14 +88,7 @@ init_compress( compress_filter_context_t *zfx, z_stream *zs )
         zlib_initialized = riscos_load_module("ZLib", zlib_path, 1);
 #endif
 
-    if( opt.compress_level >= 1 && opt.compress_level <= 9 )
-	level = opt.compress_level;
-    else if( opt.compress_level == -1 )
-	level = Z_DEFAULT_COMPRESSION;
-    else {
-	log_error("invalid compression level; using default level\n");
-	level = Z_DEFAULT_COMPRESSION;
-    }
+    level = zip_compress_level ();
 
     if( (rc = zfx->algo == 1? deflateInit2( zs, level, Z_DEFLATED,
 					    -13, 8, Z_DEFAULT_STRATEGY)
@@ -89,7 +100,9 @@ init_compress( compress_filter_context_t *zfx, z_stream *zs )
 						       "unknown error" );
     }
 
-    zfx->outbufsize = 8192;
+    /* Use the size of the pipeline buffers so that the output can be
+     * handed over to the next filter without copying.  */
+    zfx->outbufsize = iobuf_set_buffer_size (0) * 1024;
     zfx->outbuf = xmalloc( zfx->outbufsize );
 }
 
@@ -122,7 +135,7 @@ do_compress( compress_filter_context_t *zfx, z_stream *zs, int flush, IOBUF a )
 		(unsigned)zs->avail_in, (unsigned)zs->avail_out,
 					       (unsigned)n, zrc );
 
-	if( (rc=iobuf_write( a, zfx->outbuf, n )) ) {
+	if( (rc=iobuf_write_handoff( a, zfx->outbuf, n )) ) {
 	    log_debug("deflate: iobuf_write failed\n");
 	    return rc;
 	}
@@ -130,6 +143,321 @@ do_compress( compress_filter_context_t *zfx, z_stream *zs, int flush, IOBUF a )
     return 0;
 }
 
+/* The size of the blocks compressed independently by the parallel
+ * compression.  */
+#define COMPRESS_PARALLEL_BLOCKSIZE (128*1024)
+
+/* A block slot for the parallel compression.  Each block is
+ * compressed using the trailing window of the input preceding it as
+ * dictionary; that dictionary is stored in front of the block so
+ * that DATA + window is the start of the block.  */
+struct compress_block_s
+{
+  z_stream zs;            /* A raw deflate stream used only for this slot. */
+  byte *data;             /* Buffer for the dictionary and the block.  */
+  size_t dictlen;         /* Used length of the dictionary.  */
+  size_t datalen;         /* Used length of the block.  */
+  byte *out;              /* Buffer for the compressed block.  */
+  size_t outsize;         /* Allocated size of OUT.  */
+  size_t outlen;          /* Used length of OUT.  */
+  uLong adler;            /* Adler-32 of the block (ZLIB only).  */
+  int final;              /* This is the last block of the stream.  */
+  gpg_error_t err;        /* The result of the compression.  */
+};
+
+/* The state of the parallel compression.  Full blocks are collected
+ * until all slots are filled; they are then compressed concurrently
+ * and written out in their original order.  Each block except for the
+ * last ends with a sync flush so that the concatenation of the
+ * compressed blocks is a single valid deflate stream.  */
+struct compress_parallel_s
+{
+  int zlib;         /* Write a ZLIB header and trailer.  */
+  size_t window;    /* Size of the deflate window.  */
+  uLong adler;      /* Adler-32 of the data compressed so far.  */
+  int nslots;       /* Allocated number of slots.  */
+  int used;         /* Number of slots with a full block.  */
+  struct compress_block_s slots[1];
+};
+
+
+/* Release the parallel compression state P.  */
+static void
+release_parallel (struct compress_parallel_s *p)
+{
+  int i;
+
+  if (!p)
+    return;
+  for (i=0; i < p->nslots; i++)
+    {
+      if (p->slots[i].out)
+        deflateEnd (&p->slots[i].zs);
+      xfree (p->slots[i].data);
+      xfree (p->slots[i].out);
+    }
+  xfree (p);
+}
+
+
+/* Prepare ZFX for the parallel compression if this has been
+ * requested.  Returns true if the parallel compression is used; on
+ * error we fall back to the standard compression.  */
+static int
+setup_parallel (compress_filter_context_t *zfx)
+{
+  gpg_error_t err = 0;
+  struct compress_parallel_s *p;
+  int i, level, wbits;
+
+  if (opt.compress_jobs < 2)
+    return 0;
+
+  p = xtrycalloc (1, sizeof *p + (opt.compress_jobs - 1) * sizeof *p->slots);
+  if (!p)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  level = zip_compress_level ();
+  /* See init_compress for the window sizes.  */
+  wbits = zfx->algo == COMPRESS_ALGO_ZIP? 13 : 15;
+  p->zlib = zfx->algo == COMPRESS_ALGO_ZLIB;
+  p->window = (size_t)1 << wbits;
+  p->adler = adler32 (0L, Z_NULL, 0);
+  p->nslots = opt.compress_jobs;
+  for (i=0; i < p->nslots; i++)
+    {
+      struct compress_block_s *slot = p->slots + i;
+
+      slot->data = xtrymalloc (p->window + COMPRESS_PARALLEL_BLOCKSIZE);
+      if (!slot->data)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      if (deflateInit2 (&slot->zs, level, Z_DEFLATED, -wbits, 8,
+                        Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+          err = gpg_error (GPG_ERR_INTERNAL);
+          break;
+        }
+      /* Add some room for the sync flush marker.  */
+      slot->outsize = deflateBound (&slot->zs, COMPRESS_PARALLEL_BLOCKSIZE)+64;
+      slot->out = xtrymalloc (slot->outsize);
+      if (!slot->out)
+        {
+          err = gpg_error_from_syserror ();
+          deflateEnd (&slot->zs);
+          break;
+        }
+    }
+  if (err)
+    {
+      release_parallel (p);
+      goto leave;
+    }
+
+  if (DBG_FILTER)
+    log_debug ("using %d threads for the compression\n", p->nslots);
+  zfx->parallel = p;
+
+ leave:
+  if (err)
+    log_info ("parallel compression disabled: %s\n", gpg_strerror (err));
+  return !err;
+}
+
+
+/* Worker for run_parallel to compress the block in slot IDX.  */
+static void
+compress_block_job (void *opaque, int idx)
+{
+  struct compress_parallel_s *p = opaque;
+  struct compress_block_s *slot = p->slots + idx;
+  byte *block = slot->data + p->window;
+  int zrc, ok;
+
+  slot->outlen = 0;
+  slot->err = 0;
+  if (deflateReset (&slot->zs) != Z_OK
+      || (slot->dictlen
+          && deflateSetDictionary (&slot->zs,
+                                   BYTEF_CAST (block - slot->dictlen),
+                                   slot->dictlen) != Z_OK))
+    {
+      slot->err = gpg_error (GPG_ERR_INTERNAL);
+      return;
+    }
+
+  slot->zs.next_in = BYTEF_CAST (block);
+  slot->zs.avail_in = slot->datalen;
+  slot->zs.next_out = BYTEF_CAST (slot->out);
+  slot->zs.avail_out = slot->outsize;
+  zrc = deflate (&slot->zs, slot->final? Z_FINISH : Z_SYNC_FLUSH);
+  if (slot->final)
+    ok = zrc == Z_STREAM_END;
+  else /* A sync flush is complete only if there is output space left.  */
+    ok = zrc == Z_OK && !slot->zs.avail_in && slot->zs.avail_out;
+  if (!ok)
+    {
+      slot->err = gpg_error (GPG_ERR_COMPR_ALGO);
+      return;
+    }
+  slot->outlen = slot->outsize - slot->zs.avail_out;
+
+  if (p->zlib)
+    slot->adler = adler32 (adler32 (0L, Z_NULL, 0),
+                           BYTEF_CAST (block), slot->datalen);
+}
+
+
+/* Copy the trailing window of the input up to and including slot SRC
+ * into the dictionary of slot DST.  */
+static void
+set_dictionary (struct compress_parallel_s *p,
+                struct compress_block_s *dst,
+                const struct compress_block_s *src)
+{
+  size_t n = src->dictlen + src->datalen;
+
+  if (n > p->window)
+    n = p->window;
+  memmove (dst->data + p->window - n,
+           src->data + p->window + src->datalen - n, n);
+  dst->dictlen = n;
+}
+
+
+/* Compress the used slots and, if FINAL is set, the partly filled
+ * slot following them as last block.  Write the results to A.  */
+static gpg_error_t
+flush_parallel (compress_filter_context_t *zfx, iobuf_t a, int final)
+{
+  struct compress_parallel_s *p = zfx->parallel;
+  struct compress_block_s *slot;
+  gpg_error_t err = 0;
+  int i, njobs;
+
+  njobs = p->used;
+  if (final)
+    p->slots[njobs++].final = 1;
+
+  if (DBG_FILTER)
+    log_debug ("compressing %d blocks%s\n", njobs, final? " (final)":"");
+  run_parallel (p->nslots, njobs, compress_block_job, p);
+
+  for (i=0; i < njobs; i++)
+    {
+      slot = p->slots + i;
+      err = slot->err;
+      if (err)
+        {
+          log_error ("compressing block failed: %s\n", gpg_strerror (err));
+          break;
+        }
+      if (p->zlib)
+        p->adler = adler32_combine (p->adler, slot->adler, slot->datalen);
+      err = iobuf_write_handoff (a, slot->out, slot->outlen);
+      if (err)
+        break;
+    }
+
+  if (!err && !final)
+    {
+      /* Start the next round with the tail of the last block.  */
+      set_dictionary (p, p->slots, p->slots + p->used - 1);
+      for (i=0; i < p->nslots; i++)
+        p->slots[i].datalen = 0;
+    }
+  p->used = 0;
+
+  return err;
+}
+
+
+/* The flush sub-function of compress_filter for the parallel
+ * compression.  */
+static gpg_error_t
+do_compress_parallel (compress_filter_context_t *zfx, iobuf_t a,
+                      const byte *buf, size_t size)
+{
+  struct compress_parallel_s *p = zfx->parallel;
+  struct compress_block_s *slot;
+  gpg_error_t err = 0;
+  size_t n;
+
+  while (size)
+    {
+      slot = p->slots + p->used;
+      n = COMPRESS_PARALLEL_BLOCKSIZE - slot->datalen;
+      if (n > size)
+        n = size;
+      memcpy (slot->data + p->window + slot->datalen, buf, n);
+      slot->datalen += n;
+      buf  += n;
+      size -= n;
+
+      if (slot->datalen == COMPRESS_PARALLEL_BLOCKSIZE)
+        {
+          if (++p->used == p->nslots)
+            {
+              err = flush_parallel (zfx, a, 0);
+              if (err)
+                break;
+            }
+          else
+            set_dictionary (p, slot + 1, slot);
+        }
+    }
+
+  return err;
+}
+
+
+/* Write the ZLIB header for the parallel compression to A.  */
+static gpg_error_t
+write_zlib_header (iobuf_t a)
+{
+  byte header[2];
+  unsigned int value;
+  int level, flevel;
+
+  /* This is the same header as written by deflate for a 32k window.  */
+  level = zip_compress_level ();
+  if (level == Z_DEFAULT_COMPRESSION)
+    level = 6;
+  flevel = level < 2? 0 : level < 6? 1 : level == 6? 2 : 3;
+  value = ((Z_DEFLATED + ((15 - 8) << 4)) << 8) | (flevel << 6);
+  value += 31 - (value % 31);
+  header[0] = value >> 8;
+  header[1] = value;
+  return iobuf_write (a, header, 2);
+}
+
+
+/* Finish the parallel compression by compressing the last block and
+ * writing the ZLIB trailer.  */
+static gpg_error_t
+finish_parallel (compress_filter_context_t *zfx, iobuf_t a)
+{
+  struct compress_parallel_s *p = zfx->parallel;
+  gpg_error_t err;
+  byte trailer[4];
+
+  err = flush_parallel (zfx, a, 1);
+  if (!err && p->zlib)
+    {
+      trailer[0] = p->adler >> 24;
+      trailer[1] = p->adler >> 16;
+      trailer[2] = p->adler >> 8;
+      trailer[3] = p->adler;
+      err = iobuf_write (a, trailer, 4);
+    }
+  return err;
+}
+
+
 static void
 init_uncompress( compress_filter_context_t *zfx, z_stream *zs )
 {
@@ -153,7 +481,8 @@ init_uncompress( compress_filter_context_t *zfx, z_stream *zs )
 						       "unknown error" );
     }
 
-    zfx->inbufsize = 2048;
+    /* See init_compress for the buffer size.  */
+    zfx->inbufsize = iobuf_set_buffer_size (0) * 1024;
     zfx->inbuf = xmalloc( zfx->inbufsize );
     zs->avail_in = 0;
 }
@@ -258,14 +587,27 @@ compress_filter( void *opaque, int control,
 	    pkt.pkt.compressed = &cd;
 	    if( build_packet( a, &pkt ))
 		log_bug("build_packet(PKT_COMPRESSED) failed\n");
-	    zs = zfx->opaque = xmalloc_clear( sizeof *zs );
-	    init_compress( zfx, zs );
-	    zfx->status = 2;
+	    if (setup_parallel (zfx)) {
+		zfx->status = 3;
+		if (zfx->parallel->zlib)
+		    rc = write_zlib_header (a);
+	    }
+	    else {
+		zs = zfx->opaque = xmalloc_clear( sizeof *zs );
+		init_compress( zfx, zs );
+		zfx->status = 2;
+	    }
 	}
 
-	zs->next_in = BYTEF_CAST (buf);
-	zs->avail_in = size;
-	rc = do_compress( zfx, zs, Z_NO_FLUSH, a );
+	if (zfx->status == 3) {
+	    if (!rc)
+		rc = do_compress_parallel (zfx, a, buf, size);
+	}
+	else {
+	    zs->next_in = BYTEF_CAST (buf);
+	    zs->avail_in = size;
+	    rc = do_compress( zfx, zs, Z_NO_FLUSH, a );
+	}
     }
     else if( control == IOBUFCTRL_FREE ) {
 	if( zfx->status == 1 ) {
@@ -283,6 +625,11 @@ compress_filter( void *opaque, int control,
 	    zfx->opaque = NULL;
 	    xfree(zfx->outbuf); zfx->outbuf = NULL;
 	}
+	else if( zfx->status == 3 ) {
+	    rc = finish_parallel (zfx, a);
+	    release_parallel (zfx->parallel);
+	    zfx->parallel = NULL;
+	}
         if (zfx->release)
           zfx->release (zfx);
     }
@@ -292,6 +639,64 @@ compress_filter( void *opaque, int control,
 }
 #endif /*HAVE_ZIP*/
 
+
+/* The number of bytes skip_compression_p looks at to decide whether
+ * the input is worth compressing and the minimum number required for
+ * a decision.  */
+#define COMPRESS_PROBE_SIZE    (64*1024)
+#define COMPRESS_PROBE_MINSIZE 1024
+
+/* Return true if the compression of the data to be read from INP
+ * shall be skipped because it looks incompressible.  FNAME is the
+ * name of the input used for diagnostics; NULL stands for stdin.  The
+ * first bytes of INP are peeked at without consuming them and the
+ * entropy of their byte distribution is estimated.  The collision
+ * entropy -log2(sum p_i^2) is used because it can be computed without
+ * floating point; it is a lower bound of the Shannon entropy.  The
+ * data is considered incompressible if that entropy is at least 7.8
+ * bits per byte, which is for example the case for JPEG, MP4, or
+ * encrypted data.  */
+int
+skip_compression_p (iobuf_t inp, const char *fname)
+{
+  byte *buf;
+  int n, i;
+  u32 count[256];
+  uint64_t sumsq, expected;
+
+  buf = xtrymalloc (COMPRESS_PROBE_SIZE);
+  if (!buf)
+    return 0;
+  n = iobuf_peek (inp, buf, COMPRESS_PROBE_SIZE);
+  if (n < COMPRESS_PROBE_MINSIZE)
+    {
+      xfree (buf);
+      return 0;
+    }
+
+  memset (count, 0, sizeof count);
+  for (i=0; i < n; i++)
+    count[buf[i]]++;
+  xfree (buf);
+
+  sumsq = 0;
+  for (i=0; i < 256; i++)
+    sumsq += (uint64_t)count[i] * count[i];
+
+  /* For uniformly distributed data the expected value of SUMSQ is
+   * about n^2/256 + n.  Allow for 2^0.2 (~294/256) times that value,
+   * which corresponds to an entropy of 7.8 bits.  */
+  expected = (uint64_t)n * n / 256 + n;
+  if (sumsq * 256 > expected * 294)
+    return 0;
+
+  if (opt.verbose)
+    log_info (_("'%s' looks incompressible; not compressing\n"),
+              print_fname_stdin (fname));
+  write_status_text (STATUS_COMPRESSION_SKIPPED, "entropy");
+  return 1;
+}
+
 static void
 release_context (compress_filter_context_t *ctx)
 {
@@ -369,6 +774,13 @@ push_compress_filter2(IOBUF out,compress_filter_context_t *zfx,
       break;
 #endif
 
+#ifdef HAVE_ZSTD
+    case COMPRESS_ALGO_ZSTD:
+      iobuf_push_filter2(out,compress_filter_zstd,zfx,rel);
+      err = 0;
+      break;
+#endif
+
     default:
       BUG();
     }
@@ -43,6 +43,15 @@
    this is NULL.  */
 static estream_t statusfp;
 
+/* A status line is assembled in such a buffer so that it can be
+ * written to STATUSFP with one call.  Longer lines are written in
+ * several parts.  */
+struct status_line_s
+{
+  size_t len;
+  char buf[1024];
+};
+
 
 static void
 progress_cb (void *ctx, const char *what, int printchar,
@@ -127,6 +136,82 @@ set_status_fd (int fd)
 }
 
 
+/* Append the N bytes at BUFFER to the status LINE.  */
+static void
+status_line_write (struct status_line_s *line, const void *buffer, size_t n)
+{
+  const char *s = buffer;
+  size_t nbytes;
+
+  while (n)
+    {
+      if (line->len == sizeof line->buf)
+        {
+          es_write (statusfp, line->buf, line->len, NULL);
+          line->len = 0;
+        }
+      nbytes = sizeof line->buf - line->len;
+      if (nbytes > n)
+        nbytes = n;
+      memcpy (line->buf + line->len, s, nbytes);
+      line->len += nbytes;
+      s += nbytes;
+      n -= nbytes;
+    }
+}
+
+
+/* Append the string S to the status LINE.  */
+static void
+status_line_puts (struct status_line_s *line, const char *s)
+{
+  status_line_write (line, s, strlen (s));
+}
+
+
+/* Append the string S to the status LINE with CR and LF C-style
+ * escaped.  */
+static void
+status_line_escaped (struct status_line_s *line, const char *s)
+{
+  size_t n;
+
+  while (*s)
+    {
+      n = strcspn (s, "\r\n");
+      status_line_write (line, s, n);
+      s += n;
+      if (*s)
+        {
+          status_line_write (line, *s == '\n'? "\\n" : "\\r", 2);
+          s++;
+        }
+    }
+}
+
+
+/* Start a new status LINE with the keyword for NO.  */
+static void
+status_line_begin (struct status_line_s *line, int no)
+{
+  line->len = 0;
+  status_line_puts (line, "[GNUPG:] ");
+  status_line_puts (line, get_status_string (no));
+}
+
+
+/* Terminate the status LINE and write it to the status stream.  */
+static void
+status_line_end (struct status_line_s *line)
+{
+  status_line_write (line, "\n", 1);
+  es_write (statusfp, line->buf, line->len, NULL);
+  line->len = 0;
+  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
+    g10_exit (0);
+}
+
+
 int
 is_status_enabled ()
 {
@@ -134,6 +219,41 @@ is_status_enabled ()
 }
 
 
+/* Return true if status lines are written to es_stdout.  */
+int
+is_status_stdout (void)
+{
+  return statusfp && statusfp == es_stdout;
+}
+
+
+/* Replace the stream used for status output by FP and return the
+ * stream used so far.  This is used by the worker processes of
+ * --jobs to collect the status lines of one file in memory.  */
+estream_t
+status_redirect (estream_t fp)
+{
+  estream_t oldfp = statusfp;
+
+  statusfp = fp;
+  return oldfp;
+}
+
+
+/* Write the LEN bytes of already formatted status lines from BUFFER
+ * to the status stream.  */
+void
+write_status_raw (const void *buffer, size_t len)
+{
+  if (!statusfp || !len)
+    return;
+
+  es_write (statusfp, buffer, len, NULL);
+  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
+    g10_exit (0);
+}
+
+
 void
 write_status ( int no )
 {
@@ -147,37 +267,25 @@ write_status ( int no )
 void
 write_status_strings (int no, const char *text, ...)
 {
+  struct status_line_s line;
   va_list arg_ptr;
   const char *s;
 
   if (!statusfp || !status_currently_allowed (no) )
     return;  /* Not enabled or allowed. */
 
-  es_fputs ("[GNUPG:] ", statusfp);
-  es_fputs (get_status_string (no), statusfp);
+  status_line_begin (&line, no);
   if ( text )
     {
-      es_putc ( ' ', statusfp);
+      status_line_write (&line, " ", 1);
       va_start (arg_ptr, text);
       s = text;
       do
-        {
-          for (; *s; s++)
-            {
-              if (*s == '\n')
-                es_fputs ("\\n", statusfp);
-              else if (*s == '\r')
-                es_fputs ("\\r", statusfp);
-              else
-                es_fputc (*(const byte *)s, statusfp);
-            }
-        }
+        status_line_escaped (&line, s);
       while ((s = va_arg (arg_ptr, const char*)));
       va_end (arg_ptr);
     }
-  es_putc ('\n', statusfp);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  status_line_end (&line);
 }
 
 
@@ -193,17 +301,17 @@ write_status_text (int no, const char *text)
 void
 write_status_printf (int no, const char *format, ...)
 {
+  struct status_line_s line;
   va_list arg_ptr;
   char *buf;
 
   if (!statusfp || !status_currently_allowed (no) )
     return;  /* Not enabled or allowed. */
 
-  es_fputs ("[GNUPG:] ", statusfp);
-  es_fputs (get_status_string (no), statusfp);
+  status_line_begin (&line, no);
   if (format)
     {
-      es_putc ( ' ', statusfp);
+      status_line_write (&line, " ", 1);
       va_start (arg_ptr, format);
       buf = gpgrt_vbsprintf (format, arg_ptr);
       if (!buf)
@@ -211,29 +319,13 @@ write_status_printf (int no, const char *format, ...)
                    gpg_strerror (gpg_err_code_from_syserror ()));
       else
         {
-          if (strpbrk (buf, "\r\n"))
-            {
-              const byte *s;
-              for (s=buf; *s; s++)
-                {
-                  if (*s == '\n')
-                    es_fputs ("\\n", statusfp);
-                  else if (*s == '\r')
-                    es_fputs ("\\r", statusfp);
-                  else
-                    es_fputc (*s, statusfp);
-                }
-            }
-          else
-            es_fputs (buf, statusfp);
+          status_line_escaped (&line, buf);
           gpgrt_free (buf);
         }
 
       va_end (arg_ptr);
     }
-  es_putc ('\n', statusfp);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  status_line_end (&line);
 }
 
 
@@ -293,7 +385,9 @@ void
 write_status_text_and_buffer (int no, const char *string,
                               const char *buffer, size_t len, int wrap)
 {
-  const char *s, *text;
+  struct status_line_s line;
+  const char *s;
+  char hexbuf[4];
   int esc, first;
   int lower_limit = ' ';
   size_t n, count, dowrap;
@@ -307,22 +401,24 @@ write_status_text_and_buffer (int no, const char *string,
       wrap = 0;
     }
 
-  text = get_status_string (no);
+  line.len = 0;
   count = dowrap = first = 1;
   do
     {
       if (dowrap)
         {
-          es_fprintf (statusfp, "[GNUPG:] %s ", text);
+          status_line_puts (&line, "[GNUPG:] ");
+          status_line_puts (&line, get_status_string (no));
+          status_line_write (&line, " ", 1);
           count = dowrap = 0;
           if (first && string)
             {
-              es_fputs (string, statusfp);
+              status_line_puts (&line, string);
               count += strlen (string);
               /* Make sure that there is a space after the string.  */
               if (*string && string[strlen (string)-1] != ' ')
                 {
-                  es_putc (' ', statusfp);
+                  status_line_write (&line, " ", 1);
                   count++;
                 }
             }
@@ -344,22 +440,21 @@ write_status_text_and_buffer (int no, const char *string,
           s--; n++;
         }
       if (s != buffer)
-        es_fwrite (buffer, s-buffer, 1, statusfp);
+        status_line_write (&line, buffer, s-buffer);
       if ( esc )
         {
-          es_fprintf (statusfp, "%%%02X", *(const byte*)s );
+          snprintf (hexbuf, sizeof hexbuf, "%%%02X", *(const byte*)s);
+          status_line_write (&line, hexbuf, 3);
           s++; n--;
         }
       buffer = s;
       len = n;
       if (dowrap && len)
-        es_putc ('\n', statusfp);
+        status_line_write (&line, "\n", 1);
     }
   while (len);
 
-  es_putc ('\n',statusfp);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  status_line_end (&line);
 }
 
 
@@ -30,6 +30,11 @@
 #include "../common/i18n.h"
 #include "../common/status.h"
 #include "../common/compliance.h"
+#include "main.h"
+
+
+/* The smallest chunk size for which we use parallel decryption.  */
+#define AEAD_PARALLEL_MIN_CHUNKSIZE (64*1024)
 
 
 static int aead_decode_filter (void *opaque, int control, iobuf_t a,
@@ -39,6 +44,32 @@ static int mdc_decode_filter ( void *opaque, int control, IOBUF a,
 static int decode_filter ( void *opaque, int control, IOBUF a,
 					byte *buf, size_t *ret_len);
 
+/* A chunk slot for the parallel AEAD decryption.  */
+struct aead_dec_slot_s
+{
+  gcry_cipher_hd_t hd;    /* A cipher handle used only for this slot.  */
+  uint64_t chunkindex;    /* The index of the chunk in this slot.  */
+  byte *data;             /* Buffer for a chunk, its tag and 16 extra
+                           * bytes to detect an EOF.  */
+  size_t datalen;         /* Length of the chunk's data in DATA.  */
+  gpg_error_t err;        /* The result of the decryption.  */
+};
+
+/* The state of the parallel AEAD decryption.  A batch of chunks is
+ * read and then decrypted and authenticated concurrently; the
+ * plaintext is delivered in the original order.  */
+struct aead_dec_parallel_s
+{
+  struct decode_filter_context_s *dfx;
+  int nslots;      /* Allocated number of slots.  */
+  int used;        /* Number of slots of the current batch.  */
+  int outslot;     /* The slot from which we deliver data.  */
+  size_t outpos;   /* The offset into that slot.  */
+  unsigned int final_checked : 1; /* The final tag has been verified.  */
+  struct aead_dec_slot_s slots[1];
+};
+
+
 /* Our context object.  */
 struct decode_filter_context_s
 {
@@ -94,10 +125,30 @@ struct decode_filter_context_s
   /* Remaining bytes in the packet according to the packet header.
    * Not used if PARTIAL is true.  */
   size_t length;
+
+  /* The state of the parallel AEAD decryption or NULL.  */
+  struct aead_dec_parallel_s *parallel;
 };
 typedef struct decode_filter_context_s *decode_filter_ctx_t;
 
 
+/* Release the parallel decryption state P.  */
+static void
+release_aead_parallel (struct aead_dec_parallel_s *p)
+{
+  int i;
+
+  if (!p)
+    return;
+  for (i=0; i < p->nslots; i++)
+    {
+      gcry_cipher_close (p->slots[i].hd);
+      xfree (p->slots[i].data);
+    }
+  xfree (p);
+}
+
+
 /* Helper to release the decode context.  */
 static void
 release_dfx_context (decode_filter_ctx_t dfx)
@@ -108,6 +159,8 @@ release_dfx_context (decode_filter_ctx_t dfx)
   log_assert (dfx->refcount);
   if ( !--dfx->refcount )
     {
+      release_aead_parallel (dfx->parallel);
+      dfx->parallel = NULL;
       gcry_cipher_close (dfx->cipher_hd);
       dfx->cipher_hd = NULL;
       gcry_md_close (dfx->mdc_hash);
@@ -117,12 +170,13 @@ release_dfx_context (decode_filter_ctx_t dfx)
 }
 
 
-/* Set the nonce and the additional data for the current chunk.  This
- * also reset the decryption machinery * so that the handle can be
- * used for a new chunk.  If FINAL is set the final AEAD chunk is
- * processed.  */
+/* Set the nonce and the additional data for the chunk CHUNKINDEX
+ * into the cipher handle HD.  This also reset the decryption
+ * machinery so that the handle can be used for a new chunk.  If FINAL
+ * is set the final AEAD chunk is processed.  */
 static gpg_error_t
-aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
+aead_set_nonce_and_ad (decode_filter_ctx_t dfx, gcry_cipher_hd_t hd,
+                       uint64_t chunkindex, int final)
 {
   gpg_error_t err;
   unsigned char ad[21];
@@ -144,18 +198,18 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
     default:
       BUG ();
     }
-  nonce[i++] ^= dfx->chunkindex >> 56;
-  nonce[i++] ^= dfx->chunkindex >> 48;
-  nonce[i++] ^= dfx->chunkindex >> 40;
-  nonce[i++] ^= dfx->chunkindex >> 32;
-  nonce[i++] ^= dfx->chunkindex >> 24;
-  nonce[i++] ^= dfx->chunkindex >> 16;
-  nonce[i++] ^= dfx->chunkindex >>  8;
-  nonce[i++] ^= dfx->chunkindex;
+  nonce[i++] ^= chunkindex >> 56;
+  nonce[i++] ^= chunkindex >> 48;
+  nonce[i++] ^= chunkindex >> 40;
+  nonce[i++] ^= chunkindex >> 32;
+  nonce[i++] ^= chunkindex >> 24;
+  nonce[i++] ^= chunkindex >> 16;
+  nonce[i++] ^= chunkindex >>  8;
+  nonce[i++] ^= chunkindex;
 
   if (DBG_CRYPTO)
     log_printhex (nonce, i, "nonce:");
-  err = gcry_cipher_setiv (dfx->cipher_hd, nonce, i);
+  err = gcry_cipher_setiv (hd, nonce, i);
   if (err)
     return err;
 
@@ -164,14 +218,14 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
   ad[2] = dfx->cipher_algo;
   ad[3] = dfx->aead_algo;
   ad[4] = dfx->chunkbyte;
-  ad[5] = dfx->chunkindex >> 56;
-  ad[6] = dfx->chunkindex >> 48;
-  ad[7] = dfx->chunkindex >> 40;
-  ad[8] = dfx->chunkindex >> 32;
-  ad[9] = dfx->chunkindex >> 24;
-  ad[10]= dfx->chunkindex >> 16;
-  ad[11]= dfx->chunkindex >>  8;
-  ad[12]= dfx->chunkindex;
+  ad[5] = chunkindex >> 56;
+  ad[6] = chunkindex >> 48;
+  ad[7] = chunkindex >> 40;
+  ad[8] = chunkindex >> 32;
+  ad[9] = chunkindex >> 24;
+  ad[10]= chunkindex >> 16;
+  ad[11]= chunkindex >>  8;
+  ad[12]= chunkindex;
   if (final)
     {
       ad[13] = dfx->total >> 56;
@@ -185,7 +239,7 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
     }
   if (DBG_CRYPTO)
     log_printhex (ad, final? 21 : 13, "authdata:");
-  return gcry_cipher_authenticate (dfx->cipher_hd, ad, final? 21 : 13);
+  return gcry_cipher_authenticate (hd, ad, final? 21 : 13);
 }
 
 
@@ -211,6 +265,65 @@ aead_checktag (decode_filter_ctx_t dfx, int final, const void *tagbuf)
 }
 
 
+/* Prepare DFX for the parallel AEAD decryption if this has been
+ * requested.  On error we fall back to the standard decryption.  */
+static void
+aead_setup_parallel (decode_filter_ctx_t dfx, DEK *dek,
+                     enum gcry_cipher_modes ciphermode)
+{
+  gpg_error_t err;
+  struct aead_dec_parallel_s *p;
+  int i;
+
+  if (opt.aead_jobs < 2 || dfx->chunksize < AEAD_PARALLEL_MIN_CHUNKSIZE)
+    return;
+  if (dfx->chunksize > ((size_t)(-1) - 32) / opt.aead_jobs)
+    {
+      err = gpg_error (GPG_ERR_TOO_LARGE);
+      goto leave;
+    }
+
+  p = xtrycalloc (1, sizeof *p + (opt.aead_jobs - 1) * sizeof *p->slots);
+  if (!p)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  p->dfx = dfx;
+  p->nslots = opt.aead_jobs;
+  for (i=0; i < p->nslots; i++)
+    {
+      p->slots[i].data = xtrymalloc (dfx->chunksize + 32);
+      if (!p->slots[i].data)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      err = openpgp_cipher_open (&p->slots[i].hd, dfx->cipher_algo,
+                                 ciphermode, GCRY_CIPHER_SECURE);
+      if (!err)
+        err = gcry_cipher_setkey (p->slots[i].hd, dek->key, dek->keylen);
+      if (gpg_err_code (err) == GPG_ERR_WEAK_KEY)
+        err = 0;  /* Already reported for the main handle.  */
+      if (err)
+        break;
+    }
+  if (err)
+    {
+      release_aead_parallel (p);
+      goto leave;
+    }
+
+  if (DBG_FILTER)
+    log_debug ("using %d threads for the AEAD decryption\n", p->nslots);
+  dfx->parallel = p;
+
+ leave:
+  if (err)
+    log_info ("parallel AEAD decryption disabled: %s\n", gpg_strerror (err));
+}
+
+
 /****************
  * Decrypt the data, specified by ED with the key DEK.
  */
@@ -368,6 +481,7 @@ decrypt_data (ctrl_t ctrl, void *procctx, PKT_encrypted *ed, DEK *dek)
           goto leave;
         }
 
+      aead_setup_parallel (dfx, dek, ciphermode);
     }
   else /* CFB encryption.  */
     {
@@ -672,7 +786,8 @@ aead_underflow (decode_filter_ctx_t dfx, iobuf_t a, byte *buf, size_t *ret_len)
       if (!dfx->chunklen)
         {
           /* First data for this chunk - prepare.  */
-          err = aead_set_nonce_and_ad (dfx, 0);
+          err = aead_set_nonce_and_ad (dfx, dfx->cipher_hd,
+                                       dfx->chunkindex, 0);
           if (err)
             goto leave;
         }
@@ -754,7 +869,8 @@ aead_underflow (decode_filter_ctx_t dfx, iobuf_t a, byte *buf, size_t *ret_len)
       if (!dfx->chunklen)
         {
           /* First data for this chunk - prepare.  */
-          err = aead_set_nonce_and_ad (dfx, 0);
+          err = aead_set_nonce_and_ad (dfx, dfx->cipher_hd,
+                                       dfx->chunkindex, 0);
           if (err)
             goto leave;
         }
@@ -803,7 +919,7 @@ aead_underflow (decode_filter_ctx_t dfx, iobuf_t a, byte *buf, size_t *ret_len)
         }
 
       /* Check the final chunk.  */
-      err = aead_set_nonce_and_ad (dfx, 1);
+      err = aead_set_nonce_and_ad (dfx, dfx->cipher_hd, dfx->chunkindex, 1);
       if (err)
         goto leave;
       gcry_cipher_final (dfx->cipher_hd);
@@ -842,6 +958,179 @@ aead_underflow (decode_filter_ctx_t dfx, iobuf_t a, byte *buf, size_t *ret_len)
 }
 
 
+/* Decrypt and authenticate the chunk in slot IDX of the parallel
+ * decryption state OPAQUE.  This is called by run_parallel and thus
+ * must not touch anything but the slot.  */
+static void
+aead_decrypt_chunk_job (void *opaque, int idx)
+{
+  struct aead_dec_parallel_s *p = opaque;
+  struct aead_dec_slot_s *slot = p->slots + idx;
+
+  slot->err = aead_set_nonce_and_ad (p->dfx, slot->hd, slot->chunkindex, 0);
+  if (slot->err)
+    return;
+  gcry_cipher_final (slot->hd);
+  slot->err = gcry_cipher_decrypt (slot->hd, slot->data, slot->datalen,
+                                   NULL, 0);
+  if (!slot->err)
+    slot->err = gcry_cipher_checktag (slot->hd, slot->data + slot->datalen,
+                                      16);
+}
+
+
+/* Read the next batch of chunks from stream A and decrypt them.  */
+static gpg_error_t
+aead_read_batch (decode_filter_ctx_t dfx, iobuf_t a)
+{
+  struct aead_dec_parallel_s *p = dfx->parallel;
+  struct aead_dec_slot_s *slot;
+  gpg_error_t err;
+  size_t len;
+  int i;
+
+  p->used = p->outslot = 0;
+  p->outpos = 0;
+  while (p->used < p->nslots && !dfx->eof_seen)
+    {
+      /* Each slot receives a chunk with its tag and 16 more bytes
+       * which may be the final tag.  They are kept in the holdback
+       * buffer for the next slot.  */
+      slot = p->slots + p->used;
+      len = dfx->holdbacklen;
+      memcpy (slot->data, dfx->holdback, len);
+      dfx->holdbacklen = 0;
+      len = fill_buffer (dfx, a, slot->data, dfx->chunksize + 32, len);
+      if (dfx->eof_seen)
+        {
+          if (len < 16)
+            return gpg_error (GPG_ERR_TRUNCATED);
+          memcpy (dfx->holdback, slot->data + len - 16, 16);
+          dfx->holdbacklen = 16;
+          len -= 16;
+          if (!len)
+            break;  /* Only the final tag.  */
+          if (len < 17)
+            return gpg_error (GPG_ERR_TRUNCATED);
+        }
+      else
+        {
+          memcpy (dfx->holdback, slot->data + dfx->chunksize + 16, 16);
+          dfx->holdbacklen = 16;
+          len = dfx->chunksize + 16;
+        }
+      slot->datalen = len - 16;
+      slot->chunkindex = dfx->chunkindex++;
+      dfx->total += slot->datalen;
+      p->used++;
+    }
+
+  if (DBG_FILTER)
+    log_debug ("decrypting %d chunks up to chunk %ju%s\n",
+               p->used, (uintmax_t)dfx->chunkindex,
+               dfx->eof_seen? " (eof)":"");
+  run_parallel (p->nslots, p->used, aead_decrypt_chunk_job, p);
+
+  if (dfx->eof_seen)
+    {
+      for (i=0; i < p->used; i++)
+        if (p->slots[i].err)
+          return 0;  /* The error is reported when we get to the slot.  */
+
+      /* Check the final chunk.  */
+      err = aead_set_nonce_and_ad (dfx, dfx->cipher_hd, dfx->chunkindex, 1);
+      if (err)
+        return err;
+      gcry_cipher_final (dfx->cipher_hd);
+      /* Decrypt an empty string (using HOLDBACK as a dummy).  */
+      err = gcry_cipher_decrypt (dfx->cipher_hd, dfx->holdback, 0, NULL, 0);
+      if (err)
+        {
+          log_error ("gcry_cipher_decrypt failed (final): %s\n",
+                     gpg_strerror (err));
+          return err;
+        }
+      err = aead_checktag (dfx, 1, dfx->holdback);
+      if (err)
+        return err;
+      p->final_checked = 1;
+    }
+
+  return 0;
+}
+
+
+/* The underflow function of the aead_decode_filter for the parallel
+ * decryption.  */
+static gpg_error_t
+aead_underflow_parallel (decode_filter_ctx_t dfx, iobuf_t a,
+                         byte *buf, size_t *ret_len)
+{
+  struct aead_dec_parallel_s *p = dfx->parallel;
+  struct aead_dec_slot_s *slot;
+  const size_t size = *ret_len;
+  gpg_error_t err = 0;
+  size_t totallen = 0;
+  size_t n;
+
+  while (totallen < size)
+    {
+      if (p->outslot == p->used)
+        {
+          if (p->final_checked)
+            {
+              err = gpg_error (GPG_ERR_EOF);
+              break;
+            }
+          if (totallen)
+            break;  /* Return what we have before reading more.  */
+          err = aead_read_batch (dfx, a);
+          if (err)
+            break;
+          continue;
+        }
+
+      slot = p->slots + p->outslot;
+      if (slot->err)
+        {
+          err = slot->err;
+          log_error ("decrypting chunk %ju failed: %s\n",
+                     (uintmax_t)slot->chunkindex, gpg_strerror (err));
+          break;
+        }
+      n = slot->datalen - p->outpos;
+      if (n > size - totallen)
+        n = size - totallen;
+      memcpy (buf + totallen, slot->data + p->outpos, n);
+      totallen += n;
+      p->outpos += n;
+      if (p->outpos == slot->datalen)
+        {
+          p->outslot++;
+          p->outpos = 0;
+        }
+    }
+
+  if (DBG_FILTER)
+    log_debug ("aead_underflow_parallel: returning %zu (%s)\n",
+               totallen, gpg_strerror (err));
+
+  /* In case of an auth error we map the error code to the same as
+   * used by the MDC decryption.  */
+  if (gpg_err_code (err) == GPG_ERR_CHECKSUM)
+    err = gpg_error (GPG_ERR_BAD_SIGNATURE);
+
+  /* In case of an error we better wipe out the buffer than to convey
+   * partly decrypted data.  */
+  if (err && gpg_err_code (err) != GPG_ERR_EOF)
+    memset (buf, 0, size);
+
+  *ret_len = totallen;
+
+  return err;
+}
+
+
 /* The IOBUF filter used to decrypt AEAD encrypted data.  */
 static int
 aead_decode_filter (void *opaque, int control, IOBUF a,
@@ -850,7 +1139,16 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
   decode_filter_ctx_t dfx = opaque;
   int rc = 0;
 
-  if ( control == IOBUFCTRL_UNDERFLOW && dfx->eof_seen )
+  if ( control == IOBUFCTRL_UNDERFLOW && dfx->parallel )
+    {
+      /* The parallel mode buffers data beyond an EOF.  */
+      log_assert (a);
+
+      rc = aead_underflow_parallel (dfx, a, buf, ret_len);
+      if (gpg_err_code (rc) == GPG_ERR_EOF)
+        rc = -1; /* We need to use the old convention in the filter.  */
+    }
+  else if ( control == IOBUFCTRL_UNDERFLOW && dfx->eof_seen )
     {
       *ret_len = 0;
       rc = -1;
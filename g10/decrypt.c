@@ -177,106 +177,83 @@ decrypt_message_fd (ctrl_t ctrl, int input_fd, int output_fd)
 }
 
 
-void
-decrypt_messages (ctrl_t ctrl, int nfiles, char *files[])
+/* Decrypt the file FILENAME for --decrypt-files.  The output is
+   written to a file with a name derived from FILENAME.  */
+static int
+decrypt_one_message (ctrl_t ctrl, const char *filename)
 {
   IOBUF fp;
   progress_filter_context_t *pfx;
-  char *p, *output = NULL;
-  int rc=0,use_stdin=0;
-  unsigned int lno=0;
-
-  if (opt.outfile)
-    {
-      log_error(_("--output doesn't work for this command\n"));
-      return;
-    }
+  char *p, *output;
+  int rc = 0;
 
   pfx = new_progress_context ();
 
-  if(!nfiles)
-    use_stdin=1;
-
-  for(;;)
+  print_file_status(STATUS_FILE_START, filename, 3);
+  output = make_outfile_name(filename);
+  if (!output)
     {
-      char line[2048];
-      char *filename=NULL;
-
-      if(use_stdin)
-	{
-	  if(fgets(line, DIM(line), stdin))
-	    {
-	      lno++;
-	      if (!*line || line[strlen(line)-1] != '\n')
-		log_error("input line %u too long or missing LF\n", lno);
-	      else
-		{
-		  line[strlen(line)-1] = '\0';
-		  filename=line;
-		}
-	    }
-	}
-      else
-	{
-	  if(nfiles)
-	    {
-	      filename=*files;
-	      nfiles--;
-	      files++;
-	    }
-	}
+      rc = gpg_error (GPG_ERR_GENERAL);
+      goto leave;
+    }
+  fp = iobuf_open(filename);
+  if (fp)
+    iobuf_ioctl (fp, IOBUF_IOCTL_NO_CACHE, 1, NULL);
+  if (fp && is_secured_file (iobuf_get_fd (fp)))
+    {
+      iobuf_close (fp);
+      fp = NULL;
+      gpg_err_set_errno (EPERM);
+    }
+  if (!fp)
+    {
+      rc = gpg_error_from_syserror ();
+      log_error(_("can't open '%s'\n"), print_fname_stdin(filename));
+      goto leave;
+    }
 
-      if(filename==NULL)
-	break;
+  handle_progress (pfx, fp, filename);
 
-      print_file_status(STATUS_FILE_START, filename, 3);
-      output = make_outfile_name(filename);
-      if (!output)
-        goto next_file;
-      fp = iobuf_open(filename);
-      if (fp)
-        iobuf_ioctl (fp, IOBUF_IOCTL_NO_CACHE, 1, NULL);
-      if (fp && is_secured_file (iobuf_get_fd (fp)))
-        {
-          iobuf_close (fp);
-          fp = NULL;
-          gpg_err_set_errno (EPERM);
-        }
-      if (!fp)
+  if (!opt.no_armor)
+    {
+      if (use_armor_filter(fp))
         {
-          log_error(_("can't open '%s'\n"), print_fname_stdin(filename));
-          goto next_file;
+          armor_filter_context_t *afx = new_armor_context ();
+          rc = push_armor_filter (afx, fp);
+          if (rc)
+            log_error("failed to push armor filter");
+          release_armor_context (afx);
         }
+    }
+  rc = proc_packets (ctrl,NULL, fp);
+  iobuf_close(fp);
+  if (rc)
+    log_error("%s: decryption failed: %s\n", print_fname_stdin(filename),
+              gpg_strerror (rc));
+  p = get_last_passphrase();
+  set_next_passphrase(p);
+  xfree (p);
+
+ leave:
+  /* Note that we emit file_done even after an error. */
+  write_status( STATUS_FILE_DONE );
+  xfree(output);
+  reset_literals_seen();
+  release_progress_context (pfx);
+  return rc;
+}
 
-      handle_progress (pfx, fp, filename);
-
-      if (!opt.no_armor)
-        {
-          if (use_armor_filter(fp))
-            {
-              armor_filter_context_t *afx = new_armor_context ();
-              rc = push_armor_filter (afx, fp);
-              if (rc)
-                log_error("failed to push armor filter");
-              release_armor_context (afx);
-            }
-        }
-      rc = proc_packets (ctrl,NULL, fp);
-      iobuf_close(fp);
-      if (rc)
-        log_error("%s: decryption failed: %s\n", print_fname_stdin(filename),
-                  gpg_strerror (rc));
-      p = get_last_passphrase();
-      set_next_passphrase(p);
-      xfree (p);
 
-    next_file:
-      /* Note that we emit file_done even after an error. */
-      write_status( STATUS_FILE_DONE );
-      xfree(output);
-      reset_literals_seen();
+void
+decrypt_messages (ctrl_t ctrl, int nfiles, char *files[])
+{
+  if (opt.outfile)
+    {
+      log_error(_("--output doesn't work for this command\n"));
+      return;
     }
 
+  process_multifile (ctrl, nfiles, files, decrypt_one_message);
+
   set_next_passphrase(NULL);
-  release_progress_context (pfx);
 }
@@ -384,8 +384,14 @@ encrypt_simple (const char *filename, int mode, int use_seskey)
     {
       if (opt.verbose)
         log_info(_("'%s' already compressed\n"), filename);
+      write_status_text (STATUS_COMPRESSION_SKIPPED, "compressed");
       do_compress = 0;
     }
+  else if (!rc && do_compress
+           && cfx.dek
+           && (cfx.dek->use_mdc || cfx.dek->use_aead)
+           && skip_compression_p (inp, filename))
+    do_compress = 0;
 
   if ( rc || (rc = open_outfile (-1, filename, opt.armor? 1:0, 0, &out )))
     {
@@ -783,18 +789,14 @@ encrypt_crypt (ctrl_t ctrl, int filefd, const char *filename,
     for (pkr = pk_list; pkr; pkr = pkr->next)
       {
         PKT_public_key *pk = pkr->pk;
-        unsigned int nbits = nbits_from_pk (pk);
 
-        if (!gnupg_pk_is_compliant (opt.compliance,
-                                    pk->pubkey_algo, pk->pkey, nbits, NULL))
+        if (!pk_is_compliant (opt.compliance, pk, 0, NULL))
           log_info (_("WARNING: key %s is not suitable for encryption"
                       " in %s mode\n"),
                     keystr_from_pk (pk),
                     gnupg_compliance_option_string (opt.compliance));
 
-        if (compliant
-            && !gnupg_pk_is_compliant (CO_DE_VS, pk->pubkey_algo, pk->pkey,
-                                       nbits, NULL))
+        if (compliant && !pk_is_compliant (CO_DE_VS, pk, 0, NULL))
           compliant = 0;
       }
 
@@ -819,8 +821,13 @@ encrypt_crypt (ctrl_t ctrl, int filefd, const char *filename,
     {
       if (opt.verbose)
         log_info(_("'%s' already compressed\n"), filename);
+      write_status_text (STATUS_COMPRESSION_SKIPPED, "compressed");
       do_compress = 0;
     }
+  else if (!rc2 && do_compress
+           && (cfx.dek->use_mdc || cfx.dek->use_aead)
+           && skip_compression_p (inp, filename))
+    do_compress = 0;
   if (rc2)
     {
       rc = rc2;
@@ -1067,24 +1074,16 @@ encrypt_filter (void *opaque, int control,
 }
 
 
-/*
- * Write a pubkey-enc packet for the public key PK to OUT.
- */
-int
-write_pubkey_enc (ctrl_t ctrl,
-                  PKT_public_key *pk, int throw_keyid, DEK *dek, iobuf_t out)
+/* Encrypt the session key DEK for the public key PK and store the
+ * result in ENC.  This function does not take any locks and is thus
+ * also used by the worker threads of write_pubkey_enc_from_list; the
+ * keyid of PK must have been computed before.  */
+static gpg_error_t
+encrypt_session_key (PKT_public_key *pk, DEK *dek, PKT_pubkey_enc *enc)
 {
-  PACKET pkt;
-  PKT_pubkey_enc *enc;
-  int rc;
+  gpg_error_t err;
   gcry_mpi_t frame;
 
-  print_pubkey_algo_note ( pk->pubkey_algo );
-  enc = xmalloc_clear ( sizeof *enc );
-  enc->pubkey_algo = pk->pubkey_algo;
-  keyid_from_pk( pk, enc->keyid );
-  enc->throw_keyid = throw_keyid;
-
   /* Okay, what's going on: We have the session key somewhere in
    * the structure DEK and want to encode this session key in an
    * integer value of n bits. pubkey_nbits gives us the number of
@@ -1099,33 +1098,150 @@ write_pubkey_enc (ctrl_t ctrl,
    * build_packet().  */
   frame = encode_session_key (pk->pubkey_algo, dek,
                               pubkey_nbits (pk->pubkey_algo, pk->pkey));
-  rc = pk_encrypt (pk->pubkey_algo, enc->data, frame, pk, pk->pkey);
+  err = pk_encrypt (pk->pubkey_algo, enc->data, frame, pk, pk->pkey);
   gcry_mpi_release (frame);
+  return err;
+}
+
+
+/* Allocate a new pubkey-enc packet object for PK.  */
+static PKT_pubkey_enc *
+new_pubkey_enc (PKT_public_key *pk, int throw_keyid)
+{
+  PKT_pubkey_enc *enc;
+
+  print_pubkey_algo_note ( pk->pubkey_algo );
+  enc = xmalloc_clear ( sizeof *enc );
+  enc->pubkey_algo = pk->pubkey_algo;
+  keyid_from_pk( pk, enc->keyid );
+  enc->throw_keyid = throw_keyid;
+  return enc;
+}
+
+
+/* Write the pubkey-enc packet ENC for the session key DEK to OUT.  */
+static int
+write_pubkey_enc_packet (ctrl_t ctrl, PKT_pubkey_enc *enc, DEK *dek,
+                         iobuf_t out)
+{
+  PACKET pkt;
+  int rc;
+
+  if ( opt.verbose )
+    {
+      char *ustr = get_user_id_string_native (ctrl, enc->keyid);
+      log_info (_("%s/%s.%s encrypted for: \"%s\"\n"),
+                openpgp_pk_algo_name (enc->pubkey_algo),
+                openpgp_cipher_algo_name (dek->algo),
+                dek->use_aead? openpgp_aead_algo_name (dek->use_aead)
+                /**/         : "CFB",
+                ustr );
+      xfree (ustr);
+    }
+  /* And write it. */
+  init_packet (&pkt);
+  pkt.pkttype = PKT_PUBKEY_ENC;
+  pkt.pkt.pubkey_enc = enc;
+  rc = build_packet (out, &pkt);
+  if (rc)
+    log_error ("build_packet(pubkey_enc) failed: %s\n",
+               gpg_strerror (rc));
+  return rc;
+}
+
+
+/*
+ * Write a pubkey-enc packet for the public key PK to OUT.
+ */
+int
+write_pubkey_enc (ctrl_t ctrl,
+                  PKT_public_key *pk, int throw_keyid, DEK *dek, iobuf_t out)
+{
+  PKT_pubkey_enc *enc;
+  int rc;
+
+  enc = new_pubkey_enc (pk, throw_keyid);
+  rc = encrypt_session_key (pk, dek, enc);
   if (rc)
     log_error ("pubkey_encrypt failed: %s\n", gpg_strerror (rc) );
   else
+    rc = write_pubkey_enc_packet (ctrl, enc, dek, out);
+  free_pubkey_enc(enc);
+  return rc;
+}
+
+
+/* One recipient for write_pubkey_enc_parallel.  */
+struct pubkey_enc_item_s
+{
+  PKT_public_key *pk;
+  PKT_pubkey_enc *enc;
+  gpg_error_t err;
+};
+
+/* The parameters for pubkey_enc_worker.  */
+struct pubkey_enc_parm_s
+{
+  DEK *dek;
+  struct pubkey_enc_item_s *items;
+};
+
+
+/* The job function for run_parallel.  */
+static void
+pubkey_enc_worker (void *opaque, int idx)
+{
+  struct pubkey_enc_parm_s *parm = opaque;
+  struct pubkey_enc_item_s *item = parm->items + idx;
+
+  item->err = encrypt_session_key (item->pk, parm->dek, item->enc);
+}
+
+
+/* Same as the loop in write_pubkey_enc_from_list but encrypt the
+ * session key for all recipients in parallel using up to
+ * opt.recipient_jobs threads.  The packets are written in the order
+ * of PK_LIST, as by the serial version.  Returns -1 if the required
+ * memory is not available so that the caller can fall back to the
+ * serial version.  */
+static int
+write_pubkey_enc_parallel (ctrl_t ctrl, PK_LIST pk_list, DEK *dek,
+                           iobuf_t out)
+{
+  struct pubkey_enc_parm_s parm;
+  PK_LIST pkr;
+  int i, n;
+  int rc = 0;
+
+  for (n=0, pkr = pk_list; pkr; pkr = pkr->next)
+    n++;
+  parm.dek = dek;
+  parm.items = xtrycalloc (n, sizeof *parm.items);
+  if (!parm.items)
+    return -1;
+
+  for (i=0, pkr = pk_list; pkr; pkr = pkr->next, i++)
+    {
+      parm.items[i].pk = pkr->pk;
+      parm.items[i].enc = new_pubkey_enc (pkr->pk, (opt.throw_keyids
+                                                    || (pkr->flags&1)));
+    }
+
+  run_parallel (opt.recipient_jobs, n, pubkey_enc_worker, &parm);
+
+  for (i=0; i < n; i++)
     {
-      if ( opt.verbose )
+      if (!rc)
         {
-          char *ustr = get_user_id_string_native (ctrl, enc->keyid);
-          log_info (_("%s/%s.%s encrypted for: \"%s\"\n"),
-                    openpgp_pk_algo_name (enc->pubkey_algo),
-                    openpgp_cipher_algo_name (dek->algo),
-                    dek->use_aead? openpgp_aead_algo_name (dek->use_aead)
-                    /**/         : "CFB",
-                    ustr );
-          xfree (ustr);
+          rc = parm.items[i].err;
+          if (rc)
+            log_error ("pubkey_encrypt failed: %s\n", gpg_strerror (rc) );
+          else
+            rc = write_pubkey_enc_packet (ctrl, parm.items[i].enc, dek, out);
         }
-      /* And write it. */
-      init_packet (&pkt);
-      pkt.pkttype = PKT_PUBKEY_ENC;
-      pkt.pkt.pubkey_enc = enc;
-      rc = build_packet (out, &pkt);
-      if (rc)
-        log_error ("build_packet(pubkey_enc) failed: %s\n",
-                   gpg_strerror (rc));
+      free_pubkey_enc (parm.items[i].enc);
     }
-  free_pubkey_enc(enc);
+  xfree (parm.items);
   return rc;
 }
 
@@ -1136,6 +1252,8 @@ write_pubkey_enc (ctrl_t ctrl,
 static int
 write_pubkey_enc_from_list (ctrl_t ctrl, PK_LIST pk_list, DEK *dek, iobuf_t out)
 {
+  int rc;
+
   if (opt.throw_keyids && (PGP7 || PGP8))
     {
       log_info(_("option '%s' may not be used in %s mode\n"),
@@ -1144,11 +1262,18 @@ write_pubkey_enc_from_list (ctrl_t ctrl, PK_LIST pk_list, DEK *dek, iobuf_t out)
       compliance_failure();
     }
 
+  if (opt.recipient_jobs > 1 && pk_list && pk_list->next)
+    {
+      rc = write_pubkey_enc_parallel (ctrl, pk_list, dek, out);
+      if (rc != -1)
+        return rc;
+    }
+
   for ( ; pk_list; pk_list = pk_list->next )
     {
       PKT_public_key *pk = pk_list->pk;
       int throw_keyid = (opt.throw_keyids || (pk_list->flags&1));
-      int rc = write_pubkey_enc (ctrl, pk, throw_keyid, dek, out);
+      rc = write_pubkey_enc (ctrl, pk, throw_keyid, dek, out);
       if (rc)
         return rc;
     }
@@ -1847,6 +1847,92 @@ do_export_one_keyblock (ctrl_t ctrl, kbnode_t keyblock, u32 *keyid,
 }
 
 
+/* The number of keyblocks do_export_stream reads ahead if the
+ * signatures are verified on several threads.  */
+#define EXPORT_BATCH_SIZE 256
+
+/* The keyblocks read ahead by do_export_stream.  */
+struct export_batch_s
+{
+  kbnode_t keyblocks[EXPORT_BATCH_SIZE];
+  size_t descindex[EXPORT_BATCH_SIZE];
+  int nitems;          /* Number of items in the arrays.  */
+  int next;            /* Index of the next item to return.  */
+  gpg_error_t err;     /* The error which ended the reading.  */
+  int read_failed;     /* ERR is from reading a keyblock.  */
+};
+
+
+/* Read up to EXPORT_BATCH_SIZE keyblocks matching DESC into BATCH
+ * and verify their signatures using opt.export_jobs threads.  The
+ * results are cached in the signature packets, so that the later
+ * cleaning does not need to verify them again.  If FIRST_MODE is set
+ * DESC is a single KEYDB_SEARCH_MODE_FIRST which is changed to
+ * KEYDB_SEARCH_MODE_NEXT after the first search.  */
+static void
+export_batch_fill (ctrl_t ctrl, struct export_batch_s *batch,
+                   KEYDB_HANDLE kdbhd, KEYDB_SEARCH_DESC *desc, size_t ndesc,
+                   int first_mode)
+{
+  struct sig_check_item_s *items = NULL;
+  size_t nitems = 0;
+  size_t maxitems = 0;
+  kbnode_t node;
+  int i;
+
+  batch->nitems = batch->next = 0;
+  while (!batch->err && batch->nitems < EXPORT_BATCH_SIZE)
+    {
+      batch->err = keydb_search (kdbhd, desc, ndesc,
+                                 &batch->descindex[batch->nitems]);
+      if (first_mode)
+        desc[0].mode = KEYDB_SEARCH_MODE_NEXT;
+      if (batch->err)
+        break;
+      batch->err = keydb_get_keyblock (kdbhd,
+                                       &batch->keyblocks[batch->nitems]);
+      if (batch->err)
+        {
+          batch->read_failed = 1;
+          break;
+        }
+      batch->nitems++;
+    }
+
+  check_self_signatures_parallel (batch->keyblocks, batch->nitems,
+                                  opt.export_jobs);
+  for (i=0; i < batch->nitems; i++)
+    for (node = batch->keyblocks[i]; node; node = node->next)
+      {
+        if (node->pkt->pkttype != PKT_SIGNATURE)
+          continue;
+        if (nitems == maxitems)
+          {
+            maxitems += 1000;
+            items = xrealloc (items, maxitems * sizeof *items);
+          }
+        items[nitems].root = batch->keyblocks[i];
+        items[nitems].node = node;
+        nitems++;
+      }
+  if (nitems)
+    check_key_signatures_parallel (ctrl, items, nitems, opt.export_jobs);
+  xfree (items);
+}
+
+
+/* Release the keyblocks still in BATCH.  */
+static void
+export_batch_release (struct export_batch_s *batch)
+{
+  if (!batch)
+    return;
+  for (; batch->next < batch->nitems; batch->next++)
+    release_kbnode (batch->keyblocks[batch->next]);
+  xfree (batch);
+}
+
+
 /* Export the keys identified by the list of strings in USERS to the
    stream OUT.  If SECRET is false public keys will be exported.  With
    secret true secret keys will be exported; in this case 1 means the
@@ -1872,6 +1958,7 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
   gcry_cipher_hd_t cipherhd = NULL;
   struct export_stats_s dummystats;
   iobuf_t out_help = NULL;
+  struct export_batch_s *batch = NULL;
 
   if (!stats)
     stats = &dummystats;
@@ -1958,26 +2045,56 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
       kek = NULL;
     }
 
+  /* Cleaning verifies the key signatures.  If requested, read ahead
+   * a batch of keyblocks and verify their signatures in parallel.  */
+  if (opt.export_jobs > 1 && (options & EXPORT_CLEAN) && !keyblock_out)
+    batch = xcalloc (1, sizeof *batch);
+
   for (;;)
     {
       u32 keyid[2];
       PKT_public_key *pk;
 
-      err = keydb_search (kdbhd, desc, ndesc, &descindex);
-      if (!users)
-        desc[0].mode = KEYDB_SEARCH_MODE_NEXT;
-      if (err)
-        break;
-
-      /* Read the keyblock. */
       release_kbnode (keyblock);
       keyblock = NULL;
-      err = keydb_get_keyblock (kdbhd, &keyblock);
-      if (err)
+      if (batch)
         {
-          log_error (_("error reading keyblock: %s\n"), gpg_strerror (err));
-          goto leave;
-	}
+          if (batch->next == batch->nitems && !batch->err)
+            export_batch_fill (ctrl, batch, kdbhd, desc, ndesc, !users);
+          if (batch->next < batch->nitems)
+            {
+              descindex = batch->descindex[batch->next];
+              keyblock = batch->keyblocks[batch->next++];
+            }
+          else
+            {
+              err = batch->err;
+              if (batch->read_failed)
+                {
+                  log_error (_("error reading keyblock: %s\n"),
+                             gpg_strerror (err));
+                  goto leave;
+                }
+              break;
+            }
+        }
+      else
+        {
+          err = keydb_search (kdbhd, desc, ndesc, &descindex);
+          if (!users)
+            desc[0].mode = KEYDB_SEARCH_MODE_NEXT;
+          if (err)
+            break;
+
+          /* Read the keyblock. */
+          err = keydb_get_keyblock (kdbhd, &keyblock);
+          if (err)
+            {
+              log_error (_("error reading keyblock: %s\n"),
+                         gpg_strerror (err));
+              goto leave;
+            }
+        }
 
       node = find_kbnode (keyblock, PKT_PUBLIC_KEY);
       if (!node)
@@ -2088,6 +2205,7 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
     err = 0;
 
  leave:
+  export_batch_release (batch);
   iobuf_cancel (out_help);
   gcry_cipher_close (cipherhd);
   xfree(desc);
@@ -2172,13 +2290,9 @@ export_one_ssh_key (estream_t fp, PKT_public_key *pk)
 
     case PUBKEY_ALGO_ECDSA:
       {
-        char *curveoid;
         const char *curve;
 
-        curveoid = openpgp_oid_to_str (pk->pkey[0]);
-        if (!curveoid)
-          err = gpg_error_from_syserror ();
-        else if (!(curve = openpgp_oid_to_curve (curveoid, 0)))
+        if (!(curve = openpgp_oidmpi_to_curve (pk->pkey[0], 0)))
           err = gpg_error (GPG_ERR_UNKNOWN_CURVE);
         else
           {
@@ -2194,7 +2308,6 @@ export_one_ssh_key (estream_t fp, PKT_public_key *pk)
             else
               err = key_to_sshblob (&mb, identifier, pk->pkey[1], NULL);
           }
-        xfree (curveoid);
       }
       break;
 
@@ -27,6 +27,9 @@ typedef struct {
     gcry_md_hd_t md;      /* catch all */
     gcry_md_hd_t md2;     /* if we want to calculate an alternate hash */
     size_t maxbuf_size;
+    /* If not NULL the digests are computed in parallel into per
+     * algorithm contexts (see md_filter_use_parallel).  */
+    struct md_parallel_s *parallel;
 } md_filter_context_t;
 
 typedef struct {
@@ -81,6 +84,7 @@ struct compress_filter_context_s {
     int algo;	 /* compress algo */
     int algo1hack;
     int new_ctb;
+    struct compress_parallel_s *parallel; /* Parallel compression state.  */
     void (*release)(struct compress_filter_context_s*);
 };
 typedef struct compress_filter_context_s compress_filter_context_t;
@@ -132,6 +136,9 @@ typedef struct
   size_t bufsize;  /* Allocated length.  */
   size_t buflen;   /* Used length.       */
 
+  /* The state of the parallel AEAD encryption or NULL.  */
+  struct aead_parallel_s *parallel;
+
 } cipher_filter_context_t;
 
 
@@ -164,6 +171,8 @@ typedef struct {
 /*-- mdfilter.c --*/
 int md_filter( void *opaque, int control, iobuf_t a, byte *buf, size_t *ret_len);
 void free_md_filter_context( md_filter_context_t *mfx );
+void md_filter_use_parallel (md_filter_context_t *mfx);
+gcry_md_hd_t md_filter_get_md (md_filter_context_t *mfx, int algo);
 
 /*-- armor.c --*/
 armor_filter_context_t *new_armor_context (void);
@@ -176,6 +185,7 @@ gpg_error_t push_compress_filter (iobuf_t out, compress_filter_context_t *zfx,
                                   int algo);
 gpg_error_t push_compress_filter2 (iobuf_t out,compress_filter_context_t *zfx,
                                    int algo, int rel);
+int skip_compression_p (iobuf_t inp, const char *fname);
 
 /*-- cipher.c --*/
 int cipher_filter_cfb (void *opaque, int control,
@@ -27,9 +27,45 @@
 #include "../common/util.h"
 #include "packet.h"
 #include "../common/iobuf.h"
+#include "../common/init.h"
+#include "../common/mbox-util.h"
 #include "options.h"
 
 
+/* Released signature objects kept for reuse by new_signature.  A
+ * keyblock may have thousands of signatures; reusing them saves most
+ * of the malloc calls when parsing many keyblocks.  */
+#define MAX_UNUSED_SIGS 1024
+static PKT_signature *unused_sigs[MAX_UNUSED_SIGS];
+static int n_unused_sigs;
+static int unused_sigs_cleanup_registered;
+
+static void
+release_unused_sigs (void)
+{
+  while (n_unused_sigs)
+    xfree (unused_sigs[--n_unused_sigs]);
+}
+
+
+/* Return a new cleared signature object.  It may be released with
+ * free_seckey_enc or with xfree.  */
+PKT_signature *
+new_signature (void)
+{
+  PKT_signature *sig;
+
+  if (n_unused_sigs)
+    {
+      sig = unused_sigs[--n_unused_sigs];
+      memset (sig, 0, sizeof *sig);
+    }
+  else
+    sig = xmalloc_clear (sizeof *sig);
+  return sig;
+}
+
+
 /* This is mpi_copy with a fix for opaque MPIs which store a NULL
    pointer.  This will also be fixed in Libggcrypt 1.7.0.  */
 static gcry_mpi_t
@@ -84,7 +120,17 @@ free_seckey_enc( PKT_signature *sig )
     }
   xfree (sig->signers_uid);
 
-  xfree(sig);
+  if (n_unused_sigs < MAX_UNUSED_SIGS)
+    {
+      if (!unused_sigs_cleanup_registered)
+        {
+          unused_sigs_cleanup_registered = 1;
+          register_mem_cleanup_func (release_unused_sigs);
+        }
+      unused_sigs[n_unused_sigs++] = sig;
+    }
+  else
+    xfree(sig);
 }
 
 
@@ -104,6 +150,7 @@ release_public_key_parts (PKT_public_key *pk)
       mpi_release (pk->pkey[i]);
       pk->pkey[i] = NULL;
     }
+  pk->flags.grip_valid = 0;
   if (pk->seckey_info)
     {
       xfree (pk->seckey_info);
@@ -158,6 +205,7 @@ cp_subpktarea (subpktarea_t *s )
     d = xmalloc (sizeof (*d) + s->size - 1 );
     d->size = s->size;
     d->len = s->len;
+    d->indexed = 0;
     memcpy (d->data, s->data, s->len);
     return d;
 }
@@ -267,6 +315,9 @@ copy_signature( PKT_signature *d, PKT_signature *s )
     d->pka_info = s->pka_info? cp_pka_info (s->pka_info) : NULL;
     d->hashed = cp_subpktarea (s->hashed);
     d->unhashed = cp_subpktarea (s->unhashed);
+    /* TRUST_REGEXP points into the hashed area.  */
+    if (s->trust_regexp && s->hashed)
+      d->trust_regexp = d->hashed->data + (s->trust_regexp - s->hashed->data);
     if (s->signers_uid)
       d->signers_uid = xstrdup (s->signers_uid);
     if(s->numrevkeys)
@@ -279,6 +330,45 @@ copy_signature( PKT_signature *d, PKT_signature *s )
 }
 
 
+/* Return a deep copy of the user ID S.  */
+PKT_user_id *
+copy_user_id (PKT_user_id *s)
+{
+  PKT_user_id *d;
+  int i;
+
+  d = xmalloc (sizeof *d + s->len);
+  memcpy (d, s, sizeof *d + s->len);
+  d->ref = 1;
+  if (s->attrib_data)
+    {
+      d->attrib_data = xmalloc (s->attrib_len);
+      memcpy (d->attrib_data, s->attrib_data, s->attrib_len);
+    }
+  if (s->attribs)
+    {
+      /* The cooked attributes point into ATTRIB_DATA.  */
+      d->attribs = xmalloc (s->numattribs * sizeof *d->attribs);
+      for (i=0; i < s->numattribs; i++)
+        {
+          d->attribs[i] = s->attribs[i];
+          if (s->attrib_data)
+            d->attribs[i].data = (d->attrib_data
+                                  + (s->attribs[i].data - s->attrib_data));
+        }
+    }
+  if (s->namehash)
+    {
+      d->namehash = xmalloc (20);
+      memcpy (d->namehash, s->namehash, 20);
+    }
+  d->prefs = copy_prefs (s->prefs);
+  d->updateurl = s->updateurl? xstrdup (s->updateurl) : NULL;
+  d->mbox = s->mbox? xstrdup (s->mbox) : NULL;
+  return d;
+}
+
+
 /*
  * shallow copy of the user ID
  */
@@ -566,3 +656,38 @@ cmp_user_ids( PKT_user_id *a, PKT_user_id *b )
 
     return res;
 }
+
+
+/* Return the mailbox of the user id UID as computed by
+ * mailbox_from_userid or NULL if it has none.  The mailbox is
+ * derived only once and then cached in UID; the caller must not
+ * release the result.  */
+const char *
+user_id_mbox (PKT_user_id *uid)
+{
+  if (!uid->flags.mbox_checked)
+    {
+      xfree (uid->mbox);
+      uid->mbox = mailbox_from_userid (uid->name, 0);
+      /* Try again next time if we are out of core.  */
+      if (uid->mbox || errno != ENOMEM)
+        uid->flags.mbox_checked = 1;
+    }
+  return uid->mbox;
+}
+
+
+/* Return true if the mailbox of the user id UID is MBOX.  MBOX is
+ * expected to be a mailbox as returned by mailbox_from_userid; the
+ * case of ASCII characters is ignored.  This does not allocate
+ * memory after the first call for UID.  */
+int
+user_id_has_mbox (PKT_user_id *uid, const char *mbox)
+{
+  const char *s;
+
+  if (!mbox)
+    return 0;
+  s = user_id_mbox (uid);
+  return s && !ascii_strcasecmp (s, mbox);
+}
@@ -40,6 +40,7 @@
 #include "../common/host2net.h"
 #include "../common/mbox-util.h"
 #include "../common/status.h"
+#include "timing.h"
 
 #define MAX_PK_CACHE_ENTRIES   PK_UID_CACHE_SIZE
 #define MAX_UID_CACHE_ENTRIES  PK_UID_CACHE_SIZE
@@ -120,15 +121,35 @@ typedef struct keyid_list
 
 
 #if MAX_PK_CACHE_ENTRIES
+/* The public key cache is a hash table indexed by the keyid.  All
+ * entries are also on a list ordered by their last use so that the
+ * least recently used entry is dropped if the cache is full.  The
+ * fingerprint is stored as well because its keyid part tells the
+ * bucket; thus lookups by fingerprint are also possible.  */
+#define PK_CACHE_BUCKETS 1021
 typedef struct pk_cache_entry
 {
-  struct pk_cache_entry *next;
+  struct pk_cache_entry *next;     /* The next entry in the bucket.  */
+  struct pk_cache_entry *lru_prev; /* The next more recently used.  */
+  struct pk_cache_entry *lru_next; /* The next less recently used.  */
   u32 keyid[2];
+  byte fprlen;
+  byte fpr[MAX_FINGERPRINT_LEN];
   PKT_public_key *pk;
 } *pk_cache_entry_t;
-static pk_cache_entry_t pk_cache;
+static pk_cache_entry_t *pk_cache;   /* The buckets or NULL.  */
+static pk_cache_entry_t pk_cache_lru_head;
+static pk_cache_entry_t pk_cache_lru_tail;
 static int pk_cache_entries;	/* Number of entries in pk cache.  */
 static int pk_cache_disabled;
+
+static struct
+{
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int added;
+  unsigned int dropped;
+} pk_cache_stats;
 #endif
 
 #if MAX_UID_CACHE_ENTRIES < 5
@@ -162,6 +183,96 @@ print_stats ()
 #endif
 
 
+#if MAX_PK_CACHE_ENTRIES
+static inline unsigned int
+pk_cache_bucket (const u32 *keyid)
+{
+  return keyid[1] % PK_CACHE_BUCKETS;
+}
+
+
+/* Unlink CE from the LRU list.  */
+static void
+pk_cache_lru_remove (pk_cache_entry_t ce)
+{
+  if (ce->lru_prev)
+    ce->lru_prev->lru_next = ce->lru_next;
+  else
+    pk_cache_lru_head = ce->lru_next;
+  if (ce->lru_next)
+    ce->lru_next->lru_prev = ce->lru_prev;
+  else
+    pk_cache_lru_tail = ce->lru_prev;
+  ce->lru_prev = ce->lru_next = NULL;
+}
+
+
+/* Put CE at the head of the LRU list.  */
+static void
+pk_cache_lru_insert (pk_cache_entry_t ce)
+{
+  ce->lru_prev = NULL;
+  ce->lru_next = pk_cache_lru_head;
+  if (pk_cache_lru_head)
+    pk_cache_lru_head->lru_prev = ce;
+  else
+    pk_cache_lru_tail = ce;
+  pk_cache_lru_head = ce;
+}
+
+
+/* Return the cache entry for the key with KEYID or NULL.  If FPR is
+ * not NULL the fingerprint of the entry must also match FPR of
+ * length FPRLEN.  A found entry is marked as most recently used.  */
+static pk_cache_entry_t
+pk_cache_lookup (const u32 *keyid, const byte *fpr, size_t fprlen)
+{
+  pk_cache_entry_t ce;
+
+  if (!pk_cache)
+    return NULL;
+
+  for (ce = pk_cache[pk_cache_bucket (keyid)]; ce; ce = ce->next)
+    if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
+      break;
+  if (ce && fpr && (ce->fprlen != fprlen || memcmp (ce->fpr, fpr, fprlen)))
+    ce = NULL;
+
+  if (!ce)
+    {
+      pk_cache_stats.misses++;
+      return NULL;
+    }
+  pk_cache_stats.hits++;
+  if (ce != pk_cache_lru_head)
+    {
+      pk_cache_lru_remove (ce);
+      pk_cache_lru_insert (ce);
+    }
+  return ce;
+}
+
+
+/* Remove the entry CE from the cache and release it.  */
+static void
+pk_cache_drop (pk_cache_entry_t ce)
+{
+  pk_cache_entry_t *cep;
+
+  for (cep = &pk_cache[pk_cache_bucket (ce->keyid)]; *cep; cep = &(*cep)->next)
+    if (*cep == ce)
+      {
+        *cep = ce->next;
+        break;
+      }
+  pk_cache_lru_remove (ce);
+  free_public_key (ce->pk);
+  xfree (ce);
+  pk_cache_entries--;
+}
+#endif /*MAX_PK_CACHE_ENTRIES*/
+
+
 /* Cache a copy of a public key in the public key cache.  PK is not
  * cached if caching is disabled (via getkey_disable_caches), if
  * PK->FLAGS.DONT_CACHE is set, we don't know how to derive a key id
@@ -172,14 +283,16 @@ print_stats ()
  * copy_public_key.  Thus, any secret parts are not copied, for
  * instance.
  *
- * This cache is filled by get_pubkey and is read by get_pubkey and
- * get_pubkey_fast.  */
+ * This cache is filled by get_pubkey and get_pubkey_byfprint and is
+ * read by these functions and get_pubkey_fast.  If the cache is full
+ * the least recently used key is dropped.  */
 void
 cache_public_key (PKT_public_key * pk)
 {
 #if MAX_PK_CACHE_ENTRIES
-  pk_cache_entry_t ce, ce2;
+  pk_cache_entry_t ce;
   u32 keyid[2];
+  unsigned int bucket;
 
   if (pk_cache_disabled)
     return;
@@ -199,7 +312,11 @@ cache_public_key (PKT_public_key * pk)
   else
     return; /* Don't know how to get the keyid.  */
 
-  for (ce = pk_cache; ce; ce = ce->next)
+  if (!pk_cache)
+    pk_cache = xcalloc (PK_CACHE_BUCKETS, sizeof *pk_cache);
+
+  bucket = pk_cache_bucket (keyid);
+  for (ce = pk_cache[bucket]; ce; ce = ce->next)
     if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
       {
 	if (DBG_CACHE)
@@ -207,35 +324,27 @@ cache_public_key (PKT_public_key * pk)
 	return;
       }
 
-  if (pk_cache_entries >= MAX_PK_CACHE_ENTRIES)
+  while (pk_cache_entries >= MAX_PK_CACHE_ENTRIES && pk_cache_lru_tail)
     {
-      int n;
-
-      /* Remove the last 50% of the entries.  */
-      for (ce = pk_cache, n = 0; ce && n < pk_cache_entries/2; n++)
-        ce = ce->next;
-      if (ce && ce != pk_cache && ce->next)
-        {
-          ce2 = ce->next;
-          ce->next = NULL;
-          ce = ce2;
-          for (; ce; ce = ce2)
-            {
-              ce2 = ce->next;
-              free_public_key (ce->pk);
-              xfree (ce);
-              pk_cache_entries--;
-            }
-        }
-      log_assert (pk_cache_entries < MAX_PK_CACHE_ENTRIES);
+      pk_cache_drop (pk_cache_lru_tail);
+      pk_cache_stats.dropped++;
     }
-  pk_cache_entries++;
-  ce = xmalloc (sizeof *ce);
-  ce->next = pk_cache;
-  pk_cache = ce;
+
+  ce = xmalloc_clear (sizeof *ce);
   ce->pk = copy_public_key (NULL, pk);
   ce->keyid[0] = keyid[0];
   ce->keyid[1] = keyid[1];
+  {
+    size_t fprlen;
+
+    fingerprint_from_pk (pk, ce->fpr, &fprlen);
+    ce->fprlen = fprlen;
+  }
+  ce->next = pk_cache[bucket];
+  pk_cache[bucket] = ce;
+  pk_cache_lru_insert (ce);
+  pk_cache_entries++;
+  pk_cache_stats.added++;
 #endif
 }
 
@@ -263,24 +372,45 @@ void
 getkey_disable_caches ()
 {
 #if MAX_PK_CACHE_ENTRIES
-  {
-    pk_cache_entry_t ce, ce2;
-
-    for (ce = pk_cache; ce; ce = ce2)
-      {
-	ce2 = ce->next;
-	free_public_key (ce->pk);
-	xfree (ce);
-      }
-    pk_cache_disabled = 1;
-    pk_cache_entries = 0;
-    pk_cache = NULL;
-  }
+  while (pk_cache_lru_head)
+    pk_cache_drop (pk_cache_lru_head);
+  xfree (pk_cache);
+  pk_cache = NULL;
+  pk_cache_disabled = 1;
 #endif
+  getkey_flush_merge_cache ();
   /* fixme: disable user id cache ? */
 }
 
 
+/* Drop all keys from the public key cache and the merge cache.
+ * Unlike getkey_disable_caches the caches are used again afterwards.
+ * This is used after another process changed the keys.  */
+void
+getkey_flush_caches (void)
+{
+#if MAX_PK_CACHE_ENTRIES
+  while (pk_cache_lru_head)
+    pk_cache_drop (pk_cache_lru_head);
+#endif
+  getkey_flush_merge_cache ();
+}
+
+
+/* Print statistics of the public key cache.  */
+void
+getkey_dump_stats (void)
+{
+#if MAX_PK_CACHE_ENTRIES
+  log_info ("pk_cache: entries=%d max=%d hits=%u misses=%u"
+            " added=%u dropped=%u\n",
+            pk_cache_entries, MAX_PK_CACHE_ENTRIES,
+            pk_cache_stats.hits, pk_cache_stats.misses,
+            pk_cache_stats.added, pk_cache_stats.dropped);
+#endif
+}
+
+
 /* Free a list of pubkey_t objects.  */
 void
 pubkeys_free (pubkey_t keys)
@@ -326,6 +456,149 @@ get_pubkey_for_sig (ctrl_t ctrl, PKT_public_key *pk, PKT_signature *sig)
 }
 
 
+#if MAX_PK_CACHE_ENTRIES
+/* The object passed to prefetch_pubkeys_cb.  */
+struct prefetch_parm_s
+{
+  ctrl_t ctrl;
+  KEYDB_SEARCH_DESC *desc;  /* The queries.  */
+  int *index;               /* Index of each query in the caller's list.  */
+  char *found;              /* The caller's found flags or NULL.  */
+};
+
+
+/* Helper for prefetch_pubkeys to cache the matching keys of
+ * KEYBLOCK.  */
+static gpg_error_t
+prefetch_pubkeys_cb (void *opaque, size_t descidx, kbnode_t keyblock)
+{
+  struct prefetch_parm_s *parm = opaque;
+  KEYDB_SEARCH_DESC *desc = parm->desc + descidx;
+  kbnode_t node;
+  PKT_public_key *pk;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+  u32 kid[2];
+
+  merge_selfsigs (parm->ctrl, keyblock);
+  for (node = keyblock; node; node = node->next)
+    {
+      if (node->pkt->pkttype != PKT_PUBLIC_KEY
+          && node->pkt->pkttype != PKT_PUBLIC_SUBKEY)
+        continue;
+      pk = node->pkt->pkt.public_key;
+      if (desc->mode == KEYDB_SEARCH_MODE_FPR)
+        {
+          fingerprint_from_pk (pk, fpr, &fprlen);
+          if (fprlen != desc->fprlen || memcmp (fpr, desc->u.fpr, fprlen))
+            continue;
+        }
+      else
+        {
+          keyid_from_pk (pk, kid);
+          if (kid[0] != desc->u.kid[0] || kid[1] != desc->u.kid[1])
+            continue;
+        }
+      cache_public_key (pk);
+      if (parm->found)
+        parm->found[parm->index[descidx]] = 1;
+    }
+
+  release_kbnode (keyblock);
+  return 0;
+}
+#endif /*MAX_PK_CACHE_ENTRIES*/
+
+
+/* Look up the keys given by the NDESC fingerprint or long keyid
+ * search descriptions at DESC in one batch and store them in the
+ * public key cache.  This is used if many keys are needed right
+ * after, for example the keys of all signers of a message; the
+ * following get_pubkey and get_pubkey_byfprint calls are then served
+ * from the cache.  If FOUND is not NULL it is an array of NDESC
+ * flags; the flag of each description with a key in the cache is
+ * set.  Errors are not returned because a key not in the cache is
+ * simply looked up again.  */
+void
+prefetch_pubkeys (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, size_t ndesc,
+                  char *found)
+{
+#if MAX_PK_CACHE_ENTRIES
+  struct prefetch_parm_s parm;
+  KEYDB_HANDLE hd;
+  gpg_error_t err;
+  size_t idx, n;
+  u32 kid[2];
+
+  if (pk_cache_disabled || !ndesc)
+    return;
+
+  memset (&parm, 0, sizeof parm);
+  parm.ctrl = ctrl;
+  parm.found = found;
+  parm.desc = xtrycalloc (ndesc, sizeof *parm.desc);
+  parm.index = xtrycalloc (ndesc, sizeof *parm.index);
+  if (!parm.desc || !parm.index)
+    goto leave;
+
+  /* Skip the keys which are already cached.  */
+  for (idx = n = 0; idx < ndesc && n < MAX_PK_CACHE_ENTRIES; idx++)
+    {
+      if (desc[idx].mode == KEYDB_SEARCH_MODE_FPR
+          && desc[idx].fprlen == 32)
+        {
+          kid[0] = buf32_to_u32 (desc[idx].u.fpr);
+          kid[1] = buf32_to_u32 (desc[idx].u.fpr + 4);
+        }
+      else if (desc[idx].mode == KEYDB_SEARCH_MODE_FPR
+               && desc[idx].fprlen == 20)
+        {
+          kid[0] = buf32_to_u32 (desc[idx].u.fpr + 12);
+          kid[1] = buf32_to_u32 (desc[idx].u.fpr + 16);
+        }
+      else if (desc[idx].mode == KEYDB_SEARCH_MODE_LONG_KID)
+        {
+          kid[0] = desc[idx].u.kid[0];
+          kid[1] = desc[idx].u.kid[1];
+        }
+      else
+        continue;
+
+      if (pk_cache_lookup (kid,
+                           desc[idx].mode == KEYDB_SEARCH_MODE_FPR?
+                           desc[idx].u.fpr : NULL, desc[idx].fprlen))
+        {
+          if (found)
+            found[idx] = 1;
+          continue;
+        }
+      parm.desc[n] = desc[idx];
+      parm.index[n] = idx;
+      n++;
+    }
+  if (!n)
+    goto leave;
+
+  hd = keydb_new (ctrl);
+  if (!hd)
+    goto leave;
+  err = keydb_search_batch (hd, parm.desc, n, prefetch_pubkeys_cb, &parm);
+  if (err && DBG_LOOKUP)
+    log_debug ("%s: batch search failed: %s\n", __func__, gpg_strerror (err));
+  keydb_release (hd);
+
+ leave:
+  xfree (parm.desc);
+  xfree (parm.index);
+#else
+  (void)ctrl;
+  (void)desc;
+  (void)ndesc;
+  (void)found;
+#endif
+}
+
+
 /* Return the public key with the key id KEYID and store it at PK.
  * The resources in *PK should be released using
  * release_public_key_parts().  This function also stores a copy of
@@ -360,16 +633,15 @@ get_pubkey (ctrl_t ctrl, PKT_public_key * pk, u32 * keyid)
          NULL as it does not guarantee that the user IDs are
          cached. */
       pk_cache_entry_t ce;
-      for (ce = pk_cache; ce; ce = ce->next)
-	{
-	  if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-	    /* XXX: We don't check PK->REQ_USAGE here, but if we don't
-	       read from the cache, we do check it!  */
-	    {
-	      copy_public_key (pk, ce->pk);
-	      return 0;
-	    }
-	}
+
+      /* XXX: We don't check PK->REQ_USAGE here, but if we don't
+         read from the cache, we do check it!  */
+      ce = pk_cache_lookup (keyid, NULL, 0);
+      if (ce)
+        {
+          copy_public_key (pk, ce->pk);
+          return 0;
+        }
     }
 #endif
   /* More init stuff.  */
@@ -461,17 +733,15 @@ get_pubkey_fast (ctrl_t ctrl, PKT_public_key * pk, u32 * keyid)
     /* Try to get it from the cache */
     pk_cache_entry_t ce;
 
-    for (ce = pk_cache; ce; ce = ce->next)
+    ce = pk_cache_lookup (keyid, NULL, 0);
+    if (ce
+        /* Only consider primary keys.  */
+        && ce->pk->keyid[0] == ce->pk->main_keyid[0]
+        && ce->pk->keyid[1] == ce->pk->main_keyid[1])
       {
-	if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1]
-	    /* Only consider primary keys.  */
-	    && ce->pk->keyid[0] == ce->pk->main_keyid[0]
-	    && ce->pk->keyid[1] == ce->pk->main_keyid[1])
-	  {
-	    if (pk)
-	      copy_public_key (pk, ce->pk);
-	    return 0;
-	  }
+        if (pk)
+          copy_public_key (pk, ce->pk);
+        return 0;
       }
   }
 #endif
@@ -485,7 +755,8 @@ get_pubkey_fast (ctrl_t ctrl, PKT_public_key * pk, u32 * keyid)
       keydb_release (hd);
       return GPG_ERR_NO_PUBKEY;
     }
-  rc = keydb_get_keyblock (hd, &keyblock);
+  /* We only need the primary key.  */
+  rc = keydb_get_keyblock_keys (hd, &keyblock);
   keydb_release (hd);
   if (rc)
     {
@@ -1329,11 +1600,8 @@ pubkey_cmp (ctrl_t ctrl, const char *name, struct pubkey_cmp_cookie *old,
        n; n = find_next_kbnode (n, PKT_USER_ID))
     {
       PKT_user_id *uid = n->pkt->pkt.user_id;
-      char *mbox = mailbox_from_userid (uid->name, 0);
-      int match = mbox ? strcasecmp (name, mbox) == 0 : 0;
 
-      xfree (mbox);
-      if (! match)
+      if (! user_id_has_mbox (uid, name))
         continue;
 
       new->uid = scopy_user_id (uid);
@@ -1650,6 +1918,34 @@ get_pubkey_byfprint (ctrl_t ctrl, PKT_public_key *pk, kbnode_t *r_keyblock,
   if (r_keyblock)
     *r_keyblock = NULL;
 
+#if MAX_PK_CACHE_ENTRIES
+  /* Without a keyblock to return and a requested usage we can take
+   * the key from the cache.  The keyid is part of the fingerprint.  */
+  if (pk && !r_keyblock && !pk->req_usage
+      && (fprint_len == 32 || fprint_len == 20))
+    {
+      pk_cache_entry_t ce;
+      u32 kid[2];
+
+      if (fprint_len == 32)
+        {
+          kid[0] = buf32_to_u32 (fprint);
+          kid[1] = buf32_to_u32 (fprint + 4);
+        }
+      else
+        {
+          kid[0] = buf32_to_u32 (fprint + 12);
+          kid[1] = buf32_to_u32 (fprint + 16);
+        }
+      ce = pk_cache_lookup (kid, fprint, fprint_len);
+      if (ce)
+        {
+          copy_public_key (pk, ce->pk);
+          return 0;
+        }
+    }
+#endif
+
   if (fprint_len == 32 || fprint_len == 20 || fprint_len == 16)
     {
       struct getkey_ctx_s ctx;
@@ -1673,7 +1969,11 @@ get_pubkey_byfprint (ctrl_t ctrl, PKT_public_key *pk, kbnode_t *r_keyblock,
         ctx.req_usage = pk->req_usage;
       rc = lookup (ctrl, &ctx, 0, &kb, &found_key);
       if (!rc && pk)
-	pk_from_block (pk, kb, found_key);
+        {
+          pk_from_block (pk, kb, found_key);
+          if (!pk->req_usage)
+            cache_public_key (pk);
+        }
       if (!rc && r_keyblock)
 	{
 	  *r_keyblock = kb;
@@ -3242,6 +3542,7 @@ merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock)
   prefitem_t *prefs;
   unsigned int mdc_feature;
   unsigned int aead_feature;
+  timing_span_t span;
 
   if (keyblock->pkt->pkttype != PKT_PUBLIC_KEY)
     {
@@ -3257,6 +3558,7 @@ merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock)
       BUG ();
     }
 
+  timing_begin (&span, "merge_selfsigs");
   merge_selfsigs_main (ctrl, keyblock, &revoked, &rinfo);
 
   /* Now merge in the data from each of the subkeys.  */
@@ -3267,6 +3569,7 @@ merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock)
 	  merge_selfsigs_subkey (ctrl, keyblock, k);
 	}
     }
+  timing_end (&span);
 
   main_pk = keyblock->pkt->pkt.public_key;
   if (revoked || main_pk->has_expired || !main_pk->flags.valid)
@@ -3671,6 +3974,222 @@ print_status_key_considered (kbnode_t keyblock, unsigned int flags)
 
 
 
+/* Return a copy of the merged public KEYBLOCK or NULL if it has
+ * packets which we do not expect in such a keyblock.  */
+static kbnode_t
+clone_merged_keyblock (kbnode_t keyblock)
+{
+  kbnode_t root = NULL;
+  kbnode_t node, *tail = &root;
+  PACKET *pkt;
+
+  for (; keyblock; keyblock = keyblock->next)
+    {
+      pkt = xmalloc_clear (sizeof *pkt);
+      pkt->pkttype = keyblock->pkt->pkttype;
+      switch (pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+          pkt->pkt.public_key = copy_public_key (NULL,
+                                                 keyblock->pkt->pkt.public_key);
+          break;
+        case PKT_USER_ID:
+        case PKT_ATTRIBUTE:
+          pkt->pkt.user_id = copy_user_id (keyblock->pkt->pkt.user_id);
+          break;
+        case PKT_SIGNATURE:
+          pkt->pkt.signature = copy_signature (NULL,
+                                               keyblock->pkt->pkt.signature);
+          break;
+        default:
+          xfree (pkt);
+          release_kbnode (root);
+          return NULL;
+        }
+      node = new_kbnode (pkt);
+      node->flag = keyblock->flag;
+      *tail = node;
+      tail = &node->next;
+    }
+
+  return root;
+}
+
+
+/* Return the first time stamp in KEYBLOCK which is later than
+ * CURTIME or 0 if there is none.  The result of merge_selfsigs
+ * depends on the current time only by comparing it to these time
+ * stamps.  */
+static u32
+next_keyblock_event (kbnode_t keyblock, u32 curtime)
+{
+  u32 next = 0;
+  u32 t[3];
+  int i, n;
+
+  for (; keyblock; keyblock = keyblock->next)
+    {
+      n = 0;
+      switch (keyblock->pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+          t[n++] = keyblock->pkt->pkt.public_key->timestamp;
+          t[n++] = keyblock->pkt->pkt.public_key->expiredate;
+          break;
+        case PKT_USER_ID:
+        case PKT_ATTRIBUTE:
+          t[n++] = keyblock->pkt->pkt.user_id->created;
+          t[n++] = keyblock->pkt->pkt.user_id->expiredate;
+          t[n++] = keyblock->pkt->pkt.user_id->help_key_expire;
+          break;
+        case PKT_SIGNATURE:
+          t[n++] = keyblock->pkt->pkt.signature->timestamp;
+          t[n++] = keyblock->pkt->pkt.signature->expiredate;
+          break;
+        default:
+          break;
+        }
+      for (i=0; i < n; i++)
+        if (t[i] > curtime && (!next || t[i] < next))
+          next = t[i];
+    }
+
+  return next;
+}
+
+
+/* An entry of the cache of keyblocks with merged self-signatures.
+ * Running merge_selfsigs on a large keyblock is expensive because
+ * it needs to hash the data of all self-signatures.  With the
+ * keyboxd or a --server session the same keys are often looked up
+ * many times, so we keep the merged copies of the last few
+ * keyblocks.  An entry is found by the hash of the keyblock image,
+ * thus it is only used for exactly the same keyblock.  Because
+ * merge_selfsigs also depends on other keys (for example designated
+ * revokers) all entries are flushed by any keydb update.  */
+struct merge_cache_entry_s
+{
+  struct merge_cache_entry_s *next;
+  unsigned char digest[KEYDB_DIGEST_LEN];
+  u32 created;          /* The time of the merge.  */
+  u32 next_event;       /* Valid until this time or 0 for ever.  */
+  kbnode_t keyblock;    /* The merged keyblock.  */
+};
+typedef struct merge_cache_entry_s *merge_cache_entry_t;
+
+#define MAX_MERGE_CACHE_ENTRIES 32
+
+static merge_cache_entry_t merge_cache;
+static unsigned int merge_cache_entries;
+
+
+static void
+release_merge_cache_entry (merge_cache_entry_t ce)
+{
+  release_kbnode (ce->keyblock);
+  xfree (ce);
+}
+
+
+/* Drop all keyblocks with merged self-signatures from the cache.
+ * This needs to be called after each change to the keydb.  */
+void
+getkey_flush_merge_cache (void)
+{
+  merge_cache_entry_t ce, ce2;
+
+  for (ce = merge_cache; ce; ce = ce2)
+    {
+      ce2 = ce->next;
+      release_merge_cache_entry (ce);
+    }
+  merge_cache = NULL;
+  merge_cache_entries = 0;
+}
+
+
+/* Same as merge_selfsigs for the keyblock at R_KEYBLOCK which has
+ * just been returned by keydb_get_keyblock for HD.  If a merged copy
+ * of the same keyblock is in the cache, *R_KEYBLOCK is replaced by a
+ * copy of it.  Node flag bits 0 and 1 are preserved.  */
+static void
+merge_selfsigs_cached (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t *r_keyblock)
+{
+  unsigned char digest[KEYDB_DIGEST_LEN];
+  merge_cache_entry_t ce, ceprev;
+  kbnode_t keyblock, node, node2;
+  u32 curtime;
+
+  if (keydb_get_keyblock_digest (hd, digest))
+    {
+      merge_selfsigs (ctrl, *r_keyblock);
+      return;
+    }
+
+  curtime = make_timestamp ();
+  for (ce = merge_cache, ceprev = NULL; ce; ceprev = ce, ce = ce->next)
+    if (!memcmp (ce->digest, digest, KEYDB_DIGEST_LEN))
+      break;
+  if (ce)
+    {
+      /* Unlink it; it is either stale or moved to the front.  */
+      if (ceprev)
+        ceprev->next = ce->next;
+      else
+        merge_cache = ce->next;
+      merge_cache_entries--;
+
+      if (curtime >= ce->created
+          && (!ce->next_event || curtime < ce->next_event)
+          && (keyblock = clone_merged_keyblock (ce->keyblock)))
+        {
+          for (node = keyblock, node2 = *r_keyblock;
+               node && node2;
+               node = node->next, node2 = node2->next)
+            node->flag = ((node->flag & ~3) | (node2->flag & 3));
+          release_kbnode (*r_keyblock);
+          *r_keyblock = keyblock;
+          if (DBG_CACHE)
+            log_debug ("merge_selfsigs: using cached keyblock\n");
+          ce->next = merge_cache;
+          merge_cache = ce;
+          merge_cache_entries++;
+          return;
+        }
+      release_merge_cache_entry (ce);
+    }
+
+  merge_selfsigs (ctrl, *r_keyblock);
+
+  keyblock = clone_merged_keyblock (*r_keyblock);
+  if (!keyblock)
+    return;
+  if (merge_cache_entries >= MAX_MERGE_CACHE_ENTRIES)
+    {
+      /* Drop the least recently used entry.  */
+      for (ce = merge_cache, ceprev = NULL; ce->next;
+           ceprev = ce, ce = ce->next)
+        ;
+      if (ceprev)
+        ceprev->next = NULL;
+      else
+        merge_cache = NULL;
+      release_merge_cache_entry (ce);
+      merge_cache_entries--;
+    }
+  ce = xmalloc_clear (sizeof *ce);
+  memcpy (ce->digest, digest, KEYDB_DIGEST_LEN);
+  ce->created = curtime;
+  ce->next_event = next_keyblock_event (keyblock, curtime);
+  ce->keyblock = keyblock;
+  ce->next = merge_cache;
+  merge_cache = ce;
+  merge_cache_entries++;
+}
+
+
 /* A high-level function to lookup keys.
  *
  * This function builds on top of the low-level keydb API.  It first
@@ -3732,7 +4251,7 @@ lookup (ctrl_t ctrl, getkey_ctx_t ctx, int want_secret,
 
       /* Warning: node flag bits 0 and 1 should be preserved by
        * merge_selfsigs.  */
-      merge_selfsigs (ctrl, keyblock);
+      merge_selfsigs_cached (ctrl, ctx->kr_handle, &keyblock);
       found_key = finish_lookup (keyblock, ctx->req_usage, ctx->exact,
                                  want_secret, &infoflags);
       print_status_key_considered (keyblock, infoflags);
@@ -62,6 +62,7 @@
 #include "call-dirmngr.h"
 #include "tofu.h"
 #include "objcache.h"
+#include "timing.h"
 #include "../common/init.h"
 #include "../common/mbox-util.h"
 #include "../common/shareddefs.h"
@@ -109,6 +110,10 @@ enum cmd_and_opt_values
     oMaxOutput,
     oInputSizeHint,
     oChunkSize,
+    oAEADJobs,
+    oCompressJobs,
+    oRecipientJobs,
+    oJobs,
     oSigNotation,
     oCertNotation,
     oShowNotation,
@@ -129,6 +134,8 @@ enum cmd_and_opt_values
     aLSignKey,
     aQuickSignKey,
     aQuickLSignKey,
+    aQuickSignKeys,
+    aQuickLSignKeys,
     aQuickAddUid,
     aQuickAddKey,
     aQuickRevUid,
@@ -230,7 +237,9 @@ enum cmd_and_opt_values
     oDebugAll,
     oDebugIOLBF,
     oDebugSetIobufSize,
+    oDebugSetTempSpillSize,
     oDebugAllowLargeChunks,
+    oDebugTiming,
     oStatusFD,
     oStatusFile,
     oAttributeFD,
@@ -240,6 +249,10 @@ enum cmd_and_opt_values
     oCompletesNeeded,
     oMarginalsNeeded,
     oMaxCertDepth,
+    oTrustDBJobs,
+    oImportJobs,
+    oListJobs,
+    oExportJobs,
     oLoadExtension,
     oCompliance,
     oGnuPG,
@@ -371,6 +384,7 @@ enum cmd_and_opt_values
     oFixedListMode,
     oLegacyListMode,
     oNoSigCache,
+    oUidCacheSnapshot,
     oAutoCheckTrustDB,
     oNoAutoCheckTrustDB,
     oPreservePermissions,
@@ -494,6 +508,8 @@ static gpgrt_opt_t opts[] = {
               N_("quickly sign a key")),
   ARGPARSE_c (aQuickLSignKey, "quick-lsign-key",
               N_("quickly sign a key locally")),
+  ARGPARSE_c (aQuickSignKeys,  "quick-sign-keys" , "@"),
+  ARGPARSE_c (aQuickLSignKeys, "quick-lsign-keys", "@"),
   ARGPARSE_c (aSignKey,  "sign-key"   ,N_("sign a key")),
   ARGPARSE_c (aLSignKey, "lsign-key"  ,N_("sign a key locally")),
   ARGPARSE_c (aEditKey,  "edit-key"   ,N_("sign or edit a key")),
@@ -576,7 +592,9 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oDebugAll, "debug-all", "@"),
   ARGPARSE_s_n (oDebugIOLBF, "debug-iolbf", "@"),
   ARGPARSE_s_u (oDebugSetIobufSize, "debug-set-iobuf-size", "@"),
+  ARGPARSE_s_u (oDebugSetTempSpillSize, "debug-set-temp-spill-size", "@"),
   ARGPARSE_s_u (oDebugAllowLargeChunks, "debug-allow-large-chunks", "@"),
+  ARGPARSE_s_s (oDebugTiming, "debug-timing", "@"),
   ARGPARSE_s_s (oDisplayCharset, "display-charset", "@"),
   ARGPARSE_s_s (oDisplayCharset, "charset", "@"),
   ARGPARSE_conffile (oOptions, "options", N_("|FILE|read options from FILE")),
@@ -682,6 +700,10 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_i (oCompletesNeeded, "completes-needed", "@"),
   ARGPARSE_s_i (oMarginalsNeeded, "marginals-needed", "@"),
   ARGPARSE_s_i (oMaxCertDepth,	"max-cert-depth", "@" ),
+  ARGPARSE_s_i (oTrustDBJobs,	"trustdb-jobs", "@" ),
+  ARGPARSE_s_i (oImportJobs,	"import-jobs", "@" ),
+  ARGPARSE_s_i (oListJobs,	"list-jobs", "@" ),
+  ARGPARSE_s_i (oExportJobs,	"export-jobs", "@" ),
 #ifndef NO_TRUST_MODELS
   ARGPARSE_s_s (oTrustDBName, "trustdb-name", "@"),
   ARGPARSE_s_n (oAutoCheckTrustDB, "auto-check-trustdb", "@"),
@@ -741,6 +763,10 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oMangleDosFilenames,      "mangle-dos-filenames", "@"),
   ARGPARSE_s_n (oNoMangleDosFilenames, "no-mangle-dos-filenames", "@"),
   ARGPARSE_s_i (oChunkSize, "chunk-size", "@"),
+  ARGPARSE_s_i (oAEADJobs, "aead-jobs", "@"),
+  ARGPARSE_s_i (oCompressJobs, "compress-jobs", "@"),
+  ARGPARSE_s_i (oRecipientJobs, "recipient-jobs", "@"),
+  ARGPARSE_s_i (oJobs, "jobs", "@"),
   ARGPARSE_s_n (oNoSymkeyCache, "no-symkey-cache", "@"),
   ARGPARSE_s_n (oSkipVerify, "skip-verify", "@"),
   ARGPARSE_s_n (oListOnly, "list-only", "@"),
@@ -848,6 +874,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oEnableSpecialFilenames, "enable-special-filenames", "@"),
   ARGPARSE_s_n (oNoRandomSeedFile,  "no-random-seed-file", "@"),
   ARGPARSE_s_n (oNoSigCache,         "no-sig-cache", "@"),
+  ARGPARSE_s_n (oUidCacheSnapshot,   "uid-cache-snapshot", "@"),
   ARGPARSE_s_n (oIgnoreTimeConflict, "ignore-time-conflict", "@"),
   ARGPARSE_s_n (oIgnoreValidFrom,    "ignore-valid-from", "@"),
   ARGPARSE_s_n (oIgnoreCrcError, "ignore-crc-error", "@"),
@@ -2287,6 +2314,7 @@ gpg_deinit_default_ctrl (ctrl_t ctrl)
 
   keydb_release (ctrl->cached_getkey_kdb);
   gpg_keyboxd_deinit_session_data (ctrl);
+  release_recipient_cache (ctrl);
 }
 
 
@@ -2632,6 +2660,8 @@ main (int argc, char **argv)
 	  case aSign:
 	  case aQuickSignKey:
 	  case aQuickLSignKey:
+	  case aQuickSignKeys:
+	  case aQuickLSignKeys:
 	  case aSignKey:
 	  case aLSignKey:
 	  case aStore:
@@ -2702,6 +2732,22 @@ main (int argc, char **argv)
             opt.chunk_size = pargs.r.ret_int;
             break;
 
+          case oAEADJobs:
+            opt.aead_jobs = pargs.r.ret_int;
+            break;
+
+          case oCompressJobs:
+            opt.compress_jobs = pargs.r.ret_int;
+            break;
+
+          case oRecipientJobs:
+            opt.recipient_jobs = pargs.r.ret_int;
+            break;
+
+          case oJobs:
+            opt.multifile_jobs = pargs.r.ret_int;
+            break;
+
 	  case oQuiet: opt.quiet = 1; break;
 	  case oNoTTY: tty_no_terminal(1); break;
 	  case oDryRun: opt.dry_run = 1; break;
@@ -2779,10 +2825,18 @@ main (int argc, char **argv)
             opt_set_iobuf_size_used = 1;
             break;
 
+          case oDebugSetTempSpillSize:
+            iobuf_set_temp_spill_size (pargs.r.ret_ulong);
+            break;
+
           case oDebugAllowLargeChunks:
             allow_large_chunks = 1;
             break;
 
+          case oDebugTiming:
+            timing_open (pargs.r.ret_str);
+            break;
+
 	  case oStatusFD:
             set_status_fd ( translate_sys2libc_fd_int (pargs.r.ret_int, 1) );
             break;
@@ -2865,6 +2919,10 @@ main (int argc, char **argv)
 	  case oCompletesNeeded: opt.completes_needed = pargs.r.ret_int; break;
 	  case oMarginalsNeeded: opt.marginals_needed = pargs.r.ret_int; break;
 	  case oMaxCertDepth: opt.max_cert_depth = pargs.r.ret_int; break;
+	  case oTrustDBJobs: opt.trustdb_jobs = pargs.r.ret_int; break;
+	  case oImportJobs: opt.import_jobs = pargs.r.ret_int; break;
+	  case oListJobs: opt.list_jobs = pargs.r.ret_int; break;
+	  case oExportJobs: opt.export_jobs = pargs.r.ret_int; break;
 
 #ifndef NO_TRUST_MODELS
 	  case oTrustDBName: trustdb_name = pargs.r.ret_str; break;
@@ -3399,6 +3457,7 @@ main (int argc, char **argv)
             }
             break;
           case oNoSigCache: opt.no_sig_cache = 1; break;
+          case oUidCacheSnapshot: opt.uid_cache_snapshot = 1; break;
 	  case oAllowNonSelfsignedUID: opt.allow_non_selfsigned_uid = 1; break;
 	  case oNoAllowNonSelfsignedUID: opt.allow_non_selfsigned_uid=0; break;
 	  case oAllowFreeformUID: opt.allow_freeform_uid = 1; break;
@@ -4093,17 +4152,21 @@ main (int argc, char **argv)
      * need to add the keyrings if we are running under SELinux, this
      * is so that the rings are added to the list of secured files.
      * We do not add any keyring if --no-keyring or --use-keyboxd has
-     * been used.  */
+     * been used.  The keyrings are only registered with the first
+     * keydb handle so that commands not accessing keys do not need to
+     * check or create the files.  */
     if (!opt.use_keyboxd
         && default_keyring >= 0
         && (ALWAYS_ADD_KEYRINGS
             || (cmd != aDeArmor && cmd != aEnArmor && cmd != aGPGConfTest)))
       {
 	if (!nrings || default_keyring > 0)  /* Add default ring. */
-	    keydb_add_resource ("pubring" EXTSEP_S GPGEXT_GPG,
-                                KEYDB_RESOURCE_FLAG_DEFAULT);
+	    keydb_defer_resource ("pubring" EXTSEP_S GPGEXT_GPG,
+                                  KEYDB_RESOURCE_FLAG_DEFAULT);
 	for (sl = nrings; sl; sl = sl->next )
-          keydb_add_resource (sl->d, sl->flags);
+          keydb_defer_resource (sl->d, sl->flags);
+        if (ALWAYS_ADD_KEYRINGS)
+          keydb_add_deferred_resources ();
       }
     FREE_STRLIST(nrings);
 
@@ -4440,6 +4503,17 @@ main (int argc, char **argv)
         }
 	break;
 
+      case aQuickSignKeys:
+      case aQuickLSignKeys:
+        if (argc < 1)
+          wrong_args ("--quick-[l]sign-keys fingerprints");
+        sl = NULL;
+        for( ; argc; argc--, argv++)
+          append_to_strlist2 (&sl, *argv, utf8_strings);
+        keyedit_quick_sign_many (ctrl, sl, locusr, (cmd == aQuickLSignKeys));
+        free_strlist (sl);
+	break;
+
       case aSignKey:
 	if( argc != 1 )
 	  wrong_args("--sign-key user-id");
@@ -5230,13 +5304,18 @@ g10_exit( int rc )
     write_status_failure ("gpg-exit", gpg_error (GPG_ERR_GENERAL));
 
   gcry_control (GCRYCTL_UPDATE_RANDOM_SEED_FILE);
+  sig_cache_flush ();
+  objcache_write_snapshot ();
+  timing_close ();
   if (DBG_CLOCK)
     log_clock ("stop");
 
   if ( (opt.debug & DBG_MEMSTAT_VALUE) )
     {
       keydb_dump_stats ();
+      getkey_dump_stats ();
       sig_check_dump_stats ();
+      sig_cache_dump_stats ();
       objcache_dump_stats ();
       gcry_control (GCRYCTL_DUMP_MEMORY_STATS);
       gcry_control (GCRYCTL_DUMP_RANDOM_STATS);
@@ -102,6 +102,11 @@ struct server_control_s
   /* Local data for call-keyboxd.c  */
   keyboxd_local_t keyboxd_local;
 
+  /* The number of stores the keyboxd may combine into one
+   * transaction or 0 for the standard mode.  See
+   * keydb_set_bulk_mode.  */
+  unsigned int keyboxd_bulk_store;
+
   /* Local data for tofu.c  */
   struct {
     tofu_dbs_t dbs;
@@ -110,6 +115,9 @@ struct server_control_s
 
   /* This is used to cache a key data base handle.  */
   KEYDB_HANDLE cached_getkey_kdb;
+
+  /* Local data for pkclist.c  */
+  struct recipient_cache_s *recipient_cache;
 };
 
 
@@ -697,6 +697,17 @@ agent_get_keyinfo (ctrl_t ctrl, const char *hexkeygrip,
   return gpg_error (GPG_ERR_NO_SECKEY);
 }
 
+void
+agent_begin_keygrip_cache (ctrl_t ctrl)
+{
+  (void)ctrl;
+}
+
+void
+agent_end_keygrip_cache (void)
+{
+}
+
 gpg_error_t
 gpg_dirmngr_get_pka (ctrl_t ctrl, const char *userid,
                      unsigned char **r_fpr, size_t *r_fprlen,
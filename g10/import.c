@@ -62,6 +62,8 @@ struct import_stats_s
   ulong n_sigs_cleaned;
   ulong n_uids_cleaned;
   ulong v3keys;   /* Number of V3 keys seen.  */
+  char *cache_nonce;  /* The passphrase cache nonce used for all
+                       * secret keys of this import.  */
 };
 
 
@@ -78,6 +80,23 @@ struct import_stats_s
 /* A flag used by transfer_secret_keys. */
 #define NODE_TRANSFER_SECKEY 16
 
+/* The number of keyblocks read ahead in bulk import mode.  */
+#define IMPORT_BULK_BATCH  256
+/* The number of stores the keyboxd may combine into one transaction
+ * in bulk import mode.  */
+#define IMPORT_BULK_STORES 1000
+
+
+/* The read ahead state of the bulk import mode.  */
+struct import_bulk_s
+{
+  kbnode_t blocks[IMPORT_BULK_BATCH];
+  int nblocks;  /* The number of keyblocks in BLOCKS.  */
+  int next;     /* The index of the next keyblock to return.  */
+  int v3keys;   /* The number of v3 keys skipped while reading ahead.  */
+  int rc;       /* The return code of the last read_block.  */
+};
+
 
 /* An object and a global instance to store selectors created from
  * --import-filter keep-uid=EXPR.
@@ -104,6 +123,9 @@ static int import (ctrl_t ctrl,
                    int origin, const char *url);
 static int read_block (IOBUF a, unsigned int options,
                        PACKET **pending_pkt, kbnode_t *ret_root, int *r_v3keys);
+static int read_next_block (IOBUF a, unsigned int options,
+                            struct import_bulk_s *bulk, PACKET **pending_pkt,
+                            kbnode_t *ret_root, int *r_v3keys);
 static void revocation_present (ctrl_t ctrl, kbnode_t keyblock);
 static gpg_error_t import_one (ctrl_t ctrl,
                        kbnode_t keyblock,
@@ -206,6 +228,9 @@ parse_import_options(char *str,unsigned int *options,int noisy)
       {"repair-keys", IMPORT_REPAIR_KEYS, NULL,
        N_("repair keys on import")},
 
+      {"bulk-import", IMPORT_BULK, NULL,
+       N_("speed up the import of large key collections")},
+
       /* No description to avoid string change: Fixme for 2.3 */
       {"show-only", (IMPORT_SHOW | IMPORT_DRY_RUN), NULL,
        NULL},
@@ -311,6 +336,8 @@ import_new_stats_handle (void)
 void
 import_release_stats_handle (import_stats_t p)
 {
+  if (p)
+    xfree (p->cache_nonce);
   xfree (p);
 }
 
@@ -578,11 +605,31 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
                                 grasp the return semantics of
                                 read_block. */
   kbnode_t secattic = NULL;  /* Kludge for PGP desktop percularity */
+  struct import_bulk_s *bulk = NULL;
+  int bulk_stores = 0;
   int rc = 0;
   int v3keys;
+  int i;
 
   getkey_disable_caches ();
 
+  if ((options & IMPORT_BULK))
+    {
+      bulk = xtrycalloc (1, sizeof *bulk);
+      if (!bulk)
+        return gpg_error_from_syserror ();
+      if (!(opt.dry_run || (options & IMPORT_DRY_RUN)))
+        {
+          rc = keydb_set_bulk_mode (ctrl, IMPORT_BULK_STORES);
+          if (rc)
+            {
+              xfree (bulk);
+              return rc;
+            }
+          bulk_stores = 1;
+        }
+    }
+
   if (!opt.no_armor) /* Armored reading is not disabled.  */
     {
       armor_filter_context_t *afx;
@@ -593,7 +640,8 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
       release_armor_context (afx);
     }
 
-  while (!(rc = read_block (inp, options, &pending_pkt, &keyblock, &v3keys)))
+  while (!(rc = read_next_block (inp, options, bulk,
+                                 &pending_pkt, &keyblock, &v3keys)))
     {
       stats->v3keys += v3keys;
       if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
@@ -693,6 +741,20 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
 
   release_kbnode (secattic);
 
+  if (bulk)
+    {
+      /* Release the keyblocks read ahead but not processed.  */
+      for (i = bulk->next; i < bulk->nblocks; i++)
+        release_kbnode (bulk->blocks[i]);
+      xfree (bulk);
+    }
+  if (bulk_stores)
+    {
+      gpg_error_t err = keydb_set_bulk_mode (ctrl, 0);
+      if (!rc)
+        rc = err;
+    }
+
   /* When read_block loop was stopped by error, we have PENDING_PKT left.  */
   if (pending_pkt)
     {
@@ -865,10 +927,11 @@ read_block( IOBUF a, unsigned int options,
   PACKET *pkt;
   kbnode_t root = NULL;
   kbnode_t lastnode = NULL;
-  int in_cert, in_v3key, skip_sigs;
+  int in_cert, in_v3key, skip_sigs, skip_uids;
   u32 keyid[2];
   int got_keyid = 0;
   unsigned int dropped_nonselfsigs = 0;
+  unsigned int dropped_uids = 0;
 
   *r_v3keys = 0;
 
@@ -885,13 +948,15 @@ read_block( IOBUF a, unsigned int options,
   else
     in_cert = 0;
 
-  pkt = xmalloc (sizeof *pkt);
-  init_packet (pkt);
+  pkt = kbnode_new_packet ();
+  if (!pkt)
+    xoutofcore ();
   init_parse_packet (&parsectx, a);
   if (!(options & IMPORT_RESTORE))
     parsectx.skip_meta = 1;
   in_v3key = 0;
   skip_sigs = 0;
+  skip_uids = 0;
   while ((rc=parse_packet (&parsectx, pkt)) != -1)
     {
       if (rc && (gpg_err_code (rc) == GPG_ERR_LEGACY_KEY
@@ -956,6 +1021,27 @@ read_block( IOBUF a, unsigned int options,
         }
       in_v3key = 0;
 
+      /* With import-drop-uids everything from the first user ID up
+       * to the next subkey is removed later anyway.  Skip it here so
+       * that flooded user IDs are never stored.  */
+      if (skip_uids)
+        {
+          if (pkt->pkttype == PKT_PUBLIC_SUBKEY
+              || pkt->pkttype == PKT_SECRET_SUBKEY
+              || pkt->pkttype == PKT_PUBLIC_KEY
+              || pkt->pkttype == PKT_SECRET_KEY
+              || pkt->pkttype == PKT_COMPRESSED)
+            skip_uids = 0;
+          else
+            {
+              if (pkt->pkttype == PKT_USER_ID)
+                dropped_uids++;
+              free_packet (pkt, &parsectx);
+              init_packet (pkt);
+              continue;
+            }
+        }
+
       if (!root && pkt->pkttype == PKT_SIGNATURE
           && IS_KEY_REV (pkt->pkt.signature) )
         {
@@ -1021,6 +1107,15 @@ read_block( IOBUF a, unsigned int options,
           init_packet(pkt);
           break;
 
+        case PKT_USER_ID:
+          if (!in_cert || !(options & IMPORT_DROP_UIDS))
+            goto x_default;
+          skip_uids = 1;
+          dropped_uids++;
+          free_packet (pkt, &parsectx);
+          init_packet (pkt);
+          break;
+
         case PKT_PUBLIC_KEY:
         case PKT_SECRET_KEY:
           if (!got_keyid)
@@ -1048,7 +1143,9 @@ read_block( IOBUF a, unsigned int options,
                   lastnode->next = new_kbnode (pkt);
                   lastnode = lastnode->next;
                 }
-              pkt = xmalloc (sizeof *pkt);
+              pkt = kbnode_new_packet ();
+              if (!pkt)
+                xoutofcore ();
             }
           else
             free_packet (pkt, &parsectx);
@@ -1071,11 +1168,64 @@ read_block( IOBUF a, unsigned int options,
   if (!rc && dropped_nonselfsigs && opt.verbose)
     log_info ("key %s: number of dropped non-self-signatures: %u\n",
               keystr (keyid), dropped_nonselfsigs);
+  if (!rc && dropped_uids && opt.verbose)
+    log_info ("key %s: number of dropped user IDs: %u\n",
+              keystr (keyid), dropped_uids);
 
   return rc;
 }
 
 
+/* Return the next keyblock from stream A like read_block does.  If
+ * BULK is not NULL the public keyblocks are read ahead in batches and
+ * their self-signatures are verified using --import-jobs threads so
+ * that import_one finds them in the signature cache.  */
+static int
+read_next_block (IOBUF a, unsigned int options, struct import_bulk_s *bulk,
+                 PACKET **pending_pkt, kbnode_t *ret_root, int *r_v3keys)
+{
+  kbnode_t keyblock;
+  int v3keys;
+
+  if (!bulk)
+    return read_block (a, options, pending_pkt, ret_root, r_v3keys);
+
+  if (bulk->next == bulk->nblocks && !bulk->rc)
+    {
+      bulk->next = bulk->nblocks = 0;
+      while (bulk->nblocks < DIM (bulk->blocks))
+        {
+          bulk->rc = read_block (a, options, pending_pkt, &keyblock, &v3keys);
+          bulk->v3keys += v3keys;
+          if (bulk->rc)
+            break;
+          bulk->blocks[bulk->nblocks++] = keyblock;
+          /* Do not read beyond other blocks so that the PGP desktop
+           * kludge in import still sees the public key which follows
+           * a secret key.  */
+          if (keyblock->pkt->pkttype != PKT_PUBLIC_KEY)
+            break;
+        }
+
+      /* The PKS repair moves binding signatures around after having
+       * checked them; a cached result would get into its way.  */
+      if (!(options & IMPORT_REPAIR_PKS_SUBKEY_BUG))
+        check_self_signatures_parallel (bulk->blocks, bulk->nblocks,
+                                        opt.import_jobs > 1
+                                        ? opt.import_jobs : 1);
+    }
+
+  *r_v3keys = bulk->v3keys;
+  bulk->v3keys = 0;
+  if (bulk->next < bulk->nblocks)
+    {
+      *ret_root = bulk->blocks[bulk->next++];
+      return 0;
+    }
+  return bulk->rc;
+}
+
+
 /* Walk through the subkeys on a pk to find if we have the PKS
    disease: multiple subkeys with their binding sigs stripped, and the
    sig for the first subkey placed after the last subkey.  That is,
@@ -1379,11 +1529,7 @@ impex_filter_getval (void *cookie, const char *propname)
         result = uid->name;
       else if (!strcmp (propname, "mbox"))
         {
-          if (!uid->mbox)
-            {
-              uid->mbox = mailbox_from_userid (uid->name, 0);
-            }
-          result = uid->mbox;
+          result = user_id_mbox (uid);
         }
       else if (!strcmp (propname, "primary"))
         {
@@ -1920,6 +2066,14 @@ import_one_real (ctrl_t ctrl,
     log_info (_("key %s: PKS subkey corruption repaired\n"),
               keystr_from_pk(pk));
 
+  /* Verify the self-signatures using several threads.  The results
+   * are stored in the signature cache and thus the checks below do
+   * not need to repeat the public key operations.  Keyblocks read
+   * ahead by the bulk import have already been done; their cached
+   * signatures are skipped.  */
+  if (opt.import_jobs > 1)
+    check_self_signatures_parallel (&keyblock, 1, opt.import_jobs);
+
   if ((options & IMPORT_REPAIR_KEYS))
     key_check_all_keysigs (ctrl, 1, keyblock, 0, 0);
 
@@ -2094,7 +2248,7 @@ import_one_real (ctrl_t ctrl,
 
           clear_ownertrusts (ctrl, pk);
           if (non_self)
-            revalidation_mark (ctrl);
+            revalidation_mark_key (ctrl, keyblock);
         }
 
       /* Release the handle and thus unlock the keyring asap.  */
@@ -2187,7 +2341,7 @@ import_one_real (ctrl_t ctrl,
             log_error (_("error writing keyring '%s': %s\n"),
                        keydb_get_resource_name (hd), gpg_strerror (err));
           else if (non_self)
-            revalidation_mark (ctrl);
+            revalidation_mark_key (ctrl, keyblock_orig);
 
           /* Release the handle and thus unlock the keyring asap.  */
           keydb_release (hd);
@@ -2393,9 +2547,14 @@ transfer_secret_keys (ctrl_t ctrl, struct import_stats_s *stats,
   gcry_cipher_hd_t cipherhd = NULL;
   unsigned char *wrappedkey = NULL;
   size_t wrappedkeylen;
-  char *cache_nonce = NULL;
+  char *cache_nonce;
   int stub_key_skipped = 0;
 
+  /* Use the cache nonce of the previous keys so that the passphrase
+   * needs to be entered only once for a batch of keys protected by
+   * the same passphrase.  */
+  cache_nonce = stats? stats->cache_nonce : NULL;
+
   /* Get the current KEK.  */
   err = agent_keywrap_key (ctrl, 0, &kek, &keklen);
   if (err)
@@ -2483,12 +2642,13 @@ transfer_secret_keys (ctrl_t ctrl, struct import_stats_s *stats,
           || pk->pubkey_algo == PUBKEY_ALGO_ECDH)
         {
           /* The ECC case.  */
-          char *curvestr = openpgp_oid_to_str (pk->pkey[0]);
-          if (!curvestr)
+          const char *curvename = openpgp_oidmpi_to_curve (pk->pkey[0], 1);
+          char *curvestr = NULL;
+
+          if (!curvename && !(curvestr = openpgp_oid_to_str (pk->pkey[0])))
             err = gpg_error_from_syserror ();
           else
             {
-              const char *curvename = openpgp_oid_to_curve (curvestr, 1);
               gcry_sexp_release (curve);
               err = gcry_sexp_build (&curve, NULL, "(curve %s)",
                                      curvename?curvename:curvestr);
@@ -2653,7 +2813,10 @@ transfer_secret_keys (ctrl_t ctrl, struct import_stats_s *stats,
 
  leave:
   gcry_sexp_release (curve);
-  xfree (cache_nonce);
+  if (stats)
+    stats->cache_nonce = cache_nonce;
+  else
+    xfree (cache_nonce);
   xfree (wrappedkey);
   xfree (transferkey);
   gcry_cipher_close (cipherhd);
@@ -2795,8 +2958,10 @@ do_transfer (ctrl_t ctrl, kbnode_t keyblock, PKT_public_key *pk,
   gpg_error_t err;
   struct import_stats_s subkey_stats = {0};
 
+  subkey_stats.cache_nonce = stats->cache_nonce;
   err = transfer_secret_keys (ctrl, &subkey_stats, keyblock,
                               batch, 0, only_marked);
+  stats->cache_nonce = subkey_stats.cache_nonce;
   if (gpg_err_code (err) == GPG_ERR_NOT_PROCESSED)
     {
       /* TRANSLATORS: For a smartcard, each private key on host has a
@@ -3251,7 +3416,7 @@ list_standalone_revocation (ctrl_t ctrl, PKT_signature *sig, int sigrc)
       es_putc ('\n', es_stdout);
 
       if (opt.show_subpackets)
-        print_subpackets_colon (sig);
+        print_subpackets_colon (es_stdout, sig);
     }
   else /* Human readable. */
     {
@@ -3928,6 +4093,104 @@ remove_all_non_self_sigs (kbnode_t *keyblock, u32 *keyid)
 }
 
 
+/* A set of signatures to detect duplicates as defined by
+ * cmp_signatures in linear time.  Without it keys flooded with
+ * third-party signatures take ages to import.  The set does not own
+ * the signatures.  */
+struct sig_set_s
+{
+  unsigned int size;      /* Number of slots; 0 or a power of 2.  */
+  unsigned int count;     /* Number of used slots.  */
+  PKT_signature **slots;
+};
+
+
+/* Return the hash of the fields compared by cmp_signatures.  */
+static unsigned int
+sig_set_hash (PKT_signature *sig)
+{
+  unsigned char buffer[1024];
+  const unsigned char *p = NULL;
+  unsigned int h = 2166136261u;  /* FNV-1a */
+  unsigned int nbits;
+  size_t n = 0;
+
+  h = (h ^ sig->keyid[0]) * 16777619;
+  h = (h ^ sig->keyid[1]) * 16777619;
+  h = (h ^ sig->pubkey_algo) * 16777619;
+  if (!sig->data[0])
+    ;
+  else if (gcry_mpi_get_flag (sig->data[0], GCRYMPI_FLAG_OPAQUE))
+    {
+      p = gcry_mpi_get_opaque (sig->data[0], &nbits);
+      n = p? (nbits+7)/8 : 0;
+    }
+  else if (!gcry_mpi_print (GCRYMPI_FMT_USG, buffer, sizeof buffer,
+                            &n, sig->data[0]))
+    p = buffer;
+  else
+    {
+      /* Too long for our buffer; use the length and the low bits.  */
+      h = (h ^ gcry_mpi_get_nbits (sig->data[0])) * 16777619;
+      for (nbits=0; nbits < 64; nbits++)
+        h = (h ^ gcry_mpi_test_bit (sig->data[0], nbits)) * 16777619;
+      n = 0;
+    }
+
+  for (; n; n--, p++)
+    h = (h ^ *p) * 16777619;
+  return h;
+}
+
+
+/* Add SIG to SET unless an identical signature is already in SET.
+ * Returns true if such a duplicate was found.  */
+static int
+sig_set_insert (struct sig_set_s *set, PKT_signature *sig)
+{
+  PKT_signature **oldslots;
+  unsigned int oldsize, i, j, mask;
+
+  if (!pubkey_get_nsig (sig->pubkey_algo))
+    return 0;  /* cmp_signatures never considers them equal.  */
+
+  if (2 * (set->count + 1) > set->size)
+    {
+      oldslots = set->slots;
+      oldsize = set->size;
+      set->size = oldsize? 2 * oldsize : 32;
+      set->slots = xcalloc (set->size, sizeof *set->slots);
+      mask = set->size - 1;
+      for (j=0; j < oldsize; j++)
+        if (oldslots[j])
+          {
+            for (i = sig_set_hash (oldslots[j]) & mask; set->slots[i];
+                 i = (i + 1) & mask)
+              ;
+            set->slots[i] = oldslots[j];
+          }
+      xfree (oldslots);
+    }
+
+  mask = set->size - 1;
+  for (i = sig_set_hash (sig) & mask; set->slots[i]; i = (i + 1) & mask)
+    if (!cmp_signatures (set->slots[i], sig))
+      return 1;
+  set->slots[i] = sig;
+  set->count++;
+  return 0;
+}
+
+
+/* Release the memory used by SET and make it empty.  */
+static void
+sig_set_release (struct sig_set_s *set)
+{
+  xfree (set->slots);
+  memset (set, 0, sizeof *set);
+}
+
+
 /*
  * It may happen that the imported keyblock has duplicated user IDs.
  * We check this here and collapse those user IDs together with their
@@ -3939,6 +4202,9 @@ collapse_uids (kbnode_t *keyblock)
 {
   kbnode_t uid1;
   int any=0;
+  struct sig_set_s sigset;
+
+  memset (&sigset, 0, sizeof sigset);
 
   for(uid1=*keyblock;uid1;uid1=uid1->next)
     {
@@ -3987,11 +4253,10 @@ collapse_uids (kbnode_t *keyblock)
 	      uid1->next=uid2;
 	      delete_kbnode(uid2);
 
-	      /* Now dedupe uid1 */
+	      /* Now dedupe uid1; the first of identical signatures
+	         is kept.  */
 	      for(sig1=uid1->next;sig1;sig1=sig1->next)
 		{
-		  kbnode_t sig2;
-
 		  if(is_deleted_kbnode(sig1))
 		    continue;
 
@@ -4003,29 +4268,10 @@ collapse_uids (kbnode_t *keyblock)
 		  if(sig1->pkt->pkttype!=PKT_SIGNATURE)
 		    continue;
 
-		  for(sig2=sig1->next,last=sig1;sig2;last=sig2,sig2=sig2->next)
-		    {
-		      if(is_deleted_kbnode(sig2))
-			continue;
-
-		      if(sig2->pkt->pkttype==PKT_USER_ID
-			 || sig2->pkt->pkttype==PKT_PUBLIC_SUBKEY
-			 || sig2->pkt->pkttype==PKT_SECRET_SUBKEY)
-			break;
-
-		      if(sig2->pkt->pkttype!=PKT_SIGNATURE)
-			continue;
-
-		      if(cmp_signatures(sig1->pkt->pkt.signature,
-					sig2->pkt->pkt.signature)==0)
-			{
-			  /* We have a match, so delete the second
-			     signature */
-			  delete_kbnode(sig2);
-			  sig2=last;
-			}
-		    }
+		  if (sig_set_insert (&sigset, sig1->pkt->pkt.signature))
+		    delete_kbnode (sig1);
 		}
+	      sig_set_release (&sigset);
 	    }
 	}
     }
@@ -4412,11 +4658,16 @@ static int
 merge_sigs (kbnode_t dst, kbnode_t src, int *n_sigs)
 {
   kbnode_t n, n2;
-  int found = 0;
+  struct sig_set_s sigset;
 
   log_assert (dst->pkt->pkttype == PKT_USER_ID);
   log_assert (src->pkt->pkttype == PKT_USER_ID);
 
+  memset (&sigset, 0, sizeof sigset);
+  for (n2=dst->next; n2 && n2->pkt->pkttype != PKT_USER_ID; n2 = n2->next)
+    if (n2->pkt->pkttype == PKT_SIGNATURE)
+      sig_set_insert (&sigset, n2->pkt->pkt.signature);
+
   for (n=src->next; n && n->pkt->pkttype != PKT_USER_ID; n = n->next)
     {
       if (n->pkt->pkttype != PKT_SIGNATURE )
@@ -4425,14 +4676,7 @@ merge_sigs (kbnode_t dst, kbnode_t src, int *n_sigs)
           || IS_SUBKEY_REV (n->pkt->pkt.signature) )
         continue; /* skip signatures which are only valid on subkeys */
 
-      found = 0;
-      for (n2=dst->next; n2 && n2->pkt->pkttype != PKT_USER_ID; n2 = n2->next)
-        if (!cmp_signatures(n->pkt->pkt.signature,n2->pkt->pkt.signature))
-          {
-            found++;
-            break;
-          }
-      if (!found )
+      if (!sig_set_insert (&sigset, n->pkt->pkt.signature))
         {
           /* This signature is new or newer, append N to DST.
            * We add a clone to the original keyblock, because this
@@ -4445,6 +4689,7 @@ merge_sigs (kbnode_t dst, kbnode_t src, int *n_sigs)
 	}
     }
 
+  sig_set_release (&sigset);
   return 0;
 }
 
@@ -31,8 +31,15 @@
 
 #define USE_UNUSED_NODES 1
 
+/* The maximum number of released packet structures kept for reuse.  */
+#define MAX_UNUSED_PACKETS 1024
+
 static int cleanup_registered;
 static KBNODE unused_nodes;
+#if USE_UNUSED_NODES
+static PACKET *unused_packets[MAX_UNUSED_PACKETS];
+static int n_unused_packets;
+#endif /*USE_UNUSED_NODES*/
 
 static void
 release_unused_nodes (void)
@@ -44,6 +51,8 @@ release_unused_nodes (void)
       xfree (unused_nodes);
       unused_nodes = next;
     }
+  while (n_unused_packets)
+    xfree (unused_packets[--n_unused_packets]);
 #endif /*USE_UNUSED_NODES*/
 }
 
@@ -89,6 +98,52 @@ free_node( KBNODE n )
 
 
 
+/* Return a new initialized packet structure for use with new_kbnode
+ * or NULL on memory error.  The packet structures of released nodes
+ * are reused; thus parsing a keyblock usually needs no malloc call
+ * for them.  A packet allocated this way may be released with xfree
+ * like any other packet.  */
+PACKET *
+kbnode_new_packet (void)
+{
+  PACKET *pkt;
+
+#if USE_UNUSED_NODES
+  if (n_unused_packets)
+    pkt = unused_packets[--n_unused_packets];
+  else
+#endif
+    {
+      pkt = xtrymalloc (sizeof *pkt);
+      if (!pkt)
+        return NULL;
+    }
+  init_packet (pkt);
+  return pkt;
+}
+
+
+/* Free the content of PKT and PKT itself.  */
+static void
+free_node_packet (PACKET *pkt)
+{
+  free_packet (pkt, NULL);
+#if USE_UNUSED_NODES
+  if (pkt && n_unused_packets < MAX_UNUSED_PACKETS)
+    {
+      if (!cleanup_registered)
+        {
+          cleanup_registered = 1;
+          register_mem_cleanup_func (release_unused_nodes);
+        }
+      unused_packets[n_unused_packets++] = pkt;
+      return;
+    }
+#endif
+  xfree (pkt);
+}
+
+
 KBNODE
 new_kbnode( PACKET *pkt )
 {
@@ -117,8 +172,7 @@ release_kbnode( KBNODE n )
     while( n ) {
 	n2 = n->next;
 	if( !is_cloned_kbnode(n) ) {
-            free_packet (n->pkt, NULL);
-            xfree( n->pkt );
+            free_node_packet (n->pkt);
 	}
 	free_node( n );
 	n = n2;
@@ -288,8 +342,7 @@ commit_kbnode( KBNODE *root )
 	    else
 		nl->next = n->next;
 	    if( !is_cloned_kbnode(n) ) {
-                free_packet (n->pkt, NULL);
-		xfree( n->pkt );
+    		free_node_packet (n->pkt);
 	    }
 	    free_node( n );
 	    changed = 1;
@@ -312,8 +365,7 @@ remove_kbnode( KBNODE *root, KBNODE node )
 	    else
 		nl->next = n->next;
 	    if( !is_cloned_kbnode(n) ) {
-                free_packet (n->pkt, NULL);
-		xfree( n->pkt );
+    		free_node_packet (n->pkt);
 	    }
 	    free_node( n );
 	}
@@ -418,6 +418,14 @@ key_check_all_keysigs (ctrl_t ctrl, int mode, kbnode_t kb,
             else if (processed_current_component && n2 == current_component)
               /* Don't process it twice.  */
               continue;
+            else if (!processed_current_component && !opt.no_sig_cache
+                     && sig->flags.checked && sig->flags.valid)
+              {
+                /* Already verified over the current component; for
+                   example by the bulk import.  */
+                err = 0;
+                break;
+              }
             else
               {
                 err = check_signature_over_key_or_uid (ctrl,
@@ -0,0 +1,511 @@
+/* keydb-bloom.c - Bloom filter for negative keydb lookups
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * The filter file
+ *
+ * For a keyring or keybox "pubring.gpg" the Bloom filter is stored in
+ * the file "pubring.gpg.bloom".  The filter has a bit for each of the
+ * long keyids of all primary keys and subkeys in the resource.  A
+ * cleared bit proves that a keyid, or a v4 or v5 fingerprint from
+ * which the keyid can be derived, is not in the resource.  Like the
+ * keybox index, the filter is tied to the size and the modification
+ * time of the resource; a stale filter is rebuilt on the next lookup.
+ * Keys which are inserted or updated by us are added to the filter
+ * right away; deleted keys are not removed, which only creates false
+ * positives.  All integers are stored in network byte order.
+ *
+ *   - b4   Magic 'GPGb'
+ *   - byte Version number (1)
+ *   - b3   RFU
+ *   - u64  Size of the resource file
+ *   - u64  Modification time of the resource file (seconds)
+ *   - u32  Modification time of the resource file (nanoseconds)
+ *   - u32  [NBITS] Number of bits in the filter (a power of 2)
+ *   - u32  Number of keyids added to the filter
+ *   - b4   RFU
+ *   - NBITS/8 bytes with the filter bits.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/sysutils.h"
+#include "../common/host2net.h"
+#include "options.h"
+#include "keydb.h"
+#include "keydb-private.h"
+
+#define BLOOM_MAGIC        "GPGb"
+#define BLOOM_VERSION      1
+#define BLOOM_HEADER_LEN   40
+
+/* Do not use a filter for resources smaller than this.  A scan over
+ * such a small file is fast enough.  */
+#define BLOOM_MIN_FILESIZE (1024*1024)
+
+/* The number of bits to set for each keyid and the number of bits
+ * per keyid used for a new filter.  With these values the rate of
+ * false positives is below 0.1 percent.  If keys added after a build
+ * push the number of bits per keyid below BLOOM_MIN_BITS (about 3
+ * percent false positives) the filter is rebuilt.  */
+#define BLOOM_HASHES       8
+#define BLOOM_BITS_PER_KEY 16
+#define BLOOM_MIN_BITS     8
+#define BLOOM_MIN_NBITS    (1 << 14)
+#define BLOOM_MAX_NBITS    (1u << 31)
+
+
+/* The in-core version of a filter.  */
+struct keydb_bloom_s
+{
+  char *fname;          /* The name of the resource file.  */
+  char *bloomname;      /* The name of the filter file.  */
+
+  /* The state of the resource file this filter is valid for.  */
+  unsigned long long filesize;
+  unsigned long long mtime;
+  unsigned int mtime_ns;
+
+  unsigned int valid:1;     /* The filter bits are valid.  */
+  unsigned int building:1;  /* A build is in progress.  */
+  unsigned int disabled:1;  /* Do not try to rebuild the filter.  */
+
+  u32 nbits;            /* Number of bits in BITS.  */
+  u32 nkeys;            /* Number of added keyids.  */
+  unsigned char *bits;
+
+  /* The keyids collected during a build; each uses 2 slots.  */
+  u32 *kids;
+  size_t nkids;
+  size_t kidssize;
+  struct stat build_sb; /* The state of the file at build start.  */
+};
+
+
+static inline void
+put64 (unsigned char *p, unsigned long long a)
+{
+  p[0] = a >> 56;
+  p[1] = a >> 48;
+  p[2] = a >> 40;
+  p[3] = a >> 32;
+  p[4] = a >> 24;
+  p[5] = a >> 16;
+  p[6] = a >>  8;
+  p[7] = a;
+}
+
+static inline unsigned long long
+get64 (const unsigned char *p)
+{
+  return (((unsigned long long)buf32_to_u32 (p) << 32)
+          | (unsigned long long)buf32_to_u32 (p+4));
+}
+
+
+/* Return true if the state of the resource file as given by SB
+ * matches the state stored in BF.  */
+static int
+same_file_state (keydb_bloom_t bf, struct stat *sb)
+{
+  unsigned int ns;
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  ns = sb->st_mtim.tv_nsec;
+#else
+  ns = 0;
+#endif
+  return (bf->filesize == sb->st_size
+          && bf->mtime == sb->st_mtime
+          && bf->mtime_ns == ns);
+}
+
+
+/* Store the state of the resource file as given by SB in BF.  */
+static void
+set_file_state (keydb_bloom_t bf, struct stat *sb)
+{
+  bf->filesize = sb->st_size;
+  bf->mtime = sb->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  bf->mtime_ns = sb->st_mtim.tv_nsec;
+#else
+  bf->mtime_ns = 0;
+#endif
+}
+
+
+/* Set the bits for the keyid KID in BF.  */
+static void
+set_bits (keydb_bloom_t bf, const u32 *kid)
+{
+  u32 h = kid[1];
+  u32 step = kid[0] | 1;
+  int i;
+
+  for (i=0; i < BLOOM_HASHES; i++, h += step)
+    bf->bits[(h & (bf->nbits - 1)) / 8] |= 1 << (h & 7);
+}
+
+
+/* Write the filter BF to its file.  */
+static gpg_error_t
+write_filter (keydb_bloom_t bf)
+{
+  gpg_error_t err = 0;
+  char *tmpname;
+  FILE *fp;
+  unsigned char hdr[BLOOM_HEADER_LEN];
+
+  tmpname = xtryasprintf ("%s" EXTSEP_S "%u" EXTSEP_S "tmp",
+                          bf->bloomname, (unsigned int)getpid ());
+  if (!tmpname)
+    return gpg_error_from_syserror ();
+
+  memset (hdr, 0, sizeof hdr);
+  memcpy (hdr, BLOOM_MAGIC, 4);
+  hdr[4] = BLOOM_VERSION;
+  put64 (hdr+8, bf->filesize);
+  put64 (hdr+16, bf->mtime);
+  ulongtobuf (hdr+24, bf->mtime_ns);
+  ulongtobuf (hdr+28, bf->nbits);
+  ulongtobuf (hdr+32, bf->nkeys);
+
+  fp = fopen (tmpname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fwrite (hdr, sizeof hdr, 1, fp) != 1
+      || fwrite (bf->bits, bf->nbits / 8, 1, fp) != 1)
+    err = gpg_error_from_syserror ();
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+
+  if (!err)
+    err = gnupg_rename_file (tmpname, bf->bloomname, NULL);
+  if (err)
+    gnupg_remove (tmpname);
+
+ leave:
+  if (err && DBG_CACHE)
+    log_debug ("keydb: error writing '%s': %s\n",
+               bf->bloomname, gpg_strerror (err));
+  xfree (tmpname);
+  return err;
+}
+
+
+/* Load the filter file for the resource state SB into BF.  On error
+ * BF is not changed.  */
+static gpg_error_t
+load_filter (keydb_bloom_t bf, struct stat *sb)
+{
+  gpg_error_t err;
+  FILE *fp;
+  unsigned char hdr[BLOOM_HEADER_LEN];
+  struct keydb_bloom_s state;
+  u32 nbits;
+  unsigned char *bits;
+
+  fp = fopen (bf->bloomname, "rb");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  if (fread (hdr, sizeof hdr, 1, fp) != 1)
+    {
+      err = gpg_error (GPG_ERR_TOO_SHORT);
+      goto leave;
+    }
+  if (memcmp (hdr, BLOOM_MAGIC, 4) || hdr[4] != BLOOM_VERSION)
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      goto leave;
+    }
+  set_file_state (&state, sb);
+  if (get64 (hdr+8) != state.filesize
+      || get64 (hdr+16) != state.mtime
+      || buf32_to_uint (hdr+24) != state.mtime_ns)
+    {
+      err = gpg_error (GPG_ERR_ESTALE);
+      goto leave;
+    }
+  nbits = buf32_to_u32 (hdr+28);
+  if (nbits < BLOOM_MIN_NBITS || nbits > BLOOM_MAX_NBITS
+      || (nbits & (nbits - 1)))
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      goto leave;
+    }
+
+  bits = xtrymalloc (nbits / 8);
+  if (!bits)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fread (bits, nbits / 8, 1, fp) != 1)
+    {
+      err = gpg_error (GPG_ERR_TOO_SHORT);
+      xfree (bits);
+      goto leave;
+    }
+
+  xfree (bf->bits);
+  bf->bits = bits;
+  bf->nbits = nbits;
+  bf->nkeys = buf32_to_u32 (hdr+32);
+  set_file_state (bf, sb);
+  bf->valid = 1;
+  err = 0;
+
+ leave:
+  fclose (fp);
+  return err;
+}
+
+
+/* Create a new filter object for the resource file FNAME.  Returns
+ * NULL on error.  */
+keydb_bloom_t
+keydb_bloom_new (const char *fname)
+{
+  keydb_bloom_t bf;
+
+  bf = xtrycalloc (1, sizeof *bf);
+  if (!bf)
+    return NULL;
+  bf->fname = xtrystrdup (fname);
+  bf->bloomname = bf->fname? strconcat (fname, EXTSEP_S "bloom", NULL) : NULL;
+  if (!bf->bloomname)
+    {
+      xfree (bf->fname);
+      xfree (bf);
+      return NULL;
+    }
+  return bf;
+}
+
+
+/* Make sure that BF matches the current state of its resource file.
+ * Returns 0 if the filter can be used, GPG_ERR_ESTALE if it needs to
+ * be rebuilt, and another error code if no filter shall be used.
+ * WRITING must be true if the caller holds the lock on the resource
+ * and has modified it.  */
+gpg_error_t
+keydb_bloom_sync (keydb_bloom_t bf, int writing)
+{
+  struct stat sb;
+
+  if (bf->building)
+    return gpg_error (GPG_ERR_EBUSY);
+  if (stat (bf->fname, &sb))
+    return gpg_error_from_syserror ();
+  if (sb.st_size < BLOOM_MIN_FILESIZE)
+    {
+      bf->valid = 0;
+      return gpg_error (GPG_ERR_TOO_SHORT);
+    }
+
+  if (bf->valid && same_file_state (bf, &sb))
+    return 0;
+  if (bf->valid && writing)
+    {
+      /* Nobody else can have changed the file and our changes have
+       * already been added to the filter.  */
+      set_file_state (bf, &sb);
+      return 0;
+    }
+
+  bf->valid = 0;
+  if (!load_filter (bf, &sb))
+    return 0;
+  if (bf->disabled)
+    return gpg_error (GPG_ERR_NOT_ENABLED);
+  return gpg_error (GPG_ERR_ESTALE);
+}
+
+
+/* Return true if the keyid KID is definitely not in the resource of
+ * BF.  The caller must have checked that keydb_bloom_sync succeeds.  */
+int
+keydb_bloom_absent_p (keydb_bloom_t bf, const u32 *kid)
+{
+  u32 h = kid[1];
+  u32 step = kid[0] | 1;
+  int i;
+
+  if (!bf->valid || bf->building)
+    return 0;
+
+  for (i=0; i < BLOOM_HASHES; i++, h += step)
+    if (!(bf->bits[(h & (bf->nbits - 1)) / 8] & (1 << (h & 7))))
+      return 1;
+  return 0;
+}
+
+
+/* Start a rebuild of BF.  All keyids of the resource must then be
+ * passed to keydb_bloom_add and the build be finished with
+ * keydb_bloom_build_end.  */
+gpg_error_t
+keydb_bloom_build_begin (keydb_bloom_t bf)
+{
+  if (bf->building)
+    return gpg_error (GPG_ERR_EBUSY);
+  if (stat (bf->fname, &bf->build_sb))
+    return gpg_error_from_syserror ();
+  bf->valid = 0;
+  bf->building = 1;
+  bf->nkids = 0;
+  return 0;
+}
+
+
+/* Add the keyid KID to the filter BF.  During a build the keyid is
+ * collected; otherwise it is added to a valid filter directly.  */
+void
+keydb_bloom_add (keydb_bloom_t bf, const u32 *kid)
+{
+  if (bf->building)
+    {
+      if (bf->nkids + 2 > bf->kidssize)
+        {
+          size_t n = bf->kidssize? 2 * bf->kidssize : 1024;
+          u32 *tmp;
+
+          tmp = xtryreallocarray (bf->kids, bf->kidssize, n, sizeof *tmp);
+          if (!tmp)
+            {
+              /* We can't finish the build thus stop collecting.  */
+              bf->disabled = 1;
+              return;
+            }
+          bf->kids = tmp;
+          bf->kidssize = n;
+        }
+      bf->kids[bf->nkids++] = kid[0];
+      bf->kids[bf->nkids++] = kid[1];
+    }
+  else if (bf->valid)
+    {
+      set_bits (bf, kid);
+      bf->nkeys++;
+      if (bf->nkeys > bf->nbits / BLOOM_MIN_BITS)
+        bf->valid = 0;  /* Too crowded - rebuild on the next use.  */
+    }
+}
+
+
+/* Finish a build of BF.  If CANCEL is set or the resource file
+ * changed since keydb_bloom_build_begin, the filter is left invalid.
+ * Otherwise the filter is created from the collected keyids and
+ * written to its file.  */
+gpg_error_t
+keydb_bloom_build_end (keydb_bloom_t bf, int cancel)
+{
+  gpg_error_t err;
+  struct stat sb;
+  size_t n, nbits;
+
+  if (!bf->building)
+    return gpg_error (GPG_ERR_INV_STATE);
+  bf->building = 0;
+
+  if (cancel || bf->disabled)
+    {
+      /* Do not try again for the same file.  */
+      bf->disabled = 1;
+      err = gpg_error (GPG_ERR_CANCELED);
+      goto leave;
+    }
+
+  if (stat (bf->fname, &sb))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  set_file_state (bf, &bf->build_sb);
+  if (!same_file_state (bf, &sb))
+    {
+      err = gpg_error (GPG_ERR_ESTALE);
+      goto leave;
+    }
+
+  for (nbits = BLOOM_MIN_NBITS;
+       nbits < BLOOM_MAX_NBITS && nbits < (bf->nkids/2) * BLOOM_BITS_PER_KEY;
+       nbits *= 2)
+    ;
+  if (bf->nkids/2 > nbits / BLOOM_MIN_BITS)
+    {
+      err = gpg_error (GPG_ERR_TOO_LARGE);
+      goto leave;
+    }
+
+  xfree (bf->bits);
+  bf->bits = xtrycalloc (1, nbits / 8);
+  if (!bf->bits)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  bf->nbits = nbits;
+  bf->nkeys = bf->nkids / 2;
+  for (n=0; n < bf->nkids; n += 2)
+    set_bits (bf, bf->kids + n);
+  bf->valid = 1;
+
+  if (DBG_CACHE)
+    log_debug ("keydb: built filter for '%s' with %u keys\n",
+               bf->fname, (unsigned int)bf->nkeys);
+
+  /* Failing to write the filter is not an error because it can still
+   * be used by this process.  */
+  write_filter (bf);
+  err = 0;
+
+ leave:
+  xfree (bf->kids);
+  bf->kids = NULL;
+  bf->nkids = bf->kidssize = 0;
+  return err;
+}
+
+
+/* Write the filter BF after keyids have been added using
+ * keydb_bloom_add.  The caller must still hold the lock on the
+ * resource.  */
+void
+keydb_bloom_commit (keydb_bloom_t bf)
+{
+  if (keydb_bloom_sync (bf, 1))
+    return;
+  write_filter (bf);
+}
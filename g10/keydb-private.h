@@ -30,6 +30,8 @@ struct keyring_handle;
 typedef struct keyring_handle *KEYRING_HANDLE;
 struct keybox_handle;
 typedef struct keybox_handle *KEYBOX_HANDLE;
+struct keydb_bloom_s;
+typedef struct keydb_bloom_s *keydb_bloom_t;
 
 
 /* This is for keydb.c and only used in non-keyboxd mode. */
@@ -52,6 +54,8 @@ struct resource_item
     KEYBOX_HANDLE kb;
   } u;
   void *token;
+  keydb_bloom_t bloom;  /* NULL or the Bloom filter of the resource.  */
+  char *fname;          /* NULL or the file name of the resource.  */
 };
 
 
@@ -86,6 +90,11 @@ struct keydb_handle_s
   /* Flag set if this handles pertains to call-keyboxd.c.  */
   int use_keyboxd;
 
+  /* The SHA-256 hash of the image of the keyblock last returned by
+   * keydb_get_keyblock and a flag telling whether it is valid.  */
+  unsigned int kb_digest_valid:1;
+  unsigned char kb_digest[KEYDB_DIGEST_LEN];
+
   /* BEGIN USE_KEYBOXD */
   /* (These fields are only valid if USE_KEYBOXD is set.) */
 
@@ -161,7 +170,9 @@ gpg_error_t internal_keydb_init (KEYDB_HANDLE hd);
 void internal_keydb_deinit (KEYDB_HANDLE hd);
 gpg_error_t internal_keydb_lock (KEYDB_HANDLE hd);
 
-gpg_error_t internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb);
+gpg_error_t internal_keydb_get_keyblock (KEYDB_HANDLE hd, int keys_only,
+                                         KBNODE *ret_kb);
+void internal_keydb_set_digest (KEYDB_HANDLE hd, iobuf_t iobuf);
 gpg_error_t internal_keydb_update_keyblock (ctrl_t ctrl,
                                             KEYDB_HANDLE hd, kbnode_t kb);
 gpg_error_t internal_keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb);
@@ -171,6 +182,17 @@ gpg_error_t internal_keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
                                    size_t ndesc, size_t *descindex);
 
 
+/*-- keydb-bloom.c --*/
+
+keydb_bloom_t keydb_bloom_new (const char *fname);
+gpg_error_t keydb_bloom_sync (keydb_bloom_t bf, int writing);
+int keydb_bloom_absent_p (keydb_bloom_t bf, const u32 *kid);
+gpg_error_t keydb_bloom_build_begin (keydb_bloom_t bf);
+void keydb_bloom_add (keydb_bloom_t bf, const u32 *kid);
+gpg_error_t keydb_bloom_build_end (keydb_bloom_t bf, int cancel);
+void keydb_bloom_commit (keydb_bloom_t bf);
+
+
 
 
 
@@ -29,6 +29,7 @@
 
 #include "gpg.h"
 #include "../common/util.h"
+#include "../common/host2net.h"
 #include "options.h"
 #include "main.h" /*try_make_homedir ()*/
 #include "packet.h"
@@ -38,6 +39,7 @@
 #include "../common/i18n.h"
 
 #include "keydb-private.h"  /* For struct keydb_handle_s */
+#include "timing.h"
 
 static int active_handles;
 
@@ -52,6 +54,11 @@ static void *primary_keydb;
 /* Whether we have successfully registered any resource.  */
 static int any_registered;
 
+/* The resources given to keydb_defer_resource which have not yet
+ * been registered.  The flags of the list items are the resource
+ * flags.  */
+static strlist_t deferred_resources;
+
 /* Looking up keys is expensive.  To hide the cost, we cache whether
    keys exist in the key database.  Then, if we know a key does not
    exist, we don't have to spend time looking it up.  This
@@ -98,6 +105,8 @@ struct
   unsigned int found_cached;    /* Ditto but from the cache.              */
   unsigned int notfound;        /* Number of failed keydb_search calls.   */
   unsigned int notfound_cached; /* Ditto but from the cache.              */
+  unsigned int bloom_builds;    /* Number of Bloom filter builds.         */
+  unsigned int bloom_skipped;   /* Resources skipped due to the filter.   */
 } keydb_stats;
 
 
@@ -704,6 +713,9 @@ keydb_add_resource (const char *url, unsigned int flags)
               all_resources[used_resources].type = rt;
               all_resources[used_resources].u.kr = NULL; /* Not used here */
               all_resources[used_resources].token = token;
+              all_resources[used_resources].bloom
+                = read_only? NULL : keydb_bloom_new (filename);
+              all_resources[used_resources].fname = xtrystrdup (filename);
               used_resources++;
             }
         }
@@ -737,6 +749,9 @@ keydb_add_resource (const char *url, unsigned int flags)
                 all_resources[used_resources].type = rt;
                 all_resources[used_resources].u.kb = NULL; /* Not used here */
                 all_resources[used_resources].token = token;
+                all_resources[used_resources].bloom
+                  = read_only? NULL : keydb_bloom_new (filename);
+                all_resources[used_resources].fname = xtrystrdup (filename);
 
                 /* Do a compress run if needed and no other user is
                  * currently using the keybox. */
@@ -787,6 +802,101 @@ keydb_add_resource (const char *url, unsigned int flags)
 }
 
 
+/* Remember the resource URL with FLAGS for a later registration by
+ * keydb_add_deferred_resources.  Registering a resource checks and
+ * possibly creates the files; deferring this until a handle is
+ * actually needed speeds up commands which do not access keys.  The
+ * resources are registered in the order of the calls.  */
+void
+keydb_defer_resource (const char *url, unsigned int flags)
+{
+  strlist_t sl;
+
+  sl = append_to_strlist (&deferred_resources, url);
+  sl->flags = flags;
+}
+
+
+/* Register all resources deferred by keydb_defer_resource.  This is
+ * called the first time a handle is created but may also be called
+ * directly to register them right away.  */
+void
+keydb_add_deferred_resources (void)
+{
+  strlist_t sl, list;
+
+  if (!deferred_resources)
+    return;
+
+  list = deferred_resources;
+  deferred_resources = NULL;
+  for (sl = list; sl; sl = sl->next)
+    keydb_add_resource (sl->d, sl->flags);
+  free_strlist (list);
+}
+
+
+/* Store a value at R_GEN, which must provide KEYDB_DIGEST_LEN bytes,
+ * which changes whenever one of the registered resources is
+ * modified.  It is a hash over the names, the sizes and the
+ * modification times of the resource files.  Returns
+ * GPG_ERR_NOT_SUPPORTED if this is not possible; for example with the
+ * keyboxd.  */
+gpg_error_t
+keydb_get_generation (unsigned char *r_gen)
+{
+  gpg_error_t err;
+  gcry_md_hd_t md;
+  struct stat sb;
+  unsigned char buf[20];
+  unsigned long long val;
+  unsigned int ns;
+  int i;
+
+  keydb_add_deferred_resources ();
+  if (opt.use_keyboxd || !used_resources)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  err = gcry_md_open (&md, GCRY_MD_SHA256, 0);
+  if (err)
+    return err;
+
+  for (i=0; i < used_resources; i++)
+    {
+      if (!all_resources[i].fname)
+        {
+          err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+          break;
+        }
+      if (stat (all_resources[i].fname, &sb))
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+      ns = sb.st_mtim.tv_nsec;
+#else
+      ns = 0;
+#endif
+      val = sb.st_size;
+      ulongtobuf (buf,    (u32)(val >> 32));
+      ulongtobuf (buf+4,  (u32)val);
+      val = sb.st_mtime;
+      ulongtobuf (buf+8,  (u32)(val >> 32));
+      ulongtobuf (buf+12, (u32)val);
+      ulongtobuf (buf+16, ns);
+      gcry_md_write (md, all_resources[i].fname,
+                     strlen (all_resources[i].fname) + 1);
+      gcry_md_write (md, buf, sizeof buf);
+    }
+
+  if (!err)
+    memcpy (r_gen, gcry_md_read (md, GCRY_MD_SHA256), KEYDB_DIGEST_LEN);
+  gcry_md_close (md);
+  return err;
+}
+
+
 void
 keydb_dump_stats (void)
 {
@@ -810,6 +920,9 @@ keydb_dump_stats (void)
             kid_not_found_stats.count,
             kid_not_found_stats.peak,
             kid_not_found_stats.flushes);
+  log_info ("bloom_filter: builds=%u skipped=%u\n",
+            keydb_stats.bloom_builds,
+            keydb_stats.bloom_skipped);
 }
 
 
@@ -828,6 +941,10 @@ internal_keydb_init (KEYDB_HANDLE hd)
   hd->saved_found = -1;
   hd->is_reset = 1;
 
+  /* Resources may only be registered while no handle is active.  */
+  if (!active_handles)
+    keydb_add_deferred_resources ();
+
   log_assert (used_resources <= MAX_KEYDB_RESOURCES);
   for (i=j=0; ! die && i < used_resources; i++)
     {
@@ -838,6 +955,7 @@ internal_keydb_init (KEYDB_HANDLE hd)
         case KEYDB_RESOURCE_TYPE_KEYRING:
           hd->active[j].type   = all_resources[i].type;
           hd->active[j].token  = all_resources[i].token;
+          hd->active[j].bloom  = all_resources[i].bloom;
           hd->active[j].u.kr = keyring_new (all_resources[i].token);
           if (!hd->active[j].u.kr)
             {
@@ -849,12 +967,15 @@ internal_keydb_init (KEYDB_HANDLE hd)
         case KEYDB_RESOURCE_TYPE_KEYBOX:
           hd->active[j].type   = all_resources[i].type;
           hd->active[j].token  = all_resources[i].token;
+          hd->active[j].bloom  = all_resources[i].bloom;
           hd->active[j].u.kb   = keybox_new_openpgp (all_resources[i].token, 0);
           if (!hd->active[j].u.kb)
             {
               reterrno = errno;
               die = 1;
             }
+          else
+            keybox_set_mmap (hd->active[j].u.kb, 1);
           j++;
           break;
         }
@@ -1136,8 +1257,25 @@ keydb_pop_found_state (KEYDB_HANDLE hd)
 
 
 
+/* Store the hash of the keyblock image in the memory based IOBUF as
+ * the digest of the keyblock returned next by HD.  */
+void
+internal_keydb_set_digest (KEYDB_HANDLE hd, iobuf_t iobuf)
+{
+  gcry_md_hash_buffer (GCRY_MD_SHA256, hd->kb_digest,
+                       iobuf_get_temp_buffer (iobuf),
+                       iobuf_get_temp_length (iobuf));
+  hd->kb_digest_valid = 1;
+}
+
+
+/* Parse the keyblock image from IOBUF and store it at R_KEYBLOCK.
+ * PK_NO and UID_NO tell which nodes get the flag bits 0 and 1.  If
+ * KEYS_ONLY is set only the primary key and the subkey packets are
+ * parsed; all other packets are skipped by looking only at their
+ * headers.  */
 static gpg_error_t
-parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
+parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no, int keys_only,
                       kbnode_t *r_keyblock)
 {
   gpg_error_t err;
@@ -1147,19 +1285,21 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
   kbnode_t node, *tail;
   int in_cert, save_mode;
   int pk_count, uid_count;
+  timing_span_t span;
 
   *r_keyblock = NULL;
 
-  pkt = xtrymalloc (sizeof *pkt);
+  pkt = kbnode_new_packet ();
   if (!pkt)
     return gpg_error_from_syserror ();
-  init_packet (pkt);
+  timing_begin (&span, "parse_keyblock");
   init_parse_packet (&parsectx, iobuf);
   save_mode = set_packet_list_mode (0);
   in_cert = 0;
   tail = NULL;
   pk_count = uid_count = 0;
-  while ((err = parse_packet (&parsectx, pkt)) != -1)
+  while ((err = (keys_only? search_packet (&parsectx, pkt, NULL, 0)
+                 : parse_packet (&parsectx, pkt))) != -1)
     {
       if (gpg_err_code (err) == GPG_ERR_UNKNOWN_PACKET)
         {
@@ -1246,13 +1386,12 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
       else
         *tail = node;
       tail = &node->next;
-      pkt = xtrymalloc (sizeof *pkt);
+      pkt = kbnode_new_packet ();
       if (!pkt)
         {
           err = gpg_error_from_syserror ();
           break;
         }
-      init_packet (pkt);
     }
   set_packet_list_mode (save_mode);
 
@@ -1269,10 +1408,168 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
   free_packet (pkt, &parsectx);
   deinit_parse_packet (&parsectx);
   xfree (pkt);
+  timing_end (&span);
   return err;
 }
 
 
+/* Add the keyids of all keys in KEYBLOCK to the Bloom filter BF.  */
+static void
+bloom_add_keyblock (keydb_bloom_t bf, kbnode_t keyblock)
+{
+  kbnode_t node;
+  u32 kid[2];
+
+  for (node = keyblock; node; node = node->next)
+    if (node->pkt->pkttype == PKT_PUBLIC_KEY
+        || node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+      {
+        keyid_from_pk (node->pkt->pkt.public_key, kid);
+        keydb_bloom_add (bf, kid);
+      }
+}
+
+
+/* Rebuild the Bloom filter of the resource IDX of HD by walking over
+ * all its keyblocks.  Separate resource handles are used so that
+ * the search position of HD is not changed.  */
+static void
+bloom_rebuild (KEYDB_HANDLE hd, int idx)
+{
+  keydb_bloom_t bf = hd->active[idx].bloom;
+  gpg_error_t err;
+  KEYDB_SEARCH_DESC desc;
+  KEYRING_HANDLE kr = NULL;
+  KEYBOX_HANDLE kb = NULL;
+  kbnode_t keyblock;
+  unsigned long skipped;
+  iobuf_t iobuf;
+  int pk_no, uid_no;
+
+  if (keydb_bloom_build_begin (bf))
+    return;
+  keydb_stats.bloom_builds++;
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_FIRST;
+  switch (hd->active[idx].type)
+    {
+    case KEYDB_RESOURCE_TYPE_KEYRING:
+      kr = keyring_new (hd->active[idx].token);
+      if (!kr)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      while (!(err = keyring_search (kr, &desc, 1, NULL, 1)))
+        {
+          desc.mode = KEYDB_SEARCH_MODE_NEXT;
+          err = keyring_get_keyblock (kr, &keyblock);
+          if (err)
+            break;
+          bloom_add_keyblock (bf, keyblock);
+          release_kbnode (keyblock);
+        }
+      keyring_release (kr);
+      break;
+
+    case KEYDB_RESOURCE_TYPE_KEYBOX:
+      kb = keybox_new_openpgp (hd->active[idx].token, 0);
+      if (!kb)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      keybox_set_mmap (kb, 1);
+      for (;;)
+        {
+          do
+            err = keybox_search (kb, &desc, 1, KEYBOX_BLOBTYPE_PGP,
+                                 NULL, &skipped);
+          while (err == GPG_ERR_LEGACY_KEY);
+          if (err)
+            break;
+          desc.mode = KEYDB_SEARCH_MODE_NEXT;
+          err = keybox_get_keyblock (kb, &iobuf, &pk_no, &uid_no);
+          if (!err)
+            {
+              /* We only need the keyids.  */
+              err = parse_keyblock_image (iobuf, pk_no, uid_no, 1, &keyblock);
+              iobuf_close (iobuf);
+            }
+          if (err)
+            break;
+          bloom_add_keyblock (bf, keyblock);
+          release_kbnode (keyblock);
+        }
+      keybox_release (kb);
+      break;
+
+    default:
+      err = gpg_error (GPG_ERR_GENERAL);
+      break;
+    }
+
+  /* A keyblock we could not parse might still be found by a search;
+   * thus any error other than EOF cancels the build.  */
+  if (err == -1 || gpg_err_code (err) == GPG_ERR_EOF)
+    err = 0;
+  if (err)
+    log_info ("error building Bloom filter: %s\n", gpg_strerror (err));
+  keydb_bloom_build_end (bf, !!err);
+}
+
+
+/* Return true if the keyid KID is definitely not in the resource IDX
+ * of HD.  The Bloom filter is rebuilt if needed.  */
+static int
+bloom_absent_p (KEYDB_HANDLE hd, int idx, u32 *kid)
+{
+  keydb_bloom_t bf = hd->active[idx].bloom;
+  gpg_error_t err;
+
+  if (!bf)
+    return 0;
+
+  err = keydb_bloom_sync (bf, 0);
+  if (gpg_err_code (err) == GPG_ERR_ESTALE)
+    {
+      bloom_rebuild (hd, idx);
+      err = keydb_bloom_sync (bf, 0);
+    }
+  if (err)
+    return 0;
+
+  return keydb_bloom_absent_p (bf, kid);
+}
+
+
+/* Prepare the Bloom filter of the resource IDX of HD for an update of
+ * the resource.  The resource must be locked.  */
+static void
+bloom_begin_update (KEYDB_HANDLE hd, int idx)
+{
+  /* This invalidates the filter if it does not match the file.  */
+  if (hd->active[idx].bloom)
+    keydb_bloom_sync (hd->active[idx].bloom, 0);
+}
+
+
+/* Finish an update of the resource IDX of HD which added or changed
+ * KEYBLOCK.  The resource must still be locked.  */
+static void
+bloom_end_update (KEYDB_HANDLE hd, int idx, kbnode_t keyblock)
+{
+  keydb_bloom_t bf = hd->active[idx].bloom;
+
+  if (!bf)
+    return;
+  if (keyblock)
+    bloom_add_keyblock (bf, keyblock);
+  keydb_bloom_commit (bf);
+}
+
+
 /* Return the keyblock last found by keydb_search() in *RET_KB.
  * keydb_get_keyblock divert to here in the non-keyboxd mode.
  *
@@ -1282,9 +1579,15 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
  *
  * The returned keyblock has the kbnode flag bit 0 set for the node
  * with the public key used to locate the keyblock or flag bit 1 set
- * for the user ID node.  */
+ * for the user ID node.
+ *
+ * If KEYS_ONLY is set the returned keyblock may consist of only the
+ * primary key and the subkeys; this is the case for keyboxes.  The
+ * image of the keyblock is still put into the keyblock cache so that
+ * a following call to get the entire keyblock does not need to read
+ * it again.  */
 gpg_error_t
-internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
+internal_keydb_get_keyblock (KEYDB_HANDLE hd, int keys_only, KBNODE *ret_kb)
 {
   gpg_error_t err = 0;
 
@@ -1300,10 +1603,11 @@ internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
 	}
       else
 	{
+          internal_keydb_set_digest (hd, hd->keyblock_cache.iobuf);
 	  err = parse_keyblock_image (hd->keyblock_cache.iobuf,
 				      hd->keyblock_cache.pk_no,
 				      hd->keyblock_cache.uid_no,
-				      ret_kb);
+				      keys_only, ret_kb);
 	  if (err)
 	    keyblock_cache_clear (hd);
 	  if (DBG_CLOCK)
@@ -1332,7 +1636,9 @@ internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
                                    &iobuf, &pk_no, &uid_no);
         if (!err)
           {
-            err = parse_keyblock_image (iobuf, pk_no, uid_no, ret_kb);
+            internal_keydb_set_digest (hd, iobuf);
+            err = parse_keyblock_image (iobuf, pk_no, uid_no, keys_only,
+                                        ret_kb);
             if (!err && hd->keyblock_cache.state == KEYBLOCK_CACHE_PREPARED)
               {
                 hd->keyblock_cache.state     = KEYBLOCK_CACHE_FILLED;
@@ -1416,6 +1722,7 @@ internal_keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
     return gpg_error (GPG_ERR_VALUE_NOT_FOUND);
   log_assert (hd->found >= 0 && hd->found < hd->used);
 
+  bloom_begin_update (hd, hd->found);
   switch (hd->active[hd->found].type)
     {
     case KEYDB_RESOURCE_TYPE_NONE:
@@ -1440,6 +1747,7 @@ internal_keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
       }
       break;
     }
+  bloom_end_update (hd, hd->found, err? NULL : kb);
 
   unlock_all (hd);
   if (!err)
@@ -1484,6 +1792,7 @@ internal_keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
   if (err)
     return err;
 
+  bloom_begin_update (hd, idx);
   switch (hd->active[idx].type)
     {
     case KEYDB_RESOURCE_TYPE_NONE:
@@ -1511,6 +1820,7 @@ internal_keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
       }
       break;
     }
+  bloom_end_update (hd, idx, err? NULL : kb);
 
   unlock_all (hd);
   if (!err)
@@ -1544,6 +1854,7 @@ internal_keydb_delete_keyblock (KEYDB_HANDLE hd)
   if (rc)
     return rc;
 
+  bloom_begin_update (hd, hd->found);
   switch (hd->active[hd->found].type)
     {
     case KEYDB_RESOURCE_TYPE_NONE:
@@ -1556,6 +1867,8 @@ internal_keydb_delete_keyblock (KEYDB_HANDLE hd)
       rc = keybox_delete (hd->active[hd->found].u.kb);
       break;
     }
+  /* The keys of the deleted keyblock stay in the filter.  */
+  bloom_end_update (hd, hd->found, NULL);
 
   unlock_all (hd);
   if (!rc)
@@ -1639,6 +1952,7 @@ keydb_rebuild_caches (ctrl_t ctrl, int noisy)
   if (opt.use_keyboxd)
     return;  /* No need for this here.  */
 
+  keydb_add_deferred_resources ();
   for (i=0; i < used_resources; i++)
     {
       if (!keyring_is_writable (all_resources[i].token))
@@ -1741,6 +2055,8 @@ internal_keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   /* If an entry is already in the cache, then don't add it again.  */
   int already_in_cache = 0;
   int fprlen;
+  u32 bloomkid[2];
+  int use_bloom = 0;
 
   log_assert (!hd->use_keyboxd);
 
@@ -1792,10 +2108,41 @@ internal_keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       return 0;
     }
 
+  /* Searches for a single keyid or fingerprint can skip resources
+   * whose Bloom filter tells that the keyid is not there.  */
+  if (ndesc == 1 && desc[0].mode == KEYDB_SEARCH_MODE_LONG_KID)
+    {
+      bloomkid[0] = desc[0].u.kid[0];
+      bloomkid[1] = desc[0].u.kid[1];
+      use_bloom = 1;
+    }
+  else if (ndesc == 1 && fprlen == 20)
+    {
+      bloomkid[0] = buffer_to_u32 (desc[0].u.fpr+12);
+      bloomkid[1] = buffer_to_u32 (desc[0].u.fpr+16);
+      use_bloom = 1;
+    }
+  else if (ndesc == 1 && fprlen == 32)
+    {
+      bloomkid[0] = buffer_to_u32 (desc[0].u.fpr);
+      bloomkid[1] = buffer_to_u32 (desc[0].u.fpr+4);
+      use_bloom = 1;
+    }
+
   rc = -1;
   while ((rc == -1 || gpg_err_code (rc) == GPG_ERR_EOF)
          && hd->current >= 0 && hd->current < hd->used)
     {
+      if (use_bloom && bloom_absent_p (hd, hd->current, bloomkid))
+        {
+          if (DBG_LOOKUP)
+            log_debug ("%s: skipping resource %d of %d (Bloom filter)\n",
+                       __func__, hd->current, hd->used);
+          keydb_stats.bloom_skipped++;
+          hd->current++;
+          continue;
+        }
+
       if (DBG_LOOKUP)
         log_debug ("%s: searching %s (resource %d of %d)\n",
                    __func__,
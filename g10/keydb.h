@@ -25,6 +25,7 @@
 #include "../common/types.h"
 #include "../common/util.h"
 #include "packet.h"
+#include "../common/compliance.h"
 
 /* What qualifies as a certification (key-signature in contrast to a
  * data signature)?  Note that a back signature is special and can be
@@ -181,12 +182,27 @@ KEYDB_HANDLE keydb_new (ctrl_t ctrl);
 /* Release a keydb handle.  */
 void keydb_release (KEYDB_HANDLE hd);
 
+/* Let the keyboxd combine up to N stores into one transaction.  */
+gpg_error_t keydb_set_bulk_mode (ctrl_t ctrl, unsigned int n);
+
+/* Flush the key caches if the keyboxd's data has been changed.  */
+gpg_error_t keydb_check_generation (ctrl_t ctrl);
+
 /* Take a lock if we are not using the keyboxd.  */
 gpg_error_t keydb_lock (KEYDB_HANDLE hd);
 
 /* Return the keyblock last found by keydb_search.  */
 gpg_error_t keydb_get_keyblock (KEYDB_HANDLE hd, kbnode_t *ret_kb);
 
+/* Same as keydb_get_keyblock but the keyblock may lack all packets
+ * except for the key packets.  */
+gpg_error_t keydb_get_keyblock_keys (KEYDB_HANDLE hd, kbnode_t *ret_kb);
+
+/* Return the hash of the image of the keyblock last returned.  */
+#define KEYDB_DIGEST_LEN 32
+gpg_error_t keydb_get_keyblock_digest (KEYDB_HANDLE hd,
+                                       unsigned char *r_digest);
+
 /* Update the keyblock KB.  */
 gpg_error_t keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb);
 
@@ -203,6 +219,14 @@ gpg_error_t keydb_search_reset (KEYDB_HANDLE hd);
 gpg_error_t keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
                           size_t ndesc, size_t *descindex);
 
+/* Search the database for all keys matching each of the descriptions.  */
+gpg_error_t keydb_search_batch (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
+                                size_t ndesc,
+                                gpg_error_t (*cb) (void *opaque,
+                                                   size_t descidx,
+                                                   kbnode_t keyblock),
+                                void *cb_value);
+
 
 
 /*-- keydb.c --*/
@@ -219,6 +243,15 @@ char *keydb_search_desc_dump (struct keydb_search_desc *desc);
 /* Register a resource (keyring or keybox).  */
 gpg_error_t keydb_add_resource (const char *url, unsigned int flags);
 
+/* Register a resource when the first handle is created.  */
+void keydb_defer_resource (const char *url, unsigned int flags);
+
+/* Register all deferred resources now.  */
+void keydb_add_deferred_resources (void);
+
+/* Return a value which changes with each change of a resource.  */
+gpg_error_t keydb_get_generation (unsigned char *r_gen);
+
 /* Dump some statistics to the log.  */
 void keydb_dump_stats (void);
 
@@ -273,6 +306,7 @@ gpg_error_t find_and_check_key (ctrl_t ctrl,
                                 const char *name, unsigned int use,
                                 int mark_hidden, int from_file,
                                 pk_list_t *pk_list_addr);
+void release_recipient_cache (ctrl_t ctrl);
 
 int  algo_available( preftype_t preftype, int algo,
 		     const union pref_hint *hint );
@@ -326,6 +360,19 @@ void cache_public_key( PKT_public_key *pk );
 /* Disable and drop the public key cache.  */
 void getkey_disable_caches(void);
 
+/* Drop all keyblocks with merged self-signatures from the cache.  */
+void getkey_flush_merge_cache (void);
+
+/* Drop all cached keys but keep caching enabled.  */
+void getkey_flush_caches (void);
+
+/* Print statistics of the public key cache.  */
+void getkey_dump_stats (void);
+
+/* Look up the keys given by DESC in one batch and cache them.  */
+void prefetch_pubkeys (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, size_t ndesc,
+                       char *found);
+
 /* Return the public key used for signature SIG and store it at PK.  */
 gpg_error_t get_pubkey_for_sig (ctrl_t ctrl,
                                 PKT_public_key *pk, PKT_signature *sig);
@@ -526,6 +573,9 @@ u32 keyid_from_fingerprint (ctrl_t ctrl, const byte *fprint, size_t fprint_len,
                             u32 *keyid);
 byte *namehash_from_uid(PKT_user_id *uid);
 unsigned nbits_from_pk( PKT_public_key *pk );
+int pk_is_compliant (enum gnupg_compliance_mode compliance,
+                     PKT_public_key *pk, unsigned int keylength,
+                     const char *curvename);
 
 /* Convert an UTC TIMESTAMP into an UTC yyyy-mm-dd string.  Return
  * that string.  The caller should pass a buffer with at least a size
@@ -554,6 +604,7 @@ gpg_error_t hexkeygrip_from_pk (PKT_public_key *pk, char **r_grip);
 
 
 /*-- kbnode.c --*/
+PACKET *kbnode_new_packet (void);
 KBNODE new_kbnode( PACKET *pkt );
 KBNODE clone_kbnode( KBNODE node );
 void release_kbnode( KBNODE n );
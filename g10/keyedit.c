@@ -180,7 +180,7 @@ print_and_check_one_sig_colon (ctrl_t ctrl, kbnode_t keyblock, kbnode_t node,
                  sig->flags.exportable ? 'x' : 'l');
 
       if (opt.show_subpackets)
-	print_subpackets_colon (sig);
+	print_subpackets_colon (es_stdout, sig);
     }
 
   return (sigrc == '!');
@@ -474,11 +474,14 @@ trustsig_prompt (byte * trust_value, byte * trust_depth, char **regexp)
  * Loop over all LOCUSR and sign the uids after asking.  If no
  * user id is marked, all user ids will be signed; if some user_ids
  * are marked only those will be signed.  If QUICK is true the
- * function won't ask the user and use sensible defaults.
+ * function won't ask the user and use sensible defaults.  If SIGNERS
+ * is not NULL, it is used instead of building the list of signing
+ * keys from LOCUSR.
  */
 static int
 sign_uids (ctrl_t ctrl, estream_t fp,
-           kbnode_t keyblock, strlist_t locusr, int *ret_modified,
+           kbnode_t keyblock, strlist_t locusr, SK_LIST signers,
+           int *ret_modified,
 	   int local, int nonrevocable, int trust, int interactive,
            int quick)
 {
@@ -497,9 +500,14 @@ sign_uids (ctrl_t ctrl, estream_t fp,
    * why to sign keys using a subkey.  Implementation of USAGE_CERT
    * is just a hack in getkey.c and does not mean that a subkey
    * marked as certification capable will be used. */
-  rc = build_sk_list (ctrl, locusr, &sk_list, PUBKEY_USAGE_CERT);
-  if (rc)
-    goto leave;
+  if (signers)
+    sk_list = signers;
+  else
+    {
+      rc = build_sk_list (ctrl, locusr, &sk_list, PUBKEY_USAGE_CERT);
+      if (rc)
+        goto leave;
+    }
 
   /* Loop over all signators.  */
   for (sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
@@ -1050,7 +1058,8 @@ sign_uids (ctrl_t ctrl, estream_t fp,
     } /* End loop over signators.  */
 
  leave:
-  release_sk_list (sk_list);
+  if (sk_list != signers)
+    release_sk_list (sk_list);
   return rc;
 }
 
@@ -1696,7 +1705,7 @@ keyedit_menu (ctrl_t ctrl, const char *username, strlist_t locusr,
 		break;
 	      }
 
-	    sign_uids (ctrl, NULL, keyblock, locusr, &modified,
+	    sign_uids (ctrl, NULL, keyblock, locusr, NULL, &modified,
 		       localsig, nonrevokesig, trustsig, interactive, 0);
 	  }
 	  break;
@@ -2607,15 +2616,14 @@ find_by_primary_fpr (ctrl_t ctrl, const char *fpr,
 }
 
 
-/* Unattended key signing function.  If the key specifified by FPR is
-   available and FPR is the primary fingerprint all user ids of the
-   key are signed using the default signing key.  If UIDS is an empty
-   list all usable UIDs are signed, if it is not empty, only those
-   user ids matching one of the entries of the list are signed.  With
-   LOCAL being true the signatures are marked as non-exportable.  */
-void
-keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
-                    strlist_t locusr, int local)
+/* Helper for keyedit_quick_sign and keyedit_quick_sign_many.  Sign
+   the key FPR using the signing keys SIGNERS or, if that is NULL,
+   those given by LOCUSR.  The other args are the same as for
+   keyedit_quick_sign.  Returns 0 if the key has been signed or did
+   not need an update.  */
+static gpg_error_t
+quick_sign_key (ctrl_t ctrl, const char *fpr, strlist_t uids,
+                strlist_t locusr, SK_LIST signers, int local)
 {
   gpg_error_t err;
   kbnode_t keyblock = NULL;
@@ -2626,15 +2634,11 @@ keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
   strlist_t sl;
   int any;
 
-#ifdef HAVE_W32_SYSTEM
-  /* See keyedit_menu for why we need this.  */
-  check_trustdb_stale (ctrl);
-#endif
-
   /* We require a fingerprint because only this uniquely identifies a
      key and may thus be used to select a key for unattended key
      signing.  */
-  if (find_by_primary_fpr (ctrl, fpr, &keyblock, &kdbhd))
+  err = find_by_primary_fpr (ctrl, fpr, &keyblock, &kdbhd);
+  if (err)
     goto leave;
 
   if (fix_keyblock (ctrl, &keyblock))
@@ -2655,6 +2659,7 @@ keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
       if (!opt.verbose)
         show_key_with_all_names (ctrl, es_stdout, keyblock, 0, 0, 0, 0, 0, 1);
       log_error ("%s%s", _("Key is revoked."), _("  Unable to sign.\n"));
+      err = gpg_error (GPG_ERR_CERT_REVOKED);
       goto leave;
     }
 
@@ -2732,11 +2737,13 @@ keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
                       sl->d, gpg_strerror (GPG_ERR_NOT_FOUND));
         }
       log_error ("%s  %s", _("No matching user IDs."), _("Nothing to sign.\n"));
+      err = gpg_error (GPG_ERR_NO_USER_ID);
       goto leave;
     }
 
   /* Sign. */
-  sign_uids (ctrl, es_stdout, keyblock, locusr, &modified, local, 0, 0, 0, 1);
+  sign_uids (ctrl, es_stdout, keyblock, locusr, signers, &modified,
+             local, 0, 0, 0, 1);
   es_fflush (es_stdout);
 
   if (modified)
@@ -2751,13 +2758,91 @@ keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
   else
     log_info (_("Key not changed so no update needed.\n"));
 
+ leave:
+  release_kbnode (keyblock);
+  keydb_release (kdbhd);
+  return err;
+}
+
+
+/* Unattended key signing function.  If the key specifified by FPR is
+   available and FPR is the primary fingerprint all user ids of the
+   key are signed using the default signing key.  If UIDS is an empty
+   list all usable UIDs are signed, if it is not empty, only those
+   user ids matching one of the entries of the list are signed.  With
+   LOCAL being true the signatures are marked as non-exportable.  */
+void
+keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
+                    strlist_t locusr, int local)
+{
+#ifdef HAVE_W32_SYSTEM
+  /* See keyedit_menu for why we need this.  */
+  check_trustdb_stale (ctrl);
+#endif
+
+  if (!quick_sign_key (ctrl, fpr, uids, locusr, NULL, local)
+      && update_trust)
+    revalidation_mark (ctrl);
+}
+
+
+/* Unattended signing of many keys.  All user ids of the keys with the
+   primary fingerprints FPRS are signed as with keyedit_quick_sign.
+   The signing keys are looked up only once and with the keyboxd the
+   updates are stored in one transaction.  */
+void
+keyedit_quick_sign_many (ctrl_t ctrl, strlist_t fprs, strlist_t locusr,
+                         int local)
+{
+  gpg_error_t err;
+  SK_LIST sk_list = NULL;
+  strlist_t sl;
+  int bulk_mode = 0;
+  unsigned int count = 0;
+  unsigned int nsigned = 0;
+
+#ifdef HAVE_W32_SYSTEM
+  /* See keyedit_menu for why we need this.  */
+  check_trustdb_stale (ctrl);
+#endif
+
+  err = build_sk_list (ctrl, locusr, &sk_list, PUBKEY_USAGE_CERT);
+  if (err)
+    goto leave;
+
+  if (!opt.dry_run)
+    {
+      for (sl = fprs; sl; sl = sl->next)
+        count++;
+      err = keydb_set_bulk_mode (ctrl, count);
+      if (err)
+        goto leave;
+      bulk_mode = 1;
+    }
+
+  count = 0;
+  for (sl = fprs; sl; sl = sl->next)
+    {
+      count++;
+      if (!quick_sign_key (ctrl, sl->d, NULL, NULL, sk_list, local))
+        nsigned++;
+    }
+
+  err = keydb_set_bulk_mode (ctrl, 0);
+  bulk_mode = 0;
+  if (err)
+    goto leave;
+
   if (update_trust)
     revalidation_mark (ctrl);
 
+  if (count > 1 || opt.verbose)
+    log_info (_("%u of %u keys processed\n"), nsigned, count);
 
  leave:
-  release_kbnode (keyblock);
-  keydb_release (kdbhd);
+  if (bulk_mode)
+    keydb_set_bulk_mode (ctrl, 0);
+  release_sk_list (sk_list);
 }
 
 
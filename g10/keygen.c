@@ -61,6 +61,7 @@ const char *default_expiration_interval = "2y";
 #define KEYGEN_FLAG_NO_PROTECTION 1
 #define KEYGEN_FLAG_TRANSIENT_KEY 2
 #define KEYGEN_FLAG_CREATE_V5_KEY 4
+#define KEYGEN_FLAG_ASYNC         8  /* Only start the generation.  */
 
 /* Maximum number of supported algorithm preferences.  */
 #define MAX_PREFS 30
@@ -1519,6 +1520,31 @@ do_create_from_keygrip (ctrl_t ctrl, int algo,
 
 
 /* Common code for the key generation function gen_xxx.  */
+/* A key generation running in the background.  It has been started
+ * by a call of common_gen with KEYGEN_FLAG_ASYNC and its result is
+ * used by the next call with the same key parameters.  */
+static struct
+{
+  agent_genkey_job_t job;
+  char *keyparms;
+  int no_protection;
+  int is_subkey;
+} pending_genkey;
+
+
+/* Wait for a pending key generation and discard its result.  */
+static void
+cancel_pending_genkey (void)
+{
+  if (!pending_genkey.job)
+    return;
+  agent_genkey_finish (pending_genkey.job, NULL);
+  pending_genkey.job = NULL;
+  xfree (pending_genkey.keyparms);
+  pending_genkey.keyparms = NULL;
+}
+
+
 static int
 common_gen (const char *keyparms, int algo, const char *algoelem,
             kbnode_t pub_root, u32 timestamp, u32 expireval, int is_subkey,
@@ -1529,11 +1555,39 @@ common_gen (const char *keyparms, int algo, const char *algoelem,
   PACKET *pkt;
   PKT_public_key *pk;
   gcry_sexp_t s_key;
+  int no_protection = !!(keygen_flags & KEYGEN_FLAG_NO_PROTECTION);
 
-  err = agent_genkey (NULL, cache_nonce_addr, passwd_nonce_addr, keyparms,
-                      !!(keygen_flags & KEYGEN_FLAG_NO_PROTECTION),
-                      passphrase,
-                      &s_key);
+  if ((keygen_flags & KEYGEN_FLAG_ASYNC))
+    {
+      cancel_pending_genkey ();
+      pending_genkey.keyparms = xtrystrdup (keyparms);
+      if (!pending_genkey.keyparms)
+        return gpg_error_from_syserror ();
+      pending_genkey.no_protection = no_protection;
+      pending_genkey.is_subkey = is_subkey;
+      err = agent_genkey_start (keyparms, no_protection, passphrase,
+                                &pending_genkey.job);
+      if (err)
+        {
+          xfree (pending_genkey.keyparms);
+          pending_genkey.keyparms = NULL;
+        }
+      return err;
+    }
+
+  if (pending_genkey.job
+      && pending_genkey.no_protection == no_protection
+      && pending_genkey.is_subkey == is_subkey
+      && !strcmp (pending_genkey.keyparms, keyparms))
+    {
+      err = agent_genkey_finish (pending_genkey.job, &s_key);
+      pending_genkey.job = NULL;
+      xfree (pending_genkey.keyparms);
+      pending_genkey.keyparms = NULL;
+    }
+  else
+    err = agent_genkey (NULL, cache_nonce_addr, passwd_nonce_addr, keyparms,
+                        no_protection, passphrase, &s_key);
   if (err)
     {
       log_error ("agent_genkey failed: %s\n", gpg_strerror (err) );
@@ -3174,7 +3228,7 @@ do_create (int algo, unsigned int nbits, const char *curve, kbnode_t pub_root,
 
   /* Fixme: The entropy collecting message should be moved to a
      libgcrypt progress handler.  */
-  if (!opt.batch)
+  if (!opt.batch && !(keygen_flags & KEYGEN_FLAG_ASYNC))
     tty_printf (_(
 "We need to generate a lot of random bytes. It is a good idea to perform\n"
 "some other action (type on the keyboard, move the mouse, utilize the\n"
@@ -5236,6 +5290,50 @@ card_store_key_with_backup (ctrl_t ctrl, PKT_public_key *sub_psk,
 }
 
 
+/* Helper for do_generate_keypair.  Generating an RSA key takes a
+ * while; thus we start the generation of an RSA subkey in the
+ * background so that the agent generates it while it generates the
+ * primary key.  This is only possible if the subkey does not take
+ * the passphrase from the cache nonce of the primary key, i.e. if it
+ * is not protected or the passphrase is given by the parameters.
+ * The subkey is later created by do_create as usual which then takes
+ * the result of this generation.  */
+static void
+start_subkey_generation (ctrl_t ctrl, struct para_data_s *para,
+                         struct output_control_s *outctrl,
+                         kbnode_t pub_root, u32 timestamp)
+{
+  unsigned int keygen_flags;
+  unsigned int nbits;
+  unsigned int maxsize = (opt.flags.large_rsa ? 8192 : 4096);
+
+  if (!get_parameter (para, pSUBKEYTYPE)
+      || get_parameter_value (para, pSUBKEYGRIP)
+      || get_parameter_algo (ctrl, para, pSUBKEYTYPE, NULL) != PUBKEY_ALGO_RSA)
+    return;
+
+  keygen_flags = outctrl->keygen_flags;
+  if (!(keygen_flags & KEYGEN_FLAG_NO_PROTECTION)
+      && !get_parameter_passphrase (para))
+    return;
+
+  /* Do not start it for sizes gen_rsa would adjust; it would then
+   * print its notes twice.  */
+  nbits = get_parameter_uint (para, pSUBKEYLENGTH);
+  if (nbits && (nbits < 1024 || nbits > maxsize || (nbits % 32)))
+    return;
+
+  if (get_parameter_uint (para, pSUBVERSION) == 5)
+    keygen_flags |= KEYGEN_FLAG_CREATE_V5_KEY;
+
+  if (do_create (PUBKEY_ALGO_RSA, nbits, NULL, pub_root, timestamp,
+                 get_parameter_u32 (para, pSUBKEYEXPIRE), 1,
+                 keygen_flags | KEYGEN_FLAG_ASYNC,
+                 get_parameter_passphrase (para), NULL, NULL))
+    cancel_pending_genkey ();  /* We will do it the usual way.  */
+}
+
+
 static void
 do_generate_keypair (ctrl_t ctrl, struct para_data_s *para,
 		     struct output_control_s *outctrl, int card)
@@ -5353,6 +5451,9 @@ do_generate_keypair (ctrl_t ctrl, struct para_data_s *para,
   if (get_parameter_uint (para, pVERSION) == 5)
     keygen_flags |= KEYGEN_FLAG_CREATE_V5_KEY;
 
+  if (!key_from_hexgrip && !card)
+    start_subkey_generation (ctrl, para, outctrl, pub_root, subkeytimestamp);
+
   if (key_from_hexgrip)
     err = do_create_from_keygrip (ctrl, algo, key_from_hexgrip, cardkey,
                                   pub_root,
@@ -5579,6 +5680,7 @@ do_generate_keypair (ctrl_t ctrl, struct para_data_s *para,
                                 get_parameter_value (para, pHANDLE));
     }
 
+  cancel_pending_genkey ();
   release_kbnode (pub_root);
   xfree (cache_nonce);
 }
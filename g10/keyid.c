@@ -121,16 +121,18 @@ pubkey_string (PKT_public_key *pk, char *buffer, size_t bufsize)
     snprintf (buffer, bufsize, "%s%u", prefix, nbits_from_pk (pk));
   else if (prefix)
     {
-      char *curve = openpgp_oid_to_str (pk->pkey[0]);
-      const char *name = openpgp_oid_to_curve (curve, 0);
+      const char *name = openpgp_oidmpi_to_curve (pk->pkey[0], 0);
+      char *curve;
 
       if (name)
         snprintf (buffer, bufsize, "%s", name);
-      else if (curve)
-        snprintf (buffer, bufsize, "E_%s", curve);
+      else if ((curve = openpgp_oid_to_str (pk->pkey[0])))
+        {
+          snprintf (buffer, bufsize, "E_%s", curve);
+          xfree (curve);
+        }
       else
         snprintf (buffer, bufsize, "E_error");
-      xfree (curve);
     }
   else
     snprintf (buffer, bufsize, "unknown_%u", (unsigned int)pk->pubkey_algo);
@@ -509,21 +511,107 @@ keystr_from_desc(KEYDB_SEARCH_DESC *desc)
 }
 
 
+/* Store the data hashed by hash_public_key for PK into BUFFER of
+ * SIZE bytes.  Returns the length of that data or 0 if it does not
+ * fit into BUFFER or if PK needs the special cases of
+ * hash_public_key.  */
+static size_t
+public_key_hash_image (PKT_public_key *pk, byte *buffer, size_t size)
+{
+  int npkey = pubkey_get_npkey (pk->pubkey_algo);
+  int is_v5 = pk->version == 5;
+  size_t hdrlen = is_v5? 5 : 3;
+  size_t off, n, nbytes;
+  unsigned int nbits;
+  const void *p;
+  byte *s;
+  int i;
+
+  off = hdrlen + (is_v5? 10 : 6);
+  if (!npkey || off > size)
+    return 0;
+
+  for (i=0; i < npkey; i++)
+    {
+      if (!pk->pkey[i])
+        return 0;
+      if (gcry_mpi_get_flag (pk->pkey[i], GCRYMPI_FLAG_OPAQUE))
+        {
+          p = gcry_mpi_get_opaque (pk->pkey[i], &nbits);
+          nbytes = (nbits+7)/8;
+          if (!p || nbytes > size - off)
+            return 0;
+          memcpy (buffer + off, p, nbytes);
+        }
+      else if (gcry_mpi_print (GCRYMPI_FMT_PGP, buffer + off, size - off,
+                               &nbytes, pk->pkey[i]))
+        return 0;
+      off += nbytes;
+    }
+
+  n = off - hdrlen;
+  s = buffer;
+  if (is_v5)
+    {
+      *s++ = 0x9a;
+      *s++ = n >> 24;
+      *s++ = n >> 16;
+      *s++ = n >>  8;
+      *s++ = n;
+    }
+  else
+    {
+      *s++ = 0x99;
+      *s++ = n >> 8;
+      *s++ = n;
+    }
+  *s++ = pk->version;
+  *s++ = pk->timestamp >> 24;
+  *s++ = pk->timestamp >> 16;
+  *s++ = pk->timestamp >>  8;
+  *s++ = pk->timestamp;
+  *s++ = pk->pubkey_algo;
+  if (is_v5)
+    {
+      n -= 10;
+      *s++ = n >> 24;
+      *s++ = n >> 16;
+      *s++ = n >>  8;
+      *s++ = n;
+    }
+
+  return off;
+}
+
+
 /* Compute the fingerprint and keyid and store it in PK.  */
 static void
 compute_fingerprint (PKT_public_key *pk)
 {
-  const byte *dp;
+  int algo = pk->version == 5 ? GCRY_MD_SHA256 : GCRY_MD_SHA1;
+  byte image[2048];
+  byte dp[MAX_FINGERPRINT_LEN];
   gcry_md_hd_t md;
-  size_t len;
+  size_t len, n;
 
-  if (gcry_md_open (&md, pk->version == 5 ? GCRY_MD_SHA256 : GCRY_MD_SHA1, 0))
-    BUG ();
-  hash_public_key (md, pk);
-  gcry_md_final (md);
-  dp = gcry_md_read (md, 0);
-  len = gcry_md_get_algo_dlen (gcry_md_get_algo (md));
+  len = gcry_md_get_algo_dlen (algo);
   log_assert (len <= MAX_FINGERPRINT_LEN);
+
+  /* The fingerprint is computed for each key read from a keyring.
+   * Hash the packet in one go if it fits into our buffer; this is
+   * much cheaper than setting up a hash context.  */
+  n = public_key_hash_image (pk, image, sizeof image);
+  if (n)
+    gcry_md_hash_buffer (algo, dp, image, n);
+  else
+    {
+      if (gcry_md_open (&md, algo, 0))
+        BUG ();
+      hash_public_key (md, pk);
+      gcry_md_final (md);
+      memcpy (dp, gcry_md_read (md, 0), len);
+      gcry_md_close (md);
+    }
   memcpy (pk->fpr, dp, len);
   pk->fprlen = len;
   if (pk->version == 5)
@@ -536,7 +624,6 @@ compute_fingerprint (PKT_public_key *pk)
       pk->keyid[0] = buf32_to_u32 (dp+12);
       pk->keyid[1] = buf32_to_u32 (dp+16);
     }
-  gcry_md_close( md);
 }
 
 
@@ -652,6 +739,33 @@ nbits_from_pk (PKT_public_key *pk)
 }
 
 
+/* Return true if the public key PK is compliant to COMPLIANCE.  This
+ * is gnupg_pk_is_compliant for PK.  KEYLENGTH and CURVENAME may be
+ * given if the caller already knows them; with 0 or NULL they are
+ * computed as needed.  de-vs is the only mode which actually
+ * restricts the keys; the verdict for it is cached in PK so that
+ * the key length is computed only once per key.  */
+int
+pk_is_compliant (enum gnupg_compliance_mode compliance, PKT_public_key *pk,
+                 unsigned int keylength, const char *curvename)
+{
+  if (compliance != CO_DE_VS)
+    return gnupg_pk_is_compliant (compliance, pk->pubkey_algo, pk->pkey,
+                                  keylength, curvename);
+
+  if (!pk->flags.de_vs_valid)
+    {
+      if (!keylength)
+        keylength = nbits_from_pk (pk);
+      pk->flags.de_vs = !!gnupg_pk_is_compliant (CO_DE_VS, pk->pubkey_algo,
+                                                 pk->pkey, keylength,
+                                                 curvename);
+      pk->flags.de_vs_valid = 1;
+    }
+  return pk->flags.de_vs;
+}
+
+
 /* Convert an UTC TIMESTAMP into an UTC yyyy-mm-dd string.  Return
  * that string.  The caller should pass a buffer with at least a size
  * of MK_DATESTR_SIZE.  */
@@ -966,13 +1080,20 @@ format_hexfingerprint (const char *fingerprint, char *buffer, size_t buflen)
 
 /* Return the so called KEYGRIP which is the SHA-1 hash of the public
    key parameters expressed as an canonical encoded S-Exp.  ARRAY must
-   be 20 bytes long.  Returns 0 on success or an error code.  */
+   be 20 bytes long.  Returns 0 on success or an error code.  The
+   keygrip is cached in PK.  */
 gpg_error_t
 keygrip_from_pk (PKT_public_key *pk, unsigned char *array)
 {
   gpg_error_t err;
   gcry_sexp_t s_pkey;
 
+  if (pk->flags.grip_valid)
+    {
+      memcpy (array, pk->grip, KEYGRIP_LEN);
+      return 0;
+    }
+
   if (DBG_PACKET)
     log_debug ("get_keygrip for public key\n");
 
@@ -1045,7 +1166,8 @@ keygrip_from_pk (PKT_public_key *pk, unsigned char *array)
     {
       if (DBG_PACKET)
         log_printhex (array, 20, "keygrip=");
-      /* FIXME: Save the keygrip in PK.  */
+      memcpy (pk->grip, array, KEYGRIP_LEN);
+      pk->flags.grip_valid = 1;
     }
   gcry_sexp_release (s_pkey);
 
@@ -140,6 +140,9 @@ public_key_list (ctrl_t ctrl, strlist_t list, int locate_mode, int no_local)
   tofu_begin_batch_update (ctrl);
 #endif
 
+  if (!locate_mode && opt.with_secret)
+    agent_begin_keygrip_cache (ctrl);
+
   if (locate_mode)
     locate_one (ctrl, list, no_local);
   else if (!list)
@@ -147,6 +150,8 @@ public_key_list (ctrl_t ctrl, strlist_t list, int locate_mode, int no_local)
   else
     list_one (ctrl, list, 0, opt.with_secret);
 
+  agent_end_keygrip_cache ();
+
 #ifdef USE_TOFU
   tofu_end_batch_update (ctrl);
 #endif
@@ -160,10 +165,14 @@ secret_key_list (ctrl_t ctrl, strlist_t list)
 
   check_trustdb_stale (ctrl);
 
+  agent_begin_keygrip_cache (ctrl);
+
   if (!list)
     list_all (ctrl, 1, 0);
   else				/* List by user id */
     list_one (ctrl, list, 1, 0);
+
+  agent_end_keygrip_cache ();
 }
 
 
@@ -510,6 +519,95 @@ print_signature_stats (struct keylist_context *s)
 /* List all keys.  If SECRET is true only secret keys are listed.  If
    MARK_SECRET is true secret keys are indicated in a public key
    listing.  */
+/* The number of keyblocks list_all processes at once if
+ * opt.list_jobs is greater than 1.  */
+#define KEYLIST_BATCH_SIZE 256
+
+
+/* Print the key KEYBLOCK from the resource RESNAME for list_all.
+ * LASTRESNAME is used to print the resource name only once.  */
+static void
+list_all_one (ctrl_t ctrl, kbnode_t keyblock, const char *resname,
+              const char **lastresname, int secret, int any_secret,
+              struct keylist_context *listctx)
+{
+  if (!opt.with_colons && !(opt.list_options & LIST_SHOW_ONLY_FPR_MBOX))
+    {
+      if (*lastresname != resname)
+        {
+          int i;
+
+          es_fprintf (es_stdout, "%s\n", resname);
+          for (i = strlen (resname); i; i--)
+            es_putc ('-', es_stdout);
+          es_putc ('\n', es_stdout);
+          *lastresname = resname;
+        }
+    }
+  merge_keys_and_selfsig (ctrl, keyblock);
+  list_keyblock (ctrl, keyblock, secret, any_secret, opt.fingerprint,
+                 listctx);
+}
+
+
+/*
+ * Verify the signatures of the NBATCH keyblocks in BATCH using
+ * opt.list_jobs threads and then print them in their original order.
+ * RESNAMES and ANY_SECRET give the values for list_all_one.  This
+ * releases the keyblocks.
+ */
+static void
+list_all_batch (ctrl_t ctrl, kbnode_t *batch, const char **resnames,
+                int *any_secret, int nbatch, const char **lastresname,
+                int secret, struct keylist_context *listctx)
+{
+  int i;
+
+  /* The self-signatures are verified by merge_keys_and_selfsig.  */
+  check_self_signatures_parallel (batch, nbatch, opt.list_jobs);
+
+  if (listctx->check_sigs)
+    {
+      struct sig_check_item_s *items = NULL;
+      size_t nitems = 0;
+      size_t maxitems = 0;
+      kbnode_t node;
+
+      for (i=0; i < nbatch; i++)
+        for (node = batch[i]; node; node = node->next)
+          {
+            if (node->pkt->pkttype != PKT_SIGNATURE)
+              continue;
+            if (nitems == maxitems)
+              {
+                maxitems += 1000;
+                items = xrealloc (items, maxitems * sizeof *items);
+              }
+            items[nitems].root = batch[i];
+            items[nitems].node = node;
+            nitems++;
+          }
+      if (nitems)
+        check_key_signatures_parallel (ctrl, items, nitems, opt.list_jobs);
+      xfree (items);
+    }
+
+  for (i=0; i < nbatch; i++)
+    {
+      list_all_one (ctrl, batch[i], resnames[i], lastresname,
+                    secret, any_secret[i], listctx);
+      release_kbnode (batch[i]);
+      batch[i] = NULL;
+    }
+}
+
+
+/*
+ * List all keys.  If opt.list_jobs is greater than 1 the keyblocks
+ * are processed in batches; the signatures of a batch are verified
+ * in parallel before the keyblocks are printed in their original
+ * order.
+ */
 static void
 list_all (ctrl_t ctrl, int secret, int mark_secret)
 {
@@ -517,13 +615,25 @@ list_all (ctrl_t ctrl, int secret, int mark_secret)
   KBNODE keyblock = NULL;
   int rc = 0;
   int any_secret;
-  const char *lastresname, *resname;
+  const char *lastresname;
   struct keylist_context listctx;
+  kbnode_t *batch = NULL;
+  const char **batch_resnames = NULL;
+  int *batch_any_secret = NULL;
+  int nbatch = 0;
 
   memset (&listctx, 0, sizeof (listctx));
   if (opt.check_sigs)
     listctx.check_sigs = 1;
 
+  if (opt.list_jobs > 1)
+    {
+      batch = xmalloc (KEYLIST_BATCH_SIZE * sizeof *batch);
+      batch_resnames = xmalloc (KEYLIST_BATCH_SIZE * sizeof *batch_resnames);
+      batch_any_secret = xmalloc (KEYLIST_BATCH_SIZE
+                                  * sizeof *batch_any_secret);
+    }
+
   hd = keydb_new (ctrl);
   if (!hd)
     rc = gpg_error_from_syserror ();
@@ -559,30 +669,32 @@ list_all (ctrl_t ctrl, int secret, int mark_secret)
 
       if (secret && !any_secret)
         ; /* Secret key listing requested but this isn't one.  */
-      else
+      else if (batch)
         {
-          if (!opt.with_colons && !(opt.list_options & LIST_SHOW_ONLY_FPR_MBOX))
+          batch[nbatch] = keyblock;
+          batch_resnames[nbatch] = keydb_get_resource_name (hd);
+          batch_any_secret[nbatch] = any_secret;
+          keyblock = NULL;
+          if (++nbatch == KEYLIST_BATCH_SIZE)
             {
-              resname = keydb_get_resource_name (hd);
-              if (lastresname != resname)
-                {
-                  int i;
-
-                  es_fprintf (es_stdout, "%s\n", resname);
-                  for (i = strlen (resname); i; i--)
-                    es_putc ('-', es_stdout);
-                  es_putc ('\n', es_stdout);
-                  lastresname = resname;
-                }
+              list_all_batch (ctrl, batch, batch_resnames, batch_any_secret,
+                              nbatch, &lastresname, secret, &listctx);
+              nbatch = 0;
             }
-          merge_keys_and_selfsig (ctrl, keyblock);
-          list_keyblock (ctrl, keyblock, secret, any_secret, opt.fingerprint,
-                         &listctx);
         }
+      else
+        list_all_one (ctrl, keyblock, keydb_get_resource_name (hd),
+                      &lastresname, secret, any_secret, &listctx);
       release_kbnode (keyblock);
       keyblock = NULL;
     }
   while (!(rc = keydb_search_next (hd)));
+  if (nbatch)
+    {
+      list_all_batch (ctrl, batch, batch_resnames, batch_any_secret,
+                      nbatch, &lastresname, secret, &listctx);
+      nbatch = 0;
+    }
   es_fflush (es_stdout);
   if (rc && gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
     log_error ("keydb_search_next failed: %s\n", gpg_strerror (rc));
@@ -596,6 +708,11 @@ list_all (ctrl_t ctrl, int secret, int mark_secret)
     print_signature_stats (&listctx);
 
  leave:
+  for (; nbatch; nbatch--)
+    release_kbnode (batch[nbatch-1]);
+  xfree (batch);
+  xfree (batch_resnames);
+  xfree (batch_any_secret);
   keylist_context_release (&listctx);
   release_kbnode (keyblock);
   keydb_release (hd);
@@ -724,27 +841,27 @@ locate_one (ctrl_t ctrl, strlist_t names, int no_local)
 
 
 static void
-print_key_data (PKT_public_key * pk)
+print_key_data (estream_t fp, PKT_public_key *pk)
 {
   int n = pk ? pubkey_get_npkey (pk->pubkey_algo) : 0;
   int i;
 
   for (i = 0; i < n; i++)
     {
-      es_fprintf (es_stdout, "pkd:%d:%u:", i, mpi_get_nbits (pk->pkey[i]));
-      mpi_print (es_stdout, pk->pkey[i], 1);
-      es_putc (':', es_stdout);
-      es_putc ('\n', es_stdout);
+      es_fprintf (fp, "pkd:%d:%u:", i, mpi_get_nbits (pk->pkey[i]));
+      mpi_print (fp, pk->pkey[i], 1);
+      es_putc (':', fp);
+      es_putc ('\n', fp);
     }
 }
 
 
 /* Various public key screenings.  (Right now just ROCA).  With
  * COLON_MODE set the output is formatted for use in the compliance
- * field of a colon listing.
+ * field of a colon listing.  The output is written to FP.
  */
 static void
-print_pk_screening (PKT_public_key *pk, int colon_mode)
+print_pk_screening (estream_t fp, PKT_public_key *pk, int colon_mode)
 {
   gpg_error_t err;
 
@@ -756,13 +873,13 @@ print_pk_screening (PKT_public_key *pk, int colon_mode)
       else if (gpg_err_code (err) == GPG_ERR_TRUE)
         {
           if (colon_mode)
-            es_fprintf (es_stdout, colon_mode > 1? " %d":"%d", 6001);
+            es_fprintf (fp, colon_mode > 1? " %d":"%d", 6001);
           else
-            es_fprintf (es_stdout,
+            es_fprintf (fp,
                         "      Screening: ROCA vulnerability detected\n");
         }
       else if (!colon_mode)
-        es_fprintf (es_stdout, "      Screening: [ROCA check failed: %s]\n",
+        es_fprintf (fp, "      Screening: [ROCA check failed: %s]\n",
                     gpg_strerror (err));
     }
 
@@ -770,20 +887,21 @@ print_pk_screening (PKT_public_key *pk, int colon_mode)
 
 
 static void
-print_capabilities (ctrl_t ctrl, PKT_public_key *pk, KBNODE keyblock)
+print_capabilities (ctrl_t ctrl, estream_t fp,
+                    PKT_public_key *pk, KBNODE keyblock)
 {
   unsigned int use = pk->pubkey_usage;
   int c_printed = 0;
 
   if (use & PUBKEY_USAGE_ENC)
-    es_putc ('e', es_stdout);
+    es_putc ('e', fp);
 
   if (use & PUBKEY_USAGE_SIG)
     {
-      es_putc ('s', es_stdout);
+      es_putc ('s', fp);
       if (pk->flags.primary)
         {
-          es_putc ('c', es_stdout);
+          es_putc ('c', fp);
           /* The PUBKEY_USAGE_CERT flag was introduced later and we
              used to always print 'c' for a primary key.  To avoid any
              regression here we better track whether we printed 'c'
@@ -793,13 +911,13 @@ print_capabilities (ctrl_t ctrl, PKT_public_key *pk, KBNODE keyblock)
     }
 
   if ((use & PUBKEY_USAGE_CERT) && !c_printed)
-    es_putc ('c', es_stdout);
+    es_putc ('c', fp);
 
   if ((use & PUBKEY_USAGE_AUTH))
-    es_putc ('a', es_stdout);
+    es_putc ('a', fp);
 
   if ((use & PUBKEY_USAGE_UNKNOWN))
-    es_putc ('?', es_stdout);
+    es_putc ('?', fp);
 
   if (keyblock)
     {
@@ -835,46 +953,46 @@ print_capabilities (ctrl_t ctrl, PKT_public_key *pk, KBNODE keyblock)
 	    }
 	}
       if (enc)
-	es_putc ('E', es_stdout);
+	es_putc ('E', fp);
       if (sign)
-	es_putc ('S', es_stdout);
+	es_putc ('S', fp);
       if (cert)
-	es_putc ('C', es_stdout);
+	es_putc ('C', fp);
       if (auth)
-	es_putc ('A', es_stdout);
+	es_putc ('A', fp);
       if (disabled)
-	es_putc ('D', es_stdout);
+	es_putc ('D', fp);
     }
 
-  es_putc (':', es_stdout);
+  es_putc (':', fp);
 }
 
 
 /* FLAGS: 0x01 hashed
           0x02 critical  */
 static void
-print_one_subpacket (sigsubpkttype_t type, size_t len, int flags,
-		     const byte * buf)
+print_one_subpacket (estream_t fp, sigsubpkttype_t type, size_t len,
+                     int flags, const byte * buf)
 {
   size_t i;
 
-  es_fprintf (es_stdout, "spk:%d:%u:%u:", type, flags, (unsigned int) len);
+  es_fprintf (fp, "spk:%d:%u:%u:", type, flags, (unsigned int) len);
 
   for (i = 0; i < len; i++)
     {
       /* printable ascii other than : and % */
       if (buf[i] >= 32 && buf[i] <= 126 && buf[i] != ':' && buf[i] != '%')
-	es_fprintf (es_stdout, "%c", buf[i]);
+	es_fprintf (fp, "%c", buf[i]);
       else
-	es_fprintf (es_stdout, "%%%02X", buf[i]);
+	es_fprintf (fp, "%%%02X", buf[i]);
     }
 
-  es_fprintf (es_stdout, "\n");
+  es_fprintf (fp, "\n");
 }
 
 
 void
-print_subpackets_colon (PKT_signature * sig)
+print_subpackets_colon (estream_t fp, PKT_signature *sig)
 {
   byte *i;
 
@@ -889,12 +1007,12 @@ print_subpackets_colon (PKT_signature * sig)
       seq = 0;
 
       while ((p = enum_sig_subpkt (sig, 1, *i, &len, &seq, &crit)))
-	print_one_subpacket (*i, len, 0x01 | (crit ? 0x02 : 0), p);
+	print_one_subpacket (fp, *i, len, 0x01 | (crit ? 0x02 : 0), p);
 
       seq = 0;
 
       while ((p = enum_sig_subpkt (sig, 0, *i, &len, &seq, &crit)))
-	print_one_subpacket (*i, len, 0x00 | (crit ? 0x02 : 0), p);
+	print_one_subpacket (fp, *i, len, 0x00 | (crit ? 0x02 : 0), p);
     }
 }
 
@@ -993,10 +1111,10 @@ list_keyblock_print (ctrl_t ctrl, kbnode_t keyblock, int secret, int fpr,
     print_card_serialno (serialno);
 
   if (opt.with_key_data)
-    print_key_data (pk);
+    print_key_data (es_stdout, pk);
 
   if (opt.with_key_screening)
-    print_pk_screening (pk, 0);
+    print_pk_screening (es_stdout, pk, 0);
 
   if (opt.with_key_origin
       && (pk->keyorg || pk->keyupdate || pk->updateurl))
@@ -1138,9 +1256,9 @@ list_keyblock_print (ctrl_t ctrl, kbnode_t keyblock, int secret, int fpr,
           if (opt.with_keygrip && hexgrip)
             es_fprintf (es_stdout, "      Keygrip = %s\n", hexgrip);
 	  if (opt.with_key_data)
-	    print_key_data (pk2);
+	    print_key_data (es_stdout, pk2);
           if (opt.with_key_screening)
-            print_pk_screening (pk2, 0);
+            print_pk_screening (es_stdout, pk2, 0);
 	}
       else if (opt.list_sigs
 	       && node->pkt->pkttype == PKT_SIGNATURE && !skip_sigs)
@@ -1375,31 +1493,79 @@ print_revokers (estream_t fp, PKT_public_key * pk)
 /* Print the compliance flags to field 18.  PK is the public key.
  * KEYLENGTH is the length of the key in bits and CURVENAME is either
  * NULL or the name of the curve.  The latter two args are here
- * merely because the caller has already computed them.  */
+ * merely because the caller has already computed them.  The output
+ * is written to FP.  */
 static void
-print_compliance_flags (PKT_public_key *pk,
+print_compliance_flags (estream_t fp, PKT_public_key *pk,
                         unsigned int keylength, const char *curvename)
 {
   int any = 0;
 
-  if (!keylength)
-    keylength = nbits_from_pk (pk);
-
   if (pk->version == 5)
     {
-      es_fputs (gnupg_status_compliance_flag (CO_GNUPG), es_stdout);
+      es_fputs (gnupg_status_compliance_flag (CO_GNUPG), fp);
       any++;
     }
-  if (gnupg_pk_is_compliant (CO_DE_VS, pk->pubkey_algo, pk->pkey,
-			     keylength, curvename))
+  if (pk_is_compliant (CO_DE_VS, pk, keylength, curvename))
     {
-      es_fprintf (es_stdout, any ? " %s" : "%s",
+      es_fprintf (fp, any ? " %s" : "%s",
 		  gnupg_status_compliance_flag (CO_DE_VS));
       any++;
     }
 
   if (opt.with_key_screening)
-    print_pk_screening (pk, 1+any);
+    print_pk_screening (fp, pk, 1+any);
+}
+
+
+/* The colon listing of a keyblock is first written to this memory
+ * stream and then copied to es_stdout in large chunks.  This saves
+ * the locking and the buffer handling of es_stdout for each of the
+ * many small writes.  The stream is reused for all keyblocks.  */
+static estream_t colon_fp;
+
+
+/* Return the stream for the colon listing of a keyblock.  */
+static estream_t
+colon_output_begin (void)
+{
+  /* Status lines or attributes written to stdout in the middle of a
+   * keyblock must not be moved in front of the keyblock.  */
+  if (is_status_stdout () || attrib_fp == es_stdout)
+    return es_stdout;
+
+  if (!colon_fp)
+    {
+      colon_fp = es_fopenmem (0, "w+,samethread");
+      if (!colon_fp)
+        return es_stdout;
+    }
+  return colon_fp;
+}
+
+
+/* Write what has been buffered in FP to es_stdout.  */
+static void
+colon_output_flush (estream_t fp)
+{
+  char buffer[4096];
+  gpgrt_off_t len;
+  size_t nread;
+
+  if (fp == es_stdout)
+    return;
+
+  len = es_ftello (fp);
+  es_rewind (fp);
+  while (len > 0
+         && !es_read (fp, buffer, len < sizeof buffer? len : sizeof buffer,
+                      &nread)
+         && nread)
+    {
+      es_write (es_stdout, buffer, nread, NULL);
+      len -= nread;
+    }
+  es_rewind (fp);
 }
 
 
@@ -1427,6 +1593,7 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
   unsigned int keylength;
   char *curve = NULL;
   const char *curvename = NULL;
+  estream_t fp;
 
   /* Get the keyid from the keyblock.  */
   node = find_kbnode (keyblock, PKT_PUBLIC_KEY);
@@ -1477,64 +1644,64 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
 
   keylength = nbits_from_pk (pk);
 
-  es_fputs (secret? "sec:":"pub:", es_stdout);
+  fp = colon_output_begin ();
+  es_fputs (secret? "sec:":"pub:", fp);
   if (trustletter_print)
-    es_putc (trustletter_print, es_stdout);
-  es_fprintf (es_stdout, ":%u:%d:%08lX%08lX:%s:%s::",
+    es_putc (trustletter_print, fp);
+  es_fprintf (fp, ":%u:%d:%08lX%08lX:%s:%s::",
               keylength,
               pk->pubkey_algo,
               (ulong) keyid[0], (ulong) keyid[1],
               colon_datestr_from_pk (pk), colon_strtime (pk->expiredate));
 
   if (ownertrust_print)
-    es_putc (ownertrust_print, es_stdout);
-  es_putc (':', es_stdout);
-
-  es_putc (':', es_stdout);
-  es_putc (':', es_stdout);
-  print_capabilities (ctrl, pk, keyblock);
-  es_putc (':', es_stdout);		/* End of field 13. */
-  es_putc (':', es_stdout);		/* End of field 14. */
+    es_putc (ownertrust_print, fp);
+  es_putc (':', fp);
+
+  es_putc (':', fp);
+  es_putc (':', fp);
+  print_capabilities (ctrl, fp, pk, keyblock);
+  es_putc (':', fp);		/* End of field 13. */
+  es_putc (':', fp);		/* End of field 14. */
   if (secret || has_secret)
     {
       if (stubkey)
-	es_putc ('#', es_stdout);
+	es_putc ('#', fp);
       else if (serialno)
-        es_fputs (serialno, es_stdout);
+        es_fputs (serialno, fp);
       else if (has_secret)
-        es_putc ('+', es_stdout);
+        es_putc ('+', fp);
     }
-  es_putc (':', es_stdout);		/* End of field 15. */
-  es_putc (':', es_stdout);		/* End of field 16. */
+  es_putc (':', fp);		/* End of field 15. */
+  es_putc (':', fp);		/* End of field 16. */
   if (pk->pubkey_algo == PUBKEY_ALGO_ECDSA
       || pk->pubkey_algo == PUBKEY_ALGO_EDDSA
       || pk->pubkey_algo == PUBKEY_ALGO_ECDH)
     {
-      curve = openpgp_oid_to_str (pk->pkey[0]);
-      curvename = openpgp_oid_to_curve (curve, 0);
+      curvename = openpgp_oidmpi_to_curve (pk->pkey[0], 0);
       if (!curvename)
-        curvename = curve;
-      es_fputs (curvename, es_stdout);
+        curvename = curve = openpgp_oid_to_str (pk->pkey[0]);
+      es_fputs (curvename, fp);
     }
-  es_putc (':', es_stdout);		/* End of field 17. */
-  print_compliance_flags (pk, keylength, curvename);
-  es_putc (':', es_stdout);		/* End of field 18 (compliance). */
+  es_putc (':', fp);		/* End of field 17. */
+  print_compliance_flags (fp, pk, keylength, curvename);
+  es_putc (':', fp);		/* End of field 18 (compliance). */
   if (pk->keyupdate)
-    es_fputs (colon_strtime (pk->keyupdate), es_stdout);
-  es_putc (':', es_stdout);		/* End of field 19 (last_update). */
-  es_fprintf (es_stdout, "%d%s", pk->keyorg, pk->updateurl? " ":"");
+    es_fputs (colon_strtime (pk->keyupdate), fp);
+  es_putc (':', fp);		/* End of field 19 (last_update). */
+  es_fprintf (fp, "%d%s", pk->keyorg, pk->updateurl? " ":"");
   if (pk->updateurl)
-    es_write_sanitized (es_stdout, pk->updateurl, strlen (pk->updateurl),
+    es_write_sanitized (fp, pk->updateurl, strlen (pk->updateurl),
                         ":", NULL);
-  es_putc (':', es_stdout);		/* End of field 20 (origin). */
-  es_putc ('\n', es_stdout);
+  es_putc (':', fp);		/* End of field 20 (origin). */
+  es_putc ('\n', fp);
 
-  print_revokers (es_stdout, pk);
-  print_fingerprint (ctrl, NULL, pk, 0);
+  print_revokers (fp, pk);
+  print_fingerprint (ctrl, fp, pk, 0);
   if (hexgrip)
-    es_fprintf (es_stdout, "grp:::::::::%s:\n", hexgrip);
+    es_fprintf (fp, "grp:::::::::%s:\n", hexgrip);
   if (opt.with_key_data)
-    print_key_data (pk);
+    print_key_data (fp, pk);
 
   for (kbctx = NULL; (node = walk_kbnode (keyblock, &kbctx, 0));)
     {
@@ -1557,42 +1724,42 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
           else
             uid_validity = get_validity_info (ctrl, keyblock, pk, uid);
 
-          es_fputs (uid->attrib_data? "uat:":"uid:", es_stdout);
+          es_fputs (uid->attrib_data? "uat:":"uid:", fp);
           if (uid_validity)
-            es_putc (uid_validity, es_stdout);
-          es_fputs ("::::", es_stdout);
+            es_putc (uid_validity, fp);
+          es_fputs ("::::", fp);
 
-	  es_fprintf (es_stdout, "%s:", colon_strtime (uid->created));
-	  es_fprintf (es_stdout, "%s:", colon_strtime (uid->expiredate));
+	  es_fprintf (fp, "%s:", colon_strtime (uid->created));
+	  es_fprintf (fp, "%s:", colon_strtime (uid->expiredate));
 
 	  namehash_from_uid (uid);
 
 	  for (i = 0; i < 20; i++)
-	    es_fprintf (es_stdout, "%02X", uid->namehash[i]);
+	    es_fprintf (fp, "%02X", uid->namehash[i]);
 
-	  es_fprintf (es_stdout, "::");
+	  es_fprintf (fp, "::");
 
 	  if (uid->attrib_data)
-	    es_fprintf (es_stdout, "%u %lu", uid->numattribs, uid->attrib_len);
+	    es_fprintf (fp, "%u %lu", uid->numattribs, uid->attrib_len);
 	  else
-	    es_write_sanitized (es_stdout, uid->name, uid->len, ":", NULL);
-	  es_fputs (":::::::::", es_stdout);
+	    es_write_sanitized (fp, uid->name, uid->len, ":", NULL);
+	  es_fputs (":::::::::", fp);
           if (uid->keyupdate)
-            es_fputs (colon_strtime (uid->keyupdate), es_stdout);
-          es_putc (':', es_stdout);	/* End of field 19 (last_update). */
-          es_fprintf (es_stdout, "%d%s", uid->keyorg, uid->updateurl? " ":"");
+            es_fputs (colon_strtime (uid->keyupdate), fp);
+          es_putc (':', fp);	/* End of field 19 (last_update). */
+          es_fprintf (fp, "%d%s", uid->keyorg, uid->updateurl? " ":"");
           if (uid->updateurl)
-            es_write_sanitized (es_stdout,
+            es_write_sanitized (fp,
                                 uid->updateurl, strlen (uid->updateurl),
                                 ":", NULL);
-          es_putc (':', es_stdout);	/* End of field 20 (origin). */
-	  es_putc ('\n', es_stdout);
+          es_putc (':', fp);	/* End of field 20 (origin). */
+	  es_putc ('\n', fp);
 #ifdef USE_TOFU
 	  if (!uid->attrib_data && opt.with_tofu_info
               && (opt.trust_model == TM_TOFU || opt.trust_model == TM_TOFU_PGP))
 	    {
               /* Print a "tfs" record.  */
-              tofu_write_tfs_record (ctrl, es_stdout, pk, uid->name);
+              tofu_write_tfs_record (ctrl, fp, pk, uid->name);
 	    }
 #endif /*USE_TOFU*/
 	}
@@ -1620,62 +1787,62 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
             stubkey = 1;  /* Key not found.  */
 
 	  keyid_from_pk (pk2, keyid2);
-	  es_fputs (secret? "ssb:":"sub:", es_stdout);
+	  es_fputs (secret? "ssb:":"sub:", fp);
 	  if (!pk2->flags.valid)
-	    es_putc ('i', es_stdout);
+	    es_putc ('i', fp);
 	  else if (pk2->flags.revoked)
-	    es_putc ('r', es_stdout);
+	    es_putc ('r', fp);
 	  else if (pk2->has_expired)
-	    es_putc ('e', es_stdout);
+	    es_putc ('e', fp);
 	  else if (opt.fast_list_mode || opt.no_expensive_trust_checks)
 	    ;
 	  else
 	    {
 	      /* TRUSTLETTER should always be defined here. */
 	      if (trustletter)
-		es_fprintf (es_stdout, "%c", trustletter);
+		es_fprintf (fp, "%c", trustletter);
 	    }
           keylength = nbits_from_pk (pk2);
-	  es_fprintf (es_stdout, ":%u:%d:%08lX%08lX:%s:%s:::::",
+	  es_fprintf (fp, ":%u:%d:%08lX%08lX:%s:%s:::::",
                       keylength,
                       pk2->pubkey_algo,
                       (ulong) keyid2[0], (ulong) keyid2[1],
                       colon_datestr_from_pk (pk2),
                       colon_strtime (pk2->expiredate));
-	  print_capabilities (ctrl, pk2, NULL);
-          es_putc (':', es_stdout);	/* End of field 13. */
-          es_putc (':', es_stdout);	/* End of field 14. */
+	  print_capabilities (ctrl, fp, pk2, NULL);
+          es_putc (':', fp);	/* End of field 13. */
+          es_putc (':', fp);	/* End of field 14. */
           if (secret || has_secret)
             {
               if (stubkey)
-                es_putc ('#', es_stdout);
+                es_putc ('#', fp);
               else if (serialno)
-                es_fputs (serialno, es_stdout);
+                es_fputs (serialno, fp);
               else if (has_secret)
-                es_putc ('+', es_stdout);
+                es_putc ('+', fp);
             }
-          es_putc (':', es_stdout);	/* End of field 15. */
-          es_putc (':', es_stdout);	/* End of field 16. */
+          es_putc (':', fp);	/* End of field 15. */
+          es_putc (':', fp);	/* End of field 16. */
           if (pk2->pubkey_algo == PUBKEY_ALGO_ECDSA
               || pk2->pubkey_algo == PUBKEY_ALGO_EDDSA
               || pk2->pubkey_algo == PUBKEY_ALGO_ECDH)
             {
               xfree (curve);
-              curve = openpgp_oid_to_str (pk2->pkey[0]);
-              curvename = openpgp_oid_to_curve (curve, 0);
+              curve = NULL;
+              curvename = openpgp_oidmpi_to_curve (pk2->pkey[0], 0);
               if (!curvename)
-                curvename = curve;
-              es_fputs (curvename, es_stdout);
+                curvename = curve = openpgp_oid_to_str (pk2->pkey[0]);
+              es_fputs (curvename, fp);
             }
-          es_putc (':', es_stdout);	/* End of field 17. */
-          print_compliance_flags (pk2, keylength, curvename);
-          es_putc (':', es_stdout);	/* End of field 18. */
-	  es_putc ('\n', es_stdout);
-          print_fingerprint (ctrl, NULL, pk2, 0);
+          es_putc (':', fp);	/* End of field 17. */
+          print_compliance_flags (fp, pk2, keylength, curvename);
+          es_putc (':', fp);	/* End of field 18. */
+	  es_putc ('\n', fp);
+          print_fingerprint (ctrl, fp, pk2, 0);
           if (hexgrip)
-            es_fprintf (es_stdout, "grp:::::::::%s:\n", hexgrip);
+            es_fprintf (fp, "grp:::::::::%s:\n", hexgrip);
           if (opt.with_key_data)
-            print_key_data (pk2);
+            print_key_data (fp, pk2);
 	}
       else if (opt.list_sigs && node->pkt->pkttype == PKT_SIGNATURE)
 	{
@@ -1708,7 +1875,7 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
 	    sigstr = "sig";
 	  else
 	    {
-	      es_fprintf (es_stdout, "sig::::::::::%02x%c:\n",
+	      es_fprintf (fp, "sig::::::::::%02x%c:\n",
 		      sig->sig_class, sig->flags.exportable ? 'x' : 'l');
 	      continue;
 	    }
@@ -1717,6 +1884,7 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
 	    {
 	      PKT_public_key *signer_pk = NULL;
 
+	      colon_output_flush (fp);
 	      es_fflush (es_stdout);
 	      if (opt.no_sig_cache)
 		signer_pk = xmalloc_clear (sizeof (PKT_public_key));
@@ -1770,56 +1938,56 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
             }
 
 
-	  es_fputs (sigstr, es_stdout);
-	  es_putc (':', es_stdout);
+	  es_fputs (sigstr, fp);
+	  es_putc (':', fp);
 	  if (sigrc != ' ')
-	    es_putc (sigrc, es_stdout);
-	  es_fprintf (es_stdout, "::%d:%08lX%08lX:%s:%s:", sig->pubkey_algo,
+	    es_putc (sigrc, fp);
+	  es_fprintf (fp, "::%d:%08lX%08lX:%s:%s:", sig->pubkey_algo,
 		  (ulong) sig->keyid[0], (ulong) sig->keyid[1],
 		  colon_datestr_from_sig (sig),
 		  colon_expirestr_from_sig (sig));
 
 	  if (sig->trust_depth || sig->trust_value)
-	    es_fprintf (es_stdout, "%d %d", sig->trust_depth, sig->trust_value);
-	  es_fprintf (es_stdout, ":");
+	    es_fprintf (fp, "%d %d", sig->trust_depth, sig->trust_value);
+	  es_fprintf (fp, ":");
 
 	  if (sig->trust_regexp)
-	    es_write_sanitized (es_stdout, sig->trust_regexp,
+	    es_write_sanitized (fp, sig->trust_regexp,
                                 strlen (sig->trust_regexp), ":", NULL);
-	  es_fprintf (es_stdout, ":");
+	  es_fprintf (fp, ":");
 
 	  if (sigrc == '%')
-	    es_fprintf (es_stdout, "[%s] ", gpg_strerror (rc));
+	    es_fprintf (fp, "[%s] ", gpg_strerror (rc));
 	  else if (siguid)
-            es_write_sanitized (es_stdout, siguid, siguidlen, ":", NULL);
+            es_write_sanitized (fp, siguid, siguidlen, ":", NULL);
 
-	  es_fprintf (es_stdout, ":%02x%c", sig->sig_class,
+	  es_fprintf (fp, ":%02x%c", sig->sig_class,
                       sig->flags.exportable ? 'x' : 'l');
           if (reason_text)
-            es_fprintf (es_stdout, ",%02x", reason_code);
-          es_fputs ("::", es_stdout);
+            es_fprintf (fp, ",%02x", reason_code);
+          es_fputs ("::", fp);
 
 	  if (opt.no_sig_cache && opt.check_sigs && fprokay)
 	    {
 	      for (i = 0; i < fplen; i++)
-		es_fprintf (es_stdout, "%02X", fparray[i]);
+		es_fprintf (fp, "%02X", fparray[i]);
 	    }
           else if ((issuer_fpr = issuer_fpr_string (sig)))
-            es_fputs (issuer_fpr, es_stdout);
+            es_fputs (issuer_fpr, fp);
 
-	  es_fprintf (es_stdout, ":::%d:", sig->digest_algo);
+	  es_fprintf (fp, ":::%d:", sig->digest_algo);
 
           if (reason_comment)
             {
-              es_fputs ("::::", es_stdout);
-              es_write_sanitized (es_stdout, reason_comment, reason_commentlen,
+              es_fputs ("::::", fp);
+              es_write_sanitized (fp, reason_comment, reason_commentlen,
                                   ":", NULL);
-              es_putc (':', es_stdout);
+              es_putc (':', fp);
             }
-          es_putc ('\n', es_stdout);
+          es_putc ('\n', fp);
 
 	  if (opt.show_subpackets)
-	    print_subpackets_colon (sig);
+	    print_subpackets_colon (fp, sig);
 
 	  /* fixme: check or list other sigs here */
           xfree (reason_text);
@@ -1829,6 +1997,7 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
 	}
     }
 
+  colon_output_flush (fp);
   xfree (curve);
   xfree (hexgrip_buffer);
   xfree (serialno);
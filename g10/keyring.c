@@ -29,6 +29,7 @@
 
 #include "gpg.h"
 #include "../common/util.h"
+#include "../common/host2net.h"
 #include "keyring.h"
 #include "packet.h"
 #include "keydb.h"
@@ -38,6 +39,8 @@
 #include "../kbx/keybox.h"
 
 
+struct offtbl_s;
+
 typedef struct keyring_resource *KR_RESOURCE;
 struct keyring_resource
 {
@@ -46,6 +49,7 @@ struct keyring_resource
   dotlock_t lockhd;
   int is_locked;
   int did_full_scan;
+  struct offtbl_s *offtbl;  /* The keyid offset table or NULL.  */
   char fname[1];
 };
 typedef struct keyring_resource const * CONST_KR_RESOURCE;
@@ -177,6 +181,398 @@ key_present_hash_update_from_kb (key_present_hash_t tbl, KBNODE node)
     }
 }
 
+
+
+/* For large keyrings we also keep a table which maps the keyids of
+   all (sub)keys to the offset of their keyblock.  Unlike the key
+   present hash this table is stored in the file "FNAME.off" next to
+   the keyring so that a new process can seek directly to the keyblock
+   without scanning the keyring first.  Like the Bloom filter of
+   keydb-bloom.c the table is tied to the size and the modification
+   time of the keyring; a stale table is rebuilt on the next lookup.
+   All integers are stored in network byte order.
+
+     - b4   Magic 'GPGo'
+     - byte Version number (1)
+     - b3   RFU
+     - u64  Size of the keyring
+     - u64  Modification time of the keyring (seconds)
+     - u32  Modification time of the keyring (nanoseconds)
+     - u32  Number of items
+     - The items sorted by keyid, each with:
+       - u32  High word of the keyid
+       - u32  Low word of the keyid
+       - u64  Offset of the keyblock
+ */
+#define OFFTBL_MAGIC        "GPGo"
+#define OFFTBL_VERSION      1
+#define OFFTBL_HEADER_LEN   32
+#define OFFTBL_ITEM_LEN     16
+
+/* Do not use a table for keyrings smaller than this.  */
+#define OFFTBL_MIN_FILESIZE (256*1024)
+
+struct offtbl_item
+{
+  u32 kid[2];
+  off_t offset;
+};
+
+struct offtbl_s
+{
+  /* The state of the keyring this table is valid for.  */
+  unsigned long long filesize;
+  unsigned long long mtime;
+  unsigned int mtime_ns;
+
+  size_t nitems;
+  struct offtbl_item *items;
+};
+
+
+static inline void
+put64 (unsigned char *p, unsigned long long a)
+{
+  p[0] = a >> 56;
+  p[1] = a >> 48;
+  p[2] = a >> 40;
+  p[3] = a >> 32;
+  p[4] = a >> 24;
+  p[5] = a >> 16;
+  p[6] = a >>  8;
+  p[7] = a;
+}
+
+static inline unsigned long long
+get64 (const unsigned char *p)
+{
+  return (((unsigned long long)buf32_to_u32 (p) << 32)
+          | (unsigned long long)buf32_to_u32 (p+4));
+}
+
+
+static void
+offtbl_release (struct offtbl_s *tbl)
+{
+  if (!tbl)
+    return;
+  xfree (tbl->items);
+  xfree (tbl);
+}
+
+
+/* Return true if the state of the keyring as given by SB matches the
+   state stored in TBL.  */
+static int
+offtbl_same_state (struct offtbl_s *tbl, struct stat *sb)
+{
+  unsigned int ns;
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  ns = sb->st_mtim.tv_nsec;
+#else
+  ns = 0;
+#endif
+  return (tbl->filesize == sb->st_size
+          && tbl->mtime == sb->st_mtime
+          && tbl->mtime_ns == ns);
+}
+
+
+/* Store the state of the keyring as given by SB in TBL.  */
+static void
+offtbl_set_state (struct offtbl_s *tbl, struct stat *sb)
+{
+  tbl->filesize = sb->st_size;
+  tbl->mtime = sb->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  tbl->mtime_ns = sb->st_mtim.tv_nsec;
+#else
+  tbl->mtime_ns = 0;
+#endif
+}
+
+
+static int
+cmp_offtbl_items (const void *a_arg, const void *b_arg)
+{
+  const struct offtbl_item *a = a_arg;
+  const struct offtbl_item *b = b_arg;
+
+  if (a->kid[0] != b->kid[0])
+    return a->kid[0] < b->kid[0]? -1 : 1;
+  if (a->kid[1] != b->kid[1])
+    return a->kid[1] < b->kid[1]? -1 : 1;
+  return a->offset < b->offset? -1 : a->offset > b->offset;
+}
+
+
+/* Scan the keyring FNAME which is in the state SB and return a new
+   offset table.  Returns NULL if the keyring could not be parsed.  */
+static struct offtbl_s *
+offtbl_build (const char *fname, struct stat *sb)
+{
+  struct offtbl_s *tbl;
+  struct offtbl_item *item;
+  size_t nalloced = 0;
+  PACKET pkt;
+  struct parse_packet_ctx_s parsectx;
+  IOBUF a;
+  off_t offset, main_offset = -1;
+  int save_mode;
+  int rc;
+
+  tbl = xtrycalloc (1, sizeof *tbl);
+  if (!tbl)
+    return NULL;
+  offtbl_set_state (tbl, sb);
+
+  a = iobuf_open (fname);
+  if (!a)
+    {
+      xfree (tbl);
+      return NULL;
+    }
+
+  init_packet (&pkt);
+  init_parse_packet (&parsectx, a);
+  save_mode = set_packet_list_mode (0);
+  while ((rc = search_packet (&parsectx, &pkt, &offset, 0)) != -1)
+    {
+      if (gpg_err_code (rc) == GPG_ERR_LEGACY_KEY)
+        {
+          free_packet (&pkt, &parsectx);
+          continue;
+        }
+      if (rc)
+        break;
+
+      if (pkt.pkttype == PKT_PUBLIC_KEY || pkt.pkttype == PKT_SECRET_KEY)
+        main_offset = offset;
+      if (main_offset != -1
+          && (pkt.pkttype == PKT_PUBLIC_KEY
+              || pkt.pkttype == PKT_PUBLIC_SUBKEY
+              || pkt.pkttype == PKT_SECRET_KEY
+              || pkt.pkttype == PKT_SECRET_SUBKEY))
+        {
+          if (tbl->nitems == nalloced)
+            {
+              nalloced = nalloced? 2 * nalloced : 1024;
+              item = xtryrealloc (tbl->items, nalloced * sizeof *item);
+              if (!item)
+                {
+                  rc = gpg_error_from_syserror ();
+                  break;
+                }
+              tbl->items = item;
+            }
+          item = tbl->items + tbl->nitems++;
+          keyid_from_pk (pkt.pkt.public_key, item->kid);
+          item->offset = main_offset;
+        }
+      free_packet (&pkt, &parsectx);
+    }
+  free_packet (&pkt, &parsectx);
+  deinit_parse_packet (&parsectx);
+  set_packet_list_mode (save_mode);
+  iobuf_close (a);
+
+  if (rc != -1)
+    {
+      if (DBG_CACHE)
+        log_debug ("keyring: can't build offset table for '%s': %s\n",
+                   fname, gpg_strerror (rc));
+      offtbl_release (tbl);
+      return NULL;
+    }
+
+  qsort (tbl->items, tbl->nitems, sizeof *tbl->items, cmp_offtbl_items);
+  return tbl;
+}
+
+
+/* Load the offset table from the file TBLNAME.  Returns NULL if the
+   file does not exist or does not match the keyring state SB.  */
+static struct offtbl_s *
+offtbl_load (const char *tblname, struct stat *sb)
+{
+  FILE *fp;
+  unsigned char hdr[OFFTBL_HEADER_LEN];
+  unsigned char buf[OFFTBL_ITEM_LEN];
+  struct offtbl_s *tbl;
+  struct offtbl_item *item;
+  size_t n;
+
+  fp = fopen (tblname, "rb");
+  if (!fp)
+    return NULL;
+
+  tbl = xtrycalloc (1, sizeof *tbl);
+  if (!tbl)
+    goto leave;
+  offtbl_set_state (tbl, sb);
+
+  if (fread (hdr, sizeof hdr, 1, fp) != 1
+      || memcmp (hdr, OFFTBL_MAGIC, 4) || hdr[4] != OFFTBL_VERSION
+      || get64 (hdr+8) != tbl->filesize
+      || get64 (hdr+16) != tbl->mtime
+      || buf32_to_uint (hdr+24) != tbl->mtime_ns)
+    goto bad; /* Not for this state of the keyring.  */
+
+  /* Each keyblock is larger than an item thus this limits the number
+     of items even for a corrupted file.  */
+  tbl->nitems = buf32_to_size_t (hdr+28);
+  if (tbl->nitems > tbl->filesize / OFFTBL_ITEM_LEN)
+    goto bad;
+  tbl->items = xtrycalloc (tbl->nitems + 1, sizeof *tbl->items);
+  if (!tbl->items)
+    goto bad;
+  for (n=0; n < tbl->nitems; n++)
+    {
+      if (fread (buf, sizeof buf, 1, fp) != 1)
+        goto bad;
+      item = tbl->items + n;
+      item->kid[0] = buf32_to_u32 (buf);
+      item->kid[1] = buf32_to_u32 (buf+4);
+      item->offset = get64 (buf+8);
+      if (item->offset < 0 || item->offset >= tbl->filesize
+          || (n && cmp_offtbl_items (item - 1, item) > 0))
+        goto bad;
+    }
+
+ leave:
+  fclose (fp);
+  return tbl;
+
+ bad:
+  offtbl_release (tbl);
+  tbl = NULL;
+  goto leave;
+}
+
+
+/* Write the offset table TBL to the file TBLNAME.  Errors are not
+   fatal; the table is then built again by the next process.  */
+static void
+offtbl_write (const char *tblname, struct offtbl_s *tbl)
+{
+  gpg_error_t err = 0;
+  char *tmpname;
+  FILE *fp;
+  unsigned char hdr[OFFTBL_HEADER_LEN];
+  unsigned char buf[OFFTBL_ITEM_LEN];
+  size_t n;
+
+  tmpname = xtryasprintf ("%s" EXTSEP_S "%u" EXTSEP_S "tmp",
+                          tblname, (unsigned int)getpid ());
+  if (!tmpname)
+    return;
+
+  memset (hdr, 0, sizeof hdr);
+  memcpy (hdr, OFFTBL_MAGIC, 4);
+  hdr[4] = OFFTBL_VERSION;
+  put64 (hdr+8, tbl->filesize);
+  put64 (hdr+16, tbl->mtime);
+  ulongtobuf (hdr+24, tbl->mtime_ns);
+  ulongtobuf (hdr+28, tbl->nitems);
+
+  fp = fopen (tmpname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fwrite (hdr, sizeof hdr, 1, fp) != 1)
+    err = gpg_error_from_syserror ();
+  for (n=0; !err && n < tbl->nitems; n++)
+    {
+      ulongtobuf (buf, tbl->items[n].kid[0]);
+      ulongtobuf (buf+4, tbl->items[n].kid[1]);
+      put64 (buf+8, tbl->items[n].offset);
+      if (fwrite (buf, sizeof buf, 1, fp) != 1)
+        err = gpg_error_from_syserror ();
+    }
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+
+  if (!err)
+    err = gnupg_rename_file (tmpname, tblname, NULL);
+  if (err)
+    gnupg_remove (tmpname);
+
+ leave:
+  if (err && DBG_CACHE)
+    log_debug ("keyring: error writing '%s': %s\n",
+               tblname, gpg_strerror (err));
+  xfree (tmpname);
+}
+
+
+/* Return the offset table for the keyring KR.  The table is loaded
+   from its file or built if the file is missing or stale.  Returns
+   NULL if no table shall be used for this keyring.  */
+static struct offtbl_s *
+offtbl_get (KR_RESOURCE kr)
+{
+  struct stat sb;
+  char *tblname;
+
+  if (stat (kr->fname, &sb) || sb.st_size < OFFTBL_MIN_FILESIZE)
+    {
+      offtbl_release (kr->offtbl);
+      kr->offtbl = NULL;
+      return NULL;
+    }
+  if (kr->offtbl && offtbl_same_state (kr->offtbl, &sb))
+    return kr->offtbl;
+  offtbl_release (kr->offtbl);
+  kr->offtbl = NULL;
+
+  tblname = strconcat (kr->fname, EXTSEP_S "off", NULL);
+  if (!tblname)
+    return NULL;
+  kr->offtbl = offtbl_load (tblname, &sb);
+  if (!kr->offtbl)
+    {
+      if (DBG_CACHE)
+        log_debug ("keyring: building offset table for '%s'\n", kr->fname);
+      kr->offtbl = offtbl_build (kr->fname, &sb);
+      /* Write the table only if the keyring has not been changed
+         during the scan.  */
+      if (kr->offtbl && !kr->read_only && !opt.dry_run
+          && !stat (kr->fname, &sb) && offtbl_same_state (kr->offtbl, &sb))
+        offtbl_write (tblname, kr->offtbl);
+    }
+  xfree (tblname);
+  return kr->offtbl;
+}
+
+
+/* Return the offset of the first keyblock in TBL with a (sub)key
+   with the keyid KID or -1 if there is none.  */
+static off_t
+offtbl_lookup (struct offtbl_s *tbl, const u32 *kid)
+{
+  size_t lo = 0, hi = tbl->nitems, mid;
+  struct offtbl_item *item;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      item = tbl->items + mid;
+      if (item->kid[0] < kid[0]
+          || (item->kid[0] == kid[0] && item->kid[1] < kid[1]))
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo < tbl->nitems
+      && tbl->items[lo].kid[0] == kid[0] && tbl->items[lo].kid[1] == kid[1])
+    return tbl->items[lo].offset;
+  return -1;
+}
+
+
 /*
  * Register a filename for plain keyring files.  ptr is set to a
  * pointer to be used to create a handles etc, or the already-issued
@@ -210,6 +606,7 @@ keyring_register_filename (const char *fname, int read_only, void **ptr)
     kr->lockhd = NULL;
     kr->is_locked = 0;
     kr->did_full_scan = 0;
+    kr->offtbl = NULL;
     /* keep a list of all issued pointers */
     kr->next = kr_resources;
     kr_resources = kr;
@@ -312,7 +709,7 @@ keyring_lock (KEYRING_HANDLE hd, int yes)
             if (!keyring_is_writable(kr))
                 continue;
             if (!kr->lockhd) {
-                kr->lockhd = dotlock_create (kr->fname, 0);
+                kr->lockhd = dotlock_create (kr->fname, DOTLOCK_RWLOCK);
                 if (!kr->lockhd) {
                     log_info ("can't allocate lock for '%s'\n", kr->fname );
                     rc = GPG_ERR_GENERAL;
@@ -1063,6 +1460,44 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
        */
     }
 
+  /* For a new search by long keyid we can use the offset table to
+   * seek to the first matching keyblock.  The table is validated
+   * against the current state of the keyring file and thus, unlike
+   * the key present hash, is not affected by other processes.  */
+  if (ndesc == 1 && desc[0].mode == KEYDB_SEARCH_MODE_LONG_KID
+      && !iobuf_tell (hd->current.iobuf))
+    {
+      KR_RESOURCE kr;
+      struct offtbl_s *tbl = NULL;
+
+      for (kr=kr_resources; kr; kr = kr->next)
+        if (hd->current.kr == kr)
+          {
+            tbl = offtbl_get (kr);
+            break;
+          }
+      if (tbl)
+        {
+          offset = offtbl_lookup (tbl, desc[0].u.kid);
+          if (offset == -1)
+            {
+              if (DBG_LOOKUP)
+                log_debug ("%s: offset table says not present\n", __func__);
+              hd->found.kr = NULL;
+              hd->current.eof = 1;
+              return -1;
+            }
+          if (DBG_LOOKUP)
+            log_debug ("%s: offset table says offset %lld\n",
+                       __func__, (long long)offset);
+          if (iobuf_seek (hd->current.iobuf, offset))
+            {
+              log_error ("can't seek '%s'\n", hd->current.kr->fname);
+              iobuf_seek (hd->current.iobuf, 0);
+            }
+        }
+    }
+
   if (need_words)
     {
       const char *name = NULL;
@@ -1099,6 +1534,8 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
     log_debug ("%s: %ssearching from start of resource.\n",
                __func__, scanned_from_start ? "" : "not ");
   init_parse_packet (&parsectx, hd->current.iobuf);
+  /* We use only the keyid and the fingerprint of the keys.  */
+  parsectx.only_fpr = 1;
   while (1)
     {
       byte afp[MAX_FINGERPRINT_LEN];
@@ -25,6 +25,9 @@
 #include "../common/iobuf.h"
 #include "../common/types.h"
 
+/* An object to fetch keys in the background.  */
+typedef struct keyserver_job_s *keyserver_job_t;
+
 int parse_keyserver_options(char *options);
 void free_keyserver_spec(struct keyserver_spec *keyserver);
 struct keyserver_spec *keyserver_match(struct keyserver_spec *spec);
@@ -36,6 +39,14 @@ int keyserver_export (ctrl_t ctrl, strlist_t users);
 int keyserver_import (ctrl_t ctrl, strlist_t users);
 int keyserver_import_fprint (ctrl_t ctrl, const byte *fprint,size_t fprint_len,
                              struct keyserver_spec *keyserver, int quick);
+int keyserver_import_fprints (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
+                              struct keyserver_spec *keyserver, int quick);
+gpg_error_t keyserver_import_fprints_start (ctrl_t ctrl,
+                                            KEYDB_SEARCH_DESC *desc,
+                                            int ndesc,
+                                            struct keyserver_spec *keyserver,
+                                            int quick, keyserver_job_t *r_job);
+int keyserver_import_fprints_finish (keyserver_job_t job);
 int keyserver_import_keyid (ctrl_t ctrl, u32 *keyid,
                             struct keyserver_spec *keyserver, int quick);
 gpg_error_t keyserver_refresh (ctrl_t ctrl, strlist_t users);
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <npth.h>
 
 #include "gpg.h"
 #include "../common/iobuf.h"
@@ -110,6 +111,13 @@ static gpg_error_t keyserver_get (ctrl_t ctrl,
                                   int quick,
                                   unsigned char **r_fpr, size_t *r_fprlen);
 static gpg_error_t keyserver_put (ctrl_t ctrl, strlist_t keyspecs);
+static gpg_error_t ks_fetch_chunk (ctrl_t ctrl,
+                                   KEYDB_SEARCH_DESC *desc, int ndesc,
+                                   int *r_ndesc_used,
+                                   struct keyserver_spec *override_keyserver,
+                                   int quick, estream_t *r_datastream,
+                                   char **r_source, int *r_only_fprs,
+                                   ks_get_job_t *r_job);
 
 
 /* Reasonable guess.  The commonly used test key simon.josefsson.org
@@ -1162,6 +1170,207 @@ keyserver_import_fprint (ctrl_t ctrl, const byte *fprint,size_t fprint_len,
   return keyserver_get (ctrl, &desc, 1, keyserver, quick, NULL, NULL);
 }
 
+/* Import the keys with the NDESC fingerprints at DESC.  The keys are
+ * requested from the dirmngr with as few requests as possible.  */
+int
+keyserver_import_fprints (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
+                          struct keyserver_spec *keyserver, int quick)
+{
+  int i;
+
+  for (i = 0; i < ndesc; i++)
+    if (desc[i].mode != KEYDB_SEARCH_MODE_FPR)
+      return -1;
+  if (!ndesc)
+    return 0;
+
+  return keyserver_get (ctrl, desc, ndesc, keyserver, quick, NULL, NULL);
+}
+
+
+/* The key data of one chunk fetched by a keyserver job.  */
+struct keyserver_job_chunk_s
+{
+  struct keyserver_job_chunk_s *next;
+  int descidx;            /* Index of the first description.  */
+  int ndesc;              /* Number of descriptions used.  */
+  int only_fprs;          /* Only fingerprints have been requested.  */
+  estream_t data;         /* The key data.  */
+  char *source;           /* The source as returned by the dirmngr.  */
+};
+
+
+/* An object to fetch keys in the background.  */
+struct keyserver_job_s
+{
+  npth_t thread;
+  ctrl_t ctrl;
+  KEYDB_SEARCH_DESC *desc;  /* A copy of the descriptions.  */
+  int ndesc;
+  struct keyserver_spec *keyserver;
+  int quick;
+  gpg_error_t err;          /* The error of the last request.  */
+  int any_good;             /* At least one request succeeded.  */
+  struct keyserver_job_chunk_s *chunks;
+};
+
+
+static void
+release_keyserver_job (keyserver_job_t job)
+{
+  struct keyserver_job_chunk_s *chunk;
+
+  if (!job)
+    return;
+  while ((chunk = job->chunks))
+    {
+      job->chunks = chunk->next;
+      es_fclose (chunk->data);
+      xfree (chunk->source);
+      xfree (chunk);
+    }
+  xfree (job->desc);
+  xfree (job);
+}
+
+
+/* The thread started by keyserver_import_fprints_start.  It only
+ * talks to the dirmngr; the import is done by the main thread.  */
+static void *
+keyserver_job_thread (void *arg)
+{
+  keyserver_job_t job = arg;
+  struct keyserver_job_chunk_s *chunk, **tail;
+  int descidx, ndesc_used;
+
+  tail = &job->chunks;
+  for (descidx = 0; descidx < job->ndesc; descidx += ndesc_used)
+    {
+      chunk = xtrycalloc (1, sizeof *chunk);
+      if (!chunk)
+        {
+          job->err = gpg_error_from_syserror ();
+          break;
+        }
+      job->err = ks_fetch_chunk (job->ctrl, job->desc + descidx,
+                                 job->ndesc - descidx, &ndesc_used,
+                                 job->keyserver, job->quick,
+                                 &chunk->data, &chunk->source,
+                                 &chunk->only_fprs, NULL);
+      if (job->err)
+        {
+          es_fclose (chunk->data);
+          xfree (chunk->source);
+          xfree (chunk);
+          break;
+        }
+      job->any_good = 1;
+      chunk->descidx = descidx;
+      chunk->ndesc = ndesc_used;
+      *tail = chunk;
+      tail = &chunk->next;
+    }
+  return NULL;
+}
+
+
+/* Start the retrieval of the keys with the NDESC fingerprints at DESC
+ * in the background.  The arguments are the same as for
+ * keyserver_import_fprints.  Until keyserver_import_fprints_finish
+ * has been called for the job stored at R_JOB, CTRL must not be used
+ * for other dirmngr requests.  If nothing needs to be fetched NULL
+ * is stored at R_JOB.  */
+gpg_error_t
+keyserver_import_fprints_start (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc,
+                                int ndesc, struct keyserver_spec *keyserver,
+                                int quick, keyserver_job_t *r_job)
+{
+  gpg_error_t err;
+  keyserver_job_t job;
+  npth_attr_t tattr;
+  int i, rc;
+
+  *r_job = NULL;
+  for (i = 0; i < ndesc; i++)
+    if (desc[i].mode != KEYDB_SEARCH_MODE_FPR)
+      return gpg_error (GPG_ERR_INV_ARG);
+  if (!ndesc)
+    return 0;
+
+  job = xtrycalloc (1, sizeof *job);
+  if (!job)
+    return gpg_error_from_syserror ();
+  job->desc = xtrymalloc (ndesc * sizeof *job->desc);
+  if (!job->desc)
+    {
+      err = gpg_error_from_syserror ();
+      release_keyserver_job (job);
+      return err;
+    }
+  memcpy (job->desc, desc, ndesc * sizeof *job->desc);
+  job->ndesc = ndesc;
+  job->ctrl = ctrl;
+  job->keyserver = keyserver;
+  job->quick = quick;
+
+  rc = npth_attr_init (&tattr);
+  if (!rc)
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+      rc = npth_create (&job->thread, &tattr, keyserver_job_thread, job);
+      npth_attr_destroy (&tattr);
+    }
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      log_error ("error spawning worker thread: %s\n", strerror (rc));
+      release_keyserver_job (job);
+      return err;
+    }
+
+  *r_job = job;
+  return 0;
+}
+
+
+/* Wait for JOB started by keyserver_import_fprints_start, import the
+ * retrieved keys, and release JOB.  Passing NULL is a no-op.  */
+int
+keyserver_import_fprints_finish (keyserver_job_t job)
+{
+  struct ks_retrieval_screener_arg_s screenerarg;
+  struct keyserver_job_chunk_s *chunk;
+  import_stats_t stats_handle;
+  gpg_error_t err;
+
+  if (!job)
+    return 0;
+
+  npth_join (job->thread, NULL);
+
+  stats_handle = import_new_stats_handle ();
+  for (chunk = job->chunks; chunk; chunk = chunk->next)
+    {
+      screenerarg.desc = job->desc + chunk->descidx;
+      screenerarg.ndesc = chunk->ndesc;
+      import_keys_es_stream (job->ctrl, chunk->data, stats_handle,
+                             NULL, NULL,
+                             (opt.keyserver_options.import_options
+                              | IMPORT_NO_SECKEY),
+                             keyserver_retrieval_screener, &screenerarg,
+                             chunk->only_fprs? KEYORG_KS : 0,
+                             chunk->source);
+    }
+  if (job->any_good)
+    import_print_stats (stats_handle);
+  import_release_stats_handle (stats_handle);
+
+  err = job->err;
+  release_keyserver_job (job);
+  return err;
+}
+
+
 int
 keyserver_import_keyid (ctrl_t ctrl,
                         u32 *keyid,struct keyserver_spec *keyserver, int quick)
@@ -1557,31 +1766,35 @@ keyserver_search (ctrl_t ctrl, strlist_t tokens)
   return err;
 }
 
-/* Helper for keyserver_get.  Here we only receive a chunk of the
-   description to be processed in one batch.  This is required due to
-   the limited number of patterns the dirmngr interface (KS_GET) can
-   grok and to limit the amount of temporary required memory.  */
+/* Helper for keyserver_get_chunk and the keyserver jobs.  Request
+   the keys for a chunk of the description at (DESC,NDESC) from the
+   dirmngr.  The number of descriptions considered is stored at
+   R_NDESC_USED.  On success the stream with the key data is stored
+   at R_DATASTREAM and the source at R_SOURCE; R_ONLY_FPRS is set if
+   only fingerprints have been requested.  If R_JOB is not NULL the
+   data is not buffered but streamed from the dirmngr; the job is
+   then stored at R_JOB and the caller must pass it along with the
+   stream to gpg_dirmngr_ks_get_finish.  This function does not touch
+   the key database.  */
 static gpg_error_t
-keyserver_get_chunk (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
-                     int *r_ndesc_used,
-                     import_stats_t stats_handle,
-                     struct keyserver_spec *override_keyserver,
-                     int quick,
-                     unsigned char **r_fpr, size_t *r_fprlen)
-
+ks_fetch_chunk (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
+                int *r_ndesc_used,
+                struct keyserver_spec *override_keyserver, int quick,
+                estream_t *r_datastream, char **r_source, int *r_only_fprs,
+                ks_get_job_t *r_job)
 {
   gpg_error_t err = 0;
   char **pattern;
   int idx, npat, npat_fpr;
-  estream_t datastream;
-  char *source = NULL;
   size_t linelen;  /* Estimated linelen for KS_GET.  */
   size_t n;
-  int only_fprs;
 
 #define MAX_KS_GET_LINELEN 950  /* Somewhat lower than the real limit.  */
 
   *r_ndesc_used = 0;
+  *r_datastream = NULL;
+  *r_source = NULL;
+  *r_only_fprs = 0;
 
   /* Create an array filled with a search pattern for each key.  The
      array is delimited by a NULL entry.  */
@@ -1698,16 +1911,48 @@ keyserver_get_chunk (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
      this is different from NPAT.  */
   *r_ndesc_used = idx;
 
-  only_fprs = (npat && npat == npat_fpr);
+  *r_only_fprs = (npat && npat == npat_fpr);
 
-  err = gpg_dirmngr_ks_get (ctrl, pattern, override_keyserver, quick,
-                            &datastream, &source);
+  if (r_job)
+    err = gpg_dirmngr_ks_get_start (ctrl, pattern, override_keyserver, quick,
+                                    r_datastream, r_source, r_job);
+  else
+    err = gpg_dirmngr_ks_get (ctrl, pattern, override_keyserver, quick,
+                              r_datastream, r_source);
   for (idx=0; idx < npat; idx++)
     xfree (pattern[idx]);
   xfree (pattern);
-  if (opt.verbose && source)
-    log_info ("data source: %s\n", source);
+  if (opt.verbose && *r_source)
+    log_info ("data source: %s\n", *r_source);
+
+  return err;
+}
 
+
+/* Helper for keyserver_get.  Here we only receive a chunk of the
+   description to be processed in one batch.  This is required due to
+   the limited number of patterns the dirmngr interface (KS_GET) can
+   grok and to limit the amount of temporary required memory.  */
+static gpg_error_t
+keyserver_get_chunk (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
+                     int *r_ndesc_used,
+                     import_stats_t stats_handle,
+                     struct keyserver_spec *override_keyserver,
+                     int quick,
+                     unsigned char **r_fpr, size_t *r_fprlen)
+
+{
+  gpg_error_t err, err2;
+  estream_t datastream;
+  char *source;
+  int only_fprs;
+  ks_get_job_t job = NULL;
+
+  /* The data is imported while it arrives from the dirmngr so that
+     large results need not be buffered in memory.  */
+  err = ks_fetch_chunk (ctrl, desc, ndesc, r_ndesc_used,
+                        override_keyserver, quick,
+                        &datastream, &source, &only_fprs, &job);
   if (!err)
     {
       struct ks_retrieval_screener_arg_s screenerarg;
@@ -1734,7 +1979,14 @@ keyserver_get_chunk (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
                              only_fprs? KEYORG_KS : 0,
                              source);
     }
-  es_fclose (datastream);
+  if (job)
+    {
+      err2 = gpg_dirmngr_ks_get_finish (job, datastream);
+      if (!err)
+        err = err2;
+    }
+  else
+    es_fclose (datastream);
   xfree (source);
 
   return err;
@@ -201,10 +201,16 @@ unsigned int pubkey_nbits( int algo, gcry_mpi_t *pkey );
 int mpi_print (estream_t stream, gcry_mpi_t a, int mode);
 unsigned int ecdsa_qbits_from_Q (unsigned int qbits);
 
+void run_parallel (int nthreads, int njobs,
+                   void (*fnc) (void *opaque, int idx), void *opaque);
+
 
 /*-- cpr.c --*/
 void set_status_fd ( int fd );
 int  is_status_enabled ( void );
+int  is_status_stdout (void);
+estream_t status_redirect (estream_t fp);
+void write_status_raw (const void *buffer, size_t len);
 void write_status ( int no );
 void write_status_error (const char *where, gpg_error_t err);
 void write_status_errcode (const char *where, int errcode);
@@ -264,6 +270,21 @@ int sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 int clearsign_file (ctrl_t ctrl,
                     const char *fname, strlist_t locusr, const char *outfile);
 int sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr);
+typedef struct sign_batch_s *sign_batch_t;
+gpg_error_t sign_batch_new (ctrl_t ctrl, strlist_t locusr,
+                            sign_batch_t *r_batch);
+void sign_batch_release (sign_batch_t batch);
+gpg_error_t sign_batch_data (ctrl_t ctrl, sign_batch_t batch,
+                             iobuf_t inp, iobuf_t out);
+
+/*-- sig-cache.c --*/
+#define SIG_CACHE_KEYLEN 20
+gpg_error_t sig_cache_make_key (PKT_public_key *pk, PKT_signature *sig,
+                                gcry_md_hd_t md, unsigned char *key);
+int  sig_cache_lookup (const unsigned char *key);
+void sig_cache_put (const unsigned char *key);
+void sig_cache_flush (void);
+void sig_cache_dump_stats (void);
 
 /*-- sig-check.c --*/
 void sig_check_dump_stats (void);
@@ -288,6 +309,21 @@ int check_key_signature2 (ctrl_t ctrl, kbnode_t root, kbnode_t node,
                           PKT_public_key *check_pk, PKT_public_key *ret_pk,
                           int *is_selfsig, u32 *r_expiredate, int *r_expired);
 
+/* An item for check_key_signatures_parallel.  */
+struct sig_check_item_s
+{
+  kbnode_t root;  /* The keyblock.  */
+  kbnode_t node;  /* The signature node in ROOT.  */
+};
+/* Verify the key signatures ITEMS using several threads and cache the
+   results in the signature packets.  */
+void check_key_signatures_parallel (ctrl_t ctrl,
+                                    struct sig_check_item_s *items,
+                                    int nitems, int nthreads);
+/* Ditto for the self-signatures of the public keyblocks KEYBLOCKS.  */
+void check_self_signatures_parallel (kbnode_t *keyblocks, int nkeyblocks,
+                                     int nthreads);
+
 /* Returns whether SIGNER generated the signature SIG over the packet
    PACKET, which is a key, subkey or uid, and comes from the key block
    KB.  If SIGNER is NULL, it is looked up based on the information in
@@ -461,7 +497,7 @@ void release_revocation_reason_info( struct revocation_reason_info *reason );
 void public_key_list (ctrl_t ctrl, strlist_t list,
                       int locate_mode, int no_local);
 void secret_key_list (ctrl_t ctrl, strlist_t list );
-void print_subpackets_colon(PKT_signature *sig);
+void print_subpackets_colon (estream_t fp, PKT_signature *sig);
 void reorder_keyblock (KBNODE keyblock);
 void list_keyblock_direct (ctrl_t ctrl, kbnode_t keyblock, int secret,
                            int has_secret, int fpr, int no_validity);
@@ -480,6 +516,10 @@ void print_key_info_log (ctrl_t ctrl, int loglevel, int indent,
 void print_card_key_info (estream_t fp, KBNODE keyblock);
 void print_key_line (ctrl_t ctrl, estream_t fp, PKT_public_key *pk, int secret);
 
+/*-- multifile.c --*/
+int process_multifile (ctrl_t ctrl, int nfiles, char **files,
+                       int (*fnc) (ctrl_t ctrl, const char *fname));
+
 /*-- verify.c --*/
 void print_file_status( int status, const char *name, int what );
 int verify_signatures (ctrl_t ctrl, int nfiles, char **files );
@@ -87,6 +87,7 @@ struct mainproc_context
   ulong symkeys;    /* Number of symmetrically encrypted session keys.  */
   struct pubkey_enc_list *pkenc_list; /* List of encryption packets. */
   int seen_pkt_encrypted_aead; /* PKT_ENCRYPTED_AEAD packet seen. */
+  keyserver_job_t ks_job;  /* Pending keyserver lookup of signer keys. */
   struct {
     unsigned int sig_seen:1;      /* Set to true if a signature packet
                                      has been seen. */
@@ -701,8 +702,7 @@ proc_encrypted (CTX c, PACKET *pkt)
           memset (pk, 0, sizeof *pk);
           pk->pubkey_algo = i->pubkey_algo;
           if (get_pubkey (c->ctrl, pk, i->keyid) != 0
-              || ! gnupg_pk_is_compliant (CO_DE_VS, pk->pubkey_algo, pk->pkey,
-                                          nbits_from_pk (pk), NULL))
+              || ! pk_is_compliant (CO_DE_VS, pk, 0, NULL))
             compliant = 0;
           release_public_key_parts (pk);
         }
@@ -2135,9 +2135,11 @@ check_sig_and_print (CTX c, kbnode_t node)
 
   /* If the above methods didn't work, our next try is to locate
    * the key via its fingerprint from a keyserver.  This requires
-   * that the signers fingerprint is encoded in the signature.  */
+   * that the signers fingerprint is encoded in the signature.  This
+   * is skipped if prefetch_signer_keys already asked for the key.  */
   if (gpg_err_code (rc) == GPG_ERR_NO_PUBKEY
       && (opt.keyserver_options.options&KEYSERVER_AUTO_KEY_RETRIEVE)
+      && !sig->flags.ks_tried
       && keyserver_any_configured (c->ctrl))
     {
       int res;
@@ -2383,8 +2385,7 @@ check_sig_and_print (CTX c, kbnode_t node)
 
       /* Print compliance warning for Good signatures.  */
       if (!rc && pk && !opt.quiet
-          && !gnupg_pk_is_compliant (opt.compliance, pk->pubkey_algo,
-                                     pk->pkey, nbits_from_pk (pk), NULL))
+          && !pk_is_compliant (opt.compliance, pk, 0, NULL))
         {
           log_info (_("WARNING: This key is not suitable for signing"
                       " in %s mode\n"),
@@ -2467,8 +2468,7 @@ check_sig_and_print (CTX c, kbnode_t node)
 
       /* Compute compliance with CO_DE_VS.  */
       if (pk && is_status_enabled ()
-          && gnupg_pk_is_compliant (CO_DE_VS, pk->pubkey_algo, pk->pkey,
-                                    nbits_from_pk (pk), NULL)
+          && pk_is_compliant (CO_DE_VS, pk, 0, NULL)
           && gnupg_digest_is_compliant (CO_DE_VS, sig->digest_algo))
         write_status_strings (STATUS_VERIFICATION_COMPLIANCE_MODE,
                               gnupg_status_compliance_flag (CO_DE_VS),
@@ -2505,6 +2505,148 @@ check_sig_and_print (CTX c, kbnode_t node)
 }
 
 
+/* Return true if check_sig_and_print would try the keyserver lookup
+ * by fingerprint as the first auto-key-retrieve method for SIG.  */
+static int
+ks_first_method_p (PKT_signature *sig)
+{
+  if (sig->flags.pref_ks
+      && (opt.keyserver_options.options & KEYSERVER_HONOR_KEYSERVER_URL))
+    return 0;
+  if (!opt.flags.disable_signer_uid && akl_has_wkd_method ()
+      && sig->signers_uid)
+    return 0;
+  if ((opt.keyserver_options.options & KEYSERVER_HONOR_PKA_RECORD))
+    return 0;
+  return 1;
+}
+
+
+/* Import the keys requested by prefetch_signer_keys.  This is a
+ * no-op if no request is pending.  */
+static void
+finish_signer_keys (CTX c)
+{
+  int res;
+
+  if (!c->ks_job)
+    return;
+
+  glo_ctrl.in_auto_key_retrieve++;
+  res = keyserver_import_fprints_finish (c->ks_job);
+  glo_ctrl.in_auto_key_retrieve--;
+  c->ks_job = NULL;
+  if (res && DBG_LOOKUP)
+    log_debug ("lookup via %s failed: %s\n", "KS", gpg_strerror (res));
+}
+
+
+/* Look up the keys of the signatures starting at NODE in one batch
+ * so that check_sig_and_print finds them in the cache.  With
+ * auto-key-retrieve the missing keys are then requested from the
+ * keyserver in one go instead of one request per signature.  This is
+ * only done for more than one signature unless HASHING is set.
+ * HASHING indicates that the signed data will be hashed next; the
+ * keyserver request is then run in the background and
+ * finish_signer_keys must be called after hashing.  */
+static void
+prefetch_signer_keys (CTX c, kbnode_t node, int hashing)
+{
+  KEYDB_SEARCH_DESC *desc;
+  char *found;
+  kbnode_t n1;
+  PKT_signature *sig;
+  const byte *fpr;
+  size_t fprlen;
+  int nsigs, idx, n;
+
+  for (nsigs = 0, n1 = node; n1; n1 = find_next_kbnode (n1, PKT_SIGNATURE))
+    if (n1->pkt->pkttype == PKT_SIGNATURE)
+      nsigs++;
+  if (!nsigs || (nsigs < 2 && !hashing))
+    return;
+
+  desc = xtrycalloc (nsigs, sizeof *desc);
+  found = xtrycalloc (nsigs, 1);
+  if (!desc || !found)
+    goto leave;
+
+  for (idx = 0, n1 = node; n1; n1 = find_next_kbnode (n1, PKT_SIGNATURE))
+    {
+      if (n1->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      sig = n1->pkt->pkt.signature;
+      fpr = issuer_fpr_raw (sig, &fprlen);
+      if (fpr)
+        {
+          desc[idx].mode = KEYDB_SEARCH_MODE_FPR;
+          memcpy (desc[idx].u.fpr, fpr, fprlen);
+          desc[idx].fprlen = fprlen;
+        }
+      else
+        {
+          desc[idx].mode = KEYDB_SEARCH_MODE_LONG_KID;
+          desc[idx].u.kid[0] = sig->keyid[0];
+          desc[idx].u.kid[1] = sig->keyid[1];
+        }
+      idx++;
+    }
+  prefetch_pubkeys (c->ctrl, desc, nsigs, found);
+
+  if (!(opt.keyserver_options.options & KEYSERVER_AUTO_KEY_RETRIEVE)
+      || !keyserver_any_configured (c->ctrl))
+    goto leave;
+
+  /* Collect the fingerprints of the missing keys for which the
+   * keyserver would be asked anyway.  */
+  for (idx = n = 0, n1 = node; n1; n1 = find_next_kbnode (n1, PKT_SIGNATURE))
+    {
+      if (n1->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      sig = n1->pkt->pkt.signature;
+      if (!found[idx] && desc[idx].mode == KEYDB_SEARCH_MODE_FPR
+          && ks_first_method_p (sig))
+        {
+          desc[n++] = desc[idx];
+          sig->flags.ks_tried = 1;
+        }
+      idx++;
+    }
+  if (n > 1 || (n && hashing))
+    {
+      gpg_error_t err;
+
+      if (DBG_LOOKUP)
+        log_debug ("trying auto-key-retrieve method %s for %d keys\n",
+                   "KS", n);
+      /* The dirmngr is asked by a separate thread so that the network
+       * latency overlaps with the hashing of the data.  The import is
+       * done by finish_signer_keys.  */
+      err = keyserver_import_fprints_start (c->ctrl, desc, n, opt.keyserver,
+                                            1, &c->ks_job);
+      if (!err)
+        {
+          if (!hashing)
+            finish_signer_keys (c);
+          goto leave;
+        }
+      if (DBG_LOOKUP)
+        log_debug ("lookup via %s failed: %s\n", "KS", gpg_strerror (err));
+    }
+  if (n)
+    {
+      /* The keys are left to check_sig_and_print.  */
+      for (n1 = node; n1; n1 = find_next_kbnode (n1, PKT_SIGNATURE))
+        if (n1->pkt->pkttype == PKT_SIGNATURE)
+          n1->pkt->pkt.signature->flags.ks_tried = 0;
+    }
+
+ leave:
+  xfree (desc);
+  xfree (found);
+}
+
+
 /*
  * Process the tree which starts at node
  */
@@ -2562,6 +2704,8 @@ proc_tree (CTX c, kbnode_t node)
           if (n1 && n1->pkt->pkt.onepass_sig->sig_class == 0x01)
             use_textmode = 1;
 
+          prefetch_signer_keys (c, node, 1);
+
           /* Ask for file and hash it. */
           if (c->sigs_only)
             {
@@ -2583,6 +2727,7 @@ proc_tree (CTX c, kbnode_t node)
 	    }
 
         hash_err:
+          finish_signer_keys (c);
           if (rc)
             {
               log_error ("can't hash datafile: %s\n", gpg_strerror (rc));
@@ -2594,6 +2739,8 @@ proc_tree (CTX c, kbnode_t node)
           log_error (_("not a detached signature\n"));
           return;
         }
+      else
+        prefetch_signer_keys (c, node, 0);
 
       for (n1 = node; (n1 = find_next_kbnode (n1, PKT_SIGNATURE));)
         check_sig_and_print (c, n1);
@@ -2614,6 +2761,7 @@ proc_tree (CTX c, kbnode_t node)
           return;
         }
 
+      prefetch_signer_keys (c, node, 0);
       for (n1 = node; (n1 = find_next_kbnode (n1, PKT_SIGNATURE));)
         check_sig_and_print (c, n1);
 
@@ -2622,6 +2770,7 @@ proc_tree (CTX c, kbnode_t node)
     {
       PKT_signature *sig = node->pkt->pkt.signature;
       int multiple_ok = 1;
+      int prefetched = 0;
 
       n1 = find_next_kbnode (node, PKT_SIGNATURE);
       if (n1)
@@ -2706,6 +2855,12 @@ proc_tree (CTX c, kbnode_t node)
                 gcry_md_debug (c->mfx.md2, "verify2");
             }
 
+          if (multiple_ok)
+            {
+              prefetch_signer_keys (c, node, 1);
+              prefetched = 1;
+            }
+
           if (c->sigs_only)
             {
               if (c->signed_data.used && c->signed_data.data_fd != -1)
@@ -2726,6 +2881,7 @@ proc_tree (CTX c, kbnode_t node)
 	    }
 
         detached_hash_err:
+          finish_signer_keys (c);
           if (rc)
             {
               log_error ("can't hash datafile: %s\n", gpg_strerror (rc));
@@ -2742,6 +2898,8 @@ proc_tree (CTX c, kbnode_t node)
 
       if (multiple_ok)
         {
+          if (!prefetched)
+            prefetch_signer_keys (c, node, 0);
           for (n1 = node; n1; (n1 = find_next_kbnode(n1, PKT_SIGNATURE)))
 	    check_sig_and_print (c, n1);
         }
@@ -28,6 +28,87 @@
 #include "../common/iobuf.h"
 #include "../common/util.h"
 #include "filter.h"
+#include "main.h"
+#include "options.h"
+#include "timing.h"
+
+
+/* The data is collected in batches of this size and each batch is
+ * then hashed by one thread per digest algorithm.  */
+#define MD_PARALLEL_BATCHSIZE (1024*1024)
+
+/* The maximum number of different digest algorithms we expect.  */
+#define MD_PARALLEL_MAXALGOS 8
+
+struct md_parallel_s
+{
+  int nalgos;
+  gcry_md_hd_t md[MD_PARALLEL_MAXALGOS];  /* One context per algorithm. */
+  byte *buffer;     /* The current batch.  */
+  size_t nbuffer;   /* The number of bytes in BUFFER.  */
+};
+
+
+static void
+release_parallel (struct md_parallel_s *p)
+{
+  int i;
+
+  if (!p)
+    return;
+  for (i=0; i < p->nalgos; i++)
+    gcry_md_close (p->md[i]);
+  xfree (p->buffer);
+  xfree (p);
+}
+
+
+/* The job for run_parallel: hash the batch with algorithm IDX.  */
+static void
+hash_batch_job (void *opaque, int idx)
+{
+  struct md_parallel_s *p = opaque;
+
+  gcry_md_write (p->md[idx], p->buffer, p->nbuffer);
+}
+
+
+static void
+flush_batch (struct md_parallel_s *p)
+{
+  int i;
+
+  if (!p->nbuffer)
+    return;
+
+  /* A short final batch is not worth the threads.  */
+  if (p->nbuffer < MD_PARALLEL_BATCHSIZE)
+    for (i=0; i < p->nalgos; i++)
+      gcry_md_write (p->md[i], p->buffer, p->nbuffer);
+  else
+    run_parallel (p->nalgos, p->nalgos, hash_batch_job, p);
+  p->nbuffer = 0;
+}
+
+
+static void
+write_parallel (struct md_parallel_s *p, const byte *buf, size_t len)
+{
+  size_t n;
+
+  while (len)
+    {
+      n = MD_PARALLEL_BATCHSIZE - p->nbuffer;
+      if (n > len)
+        n = len;
+      memcpy (p->buffer + p->nbuffer, buf, n);
+      p->nbuffer += n;
+      buf += n;
+      len -= n;
+      if (p->nbuffer == MD_PARALLEL_BATCHSIZE)
+        flush_batch (p);
+    }
+}
 
 
 
@@ -41,6 +122,7 @@ md_filter( void *opaque, int control,
     size_t size = *ret_len;
     md_filter_context_t *mfx = opaque;
     int i, rc=0;
+    timing_span_t span;
 
     if( control == IOBUFCTRL_UNDERFLOW ) {
 	if( mfx->maxbuf_size && size > mfx->maxbuf_size )
@@ -48,9 +130,14 @@ md_filter( void *opaque, int control,
 	i = iobuf_read( a, buf, size );
 	if( i == -1 ) i = 0;
 	if( i ) {
-	    gcry_md_write(mfx->md, buf, i );
+	    timing_begin (&span, "hash");
+	    if( mfx->parallel )
+		write_parallel (mfx->parallel, buf, i);
+	    else
+		gcry_md_write(mfx->md, buf, i );
 	    if( mfx->md2 )
 		gcry_md_write(mfx->md2, buf, i );
+	    timing_add (&span);
 	}
 	else
 	    rc = -1; /* eof */
@@ -67,7 +154,68 @@ free_md_filter_context( md_filter_context_t *mfx )
 {
     gcry_md_close(mfx->md);
     gcry_md_close(mfx->md2);
+    release_parallel (mfx->parallel);
     mfx->md = NULL;
     mfx->md2 = NULL;
+    mfx->parallel = NULL;
     mfx->maxbuf_size = 0;
 }
+
+
+/* Switch MFX to compute each of the digest algorithms enabled in
+ * MFX->MD in its own thread.  Signing with several keys which use
+ * different algorithms then takes only the time of the slowest
+ * digest.  This must be called before any data has been hashed; the
+ * digests need to be retrieved with md_filter_get_md.  Nothing is
+ * changed if less than two algorithms are enabled.  */
+void
+md_filter_use_parallel (md_filter_context_t *mfx)
+{
+  struct md_parallel_s *p;
+  int algo;
+
+  if (mfx->parallel || mfx->md2 || DBG_HASHING)
+    return;
+
+  p = xtrycalloc (1, sizeof *p);
+  if (!p)
+    return;
+  for (algo = 1; algo < 256; algo++)
+    if (gcry_md_is_enabled (mfx->md, algo))
+      {
+        if (p->nalgos == MD_PARALLEL_MAXALGOS
+            || gcry_md_open (&p->md[p->nalgos], algo, 0))
+          {
+            release_parallel (p);
+            return;
+          }
+        p->nalgos++;
+      }
+  if (p->nalgos < 2 || !(p->buffer = xtrymalloc (MD_PARALLEL_BATCHSIZE)))
+    {
+      release_parallel (p);
+      return;
+    }
+
+  mfx->parallel = p;
+}
+
+
+/* Return a context with the digest of algorithm ALGO over all data
+ * seen by the filter MFX.  The caller must not close it.  */
+gcry_md_hd_t
+md_filter_get_md (md_filter_context_t *mfx, int algo)
+{
+  struct md_parallel_s *p = mfx->parallel;
+  int i;
+
+  if (!p)
+    return mfx->md;
+
+  flush_batch (p);
+  for (i=0; i < p->nalgos; i++)
+    if (gcry_md_is_enabled (p->md[i], algo))
+      return p->md[i];
+  BUG ();
+  return NULL;
+}
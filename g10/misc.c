@@ -25,6 +25,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <npth.h>
 #if defined(__linux__) && defined(__alpha__) && __GLIBC__ < 2
 #include <asm/sysinfo.h>
 #include <asm/unistd.h>
@@ -1287,6 +1288,12 @@ compress_algo_to_string(int algo)
       s="BZIP2";
       break;
 #endif
+
+#ifdef HAVE_ZSTD
+    case COMPRESS_ALGO_ZSTD:
+      s="ZSTD";
+      break;
+#endif
     }
 
   return s;
@@ -1309,6 +1316,10 @@ string_to_compress_algo(const char *string)
 #ifdef HAVE_BZIP2
   else if(ascii_strcasecmp(string,"bzip2")==0)
     return 3;
+#endif
+#ifdef HAVE_ZSTD
+  else if(ascii_strcasecmp(string,"zstd")==0)
+    return COMPRESS_ALGO_ZSTD;
 #endif
   else if(ascii_strcasecmp(string,"z0")==0)
     return 0;
@@ -1319,6 +1330,10 @@ string_to_compress_algo(const char *string)
 #ifdef HAVE_BZIP2
   else if(ascii_strcasecmp(string,"z3")==0)
     return 3;
+#endif
+#ifdef HAVE_ZSTD
+  else if(ascii_strcasecmp(string,"z100")==0)
+    return COMPRESS_ALGO_ZSTD;
 #endif
   else
     return -1;
@@ -1336,6 +1351,9 @@ check_compress_algo(int algo)
 #endif
 #ifdef HAVE_BZIP2
     case 3: return 0;
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ALGO_ZSTD: return 0;
 #endif
     default: return GPG_ERR_COMPR_ALGO;
     }
@@ -1889,3 +1907,83 @@ additional_weak_digest (const char* digestname)
   weak->next = opt.weak_digests;
   opt.weak_digests = weak;
 }
+
+
+/* The state of the worker threads started by run_parallel.  */
+struct run_parallel_s
+{
+  void (*fnc) (void *opaque, int idx);
+  void *opaque;
+  int njobs;
+  int next;   /* Index of the next job to run.  */
+};
+
+
+static void *
+run_parallel_worker (void *arg)
+{
+  struct run_parallel_s *parm = arg;
+  int idx;
+
+  /* We hold the npth lock while picking a job, thus no extra locking
+   * is required.  */
+  while (parm->next < parm->njobs)
+    {
+      idx = parm->next++;
+      npth_unprotect ();
+      parm->fnc (parm->opaque, idx);
+      npth_protect ();
+    }
+
+  return NULL;
+}
+
+
+/* Call FNC (OPAQUE, IDX) for all IDX from 0 to NJOBS-1 and return
+ * after all calls have been done.  Up to NTHREADS threads, including
+ * the calling one, are used.  FNC is called without holding the npth
+ * lock and thus may only do computations on the data passed to it;
+ * taking care of the results is up to the caller.  */
+void
+run_parallel (int nthreads, int njobs,
+              void (*fnc) (void *opaque, int idx), void *opaque)
+{
+  struct run_parallel_s parm;
+  npth_t *threads = NULL;
+  npth_attr_t tattr;
+  int nstarted = 0;
+  int i, rc;
+
+  parm.fnc = fnc;
+  parm.opaque = opaque;
+  parm.njobs = njobs;
+  parm.next = 0;
+
+  if (nthreads > njobs)
+    nthreads = njobs;
+  if (nthreads > 1)
+    threads = xtrycalloc (nthreads - 1, sizeof *threads);
+  if (threads && !npth_attr_init (&tattr))
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+      for (; nstarted < nthreads - 1; nstarted++)
+        {
+          rc = npth_create (&threads[nstarted], &tattr,
+                            run_parallel_worker, &parm);
+          if (rc)
+            {
+              log_error ("error spawning worker thread: %s\n",
+                         strerror (rc));
+              break;
+            }
+        }
+      npth_attr_destroy (&tattr);
+    }
+
+  /* The calling thread does its share or all the work if no thread
+   * could be started.  */
+  run_parallel_worker (&parm);
+  for (i=0; i < nstarted; i++)
+    npth_join (threads[i], NULL);
+  xfree (threads);
+}
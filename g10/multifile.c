@@ -0,0 +1,520 @@
+/* multifile.c - Process the files given with --multifile
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The commands --verify-files and --decrypt-files process each file
+ * on its own.  Processing a message touches a lot of global state,
+ * thus to work on several files at once (--jobs) we fork worker
+ * processes.  They are forked before the first file is processed and
+ * thus inherit the options but no open keyring, trustdb or agent
+ * connection.  The main process hands out the file names over a pipe
+ * to the workers.  Each worker collects the status lines of a file in
+ * memory and sends them back; they are then written en bloc to the
+ * status stream, so that the lines from FILE_START to FILE_DONE are
+ * never mixed up with those of other files.  Diagnostics are written
+ * by the workers directly to the log.
+ *
+ * All data on the pipes is framed by a 4 byte length in network byte
+ * order.  A request is the name of the file; the response is the 4
+ * byte return code of the processing function followed by the status
+ * lines.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef HAVE_W32_SYSTEM
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/wait.h>
+#endif
+#include <npth.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/host2net.h"
+#include "options.h"
+#include "main.h"
+#include "../common/i18n.h"
+
+
+/* The largest frame we accept from the other side.  */
+#define MAX_FRAME_LENGTH (64*1024*1024)
+
+/* The list of files and the collected results.  */
+struct multifile_s
+{
+  int use_stdin;      /* Read the file names from stdin.  */
+  int nfiles;         /* The number of files left in FILES.  */
+  char **files;
+  unsigned int lno;   /* The line number when reading from stdin.  */
+  int eof;            /* Set if there are no more files.  */
+  int first_rc;       /* The first error returned by FNC.  */
+  npth_mutex_t status_lock;
+};
+
+#ifndef HAVE_W32_SYSTEM
+/* The parent's view of a worker process.  */
+struct worker_s
+{
+  struct multifile_s *parm;
+  pid_t pid;
+  int cmdfd;          /* The write end of the command pipe.  */
+  int replyfd;        /* The read end of the reply pipe.  */
+  int started;        /* The thread serving the worker is running.  */
+  npth_t thread;
+};
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+static void
+set_rc (struct multifile_s *parm, int rc)
+{
+  if (!parm->first_rc)
+    parm->first_rc = rc;
+}
+
+
+/* Return the name of the next file to process or NULL if there is
+ * none.  The caller needs to xfree the result.  */
+static char *
+next_file (struct multifile_s *parm)
+{
+  char line[2048];
+
+  if (parm->eof)
+    return NULL;
+
+  if (!parm->use_stdin)
+    {
+      if (parm->nfiles)
+        {
+          parm->nfiles--;
+          return xstrdup (*parm->files++);
+        }
+    }
+  else if (fgets (line, DIM(line), stdin))
+    {
+      parm->lno++;
+      /* This code does not work on MSDOS but who cares there are
+       * also no script languages available.  We don't strip any
+       * spaces, so that we can process nearly all filenames.  */
+      if (*line && line[strlen (line)-1] == '\n')
+        {
+          line[strlen (line)-1] = 0;
+          return xstrdup (line);
+        }
+      log_error (_("input line %u too long or missing LF\n"), parm->lno);
+      set_rc (parm, GPG_ERR_GENERAL);
+    }
+
+  parm->eof = 1;
+  return NULL;
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+static gpg_error_t
+write_exact (int fd, const void *buffer, size_t length)
+{
+  const char *p = buffer;
+  ssize_t n;
+
+  while (length)
+    {
+      n = npth_write (fd, p, length);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return gpg_error_from_syserror ();
+      p += n;
+      length -= n;
+    }
+  return 0;
+}
+
+
+/* Read exactly LENGTH bytes from FD into BUFFER.  Returns
+ * GPG_ERR_EOF if the other side closed the pipe.  */
+static gpg_error_t
+read_exact (int fd, void *buffer, size_t length)
+{
+  char *p = buffer;
+  ssize_t n;
+
+  while (length)
+    {
+      n = npth_read (fd, p, length);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return gpg_error_from_syserror ();
+      if (!n)
+        return gpg_error (GPG_ERR_EOF);
+      p += n;
+      length -= n;
+    }
+  return 0;
+}
+
+
+static gpg_error_t
+write_frame (int fd, const void *buffer, size_t length)
+{
+  gpg_error_t err;
+  unsigned char lenbuf[4];
+
+  ulongtobuf (lenbuf, length);
+  err = write_exact (fd, lenbuf, 4);
+  if (!err && length)
+    err = write_exact (fd, buffer, length);
+  return err;
+}
+
+
+/* Read a frame from FD and store it as a malloced and Nul terminated
+ * string at R_BUFFER and its length at R_LENGTH.  */
+static gpg_error_t
+read_frame (int fd, char **r_buffer, size_t *r_length)
+{
+  gpg_error_t err;
+  unsigned char lenbuf[4];
+  size_t length;
+  char *buffer;
+
+  *r_buffer = NULL;
+  err = read_exact (fd, lenbuf, 4);
+  if (err)
+    return err;
+  length = buf32_to_size_t (lenbuf);
+  if (length > MAX_FRAME_LENGTH)
+    return gpg_error (GPG_ERR_TOO_LARGE);
+  buffer = xtrymalloc (length + 1);
+  if (!buffer)
+    return gpg_error_from_syserror ();
+  err = read_exact (fd, buffer, length);
+  if (err)
+    {
+      xfree (buffer);
+      return err;
+    }
+  buffer[length] = 0;
+  *r_buffer = buffer;
+  *r_length = length;
+  return 0;
+}
+
+
+/* The main loop of a worker process.  It reads file names from CMDFD,
+ * calls FNC for them and sends the results to REPLYFD.  Terminates
+ * the process when CMDFD is closed.  */
+static void
+run_worker (ctrl_t ctrl, int cmdfd, int replyfd,
+            int (*fnc) (ctrl_t ctrl, const char *fname))
+{
+  gpg_error_t err;
+  char *fname;
+  size_t n;
+  estream_t memfp, oldfp = NULL;
+  void *status;
+  size_t statuslen;
+  unsigned char rcbuf[4];
+  int rc;
+
+  while (!(err = read_frame (cmdfd, &fname, &n)))
+    {
+      memfp = NULL;
+      if (is_status_enabled ())
+        {
+          memfp = es_fopenmem (0, "w+b");
+          if (!memfp)
+            log_fatal ("error allocating memory stream: %s\n",
+                       strerror (errno));
+          oldfp = status_redirect (memfp);
+        }
+
+      rc = fnc (ctrl, fname);
+      xfree (fname);
+
+      status = NULL;
+      statuslen = 0;
+      if (memfp)
+        {
+          status_redirect (oldfp);
+          if (es_fclose_snatch (memfp, &status, &statuslen))
+            log_fatal ("error snatching memory stream: %s\n",
+                       strerror (errno));
+        }
+
+      ulongtobuf (rcbuf, (u32)rc);
+      err = write_exact (replyfd, rcbuf, 4);
+      if (!err)
+        err = write_frame (replyfd, status, statuslen);
+      es_free (status);
+      if (err)
+        break;
+    }
+  if (gpg_err_code (err) != GPG_ERR_EOF)
+    log_error ("worker %d: error talking to the main process: %s\n",
+               (int)getpid (), gpg_strerror (err));
+  close (cmdfd);
+  close (replyfd);
+  g10_exit (0);
+}
+
+
+/* The thread in the main process feeding the worker ARG.  */
+static void *
+serve_worker (void *arg)
+{
+  struct worker_s *wk = arg;
+  struct multifile_s *parm = wk->parm;
+  gpg_error_t err;
+  unsigned char rcbuf[4];
+  char *fname, *status;
+  size_t statuslen;
+
+  /* The npth lock serializes the access to PARM; only the writing of
+   * the status lines may be interrupted by a system call.  */
+  while ((fname = next_file (parm)))
+    {
+      err = write_frame (wk->cmdfd, fname, strlen (fname));
+      if (!err)
+        err = read_exact (wk->replyfd, rcbuf, 4);
+      if (!err)
+        err = read_frame (wk->replyfd, &status, &statuslen);
+      if (err)
+        {
+          log_error ("worker process %d failed on '%s': %s\n",
+                     (int)wk->pid, fname, gpg_strerror (err));
+          set_rc (parm, GPG_ERR_GENERAL);
+          xfree (fname);
+          break;
+        }
+      xfree (fname);
+
+      npth_mutex_lock (&parm->status_lock);
+      write_status_raw (status, statuslen);
+      npth_mutex_unlock (&parm->status_lock);
+      xfree (status);
+      set_rc (parm, (int)buf32_to_u32 (rcbuf));
+    }
+
+  close (wk->cmdfd);
+  wk->cmdfd = -1;
+  return NULL;
+}
+
+
+/* Fork up to opt.multifile_jobs worker processes.  Returns the number
+ * of workers and stores an array describing them at R_WORKERS.  */
+static int
+start_workers (ctrl_t ctrl, struct multifile_s *parm,
+               int (*fnc) (ctrl_t ctrl, const char *fname),
+               struct worker_s **r_workers)
+{
+  struct worker_s *workers;
+  int cmdpipe[2], replypipe[2];
+  int njobs = opt.multifile_jobs;
+  int i, n;
+  pid_t pid;
+
+  *r_workers = NULL;
+  if (!parm->use_stdin && njobs > parm->nfiles)
+    njobs = parm->nfiles;
+  if (njobs < 2)
+    return 0;
+  workers = xtrycalloc (njobs, sizeof *workers);
+  if (!workers)
+    return 0;
+
+  /* Make sure that pending output is not written again by the
+   * workers.  */
+  fflush (NULL);
+  es_fflush (NULL);
+
+  for (n=0; n < njobs; n++)
+    {
+      if (pipe (cmdpipe))
+        {
+          log_error ("error creating a pipe: %s\n", strerror (errno));
+          break;
+        }
+      if (pipe (replypipe))
+        {
+          log_error ("error creating a pipe: %s\n", strerror (errno));
+          close (cmdpipe[0]);
+          close (cmdpipe[1]);
+          break;
+        }
+
+      pid = fork ();
+      if (pid == (pid_t)(-1))
+        {
+          log_error ("error forking process: %s\n", strerror (errno));
+          close (cmdpipe[0]);
+          close (cmdpipe[1]);
+          close (replypipe[0]);
+          close (replypipe[1]);
+          break;
+        }
+      if (!pid)
+        {
+          /* Child.  Close the pipes to the other workers; otherwise
+           * they would not see the end of their command pipe.  */
+          for (i=0; i < n; i++)
+            {
+              close (workers[i].cmdfd);
+              close (workers[i].replyfd);
+            }
+          close (cmdpipe[1]);
+          close (replypipe[0]);
+          run_worker (ctrl, cmdpipe[0], replypipe[1], fnc);
+          /*NOTREACHED*/
+        }
+
+      close (cmdpipe[0]);
+      close (replypipe[1]);
+      workers[n].parm = parm;
+      workers[n].pid = pid;
+      workers[n].cmdfd = cmdpipe[1];
+      workers[n].replyfd = replypipe[0];
+    }
+
+  if (!n)
+    {
+      xfree (workers);
+      return 0;
+    }
+  if (opt.verbose)
+    log_info ("using %d worker processes\n", n);
+  *r_workers = workers;
+  return n;
+}
+
+
+/* Wait for the worker WK and take its exit code into account.  */
+static void
+wait_worker (struct worker_s *wk)
+{
+  int status;
+
+  while (waitpid (wk->pid, &status, 0) == (pid_t)(-1))
+    if (errno != EINTR)
+      {
+        log_error ("waiting for process %d failed: %s\n",
+                   (int)wk->pid, strerror (errno));
+        return;
+      }
+
+  if (!WIFEXITED (status))
+    log_error ("worker process %d terminated abnormally\n", (int)wk->pid);
+  else if (WEXITSTATUS (status) == 1)
+    g10_errors_seen = 1;
+  else if (WEXITSTATUS (status))
+    log_inc_errorcount ();
+}
+
+
+/* Run the workers with one thread in the main process for each of
+ * them.  Returns when all workers are gone.  */
+static void
+run_workers (struct multifile_s *parm, struct worker_s *workers,
+             int nworkers)
+{
+  npth_attr_t tattr;
+  int i, rc;
+
+  rc = npth_mutex_init (&parm->status_lock, NULL);
+  if (rc)
+    log_fatal ("error initializing mutex: %s\n", strerror (rc));
+
+  if (!npth_attr_init (&tattr))
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+      for (i=0; i < nworkers; i++)
+        {
+          rc = npth_create (&workers[i].thread, &tattr,
+                            serve_worker, &workers[i]);
+          if (rc)
+            log_error ("error spawning worker thread: %s\n", strerror (rc));
+          else
+            workers[i].started = 1;
+        }
+      npth_attr_destroy (&tattr);
+    }
+
+  for (i=0; i < nworkers; i++)
+    {
+      if (workers[i].started)
+        npth_join (workers[i].thread, NULL);
+      else
+        close (workers[i].cmdfd);
+      close (workers[i].replyfd);
+      wait_worker (&workers[i]);
+    }
+
+  npth_mutex_destroy (&parm->status_lock);
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Call FNC for each of the NFILES file names in FILES or, if NFILES
+ * is zero, for each file name read from stdin.  With --jobs the files
+ * are distributed over several worker processes.  Returns the first
+ * error returned by FNC.  */
+int
+process_multifile (ctrl_t ctrl, int nfiles, char **files,
+                   int (*fnc) (ctrl_t ctrl, const char *fname))
+{
+  struct multifile_s parm;
+  char *fname;
+
+  memset (&parm, 0, sizeof parm);
+  parm.use_stdin = !nfiles;
+  parm.nfiles = nfiles;
+  parm.files = files;
+
+#ifndef HAVE_W32_SYSTEM
+  if (opt.multifile_jobs > 1 && cpr_enabled ())
+    log_info ("%s is ignored with %s\n", "--jobs", "--command-fd");
+  else if (opt.multifile_jobs > 1)
+    {
+      struct worker_s *workers;
+      int nworkers;
+
+      nworkers = start_workers (ctrl, &parm, fnc, &workers);
+      if (nworkers)
+        {
+          run_workers (&parm, workers, nworkers);
+          xfree (workers);
+        }
+    }
+#endif /*!HAVE_W32_SYSTEM*/
+
+  /* Process the remaining files ourself; these are all files if no
+   * worker has been started.  */
+  while ((fname = next_file (&parm)))
+    {
+      set_rc (&parm, fnc (ctrl, fname));
+      xfree (fname);
+    }
+
+  return parm.first_rc;
+}
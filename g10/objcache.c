@@ -22,9 +22,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "gpg.h"
 #include "../common/util.h"
+#include "../common/sysutils.h"
+#include "../common/host2net.h"
 #include "packet.h"
 #include "keydb.h"
 #include "options.h"
@@ -57,6 +67,29 @@ static unsigned int uid_table_added;  /* # of items added.   */
 static unsigned int uid_table_dropped;/* # of items dropped.  */
 
 
+/* The state of the snapshot file; see below.  */
+static struct
+{
+  unsigned int init:1;      /* The generation has been taken.  */
+  unsigned int disabled:1;  /* Do not use a snapshot.  */
+  unsigned int loaded:1;    /* IMAGE holds a valid snapshot.  */
+  unsigned int mapped:1;    /* IMAGE is mapped and not malloced.  */
+
+  /* The generation of the key database at the first use.  */
+  unsigned char generation[KEYDB_DIGEST_LEN];
+
+  unsigned char *image;
+  size_t imagelen;
+  const unsigned char *records;
+  unsigned int nrecords;
+  const unsigned char *strings;
+  size_t stringslen;
+
+  unsigned int hits;
+  unsigned int misses;
+} snapshot;
+
+
 /* An object to store properties of a key.  Note that this can be used
  * for a primary or a subkey.  The key is linked to a user if that
  * exists.  */
@@ -143,6 +176,10 @@ objcache_dump_stats (void)
             count, uid_table_added, uid_table_dropped,
             empty, minlen > 0? minlen : 0, maxlen,
             uid_table_size, uid_table_max);
+  if (snapshot.init && !snapshot.disabled)
+    log_info ("objcache: snapshot=%u%s hits=%u misses=%u\n",
+              snapshot.nrecords, snapshot.mapped? " (mapped)":"",
+              snapshot.hits, snapshot.misses);
 }
 
 
@@ -527,6 +564,456 @@ key_table_put (PKT_public_key *pk, uid_item_t ui)
 }
 
 
+/* Return the key item for the fingerprint (FPR,FPRLEN) or NULL if
+ * it is not in the KEY_TABLE.  */
+static key_item_t
+key_table_lookup_fpr (const byte *fpr, size_t fprlen)
+{
+  u32 keyid[2];
+  key_item_t ki;
+
+  if (!key_table)
+    return NULL;
+
+  keyid_from_fingerprint (NULL, fpr, fprlen, keyid);
+  for (ki = key_table[key_table_hasher (keyid)]; ki; ki = ki->next)
+    if (ki->fprlen == fprlen && !memcmp (ki->fpr, fpr, fprlen))
+      return ki;
+  return NULL;
+}
+
+
+/* The snapshot file.
+ *
+ * With the option --uid-cache-snapshot the associations of keys and
+ * primary user ids are stored at exit in the file "uidcache.bin" in
+ * the home directory so that a new process can print user ids without
+ * accessing the key database.  The snapshot is tied to the generation
+ * of the key database as returned by keydb_get_generation; a snapshot
+ * for another generation is ignored and replaced.  A process which
+ * notices that the key database changed while it was running does
+ * not write a snapshot.  The records are sorted by keyid and
+ * fingerprint so that the mapped file can be used directly.  All
+ * integers are stored in network byte order.
+ *
+ *   - b4   Magic 'GPGu'
+ *   - byte Version number (1)
+ *   - b3   RFU
+ *   - b32  Generation of the key database
+ *   - u32  [N] Number of records
+ *   - u32  [M] Length of the string area
+ *   - N records, each with
+ *     - u32  Keyid (high)
+ *     - u32  Keyid (low)
+ *     - u32  Offset of the user id into the string area
+ *     - u32  Length of the user id
+ *     - byte Length of the fingerprint
+ *     - b3   RFU
+ *     - b32  Fingerprint
+ *   - M bytes with the user ids; each followed by a Nul.
+ */
+#define SNAPSHOT_FNAME       "uidcache.bin"
+#define SNAPSHOT_MAGIC       "GPGu"
+#define SNAPSHOT_VERSION     1
+#define SNAPSHOT_HEADER_LEN  48
+#define SNAPSHOT_RECORD_LEN  52
+#define SNAPSHOT_MAX_RECORDS (1 << 20)
+
+
+/* Return the name of the snapshot file.  Caller must free.  */
+static char *
+snapshot_filename (void)
+{
+  return make_filename (gnupg_homedir (), SNAPSHOT_FNAME, NULL);
+}
+
+
+/* Read or map the snapshot file.  */
+static void
+snapshot_load (void)
+{
+  char *fname;
+  int fd;
+  struct stat sb;
+  unsigned char *image = NULL;
+  size_t imagelen = 0;
+  int mapped = 0;
+  unsigned int nrecords;
+  size_t stringslen;
+
+  fname = snapshot_filename ();
+  fd = open (fname, O_RDONLY);
+  if (fd == -1)
+    goto leave;
+  if (fstat (fd, &sb) || sb.st_size < SNAPSHOT_HEADER_LEN
+      || (unsigned long long)sb.st_size
+         > (unsigned long long)SNAPSHOT_HEADER_LEN
+            + (unsigned long long)SNAPSHOT_MAX_RECORDS * SNAPSHOT_RECORD_LEN
+            + 0xffffffffull)
+    goto leave;
+  imagelen = sb.st_size;
+
+#ifdef HAVE_MMAP
+  image = mmap (NULL, imagelen, PROT_READ, MAP_SHARED, fd, 0);
+  if (image == MAP_FAILED)
+    image = NULL;
+  else
+    mapped = 1;
+#endif /*HAVE_MMAP*/
+  if (!image)
+    {
+      image = xtrymalloc (imagelen);
+      if (!image || read (fd, image, imagelen) != (ssize_t)imagelen)
+        {
+          xfree (image);
+          image = NULL;
+          goto leave;
+        }
+    }
+
+  if (memcmp (image, SNAPSHOT_MAGIC, 4) || image[4] != SNAPSHOT_VERSION)
+    goto leave;
+  if (memcmp (image + 8, snapshot.generation, KEYDB_DIGEST_LEN))
+    {
+      if (DBG_CACHE)
+        log_debug ("objcache: snapshot '%s' is stale\n", fname);
+      goto leave;
+    }
+  nrecords = buf32_to_uint (image + 40);
+  stringslen = buf32_to_size_t (image + 44);
+  if (nrecords > SNAPSHOT_MAX_RECORDS
+      || (SNAPSHOT_HEADER_LEN + (size_t)nrecords * SNAPSHOT_RECORD_LEN
+          + stringslen) != imagelen)
+    goto leave;
+
+  snapshot.image = image;
+  snapshot.imagelen = imagelen;
+  snapshot.mapped = mapped;
+  snapshot.records = image + SNAPSHOT_HEADER_LEN;
+  snapshot.nrecords = nrecords;
+  snapshot.strings = snapshot.records + nrecords * SNAPSHOT_RECORD_LEN;
+  snapshot.stringslen = stringslen;
+  snapshot.loaded = 1;
+  image = NULL;
+  if (DBG_CACHE)
+    log_debug ("objcache: loaded %u records from '%s'%s\n",
+               nrecords, fname, mapped? " (mapped)":"");
+
+ leave:
+  if (image)
+    {
+#ifdef HAVE_MMAP
+      if (mapped)
+        munmap (image, imagelen);
+      else
+#endif
+        xfree (image);
+    }
+  if (fd != -1)
+    close (fd);
+  xfree (fname);
+}
+
+
+/* Take the generation of the key database and load the snapshot.
+ * This is done only once and only if enabled.  */
+static void
+snapshot_init (void)
+{
+  if (snapshot.init)
+    return;
+  snapshot.init = 1;
+
+  if (!opt.uid_cache_snapshot
+      || keydb_get_generation (snapshot.generation))
+    {
+      snapshot.disabled = 1;
+      return;
+    }
+  snapshot_load ();
+}
+
+
+/* Compare the keyid and the fingerprint of the snapshot record REC
+ * with KEYID and (FPR,FPRLEN).  If FPR is NULL only the keyid is
+ * compared.  */
+static int
+snapshot_cmp (const unsigned char *rec, const u32 *keyid,
+              const byte *fpr, size_t fprlen)
+{
+  u32 a;
+
+  a = buf32_to_u32 (rec);
+  if (a != keyid[0])
+    return a < keyid[0]? -1 : 1;
+  a = buf32_to_u32 (rec + 4);
+  if (a != keyid[1])
+    return a < keyid[1]? -1 : 1;
+  if (!fpr)
+    return 0;
+  if (rec[16] != fprlen)
+    return rec[16] < fprlen? -1 : 1;
+  return memcmp (rec + 20, fpr, fprlen);
+}
+
+
+/* Return the index of the first snapshot record not less than KEYID
+ * and (FPR,FPRLEN).  */
+static unsigned int
+snapshot_lower_bound (const u32 *keyid, const byte *fpr, size_t fprlen)
+{
+  unsigned int lo, hi, mid;
+
+  lo = 0;
+  hi = snapshot.nrecords;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (snapshot_cmp (snapshot.records + mid * SNAPSHOT_RECORD_LEN,
+                        keyid, fpr, fprlen) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+
+/* Return a malloced copy of the user id of the snapshot record REC
+ * and store its length at R_LENGTH.  Returns NULL on error or if the
+ * record is corrupt.  */
+static char *
+snapshot_get_uid (const unsigned char *rec, size_t *r_length)
+{
+  size_t off, len;
+  char *p;
+
+  off = buf32_to_size_t (rec + 8);
+  len = buf32_to_size_t (rec + 12);
+  if (off >= snapshot.stringslen || len >= snapshot.stringslen - off
+      || snapshot.strings[off + len])
+    return NULL;
+  p = xtrymalloc (len + 1);
+  if (p)
+    {
+      memcpy (p, snapshot.strings + off, len + 1);
+      *r_length = len;
+    }
+  return p;
+}
+
+
+/* Return the user id of the key with KEYID or, if FPR is not NULL,
+ * with the fingerprint (FPR,FPRLEN) from the snapshot.  Like
+ * key_table_get NULL is returned for a duplicated keyid.  */
+static char *
+snapshot_lookup (const u32 *keyid, const byte *fpr, size_t fprlen,
+                 size_t *r_length)
+{
+  unsigned int idx;
+  const unsigned char *rec;
+  char *p = NULL;
+
+  snapshot_init ();
+  if (!snapshot.loaded)
+    return NULL;
+
+  idx = snapshot_lower_bound (keyid, fpr, fprlen);
+  if (idx < snapshot.nrecords)
+    {
+      rec = snapshot.records + idx * SNAPSHOT_RECORD_LEN;
+      if (!snapshot_cmp (rec, keyid, fpr, fprlen)
+          && (fpr || idx + 1 == snapshot.nrecords
+              || snapshot_cmp (rec + SNAPSHOT_RECORD_LEN, keyid, NULL, 0)))
+        p = snapshot_get_uid (rec, r_length);
+    }
+
+  if (p)
+    snapshot.hits++;
+  else
+    snapshot.misses++;
+  return p;
+}
+
+
+/* An item used to write a snapshot.  */
+struct snapshot_item_s
+{
+  u32 keyid[2];
+  byte fprlen;
+  const byte *fpr;
+  const char *name;
+  size_t namelen;
+};
+
+
+/* Helper for the qsort in objcache_write_snapshot.  */
+static int
+compare_snapshot_items (const void *arg_a, const void *arg_b)
+{
+  const struct snapshot_item_s *a = arg_a;
+  const struct snapshot_item_s *b = arg_b;
+
+  if (a->keyid[0] != b->keyid[0])
+    return a->keyid[0] < b->keyid[0]? -1 : 1;
+  if (a->keyid[1] != b->keyid[1])
+    return a->keyid[1] < b->keyid[1]? -1 : 1;
+  if (a->fprlen != b->fprlen)
+    return a->fprlen < b->fprlen? -1 : 1;
+  return memcmp (a->fpr, b->fpr, a->fprlen);
+}
+
+
+/* Write the snapshot file with the keys of the cache and those of the
+ * loaded snapshot.  This is a no-op if the snapshot is not enabled,
+ * if nothing has been added to the cache, or if the key database has
+ * been changed since the first use of the cache.  */
+void
+objcache_write_snapshot (void)
+{
+  gpg_error_t err = 0;
+  unsigned char gen[KEYDB_DIGEST_LEN];
+  struct snapshot_item_s *items = NULL;
+  unsigned int nitems, maxitems, idx;
+  const unsigned char *rec;
+  size_t stringslen, off, len;
+  unsigned char hdr[SNAPSHOT_HEADER_LEN];
+  unsigned char buf[SNAPSHOT_RECORD_LEN];
+  key_item_t ki;
+  char *fname = NULL;
+  char *tmpfname = NULL;
+  FILE *fp = NULL;
+
+  if (!snapshot.init || snapshot.disabled || !key_table_added)
+    return;
+  if (keydb_get_generation (gen)
+      || memcmp (gen, snapshot.generation, KEYDB_DIGEST_LEN))
+    {
+      if (DBG_CACHE)
+        log_debug ("objcache: keydb changed - not writing a snapshot\n");
+      return;
+    }
+
+  maxitems = snapshot.nrecords + key_table_added;
+  if (maxitems > SNAPSHOT_MAX_RECORDS)
+    maxitems = SNAPSHOT_MAX_RECORDS;
+  items = xtrycalloc (maxitems, sizeof *items);
+  if (!items)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* First the keys of the cache and then the keys of the old
+   * snapshot which are not in the cache.  */
+  nitems = 0;
+  stringslen = 0;
+  for (idx = 0; idx < key_table_size && nitems < maxitems; idx++)
+    for (ki = key_table[idx]; ki && nitems < maxitems; ki = ki->next)
+      {
+        if (!ki->ui)
+          continue;
+        items[nitems].keyid[0] = ki->keyid[0];
+        items[nitems].keyid[1] = ki->keyid[1];
+        items[nitems].fprlen = ki->fprlen;
+        items[nitems].fpr = (const byte *)ki->fpr;
+        items[nitems].name = ki->ui->name;
+        items[nitems].namelen = ki->ui->namelen;
+        stringslen += ki->ui->namelen + 1;
+        nitems++;
+      }
+  for (idx = 0; idx < snapshot.nrecords && nitems < maxitems; idx++)
+    {
+      rec = snapshot.records + idx * SNAPSHOT_RECORD_LEN;
+      if (rec[16] > MAX_FINGERPRINT_LEN
+          || key_table_lookup_fpr (rec + 20, rec[16]))
+        continue;
+      off = buf32_to_size_t (rec + 8);
+      len = buf32_to_size_t (rec + 12);
+      if (off >= snapshot.stringslen || len >= snapshot.stringslen - off)
+        continue;
+      items[nitems].keyid[0] = buf32_to_u32 (rec);
+      items[nitems].keyid[1] = buf32_to_u32 (rec + 4);
+      items[nitems].fprlen = rec[16];
+      items[nitems].fpr = rec + 20;
+      items[nitems].name = (const char *)snapshot.strings + off;
+      items[nitems].namelen = len;
+      stringslen += len + 1;
+      nitems++;
+    }
+  if (stringslen > 0xffffffff)
+    {
+      err = gpg_error (GPG_ERR_TOO_LARGE);
+      goto leave;
+    }
+  qsort (items, nitems, sizeof *items, compare_snapshot_items);
+
+  fname = snapshot_filename ();
+  tmpfname = xtryasprintf ("%s" EXTSEP_S "%u" EXTSEP_S "tmp",
+                           fname, (unsigned int)getpid ());
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  memset (hdr, 0, sizeof hdr);
+  memcpy (hdr, SNAPSHOT_MAGIC, 4);
+  hdr[4] = SNAPSHOT_VERSION;
+  memcpy (hdr + 8, gen, KEYDB_DIGEST_LEN);
+  ulongtobuf (hdr + 40, nitems);
+  ulongtobuf (hdr + 44, (u32)stringslen);
+  if (fwrite (hdr, sizeof hdr, 1, fp) != 1)
+    err = gpg_error_from_syserror ();
+
+  for (idx = 0, off = 0; !err && idx < nitems; idx++)
+    {
+      memset (buf, 0, sizeof buf);
+      ulongtobuf (buf,      items[idx].keyid[0]);
+      ulongtobuf (buf + 4,  items[idx].keyid[1]);
+      ulongtobuf (buf + 8,  (u32)off);
+      ulongtobuf (buf + 12, (u32)items[idx].namelen);
+      buf[16] = items[idx].fprlen;
+      memcpy (buf + 20, items[idx].fpr, items[idx].fprlen);
+      if (fwrite (buf, sizeof buf, 1, fp) != 1)
+        err = gpg_error_from_syserror ();
+      off += items[idx].namelen + 1;
+    }
+  for (idx = 0; !err && idx < nitems; idx++)
+    if (fwrite (items[idx].name, items[idx].namelen + 1, 1, fp) != 1)
+      err = gpg_error_from_syserror ();
+
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  fp = NULL;
+  if (!err)
+    err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    gnupg_remove (tmpfname);
+  else if (DBG_CACHE)
+    log_debug ("objcache: wrote %u records to '%s'\n", nitems, fname);
+
+ leave:
+  if (fp)
+    {
+      fclose (fp);
+      gnupg_remove (tmpfname);
+    }
+  if (err && opt.verbose)
+    log_info ("error writing user id snapshot '%s': %s\n",
+              fname? fname : SNAPSHOT_FNAME, gpg_strerror (err));
+  xfree (tmpfname);
+  xfree (fname);
+  xfree (items);
+}
+
+
 
 /* Return the user ID from the given keyblock.  We use the primary uid
  * flag which should have already been set.  The returned value is
@@ -558,6 +1045,10 @@ cache_put_keyblock (kbnode_t keyblock)
   uid_item_t ui = NULL;
   kbnode_t k;
 
+  /* Take the generation of the key database before the first key is
+   * cached.  */
+  snapshot_init ();
+
  restart:
   for (k = keyblock; k; k = k->next)
     {
@@ -616,13 +1107,20 @@ cache_get_uid_bykid (u32 *keyid, unsigned int *r_length)
 {
   key_item_t ki;
   char *p;
+  size_t n;
 
   if (r_length)
     *r_length = 0;
 
   ki = key_table_get (NULL, keyid);
   if (!ki)
-    return NULL; /* Not found or duplicate keyid.  */
+    {
+      /* Not found or duplicate keyid - try the snapshot.  */
+      p = snapshot_lookup (keyid, NULL, 0, &n);
+      if (p && r_length)
+        *r_length = n;
+      return p;
+    }
 
   if (!ki->ui)
     p = NULL;  /* No user id known for key.  */
@@ -652,24 +1150,25 @@ char *
 cache_get_uid_byfpr (const byte *fpr, size_t fprlen, size_t *r_length)
 {
   char *p;
-  unsigned int hash;
   u32 keyid[2];
   key_item_t ki;
+  size_t n;
 
   if (r_length)
     *r_length = 0;
 
-  if (!key_table)
-    return NULL;
-
-  keyid_from_fingerprint (NULL, fpr, fprlen, keyid);
-  hash = key_table_hasher (keyid);
-  for (ki = key_table[hash]; ki; ki = ki->next)
-    if (ki->fprlen == fprlen && !memcmp (ki->fpr, fpr, fprlen))
-      break; /* Found */
-
+  ki = key_table_lookup_fpr (fpr, fprlen);
   if (!ki)
-    return NULL; /* Not found.  */
+    {
+      /* Not found - try the snapshot.  */
+      if (fprlen > MAX_FINGERPRINT_LEN)
+        return NULL;
+      keyid_from_fingerprint (NULL, fpr, fprlen, keyid);
+      p = snapshot_lookup (keyid, fpr, fprlen, &n);
+      if (p && r_length)
+        *r_length = n;
+      return p;
+    }
 
   if (!ki->ui)
     p = NULL;  /* No user id known for key.  */
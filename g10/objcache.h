@@ -22,6 +22,7 @@
 #define GNUPG_G10_OBJCACHE_H
 
 void objcache_dump_stats (void);
+void objcache_write_snapshot (void);
 void cache_put_keyblock (kbnode_t keyblock);
 char *cache_get_uid_bykid (u32 *keyid, unsigned int *r_length);
 char *cache_get_uid_byfpr (const byte *fpr, size_t fprlen, size_t *r_length);
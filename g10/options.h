@@ -57,6 +57,20 @@ struct
   /* The AEAD chunk size expressed as a power of 2.  */
   int chunk_size;
 
+  /* The number of threads used for AEAD encryption and decryption.  */
+  int aead_jobs;
+
+  /* The number of threads used for ZIP and ZLIB compression.  */
+  int compress_jobs;
+
+  /* The number of threads used to encrypt the session key for the
+   * recipients.  */
+  int recipient_jobs;
+
+  /* The number of worker processes used for --verify-files and
+   * --decrypt-files.  */
+  int multifile_jobs;
+
   int dry_run;
   int autostart;
   int list_only;
@@ -117,6 +131,10 @@ struct
   int marginals_needed;
   int completes_needed;
   int max_cert_depth;
+  int trustdb_jobs;   /* Number of threads for --check-trustdb.  */
+  int import_jobs;    /* Number of threads for --import.  */
+  int list_jobs;      /* Number of threads for --list-keys.  */
+  int export_jobs;    /* Number of threads for --export.  */
   const char *agent_program;
   const char *keyboxd_program;
   const char *dirmngr_program;
@@ -209,6 +227,7 @@ struct
   int try_all_secrets;
   int no_expensive_trust_checks;
   int no_sig_cache;
+  int uid_cache_snapshot;
   int no_auto_check_trustdb;
   int preserve_permissions;
   int no_homedir_creation;
@@ -367,6 +386,7 @@ EXTERN_UNLESS_MAIN_MODULE int memory_stat_debug_mode;
 #define IMPORT_DRY_RUN                   (1<<12)
 #define IMPORT_DROP_UIDS                 (1<<13)
 #define IMPORT_SELF_SIGS_ONLY            (1<<14)
+#define IMPORT_BULK                      (1<<15)
 
 #define EXPORT_LOCAL_SIGS                (1<<0)
 #define EXPORT_ATTRIBUTES                (1<<1)
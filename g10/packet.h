@@ -171,9 +171,22 @@ typedef struct {
    co-called signature subpackets (RFC 4880, Section 5.2.3).  These
    areas are described by this data structure.  Use enum_sig_subpkt to
    parse this area.  */
+#define SUBPKT_INDEX_SIZE 40  /* Subpacket types covered by the index.  */
 typedef struct {
     size_t size;  /* allocated */
     size_t len;   /* used (serialized) */
+    /* An index to the first subpacket of each type below
+       SUBPKT_INDEX_SIZE, built on demand by enum_sig_subpkt.  OFF is
+       the offset of the subpacket's length header plus one or 0 if
+       there is no such subpacket; SEQ is its sequence number.
+       INDEXED is 1 if the index is valid, -1 if the area can't be
+       indexed, and 0 if the index has not yet been built.  Code
+       changing DATA must reset INDEXED to 0.  */
+    int indexed;
+    struct {
+      unsigned short off;
+      unsigned short seq;
+    } index[SUBPKT_INDEX_SIZE];
     byte data[1]; /* the serialized subpackes (serialized) */
 } subpktarea_t;
 
@@ -226,6 +239,8 @@ typedef struct
     unsigned pref_ks:1;     /* At least one preferred keyserver is present */
     unsigned expired:1;
     unsigned pka_tried:1;   /* Set if we tried to retrieve the PKA record. */
+    unsigned ks_tried:1;    /* Set if we tried to retrieve the key from
+                               a keyserver.  */
   } flags;
   /* The key that allegedly generated this signature.  (Directly
      serialized in v3 sigs; for v4 sigs, this must be explicitly added
@@ -319,6 +334,7 @@ typedef struct
     unsigned int primary:2; /* 2 if set via the primary flag, 1 if calculated */
     unsigned int revoked:1;
     unsigned int expired:1;
+    unsigned int mbox_checked:1; /* MBOX has been derived from NAME.  */
   } flags;
 
   char *mbox;   /* NULL or the result of mailbox_from_userid.  */
@@ -428,7 +444,13 @@ typedef struct
     unsigned int backsig:2;       /* 0=none, 1=bad, 2=good.  */
     unsigned int serialno_valid:1;/* SERIALNO below is valid.  */
     unsigned int exact:1;         /* Found via exact (!) search.  */
+    unsigned int grip_valid:1;    /* GRIP below is valid.  */
+    unsigned int de_vs_valid:1;   /* The next flag is valid.  */
+    unsigned int de_vs:1;         /* The key is de-vs compliant.  */
   } flags;
+  /* The keygrip of the key.  Only valid if FLAGS.GRIP_VALID is set;
+     use keygrip_from_pk to access it.  */
+  byte    grip[KEYGRIP_LEN];
   PKT_user_id *user_id;   /* If != NULL: found by that uid. */
   struct revocation_key *revkey;
   int     numrevkeys;
@@ -668,6 +690,8 @@ struct parse_packet_ctx_s
   struct packet_struct last_pkt; /* The last parsed packet.  */
   int free_last_pkt; /* Indicates that LAST_PKT must be freed.  */
   int skip_meta;     /* Skip ring trust packets.  */
+  int only_fpr;      /* search_packet: Public key packets need only
+                      * the keyid and fingerprint.  */
   unsigned int n_parsed_packets;	/* Number of parsed packets.  */
 };
 typedef struct parse_packet_ctx_s *parse_packet_ctx_t;
@@ -678,6 +702,7 @@ typedef struct parse_packet_ctx_s *parse_packet_ctx_t;
     (a)->last_pkt.pkt.generic= NULL;\
     (a)->free_last_pkt = 0;         \
     (a)->skip_meta = 0;             \
+    (a)->only_fpr = 0;              \
     (a)->n_parsed_packets = 0;      \
   } while (0)
 
@@ -882,6 +907,7 @@ struct notation *sig_to_notation(PKT_signature *sig);
 void free_notation(struct notation *notation);
 
 /*-- free-packet.c --*/
+PKT_signature *new_signature (void);
 void free_symkey_enc( PKT_symkey_enc *enc );
 void free_pubkey_enc( PKT_pubkey_enc *enc );
 void free_seckey_enc( PKT_signature *enc );
@@ -894,10 +920,13 @@ void free_packet (PACKET *pkt, parse_packet_ctx_t parsectx);
 prefitem_t *copy_prefs (const prefitem_t *prefs);
 PKT_public_key *copy_public_key( PKT_public_key *d, PKT_public_key *s );
 PKT_signature *copy_signature( PKT_signature *d, PKT_signature *s );
+PKT_user_id *copy_user_id (PKT_user_id *s);
 PKT_user_id *scopy_user_id (PKT_user_id *sd );
 int cmp_public_keys( PKT_public_key *a, PKT_public_key *b );
 int cmp_signatures( PKT_signature *a, PKT_signature *b );
 int cmp_user_ids( PKT_user_id *a, PKT_user_id *b );
+const char *user_id_mbox (PKT_user_id *uid);
+int user_id_has_mbox (PKT_user_id *uid, const char *mbox);
 
 
 /*-- sig-check.c --*/
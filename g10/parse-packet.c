@@ -67,6 +67,8 @@ static int parse_onepass_sig (IOBUF inp, int pkttype, unsigned long pktlen,
 			      PKT_onepass_sig * ops);
 static int parse_key (IOBUF inp, int pkttype, unsigned long pktlen,
 		      byte * hdr, int hdrlen, PACKET * packet);
+static int parse_key_fpr_only (IOBUF inp, int pkttype, unsigned long pktlen,
+                               byte *hdr, int hdrlen, PACKET *packet);
 static int parse_user_id (IOBUF inp, int pkttype, unsigned long pktlen,
 			  PACKET * packet);
 static int parse_attribute (IOBUF inp, int pkttype, unsigned long pktlen,
@@ -809,7 +811,11 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
     case PKT_SECRET_KEY:
     case PKT_SECRET_SUBKEY:
       pkt->pkt.public_key = xmalloc_clear (sizeof *pkt->pkt.public_key);
-      rc = parse_key (inp, pkttype, pktlen, hdr, hdrlen, pkt);
+      if (ctx->only_fpr && onlykeypkts && !partial && !list_mode
+          && (pkttype == PKT_PUBLIC_KEY || pkttype == PKT_PUBLIC_SUBKEY))
+        rc = parse_key_fpr_only (inp, pkttype, pktlen, hdr, hdrlen, pkt);
+      else
+        rc = parse_key (inp, pkttype, pktlen, hdr, hdrlen, pkt);
       break;
     case PKT_SYMKEY_ENC:
       rc = parse_symkeyenc (inp, pkttype, pktlen, pkt);
@@ -818,7 +824,7 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
       rc = parse_pubkeyenc (inp, pkttype, pktlen, pkt);
       break;
     case PKT_SIGNATURE:
-      pkt->pkt.signature = xmalloc_clear (sizeof *pkt->pkt.signature);
+      pkt->pkt.signature = new_signature ();
       rc = parse_signature (inp, pkttype, pktlen, pkt->pkt.signature);
       break;
     case PKT_ONEPASS_SIG:
@@ -1766,6 +1772,60 @@ can_handle_critical (const byte * buffer, size_t n, int type)
 }
 
 
+/* Build the index of the subpacket area AREA.  If the area is
+ * malformed no index is built so that enum_sig_subpkt will scan the
+ * area and print the diagnostics.  */
+static void
+build_subpkt_index (subpktarea_t *area)
+{
+  const byte *buffer = area->data;
+  size_t buflen = area->len;
+  size_t n;
+  int type;
+  unsigned int seq = 0;
+  const byte *hdr;
+
+  memset (area->index, 0, sizeof area->index);
+  area->indexed = -1;
+  if (area->len >= 0xffff)
+    return;
+  while (buflen)
+    {
+      hdr = buffer;
+      n = *buffer++;
+      buflen--;
+      if (n == 255)
+	{
+	  if (buflen < 4)
+	    return;
+	  n = buf32_to_size_t (buffer);
+	  buffer += 4;
+	  buflen -= 4;
+	}
+      else if (n >= 192)
+	{
+	  if (buflen < 2)
+	    return;
+	  n = ((n - 192) << 8) + *buffer + 192;
+	  buffer++;
+	  buflen--;
+	}
+      if (buflen < n || !buflen || !n)
+	return;
+      seq++;
+      type = *buffer & 0x7f;
+      if (type < SUBPKT_INDEX_SIZE && !area->index[type].off)
+        {
+          area->index[type].off = (hdr - area->data) + 1;
+          area->index[type].seq = seq;
+        }
+      buffer += n;
+      buflen -= n;
+    }
+  area->indexed = 1;
+}
+
+
 const byte *
 enum_sig_subpkt (PKT_signature *sig, int want_hashed, sigsubpkttype_t reqtype,
 		 size_t *ret_n, int *start, int *critical)
@@ -1776,7 +1836,7 @@ enum_sig_subpkt (PKT_signature *sig, int want_hashed, sigsubpkttype_t reqtype,
   int critical_dummy;
   int offset;
   size_t n;
-  const subpktarea_t *pktbuf = want_hashed? sig->hashed : sig->unhashed;
+  subpktarea_t *pktbuf = want_hashed? sig->hashed : sig->unhashed;
   int seq = 0;
   int reqseq = start ? *start : 0;
 
@@ -1792,6 +1852,27 @@ enum_sig_subpkt (PKT_signature *sig, int want_hashed, sigsubpkttype_t reqtype,
     }
   buffer = pktbuf->data;
   buflen = pktbuf->len;
+
+  /* For the first subpacket of a type use the index to go directly
+   * to it.  The loop below then parses only that subpacket.  */
+  if (reqtype > 0 && reqtype < SUBPKT_INDEX_SIZE && !reqseq)
+    {
+      if (!pktbuf->indexed)
+        build_subpkt_index (pktbuf);
+      if (pktbuf->indexed == 1)
+        {
+          if (!pktbuf->index[reqtype].off)
+            {
+              if (start)
+                *start = -1;
+              return NULL;  /* Not found.  */
+            }
+          buffer += pktbuf->index[reqtype].off - 1;
+          buflen -= pktbuf->index[reqtype].off - 1;
+          seq = pktbuf->index[reqtype].seq - 1;
+        }
+    }
+
   while (buflen)
     {
       n = *buffer++;
@@ -2042,6 +2123,7 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
 	  sig->hashed = xmalloc (sizeof (*sig->hashed) + n - 1);
 	  sig->hashed->size = n;
 	  sig->hashed->len = n;
+	  sig->hashed->indexed = 0;
 	  if (iobuf_read (inp, sig->hashed->data, n) != n)
 	    {
 	      log_error ("premature eof while reading "
@@ -2072,6 +2154,7 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
 	  sig->unhashed = xmalloc (sizeof (*sig->unhashed) + n - 1);
 	  sig->unhashed->size = n;
 	  sig->unhashed->len = n;
+	  sig->unhashed->indexed = 0;
 	  if (iobuf_read (inp, sig->unhashed->data, n) != n)
 	    {
 	      log_error ("premature eof while reading "
@@ -2330,6 +2413,161 @@ parse_onepass_sig (IOBUF inp, int pkttype, unsigned long pktlen,
 }
 
 
+/* Check whether BUF of length LEN holds a v4 or v5 public key packet
+ * body whose MPIs are all encoded in the canonical way.  In this case
+ * the body is exactly what hash_public_key would write and we can
+ * compute the fingerprint and keyid directly from BUF.  If so, the
+ * parameters, the fingerprint and the keyid are stored at PK and true
+ * is returned; PK->PKEY is not set.  Returns false if the body needs
+ * to be parsed by parse_key.  */
+static int
+fpr_from_key_image (const byte *buf, size_t len, int pkttype, int hdrlen,
+                    PKT_public_key *pk)
+{
+  gcry_md_hd_t md;
+  const byte *dp;
+  size_t off, n, dlen;
+  unsigned int nbits, topbits;
+  int i, version, algorithm, npkey;
+
+  version = buf[0];
+  if (version == 4)
+    off = 6;
+  else if (version == 5)
+    off = 10;
+  else
+    return 0;
+  if (len < off || (version == 4 && len > 0xffff))
+    return 0;
+  algorithm = buf[5];
+  if (version == 5 && buf32_to_size_t (buf+6) != len - 10)
+    return 0;
+
+  npkey = pubkey_get_npkey (algorithm);
+  if (!npkey)
+    return 0;
+  for (i = 0; i < npkey; i++)
+    {
+      if (off >= len)
+        return 0;
+      if (   (algorithm == PUBKEY_ALGO_ECDSA && (i == 0))
+          || (algorithm == PUBKEY_ALGO_EDDSA && (i == 0))
+          || (algorithm == PUBKEY_ALGO_ECDH  && (i == 0 || i == 2)))
+        {
+          /* The OID or the KDF params; see read_size_body.  */
+          n = buf[off];
+          if (n < 2 || n > 254 || off + 1 + n > len)
+            return 0;
+          off += 1 + n;
+        }
+      else
+        {
+          /* An MPI is canonical if it has no leading zero bits.  */
+          if (off + 2 > len)
+            return 0;
+          nbits = buf16_to_uint (buf+off);
+          if (nbits > MAX_EXTERN_MPI_BITS)
+            return 0;
+          off += 2;
+          n = (nbits + 7) / 8;
+          if (off + n > len)
+            return 0;
+          if (nbits)
+            {
+              topbits = (nbits - 1) % 8 + 1;
+              if (!(buf[off] >> (topbits - 1)) || (buf[off] >> topbits))
+                return 0;
+            }
+          off += n;
+        }
+    }
+  if (off != len)
+    return 0;  /* Trailing garbage.  */
+
+  if (gcry_md_open (&md, version == 5 ? GCRY_MD_SHA256 : GCRY_MD_SHA1, 0))
+    return 0;
+  if (version == 5)
+    {
+      gcry_md_putc (md, 0x9a);
+      gcry_md_putc (md, len >> 24);
+      gcry_md_putc (md, len >> 16);
+    }
+  else
+    gcry_md_putc (md, 0x99);
+  gcry_md_putc (md, len >> 8);
+  gcry_md_putc (md, len);
+  gcry_md_write (md, buf, len);
+  gcry_md_final (md);
+  dp = gcry_md_read (md, 0);
+  dlen = gcry_md_get_algo_dlen (gcry_md_get_algo (md));
+  log_assert (dlen <= MAX_FINGERPRINT_LEN);
+  memcpy (pk->fpr, dp, dlen);
+  pk->fprlen = dlen;
+  if (version == 5)
+    {
+      pk->keyid[0] = buf32_to_u32 (dp);
+      pk->keyid[1] = buf32_to_u32 (dp+4);
+    }
+  else
+    {
+      pk->keyid[0] = buf32_to_u32 (dp+12);
+      pk->keyid[1] = buf32_to_u32 (dp+16);
+    }
+  gcry_md_close (md);
+
+  pk->timestamp = buf32_to_u32 (buf+1);
+  pk->hdrbytes = hdrlen;
+  pk->version = version;
+  pk->flags.primary = (pkttype == PKT_PUBLIC_KEY);
+  pk->pubkey_algo = algorithm;
+  return 1;
+}
+
+
+/* A variant of parse_key used by search_packet if the caller needs
+ * only the keyid and fingerprint of public keys (for example
+ * keyring_search).  Instead of converting each MPI into a gcrypt
+ * object and serializing it again to compute the fingerprint, the
+ * fingerprint is computed directly from the packet.  If that is not
+ * possible the packet is parsed as usual.  */
+static int
+parse_key_fpr_only (IOBUF inp, int pkttype, unsigned long pktlen,
+                    byte *hdr, int hdrlen, PACKET *pkt)
+{
+  byte stackbuf[1024];
+  byte *buf;
+  iobuf_t tmp;
+  int rc;
+
+  if (pktlen < 11 || pktlen > MAX_KEY_PACKET_LENGTH)
+    return parse_key (inp, pkttype, pktlen, hdr, hdrlen, pkt);
+
+  if (pktlen <= sizeof stackbuf)
+    buf = stackbuf;
+  else if (!(buf = xtrymalloc (pktlen)))
+    return parse_key (inp, pkttype, pktlen, hdr, hdrlen, pkt);
+
+  if (iobuf_read (inp, buf, pktlen) != (int)pktlen)
+    {
+      log_error ("packet(%d) too short\n", pkttype);
+      rc = gpg_error (GPG_ERR_INV_PACKET);
+    }
+  else if (fpr_from_key_image (buf, pktlen, pkttype, hdrlen,
+                               pkt->pkt.public_key))
+    rc = 0;
+  else
+    {
+      tmp = iobuf_temp_with_content (buf, pktlen);
+      rc = parse_key (tmp, pkttype, pktlen, hdr, hdrlen, pkt);
+      iobuf_close (tmp);
+    }
+
+  if (buf != stackbuf)
+    xfree (buf);
+  return rc;
+}
+
+
 static int
 parse_key (IOBUF inp, int pkttype, unsigned long pktlen,
 	   byte * hdr, int hdrlen, PACKET * pkt)
@@ -2501,7 +2739,7 @@ parse_key (IOBUF inp, int pkttype, unsigned long pktlen,
                    || algorithm == PUBKEY_ALGO_ECDH) && i==0)
                 {
                   char *curve = openpgp_oid_to_str (pk->pkey[0]);
-                  const char *name = openpgp_oid_to_curve (curve, 0);
+                  const char *name = openpgp_oidmpi_to_curve (pk->pkey[0], 0);
                   es_fprintf (listfp, " %s (%s)", name?name:"", curve);
                   xfree (curve);
                 }
@@ -759,6 +759,151 @@ default_recipient (ctrl_t ctrl)
 }
 
 
+/* The maximum number of entries in the recipient cache.  */
+#define MAX_RECIPIENT_CACHE 256
+
+/* An entry of the recipient cache.  */
+struct recipient_cache_item_s
+{
+  struct recipient_cache_item_s *next;
+  PKT_public_key *pk;        /* The key found for NAME.  */
+  unsigned int use;          /* The requested usage.  */
+  unsigned int trustlevel;   /* The value returned by get_validity.  */
+  char name[1];              /* The user id as given to us.  */
+};
+
+/* The cache of the keys found by find_and_check_key.  In server mode
+ * and with other long running callers the same recipients are looked
+ * up over and over again; the cache saves the key lookup and the
+ * validity computation.  The cache is flushed after a change of a
+ * keyring or of the trustdb.  */
+struct recipient_cache_s
+{
+  unsigned char keydb_gen[KEYDB_DIGEST_LEN];
+  unsigned long trustdb_gen;
+  unsigned int nitems;
+  struct recipient_cache_item_s *items;
+};
+
+
+static void
+flush_recipient_cache (struct recipient_cache_s *cache)
+{
+  struct recipient_cache_item_s *item;
+
+  while ((item = cache->items))
+    {
+      cache->items = item->next;
+      free_public_key (item->pk);
+      xfree (item);
+    }
+  cache->nitems = 0;
+}
+
+
+/* Release the recipient cache of CTRL.  */
+void
+release_recipient_cache (ctrl_t ctrl)
+{
+  if (!ctrl->recipient_cache)
+    return;
+  flush_recipient_cache (ctrl->recipient_cache);
+  xfree (ctrl->recipient_cache);
+  ctrl->recipient_cache = NULL;
+}
+
+
+/* Return the recipient cache of CTRL.  The cache is flushed if the
+ * key database or the trustdb has been changed since the last use.
+ * Returns NULL if the cache can't be used.  */
+static struct recipient_cache_s *
+get_recipient_cache (ctrl_t ctrl)
+{
+  struct recipient_cache_s *cache;
+  unsigned char gen[KEYDB_DIGEST_LEN];
+  unsigned long tgen;
+
+  /* With TOFU the validity depends on the history of the binding
+   * which changes with each signature.  */
+  if (opt.trust_model == TM_TOFU || opt.trust_model == TM_TOFU_PGP
+      || opt.trust_model == TM_AUTO)
+    return NULL;
+
+  if (keydb_get_generation (gen))
+    return NULL;
+  tgen = trustdb_get_generation ();
+
+  cache = ctrl->recipient_cache;
+  if (!cache)
+    {
+      cache = xtrycalloc (1, sizeof *cache);
+      if (!cache)
+        return NULL;
+      ctrl->recipient_cache = cache;
+    }
+  else if (memcmp (cache->keydb_gen, gen, sizeof gen)
+           || cache->trustdb_gen != tgen)
+    {
+      if (DBG_LOOKUP && cache->nitems)
+        log_debug ("flushing the recipient cache\n");
+      flush_recipient_cache (cache);
+    }
+  memcpy (cache->keydb_gen, gen, sizeof gen);
+  cache->trustdb_gen = tgen;
+  return cache;
+}
+
+
+/* Return the entry of CACHE for NAME and USE or NULL.  Entries for
+ * keys which have expired in the meantime are removed.  */
+static struct recipient_cache_item_s *
+lookup_recipient_cache (struct recipient_cache_s *cache,
+                        const char *name, unsigned int use)
+{
+  struct recipient_cache_item_s *item, **itemp;
+
+  for (itemp = &cache->items; (item = *itemp); itemp = &item->next)
+    if (item->use == use && !strcmp (item->name, name))
+      {
+        if (item->pk->expiredate && item->pk->expiredate <= make_timestamp ())
+          {
+            *itemp = item->next;
+            free_public_key (item->pk);
+            xfree (item);
+            cache->nitems--;
+            return NULL;
+          }
+        return item;
+      }
+  return NULL;
+}
+
+
+/* Add the key PK with the validity TRUSTLEVEL found for NAME and USE
+ * to CACHE.  */
+static void
+add_to_recipient_cache (struct recipient_cache_s *cache,
+                        const char *name, unsigned int use,
+                        PKT_public_key *pk, unsigned int trustlevel)
+{
+  struct recipient_cache_item_s *item;
+
+  if (cache->nitems >= MAX_RECIPIENT_CACHE)
+    flush_recipient_cache (cache);
+
+  item = xtrymalloc (sizeof *item + strlen (name));
+  if (!item)
+    return;
+  strcpy (item->name, name);
+  item->use = use;
+  item->pk = copy_public_key (NULL, pk);
+  item->trustlevel = trustlevel;
+  item->next = cache->items;
+  cache->items = item;
+  cache->nitems++;
+}
+
+
 /* Helper for build_pk_list to find and check one key.  This helper is
  * also used directly in server mode by the RECIPIENTS command.  On
  * success the new key is added to PK_LIST_ADDR.  NAME is the user id
@@ -773,6 +918,8 @@ find_and_check_key (ctrl_t ctrl, const char *name, unsigned int use,
   int rc;
   PKT_public_key *pk;
   KBNODE keyblock = NULL;
+  struct recipient_cache_s *cache = NULL;
+  struct recipient_cache_item_s *item = NULL;
 
   if (!name || !*name)
     return gpg_error (GPG_ERR_INV_USER_ID);
@@ -782,7 +929,22 @@ find_and_check_key (ctrl_t ctrl, const char *name, unsigned int use,
     return gpg_error_from_syserror ();
   pk->req_usage = use;
 
-  if (from_file)
+  if (!from_file)
+    {
+      cache = get_recipient_cache (ctrl);
+      if (cache)
+        item = lookup_recipient_cache (cache, name, use);
+    }
+
+  if (item)
+    {
+      /* The messages and the status lines for a disabled or not
+       * trusted key are still emitted below.  */
+      free_public_key (pk);
+      pk = copy_public_key (NULL, item->pk);
+      rc = 0;
+    }
+  else if (from_file)
     rc = get_pubkey_fromfile (ctrl, pk, name);
   else
     rc = get_best_pubkey_byname (ctrl, GET_PUBKEY_NORMAL,
@@ -821,8 +983,16 @@ find_and_check_key (ctrl_t ctrl, const char *name, unsigned int use,
     {
       int trustlevel;
 
-      trustlevel = get_validity (ctrl, keyblock, pk, pk->user_id, NULL, 1);
-      release_kbnode (keyblock);
+      if (item)
+        trustlevel = item->trustlevel;
+      else
+        {
+          trustlevel = get_validity (ctrl, keyblock, pk, pk->user_id,
+                                     NULL, 1);
+          release_kbnode (keyblock);
+          if (cache)
+            add_to_recipient_cache (cache, name, use, pk, trustlevel);
+        }
       if ( (trustlevel & TRUST_FLAG_DISABLED) )
         {
           /* Key has been disabled. */
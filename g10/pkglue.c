@@ -29,6 +29,7 @@
 #include "pkglue.h"
 #include "main.h"
 #include "options.h"
+#include "timing.h"
 
 /* FIXME: Better change the function name because mpi_ is used by
    gcrypt macros.  */
@@ -221,7 +222,13 @@ pk_verify (pubkey_algo_t pkalgo, gcry_mpi_t hash,
     BUG ();
 
   if (!rc)
-    rc = gcry_pk_verify (s_sig, s_hash, s_pkey);
+    {
+      timing_span_t span;
+
+      timing_begin (&span, "pk_verify");
+      rc = gcry_pk_verify (s_sig, s_hash, s_pkey);
+      timing_end (&span);
+    }
 
   gcry_sexp_release (s_sig);
   gcry_sexp_release (s_hash);
@@ -300,7 +307,13 @@ pk_encrypt (pubkey_algo_t algo, gcry_mpi_t *resarr, gcry_mpi_t data,
 
   /* Pass it to libgcrypt. */
   if (!rc)
-    rc = gcry_pk_encrypt (&s_ciph, s_data, s_pkey);
+    {
+      timing_span_t span;
+
+      timing_begin (&span, "pk_encrypt");
+      rc = gcry_pk_encrypt (&s_ciph, s_data, s_pkey);
+      timing_end (&span);
+    }
 
   gcry_sexp_release (s_data);
   gcry_sexp_release (s_pkey);
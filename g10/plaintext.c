@@ -24,6 +24,11 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
+#ifdef HAVE_MMAP
+# include <unistd.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+#endif
 #ifdef HAVE_DOSISH_SYSTEM
 # include <fcntl.h> /* for setmode() */
 #endif
@@ -37,6 +42,7 @@
 #include "main.h"
 #include "../common/status.h"
 #include "../common/i18n.h"
+#include "timing.h"
 
 
 /* Get the output filename.  On success, the actual filename that is
@@ -221,6 +227,76 @@ get_output_file (const byte *embedded_name, int embedded_namelen,
   return 0;
 }
 
+/* Return the size of the buffer used to copy binary data from INP.
+ * We use at least the size of the iobuf's own buffer so that
+ * iobuf_read has the last filter (e.g. the decryption or
+ * decompression filter) write straight into our buffer; with a
+ * smaller buffer each byte would first be stored in the iobuf and
+ * then copied.  */
+static size_t
+copy_buffer_size (iobuf_t inp)
+{
+  size_t size = iobuf_get_buffer_size (inp);
+
+  return size > 32768? size : 32768;
+}
+
+
+/* Hash the text (BUF,LEN) of a cleartext signature to MD.  LF and
+ * CR,LF are hashed as CR,LF except for the very last line ending.
+ * Thus the line ending is kept pending in *R_STATE across calls: 0
+ * is nothing pending, 1 is a CR, and 2 is a line ending.  The runs
+ * between the line endings are found with memchr and hashed with one
+ * call.  */
+static void
+hash_clearsig_text (gcry_md_hd_t md, const byte *buf, size_t len,
+                    int *r_state)
+{
+  const byte *end = buf + len;
+  const byte *p;
+  int state = *r_state;
+  size_t n;
+
+  while (buf < end)
+    {
+      if (state == 2)
+        {
+          gcry_md_write (md, "\r\n", 2);
+          state = 0;
+        }
+      else if (state == 1)
+        {
+          if (*buf == '\n')
+            {
+              state = 2;
+              buf++;
+              continue;
+            }
+          gcry_md_putc (md, '\r');  /* A lone CR is hashed as is.  */
+          state = 0;
+        }
+
+      n = end - buf;
+      p = memchr (buf, '\n', n);
+      if (p)
+        n = p - buf;
+      p = memchr (buf, '\r', n);
+      if (p)
+        n = p - buf;
+      if (n)
+        gcry_md_write (md, buf, n);
+      buf += n;
+      if (buf < end)
+        {
+          state = *buf == '\r'? 1 : 2;
+          buf++;
+        }
+    }
+
+  *r_state = state;
+}
+
+
 /* Handle a plaintext packet.  If MFX is not NULL, update the MDs
  * Note: We should have used the filter stuff here, but we have to add
  * some easy mimic to set a read limit, so we calculate only the bytes
@@ -235,10 +311,12 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
   int err = 0;
   int c;
   int convert;
+  timing_span_t span;
 #ifdef __riscos__
   int filetype = 0xfff;
 #endif
 
+  timing_begin (&span, "handle_plaintext");
   if (pt->mode == 't' || pt->mode == 'u' || pt->mode == 'm')
     convert = pt->mode;
   else
@@ -330,10 +408,11 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 	}
       else  /* Binary mode.  */
 	{
-	  byte *buffer = xmalloc (32768);
+	  size_t buflen = copy_buffer_size (pt->buf);
+	  byte *buffer = xmalloc (buflen);
 	  while (pt->len)
 	    {
-	      int len = pt->len > 32768 ? 32768 : pt->len;
+	      int len = pt->len > buflen ? buflen : pt->len;
 	      len = iobuf_read (pt->buf, buffer, len);
 	      if (len == -1)
 		{
@@ -406,9 +485,10 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
       else
 	{			/* binary mode */
 	  byte *buffer;
+	  size_t buflen = copy_buffer_size (pt->buf);
 	  int eof_seen = 0;
 
-          buffer = xtrymalloc (32768);
+          buffer = xtrymalloc (buflen);
           if (!buffer)
             {
               err = gpg_error_from_syserror ();
@@ -423,10 +503,10 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 	       * off and therefore we don't catch the boundary.
 	       * So, always assume EOF if iobuf_read returns less bytes
 	       * then requested */
-	      int len = iobuf_read (pt->buf, buffer, 32768);
+	      int len = iobuf_read (pt->buf, buffer, buflen);
 	      if (len == -1)
 		break;
-	      if (len < 32768)
+	      if (len < buflen)
 		eof_seen = 1;
 	      if (mfx->md)
 		gcry_md_write (mfx->md, buffer, len);
@@ -457,60 +537,42 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
   else /* Clear text signature - don't hash the last CR,LF.   */
     {
       int state = 0;
+      byte *buffer;
+      size_t buflen = copy_buffer_size (pt->buf);
+      int len;
 
-      while ((c = iobuf_get (pt->buf)) != -1)
+      buffer = xtrymalloc (buflen);
+      if (!buffer)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+
+      while ((len = iobuf_read (pt->buf, buffer, buflen)) != -1)
 	{
 	  if (fp)
 	    {
-	      if (opt.max_output && (++count) > opt.max_output)
+	      if (opt.max_output && (count += len) > opt.max_output)
 		{
 		  log_error ("error writing to '%s': %s\n",
 			     fname, "exceeded --max-output limit\n");
 		  err = gpg_error (GPG_ERR_TOO_LARGE);
+		  xfree (buffer);
 		  goto leave;
 		}
-	      else if (es_putc (c, fp) == EOF)
+	      else if (es_fwrite (buffer, 1, len, fp) != len)
 		{
 		  err = gpg_error_from_syserror ();
 		  log_error ("error writing to '%s': %s\n",
 			     fname, gpg_strerror (err));
+		  xfree (buffer);
 		  goto leave;
 		}
 	    }
-	  if (!mfx->md)
-	    continue;
-	  if (state == 2)
-	    {
-	      gcry_md_putc (mfx->md, '\r');
-	      gcry_md_putc (mfx->md, '\n');
-	      state = 0;
-	    }
-	  if (!state)
-	    {
-	      if (c == '\r')
-		state = 1;
-	      else if (c == '\n')
-		state = 2;
-	      else
-		gcry_md_putc (mfx->md, c);
-	    }
-	  else if (state == 1)
-	    {
-	      if (c == '\n')
-		state = 2;
-	      else
-		{
-		  gcry_md_putc (mfx->md, '\r');
-		  if (c == '\r')
-		    state = 1;
-		  else
-		    {
-		      state = 0;
-		      gcry_md_putc (mfx->md, c);
-		    }
-		}
-	    }
+	  if (mfx->md)
+	    hash_clearsig_text (mfx->md, buffer, len, &state);
 	}
+      xfree (buffer);
       pt->buf = NULL;
     }
 
@@ -541,16 +603,92 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
   if (fp && fp != es_stdout && fp != opt.outfp)
     es_fclose (fp);
   xfree (fname);
+  timing_end (&span);
   return err;
 }
 
 
+#ifdef HAVE_MMAP
+/* Files smaller than this are hashed the usual way.  */
+#define MMAP_HASH_MINSIZE (1024*1024)
+/* The size of the window which is mapped at once.  */
+#define MMAP_HASH_WINDOW  (64*1024*1024)
+
+/* Hash the rest of the regular file backing FP into MD by mapping it
+ * into memory.  This is only done if FP has no filters pushed and
+ * nothing has been read from it yet.  Returns true if the file has
+ * been hashed; on false the caller needs to hash FP the usual way; in
+ * that case the file position is where the mapping stopped.  */
+static int
+hash_mmapped_file (gcry_md_hd_t md, iobuf_t fp)
+{
+  struct stat st;
+  long pagesize;
+  off_t pos, start;
+  size_t skip, len;
+  void *p;
+  int fd;
+
+  if (fp->chain || iobuf_tell (fp) || fp->d.len)
+    return 0;
+  fd = iobuf_get_fd (fp);
+  if (fd == -1 || fstat (fd, &st) || !S_ISREG (st.st_mode))
+    return 0;
+  pos = lseek (fd, 0, SEEK_CUR);
+  if (pos == (off_t)(-1) || st.st_size - pos < MMAP_HASH_MINSIZE)
+    return 0;
+
+  pagesize = sysconf (_SC_PAGESIZE);
+  if (pagesize <= 0)
+    return 0;
+
+  while (pos < st.st_size)
+    {
+      start = pos - (pos % pagesize);
+      skip = pos - start;
+      if (st.st_size - pos > MMAP_HASH_WINDOW)
+        len = MMAP_HASH_WINDOW;
+      else
+        len = st.st_size - pos;
+
+      p = mmap (NULL, skip + len, PROT_READ, MAP_SHARED, fd, start);
+      if (p == MAP_FAILED)
+        {
+          if (DBG_FILTER)
+            log_debug ("mmap of signed data failed: %s\n", strerror (errno));
+          /* Let the caller continue with read(2).  */
+          if (lseek (fd, pos, SEEK_SET) == (off_t)(-1))
+            log_fatal ("can't seek in signed data: %s\n", strerror (errno));
+          return 0;
+        }
+#ifdef MADV_SEQUENTIAL
+      madvise (p, skip + len, MADV_SEQUENTIAL);
+#endif
+      gcry_md_write (md, (char*)p + skip, len);
+      munmap (p, skip + len);
+      pos += len;
+    }
+
+  /* Leave the file position where read(2) would have left it.  */
+  lseek (fd, pos, SEEK_SET);
+  return 1;
+}
+#endif /*HAVE_MMAP*/
+
+
 static void
 do_hash (gcry_md_hd_t md, gcry_md_hd_t md2, IOBUF fp, int textmode)
 {
   text_filter_context_t tfx;
   int c;
 
+#ifdef HAVE_MMAP
+  /* Binary signatures over a large regular file can be hashed
+   * directly from the page cache.  */
+  if (!textmode && md && !md2 && hash_mmapped_file (md, fp))
+    return;
+#endif
+
   if (textmode)
     {
       memset (&tfx, 0, sizeof tfx);
@@ -584,10 +722,13 @@ do_hash (gcry_md_hd_t md, gcry_md_hd_t md2, IOBUF fp, int textmode)
     }
   else
     {
-      while ((c = iobuf_get (fp)) != -1)
+      byte buffer[8192];
+      int n;
+
+      while ((n = iobuf_read (fp, buffer, sizeof buffer)) != -1)
 	{
 	  if (md)
-	    gcry_md_putc (md, c);
+	    gcry_md_write (md, buffer, n);
 	}
     }
 }
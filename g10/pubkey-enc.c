@@ -36,6 +36,7 @@
 #include "call-agent.h"
 #include "../common/host2net.h"
 #include "../common/compliance.h"
+#include "timing.h"
 
 
 static gpg_error_t get_it (ctrl_t ctrl, struct pubkey_enc_list *k,
@@ -197,6 +198,7 @@ get_it (ctrl_t ctrl,
   char *keygrip;
   byte fp[MAX_FINGERPRINT_LEN];
   size_t fpn;
+  timing_span_t span;
 
   if (DBG_CLOCK)
     log_clock ("decryption start");
@@ -247,9 +249,11 @@ get_it (ctrl_t ctrl,
 
   /* Decrypt. */
   desc = gpg_format_keydesc (ctrl, sk, FORMAT_KEYDESC_NORMAL, 1);
+  timing_begin (&span, "pk_decrypt");
   err = agent_pkdecrypt (NULL, keygrip,
                          desc, sk->keyid, sk->main_keyid, sk->pubkey_algo,
                          s_data, &frame, &nframe, &padding);
+  timing_end (&span);
   xfree (desc);
   gcry_sexp_release (s_data);
   if (err)
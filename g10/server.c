@@ -35,10 +35,14 @@
 #include "../common/server-help.h"
 #include "../common/sysutils.h"
 #include "../common/status.h"
+#include "tofu.h"
 
 
 #define set_error(e,t) assuan_set_error (ctx, gpg_error (e), (t))
 
+/* The maximum length of a payload inquired by SIGN.  */
+#define MAXLEN_SIGN_PAYLOAD (16*1024*1024)
+
 
 /* Data used to associate an Assuan context with local server data.  */
 struct server_local_s
@@ -51,9 +55,22 @@ struct server_local_s
   /* List of prepared recipients.  */
   pk_list_t recplist;
 
+  /* List of signers as set by the SIGNER command.  */
+  strlist_t signers;
+
+  /* The keys and digest setup for SIGN as created from SIGNERS on
+   * the first use.  */
+  sign_batch_t signbatch;
+
   /* Set if pinentry notifications should be passed back to the
      client. */
   int allow_pinentry_notify;
+
+  /* The stream used for status output and the status line
+   * collected so far.  */
+  estream_t statusfp;
+  size_t statuslen;
+  char statusbuf[ASSUAN_LINELENGTH];
 };
 
 
@@ -70,6 +87,64 @@ close_message_fd (ctrl_t ctrl)
 }
 
 
+/* Send the status line collected in the buffer of CTRL as an Assuan
+ * status line.  The line has the format used with --status-fd.  */
+static gpg_error_t
+flush_status_line (ctrl_t ctrl)
+{
+  struct server_local_s *sl = ctrl->server_local;
+  char *keyword, *args;
+
+  sl->statusbuf[sl->statuslen] = 0;
+  sl->statuslen = 0;
+  keyword = sl->statusbuf;
+  if (!strncmp (keyword, "[GNUPG:] ", 9))
+    keyword += 9;
+  if (!*keyword)
+    return 0;
+  args = strchr (keyword, ' ');
+  if (args)
+    *args++ = 0;
+  return assuan_write_status (sl->assuan_ctx, keyword, args? args : "");
+}
+
+
+/* A write handler used by es_fopencookie to pass the status lines
+ * written by gpg to the client.  */
+static gpgrt_ssize_t
+status_cookie_write (void *cookie, const void *buffer, size_t size)
+{
+  ctrl_t ctrl = cookie;
+  struct server_local_s *sl = ctrl->server_local;
+  const char *s = buffer;
+  size_t n;
+
+  for (n = 0; n < size; n++, s++)
+    {
+      if (*s == '\n')
+        {
+          if (flush_status_line (ctrl))
+            {
+              gpg_err_set_errno (EIO);
+              return -1;
+            }
+        }
+      else if (sl->statuslen < sizeof sl->statusbuf - 1)
+        sl->statusbuf[sl->statuslen++] = *s;
+    }
+  return (gpgrt_ssize_t)size;
+}
+
+
+static es_cookie_io_functions_t status_cookie_functions =
+  {
+    NULL,
+    status_cookie_write,
+    NULL,
+    NULL
+  };
+
+
 /* Called by libassuan for Assuan options.  See the Assuan manual for
    details. */
 static gpg_error_t
@@ -126,6 +201,10 @@ reset_notify (assuan_context_t ctx, char *line)
 
   release_pk_list (ctrl->server_local->recplist);
   ctrl->server_local->recplist = NULL;
+  free_strlist (ctrl->server_local->signers);
+  ctrl->server_local->signers = NULL;
+  sign_batch_release (ctrl->server_local->signbatch);
+  ctrl->server_local->signbatch = NULL;
 
   close_message_fd (ctrl);
   assuan_close_input_fd (ctx);
@@ -134,6 +213,30 @@ reset_notify (assuan_context_t ctx, char *line)
 }
 
 
+/* Called by libassuan before each command.  */
+static gpg_error_t
+pre_cmd_notify (assuan_context_t ctx, const char *cmd)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+
+  /* Commands which do not use keys need no check.  */
+  if (!strcmp (cmd, "OPTION") || !strcmp (cmd, "NOP")
+      || !strcmp (cmd, "RESET") || !strcmp (cmd, "BYE")
+      || !strcmp (cmd, "INPUT") || !strcmp (cmd, "OUTPUT")
+      || !strcmp (cmd, "GETINFO"))
+    return 0;
+
+  /* Without this we would use stale cached keys after another
+   * process changed the keyboxd.  */
+  err = keydb_check_generation (ctrl);
+  if (err)
+    log_info ("error checking the keyboxd for changes: %s\n",
+              gpg_strerror (err));
+  return 0;
+}
+
+
 /* Called by libassuan for INPUT commands. */
 static gpg_error_t
 input_notify (assuan_context_t ctx, char *line)
@@ -229,14 +332,37 @@ cmd_recipient (assuan_context_t ctx, char *line)
    are *not* reset by an SIGN command because it can be expected that
    set of signers are used for more than one sign operation.
 
-   Note that this command returns an INV_RECP status which is a bit
-   strange, but they are very similar.  */
+   Note that this command returns an INV_SGNR status if the key can't
+   be used.  */
 static gpg_error_t
 cmd_signer (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  strlist_t sl = NULL;
+  sign_batch_t batch;
+
+  line = skip_options (line);
+  if (!*line)
+    return set_error (GPG_ERR_ASS_PARAMETER, "no user ID given");
+
+  /* Check the key now so that the client learns about a problem
+   * before it starts signing.  */
+  add_to_strlist (&sl, line);
+  err = sign_batch_new (ctrl, sl, &batch);
+  free_strlist (sl);
+  if (!err)
+    {
+      sign_batch_release (batch);
+      append_to_strlist (&ctrl->server_local->signers, line);
+      /* The prepared batch does not match the signers anymore.  */
+      sign_batch_release (ctrl->server_local->signbatch);
+      ctrl->server_local->signbatch = NULL;
+    }
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "SIGNER", gpg_strerror (err));
+  return err;
 }
 
 
@@ -402,10 +528,16 @@ cmd_verify (assuan_context_t ctx, char *line)
         return set_error (gpg_err_code_from_syserror (), "fdopen() failed");
     }
 
-  log_debug ("WARNING: The server mode is WORK "
-             "IN PROGRESS and not ready for use\n");
-
+#ifdef USE_TOFU
+  /* Record the TOFU data of all signatures in one transaction.  The
+   * batch ends with the command so that we do not hold the database
+   * lock while waiting for the next command.  */
+  tofu_begin_batch_update (ctrl);
+#endif
   rc = gpg_verify (ctrl, fd, ctrl->server_local->message_fd, out_fp);
+#ifdef USE_TOFU
+  tofu_end_batch_update (ctrl);
+#endif
 
   es_fclose (out_fp);
   close_message_fd (ctrl);
@@ -420,17 +552,118 @@ cmd_verify (assuan_context_t ctx, char *line)
 
 
 
-/*  SIGN [--detached]
+/*  SIGN --detached [--armor] [--inquire]
 
    Sign the data set with the INPUT command and write it to the sink
    set by OUTPUT.  With "--detached" specified, a detached signature
-   is created.  */
+   is created; other signatures are not yet supported.  With
+   "--inquire" the data is requested with the inquiry PAYLOAD and the
+   signature is returned with data lines.
+
+   The keys are taken from the SIGNER commands or, if there are none,
+   the default key is used.  The keys are looked up and the digest
+   context is set up only once for all SIGN commands until the set of
+   signers is changed.  Together with "--inquire" this allows to sign
+   a large number of small payloads without further overhead.
+
+   Unless "--inquire" is used the input, output and message pipes are
+   closed after this command.  */
 static gpg_error_t
 cmd_sign (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  int armor, inquire;
+  int inp_fd, out_fd;
+  unsigned char *payload = NULL;
+  size_t payloadlen;
+  iobuf_t inp = NULL;
+  iobuf_t out = NULL;
+  armor_filter_context_t *afx = NULL;
+
+  armor = has_option (line, "--armor");
+  inquire = has_option (line, "--inquire");
+  if (!has_option (line, "--detached"))
+    {
+      err = set_error (GPG_ERR_NOT_SUPPORTED,
+                       "only detached signatures are supported");
+      goto leave;
+    }
+
+  if (!ctrl->server_local->signbatch)
+    {
+      err = sign_batch_new (ctrl, ctrl->server_local->signers,
+                            &ctrl->server_local->signbatch);
+      if (err)
+        goto leave;
+    }
+
+  if (inquire)
+    {
+      err = assuan_inquire (ctx, "PAYLOAD", &payload, &payloadlen,
+                            MAXLEN_SIGN_PAYLOAD);
+      if (err)
+        goto leave;
+      inp = iobuf_temp_with_content ((const char *)payload, payloadlen);
+      out = iobuf_temp ();
+    }
+  else
+    {
+      inp_fd = translate_sys2libc_fd (assuan_get_input_fd (ctx), 0);
+      if (inp_fd == -1)
+        {
+          err = set_error (GPG_ERR_ASS_NO_INPUT, NULL);
+          goto leave;
+        }
+      out_fd = translate_sys2libc_fd (assuan_get_output_fd (ctx), 1);
+      if (out_fd == -1)
+        {
+          err = set_error (GPG_ERR_ASS_NO_OUTPUT, NULL);
+          goto leave;
+        }
+      inp = iobuf_fdopen_nc (inp_fd, "rb");
+      out = iobuf_fdopen_nc (out_fd, "wb");
+      if (!inp || !out)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+
+  if (armor)
+    {
+      afx = new_armor_context ();
+      afx->what = 2;
+      push_armor_filter (afx, out);
+    }
+
+  err = sign_batch_data (ctrl, ctrl->server_local->signbatch, inp, out);
+  if (!err && inquire)
+    {
+      iobuf_flush_temp (out);
+      err = assuan_send_data (ctx, iobuf_get_temp_buffer (out),
+                              iobuf_get_temp_length (out));
+    }
+
+ leave:
+  if (err)
+    iobuf_cancel (out);
+  else
+    iobuf_close (out);
+  iobuf_close (inp);
+  xfree (payload);
+  release_armor_context (afx);
+  if (!inquire)
+    {
+      /* Close and reset the fds. */
+      close_message_fd (ctrl);
+      assuan_close_input_fd (ctx);
+      assuan_close_output_fd (ctx);
+    }
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "SIGN", gpg_strerror (err));
+  return err;
 }
 
 
@@ -657,6 +890,7 @@ gpg_server (ctrl_t ctrl)
   int filedes[2];
 #endif
   assuan_context_t ctx = NULL;
+  estream_t oldstatusfp = NULL;
   static const char hello[] = ("GNU Privacy Guard's OpenPGP server "
                                VERSION " ready");
 
@@ -714,6 +948,7 @@ gpg_server (ctrl_t ctrl)
   else
     assuan_set_hello_line (ctx, hello);
   assuan_register_reset_notify (ctx, reset_notify);
+  assuan_register_pre_cmd_notify (ctx, pre_cmd_notify);
   assuan_register_input_notify (ctx, input_notify);
   assuan_register_output_notify (ctx, output_notify);
   assuan_register_option_handler (ctx, option_handler);
@@ -727,6 +962,16 @@ gpg_server (ctrl_t ctrl)
   ctrl->server_local->assuan_ctx = ctx;
   ctrl->server_local->message_fd = GNUPG_INVALID_FD;
 
+  /* The status lines are sent to the client.  */
+  ctrl->server_local->statusfp = es_fopencookie (ctrl, "w",
+                                                 status_cookie_functions);
+  if (!ctrl->server_local->statusfp)
+    {
+      rc = gpg_error_from_syserror ();
+      goto leave;
+    }
+  oldstatusfp = status_redirect (ctrl->server_local->statusfp);
+
   for (;;)
     {
       rc = assuan_accept (ctx);
@@ -752,7 +997,14 @@ gpg_server (ctrl_t ctrl)
  leave:
   if (ctrl->server_local)
     {
+      if (ctrl->server_local->statusfp)
+        {
+          status_redirect (oldstatusfp);
+          es_fclose (ctrl->server_local->statusfp);
+        }
       release_pk_list (ctrl->server_local->recplist);
+      free_strlist (ctrl->server_local->signers);
+      sign_batch_release (ctrl->server_local->signbatch);
 
       xfree (ctrl->server_local);
       ctrl->server_local = NULL;
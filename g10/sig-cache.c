@@ -0,0 +1,404 @@
+/* sig-cache.c - Persistent cache of verified key signatures
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * The cache file
+ *
+ * The file "sigcache.bin" in the home directory stores an entry for
+ * each key signature which has been verified as good by the public
+ * key operation.  An entry is the truncated SHA-256 hash over the
+ * fingerprint of the signer, the algorithms and the digest of the
+ * signed data as well as the signature values.  Thus an entry can't
+ * be used for another signature, another signer, or other signed
+ * data and there is no need to invalidate entries.  Bad signatures
+ * are not stored.  Note that only the public key operation is
+ * cached; all other checks, like the validity of the signer or the
+ * expiration of the signature, are still done by the caller.
+ *
+ * The file is a sequence of records of SIG_CACHE_KEYLEN bytes.  The
+ * first record is the header:
+ *
+ *   - b4   Magic 'GPGs'
+ *   - byte Version number (1)
+ *   - b15  RFU
+ *
+ * New records are appended so that concurrent processes do not need
+ * a lock: each write is a multiple of the record length and a header
+ * written twice by a race is just an unused record.  A trailing
+ * partial record is ignored.  If the file holds SIG_CACHE_MAX_ENTRIES
+ * records it is started anew with the next flush.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/sysutils.h"
+#include "../common/host2net.h"
+#include "options.h"
+#include "packet.h"
+#include "main.h"
+
+#define SIG_CACHE_FNAME       "sigcache.bin"
+#define SIG_CACHE_MAGIC       "GPGs"
+#define SIG_CACHE_VERSION     1
+#define SIG_CACHE_MAX_ENTRIES (1 << 19)
+#define SIG_CACHE_MIN_SLOTS   1024
+/* Number of records written with one write.  */
+#define SIG_CACHE_WRITE_CHUNK 200
+
+
+/* The in-core state of the cache.  */
+static struct
+{
+  unsigned int loaded:1;    /* The file has been read.  */
+  unsigned int disabled:1;  /* Do not use the file.  */
+  unsigned int restart:1;   /* Recreate the file with the next flush.  */
+
+  /* An open addressing hash table with NSLOTS entries; an unused
+   * slot is all zeroes.  */
+  unsigned char *table;
+  unsigned int nslots;
+  unsigned int count;
+
+  /* The entries not yet written to the file.  */
+  unsigned char *pending;
+  unsigned int npending;
+  unsigned int pendingsize;
+
+  /* Statistics.  */
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int added;
+} sigcache;
+
+/* An unused slot of the hash table.  */
+static const unsigned char unused_slot[SIG_CACHE_KEYLEN];
+
+
+/* Return the slot for KEY in TABLE with NSLOTS slots; this is either
+ * the slot holding KEY or the unused slot where it shall go.  */
+static unsigned char *
+find_slot (unsigned char *table, unsigned int nslots, const unsigned char *key)
+{
+  unsigned int idx;
+  unsigned char *slot;
+
+  /* The keys are hash values and thus can directly be used.  */
+  for (idx = buf32_to_uint (key) & (nslots - 1); ;
+       idx = (idx + 1) & (nslots - 1))
+    {
+      slot = table + idx * SIG_CACHE_KEYLEN;
+      if (!memcmp (slot, key, SIG_CACHE_KEYLEN)
+          || !memcmp (slot, unused_slot, SIG_CACHE_KEYLEN))
+        return slot;
+    }
+}
+
+
+/* Insert KEY into the hash table.  Returns 1 if it was inserted, 0
+ * if it was already in the table and -1 on error.  */
+static int
+table_insert (const unsigned char *key)
+{
+  unsigned char *newtable, *slot;
+  unsigned int newslots, i;
+
+  if ((sigcache.count + 1) * 2 > sigcache.nslots)
+    {
+      newslots = sigcache.nslots? sigcache.nslots * 2 : SIG_CACHE_MIN_SLOTS;
+      newtable = xtrycalloc (newslots, SIG_CACHE_KEYLEN);
+      if (!newtable)
+        return -1;
+      for (i=0; i < sigcache.nslots; i++)
+        {
+          slot = sigcache.table + i * SIG_CACHE_KEYLEN;
+          if (memcmp (slot, unused_slot, SIG_CACHE_KEYLEN))
+            memcpy (find_slot (newtable, newslots, slot),
+                    slot, SIG_CACHE_KEYLEN);
+        }
+      xfree (sigcache.table);
+      sigcache.table = newtable;
+      sigcache.nslots = newslots;
+    }
+
+  slot = find_slot (sigcache.table, sigcache.nslots, key);
+  if (!memcmp (slot, key, SIG_CACHE_KEYLEN))
+    return 0;
+  memcpy (slot, key, SIG_CACHE_KEYLEN);
+  sigcache.count++;
+  return 1;
+}
+
+
+/* Return the name of the cache file.  Caller must free.  */
+static char *
+cache_filename (void)
+{
+  return make_filename (gnupg_homedir (), SIG_CACHE_FNAME, NULL);
+}
+
+
+/* Read the cache file into the hash table.  */
+static void
+load_cache (void)
+{
+  char *fname;
+  FILE *fp;
+  unsigned char rec[SIG_CACHE_KEYLEN];
+  unsigned char hdr[SIG_CACHE_KEYLEN];
+  unsigned int nrecs = 0;
+
+  sigcache.loaded = 1;
+  fname = cache_filename ();
+  fp = fopen (fname, "rb");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        sigcache.disabled = 1;
+      goto leave;
+    }
+
+  if (fread (hdr, sizeof hdr, 1, fp) != 1
+      || memcmp (hdr, SIG_CACHE_MAGIC, 4) || hdr[4] != SIG_CACHE_VERSION)
+    {
+      /* Do not clobber a file we don't understand.  */
+      if (opt.verbose)
+        log_info ("ignoring invalid signature cache '%s'\n", fname);
+      sigcache.disabled = 1;
+      goto leave;
+    }
+
+  while (fread (rec, sizeof rec, 1, fp) == 1)
+    {
+      if (++nrecs >= SIG_CACHE_MAX_ENTRIES)
+        {
+          sigcache.restart = 1;
+          break;
+        }
+      if (!memcmp (rec, hdr, sizeof rec))
+        continue;  /* A duplicated header.  */
+      if (table_insert (rec) < 0)
+        break;
+    }
+
+  if (DBG_CACHE)
+    log_debug ("sig_cache: loaded %u entries from '%s'\n",
+               sigcache.count, fname);
+
+ leave:
+  if (fp)
+    fclose (fp);
+  xfree (fname);
+}
+
+
+/* Compute the cache key for the signature SIG by the key PK into
+ * KEY, which must have a length of SIG_CACHE_KEYLEN.  MD is the
+ * digest context after hashing the signature trailer; it is
+ * finalized by this function.  */
+gpg_error_t
+sig_cache_make_key (PKT_public_key *pk, PKT_signature *sig,
+                    gcry_md_hd_t md, unsigned char *key)
+{
+  gpg_error_t err;
+  gcry_md_hd_t h;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+  const unsigned char *p;
+  unsigned char *buf;
+  size_t n;
+  unsigned int nbits;
+  unsigned char tmp[2];
+  int i;
+
+  p = gcry_md_read (md, sig->digest_algo);
+  if (!p)
+    return gpg_error (GPG_ERR_DIGEST_ALGO);
+
+  err = gcry_md_open (&h, GCRY_MD_SHA256, 0);
+  if (err)
+    return err;
+
+  fingerprint_from_pk (pk, fpr, &fprlen);
+  tmp[0] = fprlen;
+  gcry_md_write (h, tmp, 1);
+  gcry_md_write (h, fpr, fprlen);
+  tmp[0] = sig->pubkey_algo;
+  tmp[1] = sig->digest_algo;
+  gcry_md_write (h, tmp, 2);
+  gcry_md_write (h, p, gcry_md_get_algo_dlen (sig->digest_algo));
+
+  for (i=0; i < pubkey_get_nsig (sig->pubkey_algo); i++)
+    {
+      if (!sig->data[i])
+        n = 0, buf = NULL;
+      else if (gcry_mpi_get_flag (sig->data[i], GCRYMPI_FLAG_OPAQUE))
+        {
+          p = gcry_mpi_get_opaque (sig->data[i], &nbits);
+          n = (nbits + 7) / 8;
+          buf = NULL;
+        }
+      else
+        {
+          err = gcry_mpi_aprint (GCRYMPI_FMT_USG, &buf, &n, sig->data[i]);
+          if (err)
+            {
+              gcry_md_close (h);
+              return err;
+            }
+          p = buf;
+        }
+      tmp[0] = n >> 8;
+      tmp[1] = n;
+      gcry_md_write (h, tmp, 2);
+      if (n)
+        gcry_md_write (h, p, n);
+      gcry_free (buf);
+    }
+
+  memcpy (key, gcry_md_read (h, GCRY_MD_SHA256), SIG_CACHE_KEYLEN);
+  gcry_md_close (h);
+  return 0;
+}
+
+
+/* Return true if KEY is in the cache, i.e. the signature is known to
+ * be good.  */
+int
+sig_cache_lookup (const unsigned char *key)
+{
+  if (!sigcache.loaded)
+    load_cache ();
+
+  if (sigcache.nslots
+      && !memcmp (find_slot (sigcache.table, sigcache.nslots, key),
+                  key, SIG_CACHE_KEYLEN))
+    {
+      sigcache.hits++;
+      return 1;
+    }
+  sigcache.misses++;
+  return 0;
+}
+
+
+/* Add KEY of a good signature to the cache.  The new entries are
+ * written by sig_cache_flush.  */
+void
+sig_cache_put (const unsigned char *key)
+{
+  unsigned char *p;
+
+  if (!sigcache.loaded)
+    load_cache ();
+
+  if (table_insert (key) < 1)
+    return;
+  sigcache.added++;
+
+  if (sigcache.disabled)
+    return;
+  if (sigcache.npending == sigcache.pendingsize)
+    {
+      p = xtryrealloc (sigcache.pending,
+                       (sigcache.pendingsize + 256) * SIG_CACHE_KEYLEN);
+      if (!p)
+        return;
+      sigcache.pending = p;
+      sigcache.pendingsize += 256;
+    }
+  memcpy (sigcache.pending + sigcache.npending * SIG_CACHE_KEYLEN,
+          key, SIG_CACHE_KEYLEN);
+  sigcache.npending++;
+}
+
+
+/* Write the new entries to the cache file.  */
+void
+sig_cache_flush (void)
+{
+  gpg_error_t err = 0;
+  char *fname;
+  FILE *fp;
+  unsigned char hdr[SIG_CACHE_KEYLEN];
+  unsigned int i, n;
+
+  if (sigcache.disabled || !sigcache.npending)
+    return;
+
+  fname = cache_filename ();
+  if (sigcache.restart)
+    gnupg_remove (fname);
+  fp = fopen (fname, "ab");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Write the header to a new file.  */
+  if (fseek (fp, 0, SEEK_END) || ftell (fp) < 0)
+    err = gpg_error_from_syserror ();
+  else if (!ftell (fp))
+    {
+      memset (hdr, 0, sizeof hdr);
+      memcpy (hdr, SIG_CACHE_MAGIC, 4);
+      hdr[4] = SIG_CACHE_VERSION;
+      if (fwrite (hdr, sizeof hdr, 1, fp) != 1 || fflush (fp))
+        err = gpg_error_from_syserror ();
+    }
+
+  for (i=0; !err && i < sigcache.npending; i += n)
+    {
+      n = sigcache.npending - i;
+      if (n > SIG_CACHE_WRITE_CHUNK)
+        n = SIG_CACHE_WRITE_CHUNK;
+      if (fwrite (sigcache.pending + i * SIG_CACHE_KEYLEN,
+                  SIG_CACHE_KEYLEN, n, fp) != n
+          || fflush (fp))
+        err = gpg_error_from_syserror ();
+    }
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+
+ leave:
+  if (err && opt.verbose)
+    log_info ("error writing signature cache '%s': %s\n",
+              fname, gpg_strerror (err));
+  xfree (fname);
+  sigcache.npending = 0;
+  sigcache.restart = 0;
+}
+
+
+/* Dump the statistics of the cache.  */
+void
+sig_cache_dump_stats (void)
+{
+  if (sigcache.loaded)
+    log_info ("sig_cache: persistent=%u hits=%u misses=%u added=%u\n",
+              sigcache.count, sigcache.hits, sigcache.misses,
+              sigcache.added);
+}
@@ -453,56 +453,13 @@ check_signature_end (PKT_public_key *pk, PKT_signature *sig,
 }
 
 
-/* This function is similar to check_signature_end, but it only checks
- * whether the signature was generated by PK.  It does not check
- * expiration, revocation, etc.  */
-static int
-check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
-                            gcry_md_hd_t digest,
-                            const void *extrahash, size_t extrahashlen)
+/* Complete the DIGEST for a signature check of SIG by hashing the
+ * signature's own data.  EXTRAHASH and EXTRAHASHLEN are used for v5
+ * data signatures; see check_signature_end.  */
+static void
+hash_sig_trailer (PKT_signature *sig, gcry_md_hd_t digest,
+                  const void *extrahash, size_t extrahashlen)
 {
-  gcry_mpi_t result = NULL;
-  int rc = 0;
-  const struct weakhash *weak;
-
-  if (!opt.flags.allow_weak_digest_algos)
-    {
-      for (weak = opt.weak_digests; weak; weak = weak->next)
-        if (sig->digest_algo == weak->algo)
-          {
-            print_digest_rejected_note(sig->digest_algo);
-            return GPG_ERR_DIGEST_ALGO;
-          }
-    }
-
-  /* For key signatures check that the key has a cert usage.  We may
-   * do this only for subkeys because the primary may always issue key
-   * signature.  The latter may not be reflected in the pubkey_usage
-   * field because we need to check the key signatures to extract the
-   * key usage.  */
-  if (!pk->flags.primary
-      && IS_CERT (sig) && !(pk->pubkey_usage & PUBKEY_USAGE_CERT))
-    {
-      rc = gpg_error (GPG_ERR_WRONG_KEY_USAGE);
-      if (!opt.quiet)
-        log_info (_("bad key signature from key %s: %s (0x%02x, 0x%x)\n"),
-                  keystr_from_pk (pk), gpg_strerror (rc),
-                  sig->sig_class, pk->pubkey_usage);
-      return rc;
-    }
-
-  /* For data signatures check that the key has sign usage.  */
-  if (!IS_BACK_SIG (sig) && IS_SIG (sig)
-      && !(pk->pubkey_usage & PUBKEY_USAGE_SIG))
-    {
-      rc = gpg_error (GPG_ERR_WRONG_KEY_USAGE);
-      if (!opt.quiet)
-        log_info (_("bad data signature from key %s: %s (0x%02x, 0x%x)\n"),
-                  keystr_from_pk (pk), gpg_strerror (rc),
-                  sig->sig_class, pk->pubkey_usage);
-      return rc;
-    }
-
   /* Make sure the digest algo is enabled (in case of a detached
    * signature).  */
   gcry_md_enable (digest, sig->digest_algo);
@@ -583,20 +540,87 @@ check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
       buf[i++] = n;
       gcry_md_write (digest, buf, i);
     }
-    gcry_md_final( digest );
+  gcry_md_final( digest );
+}
+
+
+/* This function is similar to check_signature_end, but it only checks
+ * whether the signature was generated by PK.  It does not check
+ * expiration, revocation, etc.  */
+static int
+check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
+                            gcry_md_hd_t digest,
+                            const void *extrahash, size_t extrahashlen)
+{
+  gcry_mpi_t result = NULL;
+  int rc = 0;
+  const struct weakhash *weak;
+  unsigned char cachekey[SIG_CACHE_KEYLEN];
+  int use_cache;
+
+  if (!opt.flags.allow_weak_digest_algos)
+    {
+      for (weak = opt.weak_digests; weak; weak = weak->next)
+        if (sig->digest_algo == weak->algo)
+          {
+            print_digest_rejected_note(sig->digest_algo);
+            return GPG_ERR_DIGEST_ALGO;
+          }
+    }
+
+  /* For key signatures check that the key has a cert usage.  We may
+   * do this only for subkeys because the primary may always issue key
+   * signature.  The latter may not be reflected in the pubkey_usage
+   * field because we need to check the key signatures to extract the
+   * key usage.  */
+  if (!pk->flags.primary
+      && IS_CERT (sig) && !(pk->pubkey_usage & PUBKEY_USAGE_CERT))
+    {
+      rc = gpg_error (GPG_ERR_WRONG_KEY_USAGE);
+      if (!opt.quiet)
+        log_info (_("bad key signature from key %s: %s (0x%02x, 0x%x)\n"),
+                  keystr_from_pk (pk), gpg_strerror (rc),
+                  sig->sig_class, pk->pubkey_usage);
+      return rc;
+    }
+
+  /* For data signatures check that the key has sign usage.  */
+  if (!IS_BACK_SIG (sig) && IS_SIG (sig)
+      && !(pk->pubkey_usage & PUBKEY_USAGE_SIG))
+    {
+      rc = gpg_error (GPG_ERR_WRONG_KEY_USAGE);
+      if (!opt.quiet)
+        log_info (_("bad data signature from key %s: %s (0x%02x, 0x%x)\n"),
+                  keystr_from_pk (pk), gpg_strerror (rc),
+                  sig->sig_class, pk->pubkey_usage);
+      return rc;
+    }
 
-    /* Convert the digest to an MPI.  */
-    result = encode_md_value (pk, digest, sig->digest_algo );
-    if (!result)
+  hash_sig_trailer (sig, digest, extrahash, extrahashlen);
+
+  /* Key signatures which have already been verified by us are found
+   * in the persistent cache.  */
+  use_cache = (!opt.no_sig_cache && (IS_CERT (sig) || IS_BACK_SIG (sig))
+               && !sig_cache_make_key (pk, sig, digest, cachekey));
+  if (use_cache && sig_cache_lookup (cachekey))
+    rc = 0;
+  else
+    {
+      /* Convert the digest to an MPI.  */
+      result = encode_md_value (pk, digest, sig->digest_algo );
+      if (!result)
         return GPG_ERR_GENERAL;
 
-    /* Verify the signature.  */
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("enter pk_verify");
-    rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("leave pk_verify");
-    gcry_mpi_release (result);
+      /* Verify the signature.  */
+      if (DBG_CLOCK && sig->sig_class <= 0x01)
+        log_clock ("enter pk_verify");
+      rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
+      if (DBG_CLOCK && sig->sig_class <= 0x01)
+        log_clock ("leave pk_verify");
+      gcry_mpi_release (result);
+      if (!rc && use_cache)
+        sig_cache_put (cachekey);
+    }
 
   if (!rc && sig->flags.unknown_critical)
     {
@@ -1249,3 +1273,296 @@ check_key_signature2 (ctrl_t ctrl,
 
   return rc;
 }
+
+
+/* Internal state for one item of check_key_signatures_parallel and
+ * check_self_signatures_parallel.  */
+struct sig_check_job_s
+{
+  PKT_signature *sig;      /* The signature to verify.  */
+  PKT_public_key *signer;  /* The signer's key or NULL if not prepared.  */
+  gcry_mpi_t hash;         /* The encoded digest to verify.  */
+  gpg_error_t err;         /* The result of the verification.  */
+  unsigned int signer_alloced:1; /* SIGNER needs to be released.  */
+  unsigned int use_cache:1;      /* CACHEKEY is valid.  */
+  unsigned char cachekey[SIG_CACHE_KEYLEN]; /* For the persistent cache.  */
+};
+
+
+/* Finish the preparation of JOB for the signature SIG by SIGNER over
+ * the data hashed into MD.  MD is closed.  Returns true if the public
+ * key operation still needs to be done.  */
+static int
+finish_sig_check_job (struct sig_check_job_s *job, PKT_signature *sig,
+                      PKT_public_key *signer, gcry_md_hd_t md)
+{
+  hash_sig_trailer (sig, md, NULL, 0);
+  job->use_cache = !sig_cache_make_key (signer, sig, md, job->cachekey);
+  if (job->use_cache && sig_cache_lookup (job->cachekey))
+    {
+      /* Found in the persistent cache.  */
+      gcry_md_close (md);
+      cache_sig_result (sig, 0);
+      return 0;
+    }
+  job->hash = encode_md_value (signer, md, sig->digest_algo);
+  gcry_md_close (md);
+  return !!job->hash;
+}
+
+
+/* Prepare the check of the signature NODE from keyblock ROOT so that
+ * only the public key operation needs to be done.  Returns true and
+ * fills JOB on success.  Returns false for all signatures which
+ * shall be verified by the regular code; this is the case for all
+ * signatures for which the regular code would print a diagnostic or
+ * where no shortcut for the signer is possible.  */
+static int
+prepare_sig_check_job (ctrl_t ctrl, kbnode_t root, kbnode_t node,
+                       struct sig_check_job_s *job)
+{
+  PKT_public_key *pripk = root->pkt->pkt.public_key;
+  PKT_signature *sig = node->pkt->pkt.signature;
+  PKT_public_key *signer;
+  const struct weakhash *weak;
+  kbnode_t n;
+  gcry_md_hd_t md;
+
+  if (sig->flags.checked || sig->flags.unknown_critical)
+    return 0;  /* Already cached or we want the diagnostic.  */
+  if (!IS_UID_SIG (sig) && !IS_UID_REV (sig))
+    return 0;
+  if (openpgp_pk_test_algo (sig->pubkey_algo)
+      || openpgp_md_test_algo (sig->digest_algo))
+    return 0;
+  if (!opt.flags.allow_weak_digest_algos)
+    for (weak = opt.weak_digests; weak; weak = weak->next)
+      if (sig->digest_algo == weak->algo)
+        return 0;
+  if (sig->digest_algo == DIGEST_ALGO_SHA1
+      && !opt.flags.allow_weak_key_signatures)
+    return 0;
+
+  /* Leave signatures issued by the key itself to the regular code;
+   * they do not require a key lookup anyway.  */
+  for (n = root; n; n = n->next)
+    if ((n->pkt->pkttype == PKT_PUBLIC_KEY
+         || n->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+        && !keyid_cmp (pk_keyid (n->pkt->pkt.public_key), sig->keyid))
+      return 0;
+
+  n = find_prev_kbnode (root, node, PKT_USER_ID);
+  if (!n)
+    return 0;
+
+  signer = xtrycalloc (1, sizeof *signer);
+  if (!signer)
+    return 0;
+  signer->req_usage = PUBKEY_USAGE_CERT;
+  if (get_pubkey_for_sig (ctrl, signer, sig)
+      || (!signer->flags.primary
+          && !(signer->pubkey_usage & PUBKEY_USAGE_CERT)))
+    {
+      free_public_key (signer);
+      return 0;
+    }
+
+  if (gcry_md_open (&md, sig->digest_algo, 0))
+    BUG ();
+  hash_public_key (md, pripk);
+  hash_uid_packet (n->pkt->pkt.user_id, md, sig);
+  if (!finish_sig_check_job (job, sig, signer, md))
+    {
+      free_public_key (signer);
+      return 0;
+    }
+
+  job->sig = sig;
+  job->signer = signer;
+  job->signer_alloced = 1;
+  return 1;
+}
+
+
+/* Prepare the check of the self-signature NODE of the keyblock ROOT.
+ * UIDNODE and SUBNODE are the last user id and the last subkey node
+ * seen before NODE.  This is the counterpart to
+ * prepare_sig_check_job for signatures issued by the primary key and
+ * follows the rules of check_key_signature2.  */
+static int
+prepare_self_sig_job (kbnode_t root, kbnode_t node,
+                      kbnode_t uidnode, kbnode_t subnode,
+                      struct sig_check_job_s *job)
+{
+  PKT_public_key *pripk = root->pkt->pkt.public_key;
+  PKT_signature *sig = node->pkt->pkt.signature;
+  const struct weakhash *weak;
+  gcry_md_hd_t md;
+
+  if (sig->flags.checked || sig->flags.unknown_critical)
+    return 0;
+  if (keyid_cmp (pk_keyid (pripk), sig->keyid))
+    return 0;  /* Not a self-signature.  */
+  if (openpgp_pk_test_algo (sig->pubkey_algo)
+      || openpgp_md_test_algo (sig->digest_algo)
+      || sig->pubkey_algo != pripk->pubkey_algo)
+    return 0;
+  if (!opt.flags.allow_weak_digest_algos)
+    for (weak = opt.weak_digests; weak; weak = weak->next)
+      if (sig->digest_algo == weak->algo)
+        return 0;
+
+  if (IS_KEY_SIG (sig) || IS_KEY_REV (sig))
+    {
+      if (gcry_md_open (&md, sig->digest_algo, 0))
+        BUG ();
+      hash_public_key (md, pripk);
+    }
+  else if (IS_SUBKEY_SIG (sig) || IS_SUBKEY_REV (sig))
+    {
+      if (!subnode)
+        return 0;  /* Let the regular code print the diagnostic.  */
+      if (gcry_md_open (&md, sig->digest_algo, 0))
+        BUG ();
+      hash_public_key (md, pripk);
+      hash_public_key (md, subnode->pkt->pkt.public_key);
+    }
+  else if (IS_UID_SIG (sig) || IS_UID_REV (sig))
+    {
+      if (!uidnode)
+        return 0;
+      if (gcry_md_open (&md, sig->digest_algo, 0))
+        BUG ();
+      hash_public_key (md, pripk);
+      hash_uid_packet (uidnode->pkt->pkt.user_id, md, sig);
+    }
+  else
+    return 0;
+
+  if (!finish_sig_check_job (job, sig, pripk, md))
+    return 0;
+
+  job->sig = sig;
+  job->signer = pripk;
+  job->signer_alloced = 0;
+  return 1;
+}
+
+
+/* Worker function for run_parallel; OPAQUE is the array of jobs.  */
+static void
+sig_check_worker (void *opaque, int idx)
+{
+  struct sig_check_job_s *job = (struct sig_check_job_s *)opaque + idx;
+
+  if (job->signer)
+    job->err = pk_verify (job->signer->pubkey_algo, job->hash,
+                          job->sig->data, job->signer->pkey);
+}
+
+
+/* Run the NJOBS prepared JOBS using up to NTHREADS threads and store
+ * the results in the signature cache.  The jobs are released.  */
+static void
+run_sig_check_jobs (struct sig_check_job_s *jobs, int njobs, int nthreads)
+{
+  int i;
+
+  run_parallel (nthreads, njobs, sig_check_worker, jobs);
+
+  /* Store the results in the order of the jobs.  */
+  for (i=0; i < njobs; i++)
+    {
+      if (!jobs[i].signer)
+        continue;
+      cache_sig_result (jobs[i].sig, jobs[i].err);
+      if (!jobs[i].err && jobs[i].use_cache)
+        sig_cache_put (jobs[i].cachekey);
+      gcry_mpi_release (jobs[i].hash);
+      if (jobs[i].signer_alloced)
+        free_public_key (jobs[i].signer);
+    }
+}
+
+
+/* Verify the key signatures described by ITEMS using up to NTHREADS
+ * threads and store the results in the signature cache of the
+ * signature packets.  A later check_key_signature will then use the
+ * cached result.  Signatures which can't be handled here are left
+ * alone and checked by check_key_signature as usual.  This function
+ * does nothing if the signature cache has been disabled.  */
+void
+check_key_signatures_parallel (ctrl_t ctrl,
+                               struct sig_check_item_s *items, int nitems,
+                               int nthreads)
+{
+  struct sig_check_job_s *jobs;
+  int i;
+
+  if (opt.no_sig_cache || nitems < 1)
+    return;
+
+  jobs = xtrycalloc (nitems, sizeof *jobs);
+  if (!jobs)
+    return;
+  for (i=0; i < nitems; i++)
+    prepare_sig_check_job (ctrl, items[i].root, items[i].node, jobs + i);
+
+  run_sig_check_jobs (jobs, nitems, nthreads);
+  xfree (jobs);
+}
+
+
+/* Verify the self-signatures of the NKEYBLOCKS public keyblocks at
+ * KEYBLOCKS using up to NTHREADS threads and store the results in the
+ * signature cache of the signature packets.  As with
+ * check_key_signatures_parallel, signatures not handled here are left
+ * to check_key_signature.  Entries of KEYBLOCKS which are NULL or do
+ * not start with a public key are skipped.  */
+void
+check_self_signatures_parallel (kbnode_t *keyblocks, int nkeyblocks,
+                                int nthreads)
+{
+  struct sig_check_job_s *jobs;
+  kbnode_t node, uidnode, subnode;
+  int i, njobs, nsigs;
+
+  if (opt.no_sig_cache || nkeyblocks < 1 || nthreads < 1)
+    return;
+
+  nsigs = 0;
+  for (i=0; i < nkeyblocks; i++)
+    if (keyblocks[i] && keyblocks[i]->pkt->pkttype == PKT_PUBLIC_KEY)
+      for (node = keyblocks[i]; node; node = node->next)
+        if (node->pkt->pkttype == PKT_SIGNATURE)
+          nsigs++;
+  if (!nsigs)
+    return;
+
+  jobs = xtrycalloc (nsigs, sizeof *jobs);
+  if (!jobs)
+    return;
+
+  njobs = 0;
+  for (i=0; i < nkeyblocks; i++)
+    {
+      if (!keyblocks[i] || keyblocks[i]->pkt->pkttype != PKT_PUBLIC_KEY)
+        continue;
+      uidnode = subnode = NULL;
+      for (node = keyblocks[i]; node; node = node->next)
+        {
+          if (node->pkt->pkttype == PKT_USER_ID)
+            uidnode = node;
+          else if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+            subnode = node;
+          else if (node->pkt->pkttype == PKT_SIGNATURE
+                   && prepare_self_sig_job (keyblocks[i], node,
+                                            uidnode, subnode, jobs + njobs))
+            njobs++;
+        }
+    }
+
+  if (njobs)
+    run_sig_check_jobs (jobs, njobs, nthreads);
+  xfree (jobs);
+}
@@ -42,6 +42,7 @@
 #include "call-agent.h"
 #include "../common/mbox-util.h"
 #include "../common/compliance.h"
+#include "timing.h"
 
 #ifdef HAVE_DOSISH_SYSTEM
 #define LF "\r\n"
@@ -172,16 +173,14 @@ mk_notation_policy_etc (ctrl_t ctrl, PKT_signature *sig,
   /* Set signer's user id.  */
   if (IS_SIG (sig) && !opt.flags.disable_signer_uid)
     {
-      char *mbox;
+      const char *mbox;
 
       /* For now we use the uid which was used to locate the key.  */
-      if (pksk->user_id
-          && (mbox = mailbox_from_userid (pksk->user_id->name, 0)))
+      if (pksk->user_id && (mbox = user_id_mbox (pksk->user_id)))
         {
           if (DBG_LOOKUP)
             log_debug ("setting Signer's UID to '%s'\n", mbox);
           build_sig_subpkt (sig, SIGSUBPKT_SIGNERS_UID, mbox, strlen (mbox));
-          xfree (mbox);
         }
       else if (opt.sender_list)
         {
@@ -402,12 +401,15 @@ do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
     {
       char *desc;
       gcry_sexp_t s_sigval;
+      timing_span_t span;
 
       desc = gpg_format_keydesc (ctrl, pksk, FORMAT_KEYDESC_NORMAL, 1);
+      timing_begin (&span, "pk_sign");
       err = agent_pksign (NULL/*ctrl*/, cache_nonce, hexgrip, desc,
                           pksk->keyid, pksk->main_keyid, pksk->pubkey_algo,
                           dp, gcry_md_get_algo_dlen (mdalgo), mdalgo,
                           &s_sigval);
+      timing_end (&span);
       xfree (desc);
 
       if (err)
@@ -817,7 +819,7 @@ write_plaintext_packet (iobuf_t out, iobuf_t inp,
  */
 static int
 write_signature_packets (ctrl_t ctrl,
-                         SK_LIST sk_list, IOBUF out, gcry_md_hd_t hash,
+                         SK_LIST sk_list, IOBUF out, md_filter_context_t *mfx,
                          pt_extra_hash_data_t extrahash,
                          int sigclass, u32 timestamp, u32 duration,
 			 int status_letter, const char *cache_nonce)
@@ -855,7 +857,7 @@ write_signature_packets (ctrl_t ctrl,
         sig->expiredate = sig->timestamp + duration;
       sig->sig_class = sigclass;
 
-      if (gcry_md_copy (&md, hash))
+      if (gcry_md_copy (&md, md_filter_get_md (mfx, sig->digest_algo)))
         BUG ();
 
       build_sig_subpkt_from_sig (sig, pk);
@@ -1107,6 +1109,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 
   for (sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
     gcry_md_enable (mfx.md, hash_for (sk_rover->pk));
+  md_filter_use_parallel (&mfx);
 
   if (!multifile)
     iobuf_push_filter (inp, md_filter, &mfx);
@@ -1152,6 +1155,13 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
                     compress_algo_to_string (compr_algo), compr_algo);
         }
 
+      /* When only signing we may skip the compression of data which
+       * can't be compressed anyway.  When encrypting we leave the
+       * decision to compress to the preferences.  */
+      if (compr_algo && inp && !encryptflag
+          && skip_compression_p (inp, fname))
+        compr_algo = 0;
+
       /* Algo 0 means no compression. */
       if (compr_algo)
         push_compress_filter (out, &zfx, compr_algo);
@@ -1233,7 +1243,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
     goto leave;
 
   /* Write the signatures. */
-  rc = write_signature_packets (ctrl, sk_list, out, mfx.md, extrahash,
+  rc = write_signature_packets (ctrl, sk_list, out, &mfx, extrahash,
                                 opt.textmode && !outfile? 0x01 : 0x00,
                                 0, duration, detached ? 'D':'S', NULL);
   if (rc)
@@ -1250,7 +1260,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
         write_status (STATUS_END_ENCRYPTION);
     }
   iobuf_close (inp);
-  gcry_md_close (mfx.md);
+  free_md_filter_context (&mfx);
   release_sk_list (sk_list);
   release_pk_list (pk_list);
   recipient_digest_algo = 0;
@@ -1271,6 +1281,7 @@ clearsign_file (ctrl_t ctrl,
   armor_filter_context_t *afx;
   progress_filter_context_t *pfx;
   gcry_md_hd_t textmd = NULL;
+  md_filter_context_t mfx;
   iobuf_t inp = NULL;
   iobuf_t out = NULL;
   PACKET pkt;
@@ -1379,15 +1390,20 @@ clearsign_file (ctrl_t ctrl,
   if (DBG_HASHING)
     gcry_md_debug (textmd, "clearsign");
 
-  copy_clearsig_text (out, inp, textmd, !opt.not_dash_escaped, opt.escape_from);
+  rc = copy_clearsig_text (out, inp, textmd,
+                           !opt.not_dash_escaped, opt.escape_from);
   /* fixme: check for read errors */
+  if (rc)
+    goto leave;
 
   /* Now write the armor. */
   afx->what = 2;
   push_armor_filter (afx, out);
 
   /* Write the signatures.  */
-  rc = write_signature_packets (ctrl, sk_list, out, textmd, NULL, 0x01, 0,
+  memset (&mfx, 0, sizeof mfx);
+  mfx.md = textmd;
+  rc = write_signature_packets (ctrl, sk_list, out, &mfx, NULL, 0x01, 0,
                                 duration, 'C', NULL);
   if (rc)
     goto leave;
@@ -1406,6 +1422,88 @@ clearsign_file (ctrl_t ctrl,
 }
 
 
+/* The state to create many detached signatures with the same keys.
+ * This is used by the server to avoid the key lookup and the digest
+ * setup for each signature.  */
+struct sign_batch_s
+{
+  SK_LIST sk_list;
+  gcry_md_hd_t md;   /* All required digest algorithms are enabled.  */
+  u32 duration;
+};
+
+
+/* Prepare to create detached signatures with the keys from LOCUSR.
+ * On success the new batch context is stored at R_BATCH.  */
+gpg_error_t
+sign_batch_new (ctrl_t ctrl, strlist_t locusr, sign_batch_t *r_batch)
+{
+  gpg_error_t err;
+  sign_batch_t batch;
+  SK_LIST sk_rover;
+
+  *r_batch = NULL;
+
+  batch = xtrycalloc (1, sizeof *batch);
+  if (!batch)
+    return gpg_error_from_syserror ();
+
+  err = build_sk_list (ctrl, locusr, &batch->sk_list, PUBKEY_USAGE_SIG);
+  if (!err)
+    err = gcry_md_open (&batch->md, 0, 0);
+  if (err)
+    {
+      sign_batch_release (batch);
+      return err;
+    }
+  if (DBG_HASHING)
+    gcry_md_debug (batch->md, "sign-batch");
+  for (sk_rover = batch->sk_list; sk_rover; sk_rover = sk_rover->next)
+    gcry_md_enable (batch->md, hash_for (sk_rover->pk));
+
+  batch->duration = parse_expire_string (opt.def_sig_expire);
+
+  *r_batch = batch;
+  return 0;
+}
+
+
+void
+sign_batch_release (sign_batch_t batch)
+{
+  if (!batch)
+    return;
+
+  release_sk_list (batch->sk_list);
+  gcry_md_close (batch->md);
+  xfree (batch);
+}
+
+
+/* Create a detached binary signature over the data read from INP
+ * using the keys of BATCH and write it to OUT.  */
+gpg_error_t
+sign_batch_data (ctrl_t ctrl, sign_batch_t batch, iobuf_t inp, iobuf_t out)
+{
+  gpg_error_t err;
+  md_filter_context_t mfx;
+  byte buffer[8192];
+  int n;
+
+  gcry_md_reset (batch->md);
+  while ((n = iobuf_read (inp, buffer, sizeof buffer)) != -1)
+    gcry_md_write (batch->md, buffer, n);
+  err = iobuf_error (inp);
+  if (err)
+    return err;
+
+  memset (&mfx, 0, sizeof mfx);
+  mfx.md = batch->md;
+  return write_signature_packets (ctrl, batch->sk_list, out, &mfx, NULL,
+                                  0x00, 0, batch->duration, 'D', NULL);
+}
+
+
 /*
  * Sign and conventionally encrypt the given file.
  * FIXME: Far too much code is duplicated - revamp the whole file.
@@ -1507,6 +1605,7 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
 
   for (sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
     gcry_md_enable (mfx.md, hash_for (sk_rover->pk));
+  md_filter_use_parallel (&mfx);
 
   iobuf_push_filter (inp, md_filter, &mfx);
 
@@ -1561,7 +1660,7 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
 
   /* Write the signatures.  */
   /* (current filters: zip - encrypt - armor) */
-  rc = write_signature_packets (ctrl, sk_list, out, mfx.md, extrahash,
+  rc = write_signature_packets (ctrl, sk_list, out, &mfx, extrahash,
                                 opt.textmode? 0x01 : 0x00,
                                 0, duration, 'S', NULL);
   if (rc)
@@ -1578,7 +1677,7 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
     }
   iobuf_close (inp);
   release_sk_list (sk_list);
-  gcry_md_close (mfx.md);
+  free_md_filter_context (&mfx);
   xfree (cfx.dek);
   xfree (s2k);
   release_progress_context (pfx);
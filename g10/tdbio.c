@@ -27,6 +27,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "gpg.h"
 #include "../common/status.h"
@@ -64,7 +67,8 @@
 typedef struct cache_ctrl_struct *CACHE_CTRL;
 struct cache_ctrl_struct
 {
-  CACHE_CTRL next;
+  CACHE_CTRL next;   /* Next item in the list of all items.  */
+  CACHE_CTRL hnext;  /* Next item in the hash bucket or unused list.  */
   struct {
     unsigned used:1;
     unsigned dirty:1;
@@ -77,12 +81,21 @@ struct cache_ctrl_struct
    transaction this may not be sufficient and thus we may increase it
    then up to the HARD limit.  */
 #define MAX_CACHE_ENTRIES_SOFT	200
-#define MAX_CACHE_ENTRIES_HARD	10000
+#define MAX_CACHE_ENTRIES_HARD	200000
+
+/* The used items are found by a hash table over the record number.
+ * With the large cache of a transaction a linear search would take
+ * far too long.  */
+#define CACHE_HASH_SIZE 4096
+#define CACHE_HASH(recno) ((recno) % CACHE_HASH_SIZE)
 
 
 /* The cache is controlled by these variables.  */
 static CACHE_CTRL cache_list;
+static CACHE_CTRL cache_hash[CACHE_HASH_SIZE];
+static CACHE_CTRL cache_unused;
 static int cache_entries;
+static int cache_dirty_entries;
 static int cache_is_dirty;
 
 
@@ -114,8 +127,34 @@ static unsigned int is_locked;
 /* The file descriptor of the trustdb.  */
 static int  db_fd = -1;
 
-/* A flag indicating that a transaction is active.  */
-/* static int in_transaction;   Not yet used. */
+/* A counter incremented with each change of the trustdb; see
+ * tdbio_get_generation.  The size and modification time of the file
+ * are used to detect changes done by other processes.  */
+static unsigned long db_generation;
+static struct
+{
+  off_t size;
+  time_t mtime;
+  long nsec;
+} db_stat;
+
+#ifdef HAVE_MMAP
+/* The trustdb mapped read-only into memory.  Records not in the
+ * cache are read from this mapping so that a lookup does not need
+ * any system call.  Writes are still done with write(2) from the
+ * dirty records of the cache; the shared mapping sees them.  The
+ * mapping covers the first DB_MAPLEN bytes of the file and is
+ * extended when a record beyond it is requested and the file has
+ * grown.  */
+static const byte *db_map;
+static size_t db_maplen;
+static int db_map_disabled;
+#endif /*HAVE_MMAP*/
+
+/* A flag indicating that a transaction is active and another one
+ * that dirty records had to be written before its end.  */
+static int in_transaction;
+static int transaction_flushed;
 
 
 
@@ -188,6 +227,46 @@ release_write_lock (void)
  ************* record cache **********
  *************************************/
 
+/*
+ * Return the used cache item for RECNO or NULL.
+ */
+static CACHE_CTRL
+cache_lookup (ulong recno)
+{
+  CACHE_CTRL r;
+
+  for (r = cache_hash[CACHE_HASH (recno)]; r; r = r->hnext)
+    if (r->recno == recno)
+      return r;
+  return NULL;
+}
+
+
+/*
+ * Remove the used cache item R from the hash table and put it on the
+ * list of unused items.
+ */
+static void
+cache_release_item (CACHE_CTRL r)
+{
+  CACHE_CTRL *rp;
+
+  for (rp = &cache_hash[CACHE_HASH (r->recno)]; *rp; rp = &(*rp)->hnext)
+    if (*rp == r)
+      {
+        *rp = r->hnext;
+        break;
+      }
+  if (r->flags.dirty)
+    cache_dirty_entries--;
+  r->flags.used = 0;
+  r->flags.dirty = 0;
+  r->hnext = cache_unused;
+  cache_unused = r;
+  cache_entries--;
+}
+
+
 /*
  * Get the data from the record cache and return a pointer into that
  * cache.  Caller should copy the returned data.  NULL is returned on
@@ -198,13 +277,81 @@ get_record_from_cache (ulong recno)
 {
   CACHE_CTRL r;
 
-  for (r = cache_list; r; r = r->next)
+  r = cache_lookup (recno);
+  return r? r->data : NULL;
+}
+
+
+#ifdef HAVE_MMAP
+/*
+ * Map the trustdb or extend an existing mapping to the current size
+ * of the file.  On failure the mapping is not used anymore.
+ */
+static void
+update_db_map (void)
+{
+  struct stat st;
+  size_t len;
+  void *p;
+
+  if (db_map_disabled)
+    return;
+
+  if (fstat (db_fd, &st))
+    {
+      db_map_disabled = 1;
+      return;
+    }
+  if (st.st_size <= db_maplen)
+    return;
+  if ((unsigned long long)st.st_size > (size_t)(-1))
+    len = (size_t)(-1);
+  else
+    len = st.st_size;
+  len -= len % TRUST_RECORD_LEN;
+  if (len <= db_maplen)
+    return;
+
+  if (db_map)
     {
-      if (r->flags.used && r->recno == recno)
-        return r->data;
+      munmap ((void*)db_map, db_maplen);
+      db_map = NULL;
+      db_maplen = 0;
     }
-  return NULL;
+  p = mmap (NULL, len, PROT_READ, MAP_SHARED, db_fd, 0);
+  if (p == MAP_FAILED)
+    {
+      if (DBG_CACHE)
+        log_debug ("trustdb: mmap failed: %s\n", strerror (errno));
+      db_map_disabled = 1;
+      return;
+    }
+#ifdef MADV_RANDOM
+  madvise (p, len, MADV_RANDOM);
+#endif
+  db_map = p;
+  db_maplen = len;
+}
+
+
+/*
+ * Return a pointer to the record RECNUM in the mapped trustdb or NULL
+ * if the record is not mapped.
+ */
+static const byte *
+get_record_from_map (ulong recnum)
+{
+  if (db_map_disabled)
+    return NULL;
+  if ((unsigned long long)(recnum + 1) * TRUST_RECORD_LEN > db_maplen)
+    {
+      update_db_map ();
+      if ((unsigned long long)(recnum + 1) * TRUST_RECORD_LEN > db_maplen)
+        return NULL;
+    }
+  return db_map + (size_t)recnum * TRUST_RECORD_LEN;
 }
+#endif /*HAVE_MMAP*/
 
 
 /*
@@ -234,6 +381,7 @@ write_cache_item (CACHE_CTRL r)
       return err;
     }
   r->flags.dirty = 0;
+  cache_dirty_entries--;
   return 0;
 }
 
@@ -247,176 +395,104 @@ write_cache_item (CACHE_CTRL r)
 static int
 put_record_into_cache (ulong recno, const char *data)
 {
-  CACHE_CTRL r, unused;
-  int dirty_count = 0;
-  int clean_count = 0;
+  CACHE_CTRL r;
+  int n;
 
   /* See whether we already cached this one.  */
-  for (unused = NULL, r = cache_list; r; r = r->next)
+  r = cache_lookup (recno);
+  if (r)
     {
-      if (!r->flags.used)
+      if (!r->flags.dirty && memcmp (r->data, data, TRUST_RECORD_LEN))
         {
-          if (!unused)
-            unused = r;
-	}
-      else if (r->recno == recno)
-        {
-          if (!r->flags.dirty)
-            {
-              /* Hmmm: should we use a copy and compare? */
-              if (memcmp (r->data, data, TRUST_RECORD_LEN))
-                {
-                  r->flags.dirty = 1;
-                  cache_is_dirty = 1;
-		}
-	    }
-          memcpy (r->data, data, TRUST_RECORD_LEN);
-          return 0;
-	}
-      if (r->flags.used)
-        {
-          if (r->flags.dirty)
-            dirty_count++;
-          else
-            clean_count++;
-	}
-    }
-
-  /* Not in the cache: add a new entry. */
-  if (unused)
-    {
-      /* Reuse this entry. */
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
+          r->flags.dirty = 1;
+          cache_dirty_entries++;
+          cache_is_dirty = 1;
+        }
       memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
       return 0;
     }
 
-  /* See whether we reached the limit. */
-  if (cache_entries < MAX_CACHE_ENTRIES_SOFT)
+  /* Not in the cache: add a new entry.  If there is no unused entry
+   * we allocate a new one as long as we are below the limit.  While
+   * in a transaction we do not want to write anything and thus the
+   * hard limit is used.  */
+  if (!cache_unused
+      && (cache_entries < MAX_CACHE_ENTRIES_SOFT
+          || (in_transaction && cache_entries < MAX_CACHE_ENTRIES_HARD)))
     {
-      /* No: Put into cache.  */
       r = xmalloc (sizeof *r);
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
+      r->flags.used = 0;
+      r->flags.dirty = 0;
       r->next = cache_list;
       cache_list = r;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
+      r->hnext = cache_unused;
+      cache_unused = r;
+      if (in_transaction && DBG_CACHE && cache_entries >= MAX_CACHE_ENTRIES_SOFT
+          && !(cache_entries % 1000))
+        log_debug ("increasing tdbio cache size\n");
     }
-
-  /* Cache is full: discard some clean entries.  */
-  if (clean_count)
+  else if (!cache_unused && cache_entries > cache_dirty_entries)
     {
-      int n;
-
-      /* We discard a third of the clean entries.  */
-      n = clean_count / 3;
+      /* Cache is full: We discard a third of the clean entries.  */
+      n = (cache_entries - cache_dirty_entries) / 3;
       if (!n)
         n = 1;
 
-      for (unused = NULL, r = cache_list; r; r = r->next)
-        {
-          if (r->flags.used && !r->flags.dirty)
-            {
-              if (!unused)
-                unused = r;
-              r->flags.used = 0;
-              cache_entries--;
-              if (!--n)
-                break;
-	    }
-	}
-
-      /* Now put into the cache.  */
-      log_assert (unused);
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
+      for (r = cache_list; r && n; r = r->next)
+        if (r->flags.used && !r->flags.dirty)
+          {
+            cache_release_item (r);
+            n--;
+          }
     }
-
-  /* No clean entries: We have to flush some dirty entries.  */
-#if 0 /* Transactions are not yet used.  */
-  if (in_transaction)
+  else if (!cache_unused)
     {
-      /* But we can't do this while in a transaction.  Thus we
-       * increase the cache size instead.  */
-      if (cache_entries < MAX_CACHE_ENTRIES_HARD)
+      /* No clean entries: We have to flush some dirty entries.  In a
+       * transaction this means that the transaction can't be
+       * cancelled anymore; but that is better than failing.  */
+      if (in_transaction)
         {
-          if (opt.debug && !(cache_entries % 100))
-            log_debug ("increasing tdbio cache size\n");
-          r = xmalloc (sizeof *r);
-          r->flags.used = 1;
-          r->recno = recno;
-          memcpy (r->data, data, TRUST_RECORD_LEN);
-          r->flags.dirty = 1;
-          r->next = cache_list;
-          cache_list = r;
-          cache_is_dirty = 1;
-          cache_entries++;
-          return 0;
-	}
-      /* Hard limit for the cache size reached.  */
-      log_info (_("trustdb transaction too large\n"));
-      return GPG_ERR_RESOURCE_LIMIT;
-    }
-#endif
-
-  if (dirty_count)
-    {
-      int n;
+          if (!transaction_flushed)
+            log_info (_("trustdb transaction too large\n"));
+          transaction_flushed = 1;
+        }
 
-      /* Discard some dirty entries. */
-      n = dirty_count / 5;
+      n = cache_dirty_entries / 5;
       if (!n)
         n = 1;
 
       take_write_lock ();
-      for (unused = NULL, r = cache_list; r; r = r->next)
-        {
-          if (r->flags.used && r->flags.dirty)
-            {
-              int rc;
-
-              rc = write_cache_item (r);
-              if (rc)
+      for (r = cache_list; r && n; r = r->next)
+        if (r->flags.used && r->flags.dirty)
+          {
+            int rc;
+
+            rc = write_cache_item (r);
+            if (rc)
+              {
+                release_write_lock ();
                 return rc;
-              if (!unused)
-                unused = r;
-              r->flags.used = 0;
-              cache_entries--;
-              if (!--n)
-                break;
-	    }
-	}
+              }
+            cache_release_item (r);
+            n--;
+          }
       release_write_lock ();
-
-      /* Now put into the cache.  */
-      log_assert (unused);
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
     }
 
-  /* We should never reach this.  */
-  BUG();
+  /* Now put into the cache.  */
+  log_assert (cache_unused);
+  r = cache_unused;
+  cache_unused = r->hnext;
+  r->flags.used = 1;
+  r->flags.dirty = 1;
+  r->recno = recno;
+  memcpy (r->data, data, TRUST_RECORD_LEN);
+  r->hnext = cache_hash[CACHE_HASH (recno)];
+  cache_hash[CACHE_HASH (recno)] = r;
+  cache_entries++;
+  cache_dirty_entries++;
+  cache_is_dirty = 1;
+  return 0;
 }
 
 
@@ -429,7 +505,8 @@ tdbio_is_dirty()
 
 
 /*
- * Flush the cache.  This cannot be used while in a transaction.
+ * Flush the cache.  While in a transaction this does nothing; the
+ * cache is then flushed by tdbio_end_transaction.
  */
 int
 tdbio_sync()
@@ -439,10 +516,8 @@ tdbio_sync()
 
     if( db_fd == -1 )
 	open_db();
-#if 0 /* Transactions are not yet used.  */
     if( in_transaction )
-	log_bug("tdbio: syncing while in transaction\n");
-#endif
+	return 0;
 
     if( !cache_is_dirty )
 	return 0;
@@ -453,8 +528,11 @@ tdbio_sync()
     for( r = cache_list; r; r = r->next ) {
 	if( r->flags.used && r->flags.dirty ) {
 	    int rc = write_cache_item( r );
-	    if( rc )
+	    if( rc ) {
+		if (did_lock)
+		    release_write_lock ();
 		return rc;
+	    }
 	}
     }
     cache_is_dirty = 0;
@@ -465,17 +543,16 @@ tdbio_sync()
 }
 
 
-#if 0  /* Not yet used.  */
 /*
  * Simple transactions system:
  * Everything between begin_transaction and end/cancel_transaction
  * is not immediately written but at the time of end_transaction.
- *
- * NOTE: The transaction code is disabled in the 1.2 branch, as it is
- * not yet used.
+ * Only if the transaction is too large for the cache, records are
+ * written earlier.  Thus a complete update of the trustdb is written
+ * in one go and synced to the disk only once.
  */
 int
-tdbio_begin_transaction ()  /* Not yet used.  */
+tdbio_begin_transaction (void)
 {
   int rc;
 
@@ -486,11 +563,17 @@ tdbio_begin_transaction ()  /* Not yet used.  */
   if (rc)
     return rc;
   in_transaction = 1;
+  transaction_flushed = 0;
   return 0;
 }
 
+
+/*
+ * Write all records of the current transaction and make sure that
+ * they are on the disk.
+ */
 int
-tdbio_end_transaction ()  /* Not yet used.  */
+tdbio_end_transaction (void)
 {
   int rc;
 
@@ -500,13 +583,26 @@ tdbio_end_transaction ()  /* Not yet used.  */
   gnupg_block_all_signals ();
   in_transaction = 0;
   rc = tdbio_sync();
+#ifdef HAVE_FSYNC
+  if (!rc && fsync (db_fd))
+    {
+      rc = gpg_error_from_syserror ();
+      log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc));
+    }
+#endif
   gnupg_unblock_all_signals();
   release_write_lock ();
   return rc;
 }
 
+
+/*
+ * Forget all changes of the current transaction.  Changes which had
+ * to be written early because the transaction was too large can't be
+ * undone; an error is returned in this case.
+ */
 int
-tdbio_cancel_transaction () /* Not yet used.  */
+tdbio_cancel_transaction (void)
 {
   CACHE_CTRL r;
 
@@ -520,18 +616,14 @@ tdbio_cancel_transaction () /* Not yet used.  */
       for (r = cache_list; r; r = r->next)
         {
           if (r->flags.used && r->flags.dirty)
-            {
-              r->flags.used = 0;
-              cache_entries--;
-	    }
+            cache_release_item (r);
 	}
       cache_is_dirty = 0;
     }
 
   in_transaction = 0;
-  return 0;
+  return transaction_flushed? gpg_error (GPG_ERR_INV_STATE) : 0;
 }
-#endif  /* Not yet used.  */
 
 
 
@@ -1522,6 +1614,10 @@ tdbio_read_record (ulong recnum, TRUSTREC *rec, int expected)
     open_db ();
 
   buf = get_record_from_cache( recnum );
+#ifdef HAVE_MMAP
+  if (!buf)
+    buf = get_record_from_map (recnum);
+#endif
   if (!buf)
     {
       if (lseek (db_fd, recnum * TRUST_RECORD_LEN, SEEK_SET) == -1)
@@ -1671,6 +1767,8 @@ tdbio_write_record (ctrl_t ctrl, TRUSTREC *rec)
   if (db_fd == -1)
     open_db ();
 
+  db_generation++;
+
   memset (buf, 0, TRUST_RECORD_LEN);
   p = buf;
   *p++ = rec->rectype; p++;
@@ -1792,6 +1890,37 @@ tdbio_delete_record (ctrl_t ctrl, ulong recnum)
 }
 
 
+/*
+ * Return a value which changes with each change of the trustdb.  This
+ * is used to invalidate data derived from the trustdb.
+ */
+unsigned long
+tdbio_get_generation (void)
+{
+  struct stat sb;
+  long nsec;
+
+  if (db_name && !stat (db_name, &sb))
+    {
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+      nsec = sb.st_mtim.tv_nsec;
+#else
+      nsec = 0;
+#endif
+      if (sb.st_size != db_stat.size || sb.st_mtime != db_stat.mtime
+          || nsec != db_stat.nsec)
+        {
+          db_stat.size = sb.st_size;
+          db_stat.mtime = sb.st_mtime;
+          db_stat.nsec = nsec;
+          db_generation++;
+        }
+    }
+
+  return db_generation;
+}
+
+
 /*
  * Create a new record and return its record number.
  */
@@ -105,6 +105,7 @@ ulong tdbio_read_nextcheck (void);
 int tdbio_write_nextcheck (ctrl_t ctrl, ulong stamp);
 int tdbio_is_dirty(void);
 int tdbio_sync(void);
+unsigned long tdbio_get_generation (void);
 int tdbio_begin_transaction(void);
 int tdbio_end_transaction(void);
 int tdbio_cancel_transaction(void);
@@ -42,22 +42,19 @@
 			  /* to make sure that a warning is displayed while */
 			  /* creating a message */
 
+/* The size of the blocks used by copy_clearsig_text to hash and to
+ * write the text.  */
+#define CLEARSIG_BLOCKSIZE 32768
+
 static unsigned
 len_without_trailing_chars( byte *line, unsigned len, const char *trimchars )
 {
-    byte *p, *mark;
-    unsigned n;
-
-    for(mark=NULL, p=line, n=0; n < len; n++, p++ ) {
-	if( strchr( trimchars, *p ) ) {
-	    if( !mark )
-		mark = p;
-	}
-	else
-	    mark = NULL;
-    }
+    /* Scan from the end so that only the trailing characters are
+     * looked at.  */
+    while( len && strchr( trimchars, line[len-1] ) )
+	len--;
 
-    return mark? (mark - line) : len;
+    return len;
 }
 
 
@@ -74,8 +71,15 @@ standard( text_filter_context_t *tfx, IOBUF a,
     while( !rc && len < size ) {
 	int lf_seen;
 
-	while( len < size && tfx->buffer_pos < tfx->buffer_len )
-	    buf[len++] = tfx->buffer[tfx->buffer_pos++];
+	if( tfx->buffer_pos < tfx->buffer_len ) {
+	    size_t n = tfx->buffer_len - tfx->buffer_pos;
+
+	    if( n > size - len )
+		n = size - len;
+	    memcpy( buf + len, tfx->buffer + tfx->buffer_pos, n );
+	    len += n;
+	    tfx->buffer_pos += n;
+	}
 	if( len >= size )
 	    continue;
 
@@ -154,9 +158,56 @@ text_filter( void *opaque, int control,
 }
 
 
+/* A buffer used by copy_clearsig_text to collect the lines.  Either
+ * MD or OUT is set; a full buffer is passed to it.  */
+struct clearsig_buffer_s
+{
+    gcry_md_hd_t md;
+    IOBUF out;
+    size_t used;
+    byte buf[CLEARSIG_BLOCKSIZE];
+};
+
+
+static void
+flush_clearsig_buffer( struct clearsig_buffer_s *cb )
+{
+    if( !cb->used )
+	return;
+    if( cb->md )
+	gcry_md_write( cb->md, cb->buf, cb->used );
+    else
+	iobuf_write( cb->out, cb->buf, cb->used );
+    cb->used = 0;
+}
+
+
+/* Append (DATA,LEN) to the buffer CB.  */
+static void
+put_clearsig_buffer( struct clearsig_buffer_s *cb,
+		     const void *data, size_t len )
+{
+    if( cb->used + len > sizeof cb->buf ) {
+	flush_clearsig_buffer( cb );
+	if( len > sizeof cb->buf ) {
+	    if( cb->md )
+		gcry_md_write( cb->md, data, len );
+	    else
+		iobuf_write( cb->out, data, len );
+	    return;
+	}
+    }
+    memcpy( cb->buf + cb->used, data, len );
+    cb->used += len;
+}
+
+
 /****************
  * Copy data from INP to OUT and do some escaping if requested.
  * md is updated as required by rfc2440
+ *
+ * The lines are collected in blocks so that the digest and the
+ * output are not updated for each line.
  */
 int
 copy_clearsig_text( IOBUF out, IOBUF inp, gcry_md_hd_t md,
@@ -168,10 +219,25 @@ copy_clearsig_text( IOBUF out, IOBUF inp, gcry_md_hd_t md,
     unsigned int n;
     int truncated = 0;
     int pending_lf = 0;
+    struct clearsig_buffer_s *hashbuf, *outbuf;
 
    if( !escape_dash )
 	escape_from = 0;
 
+    hashbuf = xtrymalloc( sizeof *hashbuf );
+    outbuf = hashbuf? xtrymalloc( sizeof *outbuf ) : NULL;
+    if( !outbuf ) {
+	gpg_error_t err = gpg_error_from_syserror ();
+	xfree( hashbuf );
+	return err;
+    }
+    hashbuf->md = md;
+    hashbuf->out = NULL;
+    hashbuf->used = 0;
+    outbuf->md = NULL;
+    outbuf->out = out;
+    outbuf->used = 0;
+
     write_status_begin_signing (md);
 
     for(;;) {
@@ -185,22 +251,19 @@ copy_clearsig_text( IOBUF out, IOBUF inp, gcry_md_hd_t md,
 
 	/* update the message digest */
 	if( escape_dash ) {
-	    if( pending_lf ) {
-		gcry_md_putc ( md, '\r' );
-		gcry_md_putc ( md, '\n' );
-	    }
-	    gcry_md_write ( md, buffer,
+	    if( pending_lf )
+		put_clearsig_buffer( hashbuf, "\r\n", 2 );
+	    put_clearsig_buffer( hashbuf, buffer,
                             len_without_trailing_chars (buffer, n, " \t\r\n"));
 	}
 	else
-            gcry_md_write ( md, buffer, n );
+            put_clearsig_buffer( hashbuf, buffer, n );
 	pending_lf = buffer[n-1] == '\n';
 
 	/* write the output */
 	if(    ( escape_dash && *buffer == '-')
 	    || ( escape_from && n > 4 && !memcmp(buffer, "From ", 5 ) ) ) {
-	    iobuf_put( out, '-' );
-	    iobuf_put( out, ' ' );
+	    put_clearsig_buffer( outbuf, "- ", 2 );
 	}
 
 #if  0 /*defined(HAVE_DOSISH_SYSTEM)*/
@@ -226,20 +289,24 @@ copy_clearsig_text( IOBUF out, IOBUF inp, gcry_md_hd_t md,
 	    iobuf_write( out, buffer, n );
 
 #else
-	iobuf_write( out, buffer, n );
+	put_clearsig_buffer( outbuf, buffer, n );
 #endif
     }
 
     /* at eof */
     if( !pending_lf ) { /* make sure that the file ends with a LF */
-	iobuf_writestr( out, LF );
+	put_clearsig_buffer( outbuf, LF, strlen (LF) );
 	if( !escape_dash )
-	    gcry_md_putc( md, '\n' );
+	    put_clearsig_buffer( hashbuf, "\n", 1 );
     }
+    flush_clearsig_buffer( hashbuf );
+    flush_clearsig_buffer( outbuf );
 
     if( truncated )
 	log_info(_("input line longer than %d characters\n"), MAX_LINELEN );
 
+    xfree (hashbuf);
+    xfree (outbuf);
     xfree (buffer);
     return 0; /* okay */
 }
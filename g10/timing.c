@@ -0,0 +1,214 @@
+/* timing.c - Timing trace of the major phases of gpg
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* With --debug-timing FILE gpg writes the wall clock and CPU time of
+ * its major phases to FILE.  The format is the JSON array format of
+ * the Chrome trace viewer (chrome://tracing, Perfetto): each phase is
+ * written as a complete ("X") event with the CPU time in its args.
+ * Phases which run very often, like hashing a buffer, are only
+ * summed up by timing_add and written as one instant ("i") event per
+ * name when the trace is closed.  Without --debug-timing the span
+ * functions return right away.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/i18n.h"
+#include "timing.h"
+
+
+/* The maximum number of names used with timing_add.  */
+#define MAX_SUMS 16
+
+/* The stream of the trace or NULL if not active.  */
+static estream_t trace_fp;
+
+/* The start of the trace; times in the trace are relative to this.  */
+static unsigned long long trace_start;
+
+/* The process id used for all events.  */
+static unsigned long trace_pid;
+
+/* Number of events written; used to place the commas.  */
+static unsigned long trace_nevents;
+
+/* The phases summed up by timing_add.  */
+static struct
+{
+  const char *name;
+  unsigned long count;
+  unsigned long long wall;
+  unsigned long long cpu;
+} sums[MAX_SUMS];
+
+
+
+/* Return the wall clock time in microseconds.  */
+static unsigned long long
+get_wall_usec (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+
+/* Return the CPU time of the process in microseconds.  */
+static unsigned long long
+get_cpu_usec (void)
+{
+  return (unsigned long long)clock () * 1000000ULL / CLOCKS_PER_SEC;
+}
+
+
+/* Start the event and print the separator.  */
+static void
+begin_event (void)
+{
+  if (trace_nevents++)
+    es_fputs (",\n", trace_fp);
+}
+
+
+/* Start writing the trace to FNAME.  */
+gpg_error_t
+timing_open (const char *fname)
+{
+  gpg_error_t err;
+
+  if (trace_fp)
+    timing_close ();
+
+  trace_fp = es_fopen (fname, "w");
+  if (!trace_fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't create '%s': %s\n"), fname, gpg_strerror (err));
+      return err;
+    }
+  trace_start = get_wall_usec ();
+  trace_pid = (unsigned long)getpid ();
+  trace_nevents = 0;
+  es_fputs ("[\n", trace_fp);
+  begin_event ();
+  es_fprintf (trace_fp,
+              "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,"
+              "\"tid\":1,\"args\":{\"name\":\"gpg\"}}",
+              trace_pid);
+  return 0;
+}
+
+
+/* Write the sums and close the trace.  */
+void
+timing_close (void)
+{
+  unsigned long long now;
+  int i;
+
+  if (!trace_fp)
+    return;
+
+  now = get_wall_usec () - trace_start;
+  for (i=0; i < MAX_SUMS && sums[i].name; i++)
+    {
+      begin_event ();
+      es_fprintf (trace_fp,
+                  "{\"name\":\"%s\",\"cat\":\"gpg\",\"ph\":\"i\",\"s\":\"p\","
+                  "\"ts\":%llu,\"pid\":%lu,\"tid\":1,\"args\":{"
+                  "\"count\":%lu,\"wall_us\":%llu,\"cpu_us\":%llu}}",
+                  sums[i].name, now, trace_pid, sums[i].count,
+                  sums[i].wall, sums[i].cpu);
+    }
+  es_fputs ("\n]\n", trace_fp);
+  if (es_fclose (trace_fp))
+    log_error ("error closing the timing trace: %s\n",
+               gpg_strerror (gpg_error_from_syserror ()));
+  trace_fp = NULL;
+}
+
+
+/* Start the span SPAN for the phase NAME.  NAME must be a string
+ * constant which needs no JSON escaping.  */
+void
+timing_begin (timing_span_t *span, const char *name)
+{
+  if (!trace_fp)
+    return;
+
+  span->name = name;
+  span->wall = get_wall_usec ();
+  span->cpu = get_cpu_usec ();
+}
+
+
+/* Finish SPAN and write it as an event.  */
+void
+timing_end (timing_span_t *span)
+{
+  unsigned long long wall, cpu;
+
+  if (!trace_fp || !span->name)
+    return;
+
+  wall = get_wall_usec ();
+  cpu = get_cpu_usec ();
+  begin_event ();
+  es_fprintf (trace_fp,
+              "{\"name\":\"%s\",\"cat\":\"gpg\",\"ph\":\"X\",\"ts\":%llu,"
+              "\"dur\":%llu,\"pid\":%lu,\"tid\":1,\"args\":{\"cpu_us\":%llu}}",
+              span->name, span->wall - trace_start, wall - span->wall,
+              trace_pid, cpu - span->cpu);
+  span->name = NULL;
+}
+
+
+/* Finish SPAN and add its times to the sum for its name.  */
+void
+timing_add (timing_span_t *span)
+{
+  int i;
+
+  if (!trace_fp || !span->name)
+    return;
+
+  for (i=0; i < MAX_SUMS; i++)
+    if (!sums[i].name || sums[i].name == span->name
+        || !strcmp (sums[i].name, span->name))
+      break;
+  if (i == MAX_SUMS)
+    {
+      timing_end (span);  /* No more space; write it as event.  */
+      return;
+    }
+  sums[i].name = span->name;
+  sums[i].count++;
+  sums[i].wall += get_wall_usec () - span->wall;
+  sums[i].cpu += get_cpu_usec () - span->cpu;
+  span->name = NULL;
+}
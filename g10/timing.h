@@ -0,0 +1,40 @@
+/* timing.h - Timing trace of the major phases of gpg
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef GNUPG_G10_TIMING_H
+#define GNUPG_G10_TIMING_H
+
+/* A span of the timing trace.  The object is usually allocated on
+ * the stack of the function doing the work of the phase.  */
+struct timing_span_s
+{
+  const char *name;   /* Name of the phase; a string constant.  */
+  unsigned long long wall;  /* Start in microseconds since the epoch.  */
+  unsigned long long cpu;   /* Start of the CPU time in microseconds.  */
+};
+typedef struct timing_span_s timing_span_t;
+
+gpg_error_t timing_open (const char *fname);
+void timing_close (void);
+void timing_begin (timing_span_t *span, const char *name);
+void timing_end (timing_span_t *span);
+void timing_add (timing_span_t *span);
+
+#endif /*GNUPG_G10_TIMING_H*/
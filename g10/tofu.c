@@ -71,6 +71,8 @@ struct tofu_dbs_s
   {
     sqlite3_stmt *savepoint_batch;
     sqlite3_stmt *savepoint_batch_commit;
+    sqlite3_stmt *savepoint_inner1;
+    sqlite3_stmt *savepoint_release1;
 
     sqlite3_stmt *record_binding_get_old_policy;
     sqlite3_stmt *record_binding_update;
@@ -79,6 +81,7 @@ struct tofu_dbs_s
     sqlite3_stmt *get_trust_gather_other_user_ids;
     sqlite3_stmt *get_trust_gather_signature_stats;
     sqlite3_stmt *get_trust_gather_encryption_stats;
+    sqlite3_stmt *show_statistics;
     sqlite3_stmt *register_already_seen;
     sqlite3_stmt *register_signature;
     sqlite3_stmt *register_encryption;
@@ -111,6 +114,7 @@ struct tofu_dbs_s
 /* Local prototypes.  */
 static gpg_error_t end_transaction (ctrl_t ctrl, int only_batch);
 static char *email_from_user_id (const char *user_id);
+static int user_id_has_email (PKT_user_id *uid, const char *email);
 static int show_statistics (tofu_dbs_t dbs,
                             const char *fingerprint, const char *email,
                             enum tofu_policy policy,
@@ -247,9 +251,16 @@ begin_transaction (ctrl_t ctrl, int only_batch)
   log_assert (dbs->in_transaction >= 0);
   dbs->in_transaction ++;
 
-  rc = gpgsql_exec_printf (dbs->db, NULL, NULL, &err,
-                           "savepoint inner%d;",
-                           dbs->in_transaction);
+  /* The outermost save point is by far the most common one; thus we
+   * use a prepared statement for it.  */
+  if (dbs->in_transaction == 1)
+    rc = gpgsql_stepx (dbs->db, &dbs->s.savepoint_inner1,
+                       NULL, NULL, &err,
+                       "savepoint inner1;", GPGSQL_ARG_END);
+  else
+    rc = gpgsql_exec_printf (dbs->db, NULL, NULL, &err,
+                             "savepoint inner%d;",
+                             dbs->in_transaction);
   if (rc)
     {
       log_error (_("error beginning transaction on TOFU database: %s\n"),
@@ -314,8 +325,13 @@ end_transaction (ctrl_t ctrl, int only_batch)
   log_assert (dbs);
   log_assert (dbs->in_transaction > 0);
 
-  rc = gpgsql_exec_printf (dbs->db, NULL, NULL, &err,
-                           "release inner%d;", dbs->in_transaction);
+  if (dbs->in_transaction == 1)
+    rc = gpgsql_stepx (dbs->db, &dbs->s.savepoint_release1,
+                       NULL, NULL, &err,
+                       "release inner1;", GPGSQL_ARG_END);
+  else
+    rc = gpgsql_exec_printf (dbs->db, NULL, NULL, &err,
+                             "release inner%d;", dbs->in_transaction);
 
   dbs->in_transaction --;
 
@@ -656,6 +672,109 @@ check_utks (sqlite3 *db)
   return rc;
 }
 
+/* Create the tables with the statistics for each binding if they do
+ * not yet exist.
+ *
+ * BINDING_STATS has one row for each binding with signatures or
+ * encryptions.  It holds the number of signatures and encryptions,
+ * the number of distinct days on which they have been seen, and the
+ * times of the first and the last one.  BINDING_STATS_DAYS lists
+ * these days (KIND is 0 for signatures and 1 for encryptions) so
+ * that the number of days can be maintained as well.  Both tables
+ * are updated by triggers on the signatures and encryptions tables.
+ * Thus the statistics are available without scanning the history,
+ * and they also stay correct if an older version of gpg updates the
+ * database.  When the tables are created they are filled from the
+ * existing data.  */
+static int
+init_binding_stats (sqlite3 *db)
+{
+  int rc;
+  char *err = NULL;
+  unsigned long count = 0;
+
+  rc = sqlite3_exec (db,
+                     "select count(*) from sqlite_master"
+                     " where type='table' and name='binding_stats';",
+                     get_single_unsigned_long_cb, &count, &err);
+  if (rc)
+    {
+      log_error (_("error reading TOFU database: %s\n"), err);
+      print_further_info ("query available tables");
+      sqlite3_free (err);
+      return rc;
+    }
+  if (count)
+    return 0;  /* Already there.  */
+
+#define STATS_TRIGGER(table, prefix, kind)                            \
+  "create trigger " table "_binding_stats after insert on " table "\n" \
+  " begin\n"                                                          \
+  "  insert or ignore into binding_stats (binding)"                   \
+  "   values (new.binding);\n"                                        \
+  "  update binding_stats set\n"                                      \
+  "    " prefix "_count = " prefix "_count + 1,\n"                    \
+  "    " prefix "_days = " prefix "_days + not exists\n"              \
+  "      (select 1 from binding_stats_days\n"                         \
+  "        where binding = new.binding and kind = " kind "\n"         \
+  "         and day = round (new.time / (24 * 60 * 60))),\n"          \
+  "    " prefix "_first = coalesce (min (" prefix "_first, new.time),"  \
+  " new.time),\n"                                                     \
+  "    " prefix "_last = coalesce (max (" prefix "_last, new.time),"    \
+  " new.time)\n"                                                      \
+  "   where binding = new.binding;\n"                                 \
+  "  insert or ignore into binding_stats_days\n"                      \
+  "   values (new.binding, " kind ", round (new.time / (24 * 60 * 60)));\n" \
+  " end;\n"
+
+#define STATS_FILL(table, prefix, kind)                                \
+  "insert or ignore into binding_stats_days\n"                        \
+  " select distinct binding, " kind ", round (time / (24 * 60 * 60))\n" \
+  "  from " table ";\n"                                               \
+  "update binding_stats set\n"                                        \
+  "  " prefix "_count = (select count (*) from " table                \
+  "   where binding = binding_stats.binding),\n"                      \
+  "  " prefix "_days = (select count (*) from binding_stats_days"     \
+  "   where binding = binding_stats.binding and kind = " kind "),\n"  \
+  "  " prefix "_first = (select min (time) from " table               \
+  "   where binding = binding_stats.binding),\n"                      \
+  "  " prefix "_last = (select max (time) from " table                \
+  "   where binding = binding_stats.binding);\n"
+
+  rc = sqlite3_exec (db,
+                     "create table binding_stats\n"
+                     " (binding INTEGER PRIMARY KEY,\n"
+                     "  sig_count INTEGER NOT NULL DEFAULT 0,\n"
+                     "  sig_days INTEGER NOT NULL DEFAULT 0,\n"
+                     "  sig_first INTEGER, sig_last INTEGER,\n"
+                     "  enc_count INTEGER NOT NULL DEFAULT 0,\n"
+                     "  enc_days INTEGER NOT NULL DEFAULT 0,\n"
+                     "  enc_first INTEGER, enc_last INTEGER);\n"
+                     "create table binding_stats_days\n"
+                     " (binding INTEGER NOT NULL, kind INTEGER NOT NULL,\n"
+                     "  day INTEGER NOT NULL,\n"
+                     "  primary key (binding, kind, day));\n"
+                     STATS_TRIGGER ("signatures", "sig", "0")
+                     STATS_TRIGGER ("encryptions", "enc", "1")
+                     "insert into binding_stats (binding)\n"
+                     " select binding from signatures\n"
+                     " union select binding from encryptions;\n"
+                     STATS_FILL ("signatures", "sig", "0")
+                     STATS_FILL ("encryptions", "enc", "1"),
+                     NULL, NULL, &err);
+#undef STATS_TRIGGER
+#undef STATS_FILL
+  if (rc)
+    {
+      log_error (_("error initializing TOFU database: %s\n"), err);
+      print_further_info ("create binding_stats");
+      sqlite3_free (err);
+    }
+
+  return rc;
+}
+
+
 /* If the DB is new, initialize it.  Otherwise, check the DB's
    version.
 
@@ -876,6 +995,9 @@ initdb (sqlite3 *db)
 	}
     }
 
+  if (! rc)
+    rc = init_binding_stats (db);
+
   if (! rc)
     rc = check_utks (db);
 
@@ -935,6 +1057,61 @@ busy_handler (void *cookie, int call_count)
   return 1;
 }
 
+/* Callback for the journal_mode pragma; sets the int at COOKIE if
+ * the database is in WAL mode.  */
+static int
+journal_mode_cb (void *cookie, int argc, char **argv, char **azColName)
+{
+  int *r_wal = cookie;
+
+  (void)azColName;
+
+  if (argc == 1 && argv[0] && !ascii_strcasecmp (argv[0], "wal"))
+    *r_wal = 1;
+  return 0;
+}
+
+
+/* Switch DB to write-ahead logging.  With WAL readers do not block
+ * the writer and a commit needs only one sync, which is what limits
+ * the number of signatures we can record per second.  In WAL mode
+ * the synchronous mode NORMAL still keeps the database consistent;
+ * only the last transactions may be lost on a power failure, which is
+ * not a problem for the TOFU data.  If WAL is not supported, for
+ * example on file systems without shared memory, the rollback
+ * journal is kept.  */
+static void
+set_wal_mode (sqlite3 *db)
+{
+  int rc;
+  int wal = 0;
+  char *err = NULL;
+
+  rc = sqlite3_exec (db, "pragma journal_mode = wal;",
+                     journal_mode_cb, &wal, &err);
+  if (rc)
+    {
+      if (DBG_TRUST)
+        log_debug ("TOFU: error enabling WAL mode: %s\n", err);
+      sqlite3_free (err);
+      return;
+    }
+  if (!wal)
+    {
+      if (DBG_TRUST)
+        log_debug ("TOFU: WAL mode not available\n");
+      return;
+    }
+
+  rc = sqlite3_exec (db, "pragma synchronous = normal;", NULL, NULL, &err);
+  if (rc)
+    {
+      log_debug ("TOFU: error setting synchronous mode: %s\n", err);
+      sqlite3_free (err);
+    }
+}
+
+
 /* Create a new DB handle.  Returns NULL on error.  */
 /* FIXME: Change to return an error code for better reporting by the
    caller.  */
@@ -965,6 +1142,7 @@ opendbs (ctrl_t ctrl)
         {
           sqlite3_busy_timeout (db, 5 * 1000);
           sqlite3_busy_handler (db, busy_handler, ctrl);
+          set_wal_mode (db);
         }
 
       if (db && initdb (db))
@@ -1410,12 +1588,9 @@ cross_sigs (const char *email, kbnode_t a, kbnode_t b)
                 {
                   /* See if this is the matching user id.  */
                   PKT_user_id *user_id = n->pkt->pkt.user_id;
-                  char *email2 = email_from_user_id (user_id->name);
 
-                  if (strcmp (email, email2) == 0)
+                  if (user_id_has_email (user_id, email))
                     saw_email = 1;
-
-                  xfree (email2);
                 }
             }
 
@@ -1479,12 +1654,9 @@ signed_by_utk (const char *email, kbnode_t a)
             {
               /* See if this is the matching user id.  */
               PKT_user_id *user_id = n->pkt->pkt.user_id;
-              char *email2 = email_from_user_id (user_id->name);
 
-              if (strcmp (email, email2) == 0)
+              if (user_id_has_email (user_id, email))
                 saw_email = 1;
-
-              xfree (email2);
             }
         }
 
@@ -2203,14 +2375,11 @@ build_conflict_set (ctrl_t ctrl, tofu_dbs_t dbs,
       while ((n = find_next_kbnode (n, PKT_USER_ID)) && ! found_user_id)
         {
           PKT_user_id *user_id2 = n->pkt->pkt.user_id;
-          char *email2;
 
           if (user_id2->attrib_data)
             continue;
 
-          email2 = email_from_user_id (user_id2->name);
-
-          if (strcmp (email, email2) == 0)
+          if (user_id_has_email (user_id2, email))
             {
               found_user_id = 1;
 
@@ -2219,8 +2388,6 @@ build_conflict_set (ctrl_t ctrl, tofu_dbs_t dbs,
               if (user_id2->flags.expired)
                 iter->flags |= BINDING_EXPIRED;
             }
-
-          xfree (email2);
         }
 
       if (! found_user_id)
@@ -3007,90 +3174,24 @@ show_statistics (tofu_dbs_t dbs,
 
   fingerprint_pp = format_hexfingerprint (fingerprint, NULL, 0);
 
-  /* Get the signature stats.  */
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
-     "select count (*), coalesce (min (signatures.time), 0),\n"
-     "  coalesce (max (signatures.time), 0)\n"
-     " from signatures\n"
-     " left join bindings on signatures.binding = bindings.oid\n"
-     " where fingerprint = %Q and email = %Q;",
-     fingerprint, email);
-  if (rc)
-    {
-      log_error (_("error reading TOFU database: %s\n"), err);
-      print_further_info ("getting signature statistics");
-      sqlite3_free (err);
-      rc = gpg_error (GPG_ERR_GENERAL);
-      goto out;
-    }
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
-     "select count (*) from\n"
-     "  (select round(signatures.time / (24 * 60 * 60)) day\n"
-     "    from signatures\n"
-     "    left join bindings on signatures.binding = bindings.oid\n"
-     "    where fingerprint = %Q and email = %Q\n"
-     "    group by day);",
-     fingerprint, email);
-  if (rc)
-    {
-      log_error (_("error reading TOFU database: %s\n"), err);
-      print_further_info ("getting signature statistics (by day)");
-      sqlite3_free (err);
-      rc = gpg_error (GPG_ERR_GENERAL);
-      goto out;
-    }
-
-  if (strlist)
-    {
-      /* We expect exactly 4 elements.  */
-      log_assert (strlist->next);
-      log_assert (strlist->next->next);
-      log_assert (strlist->next->next->next);
-      log_assert (! strlist->next->next->next->next);
-
-      string_to_ulong (&signature_days, strlist->d, -1, __LINE__);
-      string_to_ulong (&signature_count, strlist->next->d, -1, __LINE__);
-      string_to_ulong (&signature_first_seen,
-                       strlist->next->next->d, -1, __LINE__);
-      string_to_ulong (&signature_most_recent,
-                       strlist->next->next->next->d, -1, __LINE__);
-
-      free_strlist (strlist);
-      strlist = NULL;
-    }
-
-  /* Get the encryption stats.  */
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
-     "select count (*), coalesce (min (encryptions.time), 0),\n"
-     "  coalesce (max (encryptions.time), 0)\n"
-     " from encryptions\n"
-     " left join bindings on encryptions.binding = bindings.oid\n"
-     " where fingerprint = %Q and email = %Q;",
-     fingerprint, email);
-  if (rc)
-    {
-      log_error (_("error reading TOFU database: %s\n"), err);
-      print_further_info ("getting encryption statistics");
-      sqlite3_free (err);
-      rc = gpg_error (GPG_ERR_GENERAL);
-      goto out;
-    }
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
-     "select count (*) from\n"
-     "  (select round(encryptions.time / (24 * 60 * 60)) day\n"
-     "    from encryptions\n"
-     "    left join bindings on encryptions.binding = bindings.oid\n"
-     "    where fingerprint = %Q and email = %Q\n"
-     "    group by day);",
-     fingerprint, email);
+  /* Get the signature and encryption stats.  These are maintained by
+   * triggers; see init_binding_stats.  */
+  rc = gpgsql_stepx
+    (dbs->db, &dbs->s.show_statistics,
+     strings_collect_cb2, &strlist, &err,
+     "select coalesce (sig_count, 0), coalesce (sig_days, 0),\n"
+     "  coalesce (sig_first, 0), coalesce (sig_last, 0),\n"
+     "  coalesce (enc_count, 0), coalesce (enc_days, 0),\n"
+     "  coalesce (enc_first, 0), coalesce (enc_last, 0)\n"
+     " from bindings\n"
+     " left join binding_stats on binding_stats.binding = bindings.oid\n"
+     " where fingerprint = ? and email = ?;",
+     GPGSQL_ARG_STRING, fingerprint, GPGSQL_ARG_STRING, email,
+     GPGSQL_ARG_END);
   if (rc)
     {
       log_error (_("error reading TOFU database: %s\n"), err);
-      print_further_info ("getting encryption statistics (by day)");
+      print_further_info ("getting statistics");
       sqlite3_free (err);
       rc = gpg_error (GPG_ERR_GENERAL);
       goto out;
@@ -3098,18 +3199,22 @@ show_statistics (tofu_dbs_t dbs,
 
   if (strlist)
     {
-      /* We expect exactly 4 elements.  */
-      log_assert (strlist->next);
-      log_assert (strlist->next->next);
-      log_assert (strlist->next->next->next);
-      log_assert (! strlist->next->next->next->next);
-
-      string_to_ulong (&encryption_days, strlist->d, -1, __LINE__);
-      string_to_ulong (&encryption_count, strlist->next->d, -1, __LINE__);
-      string_to_ulong (&encryption_first_done,
-                       strlist->next->next->d, -1, __LINE__);
-      string_to_ulong (&encryption_most_recent,
-                       strlist->next->next->next->d, -1, __LINE__);
+      unsigned long *values[8];
+      strlist_t sl;
+      int i;
+
+      values[0] = &signature_count;
+      values[1] = &signature_days;
+      values[2] = &signature_first_seen;
+      values[3] = &signature_most_recent;
+      values[4] = &encryption_count;
+      values[5] = &encryption_days;
+      values[6] = &encryption_first_done;
+      values[7] = &encryption_most_recent;
+      for (sl = strlist, i = 0; sl && i < DIM (values); sl = sl->next, i++)
+        string_to_ulong (values[i], sl->d, -1, __LINE__);
+      /* We expect exactly 8 elements in the order of the columns.  */
+      log_assert (!sl && i == DIM (values));
 
       free_strlist (strlist);
       strlist = NULL;
@@ -3296,6 +3401,22 @@ email_from_user_id (const char *user_id)
   return email;
 }
 
+
+/* Return true if email_from_user_id would return EMAIL for the user
+   id UID.  EMAIL must be normalized the same way.  Unlike
+   email_from_user_id this does not allocate a new string on each
+   call; the mailbox is cached in UID.  */
+static int
+user_id_has_email (PKT_user_id *uid, const char *email)
+{
+  const char *mbox = user_id_mbox (uid);
+
+  if (mbox)
+    return !strcmp (mbox, email);
+  /* EMAIL is the lowercased user id in this case.  */
+  return !ascii_strcasecmp (uid->name, email);
+}
+
 /* Register the signature with the bindings <fingerprint, USER_ID>,
    for each USER_ID in USER_ID_LIST.  The fingerprint is taken from
    the primary key packet PK.
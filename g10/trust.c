@@ -33,6 +33,7 @@
 #include "../common/i18n.h"
 #include "trustdb.h"
 #include "../common/host2net.h"
+#include "timing.h"
 
 
 /* Return true if key is disabled.  Note that this is usually used via
@@ -304,6 +305,33 @@ revalidation_mark (ctrl_t ctrl)
 }
 
 
+/* Return a value which changes whenever the validity of keys may
+ * have changed due to a change of the trustdb.  */
+unsigned long
+trustdb_get_generation (void)
+{
+#ifdef NO_TRUST_MODELS
+  return 0;
+#else
+  return tdb_get_generation ();
+#endif
+}
+
+
+/* Same as revalidation_mark but only if a change of KEYBLOCK may
+ * change the validity of any key.  */
+void
+revalidation_mark_key (ctrl_t ctrl, kbnode_t keyblock)
+{
+#ifndef NO_TRUST_MODELS
+  tdb_revalidation_mark_key (ctrl, keyblock);
+#else
+  (void)ctrl;
+  (void)keyblock;
+#endif
+}
+
+
 void
 check_trustdb_stale (ctrl_t ctrl)
 {
@@ -381,7 +409,14 @@ get_validity (ctrl_t ctrl, kbnode_t kb, PKT_public_key *pk, PKT_user_id *uid,
 #ifdef NO_TRUST_MODELS
   validity = TRUST_UNKNOWN;
 #else
-  validity = tdb_get_validity_core (ctrl, kb, pk, uid, main_pk, sig, may_ask);
+  {
+    timing_span_t span;
+
+    timing_begin (&span, "get_validity");
+    validity = tdb_get_validity_core (ctrl, kb, pk, uid, main_pk,
+                                      sig, may_ask);
+    timing_end (&span);
+  }
 #endif
 
  leave:
@@ -42,6 +42,7 @@
 #include "trustdb.h"
 #include "tofu.h"
 #include "key-clean.h"
+#include "timing.h"
 
 
 typedef struct key_item **KeyHashTable; /* see new_key_hash_table() */
@@ -73,6 +74,8 @@ static struct key_item *utk_list;      /* all ultimately trusted keys */
 static int pending_check_trustdb;
 
 static int validate_keys (ctrl_t ctrl, int interactive);
+static int read_trust_record (ctrl_t ctrl, PKT_public_key *pk,
+                              TRUSTREC *rec);
 
 
 /**********************************************
@@ -103,6 +106,10 @@ release_key_items (struct key_item *k)
 
 #define KEY_HASH_TABLE_SIZE 1024
 
+/* Number of keyblocks collected by validate_key_list before their
+ * signatures are checked in parallel.  */
+#define TRUSTDB_BATCH_SIZE 256
+
 /*
  * For fast keylook up we need a hash table.  Each byte of a KeyID
  * should be distributed equally over the 256 possible values (except
@@ -592,6 +599,176 @@ tdb_revalidation_mark (ctrl_t ctrl)
   pending_check_trustdb = 1;
 }
 
+
+/*
+ * Return true if the key PK may introduce validity to other keys.
+ * Only ultimately trusted keys and keys with a fully valid user id
+ * are put on the key lists used by validate_keys; the signatures of
+ * all other keys are ignored.  On error true is returned.
+ */
+static int
+key_may_introduce (ctrl_t ctrl, PKT_public_key *pk)
+{
+  TRUSTREC trec, vrec;
+  gpg_error_t err;
+  u32 kid[2];
+  ulong recno;
+
+  keyid_from_pk (pk, kid);
+  if (tdb_keyid_is_utk (kid))
+    return 1;
+
+  err = read_trust_record (ctrl, pk, &trec);
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    return 0;
+  if (err)
+    return 1;
+
+  for (recno = trec.r.trust.validlist; recno; recno = vrec.r.valid.next)
+    {
+      read_record (recno, &vrec, RECTYPE_VALID);
+      if ((vrec.r.valid.validity & TRUST_MASK) >= TRUST_FULLY)
+        return 1;
+    }
+  return 0;
+}
+
+
+/*
+ * Return true if a change of KEYBLOCK may change the validity of any
+ * key.  The web of trust has an edge from the signer to the signee
+ * only if the signer may introduce validity (see key_may_introduce).
+ * Thus if KEYBLOCK has neither a validity nor an ownertrust and none
+ * of its certifications has been made by such a key, KEYBLOCK is not
+ * part of the web and a new validation would not change anything.
+ * On error true is returned.
+ */
+static int
+keyblock_affects_validity (ctrl_t ctrl, kbnode_t keyblock)
+{
+  PKT_public_key *pk = keyblock->pkt->pkt.public_key;
+  PKT_public_key spk;
+  PKT_signature *sig;
+  TRUSTREC trec, vrec;
+  kbnode_t node;
+  gpg_error_t err;
+  u32 kid[2];
+  ulong recno;
+  int rc = 0;
+
+  keyid_from_pk (pk, kid);
+  if (tdb_keyid_is_utk (kid))
+    return 1;
+
+  err = read_trust_record (ctrl, pk, &trec);
+  if (err && gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+    return 1;
+  if (!err)
+    {
+      if ((trec.r.trust.ownertrust & TRUST_MASK)
+          || trec.r.trust.min_ownertrust)
+        return 1;
+      for (recno = trec.r.trust.validlist; recno; recno = vrec.r.valid.next)
+        {
+          read_record (recno, &vrec, RECTYPE_VALID);
+          if ((vrec.r.valid.validity & TRUST_MASK))
+            return 1;
+        }
+    }
+
+  for (node = keyblock; node && !rc; node = node->next)
+    {
+      if (node->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      sig = node->pkt->pkt.signature;
+      if (sig->keyid[0] == kid[0] && sig->keyid[1] == kid[1])
+        continue;  /* Self-signature.  */
+
+      memset (&spk, 0, sizeof spk);
+      err = get_pubkey (ctrl, &spk, sig->keyid);
+      if (!err)
+        rc = key_may_introduce (ctrl, &spk);
+      else if (gpg_err_code (err) != GPG_ERR_NO_PUBKEY)
+        rc = 1;
+      release_public_key_parts (&spk);
+    }
+
+  return rc;
+}
+
+
+/*
+ * Return true if the stored validity values are not up to date.
+ */
+static int
+trustdb_is_stale (void)
+{
+  ulong scheduled;
+
+  if (pending_check_trustdb)
+    return 1;
+  scheduled = tdbio_read_nextcheck ();
+  return (scheduled && scheduled <= make_timestamp ());
+}
+
+
+/*
+ * Same as tdb_revalidation_mark but only if the imported or updated
+ * KEYBLOCK may change the web of trust.
+ */
+void
+tdb_revalidation_mark_key (ctrl_t ctrl, kbnode_t keyblock)
+{
+  init_trustdb (ctrl, 0);
+  if (trustdb_args.no_trustdb && opt.trust_model == TM_ALWAYS)
+    return;
+
+  /* The test uses the stored validity values; thus it is only
+   * possible if they are up to date.  */
+  if (!trustdb_is_stale () && !keyblock_affects_validity (ctrl, keyblock))
+    {
+      if (DBG_TRUST)
+        log_debug ("key %s: not part of the web of trust;"
+                   " no trustdb update needed\n",
+                   keystr_from_pk (keyblock->pkt->pkt.public_key));
+      return;
+    }
+
+  tdb_revalidation_mark (ctrl);
+}
+
+
+/*
+ * Return a value which changes with each change of the trustdb.
+ */
+unsigned long
+tdb_get_generation (void)
+{
+  return tdbio_get_generation ();
+}
+
+
+/*
+ * Return true if changing the ownertrust of PK from OLD_TRUST to
+ * NEW_TRUST requires a new validation.  The ownertrust is only used
+ * for keys which may introduce validity.
+ */
+static int
+ownertrust_change_affects_validity (ctrl_t ctrl, PKT_public_key *pk,
+                                    unsigned int old_trust,
+                                    unsigned int new_trust)
+{
+  if ((old_trust & ~TRUST_MASK) != (new_trust & ~TRUST_MASK))
+    return 1;
+  if ((old_trust & TRUST_MASK) == TRUST_ULTIMATE
+      || (new_trust & TRUST_MASK) == TRUST_ULTIMATE)
+    return 1;
+  if (trustdb_is_stale ())
+    return 1;
+  return key_may_introduce (ctrl, pk);
+}
+
+
 int
 trustdb_pending_check(void)
 {
@@ -756,9 +933,13 @@ tdb_update_ownertrust (ctrl_t ctrl, PKT_public_key *pk, unsigned int new_trust )
                    (unsigned int)rec.r.trust.ownertrust, new_trust );
       if (rec.r.trust.ownertrust != new_trust)
         {
+          int mark = ownertrust_change_affects_validity
+            (ctrl, pk, rec.r.trust.ownertrust, new_trust);
+
           rec.r.trust.ownertrust = new_trust;
           write_record (ctrl, &rec);
-          tdb_revalidation_mark (ctrl);
+          if (mark)
+            tdb_revalidation_mark (ctrl);
           do_sync ();
         }
     }
@@ -766,16 +947,20 @@ tdb_update_ownertrust (ctrl_t ctrl, PKT_public_key *pk, unsigned int new_trust )
     { /* no record yet - create a new one */
       size_t dummy;
 
+      int mark;
+
       if (DBG_TRUST)
         log_debug ("insert ownertrust %u\n", new_trust );
 
+      mark = ownertrust_change_affects_validity (ctrl, pk, 0, new_trust);
       memset (&rec, 0, sizeof rec);
       rec.recnum = tdbio_new_recnum (ctrl);
       rec.rectype = RECTYPE_TRUST;
       fingerprint_from_pk (pk, rec.r.trust.fingerprint, &dummy);
       rec.r.trust.ownertrust = new_trust;
       write_record (ctrl, &rec);
-      tdb_revalidation_mark (ctrl);
+      if (mark)
+        tdb_revalidation_mark (ctrl);
       do_sync ();
     }
   else
@@ -1133,17 +1318,15 @@ tdb_get_validity_core (ctrl_t ctrl,
           if (sig && sig->signers_uid)
             /* Make sure the UID matches.  */
             {
-              char *email = mailbox_from_userid (user_id->name, 0);
+              const char *email = user_id_mbox (user_id);
               if (!email || !*email || strcmp (sig->signers_uid, email) != 0)
                 {
                   if (DBG_TRUST)
                     log_debug ("TOFU: skipping user id '%s', which does"
                                " not match the signer's email ('%s')\n",
                                email, sig->signers_uid);
-                  xfree (email);
                   continue;
                 }
-              xfree (email);
             }
 
           /* If the user id is revoked or expired, then skip it.  */
@@ -1795,6 +1978,143 @@ validate_one_keyblock (ctrl_t ctrl, kbnode_t kb, struct key_item *klist,
 }
 
 
+/*
+ * Add the signatures of the keyblock KB which will be checked by
+ * validate_one_keyblock to the array ITEMS.  This uses the same
+ * selection as mark_usable_uid_certs.
+ */
+static void
+collect_sig_checks (kbnode_t kb, struct key_item *klist,
+                    struct sig_check_item_s **items,
+                    size_t *nitems, size_t *maxitems)
+{
+  kbnode_t node;
+  PKT_signature *sig;
+  u32 main_kid[2];
+  int in_uid = 0;
+
+  keyid_from_pk (kb->pkt->pkt.public_key, main_kid);
+  for (node = kb; node; node = node->next)
+    {
+      if (node->pkt->pkttype == PKT_USER_ID)
+        {
+          in_uid = (!node->pkt->pkt.user_id->flags.revoked
+                    && !node->pkt->pkt.user_id->flags.expired);
+          continue;
+        }
+      if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+        break;
+      if (!in_uid || node->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      sig = node->pkt->pkt.signature;
+      if (sig->keyid[0] == main_kid[0] && sig->keyid[1] == main_kid[1])
+        continue;
+      if (!IS_UID_SIG (sig) && !IS_UID_REV (sig))
+        continue;
+      if (sig->sig_class >= 0x11 && sig->sig_class <= 0x13
+          && sig->sig_class - 0x10 < opt.min_cert_level)
+        continue;
+      if (klist && !is_in_klist (klist, sig))
+        continue;
+
+      if (*nitems == *maxitems)
+        {
+          *maxitems += 1000;
+          *items = xrealloc (*items, *maxitems * sizeof **items);
+        }
+      (*items)[*nitems].root = kb;
+      (*items)[*nitems].node = node;
+      (*nitems)++;
+    }
+}
+
+
+/*
+ * Validate the keyblock KB and add it to the key array KEYS if
+ * suitable.  KB is consumed by this function.  See validate_key_list
+ * for the other arguments.
+ */
+static void
+validate_key_list_item (ctrl_t ctrl, kbnode_t keyblock,
+                        KeyHashTable full_trust, struct key_item *klist,
+                        u32 curtime, u32 *next_expire,
+                        struct key_array **keys,
+                        size_t *nkeys, size_t *maxkeys)
+{
+  PKT_public_key *pk = keyblock->pkt->pkt.public_key;
+
+  if (pk->has_expired || pk->flags.revoked)
+    {
+      /* it does not make sense to look further at those keys */
+      mark_keyblock_seen (full_trust, keyblock);
+    }
+  else if (validate_one_keyblock (ctrl, keyblock, klist,
+                                  curtime, next_expire))
+    {
+      KBNODE node;
+
+      if (pk->expiredate && pk->expiredate >= curtime
+          && pk->expiredate < *next_expire)
+        *next_expire = pk->expiredate;
+
+      if (*nkeys == *maxkeys) {
+        *maxkeys += 1000;
+        *keys = xrealloc (*keys, (*maxkeys+1) * sizeof **keys);
+      }
+      (*keys)[(*nkeys)++].keyblock = keyblock;
+
+      /* Optimization - if all uids are fully trusted, then we
+         never need to consider this key as a candidate again. */
+
+      for (node=keyblock; node; node = node->next)
+        if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
+          break;
+
+      if(node==NULL)
+        mark_keyblock_seen (full_trust, keyblock);
+
+      keyblock = NULL;
+    }
+
+  release_kbnode (keyblock);
+}
+
+
+/*
+ * Run the signature checks for the keyblocks in BATCH using
+ * opt.trustdb_jobs threads and then validate the keyblocks in their
+ * original order.  This releases the keyblocks and resets NBATCH.
+ */
+static void
+validate_key_list_batch (ctrl_t ctrl, kbnode_t *batch, size_t *nbatch,
+                         KeyHashTable full_trust, struct key_item *klist,
+                         u32 curtime, u32 *next_expire,
+                         struct key_array **keys,
+                         size_t *nkeys, size_t *maxkeys)
+{
+  struct sig_check_item_s *items = NULL;
+  size_t nitems = 0;
+  size_t maxitems = 0;
+  size_t n;
+
+  for (n=0; n < *nbatch; n++)
+    {
+      PKT_public_key *pk = batch[n]->pkt->pkt.public_key;
+
+      if (!pk->has_expired && !pk->flags.revoked)
+        collect_sig_checks (batch[n], klist, &items, &nitems, &maxitems);
+    }
+  if (nitems)
+    check_key_signatures_parallel (ctrl, items, nitems, opt.trustdb_jobs);
+  xfree (items);
+
+  for (n=0; n < *nbatch; n++)
+    validate_key_list_item (ctrl, batch[n], full_trust, klist,
+                            curtime, next_expire, keys, nkeys, maxkeys);
+  *nbatch = 0;
+}
+
+
 static int
 search_skipfnc (void *opaque, u32 *kid, int dummy_uid_no)
 {
@@ -1809,6 +2129,10 @@ search_skipfnc (void *opaque, u32 *kid, int dummy_uid_no)
  * to create our own.  Returns either a key_array or NULL in case of
  * an error.  No results found are indicated by an empty array.
  * Caller hast to release the returned array.
+ *
+ * If opt.trustdb_jobs is greater than 1 the keyblocks are processed
+ * in batches; the signature checks of a batch are run in parallel
+ * before the keyblocks are validated in their original order.
  */
 static struct key_array *
 validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
@@ -1817,6 +2141,8 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
   KBNODE keyblock = NULL;
   struct key_array *keys = NULL;
   size_t nkeys, maxkeys;
+  kbnode_t *batch = NULL;
+  size_t nbatch = 0;
   int rc;
   KEYDB_SEARCH_DESC desc;
 
@@ -1824,11 +2150,15 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
   keys = xmalloc ((maxkeys+1) * sizeof *keys);
   nkeys = 0;
 
+  if (opt.trustdb_jobs > 1)
+    batch = xmalloc (TRUSTDB_BATCH_SIZE * sizeof *batch);
+
   rc = keydb_search_reset (hd);
   if (rc)
     {
       log_error ("keydb_search_reset failed: %s\n", gpg_strerror (rc));
       xfree (keys);
+      xfree (batch);
       return NULL;
     }
 
@@ -1840,6 +2170,7 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
   if (gpg_err_code (rc) == GPG_ERR_NOT_FOUND)
     {
       keys[nkeys].keyblock = NULL;
+      xfree (batch);
       return keys;
     }
   if (rc)
@@ -1851,8 +2182,6 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
   desc.mode = KEYDB_SEARCH_MODE_NEXT; /* change mode */
   do
     {
-      PKT_public_key *pk;
-
       rc = keydb_get_keyblock (hd, &keyblock);
       if (rc)
         {
@@ -1872,41 +2201,18 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
       /* prepare the keyblock for further processing */
       merge_keys_and_selfsig (ctrl, keyblock);
       clear_kbnode_flags (keyblock);
-      pk = keyblock->pkt->pkt.public_key;
-      if (pk->has_expired || pk->flags.revoked)
+      if (batch)
         {
-          /* it does not make sense to look further at those keys */
-          mark_keyblock_seen (full_trust, keyblock);
+          batch[nbatch++] = keyblock;
+          if (nbatch == TRUSTDB_BATCH_SIZE)
+            validate_key_list_batch (ctrl, batch, &nbatch, full_trust, klist,
+                                     curtime, next_expire,
+                                     &keys, &nkeys, &maxkeys);
         }
-      else if (validate_one_keyblock (ctrl, keyblock, klist,
-                                      curtime, next_expire))
-        {
-	  KBNODE node;
-
-          if (pk->expiredate && pk->expiredate >= curtime
-              && pk->expiredate < *next_expire)
-            *next_expire = pk->expiredate;
-
-          if (nkeys == maxkeys) {
-            maxkeys += 1000;
-            keys = xrealloc (keys, (maxkeys+1) * sizeof *keys);
-          }
-          keys[nkeys++].keyblock = keyblock;
-
-	  /* Optimization - if all uids are fully trusted, then we
-	     never need to consider this key as a candidate again. */
-
-	  for (node=keyblock; node; node = node->next)
-	    if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
-	      break;
-
-	  if(node==NULL)
-	    mark_keyblock_seen (full_trust, keyblock);
-
-          keyblock = NULL;
-        }
-
-      release_kbnode (keyblock);
+      else
+        validate_key_list_item (ctrl, keyblock, full_trust, klist,
+                                curtime, next_expire,
+                                &keys, &nkeys, &maxkeys);
       keyblock = NULL;
     }
   while (!(rc = keydb_search (hd, &desc, 1, NULL)));
@@ -1917,10 +2223,18 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
       goto die;
     }
 
+  if (nbatch)
+    validate_key_list_batch (ctrl, batch, &nbatch, full_trust, klist,
+                             curtime, next_expire, &keys, &nkeys, &maxkeys);
+  xfree (batch);
+
   keys[nkeys].keyblock = NULL;
   return keys;
 
  die:
+  for (; nbatch; nbatch--)
+    release_kbnode (batch[nbatch-1]);
+  xfree (batch);
   keys[nkeys].keyblock = NULL;
   release_key_array (keys);
   return NULL;
@@ -2009,6 +2323,9 @@ validate_keys (ctrl_t ctrl, int interactive)
   int ot_unknown, ot_undefined, ot_never, ot_marginal, ot_full, ot_ultimate;
   KeyHashTable stored,used,full_trust;
   u32 start_time, next_expire;
+  timing_span_t span;
+
+  timing_begin (&span, "validate_keys");
 
   /* Make sure we have all sigs cached.  TODO: This is going to
      require some architectural re-thinking, as it is agonizingly slow.
@@ -2019,7 +2336,10 @@ validate_keys (ctrl_t ctrl, int interactive)
 
   kdb = keydb_new (ctrl);
   if (!kdb)
-    return gpg_error_from_syserror ();
+    {
+      timing_end (&span);
+      return gpg_error_from_syserror ();
+    }
 
   start_time = make_timestamp ();
   next_expire = 0xffffffff; /* set next expire to the year 2106 */
@@ -2027,6 +2347,15 @@ validate_keys (ctrl_t ctrl, int interactive)
   used = new_key_hash_table ();
   full_trust = new_key_hash_table ();
 
+  /* Write the complete update of the trustdb in one transaction.
+   * All the do_sync calls below are then deferred to its end.  */
+  rc = tdbio_begin_transaction ();
+  if (rc)
+    {
+      log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc));
+      g10_exit (2);
+    }
+
   reset_trust_records (ctrl);
 
   /* Fixme: Instead of always building a UTK list, we could just build it
@@ -2256,5 +2585,9 @@ validate_keys (ctrl_t ctrl, int interactive)
       pending_check_trustdb = 0;
     }
 
+  if (tdbio_end_transaction ())
+    g10_exit (2);  /* Error already printed.  */
+
+  timing_end (&span);
   return rc;
 }
@@ -62,6 +62,8 @@ void update_ownertrust (ctrl_t ctrl,
 int clear_ownertrusts (ctrl_t ctrl, PKT_public_key *pk);
 
 void revalidation_mark (ctrl_t ctrl);
+void revalidation_mark_key (ctrl_t ctrl, kbnode_t keyblock);
+unsigned long trustdb_get_generation (void);
 void check_trustdb_stale (ctrl_t ctrl);
 void check_or_update_trustdb (ctrl_t ctrl);
 
@@ -91,6 +93,8 @@ gpg_error_t init_trustdb (ctrl_t ctrl, int no_create);
 int have_trustdb (ctrl_t ctrl);
 void tdb_check_trustdb_stale (ctrl_t ctrl);
 void tdb_revalidation_mark (ctrl_t ctrl);
+void tdb_revalidation_mark_key (ctrl_t ctrl, kbnode_t keyblock);
+unsigned long tdb_get_generation (void);
 int trustdb_pending_check(void);
 void tdb_check_or_update (ctrl_t ctrl);
 
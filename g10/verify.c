@@ -35,6 +35,7 @@
 #include "filter.h"
 #include "../common/ttyio.h"
 #include "../common/i18n.h"
+#include "tofu.h"
 
 
 /****************
@@ -191,39 +192,25 @@ verify_one_file (ctrl_t ctrl, const char *name )
 int
 verify_files (ctrl_t ctrl, int nfiles, char **files )
 {
-    int i, rc;
-    int first_rc = 0;
-
-    if( !nfiles ) { /* read the filenames from stdin */
-	char line[2048];
-	unsigned int lno = 0;
-
-	while( fgets(line, DIM(line), stdin) ) {
-	    lno++;
-	    if( !*line || line[strlen(line)-1] != '\n' ) {
-		log_error(_("input line %u too long or missing LF\n"), lno );
-		return GPG_ERR_GENERAL;
-	    }
-	    /* This code does not work on MSDOS but hwo cares there are
-	     * also no script languages available.  We don't strip any
-	     * spaces, so that we can process nearly all filenames */
-	    line[strlen(line)-1] = 0;
-	    rc = verify_one_file (ctrl, line);
-            if (!first_rc)
-              first_rc = rc;
-	}
-
-    }
-    else {  /* take filenames from the array */
-	for(i=0; i < nfiles; i++ )
-          {
-            rc = verify_one_file (ctrl, files[i]);
-            if (!first_rc)
-              first_rc = rc;
-          }
-    }
-
-    return first_rc;
+  int rc;
+#ifdef USE_TOFU
+  int batch;
+
+  /* Record the TOFU data of all files in one transaction.  This is
+   * not done if worker processes are used because they would then
+   * compete for the database lock.  */
+  batch = (opt.multifile_jobs <= 1);
+  if (batch)
+    tofu_begin_batch_update (ctrl);
+#endif
+
+  rc = process_multifile (ctrl, nfiles, files, verify_one_file);
+
+#ifdef USE_TOFU
+  if (batch)
+    tofu_end_batch_update (ctrl);
+#endif
+  return rc;
 }
 
 
@@ -231,10 +218,8 @@ verify_files (ctrl_t ctrl, int nfiles, char **files )
 
 /* Perform a verify operation.  To verify detached signatures, DATA_FD
    shall be the descriptor of the signed data; for regular signatures
-   it needs to be -1.  If OUT_FP is not NULL and DATA_FD is not -1 the
-   the signed material gets written that stream.
-
-   FIXME: OUTFP is not yet implemented.
+   it needs to be -1.  If OUT_FP is not NULL the signed material of a
+   regular signature gets written to that stream.
 */
 int
 gpg_verify (ctrl_t ctrl, int sig_fd, int data_fd, estream_t out_fp)
@@ -245,7 +230,17 @@ gpg_verify (ctrl_t ctrl, int sig_fd, int data_fd, estream_t out_fp)
   progress_filter_context_t *pfx = new_progress_context ();
 
   (void)ctrl;
-  (void)out_fp;
+
+  /* The signed text is written to OUT_FP if given.  */
+  if (out_fp)
+    {
+      if (opt.outfp)
+        {
+          release_progress_context (pfx);
+          return gpg_error (GPG_ERR_BUG);
+        }
+      opt.outfp = out_fp;
+    }
 
   if (is_secured_file (sig_fd))
     {
@@ -276,6 +271,8 @@ gpg_verify (ctrl_t ctrl, int sig_fd, int data_fd, estream_t out_fp)
     rc = gpg_error (GPG_ERR_NO_DATA);
 
  leave:
+  if (out_fp)
+    opt.outfp = NULL;
   iobuf_close (fp);
   release_progress_context (pfx);
   release_armor_context (afx);
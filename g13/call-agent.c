@@ -0,0 +1,188 @@
+/* call-agent.c - Communication with gpg-agent
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "g13.h"
+#include <assuan.h>
+#include "../common/i18n.h"
+#include "../common/asshelp.h"
+#include "../common/membuf.h"
+#include "call-agent.h"
+
+
+/* Local data for this module.  A pointer to this is stored in the
+   CTRL object of each connection.  */
+struct call_agent_s
+{
+  assuan_context_t assctx;  /* The Assuan context for the current
+                               gpg-agent connection.  */
+};
+
+
+/* Parameter for the PUT_SECRET inquiry.  */
+struct put_secret_parm_s
+{
+  assuan_context_t ctx;
+  const void *value;
+  size_t valuelen;
+};
+
+
+/* Fork off the gpg-agent if this has not already been done.  On
+   success stores the assuan context at R_CTX.  */
+static gpg_error_t
+start_agent (ctrl_t ctrl, assuan_context_t *r_ctx)
+{
+  gpg_error_t err;
+
+  if (ctrl->agent_local && (*r_ctx = ctrl->agent_local->assctx))
+    return 0; /* Already set.  */
+
+  *r_ctx = NULL;
+
+  if (!ctrl->agent_local)
+    {
+      ctrl->agent_local = xtrycalloc (1, sizeof *ctrl->agent_local);
+      if (!ctrl->agent_local)
+        return gpg_error_from_syserror ();
+    }
+
+  err = start_new_gpg_agent (&ctrl->agent_local->assctx,
+                             GPG_ERR_SOURCE_DEFAULT,
+                             opt.agent_program,
+                             opt.lc_ctype, opt.lc_messages,
+                             opt.session_env,
+                             1, opt.verbose, DBG_IPC,
+                             NULL, NULL);
+  if (err)
+    return err;
+
+  ctrl->agent_seen = 1;
+  *r_ctx = ctrl->agent_local->assctx;
+  return 0;
+}
+
+
+/* Release local resources associated with CTRL.  */
+void
+call_agent_release (ctrl_t ctrl)
+{
+  if (!ctrl)
+    return;
+  if (ctrl->agent_local)
+    {
+      assuan_release (ctrl->agent_local->assctx);
+      ctrl->agent_local->assctx = NULL;
+      xfree (ctrl->agent_local);
+      ctrl->agent_local = NULL;
+    }
+}
+
+
+/* Return the secret stored in gpg-agent's data cache under KEY.  On
+   success the value is stored in a newly allocated buffer in secure
+   memory at R_VALUE and its length at R_VALUELEN.  Returns
+   GPG_ERR_NO_DATA if nothing is cached under KEY.  */
+gpg_error_t
+call_agent_get_secret (ctrl_t ctrl, const char *key,
+                       void **r_value, size_t *r_valuelen)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+  membuf_t data;
+  char *line;
+
+  *r_value = NULL;
+  *r_valuelen = 0;
+
+  err = start_agent (ctrl, &ctx);
+  if (err)
+    return err;
+
+  line = xtryasprintf ("GET_SECRET %s", key);
+  if (!line)
+    return gpg_error_from_syserror ();
+
+  init_membuf_secure (&data, 1024);
+  err = assuan_transact (ctx, line, put_membuf_cb, &data,
+                         NULL, NULL, NULL, NULL);
+  xfree (line);
+  if (err)
+    {
+      void *p;
+      size_t n;
+
+      p = get_membuf (&data, &n);
+      if (p)
+        wipememory (p, n);
+      xfree (p);
+      return err;
+    }
+  *r_value = get_membuf (&data, r_valuelen);
+  if (!*r_value)
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* Inquiry callback for PUT_SECRET.  */
+static gpg_error_t
+put_secret_inq_cb (void *opaque, const char *line)
+{
+  struct put_secret_parm_s *parm = opaque;
+
+  if (has_leading_keyword (line, "SECRET"))
+    return assuan_send_data (parm->ctx, parm->value, parm->valuelen);
+
+  return 0;
+}
+
+
+/* Store (VALUE,VALUELEN) in gpg-agent's data cache under KEY for TTL
+   seconds.  */
+gpg_error_t
+call_agent_put_secret (ctrl_t ctrl, const char *key, int ttl,
+                       const void *value, size_t valuelen)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+  struct put_secret_parm_s parm;
+  char *line;
+
+  err = start_agent (ctrl, &ctx);
+  if (err)
+    return err;
+
+  line = xtryasprintf ("PUT_SECRET %s %d", key, ttl);
+  if (!line)
+    return gpg_error_from_syserror ();
+
+  parm.ctx = ctx;
+  parm.value = value;
+  parm.valuelen = valuelen;
+  err = assuan_transact (ctx, line, NULL, NULL,
+                         put_secret_inq_cb, &parm, NULL, NULL);
+  xfree (line);
+  return err;
+}
@@ -0,0 +1,30 @@
+/* call-agent.h - Communication with gpg-agent
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GNUPG_G13_CALL_AGENT_H
+#define GNUPG_G13_CALL_AGENT_H
+
+void call_agent_release (ctrl_t ctrl);
+gpg_error_t call_agent_get_secret (ctrl_t ctrl, const char *key,
+                                   void **r_value, size_t *r_valuelen);
+gpg_error_t call_agent_put_secret (ctrl_t ctrl, const char *key, int ttl,
+                                   const void *value, size_t valuelen);
+
+
+#endif /*GNUPG_G13_CALL_AGENT_H*/
@@ -313,9 +313,12 @@ static gpg_error_t
 create_status_cb (void *opaque, const char *line)
 {
   struct create_parm_s *parm = opaque;
+  const char *s;
 
   if (has_leading_keyword (line, "PLAINTEXT_FOLLOWS"))
     parm->expect_plaintext = 1;
+  else if ((s = has_leading_keyword (line, "PROGRESS")))
+    g13_status (parm->ctrl, STATUS_PROGRESS, s, NULL);
 
   return 0;
 }
@@ -414,7 +417,15 @@ call_syshelp_run_create (ctrl_t ctrl, int conttype)
   init_membuf (&parm.plaintext, 512);
   if (conttype == CONTTYPE_DM_CRYPT)
     {
-      err = assuan_transact (ctx, "CREATE dm-crypt",
+      const char *cmd;
+
+      if (opt.fill_mode == FILL_MODE_ZERO)
+        cmd = "CREATE --fill=zero dm-crypt";
+      else if (opt.fill_mode == FILL_MODE_RANDOM)
+        cmd = "CREATE --fill=random dm-crypt";
+      else
+        cmd = "CREATE dm-crypt";
+      err = assuan_transact (ctx, cmd,
                              create_data_cb, &parm,
                              create_inq_cb, &parm,
                              create_status_cb, &parm);
@@ -44,6 +44,11 @@
 #define DBG_MEMORY   (opt.debug & DBG_MEMORY_VALUE)
 #define DBG_IPC      (opt.debug & DBG_IPC_VALUE)
 
+/* Modes to initialize the space of a new container.  */
+#define FILL_MODE_NONE    0
+#define FILL_MODE_ZERO    1   /* Write zeroes to the device.  */
+#define FILL_MODE_RANDOM  2   /* Write zeroes through the encryption.  */
+
 /* A large struct named "opt" to keep global flags.  Note that this
    struct is used by g13 and g13-syshelp and thus some fields may only
    make sense for one of them.  */
@@ -81,6 +86,12 @@ struct
   /* Name of the output file - FIXME: what is this?  */
   const char *outfile;
 
+  /* How to fill a new container (FILL_MODE_*).  */
+  int fill_mode;
+
+  /* Seconds to cache decrypted keyblobs in gpg-agent; 0 disables.  */
+  int keyblob_cache_ttl;
+
 } opt;
 
 
@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <npth.h>
 #ifdef HAVE_PWD_H
 # include <pwd.h>
 #endif
@@ -253,6 +254,9 @@ main (int argc, char **argv)
   i18n_init ();
   init_common_subsystems (&argc, &argv);
 
+  /* Threads are used to fill new containers.  */
+  npth_init ();
+
   /* Take extra care of the random pool.  */
   gcry_control (GCRYCTL_USE_SECURE_RNDPOOL);
 
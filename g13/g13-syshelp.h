@@ -80,10 +80,17 @@ gpg_error_t sh_encrypt_keyblob (ctrl_t ctrl,
 /*-- sh-blockdev.c --*/
 gpg_error_t sh_blockdev_getsz (const char *name, unsigned long long *r_nblocks);
 gpg_error_t sh_is_empty_partition (const char *name);
+gpg_error_t sh_blockdev_fill (ctrl_t ctrl, const char *name,
+                              unsigned long long start,
+                              unsigned long long nsectors,
+                              unsigned long long resume,
+                              gpg_error_t (*ckpt_cb)(void *opaque,
+                                                     unsigned long long done),
+                              void *ckpt_cb_value);
 
 /*-- sh-dmcrypt.c --*/
 gpg_error_t sh_dmcrypt_create_container (ctrl_t ctrl, const char *devname,
-                                         estream_t devfp);
+                                         estream_t devfp, int fill_mode);
 gpg_error_t sh_dmcrypt_mount_container (ctrl_t ctrl, const char *devname,
                                         tupledesc_t keyblob);
 gpg_error_t sh_dmcrypt_umount_container (ctrl_t ctrl, const char *devname);
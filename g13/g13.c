@@ -49,6 +49,7 @@
 #include "mountinfo.h"
 #include "backend.h"
 #include "call-syshelp.h"
+#include "call-agent.h"
 
 
 enum cmd_and_opt_values {
@@ -103,6 +104,8 @@ enum cmd_and_opt_values {
   oWithColons,
   oDryRun,
   oNoDetach,
+  oFill,
+  oKeyblobCacheTTL,
 
   oNoRandomSeedFile,
   oFakedSystemTime
@@ -128,6 +131,10 @@ static gpgrt_opt_t opts[] = {
 
   ARGPARSE_s_s (oRecipient, "recipient", N_("|USER-ID|encrypt for USER-ID")),
   ARGPARSE_s_s (oType, "type", N_("|NAME|use container format NAME")),
+  ARGPARSE_s_s (oFill, "fill",
+                N_("|MODE|fill a new container (\"zero\" or \"random\")")),
+  ARGPARSE_s_i (oKeyblobCacheTTL, "keyblob-cache-ttl",
+                N_("|N|cache decrypted keyblobs for N seconds")),
 
   ARGPARSE_s_s (oOutput, "output", N_("|FILE|write output to FILE")),
   ARGPARSE_s_n (oVerbose, "verbose", N_("verbose")),
@@ -564,6 +571,24 @@ main (int argc, char **argv)
           add_to_strlist (&recipients, pargs.r.ret_str);
           break;
 
+        case oKeyblobCacheTTL:
+          opt.keyblob_cache_ttl = pargs.r.ret_int;
+          break;
+
+        case oFill:
+          if (!strcmp (pargs.r.ret_str, "zero"))
+            opt.fill_mode = FILL_MODE_ZERO;
+          else if (!strcmp (pargs.r.ret_str, "random"))
+            opt.fill_mode = FILL_MODE_RANDOM;
+          else if (!strcmp (pargs.r.ret_str, "none"))
+            opt.fill_mode = FILL_MODE_NONE;
+          else
+            {
+              pargs.r_opt = ARGPARSE_INVALID_ARG;
+              pargs.err = ARGPARSE_PRINT_ERROR;
+            }
+          break;
+
         case oType:
           if (!strcmp (pargs.r.ret_str, "help"))
             {
@@ -842,6 +867,7 @@ void
 g13_deinit_default_ctrl (ctrl_t ctrl)
 {
   call_syshelp_release (ctrl);
+  call_agent_release (ctrl);
   FREE_STRLIST (ctrl->recipients);
 }
 
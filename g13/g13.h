@@ -38,6 +38,7 @@ struct server_control_s
   int  status_fd;     /* Only for non-server mode */
   struct server_local_s *server_local;
   struct call_syshelp_s *syshelp_local;
+  struct call_agent_s *agent_local;
 
   int agent_seen;     /* Flag indicating that the gpg-agent has been
                          accessed.  */
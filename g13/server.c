@@ -36,6 +36,7 @@
 #include "../common/server-help.h"
 #include "../common/asshelp.h"
 #include "../common/call-gpg.h"
+#include "call-agent.h"
 
 
 /* The filepointer for status message used in non-server mode */
@@ -773,11 +774,42 @@ g13_keyblob_decrypt (ctrl_t ctrl, const void *enckeyblob, size_t enckeybloblen,
                      void **r_keyblob, size_t *r_keybloblen)
 {
   gpg_error_t err;
+  unsigned char hash[32];
+  char cachekey[4 + 2*32 + 1];
+
+  /* With --keyblob-cache-ttl the plaintext is cached in gpg-agent
+   * under the hash of the encrypted keyblob.  This saves the gpg
+   * process and the public key decryption on a re-mount.  */
+  if (opt.keyblob_cache_ttl > 0)
+    {
+      gcry_md_hash_buffer (GCRY_MD_SHA256, hash, enckeyblob, enckeybloblen);
+      strcpy (cachekey, "g13:");
+      bin2hex (hash, 32, cachekey + 4);
+      err = call_agent_get_secret (ctrl, cachekey, r_keyblob, r_keybloblen);
+      if (!err)
+        {
+          if (opt.verbose)
+            log_info ("using cached keyblob\n");
+          return 0;
+        }
+      if (gpg_err_code (err) != GPG_ERR_NO_DATA)
+        log_info ("error reading keyblob cache: %s\n", gpg_strerror (err));
+    }
 
   /* FIXME:  For now we only implement OpenPGP.  */
   err = gpg_decrypt_blob (ctrl, opt.gpg_program, opt.gpg_arguments,
                           enckeyblob, enckeybloblen,
                           r_keyblob, r_keybloblen);
 
+  if (!err && opt.keyblob_cache_ttl > 0)
+    {
+      gpg_error_t err2;
+
+      err2 = call_agent_put_secret (ctrl, cachekey, opt.keyblob_cache_ttl,
+                                    *r_keyblob, *r_keybloblen);
+      if (err2)
+        log_info ("error caching keyblob: %s\n", gpg_strerror (err2));
+    }
+
   return err;
 }
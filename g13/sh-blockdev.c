@@ -25,6 +25,10 @@
 #include <errno.h>
 #include <assert.h>
 #include <limits.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <npth.h>
 
 #include "g13-syshelp.h"
 #include <assuan.h>
@@ -39,6 +43,32 @@
 # error ULLONG_MAX missing
 #endif
 
+/* The standard disk block size (logical).  */
+#define SECTOR_SIZE 512
+
+/* Parameters for sh_blockdev_fill.  A chunk is the unit of work for
+ * a thread; after each batch the data is synced and the checkpoint
+ * callback is called.  */
+#define FILL_THREADS        4
+#define FILL_CHUNK_SECTORS  8192                 /* 4 MiB */
+#define FILL_BATCH_SECTORS  (64 * FILL_CHUNK_SECTORS)  /* 256 MiB */
+#define FILL_ALIGN          4096
+
+/* The state shared by the fill threads.  */
+struct fill_job_s
+{
+  npth_mutex_t lock;
+  npth_cond_t cond;
+  int fd;                      /* The device.  */
+  const char *buffer;          /* FILL_CHUNK_SECTORS zeroes.  */
+  unsigned long long start;    /* First sector of the area.  */
+  unsigned long long next;     /* Next sector of the batch to write.  */
+  unsigned long long end;      /* End of the current batch.  */
+  unsigned long long ndone;    /* Sectors of the batch done.  */
+  int stop;                    /* Tell the threads to terminate.  */
+  int error;                   /* ERRNO of the first failed write.  */
+};
+
 
 /* Return the size measured in the number of 512 byte sectors for the
    block device NAME.  */
@@ -69,6 +99,226 @@ sh_blockdev_getsz (const char *name, unsigned long long *r_nblocks)
 }
 
 
+/* Write the LENGTH bytes of BUFFER at OFFSET to FD.  Returns 0 or
+ * an errno value.  */
+static int
+fill_write (int fd, const char *buffer, size_t length, off_t offset)
+{
+  ssize_t n;
+
+  while (length)
+    {
+      n = pwrite (fd, buffer, length, offset);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return errno;
+      if (!n)
+        return ENOSPC;
+      buffer += n;
+      length -= n;
+      offset += n;
+    }
+  return 0;
+}
+
+
+/* The thread to write the chunks of a fill job.  */
+static void *
+fill_thread (void *arg)
+{
+  struct fill_job_s *job = arg;
+  unsigned long long sector, nsect;
+  int rc;
+
+  npth_mutex_lock (&job->lock);
+  for (;;)
+    {
+      while (!job->stop && !job->error && job->next >= job->end)
+        npth_cond_wait (&job->cond, &job->lock);
+      if (job->stop || job->error)
+        break;
+
+      sector = job->next;
+      nsect = job->end - sector;
+      if (nsect > FILL_CHUNK_SECTORS)
+        nsect = FILL_CHUNK_SECTORS;
+      job->next += nsect;
+      npth_mutex_unlock (&job->lock);
+
+      rc = fill_write (job->fd, job->buffer, nsect * SECTOR_SIZE,
+                       (off_t)(job->start + sector) * SECTOR_SIZE);
+
+      npth_mutex_lock (&job->lock);
+      if (rc && !job->error)
+        job->error = rc;
+      job->ndone += nsect;
+      npth_cond_broadcast (&job->cond);
+    }
+  npth_mutex_unlock (&job->lock);
+  return NULL;
+}
+
+
+/* Send a progress status line for a fill job.  */
+static void
+fill_progress (ctrl_t ctrl, unsigned long long done,
+               unsigned long long total)
+{
+  char curbuf[35], totbuf[35];
+
+  snprintf (curbuf, sizeof curbuf, "%llu", done / 2048);
+  snprintf (totbuf, sizeof totbuf, "%llu", total / 2048);
+  g13_status (ctrl, STATUS_PROGRESS, "g13_fill", "?", curbuf, totbuf, "MiB",
+              NULL);
+}
+
+
+/* Overwrite NSECTORS sectors of the block device NAME starting at
+ * sector START with zeroes.  If NAME is a dm-crypt mapping this fills
+ * the underlying device with ciphertext, which looks random.  The
+ * first RESUME sectors are assumed to be already written.  The data
+ * is written by several threads using O_DIRECT.  Progress is
+ * reported using status lines.  After each batch the data is synced
+ * and CKPT_CB is called with the number of sectors written so far;
+ * if the process is killed a new call may resume from there.  */
+gpg_error_t
+sh_blockdev_fill (ctrl_t ctrl, const char *name,
+                  unsigned long long start, unsigned long long nsectors,
+                  unsigned long long resume,
+                  gpg_error_t (*ckpt_cb)(void *opaque,
+                                         unsigned long long done),
+                  void *ckpt_cb_value)
+{
+  gpg_error_t err = 0;
+  struct fill_job_s job;
+  npth_t threads[FILL_THREADS];
+  int nthreads = 0;
+  npth_attr_t tattr;
+  char *buffer_mem = NULL;
+  unsigned long long pos, batch;
+  time_t last = 0;
+  int i;
+
+  memset (&job, 0, sizeof job);
+  job.fd = -1;
+  job.start = start;
+  npth_mutex_init (&job.lock, NULL);
+  npth_cond_init (&job.cond, NULL);
+
+  if (resume > nsectors)
+    resume = nsectors;
+
+  buffer_mem = xtrycalloc (1, FILL_CHUNK_SECTORS * SECTOR_SIZE + FILL_ALIGN);
+  if (!buffer_mem)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  job.buffer = buffer_mem + (FILL_ALIGN
+                             - ((size_t)buffer_mem % FILL_ALIGN));
+
+#ifdef O_DIRECT
+  /* Bypass the page cache; we won't read the data again.  */
+  job.fd = open (name, O_WRONLY | O_DIRECT);
+  if (job.fd == -1 && errno == EINVAL)
+#endif
+    job.fd = open (name, O_WRONLY);
+  if (job.fd == -1)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error opening '%s': %s\n", name, gpg_strerror (err));
+      goto leave;
+    }
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (i=0; i < FILL_THREADS; i++)
+    {
+      if (npth_create (&threads[nthreads], &tattr, fill_thread, &job))
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error creating fill thread: %s\n", gpg_strerror (err));
+          break;
+        }
+      nthreads++;
+    }
+  npth_attr_destroy (&tattr);
+  if (!nthreads)
+    goto leave;
+  err = 0;
+
+  if (resume)
+    log_info ("resuming fill of '%s' at sector %llu\n", name, resume);
+
+  fill_progress (ctrl, resume, nsectors);
+  for (pos = resume; pos < nsectors; pos += batch)
+    {
+      batch = nsectors - pos;
+      if (batch > FILL_BATCH_SECTORS)
+        batch = FILL_BATCH_SECTORS;
+
+      npth_mutex_lock (&job.lock);
+      job.next = pos;
+      job.end = pos + batch;
+      job.ndone = 0;
+      npth_cond_broadcast (&job.cond);
+      while (!job.error && job.ndone < batch)
+        {
+          npth_cond_wait (&job.cond, &job.lock);
+          if (gnupg_get_time () != last)
+            {
+              unsigned long long done = pos + job.ndone;
+
+              last = gnupg_get_time ();
+              npth_mutex_unlock (&job.lock);
+              fill_progress (ctrl, done, nsectors);
+              npth_mutex_lock (&job.lock);
+            }
+        }
+      /* Wait for the writes still running after an error.  */
+      while (job.error && job.next - pos > job.ndone)
+        npth_cond_wait (&job.cond, &job.lock);
+      if (job.error)
+        err = gpg_error_from_errno (job.error);
+      npth_mutex_unlock (&job.lock);
+      if (err)
+        {
+          log_error ("error filling '%s': %s\n", name, gpg_strerror (err));
+          goto leave;
+        }
+
+      if (fdatasync (job.fd))
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error syncing '%s': %s\n", name, gpg_strerror (err));
+          goto leave;
+        }
+      if (ckpt_cb)
+        {
+          err = ckpt_cb (ckpt_cb_value, pos + batch);
+          if (err)
+            goto leave;
+        }
+    }
+  fill_progress (ctrl, nsectors, nsectors);
+
+ leave:
+  npth_mutex_lock (&job.lock);
+  job.stop = 1;
+  npth_cond_broadcast (&job.cond);
+  npth_mutex_unlock (&job.lock);
+  for (i=0; i < nthreads; i++)
+    npth_join (threads[i], NULL);
+  if (job.fd != -1)
+    close (job.fd);
+  npth_cond_destroy (&job.cond);
+  npth_mutex_destroy (&job.lock);
+  xfree (buffer_mem);
+  return err;
+}
+
+
 /* Return 0 if the device NAME looks like an empty partition. */
 gpg_error_t
 sh_is_empty_partition (const char *name)
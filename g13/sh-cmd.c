@@ -313,16 +313,35 @@ cmd_device (assuan_context_t ctx, char *line)
 
 
 static const char hlp_create[] =
-  "CREATE <type>\n"
+  "CREATE [--fill=zero|random] <type>\n"
   "\n"
   "Create a new encrypted partition on the current device.\n"
-  "<type> must be \"dm-crypt\" for now.";
+  "<type> must be \"dm-crypt\" for now.  With --fill the encrypted\n"
+  "space is overwritten with zeroes or with data which looks random;\n"
+  "progress is reported with PROGRESS status lines.";
 static gpg_error_t
 cmd_create (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
   gpg_error_t err = 0;
   estream_t fp = NULL;
+  int fill_mode = FILL_MODE_NONE;
+  const char *s;
+
+  s = strstr (line, "--fill=");
+  if (s && s < skip_options (line))
+    {
+      s += 7;
+      if (!strncmp (s, "zero", 4) && (!s[4] || spacep (s+4)))
+        fill_mode = FILL_MODE_ZERO;
+      else if (!strncmp (s, "random", 6) && (!s[6] || spacep (s+6)))
+        fill_mode = FILL_MODE_RANDOM;
+      else
+        {
+          err = set_error (GPG_ERR_INV_ARG, "Invalid fill mode");
+          goto leave;
+        }
+    }
 
   line = skip_options (line);
   if (strcmp (line, "dm-crypt"))
@@ -367,7 +386,7 @@ cmd_create (assuan_context_t ctx, char *line)
 
   err = sh_dmcrypt_create_container (ctrl,
                                      ctrl->server_local->devicename,
-                                     fp);
+                                     fp, fill_mode);
   if (es_fclose (fp))
     {
       gpg_error_t err2 = gpg_error_from_syserror ();
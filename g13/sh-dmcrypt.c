@@ -41,6 +41,7 @@
 #include "../common/i18n.h"
 #include "g13tuple.h"
 #include "../common/exectool.h"
+#include "../common/host2net.h"
 #include "keyblob.h"
 
 /* The standard disk block size (logical).  */
@@ -69,6 +70,15 @@
    less an arbitrary value.  */
 #define MIN_ENCRYPTED_SPACE 32
 
+/* While the encrypted space is filled a checkpoint is kept in the
+   first sector of the footer space; that space is written only after
+   the fill.  The checkpoint is the magic, the fill mode, 7 reserved
+   bytes, the size of the encrypted space and the number of sectors
+   already written; the two numbers are 64 bit big endian.  */
+#define FILL_CKPT_MAGIC     "GnuPG/G13/FILL"
+#define FILL_CKPT_MAGIC_LEN 15
+#define FILL_CKPT_LEN       40
+
 /* Some consistency checks for the above constants.  */
 #if (PHY_SECTOR_SIZE % SECTOR_SIZE)
 # error the physical secotor size should be a multiple of 512
@@ -219,9 +229,102 @@ mk_setup_area_prefix (size_t *r_length)
 }
 
 
-/* Create a new g13 styloe DM-Crypt container on devoce DEVNAME.  */
+/* Context for the fill checkpoint.  */
+struct fill_ckpt_s
+{
+  estream_t devfp;
+  const char *devname;
+  unsigned long long offset;   /* Sector of the checkpoint.  */
+  unsigned long long nblocks;  /* Size of the encrypted space.  */
+  int fill_mode;
+};
+
+
+/* Return the number of sectors of an interrupted fill recorded in
+   the checkpoint CKPT or 0.  */
+static unsigned long long
+read_fill_checkpoint (struct fill_ckpt_s *ckpt)
+{
+  unsigned char buf[FILL_CKPT_LEN];
+  unsigned long long done;
+  size_t nread;
+
+  if (es_fseeko (ckpt->devfp, ckpt->offset * SECTOR_SIZE, SEEK_SET)
+      || es_read (ckpt->devfp, buf, sizeof buf, &nread)
+      || nread != sizeof buf)
+    {
+      es_clearerr (ckpt->devfp);
+      return 0;
+    }
+  if (memcmp (buf, FILL_CKPT_MAGIC, FILL_CKPT_MAGIC_LEN)
+      || buf[FILL_CKPT_MAGIC_LEN] != ckpt->fill_mode
+      || (((unsigned long long)buf32_to_u32 (buf+24) << 32)
+          | buf32_to_u32 (buf+28)) != ckpt->nblocks)
+    return 0;
+  done = (((unsigned long long)buf32_to_u32 (buf+32) << 32)
+          | buf32_to_u32 (buf+36));
+  return done <= ckpt->nblocks? done : 0;
+}
+
+
+/* Callback for sh_blockdev_fill to write the checkpoint.  */
+static gpg_error_t
+write_fill_checkpoint (void *opaque, unsigned long long done)
+{
+  struct fill_ckpt_s *ckpt = opaque;
+  gpg_error_t err = 0;
+  unsigned char buf[FILL_CKPT_LEN];
+  size_t nwritten;
+
+  memset (buf, 0, sizeof buf);
+  memcpy (buf, FILL_CKPT_MAGIC, FILL_CKPT_MAGIC_LEN);
+  buf[FILL_CKPT_MAGIC_LEN] = ckpt->fill_mode;
+  ulongtobuf (buf+24, (u32)(ckpt->nblocks >> 32));
+  ulongtobuf (buf+28, (u32)ckpt->nblocks);
+  ulongtobuf (buf+32, (u32)(done >> 32));
+  ulongtobuf (buf+36, (u32)done);
+
+  if (es_fseeko (ckpt->devfp, ckpt->offset * SECTOR_SIZE, SEEK_SET)
+      || es_write (ckpt->devfp, buf, sizeof buf, &nwritten)
+      || es_fflush (ckpt->devfp))
+    err = gpg_error_from_syserror ();
+  else if (nwritten != sizeof buf)
+    err = gpg_error (GPG_ERR_TOO_SHORT);
+  else if (fsync (es_fileno (ckpt->devfp)))
+    err = gpg_error_from_syserror ();
+  if (err)
+    log_error ("error writing fill checkpoint of '%s': %s\n",
+               ckpt->devname, gpg_strerror (err));
+  return err;
+}
+
+
+/* Remove the device mapper target TARGETNAME after a failed create.  */
+static void
+remove_target (const char *targetname)
+{
+  gpg_error_t err;
+  const char *argv[3];
+  char *result = NULL;
+
+  argv[0] = "remove";
+  argv[1] = targetname;
+  argv[2] = NULL;
+  log_debug ("now running \"dmsetup remove %s\"\n", targetname);
+  err = gnupg_exec_tool ("/sbin/dmsetup", argv, NULL, &result, NULL);
+  if (err)
+    log_error ("error running \"dmsetup remove %s\": %s\n",
+               targetname, gpg_strerror (err));
+  xfree (result);
+}
+
+
+/* Create a new g13 styloe DM-Crypt container on devoce DEVNAME.  If
+   FILL_MODE is not FILL_MODE_NONE the encrypted space is overwritten
+   before the setup areas are written.  */
 gpg_error_t
-sh_dmcrypt_create_container (ctrl_t ctrl, const char *devname, estream_t devfp)
+sh_dmcrypt_create_container (ctrl_t ctrl, const char *devname, estream_t devfp,
+                             int fill_mode)
 {
   gpg_error_t err;
   char *header_space;
@@ -450,6 +553,50 @@ sh_dmcrypt_create_container (ctrl_t ctrl, const char *devname, estream_t devfp)
   if (result && *result)
     log_debug ("dmsetup result: %s\n", result);
 
+  /* Fill the encrypted space.  This is done before writing the setup
+     area so that a container whose fill was interrupted is still
+     considered empty and the create can be repeated; it then resumes
+     at the recorded checkpoint.  For a random fill the already written
+     part has been encrypted with the old key; that is fine because we
+     only need data which can't be told from ciphertext.  */
+  if (fill_mode != FILL_MODE_NONE)
+    {
+      struct fill_ckpt_s ckpt;
+      char *fillname;
+      unsigned long long fillstart;
+
+      ckpt.devfp = devfp;
+      ckpt.devname = devname;
+      ckpt.offset = HEADER_SECTORS + nblocks;
+      ckpt.nblocks = nblocks;
+      ckpt.fill_mode = fill_mode;
+
+      /* For a random fill we write through the new mapping which
+         starts at HEADER_SECTORS of the device.  */
+      if (fill_mode == FILL_MODE_RANDOM)
+        {
+          fillname = strconcat ("/dev/mapper/", targetname, NULL);
+          fillstart = 0;
+        }
+      else
+        {
+          fillname = xtrystrdup (devname);
+          fillstart = HEADER_SECTORS;
+        }
+      if (!fillname)
+        err = gpg_error_from_syserror ();
+      else
+        err = sh_blockdev_fill (ctrl, fillname, fillstart, nblocks,
+                                read_fill_checkpoint (&ckpt),
+                                write_fill_checkpoint, &ckpt);
+      xfree (fillname);
+      if (err)
+        {
+          remove_target (targetname);
+          goto leave;
+        }
+    }
+
   /* Write the setup area.  */
   if (es_fseeko (devfp, 0, SEEK_SET))
     {
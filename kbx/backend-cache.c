@@ -38,12 +38,15 @@
 #include "keybox-defs.h"
 
 
-/* Standard values for the number of buckets and the threshold we use
- * to flush items.  */
-#define NO_OF_KEY_ITEM_BUCKETS          383
-#define KEY_ITEMS_PER_BUCKET_THRESHOLD  40
-#define NO_OF_BLOB_BUCKETS              383
-#define BLOBS_PER_BUCKET_THRESHOLD      20
+/* Standard values for the maximum number of cached items and the
+ * minimum number of buckets.  The number of buckets is derived from
+ * the maximum number of items so that the average length of a chain
+ * stays at about ITEMS_PER_BUCKET.  */
+#define DEFAULT_KEY_CACHE_SIZE   15000
+#define DEFAULT_BLOB_CACHE_SIZE  7500
+#define MIN_CACHE_SIZE           64
+#define MIN_NO_OF_BUCKETS        383
+#define ITEMS_PER_BUCKET         8
 
 
 /* Our definition of the backend handle.  */
@@ -58,6 +61,8 @@ struct backend_handle_s
 typedef struct blob_s
 {
   struct blob_s *next;
+  struct blob_s *lru_prev;    /* Links for the LRU list.  The head of  */
+  struct blob_s *lru_next;    /* the list is the most recently used.  */
   enum pubkey_types pktype;
   unsigned int refcount;
   unsigned int usecount;
@@ -69,9 +74,14 @@ typedef struct blob_s
 
 static blob_t *blob_table;                /* Hash table with the blobs.   */
 static size_t blob_table_size;            /* Number of allocated buckets. */
-static unsigned int blob_table_threshold; /* Max. # of items per bucket.  */
+static unsigned int blob_table_max;       /* Max. # of cached items.      */
+static unsigned int blob_table_count;     /* Current # of cached items.   */
 static unsigned int blob_table_added;     /* Number of items added.       */
-static unsigned int blob_table_dropped;   /* Number of items dropped.     */
+static unsigned int blob_table_dropped;   /* Number of items evicted.     */
+static unsigned long blob_table_hits;     /* Number of lookup hits.       */
+static unsigned long blob_table_misses;   /* Number of lookup misses.     */
+static blob_t blob_lru_head;              /* Most recently used blob.     */
+static blob_t blob_lru_tail;              /* Least recently used blob.    */
 static blob_t blob_attic;                 /* List of freed blobs.         */
 
 
@@ -106,6 +116,8 @@ static bloblist_t bloblist_attic;  /* List of freed items.  */
 typedef struct key_item_s
 {
   struct key_item_s *next;
+  struct key_item_s *lru_prev; /* Links for the LRU list.  The head of  */
+  struct key_item_s *lru_next; /* the list is the most recently used.  */
   bloblist_t  blist;       /* List of blobs or NULL for not-found.  */
   unsigned int usecount;
   unsigned int refcount;   /* Reference counter for this item.  */
@@ -115,32 +127,68 @@ typedef struct key_item_s
 
 static key_item_t *key_table;            /* Hash table with the keys.    */
 static size_t key_table_size;            /* Number of allocated buckets. */
-static unsigned int key_table_threshold; /* Max. # of items per bucket.  */
+static unsigned int key_table_max;       /* Max. # of cached items.      */
+static unsigned int key_table_count;     /* Current # of cached items.   */
 static unsigned int key_table_added;     /* Number of items added.       */
-static unsigned int key_table_dropped;   /* Number of items dropped.     */
+static unsigned int key_table_dropped;   /* Number of items evicted.     */
+static key_item_t key_lru_head;          /* Most recently used item.     */
+static key_item_t key_lru_tail;          /* Least recently used item.    */
 static key_item_t key_item_attic;        /* List of freed items.         */
 
+/* Counters for the outcome of be_cache_search.  */
+static unsigned long cache_search_hits;     /* Found in the cache.      */
+static unsigned long cache_search_neghits;  /* Cached as not found.     */
+static unsigned long cache_search_misses;   /* Not in the cache.        */
+
 
 
 
-/* The hash function we use for the key_table.  Must not call a system
+/* Return the number of buckets to use for a table holding up to
+ * MAXITEMS items.  */
+static size_t
+compute_table_size (unsigned int maxitems)
+{
+  size_t n;
+
+  n = maxitems / ITEMS_PER_BUCKET;
+  if (n < MIN_NO_OF_BUCKETS)
+    n = MIN_NO_OF_BUCKETS;
+  return n | 1;  /* Avoid an even modulus.  */
+}
+
+
+/* Return the configured maximum number of items for a cache table.
+ * VALUE is the value from the option and DEFVALUE the default.  */
+static unsigned int
+configured_cache_size (unsigned int value, unsigned int defvalue)
+{
+  if (!value)
+    return defvalue;
+  if (value < MIN_CACHE_SIZE)
+    return MIN_CACHE_SIZE;
+  return value;
+}
+
+
+/* The hash function we use for the blob_table.  Must not call a system
  * function.  */
 static inline unsigned int
 blob_table_hasher (const unsigned char *ubid)
 {
-  return (ubid[0] << 16 | ubid[1]) % blob_table_size;
+  return buf32_to_uint (ubid) % blob_table_size;
 }
 
 
-/* Runtime allocation of the key table.  This allows us to eventually
- * add an option to control the size.  */
+/* Runtime allocation of the blob table.  The size is controlled by
+ * the option --blob-cache-size.  */
 static gpg_error_t
 blob_table_init (void)
 {
   if (blob_table)
     return 0;
-  blob_table_size = NO_OF_BLOB_BUCKETS;
-  blob_table_threshold  = BLOBS_PER_BUCKET_THRESHOLD;
+  blob_table_max = configured_cache_size (opt.blob_cache_size,
+                                          DEFAULT_BLOB_CACHE_SIZE);
+  blob_table_size = compute_table_size (blob_table_max);
   blob_table = xtrycalloc (blob_table_size, sizeof *blob_table);
   if (!blob_table)
     return gpg_error_from_syserror ();
@@ -187,20 +235,66 @@ find_blob (unsigned int hash, const unsigned char *ubid,
 }
 
 
-/* Helper for the qsort in key_table_put.  */
+/* Move the blob B to the head of the LRU list.  If B is not yet on
+ * the list it is inserted.  Must not call a system function.  */
+static void
+blob_lru_touch (blob_t b)
+{
+  if (b == blob_lru_head)
+    return;
+
+  /* Unlink.  */
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else if (b == blob_lru_tail)
+    blob_lru_tail = b->lru_prev;
+
+  /* Insert at the head.  */
+  b->lru_prev = NULL;
+  b->lru_next = blob_lru_head;
+  if (blob_lru_head)
+    blob_lru_head->lru_prev = b;
+  blob_lru_head = b;
+  if (!blob_lru_tail)
+    blob_lru_tail = b;
+}
+
+
+/* Remove the least recently used blob from the table.  Returns false
+ * if the table is empty.  Note that this may call free and thus the
+ * caller needs to start over with its bucket lookup.  */
 static int
-compare_blobs (const void *arg_a, const void *arg_b)
+blob_table_evict (void)
 {
-  const blob_t a = *(const blob_t *)arg_a;
-  const blob_t b = *(const blob_t *)arg_b;
+  blob_t b, *bp;
 
-  /* Reverse sort on the usecount.  */
-  if (a->usecount > b->usecount)
-    return -1;
-  else if (a->usecount == b->usecount)
+  b = blob_lru_tail;
+  if (!b)
     return 0;
+
+  /* Unlink from the LRU list.  */
+  blob_lru_tail = b->lru_prev;
+  if (blob_lru_tail)
+    blob_lru_tail->lru_next = NULL;
   else
-    return 1;
+    blob_lru_head = NULL;
+  b->lru_prev = b->lru_next = NULL;
+
+  /* Unlink from the bucket.  */
+  for (bp = &blob_table[blob_table_hasher (b->ubid)]; *bp; bp = &(*bp)->next)
+    if (*bp == b)
+      {
+        *bp = b->next;
+        break;
+      }
+  b->next = NULL;
+
+  blob_table_count--;
+  blob_table_dropped++;
+  blob_unref (b);
+  return 1;
 }
 
 
@@ -212,12 +306,12 @@ blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
 {
   unsigned int hash;
   blob_t b;
-  unsigned int count, n;
+  unsigned int n;
   void *blobdatacopy = NULL;
 
   hash = blob_table_hasher (ubid);
  find_again:
-  b = find_blob (hash, ubid, &count);
+  b = find_blob (hash, ubid, NULL);
   if (b)
     {
       xfree (blobdatacopy);
@@ -237,70 +331,14 @@ blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
       memcpy (blobdatacopy, blobdata, blobdatalen);
     }
 
-  /* If the bucket is full remove a couple of items. */
-  if (count >= blob_table_threshold)
+  /* If the cache is full evict the least recently used items.  */
+  if (blob_table_count >= blob_table_max)
     {
-      blob_t list_head, *list_tailp, b_next;
-      blob_t *array;
-      int narray, idx;
-
-      /* Unlink from the global list so that other threads don't
-       * disturb us.  If another thread adds or removes something only
-       * one will be the winner.  Bad luck for the dropped cache items
-       * but after all it is just a cache.  */
-      list_head = blob_table[hash];
-      blob_table[hash] = NULL;
-
-      /* Put all items into an array for sorting.  */
-      array = xtrycalloc (count, sizeof *array);
-      if (!array)
-        {
-          /* That's bad; give up all  items of the bucket.  */
-          log_info ("Note: malloc failed while purging blobs from the "
-                    "cache: %s\n", gpg_strerror (gpg_error_from_syserror ()));
-          goto leave_drop;
-        }
-      narray = 0;
-      for (b = list_head; b; b = b_next)
-        {
-          b_next = b->next;
-          array[narray++] = b;
-          b->next = NULL;
-        }
-      log_assert (narray == count);
-
-      /* Sort the array and put half of it onto a new list.  */
-      qsort (array, narray, sizeof *array, compare_blobs);
-      list_head = NULL;
-      list_tailp = &list_head;
-      for (idx=0; idx < narray/2; idx++)
-        {
-          *list_tailp = array[idx];
-          list_tailp = &array[idx]->next;
-        }
-
-      /* Put the new list into the bucket.  */
-      b = blob_table[hash];
-      blob_table[hash] = list_head;
-      list_head = b;
-
-      /* Free the remaining items and the array.  */
-      for (; idx < narray; idx++)
-        {
-          blob_unref (array[idx]);
-          blob_table_dropped++;
-        }
-      xfree (array);
-
-    leave_drop:
-      /* Free any items added in the meantime by other threads.  This
-       * is also used in case of a malloc problem (which won't update
-       * the counters, though). */
-      for ( ; list_head; list_head = b_next)
-        {
-          b_next = list_head->next;
-          blob_unref (list_head);
-        }
+      for (n = 0; blob_table_count >= blob_table_max && blob_table_evict (); )
+        n++;
+      /* Freeing the blobs might have let other threads run.  */
+      if (n)
+        goto find_again;
     }
 
   /* Add an item to the bucket.  We allocate a whole block of items
@@ -341,8 +379,11 @@ blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
   memcpy (b->ubid, ubid, UBID_LEN);
   b->usecount = 1;
   b->refcount = 1;
+  b->lru_prev = b->lru_next = NULL;
   b->next = blob_table[hash];
   blob_table[hash] = b;
+  blob_lru_touch (b);
+  blob_table_count++;
   blob_table_added++;
 }
 
@@ -361,9 +402,12 @@ blob_table_get (const unsigned char *ubid)
     {
       b->usecount++;
       b->refcount++;
+      blob_lru_touch (b);
+      blob_table_hits++;
       return b;  /* Found  */
     }
 
+  blob_table_misses++;
   return NULL;
 }
 
@@ -378,15 +422,16 @@ key_table_hasher (u32 kid_l)
 }
 
 
-/* Runtime allocation of the key table.  This allows us to eventually
- * add an option to control the size.  */
+/* Runtime allocation of the key table.  The size is controlled by
+ * the option --key-cache-size.  */
 static gpg_error_t
 key_table_init (void)
 {
   if (key_table)
     return 0;
-  key_table_size = NO_OF_KEY_ITEM_BUCKETS;
-  key_table_threshold  = KEY_ITEMS_PER_BUCKET_THRESHOLD;
+  key_table_max = configured_cache_size (opt.key_cache_size,
+                                         DEFAULT_KEY_CACHE_SIZE);
+  key_table_size = compute_table_size (key_table_max);
   key_table = xtrycalloc (key_table_size, sizeof *key_table);
   if (!key_table)
     return gpg_error_from_syserror ();
@@ -441,20 +486,67 @@ find_in_chain (unsigned int hash, u32 kid_h, u32 kid_l,
 }
 
 
-/* Helper for the qsort in key_table_put.  */
+/* Move the key item KI to the head of the LRU list.  If KI is not
+ * yet on the list it is inserted.  Must not call a system
+ * function.  */
+static void
+key_lru_touch (key_item_t ki)
+{
+  if (ki == key_lru_head)
+    return;
+
+  /* Unlink.  */
+  if (ki->lru_prev)
+    ki->lru_prev->lru_next = ki->lru_next;
+  if (ki->lru_next)
+    ki->lru_next->lru_prev = ki->lru_prev;
+  else if (ki == key_lru_tail)
+    key_lru_tail = ki->lru_prev;
+
+  /* Insert at the head.  */
+  ki->lru_prev = NULL;
+  ki->lru_next = key_lru_head;
+  if (key_lru_head)
+    key_lru_head->lru_prev = ki;
+  key_lru_head = ki;
+  if (!key_lru_tail)
+    key_lru_tail = ki;
+}
+
+
+/* Remove the least recently used key item from the table.  Returns
+ * false if the table is empty.  Must not call a system function.  */
 static int
-compare_key_items (const void *arg_a, const void *arg_b)
+key_table_evict (void)
 {
-  const key_item_t a = *(const key_item_t *)arg_a;
-  const key_item_t b = *(const key_item_t *)arg_b;
+  key_item_t ki, *kip;
 
-  /* Reverse sort on the usecount.  */
-  if (a->usecount > b->usecount)
-    return -1;
-  else if (a->usecount == b->usecount)
+  ki = key_lru_tail;
+  if (!ki)
     return 0;
+
+  /* Unlink from the LRU list.  */
+  key_lru_tail = ki->lru_prev;
+  if (key_lru_tail)
+    key_lru_tail->lru_next = NULL;
   else
-    return 1;
+    key_lru_head = NULL;
+  ki->lru_prev = ki->lru_next = NULL;
+
+  /* Unlink from the bucket.  */
+  for (kip = &key_table[key_table_hasher (ki->kid_l)]; *kip;
+       kip = &(*kip)->next)
+    if (*kip == ki)
+      {
+        *kip = ki->next;
+        break;
+      }
+  ki->next = NULL;
+
+  key_table_count--;
+  key_table_dropped++;
+  key_item_unref (ki);
+  return 1;
 }
 
 
@@ -545,85 +637,6 @@ new_bloblist_item (const unsigned char *fpr, unsigned int fprlen,
 }
 
 
-/* If the list of key item in the bucken HASH is full remove a couple
- * of them.  On error a diagnostic is printed and an error code
- * return.  Note that the error code GPG_ERR_TRUE is returned if any
- * flush and thus system calls were done.
- */
-static gpg_error_t
-maybe_flush_some_key_buckets (unsigned int hash, unsigned int count)
-{
-  gpg_error_t err;
-  key_item_t ki, list_head, *list_tailp, ki_next;
-  key_item_t *array;
-  int narray, idx;
-
-  if (count < key_table_threshold)
-    return 0;  /* Nothing to do.  */
-
-  /* Unlink from the global list so that other threads don't disturb
-   * us.  If another thread adds or removes something only one will be
-   * the winner.  Bad luck for the dropped cache items but after all
-   * it is just a cache.  */
-  list_head = key_table[hash];
-  key_table[hash] = NULL;
-
-  /* Put all items into an array for sorting.  */
-  array = xtrycalloc (count, sizeof *array);
-  if (!array)
-    {
-      /* That's bad; give up all items of the bucket.  */
-      err = gpg_error_from_syserror ();
-      log_info ("Note: malloc failed while purging from the cache: %s\n",
-                gpg_strerror (err));
-      goto leave;
-    }
-  narray = 0;
-  for (ki = list_head; ki; ki = ki_next)
-    {
-      ki_next = ki->next;
-      array[narray++] = ki;
-      ki->next = NULL;
-    }
-  log_assert (narray == count);
-
-  /* Sort the array and put half of it onto a new list.  */
-  qsort (array, narray, sizeof *array, compare_key_items);
-  list_head = NULL;
-  list_tailp = &list_head;
-  for (idx=0; idx < narray/2; idx++)
-    {
-      *list_tailp = array[idx];
-      list_tailp = &array[idx]->next;
-    }
-
-  /* Put the new list into the bucket.  */
-  ki = key_table[hash];
-  key_table[hash] = list_head;
-  list_head = ki;
-
-  /* Free the remaining items and the array.  */
-  for (; idx < narray; idx++)
-    {
-      key_item_unref (array[idx]);
-      key_table_dropped++;
-    }
-  xfree (array);
-  err = gpg_error (GPG_ERR_TRUE);
-
- leave:
-  /* Free any items added in the meantime by other threads.  This is
-   * also used in case of a malloc problem (which won't update the
-   * counters, though). */
-  for ( ; list_head; list_head = ki_next)
-    {
-      ki_next = list_head->next;
-      key_item_unref (list_head);
-    }
-  return err;
-}
-
-
 /* This is the core of
  *   key_table_put,
  *   key_table_put_no_fpr,
@@ -637,16 +650,16 @@ do_key_table_put (u32 kid_h, u32 kid_l,
   unsigned int hash;
   key_item_t ki;
   bloblist_t bl, bl_tail;
-  unsigned int count;
   int do_find_again;
   int mark_not_found = !fpr;
 
   hash = key_table_hasher (kid_l);
  find_again:
   do_find_again = 0;
-  ki = find_in_chain (hash, kid_h, kid_l, &count);
+  ki = find_in_chain (hash, kid_h, kid_l, NULL);
   if (ki)
     {
+      key_lru_touch (ki);
       if (mark_not_found)
         return; /* Can't put the mark because meanwhile a entry was
                  * added.  */
@@ -677,14 +690,6 @@ do_key_table_put (u32 kid_h, u32 kid_l,
       return;
     }
 
-  /* If the bucket is full remove a couple of items. */
-  if (maybe_flush_some_key_buckets (hash, count))
-    {
-      /* During the function call another thread might have changed
-       * the bucket.  Thus we need to start over.  */
-      do_find_again = 1;
-    }
-
   if (!key_item_attic)
     {
       if (alloc_more_key_items ())
@@ -704,6 +709,8 @@ do_key_table_put (u32 kid_h, u32 kid_l,
 
   /* We now know that there are items in the attics.  Put them into
    * the chain.  Note that we may not use any system call here. */
+  while (key_table_count >= key_table_max && key_table_evict ())
+    ;
   ki = key_item_attic;
   key_item_attic = ki->next;
   ki->next = NULL;
@@ -717,9 +724,12 @@ do_key_table_put (u32 kid_h, u32 kid_l,
   ki->kid_l = kid_l;
   ki->usecount = 1;
   ki->refcount = 1;
+  ki->lru_prev = ki->lru_next = NULL;
 
   ki->next = key_table[hash];
   key_table[hash] = ki;
+  key_lru_touch (ki);
+  key_table_count++;
   key_table_added++;
 }
 
@@ -798,6 +808,7 @@ key_table_get (u32 kid_h, u32 kid_l)
     {
       ki->usecount++;
       ki->refcount++;
+      key_lru_touch (ki);
       return ki;  /* Found  */
     }
 
@@ -859,6 +870,54 @@ be_cache_initialize (void)
 }
 
 
+/* Store the current cache statistics at R_STATS.  */
+void
+be_cache_get_stats (struct be_cache_stats_s *r_stats)
+{
+  memset (r_stats, 0, sizeof *r_stats);
+  r_stats->keys       = key_table_count;
+  r_stats->max_keys   = key_table_max;
+  r_stats->key_added  = key_table_added;
+  r_stats->key_evicted = key_table_dropped;
+  r_stats->blobs      = blob_table_count;
+  r_stats->max_blobs  = blob_table_max;
+  r_stats->blob_added = blob_table_added;
+  r_stats->blob_evicted = blob_table_dropped;
+  r_stats->blob_hits  = blob_table_hits;
+  r_stats->blob_misses = blob_table_misses;
+  r_stats->hits       = cache_search_hits;
+  r_stats->neghits    = cache_search_neghits;
+  r_stats->misses     = cache_search_misses;
+}
+
+
+/* Return an array with the UBIDs of up to MAXITEMS cached blobs; the
+ * most recently used first.  The number of UBIDs is stored at
+ * R_COUNT.  The caller must xfree the result.  NULL is returned if
+ * the cache is empty or on a memory error.  */
+unsigned char *
+be_cache_recent_ubids (unsigned int maxitems, unsigned int *r_count)
+{
+  unsigned char *result;
+  unsigned int n;
+  blob_t b;
+
+  *r_count = 0;
+  if (!maxitems || !blob_lru_head)
+    return NULL;
+  if (maxitems > blob_table_count)
+    maxitems = blob_table_count;
+
+  result = xtrymalloc (maxitems * UBID_LEN);
+  if (!result)
+    return NULL;
+  for (n=0, b = blob_lru_head; b && n < maxitems; b = b->lru_next, n++)
+    memcpy (result + n * UBID_LEN, b->ubid, UBID_LEN);
+  *r_count = n;
+  return result;
+}
+
+
 /* Install a new resource and return a handle for that backend.  */
 gpg_error_t
 be_cache_add_resource (ctrl_t ctrl, backend_handle_t *r_hd)
@@ -1078,6 +1137,12 @@ be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request,
     err = gpg_error (GPG_ERR_EOF);
 
  leave:
+  if (!err)
+    cache_search_hits++;
+  else if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    cache_search_neghits++;
+  else if (gpg_err_code (err) == GPG_ERR_EOF)
+    cache_search_misses++;
   return err;
 }
 
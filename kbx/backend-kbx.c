@@ -233,6 +233,8 @@ be_kbx_init_request_part (backend_handle_t backend_hd, db_request_part_t part)
   part->kbx_hd = keybox_new_openpgp (backend_hd->token, 0);
   if (!part->kbx_hd)
     return gpg_error_from_syserror ();
+  keybox_set_mmap (part->kbx_hd, 1);
+  keybox_set_scan_threads (part->kbx_hd, opt.scan_threads);
   return 0;
 }
 
@@ -51,11 +51,16 @@ gpg_err_code_from_sqlite (int sqlres)
 #endif /*GPGRT_VERSION_NUMBER*/
 
 
+/* The time in milliseconds a reader waits for a busy database.  */
+#define READER_BUSY_TIMEOUT 5000
+
+
 /* Our definition of the backend handle.  */
 struct backend_handle_s
 {
   enum database_types db_type; /* Always DB_TYPE_SQLITE.  */
   unsigned int backend_id;     /* Always the id of the backend.  */
+  int readonly;                /* The database may not be modified.  */
 
   char filename[1];
 };
@@ -64,12 +69,23 @@ struct backend_handle_s
 /* Definition of local request data.  */
 struct be_sqlite_local_s
 {
+  /* The read-only database connection of this request or NULL.  It
+   * is used for selects without holding DATABASE_MUTEX.  */
+  sqlite3 *reader_hd;
+
+  /* The database connection SELECT_STMT belongs to.  This is either
+   * DATABASE_HD or READER_HD.  */
+  sqlite3 *select_db;
+
   /* The statement object of the current select command.  */
   sqlite3_stmt *select_stmt;
 
   /* The search mode represented by the current select command.  */
   KeydbSearchMode select_mode;
 
+  /* The current select command uses the full text index.  */
+  int select_fts;
+
   /* The select statement has been executed with success.  */
   int select_done;
 
@@ -80,12 +96,74 @@ struct be_sqlite_local_s
 
 /* The Mutex we use to protect all our SQLite calls.  */
 static npth_mutex_t database_mutex = NPTH_MUTEX_INITIALIZER;
-/* The one and only database handle. */
+/* The one and only database handle used for writing. */
 static sqlite3 *database_hd;
+/* True if the database uses write-ahead logging.  Only in this case
+ * we use separate connections for readers.  */
+static int database_wal;
+
+/* True if the full text index USERIDFTS is available.  */
+static int database_fts;
+
 /* A lockfile used make sure only we are accessing the database.  */
 static dotlock_t database_lock;
 
 
+/* The statements we keep prepared for the lifetime of DATABASE_HD.
+ * The index into CACHED_SQL and STMT_CACHE is one of the STMT_
+ * constants.  */
+enum cached_stmt_ids
+  {
+   STMT_BEGIN,
+   STMT_COMMIT,
+   STMT_ROLLBACK,
+   STMT_SAVEPOINT,
+   STMT_RELEASE,
+   STMT_ROLLBACK_TO,
+   STMT_PUBKEY_UPDATE,
+   STMT_PUBKEY_INSERT,
+   STMT_PUBKEY_AUTO,
+   STMT_FPR_STORE,
+   STMT_UID_STORE,
+   STMT_FPR_DELETE,
+   STMT_UID_DELETE,
+   STMT_PUBKEY_DELETE,
+   N_CACHED_STMTS
+  };
+static const char *cached_sql[N_CACHED_STMTS] =
+  {
+   "begin transaction",
+   "commit",
+   "rollback",
+   "SAVEPOINT kbxd_store",
+   "RELEASE kbxd_store",
+   "ROLLBACK TO kbxd_store",
+   "UPDATE pubkey set keyblob = :3, type = :2 WHERE ubid = :1",
+   "INSERT INTO pubkey(ubid,type,keyblob) VALUES(:1,:2,:3)",
+   "INSERT OR REPLACE INTO pubkey(ubid,type,keyblob) VALUES(:1,:2,:3)",
+   "INSERT OR REPLACE INTO fingerprint(fpr,kid,keygrip,subkey,ubid)"
+   " VALUES(:1,:2,:3,:4,:5)",
+   "INSERT OR REPLACE INTO userid(uid,addrspec,type,ubid)"
+   " VALUES(:1,:2,:3,:4)",
+   "DELETE FROM fingerprint WHERE ubid = :1",
+   "DELETE FROM userid WHERE ubid = :1",
+   "DELETE FROM pubkey WHERE ubid = :1"
+  };
+static sqlite3_stmt *stmt_cache[N_CACHED_STMTS];
+
+
+/* State of a bulk store.  In bulk mode the stores of one connection
+ * are collected in a single transaction which is committed after
+ * LIMIT stores, by be_sqlite_commit_bulk, or before any store or
+ * delete of another connection.  Each store is wrapped into a
+ * savepoint so that a failed store does not affect the others.  */
+static struct
+{
+  ctrl_t owner;          /* The connection owning the transaction.  */
+  unsigned int pending;  /* Number of stores not yet committed.     */
+} bulk_state;
+
+
 static struct
 {
   const char *sql;
@@ -156,6 +234,39 @@ static struct
   };
 
 
+/* The optional full text index for substring searches on user ids
+ * and mail addresses.  A LIKE with a leading wildcard can't use the
+ * indices of the userid table but it can use an FTS5 table with the
+ * trigram tokenizer.  The index is an external content table of the
+ * userid table and kept up to date by triggers.  */
+static const char *fts_definitions[] =
+  {
+   "CREATE VIRTUAL TABLE useridfts USING fts5 ("
+   "uid, addrspec, content='userid', content_rowid='rowid',"
+   " tokenize='trigram')",
+
+   "CREATE TRIGGER useridfts_ai AFTER INSERT ON userid BEGIN"
+   " INSERT INTO useridfts (rowid, uid, addrspec)"
+   " VALUES (new.rowid, new.uid, new.addrspec);"
+   " END",
+
+   "CREATE TRIGGER useridfts_ad AFTER DELETE ON userid BEGIN"
+   " INSERT INTO useridfts (useridfts, rowid, uid, addrspec)"
+   " VALUES ('delete', old.rowid, old.uid, old.addrspec);"
+   " END",
+
+   "CREATE TRIGGER useridfts_au AFTER UPDATE ON userid BEGIN"
+   " INSERT INTO useridfts (useridfts, rowid, uid, addrspec)"
+   " VALUES ('delete', old.rowid, old.uid, old.addrspec);"
+   " INSERT INTO useridfts (rowid, uid, addrspec)"
+   " VALUES (new.rowid, new.uid, new.addrspec);"
+   " END",
+
+   /* Index the already existing user ids.  */
+   "INSERT INTO useridfts (useridfts) VALUES ('rebuild')"
+  };
+
+
 
 
 /* Take a lock for accessing SQLite.  */
@@ -288,14 +399,15 @@ run_sql_reset (sqlite3_stmt *stmt)
 }
 
 
-/* Run an SQL prepare for SQLSTR and return a statement at R_STMT.  */
+/* Run an SQL prepare for SQLSTR on the connection DB and return a
+ * statement at R_STMT.  */
 static gpg_error_t
-run_sql_prepare (const char *sqlstr, sqlite3_stmt **r_stmt)
+run_sql_prepare_db (sqlite3 *db, const char *sqlstr, sqlite3_stmt **r_stmt)
 {
   gpg_error_t err;
   int res;
 
-  res = sqlite3_prepare_v2 (database_hd, sqlstr, -1, r_stmt, NULL);
+  res = sqlite3_prepare_v2 (db, sqlstr, -1, r_stmt, NULL);
   if (res)
     err = diag_prepare_err (res, sqlstr);
   else
@@ -304,6 +416,14 @@ run_sql_prepare (const char *sqlstr, sqlite3_stmt **r_stmt)
 }
 
 
+/* Run an SQL prepare for SQLSTR and return a statement at R_STMT.  */
+static gpg_error_t
+run_sql_prepare (const char *sqlstr, sqlite3_stmt **r_stmt)
+{
+  return run_sql_prepare_db (database_hd, sqlstr, r_stmt);
+}
+
+
 /* Helper to bind a BLOB parameter to a statement.  */
 static gpg_error_t
 run_sql_bind_blob (sqlite3_stmt *stmt, int no,
@@ -423,14 +543,23 @@ run_sql_step (sqlite3_stmt *stmt)
 
 /* Wrapper around sqlite3_step for use with select.  This version does
  * not print diags for SQLITE_DONE or SQLITE_ROW but returns them as
- * gpg error codes.  */
+ * gpg error codes.  If UNPROTECTED is set the step is run outside of
+ * the npth lock so that other threads can run meanwhile; this may
+ * only be used for a private connection.  */
 static gpg_error_t
-run_sql_step_for_select (sqlite3_stmt *stmt)
+run_sql_step_for_select (sqlite3_stmt *stmt, int unprotected)
 {
   gpg_error_t err;
   int res;
 
-  res = sqlite3_step (stmt);
+  if (unprotected)
+    {
+      npth_unprotect ();
+      res = sqlite3_step (stmt);
+      npth_protect ();
+    }
+  else
+    res = sqlite3_step (stmt);
   if (res == SQLITE_DONE || res == SQLITE_ROW)
     err = gpg_error (gpg_err_code_from_sqlite (res));
   else
@@ -448,6 +577,95 @@ run_sql_step_for_select (sqlite3_stmt *stmt)
 }
 
 
+/* Return the cached statement ID at R_STMT; it is prepared on first
+ * use.  The caller must return it using put_cached_stmt and may not
+ * finalize it.  */
+static gpg_error_t
+get_cached_stmt (enum cached_stmt_ids id, sqlite3_stmt **r_stmt)
+{
+  gpg_error_t err;
+
+  if (!stmt_cache[id])
+    {
+      err = run_sql_prepare (cached_sql[id], &stmt_cache[id]);
+      if (err)
+        {
+          *r_stmt = NULL;
+          return err;
+        }
+    }
+  *r_stmt = stmt_cache[id];
+  return 0;
+}
+
+
+/* Make the cached statement STMT ready for its next use.  */
+static void
+put_cached_stmt (sqlite3_stmt *stmt)
+{
+  if (!stmt)
+    return;
+  /* The return value of the reset is the error of the last step
+   * which has already been diagnosed.  */
+  sqlite3_reset (stmt);
+  sqlite3_clear_bindings (stmt);
+}
+
+
+/* Run the cached statement ID.  If UBID is not NULL this will be
+ * bound to :1.  This command may not be used for select or other
+ * commands which return rows.  */
+static gpg_error_t
+run_cached_stmt_bind_ubid (enum cached_stmt_ids id,
+                           const unsigned char *ubid)
+{
+  gpg_error_t err;
+  sqlite3_stmt *stmt;
+
+  err = get_cached_stmt (id, &stmt);
+  if (err)
+    return err;
+  if (ubid)
+    err = run_sql_bind_blob (stmt, 1, ubid, UBID_LEN);
+  if (!err)
+    err = run_sql_step (stmt);
+  put_cached_stmt (stmt);
+  return err;
+}
+
+
+/* Run the cached statement ID which takes no parameters.  */
+static gpg_error_t
+run_cached_stmt (enum cached_stmt_ids id)
+{
+  return run_cached_stmt_bind_ubid (id, NULL);
+}
+
+
+/* Commit the transaction of a bulk store.  Must be called with the
+ * mutex held.  */
+static gpg_error_t
+commit_bulk (void)
+{
+  gpg_error_t err;
+
+  if (!bulk_state.owner)
+    return 0;
+
+  err = run_cached_stmt (STMT_COMMIT);
+  if (err)
+    {
+      log_error ("error committing %u bulk stores: %s\n",
+                 bulk_state.pending, gpg_strerror (err));
+      if (run_cached_stmt (STMT_ROLLBACK))
+        log_error ("Warning: database rollback failed - should not happen!\n");
+    }
+  bulk_state.owner = NULL;
+  bulk_state.pending = 0;
+  return err;
+}
+
+
 /* Run the simple SQL statement in SQLSTR.  If UBID is not NULL this
  * will be bound to :1 in SQLSTR.  This command may not be used for
  * select or other command which return rows.  */
@@ -486,11 +704,98 @@ run_sql_statement (const char *sqlstr)
 }
 
 
+/* Switch the database to WAL mode and set DATABASE_WAL accordingly.
+ * If READONLY is set the mode is only checked.  Failing to use WAL
+ * is not an error; we then use only the main connection.  */
+static gpg_error_t
+enable_wal_mode (int readonly)
+{
+  gpg_error_t err;
+  sqlite3_stmt *stmt;
+  const unsigned char *mode;
+
+  database_wal = 0;
+  err = run_sql_prepare (readonly? "PRAGMA journal_mode"
+                         /*   */: "PRAGMA journal_mode = WAL", &stmt);
+  if (err)
+    return err;
+  err = run_sql_step_for_select (stmt, 0);
+  if (gpg_err_code (err) == GPG_ERR_SQL_ROW)
+    {
+      mode = sqlite3_column_text (stmt, 0);
+      if (mode && !strcmp ((const char *)mode, "wal"))
+        database_wal = 1;
+      else
+        log_info ("Note: database journal mode is '%s'"
+                  " - disabling concurrent readers\n",
+                  mode? (const char *)mode : "?");
+      err = 0;
+    }
+  sqlite3_finalize (stmt);
+  return err;
+}
+
+
+/* Check whether the full text index exists and, unless READONLY is
+ * set, create it if not.  Sets DATABASE_FTS accordingly.  The index
+ * requires SQLite 3.34 with FTS5; without it we fall back to plain
+ * LIKE searches.  */
+static void
+setup_fts_index (int readonly)
+{
+  gpg_error_t err;
+  sqlite3_stmt *stmt;
+  int idx;
+
+  database_fts = 0;
+  err = run_sql_prepare ("SELECT name FROM sqlite_master"
+                         " WHERE type = 'table' AND name = 'useridfts'",
+                         &stmt);
+  if (err)
+    return;
+  err = run_sql_step_for_select (stmt, 0);
+  sqlite3_finalize (stmt);
+  if (gpg_err_code (err) == GPG_ERR_SQL_ROW)
+    {
+      database_fts = 1;
+      return;
+    }
+  if (readonly || gpg_err_code (err) != GPG_ERR_SQL_DONE)
+    return;
+
+  if (sqlite3_libversion_number () < 3034000
+      || !sqlite3_compileoption_used ("ENABLE_FTS5"))
+    {
+      if (opt.verbose)
+        log_info ("Note: SQLite lacks FTS5 trigram support"
+                  " - substring searches are not indexed\n");
+      return;
+    }
+
+  err = run_sql_statement ("SAVEPOINT kbxd_fts");
+  if (err)
+    return;
+  for (idx=0; idx < DIM (fts_definitions) && !err; idx++)
+    err = run_sql_statement (fts_definitions[idx]);
+  if (err && run_sql_statement ("ROLLBACK TO kbxd_fts"))
+    log_error ("Warning: database rollback failed - should not happen!\n");
+  if (run_sql_statement ("RELEASE kbxd_fts") && !err)
+    err = gpg_error (GPG_ERR_GENERAL);
+  if (!err)
+    {
+      database_fts = 1;
+      if (!opt.quiet)
+        log_info ("full text index for user ids created\n");
+    }
+}
+
+
 /* Create and initialize a new SQL database file if it does not
  * exists; else open it and check that all required objects are
- * available.  */
+ * available.  If READONLY is set the database is opened read-only
+ * and it must already exist.  */
 static gpg_error_t
-create_or_open_database (const char *filename)
+create_or_open_database (const char *filename, int readonly)
 {
   gpg_error_t err;
   int res;
@@ -533,9 +838,10 @@ create_or_open_database (const char *filename)
    * npth_unprotect/protect.  */
   res = sqlite3_open_v2 (filename,
                          &database_hd,
-                         (SQLITE_OPEN_READWRITE
-                          | SQLITE_OPEN_CREATE
-                          | SQLITE_OPEN_NOMUTEX),
+                         (readonly
+                          ? SQLITE_OPEN_READONLY
+                          : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE))
+                         | SQLITE_OPEN_NOMUTEX,
                          NULL);
   if (res)
     {
@@ -546,6 +852,20 @@ create_or_open_database (const char *filename)
   /* Enable extended error codes.  */
   sqlite3_extended_result_codes (database_hd, 1);
 
+  /* Switch to write-ahead logging so that readers on their own
+   * connections do not block the writer and vice versa.  This is a
+   * persistent property of the database.  */
+  err = enable_wal_mode (readonly);
+  if (err)
+    goto leave;
+
+  if (readonly)
+    {
+      setup_fts_index (1);
+      err = 0;
+      goto leave;
+    }
+
   /* Create the tables if needed.  */
   for (idx=0; idx < DIM(table_definitions); idx++)
     {
@@ -558,6 +878,7 @@ create_or_open_database (const char *filename)
           // FIXME
         }
     }
+  setup_fts_index (0);
 
   if (!opt.quiet)
     log_info (_("database '%s' created\n"), filename);
@@ -568,6 +889,11 @@ create_or_open_database (const char *filename)
     {
       log_error (_("error creating database '%s': %s\n"),
                  filename, gpg_strerror (err));
+      if (database_hd)
+        {
+          sqlite3_close (database_hd);
+          database_hd = NULL;
+        }
       dotlock_release (database_lock);
       dotlock_destroy (database_lock);
       database_lock = NULL;
@@ -586,16 +912,16 @@ be_sqlite_add_resource (ctrl_t ctrl, backend_handle_t *r_hd,
   backend_handle_t hd;
 
   (void)ctrl;
-  (void)readonly;  /* FIXME: implement read-only mode.  */
 
   *r_hd = NULL;
   hd = xtrycalloc (1, sizeof *hd + strlen (filename));
   if (!hd)
     return gpg_error_from_syserror ();
   hd->db_type = DB_TYPE_SQLITE;
+  hd->readonly = !!readonly;
   strcpy (hd->filename, filename);
 
-  err = create_or_open_database (filename);
+  err = create_or_open_database (filename, hd->readonly);
   if (err)
     goto leave;
 
@@ -644,10 +970,44 @@ be_sqlite_release_local (be_sqlite_local_t ctx)
 {
   if (ctx->select_stmt)
     sqlite3_finalize (ctx->select_stmt);
+  if (ctx->reader_hd)
+    sqlite3_close (ctx->reader_hd);
   xfree (ctx);
 }
 
 
+/* Open the private read-only connection for the request CTX.  Returns
+ * an error if this is not possible or not useful; the caller then
+ * falls back to the main connection.  */
+static gpg_error_t
+open_reader (backend_handle_t backend_hd, be_sqlite_local_t ctx)
+{
+  gpg_error_t err;
+  int res;
+
+  if (ctx->reader_hd)
+    return 0;
+  if (!database_wal || !sqlite3_threadsafe ())
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  res = sqlite3_open_v2 (backend_hd->filename, &ctx->reader_hd,
+                         SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+  if (res)
+    {
+      err = gpg_error (gpg_err_code_from_sqlite (res));
+      log_error ("error opening reader for '%s': %s\n",
+                 backend_hd->filename, sqlite3_errstr (res));
+      sqlite3_close (ctx->reader_hd);
+      ctx->reader_hd = NULL;
+      database_wal = 0;  /* Don't try again.  */
+      return err;
+    }
+  sqlite3_extended_result_codes (ctx->reader_hd, 1);
+  sqlite3_busy_timeout (ctx->reader_hd, READER_BUSY_TIMEOUT);
+  return 0;
+}
+
+
 /* Run a select for the search given by (DESC,NDESC).  The data is not
  * returned but stored in the request item.  */
 static gpg_error_t
@@ -656,6 +1016,7 @@ run_select_statement (be_sqlite_local_t ctx,
 {
   gpg_error_t err = 0;
   unsigned int descidx;
+  int fts;
 
   descidx = 0; /* Fixme: take from context.  */
   if (descidx >= ndesc)
@@ -664,16 +1025,24 @@ run_select_statement (be_sqlite_local_t ctx,
       goto leave;
     }
 
+  /* The trigram index can only be used with at least 3 characters;
+   * for shorter substrings we need to scan the table.  */
+  fts = (database_fts
+         && (desc[descidx].mode == KEYDB_SEARCH_MODE_SUBSTR
+             || desc[descidx].mode == KEYDB_SEARCH_MODE_MAILSUB)
+         && strlen (desc[descidx].u.name) >= 3);
+
   /* Check whether we can re-use the current select statement.  */
   if (!ctx->select_stmt)
     ;
-  else if (ctx->select_mode != desc[descidx].mode)
+  else if (ctx->select_mode != desc[descidx].mode || ctx->select_fts != fts)
     {
       sqlite3_finalize (ctx->select_stmt);
       ctx->select_stmt = NULL;
     }
 
   ctx->select_mode = desc[descidx].mode;
+  ctx->select_fts = fts;
 
   /* Prepare the select and bind the parameters.  */
   if (ctx->select_stmt)
@@ -694,41 +1063,65 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_EXACT:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE u.uid = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (ctx->select_db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, userid as u"
+                                  " WHERE u.uid = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_text (ctx->select_stmt, 1, desc[descidx].u.name);
       break;
 
     case KEYDB_SEARCH_MODE_MAIL:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE u.addrspec = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (ctx->select_db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, userid as u"
+                                  " WHERE u.addrspec = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_text (ctx->select_stmt, 1, desc[descidx].u.name);
       break;
 
     case KEYDB_SEARCH_MODE_MAILSUB:
-      if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE u.addrspec LIKE ?1",
-                               &ctx->select_stmt);
+      /* With the full text index the LIKE is also applied to the
+       * userid table so that a stale index can't yield wrong keys.  */
+      if (!ctx->select_stmt && fts)
+        err = run_sql_prepare_db (ctx->select_db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, userid as u"
+                                  " WHERE p.ubid = u.ubid AND u.rowid IN"
+                                  " (SELECT rowid FROM useridfts"
+                                  "  WHERE addrspec LIKE ?1)"
+                                  " AND u.addrspec LIKE ?1",
+                                  &ctx->select_stmt);
+      else if (!ctx->select_stmt)
+        err = run_sql_prepare_db (ctx->select_db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, userid as u"
+                                  " WHERE u.addrspec LIKE ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_text_like (ctx->select_stmt, 1,
                                       desc[descidx].u.name);
       break;
 
     case KEYDB_SEARCH_MODE_SUBSTR:
-      if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE u.uid LIKE ?1",
-                               &ctx->select_stmt);
+      if (!ctx->select_stmt && fts)
+        err = run_sql_prepare_db (ctx->select_db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, userid as u"
+                                  " WHERE p.ubid = u.ubid AND u.rowid IN"
+                                  " (SELECT rowid FROM useridfts"
+                                  "  WHERE uid LIKE ?1)"
+                                  " AND u.uid LIKE ?1",
+                                  &ctx->select_stmt);
+      else if (!ctx->select_stmt)
+        err = run_sql_prepare_db (ctx->select_db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, userid as u"
+                                  " WHERE u.uid LIKE ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_text_like (ctx->select_stmt, 1,
                                       desc[descidx].u.name);
@@ -773,10 +1166,11 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_LONG_KID:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, fingerprint as f"
-                               " WHERE p.ubid = f.ubid AND f.kid = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (ctx->select_db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, fingerprint as f"
+                                  " WHERE p.ubid = f.ubid AND f.kid = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_int64 (ctx->select_stmt, 1,
                                   kid_from_u32 (desc[descidx].u.kid));
@@ -784,10 +1178,11 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_FPR:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, fingerprint as f"
-                               " WHERE p.ubid = f.ubid AND f.fpr = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (ctx->select_db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, fingerprint as f"
+                                  " WHERE p.ubid = f.ubid AND f.fpr = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_blob (ctx->select_stmt, 1,
                                  desc[descidx].u.fpr, desc[descidx].fprlen);
@@ -795,10 +1190,11 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_KEYGRIP:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, fingerprint as f"
-                               " WHERE p.ubid = f.ubid AND f.keygrip = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (ctx->select_db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, fingerprint as f"
+                                  " WHERE p.ubid = f.ubid AND f.keygrip = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_blob (ctx->select_stmt, 1,
                                  desc[descidx].u.grip, KEYGRIP_LEN);
@@ -806,10 +1202,11 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_UBID:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT ubid, type, keyblob"
-                               " FROM pubkey"
-                               " WHERE ubid = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (ctx->select_db,
+                                  "SELECT ubid, type, keyblob"
+                                  " FROM pubkey"
+                                  " WHERE ubid = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_blob (ctx->select_stmt, 1,
                                  desc[descidx].u.ubid, UBID_LEN);
@@ -817,9 +1214,10 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_FIRST:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT ubid, type, keyblob"
-                               " FROM pubkey ORDER by ubid",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (ctx->select_db,
+                                  "SELECT ubid, type, keyblob"
+                                  " FROM pubkey ORDER by ubid",
+                                  &ctx->select_stmt);
       break;
 
     case KEYDB_SEARCH_MODE_NEXT:
@@ -838,7 +1236,10 @@ run_select_statement (be_sqlite_local_t ctx,
 
 /* Search for the keys described by (DESC,NDESC) and return them to
  * the caller.  BACKEND_HD is the handle for this backend and REQUEST
- * is the current database request object.  */
+ * is the current database request object.  If possible the select is
+ * run on a private read-only connection of the request without
+ * taking the database mutex so that searches of several connections
+ * can run concurrently.  */
 gpg_error_t
 be_sqlite_search (ctrl_t ctrl,
                   backend_handle_t backend_hd, db_request_t request,
@@ -847,18 +1248,45 @@ be_sqlite_search (ctrl_t ctrl,
   gpg_error_t err;
   db_request_part_t part;
   be_sqlite_local_t ctx;
+  int got_mutex = 0;
+  sqlite3 *db;
 
   log_assert (backend_hd && backend_hd->db_type == DB_TYPE_SQLITE);
   log_assert (request);
 
-  acquire_mutex ();
-
   /* Find the specific request part or allocate it.  */
   err = be_find_request_part (backend_hd, request, &part);
   if (err)
     goto leave;
   ctx = part->besqlite;
 
+  if (desc && !ctx->select_done)
+    {
+      /* Select the connection for a new select.  A connection with
+       * pending bulk stores needs to see them and thus uses the main
+       * connection.  This is also true for all other connections in
+       * bulk mode because a client may use several connections for
+       * one import.  */
+      if (!(bulk_state.owner == ctrl
+            || (bulk_state.owner && ctrl->bulk_store))
+          && !open_reader (backend_hd, ctx))
+        db = ctx->reader_hd;
+      else
+        db = database_hd;
+      if (ctx->select_stmt && ctx->select_db != db)
+        {
+          sqlite3_finalize (ctx->select_stmt);
+          ctx->select_stmt = NULL;
+        }
+      ctx->select_db = db;
+    }
+
+  if (!ctx->select_db || ctx->select_db == database_hd)
+    {
+      acquire_mutex ();
+      got_mutex = 1;
+    }
+
   if (!desc)
     {
       /* Reset */
@@ -887,7 +1315,7 @@ be_sqlite_search (ctrl_t ctrl,
   show_sqlstmt (ctx->select_stmt);
 
   /* SQL select succeeded - get the first or next row. */
-  err = run_sql_step_for_select (ctx->select_stmt);
+  err = run_sql_step_for_select (ctx->select_stmt, !got_mutex);
   if (gpg_err_code (err) == GPG_ERR_SQL_ROW)
     {
       int n;
@@ -899,7 +1327,7 @@ be_sqlite_search (ctrl_t ctrl,
       n = sqlite3_column_bytes (ctx->select_stmt, 0);
       if (!ubid || n < 0)
         {
-          if (!ubid && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+          if (!ubid && sqlite3_errcode (ctx->select_db) == SQLITE_NOMEM)
             err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
           else
             err = gpg_error (GPG_ERR_DB_CORRUPTED);
@@ -916,7 +1344,7 @@ be_sqlite_search (ctrl_t ctrl,
         }
 
       n = sqlite3_column_int (ctx->select_stmt, 1);
-      if (!n && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+      if (!n && sqlite3_errcode (ctx->select_db) == SQLITE_NOMEM)
         {
           err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
           show_sqlstmt (ctx->select_stmt);
@@ -930,7 +1358,7 @@ be_sqlite_search (ctrl_t ctrl,
       n = sqlite3_column_bytes (ctx->select_stmt, 2);
       if (!keyblob || n < 0)
         {
-          if (!keyblob && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+          if (!keyblob && sqlite3_errcode (ctx->select_db) == SQLITE_NOMEM)
             err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
           else
             err = gpg_error (GPG_ERR_DB_CORRUPTED);
@@ -957,7 +1385,8 @@ be_sqlite_search (ctrl_t ctrl,
     }
 
  leave:
-  release_mutex ();
+  if (got_mutex)
+    release_mutex ();
   return err;
 }
 
@@ -971,17 +1400,14 @@ store_into_pubkey (enum kbxd_store_modes mode,
                    const void *blob, size_t bloblen)
 {
   gpg_error_t err;
-  const char *sqlstr;
   sqlite3_stmt *stmt = NULL;
 
   if (mode == KBXD_STORE_UPDATE)
-    sqlstr = ("UPDATE pubkey set keyblob = :3, type = :2 WHERE ubid = :1");
+    err = get_cached_stmt (STMT_PUBKEY_UPDATE, &stmt);
   else if (mode == KBXD_STORE_INSERT)
-    sqlstr = ("INSERT INTO pubkey(ubid,type,keyblob) VALUES(:1,:2,:3)");
+    err = get_cached_stmt (STMT_PUBKEY_INSERT, &stmt);
   else /* Auto */
-    sqlstr = ("INSERT OR REPLACE INTO pubkey(ubid,type,keyblob)"
-              " VALUES(:1,:2,:3)");
-  err = run_sql_prepare (sqlstr, &stmt);
+    err = get_cached_stmt (STMT_PUBKEY_AUTO, &stmt);
   if (err)
     goto leave;
   err = run_sql_bind_blob (stmt, 1, ubid, UBID_LEN);
@@ -997,8 +1423,7 @@ store_into_pubkey (enum kbxd_store_modes mode,
   err = run_sql_step (stmt);
 
  leave:
-  if (stmt)
-    sqlite3_finalize (stmt);
+  put_cached_stmt (stmt);
   return err;
 }
 
@@ -1011,12 +1436,9 @@ store_into_fingerprint (const unsigned char *ubid, int subkey,
                         const unsigned char *fpr, int fprlen)
 {
   gpg_error_t err;
-  const char *sqlstr;
   sqlite3_stmt *stmt = NULL;
 
-  sqlstr = ("INSERT OR REPLACE INTO fingerprint(fpr,kid,keygrip,subkey,ubid)"
-            " VALUES(:1,:2,:3,:4,:5)");
-  err = run_sql_prepare (sqlstr, &stmt);
+  err = get_cached_stmt (STMT_FPR_STORE, &stmt);
   if (err)
     goto leave;
   err = run_sql_bind_blob (stmt, 1, fpr, fprlen);
@@ -1038,8 +1460,7 @@ store_into_fingerprint (const unsigned char *ubid, int subkey,
   err = run_sql_step (stmt);
 
  leave:
-  if (stmt)
-    sqlite3_finalize (stmt);
+  put_cached_stmt (stmt);
   return err;
 }
 
@@ -1051,13 +1472,10 @@ store_into_userid (const unsigned char *ubid, enum pubkey_types pktype,
                    const char *uid)
 {
   gpg_error_t err;
-  const char *sqlstr;
   sqlite3_stmt *stmt = NULL;
   char *addrspec = NULL;
 
-  sqlstr = ("INSERT OR REPLACE INTO userid(uid,addrspec,type,ubid)"
-            " VALUES(:1,:2,:3,:4)");
-  err = run_sql_prepare (sqlstr, &stmt);
+  err = get_cached_stmt (STMT_UID_STORE, &stmt);
   if (err)
     goto leave;
 
@@ -1078,8 +1496,7 @@ store_into_userid (const unsigned char *ubid, enum pubkey_types pktype,
   err = run_sql_step (stmt);
 
  leave:
-  if (stmt)
-    sqlite3_finalize (stmt);
+  put_cached_stmt (stmt);
   xfree (addrspec);
   return err;
 }
@@ -1088,7 +1505,9 @@ store_into_userid (const unsigned char *ubid, enum pubkey_types pktype,
 /* Store (BLOB,BLOBLEN) into the database.  UBID is the UBID matching
  * that blob.  BACKEND_HD is the handle for this backend and REQUEST
  * is the current database request object.  MODE is the store
- * mode.  */
+ * mode.  If CTRL->BULK_STORE is set the store is added to the bulk
+ * transaction of this connection and only committed after that many
+ * stores.  */
 gpg_error_t
 be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
                  db_request_t request, enum kbxd_store_modes mode,
@@ -1100,6 +1519,7 @@ be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
   /* be_sqlite_local_t ctx; */
   int got_mutex = 0;
   int in_transaction = 0;
+  int in_savepoint = 0;
   int info_valid = 0;
   struct _keybox_openpgp_info info;
   struct _keybox_openpgp_key_info *kinfo;
@@ -1109,6 +1529,9 @@ be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
   log_assert (backend_hd && backend_hd->db_type == DB_TYPE_SQLITE);
   log_assert (request);
 
+  if (backend_hd->readonly)
+    return gpg_error (GPG_ERR_EACCES);
+
   /* Fixme: The code below is duplicated in be_ubid_from_blob - we
    * should have only one function and pass the passed info around
    * with the BLOB.  */
@@ -1145,10 +1568,32 @@ be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
     goto leave;
   /* ctx = part->besqlite; */
 
-  err = run_sql_statement ("begin transaction");
-  if (err)
-    goto leave;
-  in_transaction = 1;
+  /* A bulk transaction of another connection is committed first.  */
+  if (bulk_state.owner && (bulk_state.owner != ctrl || !ctrl->bulk_store))
+    commit_bulk ();
+
+  if (ctrl->bulk_store)
+    {
+      if (!bulk_state.owner)
+        {
+          err = run_cached_stmt (STMT_BEGIN);
+          if (err)
+            goto leave;
+          bulk_state.owner = ctrl;
+          bulk_state.pending = 0;
+        }
+      err = run_cached_stmt (STMT_SAVEPOINT);
+      if (err)
+        goto leave;
+      in_savepoint = 1;
+    }
+  else
+    {
+      err = run_cached_stmt (STMT_BEGIN);
+      if (err)
+        goto leave;
+      in_transaction = 1;
+    }
 
   err = store_into_pubkey (mode, pktype, ubid, blob, bloblen);
   if (err)
@@ -1156,12 +1601,10 @@ be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
 
   /* Delete all related rows so that we can freshly add possibly added
    * or changed user ids and subkeys.  */
-  err = run_sql_statement_bind_ubid
-    ("DELETE FROM fingerprint WHERE ubid = :1", ubid);
+  err = run_cached_stmt_bind_ubid (STMT_FPR_DELETE, ubid);
   if (err)
     goto leave;
-  err = run_sql_statement_bind_ubid
-    ("DELETE FROM userid WHERE ubid = :1", ubid);
+  err = run_cached_stmt_bind_ubid (STMT_UID_DELETE, ubid);
   if (err)
     goto leave;
 
@@ -1218,11 +1661,20 @@ be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
 
  leave:
   if (in_transaction && !err)
-    err = run_sql_statement ("commit");
+    err = run_cached_stmt (STMT_COMMIT);
   else if (in_transaction)
     {
-      if (run_sql_statement ("rollback"))
+      if (run_cached_stmt (STMT_ROLLBACK))
+        log_error ("Warning: database rollback failed - should not happen!\n");
+    }
+  else if (in_savepoint)
+    {
+      if (err && run_cached_stmt (STMT_ROLLBACK_TO))
         log_error ("Warning: database rollback failed - should not happen!\n");
+      if (run_cached_stmt (STMT_RELEASE))
+        log_error ("Warning: releasing savepoint failed\n");
+      if (!err && ++bulk_state.pending >= ctrl->bulk_store)
+        err = commit_bulk ();
     }
   if (got_mutex)
     release_mutex ();
@@ -1250,6 +1702,9 @@ be_sqlite_delete (ctrl_t ctrl, backend_handle_t backend_hd,
   log_assert (backend_hd && backend_hd->db_type == DB_TYPE_SQLITE);
   log_assert (request);
 
+  if (backend_hd->readonly)
+    return gpg_error (GPG_ERR_EACCES);
+
   acquire_mutex ();
 
   /* Find the specific request part or allocate it.  */
@@ -1258,31 +1713,47 @@ be_sqlite_delete (ctrl_t ctrl, backend_handle_t backend_hd,
     goto leave;
   /* ctx = part->besqlite; */
 
-  err = run_sql_statement ("begin transaction");
+  /* Make sure that pending bulk stores are not rolled back by the
+   * delete.  */
+  commit_bulk ();
+
+  err = run_cached_stmt (STMT_BEGIN);
   if (err)
     goto leave;
   in_transaction = 1;
 
-  err = run_sql_statement_bind_ubid
-    ("DELETE from userid WHERE ubid = :1", ubid);
+  err = run_cached_stmt_bind_ubid (STMT_UID_DELETE, ubid);
   if (!err)
-    err = run_sql_statement_bind_ubid
-      ("DELETE from fingerprint WHERE ubid = :1", ubid);
+    err = run_cached_stmt_bind_ubid (STMT_FPR_DELETE, ubid);
   if (!err)
-    err = run_sql_statement_bind_ubid
-      ("DELETE from pubkey WHERE ubid = :1", ubid);
+    err = run_cached_stmt_bind_ubid (STMT_PUBKEY_DELETE, ubid);
 
 
  leave:
   if (stmt)
     sqlite3_finalize (stmt);
   if (in_transaction && !err)
-    err = run_sql_statement ("commit");
+    err = run_cached_stmt (STMT_COMMIT);
   else if (in_transaction)
     {
-      if (run_sql_statement ("rollback"))
+      if (run_cached_stmt (STMT_ROLLBACK))
         log_error ("Warning: database rollback failed - should not happen!\n");
     }
   release_mutex ();
   return err;
 }
+
+
+/* Commit the pending bulk stores of the connection CTRL.  This is a
+ * no-op if CTRL has no pending bulk stores.  */
+gpg_error_t
+be_sqlite_commit_bulk (ctrl_t ctrl)
+{
+  gpg_error_t err = 0;
+
+  acquire_mutex ();
+  if (bulk_state.owner == ctrl)
+    err = commit_bulk ();
+  release_mutex ();
+  return err;
+}
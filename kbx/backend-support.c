@@ -172,7 +172,11 @@ be_return_pubkey (ctrl_t ctrl, const void *buffer, size_t buflen,
   char hexubid[2*UBID_LEN+1];
 
   bin2hex (ubid, UBID_LEN, hexubid);
-  err = status_printf (ctrl, "PUBKEY_INFO", "%d %s", pubkey_type, hexubid);
+  if (ctrl->batch_search)
+    err = status_printf (ctrl, "PUBKEY_INFO", "%d %s %u",
+                         pubkey_type, hexubid, ctrl->query_index);
+  else
+    err = status_printf (ctrl, "PUBKEY_INFO", "%d %s", pubkey_type, hexubid);
   if (err)
     goto leave;
 
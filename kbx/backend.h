@@ -121,7 +121,29 @@ gpg_error_t be_ubid_from_blob (const void *blob, size_t bloblen,
 
 
 /*-- backend-cache.c --*/
+
+/* Statistics about the cache as returned by be_cache_get_stats.  */
+struct be_cache_stats_s
+{
+  unsigned int keys;          /* Number of cached key items.       */
+  unsigned int max_keys;      /* Configured maximum of key items.  */
+  unsigned int key_added;     /* Number of key items added.        */
+  unsigned int key_evicted;   /* Number of key items evicted.      */
+  unsigned int blobs;         /* Number of cached blobs.           */
+  unsigned int max_blobs;     /* Configured maximum of blobs.      */
+  unsigned int blob_added;    /* Number of blobs added.            */
+  unsigned int blob_evicted;  /* Number of blobs evicted.          */
+  unsigned long blob_hits;    /* Blob lookups found in the cache.  */
+  unsigned long blob_misses;  /* Blob lookups not in the cache.    */
+  unsigned long hits;         /* Searches answered from the cache. */
+  unsigned long neghits;      /* Searches answered as not found.   */
+  unsigned long misses;       /* Searches not answered.            */
+};
+
 gpg_error_t be_cache_initialize (void);
+void be_cache_get_stats (struct be_cache_stats_s *r_stats);
+unsigned char *be_cache_recent_ubids (unsigned int maxitems,
+                                      unsigned int *r_count);
 gpg_error_t be_cache_add_resource (ctrl_t ctrl, backend_handle_t *r_hd);
 void be_cache_release_resource (ctrl_t ctrl, backend_handle_t hd);
 gpg_error_t be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd,
@@ -174,6 +196,7 @@ gpg_error_t be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
                              enum pubkey_types pktype,
                              const unsigned char *ubid,
                              const void *blob, size_t bloblen);
+gpg_error_t be_sqlite_commit_bulk (ctrl_t ctrl);
 gpg_error_t be_sqlite_delete (ctrl_t ctrl, backend_handle_t backend_hd,
                               db_request_t request, const unsigned char *ubid);
 
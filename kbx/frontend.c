@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <npth.h>
 
 #include "keyboxd.h"
 #include <assuan.h>
@@ -41,12 +42,165 @@ struct
 
 
 
+/* The lock protecting the database.  Any number of searches may run
+ * at the same time; a store or delete is run exclusively.  Note that
+ * we can't use static initialization, as that is not available
+ * through w32-pth.  */
+static npth_rwlock_t database_rwlock;
+static int database_rwlock_initialized;
+
+
+/* The number of changes to the database and the time the database
+ * was set.  Both are returned by kbxd_get_generation so that clients
+ * can tell whether their caches are still valid.  */
+static unsigned long change_generation;
+static unsigned long change_epoch;
+
+
+/* Statistics of the searches indexed by the mode of the first search
+ * description.  They are returned by kbxd_search_stats.  */
+static struct
+{
+  unsigned long count;     /* Number of searches.                  */
+  unsigned long found;     /* Number of searches returning a key.  */
+  unsigned long cached;    /* Number of searches done by the cache. */
+  unsigned long slow;      /* Number of logged slow searches.       */
+  unsigned long total_ms;  /* Total time of all searches.           */
+  unsigned long max_ms;    /* Time of the slowest search.           */
+} search_stats[KEYDB_SEARCH_MODE_NEXT + 1];
+
+
+/* Return a name for the search MODE.  */
+static const char *
+strsearchmode (KeydbSearchMode mode)
+{
+  switch (mode)
+    {
+    case KEYDB_SEARCH_MODE_NONE:      return "none";
+    case KEYDB_SEARCH_MODE_EXACT:     return "exact";
+    case KEYDB_SEARCH_MODE_SUBSTR:    return "substr";
+    case KEYDB_SEARCH_MODE_MAIL:      return "mail";
+    case KEYDB_SEARCH_MODE_MAILSUB:   return "mailsub";
+    case KEYDB_SEARCH_MODE_MAILEND:   return "mailend";
+    case KEYDB_SEARCH_MODE_WORDS:     return "words";
+    case KEYDB_SEARCH_MODE_SHORT_KID: return "short_kid";
+    case KEYDB_SEARCH_MODE_LONG_KID:  return "long_kid";
+    case KEYDB_SEARCH_MODE_FPR:       return "fpr";
+    case KEYDB_SEARCH_MODE_ISSUER:    return "issuer";
+    case KEYDB_SEARCH_MODE_ISSUER_SN: return "issuer_sn";
+    case KEYDB_SEARCH_MODE_SN:        return "sn";
+    case KEYDB_SEARCH_MODE_SUBJECT:   return "subject";
+    case KEYDB_SEARCH_MODE_KEYGRIP:   return "keygrip";
+    case KEYDB_SEARCH_MODE_UBID:      return "ubid";
+    case KEYDB_SEARCH_MODE_FIRST:     return "first";
+    case KEYDB_SEARCH_MODE_NEXT:      return "next";
+    }
+  return "?";
+}
+
+
+/* Account for the search for (DESC,NDESC) started at STARTED which
+ * returned ERR and log it if it was slow.  */
+static void
+update_search_stats (KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
+                     const struct timespec *started, gpg_error_t err)
+{
+  struct timespec now;
+  unsigned long ms;
+  int mode;
+
+  npth_clock_gettime (&now);
+  ms = ((now.tv_sec - started->tv_sec) * 1000
+        + (now.tv_nsec - started->tv_nsec) / 1000000);
+
+  mode = desc[0].mode;
+  if (mode < 0 || mode > KEYDB_SEARCH_MODE_NEXT)
+    mode = KEYDB_SEARCH_MODE_NONE;
+  search_stats[mode].count++;
+  if (!err)
+    search_stats[mode].found++;
+  if (the_database.db_type == DB_TYPE_CACHE)
+    search_stats[mode].cached++;
+  search_stats[mode].total_ms += ms;
+  if (ms > search_stats[mode].max_ms)
+    search_stats[mode].max_ms = ms;
+
+  if (opt.slow_query_ms && ms >= opt.slow_query_ms)
+    {
+      search_stats[mode].slow++;
+      log_info ("slow search (%lu ms): mode=%s ndesc=%u backend=%s: %s\n",
+                ms, strsearchmode (mode), ndesc,
+                strdbtype (the_database.db_type),
+                err? gpg_strerror (err) : "found");
+    }
+}
+
+
+/* Return a malloced string describing the state of the database or
+ * NULL on a memory error.  The string changes with each store or
+ * delete and also if keyboxd has been restarted; it has no other
+ * meaning and shall only be compared.  */
+char *
+kbxd_get_generation (void)
+{
+  return xtryasprintf ("%lu.%lu", change_epoch, change_generation);
+}
+
+
+/* Return a malloced string with the search statistics or NULL on a
+ * memory error.  Each mode used is described by one line.  */
+char *
+kbxd_search_stats (void)
+{
+  membuf_t mb;
+  int mode;
+
+  init_membuf (&mb, 256);
+  for (mode = 0; mode <= KEYDB_SEARCH_MODE_NEXT; mode++)
+    if (search_stats[mode].count)
+      put_membuf_printf (&mb,
+                         "%s n=%lu found=%lu cached=%lu slow=%lu"
+                         " total_ms=%lu max_ms=%lu\n",
+                         strsearchmode (mode),
+                         search_stats[mode].count, search_stats[mode].found,
+                         search_stats[mode].cached, search_stats[mode].slow,
+                         search_stats[mode].total_ms,
+                         search_stats[mode].max_ms);
+  put_membuf (&mb, "", 1);
+  return get_membuf (&mb, NULL);
+}
+
+
+/* Initialize the database lock.  This is called at startup.  */
+static void
+init_database_lock (void)
+{
+  int res;
+
+  if (database_rwlock_initialized)
+    return;
+  res = npth_rwlock_init (&database_rwlock, NULL);
+  if (res)
+    log_fatal ("can't initialize the database lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  database_rwlock_initialized = 1;
+}
+
+
 /* Take a lock for reading the databases.  */
 static void
 take_read_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  int res;
+
+  log_assert (!ctrl->db_lock_held);
+  if (!database_rwlock_initialized)
+    return;  /* No database configured.  */
+  res = npth_rwlock_rdlock (&database_rwlock);
+  if (res)
+    log_fatal ("can't acquire read lock on the database: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  ctrl->db_lock_held = 1;
 }
 
 
@@ -54,8 +208,16 @@ take_read_lock (ctrl_t ctrl)
 static void
 take_read_write_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  int res;
+
+  log_assert (!ctrl->db_lock_held);
+  if (!database_rwlock_initialized)
+    return;  /* No database configured.  */
+  res = npth_rwlock_wrlock (&database_rwlock);
+  if (res)
+    log_fatal ("can't acquire write lock on the database: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  ctrl->db_lock_held = 1;
 }
 
 
@@ -64,8 +226,15 @@ take_read_write_lock (ctrl_t ctrl)
 static void
 release_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  int res;
+
+  if (!ctrl->db_lock_held)
+    return;
+  res = npth_rwlock_unlock (&database_rwlock);
+  if (res)
+    log_fatal ("can't release lock on the database: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  ctrl->db_lock_held = 0;
 }
 
 
@@ -105,6 +274,8 @@ kbxd_set_database (ctrl_t ctrl, const char *filename_arg, int readonly)
       goto leave;
     }
 
+  init_database_lock ();
+
   /* Init the cache.  */
   err = be_cache_initialize ();
   if (err)
@@ -148,6 +319,7 @@ kbxd_set_database (ctrl_t ctrl, const char *filename_arg, int readonly)
   the_database.db_type = db_type;
   the_database.backend_handle = handle;
   handle = NULL;
+  change_epoch = (unsigned long)gnupg_get_time ();
 
  leave:
   if (err)
@@ -167,6 +339,11 @@ kbxd_release_session_info (ctrl_t ctrl)
 {
   if (!ctrl)
     return;
+  if (ctrl->bulk_store)
+    {
+      ctrl->bulk_store = 0;
+      kbxd_commit_bulk (ctrl);
+    }
   be_release_request (ctrl->opgp_req);
   ctrl->opgp_req = NULL;
   be_release_request (ctrl->x509_req);
@@ -186,9 +363,11 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
   gpg_error_t err;
   int i;
   db_request_t request;
+  struct timespec started;
 
   if (DBG_CLOCK)
     log_clock ("%s: enter", __func__);
+  npth_clock_gettime (&started);
 
   if (DBG_LOOKUP)
     {
@@ -316,6 +495,8 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
 
  leave:
   release_lock (ctrl);
+  if (desc && ndesc)
+    update_search_stats (desc, ndesc, &started, err);
   if (DBG_CLOCK)
     log_clock ("%s: leave (%s)", __func__, err? "not found" : "found");
   return err;
@@ -406,6 +587,8 @@ kbxd_store (ctrl_t ctrl, const void *blob, size_t bloblen,
                  __func__, the_database.db_type);
       err = gpg_error (GPG_ERR_INTERNAL);
     }
+  if (!err)
+    change_generation++;
 
 
  leave:
@@ -477,6 +660,8 @@ kbxd_delete (ctrl_t ctrl, const unsigned char *ubid)
                  __func__, the_database.db_type);
       err = gpg_error (GPG_ERR_INTERNAL);
     }
+  if (!err)
+    change_generation++;
 
 
  leave:
@@ -485,3 +670,131 @@ kbxd_delete (ctrl_t ctrl, const unsigned char *ubid)
     log_clock ("%s: leave", __func__);
   return err;
 }
+
+
+/* Write the UBIDs of up to MAXITEMS recently used keys to FNAME so
+ * that kbxd_warmup can load them again after a restart.  The file has
+ * one hex encoded UBID per line, the most recently used first.  If
+ * the cache is empty an existing file is kept.  */
+gpg_error_t
+kbxd_save_warmup (const char *fname, unsigned int maxitems)
+{
+  gpg_error_t err;
+  unsigned char *ubids;
+  unsigned int count, n;
+  char hexubid[2*UBID_LEN+1];
+  estream_t fp;
+
+  ubids = be_cache_recent_ubids (maxitems, &count);
+  if (!ubids)
+    return 0;
+
+  fp = es_fopen (fname, "w,mode=-rw");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("error creating '%s': %s\n"), fname, gpg_strerror (err));
+      xfree (ubids);
+      return err;
+    }
+  for (n=0; n < count; n++)
+    {
+      bin2hex (ubids + n * UBID_LEN, UBID_LEN, hexubid);
+      es_fprintf (fp, "%s\n", hexubid);
+    }
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("error writing '%s': %s\n"), fname, gpg_strerror (err));
+    }
+  else
+    {
+      err = 0;
+      if (opt.verbose)
+        log_info ("saved %u keys for the cache warm-up\n", count);
+    }
+  xfree (ubids);
+  return err;
+}
+
+
+/* Load the keys listed in FNAME by kbxd_save_warmup into the cache.
+ * CTRL is an unconnected control object; the searched keys are not
+ * returned but put into the cache as with any search.  This is meant
+ * to run in its own thread and thus pauses every few keys so that
+ * the connections are not starved.  The least recently used keys are
+ * loaded first so that the order of the LRU lists is restored.  Keys
+ * which do not exist anymore are silently ignored.  */
+void
+kbxd_warmup (ctrl_t ctrl, const char *fname)
+{
+  estream_t fp;
+  char line[2*UBID_LEN+10];
+  unsigned char *ubids = NULL;
+  unsigned int count = 0, allocated = 0, loaded = 0;
+  KEYDB_SEARCH_DESC desc;
+  void *tmp;
+
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    return;  /* No list - nothing to do.  */
+  while (es_fgets (line, sizeof line, fp))
+    {
+      trim_spaces (line);
+      if (strlen (line) != 2*UBID_LEN)
+        continue;
+      if (count == allocated)
+        {
+          allocated = allocated? 2*allocated : 256;
+          tmp = xtryrealloc (ubids, allocated * UBID_LEN);
+          if (!tmp)
+            {
+              log_error ("cache warm-up: %s\n",
+                         gpg_strerror (gpg_error_from_syserror ()));
+              break;
+            }
+          ubids = tmp;
+        }
+      if (hex2bin (line, ubids + count * UBID_LEN, UBID_LEN) < 0)
+        continue;
+      count++;
+    }
+  es_fclose (fp);
+
+  ctrl->no_data_return = 1;
+  while (count--)
+    {
+      memset (&desc, 0, sizeof desc);
+      desc.mode = KEYDB_SEARCH_MODE_UBID;
+      memcpy (desc.u.ubid, ubids + count * UBID_LEN, UBID_LEN);
+      if (!kbxd_search (ctrl, &desc, 1, 1))
+        loaded++;
+      if (!(count % 16))
+        npth_usleep (1000);
+    }
+  ctrl->no_data_return = 0;
+  xfree (ubids);
+
+  if (opt.verbose)
+    log_info ("cache warm-up: %u keys loaded\n", loaded);
+}
+
+
+/* Commit all stores done in bulk mode by the connection CTRL.  */
+gpg_error_t
+kbxd_commit_bulk (ctrl_t ctrl)
+{
+  gpg_error_t err;
+
+  take_read_write_lock (ctrl);
+
+  if (the_database.db_type == DB_TYPE_SQLITE)
+    err = be_sqlite_commit_bulk (ctrl);
+  else
+    err = 0;  /* Other databases have no bulk mode.  */
+  if (!err)
+    change_generation++;  /* Other connections now see the stores.  */
+
+  release_lock (ctrl);
+  return err;
+}
@@ -34,6 +34,11 @@ gpg_error_t kbxd_search (ctrl_t ctrl,
 gpg_error_t kbxd_store (ctrl_t ctrl, const void *blob, size_t bloblen,
                         enum kbxd_store_modes mode);
 gpg_error_t kbxd_delete (ctrl_t ctrl, const unsigned char *ubid);
+gpg_error_t kbxd_commit_bulk (ctrl_t ctrl);
+gpg_error_t kbxd_save_warmup (const char *fname, unsigned int maxitems);
+void kbxd_warmup (ctrl_t ctrl, const char *fname);
+char *kbxd_search_stats (void);
+char *kbxd_get_generation (void);
 
 
 #endif /*KBX_FRONTEND_H*/
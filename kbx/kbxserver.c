@@ -28,6 +28,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
+#include <fcntl.h>
 
 #include "keyboxd.h"
 #include <assuan.h>
@@ -37,6 +41,7 @@
 #include "../common/asshelp.h"
 #include "../common/host2net.h"
 #include "frontend.h"
+#include "backend.h"
 
 
 
@@ -86,6 +91,16 @@ struct server_local_s
 
   /* If not NULL write output to this stream instead of using D lines.  */
   estream_t outstream;
+
+  /* If SHM_ENABLED is set the output is written to the shared memory
+   * segment SHM_FD as set by SHMOUTPUT.  SHM_BASE is its mapping of
+   * SHM_SIZE bytes and SHM_USED the number of bytes used by the
+   * current command.  */
+  unsigned int shm_enabled : 1;
+  int shm_fd;
+  unsigned char *shm_base;
+  size_t shm_size;
+  size_t shm_used;
 };
 
 
@@ -112,6 +127,9 @@ prepare_outstream (ctrl_t ctrl)
 
   log_assert (ctrl && ctrl->server_local);
 
+  /* Each command starts at the begin of the shared memory.  */
+  ctrl->server_local->shm_used = 0;
+
   if (ctrl->server_local->outstream)
     return 0;  /* Already enabled.  */
 
@@ -151,6 +169,79 @@ kbxd_writen (estream_t fp, const void *buffer, size_t length)
 }
 
 
+/* Release the shared memory segment of the session CTRL.  */
+static void
+release_shm (ctrl_t ctrl)
+{
+  if (!ctrl->server_local->shm_enabled)
+    return;
+#ifdef HAVE_MMAP
+  if (ctrl->server_local->shm_base)
+    munmap (ctrl->server_local->shm_base, ctrl->server_local->shm_size);
+#endif
+  close (ctrl->server_local->shm_fd);
+  ctrl->server_local->shm_enabled = 0;
+  ctrl->server_local->shm_fd = -1;
+  ctrl->server_local->shm_base = NULL;
+  ctrl->server_local->shm_size = 0;
+  ctrl->server_local->shm_used = 0;
+}
+
+
+/* Copy (BUFFER,SIZE) to the shared memory segment and tell the client
+ * where to find it.  The segment is enlarged as needed.  */
+static gpg_error_t
+shm_write_data (ctrl_t ctrl, const void *buffer, size_t size)
+{
+#ifdef HAVE_MMAP
+  struct server_local_s *sl = ctrl->server_local;
+  gpg_error_t err;
+  size_t newsize;
+  void *p;
+
+  if (size > sl->shm_size - sl->shm_used)
+    {
+      newsize = sl->shm_size? sl->shm_size : 65536;
+      while (newsize - sl->shm_used < size)
+        {
+          if (newsize > ((size_t)-1) / 2)
+            return gpg_error (GPG_ERR_TOO_LARGE);
+          newsize *= 2;
+        }
+      if (ftruncate (sl->shm_fd, newsize))
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error resizing shared memory: %s\n", gpg_strerror (err));
+          return err;
+        }
+      p = mmap (NULL, newsize, PROT_READ|PROT_WRITE, MAP_SHARED,
+                sl->shm_fd, 0);
+      if (p == MAP_FAILED)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error mapping shared memory: %s\n", gpg_strerror (err));
+          return err;
+        }
+      if (sl->shm_base)
+        munmap (sl->shm_base, sl->shm_size);
+      sl->shm_base = p;
+      sl->shm_size = newsize;
+    }
+
+  memcpy (sl->shm_base + sl->shm_used, buffer, size);
+  err = status_printf (ctrl, "SHMDATA", "%zu %zu", sl->shm_used, size);
+  if (!err)
+    sl->shm_used += size;
+  return err;
+#else /*!HAVE_MMAP*/
+  (void)ctrl;
+  (void)buffer;
+  (void)size;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+#endif /*!HAVE_MMAP*/
+}
+
+
 /* A wrapper around assuan_send_data which makes debugging the output
  * in verbose mode easier.  It also takes CTRL as argument.  */
 gpg_error_t
@@ -163,6 +254,13 @@ kbxd_write_data_line (ctrl_t ctrl, const void *buffer_arg, size_t size)
   if (!ctx) /* Oops - no assuan context.  */
     return gpg_error (GPG_ERR_NOT_PROCESSED);
 
+  /* Write to the shared memory segment if enabled.  */
+  if (ctrl->server_local && ctrl->server_local->shm_enabled)
+    {
+      err = shm_write_data (ctrl, buffer, size);
+      goto leave;
+    }
+
   /* Write toa file descriptor if enabled.  */
   if (ctrl && ctrl->server_local && ctrl->server_local->outstream)
     {
@@ -220,6 +318,14 @@ kbxd_write_data_line (ctrl_t ctrl, const void *buffer_arg, size_t size)
         }
     }
 
+  /* In batch mode the client splits the data at the status lines and
+   * thus we need to flush the data before the next status line.  */
+  if (ctrl->batch_search && (err = assuan_send_data (ctx, NULL, 0)))
+    {
+      gpg_err_set_errno (EIO);
+      goto leave;
+    }
+
  leave:
   if (ctrl && ctrl->server_local && ctrl->server_local->inhibit_data_logging)
     {
@@ -268,6 +374,18 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
       if (!ctrl->lc_messages)
         return out_of_core ();
     }
+  else if (!strcmp (key, "bulk-store"))
+    {
+      /* Collect up to N stores in one transaction.  A value of 0
+       * commits all pending stores and ends the bulk mode.  */
+      unsigned long n = strtoul (value, NULL, 10);
+
+      if (n > 100000)
+        n = 100000;
+      ctrl->bulk_store = n;
+      if (!n)
+        err = kbxd_commit_bulk (ctrl);
+    }
   else
     err = gpg_error (GPG_ERR_UNKNOWN_OPTION);
 
@@ -276,27 +394,79 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
 
 
 
+/* Run a batch search for the NDESC descriptions at DESC.  In
+ * contrast to a regular search each description is handled as a
+ * separate query and all matching blobs of all queries are returned
+ * in one go.  Each blob is tagged with the index of the query it
+ * answers.  Returns GPG_ERR_NOT_FOUND if no query found anything.  */
+static gpg_error_t
+do_batch_search (ctrl_t ctrl, KEYBOX_SEARCH_DESC *desc, unsigned int ndesc)
+{
+  gpg_error_t err = 0;
+  unsigned int idx;
+  int any_found = 0;
+
+  ctrl->batch_search = 1;
+  for (idx=0; idx < ndesc; idx++)
+    {
+      ctrl->query_index = idx;
+      err = kbxd_search (ctrl, &desc[idx], 1, 1);
+      while (!err)
+        {
+          any_found = 1;
+          if (desc[idx].mode == KEYDB_SEARCH_MODE_FIRST)
+            desc[idx].mode = KEYDB_SEARCH_MODE_NEXT;
+          err = kbxd_search (ctrl, &desc[idx], 1, 0);
+        }
+      if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+        goto leave;
+      err = 0;
+    }
+
+  if (!any_found)
+    err = gpg_error (GPG_ERR_NOT_FOUND);
+
+ leave:
+  ctrl->batch_search = 0;
+  ctrl->query_index = 0;
+  return err;
+}
+
+
 static const char hlp_search[] =
-  "SEARCH [--no-data] [[--more] PATTERN]\n"
+  "SEARCH [--no-data] [[--more|--batch] PATTERN]\n"
   "\n"
   "Search for the keys identified by PATTERN.  With --more more\n"
   "patterns to be used for the search are expected with the next\n"
   "command.  With --no-data only the search status is returned but\n"
-  "not the actual data.  See also \"NEXT\".";
+  "not the actual data.  See also \"NEXT\".\n"
+  "\n"
+  "With --batch PATTERN is the last pattern and each pattern given\n"
+  "so far is used as a separate query.  All matching keys of all\n"
+  "queries are returned and the PUBKEY_INFO status line of each key\n"
+  "carries the 0-based index of its query as third argument.  NEXT\n"
+  "may not be used after a batch search.";
 static gpg_error_t
 cmd_search (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
-  int opt_more, opt_no_data;
+  int opt_more, opt_no_data, opt_batch;
   gpg_error_t err;
   unsigned int n, k;
 
   opt_no_data = has_option (line, "--no-data");
   opt_more = has_option (line, "--more");
+  opt_batch = has_option (line, "--batch");
   line = skip_options (line);
 
   ctrl->server_local->search_any_found = 0;
 
+  if (opt_more && opt_batch)
+    {
+      err = set_error (GPG_ERR_CONFLICT, "--more and --batch given");
+      goto leave;
+    }
+
   if (!*line)
     {
       if (opt_more)
@@ -383,6 +553,18 @@ cmd_search (assuan_context_t ctx, char *line)
   err = prepare_outstream (ctrl);
   if (err)
     ;
+  else if (opt_batch)
+    {
+      if (ctrl->server_local->multi_search_desc_len)
+        err = do_batch_search (ctrl, ctrl->server_local->multi_search_desc,
+                               ctrl->server_local->multi_search_desc_len);
+      else
+        err = do_batch_search (ctrl, &ctrl->server_local->search_desc, 1);
+      /* There is no defined search position after a batch and thus
+       * we do not set the flag for NEXT.  */
+      ctrl->server_local->multi_search_desc_len = 0;
+      goto leave;
+    }
   else if (ctrl->server_local->multi_search_desc_len)
     err = kbxd_search (ctrl, ctrl->server_local->multi_search_desc,
                        ctrl->server_local->multi_search_desc_len, 1);
@@ -473,7 +655,10 @@ static const char hlp_store[] =
   "With option --update the key must already exist.\n"
   "With option --insert the key must not already exist.\n"
   "The actual key material is requested by this function using\n"
-  "  INQUIRE BLOB";
+  "  INQUIRE BLOB\n"
+  "If the option \"bulk-store=N\" has been set, the stores are\n"
+  "collected and committed in transactions of N stores.  Setting\n"
+  "that option to 0 commits all pending stores.";
 static gpg_error_t
 cmd_store (assuan_context_t ctx, char *line)
 {
@@ -574,7 +759,12 @@ static const char hlp_getinfo[] =
   "pid         - Return the process id of the server.\n"
   "socket_name - Return the name of the socket.\n"
   "session_id  - Return the current session_id.\n"
-  "getenv NAME - Return value of envvar NAME\n";
+  "getenv NAME - Return value of envvar NAME\n"
+  "shm         - Return OK if SHMOUTPUT is supported\n"
+  "cache_stats - Return statistics about the key cache\n"
+  "search_stats - Return statistics about the searches\n"
+  "generation  - Return a string which changes with the data\n"
+  "connection_pool - Return statistics of the connection threads\n";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
 {
@@ -621,6 +811,74 @@ cmd_getinfo (assuan_context_t ctx, char *line)
             err = assuan_send_data (ctx, s, strlen (s));
         }
     }
+  else if (!strcmp (line, "shm"))
+    {
+#if defined(HAVE_MMAP) && !defined(HAVE_W32_SYSTEM)
+      err = 0;
+#else
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+#endif
+    }
+  else if (!strcmp (line, "generation"))
+    {
+      char *buf = kbxd_get_generation ();
+
+      if (!buf)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
+  else if (!strcmp (line, "connection_pool"))
+    {
+      char *buf = get_kbxd_connection_pool_stats ();
+
+      if (!buf)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
+  else if (!strcmp (line, "cache_stats"))
+    {
+      struct be_cache_stats_s stats;
+      char *buf;
+
+      be_cache_get_stats (&stats);
+      buf = xtryasprintf ("keys=%u/%u key_added=%u key_evicted=%u"
+                          " blobs=%u/%u blob_added=%u blob_evicted=%u"
+                          " blob_hits=%lu blob_misses=%lu"
+                          " hits=%lu neghits=%lu misses=%lu",
+                          stats.keys, stats.max_keys,
+                          stats.key_added, stats.key_evicted,
+                          stats.blobs, stats.max_blobs,
+                          stats.blob_added, stats.blob_evicted,
+                          stats.blob_hits, stats.blob_misses,
+                          stats.hits, stats.neghits, stats.misses);
+      if (!buf)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
+  else if (!strcmp (line, "search_stats"))
+    {
+      char *buf = kbxd_search_stats ();
+
+      if (!buf)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
   else
     err = set_error (GPG_ERR_ASS_PARAMETER, "unknown value for WHAT");
 
@@ -663,6 +921,65 @@ cmd_reloadkeyboxd (assuan_context_t ctx, char *line)
 }
 
 
+static const char hlp_shmoutput[] =
+  "SHMOUTPUT FD[=<n>]\n"
+  "\n"
+  "Use the memory file N to return the output data of SEARCH and NEXT.\n"
+  "If N is not given the file descriptor currently in flight will be\n"
+  "used.  The keyboxd grows the file as needed, copies the keyblocks\n"
+  "into it and emits a status line\n"
+  "\n"
+  "  SHMDATA <offset> <length>\n"
+  "\n"
+  "for each of them instead of sending the data.  The data is valid\n"
+  "until the next command.  The file must not be shrunk by the client;\n"
+  "if supported by the system a seal against shrinking is required.";
+static gpg_error_t
+cmd_shmoutput (assuan_context_t ctx, char *line)
+{
+#if defined(HAVE_MMAP) && !defined(HAVE_W32_SYSTEM)
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  gnupg_fd_t sysfd;
+  int fd;
+
+  err = assuan_command_parse_fd (ctx, line, &sysfd);
+  if (err)
+    goto leave;
+  fd = translate_sys2libc_fd (sysfd, 0);
+  if (fd == -1)
+    {
+      err = set_error (GPG_ERR_ASS_NO_OUTPUT, NULL);
+      goto leave;
+    }
+
+#ifdef F_GET_SEALS
+  /* A shrinking file would let us crash with a SIGBUS; thus make
+   * sure that the client can't do this.  */
+  {
+    int seals = fcntl (fd, F_GET_SEALS);
+    if (seals == -1 || !(seals & F_SEAL_SHRINK))
+      {
+        close (fd);
+        err = set_error (GPG_ERR_INV_ARG, "memory file not sealed");
+        goto leave;
+      }
+  }
+#endif
+
+  release_shm (ctrl);
+  ctrl->server_local->shm_fd = fd;
+  ctrl->server_local->shm_enabled = 1;
+
+ leave:
+  return leave_cmd (ctx, err);
+#else
+  (void)line;
+  return leave_cmd (ctx, gpg_error (GPG_ERR_NOT_SUPPORTED));
+#endif
+}
+
+
 static const char hlp_output[] =
   "OUTPUT FD[=<n>]\n"
   "\n"
@@ -686,6 +1003,7 @@ register_commands (assuan_context_t ctx)
     { "DELETE",     cmd_delete,     hlp_delete  },
     { "GETINFO",    cmd_getinfo,    hlp_getinfo },
     { "OUTPUT",     NULL,           hlp_output },
+    { "SHMOUTPUT",  cmd_shmoutput,  hlp_shmoutput },
     { "KILLKEYBOXD",cmd_killkeyboxd,hlp_killkeyboxd },
     { "RELOADKEYBOXD",cmd_reloadkeyboxd,hlp_reloadkeyboxd },
     { NULL, NULL }
@@ -868,6 +1186,7 @@ kbxd_start_command_handler (ctrl_t ctrl, gnupg_fd_t fd, unsigned int session_id)
                ctrl->refcount);
   else
     {
+      release_shm (ctrl);
       xfree (ctrl->server_local->multi_search_desc);
       xfree (ctrl->server_local);
       ctrl->server_local = NULL;
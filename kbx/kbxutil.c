@@ -56,6 +56,8 @@ enum cmd_and_opt_values {
   aImportOpenPGP,
   aFindDups,
   aCut,
+  aCompact,
+  aCreateSnapshot,
 
   oDebug,
   oDebugAll,
@@ -63,6 +65,8 @@ enum cmd_and_opt_values {
   oNoArmor,
   oFrom,
   oTo,
+  oSort,
+  oRebuildIndex,
 
   aTest
 };
@@ -78,11 +82,16 @@ static gpgrt_opt_t opts[] = {
   { aImportOpenPGP, "import-openpgp", 0, "import OpenPGP keyblocks"},
   { aFindDups,    "find-dups",   0, "find duplicates" },
   { aCut,         "cut",         0, "export records" },
+  { aCompact,     "compact",     0, "remove deleted and expired records" },
+  { aCreateSnapshot, "create-snapshot", 0,
+    "create an indexed keybox from OpenPGP keyrings" },
 
   { 301, NULL, 0, N_("@\nOptions:\n ") },
 
   { oFrom, "from", 4, "|N|first record to export" },
   { oTo,   "to",   4, "|N|last record to export" },
+  { oSort, "sort", 0, "sort the records by fingerprint (--compact)" },
+  { oRebuildIndex, "rebuild-index", 0, "rebuild the index (--compact)" },
 /*   { oArmor, "armor",     0, N_("create ascii armored output")}, */
 /*   { oArmor, "armour",     0, "@" }, */
 /*   { oOutput, "output",    2, N_("use as output file")}, */
@@ -393,8 +402,51 @@ dump_openpgp_key (keybox_openpgp_info_t info, const unsigned char *image)
 }
 
 
+/* Compact the keybox FILENAME.  See keybox_compress_ext for
+   FLAGS.  */
 static void
-import_openpgp (const char *filename, int dryrun)
+compact_file (const char *filename, unsigned int flags)
+{
+  gpg_error_t err;
+  void *token;
+  KEYBOX_HANDLE hd;
+
+  err = keybox_register_file (filename, 0, &token);
+  if (err && gpg_err_code (err) != GPG_ERR_EEXIST)
+    {
+      log_error ("%s: error registering keybox: %s\n",
+                 filename, gpg_strerror (err));
+      return;
+    }
+  hd = keybox_new_x509 (token, 0);
+  if (!hd)
+    {
+      log_error ("%s: error creating keybox handle: %s\n",
+                 filename, gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+
+  /* Other processes may use the keybox; thus we need to lock it.  */
+  err = keybox_lock (hd, 1, -1);
+  if (err)
+    log_error ("%s: error locking keybox: %s\n",
+               filename, gpg_strerror (err));
+  else
+    {
+      err = keybox_compress_ext (hd, flags | KEYBOX_COMPRESS_FORCE);
+      if (err)
+        log_error ("%s: error compacting keybox: %s\n",
+                   filename, gpg_strerror (err));
+      keybox_lock (hd, 0, 0);
+    }
+  keybox_release (hd);
+}
+
+
+/* Parse the OpenPGP keyblocks in FILENAME and write them as keybox
+   blobs to OUTFP.  With DRYRUN the keyblocks are only dumped.  */
+static void
+import_openpgp (const char *filename, int dryrun, FILE *outfp)
 {
   gpg_error_t err;
   char *buffer;
@@ -443,7 +495,7 @@ import_openpgp (const char *filename, int dryrun)
                 }
               else
                 {
-                  err = _keybox_write_blob (blob, stdout);
+                  err = _keybox_write_blob (blob, outfp);
                   _keybox_release_blob (blob);
                   if (err)
                     {
@@ -463,6 +515,60 @@ import_openpgp (const char *filename, int dryrun)
 }
 
 
+/* Create the keybox SNAPSHOT from the OpenPGP keyrings given by
+   (ARGC,ARGV) or from stdin if ARGC is 0.  The keybox is written
+   sorted and with its index so that a reader like gpgv can look up
+   keys without scanning the file.  */
+static void
+create_snapshot (const char *snapshot, int argc, char **argv)
+{
+  gpg_error_t err;
+  char *tmpfname;
+  FILE *fp;
+
+  tmpfname = xstrconcat (snapshot, ".tmp", NULL);
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      log_error ("can't create '%s': %s\n", tmpfname, strerror (errno));
+      xfree (tmpfname);
+      return;
+    }
+
+  err = _keybox_write_header_blob (fp, NULL, 1);
+  if (err)
+    log_error ("%s: error writing the header: %s\n",
+               tmpfname, gpg_strerror (err));
+  else if (!argc)
+    import_openpgp ("-", 0, fp);
+  else
+    {
+      for (; argc; argc--, argv++)
+        import_openpgp (*argv, 0, fp);
+    }
+
+  if (fclose (fp))
+    log_error ("error closing '%s': %s\n", tmpfname, strerror (errno));
+  if (log_get_errorcount (0))
+    {
+      gnupg_remove (tmpfname);
+      xfree (tmpfname);
+      return;
+    }
+
+  err = gnupg_rename_file (tmpfname, snapshot, NULL);
+  if (err)
+    {
+      log_error ("error renaming '%s' to '%s': %s\n",
+                 tmpfname, snapshot, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+  else
+    compact_file (snapshot, KEYBOX_COMPRESS_SORT | KEYBOX_COMPRESS_INDEX);
+  xfree (tmpfname);
+}
+
+
 
 
 int
@@ -472,6 +578,7 @@ main (int argc, char **argv)
   enum cmd_and_opt_values cmd = 0;
   unsigned long from = 0, to = ULONG_MAX;
   int dry_run = 0;
+  unsigned int compact_flags = 0;
 
   early_system_init ();
   gpgrt_set_strusage( my_strusage );
@@ -515,11 +622,15 @@ main (int argc, char **argv)
         case aImportOpenPGP:
         case aFindDups:
         case aCut:
+        case aCompact:
+        case aCreateSnapshot:
           cmd = pargs.r_opt;
           break;
 
         case oFrom: from = pargs.r.ret_ulong; break;
         case oTo: to = pargs.r.ret_ulong; break;
+        case oSort: compact_flags |= KEYBOX_COMPRESS_SORT; break;
+        case oRebuildIndex: compact_flags |= KEYBOX_COMPRESS_INDEX; break;
 
         case oDryRun: dry_run = 1; break;
 
@@ -577,14 +688,30 @@ main (int argc, char **argv)
             _keybox_dump_cut_records (*argv, from, to, stdout);
         }
     }
+  else if (cmd == aCompact)
+    {
+      if (!argc)
+        log_error ("usage: kbxutil --compact [--sort] [--rebuild-index]"
+                   " KEYBOXFILES\n");
+      for (; argc; argc--, argv++)
+        compact_file (*argv, compact_flags);
+    }
+  else if (cmd == aCreateSnapshot)
+    {
+      if (!argc)
+        log_error ("usage: kbxutil --create-snapshot SNAPSHOT"
+                   " [KEYRINGS]\n");
+      else
+        create_snapshot (*argv, argc - 1, argv + 1);
+    }
   else if (cmd == aImportOpenPGP)
     {
       if (!argc)
-        import_openpgp ("-", dry_run);
+        import_openpgp ("-", dry_run, stdout);
       else
         {
           for (; argc; argc--, argv++)
-            import_openpgp (*argv, dry_run);
+            import_openpgp (*argv, dry_run, stdout);
         }
     }
 #if 0
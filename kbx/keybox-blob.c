@@ -227,6 +227,7 @@ struct keyboxblob {
   byte *blob;
   size_t bloblen;
   off_t fileoffset;
+  int mapped;   /* BLOB points into a mapped file and must not be freed. */
 
   /* stuff used only by keybox_create_blob */
   unsigned char *serialbuf;
@@ -1061,6 +1062,56 @@ _keybox_new_blob (KEYBOXBLOB *r_blob,
 }
 
 
+/* Create a blob object which is used to reference blobs in a mapped
+ * keybox file without copying them.  The image is set using
+ * _keybox_set_mapped_blob.  */
+gpg_error_t
+_keybox_new_mapped_blob (KEYBOXBLOB *r_blob)
+{
+  KEYBOXBLOB blob;
+
+  *r_blob = NULL;
+  blob = xtrycalloc (1, sizeof *blob);
+  if (!blob)
+    return gpg_error_from_syserror ();
+  blob->mapped = 1;
+  *r_blob = blob;
+  return 0;
+}
+
+
+/* Let the mapped BLOB reference {IMAGE,IMAGELEN} which has been
+ * found at the file offset OFF.  */
+void
+_keybox_set_mapped_blob (KEYBOXBLOB blob, const unsigned char *image,
+                         size_t imagelen, off_t off)
+{
+  log_assert (blob->mapped);
+  blob->blob = (byte *)image;
+  blob->bloblen = imagelen;
+  blob->fileoffset = off;
+}
+
+
+/* Store a copy of the mapped blob BLOB at R_BLOB.  */
+gpg_error_t
+_keybox_copy_mapped_blob (KEYBOXBLOB *r_blob, KEYBOXBLOB blob)
+{
+  gpg_error_t err;
+  unsigned char *image;
+
+  *r_blob = NULL;
+  image = xtrymalloc (blob->bloblen);
+  if (!image)
+    return gpg_error_from_syserror ();
+  memcpy (image, blob->blob, blob->bloblen);
+  err = _keybox_new_blob (r_blob, image, blob->bloblen, blob->fileoffset);
+  if (err)
+    xfree (image);
+  return err;
+}
+
+
 void
 _keybox_release_blob (KEYBOXBLOB blob)
 {
@@ -1078,7 +1129,8 @@ _keybox_release_blob (KEYBOXBLOB blob)
     xfree (blob->uids[i].name);
   xfree (blob->uids );
   xfree (blob->sigs );
-  xfree (blob->blob );
+  if (!blob->mapped)
+    xfree (blob->blob );
   xfree (blob );
 }
 
@@ -32,12 +32,17 @@
         map_assuan_err_with_source (GPG_ERR_SOURCE_DEFAULT, (a))
 
 #include <sys/types.h> /* off_t */
+#include <time.h>
 
 #include "../common/util.h"
 #include "keybox.h"
 
 
+/* Blobs larger than this are skipped by the search functions.  */
+#define IMAGELEN_LIMIT (5*1024*1024)
+
 typedef struct keyboxblob *KEYBOXBLOB;
+typedef struct keybox_index_s *keybox_index_t;
 
 
 typedef struct keybox_name *KB_NAME;
@@ -65,6 +70,9 @@ struct keybox_name
   /* Not yet used.  */
   int did_full_scan;
 
+  /* True if building the index failed; we then do not try again.  */
+  int index_disabled;
+
   /* The name of the resource file. */
   char fname[1];
 };
@@ -91,6 +99,22 @@ struct keybox_handle {
     char *name;
     char *pattern;
   } word_match;
+  int use_mmap;           /* Read the file via mmap if possible.  */
+  struct {
+    unsigned char *base;  /* The mapped file or NULL.  */
+    size_t size;          /* The length of the mapping.  */
+    KEYBOXBLOB blob;      /* Blob object referencing the mapped file.  */
+  } map;
+  unsigned int scan_threads;  /* Threads for a partitioned scan.  */
+  struct {
+    char *key;            /* Identifies the search descriptions.  */
+    off_t *offsets;       /* The offsets of the candidate blobs.  */
+    size_t count;         /* The number of items in OFFSETS.  */
+    keybox_blobtype_t want_blobtype;
+    off_t size;           /* Size, mtime and inode of the file.  */
+    time_t mtime;
+    ino_t ino;
+  } pscan;
 };
 
 
@@ -158,6 +182,10 @@ int  _keybox_new_blob (KEYBOXBLOB *r_blob,
                        unsigned char *image, size_t imagelen,
                        off_t off);
 void _keybox_release_blob (KEYBOXBLOB blob);
+gpg_error_t _keybox_new_mapped_blob (KEYBOXBLOB *r_blob);
+void _keybox_set_mapped_blob (KEYBOXBLOB blob, const unsigned char *image,
+                              size_t imagelen, off_t off);
+gpg_error_t _keybox_copy_mapped_blob (KEYBOXBLOB *r_blob, KEYBOXBLOB blob);
 const unsigned char *_keybox_get_blob_image (KEYBOXBLOB blob, size_t *n);
 off_t _keybox_get_blob_fileoffset (KEYBOXBLOB blob);
 void _keybox_update_header_blob (KEYBOXBLOB blob, int for_openpgp);
@@ -172,8 +200,30 @@ void _keybox_destroy_openpgp_info (keybox_openpgp_info_t info);
 /*-- keybox-file.c --*/
 int _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted);
 int _keybox_write_blob (KEYBOXBLOB blob, FILE *fp);
+gpg_error_t _keybox_map_file (KEYBOX_HANDLE hd);
+void _keybox_unmap_file (KEYBOX_HANDLE hd);
+int _keybox_read_mapped_blob (KEYBOX_HANDLE hd, off_t *r_pos,
+                              int *skipped_deleted);
+
+/*-- keybox-index.c --*/
+#define KEYBOX_INDEX_ABORT  0
+#define KEYBOX_INDEX_INSERT 1
+#define KEYBOX_INDEX_UPDATE 2
+#define KEYBOX_INDEX_DELETE 3
+#define KEYBOX_INDEX_TOUCH  4
+int _keybox_index_usable (KEYBOX_SEARCH_DESC *desc, size_t ndesc);
+gpg_error_t _keybox_index_lookup (KEYBOX_HANDLE hd,
+                                  KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+                                  off_t **r_offsets, size_t *r_count);
+keybox_index_t _keybox_index_begin_update (const char *fname);
+void _keybox_index_end_update (keybox_index_t idx, const char *fname,
+                               int mode, off_t off, size_t oldlen,
+                               KEYBOXBLOB blob);
+void _keybox_index_remove (const char *fname);
+gpg_error_t _keybox_index_rebuild (const char *fname);
 
 /*-- keybox-search.c --*/
+void _keybox_pscan_release (KEYBOX_HANDLE hd);
 gpg_err_code_t _keybox_get_flag_location (const unsigned char *buffer,
                                           size_t length,
                                           int what,
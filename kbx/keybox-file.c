@@ -23,11 +23,14 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "keybox-defs.h"
-
-
-#define IMAGELEN_LIMIT (5*1024*1024)
+#include "../common/host2net.h"
 
 
 #if !defined(HAVE_FTELLO) && !defined(ftello)
@@ -128,6 +131,108 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted)
 }
 
 
+/* Map the file opened at HD read-only into memory.  Returns 0 on
+ * success or an error code; in the latter case the caller should
+ * fall back to stdio based reading.  */
+gpg_error_t
+_keybox_map_file (KEYBOX_HANDLE hd)
+{
+#ifdef HAVE_MMAP
+  gpg_error_t err;
+  struct stat sb;
+  void *base;
+
+  if (hd->map.base)
+    return 0;  /* Already mapped.  */
+  if (!hd->fp)
+    return gpg_error (GPG_ERR_INV_STATE);
+  if (fstat (fileno (hd->fp), &sb))
+    return gpg_error_from_syserror ();
+  if (!sb.st_size || (off_t)(size_t)sb.st_size != sb.st_size)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);  /* Empty or too large.  */
+
+  if (!hd->map.blob)
+    {
+      err = _keybox_new_mapped_blob (&hd->map.blob);
+      if (err)
+        return err;
+    }
+
+  base = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fileno (hd->fp), 0);
+  if (base == MAP_FAILED)
+    return gpg_error_from_syserror ();
+  hd->map.base = base;
+  hd->map.size = sb.st_size;
+  return 0;
+#else /*!HAVE_MMAP*/
+  (void)hd;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+#endif /*!HAVE_MMAP*/
+}
+
+
+/* Remove the mapping of the file at HD.  */
+void
+_keybox_unmap_file (KEYBOX_HANDLE hd)
+{
+#ifdef HAVE_MMAP
+  if (hd->map.base)
+    {
+      munmap (hd->map.base, hd->map.size);
+      hd->map.base = NULL;
+      hd->map.size = 0;
+    }
+#else
+  (void)hd;
+#endif
+}
+
+
+/* This is the mmap version of _keybox_read_blob.  It reads the blob
+ * at the offset R_POS of the file mapped at HD and stores it in the
+ * mapped blob object of HD without copying.  The value at R_POS is
+ * updated to the offset of the next blob.  */
+int
+_keybox_read_mapped_blob (KEYBOX_HANDLE hd, off_t *r_pos,
+                          int *skipped_deleted)
+{
+  const unsigned char *image;
+  size_t imagelen;
+  off_t off;
+
+  if (skipped_deleted)
+    *skipped_deleted = 0;
+ again:
+  off = *r_pos;
+  if ((uint64_t)off >= hd->map.size)
+    return -1; /* eof */
+  if (hd->map.size - (size_t)off < 5)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  image = hd->map.base + off;
+  imagelen = buf32_to_size_t (image);
+  if (imagelen < 5)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+  if (imagelen > hd->map.size - (size_t)off)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+  *r_pos = off + imagelen;
+
+  if (!image[4])
+    {
+      /* Special treatment for empty blobs. */
+      if (skipped_deleted)
+        *skipped_deleted = 1;
+      goto again;
+    }
+
+  if (imagelen > IMAGELEN_LIMIT) /* Sanity check. */
+    return gpg_error (GPG_ERR_TOO_LARGE);
+
+  _keybox_set_mapped_blob (hd->map.blob, image, imagelen, off);
+  return 0;
+}
+
+
 /* Write the block to the current file position */
 int
 _keybox_write_blob (KEYBOXBLOB blob, FILE *fp)
@@ -0,0 +1,907 @@
+/* keybox-index.c - Sidecar index for keybox files
+ * Copyright (C) 2021 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * The index file
+ *
+ * For a keybox file "pubring.kbx" the index is stored in the file
+ * "pubring.kbx.idx".  It maps the long keyids, the fingerprints, the
+ * keygrips and the mail addresses of all OpenPGP blobs to the file
+ * offsets of their blobs.  The index is only used if it has been built for exactly
+ * the current version of the keybox file; this is checked using the
+ * size and the modification time of the keybox which are stored in
+ * the header of the index.  If the index is stale it is ignored and
+ * rebuilt on the next indexed search.  All integers are stored in
+ * network byte order.
+ *
+ *   - b4   Magic 'KBXi'
+ *   - byte Version number (2)
+ *   - b3   RFU
+ *   - u64  Size of the keybox file
+ *   - u64  Modification time of the keybox file (seconds)
+ *   - u32  Modification time of the keybox file (nanoseconds)
+ *   - u32  [NKID]  Number of entries in the keyid table
+ *   - u32  [NFPR]  Number of entries in the fingerprint table
+ *   - u32  [NGRIP] Number of entries in the keygrip table
+ *   - u32  [NMAIL] Number of entries in the mail address table
+ *   - b4   RFU
+ *   - NKID, NFPR, NGRIP, NMAIL times:
+ *     - b8   The first 8 bytes of the keyid, fingerprint, keygrip or
+ *            of the SHA-1 hash of the lowercased mail address.
+ *     - u64  The offset of the blob in the keybox file.
+ *
+ * Each table is sorted by the entire entry.  Because only a prefix
+ * of the fingerprint, keygrip or hash is stored a match in the index
+ * is just a candidate; the search code verifies it against the blob.
+ * The mail addresses are taken from the user ids the same way as
+ * done by the exact mail search.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "keybox-defs.h"
+#include <gcrypt.h>
+#include "../common/sysutils.h"
+#include "../common/host2net.h"
+#include "../common/mbox-util.h"
+
+#define EXTSEP_S "."
+
+#define INDEX_MAGIC        "KBXi"
+#define INDEX_VERSION      2
+#define INDEX_HEADER_LEN   48
+#define INDEX_ENTRY_LEN    16
+
+/* Do not create an index for keyboxes smaller than this.  A linear
+ * scan over such a small file is fast enough.  */
+#define INDEX_MIN_FILESIZE (1024*1024)
+
+/* Mail addresses longer than this are not indexed.  */
+#define INDEX_MAX_MAILLEN  255
+
+/* The tables in the index.  */
+enum
+  {
+    IDXTBL_KID  = 0,
+    IDXTBL_FPR  = 1,
+    IDXTBL_GRIP = 2,
+    IDXTBL_MAIL = 3,
+    IDXTBL_COUNT
+  };
+
+
+/* An in-core version of the index used for building and updating.  */
+struct keybox_index_s
+{
+  /* The state of the keybox file this index is valid for.  */
+  unsigned long long filesize;
+  unsigned long long mtime;
+  unsigned int mtime_ns;
+
+  struct {
+    size_t used;
+    size_t size;
+    unsigned char *ent;  /* USED entries, each INDEX_ENTRY_LEN bytes.  */
+  } tbl[IDXTBL_COUNT];
+};
+
+
+static inline void
+put64 (unsigned char *p, unsigned long long a)
+{
+  p[0] = a >> 56;
+  p[1] = a >> 48;
+  p[2] = a >> 40;
+  p[3] = a >> 32;
+  p[4] = a >> 24;
+  p[5] = a >> 16;
+  p[6] = a >>  8;
+  p[7] = a;
+}
+
+static inline unsigned long long
+get64 (const unsigned char *p)
+{
+  return (((unsigned long long)buf32_to_u32 (p) << 32)
+          | (unsigned long long)buf32_to_u32 (p+4));
+}
+
+
+/* Return a malloced string with the name of the index for the keybox
+ * FNAME.  */
+static char *
+index_fname (const char *fname)
+{
+  return strconcat (fname, EXTSEP_S "idx", NULL);
+}
+
+
+/* Fill the file state of the index IDX from the stat info SB.  */
+static void
+set_file_state (keybox_index_t idx, struct stat *sb)
+{
+  idx->filesize = sb->st_size;
+  idx->mtime = sb->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  idx->mtime_ns = sb->st_mtim.tv_nsec;
+#else
+  idx->mtime_ns = 0;
+#endif
+}
+
+
+static void
+release_index (keybox_index_t idx)
+{
+  int i;
+
+  if (!idx)
+    return;
+  for (i=0; i < IDXTBL_COUNT; i++)
+    xfree (idx->tbl[i].ent);
+  xfree (idx);
+}
+
+
+/* Append the entry (KEY,OFF) to the table TBLNO of IDX.  */
+static gpg_error_t
+add_entry (keybox_index_t idx, int tblno, const unsigned char *key, off_t off)
+{
+  unsigned char *p;
+
+  if (idx->tbl[tblno].used == idx->tbl[tblno].size)
+    {
+      size_t newsize = idx->tbl[tblno].size? 2*idx->tbl[tblno].size : 1024;
+
+      p = xtryrealloc (idx->tbl[tblno].ent, newsize * INDEX_ENTRY_LEN);
+      if (!p)
+        return gpg_error_from_syserror ();
+      idx->tbl[tblno].ent = p;
+      idx->tbl[tblno].size = newsize;
+    }
+  p = idx->tbl[tblno].ent + idx->tbl[tblno].used * INDEX_ENTRY_LEN;
+  memcpy (p, key, 8);
+  put64 (p+8, off);
+  idx->tbl[tblno].used++;
+  return 0;
+}
+
+
+/* Compute the index key for the mail address {MAIL,MAILLEN} and
+ * store it at KEY.  Returns false if the address is not indexed.  */
+static int
+mail_key (const unsigned char *mail, size_t maillen, unsigned char *key)
+{
+  unsigned char buffer[INDEX_MAX_MAILLEN];
+  unsigned char digest[20];
+  size_t n;
+
+  if (!maillen || maillen > INDEX_MAX_MAILLEN)
+    return 0;
+  for (n=0; n < maillen; n++)
+    buffer[n] = ascii_tolower (mail[n]);
+  gcry_md_hash_buffer (GCRY_MD_SHA1, digest, buffer, maillen);
+  memcpy (key, digest, 8);
+  return 1;
+}
+
+
+/* Add the mail address entries for the OpenPGP blob {IMAGE,IMAGELEN}
+ * at the file offset OFF.  The parsing is the same as in
+ * blob_cmp_mail.  */
+static gpg_error_t
+add_mail_entries (keybox_index_t idx, const unsigned char *image,
+                  size_t imagelen, off_t off)
+{
+  gpg_error_t err;
+  size_t pos, nkeys, keyinfolen, nserial, nuids, uidinfolen;
+  size_t n, uoff, ulen, uend, p;
+  unsigned char key[8];
+
+  nkeys = buf16_to_ulong (image + 16);
+  keyinfolen = buf16_to_ulong (image + 18);
+  pos = 20 + keyinfolen * nkeys;
+  if (pos + 2 > imagelen)
+    return 0;
+  nserial = buf16_to_ulong (image + pos);
+  pos += 2 + nserial;
+  if (pos + 4 > imagelen)
+    return 0;
+  nuids = buf16_to_ulong (image + pos);
+  uidinfolen = buf16_to_ulong (image + pos + 2);
+  pos += 4;
+  if (uidinfolen < 12 || pos + uidinfolen * nuids > imagelen)
+    return 0;
+
+  for (n=0; n < nuids; n++)
+    {
+      uoff = buf32_to_size_t (image + pos + n * uidinfolen);
+      ulen = buf32_to_size_t (image + pos + n * uidinfolen + 4);
+      if ((uint64_t)uoff + (uint64_t)ulen > (uint64_t)imagelen)
+        return 0;
+      uend = uoff + ulen;
+      for (p=uoff; p < uend && image[p] != '<'; p++)
+        ;
+      if (uend - p < 2)
+        {
+          /* No angle brackets; check for a plain address.  */
+          if (!is_valid_mailbox_mem (image + uoff, ulen))
+            continue;
+        }
+      else
+        {
+          uoff = ++p;
+          for (; p < uend && image[p] != '>'; p++)
+            ;
+          if (p == uend || p == uoff)
+            continue;
+          ulen = p - uoff;
+        }
+      if (!mail_key (image + uoff, ulen, key))
+        continue;
+      err = add_entry (idx, IDXTBL_MAIL, key, off);
+      if (err)
+        return err;
+    }
+  return 0;
+}
+
+
+/* Add the index entries for the blob {IMAGE,IMAGELEN} at the file
+ * offset OFF.  Blobs which are not OpenPGP blobs are ignored.  */
+static gpg_error_t
+add_blob_entries (keybox_index_t idx, const unsigned char *image,
+                  size_t imagelen, off_t off)
+{
+  gpg_error_t err;
+  size_t nkeys, keyinfolen, keyoff, image_off, image_len;
+  int n, fpr32, fprlen;
+  struct _keybox_openpgp_info info;
+  struct _keybox_openpgp_key_info *k;
+
+  if (imagelen < 40 || image[4] != KEYBOX_BLOBTYPE_PGP)
+    return 0;
+  fpr32 = image[5] == 2;
+
+  nkeys = buf16_to_ulong (image + 16);
+  keyinfolen = buf16_to_ulong (image + 18);
+  if (keyinfolen < (fpr32?56:28))
+    return 0; /* Invalid blob.  */
+  if (20 + (uint64_t)keyinfolen*nkeys > (uint64_t)imagelen)
+    return 0; /* Out of bounds.  */
+
+  for (n=0; n < nkeys; n++)
+    {
+      keyoff = 20 + n * keyinfolen;
+      if (fpr32)
+        fprlen = (buf16_to_ulong (image + keyoff + 32) & 0x80)? 32:20;
+      else
+        fprlen = 20;
+
+      err = add_entry (idx, IDXTBL_FPR, image + keyoff, off);
+      if (!err)
+        err = add_entry (idx, IDXTBL_KID,
+                         image + keyoff + (fprlen == 32? 0 : 12), off);
+      if (err)
+        return err;
+    }
+
+  err = add_mail_entries (idx, image, imagelen, off);
+  if (err)
+    return err;
+
+  /* The keygrips are not stored in the blob metadata; thus we need
+   * to parse the keyblock.  */
+  image_off = buf32_to_size_t (image+8);
+  image_len = buf32_to_size_t (image+12);
+  if ((uint64_t)image_off+(uint64_t)image_len > (uint64_t)imagelen)
+    return 0;
+  if (_keybox_parse_openpgp (image + image_off, image_len, NULL, &info))
+    return 0; /* Not indexable - will never match a grip search.  */
+  err = add_entry (idx, IDXTBL_GRIP, info.primary.grip, off);
+  if (!err && info.nsubkeys)
+    for (k = &info.subkeys; k && !err; k = k->next)
+      err = add_entry (idx, IDXTBL_GRIP, k->grip, off);
+  _keybox_destroy_openpgp_info (&info);
+  return err;
+}
+
+
+/* Remove all entries of IDX which point to the blob at OFF.
+ * Entries for blobs after OFF are shifted by DELTA bytes.  */
+static void
+remove_and_shift (keybox_index_t idx, off_t off, long long delta)
+{
+  int i;
+  size_t n, m;
+  unsigned char *p;
+  unsigned long long entoff;
+
+  for (i=0; i < IDXTBL_COUNT; i++)
+    {
+      for (n=m=0; n < idx->tbl[i].used; n++)
+        {
+          p = idx->tbl[i].ent + n * INDEX_ENTRY_LEN;
+          entoff = get64 (p+8);
+          if (entoff == (unsigned long long)off)
+            continue;
+          if (delta && entoff > (unsigned long long)off)
+            put64 (p+8, entoff + delta);
+          if (m != n)
+            memcpy (idx->tbl[i].ent + m * INDEX_ENTRY_LEN, p, INDEX_ENTRY_LEN);
+          m++;
+        }
+      idx->tbl[i].used = m;
+    }
+}
+
+
+static int
+cmp_entries (const void *a, const void *b)
+{
+  return memcmp (a, b, INDEX_ENTRY_LEN);
+}
+
+
+/* Write the index IDX for the keybox FNAME.  The index is first
+ * written to a temporary file which is then renamed.  */
+static gpg_error_t
+write_index (keybox_index_t idx, const char *fname)
+{
+  gpg_error_t err = 0;
+  char *idxname, *tmpname;
+  FILE *fp;
+  unsigned char hdr[INDEX_HEADER_LEN];
+  int i;
+
+  idxname = index_fname (fname);
+  if (!idxname)
+    return gpg_error_from_syserror ();
+  tmpname = xtryasprintf ("%s" EXTSEP_S "%u" EXTSEP_S "tmp",
+                          idxname, (unsigned int)getpid ());
+  if (!tmpname)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (idxname);
+      return err;
+    }
+
+  for (i=0; i < IDXTBL_COUNT; i++)
+    if (idx->tbl[i].used)
+      qsort (idx->tbl[i].ent, idx->tbl[i].used, INDEX_ENTRY_LEN, cmp_entries);
+
+  memset (hdr, 0, sizeof hdr);
+  memcpy (hdr, INDEX_MAGIC, 4);
+  hdr[4] = INDEX_VERSION;
+  put64 (hdr+8, idx->filesize);
+  put64 (hdr+16, idx->mtime);
+  ulongtobuf (hdr+24, idx->mtime_ns);
+  ulongtobuf (hdr+28, idx->tbl[IDXTBL_KID].used);
+  ulongtobuf (hdr+32, idx->tbl[IDXTBL_FPR].used);
+  ulongtobuf (hdr+36, idx->tbl[IDXTBL_GRIP].used);
+  ulongtobuf (hdr+40, idx->tbl[IDXTBL_MAIL].used);
+
+  fp = fopen (tmpname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fwrite (hdr, sizeof hdr, 1, fp) != 1)
+    err = gpg_error_from_syserror ();
+  for (i=0; !err && i < IDXTBL_COUNT; i++)
+    if (idx->tbl[i].used
+        && fwrite (idx->tbl[i].ent, INDEX_ENTRY_LEN, idx->tbl[i].used, fp)
+           != idx->tbl[i].used)
+      err = gpg_error_from_syserror ();
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+
+  if (!err)
+    err = gnupg_rename_file (tmpname, idxname, NULL);
+  if (err)
+    gnupg_remove (tmpname);
+
+ leave:
+  xfree (tmpname);
+  xfree (idxname);
+  return err;
+}
+
+
+/* Read the header of the index file FP into HDR and check that it
+ * matches the keybox state given by SB.  */
+static gpg_error_t
+read_index_header (FILE *fp, unsigned char *hdr, struct stat *sb)
+{
+  struct keybox_index_s state;
+
+  if (fread (hdr, INDEX_HEADER_LEN, 1, fp) != 1)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+  if (memcmp (hdr, INDEX_MAGIC, 4) || hdr[4] != INDEX_VERSION)
+    return gpg_error (GPG_ERR_INV_OBJ);
+
+  set_file_state (&state, sb);
+  if (get64 (hdr+8) != state.filesize
+      || get64 (hdr+16) != state.mtime
+      || buf32_to_uint (hdr+24) != state.mtime_ns)
+    return gpg_error (GPG_ERR_ESTALE);
+  return 0;
+}
+
+
+/* Load the entire index for the keybox FNAME with the state SB.
+ * Returns NULL if the index does not exist, is stale, or on error.  */
+static keybox_index_t
+load_index (const char *fname, struct stat *sb)
+{
+  char *idxname;
+  FILE *fp;
+  unsigned char hdr[INDEX_HEADER_LEN];
+  keybox_index_t idx = NULL;
+  int i;
+
+  idxname = index_fname (fname);
+  if (!idxname)
+    return NULL;
+  fp = fopen (idxname, "rb");
+  xfree (idxname);
+  if (!fp)
+    return NULL;
+
+  if (read_index_header (fp, hdr, sb))
+    goto leave;
+
+  idx = xtrycalloc (1, sizeof *idx);
+  if (!idx)
+    goto leave;
+  set_file_state (idx, sb);
+  for (i=0; i < IDXTBL_COUNT; i++)
+    {
+      size_t n = buf32_to_size_t (hdr + 28 + 4*i);
+
+      if (!n)
+        continue;
+      idx->tbl[i].ent = xtrymalloc (n * INDEX_ENTRY_LEN);
+      if (!idx->tbl[i].ent
+          || fread (idx->tbl[i].ent, INDEX_ENTRY_LEN, n, fp) != n)
+        {
+          release_index (idx);
+          idx = NULL;
+          goto leave;
+        }
+      idx->tbl[i].used = idx->tbl[i].size = n;
+    }
+
+ leave:
+  fclose (fp);
+  return idx;
+}
+
+
+/* Create the index for the keybox FNAME by scanning the entire
+ * file.  */
+static gpg_error_t
+build_index (const char *fname)
+{
+  gpg_error_t err;
+  FILE *fp;
+  struct stat sb;
+  keybox_index_t idx;
+  KEYBOXBLOB blob = NULL;
+  const unsigned char *image;
+  size_t imagelen;
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    return gpg_error_from_syserror ();
+  if (fstat (fileno (fp), &sb))
+    {
+      err = gpg_error_from_syserror ();
+      fclose (fp);
+      return err;
+    }
+
+  idx = xtrycalloc (1, sizeof *idx);
+  if (!idx)
+    {
+      err = gpg_error_from_syserror ();
+      fclose (fp);
+      return err;
+    }
+  set_file_state (idx, &sb);
+
+  for (;;)
+    {
+      err = _keybox_read_blob (&blob, fp, NULL);
+      if (gpg_err_code (err) == GPG_ERR_TOO_LARGE
+          && gpg_err_source (err) == GPG_ERR_SOURCE_KEYBOX)
+        continue; /* Too large records are never returned by a search.  */
+      if (err)
+        break;
+      image = _keybox_get_blob_image (blob, &imagelen);
+      err = add_blob_entries (idx, image, imagelen,
+                              _keybox_get_blob_fileoffset (blob));
+      _keybox_release_blob (blob);
+      blob = NULL;
+      if (err)
+        break;
+    }
+  if (err == -1)
+    err = 0;
+  fclose (fp);
+
+  if (!err)
+    err = write_index (idx, fname);
+  release_index (idx);
+  return err;
+}
+
+
+/* Return true if the search descriptions (DESC,NDESC) can be
+ * handled by the index.  */
+int
+_keybox_index_usable (KEYBOX_SEARCH_DESC *desc, size_t ndesc)
+{
+  size_t n;
+
+  if (!ndesc)
+    return 0;
+  for (n=0; n < ndesc; n++)
+    switch (desc[n].mode)
+      {
+      case KEYDB_SEARCH_MODE_LONG_KID:
+      case KEYDB_SEARCH_MODE_FPR:
+      case KEYDB_SEARCH_MODE_KEYGRIP:
+      case KEYDB_SEARCH_MODE_UBID:
+      case KEYDB_SEARCH_MODE_MAIL:
+        break;
+      default:
+        return 0;
+      }
+  return 1;
+}
+
+
+/* Collect the offsets of all entries in table TBLNO of the index
+ * FP which start with the 8 byte KEY.  HDR is the header of that
+ * index.  The offsets are appended to the array at R_OFFSETS.  */
+static gpg_error_t
+lookup_table (FILE *fp, const unsigned char *hdr, int tblno,
+              const unsigned char *key,
+              off_t **r_offsets, size_t *r_count, size_t *r_size)
+{
+  unsigned char ent[INDEX_ENTRY_LEN];
+  unsigned long long base;
+  size_t lo, hi, mid, n;
+  int i;
+
+  base = INDEX_HEADER_LEN;
+  for (i=0; i < tblno; i++)
+    base += (unsigned long long)buf32_to_size_t (hdr+28+4*i) * INDEX_ENTRY_LEN;
+  n = buf32_to_size_t (hdr+28+4*tblno);
+
+  /* Find the first entry not less than KEY.  */
+  for (lo=0, hi=n; lo < hi; )
+    {
+      mid = lo + (hi - lo) / 2;
+      if (fseeko (fp, base + (unsigned long long)mid * INDEX_ENTRY_LEN,
+                  SEEK_SET)
+          || fread (ent, INDEX_ENTRY_LEN, 1, fp) != 1)
+        return gpg_error (GPG_ERR_TOO_SHORT);
+      if (memcmp (ent, key, 8) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  if (lo < n && fseeko (fp, base + (unsigned long long)lo * INDEX_ENTRY_LEN,
+                        SEEK_SET))
+    return gpg_error_from_syserror ();
+  for (; lo < n; lo++)
+    {
+      if (fread (ent, INDEX_ENTRY_LEN, 1, fp) != 1)
+        return gpg_error (GPG_ERR_TOO_SHORT);
+      if (memcmp (ent, key, 8))
+        break;
+      if (*r_count == *r_size)
+        {
+          off_t *tmp;
+          size_t newsize = *r_size? 2 * *r_size : 16;
+
+          tmp = xtryrealloc (*r_offsets, newsize * sizeof *tmp);
+          if (!tmp)
+            return gpg_error_from_syserror ();
+          *r_offsets = tmp;
+          *r_size = newsize;
+        }
+      (*r_offsets)[(*r_count)++] = get64 (ent+8);
+    }
+
+  return 0;
+}
+
+
+static int
+cmp_offsets (const void *a, const void *b)
+{
+  off_t x = *(const off_t *)a;
+  off_t y = *(const off_t *)b;
+
+  return x < y? -1 : x > y? 1 : 0;
+}
+
+
+/* Look up the search descriptions (DESC,NDESC) in the index of the
+ * keybox opened at HD.  On success a sorted array with the offsets
+ * of all candidate blobs is stored at R_OFFSETS and its length at
+ * R_COUNT.  The caller must verify that the blobs really match.  An
+ * error is returned if no valid index is available; the caller
+ * should then fall back to a linear scan.  */
+gpg_error_t
+_keybox_index_lookup (KEYBOX_HANDLE hd,
+                      KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+                      off_t **r_offsets, size_t *r_count)
+{
+  gpg_error_t err;
+  struct stat sb;
+  char *idxname = NULL;
+  FILE *fp = NULL;
+  unsigned char hdr[INDEX_HEADER_LEN];
+  unsigned char key[8];
+  off_t *offsets = NULL;
+  size_t count = 0, size = 0, i, n;
+  int tblno, built = 0;
+
+  *r_offsets = NULL;
+  *r_count = 0;
+
+  if (hd->kb->index_disabled)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  if (!hd->fp || fstat (fileno (hd->fp), &sb))
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  idxname = index_fname (hd->kb->fname);
+  if (!idxname)
+    return gpg_error_from_syserror ();
+
+ again:
+  fp = fopen (idxname, "rb");
+  if (!fp || read_index_header (fp, hdr, &sb))
+    {
+      if (fp)
+        fclose (fp);
+      fp = NULL;
+      if (built || sb.st_size < INDEX_MIN_FILESIZE
+          || !keybox_is_writable (hd->kb))
+        {
+          err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+          goto leave;
+        }
+      err = build_index (hd->kb->fname);
+      if (err)
+        {
+          log_info ("error building index for '%s': %s\n",
+                    hd->kb->fname, gpg_strerror (err));
+          hd->kb->index_disabled = 1;
+          goto leave;
+        }
+      /* Check that the file did not change while we were building
+       * the index.  */
+      built = 1;
+      goto again;
+    }
+
+  for (n=0; n < ndesc; n++)
+    {
+      switch (desc[n].mode)
+        {
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          tblno = IDXTBL_KID;
+          ulongtobuf (key, desc[n].u.kid[0]);
+          ulongtobuf (key+4, desc[n].u.kid[1]);
+          break;
+        case KEYDB_SEARCH_MODE_FPR:
+          tblno = IDXTBL_FPR;
+          memcpy (key, desc[n].u.fpr, 8);
+          break;
+        case KEYDB_SEARCH_MODE_UBID:
+          tblno = IDXTBL_FPR;
+          memcpy (key, desc[n].u.ubid, 8);
+          break;
+        case KEYDB_SEARCH_MODE_KEYGRIP:
+          tblno = IDXTBL_GRIP;
+          memcpy (key, desc[n].u.grip, 8);
+          break;
+        case KEYDB_SEARCH_MODE_MAIL:
+          {
+            /* Strip the brackets the same way as has_mail.  */
+            const char *s = desc[n].u.name;
+            size_t slen;
+
+            if (!s)
+              {
+                err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+                goto leave;
+              }
+            if (*s == '<')
+              s++;
+            slen = strlen (s);
+            if (slen && s[slen-1] == '>')
+              slen--;
+            if (!mail_key ((const unsigned char *)s, slen, key))
+              {
+                err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+                goto leave;
+              }
+            tblno = IDXTBL_MAIL;
+          }
+          break;
+        default:
+          err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+          goto leave;
+        }
+      err = lookup_table (fp, hdr, tblno, key, &offsets, &count, &size);
+      if (err)
+        goto leave;
+    }
+
+  /* Sort and remove duplicates.  */
+  if (count > 1)
+    {
+      qsort (offsets, count, sizeof *offsets, cmp_offsets);
+      for (i=n=1; i < count; i++)
+        if (offsets[i] != offsets[n-1])
+          offsets[n++] = offsets[i];
+      count = n;
+    }
+
+  *r_offsets = offsets;
+  *r_count = count;
+  offsets = NULL;
+  err = 0;
+
+ leave:
+  if (fp)
+    fclose (fp);
+  xfree (offsets);
+  xfree (idxname);
+  return err;
+}
+
+
+/* Prepare an update of the index for the keybox FNAME.  This needs
+ * to be called with the keybox locked and before the keybox is
+ * modified.  Returns NULL if there is no valid index; in this case
+ * the index will be rebuilt by the next indexed search.  */
+keybox_index_t
+_keybox_index_begin_update (const char *fname)
+{
+  struct stat sb;
+
+  if (stat (fname, &sb))
+    return NULL;
+  return load_index (fname, &sb);
+}
+
+
+/* Finish an update of the index IDX after the keybox FNAME has been
+ * modified.  MODE describes the modification:
+ *
+ *   KEYBOX_INDEX_ABORT  - The keybox has not been modified.
+ *   KEYBOX_INDEX_INSERT - BLOB has been appended to the file.
+ *   KEYBOX_INDEX_UPDATE - The blob of length OLDLEN at OFF has been
+ *                         replaced by BLOB.
+ *   KEYBOX_INDEX_DELETE - The blob at OFF has been deleted in place.
+ *   KEYBOX_INDEX_TOUCH  - The keybox was changed in place without
+ *                         changing the keys or offsets.
+ *
+ * IDX is released by this function.  If updating the index fails the
+ * index is removed so that it will be rebuilt.  */
+void
+_keybox_index_end_update (keybox_index_t idx, const char *fname, int mode,
+                          off_t off, size_t oldlen, KEYBOXBLOB blob)
+{
+  gpg_error_t err = 0;
+  struct stat sb;
+  const unsigned char *image;
+  size_t imagelen = 0;
+
+  if (!idx)
+    return;
+
+  image = blob? _keybox_get_blob_image (blob, &imagelen) : NULL;
+  switch (mode)
+    {
+    case KEYBOX_INDEX_ABORT:
+      release_index (idx);
+      return;
+    case KEYBOX_INDEX_INSERT:
+      /* Blobs are always appended to the end of the file.  */
+      err = add_blob_entries (idx, image, imagelen, idx->filesize);
+      break;
+    case KEYBOX_INDEX_UPDATE:
+      remove_and_shift (idx, off, (long long)imagelen - (long long)oldlen);
+      err = add_blob_entries (idx, image, imagelen, off);
+      break;
+    case KEYBOX_INDEX_DELETE:
+      remove_and_shift (idx, off, 0);
+      break;
+    case KEYBOX_INDEX_TOUCH:
+      break;
+    default:
+      err = gpg_error (GPG_ERR_INV_VALUE);
+      break;
+    }
+
+  if (!err)
+    {
+      if (stat (fname, &sb))
+        err = gpg_error_from_syserror ();
+      else
+        {
+          set_file_state (idx, &sb);
+          err = write_index (idx, fname);
+        }
+    }
+
+  if (err)
+    {
+      char *idxname = index_fname (fname);
+
+      log_info ("error updating index for '%s': %s\n",
+                fname, gpg_strerror (err));
+      if (idxname)
+        gnupg_remove (idxname);
+      xfree (idxname);
+    }
+
+  release_index (idx);
+}
+
+
+/* Remove the index of the keybox FNAME.  This is used after the
+ * keybox has been rewritten.  */
+void
+_keybox_index_remove (const char *fname)
+{
+  char *idxname = index_fname (fname);
+
+  if (idxname)
+    gnupg_remove (idxname);
+  xfree (idxname);
+}
+
+
+/* Rebuild the index of the keybox FNAME.  Unlike the automatic
+ * creation by a search this is also done for small keyboxes.  */
+gpg_error_t
+_keybox_index_rebuild (const char *fname)
+{
+  _keybox_index_remove (fname);
+  return build_index (fname);
+}
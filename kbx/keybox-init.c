@@ -63,6 +63,7 @@ keybox_register_file (const char *fname, int secret, void **r_token)
   kr->lockhd = NULL;
   kr->is_locked = 0;
   kr->did_full_scan = 0;
+  kr->index_disabled = 0;
   /* keep a list of all issued pointers */
   kr->next = kb_names;
   kb_names = kr;
@@ -177,6 +178,9 @@ keybox_release (KEYBOX_HANDLE hd)
     }
   _keybox_release_blob (hd->found.blob);
   _keybox_release_blob (hd->saved_found.blob);
+  _keybox_unmap_file (hd);
+  _keybox_release_blob (hd->map.blob);
+  _keybox_pscan_release (hd);
   if (hd->fp)
     {
       fclose (hd->fp);
@@ -235,6 +239,36 @@ keybox_set_ephemeral (KEYBOX_HANDLE hd, int yes)
 }
 
 
+/* Enable or disable the use of mmap for reading the keybox.  With
+ * mmap searches check the blobs directly in the mapped file instead
+ * of reading each blob into an allocated buffer.  This is ignored on
+ * systems without mmap.  */
+void
+keybox_set_mmap (KEYBOX_HANDLE hd, int yes)
+{
+  if (!hd)
+    return;
+  hd->use_mmap = !!yes;
+  if (!hd->use_mmap)
+    _keybox_unmap_file (hd);
+}
+
+
+/* Set the number of threads used by searches which need to look at
+ * all blobs.  With 0 or 1 such searches are done by the calling
+ * thread.  This is only supported by the keyboxd; a partitioned scan
+ * is only done for large files.  */
+void
+keybox_set_scan_threads (KEYBOX_HANDLE hd, unsigned int nthreads)
+{
+  if (!hd)
+    return;
+  hd->scan_threads = nthreads;
+  if (nthreads < 2)
+    _keybox_pscan_release (hd);
+}
+
+
 /* Close the file of the resource identified by HD.  For consistent
    results this function closes the files of all handles pointing to
    the resource identified by HD.  */
@@ -250,6 +284,7 @@ _keybox_close_file (KEYBOX_HANDLE hd)
   for (idx=0; idx < hd->kb->handle_table_size; idx++)
     if ((roverhd = hd->kb->handle_table[idx]))
       {
+        _keybox_unmap_file (roverhd);
         if (roverhd->fp)
           {
             fclose (roverhd->fp);
@@ -277,7 +312,7 @@ keybox_lock (KEYBOX_HANDLE hd, int yes, long timeout)
   /* Make sure the lock handle has been created.  */
   if (!kb->lockhd)
     {
-      kb->lockhd = dotlock_create (kb->fname, 0);
+      kb->lockhd = dotlock_create (kb->fname, DOTLOCK_RWLOCK);
       if (!kb->lockhd)
         {
           err = gpg_error_from_syserror ();
@@ -24,6 +24,14 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
+#ifdef KEYBOX_WITH_NPTH
+# include <npth.h>
+#endif
 
 #include "keybox-defs.h"
 #include <gcrypt.h>
@@ -45,6 +53,40 @@ struct sn_array_s {
 #define get16(a) buf16_to_ulong ((a))
 
 
+/* Return true if the LEN bytes at A and B are equal.  This is used
+ * for fingerprints and keyids in the key table of a blob.  These are
+ * short and almost always differ in the first bytes; comparing them
+ * a word at a time is cheaper than a call to memcmp.  */
+static inline int
+fpr_equal_p (const unsigned char *a, const unsigned char *b, size_t len)
+{
+  uint64_t x, y;
+  uint32_t u, v;
+
+  for (; len >= 8; a += 8, b += 8, len -= 8)
+    {
+      memcpy (&x, a, 8);
+      memcpy (&y, b, 8);
+      if (x != y)
+        return 0;
+    }
+  if (len >= 4)
+    {
+      memcpy (&u, a, 4);
+      memcpy (&v, b, 4);
+      if (u != v)
+        return 0;
+      a += 4;
+      b += 4;
+      len -= 4;
+    }
+  for (; len; len--)
+    if (*a++ != *b++)
+      return 0;
+  return 1;
+}
+
+
 static inline unsigned int
 blob_get_blob_flags (KEYBOXBLOB blob)
 {
@@ -272,7 +314,7 @@ blob_cmp_fpr (KEYBOXBLOB blob, const unsigned char *fpr, unsigned int fprlen)
       else
         storedfprlen = 20;
       if (storedfprlen == fprlen
-          && !memcmp (buffer + off, fpr, storedfprlen))
+          && fpr_equal_p (buffer + off, fpr, storedfprlen))
         return idx+1; /* found */
     }
   return 0; /* not found */
@@ -314,7 +356,7 @@ blob_cmp_fpr_part (KEYBOXBLOB blob, const unsigned char *fpr,
       else
         storedfprlen = 20;
       if (storedfprlen == fproff + fprlen
-          && !memcmp (buffer + off + fproff, fpr, fprlen))
+          && fpr_equal_p (buffer + off + fproff, fpr, fprlen))
         return idx+1; /* found */
     }
   return 0; /* not found */
@@ -345,7 +387,7 @@ blob_cmp_ubid (KEYBOXBLOB blob, const unsigned char *ubid)
   if (pos + (uint64_t)keyinfolen*nkeys > (uint64_t)length)
     return 0; /* out of bounds */
 
-  if (!memcmp (buffer + pos, ubid, UBID_LEN))
+  if (fpr_equal_p (buffer + pos, ubid, UBID_LEN))
     return 1; /* found */
   return 0;   /* not found */
 }
@@ -609,12 +651,13 @@ blob_openpgp_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
 
 
 #ifdef KEYBOX_WITH_X509
-/* Return true if the key in BLOB matches the 20 bytes keygrip GRIP.
-   We don't have the keygrips as meta data, thus we need to parse the
+/* Compute the keygrip of the certificate in BLOB and store it at
+   ARRAY which must provide 20 bytes.  Returns true on success.  We
+   don't have the keygrips as meta data, thus we need to parse the
    certificate. Fixme: We might want to return proper error codes
    instead of failing a search for invalid certificates etc.  */
 static int
-blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
+blob_x509_get_grip (KEYBOXBLOB blob, unsigned char *array)
 {
   int rc;
   const unsigned char *buffer;
@@ -624,7 +667,6 @@ blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
   ksba_cert_t cert = NULL;
   ksba_sexp_t p = NULL;
   gcry_sexp_t s_pkey;
-  unsigned char array[20];
   unsigned char *rcp;
   size_t n;
 
@@ -668,13 +710,23 @@ blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
   xfree (p);
   ksba_cert_release (cert);
   ksba_reader_release (reader);
-  return !memcmp (array, grip, 20);
+  return 1;
  failed:
   xfree (p);
   ksba_cert_release (cert);
   ksba_reader_release (reader);
   return 0;
 }
+
+
+/* Return true if the key in BLOB matches the 20 bytes keygrip GRIP.  */
+static int
+blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
+{
+  unsigned char array[20];
+
+  return blob_x509_get_grip (blob, array) && !memcmp (array, grip, 20);
+}
 #endif /*KEYBOX_WITH_X509*/
 
 
@@ -857,10 +909,666 @@ open_file (KEYBOX_HANDLE hd)
       return hd->error;
     }
 
+  /* Failing to map the file is not an error; we then use stdio.  */
+  if (hd->use_mmap)
+    _keybox_map_file (hd);
+
   return 0;
 }
 
 
+/*
+ * A set of the descriptors with the modes FPR, LONG_KID and KEYGRIP.
+ * If many descriptors are given, checking each of them against each
+ * blob is slow.  We then sort these descriptors by their value and
+ * check the keys of a blob with one binary search per key and mode.
+ */
+
+/* The minimal number of descriptors for which the set is used.  */
+#define DESCSET_MIN_DESC 8
+
+/* An entry of a descriptor set.  */
+struct descset_entry_s
+{
+  unsigned char key[32];   /* The fingerprint, keyid or keygrip.  */
+  unsigned int keylen;
+  size_t descidx;          /* The index of the descriptor.  */
+};
+typedef struct descset_entry_s *descset_entry_t;
+
+struct descset_s
+{
+  descset_entry_t fpr;     /* The sorted entries of each mode.  */
+  size_t nfpr;
+  descset_entry_t kid;
+  size_t nkid;
+  descset_entry_t grip;
+  size_t ngrip;
+  char *member;            /* Flags telling which descriptors are in
+                            * the set.  */
+};
+typedef struct descset_s *descset_t;
+
+
+static int
+compare_descset_key (const unsigned char *key, unsigned int keylen,
+                     const struct descset_entry_s *b)
+{
+  if (keylen != b->keylen)
+    return keylen < b->keylen? -1 : 1;
+  return memcmp (key, b->key, keylen);
+}
+
+
+/* The sort function for the entries.  Entries with the same key are
+ * sorted by the index of their descriptor.  */
+static int
+compare_descset_entries (const void *a_arg, const void *b_arg)
+{
+  const struct descset_entry_s *a = a_arg;
+  const struct descset_entry_s *b = b_arg;
+  int cmp;
+
+  cmp = compare_descset_key (a->key, a->keylen, b);
+  if (cmp)
+    return cmp;
+  return a->descidx < b->descidx? -1 : a->descidx > b->descidx;
+}
+
+
+static void
+release_descset (descset_t set)
+{
+  if (!set)
+    return;
+  xfree (set->fpr);
+  xfree (set->kid);
+  xfree (set->grip);
+  xfree (set->member);
+  xfree (set);
+}
+
+
+/* Create a descriptor set for DESC and NDESC.  Returns NULL if there
+ * are not enough suitable descriptors or on memory shortage; the
+ * caller then checks all descriptors one by one.  */
+static descset_t
+create_descset (KEYBOX_SEARCH_DESC *desc, size_t ndesc)
+{
+  descset_t set;
+  descset_entry_t e;
+  size_t n, count;
+
+  for (count=n=0; n < ndesc; n++)
+    if (desc[n].mode == KEYDB_SEARCH_MODE_FPR
+        || desc[n].mode == KEYDB_SEARCH_MODE_LONG_KID
+        || desc[n].mode == KEYDB_SEARCH_MODE_KEYGRIP)
+      count++;
+  if (count < DESCSET_MIN_DESC)
+    return NULL;
+
+  set = xtrycalloc (1, sizeof *set);
+  if (!set)
+    return NULL;
+  set->fpr = xtrycalloc (count, sizeof *set->fpr);
+  set->kid = xtrycalloc (count, sizeof *set->kid);
+  set->grip = xtrycalloc (count, sizeof *set->grip);
+  set->member = xtrycalloc (ndesc, 1);
+  if (!set->fpr || !set->kid || !set->grip || !set->member)
+    {
+      release_descset (set);
+      return NULL;
+    }
+
+  for (n=0; n < ndesc; n++)
+    {
+      switch (desc[n].mode)
+        {
+        case KEYDB_SEARCH_MODE_FPR:
+          if (desc[n].fprlen > sizeof e->key)
+            continue;
+          e = set->fpr + set->nfpr++;
+          memcpy (e->key, desc[n].u.fpr, desc[n].fprlen);
+          e->keylen = desc[n].fprlen;
+          break;
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          e = set->kid + set->nkid++;
+          e->key[0] = desc[n].u.kid[0] >> 24;
+          e->key[1] = desc[n].u.kid[0] >> 16;
+          e->key[2] = desc[n].u.kid[0] >> 8;
+          e->key[3] = desc[n].u.kid[0];
+          e->key[4] = desc[n].u.kid[1] >> 24;
+          e->key[5] = desc[n].u.kid[1] >> 16;
+          e->key[6] = desc[n].u.kid[1] >> 8;
+          e->key[7] = desc[n].u.kid[1];
+          e->keylen = 8;
+          break;
+        case KEYDB_SEARCH_MODE_KEYGRIP:
+          e = set->grip + set->ngrip++;
+          memcpy (e->key, desc[n].u.grip, 20);
+          e->keylen = 20;
+          break;
+        default:
+          continue;
+        }
+      e->descidx = n;
+      set->member[n] = 1;
+    }
+
+  qsort (set->fpr, set->nfpr, sizeof *set->fpr, compare_descset_entries);
+  qsort (set->kid, set->nkid, sizeof *set->kid, compare_descset_entries);
+  qsort (set->grip, set->ngrip, sizeof *set->grip, compare_descset_entries);
+  return set;
+}
+
+
+/* Return the lowest descriptor index of the entries in the sorted
+ * array ENTRIES with NENTRIES which match KEY of KEYLEN.  Returns
+ * (size_t)-1 if there is no such entry.  */
+static size_t
+lookup_descset (descset_entry_t entries, size_t nentries,
+                const unsigned char *key, unsigned int keylen)
+{
+  size_t lo, hi, mid;
+
+  /* Find the first entry not less than KEY.  */
+  for (lo=0, hi=nentries; lo < hi; )
+    {
+      mid = lo + (hi - lo) / 2;
+      if (compare_descset_key (key, keylen, entries + mid) > 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo < nentries && !compare_descset_key (key, keylen, entries + lo))
+    return entries[lo].descidx;
+  return (size_t)-1;
+}
+
+
+/* Helper for match_descset to update the best match.  */
+static void
+update_descset_match (size_t idx, int pk_no, size_t *r_best, int *r_pk_no)
+{
+  if (idx < *r_best)
+    {
+      *r_best = idx;
+      *r_pk_no = pk_no;
+    }
+}
+
+
+/* Check BLOB against the descriptor set SET.  Returns the lowest
+ * index of a matching descriptor or NDESC if none matches.  The key
+ * number as returned by has_fingerprint or has_long_kid is stored at
+ * R_PK_NO; it is 0 for a keygrip match.  This yields the same result
+ * as checking the descriptors of the set in order.  */
+static size_t
+match_descset (descset_t set, size_t ndesc, KEYBOXBLOB blob, int *r_pk_no)
+{
+  const unsigned char *buffer;
+  size_t length;
+  size_t pos, off;
+  size_t nkeys, keyinfolen;
+  int idx, fpr32, storedfprlen;
+  size_t best = ndesc;
+
+  *r_pk_no = 0;
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 40)
+    return ndesc; /* blob too short */
+  fpr32 = buffer[5] == 2;
+
+  /* Check the fingerprints and keyids in the same way as blob_cmp_fpr
+   * and blob_cmp_fpr_part.  */
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18 );
+  pos = 20;
+  if ((set->nfpr || set->nkid)
+      && keyinfolen >= (fpr32?56:28)
+      && pos + (uint64_t)keyinfolen*nkeys <= (uint64_t)length)
+    {
+      for (idx=0; idx < nkeys; idx++)
+        {
+          off = pos + idx*keyinfolen;
+          if (fpr32)
+            storedfprlen = (get16 (buffer + off + 32) & 0x80)? 32:20;
+          else
+            storedfprlen = 20;
+          if (set->nfpr)
+            update_descset_match (lookup_descset (set->fpr, set->nfpr,
+                                                  buffer + off, storedfprlen),
+                                  idx+1, &best, r_pk_no);
+          if (set->nkid && !fpr32)
+            update_descset_match (lookup_descset (set->kid, set->nkid,
+                                                  buffer + off + 12, 8),
+                                  idx+1, &best, r_pk_no);
+        }
+    }
+
+  /* Check the keygrips.  These need to be computed and thus we do
+   * this only once for all descriptors.  */
+  if (set->ngrip && blob_get_type (blob) == KEYBOX_BLOBTYPE_PGP)
+    {
+      size_t cert_off, cert_len;
+      struct _keybox_openpgp_info info;
+      struct _keybox_openpgp_key_info *k;
+
+      cert_off = get32 (buffer+8);
+      cert_len = get32 (buffer+12);
+      if ((uint64_t)cert_off+(uint64_t)cert_len <= (uint64_t)length
+          && !_keybox_parse_openpgp (buffer + cert_off, cert_len, NULL, &info))
+        {
+          update_descset_match (lookup_descset (set->grip, set->ngrip,
+                                                info.primary.grip, 20),
+                                0, &best, r_pk_no);
+          if (info.nsubkeys)
+            for (k = &info.subkeys; k; k = k->next)
+              update_descset_match (lookup_descset (set->grip, set->ngrip,
+                                                    k->grip, 20),
+                                    0, &best, r_pk_no);
+          _keybox_destroy_openpgp_info (&info);
+        }
+    }
+#ifdef KEYBOX_WITH_X509
+  else if (set->ngrip && blob_get_type (blob) == KEYBOX_BLOBTYPE_X509)
+    {
+      unsigned char grip[20];
+
+      if (blob_x509_get_grip (blob, grip))
+        update_descset_match (lookup_descset (set->grip, set->ngrip,
+                                              grip, 20),
+                              0, &best, r_pk_no);
+    }
+#endif /*KEYBOX_WITH_X509*/
+
+  return best;
+}
+
+
+
+#if defined(KEYBOX_WITH_NPTH) && defined(HAVE_MMAP)
+/*
+ * Partitioned scans
+
+   Searches which can't use the index need to look at all blobs.  On
+   large keyboxes these searches are done by several threads: the file
+   is split at blob boundaries into one partition per thread and each
+   thread collects the offsets of the matching blobs of its partition.
+   Concatenating the lists yields the candidates in file order which
+   are then checked by keybox_search as it does with the index.  The
+   list is kept in the handle so that continued searches with the same
+   descriptions do not scan the file again.  Because the file has no
+   markers, finding the boundaries requires a walk over the length
+   fields of all blobs; this is cheap compared to matching the names.
+*/
+
+/* Do not use a partitioned scan for keyboxes smaller than this.  */
+#define PSCAN_MIN_FILESIZE (16*1024*1024)
+
+/* The maximum number of threads for a partitioned scan.  */
+#define PSCAN_MAX_THREADS 64
+
+/* The state of one partition.  */
+struct pscan_part_s
+{
+  const unsigned char *base;    /* The mapped file.  */
+  off_t start;                  /* Offset of the first blob.  */
+  off_t end;                    /* Offset after the last blob.  */
+  KEYBOX_SEARCH_DESC *desc;
+  size_t ndesc;
+  keybox_blobtype_t want_blobtype;
+  int ephemeral;
+  KEYBOXBLOB blob;              /* Blob object used by the thread.  */
+  off_t *offsets;               /* The offsets of the matching blobs.  */
+  size_t count;                 /* Number of items in OFFSETS.  */
+  size_t size;                  /* Allocated number of items.  */
+  gpg_error_t err;
+  npth_t thread;
+  int started;
+};
+
+
+/* Return true if all descriptions in (DESC,NDESC) require a scan
+ * which is worth to be done in parallel.  */
+static int
+pscan_usable (KEYBOX_SEARCH_DESC *desc, size_t ndesc)
+{
+  size_t n;
+
+  for (n=0; n < ndesc; n++)
+    switch (desc[n].mode)
+      {
+      case KEYDB_SEARCH_MODE_EXACT:
+      case KEYDB_SEARCH_MODE_MAIL:
+      case KEYDB_SEARCH_MODE_MAILSUB:
+      case KEYDB_SEARCH_MODE_SUBSTR:
+      case KEYDB_SEARCH_MODE_ISSUER:
+      case KEYDB_SEARCH_MODE_SUBJECT:
+        if (!desc[n].u.name)
+          return 0;
+        break;
+      default:
+        return 0;
+      }
+
+  return !!ndesc;
+}
+
+
+/* Return a malloced string identifying the descriptions (DESC,NDESC)
+ * or NULL on error.  */
+static char *
+pscan_make_key (KEYBOX_SEARCH_DESC *desc, size_t ndesc)
+{
+  size_t n, len;
+  char *key, *p;
+
+  for (len=1, n=0; n < ndesc; n++)
+    len += 4 + strlen (desc[n].u.name);
+  key = xtrymalloc (len);
+  if (!key)
+    return NULL;
+  for (p=key, n=0; n < ndesc; n++)
+    {
+      *p++ = '0' + desc[n].mode / 10;
+      *p++ = '0' + desc[n].mode % 10;
+      *p++ = ':';
+      p = stpcpy (p, desc[n].u.name);
+      *p++ = '\n';
+    }
+  *p = 0;
+  return key;
+}
+
+
+/* Return true if BLOB matches one of the descriptions of PART.  */
+static int
+pscan_match (struct pscan_part_s *part, KEYBOXBLOB blob)
+{
+  size_t n;
+
+  for (n=0; n < part->ndesc; n++)
+    switch (part->desc[n].mode)
+      {
+      case KEYDB_SEARCH_MODE_EXACT:
+        if (has_username (blob, part->desc[n].u.name, 0))
+          return 1;
+        break;
+      case KEYDB_SEARCH_MODE_MAIL:
+        if (has_mail (blob, part->desc[n].u.name, 0))
+          return 1;
+        break;
+      case KEYDB_SEARCH_MODE_MAILSUB:
+        if (has_mail (blob, part->desc[n].u.name, 1))
+          return 1;
+        break;
+      case KEYDB_SEARCH_MODE_SUBSTR:
+        if (has_username (blob, part->desc[n].u.name, 1))
+          return 1;
+        break;
+      case KEYDB_SEARCH_MODE_ISSUER:
+        if (has_issuer (blob, part->desc[n].u.name))
+          return 1;
+        break;
+      case KEYDB_SEARCH_MODE_SUBJECT:
+        if (has_subject (blob, part->desc[n].u.name))
+          return 1;
+        break;
+      default:
+        break;
+      }
+
+  return 0;
+}
+
+
+/* Append OFF to the result of PART.  */
+static gpg_error_t
+pscan_add (struct pscan_part_s *part, off_t off)
+{
+  off_t *tmp;
+
+  if (part->count == part->size)
+    {
+      part->size = part->size? part->size * 2 : 256;
+      tmp = xtryrealloc (part->offsets, part->size * sizeof *tmp);
+      if (!tmp)
+        return (part->err = gpg_error_from_syserror ());
+      part->offsets = tmp;
+    }
+  part->offsets[part->count++] = off;
+  return 0;
+}
+
+
+/* The thread function scanning one partition.  The thread does not
+ * use any shared state and thus runs without the nPth lock.  */
+static void *
+pscan_thread (void *arg)
+{
+  struct pscan_part_s *part = arg;
+  const unsigned char *image;
+  size_t imagelen;
+  off_t pos;
+  int blobtype;
+
+  npth_unprotect ();
+  for (pos = part->start; pos < part->end; pos += imagelen)
+    {
+      /* The lengths have already been checked by pscan_split.  */
+      image = part->base + pos;
+      imagelen = buf32_to_size_t (image);
+      if (!image[4])
+        continue;  /* Deleted blob.  */
+      if (imagelen > IMAGELEN_LIMIT)
+        {
+          /* Let keybox_search count the too large blob.  */
+          if (pscan_add (part, pos))
+            break;
+          continue;
+        }
+
+      _keybox_set_mapped_blob (part->blob, image, imagelen, pos);
+      blobtype = blob_get_type (part->blob);
+      if (blobtype == KEYBOX_BLOBTYPE_HEADER)
+        continue;
+      if (part->want_blobtype && blobtype != part->want_blobtype)
+        continue;
+      if (!part->ephemeral && (blob_get_blob_flags (part->blob) & 2))
+        continue;
+      if (pscan_match (part, part->blob) && pscan_add (part, pos))
+        break;
+    }
+  npth_protect ();
+
+  return NULL;
+}
+
+
+/* Split the file of SIZE bytes mapped at BASE into up to NPARTS
+ * partitions of about the same size and store their boundaries at
+ * PARTS.  Returns the number of partitions or 0 if the file is
+ * corrupt.  */
+static size_t
+pscan_split (const unsigned char *base, size_t size,
+             struct pscan_part_s *parts, size_t nparts)
+{
+  size_t chunk, imagelen, n;
+  size_t pos;
+
+  chunk = size / nparts;
+  n = 0;
+  parts[0].start = 0;
+  for (pos = 0; pos < size; pos += imagelen)
+    {
+      if (size - pos < 5)
+        return 0;
+      imagelen = buf32_to_size_t (base + pos);
+      if (imagelen < 5 || imagelen > size - pos)
+        return 0;
+      if (n + 1 < nparts && pos >= chunk * (n + 1))
+        {
+          parts[n].end = pos;
+          parts[++n].start = pos;
+        }
+    }
+  parts[n].end = pos;
+  return n + 1;
+}
+
+
+/* Scan the file of HD for blobs matching (DESC,NDESC) using up to
+ * HD->SCAN_THREADS threads.  On success the offsets of the candidate
+ * blobs are available at HD->PSCAN.  If the file has not changed
+ * since the last scan with the same descriptions, that result is
+ * used.  Returns GPG_ERR_NOT_SUPPORTED if a linear scan shall be used
+ * instead.  */
+static gpg_error_t
+pscan_file (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+            keybox_blobtype_t want_blobtype)
+{
+  gpg_error_t err;
+  struct stat sb;
+  char *key;
+  void *base;
+  struct pscan_part_s *parts = NULL;
+  size_t nparts, n, count;
+  off_t *offsets;
+
+  if (fstat (fileno (hd->fp), &sb))
+    return gpg_error_from_syserror ();
+  if (sb.st_size < PSCAN_MIN_FILESIZE
+      || (off_t)(size_t)sb.st_size != sb.st_size)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  key = pscan_make_key (desc, ndesc);
+  if (!key)
+    return gpg_error_from_syserror ();
+  if (hd->pscan.key && !strcmp (hd->pscan.key, key)
+      && hd->pscan.want_blobtype == want_blobtype
+      && hd->pscan.size == sb.st_size
+      && hd->pscan.mtime == sb.st_mtime
+      && hd->pscan.ino == sb.st_ino)
+    {
+      xfree (key);
+      return 0;  /* Use the last result.  */
+    }
+  _keybox_pscan_release (hd);
+
+  /* We use our own mapping because another connection may close the
+   * file of HD while we are waiting for the threads.  */
+  base = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fileno (hd->fp), 0);
+  if (base == MAP_FAILED)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (key);
+      return err;
+    }
+
+  nparts = hd->scan_threads;
+  if (nparts > PSCAN_MAX_THREADS)
+    nparts = PSCAN_MAX_THREADS;
+  parts = xtrycalloc (nparts, sizeof *parts);
+  if (!parts)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  nparts = pscan_split (base, sb.st_size, parts, nparts);
+  if (!nparts)
+    {
+      /* Let the linear scan report the error.  */
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      goto leave;
+    }
+
+  for (n=0; n < nparts; n++)
+    {
+      parts[n].base = base;
+      parts[n].desc = desc;
+      parts[n].ndesc = ndesc;
+      parts[n].want_blobtype = want_blobtype;
+      parts[n].ephemeral = hd->ephemeral;
+      err = _keybox_new_mapped_blob (&parts[n].blob);
+      if (err)
+        goto leave;
+    }
+
+  err = 0;
+  for (n=0; n < nparts && !err; n++)
+    {
+      int ret = npth_create (&parts[n].thread, NULL, pscan_thread, parts + n);
+      if (ret)
+        err = gpg_error_from_errno (ret);
+      else
+        parts[n].started = 1;
+    }
+  for (n=0; n < nparts; n++)
+    if (parts[n].started)
+      {
+        npth_join (parts[n].thread, NULL);
+        if (!err)
+          err = parts[n].err;
+      }
+  if (err)
+    goto leave;
+
+  /* Merge the results in file order.  */
+  for (count=0, n=0; n < nparts; n++)
+    count += parts[n].count;
+  offsets = xtrymalloc ((count? count : 1) * sizeof *offsets);
+  if (!offsets)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (count=0, n=0; n < nparts; n++)
+    {
+      if (parts[n].count)
+        memcpy (offsets + count, parts[n].offsets,
+                parts[n].count * sizeof *offsets);
+      count += parts[n].count;
+    }
+
+  hd->pscan.key = key;
+  key = NULL;
+  hd->pscan.offsets = offsets;
+  hd->pscan.count = count;
+  hd->pscan.want_blobtype = want_blobtype;
+  hd->pscan.size = sb.st_size;
+  hd->pscan.mtime = sb.st_mtime;
+  hd->pscan.ino = sb.st_ino;
+
+ leave:
+  if (parts)
+    {
+      for (n=0; n < nparts; n++)
+        {
+          _keybox_release_blob (parts[n].blob);
+          xfree (parts[n].offsets);
+        }
+      xfree (parts);
+    }
+  munmap (base, sb.st_size);
+  xfree (key);
+  return err;
+}
+#endif /*KEYBOX_WITH_NPTH && HAVE_MMAP*/
+
+
+/* Release the result of the last partitioned scan of HD.  */
+void
+_keybox_pscan_release (KEYBOX_HANDLE hd)
+{
+  xfree (hd->pscan.key);
+  hd->pscan.key = NULL;
+  xfree (hd->pscan.offsets);
+  hd->pscan.offsets = NULL;
+  hd->pscan.count = 0;
+}
+
+
 
 /*
 
@@ -886,6 +1594,7 @@ keybox_search_reset (KEYBOX_HANDLE hd)
         {
           /* Ooops.  Seek did not work.  Close so that the search will
            * open the file again.  */
+          _keybox_unmap_file (hd);
           fclose (hd->fp);
           hd->fp = NULL;
         }
@@ -913,6 +1622,14 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
   struct sn_array_s *sn_array = NULL;
   int pk_no, uid_no;
   off_t lastfoundoff;
+  int use_index = 0;
+  off_t *idx_offsets = NULL;
+  size_t idx_count = 0;
+  size_t idx_pos = 0;
+  off_t mappos = 0;
+  descset_t descset = NULL;
+  size_t setidx;
+  int set_pk_no;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -1058,6 +1775,58 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         }
     }
 
+  /* If all search descriptions can be looked up in the index, we use
+   * it to get the offsets of the candidate blobs and check only
+   * those.  Without a usable index we fall back to a linear scan.  */
+  if (want_blobtype == KEYBOX_BLOBTYPE_PGP
+      && _keybox_index_usable (desc, ndesc))
+    {
+      off_t curoff = ftello (hd->fp);
+
+      if (curoff != (off_t)-1
+          && !_keybox_index_lookup (hd, desc, ndesc, &idx_offsets, &idx_count))
+        {
+          use_index = 1;
+          /* Skip candidates before the current position so that a
+           * repeated search continues with the next match.  */
+          while (idx_pos < idx_count && idx_offsets[idx_pos] < curoff)
+            idx_pos++;
+        }
+    }
+#if defined(KEYBOX_WITH_NPTH) && defined(HAVE_MMAP)
+  /* Searches which need to look at all blobs are done by several
+   * threads if requested.  The result is then used like the result
+   * of an index lookup.  */
+  if (!use_index && hd->scan_threads > 1 && pscan_usable (desc, ndesc))
+    {
+      off_t curoff = ftello (hd->fp);
+
+      if (curoff != (off_t)-1
+          && !pscan_file (hd, desc, ndesc, want_blobtype))
+        {
+          use_index = 1;
+          idx_offsets = hd->pscan.offsets;
+          idx_count = hd->pscan.count;
+          while (idx_pos < idx_count && idx_offsets[idx_pos] < curoff)
+            idx_pos++;
+        }
+    }
+#endif /*KEYBOX_WITH_NPTH && HAVE_MMAP*/
+
+  /* In mmap mode we track the file position ourselves and update
+   * the position of the stream only when we are done.  */
+  if (hd->map.base)
+    {
+      mappos = ftello (hd->fp);
+      if (mappos == (off_t)-1)
+        {
+          rc = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+
+  /* With many descriptors we look up most of them in a sorted set.  */
+  descset = create_descset (desc, ndesc);
 
   pk_no = uid_no = 0;
   for (;;)
@@ -1065,8 +1834,33 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       unsigned int blobflags;
       int blobtype;
 
-      _keybox_release_blob (blob); blob = NULL;
-      rc = _keybox_read_blob (&blob, hd->fp, NULL);
+      if (blob != hd->map.blob)
+        _keybox_release_blob (blob);
+      blob = NULL;
+      if (use_index)
+        {
+          if (idx_pos >= idx_count)
+            {
+              rc = -1; /* No more candidates.  */
+              break;
+            }
+          if (hd->map.base)
+            mappos = idx_offsets[idx_pos];
+          else if (fseeko (hd->fp, idx_offsets[idx_pos], SEEK_SET))
+            {
+              rc = gpg_error_from_syserror ();
+              break;
+            }
+          idx_pos++;
+        }
+      if (hd->map.base)
+        {
+          rc = _keybox_read_mapped_blob (hd, &mappos, NULL);
+          if (!rc)
+            blob = hd->map.blob;
+        }
+      else
+        rc = _keybox_read_blob (&blob, hd->fp, NULL);
       if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
           && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
         {
@@ -1077,6 +1871,10 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       if (rc)
         break;
 
+      if (use_index
+          && _keybox_get_blob_fileoffset (blob) != idx_offsets[idx_pos-1])
+        continue; /* The candidate blob has been deleted.  */
+
       blobtype = blob_get_type (blob);
       if (blobtype == KEYBOX_BLOBTYPE_HEADER)
         continue;
@@ -1087,8 +1885,14 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       if (!hd->ephemeral && (blobflags & 2))
         continue; /* Not in ephemeral mode but blob is flagged ephemeral.  */
 
-      for (n=0; n < ndesc; n++)
+      if (descset)
+        setidx = match_descset (descset, ndesc, blob, &set_pk_no);
+      else
+        setidx = ndesc;
+      for (n=0; n < setidx; n++)
         {
+          if (descset && descset->member[n])
+            continue;
           switch (desc[n].mode)
             {
             case KEYDB_SEARCH_MODE_NONE:
@@ -1173,6 +1977,13 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
               goto found;
             }
 	}
+      if (setidx < ndesc)
+        {
+          n = setidx;
+          if (set_pk_no)
+            pk_no = set_pk_no;
+          goto found;
+        }
       continue;
     found:
       /* Record which DESC we matched on.  Note this value is only
@@ -1192,6 +2003,18 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         break; /* got it */
     }
 
+  if (hd->map.base)
+    {
+      /* Sync the stream with the position in the mapped file.  */
+      if (fseeko (hd->fp, mappos, SEEK_SET) && !rc)
+        rc = gpg_error_from_syserror ();
+      /* The found blob shall persist when the file is unmapped.  */
+      if (!rc && blob == hd->map.blob)
+        rc = _keybox_copy_mapped_blob (&blob, hd->map.blob);
+      else if (blob == hd->map.blob)
+        blob = NULL;
+    }
+
   if (!rc)
     {
       hd->found.blob = blob;
@@ -1209,8 +2032,12 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       hd->error = rc;
     }
 
+ leave:
   if (sn_array)
     release_sn_array (sn_array, ndesc);
+  if (idx_offsets != hd->pscan.offsets)
+    xfree (idx_offsets);
+  release_descset (descset);
 
   return rc;
 }
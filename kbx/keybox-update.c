@@ -37,6 +37,12 @@
 #define FILECOPY_DELETE 2
 #define FILECOPY_UPDATE 3
 
+/* The journal written by blob_append to "FNAME.jnl" consists of this
+ * magic followed by the length of the keybox before the append as an
+ * u64 in network byte order.  */
+#define JOURNAL_MAGIC "KBXj"
+#define JOURNAL_LEN   12
+
 
 #if !defined(HAVE_FSEEKO) && !defined(fseeko)
 
@@ -154,6 +160,174 @@ rename_tmp_file (const char *bakfname, const char *tmpfname,
 
 
 
+/* Flush FP and make sure that the data is on the disk.  */
+static gpg_error_t
+sync_file (FILE *fp)
+{
+  if (fflush (fp))
+    return gpg_error_from_syserror ();
+#ifdef HAVE_FSYNC
+  if (fsync (fileno (fp)))
+    return gpg_error_from_syserror ();
+#endif
+  return 0;
+}
+
+
+/* Roll back an append to the keybox FNAME which has been interrupted
+ * before it was completed.  This must be called with the keybox
+ * locked.  */
+static gpg_error_t
+recover_journal (const char *fname)
+{
+  gpg_error_t err = 0;
+  char *jname;
+  FILE *jfp, *fp;
+  unsigned char buf[JOURNAL_LEN];
+  off_t size;
+
+  jname = strconcat (fname, EXTSEP_S "jnl", NULL);
+  if (!jname)
+    return gpg_error_from_syserror ();
+
+  jfp = fopen (jname, "rb");
+  if (!jfp)
+    {
+      if (errno != ENOENT)
+        err = gpg_error_from_syserror ();
+      xfree (jname);
+      return err;
+    }
+
+  /* A short journal was not completely written; thus the keybox has
+   * not yet been touched.  */
+  if (fread (buf, JOURNAL_LEN, 1, jfp) == 1
+      && !memcmp (buf, JOURNAL_MAGIC, 4))
+    {
+      size = (((off_t)buf32_to_u32 (buf+4)) << 32) | buf32_to_u32 (buf+8);
+      log_info ("%s: rolling back an interrupted update\n", fname);
+      fp = fopen (fname, "r+b");
+      if (!fp)
+        err = gpg_error_from_syserror ();
+#ifdef HAVE_FTRUNCATE
+      else if (ftruncate (fileno (fp), size))
+        err = gpg_error_from_syserror ();
+#else
+      else
+        err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+#endif
+      if (fp)
+        fclose (fp);
+      /* The offsets in the index may now be wrong.  */
+      if (!err)
+        _keybox_index_remove (fname);
+    }
+  fclose (jfp);
+  if (!err)
+    gnupg_remove (jname);
+  else
+    log_error ("%s: error rolling back an interrupted update: %s\n",
+               fname, gpg_strerror (err));
+  xfree (jname);
+  return err;
+}
+
+
+/* Append BLOB to the existing keybox FNAME without copying the file.
+ * Before the blob is written the old length of the file is stored in
+ * a journal so that a failed append can be undone by
+ * recover_journal.  Returns GPG_ERR_NOT_SUPPORTED if this needs to be
+ * done by blob_filecopy; this is the case if the file does not yet
+ * exist or its header needs to be updated for FOR_OPENPGP.  This must
+ * be called with the keybox locked.  */
+static gpg_error_t
+blob_append (const char *fname, KEYBOXBLOB blob, int for_openpgp)
+{
+#ifdef HAVE_FTRUNCATE
+  gpg_error_t err;
+  FILE *fp, *jfp;
+  char *jname = NULL;
+  unsigned char buf[JOURNAL_LEN];
+  off_t size;
+  int i;
+  int keep_journal = 0;
+
+  err = recover_journal (fname);
+  if (err)
+    return err;
+
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  /* The header blob is the first one; check its type and, for
+   * OpenPGP, the flag telling that the keybox has OpenPGP blobs.  */
+  if (fread (buf, 8, 1, fp) != 1
+      || buf[4] != KEYBOX_BLOBTYPE_HEADER
+      || (for_openpgp && !(buf[7] & 0x02)))
+    {
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      goto leave;
+    }
+
+  if (fseeko (fp, 0, SEEK_END) || (size = ftello (fp)) == (off_t)-1)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  jname = strconcat (fname, EXTSEP_S "jnl", NULL);
+  if (!jname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  jfp = fopen (jname, "wb");
+  if (!jfp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  memcpy (buf, JOURNAL_MAGIC, 4);
+  for (i=0; i < 8; i++)
+    buf[4+i] = ((unsigned long long)size) >> (8 * (7 - i));
+  if (fwrite (buf, JOURNAL_LEN, 1, jfp) != 1)
+    err = gpg_error_from_syserror ();
+  if (!err)
+    err = sync_file (jfp);
+  if (fclose (jfp) && !err)
+    err = gpg_error_from_syserror ();
+  if (err)
+    goto leave;
+
+  err = _keybox_write_blob (blob, fp);
+  if (!err)
+    err = sync_file (fp);
+  if (err)
+    {
+      /* Try to undo the partial append right away; if that does not
+       * work the next writer does this using the journal.  */
+      if (fflush (fp) || ftruncate (fileno (fp), size))
+        keep_journal = 1;
+    }
+
+ leave:
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  if (jname && !keep_journal)
+    gnupg_remove (jname);
+  xfree (jname);
+  return err;
+#else /*!HAVE_FTRUNCATE*/
+  (void)fname;
+  (void)blob;
+  (void)for_openpgp;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+#endif /*!HAVE_FTRUNCATE*/
+}
+
+
+
 /* Perform insert/delete/update operation.  MODE is one of
    FILECOPY_INSERT, FILECOPY_DELETE, FILECOPY_UPDATE.  FOR_OPENPGP
    indicates that this is called due to an OpenPGP keyblock change.  */
@@ -173,6 +347,11 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
   if (access (fname, W_OK))
     return gpg_error_from_syserror ();
 
+  /* Do not copy the remains of an interrupted append.  */
+  rc = recover_journal (fname);
+  if (rc)
+    return rc;
+
   fp = fopen (fname, "rb");
   if (mode == FILECOPY_INSERT && !fp && errno == ENOENT)
     {
@@ -362,6 +541,7 @@ keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   KEYBOXBLOB blob;
   size_t nparsed;
   struct _keybox_openpgp_info info;
+  keybox_index_t idx;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_HANDLE);
@@ -386,7 +566,13 @@ keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   _keybox_destroy_openpgp_info (&info);
   if (!err)
     {
-      err = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 1, 0);
+      idx = _keybox_index_begin_update (fname);
+      err = blob_append (fname, blob, 1);
+      if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED)
+        err = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 1, 0);
+      _keybox_index_end_update (idx, fname,
+                                err? KEYBOX_INDEX_ABORT : KEYBOX_INDEX_INSERT,
+                                0, 0, blob);
       _keybox_release_blob (blob);
       /*    if (!rc && !hd->secret && kb_offtbl) */
       /*      { */
@@ -405,9 +591,11 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   gpg_error_t err;
   const char *fname;
   off_t off;
+  size_t oldlen;
   KEYBOXBLOB blob;
   size_t nparsed;
   struct _keybox_openpgp_info info;
+  keybox_index_t idx;
 
   if (!hd || !image || !imagelen)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -422,6 +610,7 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
+  _keybox_get_blob_image (hd->found.blob, &oldlen);
 
   /* Close the file so that we do no mess up the position for a
      next search.  */
@@ -439,7 +628,11 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   /* Update the keyblock.  */
   if (!err)
     {
+      idx = _keybox_index_begin_update (fname);
       err = blob_filecopy (FILECOPY_UPDATE, fname, blob, hd->secret, 1, off);
+      _keybox_index_end_update (idx, fname,
+                                err? KEYBOX_INDEX_ABORT : KEYBOX_INDEX_UPDATE,
+                                off, oldlen, blob);
       _keybox_release_blob (blob);
     }
   return err;
@@ -455,6 +648,7 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   int rc;
   const char *fname;
   KEYBOXBLOB blob;
+  keybox_index_t idx;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_HANDLE);
@@ -472,7 +666,13 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   rc = _keybox_create_x509_blob (&blob, cert, sha1_digest, hd->ephemeral);
   if (!rc)
     {
-      rc = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 0, 0);
+      idx = _keybox_index_begin_update (fname);
+      rc = blob_append (fname, blob, 0);
+      if (gpg_err_code (rc) == GPG_ERR_NOT_SUPPORTED)
+        rc = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 0, 0);
+      _keybox_index_end_update (idx, fname,
+                                rc? KEYBOX_INDEX_ABORT : KEYBOX_INDEX_INSERT,
+                                0, 0, blob);
       _keybox_release_blob (blob);
       /*    if (!rc && !hd->secret && kb_offtbl) */
       /*      { */
@@ -508,6 +708,7 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
   size_t flag_pos, flag_size;
   const unsigned char *buffer;
   size_t length;
+  keybox_index_t kbxidx;
 
   (void)idx;  /* Not yet used.  */
 
@@ -535,9 +736,13 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
   off += flag_pos;
 
   _keybox_close_file (hd);
+  kbxidx = _keybox_index_begin_update (fname);
   fp = fopen (hd->kb->fname, "r+b");
   if (!fp)
-    return gpg_error_from_syserror ();
+    {
+      _keybox_index_end_update (kbxidx, fname, KEYBOX_INDEX_ABORT, 0, 0, NULL);
+      return gpg_error_from_syserror ();
+    }
 
   ec = 0;
   if (fseeko (fp, off, SEEK_SET))
@@ -571,6 +776,9 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
         ec = gpg_err_code_from_syserror ();
     }
 
+  _keybox_index_end_update (kbxidx, fname,
+                            ec? KEYBOX_INDEX_ABORT : KEYBOX_INDEX_TOUCH,
+                            0, 0, NULL);
   return gpg_error (ec);
 }
 
@@ -583,6 +791,7 @@ keybox_delete (KEYBOX_HANDLE hd)
   const char *fname;
   FILE *fp;
   int rc;
+  keybox_index_t idx;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -597,14 +806,17 @@ keybox_delete (KEYBOX_HANDLE hd)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
-  off += 4;
 
   _keybox_close_file (hd);
+  idx = _keybox_index_begin_update (fname);
   fp = fopen (hd->kb->fname, "r+b");
   if (!fp)
-    return gpg_error_from_syserror ();
+    {
+      _keybox_index_end_update (idx, fname, KEYBOX_INDEX_ABORT, 0, 0, NULL);
+      return gpg_error_from_syserror ();
+    }
 
-  if (fseeko (fp, off, SEEK_SET))
+  if (fseeko (fp, off + 4, SEEK_SET))
     rc = gpg_error_from_syserror ();
   else if (putc (0, fp) == EOF)
     rc = gpg_error_from_syserror ();
@@ -617,14 +829,134 @@ keybox_delete (KEYBOX_HANDLE hd)
         rc = gpg_error_from_syserror ();
     }
 
+  _keybox_index_end_update (idx, fname,
+                            rc? KEYBOX_INDEX_ABORT : KEYBOX_INDEX_DELETE,
+                            off, 0, NULL);
   return rc;
 }
 
 
+/* An entry used by keybox_compress_ext to sort the blobs.  */
+struct compress_entry_s
+{
+  off_t off;                  /* The offset of the blob in the file.  */
+  unsigned char key[33];      /* The blob type and the fingerprint.  */
+};
+typedef struct compress_entry_s *compress_entry_t;
+
+
+static int
+cmp_compress_entries (const void *a_arg, const void *b_arg)
+{
+  const struct compress_entry_s *a = a_arg;
+  const struct compress_entry_s *b = b_arg;
+  int cmp;
+
+  cmp = memcmp (a->key, b->key, sizeof a->key);
+  if (cmp)
+    return cmp;
+  return a->off < b->off? -1 : a->off > b->off;
+}
+
+
+/* Append an entry for BLOB to the array at R_ENTRIES which has
+ * R_NENTRIES used and R_NALLOCED allocated items.  */
+static gpg_error_t
+add_compress_entry (compress_entry_t *r_entries, size_t *r_nentries,
+                    size_t *r_nalloced, KEYBOXBLOB blob)
+{
+  const unsigned char *buffer;
+  size_t length, n;
+  compress_entry_t e;
+
+  if (*r_nentries == *r_nalloced)
+    {
+      size_t newsize = *r_nalloced? 2 * *r_nalloced : 1024;
+
+      e = xtryrealloc (*r_entries, newsize * sizeof *e);
+      if (!e)
+        return gpg_error_from_syserror ();
+      *r_entries = e;
+      *r_nalloced = newsize;
+    }
+  e = *r_entries + (*r_nentries)++;
+  memset (e, 0, sizeof *e);
+  e->off = _keybox_get_blob_fileoffset (blob);
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length > 4)
+    e->key[0] = buffer[4];
+  /* The fingerprint of the primary key is the first item of the key
+   * table.  It is the UBID of the blob.  */
+  if (length > 20)
+    {
+      n = length - 20;
+      if (n > sizeof e->key - 1)
+        n = sizeof e->key - 1;
+      memcpy (e->key + 1, buffer + 20, n);
+    }
+  return 0;
+}
+
+
+/* Write the blobs described by ENTRIES and NENTRIES from FP to NEWFP
+ * in the sorted order.  R_ANY_CHANGES is set if the order differs
+ * from the order in FP.  */
+static gpg_error_t
+write_sorted_blobs (FILE *fp, FILE *newfp,
+                    compress_entry_t entries, size_t nentries,
+                    int *r_any_changes)
+{
+  gpg_error_t err;
+  KEYBOXBLOB blob;
+  size_t n;
+
+  qsort (entries, nentries, sizeof *entries, cmp_compress_entries);
+  for (n=1; n < nentries; n++)
+    if (entries[n].off < entries[n-1].off)
+      {
+        *r_any_changes = 1;
+        break;
+      }
+
+  for (n=0; n < nentries; n++)
+    {
+      if (fseeko (fp, entries[n].off, SEEK_SET))
+        return gpg_error_from_syserror ();
+      err = _keybox_read_blob (&blob, fp, NULL);
+      if (err == -1)
+        err = gpg_error (GPG_ERR_EOF);
+      if (err)
+        return err;
+      err = _keybox_write_blob (blob, newfp);
+      _keybox_release_blob (blob);
+      if (err)
+        return err;
+    }
+  return 0;
+}
+
+
 /* Compress the keybox file.  This should be run with the file
    locked. */
 int
 keybox_compress (KEYBOX_HANDLE hd)
+{
+  return keybox_compress_ext (hd, 0);
+}
+
+
+/* Compress the keybox file like keybox_compress.  FLAGS modify the
+ * operation:
+ *
+ *   KEYBOX_COMPRESS_FORCE - Do not skip the run if the last one was
+ *                           less than 3 hours ago.
+ *   KEYBOX_COMPRESS_SORT  - Write the blobs sorted by their type and
+ *                           fingerprint.
+ *   KEYBOX_COMPRESS_INDEX - Rebuild the index after the run.
+ *
+ * This should be run with the file locked.  */
+int
+keybox_compress_ext (KEYBOX_HANDLE hd, unsigned int flags)
 {
   int read_rc, rc;
   const char *fname;
@@ -636,6 +968,9 @@ keybox_compress (KEYBOX_HANDLE hd)
   u32 cut_time;
   int any_changes = 0;
   int skipped_deleted;
+  compress_entry_t entries = NULL;
+  size_t nentries = 0;
+  size_t nalloced = 0;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_HANDLE);
@@ -654,6 +989,10 @@ keybox_compress (KEYBOX_HANDLE hd)
   if (access (fname, W_OK))
     return gpg_error_from_syserror ();
 
+  rc = recover_journal (fname);
+  if (rc)
+    return rc;
+
   fp = fopen (fname, "rb");
   if (!fp && errno == ENOENT)
     return 0; /* Ready. File has been deleted right after the access above. */
@@ -665,7 +1004,7 @@ keybox_compress (KEYBOX_HANDLE hd)
 
   /* A quick test to see if we need to compress the file at all.  We
      schedule a compress run after 3 hours. */
-  if ( !_keybox_read_blob (&blob, fp, NULL) )
+  if (!(flags & KEYBOX_COMPRESS_FORCE) && !_keybox_read_blob (&blob, fp, NULL))
     {
       const unsigned char *buffer;
       size_t length;
@@ -679,6 +1018,8 @@ keybox_compress (KEYBOX_HANDLE hd)
             {
               fclose (fp);
               _keybox_release_blob (blob);
+              if ((flags & KEYBOX_COMPRESS_INDEX))
+                return _keybox_index_rebuild (fname);
               return 0; /* Compress run not yet needed. */
             }
         }
@@ -767,6 +1108,15 @@ keybox_compress (KEYBOX_HANDLE hd)
             }
         }
 
+      if ((flags & KEYBOX_COMPRESS_SORT))
+        {
+          /* Only remember the blob; it is written after sorting.  */
+          rc = add_compress_entry (&entries, &nentries, &nalloced, blob);
+          if (rc)
+            break;
+          continue;
+        }
+
       rc = _keybox_write_blob (blob, newfp);
       if (rc)
         break;
@@ -778,6 +1128,9 @@ keybox_compress (KEYBOX_HANDLE hd)
     rc = 0;
   else if (!rc)
     rc = read_rc;
+  if (!rc && (flags & KEYBOX_COMPRESS_SORT))
+    rc = write_sorted_blobs (fp, newfp, entries, nentries, &any_changes);
+  xfree (entries);
 
   /* Close both files. */
   if (fclose(fp) && !rc)
@@ -789,7 +1142,15 @@ keybox_compress (KEYBOX_HANDLE hd)
   if (rc || !any_changes)
     gnupg_remove (tmpfname);
   else
-    rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
+    {
+      rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
+      /* All offsets have changed; the index will be rebuilt by the
+       * next search which can make use of it.  */
+      if (!rc)
+        _keybox_index_remove (fname);
+    }
+  if (!rc && (flags & KEYBOX_COMPRESS_INDEX))
+    rc = _keybox_index_rebuild (fname);
 
   xfree(bakfname);
   xfree(tmpfname);
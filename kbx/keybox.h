@@ -75,6 +75,8 @@ void keybox_push_found_state (KEYBOX_HANDLE hd);
 void keybox_pop_found_state (KEYBOX_HANDLE hd);
 const char *keybox_get_resource_name (KEYBOX_HANDLE hd);
 int keybox_set_ephemeral (KEYBOX_HANDLE hd, int yes);
+void keybox_set_mmap (KEYBOX_HANDLE hd, int yes);
+void keybox_set_scan_threads (KEYBOX_HANDLE hd, unsigned int nthreads);
 
 gpg_error_t keybox_lock (KEYBOX_HANDLE hd, int yes, long timeout);
 
@@ -121,6 +123,10 @@ int keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value);
 
 int keybox_delete (KEYBOX_HANDLE hd);
 int keybox_compress (KEYBOX_HANDLE hd);
+#define KEYBOX_COMPRESS_FORCE 1
+#define KEYBOX_COMPRESS_SORT  2
+#define KEYBOX_COMPRESS_INDEX 4
+int keybox_compress_ext (KEYBOX_HANDLE hd, unsigned int flags);
 
 
 /*--  --*/
@@ -58,6 +58,7 @@
 #include "../common/init.h"
 #include "../common/gc-opt-flags.h"
 #include "../common/exechelp.h"
+#include "../common/workpool.h"
 #include "frontend.h"
 
 
@@ -89,7 +90,13 @@ enum cmd_and_opt_values
     oBatch,
     oFakedSystemTime,
     oListenBacklog,
+    oConnectionThreads,
     oDisableCheckOwnSocket,
+    oKeyCacheSize,
+    oBlobCacheSize,
+    oLogSlowQueries,
+    oCacheWarmup,
+    oScanThreads,
 
     oDummy
   };
@@ -120,6 +127,18 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_s (oHomedir,    "homedir",      "@"),
 
   ARGPARSE_s_i (oListenBacklog, "listen-backlog", "@"),
+  ARGPARSE_s_u (oConnectionThreads, "connection-threads", "@"),
+
+  ARGPARSE_s_u (oKeyCacheSize,  "key-cache-size",
+                N_("|N|cache up to N key items")),
+  ARGPARSE_s_u (oBlobCacheSize, "blob-cache-size",
+                N_("|N|cache up to N keyblocks")),
+  ARGPARSE_s_u (oLogSlowQueries, "log-slow-queries",
+                N_("|N|log searches taking N milliseconds or more")),
+  ARGPARSE_s_u (oCacheWarmup, "cache-warmup",
+                N_("|N|preload the N most recently used keyblocks")),
+  ARGPARSE_s_u (oScanThreads, "scan-threads",
+                N_("|N|use N threads for searches scanning all keys")),
 
   ARGPARSE_end () /* End of list */
 };
@@ -154,6 +173,10 @@ static struct debug_flags_s debug_flags [] =
 # define CHECK_OWN_SOCKET_INTERVAL  (60)
 #endif
 
+/* The name of the file below the public keys directory which lists
+ * the keys for the cache warm-up.  */
+#define CACHE_WARMUP_NAME "cache-warmup.lst"
+
 /* The list of open file descriptors at startup.  Note that this list
  * has been allocated using the standard malloc.  */
 #ifndef HAVE_W32_SYSTEM
@@ -190,6 +213,13 @@ static assuan_sock_nonce_t socket_nonce;
  * Let's try this as default.  Change at runtime with --listen-backlog.  */
 static int listen_backlog = 64;
 
+/* The maximum number of threads handling connections or 0 to start a
+ * thread for each connection.  Change with --connection-threads.  */
+static unsigned int connection_threads;
+
+/* The pool used with --connection-threads.  */
+static workpool_t connection_pool;
+
 /* Name of a config file, which will be reread on a HUP if it is not NULL. */
 static char *config_filename;
 
@@ -253,6 +283,8 @@ static void kbxd_init_default_ctrl (ctrl_t ctrl);
 static void kbxd_deinit_default_ctrl (ctrl_t ctrl);
 
 static void handle_connections (gnupg_fd_t listen_fd);
+static void start_cache_warmup (void);
+static void save_cache_warmup (void);
 static void check_own_socket (void);
 static int check_for_running_kbxd (int silent);
 
@@ -378,6 +410,7 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       opt.quiet = 0;
       opt.verbose = 0;
       opt.debug = 0;
+      opt.slow_query_ms = 0;
       disable_check_own_socket = 0;
       return 1;
     }
@@ -406,6 +439,8 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
 
     case oDisableCheckOwnSocket: disable_check_own_socket = 1; break;
 
+    case oLogSlowQueries: opt.slow_query_ms = pargs->r.ret_ulong; break;
+
     default:
       return 0; /* not handled */
     }
@@ -586,6 +621,15 @@ main (int argc, char **argv )
           listen_backlog = pargs.r.ret_int;
           break;
 
+        case oConnectionThreads:
+          connection_threads = pargs.r.ret_ulong;
+          break;
+
+        case oKeyCacheSize: opt.key_cache_size = pargs.r.ret_ulong; break;
+        case oBlobCacheSize: opt.blob_cache_size = pargs.r.ret_ulong; break;
+        case oCacheWarmup: opt.cache_warmup = pargs.r.ret_ulong; break;
+        case oScanThreads: opt.scan_threads = pargs.r.ret_ulong; break;
+
         default:
           if (configname)
             pargs.err = ARGPARSE_PRINT_WARNING;
@@ -861,8 +905,10 @@ main (int argc, char **argv )
       }
 
       log_info ("%s %s started\n", gpgrt_strusage(11), gpgrt_strusage(13));
+      start_cache_warmup ();
       handle_connections (fd);
       assuan_sock_close (fd);
+      save_cache_warmup ();
     }
 
   return 0;
@@ -1062,6 +1108,17 @@ get_kbxd_active_connection_count (void)
 }
 
 
+/* Return a malloced string with the statistics of the connection
+ * thread pool or NULL on a memory error.  */
+char *
+get_kbxd_connection_pool_stats (void)
+{
+  if (!connection_pool)
+    return xtrystrdup ("max_threads=0");
+  return workpool_stats (connection_pool);
+}
+
+
 /* Create a name for the socket in the home directory as using
  * STANDARD_NAME.  We also check for valid characters as well as
  * against a maximum allowed length for a Unix domain socket is done.
@@ -1420,6 +1477,81 @@ do_start_connection_thread (ctrl_t ctrl)
 }
 
 
+/* Return the malloced name of the file with the keys for the cache
+ * warm-up.  */
+static char *
+cache_warmup_filename (void)
+{
+  return make_filename (gnupg_homedir (), GNUPG_PUBLIC_KEYS_DIR,
+                        CACHE_WARMUP_NAME, NULL);
+}
+
+
+/* The thread loading the keys saved at the last shutdown into the
+ * cache.  */
+static void *
+cache_warmup_thread (void *arg)
+{
+  ctrl_t ctrl = arg;
+  char *fname;
+
+  kbxd_init_default_ctrl (ctrl);
+  fname = cache_warmup_filename ();
+  kbxd_warmup (ctrl, fname);
+  xfree (fname);
+  kbxd_deinit_default_ctrl (ctrl);
+  xfree (ctrl);
+  return NULL;
+}
+
+
+/* Start the cache warm-up thread if enabled by --cache-warmup.  */
+static void
+start_cache_warmup (void)
+{
+  npth_attr_t tattr;
+  npth_t thread;
+  ctrl_t ctrl;
+  int ret;
+
+  if (!opt.cache_warmup)
+    return;
+
+  ctrl = xtrycalloc (1, sizeof *ctrl);
+  if (!ctrl)
+    {
+      log_error ("error allocating control data for the cache warm-up: %s\n",
+                 strerror (errno));
+      return;
+    }
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  ret = npth_create (&thread, &tattr, cache_warmup_thread, ctrl);
+  if (ret)
+    {
+      log_error ("error spawning the cache warm-up thread: %s\n",
+                 strerror (ret));
+      xfree (ctrl);
+    }
+  npth_attr_destroy (&tattr);
+}
+
+
+/* Save the keys for the next cache warm-up if enabled.  */
+static void
+save_cache_warmup (void)
+{
+  char *fname;
+
+  if (!opt.cache_warmup)
+    return;
+
+  fname = cache_warmup_filename ();
+  kbxd_save_warmup (fname, opt.cache_warmup);
+  xfree (fname);
+}
+
+
 /* This is the standard connection thread's main function.  */
 static void *
 start_connection_thread (void *arg)
@@ -1474,6 +1606,11 @@ handle_connections (gnupg_fd_t listen_fd)
     log_fatal ("error allocating thread attributes: %s\n", strerror (ret));
   npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
 
+  if (connection_threads
+      && (err = workpool_new (&connection_pool, "connections",
+                              connection_threads, 0)))
+    log_fatal ("error creating connection pool: %s\n", gpg_strerror (err));
+
 #ifndef HAVE_W32_SYSTEM
   npth_sigev_init ();
   npth_sigev_add (SIGHUP);
@@ -1662,8 +1799,15 @@ handle_connections (gnupg_fd_t listen_fd)
               else
                 {
                   ctrl->thread_startup.fd = fd;
-                  ret = npth_create (&thread, &tattr,
-                                     listentbl[idx].func, ctrl);
+                  if (connection_pool)
+                    {
+                      err = workpool_submit (connection_pool,
+                                             listentbl[idx].func, ctrl, 0);
+                      ret = err? gpg_err_code_to_errno (err) : 0;
+                    }
+                  else
+                    ret = npth_create (&thread, &tattr,
+                                       listentbl[idx].func, ctrl);
                   if (ret)
                     {
                       log_error ("error spawning connection handler for %s:"
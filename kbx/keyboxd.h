@@ -45,6 +45,23 @@ struct
   /* True if we are running detached from the tty. */
   int running_detached;
 
+  /* The maximum number of key items and blobs to keep in the cache.
+   * 0 selects the default.  */
+  unsigned int key_cache_size;
+  unsigned int blob_cache_size;
+
+  /* Searches taking at least this many milliseconds are logged.  0
+   * disables the slow query log.  */
+  unsigned int slow_query_ms;
+
+  /* The number of recently used keyblocks to save at shutdown and to
+   * load into the cache at startup.  0 disables this.  */
+  unsigned int cache_warmup;
+
+  /* The number of threads used for searches which need to look at all
+   * keys of a keybox file.  0 or 1 disables parallel scans.  */
+  unsigned int scan_threads;
+
 } opt;
 
 
@@ -113,6 +130,13 @@ struct server_control_s
 
   /* Flags for the current request.  */
   unsigned int no_data_return : 1;  /* Used by SEARCH and NEXT.  */
+  unsigned int batch_search : 1;    /* A SEARCH --batch is running.  */
+  unsigned int db_lock_held : 1;    /* The database lock is held.      */
+  unsigned int query_index;         /* The current query of a batch.   */
+
+  /* If not 0 stores are collected in transactions of that many
+   * stores.  Set by the option "bulk-store".  */
+  unsigned int bulk_store;
 };
 
 
@@ -154,6 +178,7 @@ void kbxd_set_progress_cb (void (*cb)(ctrl_t ctrl, const char *what,
                            ctrl_t ctrl);
 const char *get_kbxd_socket_name (void);
 int get_kbxd_active_connection_count (void);
+char *get_kbxd_connection_pool_stats (void);
 void kbxd_sighup_action (void);
 
 
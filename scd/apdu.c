@@ -51,6 +51,7 @@
 
 #include "iso7816.h"
 #include "apdu.h"
+#include "atr.h"
 #define CCID_DRIVER_INCLUDE_USB_IDS 1
 #include "ccid-driver.h"
 
@@ -61,7 +62,7 @@ struct dev_list {
   int idx_max;
 };
 
-#define MAX_READER 4 /* Number of readers we support concurrently. */
+#define MAX_READER 16 /* Number of readers we support concurrently. */
 
 
 #if defined(_WIN32) || defined(__CYGWIN__)
@@ -134,6 +135,10 @@ struct reader_table_s {
                                               supports variable length pinpad
                                               input.  */
   unsigned int require_get_status:1;
+  unsigned int no_exlen:1;     /* The reader can't transfer extended
+                                  length APDUs.  */
+  unsigned int exlen_probed:1; /* EXLEN_AUTO is valid for the ATR.  */
+  unsigned int exlen_auto:1;   /* Use extended length for reads.  */
   unsigned char atr[33];
   size_t atrlen;           /* A zero length indicates that the ATR has
                               not yet been read; i.e. the card is not
@@ -193,6 +198,8 @@ static npth_mutex_t reader_table_lock;
 # define PCSC_SPECIFIC   0x0040  /* Card is ready for use.  */
 #endif
 
+#define PCSC_INFINITE          0xFFFFFFFF  /* Timeout for no timeout.  */
+
 #define PCSC_STATE_UNAWARE     0x0000  /* Want status.  */
 #define PCSC_STATE_IGNORE      0x0001  /* Ignore this reader.  */
 #define PCSC_STATE_CHANGED     0x0002  /* State has changed.  */
@@ -339,6 +346,7 @@ long (* DLSTDCALL pcsc_transmit) (long card,
                                   pcsc_dword_t *recv_len);
 long (* DLSTDCALL pcsc_set_timeout) (HANDLE context,
                                      pcsc_dword_t timeout);
+long (* DLSTDCALL pcsc_cancel) (HANDLE context);
 long (* DLSTDCALL pcsc_control) (HANDLE card,
                                  pcsc_dword_t control_code,
                                  const void *send_buffer,
@@ -456,6 +464,9 @@ new_reader_slot (void)
 
   reader_table[reader].is_t0 = 1;
   reader_table[reader].is_spr532 = 0;
+  reader_table[reader].no_exlen = 0;
+  reader_table[reader].exlen_probed = 0;
+  reader_table[reader].exlen_auto = 0;
   reader_table[reader].pinpad_varlen_supported = 0;
   reader_table[reader].require_get_status = 1;
   reader_table[reader].pcsc.verify_ioctl = 0;
@@ -750,9 +761,17 @@ pcsc_send_apdu (int slot, unsigned char *apdu, size_t apdulen,
       send_pci.protocol = PCSC_PROTOCOL_T0;
   send_pci.pci_len = sizeof send_pci;
   recv_len = *buflen;
+  /* Release the CPU during the transfer so that commands for cards
+     in other readers can run meanwhile.  */
+#ifdef USE_NPTH
+  npth_unprotect ();
+#endif
   err = pcsc_transmit (reader_table[slot].pcsc.card,
                        &send_pci, apdu, apdulen,
                        NULL, buffer, &recv_len);
+#ifdef USE_NPTH
+  npth_protect ();
+#endif
   *buflen = recv_len;
   if (err)
     log_error ("pcsc_transmit failed: %s (0x%lx)\n",
@@ -782,8 +801,14 @@ control_pcsc (int slot, pcsc_dword_t ioctl_code,
 {
   long err;
 
+#ifdef USE_NPTH
+  npth_unprotect ();
+#endif
   err = pcsc_control (reader_table[slot].pcsc.card, ioctl_code,
                       cntlbuf, len, buffer, buflen? *buflen:0, buflen);
+#ifdef USE_NPTH
+  npth_protect ();
+#endif
   if (err)
     {
       log_error ("pcsc_control failed: %s (0x%lx)\n",
@@ -795,6 +820,171 @@ control_pcsc (int slot, pcsc_dword_t ioctl_code,
 }
 
 
+#ifdef USE_NPTH
+/* State of the thread which waits for status changes of the PC/SC
+   readers.  With that thread running there is no need to poll the
+   readers.  The thread uses its own context because pcsc-lite locks
+   the context for the duration of a pcsc_get_status_change.  */
+static struct
+{
+  unsigned int running:1;  /* The thread is running.  */
+  unsigned int update:1;   /* The set of open readers has changed.  */
+  unsigned int stop:1;     /* The thread shall terminate.  */
+  HANDLE context;
+} pcsc_monitor;
+
+
+/* Set the polling requirement of all open PC/SC readers to VALUE.  */
+static void
+pcsc_monitor_set_polling (int value)
+{
+  int slot;
+
+  for (slot = 0; slot < MAX_READER; slot++)
+    if (reader_table[slot].used
+        && reader_table[slot].get_status_reader == pcsc_get_status)
+      reader_table[slot].require_get_status = value;
+}
+
+
+static void *
+pcsc_monitor_thread (void *arg)
+{
+  struct pcsc_readerstate_s rdrstates[MAX_READER];
+  char *rdrnames[MAX_READER];
+  int nrdr = 0;
+  int slot, i, changed;
+  long err = 0;
+
+  (void)arg;
+
+  while (!pcsc_monitor.stop)
+    {
+      if (pcsc_monitor.update)
+        {
+          /* Take a copy of the names because a reader may be closed
+             while we wait.  A reader is polled until we watch it.  */
+          pcsc_monitor.update = 0;
+          for (i = 0; i < nrdr; i++)
+            xfree (rdrnames[i]);
+          nrdr = 0;
+          for (slot = 0; slot < MAX_READER; slot++)
+            if (reader_table[slot].used
+                && reader_table[slot].get_status_reader == pcsc_get_status
+                && reader_table[slot].rdrname
+                && (rdrnames[nrdr] = xtrystrdup (reader_table[slot].rdrname)))
+              {
+                memset (&rdrstates[nrdr], 0, sizeof *rdrstates);
+                rdrstates[nrdr].reader = rdrnames[nrdr];
+                rdrstates[nrdr].current_state = PCSC_STATE_UNAWARE;
+                reader_table[slot].require_get_status = 0;
+                nrdr++;
+              }
+          if (!nrdr)
+            break;
+        }
+
+      npth_unprotect ();
+      err = pcsc_get_status_change (pcsc_monitor.context, PCSC_INFINITE,
+                                    rdrstates, nrdr);
+      npth_protect ();
+      if (err == PCSC_E_CANCELLED || err == PCSC_E_TIMEOUT)
+        continue;
+      if (err)
+        {
+          log_error ("pcsc_get_status_change failed: %s (0x%lx)\n",
+                     pcsc_error_string (err), err);
+          break;
+        }
+
+      changed = 0;
+      for (i = 0; i < nrdr; i++)
+        if ((rdrstates[i].event_state & PCSC_STATE_CHANGED))
+          {
+            /* The first result for a reader is its initial state.  */
+            if (rdrstates[i].current_state != PCSC_STATE_UNAWARE)
+              changed = 1;
+            rdrstates[i].current_state =
+              (rdrstates[i].event_state & ~PCSC_STATE_CHANGED);
+          }
+      if (changed)
+        {
+          if (DBG_READER)
+            log_debug ("pcsc monitor: status change detected\n");
+          scd_kick_the_loop ();
+        }
+    }
+
+  for (i = 0; i < nrdr; i++)
+    xfree (rdrnames[i]);
+  pcsc_release_context (pcsc_monitor.context);
+  pcsc_monitor.context = 0;
+  pcsc_monitor.running = 0;
+  if (err)
+    {
+      /* Fall back to polling.  */
+      pcsc_monitor_set_polling (1);
+      scd_kick_the_loop ();
+    }
+  return NULL;
+}
+#endif /*USE_NPTH*/
+
+
+/* Tell the status monitor that the set of open PC/SC readers has
+   changed.  The monitor is started with the first reader and stops
+   after the last one has been closed.  */
+static void
+pcsc_monitor_update (void)
+{
+#ifdef USE_NPTH
+  npth_attr_t tattr;
+  npth_t thread;
+  long err;
+  int rc;
+
+  if (!pcsc_cancel)
+    return;
+
+  pcsc_monitor.update = 1;
+  pcsc_monitor.stop = !pcsc.count;
+  if (pcsc_monitor.running)
+    {
+      /* Let the thread re-read the list of readers.  */
+      pcsc_cancel (pcsc_monitor.context);
+      return;
+    }
+  if (pcsc_monitor.stop)
+    return;
+
+  err = pcsc_establish_context (PCSC_SCOPE_SYSTEM, NULL, NULL,
+                                &pcsc_monitor.context);
+  if (err)
+    {
+      log_error ("pcsc_establish_context failed: %s (0x%lx)\n",
+                 pcsc_error_string (err), err);
+      return;
+    }
+
+  rc = npth_attr_init (&tattr);
+  if (!rc)
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+      rc = npth_create (&thread, &tattr, pcsc_monitor_thread, NULL);
+      npth_attr_destroy (&tattr);
+    }
+  if (rc)
+    {
+      log_error ("error spawning pcsc monitor: %s\n", strerror (rc));
+      pcsc_release_context (pcsc_monitor.context);
+      pcsc_monitor.context = 0;
+      return;
+    }
+  pcsc_monitor.running = 1;
+#endif /*USE_NPTH*/
+}
+
+
 static int
 close_pcsc_reader (int slot)
 {
@@ -808,6 +998,7 @@ close_pcsc_reader (int slot)
       for (i = 0; i < MAX_READER; i++)
         pcsc.rdrname[i] = NULL;
     }
+  pcsc_monitor_update ();
   return 0;
 }
 
@@ -824,6 +1015,7 @@ connect_pcsc_card (int slot)
     return SW_HOST_ALREADY_CONNECTED;
 
   reader_table[slot].atrlen = 0;
+  reader_table[slot].exlen_probed = 0;
   reader_table[slot].is_t0 = 0;
 
   err = pcsc_connect (pcsc.context,
@@ -1112,6 +1304,7 @@ pcsc_init (void)
       pcsc_end_transaction   = dlsym (handle, "SCardEndTransaction");
       pcsc_transmit          = dlsym (handle, "SCardTransmit");
       pcsc_set_timeout       = dlsym (handle, "SCardSetTimeout");
+      pcsc_cancel            = dlsym (handle, "SCardCancel");
       pcsc_control           = dlsym (handle, "SCardControl");
 
       if (!pcsc_establish_context
@@ -1129,7 +1322,8 @@ pcsc_init (void)
           /* || !pcsc_set_timeout */)
         {
           /* Note that set_timeout is currently not used and also not
-             available under Windows. */
+             available under Windows.  Without cancel we poll for
+             status changes. */
           log_error ("apdu_open_reader: invalid PC/SC driver "
                      "(%d%d%d%d%d%d%d%d%d%d%d%d%d)\n",
                      !!pcsc_establish_context,
@@ -1186,6 +1380,7 @@ open_pcsc_reader (const char *rdrname)
 
   reader_table[slot].pcsc.card = 0;
   reader_table[slot].atrlen = 0;
+  reader_table[slot].exlen_probed = 0;
 
   reader_table[slot].connect_card = connect_pcsc_card;
   reader_table[slot].disconnect_card = disconnect_pcsc_card;
@@ -1196,6 +1391,7 @@ open_pcsc_reader (const char *rdrname)
   reader_table[slot].dump_status_reader = dump_pcsc_reader_status;
 
   pcsc.count++;
+  pcsc_monitor_update ();
   dump_reader_status (slot);
   unlock_slot (slot);
   return slot;
@@ -1439,6 +1635,7 @@ reset_ccid_reader (int slot)
   /* If the reset was successful, update the ATR. */
   assert (sizeof slotp->atr >= sizeof atr);
   slotp->atrlen = atrlen;
+  slotp->exlen_probed = 0;
   memcpy (slotp->atr, atr, atrlen);
   dump_reader_status (slot);
   return 0;
@@ -1607,6 +1804,7 @@ open_ccid_reader (struct dev_list *dl)
      flag.  */
   reader_table[slot].is_t0 = 0;
   reader_table[slot].require_get_status = require_get_status;
+  reader_table[slot].no_exlen = !ccid_extended_apdu_p (slotp->ccid.handle);
 
   dump_reader_status (slot);
   unlock_slot (slot);
@@ -2012,17 +2210,16 @@ apdu_dev_list_start (const char *portstr, struct dev_list **l_p)
               break;
             }
 
+          if (dl->idx_max >= MAX_READER)
+            {
+              log_error ("too many readers from pcsc_list_readers\n");
+              break;
+            }
           log_info ("detected reader '%s'\n", p);
           pcsc.rdrname[dl->idx_max] = p;
           nreader -= n + 1;
           p += n + 1;
           dl->idx_max++;
-          if (dl->idx_max > MAX_READER)
-            {
-              log_error ("too many readers from pcsc_list_readers\n");
-              dl->idx_max--;
-              break;
-            }
         }
     }
 
@@ -2381,6 +2578,18 @@ apdu_connect (int slot)
 }
 
 
+/* Return true if status changes of the reader at SLOT are only
+   detected by calling apdu_get_status.  This may change while the
+   reader is open.  */
+int
+apdu_require_get_status (int slot)
+{
+  if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used)
+    return 0;
+  return reader_table[slot].require_get_status;
+}
+
+
 int
 apdu_disconnect (int slot)
 {
@@ -2566,7 +2775,10 @@ apdu_get_status_internal (int slot, int hang, unsigned int *status, int on_wire)
   if (sw)
     {
       if (on_wire)
-        reader_table[slot].atrlen = 0;
+        {
+          reader_table[slot].atrlen = 0;
+          reader_table[slot].exlen_probed = 0;
+        }
       s = 0;
     }
 
@@ -2692,24 +2904,36 @@ send_apdu (int slot, unsigned char *apdu, size_t apdulen,
 }
 
 
-/* Core APDU transceiver function. Parameters are described at
-   apdu_send_le with the exception of PININFO which indicates pinpad
-   related operations if not NULL.  If EXTENDED_MODE is not 0
-   command chaining or extended length will be used according to these
-   values:
-       n < 0 := Use command chaining with the data part limited to -n
-                in each chunk.  If -1 is used a default value is used.
-      n == 0 := No extended mode or command chaining.
-      n == 1 := Use extended length for input and output without a
-                length limit.
-       n > 1 := Use extended length with up to N bytes.
+/* Return true if extended length shall be used for reading data
+   from the card in SLOT even if the caller did not ask for it.  This
+   is the case if the card announces support for extended Lc and Le
+   fields in its ATR and the reader is able to transfer such APDUs.
+   The result is cached until the ATR changes.  */
+static int
+exlen_auto_p (int slot)
+{
+  reader_table_t slotp = reader_table + slot;
 
-*/
+  if (!slotp->exlen_probed)
+    {
+      slotp->exlen_auto = (!slotp->is_t0 && !slotp->no_exlen
+                           && slotp->atrlen
+                           && atr_ext_lc_le_p (slotp->atr, slotp->atrlen));
+      slotp->exlen_probed = 1;
+      if (DBG_CARD_IO)
+        log_debug ("slot %d: extended length for reading is %s\n",
+                   slot, slotp->exlen_auto? "enabled":"disabled");
+    }
+  return slotp->exlen_auto;
+}
+
+
+/* The actual APDU transceiver function of send_le.  */
 static int
-send_le (int slot, int class, int ins, int p0, int p1,
-         int lc, const char *data, int le,
-         unsigned char **retbuf, size_t *retbuflen,
-         pininfo_t *pininfo, int extended_mode)
+send_le_core (int slot, int class, int ins, int p0, int p1,
+              int lc, const char *data, int le,
+              unsigned char **retbuf, size_t *retbuflen,
+              pininfo_t *pininfo, int extended_mode)
 {
 #define SHORT_RESULT_BUFFER_SIZE 258
   /* We allocate 8 extra bytes as a safety margin towards a driver bug.  */
@@ -3049,6 +3273,63 @@ send_le (int slot, int class, int ins, int p0, int p1,
   return sw;
 }
 
+/* Core APDU transceiver function. Parameters are described at
+   apdu_send_le with the exception of PININFO which indicates pinpad
+   related operations if not NULL.  If EXTENDED_MODE is not 0
+   command chaining or extended length will be used according to these
+   values:
+       n < 0 := Use command chaining with the data part limited to -n
+                in each chunk.  If -1 is used a default value is used.
+      n == 0 := No extended mode or command chaining.
+      n == 1 := Use extended length for input and output without a
+                length limit.
+       n > 1 := Use extended length with up to N bytes.
+
+   Commands reading data with a short Le are sent with an extended Le
+   if the card and the reader support this; this avoids a GET
+   RESPONSE exchange for each 256 bytes.  If the card rejects the
+   extended APDU the short APDU is sent and extended length is not
+   used again for that card.
+*/
+static int
+send_le (int slot, int class, int ins, int p0, int p1,
+         int lc, const char *data, int le,
+         unsigned char **retbuf, size_t *retbuflen,
+         pininfo_t *pininfo, int extended_mode)
+{
+  int sw;
+
+  if (!extended_mode && retbuf && !pininfo
+      && (ins == 0xB0 || ins == 0xB2 || ins == 0xCA || ins == 0xCB)
+      && lc <= 255 && (le == 0 || (le >= 256 && le <= 65535))
+      && slot >= 0 && slot < MAX_READER && reader_table[slot].used
+      && exlen_auto_p (slot))
+    {
+      sw = send_le_core (slot, class, ins, p0, p1, lc, data,
+                         (le == 0 || le == 256)? 65534 : le,
+                         retbuf, retbuflen, NULL, 1);
+      if (sw != SW_WRONG_LENGTH && sw != SW_HOST_NOT_SUPPORTED
+          && sw != SW_HOST_INV_VALUE)
+        return sw;
+
+      if (le > 256)
+        return sw;  /* Can't be done with a short APDU.  */
+      sw = send_le_core (slot, class, ins, p0, p1, lc, data, le,
+                         retbuf, retbuflen, NULL, 0);
+      if (sw == SW_SUCCESS || (sw & 0xff00) == SW_MORE_DATA)
+        {
+          log_info ("slot %d: extended length rejected; not used anymore\n",
+                    slot);
+          reader_table[slot].exlen_auto = 0;
+        }
+      return sw;
+    }
+
+  return send_le_core (slot, class, ins, p0, p1, lc, data, le,
+                       retbuf, retbuflen, pininfo, extended_mode);
+}
+
+
 /* Send an APDU to the card in SLOT.  The APDU is created from all
    given parameters: CLASS, INS, P0, P1, LC, DATA, LE.  A value of -1
    for LC won't sent this field and the data field; in this case DATA
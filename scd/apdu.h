@@ -115,6 +115,7 @@ const char *apdu_strerror (int rc);
 /* These APDU functions return status words. */
 
 int apdu_connect (int slot);
+int apdu_require_get_status (int slot);
 int apdu_disconnect (int slot);
 
 int apdu_set_progress_cb (int slot, gcry_handler_progress_t cb, void *cb_arg);
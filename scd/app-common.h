@@ -78,6 +78,7 @@ typedef enum
 struct card_ctx_s;
 struct app_ctx_s;
 struct app_local_s;  /* Defined by all app-*.c.  */
+struct card_cache_item_s;  /* Defined in app.c.  */
 
 
 typedef struct card_ctx_s *card_t;
@@ -113,6 +114,9 @@ struct card_ctx_s {
    * put the active app at the head of the list.  */
   app_t app;
 
+  /* Cached responses for this card; see app.c.  */
+  struct card_cache_item_s *cache;
+
   /* Various flags.  */
   unsigned int reset_requested:1;
   unsigned int periodical_check_needed:1;
@@ -232,6 +236,7 @@ gpg_error_t app_send_card_list (ctrl_t ctrl);
 gpg_error_t app_send_active_apps (card_t card, ctrl_t ctrl);
 char *card_get_serialno (card_t card);
 char *app_get_serialno (app_t app);
+char *app_get_cache_fname (app_t app, const char *suffix, int create_dir);
 
 void app_dump_state (void);
 void application_notify_card_reset (int slot);
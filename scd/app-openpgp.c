@@ -146,6 +146,32 @@ typedef enum
 rsa_key_format_t;
 
 
+/* The DOs which are also stored in the persistent cache.  These are
+ * not sensitive and are changed only rarely.  The persistent cache is
+ * a file named by app_get_cache_fname.  It is only used if the Application Related Data (0x6E)
+ * stored along with the DOs matches the one read from the card; that
+ * DO covers the fingerprints, generation times and key attributes.
+ * Other changes are detected only if they have been done by us or
+ * after PCACHE_MAX_AGE seconds.  The file format is
+ *
+ *   - b4   Magic 'OPGc'
+ *   - byte Version number (1)
+ *   - b3   RFU
+ *   - u32  Creation time
+ *   - n times:
+ *     - u16  Tag; the first one is 0x6E.
+ *     - u32  Length of the value
+ *     - bN   The value
+ *
+ * All integers are stored in network byte order.  */
+static int const persistent_dos[] =
+  { 0x005E, 0x5F50, 0x0065, 0x00F9, 0x7F21 };
+
+#define PCACHE_MAGIC    "OPGc"
+#define PCACHE_VERSION  1
+#define PCACHE_MAX_AGE  (24*60*60)
+
+
 /* One cache item for DOs.  */
 struct cache_s {
   struct cache_s *next;
@@ -339,6 +365,36 @@ wipe_and_free_string (char *p)
 }
 
 
+static void store_persistent_cache (app_t app);
+static void remove_persistent_cache (app_t app);
+
+
+/* Return true if TAG is stored in the persistent cache.  */
+static int
+is_persistent_do (int tag)
+{
+  int i;
+
+  for (i=0; i < DIM (persistent_dos); i++)
+    if (persistent_dos[i] == tag)
+      return 1;
+  return 0;
+}
+
+
+/* Return the cache item for TAG or NULL.  */
+static struct cache_s *
+find_cache_item (app_t app, int tag)
+{
+  struct cache_s *c;
+
+  for (c=app->app_local->cache; c; c = c->next)
+    if (c->tag == tag)
+      return c;
+  return NULL;
+}
+
+
 /* Wrapper around iso7816_get_data which first tries to get the data
    from the cache.  With GET_IMMEDIATE passed as true, the cache is
    bypassed.  With TRY_EXTLEN extended lengths APDUs are use if
@@ -424,6 +480,8 @@ get_cached_data (app_t app, int tag,
       c->tag = tag;
       c->next = app->app_local->cache;
       app->app_local->cache = c;
+      if (is_persistent_do (tag))
+        store_persistent_cache (app);
     }
 
   return 0;
@@ -439,6 +497,9 @@ flush_cache_item (app_t app, int tag)
   if (!app->app_local)
     return;
 
+  if (is_persistent_do (tag))
+    remove_persistent_cache (app);
+
   for (c=app->app_local->cache, cprev=NULL; c ; cprev=c, c = c->next)
     if (c->tag == tag)
       {
@@ -493,6 +554,198 @@ flush_cache (app_t app)
 }
 
 
+/* Remove the persistent cache of APP.  */
+static void
+remove_persistent_cache (app_t app)
+{
+  char *fname;
+
+  fname = app_get_cache_fname (app, NULL, 0);
+  if (fname && !gnupg_remove (fname) && DBG_CACHE)
+    log_debug ("removed DO cache '%s'\n", fname);
+  xfree (fname);
+}
+
+
+/* Write one item of the persistent cache to FP.  */
+static void
+write_pcache_item (estream_t fp, int tag, const void *data, size_t datalen)
+{
+  unsigned char hdr[6];
+
+  hdr[0] = tag >> 8;
+  hdr[1] = tag;
+  ulongtobuf (hdr+2, datalen);
+  es_fwrite (hdr, 6, 1, fp);
+  if (datalen)
+    es_fwrite (data, datalen, 1, fp);
+}
+
+
+/* Write the persistent DOs found in the cache of APP to the
+   persistent cache.  */
+static void
+store_persistent_cache (app_t app)
+{
+  struct cache_s *aidc, *c;
+  unsigned char hdr[12];
+  char *fname, *tmpfname = NULL;
+  estream_t fp = NULL;
+  gpg_error_t err;
+
+  aidc = find_cache_item (app, 0x006E);
+  if (!aidc)
+    return;  /* We can't validate the cache without the data.  */
+
+  fname = app_get_cache_fname (app, NULL, 1);
+  if (!fname)
+    return;
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    goto leave;
+  fp = es_fopen (tmpfname, "wb");
+  if (!fp)
+    goto leave;
+
+  memcpy (hdr, PCACHE_MAGIC, 4);
+  hdr[4] = PCACHE_VERSION;
+  hdr[5] = hdr[6] = hdr[7] = 0;
+  ulongtobuf (hdr+8, (unsigned long)gnupg_get_time ());
+  es_fwrite (hdr, sizeof hdr, 1, fp);
+  write_pcache_item (fp, aidc->tag, aidc->data, aidc->length);
+  for (c=app->app_local->cache; c; c = c->next)
+    if (is_persistent_do (c->tag))
+      write_pcache_item (fp, c->tag, c->data, c->length);
+
+  if (es_ferror (fp))
+    {
+      es_fclose (fp);
+      fp = NULL;
+      goto leave;
+    }
+  if (es_fclose (fp))
+    {
+      fp = NULL;
+      goto leave;
+    }
+  fp = NULL;
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (!err)
+    {
+      if (DBG_CACHE)
+        log_debug ("stored DO cache '%s'\n", fname);
+      xfree (tmpfname);
+      tmpfname = NULL;
+    }
+
+ leave:
+  if (tmpfname)
+    {
+      log_info ("error writing DO cache '%s': %s\n",
+                fname, gpg_strerror (gpg_error_from_syserror ()));
+      es_fclose (fp);
+      gnupg_remove (tmpfname);
+      xfree (tmpfname);
+    }
+  xfree (fname);
+}
+
+
+/* Load the persistent cache of APP into its cache if it is still
+   valid.  */
+static void
+load_persistent_cache (app_t app)
+{
+  char *fname;
+  estream_t fp = NULL;
+  unsigned char hdr[12];
+  unsigned char *buffer = NULL;
+  size_t buflen;
+  struct cache_s *aidc, *c;
+  unsigned long created;
+  int tag, first = 1;
+  size_t len;
+
+  /* Make sure that the Application Related Data is in the cache.  */
+  if (!find_cache_item (app, 0x006E))
+    {
+      if (get_cached_data (app, 0x006E, &buffer, &buflen, 0, 0))
+        return;
+      xfree (buffer);
+    }
+  aidc = find_cache_item (app, 0x006E);
+  if (!aidc)
+    return;
+
+  fname = app_get_cache_fname (app, NULL, 0);
+  if (!fname)
+    return;
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    goto leave;
+
+  if (es_read (fp, hdr, sizeof hdr, &len) || len != sizeof hdr
+      || memcmp (hdr, PCACHE_MAGIC, 4) || hdr[4] != PCACHE_VERSION)
+    goto invalid;
+  created = buf32_to_ulong (hdr+8);
+  if (created > (unsigned long)gnupg_get_time ()
+      || (unsigned long)gnupg_get_time () - created > PCACHE_MAX_AGE)
+    goto invalid;
+
+  while (!es_read (fp, hdr, 6, &len) && len == 6)
+    {
+      tag = (hdr[0] << 8) | hdr[1];
+      buflen = buf32_to_size_t (hdr+2);
+      if (buflen > 65535)
+        goto invalid;
+      c = xtrymalloc (sizeof *c + buflen);
+      if (!c)
+        goto leave;
+      if (buflen && (es_read (fp, c->data, buflen, &len) || len != buflen))
+        {
+          xfree (c);
+          goto invalid;
+        }
+      c->tag = tag;
+      c->length = buflen;
+
+      if (first)
+        {
+          first = 0;
+          /* The stored data must match the card.  */
+          if (tag != 0x006E || c->length != aidc->length
+              || memcmp (c->data, aidc->data, c->length))
+            {
+              xfree (c);
+              goto invalid;
+            }
+          xfree (c);
+        }
+      else if (!is_persistent_do (tag) || find_cache_item (app, tag))
+        xfree (c);
+      else
+        {
+          c->next = app->app_local->cache;
+          app->app_local->cache = c;
+          if (DBG_CACHE)
+            log_debug ("DO %04X taken from the DO cache\n", tag);
+        }
+    }
+  goto leave;
+
+ invalid:
+  if (DBG_CACHE)
+    log_debug ("DO cache '%s' is not valid\n", fname);
+  es_fclose (fp);
+  fp = NULL;
+  gnupg_remove (fname);
+
+ leave:
+  es_fclose (fp);
+  xfree (fname);
+}
+
+
 /* Get the DO identified by TAG from the card in SLOT and return a
    buffer with its content in RESULT and NBYTES.  The return value is
    NULL if not found or a pointer which must be used to release the
@@ -5559,32 +5812,14 @@ parse_historical (struct app_local_s *apploc,
 static const char *
 ecc_curve (unsigned char *buf, size_t buflen)
 {
-  gcry_mpi_t oid;
-  char *oidstr;
-  const char *result;
-  unsigned char *oidbuf;
+  unsigned char oidbuf[256];
 
-  oidbuf = xtrymalloc (buflen + 1);
-  if (!oidbuf)
+  if (buflen >= sizeof oidbuf)
     return NULL;
 
   memcpy (oidbuf+1, buf, buflen);
   oidbuf[0] = buflen;
-  oid = gcry_mpi_set_opaque (NULL, oidbuf, (buflen+1) * 8);
-  if (!oid)
-    {
-      xfree (oidbuf);
-      return NULL;
-    }
-
-  oidstr = openpgp_oid_to_str (oid);
-  gcry_mpi_release (oid);
-  if (!oidstr)
-    return NULL;
-
-  result = openpgp_oid_to_curve (oidstr, 1);
-  xfree (oidstr);
-  return result;
+  return openpgp_oidbuf_to_curve (oidbuf, buflen+1, 1);
 }
 
 
@@ -5881,6 +6116,7 @@ app_select_openpgp (app_t app)
         /* It must be: 03 81 01 20 */
         app->app_local->extcap.has_button = 1;
 
+      load_persistent_cache (app);
       parse_login_data (app);
 
       if (opt.verbose)
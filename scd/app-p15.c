@@ -39,6 +39,7 @@
 
 #include "iso7816.h"
 #include "../common/tlv.h"
+#include "../common/host2net.h"
 #include "apdu.h" /* fixme: we should move the card detection to a
                      separate file */
 
@@ -271,6 +272,34 @@ struct aodf_object_s
 typedef struct aodf_object_s *aodf_object_t;
 
 
+/* The persistent cache of the directory EFs.  The ODF, CDFs, PrKDF
+ * and AODF are stored in a file named by app_get_cache_fname.  The
+ * format is
+ *
+ *   - b4   Magic 'P15c'
+ *   - byte Version number (1)
+ *   - b3   RFU
+ *   - u32  Creation time
+ *   - n times:
+ *     - u16  FID; the first one is EF(TokenInfo) 0x5032.
+ *     - u32  Length of the content
+ *     - bN   The content of the EF
+ *
+ * All integers are stored in network byte order.  */
+#define DIRCACHE_MAGIC    "P15c"
+#define DIRCACHE_VERSION  1
+#define DIRCACHE_MAX_AGE  (24*60*60)
+
+/* One directory EF in the cache.  */
+struct dircache_s
+{
+  struct dircache_s *next;
+  unsigned short fid;
+  size_t length;
+  unsigned char data[1];
+};
+
+
 /* Context local to this application. */
 struct app_local_s
 {
@@ -303,6 +332,15 @@ struct app_local_s
   unsigned char *serialno;
   size_t serialnolen;
 
+  /* The content of EF(TokenInfo) or NULL.  Malloced.  */
+  unsigned char *tokeninfo;
+  size_t tokeninfolen;
+
+  /* The directory EFs read by read_p15_info and whether one of them
+   * has not been taken from the persistent cache.  */
+  struct dircache_s *dircache;
+  int dircache_dirty;
+
   /* Information on all certificates. */
   cdf_object_t certificate_info;
   /* Information on all trusted certificates. */
@@ -379,6 +417,22 @@ release_aodflist (aodf_object_t a)
 }
 
 
+/* Release the list of cached directory EFs of APP.  */
+static void
+release_dircache (app_t app)
+{
+  struct dircache_s *d, *d2;
+
+  for (d = app->app_local->dircache; d; d = d2)
+    {
+      d2 = d->next;
+      xfree (d);
+    }
+  app->app_local->dircache = NULL;
+  app->app_local->dircache_dirty = 0;
+}
+
+
 /* Release all local resources.  */
 static void
 do_deinit (app_t app)
@@ -390,7 +444,9 @@ do_deinit (app_t app)
       release_cdflist (app->app_local->useful_certificate_info);
       release_prkdflist (app->app_local->private_key_info);
       release_aodflist (app->app_local->auth_object_info);
+      release_dircache (app);
       xfree (app->app_local->serialno);
+      xfree (app->app_local->tokeninfo);
       xfree (app->app_local);
       app->app_local = NULL;
     }
@@ -426,6 +482,217 @@ select_and_read_binary (int slot, unsigned short efid, const char *efid_desc,
 }
 
 
+/* Return the name of the persistent cache for the directory EFs of
+   APP or NULL on error.  */
+static char *
+dircache_fname (app_t app, int create_dir)
+{
+  char suffix[20];
+
+  snprintf (suffix, sizeof suffix, "p15-%04X",
+            (unsigned int)(app->app_local->home_df & 0xffff));
+  return app_get_cache_fname (app, suffix, create_dir);
+}
+
+
+/* Add the content (DATA,DATALEN) of the EF FID to the list of cached
+   directory EFs.  */
+static gpg_error_t
+add_dircache_item (app_t app, unsigned short fid,
+                   const unsigned char *data, size_t datalen)
+{
+  struct dircache_s *d;
+
+  d = xtrymalloc (sizeof *d + datalen);
+  if (!d)
+    return gpg_error_from_syserror ();
+  d->fid = fid;
+  d->length = datalen;
+  if (datalen)
+    memcpy (d->data, data, datalen);
+  d->next = app->app_local->dircache;
+  app->app_local->dircache = d;
+  return 0;
+}
+
+
+/* Load the persistent cache of the directory EFs of APP.  The cache
+   is only used if the stored EF(TokenInfo) matches the current one;
+   if the card provides a lastUpdate this is how changes are
+   detected.  The cache is also dropped after DIRCACHE_MAX_AGE
+   seconds.  */
+static void
+load_dircache (app_t app)
+{
+  char *fname;
+  estream_t fp = NULL;
+  unsigned char hdr[12];
+  unsigned char *buffer = NULL;
+  size_t buflen, len;
+  unsigned long created;
+  unsigned short fid;
+  int first = 1;
+
+  if (!app->app_local->tokeninfo)
+    return;
+  fname = dircache_fname (app, 0);
+  if (!fname)
+    return;
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    goto leave;
+
+  if (es_read (fp, hdr, sizeof hdr, &len) || len != sizeof hdr
+      || memcmp (hdr, DIRCACHE_MAGIC, 4) || hdr[4] != DIRCACHE_VERSION)
+    goto invalid;
+  created = buf32_to_ulong (hdr+8);
+  if (created > (unsigned long)gnupg_get_time ()
+      || (unsigned long)gnupg_get_time () - created > DIRCACHE_MAX_AGE)
+    goto invalid;
+
+  while (!es_read (fp, hdr, 6, &len) && len == 6)
+    {
+      fid = (hdr[0] << 8) | hdr[1];
+      buflen = buf32_to_size_t (hdr+2);
+      if (buflen > 65535)
+        goto invalid;
+      xfree (buffer);
+      buffer = xtrymalloc (buflen + 1);
+      if (!buffer)
+        goto invalid;
+      if (buflen && (es_read (fp, buffer, buflen, &len) || len != buflen))
+        goto invalid;
+      if (first)
+        {
+          first = 0;
+          if (fid != 0x5032 || buflen != app->app_local->tokeninfolen
+              || memcmp (buffer, app->app_local->tokeninfo, buflen))
+            goto invalid;
+        }
+      else if (add_dircache_item (app, fid, buffer, buflen))
+        goto invalid;
+    }
+  if (opt.verbose)
+    log_info ("using cached PKCS#15 directory '%s'\n", fname);
+  goto leave;
+
+ invalid:
+  if (DBG_CACHE)
+    log_debug ("PKCS#15 directory cache '%s' is not valid\n", fname);
+  release_dircache (app);
+  es_fclose (fp);
+  fp = NULL;
+  gnupg_remove (fname);
+
+ leave:
+  xfree (buffer);
+  es_fclose (fp);
+  xfree (fname);
+}
+
+
+/* Write one item of the directory cache to FP.  */
+static void
+write_dircache_item (estream_t fp, unsigned short fid,
+                     const void *data, size_t datalen)
+{
+  unsigned char hdr[6];
+
+  hdr[0] = fid >> 8;
+  hdr[1] = fid;
+  ulongtobuf (hdr+2, datalen);
+  es_fwrite (hdr, 6, 1, fp);
+  if (datalen)
+    es_fwrite (data, datalen, 1, fp);
+}
+
+
+/* Store the directory EFs of APP in the persistent cache.  */
+static void
+store_dircache (app_t app)
+{
+  struct dircache_s *d;
+  unsigned char hdr[12];
+  char *fname, *tmpfname = NULL;
+  estream_t fp = NULL;
+
+  if (!app->app_local->tokeninfo)
+    return;
+  fname = dircache_fname (app, 1);
+  if (!fname)
+    return;
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    goto leave;
+  fp = es_fopen (tmpfname, "wb");
+  if (!fp)
+    goto leave;
+
+  memcpy (hdr, DIRCACHE_MAGIC, 4);
+  hdr[4] = DIRCACHE_VERSION;
+  hdr[5] = hdr[6] = hdr[7] = 0;
+  ulongtobuf (hdr+8, (unsigned long)gnupg_get_time ());
+  es_fwrite (hdr, sizeof hdr, 1, fp);
+  write_dircache_item (fp, 0x5032, app->app_local->tokeninfo,
+                       app->app_local->tokeninfolen);
+  for (d = app->app_local->dircache; d; d = d->next)
+    write_dircache_item (fp, d->fid, d->data, d->length);
+
+  if (es_ferror (fp))
+    goto leave;
+  if (es_fclose (fp))
+    {
+      fp = NULL;
+      goto leave;
+    }
+  fp = NULL;
+  if (!gnupg_rename_file (tmpfname, fname, NULL))
+    {
+      xfree (tmpfname);
+      tmpfname = NULL;
+    }
+
+ leave:
+  if (tmpfname)
+    {
+      log_info ("error writing PKCS#15 directory cache '%s': %s\n",
+                fname, gpg_strerror (gpg_error_from_syserror ()));
+      es_fclose (fp);
+      gnupg_remove (tmpfname);
+      xfree (tmpfname);
+    }
+  xfree (fname);
+}
+
+
+/* Read the directory EF with FID like select_and_read_binary but take
+   it from the cache if possible.  New EFs are added to the cache.  */
+static gpg_error_t
+read_dir_ef (app_t app, unsigned short fid, const char *efid_desc,
+             unsigned char **buffer, size_t *buflen)
+{
+  gpg_error_t err;
+  struct dircache_s *d;
+
+  for (d = app->app_local->dircache; d; d = d->next)
+    if (d->fid == fid)
+      {
+        *buffer = xtrymalloc (d->length + 1);
+        if (!*buffer)
+          return gpg_error_from_syserror ();
+        memcpy (*buffer, d->data, d->length);
+        *buflen = d->length;
+        return 0;
+      }
+
+  err = select_and_read_binary (app_get_slot (app), fid, efid_desc,
+                                buffer, buflen);
+  if (!err && !add_dircache_item (app, fid, *buffer, *buflen))
+    app->app_local->dircache_dirty = 1;
+  return err;
+}
+
+
 /* This function calls select file to read a file using a complete
    path which may or may not start at the master file (MF). */
 static gpg_error_t
@@ -612,8 +879,7 @@ read_ef_odf (app_t app, unsigned short odf_fid)
   unsigned short value;
   size_t offset;
 
-  err = select_and_read_binary (app_get_slot (app), odf_fid, "ODF",
-                                &buffer, &buflen);
+  err = read_dir_ef (app, odf_fid, "ODF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -827,8 +1093,7 @@ read_ef_prkdf (app_t app, unsigned short fid, prkdf_object_t *result)
   if (!fid)
     return gpg_error (GPG_ERR_NO_DATA); /* No private keys. */
 
-  err = select_and_read_binary (app_get_slot (app), fid, "PrKDF",
-                                &buffer, &buflen);
+  err = read_dir_ef (app, fid, "PrKDF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -1284,8 +1549,7 @@ read_ef_cdf (app_t app, unsigned short fid, cdf_object_t *result)
   if (!fid)
     return gpg_error (GPG_ERR_NO_DATA); /* No certificates. */
 
-  err = select_and_read_binary (app_get_slot (app), fid, "CDF",
-                                &buffer, &buflen);
+  err = read_dir_ef (app, fid, "CDF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -1558,8 +1822,7 @@ read_ef_aodf (app_t app, unsigned short fid, aodf_object_t *result)
   if (!fid)
     return gpg_error (GPG_ERR_NO_DATA); /* No authentication objects. */
 
-  err = select_and_read_binary (app_get_slot (app), fid, "AODF",
-                                &buffer, &buflen);
+  err = read_dir_ef (app, fid, "AODF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -2225,6 +2488,15 @@ read_ef_tokeninfo (app_t app)
   if (err)
     return err;
 
+  /* Keep a copy to validate the directory cache.  */
+  xfree (app->app_local->tokeninfo);
+  app->app_local->tokeninfo = xtrymalloc (buflen + 1);
+  if (app->app_local->tokeninfo)
+    {
+      memcpy (app->app_local->tokeninfo, buffer, buflen);
+      app->app_local->tokeninfolen = buflen;
+    }
+
   p = buffer;
   n = buflen;
 
@@ -2308,6 +2580,7 @@ read_p15_info (app_t app)
           if (err)
             return err;
         }
+      load_dircache (app);
     }
 
   /* Read the ODF so that we know the location of all directory
@@ -2350,6 +2623,9 @@ read_p15_info (app_t app)
   if (gpg_err_code (err) == GPG_ERR_NO_DATA)
     err = 0;
 
+  if (!err && app->app_local->dircache_dirty)
+    store_dircache (app);
+  release_dircache (app);
 
   return err;
 }
@@ -242,6 +242,31 @@ lock_card (card_t card, ctrl_t ctrl)
 }
 
 
+/* Same as lock_card but return GPG_ERR_EBUSY if another thread
+ * holds the lock.  */
+static gpg_error_t
+trylock_card (card_t card, ctrl_t ctrl)
+{
+  int rc;
+
+  rc = npth_mutex_trylock (&card->lock);
+  if (rc == EBUSY)
+    return gpg_error (GPG_ERR_EBUSY);
+  if (rc)
+    {
+      gpg_error_t err = gpg_error_from_errno (rc);
+      log_error ("failed to acquire CARD lock for %p: %s\n",
+                 card, gpg_strerror (err));
+      return err;
+    }
+
+  apdu_set_progress_cb (card->slot, print_progress_line, ctrl);
+  apdu_set_prompt_cb (card->slot, popup_prompt, ctrl);
+
+  return 0;
+}
+
+
 /* Release a lock on a card.  See lock_reader(). */
 static void
 unlock_card (card_t card)
@@ -258,6 +283,180 @@ unlock_card (card_t card)
 }
 
 
+/* Objects of a card which rarely change, like certificates, public
+ * keys and fingerprints, are cached so that they need to be read from
+ * the card only once.  Along with the data the status lines emitted
+ * by the application are stored so that they can be replayed.  The
+ * cache is part of the card object and thus bound to the card's
+ * serial number; it is flushed if the card has been removed or reset
+ * and by all commands which may modify the card.  Volatile items,
+ * like the LEARN output which shows counters, are also flushed by
+ * commands which use a key or verify a PIN.  The cache is accessed
+ * only while holding the card lock.  */
+struct card_cache_item_s
+{
+  struct card_cache_item_s *next;
+  unsigned int is_volatile:1;
+  unsigned char *data;      /* The data or NULL.  */
+  size_t datalen;
+  char *status;             /* The captured status lines or NULL.  */
+  size_t statuslen;
+  char key[1];              /* The request key.  */
+};
+typedef struct card_cache_item_s *card_cache_item_t;
+
+
+/* Release the items of CARD's cache.  If ONLY_VOLATILE is set only the
+ * volatile items are released.  */
+static void
+card_cache_flush (card_t card, int only_volatile)
+{
+  card_cache_item_t item, next, prev;
+
+  for (prev = NULL, item = card->cache; item; item = next)
+    {
+      next = item->next;
+      if (only_volatile && !item->is_volatile)
+        {
+          prev = item;
+          continue;
+        }
+      if (prev)
+        prev->next = next;
+      else
+        card->cache = next;
+      xfree (item->data);
+      es_free (item->status);
+      xfree (item);
+    }
+}
+
+
+/* Look up the response for the request KEY in CARD's cache.  If
+ * found, the status lines are sent to CTRL, a copy of the data is
+ * stored at R_DATA and R_DATALEN, and true is returned.  R_DATA and
+ * R_DATALEN may be NULL if the data is not needed.  */
+static int
+card_cache_replay (card_t card, ctrl_t ctrl, const char *key,
+                   unsigned char **r_data, size_t *r_datalen)
+{
+  card_cache_item_t item;
+  char *buffer, *line, *p, *args;
+
+  if (!key)
+    return 0;
+  for (item = card->cache; item; item = item->next)
+    if (!strcmp (item->key, key))
+      break;
+  if (!item)
+    return 0;
+
+  if (r_data)
+    {
+      *r_data = NULL;
+      if (r_datalen)
+        *r_datalen = 0;
+      if (item->data)
+        {
+          *r_data = xtrymalloc (item->datalen);
+          if (!*r_data)
+            return 0;
+          memcpy (*r_data, item->data, item->datalen);
+          if (r_datalen)
+            *r_datalen = item->datalen;
+        }
+    }
+
+  if (item->status && (buffer = xtrystrdup (item->status)))
+    {
+      for (line = buffer; *line; line = p)
+        {
+          if ((p = strchr (line, '\n')))
+            *p++ = 0;
+          else
+            p = line + strlen (line);
+          if ((args = strchr (line, ' ')))
+            *args++ = 0;
+          if (*line)
+            send_status_direct (ctrl, line, args? args : "");
+        }
+      xfree (buffer);
+    }
+
+  if (DBG_APP)
+    log_debug ("slot %d: using cached response for '%s'\n", card->slot, key);
+  return 1;
+}
+
+
+/* Start to capture the status lines written to CTRL.  Returns the
+ * stream used for capturing or NULL if the response shall not be
+ * cached.  */
+static estream_t
+card_cache_start (ctrl_t ctrl, const char *key)
+{
+  estream_t fp;
+
+  if (!key || !ctrl || ctrl->status_capture)
+    return NULL;
+  fp = es_fopenmem (0, "w+");
+  ctrl->status_capture = fp;
+  return fp;
+}
+
+
+/* Stop capturing status lines for CTRL and, if ERR is 0, store the
+ * response for KEY consisting of DATA and the lines captured in FP
+ * in CARD's cache.  FP is closed.  */
+static void
+card_cache_finish (card_t card, ctrl_t ctrl, estream_t fp, gpg_error_t err,
+                   const char *key, int is_volatile,
+                   const unsigned char *data, size_t datalen)
+{
+  card_cache_item_t item;
+  void *status = NULL;
+  size_t statuslen = 0;
+
+  if (!fp)
+    return;
+  ctrl->status_capture = NULL;
+  if (err || es_fputc (0, fp) == EOF)
+    {
+      es_fclose (fp);
+      return;
+    }
+  if (es_fclose_snatch (fp, &status, &statuslen))
+    return;
+
+  item = xtrycalloc (1, sizeof *item + strlen (key));
+  if (!item)
+    {
+      es_free (status);
+      return;
+    }
+  strcpy (item->key, key);
+  item->is_volatile = !!is_volatile;
+  if (statuslen > 1)
+    item->status = status;
+  else
+    es_free (status);
+  if (data && datalen)
+    {
+      item->data = xtrymalloc (datalen);
+      if (!item->data)
+        {
+          es_free (item->status);
+          xfree (item);
+          return;
+        }
+      memcpy (item->data, data, datalen);
+      item->datalen = datalen;
+    }
+  item->next = card->cache;
+  card->cache = item;
+}
+
+
 /* This function may be called to print information pertaining to the
  * current state of this module to the log. */
 void
@@ -370,6 +569,7 @@ card_reset (card_t card, ctrl_t ctrl, int send_reset)
         err = gpg_error (GPG_ERR_CARD_RESET);
 
       card->reset_requested = 1;
+      card_cache_flush (card, 0);
       unlock_card (card);
 
       scd_kick_the_loop ();
@@ -1019,6 +1219,7 @@ deallocate_card (card_t card)
       xfree (a);
     }
 
+  card_cache_flush (card, 0);
   xfree (card->serialno);
   unlock_card (card);
   xfree (card);
@@ -1147,6 +1348,47 @@ app_get_serialno (app_t app)
 }
 
 
+/* Return a malloced string with the name of a persistent cache file
+ * of APP or NULL on error.  The name is the serial number of the card
+ * followed by a dash and SUFFIX if that is not NULL.  The files are
+ * stored in the directory "card-cache.d" below the home directory
+ * which is created if CREATE_DIR is set.  */
+char *
+app_get_cache_fname (app_t app, const char *suffix, int create_dir)
+{
+  char *serial, *dname, *fname;
+
+  serial = app_get_serialno (app);
+  if (!serial)
+    return NULL;
+  dname = make_filename_try (gnupg_homedir (), "card-cache.d", NULL);
+  if (!dname)
+    {
+      xfree (serial);
+      return NULL;
+    }
+  if (create_dir && gnupg_mkdir (dname, "-rwx") && errno != EEXIST)
+    {
+      log_info ("can't create directory '%s': %s\n",
+                dname, gpg_strerror (gpg_error_from_syserror ()));
+      xfree (dname);
+      xfree (serial);
+      return NULL;
+    }
+  if (suffix)
+    {
+      char *tmp = strconcat (serial, "-", suffix, NULL);
+
+      xfree (serial);
+      serial = tmp;
+    }
+  fname = serial? make_filename_try (dname, serial, NULL) : NULL;
+  xfree (dname);
+  xfree (serial);
+  return fname;
+}
+
+
 /* Helper to run the reselect function.  */
 static gpg_error_t
 run_reselect (ctrl_t ctrl, card_t c, app_t a, app_t a_prev)
@@ -1309,6 +1551,8 @@ app_write_learn_status (card_t card, ctrl_t ctrl, unsigned int flags)
   gpg_error_t err, err2, tmperr;
   app_t app, last_app;
   int any_reselect = 0;
+  char *key = NULL;
+  estream_t capture = NULL;
 
   if (!card)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -1323,8 +1567,12 @@ app_write_learn_status (card_t card, ctrl_t ctrl, unsigned int flags)
     ;
   else if (!card->app->fnc.learn_status)
     err = gpg_error (GPG_ERR_UNSUPPORTED_OPERATION);
+  else if ((key = xtryasprintf ("%d/learn/%u", card->app->apptype, flags))
+           && card_cache_replay (card, ctrl, key, NULL, NULL))
+    ;
   else
     {
+      capture = card_cache_start (ctrl, key);
       err = write_learn_status_core (card, card->app, ctrl, flags);
       if (!err && card->app->fnc.reselect && (flags & APP_LEARN_FLAG_MULTI))
         {
@@ -1376,9 +1624,11 @@ app_write_learn_status (card_t card, ctrl_t ctrl, unsigned int flags)
                 }
             }
         }
+      card_cache_finish (card, ctrl, capture, err, key, 1, NULL, 0);
     }
 
   unlock_card (card);
+  xfree (key);
   return err;
 }
 
@@ -1392,6 +1642,8 @@ app_readcert (card_t card, ctrl_t ctrl, const char *certid,
               unsigned char **cert, size_t *certlen)
 {
   gpg_error_t err;
+  char *key = NULL;
+  estream_t capture;
 
   if (!card)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -1403,15 +1655,23 @@ app_readcert (card_t card, ctrl_t ctrl, const char *certid,
     ;
   else if (!card->app->fnc.readcert)
     err = gpg_error (GPG_ERR_UNSUPPORTED_OPERATION);
+  else if ((key = xtryasprintf ("%d/readcert/%s",
+                                card->app->apptype, certid))
+           && card_cache_replay (card, ctrl, key, cert, certlen))
+    ;
   else
     {
       if (DBG_APP)
         log_debug ("slot %d app %s: calling readcert(%s)\n",
                    card->slot, xstrapptype (card->app), certid);
+      capture = card_cache_start (ctrl, key);
       err = card->app->fnc.readcert (card->app, certid, cert, certlen);
+      card_cache_finish (card, ctrl, capture, err, key, 0,
+                         err? NULL : *cert, err? 0 : *certlen);
     }
 
   unlock_card (card);
+  xfree (key);
   return err;
 }
 
@@ -1429,6 +1689,8 @@ app_readkey (card_t card, ctrl_t ctrl, const char *keyid, unsigned int flags,
              unsigned char **pk, size_t *pklen)
 {
   gpg_error_t err;
+  char *key = NULL;
+  estream_t capture;
 
   if (pk)
     *pk = NULL;
@@ -1445,24 +1707,54 @@ app_readkey (card_t card, ctrl_t ctrl, const char *keyid, unsigned int flags,
     ;
   else if (!card->app->fnc.readkey)
     err = gpg_error (GPG_ERR_UNSUPPORTED_OPERATION);
+  else if ((key = xtryasprintf ("%d/readkey/%u/%d/%s", card->app->apptype,
+                                flags, !!pk, keyid))
+           && card_cache_replay (card, ctrl, key, pk, pklen))
+    ;
   else
     {
       if (DBG_APP)
         log_debug ("slot %d app %s: calling readkey(%s)\n",
                    card->slot, xstrapptype (card->app), keyid);
+      capture = card_cache_start (ctrl, key);
       err = card->app->fnc.readkey (card->app, ctrl, keyid, flags, pk, pklen);
+      card_cache_finish (card, ctrl, capture, err, key, 0,
+                         (err || !pk)? NULL : *pk,
+                         (err || !pk || !pklen)? 0 : *pklen);
     }
 
   unlock_card (card);
+  xfree (key);
   return err;
 }
 
 
+/* Return true if the value of the attribute NAME does not change
+ * unless the card is modified.  */
+static int
+is_cacheable_attr (const char *name)
+{
+  static const char *names[] = {
+    "KEY-FPR", "KEY-TIME", "KEY-ATTR", "CA-FPR", "DISP-NAME",
+    "DISP-LANG", "DISP-SEX", "PUBKEY-URL", "LOGIN-DATA", "EXTCAP",
+    "MANUFACTURER", NULL
+  };
+  int i;
+
+  for (i=0; names[i]; i++)
+    if (!strcmp (names[i], name))
+      return 1;
+  return 0;
+}
+
+
 /* Perform a GETATTR operation.  */
 gpg_error_t
 app_getattr (card_t card, ctrl_t ctrl, const char *name)
 {
   gpg_error_t err;
+  char *key = NULL;
+  estream_t capture;
 
   if (!card || !name || !*name)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -1495,15 +1787,23 @@ app_getattr (card_t card, ctrl_t ctrl, const char *name)
     }
   else if (!card->app->fnc.getattr)
     err = gpg_error (GPG_ERR_UNSUPPORTED_OPERATION);
+  else if (is_cacheable_attr (name)
+           && (key = xtryasprintf ("%d/getattr/%s",
+                                   card->app->apptype, name))
+           && card_cache_replay (card, ctrl, key, NULL, NULL))
+    ;
   else
     {
       if (DBG_APP)
         log_debug ("slot %d app %s: calling getattr(%s)\n",
                    card->slot, xstrapptype (card->app), name);
+      capture = card_cache_start (ctrl, key);
       err = card->app->fnc.getattr (card->app, ctrl, name);
+      card_cache_finish (card, ctrl, capture, err, key, 0, NULL, 0);
     }
 
   unlock_card (card);
+  xfree (key);
   return err;
 }
 
@@ -1536,6 +1836,7 @@ app_setattr (card_t card, ctrl_t ctrl, const char *name,
                                     value, valuelen);
     }
 
+  card_cache_flush (card, 0);
   unlock_card (card);
   return err;
 }
@@ -1574,6 +1875,7 @@ app_sign (card_t card, ctrl_t ctrl, const char *keyidstr, int hashalgo,
                                  outdata, outdatalen);
     }
 
+  card_cache_flush (card, 1);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation sign result: %s\n", gpg_strerror (err));
@@ -1615,6 +1917,7 @@ app_auth (card_t card, ctrl_t ctrl, const char *keyidstr,
                                  outdata, outdatalen);
     }
 
+  card_cache_flush (card, 1);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation auth result: %s\n", gpg_strerror (err));
@@ -1659,6 +1962,7 @@ app_decipher (card_t card, ctrl_t ctrl, const char *keyidstr,
                                      r_info);
     }
 
+  card_cache_flush (card, 1);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation decipher result: %s\n", gpg_strerror (err));
@@ -1695,6 +1999,7 @@ app_writecert (card_t card, ctrl_t ctrl,
                                       pincb, pincb_arg, data, datalen);
     }
 
+  card_cache_flush (card, 0);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation writecert result: %s\n", gpg_strerror (err));
@@ -1731,6 +2036,7 @@ app_writekey (card_t card, ctrl_t ctrl,
                                      pincb, pincb_arg, keydata, keydatalen);
     }
 
+  card_cache_flush (card, 0);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation writekey result: %s\n", gpg_strerror (err));
@@ -1766,6 +2072,7 @@ app_genkey (card_t card, ctrl_t ctrl, const char *keynostr,
                                    createtime, pincb, pincb_arg);
     }
 
+  card_cache_flush (card, 0);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation genkey result: %s\n", gpg_strerror (err));
@@ -1826,6 +2133,7 @@ app_change_pin (card_t card, ctrl_t ctrl, const char *chvnostr,
                                        chvnostr, flags, pincb, pincb_arg);
     }
 
+  card_cache_flush (card, 0);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation change_pin result: %s\n", gpg_strerror (err));
@@ -1862,6 +2170,7 @@ app_check_pin (card_t card, ctrl_t ctrl, const char *keyidstr,
                                       pincb, pincb_arg);
     }
 
+  card_cache_flush (card, 1);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation check_pin result: %s\n", gpg_strerror (err));
@@ -1941,9 +2250,22 @@ scd_update_reader_status_file (void)
       int sw;
       unsigned int status;
 
-      lock_card (card, NULL);
       card_next = card->next;
 
+      /* A card which is in use is obviously present; we check it
+       * with the next tick.  Waiting for the lock would keep the
+       * card list locked during the whole command and thus block
+       * commands for all other cards.  */
+      if (trylock_card (card, NULL))
+        {
+          periodical_check_needed = 1;
+          continue;
+        }
+
+      /* The reader may switch between polling and event notification
+       * (e.g. if the PC/SC monitor failed).  */
+      card->periodical_check_needed = apdu_require_get_status (card->slot);
+
       if (card->reset_requested)
         status = 0;
       else
@@ -1966,6 +2288,7 @@ scd_update_reader_status_file (void)
 
       if (card->card_status != status)
         {
+          card_cache_flush (card, 0);
           report_change (card->slot, card->card_status, status);
           send_client_notifications (card, status == 0);
 
@@ -2186,6 +2509,55 @@ app_switch_active_app (card_t card, ctrl_t ctrl, const char *appname)
 }
 
 
+/* Helper for app_do_with_keygrip to run ACTION on the locked card C.
+ * Returns true if the lookup succeeded; the matching app is then
+ * stored at R_APP.  */
+static int
+do_with_keygrip_on_card (ctrl_t ctrl, card_t c, int action,
+                         const char *keygrip_str, int capability,
+                         app_t *r_app)
+{
+  app_t a, a_prev;
+
+  a_prev = NULL;
+  for (a = c->app; a; a = a->next)
+    {
+      if (!a->fnc.with_keygrip)
+        continue;
+
+      /* Note that we need to do a re-select even for the current
+       * app because the last selected application (e.g. after
+       * init) might be a different one and we do not run
+       * maybe_switch_app here.  Of course we we do this only iff
+       * we have an additional app. */
+      if (c->app->next)
+        {
+          if (run_reselect (ctrl, c, a, a_prev))
+            continue;
+        }
+      a_prev = a;
+
+      if (DBG_APP)
+        log_debug ("slot %d, app %s: calling with_keygrip(%s)\n",
+                   c->slot, xstrapptype (a),
+                   action == KEYGRIP_ACTION_SEND_DATA? "send_data":
+                   action == KEYGRIP_ACTION_WRITE_STATUS? "write_data":
+                   action == KEYGRIP_ACTION_LOOKUP? "lookup":"?");
+      if (!a->fnc.with_keygrip (a, ctrl, action, keygrip_str, capability))
+        {
+          *r_app = a;
+          return 1;
+        }
+    }
+
+  /* Select the first app again.  */
+  if (c->app->next)
+    run_reselect (ctrl, c, c->app, a_prev);
+
+  return 0;
+}
+
+
 /* Execute an action for each app.  ACTION can be one of:
  *
  * - KEYGRIP_ACTION_SEND_DATA
@@ -2215,67 +2587,52 @@ card_t
 app_do_with_keygrip (ctrl_t ctrl, int action, const char *keygrip_str,
                      int capability)
 {
-  int locked = 0;
   card_t c;
-  app_t a, a_prev;
+  app_t a = NULL;
+  unsigned int busy = 0;
+  int pass;
 
   npth_mutex_lock (&card_list_lock);
 
-  for (c = card_top; c; c = c->next)
-    {
-      if (lock_card (c, ctrl))
-        {
-          c = NULL;
-          goto leave_the_loop;
-        }
-      locked = 1;
-      a_prev = NULL;
-      for (a = c->app; a; a = a->next)
-        {
-          if (!a->fnc.with_keygrip)
-            continue;
-
-          /* Note that we need to do a re-select even for the current
-           * app because the last selected application (e.g. after
-           * init) might be a different one and we do not run
-           * maybe_switch_app here.  Of course we we do this only iff
-           * we have an additional app. */
-          if (c->app->next)
-            {
-              if (run_reselect (ctrl, c, a, a_prev))
+  /* For a lookup we first try all cards which are not in use by
+   * another connection and only then wait for the busy ones.  Thus a
+   * long running operation on one token does not delay a request for
+   * a key on another token.  */
+  for (pass = (action == KEYGRIP_ACTION_LOOKUP)? 0 : 1; pass < 2; pass++)
+    for (c = card_top; c; c = c->next)
+      {
+        if (!pass)
+          {
+            if (trylock_card (c, ctrl))
+              {
+                busy |= (1 << c->slot);
                 continue;
-            }
-          a_prev = a;
-
-          if (DBG_APP)
-            log_debug ("slot %d, app %s: calling with_keygrip(%s)\n",
-                       c->slot, xstrapptype (a),
-                       action == KEYGRIP_ACTION_SEND_DATA? "send_data":
-                       action == KEYGRIP_ACTION_WRITE_STATUS? "write_data":
-                       action == KEYGRIP_ACTION_LOOKUP? "lookup":"?");
-          if (!a->fnc.with_keygrip (a, ctrl, action, keygrip_str, capability))
-            goto leave_the_loop; /* ACTION_LOOKUP succeeded.  */
-        }
-
-      /* Select the first app again.  */
-      if (c->app->next)
-        run_reselect (ctrl, c, c->app, a_prev);
-
-      unlock_card (c);
-      locked = 0;
-    }
-
- leave_the_loop:
-  /* Force switching of the app if the selected one is not the current
-   * one.  Changing the current apptype is sufficient to do this.  */
-  if (c && c->app && c->app->apptype != a->apptype)
-    ctrl->current_apptype = a->apptype;
+              }
+          }
+        else if (action == KEYGRIP_ACTION_LOOKUP && !(busy & (1 << c->slot)))
+          continue;
+        else if (lock_card (c, ctrl))
+          {
+            c = NULL;
+            goto leave;
+          }
+
+        if (do_with_keygrip_on_card (ctrl, c, action, keygrip_str,
+                                     capability, &a))
+          {
+            /* ACTION_LOOKUP succeeded.  Force switching of the app
+             * if the selected one is not the current one.  Changing
+             * the current apptype is sufficient to do this.  */
+            if (c->app && c->app->apptype != a->apptype)
+              ctrl->current_apptype = a->apptype;
+            unlock_card (c);
+            goto leave;
+          }
+        unlock_card (c);
+      }
+  c = NULL;
 
-  if (locked && c)
-    {
-      unlock_card (c);
-      locked = 0;
-    }
+ leave:
   npth_mutex_unlock (&card_list_lock);
   return c;
 }
@@ -288,3 +288,61 @@ atr_dump (const void *buffer, size_t buflen)
 
   return result;
 }
+
+
+/* Return true if the card with the ATR in (BUFFER,BUFLEN) announces
+   support for extended Lc and Le fields in the card capabilities of
+   its historical bytes.  */
+int
+atr_ext_lc_le_p (const void *buffer, size_t buflen)
+{
+  const unsigned char *atr = buffer;
+  size_t idx, n_historical;
+  unsigned int y, tag, len;
+
+  if (buflen < 2)
+    return 0;
+
+  /* Skip the interface characters.  */
+  n_historical = (atr[1] & 0x0f);
+  y = (atr[1] & 0xf0);
+  idx = 2;
+  while (y)
+    {
+      idx += !!(y & 0x10) + !!(y & 0x20) + !!(y & 0x40);
+      if (!(y & 0x80))
+        break;
+      if (idx >= buflen)
+        return 0;
+      y = (atr[idx++] & 0xf0);
+    }
+  if (n_historical < 2 || idx + n_historical > buflen)
+    return 0;
+  atr += idx;
+
+  /* With a category indicator of 0x00 the last 3 bytes are the
+     status indicator; with 0x80 only Compact-TLV objects follow.  */
+  if (*atr == 0x00)
+    {
+      if (n_historical < 4)
+        return 0;
+      n_historical -= 3;
+    }
+  else if (*atr != 0x80)
+    return 0;
+  atr++;
+  n_historical--;
+
+  while (n_historical)
+    {
+      tag = (*atr >> 4);
+      len = (*atr & 0x0f);
+      if (len + 1 > n_historical)
+        return 0;
+      if (tag == 7 && len == 3)
+        return !!(atr[3] & 0x40);  /* Card capabilities.  */
+      atr += len + 1;
+      n_historical -= len + 1;
+    }
+  return 0;
+}
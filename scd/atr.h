@@ -21,6 +21,7 @@
 #define ATR_H
 
 char *atr_dump (const void *buffer, size_t buflen);
+int atr_ext_lc_le_p (const void *buffer, size_t buflen);
 
 
 
@@ -741,7 +741,10 @@ parse_ccid_descriptor (ccid_driver_t handle, unsigned short bcd_device,
 
   us = convert_le_u32(buf+28);
   DEBUGOUT_1 ("  dwMaxIFSD           %5u\n", us);
-  handle->max_ifsd = us;
+  /* We request the largest IFSD the reader supports.  Some readers
+     announce more than the maximum of 254 allowed by T=1 (ISO/IEC
+     7816-3, 11.4.2); this would wrap around in the S-block.  */
+  handle->max_ifsd = us > 254? 254 : us;
 
   us = convert_le_u32(buf+32);
   DEBUGOUT_1 ("  dwSyncProtocols  %08X ", us);
@@ -909,6 +912,15 @@ parse_ccid_descriptor (ccid_driver_t handle, unsigned short bcd_device,
       handle->max_ifsd = 48;
     }
 
+  /* A T=1 block with the IFSD must fit into one CCID message:
+        10 CCID header + 3 prologue + IFSD + 2 epilogue  */
+  if (handle->max_ccid_msglen > 15
+      && handle->max_ifsd > handle->max_ccid_msglen - 15)
+    {
+      handle->max_ifsd = handle->max_ccid_msglen - 15;
+      DEBUGOUT_1 ("limiting IFSD to %d\n", handle->max_ifsd);
+    }
+
   if (handle->id_vendor == VENDOR_GEMPC)
     {
       DEBUGOUT ("enabling product quirk: disable non-null NAD\n");
@@ -1259,7 +1271,7 @@ ccid_vendor_specific_init (ccid_driver_t handle)
 }
 
 
-#define MAX_DEVICE 4 /* See MAX_READER in apdu.c.  */
+#define MAX_DEVICE 16 /* See MAX_READER in apdu.c.  */
 
 struct ccid_dev_table {
   int n;                        /* Index to ccid_usb_dev_list */
@@ -2842,6 +2854,19 @@ compute_edc (const unsigned char *data, size_t datalen, int use_crc)
 }
 
 
+/* Return true if the reader HANDLE is able to transfer extended
+ * length APDUs.  This is not the case for readers supporting only
+ * the short APDU level exchange; except for Omnikey readers for which
+ * we use an escape sequence to send TPDUs.  */
+int
+ccid_extended_apdu_p (ccid_driver_t handle)
+{
+  if (!handle)
+    return 0;
+  return (handle->apdu_level != 1 || handle->id_vendor == VENDOR_OMNIKEY);
+}
+
+
 /* Return true if APDU is an extended length one.  */
 static int
 is_exlen_apdu (const unsigned char *apdu, size_t apdulen)
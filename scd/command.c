@@ -2305,6 +2305,17 @@ scd_command_handler (ctrl_t ctrl, int fd)
 }
 
 
+/* Write the status line KEYWORD ARGS to the capture stream of CTRL
+ * if there is one.  */
+static void
+capture_status (ctrl_t ctrl, const char *keyword, const char *args)
+{
+  if (ctrl->status_capture)
+    es_fprintf (ctrl->status_capture, "%s%s%s\n",
+                keyword, *args? " ":"", args);
+}
+
+
 /* Send a line with status information via assuan and escape all given
    buffers. The variable elements are pairs of (char *, size_t),
    terminated with a (NULL, 0). */
@@ -2350,6 +2361,7 @@ send_status_info (ctrl_t ctrl, const char *keyword, ...)
     }
   *p = 0;
   assuan_write_status (ctx, keyword, buf);
+  capture_status (ctrl, keyword, buf);
 
   va_end (arg_ptr);
 }
@@ -2364,7 +2376,10 @@ send_status_direct (ctrl_t ctrl, const char *keyword, const char *args)
   if (strchr (args, '\n'))
     log_error ("error: LF detected in status line - not sending\n");
   else
-    assuan_write_status (ctx, keyword, args);
+    {
+      assuan_write_status (ctx, keyword, args);
+      capture_status (ctrl, keyword, args);
+    }
 }
 
 
@@ -2384,6 +2399,18 @@ send_status_printf (ctrl_t ctrl, const char *keyword, const char *format, ...)
   va_start (arg_ptr, format);
   err = vprint_assuan_status (ctx, keyword, format, arg_ptr);
   va_end (arg_ptr);
+  if (ctrl->status_capture)
+    {
+      char *buf;
+
+      va_start (arg_ptr, format);
+      if (gpgrt_vasprintf (&buf, format, arg_ptr) >= 0)
+        {
+          capture_status (ctrl, keyword, buf);
+          es_free (buf);
+        }
+      va_end (arg_ptr);
+    }
   return err;
 }
 
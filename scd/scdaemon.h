@@ -120,6 +120,10 @@ struct server_control_s
     unsigned char *value;
     int valuelen;
   } in_data;
+
+  /* If not NULL all status lines are also written to this stream.
+   * This is used by the card cache in app.c.  */
+  estream_t status_capture;
 };
 
 
@@ -43,6 +43,15 @@
 
 static assuan_context_t agent_ctx = NULL;
 
+/* The sorted keygrips of all secret keys while a listing is running;
+   see gpgsm_agent_begin_keygrip_cache.  */
+static struct
+{
+  int active;
+  unsigned char *grips;  /* COUNT keygrips of 20 bytes each.  */
+  size_t count;
+} keygrip_cache;
+
 
 struct cipher_parm_s
 {
@@ -968,6 +977,72 @@ gpgsm_agent_marktrusted (ctrl_t ctrl, ksba_cert_t cert)
 
 
 
+/* Helper for qsort and bsearch of keygrip_cache.  */
+static int
+cmp_keygrips (const void *a, const void *b)
+{
+  return memcmp (a, b, KEYGRIP_LEN);
+}
+
+
+/* Fetch the keygrips of all secret keys from the agent so that
+   gpgsm_agent_havekey does not need to ask the agent for each
+   certificate of a listing.  If the agent does not support "HAVEKEY
+   --list" nothing changes.  */
+void
+gpgsm_agent_begin_keygrip_cache (ctrl_t ctrl)
+{
+  gpg_error_t err;
+  membuf_t data;
+  unsigned char *buf;
+  size_t len;
+
+  gpgsm_agent_end_keygrip_cache ();
+
+  err = start_agent (ctrl);
+  if (err)
+    return;
+
+  init_membuf (&data, 1024);
+  err = assuan_transact (agent_ctx, "HAVEKEY --list",
+                         put_membuf_cb, &data, NULL, NULL, NULL, NULL);
+  if (err)
+    {
+      xfree (get_membuf (&data, &len));
+      if (DBG_IPC)
+        log_debug ("no keygrip cache: %s\n", gpg_strerror (err));
+      return;
+    }
+  buf = get_membuf (&data, &len);
+  if (!buf)
+    return;  /* Out of core.  */
+  if ((len % KEYGRIP_LEN))
+    {
+      log_error ("invalid keygrip list returned by the agent\n");
+      xfree (buf);
+      return;
+    }
+
+  keygrip_cache.grips = buf;
+  keygrip_cache.count = len / KEYGRIP_LEN;
+  if (keygrip_cache.count > 1)
+    qsort (keygrip_cache.grips, keygrip_cache.count, KEYGRIP_LEN,
+           cmp_keygrips);
+  keygrip_cache.active = 1;
+}
+
+
+/* Release the keygrips fetched by gpgsm_agent_begin_keygrip_cache.  */
+void
+gpgsm_agent_end_keygrip_cache (void)
+{
+  xfree (keygrip_cache.grips);
+  keygrip_cache.grips = NULL;
+  keygrip_cache.count = 0;
+  keygrip_cache.active = 0;
+}
+
+
 /* Ask the agent whether the a corresponding secret key is available
    for the given keygrip */
 int
@@ -976,13 +1051,26 @@ gpgsm_agent_havekey (ctrl_t ctrl, const char *hexkeygrip)
   int rc;
   char line[ASSUAN_LINELENGTH];
 
+  if (!hexkeygrip || strlen (hexkeygrip) != 40)
+    return gpg_error (GPG_ERR_INV_VALUE);
+
+  if (keygrip_cache.active)
+    {
+      unsigned char grip[KEYGRIP_LEN];
+
+      if (hex2bin (hexkeygrip, grip, KEYGRIP_LEN) < 0)
+        return gpg_error (GPG_ERR_INV_VALUE);
+      if (keygrip_cache.count
+          && bsearch (grip, keygrip_cache.grips, keygrip_cache.count,
+                      KEYGRIP_LEN, cmp_keygrips))
+        return 0;
+      return gpg_error (GPG_ERR_NO_SECKEY);
+    }
+
   rc = start_agent (ctrl);
   if (rc)
     return rc;
 
-  if (!hexkeygrip || strlen (hexkeygrip) != 40)
-    return gpg_error (GPG_ERR_INV_VALUE);
-
   snprintf (line, DIM(line), "HAVEKEY %s", hexkeygrip);
 
   rc = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
@@ -67,6 +67,54 @@ struct isvalid_status_parm_s {
   unsigned char fpr[20];
 };
 
+/* Results of the ISVALID command are kept for this number of
+   seconds.  A listing with validation checks the same intermediate
+   and root certificates for each certificate; with the cache only
+   the first check needs a round trip to the dirmngr.  */
+#define ISVALID_CACHE_TTL  120
+#define ISVALID_CACHE_SIZE 256
+
+struct isvalid_cache_s {
+  struct isvalid_cache_s *next;
+  time_t created;
+  int use_ocsp;
+  gpg_error_t err;
+  unsigned char fpr[20];         /* SHA-1 of the certificate.  */
+  unsigned char issuer_fpr[20];  /* SHA-1 of its issuer.  */
+};
+static struct isvalid_cache_s *isvalid_cache;
+static unsigned int isvalid_cache_size;
+
+/* Set if we have sent the options for the ISVALID command.  It is
+ * sufficient to send them only once because we have one connection
+ * per process only.  */
+static int did_isvalid_options;
+
+/* Set if the dirmngr does not support ISVALID --batch.  */
+static int no_isvalid_batch;
+
+/* The maximum number of certificates checked with one request.  */
+#define ISVALID_BATCH_MAX 32
+
+/* Result of one certificate checked with ISVALID --batch.  */
+struct isvalid_batch_item_s {
+  int idx;               /* Index into the caller's arrays.  */
+  int done;              /* We received the result.  */
+  gpg_error_t err;       /* The result.  */
+  int seen;              /* Count of ONLY_VALID_IF_CERT_VALID.  */
+  unsigned char fpr[20]; /* The fingerprint from that status.  */
+};
+
+struct isvalid_batch_parm_s {
+  ctrl_t ctrl;
+  struct inq_certificate_parm_s *inqparm;
+  ksba_cert_t *certs;
+  struct isvalid_batch_item_s *items;
+  int nitems;
+  int seen;               /* Status for the next result.  */
+  unsigned char fpr[20];
+};
+
 
 struct lookup_parm_s {
   ctrl_t ctrl;
@@ -483,6 +531,142 @@ isvalid_status_cb (void *opaque, const char *line)
 
 
 
+/* Return the cache item for CERT, ISSUER_CERT and USE_OCSP or NULL.
+   FPR and ISSUER_FPR are the fingerprints of the certificates.  */
+static struct isvalid_cache_s *
+isvalid_cache_lookup (const unsigned char *fpr,
+                      const unsigned char *issuer_fpr, int use_ocsp)
+{
+  struct isvalid_cache_s *item, *prev, *next;
+  time_t now = gnupg_get_time ();
+
+  for (prev = NULL, item = isvalid_cache; item; item = next)
+    {
+      next = item->next;
+      if (item->created + ISVALID_CACHE_TTL <= now || item->created > now)
+        {
+          if (prev)
+            prev->next = next;
+          else
+            isvalid_cache = next;
+          isvalid_cache_size--;
+          xfree (item);
+          continue;
+        }
+      if (item->use_ocsp == use_ocsp
+          && !memcmp (item->fpr, fpr, 20)
+          && !memcmp (item->issuer_fpr, issuer_fpr, 20))
+        return item;
+      prev = item;
+    }
+  return NULL;
+}
+
+
+/* Store the result ERR of an ISVALID command in the cache.  Only
+   definite answers are stored.  */
+static void
+isvalid_cache_put (const unsigned char *fpr, const unsigned char *issuer_fpr,
+                   int use_ocsp, gpg_error_t err)
+{
+  struct isvalid_cache_s *item, *prev;
+
+  switch (gpg_err_code (err))
+    {
+    case 0:
+    case GPG_ERR_CERT_REVOKED:
+    case GPG_ERR_NO_CRL_KNOWN:
+    case GPG_ERR_NO_DATA:
+    case GPG_ERR_CRL_TOO_OLD:
+      break;
+    default:
+      return;
+    }
+
+  if (isvalid_cache_size >= ISVALID_CACHE_SIZE)
+    {
+      /* Drop the oldest item which is the last one.  */
+      for (prev = NULL, item = isvalid_cache; item->next;
+           prev = item, item = item->next)
+        ;
+      if (prev)
+        prev->next = NULL;
+      else
+        isvalid_cache = NULL;
+      isvalid_cache_size--;
+      xfree (item);
+    }
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    return;  /* Not a problem; it is only a cache.  */
+  item->created = gnupg_get_time ();
+  item->use_ocsp = use_ocsp;
+  item->err = err;
+  memcpy (item->fpr, fpr, 20);
+  memcpy (item->issuer_fpr, issuer_fpr, 20);
+  item->next = isvalid_cache;
+  isvalid_cache = item;
+  isvalid_cache_size++;
+}
+
+
+
+/* Helper for the ISVALID functions to check the certificate with the
+   fingerprint FPR which the dirmngr used to sign an OCSP response.
+   The dirmngr context must be locked.  */
+static gpg_error_t
+check_ocsp_signer (ctrl_t ctrl, const unsigned char *fpr)
+{
+  gpg_error_t rc = 0;
+  ksba_cert_t rspcert = NULL;
+
+  if (get_cached_cert (dirmngr_ctx, fpr, &rspcert))
+    {
+      /* Ooops: Something went wrong getting the certificate
+         from the dirmngr.  Try our own cert store now.  */
+      KEYDB_HANDLE kh;
+
+      kh = keydb_new ();
+      if (!kh)
+        rc = gpg_error (GPG_ERR_ENOMEM);
+      if (!rc)
+        rc = keydb_search_fpr (ctrl, kh, fpr);
+      if (!rc)
+        rc = keydb_get_cert (kh, &rspcert);
+      if (rc)
+        {
+          log_error ("unable to find the certificate used "
+                     "by the dirmngr: %s\n", gpg_strerror (rc));
+          rc = gpg_error (GPG_ERR_INV_CRL);
+        }
+      keydb_release (kh);
+    }
+
+  if (!rc)
+    {
+      rc = gpgsm_cert_use_ocsp_p (rspcert);
+      if (rc)
+        rc = gpg_error (GPG_ERR_INV_CRL);
+      else
+        {
+          /* Note the no_dirmngr flag: This avoids checking
+             this certificate over and over again. */
+          rc = gpgsm_validate_chain (ctrl, rspcert, "", NULL, 0, NULL,
+                                     VALIDATE_FLAG_NO_DIRMNGR, NULL);
+          if (rc)
+            {
+              log_error ("invalid certificate used for CRL/OCSP: %s\n",
+                         gpg_strerror (rc));
+              rc = gpg_error (GPG_ERR_INV_CRL);
+            }
+        }
+    }
+  ksba_cert_release (rspcert);
+  return rc;
+}
+
+
 /* Call the directory manager to check whether the certificate is valid
    Returns 0 for valid or usually one of the errors:
 
@@ -499,12 +683,24 @@ int
 gpgsm_dirmngr_isvalid (ctrl_t ctrl,
                        ksba_cert_t cert, ksba_cert_t issuer_cert, int use_ocsp)
 {
-  static int did_options;
   int rc;
   char *certid, *certfpr;
   char line[ASSUAN_LINELENGTH];
   struct inq_certificate_parm_s parm;
   struct isvalid_status_parm_s stparm;
+  struct isvalid_cache_s *item;
+  unsigned char fpr[20], issuer_fpr[20];
+
+  gpgsm_get_fingerprint (cert, GCRY_MD_SHA1, fpr, NULL);
+  gpgsm_get_fingerprint (issuer_cert, GCRY_MD_SHA1, issuer_fpr, NULL);
+  item = isvalid_cache_lookup (fpr, issuer_fpr, use_ocsp);
+  if (item)
+    {
+      if (opt.verbose > 1)
+        log_info ("using cached dirmngr response: %s\n",
+                  item->err? gpg_strerror (item->err): "okay");
+      return item->err;
+    }
 
   rc = start_dirmngr (ctrl);
   if (rc)
@@ -536,14 +732,12 @@ gpgsm_dirmngr_isvalid (ctrl_t ctrl,
   stparm.seen = 0;
   memset (stparm.fpr, 0, 20);
 
-  /* It is sufficient to send the options only once because we have
-   * one connection per process only.  */
-  if (!did_options)
+  if (!did_isvalid_options)
     {
       if (opt.force_crl_refresh)
         assuan_transact (dirmngr_ctx, "OPTION force-crl-refresh=1",
                          NULL, NULL, NULL, NULL, NULL, NULL);
-      did_options = 1;
+      did_isvalid_options = 1;
     }
   snprintf (line, DIM(line), "ISVALID%s%s %s%s%s",
             use_ocsp == 2 || opt.no_crl_check ? " --only-ocsp":"",
@@ -569,55 +763,217 @@ gpgsm_dirmngr_isvalid (ctrl_t ctrl,
           rc = gpg_error (GPG_ERR_INV_CRL);
         }
       else
+        rc = check_ocsp_signer (ctrl, stparm.fpr);
+    }
+  release_dirmngr (ctrl);
+  isvalid_cache_put (fpr, issuer_fpr, use_ocsp, rc);
+  return rc;
+}
+
+
+/* Inquiry callback for gpgsm_dirmngr_isvalid_list.  */
+static gpg_error_t
+isvalid_batch_inq_cb (void *opaque, const char *line)
+{
+  struct isvalid_batch_parm_s *parm = opaque;
+  const unsigned char *der;
+  size_t derlen;
+  gpg_error_t err;
+  int i;
+
+  if (!has_leading_keyword (line, "CERTLIST"))
+    return inq_certificate (parm->inqparm, line);
+
+  for (i = 0; i < parm->nitems; i++)
+    {
+      der = ksba_cert_get_image (parm->certs[parm->items[i].idx], &derlen);
+      if (!der)
+        return gpg_error (GPG_ERR_INV_CERT_OBJ);
+      err = assuan_send_data (parm->inqparm->ctx, der, derlen);
+      if (err)
+        return err;
+    }
+  return 0;
+}
+
+
+/* Status callback for gpgsm_dirmngr_isvalid_list.  */
+static gpg_error_t
+isvalid_batch_status_cb (void *opaque, const char *line)
+{
+  struct isvalid_batch_parm_s *parm = opaque;
+  struct isvalid_batch_item_s *item;
+  const char *s;
+  char *endp;
+  long idx;
+
+  if ((s = has_leading_keyword (line, "ISVALID")))
+    {
+      idx = strtol (s, &endp, 10);
+      if (endp == s || idx < 0 || idx >= parm->nitems)
+        return 0;  /* Ignore garbage.  */
+      item = parm->items + idx;
+      item->done = 1;
+      item->err = strtoul (endp, NULL, 10);
+      /* An ONLY_VALID_IF_CERT_VALID is emitted before the result.  */
+      item->seen = parm->seen;
+      memcpy (item->fpr, parm->fpr, 20);
+      parm->seen = 0;
+    }
+  else if ((s = has_leading_keyword (line, "ONLY_VALID_IF_CERT_VALID")))
+    {
+      parm->seen++;
+      if (!*s || !unhexify_fpr (s, parm->fpr))
+        parm->seen++; /* Bump it to indicate an error. */
+    }
+  else if ((s = has_leading_keyword (line, "PROGRESS")))
+    {
+      if (parm->ctrl && gpgsm_status (parm->ctrl, STATUS_PROGRESS, s))
+        return gpg_error (GPG_ERR_ASS_CANCELED);
+    }
+  return 0;
+}
+
+
+/* Check the NCERTS certificates CERTS with their issuer certificates
+   ISSUERS like gpgsm_dirmngr_isvalid but use only one request to the
+   dirmngr for all of them.  The result for each certificate is stored
+   at R_ERRS.  Returns an error only if the request failed as a whole;
+   GPG_ERR_NOT_SUPPORTED indicates that the caller should use
+   gpgsm_dirmngr_isvalid instead.  */
+gpg_error_t
+gpgsm_dirmngr_isvalid_list (ctrl_t ctrl, ksba_cert_t *certs,
+                            ksba_cert_t *issuers, int ncerts, int use_ocsp,
+                            gpg_error_t *r_errs)
+{
+  gpg_error_t err;
+  struct isvalid_cache_s *citem;
+  struct isvalid_batch_item_s *items = NULL;
+  struct isvalid_batch_parm_s parm;
+  struct inq_certificate_parm_s inqparm;
+  unsigned char (*fprs)[2][20] = NULL;
+  int *dup = NULL;
+  int i, j, nitems;
+  char line[ASSUAN_LINELENGTH];
+
+  if (no_isvalid_batch || ncerts > ISVALID_BATCH_MAX)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  fprs = xtrycalloc (ncerts, sizeof *fprs);
+  dup = xtrycalloc (ncerts, sizeof *dup);
+  items = xtrycalloc (ncerts, sizeof *items);
+  if (!fprs || !dup || !items)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Take what we can from the cache and send each remaining pair of
+     certificates only once.  */
+  nitems = 0;
+  for (i = 0; i < ncerts; i++)
+    {
+      dup[i] = -1;
+      gpgsm_get_fingerprint (certs[i], GCRY_MD_SHA1, fprs[i][0], NULL);
+      gpgsm_get_fingerprint (issuers[i], GCRY_MD_SHA1, fprs[i][1], NULL);
+      citem = isvalid_cache_lookup (fprs[i][0], fprs[i][1], use_ocsp);
+      if (citem)
+        {
+          r_errs[i] = citem->err;
+          continue;
+        }
+      for (j = 0; j < i; j++)
+        if (!memcmp (fprs[i], fprs[j], sizeof *fprs))
+          break;
+      if (j < i)
         {
-          ksba_cert_t rspcert = NULL;
+          dup[i] = j;
+          continue;
+        }
+      items[nitems].idx = i;
+      items[nitems].err = gpg_error (GPG_ERR_INV_CRL);
+      nitems++;
+    }
+
+  if (nitems)
+    {
+      err = start_dirmngr (ctrl);
+      if (err)
+        goto leave;
 
-          if (get_cached_cert (dirmngr_ctx, stparm.fpr, &rspcert))
+      if (!did_isvalid_options)
+        {
+          if (opt.force_crl_refresh)
+            assuan_transact (dirmngr_ctx, "OPTION force-crl-refresh=1",
+                             NULL, NULL, NULL, NULL, NULL, NULL);
+          did_isvalid_options = 1;
+        }
+
+      memset (&inqparm, 0, sizeof inqparm);
+      inqparm.ctx = dirmngr_ctx;
+      inqparm.ctrl = ctrl;
+      memset (&parm, 0, sizeof parm);
+      parm.ctrl = ctrl;
+      parm.inqparm = &inqparm;
+      parm.certs = certs;
+      parm.items = items;
+      parm.nitems = nitems;
+
+      snprintf (line, DIM(line), "ISVALID --batch%s%s%s",
+                use_ocsp? " --ocsp":"",
+                use_ocsp == 2 || opt.no_crl_check ? " --only-ocsp":"",
+                use_ocsp == 2? " --force-default-responder":"");
+      if (opt.verbose > 1)
+        log_info ("asking dirmngr about %d certificates%s\n", nitems,
+                  use_ocsp? " (using OCSP)":"");
+      err = assuan_transact (dirmngr_ctx, line, NULL, NULL,
+                             isvalid_batch_inq_cb, &parm,
+                             isvalid_batch_status_cb, &parm);
+      if (gpg_err_code (err) == GPG_ERR_ASS_PARAMETER)
+        {
+          /* An old dirmngr which does not know --batch.  */
+          no_isvalid_batch = 1;
+          err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+        }
+
+      for (j = 0; !err && j < nitems; j++)
+        {
+          struct isvalid_batch_item_s *item = items + j;
+
+          if (!item->done)
             {
-              /* Ooops: Something went wrong getting the certificate
-                 from the dirmngr.  Try our own cert store now.  */
-              KEYDB_HANDLE kh;
-
-              kh = keydb_new ();
-              if (!kh)
-                rc = gpg_error (GPG_ERR_ENOMEM);
-              if (!rc)
-                rc = keydb_search_fpr (ctrl, kh, stparm.fpr);
-              if (!rc)
-                rc = keydb_get_cert (kh, &rspcert);
-              if (rc)
-                {
-                  log_error ("unable to find the certificate used "
-                             "by the dirmngr: %s\n", gpg_strerror (rc));
-                  rc = gpg_error (GPG_ERR_INV_CRL);
-                }
-              keydb_release (kh);
+              log_error ("communication problem with dirmngr detected\n");
+              item->err = gpg_error (GPG_ERR_INV_CRL);
             }
-
-          if (!rc)
+          else if (!item->err && item->seen)
             {
-              rc = gpgsm_cert_use_ocsp_p (rspcert);
-              if (rc)
-                rc = gpg_error (GPG_ERR_INV_CRL);
-              else
+              if (item->seen != 1)
                 {
-                  /* Note the no_dirmngr flag: This avoids checking
-                     this certificate over and over again. */
-                  rc = gpgsm_validate_chain (ctrl, rspcert, "", NULL, 0, NULL,
-                                             VALIDATE_FLAG_NO_DIRMNGR, NULL);
-                  if (rc)
-                    {
-                      log_error ("invalid certificate used for CRL/OCSP: %s\n",
-                                 gpg_strerror (rc));
-                      rc = gpg_error (GPG_ERR_INV_CRL);
-                    }
+                  log_error ("communication problem with dirmngr detected\n");
+                  item->err = gpg_error (GPG_ERR_INV_CRL);
                 }
+              else
+                item->err = check_ocsp_signer (ctrl, item->fpr);
             }
-          ksba_cert_release (rspcert);
+          r_errs[item->idx] = item->err;
+          isvalid_cache_put (fprs[item->idx][0], fprs[item->idx][1],
+                             use_ocsp, item->err);
         }
+      release_dirmngr (ctrl);
+      if (err)
+        goto leave;
     }
-  release_dirmngr (ctrl);
-  return rc;
+
+  for (i = 0; i < ncerts; i++)
+    if (dup[i] != -1)
+      r_errs[i] = r_errs[dup[i]];
+  err = 0;
+
+ leave:
+  xfree (items);
+  xfree (dup);
+  xfree (fprs);
+  return err;
 }
 
 
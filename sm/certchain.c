@@ -58,6 +58,40 @@ struct chain_item_s
 typedef struct chain_item_s *chain_item_t;
 
 
+/* A revocation check which has been deferred so that the checks for
+   all links of a chain can be sent to the dirmngr at once.  */
+struct pending_check_s
+{
+  struct pending_check_s *next;
+  ksba_cert_t subject_cert;
+  ksba_cert_t issuer_cert;
+};
+typedef struct pending_check_s *pending_check_t;
+
+
+/* Successfully validated chains are kept for this number of seconds
+   so that verifying several signatures of the same signer does not
+   need to walk the chain again.  The dirmngr does not tell us the
+   next update time of the CRL or OCSP response; thus we use a short
+   fixed time.  */
+#define VALIDATED_CACHE_TTL  300
+#define VALIDATED_CACHE_SIZE 128
+
+/* An item of the cache of validated chains.  */
+struct validated_cache_s
+{
+  struct validated_cache_s *next;
+  time_t expires;          /* Use the item only until this time.  */
+  unsigned int flags;      /* The VALIDATE_FLAG_* used.  */
+  unsigned int mode;       /* Offline and OCSP mode of the session.  */
+  int is_qualified;        /* -1 = unknown, 0 = no, 1 = yes.  */
+  ksba_isotime_t exptime;  /* Nearest expiration time of the chain.  */
+  unsigned char fpr[20];   /* SHA-1 of the target certificate.  */
+};
+static struct validated_cache_s *validated_cache;
+static unsigned int validated_cache_size;
+
+
 static int is_root_cert (ksba_cert_t cert,
                          const char *issuerdn, const char *subjectdn);
 static int get_regtp_ca_info (ctrl_t ctrl, ksba_cert_t cert, int *chainlen);
@@ -1040,6 +1074,13 @@ gpgsm_is_root_cert (ksba_cert_t cert)
 }
 
 
+static gpg_error_t handle_isvalid_result (ctrl_t ctrl, gpg_error_t err,
+                                          int lm, estream_t fp,
+                                          ksba_cert_t subject_cert,
+                                          int *any_revoked, int *any_no_crl,
+                                          int *any_crl_too_old);
+
+
 /* This is a helper for gpgsm_validate_chain. */
 static gpg_error_t
 is_cert_still_valid (ctrl_t ctrl, int force_ocsp, int lm, estream_t fp,
@@ -1058,6 +1099,18 @@ is_cert_still_valid (ctrl_t ctrl, int force_ocsp, int lm, estream_t fp,
   err = gpgsm_dirmngr_isvalid (ctrl,
                                subject_cert, issuer_cert,
                                force_ocsp? 2 : !!ctrl->use_ocsp);
+  return handle_isvalid_result (ctrl, err, lm, fp, subject_cert,
+                                any_revoked, any_no_crl, any_crl_too_old);
+}
+
+
+/* Helper for is_cert_still_valid and run_pending_checks to evaluate
+   the result ERR of the check of SUBJECT_CERT.  */
+static gpg_error_t
+handle_isvalid_result (ctrl_t ctrl, gpg_error_t err, int lm, estream_t fp,
+                       ksba_cert_t subject_cert, int *any_revoked,
+                       int *any_no_crl, int *any_crl_too_old)
+{
   audit_log_ok (ctrl->audit, AUDIT_CRL_CHECK, err);
 
   if (err)
@@ -1104,6 +1157,97 @@ is_cert_still_valid (ctrl_t ctrl, int force_ocsp, int lm, estream_t fp,
 }
 
 
+/* Helper for do_validate_chain to check the revocation status of
+   SUBJECT_CERT.  If possible the check is appended to PENDING and
+   done later by run_pending_checks.  */
+static gpg_error_t
+queue_revocation_check (ctrl_t ctrl, pending_check_t *pending,
+                        int force_ocsp, int lm, estream_t fp,
+                        ksba_cert_t subject_cert, ksba_cert_t issuer_cert,
+                        int *any_revoked, int *any_no_crl,
+                        int *any_crl_too_old)
+{
+  pending_check_t pc;
+
+  if (ctrl->offline || (opt.no_crl_check && !ctrl->use_ocsp)
+      || !(pc = xtrycalloc (1, sizeof *pc)))
+    return is_cert_still_valid (ctrl, force_ocsp, lm, fp,
+                                subject_cert, issuer_cert,
+                                any_revoked, any_no_crl, any_crl_too_old);
+
+  ksba_cert_ref (subject_cert);
+  pc->subject_cert = subject_cert;
+  ksba_cert_ref (issuer_cert);
+  pc->issuer_cert = issuer_cert;
+  while (*pending)
+    pending = &(*pending)->next;
+  *pending = pc;
+  return 0;
+}
+
+
+/* Run the revocation checks queued in PENDING.  */
+static gpg_error_t
+run_pending_checks (ctrl_t ctrl, pending_check_t pending,
+                    int force_ocsp, int lm, estream_t fp,
+                    int *any_revoked, int *any_no_crl, int *any_crl_too_old)
+{
+  gpg_error_t err;
+  pending_check_t pc;
+  ksba_cert_t *certs = NULL;
+  ksba_cert_t *issuers = NULL;
+  gpg_error_t *errs = NULL;
+  int i, n;
+
+  for (n = 0, pc = pending; pc; pc = pc->next)
+    n++;
+
+  err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+  if (n > 1)
+    {
+      certs = xtrycalloc (n, sizeof *certs);
+      issuers = xtrycalloc (n, sizeof *issuers);
+      errs = xtrycalloc (n, sizeof *errs);
+      if (certs && issuers && errs)
+        {
+          for (i = 0, pc = pending; pc; pc = pc->next, i++)
+            {
+              certs[i] = pc->subject_cert;
+              issuers[i] = pc->issuer_cert;
+            }
+          err = gpgsm_dirmngr_isvalid_list (ctrl, certs, issuers, n,
+                                            force_ocsp? 2 : !!ctrl->use_ocsp,
+                                            errs);
+        }
+    }
+
+  if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED || !errs)
+    {
+      /* Check them one by one.  */
+      err = 0;
+      for (pc = pending; pc && !err; pc = pc->next)
+        err = is_cert_still_valid (ctrl, force_ocsp, lm, fp,
+                                   pc->subject_cert, pc->issuer_cert,
+                                   any_revoked, any_no_crl, any_crl_too_old);
+    }
+  else if (err)
+    err = handle_isvalid_result (ctrl, err, lm, fp, pending->subject_cert,
+                                 any_revoked, any_no_crl, any_crl_too_old);
+  else
+    {
+      for (i = 0, pc = pending; pc && !err; pc = pc->next, i++)
+        err = handle_isvalid_result (ctrl, errs[i], lm, fp, pc->subject_cert,
+                                     any_revoked, any_no_crl,
+                                     any_crl_too_old);
+    }
+
+  xfree (certs);
+  xfree (issuers);
+  xfree (errs);
+  return err;
+}
+
+
 /* Helper for gpgsm_validate_chain to check the validity period of
    SUBJECT_CERT.  The caller needs to pass EXPTIME which will be
    updated to the nearest expiration time seen.  A DEPTH of 0 indicates
@@ -1363,6 +1507,7 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
                             from a qualified root certificate.
                             -1 = unknown, 0 = no, 1 = yes. */
   chain_item_t chain = NULL; /* A list of all certificates in the chain.  */
+  pending_check_t pending = NULL; /* Deferred revocation checks.  */
 
 
   gnupg_get_isotime (current_time);
@@ -1615,12 +1760,12 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
           else if (opt.no_trusted_cert_crl_check || rootca_flags->relax)
             ;
           else
-            rc = is_cert_still_valid (ctrl,
-                                      (flags & VALIDATE_FLAG_CHAIN_MODEL),
-                                      listmode, listfp,
-                                      subject_cert, subject_cert,
-                                      &any_revoked, &any_no_crl,
-                                      &any_crl_too_old);
+            rc = queue_revocation_check (ctrl, &pending,
+                                         (flags & VALIDATE_FLAG_CHAIN_MODEL),
+                                         listmode, listfp,
+                                         subject_cert, subject_cert,
+                                         &any_revoked, &any_no_crl,
+                                         &any_crl_too_old);
           if (rc)
             goto leave;
 
@@ -1799,11 +1944,12 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
                            || (!istrusted_rc && rootca_flags->relax)))
         rc = 0;
       else
-        rc = is_cert_still_valid (ctrl,
-                                  (flags & VALIDATE_FLAG_CHAIN_MODEL),
-                                  listmode, listfp,
-                                  subject_cert, issuer_cert,
-                                  &any_revoked, &any_no_crl, &any_crl_too_old);
+        rc = queue_revocation_check (ctrl, &pending,
+                                     (flags & VALIDATE_FLAG_CHAIN_MODEL),
+                                     listmode, listfp,
+                                     subject_cert, issuer_cert,
+                                     &any_revoked, &any_no_crl,
+                                     &any_crl_too_old);
       if (rc)
         goto leave;
 
@@ -1844,6 +1990,13 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
                   ctrl->offline ? "offline" : "--disable-crl-checks");
     }
 
+  /* Now that the chain is complete, check all links for revocation.  */
+  if (!rc && pending)
+    rc = run_pending_checks (ctrl, pending,
+                             (flags & VALIDATE_FLAG_CHAIN_MODEL),
+                             listmode, listfp,
+                             &any_revoked, &any_no_crl, &any_crl_too_old);
+
   if (!rc)
     { /* If we encountered an error somewhere during the checks, set
          the error code to the most critical one */
@@ -1938,12 +2091,114 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
       xfree (chain);
       chain = ci_next;
     }
+  while (pending)
+    {
+      pending_check_t pc_next = pending->next;
+      ksba_cert_release (pending->subject_cert);
+      ksba_cert_release (pending->issuer_cert);
+      xfree (pending);
+      pending = pc_next;
+    }
   ksba_cert_release (issuer_cert);
   ksba_cert_release (subject_cert);
   return rc;
 }
 
 
+/* Return a value describing the session settings which affect the
+   revocation checks.  */
+static unsigned int
+validated_cache_mode (ctrl_t ctrl)
+{
+  return (!!ctrl->offline) | (ctrl->use_ocsp << 1);
+}
+
+
+/* Return the cached result for the target certificate with the
+   fingerprint FPR or NULL.  */
+static struct validated_cache_s *
+validated_cache_lookup (ctrl_t ctrl, const unsigned char *fpr,
+                        unsigned int flags)
+{
+  struct validated_cache_s *item, *prev, *next;
+  time_t now = gnupg_get_time ();
+  unsigned int mode = validated_cache_mode (ctrl);
+
+  for (prev = NULL, item = validated_cache; item; item = next)
+    {
+      next = item->next;
+      if (item->expires <= now
+          || item->expires > now + VALIDATED_CACHE_TTL)
+        {
+          if (prev)
+            prev->next = next;
+          else
+            validated_cache = next;
+          validated_cache_size--;
+          xfree (item);
+          continue;
+        }
+      if (item->flags == flags && item->mode == mode
+          && !memcmp (item->fpr, fpr, 20))
+        return item;
+      prev = item;
+    }
+  return NULL;
+}
+
+
+/* Store the successful validation of CERT with FLAGS in the cache.
+   EXPTIME is the nearest expiration time of the chain.  */
+static void
+validated_cache_put (ctrl_t ctrl, ksba_cert_t cert, const unsigned char *fpr,
+                     unsigned int flags, ksba_isotime_t exptime)
+{
+  struct validated_cache_s *item, *prev;
+  time_t exp;
+  size_t buflen;
+  char buf[1];
+
+  if (validated_cache_size >= VALIDATED_CACHE_SIZE)
+    {
+      /* Drop the oldest item which is the last one.  */
+      for (prev = NULL, item = validated_cache; item->next;
+           prev = item, item = item->next)
+        ;
+      if (prev)
+        prev->next = NULL;
+      else
+        validated_cache = NULL;
+      validated_cache_size--;
+      xfree (item);
+    }
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    return;  /* Not a problem; it is only a cache.  */
+
+  item->expires = gnupg_get_time () + VALIDATED_CACHE_TTL;
+  if (*exptime)
+    {
+      exp = isotime2epoch (exptime);
+      if (exp != (time_t)(-1) && exp < item->expires)
+        item->expires = exp;
+    }
+  item->flags = flags;
+  item->mode = validated_cache_mode (ctrl);
+  if (!ksba_cert_get_user_data (cert, "is_qualified",
+                                &buf, sizeof (buf), &buflen) && buflen)
+    item->is_qualified = !!*buf;
+  else
+    item->is_qualified = -1;
+  gnupg_copy_time (item->exptime, exptime);
+  memcpy (item->fpr, fpr, 20);
+
+  item->next = validated_cache;
+  validated_cache = item;
+  validated_cache_size++;
+}
+
+
 /* Validate a certificate chain.  For a description see
    do_validate_chain.  This function is a wrapper to handle a root
    certificate with the chain_model flag set.  If RETFLAGS is not
@@ -1965,6 +2220,9 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
   int rc;
   struct rootca_flags_s rootca_flags;
   unsigned int dummy_retflags;
+  ksba_isotime_t exptime;
+  unsigned char fpr[20];
+  int use_cache;
 
   if (!retflags)
     retflags = &dummy_retflags;
@@ -1982,8 +2240,39 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
 
   memset (&rootca_flags, 0, sizeof rootca_flags);
 
+  /* A chain validated with the shell model does not depend on
+     CHECKTIME; thus we can use a previous result.  We don't do this
+     for listings because they print the details of the checks and
+     not if auditing has been requested.  */
+  use_cache = (!(flags & (VALIDATE_FLAG_CHAIN_MODEL | VALIDATE_FLAG_STEED))
+               && !listmode && !ctrl->audit
+               && !opt.no_chain_validation && !opt.force_crl_refresh);
+  if (use_cache)
+    {
+      struct validated_cache_s *item;
+
+      gpgsm_get_fingerprint (cert, GCRY_MD_SHA1, fpr, NULL);
+      item = validated_cache_lookup (ctrl, fpr, flags);
+      if (item)
+        {
+          if (opt.verbose)
+            log_info (_("certificate chain is good (cached)\n"));
+          gnupg_get_isotime (ctrl->current_time);
+          if (item->is_qualified != -1)
+            {
+              char buf[1];
+
+              buf[0] = item->is_qualified;
+              ksba_cert_set_user_data (cert, "is_qualified", buf, 1);
+            }
+          if (r_exptime)
+            gnupg_copy_time (r_exptime, item->exptime);
+          return 0;
+        }
+    }
+
   rc = do_validate_chain (ctrl, cert, checktime,
-                          r_exptime, listmode, listfp, flags,
+                          exptime, listmode, listfp, flags,
                           &rootca_flags);
   if (!rc && (flags & VALIDATE_FLAG_STEED))
     {
@@ -1995,11 +2284,16 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
     {
       do_list (0, listmode, listfp, _("switching to chain model"));
       rc = do_validate_chain (ctrl, cert, checktime,
-                              r_exptime, listmode, listfp,
+                              exptime, listmode, listfp,
                               (flags |= VALIDATE_FLAG_CHAIN_MODEL),
                               &rootca_flags);
       *retflags |= VALIDATE_FLAG_CHAIN_MODEL;
     }
+  else if (!rc && use_cache)
+    validated_cache_put (ctrl, cert, fpr, flags, exptime);
+
+  if (r_exptime)
+    gnupg_copy_time (r_exptime, exptime);
 
   if (opt.verbose)
     do_list (0, listmode, listfp, _("validation model used: %s"),
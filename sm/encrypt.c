@@ -59,6 +59,10 @@ struct encrypt_cb_parm_s
   int bufsize;
   unsigned char *buffer;
   int buflen;
+  int bufstart;               /* Offset of the unprocessed data.  */
+  const unsigned char *map;   /* The mapped input file or NULL.  */
+  size_t maplen;
+  size_t mapoff;
 };
 
 
@@ -242,41 +246,70 @@ encrypt_cb (void *cb_value, char *buffer, size_t count, size_t *nread)
   if (count < blklen)
     BUG ();
 
-  if (!parm->eof_seen)
-    { /* fillup the buffer */
-      p = parm->buffer;
-      for (n=parm->buflen; n < parm->bufsize; n++)
+  if (parm->map && !parm->eof_seen)
+    { /* Encrypt directly from the mapped file.  */
+      n = parm->maplen - parm->mapoff;
+      if (n >= blklen)
+        {
+          if (n > count)
+            n = count;
+          n = n/blklen * blklen;
+          gcry_cipher_encrypt (parm->dek->chd, buffer, n,
+                               parm->map + parm->mapoff, n);
+          parm->mapoff += n;
+          *nread = n;
+          return 0;
+        }
+      /* Less than a block is left; copy it for the padding code.  */
+      memcpy (parm->buffer, parm->map + parm->mapoff, n);
+      parm->mapoff += n;
+      parm->buflen = n;
+      parm->eof_seen = 1;
+    }
+
+  if (!parm->eof_seen && parm->buflen - parm->bufstart < count)
+    { /* Move the rest to the front and fill up the buffer.  */
+      parm->buflen -= parm->bufstart;
+      memmove (parm->buffer, parm->buffer + parm->bufstart, parm->buflen);
+      parm->bufstart = 0;
+      while (parm->buflen < parm->bufsize)
         {
-          int c = es_getc (parm->fp);
-          if (c == EOF)
+          size_t nbytes;
+
+          if (es_read (parm->fp, parm->buffer + parm->buflen,
+                       parm->bufsize - parm->buflen, &nbytes))
+            {
+              parm->readerror = errno;
+              return -1;
+            }
+          if (!nbytes)
             {
-              if (es_ferror (parm->fp))
-                {
-                  parm->readerror = errno;
-                  return -1;
-                }
               parm->eof_seen = 1;
               break;
             }
-          p[n] = c;
+          parm->buflen += nbytes;
         }
-      parm->buflen = n;
     }
 
-  n = parm->buflen < count? parm->buflen : count;
+  p = parm->buffer + parm->bufstart;
+  n = parm->buflen - parm->bufstart;
+  if (n > count)
+    n = count;
   n = n/blklen * blklen;
   if (n)
     { /* encrypt the stuff */
-      gcry_cipher_encrypt (parm->dek->chd, buffer, n, parm->buffer, n);
+      gcry_cipher_encrypt (parm->dek->chd, buffer, n, p, n);
       *nread = n;
-      /* Who cares about cycles, take the easy way and shift the buffer */
-      parm->buflen -= n;
-      memmove (parm->buffer, parm->buffer+n, parm->buflen);
+      parm->bufstart += n;
     }
   else if (parm->eof_seen)
     { /* no complete block but eof: add padding */
-      /* fixme: we should try to do this also in the above code path */
-      int i, npad = blklen - (parm->buflen % blklen);
+      int i, npad;
+
+      parm->buflen -= parm->bufstart;
+      memmove (parm->buffer, p, parm->buflen);
+      parm->bufstart = 0;
+      npad = blklen - (parm->buflen % blklen);
       p = parm->buffer;
       for (n=parm->buflen, i=0; n < parm->bufsize && i < npad; n++, i++)
         p[n] = npad;
@@ -456,14 +489,22 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
     }
 
   encparm.dek = dek;
-  /* Use a ~8k (AES) or ~4k (3DES) buffer */
-  encparm.bufsize = 500 * dek->ivlen;
+  /* Use a large buffer with a multiple of the block length.  */
+  encparm.bufsize = GPGSM_IOBUFSIZE / dek->ivlen * dek->ivlen;
   encparm.buffer = xtrymalloc (encparm.bufsize);
   if (!encparm.buffer)
     {
       rc = out_of_core ();
       goto leave;
     }
+  /* If the input is a regular file we encrypt directly from the
+     file's pages without copying it through the buffer.  */
+  {
+    const void *mem;
+
+    if (!gpgsm_map_fd (data_fd, &mem, &encparm.maplen))
+      encparm.map = mem;
+  }
 
   audit_log_s (ctrl->audit, AUDIT_SESSION_KEY, dek->algoid);
 
@@ -573,5 +614,6 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
   xfree (dek);
   es_fclose (data_fp);
   xfree (encparm.buffer);
+  gpgsm_unmap_fd (encparm.map, encparm.maplen);
   return rc;
 }
@@ -39,6 +39,10 @@
 
 #define MAX_DIGEST_LEN 64
 
+/* The size of the chunks used to process the data for signing and
+   encryption.  This is also the size of the octet strings we write.  */
+#define GPGSM_IOBUFSIZE (64*1024)
+
 struct keyserver_spec
 {
   struct keyserver_spec *next;
@@ -424,6 +428,8 @@ int gpgsm_agent_scd_keypairinfo (ctrl_t ctrl, strlist_t *r_list);
 int gpgsm_agent_istrusted (ctrl_t ctrl, ksba_cert_t cert, const char *hexfpr,
                            struct rootca_flags_s *rootca_flags);
 int gpgsm_agent_havekey (ctrl_t ctrl, const char *hexkeygrip);
+void gpgsm_agent_begin_keygrip_cache (ctrl_t ctrl);
+void gpgsm_agent_end_keygrip_cache (void);
 int gpgsm_agent_marktrusted (ctrl_t ctrl, ksba_cert_t cert);
 int gpgsm_agent_learn (ctrl_t ctrl);
 int gpgsm_agent_passwd (ctrl_t ctrl, const char *hexkeygrip, const char *desc);
@@ -446,6 +452,9 @@ gpg_error_t gpgsm_agent_export_key (ctrl_t ctrl, const char *keygrip,
 int gpgsm_dirmngr_isvalid (ctrl_t ctrl,
                            ksba_cert_t cert, ksba_cert_t issuer_cert,
                            int use_ocsp);
+gpg_error_t gpgsm_dirmngr_isvalid_list (ctrl_t ctrl, ksba_cert_t *certs,
+                                        ksba_cert_t *issuers, int ncerts,
+                                        int use_ocsp, gpg_error_t *r_errs);
 int gpgsm_dirmngr_lookup (ctrl_t ctrl, strlist_t names, int cache_only,
                           void (*cb)(void*, ksba_cert_t), void *cb_value);
 int gpgsm_dirmngr_run_command (ctrl_t ctrl, const char *command,
@@ -458,6 +467,8 @@ gpg_error_t transform_sigval (const unsigned char *sigval, size_t sigvallen,
                               int mdalgo,
                               unsigned char **r_newsigval,
                               size_t *r_newsigvallen);
+gpg_error_t gpgsm_map_fd (int fd, const void **r_mem, size_t *r_len);
+void gpgsm_unmap_fd (const void *mem, size_t len);
 
 
 
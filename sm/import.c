@@ -38,8 +38,9 @@
 #include "../common/membuf.h"
 #include "minip12.h"
 
-/* The arbitrary limit of one PKCS#12 object.  */
-#define MAX_P12OBJ_SIZE 128 /*kb*/
+/* The arbitrary limit of one PKCS#12 object.  The object is parsed
+   from a stream and thus this does not limit the memory used.  */
+#define MAX_P12OBJ_SIZE 16384 /*kb*/
 
 
 struct stats_s {
@@ -522,7 +523,12 @@ gpgsm_import (ctrl_t ctrl, int in_fd, int reimport_mode)
   if (reimport_mode)
     rc = reimport_one (ctrl, &stats, in_fd);
   else
-    rc = import_one (ctrl, &stats, in_fd);
+    {
+      /* On error the certificates are stored one by one.  */
+      keydb_bulk_begin ();
+      rc = import_one (ctrl, &stats, in_fd);
+      keydb_bulk_end ();
+    }
   print_imported_summary (ctrl, &stats);
   /* If we never printed an error message do it now so that a command
      line invocation will return with an error (log_error keeps a
@@ -542,6 +548,8 @@ gpgsm_import_files (ctrl_t ctrl, int nfiles, char **files,
 
   memset (&stats, 0, sizeof stats);
 
+  /* On error the certificates are stored one by one.  */
+  keydb_bulk_begin ();
   if (!nfiles)
     rc = import_one (ctrl, &stats, 0);
   else
@@ -555,6 +563,7 @@ gpgsm_import_files (ctrl_t ctrl, int nfiles, char **files,
             rc = 0;
         }
     }
+  keydb_bulk_end ();
   print_imported_summary (ctrl, &stats);
   /* If we never printed an error message do it now so that a command
      line invocation will return with an error (log_error keeps a
@@ -691,6 +700,74 @@ store_cert_cb (void *opaque,
 }
 
 
+/* Object passed to p12_reader_read.  */
+struct p12_reader_parm_s
+{
+  ksba_reader_t reader;
+  gpg_error_t err;          /* The first read error.  */
+  size_t ntotal;            /* Number of bytes read so far.  */
+  char pending[18];         /* Bytes already read from READER.  */
+  size_t npending;
+};
+
+
+/* The read function of the stream used to pass the PKCS#12 object
+   from the reader to the parser.  */
+static gpgrt_ssize_t
+p12_reader_read (void *cookie, void *buffer, size_t size)
+{
+  struct p12_reader_parm_s *parm = cookie;
+  gpg_error_t err;
+  size_t nread;
+
+  if (parm->npending)
+    {
+      nread = parm->npending < size? parm->npending : size;
+      memcpy (buffer, parm->pending, nread);
+      parm->npending -= nread;
+      memmove (parm->pending, parm->pending + nread, parm->npending);
+      return nread;
+    }
+
+  if (parm->ntotal >= MAX_P12OBJ_SIZE*1024)
+    {
+      /* Arbitrary limit to avoid DoS attacks. */
+      if (!parm->err)
+        {
+          parm->err = gpg_error (GPG_ERR_TOO_LARGE);
+          log_error ("pkcs#12 object is larger than %dk\n", MAX_P12OBJ_SIZE);
+        }
+      gpg_err_set_errno (E2BIG);
+      return -1;
+    }
+
+  err = ksba_reader_read (parm->reader, buffer, size, &nread);
+  if (gpg_err_code (err) == GPG_ERR_EOF)
+    return 0;
+  if (err)
+    {
+      if (!parm->err)
+        {
+          parm->err = err;
+          log_error (_("error reading input: %s\n"), gpg_strerror (err));
+        }
+      gpg_err_set_errno (EIO);
+      return -1;
+    }
+  parm->ntotal += nread;
+  return nread;
+}
+
+
+static es_cookie_io_functions_t p12_reader_functions =
+  {
+    p12_reader_read,
+    NULL,
+    NULL,
+    NULL
+  };
+
+
 /* Assume that the reader is at a pkcs#12 message and try to import
    certificates from that stupid format.  We will transfer secret
    keys to the agent.  */
@@ -698,12 +775,11 @@ static gpg_error_t
 parse_p12 (ctrl_t ctrl, ksba_reader_t reader, struct stats_s *stats)
 {
   gpg_error_t err = 0;
-  char buffer[1024];
-  size_t ntotal, nread;
-  membuf_t p12mbuf;
-  char *p12buffer = NULL;
-  size_t p12buflen;
-  size_t p12bufoff;
+  struct p12_reader_parm_s p12parm;
+  estream_t p12fp = NULL;
+  size_t nread;
+  int c;
+  int skip_prefix = 0;
   gcry_mpi_t *kparms = NULL;
   struct rsa_secret_key_s sk;
   char *passphrase = NULL;
@@ -724,50 +800,47 @@ parse_p12 (ctrl_t ctrl, ksba_reader_t reader, struct stats_s *stats)
   store_cert_parm.ctrl = ctrl;
   store_cert_parm.stats = stats;
 
-  init_membuf (&p12mbuf, 4096);
-  ntotal = 0;
-  while (!(err = ksba_reader_read (reader, buffer, sizeof buffer, &nread)))
-    {
-      if (ntotal >= MAX_P12OBJ_SIZE*1024)
-        {
-          /* Arbitrary limit to avoid DoS attacks. */
-          err = gpg_error (GPG_ERR_TOO_LARGE);
-          log_error ("pkcs#12 object is larger than %dk\n", MAX_P12OBJ_SIZE);
-          break;
-        }
-      put_membuf (&p12mbuf, buffer, nread);
-      ntotal += nread;
-    }
+  memset (&p12parm, 0, sizeof p12parm);
+  p12parm.reader = reader;
+
+  /* GnuPG 2.0.4 accidentally created binary P12 files with the string
+     "The passphrase is %s encoded.\n\n" prepended to the ASN.1 data.
+     We fix that here.  */
+  while (p12parm.npending < sizeof p12parm.pending
+         && !(err = ksba_reader_read (reader,
+                                      p12parm.pending + p12parm.npending,
+                                      sizeof p12parm.pending
+                                      - p12parm.npending, &nread)))
+    p12parm.npending += nread;
   if (gpg_err_code (err) == GPG_ERR_EOF)
     err = 0;
-  if (!err)
-    {
-      p12buffer = get_membuf (&p12mbuf, &p12buflen);
-      if (!p12buffer)
-        err = gpg_error_from_syserror ();
-    }
   if (err)
     {
       log_error (_("error reading input: %s\n"), gpg_strerror (err));
       goto leave;
     }
+  p12parm.ntotal = p12parm.npending;
+  if (p12parm.npending == 18
+      && !memcmp (p12parm.pending, "The passphrase is ", 18))
+    {
+      skip_prefix = 1;
+      p12parm.npending = 0;
+    }
 
-  /* GnuPG 2.0.4 accidentally created binary P12 files with the string
-     "The passphrase is %s encoded.\n\n" prepended to the ASN.1 data.
-     We fix that here.  */
-  if (p12buflen > 29 && !memcmp (p12buffer, "The passphrase is ", 18))
+  p12fp = es_fopencookie (&p12parm, "r", p12_reader_functions);
+  if (!p12fp)
     {
-      for (p12bufoff=18;
-           p12bufoff < p12buflen && p12buffer[p12bufoff] != '\n';
-           p12bufoff++)
+      err = gpg_error_from_syserror ();
+      log_error ("error creating stream: %s\n", gpg_strerror (err));
+      goto leave;
+    }
+  if (skip_prefix)
+    {
+      while ((c = es_getc (p12fp)) != EOF && c != '\n')
         ;
-      p12bufoff++;
-      if (p12bufoff < p12buflen && p12buffer[p12bufoff] == '\n')
-        p12bufoff++;
+      if (c != EOF && (c = es_getc (p12fp)) != EOF && c != '\n')
+        es_ungetc (c, p12fp);
     }
-  else
-    p12bufoff = 0;
-
 
   err = gpgsm_agent_ask_passphrase
     (ctrl,
@@ -776,8 +849,8 @@ parse_p12 (ctrl_t ctrl, ksba_reader_t reader, struct stats_s *stats)
   if (err)
     goto leave;
 
-  kparms = p12_parse (p12buffer + p12bufoff, p12buflen - p12bufoff,
-                      passphrase, store_cert_cb, &store_cert_parm, &bad_pass);
+  kparms = p12_parse_stream (p12fp, passphrase,
+                             store_cert_cb, &store_cert_parm, &bad_pass);
 
   xfree (passphrase);
   passphrase = NULL;
@@ -785,7 +858,7 @@ parse_p12 (ctrl_t ctrl, ksba_reader_t reader, struct stats_s *stats)
   if (!kparms)
     {
       log_error ("error parsing or decrypting the PKCS#12 file\n");
-      err = gpg_error (GPG_ERR_INV_OBJ);
+      err = p12parm.err? p12parm.err : gpg_error (GPG_ERR_INV_OBJ);
       goto leave;
     }
 
@@ -921,8 +994,7 @@ parse_p12 (ctrl_t ctrl, ksba_reader_t reader, struct stats_s *stats)
   gcry_cipher_close (cipherhd);
   xfree (wrappedkey);
   xfree (kek);
-  xfree (get_membuf (&p12mbuf, NULL));
-  xfree (p12buffer);
+  es_fclose (p12fp);
 
   if (bad_pass)
     {
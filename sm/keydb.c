@@ -29,6 +29,7 @@
 
 #include "gpgsm.h"
 #include "../kbx/keybox.h"
+#include "../common/host2net.h"
 #include "keydb.h"
 #include "../common/i18n.h"
 
@@ -54,6 +55,23 @@ static int used_resources;
 /* Whether we have successfully registered any resource.  */
 static int any_registered;
 
+/* A slot of the hash table of fingerprints used for bulk stores.  */
+struct bulk_slot_s
+{
+  unsigned int used:1;
+  unsigned char fpr[20];
+};
+
+/* The state of a bulk store operation; see keydb_bulk_begin.  */
+static struct
+{
+  KEYDB_HANDLE hd;            /* The locked handle used for all stores.  */
+  struct bulk_slot_s *slots;  /* Hash table with the fingerprints of the
+                               * certificates stored permanently.  */
+  unsigned int size;          /* Allocated number of slots.  */
+  unsigned int used;          /* Number of used slots.  */
+} bulk;
+
 
 struct keydb_handle {
 
@@ -614,6 +632,13 @@ unlock_all (KEYDB_HANDLE hd)
   if (!hd->locked || hd->keep_lock)
     return;
 
+  /* During a bulk store the lock is owned by the bulk handle.  */
+  if (bulk.hd && hd != bulk.hd)
+    {
+      hd->locked = 0;
+      return;
+    }
+
   for (i=hd->used-1; i >= 0; i--)
     {
       switch (hd->active[i].type)
@@ -1285,6 +1310,113 @@ keydb_search_subject (ctrl_t ctrl, KEYDB_HANDLE hd, const char *name)
 
 
 
+/* Return true if the certificate with fingerprint FPR has been
+ * stored permanently during the current bulk operation.  */
+static int
+bulk_has_fpr (const unsigned char *fpr)
+{
+  unsigned int i;
+
+  if (!bulk.size)
+    return 0;
+  for (i = buf32_to_uint (fpr) % bulk.size; bulk.slots[i].used;
+       i = (i + 1) % bulk.size)
+    if (!memcmp (bulk.slots[i].fpr, fpr, 20))
+      return 1;
+  return 0;
+}
+
+
+/* Remember the fingerprint FPR for the current bulk operation.
+ * Errors are ignored because this is only an optimization.  */
+static void
+bulk_add_fpr (const unsigned char *fpr)
+{
+  struct bulk_slot_s *slots, *oldslots;
+  unsigned int size, oldsize, i, j;
+
+  if (bulk_has_fpr (fpr))
+    return;
+
+  if (2 * (bulk.used + 1) > bulk.size)
+    {
+      size = bulk.size? 2 * bulk.size : 1024;
+      slots = xtrycalloc (size, sizeof *slots);
+      if (!slots)
+        return;
+      oldslots = bulk.slots;
+      oldsize = bulk.size;
+      bulk.slots = slots;
+      bulk.size = size;
+      bulk.used = 0;
+      for (j=0; j < oldsize; j++)
+        if (oldslots[j].used)
+          bulk_add_fpr (oldslots[j].fpr);
+      xfree (oldslots);
+    }
+
+  for (i = buf32_to_uint (fpr) % bulk.size; bulk.slots[i].used;
+       i = (i + 1) % bulk.size)
+    ;
+  bulk.slots[i].used = 1;
+  memcpy (bulk.slots[i].fpr, fpr, 20);
+  bulk.used++;
+}
+
+
+/* Start a bulk store operation.  Until keydb_bulk_end is called all
+ * calls to keydb_store_cert use one handle and keep the lock; the
+ * fingerprints of the stored certificates are remembered so that
+ * duplicates are detected without a search.  This is used to import
+ * a large number of certificates.  */
+gpg_error_t
+keydb_bulk_begin (void)
+{
+  gpg_error_t err;
+  KEYDB_HANDLE hd;
+
+  if (bulk.hd)
+    return gpg_error (GPG_ERR_CONFLICT);
+
+  hd = keydb_new ();
+  if (!hd)
+    return gpg_error_from_syserror ();
+  err = keydb_lock (hd);
+  if (err)
+    {
+      keydb_release (hd);
+      return err;
+    }
+  bulk.hd = hd;
+  return 0;
+}
+
+
+/* Finish a bulk store operation and release the lock.  */
+void
+keydb_bulk_end (void)
+{
+  KEYDB_HANDLE hd = bulk.hd;
+
+  if (!hd)
+    return;
+  bulk.hd = NULL;
+  keydb_release (hd);
+  xfree (bulk.slots);
+  bulk.slots = NULL;
+  bulk.size = bulk.used = 0;
+}
+
+
+/* Release the handle KH used by keydb_store_cert.  */
+static void
+release_store_handle (KEYDB_HANDLE kh)
+{
+  if (kh != bulk.hd)
+    keydb_release (kh);
+}
+
+
 /* Store the certificate in the key DB but make sure that it does not
    already exists.  We do this simply by comparing the fingerprint.
    If EXISTED is not NULL it will be set to true if the certificate
@@ -1305,11 +1437,27 @@ keydb_store_cert (ctrl_t ctrl, ksba_cert_t cert, int ephemeral, int *existed)
       return gpg_error (GPG_ERR_GENERAL);
     }
 
-  kh = keydb_new ();
-  if (!kh)
+  if (bulk.hd)
     {
-      log_error (_("failed to allocate keyDB handle\n"));
-      return gpg_error (GPG_ERR_ENOMEM);;
+      /* A certificate already stored by this bulk operation needs no
+       * further action.  */
+      if (bulk_has_fpr (fpr))
+        {
+          if (existed)
+            *existed = 1;
+          return 0;
+        }
+      kh = bulk.hd;
+      keydb_search_reset (kh);
+    }
+  else
+    {
+      kh = keydb_new ();
+      if (!kh)
+        {
+          log_error (_("failed to allocate keyDB handle\n"));
+          return gpg_error (GPG_ERR_ENOMEM);;
+        }
     }
 
   /* Set the ephemeral flag so that the search looks at all
@@ -1318,12 +1466,15 @@ keydb_store_cert (ctrl_t ctrl, ksba_cert_t cert, int ephemeral, int *existed)
 
   rc = lock_all (kh);
   if (rc)
-    return rc;
+    {
+      release_store_handle (kh);
+      return rc;
+    }
 
   rc = keydb_search_fpr (ctrl, kh, fpr);
   if (rc != -1)
     {
-      keydb_release (kh);
+      release_store_handle (kh);
       if (!rc)
         {
           if (existed)
@@ -1340,6 +1491,8 @@ keydb_store_cert (ctrl_t ctrl, ksba_cert_t cert, int ephemeral, int *existed)
                              gpg_strerror (rc));
                   return rc;
                 }
+              if (bulk.hd)
+                bulk_add_fpr (fpr);
             }
           return 0; /* okay */
         }
@@ -1356,7 +1509,7 @@ keydb_store_cert (ctrl_t ctrl, ksba_cert_t cert, int ephemeral, int *existed)
   if (rc)
     {
       log_error (_("error finding writable keyDB: %s\n"), gpg_strerror (rc));
-      keydb_release (kh);
+      release_store_handle (kh);
       return rc;
     }
 
@@ -1364,10 +1517,12 @@ keydb_store_cert (ctrl_t ctrl, ksba_cert_t cert, int ephemeral, int *existed)
   if (rc)
     {
       log_error (_("error storing certificate: %s\n"), gpg_strerror (rc));
-      keydb_release (kh);
+      release_store_handle (kh);
       return rc;
     }
-  keydb_release (kh);
+  if (bulk.hd && !ephemeral)
+    bulk_add_fpr (fpr);
+  release_store_handle (kh);
   return 0;
 }
 
@@ -1435,6 +1435,10 @@ list_internal_keys (ctrl_t ctrl, strlist_t names, estream_t fp,
       goto leave;
     }
 
+  /* Avoid asking the agent for each certificate.  */
+  if (mode)
+    gpgsm_agent_begin_keygrip_cache (ctrl);
+
   if (!names)
     ndesc = 1;
   else
@@ -1588,6 +1592,7 @@ list_internal_keys (ctrl_t ctrl, strlist_t names, estream_t fp,
     log_error ("keydb_search failed: %s\n", gpg_strerror (rc));
 
  leave:
+  gpgsm_agent_end_keygrip_cache ();
   ksba_cert_release (cert);
   ksba_cert_release (lastcert);
   xfree (desc);
@@ -33,8 +33,10 @@
 #include <unistd.h>
 #endif
 
+#include "../common/util.h"
 #include "../common/logging.h"
 #include "../common/utf8conv.h"
+#include "../common/membuf.h"
 #include "minip12.h"
 
 #ifndef DIM
@@ -178,10 +180,11 @@ struct tag_info
 
 /* Parse the buffer at the address BUFFER which is of SIZE and return
    the tag and the length part from the TLV triplet.  Update BUFFER
-   and SIZE on success.  Checks that the encoded length does not
-   exhaust the length of the provided buffer. */
+   and SIZE on success.  Unlike parse_tag this does not check that the
+   value fits into the buffer. */
 static int
-parse_tag (unsigned char const **buffer, size_t *size, struct tag_info *ti)
+parse_tag_header (unsigned char const **buffer, size_t *size,
+                  struct tag_info *ti)
 {
   int c;
   unsigned long tag;
@@ -250,6 +253,24 @@ parse_tag (unsigned char const **buffer, size_t *size, struct tag_info *ti)
   if (ti->class == UNIVERSAL && !ti->tag)
     ti->length = 0;
 
+  *buffer = buf;
+  *size = length;
+  return 0;
+}
+
+
+/* Parse the buffer at the address BUFFER which is of SIZE and return
+   the tag and the length part from the TLV triplet.  Update BUFFER
+   and SIZE on success.  Checks that the encoded length does not
+   exhaust the length of the provided buffer. */
+static int
+parse_tag (unsigned char const **buffer, size_t *size, struct tag_info *ti)
+{
+  const unsigned char *buf = *buffer;
+  size_t length = *size;
+
+  if (parse_tag_header (&buf, &length, ti))
+    return -1;
   if (ti->length > length)
     return -1; /* data larger than buffer. */
 
@@ -259,6 +280,170 @@ parse_tag (unsigned char const **buffer, size_t *size, struct tag_info *ti)
 }
 
 
+/* Read a TLV header from FP and parse it into TI.  The raw header is
+   stored at HDR which must provide space for MAX_TAG_HDR bytes; its
+   length is stored at R_NHDR.  */
+#define MAX_TAG_HDR 16
+static int
+read_tag (estream_t fp, unsigned char *hdr, size_t *r_nhdr,
+          struct tag_info *ti)
+{
+  const unsigned char *p;
+  size_t n = 0;
+  size_t length;
+  int c, count;
+
+  c = es_getc (fp);
+  if (c == EOF)
+    return -1;
+  hdr[n++] = c;
+  if ((c & 0x1f) == 0x1f)
+    {
+      do
+        {
+          c = es_getc (fp);
+          if (c == EOF || n > 5)
+            return -1; /* premature eof or tag too large */
+          hdr[n++] = c;
+        }
+      while (c & 0x80);
+    }
+
+  c = es_getc (fp);
+  if (c == EOF)
+    return -1;
+  hdr[n++] = c;
+  if ((c & 0x80) && c != 0x80 && c != 0xff)
+    {
+      count = c & 0x7f;
+      if (count > sizeof (unsigned long))
+        return -1; /* length too large */
+      for (; count; count--)
+        {
+          c = es_getc (fp);
+          if (c == EOF)
+            return -1;
+          hdr[n++] = c;
+        }
+    }
+
+  p = hdr;
+  length = n;
+  if (parse_tag_header (&p, &length, ti))
+    return -1;
+  *r_nhdr = n;
+  return 0;
+}
+
+
+/* Read exactly LENGTH bytes from FP and append them to MB.  */
+static int
+copy_bytes (estream_t fp, membuf_t *mb, unsigned long length)
+{
+  char buffer[4096];
+  size_t n, nread;
+
+  while (length)
+    {
+      n = length < sizeof buffer? length : sizeof buffer;
+      if (es_read (fp, buffer, n, &nread) || nread != n)
+        return -1;
+      put_membuf (mb, buffer, n);
+      length -= n;
+    }
+  wipememory (buffer, sizeof buffer);
+  return 0;
+}
+
+
+/* Read a complete TLV object from FP and append it to MB.  The tag
+   of the object is stored at TI.  Objects with an indefinite length
+   are read up to their end-of-contents marker.  */
+static int
+read_element (estream_t fp, membuf_t *mb, struct tag_info *ti, int depth)
+{
+  unsigned char hdr[MAX_TAG_HDR];
+  size_t nhdr;
+  struct tag_info ti2;
+
+  if (depth > 32)
+    return -1; /* Nested too deeply.  */
+  if (read_tag (fp, hdr, &nhdr, ti))
+    return -1;
+  put_membuf (mb, hdr, nhdr);
+  if (!ti->ndef)
+    return copy_bytes (fp, mb, ti->length);
+  if (!ti->is_constructed)
+    return -1;
+  do
+    {
+      if (read_element (fp, mb, &ti2, depth + 1))
+        return -1;
+    }
+  while (!(ti2.class == UNIVERSAL && !ti2.tag && !ti2.is_constructed));
+  return 0;
+}
+
+
+/* The state for reading the content of a constructed octet string
+   as a plain stream; see cram_octet_string.  */
+struct cram_parm_s
+{
+  estream_t fp;          /* The stream with the octet strings.  */
+  unsigned long left;    /* Bytes left in the current octet string.  */
+  int eof;               /* The end-of-contents has been seen.  */
+};
+
+
+static gpgrt_ssize_t
+cram_cookie_read (void *cookie, void *buffer, size_t size)
+{
+  struct cram_parm_s *parm = cookie;
+  unsigned char hdr[MAX_TAG_HDR];
+  struct tag_info ti;
+  size_t n, nhdr, nread;
+  size_t total = 0;
+
+  while (total < size && !parm->eof)
+    {
+      if (!parm->left)
+        {
+          if (read_tag (parm->fp, hdr, &nhdr, &ti))
+            goto bad;
+          if (ti.class == UNIVERSAL && !ti.tag && !ti.is_constructed)
+            parm->eof = 1;
+          else if (ti.class == UNIVERSAL && ti.tag == TAG_OCTET_STRING
+                   && !ti.ndef && !ti.is_constructed)
+            parm->left = ti.length;
+          else
+            goto bad;
+          continue;
+        }
+      n = size - total;
+      if (n > parm->left)
+        n = parm->left;
+      if (es_read (parm->fp, (char *)buffer + total, n, &nread) || !nread)
+        goto bad;
+      parm->left -= nread;
+      total += nread;
+    }
+  return total;
+
+ bad:
+  gpg_err_set_errno (EINVAL);
+  return -1;
+}
+
+
+static es_cookie_io_functions_t cram_cookie_functions =
+  {
+    cram_cookie_read,
+    NULL,
+    NULL,
+    NULL
+  };
+
+
 /* Given an ASN.1 chunk of a structure like:
 
      24 NDEF:       OCTET STRING  -- This is not passed to us
@@ -1490,6 +1675,121 @@ parse_bag_data (const unsigned char *buffer, size_t length, int startoffset,
 }
 
 
+/* Parse one element of the AuthenticatedSafe sequence, i.e. a
+   ContentInfo with the bags, from the buffer at *BUFFER of *SIZE and
+   update BUFFER and SIZE.  P_START is the start of the buffer and
+   only used for diagnostics.  The first private key found is stored
+   at R_RESULT if that is still NULL.  The name of the object being
+   parsed is stored at R_WHERE for error messages.  */
+static int
+parse_authsafe_element (const unsigned char **buffer, size_t *size,
+                        const unsigned char *p_start, const char *pw,
+                        void (*certcb)(void*, const unsigned char*, size_t),
+                        void *certcbarg, gcry_mpi_t **r_result,
+                        int *r_badpass, const char **r_where)
+{
+  struct tag_info ti;
+  const unsigned char *p = *buffer;
+  size_t n = *size;
+  long len;
+  int lenndef;
+
+  *r_where = "bag-sequence";
+  if (parse_tag (&p, &n, &ti))
+    return -1;
+  if (ti.class != UNIVERSAL || ti.tag != TAG_SEQUENCE)
+    return -1;
+  lenndef = ti.ndef;
+  len = ti.length;
+
+  if (parse_tag (&p, &n, &ti))
+    return -1;
+  if (lenndef)
+    len = ti.nhdr;
+  else
+    len -= ti.nhdr;
+
+  if (ti.tag == TAG_OBJECT_ID && ti.length == DIM(oid_encryptedData)
+      && !memcmp (p, oid_encryptedData, DIM(oid_encryptedData)))
+    {
+      size_t consumed = 0;
+
+      p += DIM(oid_encryptedData);
+      n -= DIM(oid_encryptedData);
+      if (!lenndef)
+        len -= DIM(oid_encryptedData);
+      *r_where = "bag.encryptedData";
+      if (parse_bag_encrypted_data (p, n, (p - p_start), &consumed, pw,
+                                    certcb, certcbarg,
+                                    *r_result? NULL : r_result, r_badpass))
+        return -1;
+      if (lenndef)
+        len += consumed;
+    }
+  else if (ti.tag == TAG_OBJECT_ID && ti.length == DIM(oid_data)
+           && !memcmp (p, oid_data, DIM(oid_data)))
+    {
+      if (*r_result)
+        {
+          log_info ("already got an key object, skipping this one\n");
+          p += ti.length;
+          n -= ti.length;
+        }
+      else
+        {
+          size_t consumed = 0;
+
+          p += DIM(oid_data);
+          n -= DIM(oid_data);
+          if (!lenndef)
+            len -= DIM(oid_data);
+          *r_result = parse_bag_data (p, n, (p - p_start), &consumed, pw);
+          if (!*r_result)
+            return -1;
+          if (lenndef)
+            len += consumed;
+        }
+    }
+  else
+    {
+      log_info ("unknown bag type - skipped\n");
+      p += ti.length;
+      n -= ti.length;
+    }
+
+  if (len < 0 || len > n)
+    return -1;
+  p += len;
+  n -= len;
+  if (lenndef)
+    {
+      /* Need to skip the Null Tag. */
+      if (parse_tag (&p, &n, &ti))
+        return -1;
+      if (!(ti.class == UNIVERSAL && !ti.tag && !ti.is_constructed))
+        return -1;
+    }
+
+  *buffer = p;
+  *size = n;
+  return 0;
+}
+
+
+/* Release the key parameters returned by p12_parse.  */
+static void
+release_result (gcry_mpi_t *result)
+{
+  int i;
+
+  if (!result)
+    return;
+  for (i=0; result[i]; i++)
+    gcry_mpi_release (result[i]);
+  gcry_free (result);
+}
+
+
 /* Parse a PKCS12 object and return an array of MPI representing the
    secret key parameters.  This is a very limited implementation in
    that it is only able to look for 3DES encoded encryptedData and
@@ -1506,8 +1806,8 @@ p12_parse (const unsigned char *buffer, size_t length, const char *pw,
   const unsigned char *p_start = buffer;
   size_t n = length;
   const char *where;
-  int bagseqlength, len;
-  int bagseqndef, lenndef;
+  int bagseqlength;
+  int bagseqndef;
   gcry_mpi_t *result = NULL;
   unsigned char *cram_buffer = NULL;
 
@@ -1567,110 +1867,170 @@ p12_parse (const unsigned char *buffer, size_t length, const char *pw,
   bagseqlength = ti.length;
   while (bagseqlength || bagseqndef)
     {
+      const unsigned char *p_elem = p;
+      size_t n_elem = n;
+
 /*       log_debug ( "at offset %u\n", (p - p_start)); */
-      where = "bag-sequence";
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (bagseqndef && ti.class == UNIVERSAL && !ti.tag && !ti.is_constructed)
+      if (bagseqndef && !parse_tag (&p_elem, &n_elem, &ti)
+          && ti.class == UNIVERSAL && !ti.tag && !ti.is_constructed)
         break; /* Ready */
-      if (ti.class != UNIVERSAL || ti.tag != TAG_SEQUENCE)
+      p_elem = p;
+      if (parse_authsafe_element (&p, &n, p_start, pw, certcb, certcbarg,
+                                  &result, r_badpass, &where))
         goto bailout;
-
       if (!bagseqndef)
         {
-          if (bagseqlength < ti.nhdr)
-            goto bailout;
-          bagseqlength -= ti.nhdr;
-          if (bagseqlength < ti.length)
+          if (bagseqlength < p - p_elem)
             goto bailout;
-          bagseqlength -= ti.length;
+          bagseqlength -= p - p_elem;
         }
-      lenndef = ti.ndef;
-      len = ti.length;
+    }
 
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (lenndef)
-        len = ti.nhdr;
-      else
-        len -= ti.nhdr;
+  gcry_free (cram_buffer);
+  return result;
+ bailout:
+  log_error ("error at \"%s\", offset %u\n",
+             where, (unsigned int)(p - p_start));
+  release_result (result);
+  gcry_free (cram_buffer);
+  return NULL;
+}
 
-      if (ti.tag == TAG_OBJECT_ID && ti.length == DIM(oid_encryptedData)
-          && !memcmp (p, oid_encryptedData, DIM(oid_encryptedData)))
-        {
-          size_t consumed = 0;
 
-          p += DIM(oid_encryptedData);
-          n -= DIM(oid_encryptedData);
-          if (!lenndef)
-            len -= DIM(oid_encryptedData);
-          where = "bag.encryptedData";
-          if (parse_bag_encrypted_data (p, n, (p - p_start), &consumed, pw,
-                                        certcb, certcbarg,
-                                        result? NULL : &result, r_badpass))
-            goto bailout;
-          if (lenndef)
-            len += consumed;
-        }
-      else if (ti.tag == TAG_OBJECT_ID && ti.length == DIM(oid_data)
-               && !memcmp (p, oid_data, DIM(oid_data)))
-        {
-          if (result)
-            {
-              log_info ("already got an key object, skipping this one\n");
-              p += ti.length;
-              n -= ti.length;
-            }
-          else
-            {
-              size_t consumed = 0;
-
-              p += DIM(oid_data);
-              n -= DIM(oid_data);
-              if (!lenndef)
-                len -= DIM(oid_data);
-              result = parse_bag_data (p, n, (p - p_start), &consumed, pw);
-              if (!result)
-                goto bailout;
-              if (lenndef)
-                len += consumed;
-            }
-        }
-      else
+/* Parse a PKCS12 object read from the stream FP.  This is the same
+   as p12_parse but does not require the entire object in memory: The
+   outer structure is parsed directly from FP and only one element of
+   the AuthenticatedSafe is read into memory at a time.  Thus the
+   memory required for a large object with many or long certificate
+   chains is bounded by its largest element.  */
+gcry_mpi_t *
+p12_parse_stream (estream_t fp, const char *pw,
+                  void (*certcb)(void*, const unsigned char*, size_t),
+                  void *certcbarg, int *r_badpass)
+{
+  struct tag_info ti;
+  unsigned char hdr[MAX_TAG_HDR];
+  unsigned char oid[DIM(oid_data)];
+  size_t nhdr, nread;
+  const char *where;
+  estream_t bagfp = NULL;
+  struct cram_parm_s cram;
+  membuf_t mb;
+  unsigned char *elem = NULL;
+  size_t elemlen = 0;
+  const unsigned char *p;
+  size_t n;
+  unsigned long bagseqlength;
+  int bagseqndef;
+  gcry_mpi_t *result = NULL;
+
+  *r_badpass = 0;
+  where = "pfx";
+  if (read_tag (fp, hdr, &nhdr, &ti))
+    goto bailout;
+  if (ti.tag != TAG_SEQUENCE)
+    goto bailout;
+
+  where = "pfxVersion";
+  if (read_tag (fp, hdr, &nhdr, &ti))
+    goto bailout;
+  if (ti.tag != TAG_INTEGER || ti.length != 1 || es_getc (fp) != 3)
+    goto bailout;
+
+  where = "authSave";
+  if (read_tag (fp, hdr, &nhdr, &ti))
+    goto bailout;
+  if (ti.tag != TAG_SEQUENCE)
+    goto bailout;
+  if (read_tag (fp, hdr, &nhdr, &ti))
+    goto bailout;
+  if (ti.tag != TAG_OBJECT_ID || ti.length != DIM(oid_data)
+      || es_read (fp, oid, DIM(oid), &nread) || nread != DIM(oid)
+      || memcmp (oid, oid_data, DIM(oid_data)))
+    goto bailout;
+
+  if (read_tag (fp, hdr, &nhdr, &ti))
+    goto bailout;
+  if (ti.class != ASNCONTEXT || ti.tag)
+    goto bailout;
+  if (read_tag (fp, hdr, &nhdr, &ti))
+    goto bailout;
+  if (ti.class != UNIVERSAL || ti.tag != TAG_OCTET_STRING)
+    goto bailout;
+
+  if (ti.is_constructed && ti.ndef)
+    {
+      /* Read the chunks of octet strings (see p12_parse) as one
+         stream.  */
+      where = "cram-bags";
+      memset (&cram, 0, sizeof cram);
+      cram.fp = fp;
+      bagfp = es_fopencookie (&cram, "r", cram_cookie_functions);
+      if (!bagfp)
+        goto bailout;
+    }
+  else
+    bagfp = fp;
+
+  where = "bags";
+  if (read_tag (bagfp, hdr, &nhdr, &ti))
+    goto bailout;
+  if (ti.class != UNIVERSAL || ti.tag != TAG_SEQUENCE)
+    goto bailout;
+  bagseqndef = ti.ndef;
+  bagseqlength = ti.length;
+  while (bagseqlength || bagseqndef)
+    {
+      where = "bag-sequence";
+      init_membuf (&mb, 4096);
+      if (read_element (bagfp, &mb, &ti, 0))
         {
-          log_info ("unknown bag type - skipped\n");
-          p += ti.length;
-          n -= ti.length;
+          xfree (get_membuf (&mb, NULL));
+          goto bailout;
         }
-
-      if (len < 0 || len > n)
+      elem = get_membuf (&mb, &elemlen);
+      if (!elem)
         goto bailout;
-      p += len;
-      n -= len;
-      if (lenndef)
+      if (bagseqndef && ti.class == UNIVERSAL && !ti.tag && !ti.is_constructed)
+        break; /* Ready */
+      if (!bagseqndef)
         {
-          /* Need to skip the Null Tag. */
-          if (parse_tag (&p, &n, &ti))
-            goto bailout;
-          if (!(ti.class == UNIVERSAL && !ti.tag && !ti.is_constructed))
+          if (bagseqlength < elemlen)
             goto bailout;
+          bagseqlength -= elemlen;
         }
+
+      p = elem;
+      n = elemlen;
+      if (parse_authsafe_element (&p, &n, elem, pw, certcb, certcbarg,
+                                  &result, r_badpass, &where))
+        goto bailout;
+      if (n)
+        goto bailout;  /* Garbage after the element.  */
+      wipememory (elem, elemlen);
+      xfree (elem);
+      elem = NULL;
     }
 
-  gcry_free (cram_buffer);
+  if (elem)
+    {
+      wipememory (elem, elemlen);
+      xfree (elem);
+    }
+  if (bagfp != fp)
+    es_fclose (bagfp);
   return result;
+
  bailout:
-  log_error ("error at \"%s\", offset %u\n",
-             where, (unsigned int)(p - p_start));
-  if (result)
+  log_error ("error at \"%s\"\n", where);
+  if (elem)
     {
-      int i;
-
-      for (i=0; result[i]; i++)
-        gcry_mpi_release (result[i]);
-      gcry_free (result);
+      wipememory (elem, elemlen);
+      xfree (elem);
     }
-  gcry_free (cram_buffer);
+  if (bagfp && bagfp != fp)
+    es_fclose (bagfp);
+  release_result (result);
   return NULL;
 }
 
@@ -26,6 +26,10 @@ gcry_mpi_t *p12_parse (const unsigned char *buffer, size_t length,
                        const char *pw,
                        void (*certcb)(void*, const unsigned char*, size_t),
                        void *certcbarg, int *r_badpass);
+gcry_mpi_t *p12_parse_stream (estream_t fp, const char *pw,
+                              void (*certcb)(void*, const unsigned char*,
+                                             size_t),
+                              void *certcbarg, int *r_badpass);
 
 unsigned char *p12_build (gcry_mpi_t *kparms,
                           const void *cert, size_t certlen,
@@ -24,9 +24,14 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "gpgsm.h"
 #include "../common/i18n.h"
@@ -264,3 +269,61 @@ transform_sigval (const unsigned char *sigval, size_t sigvallen, int mdalgo,
 
   return err;
 }
+
+
+/* Map the regular file open on FD into memory for reading.  On
+ * success the address and the length of the mapping are stored at
+ * R_MEM and R_LEN; the caller must release the mapping with
+ * gpgsm_unmap_fd.  GPG_ERR_NOT_SUPPORTED is returned if FD can't be
+ * mapped, for example because it is a pipe, empty, or not at its
+ * start; the caller is then expected to read FD as usual.  */
+gpg_error_t
+gpgsm_map_fd (int fd, const void **r_mem, size_t *r_len)
+{
+#ifdef HAVE_MMAP
+  struct stat st;
+  void *mem;
+
+  *r_mem = NULL;
+  *r_len = 0;
+
+  if (fstat (fd, &st) || !S_ISREG (st.st_mode)
+      || st.st_size <= 0 || (off_t)(size_t)st.st_size != st.st_size
+      || lseek (fd, 0, SEEK_CUR) != 0)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  mem = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED)
+    {
+      if (opt.verbose)
+        log_info ("mmap of fd %d failed: %s\n", fd, strerror (errno));
+      return gpg_error (GPG_ERR_NOT_SUPPORTED);
+    }
+# ifdef MADV_SEQUENTIAL
+  madvise (mem, (size_t)st.st_size, MADV_SEQUENTIAL);
+# endif
+
+  *r_mem = mem;
+  *r_len = (size_t)st.st_size;
+  return 0;
+#else /*!HAVE_MMAP*/
+  (void)fd;
+  *r_mem = NULL;
+  *r_len = 0;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+#endif /*!HAVE_MMAP*/
+}
+
+
+/* Release a mapping created by gpgsm_map_fd.  */
+void
+gpgsm_unmap_fd (const void *mem, size_t len)
+{
+#ifdef HAVE_MMAP
+  if (mem)
+    munmap ((void *)mem, len);
+#else
+  (void)mem;
+  (void)len;
+#endif
+}
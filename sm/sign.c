@@ -40,20 +40,37 @@ static int
 hash_data (int fd, gcry_md_hd_t md)
 {
   estream_t fp;
-  char buffer[4096];
-  int nread;
+  const void *mem;
+  size_t memlen;
+  char *buffer;
+  size_t nread;
   int rc = 0;
 
+  if (!gpgsm_map_fd (fd, &mem, &memlen))
+    {
+      gcry_md_write (md, mem, memlen);
+      gpgsm_unmap_fd (mem, memlen);
+      return 0;
+    }
+
+  buffer = xtrymalloc (GPGSM_IOBUFSIZE);
+  if (!buffer)
+    {
+      log_error ("error allocating buffer: %s\n", strerror (errno));
+      return -1;
+    }
+
   fp = es_fdopen_nc (fd, "rb");
   if (!fp)
     {
       log_error ("fdopen(%d) failed: %s\n", fd, strerror (errno));
+      xfree (buffer);
       return -1;
     }
 
   do
     {
-      nread = es_fread (buffer, 1, DIM(buffer), fp);
+      nread = es_fread (buffer, 1, GPGSM_IOBUFSIZE, fp);
       gcry_md_write (md, buffer, nread);
     }
   while (nread);
@@ -63,41 +80,72 @@ hash_data (int fd, gcry_md_hd_t md)
       rc = -1;
     }
   es_fclose (fp);
+  xfree (buffer);
   return rc;
 }
 
 
+/* Helper for hash_and_copy_data to process a chunk of data.  */
+static gpg_error_t
+hash_and_copy_chunk (gcry_md_hd_t md, ksba_writer_t writer,
+                     const void *buffer, size_t length)
+{
+  gpg_error_t err;
+
+  gcry_md_write (md, buffer, length);
+  err = ksba_writer_write_octet_string (writer, buffer, length, 0);
+  if (err)
+    log_error ("write failed: %s\n", gpg_strerror (err));
+  return err;
+}
+
+
 static int
 hash_and_copy_data (int fd, gcry_md_hd_t md, ksba_writer_t writer)
 {
-  gpg_error_t err;
   estream_t fp;
-  char buffer[4096];
-  int nread;
+  const void *mem;
+  size_t memlen, off, n;
+  char *buffer;
+  size_t nread;
   int rc = 0;
   int any = 0;
 
+  if (!gpgsm_map_fd (fd, &mem, &memlen))
+    {
+      /* A regular file: Take the data directly from the mapping.  */
+      any = 1;
+      for (off = 0; off < memlen && !rc; off += n)
+        {
+          n = memlen - off;
+          if (n > GPGSM_IOBUFSIZE)
+            n = GPGSM_IOBUFSIZE;
+          rc = hash_and_copy_chunk (md, writer, (const char *)mem + off, n);
+        }
+      gpgsm_unmap_fd (mem, memlen);
+      goto leave;
+    }
+
+  buffer = xtrymalloc (GPGSM_IOBUFSIZE);
+  if (!buffer)
+    return out_of_core ();
+
   fp = es_fdopen_nc (fd, "rb");
   if (!fp)
     {
       gpg_error_t tmperr = gpg_error_from_syserror ();
       log_error ("fdopen(%d) failed: %s\n", fd, strerror (errno));
+      xfree (buffer);
       return tmperr;
     }
 
   do
     {
-      nread = es_fread (buffer, 1, DIM(buffer), fp);
+      nread = es_fread (buffer, 1, GPGSM_IOBUFSIZE, fp);
       if (nread)
         {
           any = 1;
-          gcry_md_write (md, buffer, nread);
-          err = ksba_writer_write_octet_string (writer, buffer, nread, 0);
-          if (err)
-            {
-              log_error ("write failed: %s\n", gpg_strerror (err));
-              rc = err;
-            }
+          rc = hash_and_copy_chunk (md, writer, buffer, nread);
         }
     }
   while (nread && !rc);
@@ -107,6 +155,9 @@ hash_and_copy_data (int fd, gcry_md_hd_t md, ksba_writer_t writer)
       log_error ("read error on fd %d: %s\n", fd, strerror (errno));
     }
   es_fclose (fp);
+  xfree (buffer);
+
+ leave:
   if (!any)
     {
       /* We can't allow signing an empty message because it does not
@@ -118,12 +169,9 @@ hash_and_copy_data (int fd, gcry_md_hd_t md, ksba_writer_t writer)
     }
   if (!rc)
     {
-      err = ksba_writer_write_octet_string (writer, NULL, 0, 1);
-      if (err)
-        {
-          log_error ("write failed: %s\n", gpg_strerror (err));
-          rc = err;
-        }
+      rc = ksba_writer_write_octet_string (writer, NULL, 0, 1);
+      if (rc)
+        log_error ("write failed: %s\n", gpg_strerror (rc));
     }
 
   return rc;
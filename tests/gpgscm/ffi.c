@@ -33,6 +33,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #if HAVE_LIBREADLINE
@@ -532,6 +533,23 @@ do_get_time (scheme *sc, pointer args)
   FFI_RETURN_INT (sc, gnupg_get_time ());
 }
 
+/* Return the number of milliseconds since the first call.  This is
+ * meant for measuring durations; the start value keeps the result
+ * small enough for a 32 bit integer.  */
+static pointer
+do_get_clock (scheme *sc, pointer args)
+{
+  FFI_PROLOG ();
+  static struct timeval base;
+  struct timeval tv;
+  FFI_ARGS_DONE_OR_RETURN (sc, args);
+  gettimeofday (&tv, NULL);
+  if (!base.tv_sec)
+    base = tv;
+  FFI_RETURN_INT (sc, ((tv.tv_sec - base.tv_sec) * 1000
+                       + (tv.tv_usec - base.tv_usec) / 1000));
+}
+
 static pointer
 do_getpid (scheme *sc, pointer args)
 {
@@ -1382,6 +1400,7 @@ ffi_init (scheme *sc, const char *argv0, const char *scriptname,
   ffi_define_function (sc, rmdir);
   ffi_define_function (sc, get_isotime);
   ffi_define_function (sc, get_time);
+  ffi_define_function (sc, get_clock);
   ffi_define_function (sc, getpid);
 
   /* Random numbers.  */
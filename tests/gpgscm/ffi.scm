@@ -49,3 +49,6 @@
 
 ;; Get the current time in seconds since the epoch.
 (ffi-define (get-time))
+
+;; Get a clock value in milliseconds for measuring durations.
+(ffi-define (get-clock))
@@ -0,0 +1,100 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2021 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+;; Latency benchmark for requests to gpg-agent.  This is not part of
+;; the test suite; it is run by
+;;
+;;   obj $ make -C tests/openpgp check-perf
+;;
+;; Each operation is sent BENCH_AGENT_COUNT times (default 1000) over
+;; a single connection so that the time to start gpg-connect-agent
+;; does not matter.  The operations are
+;;
+;;   getinfo     GETINFO version; the plain round trip.
+;;   passphrase  GET_PASSPHRASE --no-ask for a cached passphrase.
+;;   keyinfo     KEYINFO --list over all private keys.
+;;   readkey     READKEY of one key.
+;;
+;; If BENCH_OUTPUT is set, the results are also written to this file.
+;; Each result is printed as one line of colon delimited fields:
+;;
+;;   bench-agent:OP:COUNT:MS:USEC
+;;
+;; MS is the total time in milliseconds and USEC the latency of a
+;; single request in microseconds.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-environment)
+
+(define bench-count
+  (let ((n (getenv "BENCH_AGENT_COUNT")))
+    (if (string=? n "") 1000 (string->number n))))
+
+(define results '())
+
+(define (report op count ms)
+  (let ((line (string-append
+	       "bench-agent:" op ":" (number->string count)
+	       ":" (number->string ms)
+	       ":" (number->string (quotient (* ms 1000) count)))))
+    (set! results (cons line results))
+    (info line)))
+
+;; Send the request COMMAND COUNT times and return the responses.
+(define (agent-repeat command count)
+  (call-popen `(,(tool 'gpg-connect-agent))
+	      (let loop ((acc '("/bye\n")) (i 0))
+		(if (< i count)
+		    (loop (cons (string-append command "\n") acc) (+ i 1))
+		    (apply string-append acc)))))
+
+;; Time COUNT requests COMMAND and report them as OP.
+(define (run op command)
+  (let* ((start (get-clock))
+	 (response (agent-repeat command bench-count))
+	 (ms (- (get-clock) start)))
+    (if (string-contains? response "ERR ")
+	(fail "request failed:" command))
+    (report op bench-count ms)))
+
+;; Return the keygrip of the first key listed by KEYINFO --list.
+(define (first-keygrip)
+  (let ((lines (filter (lambda (l) (string-prefix? l "S KEYINFO "))
+		       (string-split-newlines
+			(call-popen `(,(tool 'gpg-connect-agent))
+				    "KEYINFO --list\n/bye\n")))))
+    (if (null? lines)
+	(fail "no private keys"))
+    (caddr (string-split (car lines) #\space))))
+
+(call-check `(,(tool 'gpg-preset-passphrase)
+	      --preset --passphrase bench_passphrase bench_id))
+
+(run "getinfo" "GETINFO version")
+(run "passphrase" "GET_PASSPHRASE --no-ask bench_id X X X")
+(run "keyinfo" "KEYINFO --list")
+(run "readkey" (string-append "READKEY " (first-keygrip)))
+
+(let ((output (getenv "BENCH_OUTPUT")))
+  (unless (string=? output "")
+	  (call-with-output-file
+	   output
+	   (lambda (port)
+	     (for-each (lambda (line) (display line port) (newline port))
+		       (reverse results))))))
@@ -0,0 +1,177 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2021 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+;; Throughput benchmarks for the OpenPGP data path.  This is not part
+;; of the test suite; run it using
+;;
+;;   obj $ make -C tests/openpgp bench
+;;
+;; The following environment variables select what is measured:
+;;
+;;   BENCH_SIZES        Space separated list of data sizes with an
+;;                      optional suffix K, M or G.  The default is
+;;                      "1K 64K 1M 16M"; use e.g. "1K 1M 1G 10G" for a
+;;                      full run.
+;;   BENCH_ITERATIONS   Number of runs for each measurement.  The
+;;                      default depends on the size.
+;;   BENCH_IOBUF_SIZES  Space separated list of iobuf buffer sizes in
+;;                      KiB as used with --debug-set-iobuf-size.  0
+;;                      stands for the built-in default, which is also
+;;                      the default for this variable.
+;;   BENCH_OUTPUT       If set, the results are also written to this
+;;                      file.  The bench target sets it to
+;;                      benchmark.out in the build directory.
+;;
+;; Each result is printed as one line of colon delimited fields:
+;;
+;;   bench:OP:SIZE:DATA:COMPRESS:MODE:IOBUF:ITERATIONS:MS:BPS:USEC
+;;
+;; OP is encrypt, decrypt, sign, verify, armor or dearmor.  SIZE is
+;; the size of the plaintext in bytes.  DATA is "random" or "text".
+;; COMPRESS is the compression algorithm.  MODE is "cfb" or "aead"
+;; for encryption and "-" otherwise.  IOBUF is the requested buffer
+;; size.  MS is the total time for all ITERATIONS runs in
+;; milliseconds.  BPS is the throughput in bytes per second.  USEC is
+;; the latency of a single run in microseconds.  Timing includes the
+;; start of the gpg process.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-legacy-environment)
+
+(define (words s)
+  (filter (lambda (x) (not (string=? x ""))) (string-split s #\space)))
+
+(define (parse-size s)
+  (let* ((n (string-length s))
+	 (scale (assv (char-upcase (string-ref s (- n 1)))
+		      '((#\K . 1024) (#\M . 1048576) (#\G . 1073741824)))))
+    (if scale
+	(* (cdr scale) (string->number (substring s 0 (- n 1))))
+	(string->number s))))
+
+(define bench-sizes
+  (map parse-size (words (getenv' "BENCH_SIZES" "1K 64K 1M 16M"))))
+(define bench-iobuf-sizes (words (getenv' "BENCH_IOBUF_SIZES" "0")))
+(define bench-modes '(("cfb") ("aead" --force-aead)))
+
+(define (iterations-for size)
+  (let ((n (getenv "BENCH_ITERATIONS")))
+    (if (string=? n "")
+	(max 1 (min 20 (quotient (* 16 1048576) size)))
+	(string->number n))))
+
+;; Data files are written in blocks of this size.
+(define block-size 65536)
+
+(define text-block
+  (let ((line "The quick brown fox jumps over the lazy dog 0123456789.\n"))
+    (let loop ((acc '()) (n 0))
+      (if (>= n block-size)
+	  (substring (apply string-append acc) 0 block-size)
+	  (loop (cons line acc) (+ n (string-length line)))))))
+
+(define (make-bench-file name size block)
+  (call-with-binary-output-file
+   name
+   (lambda (port)
+     (let loop ((left size))
+       (when (> left 0)
+	     (display (if (< left block-size) (substring block 0 left) block)
+		      port)
+	     (loop (- left block-size)))))))
+
+(define results '())
+
+(define (report op size data compress mode iobuf iterations ms)
+  (let* ((ms' (max ms 1))
+	 (line (string-append
+		"bench:" op ":" (number->string size) ":" data ":"
+		compress ":" mode ":" iobuf ":" (number->string iterations)
+		":" (number->string ms)
+		":" (number->string (quotient (* size iterations 1000) ms'))
+		":" (number->string (quotient (* ms 1000) iterations)))))
+    (set! results (cons line results))
+    (info line)))
+
+;; Run gpg with ARGS ITERATIONS times and return the time taken in
+;; milliseconds.
+(define (time-gpg iterations args)
+  (let ((start (get-clock)))
+    (let loop ((i 0))
+      (when (< i iterations)
+	    (call-check `(,@GPG --yes ,@args))
+	    (loop (+ i 1))))
+    (- (get-clock) start)))
+
+(define (iobuf-args iobuf)
+  (if (string=? iobuf "0") '() `(--debug-set-iobuf-size ,iobuf)))
+
+(define (bench-size size)
+  (let ((n (iterations-for size))
+	(plain "bench-plain")
+	(text "bench-text"))
+    (make-bench-file plain size (make-random-string block-size))
+    (make-bench-file text size text-block)
+    (for-each
+     (lambda (iobuf)
+       (define (run op data compress mode args)
+	 (report op size data compress mode iobuf n
+		 (time-gpg n `(,@(iobuf-args iobuf) ,@args))))
+
+       (for-each
+	(lambda (mode)
+	  (run "encrypt" "random" "none" (car mode)
+	       `(--output bench-enc --compress-algo none ,@(cdr mode)
+			  --encrypt --recipient ,usrname2 ,plain))
+	  (run "decrypt" "random" "none" (car mode)
+	       '(--output bench-dec --decrypt bench-enc))
+	  (if (and (<= size 16777216) (not (file=? plain "bench-dec")))
+	      (fail "decrypted data does not match")))
+	bench-modes)
+
+       (for-each
+	(lambda (compress)
+	  (run "encrypt" "text" compress "cfb"
+	       `(--output bench-enc --compress-algo ,compress
+			  --encrypt --recipient ,usrname2 ,text))
+	  (run "decrypt" "text" compress "cfb"
+	       '(--output bench-dec --decrypt bench-enc)))
+	(force all-compression-algos))
+
+       (run "sign" "random" "none" "-"
+	    `(--output bench-sig --compress-algo none --sign ,plain))
+       (run "verify" "random" "none" "-" '(--verify bench-sig))
+
+       (run "armor" "random" "none" "-"
+	    `(--output bench-arm --enarmor ,plain))
+       (run "dearmor" "random" "none" "-"
+	    '(--output bench-dec --dearmor bench-arm)))
+     bench-iobuf-sizes)
+    (for-each (lambda (name) (catch #f (unlink name)))
+	      `(,plain ,text "bench-enc" "bench-dec" "bench-sig" "bench-arm"))))
+
+(for-each bench-size bench-sizes)
+
+(let ((output (getenv "BENCH_OUTPUT")))
+  (unless (string=? output "")
+	  (call-with-output-file
+	   output
+	   (lambda (port)
+	     (for-each (lambda (line) (display line port) (newline port))
+		       (reverse results))))))
@@ -0,0 +1,117 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2021 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+;; Compare benchmark results with a baseline.  This is used by the
+;; check-perf target:
+;;
+;;   gpgscm perf-compare.scm [--update] BASELINE RESULTS...
+;;
+;; RESULTS are the output files of benchmark.scm, bench-agent.scm and
+;; g10/bench-keydb.  The last field of each result line is the
+;; latency of one run in microseconds; a result is a regression if
+;; this is more than PERF_TOLERANCE percent (default 25) plus
+;; PERF_SLACK microseconds (default 1000) above the baseline.  The
+;; slack keeps the noise of very short runs from failing the check.
+;; If BASELINE does not exist or --update is given, the results are
+;; stored as the new baseline.  Results without a baseline are only
+;; reported.  The exit code is 1 if a regression was found.
+
+;; The number of fields identifying a measurement for each kind of
+;; result line.  See the benchmarks for the format.
+(define key-fields '(("bench" . 7) ("bench-keydb" . 3) ("bench-agent" . 2)))
+
+(define (env-number name default)
+  (let ((value (getenv name)))
+    (if (string=? value "") default (string->number value))))
+
+(define tolerance (env-number "PERF_TOLERANCE" 25))
+(define slack (env-number "PERF_SLACK" 1000))
+
+(define (string-join strings separator)
+  (if (null? strings)
+      ""
+      (apply string-append
+	     (car strings)
+	     (map (lambda (s) (string-append separator s)) (cdr strings)))))
+
+;; Return the result lines of FILE.
+(define (read-results file)
+  (filter (lambda (line)
+	    (let ((fields (string-split line #\:)))
+	      (and (> (length fields) 1) (assoc (car fields) key-fields))))
+	  (string-split-newlines
+	   (call-with-input-file file read-all))))
+
+;; Return the pair (KEY . USEC) for the result LINE.
+(define (parse-result line)
+  (let* ((fields (string-split line #\:))
+	 (n (cdr (assoc (car fields) key-fields))))
+    (let loop ((acc '()) (i 0) (f fields))
+      (if (< i n)
+	  (loop (cons (car f) acc) (+ i 1) (cdr f))
+	  (cons (string-join (reverse acc) ":")
+		(string->number (last fields)))))))
+
+(define (write-baseline file lines)
+  (call-with-output-file
+   file
+   (lambda (port)
+     (for-each (lambda (line) (display line port) (newline port)) lines))))
+
+(define update? (member "--update" *args*))
+(define files (filter (lambda (arg) (not (string-prefix? arg "--"))) *args*))
+
+(when (< (length files) 2)
+      (echo "usage: perf-compare.scm [--update] BASELINE RESULTS...")
+      (exit 2))
+
+(define baseline-file (car files))
+(define lines (apply append (map read-results (cdr files))))
+
+(when (or update? (not (file-exists? baseline-file)))
+      (write-baseline baseline-file lines)
+      (echo "Stored" (length lines) "results as baseline in" baseline-file)
+      (exit 0))
+
+(define baseline (map parse-result (read-results baseline-file)))
+
+(define regressions
+  (let loop ((n 0) (results (map parse-result lines)))
+    (if (null? results)
+	n
+	(let* ((key (caar results))
+	       (usec (cdar results))
+	       (base (assoc key baseline)))
+	  (cond
+	   ((not base)
+	    (echo "new:" key usec "us")
+	    (loop n (cdr results)))
+	   ((> usec (+ (quotient (* (cdr base) (+ 100 tolerance)) 100) slack))
+	    (echo "REGRESSION:" key (cdr base) "us ->" usec "us")
+	    (loop (+ n 1) (cdr results)))
+	   (else
+	    (echo "ok:" key (cdr base) "us ->" usec "us")
+	    (loop n (cdr results))))))))
+
+(if (> regressions 0)
+    (begin
+      (echo regressions "performance regressions beyond"
+	    (string-append (number->string tolerance) "%"))
+      (exit 1))
+    (echo "No performance regressions."))
@@ -559,6 +559,17 @@ get_serialno_cb (void *opaque, const char *line)
 }
 
 
+/* Close the connection to the agent.  The next call opens a new one.
+ * This is used before forking so that the processes do not share the
+ * connection.  */
+void
+scd_release_connection (void)
+{
+  assuan_release (agent_ctx);
+  agent_ctx = NULL;
+}
+
+
 /* Make the card with SERIALNO the current one.  */
 gpg_error_t
 scd_switchcard (const char *serialno)
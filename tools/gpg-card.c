@@ -22,6 +22,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#ifndef HAVE_W32_SYSTEM
+# include <unistd.h>
+# include <poll.h>
+# include <sys/types.h>
+# include <sys/wait.h>
+#endif
 #ifdef HAVE_LIBREADLINE
 # define GNUPG_LIBREADLINE_H_INCLUDED
 # include <readline/readline.h>
@@ -72,6 +79,7 @@ enum opt_values
     oLCmessages,
 
     oNoKeyLookup,
+    oAllCards,
 
     oDummy
   };
@@ -98,6 +106,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_s (oLCmessages, "lc-messages","@"),
   ARGPARSE_s_n (oNoKeyLookup,"no-key-lookup",
                 "use --no-key-lookup for \"list\""),
+  ARGPARSE_s_n (oAllCards, "all-cards", "run the commands on all cards"),
 
   ARGPARSE_end ()
 };
@@ -136,6 +145,7 @@ typedef struct keyinfolabel_s *keyinfolabel_t;
 static void show_keysize_warning (void);
 static gpg_error_t dispatch_command (card_info_t info, const char *command);
 static void interactive_loop (void);
+static void run_on_all_cards (char **command_list);
 #ifdef HAVE_LIBREADLINE
 static char **command_completion (const char *text, int start, int end);
 #endif /*HAVE_LIBREADLINE*/
@@ -227,6 +237,7 @@ parse_arguments (gpgrt_argparse_t *pargs, gpgrt_opt_t *popts)
         case oLCmessages:  opt.lc_messages = pargs->r.ret_str; break;
 
         case oNoKeyLookup: opt.no_key_lookup = 1; break;
+        case oAllCards:    opt.all_cards = 1; break;
 
         default: pargs->err = 2; break;
 	}
@@ -312,6 +323,8 @@ main (int argc, char **argv)
           command = NULL;
         }
     }
+  if (opt.all_cards && !cmdidx)
+    command_list[cmdidx++] = xstrdup ("list");
   opt.interactive = !cmdidx;
 
   if (opt.interactive)
@@ -319,6 +332,12 @@ main (int argc, char **argv)
       interactive_loop ();
       err = 0;
     }
+  else if (opt.all_cards)
+    {
+      run_on_all_cards (command_list);
+      err = 0;
+      command = NULL;
+    }
   else
     {
       struct card_info_s info_buffer = { 0 };
@@ -3241,6 +3260,250 @@ dispatch_command (card_info_t info, const char *orig_command)
 }
 
 
+/* Run the commands in COMMAND_LIST on the card with SERIALNO.
+ * Returns true on success.  */
+static int
+run_commands_on_card (const char *serialno, char **command_list)
+{
+  gpg_error_t err;
+  struct card_info_s info_buffer = { 0 };
+  card_info_t info = &info_buffer;
+  char *command;
+  int cmdidx;
+
+  err = scd_switchcard (serialno);
+  if (err)
+    {
+      log_error ("error selecting card %s: %s\n",
+                 serialno, gpg_strerror (err));
+      return 0;
+    }
+
+  for (cmdidx=0; (command = command_list[cmdidx]); cmdidx++)
+    {
+      err = dispatch_command (info, command);
+      if (err)
+        break;
+    }
+  if (gpg_err_code (err) == GPG_ERR_EOF)
+    err = 0; /* This was a "quit".  */
+  else if (command && !opt.quiet)
+    log_info ("stopped at command '%s'\n", command);
+  release_card_info (info);
+  flush_keyblock_cache ();
+  es_fflush (es_stdout);
+  return !err;
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+/* The state of a process started by run_on_all_cards.  */
+struct card_job_s
+{
+  const char *serialno;
+  pid_t pid;
+  int fd;             /* The read end of its output pipe or -1.  */
+  size_t buflen;      /* Number of bytes in BUFFER.  */
+  char buffer[1024];  /* The incomplete last line of its output.  */
+};
+
+
+/* Write the output lines of JOB prefixed with its serial number.  If
+ * FLUSH is set an incomplete last line is also written.  */
+static void
+write_card_job_output (struct card_job_s *job, int flush)
+{
+  char *p, *start;
+  size_t n;
+
+  start = job->buffer;
+  n = job->buflen;
+  while ((p = memchr (start, '\n', n)))
+    {
+      es_fprintf (es_stdout, "%s: %.*s\n",
+                  job->serialno, (int)(p - start), start);
+      n -= p + 1 - start;
+      start = p + 1;
+    }
+  if (n && (flush || n == sizeof job->buffer))
+    {
+      es_fprintf (es_stdout, "%s: %.*s\n", job->serialno, (int)n, start);
+      n = 0;
+    }
+  memmove (job->buffer, start, n);
+  job->buflen = n;
+  es_fflush (es_stdout);
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Run the commands in COMMAND_LIST on all cards.  A process is
+ * forked for each card so that, for example, the keys of many tokens
+ * are generated at the same time; each process has its own connection
+ * to the agent and scdaemon can thus work on all cards at once.  The
+ * output of each process is prefixed with the serial number of its
+ * card.  Commands which ask the user are not useful here.  */
+static void
+run_on_all_cards (char **command_list)
+{
+  gpg_error_t err;
+  strlist_t cards, sl;
+  int ncards, ndone, nfailed;
+
+  err = scd_cardlist (&cards);
+  if (err)
+    {
+      log_error ("error getting the list of cards: %s\n", gpg_strerror (err));
+      return;
+    }
+  for (ncards=0, sl = cards; sl; sl = sl->next)
+    ncards++;
+  if (!ncards)
+    {
+      log_error (_("No card found\n"));
+      return;
+    }
+  ndone = nfailed = 0;
+
+#ifdef HAVE_W32_SYSTEM
+  /* Without fork we do one card after the other.  */
+  for (sl = cards; sl; sl = sl->next)
+    {
+      if (!run_commands_on_card (sl->d, command_list))
+        nfailed++;
+      ndone++;
+      if (!opt.quiet)
+        log_info ("card %s done (%d of %d)\n", sl->d, ndone, ncards);
+    }
+#else /*!HAVE_W32_SYSTEM*/
+  {
+    struct card_job_s *jobs;
+    struct pollfd *pfds;
+    int njobs, nopen, n, i, status;
+    int fds[2];
+    pid_t pid;
+    ssize_t nread;
+
+    jobs = xcalloc (ncards, sizeof *jobs);
+    pfds = xcalloc (ncards, sizeof *pfds);
+
+    /* The processes must not share the connection to the agent and
+     * must not write our pending output again.  */
+    scd_release_connection ();
+    fflush (NULL);
+    es_fflush (NULL);
+
+    for (njobs=0, sl = cards; sl; sl = sl->next)
+      {
+        if (pipe (fds))
+          {
+            log_error ("error creating a pipe: %s\n", strerror (errno));
+            break;
+          }
+        pid = fork ();
+        if (pid == (pid_t)(-1))
+          {
+            log_error ("error forking process: %s\n", strerror (errno));
+            close (fds[0]);
+            close (fds[1]);
+            break;
+          }
+        if (!pid)
+          {
+            /* Child.  */
+            for (i=0; i < njobs; i++)
+              close (jobs[i].fd);
+            close (fds[0]);
+            if (dup2 (fds[1], 1) == -1 || dup2 (fds[1], 2) == -1)
+              _exit (2);
+            close (fds[1]);
+            exit (run_commands_on_card (sl->d, command_list)
+                  && !log_get_errorcount (0) ? 0 : 1);
+          }
+        close (fds[1]);
+        jobs[njobs].serialno = sl->d;
+        jobs[njobs].pid = pid;
+        jobs[njobs].fd = fds[0];
+        njobs++;
+        if (opt.verbose)
+          log_info ("card %s started\n", sl->d);
+      }
+
+    /* Collect the output until all processes closed their pipe.  */
+    for (nopen = njobs; nopen; )
+      {
+        for (n=i=0; i < njobs; i++)
+          if (jobs[i].fd != -1)
+            {
+              pfds[n].fd = jobs[i].fd;
+              pfds[n].events = POLLIN;
+              pfds[n].revents = 0;
+              n++;
+            }
+        if (poll (pfds, n, -1) == -1)
+          {
+            if (errno == EINTR)
+              continue;
+            log_error ("poll failed: %s\n", strerror (errno));
+            break;
+          }
+        for (n=i=0; i < njobs; i++)
+          {
+            struct card_job_s *job = jobs + i;
+
+            if (job->fd == -1)
+              continue;
+            if (!(pfds[n++].revents & (POLLIN|POLLHUP|POLLERR)))
+              continue;
+            nread = read (job->fd, job->buffer + job->buflen,
+                          sizeof job->buffer - job->buflen);
+            if (nread == -1 && errno == EINTR)
+              continue;
+            if (nread > 0)
+              {
+                job->buflen += nread;
+                write_card_job_output (job, 0);
+                continue;
+              }
+            /* EOF or error: the process is done.  */
+            write_card_job_output (job, 1);
+            close (job->fd);
+            job->fd = -1;
+            nopen--;
+
+            while (waitpid (job->pid, &status, 0) == (pid_t)(-1))
+              if (errno != EINTR)
+                {
+                  status = -1;
+                  break;
+                }
+            ndone++;
+            if (status == -1 || !WIFEXITED (status) || WEXITSTATUS (status))
+              {
+                nfailed++;
+                log_info ("card %s failed (%d of %d)\n",
+                          job->serialno, ndone, ncards);
+              }
+            else if (!opt.quiet)
+              log_info ("card %s done (%d of %d)\n",
+                        job->serialno, ndone, ncards);
+          }
+      }
+
+    /* Note that cards for which no process could be started are
+     * counted as failed.  */
+    nfailed += ncards - njobs;
+    xfree (pfds);
+    xfree (jobs);
+  }
+#endif /*!HAVE_W32_SYSTEM*/
+
+  if (nfailed)
+    log_error ("commands failed on %d of %d cards\n", nfailed, ncards);
+  free_strlist (cards);
+}
+
+
 /* The interactive main loop.  */
 static void
 interactive_loop (void)
@@ -39,6 +39,7 @@ struct
   int autostart;
 
   int no_key_lookup;  /* Assume --no-key-lookup for "list".  */
+  int all_cards;      /* Run the commands on all cards.  */
 
   /* Options passed to the gpg-agent: */
   session_env_t session_env;
@@ -203,6 +204,7 @@ const char *app_type_string (app_type_t app_type);
 gpg_error_t scd_apdu (const char *hexapdu, unsigned int *r_sw,
                       unsigned char **r_data, size_t *r_datalen);
 
+void scd_release_connection (void);
 gpg_error_t scd_switchcard (const char *serialno);
 gpg_error_t scd_switchapp (const char *appname);
 
@@ -37,6 +37,12 @@
 #include "../common/ttyio.h"
 #ifdef HAVE_W32_SYSTEM
 #  include "../common/exechelp.h"
+#else
+#  include <signal.h>
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <sys/socket.h>
+#  include <sys/un.h>
 #endif
 #include "../common/init.h"
 
@@ -67,6 +73,7 @@ enum cmd_and_opt_values
     oDirmngr,
     oKeyboxd,
     oUIServer,
+    oMultiplex,
     oNoAutostart
 
   };
@@ -94,6 +101,8 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_s (oRun,  "run",
                 N_("|FILE|run commands from FILE on startup")),
   ARGPARSE_s_n (oSubst, "subst",     N_("run /subst on startup")),
+  ARGPARSE_s_s (oMultiplex, "multiplex",
+                N_("|NAME|serve the connection to clients at socket NAME")),
 
   ARGPARSE_s_n (oNoAutostart, "no-autostart", "@"),
   ARGPARSE_s_n (oNoVerbose, "no-verbose", "@"),
@@ -123,6 +132,7 @@ struct
   int use_uiserver;     /* Use the standard UI server.  */
   const char *raw_socket; /* Name of socket to connect in raw mode. */
   const char *tcp_socket; /* Name of server to connect in tcp mode. */
+  const char *multiplex;  /* Name of the socket for --multiplex.  */
   int exec;             /* Run the pgm given on the command line. */
   unsigned int connect_flags;    /* Flags used for connecting. */
   int enable_varsubst;  /* Set if variable substitution is enabled.  */
@@ -189,6 +199,7 @@ static char *substitute_line_copy (const char *buffer);
 static int read_and_print_response (assuan_context_t ctx, int withhash,
                                     int *r_goterr);
 static assuan_context_t start_agent (void);
+static void run_multiplexer (assuan_context_t ctx, const char *sockname);
 
 
 
@@ -1217,6 +1228,7 @@ main (int argc, char **argv)
         case oUIServer:  opt.use_uiserver = 1; break;
         case oRawSocket: opt.raw_socket = pargs.r.ret_str; break;
         case oTcpSocket: opt.tcp_socket = pargs.r.ret_str; break;
+        case oMultiplex: opt.multiplex = pargs.r.ret_str; break;
         case oExec:      opt.exec = 1; break;
         case oNoExtConnect: opt.connect_flags &= ~(1); break;
         case oRun:       opt_run = pargs.r.ret_str; break;
@@ -1381,6 +1393,13 @@ main (int argc, char **argv)
         log_info (_("receiving line failed: %s\n"), gpg_strerror (rc) );
     }
 
+  if (opt.multiplex)
+    {
+      run_multiplexer (ctx, opt.multiplex);
+      assuan_release (ctx);
+      return 0;
+    }
+
 
   for (loopidx=0; loopidx < DIM (loopstack); loopidx++)
     loopstack[loopidx].collecting = 0;
@@ -2219,6 +2238,262 @@ read_and_print_response (assuan_context_t ctx, int withhash, int *r_goterr)
 
 
 
+#ifndef HAVE_W32_SYSTEM
+/* Write LINE of LENGTH bytes and a LF to the client stream FP.  */
+static int
+mux_write_line (estream_t fp, const char *line, size_t length)
+{
+  if (es_fwrite (line, length, 1, fp) != 1
+      || es_putc ('\n', fp) == EOF
+      || es_fflush (fp))
+    return -1;
+  return 0;
+}
+
+
+/* Read a line from the client stream FP into the buffer at LINEP of
+ * size LINESIZEP.  Returns the length of the line without the LF or
+ * -1 on EOF or error.  */
+static int
+mux_read_line (estream_t fp, char **linep, size_t *linesizep)
+{
+  size_t maxlength = ASSUAN_LINELENGTH;
+  int n;
+
+  n = es_read_line (fp, linep, linesizep, &maxlength);
+  if (n <= 0 || !maxlength)
+    return -1;
+  if ((*linep)[n-1] == '\n')
+    (*linep)[--n] = 0;
+  if (n && (*linep)[n-1] == '\r')
+    (*linep)[--n] = 0;
+  return n;
+}
+
+
+/* Send the command LINE to the server CTX and copy all response
+ * lines to the client stream OUTFP.  Inquiries are answered with the
+ * lines the client sends on INFP.  Returns 0, -1 if the client
+ * vanished, or an error code for problems with the server.  */
+static gpg_error_t
+mux_transact (assuan_context_t ctx, const char *line,
+              estream_t infp, estream_t outfp,
+              char **bufferp, size_t *buffersizep)
+{
+  gpg_error_t err;
+  char *resp;
+  size_t resplen;
+  int client_gone = 0;
+  int n;
+
+  err = assuan_write_line (ctx, line);
+  if (err)
+    return err;
+
+  for (;;)
+    {
+      err = assuan_read_line (ctx, &resp, &resplen);
+      if (err)
+        return err;
+      if (!client_gone && mux_write_line (outfp, resp, resplen))
+        client_gone = 1;
+
+      if ((resplen >= 2 && resp[0] == 'O' && resp[1] == 'K'
+           && (resplen == 2 || resp[2] == ' '))
+          || (resplen >= 3 && !memcmp (resp, "ERR", 3)
+              && (resplen == 3 || resp[3] == ' ')))
+        break;
+
+      if (resplen >= 7 && !memcmp (resp, "INQUIRE", 7)
+          && (resplen == 7 || resp[7] == ' '))
+        {
+          /* Pass the client's data lines up to END or CAN.  If the
+           * client has gone we cancel the inquiry.  */
+          for (;;)
+            {
+              n = client_gone? -1 : mux_read_line (infp, bufferp,
+                                                   buffersizep);
+              if (n < 0)
+                {
+                  client_gone = 1;
+                  err = assuan_write_line (ctx, "CAN");
+                  break;
+                }
+              err = assuan_write_line (ctx, *bufferp);
+              if (err)
+                break;
+              if (!strcmp (*bufferp, "END") || !strcmp (*bufferp, "CAN"))
+                break;
+            }
+          if (err)
+            return err;
+        }
+    }
+
+  return client_gone? -1 : 0;
+}
+
+
+/* Serve one client on the socket FD using the server CTX.  */
+static gpg_error_t
+mux_serve_client (assuan_context_t ctx, int fd)
+{
+  gpg_error_t err = 0;
+  estream_t infp, outfp;
+  char *line = NULL;
+  size_t linesize = 0;
+  int n;
+
+  infp = es_fdopen_nc (fd, "rb");
+  outfp = es_fdopen_nc (fd, "wb");
+  if (!infp || !outfp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  if (mux_write_line (outfp, "OK gpg-connect-agent multiplexer ready", 38))
+    goto leave;
+
+  while ((n = mux_read_line (infp, &line, &linesize)) >= 0)
+    {
+      if (!n || *line == '#')
+        continue;
+      if (!ascii_strcasecmp (line, "BYE")
+          || !ascii_strncasecmp (line, "BYE ", 4))
+        {
+          mux_write_line (outfp, "OK closing connection", 21);
+          break;
+        }
+      err = mux_transact (ctx, line, infp, outfp, &line, &linesize);
+      if (err == (gpg_error_t)(-1))
+        {
+          err = 0;
+          break;
+        }
+      if (err)
+        break;
+    }
+
+ leave:
+  xfree (line);
+  es_fclose (infp);
+  es_fclose (outfp);
+  return err;
+}
+
+
+/* Create the listening socket SOCKNAME.  Only the current user may
+ * connect to it.  Returns the fd or -1.  */
+static int
+mux_create_socket (const char *sockname)
+{
+  struct sockaddr_un addr;
+  struct stat sb;
+  mode_t oldmask;
+  int fd;
+
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen (sockname) >= sizeof addr.sun_path)
+    {
+      log_error ("socket name '%s' is too long\n", sockname);
+      return -1;
+    }
+  strcpy (addr.sun_path, sockname);
+
+  /* Remove a stale socket from an earlier run.  */
+  if (!lstat (sockname, &sb) && S_ISSOCK (sb.st_mode))
+    gnupg_remove (sockname);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    {
+      log_error ("can't create socket: %s\n", strerror (errno));
+      return -1;
+    }
+  oldmask = umask (077);
+  if (bind (fd, (struct sockaddr *)&addr, sizeof addr))
+    {
+      log_error ("error binding socket to '%s': %s\n",
+                 sockname, strerror (errno));
+      umask (oldmask);
+      close (fd);
+      return -1;
+    }
+  umask (oldmask);
+  if (listen (fd, 64))
+    {
+      log_error ("listen on socket '%s' failed: %s\n",
+                 sockname, strerror (errno));
+      close (fd);
+      gnupg_remove (sockname);
+      return -1;
+    }
+  return fd;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Run the multiplexer: Accept clients on the socket SOCKNAME and pass
+ * their commands to the server CTX.  Clients are served one after the
+ * other; this is what we can do with a single connection anyway.
+ * After each client the server is reset.  Clients connect using
+ * "gpg-connect-agent -S SOCKNAME" or any other Assuan client.  This
+ * function returns only if the server connection failed.  */
+static void
+run_multiplexer (assuan_context_t ctx, const char *sockname)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)ctx;
+  log_error (_("option \"%s\" is not supported on this platform\n"),
+             "--multiplex");
+#else
+  gpg_error_t err;
+  int listen_fd, fd;
+
+  listen_fd = mux_create_socket (sockname);
+  if (listen_fd == -1)
+    return;
+
+  /* A client may close the connection while we write to it.  */
+  signal (SIGPIPE, SIG_IGN);
+
+  if (opt.verbose)
+    log_info ("listening on socket '%s'\n", sockname);
+
+  for (;;)
+    {
+      fd = accept (listen_fd, NULL, NULL);
+      if (fd == -1)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          log_error ("accept failed: %s\n", strerror (errno));
+          break;
+        }
+      err = mux_serve_client (ctx, fd);
+      close (fd);
+      if (!err)
+        {
+          /* Clear the state the client may have left.  */
+          err = assuan_transact (ctx, "RESET",
+                                 NULL, NULL, NULL, NULL, NULL, NULL);
+        }
+      if (err)
+        {
+          log_error ("connection to the server failed: %s\n",
+                     gpg_strerror (err));
+          break;
+        }
+    }
+
+  close (listen_fd);
+  gnupg_remove (sockname);
+#endif /*!HAVE_W32_SYSTEM*/
+}
+
+
 /* Connect to the agent and send the standard options.  */
 static assuan_context_t
 start_agent (void)
@@ -307,6 +307,8 @@ main (int argc, char **argv)
   /* Tell call-dirmngr what options we want.  */
   set_dirmngr_options (opt.verbose, (opt.debug & DBG_IPC_VALUE), 1);
 
+  gnupg_exec_tool_set_debug (DBG_EXTPROG);
+
 
   /* Check that the top directory exists.  */
   if (cmd == aInstallKey || cmd == aRemoveKey)
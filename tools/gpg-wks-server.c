@@ -66,6 +66,7 @@ enum cmd_and_opt_values
     oDebug      = 500,
 
     aReceive,
+    aReceiveSpool,
     aCron,
     aListDomains,
     aInstallKey,
@@ -90,6 +91,8 @@ static gpgrt_opt_t opts[] = {
 
   ARGPARSE_c (aReceive,   "receive",
               ("receive a submission or confirmation")),
+  ARGPARSE_c (aReceiveSpool, "receive-spool",
+              ("receive all submissions and confirmations from a DIR")),
   ARGPARSE_c (aCron,      "cron",
               ("run regular jobs")),
   ARGPARSE_c (aListDomains, "list-domains",
@@ -152,6 +155,12 @@ static int opt_with_dir;
 /* Flag for --with-file.  */
 static int opt_with_file;
 
+/* The list of writable domain directories.  This is only set while
+ * processing a spool directory so that the domain directories need
+ * to be checked only once for all messages.  */
+static strlist_t cached_domains;
+static int cached_domains_valid;
+
 
 /* Prototypes.  */
 static gpg_error_t get_domain_list (strlist_t *r_list);
@@ -159,6 +168,7 @@ static gpg_error_t get_domain_list (strlist_t *r_list);
 static gpg_error_t command_receive_cb (void *opaque,
                                        const char *mediatype, estream_t fp,
                                        unsigned int flags);
+static gpg_error_t command_receive_spool (const char *spooldir);
 static gpg_error_t command_list_domains (void);
 static gpg_error_t command_revoke_key (const char *mailaddr);
 static gpg_error_t command_check_key (const char *mailaddr);
@@ -253,6 +263,7 @@ parse_arguments (gpgrt_argparse_t *pargs, gpgrt_opt_t *popts)
           break;
 
 	case aReceive:
+        case aReceiveSpool:
         case aCron:
         case aListDomains:
         case aCheck:
@@ -313,6 +324,8 @@ main (int argc, char **argv)
   if (!opt.directory)
     opt.directory = "/var/lib/gnupg/wks";
 
+  gnupg_exec_tool_set_debug (DBG_EXTPROG);
+
   /* Check for syntax errors in the --header option to avoid later
    * error messages with a not easy to find cause */
   if (opt.extra_headers)
@@ -376,6 +389,12 @@ main (int argc, char **argv)
       err = wks_receive (es_stdin, command_receive_cb, NULL);
       break;
 
+    case aReceiveSpool:
+      if (argc != 1)
+        wrong_args ("--receive-spool DIR");
+      err = command_receive_spool (*argv);
+      break;
+
     case aCron:
       if (argc)
         wrong_args ("--cron");
@@ -1137,6 +1156,18 @@ send_confirmation_request (server_ctx_t ctx,
 }
 
 
+/* Return true if the domain directory DNAME exists and is writable.
+ * While processing a spool directory the cached list of domains is
+ * used instead of asking the file system for each message.  */
+static int
+is_writable_domain (const char *dname)
+{
+  if (cached_domains_valid)
+    return !!strlist_find (cached_domains, dname);
+  return !access (dname, W_OK);
+}
+
+
 /* Store the key given by KEY into the pending directory and send a
  * confirmation requests.  */
 static gpg_error_t
@@ -1182,7 +1213,7 @@ process_new_key (server_ctx_t ctx, estream_t key)
           goto leave;
         }
 
-      if (access (dname, W_OK))
+      if (!is_writable_domain (dname))
         {
           log_info ("skipping address '%s': Domain not configured\n", sl->mbox);
           continue;
@@ -1605,6 +1636,177 @@ command_receive_cb (void *opaque, const char *mediatype,
 }
 
 
+
+/* Move the spool file NAME in SPOOLDIR to the "failed" subdirectory
+ * so that it won't be processed again.  */
+static void
+move_spool_file_to_failed (const char *spooldir, const char *name)
+{
+  gpg_error_t err;
+  char *dname, *oldname, *newname;
+
+  dname = make_filename_try (spooldir, "failed", NULL);
+  oldname = make_filename_try (spooldir, name, NULL);
+  newname = make_filename_try (spooldir, "failed", name, NULL);
+  if (!dname || !oldname || !newname)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("make_filename failed in %s: %s\n",
+                 __func__, gpg_strerror (err));
+      goto leave;
+    }
+
+  if (gnupg_mkdir (dname, "-rwx") && errno != EEXIST)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error creating directory '%s': %s\n",
+                 dname, gpg_strerror (err));
+      goto leave;
+    }
+
+  err = gnupg_rename_file (oldname, newname, NULL);
+  if (err)
+    log_error ("error renaming '%s' to '%s': %s\n",
+               oldname, newname, gpg_strerror (err));
+
+ leave:
+  xfree (dname);
+  xfree (oldname);
+  xfree (newname);
+}
+
+
+/* Process all mails stored as separate files in SPOOLDIR.  This is
+ * the same as running --receive for each file but the domain
+ * directories are checked only once for the entire run.  Successfully
+ * processed files are removed; files which could not be processed
+ * are moved to the sub directory "failed".  Files with a leading dot
+ * are ignored so that a MTA can deliver files using a temporary
+ * name.  */
+static gpg_error_t
+command_receive_spool (const char *spooldir)
+{
+  gpg_error_t err, firsterr = 0;
+  DIR *dir = NULL;
+  struct dirent *dentry;
+  struct stat sb;
+  strlist_t domaindirs = NULL;
+  strlist_t files = NULL;
+  strlist_t sl;
+  char *fname = NULL;
+  estream_t fp;
+  unsigned int nfiles = 0;
+  unsigned int nfailed = 0;
+
+  /* Build the list of writable domain directories once.  */
+  err = get_domain_list (&domaindirs);
+  if (err)
+    {
+      log_error ("error reading list of domains: %s\n", gpg_strerror (err));
+      goto leave;
+    }
+  for (sl = domaindirs; sl; sl = sl->next)
+    if (!access (sl->d, W_OK) && !add_to_strlist_try (&cached_domains, sl->d))
+      {
+        err = gpg_error_from_syserror ();
+        goto leave;
+      }
+  cached_domains_valid = 1;
+
+  /* First collect the names so that new deliveries during this run
+   * don't affect the directory scan.  */
+  dir = opendir (spooldir);
+  if (!dir)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error reading directory '%s': %s\n",
+                 spooldir, gpg_strerror (err));
+      goto leave;
+    }
+  while ((dentry = readdir (dir)))
+    {
+      if (*dentry->d_name == '.')
+        continue;
+      xfree (fname);
+      fname = make_filename_try (spooldir, dentry->d_name, NULL);
+      if (!fname)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      if (stat (fname, &sb) || !S_ISREG (sb.st_mode))
+        continue;
+      if (!add_to_strlist_try (&files, dentry->d_name))
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+  closedir (dir);
+  dir = NULL;
+
+  for (sl = files; sl; sl = sl->next)
+    {
+      xfree (fname);
+      fname = make_filename_try (spooldir, sl->d, NULL);
+      if (!fname)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      nfiles++;
+      if (opt.verbose)
+        log_info ("processing '%s'\n", fname);
+
+      fp = es_fopen (fname, "rb");
+      if (!fp)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error opening '%s': %s\n", fname, gpg_strerror (err));
+        }
+      else
+        {
+          err = wks_receive (fp, command_receive_cb, NULL);
+          es_fclose (fp);
+          if (err)
+            log_error ("processing '%s' failed: %s\n",
+                       fname, gpg_strerror (err));
+        }
+
+      if (err)
+        {
+          nfailed++;
+          if (!firsterr)
+            firsterr = err;
+          move_spool_file_to_failed (spooldir, sl->d);
+        }
+      else if (gnupg_remove (fname))
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error removing '%s': %s\n", fname, gpg_strerror (err));
+          if (!firsterr)
+            firsterr = err;
+        }
+    }
+
+  if (opt.verbose || nfailed)
+    log_info ("%u of %u spooled messages processed successfully\n",
+              nfiles - nfailed, nfiles);
+  err = firsterr;
+
+ leave:
+  if (dir)
+    closedir (dir);
+  cached_domains_valid = 0;
+  free_strlist (cached_domains);
+  cached_domains = NULL;
+  free_strlist (domaindirs);
+  free_strlist (files);
+  xfree (fname);
+  return err;
+}
+
+
 
 /* Return a list of all configured domains.  Each list element is the
  * top directory for the domain.  To figure out the actual domain
@@ -57,6 +57,7 @@ struct
 #define DBG_MIME     (opt.debug & DBG_MIME_VALUE)
 #define DBG_PARSER   (opt.debug & DBG_PARSER_VALUE)
 #define DBG_CRYPTO   (opt.debug & DBG_CRYPTO_VALUE)
+#define DBG_EXTPROG  (opt.debug & DBG_EXTPROG_VALUE)
 
 
 /* The parsed policy flags. */
@@ -28,6 +28,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <time.h>
 #include <stdarg.h>
@@ -587,6 +588,9 @@ static gc_option_t gc_options_gpg_agent[] =
    { "pinentry-timeout", GC_OPT_FLAG_RUNTIME,
      GC_LEVEL_ADVANCED, "gnupg", NULL,
      GC_ARG_TYPE_UINT32, GC_BACKEND_GPG_AGENT },
+   { "pinentry-keep-alive", GC_OPT_FLAG_RUNTIME,
+     GC_LEVEL_EXPERT, "gnupg", NULL,
+     GC_ARG_TYPE_UINT32, GC_BACKEND_GPG_AGENT },
 
    GC_OPTION_NULL
  };
@@ -2049,6 +2053,272 @@ get_config_filename (gc_component_t component, gc_backend_t backend)
 }
 
 
+/* Run PGMNAME with the single argument ARG and return its output as
+ * a list of lines without the line endings.  WHAT is used in the
+ * error messages.  */
+static strlist_t
+read_program_lines (const char *pgmname, const char *arg, const char *what)
+{
+  gpg_error_t err;
+  const char *argv[2];
+  estream_t outfp;
+  int exitcode;
+  pid_t pid;
+  char *line = NULL;
+  size_t line_len = 0;
+  ssize_t length;
+  strlist_t lines = NULL;
+
+  argv[0] = arg;
+  argv[1] = NULL;
+  err = gnupg_spawn_process (pgmname, argv, NULL, NULL, 0,
+                             NULL, &outfp, NULL, &pid);
+  if (err)
+    {
+      gc_error (1, 0, "could not gather %s from '%s': %s",
+                what, pgmname, gpg_strerror (err));
+    }
+
+  while ((length = es_read_line (outfp, &line, &line_len, NULL)) > 0)
+    {
+      /* Strip newline and carriage return, if present.  */
+      while (length > 0
+	     && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+	line[--length] = '\0';
+      append_to_strlist (&lines, line);
+    }
+  if (length < 0 || es_ferror (outfp))
+    gc_error (1, errno, "error reading from %s", pgmname);
+  if (es_fclose (outfp))
+    gc_error (1, errno, "error closing %s", pgmname);
+
+  err = gnupg_wait_process (pgmname, pid, 1, &exitcode);
+  if (err)
+    gc_error (1, 0, "running %s failed (exitcode=%d): %s",
+              pgmname, exitcode, gpg_strerror (err));
+  gnupg_release_process (pid);
+
+  xfree (line);
+  return lines;
+}
+
+
+
+/* The output of --dump-option-table and --gpgconf-list depends only
+ * on the installed program, the home directory and the program's
+ * config files.  To avoid running all programs on each invocation of
+ * gpgconf, we cache the output in a file in the socket directory.
+ * The file starts with the version line, the home directory and the
+ * files it depends on, each with the modification time and size.
+ * The output lines follow, prefixed by "T " for the option table and
+ * "L " for the gpgconf list.  */
+#define OPTION_CACHE_VERSION "GPGCONF-CACHE 1"
+
+
+/* Return the malloced name of the cache file for PGMNAME.  */
+static char *
+option_cache_filename (const char *pgmname)
+{
+  const char *s;
+
+  s = strrchr (pgmname, '/');
+#ifdef HAVE_W32_SYSTEM
+  if (!s)
+    s = strrchr (pgmname, '\\');
+#endif
+  s = s? s+1 : pgmname;
+  return xstrconcat (gnupg_socketdir (), DIRSEP_S "gpgconf-", s, ".cache",
+                     NULL);
+}
+
+
+/* Return a malloced string with the stat info of FNAME as stored in
+ * the cache.  */
+static char *
+option_cache_fileinfo (const char *fname)
+{
+  struct stat sb;
+  char *fname_esc;
+  char *result;
+
+  if (stat (fname, &sb))
+    {
+      sb.st_mtime = 0;
+      sb.st_size = 0;
+    }
+  fname_esc = percent_escape (fname, NULL);
+  result = xasprintf ("F %lu %llu %s", (unsigned long)sb.st_mtime,
+                      (unsigned long long)sb.st_size, fname_esc);
+  xfree (fname_esc);
+  return result;
+}
+
+
+/* Return a list with the files the output of PGMNAME for BACKEND
+ * depends on.  LIST_LINES is the output of --gpgconf-list, which
+ * tells us the name of the config file.  */
+static strlist_t
+option_cache_depends (const char *pgmname, gc_backend_t backend,
+                      strlist_t list_lines)
+{
+  const char *config_name = gc_backend[backend].option_config_filename;
+  strlist_t files = NULL;
+  strlist_t sl;
+  size_t n;
+  char *p, *fname, *info;
+  const char *s;
+
+  info = option_cache_fileinfo (pgmname);
+  append_to_strlist (&files, info);
+  xfree (info);
+
+  n = config_name? strlen (config_name) : 0;
+  for (sl = list_lines; n && sl; sl = sl->next)
+    {
+      /* The line is NAME:FLAGS:"VALUE.  */
+      if (strncmp (sl->d, config_name, n) || sl->d[n] != ':'
+          || !(p = strchr (sl->d + n + 1, ':')) || p[1] != '"')
+        continue;
+      fname = percent_unescape (p + 2, 0);
+      p = strchr (fname, ':');
+      if (p)
+        *p = 0;
+      info = option_cache_fileinfo (fname);
+      append_to_strlist (&files, info);
+      xfree (info);
+
+      /* The system wide config file has the same name.  */
+      s = strrchr (fname, '/');
+      s = s? s+1 : fname;
+      p = xstrconcat (gnupg_sysconfdir (), DIRSEP_S, s, NULL);
+      info = option_cache_fileinfo (p);
+      append_to_strlist (&files, info);
+      xfree (info);
+      xfree (p);
+      xfree (fname);
+      break;
+    }
+
+  return files;
+}
+
+
+/* Try to read the output of PGMNAME for BACKEND from the cache.  On
+ * success store the lines at R_TABLE_LINES and R_LIST_LINES and
+ * return true.  */
+static int
+option_cache_load (const char *pgmname, gc_backend_t backend,
+                   strlist_t *r_table_lines, strlist_t *r_list_lines)
+{
+  char *fname;
+  estream_t fp;
+  char *line = NULL;
+  size_t line_len = 0;
+  ssize_t length;
+  int lnr = 0;
+  int okay = 0;
+  strlist_t files = NULL;
+  strlist_t depends = NULL;
+  strlist_t sl, sl2;
+
+  *r_table_lines = NULL;
+  *r_list_lines = NULL;
+
+  fname = option_cache_filename (pgmname);
+  fp = es_fopen (fname, "r");
+  xfree (fname);
+  if (!fp)
+    return 0;
+
+  while ((length = es_read_line (fp, &line, &line_len, NULL)) > 0)
+    {
+      while (length > 0
+	     && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+	line[--length] = '\0';
+      lnr++;
+      if (lnr == 1)
+        {
+          if (strcmp (line, OPTION_CACHE_VERSION))
+            goto leave;
+        }
+      else if (lnr == 2)
+        {
+          if (strncmp (line, "H ", 2) || strcmp (line+2, gnupg_homedir ()))
+            goto leave;
+        }
+      else if (!strncmp (line, "F ", 2))
+        append_to_strlist (&files, line);
+      else if (!strncmp (line, "T ", 2))
+        append_to_strlist (r_table_lines, line+2);
+      else if (!strncmp (line, "L ", 2))
+        append_to_strlist (r_list_lines, line+2);
+      else
+        goto leave;
+    }
+  if (length < 0 || es_ferror (fp) || !*r_table_lines || !*r_list_lines)
+    goto leave;
+
+  /* Check that the files did not change.  */
+  depends = option_cache_depends (pgmname, backend, *r_list_lines);
+  for (sl = files, sl2 = depends; sl && sl2; sl = sl->next, sl2 = sl2->next)
+    if (strcmp (sl->d, sl2->d))
+      break;
+  if (sl || sl2)
+    goto leave;
+
+  okay = 1;
+
+ leave:
+  if (!okay)
+    {
+      free_strlist (*r_table_lines);
+      *r_table_lines = NULL;
+      free_strlist (*r_list_lines);
+      *r_list_lines = NULL;
+    }
+  free_strlist (files);
+  free_strlist (depends);
+  xfree (line);
+  es_fclose (fp);
+  return okay;
+}
+
+
+/* Store the output lines TABLE_LINES and LIST_LINES of PGMNAME for
+ * BACKEND in the cache.  Errors are ignored.  */
+static void
+option_cache_store (const char *pgmname, gc_backend_t backend,
+                    strlist_t table_lines, strlist_t list_lines)
+{
+  char *fname, *tmpname;
+  estream_t fp;
+  strlist_t depends, sl;
+
+  fname = option_cache_filename (pgmname);
+  tmpname = xstrconcat (fname, ".tmp", NULL);
+  fp = es_fopen (tmpname, "w");
+  if (!fp)
+    goto leave;
+
+  depends = option_cache_depends (pgmname, backend, list_lines);
+  es_fprintf (fp, "%s\nH %s\n", OPTION_CACHE_VERSION, gnupg_homedir ());
+  for (sl = depends; sl; sl = sl->next)
+    es_fprintf (fp, "%s\n", sl->d);
+  free_strlist (depends);
+  for (sl = table_lines; sl; sl = sl->next)
+    es_fprintf (fp, "T %s\n", sl->d);
+  for (sl = list_lines; sl; sl = sl->next)
+    es_fprintf (fp, "L %s\n", sl->d);
+
+  if (es_fclose (fp) || gnupg_rename_file (tmpname, fname, NULL))
+    gnupg_remove (tmpname);
+
+ leave:
+  xfree (tmpname);
+  xfree (fname);
+}
+
+
 /* Retrieve the options for the component COMPONENT from backend
  * BACKEND, which we already know is a program-type backend.  With
  * ONLY_INSTALLED set components which are not installed are silently
@@ -2057,16 +2327,12 @@ static void
 retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
                                int only_installed)
 {
-  gpg_error_t err;
   const char *pgmname;
-  const char *argv[2];
-  estream_t outfp;
-  int exitcode;
-  pid_t pid;
   gc_option_t *option;
-  char *line = NULL;
-  size_t line_len = 0;
-  ssize_t length;
+  char *line;
+  strlist_t table_lines = NULL;
+  strlist_t list_lines = NULL;
+  strlist_t sl;
   const char *config_name;
   gpgrt_argparse_t pargs;
   int dummy_argc;
@@ -2092,27 +2358,23 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
     }
 
 
-  /* First we need to read the option table from the program.  */
-  argv[0] = "--dump-option-table";
-  argv[1] = NULL;
-  err = gnupg_spawn_process (pgmname, argv, NULL, NULL, 0,
-                             NULL, &outfp, NULL, &pid);
-  if (err)
+  /* First we need to read the option table and the default options
+   * from the program or the cache.  */
+  if (!option_cache_load (pgmname, backend, &table_lines, &list_lines))
     {
-      gc_error (1, 0, "could not gather option table from '%s': %s",
-                pgmname, gpg_strerror (err));
+      table_lines = read_program_lines (pgmname, "--dump-option-table",
+                                        "option table");
+      list_lines = read_program_lines (pgmname, "--gpgconf-list",
+                                       "active options");
+      option_cache_store (pgmname, backend, table_lines, list_lines);
     }
 
-  while ((length = es_read_line (outfp, &line, &line_len, NULL)) > 0)
+  for (sl = table_lines; sl; sl = sl->next)
     {
       char *fields[4];
       char *optname, *optdesc;
 
-      /* Strip newline and carriage return, if present.  */
-      while (length > 0
-	     && (line[length - 1] == '\n' || line[length - 1] == '\r'))
-	line[--length] = '\0';
-
+      line = sl->d;
       log_debug ("line='%s'\n", line);
       if (split_fields_colon (line, fields, DIM (fields)) < 4)
         {
@@ -2155,40 +2417,16 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
       if (option && !option->desc)
         option->desc = xstrdup (optdesc);
     }
-  if (length < 0 || es_ferror (outfp))
-    gc_error (1, errno, "error reading from %s", pgmname);
-  if (es_fclose (outfp))
-    gc_error (1, errno, "error closing %s", pgmname);
-
-  err = gnupg_wait_process (pgmname, pid, 1, &exitcode);
-  if (err)
-    gc_error (1, 0, "running %s failed (exitcode=%d): %s",
-              pgmname, exitcode, gpg_strerror (err));
-  gnupg_release_process (pid);
 
 
-  /* Now read the default options.  */
-  argv[0] = "--gpgconf-list";
-  argv[1] = NULL;
-  err = gnupg_spawn_process (pgmname, argv, NULL, NULL, 0,
-                             NULL, &outfp, NULL, &pid);
-  if (err)
-    {
-      gc_error (1, 0, "could not gather active options from '%s': %s",
-                pgmname, gpg_strerror (err));
-    }
-
-  while ((length = es_read_line (outfp, &line, &line_len, NULL)) > 0)
+  /* Now parse the default options.  */
+  for (sl = list_lines; sl; sl = sl->next)
     {
       char *linep;
       unsigned long flags = 0;
       char *default_value = NULL;
 
-      /* Strip newline and carriage return, if present.  */
-      while (length > 0
-	     && (line[length - 1] == '\n' || line[length - 1] == '\r'))
-	line[--length] = '\0';
-
+      line = sl->d;
       linep = strchr (line, ':');
       if (linep)
 	*(linep++) = '\0';
@@ -2246,16 +2484,6 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
 	    option->default_value = xstrdup (default_value);
 	}
     }
-  if (length < 0 || es_ferror (outfp))
-    gc_error (1, errno, "error reading from %s", pgmname);
-  if (es_fclose (outfp))
-    gc_error (1, errno, "error closing %s", pgmname);
-
-  err = gnupg_wait_process (pgmname, pid, 1, &exitcode);
-  if (err)
-    gc_error (1, 0, "running %s failed (exitcode=%d): %s",
-              pgmname, exitcode, gpg_strerror (err));
-  gnupg_release_process (pid);
 
 
   /* At this point, we can parse the configuration file.  */
@@ -2341,7 +2569,8 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
         }
     }
 
-  xfree (line);
+  free_strlist (table_lines);
+  free_strlist (list_lines);
   xfree (opt_table);
   /* Note that we release the string array after the option table
    * because the option table has pointers into tye string array.  */
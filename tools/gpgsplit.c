@@ -41,6 +41,7 @@
 #define INCLUDED_BY_MAIN_MODULE 1
 #include "../common/util.h"
 #include "../common/openpgpdefs.h"
+#include "../common/host2net.h"
 
 #ifdef HAVE_BZIP2
 # include <bzlib.h>
@@ -51,6 +52,13 @@ static const char *opt_prefix = "";
 static int opt_uncompress;
 static int opt_secret_to_public;
 static int opt_no_split;
+static int opt_list;
+
+/* The offset of the next packet in --list mode.  */
+static unsigned long long list_offset;
+
+/* The largest packet read in --list mode to get the keyid.  */
+#define LIST_MAX_PEEK (128*1024)
 
 static void g10_exit( int rc );
 static void split_packets (const char *fname);
@@ -63,6 +71,7 @@ enum cmd_and_opt_values {
   oUncompress   = 500,
   oSecretToPublic,
   oNoSplit,
+  oList,
 
   aTest
 };
@@ -77,6 +86,7 @@ static gpgrt_opt_t opts[] = {
     { oUncompress, "uncompress", 0, "uncompress a packet"},
     { oSecretToPublic, "secret-to-public", 0, "convert secret keys to public keys"},
     { oNoSplit, "no-split", 0, "write to stdout and don't actually split"},
+    { oList, "list", 0, "list the packets and don't actually split"},
 
     ARGPARSE_end ()
 };
@@ -139,6 +149,7 @@ main (int argc, char **argv)
         case oUncompress: opt_uncompress = 1; break;
         case oSecretToPublic: opt_secret_to_public = 1; break;
         case oNoSplit: opt_no_split = 1; break;
+        case oList: opt_list = 1; break;
         default : pargs.err = 2; break;
 	}
     }
@@ -147,6 +158,11 @@ main (int argc, char **argv)
   if (log_get_errorcount(0))
     g10_exit (2);
 
+  /* Libgcrypt is only used to compute the keyids.  */
+  if (opt_list && !gcry_check_version (NEED_LIBGCRYPT_VERSION))
+    log_fatal ("%s is too old (need %s, have %s)\n", "libgcrypt",
+               NEED_LIBGCRYPT_VERSION, gcry_check_version (NULL));
+
   if (!argc)
     split_packets (NULL);
   else
@@ -250,6 +266,53 @@ read_u32 (FILE *fp, unsigned long *rn)
   return 0;
 }
 
+
+/* The buffer used by copy_bytes and copy_to_eof.  */
+static unsigned char copy_buffer[32768];
+
+/* Copy N bytes from FPIN to FPOUT.  If FPOUT is NULL the bytes are
+ * skipped.  Returns 0 on success, -1 on a read error or premature EOF
+ * and 1 on a write error.  */
+static int
+copy_bytes (FILE *fpin, FILE *fpout, unsigned long n)
+{
+  size_t nbytes;
+
+  while (n)
+    {
+      nbytes = n < sizeof copy_buffer? n : sizeof copy_buffer;
+      if (fread (copy_buffer, 1, nbytes, fpin) != nbytes)
+        return -1;
+      if (fpout && fwrite (copy_buffer, 1, nbytes, fpout) != nbytes)
+        return 1;
+      n -= nbytes;
+    }
+  return 0;
+}
+
+
+/* Copy all bytes up to EOF from FPIN to FPOUT.  If FPOUT is NULL the
+ * bytes are skipped.  The number of bytes is stored at R_COUNT if not
+ * NULL.  Returns 0 on success, -1 on a read error and 1 on a write
+ * error.  */
+static int
+copy_to_eof (FILE *fpin, FILE *fpout, unsigned long long *r_count)
+{
+  unsigned long long count = 0;
+  size_t nbytes;
+
+  while ((nbytes = fread (copy_buffer, 1, sizeof copy_buffer, fpin)))
+    {
+      if (fpout && fwrite (copy_buffer, 1, nbytes, fpout) != nbytes)
+        return 1;
+      count += nbytes;
+    }
+  if (r_count)
+    *r_count = count;
+  return ferror (fpin)? -1 : 0;
+}
+
+
 static int
 write_old_header (FILE *fp, int pkttype, unsigned int len)
 {
@@ -324,12 +387,15 @@ public_key_length (const unsigned char *buf, size_t buflen)
 {
   const unsigned char *s;
   int nmpis;
+  int algo;
 
   /*   byte version number (3 or 4)
        u32  creation time
        [u16  valid days (version 3 only)]
        byte algorithm
-       n    MPIs (n and e) */
+       [byte length and curve OID (ECC only)]
+       n    MPIs (n and e)
+       [byte length and KDF parameters (ECDH only)] */
   if (!buflen)
     return 0;
   if (buf[0] < 2 || buf[0] > 4)
@@ -338,7 +404,8 @@ public_key_length (const unsigned char *buf, size_t buflen)
     return 0;
   s = buf + (buf[0] == 4? 6:8);
   buflen -= (buf[0] == 4? 6:8);
-  switch (s[-1])
+  algo = s[-1];
+  switch (algo)
     {
     case 1:
     case 2:
@@ -352,6 +419,15 @@ public_key_length (const unsigned char *buf, size_t buflen)
     case 17:
       nmpis = 4;
       break;
+    case 18:
+    case 19:
+    case 22:
+      if (!buflen || !s[0] || s[0] == 0xff || buflen < 1 + s[0])
+        return 0;
+      buflen -= 1 + s[0];
+      s += 1 + s[0];
+      nmpis = 1;
+      break;
     default:
       return 0;
     }
@@ -370,6 +446,13 @@ public_key_length (const unsigned char *buf, size_t buflen)
       s += nbytes; buflen -= nbytes;
     }
 
+  if (algo == 18)
+    {
+      if (!buflen || !s[0] || s[0] == 0xff || buflen < 1 + s[0])
+        return 0;
+      s += 1 + s[0];
+    }
+
   return s - buf;
 }
 
@@ -380,7 +463,7 @@ handle_zlib(int algo,FILE *fpin,FILE *fpout)
   z_stream zs;
   byte *inbuf, *outbuf;
   unsigned int inbufsize, outbufsize;
-  int c,zinit_done, zrc, nread, count;
+  int zinit_done, zrc, nread, count;
   size_t n;
 
   memset (&zs, 0, sizeof zs);
@@ -399,10 +482,7 @@ handle_zlib(int algo,FILE *fpin,FILE *fpout)
 	  if (!n)
 	    zs.next_in = (Bytef *) inbuf;
 	  count = inbufsize - n;
-	  for (nread=0;
-	       nread < count && (c=getc (fpin)) != EOF;
-	       nread++)
-	    inbuf[n+nread] = c;
+	  nread = fread (inbuf + n, 1, count, fpin);
 
 	  n += nread;
 	  if (nread < count && algo == 1)
@@ -445,11 +525,9 @@ handle_zlib(int algo,FILE *fpin,FILE *fpout)
 	      else
 		log_fatal ("zlib inflate problem: rc=%d\n", zrc );
 	    }
-	  for (n=0; n < outbufsize - zs.avail_out; n++)
-	    {
-	      if (putc (outbuf[n], fpout) == EOF )
-		return 1;
-	    }
+	  n = outbufsize - zs.avail_out;
+	  if (n && fwrite (outbuf, 1, n, fpout) != n)
+	    return 1;
 	}
     }
   while (zrc != Z_STREAM_END && zrc != Z_BUF_ERROR);
@@ -475,7 +553,7 @@ handle_bzip2(int algo,FILE *fpin,FILE *fpout)
   bz_stream bzs;
   byte *inbuf, *outbuf;
   unsigned int inbufsize, outbufsize;
-  int c,zinit_done, zrc, nread, count;
+  int zinit_done, zrc, nread, count;
   size_t n;
 
   memset (&bzs, 0, sizeof bzs);
@@ -494,10 +572,7 @@ handle_bzip2(int algo,FILE *fpin,FILE *fpout)
 	  if (!n)
 	    bzs.next_in = inbuf;
 	  count = inbufsize - n;
-	  for (nread=0;
-	       nread < count && (c=getc (fpin)) != EOF;
-	       nread++)
-	    inbuf[n+nread] = c;
+	  nread = fread (inbuf + n, 1, count, fpin);
 
 	  n += nread;
 	  if (nread < count && algo == 1)
@@ -524,11 +599,9 @@ handle_bzip2(int algo,FILE *fpin,FILE *fpout)
 	    ; /* eof */
 	  else if (zrc != BZ_OK && zrc != BZ_PARAM_ERROR)
 	    log_fatal ("bz2lib inflate problem: %d\n", zrc );
-	  for (n=0; n < outbufsize - bzs.avail_out; n++)
-	    {
-	      if (putc (outbuf[n], fpout) == EOF )
-		return 1;
-	    }
+	  n = outbufsize - bzs.avail_out;
+	  if (n && fwrite (outbuf, 1, n, fpout) != n)
+	    return 1;
 	}
     }
   while (zrc != BZ_STREAM_END && zrc != BZ_PARAM_ERROR);
@@ -544,7 +617,7 @@ write_part (FILE *fpin, unsigned long pktlen,
             int pkttype, int partial, unsigned char *hdr, size_t hdrlen)
 {
   FILE *fpout;
-  int c, first;
+  int c, first, rc;
   unsigned char *p;
   const char *outname = create_filename (pkttype);
 
@@ -574,17 +647,12 @@ write_part (FILE *fpin, unsigned long pktlen,
       && (pkttype == PKT_SECRET_KEY || pkttype == PKT_SECRET_SUBKEY))
     {
       unsigned char *blob = xmalloc (pktlen);
-      int i, len;
+      int len;
 
       pkttype = pkttype == PKT_SECRET_KEY? PKT_PUBLIC_KEY:PKT_PUBLIC_SUBKEY;
 
-      for (i=0; i < pktlen; i++)
-        {
-          c = getc (fpin);
-          if (c == EOF)
-            goto read_error;
-          blob[i] = c;
-        }
+      if (fread (blob, 1, pktlen, fpin) != pktlen)
+        goto read_error;
       len = public_key_length (blob, pktlen);
       if (!len)
         {
@@ -602,11 +670,8 @@ write_part (FILE *fpin, unsigned long pktlen,
             goto write_error;
         }
 
-      for (i=0; i < len; i++)
-        {
-          if ( putc (blob[i], fpout) == EOF )
-            goto write_error;
-        }
+      if (fwrite (blob, 1, len, fpout) != len)
+        goto write_error;
 
       goto ready;
     }
@@ -671,13 +736,11 @@ write_part (FILE *fpin, unsigned long pktlen,
                     goto write_error;
                 }
               partlen = 1 << (c & 0x1f);
-              for (; partlen; partlen--)
-                {
-                  if ((c = getc (fpin)) == EOF)
-                    goto read_error;
-                  if ( putc (c, fpout) == EOF )
-                    goto write_error;
-                }
+              rc = copy_bytes (fpin, fpout, partlen);
+              if (rc > 0)
+                goto write_error;
+              if (rc)
+                goto read_error;
             }
         }
       else if (partial == 2)
@@ -694,14 +757,11 @@ write_part (FILE *fpin, unsigned long pktlen,
             }
           if (!partlen)
             partial = 0; /* end of packet */
-          for (; partlen; partlen--)
-            {
-              c = getc (fpin);
-              if (c == EOF)
-                goto read_error;
-              if ( putc (c, fpout) == EOF )
-                goto write_error;
-            }
+          rc = copy_bytes (fpin, fpout, partlen);
+          if (rc > 0)
+            goto write_error;
+          if (rc)
+            goto read_error;
         }
       else
         { /* compressed: read to end */
@@ -737,11 +797,9 @@ write_part (FILE *fpin, unsigned long pktlen,
             }
           else
             {
-              while ( (c=getc (fpin)) != EOF )
-                {
-                  if ( putc (c, fpout) == EOF )
-                    goto write_error;
-                }
+              rc = copy_to_eof (fpin, fpout, NULL);
+              if (rc > 0)
+                goto write_error;
             }
           if (!feof (fpin))
             goto read_error;
@@ -755,14 +813,11 @@ write_part (FILE *fpin, unsigned long pktlen,
     }
 
   /* standard packet or last segment of partial length encoded packet */
-  for (; pktlen; pktlen--)
-    {
-      c = getc (fpin);
-      if (c == EOF)
-        goto read_error;
-      if ( putc (c, fpout) == EOF )
-        goto write_error;
-    }
+  rc = copy_bytes (fpin, fpout, pktlen);
+  if (rc > 0)
+    goto write_error;
+  if (rc)
+    goto read_error;
 
  ready:
   if ( !opt_no_split && fclose (fpout) )
@@ -787,6 +842,287 @@ write_part (FILE *fpin, unsigned long pktlen,
 
 
 
+/* Store the keyid from the key material (BUF,BUFLEN) of a key packet
+ * at KEYID; PKTTYPE tells whether this is a secret key.  Returns true
+ * on success.  */
+static int
+key_packet_keyid (int pkttype, const unsigned char *buf, size_t buflen,
+                  unsigned char *keyid)
+{
+  gcry_md_hd_t md;
+  size_t len;
+  unsigned int nbytes;
+
+  if (!buflen)
+    return 0;
+  if (buf[0] == 2 || buf[0] == 3)
+    {
+      /* The low 64 bits of the RSA modulus.  */
+      if (buflen < 10 || buf[7] < 1 || buf[7] > 3)
+        return 0;
+      nbytes = (((buf[8] << 8) | buf[9]) + 7) / 8;
+      if (nbytes < 8 || buflen < 10 + nbytes)
+        return 0;
+      memcpy (keyid, buf + 10 + nbytes - 8, 8);
+      return 1;
+    }
+  else if (buf[0] == 4)
+    {
+      if (pkttype == PKT_SECRET_KEY || pkttype == PKT_SECRET_SUBKEY)
+        len = public_key_length (buf, buflen);
+      else
+        len = buflen;
+      if (!len || len > 0xffff)
+        return 0;
+      if (gcry_md_open (&md, GCRY_MD_SHA1, 0))
+        return 0;
+      gcry_md_putc (md, 0x99);
+      gcry_md_putc (md, len >> 8);
+      gcry_md_putc (md, len);
+      gcry_md_write (md, buf, len);
+      memcpy (keyid, gcry_md_read (md, 0) + 12, 8);
+      gcry_md_close (md);
+      return 1;
+    }
+  else if (buf[0] == 5)
+    {
+      if (buflen < 10)
+        return 0;
+      len = 10 + buf32_to_size_t (buf + 6);
+      if (len < 10 || len > buflen)
+        return 0;
+      if (gcry_md_open (&md, GCRY_MD_SHA256, 0))
+        return 0;
+      gcry_md_putc (md, 0x9a);
+      gcry_md_putc (md, len >> 24);
+      gcry_md_putc (md, len >> 16);
+      gcry_md_putc (md, len >> 8);
+      gcry_md_putc (md, len);
+      gcry_md_write (md, buf, len);
+      memcpy (keyid, gcry_md_read (md, 0), 8);
+      gcry_md_close (md);
+      return 1;
+    }
+
+  return 0;
+}
+
+
+/* Look for an issuer or issuer fingerprint subpacket in the
+ * subpacket area (BUF,BUFLEN) and store the keyid at KEYID.  The
+ * subpackets are not further decoded.  Returns true on success.  */
+static int
+find_issuer (const unsigned char *buf, size_t buflen, unsigned char *keyid)
+{
+  size_t n;
+
+  while (buflen)
+    {
+      n = *buf++; buflen--;
+      if (n == 255)
+        {
+          if (buflen < 4)
+            return 0;
+          n = buf32_to_size_t (buf);
+          buf += 4; buflen -= 4;
+        }
+      else if (n >= 192)
+        {
+          if (buflen < 1)
+            return 0;
+          n = ((n - 192) << 8) + *buf + 192;
+          buf++; buflen--;
+        }
+      if (!n || buflen < n)
+        return 0;
+
+      if ((buf[0] & 0x7f) == SIGSUBPKT_ISSUER && n == 9)
+        {
+          memcpy (keyid, buf + 1, 8);
+          return 1;
+        }
+      if ((buf[0] & 0x7f) == SIGSUBPKT_ISSUER_FPR)
+        {
+          if (n == 22 && buf[1] == 4)
+            {
+              memcpy (keyid, buf + 2 + 12, 8);
+              return 1;
+            }
+          if (n == 34 && buf[1] == 5)
+            {
+              memcpy (keyid, buf + 2, 8);
+              return 1;
+            }
+        }
+      buf += n; buflen -= n;
+    }
+  return 0;
+}
+
+
+/* Store the keyid of the packet of type PKTTYPE with the body
+ * (BUF,BUFLEN) at KEYID.  Returns true if the packet has a keyid.  */
+static int
+packet_keyid (int pkttype, const unsigned char *buf, size_t buflen,
+              unsigned char *keyid)
+{
+  size_t n;
+
+  switch (pkttype)
+    {
+    case PKT_PUBKEY_ENC:
+      if (buflen < 9 || buf[0] != 3)
+        return 0;
+      memcpy (keyid, buf + 1, 8);
+      return 1;
+
+    case PKT_ONEPASS_SIG:
+      if (buflen < 12 || buf[0] != 3)
+        return 0;
+      memcpy (keyid, buf + 4, 8);
+      return 1;
+
+    case PKT_SIGNATURE:
+      if (buflen >= 15 && (buf[0] == 2 || buf[0] == 3))
+        {
+          memcpy (keyid, buf + 7, 8);
+          return 1;
+        }
+      if (buflen < 6 || (buf[0] != 4 && buf[0] != 5))
+        return 0;
+      n = (buf[4] << 8) | buf[5];
+      buf += 6; buflen -= 6;
+      if (buflen < n)
+        return 0;
+      if (find_issuer (buf, n, keyid))
+        return 1;
+      buf += n; buflen -= n;
+      if (buflen < 2)
+        return 0;
+      n = (buf[0] << 8) | buf[1];
+      buf += 2; buflen -= 2;
+      if (buflen < n)
+        return 0;
+      return find_issuer (buf, n, keyid);
+
+    case PKT_PUBLIC_KEY:
+    case PKT_PUBLIC_SUBKEY:
+    case PKT_SECRET_KEY:
+    case PKT_SECRET_SUBKEY:
+      return key_packet_keyid (pkttype, buf, buflen, keyid);
+
+    default:
+      return 0;
+    }
+}
+
+
+/* Print a line describing the packet with the header HDR of HDRLEN
+ * bytes and skip its body.  This is used with --list; only the
+ * packet headers and, to get the keyid, the body of small packets
+ * are looked at.  */
+static int
+list_part (FILE *fpin, unsigned long pktlen,
+           int pkttype, int partial, unsigned char *hdr, size_t hdrlen)
+{
+  static unsigned char *peekbuf;
+  unsigned long long offset = list_offset;
+  unsigned long long bodylen = 0;
+  unsigned char keyid[8];
+  int have_keyid = 0;
+  int c, rc;
+
+  list_offset += hdrlen;
+  if (!partial)
+    {
+      if (pktlen <= LIST_MAX_PEEK
+          && (pkttype == PKT_PUBKEY_ENC || pkttype == PKT_ONEPASS_SIG
+              || pkttype == PKT_SIGNATURE
+              || pkttype == PKT_PUBLIC_KEY || pkttype == PKT_PUBLIC_SUBKEY
+              || pkttype == PKT_SECRET_KEY || pkttype == PKT_SECRET_SUBKEY))
+        {
+          if (!peekbuf)
+            peekbuf = xmalloc (LIST_MAX_PEEK);
+          if (fread (peekbuf, 1, pktlen, fpin) != pktlen)
+            return -1;
+          have_keyid = packet_keyid (pkttype, peekbuf, pktlen, keyid);
+        }
+      else if ((rc = copy_bytes (fpin, NULL, pktlen)))
+        return rc;
+      bodylen = pktlen;
+    }
+  else if (partial == 1)
+    {
+      /* The first length byte is in PKTLEN and already counted.  */
+      for (c = pktlen; c >= 224 && c < 255; list_offset++)
+        {
+          pktlen = 1 << (c & 0x1f);
+          if ((rc = copy_bytes (fpin, NULL, pktlen)))
+            return rc;
+          bodylen += pktlen;
+          if ((c = getc (fpin)) == EOF)
+            return -1;
+        }
+      if (c < 192)
+        pktlen = c;
+      else if (c < 224)
+        {
+          pktlen = (c - 192) * 256;
+          if ((c = getc (fpin)) == EOF)
+            return -1;
+          pktlen += c + 192;
+          list_offset++;
+        }
+      else
+        {
+          if (read_u32 (fpin, &pktlen))
+            return -1;
+          list_offset += 4;
+        }
+      if ((rc = copy_bytes (fpin, NULL, pktlen)))
+        return rc;
+      bodylen += pktlen;
+    }
+  else if (partial == 2)
+    {
+      size_t partlen;
+
+      do
+        {
+          if (read_u16 (fpin, &partlen))
+            return -1;
+          list_offset += 2;
+          if ((rc = copy_bytes (fpin, NULL, partlen)))
+            return rc;
+          bodylen += partlen;
+        }
+      while (partlen);
+    }
+  else
+    {
+      if (copy_to_eof (fpin, NULL, &bodylen) || !feof (fpin))
+        return -1;
+    }
+  list_offset += bodylen;
+
+  printf ("off=%llu ctb=%02x tag=%d hlen=%u plen=%llu%s %s",
+          offset, hdr[0], pkttype, (unsigned int)hdrlen, bodylen,
+          !partial? "" : partial == 1? " partial" : " indeterminate",
+          pkttype_to_string (pkttype));
+  if (have_keyid)
+    printf (" keyid=%02X%02X%02X%02X%02X%02X%02X%02X",
+            keyid[0], keyid[1], keyid[2], keyid[3],
+            keyid[4], keyid[5], keyid[6], keyid[7]);
+  putchar ('\n');
+  if (ferror (stdout))
+    {
+      log_error ("error writing to stdout: %s\n", strerror (errno));
+      return 2;
+    }
+  return 0;
+}
+
+
 static int
 do_split (FILE *fp)
 {
@@ -866,6 +1202,8 @@ do_split (FILE *fp)
 	}
     }
 
+  if (opt_list)
+    return list_part (fp, pktlen, pkttype, partial, header, header_idx);
   return write_part (fp, pktlen, pkttype, partial, header, header_idx);
 }
 
@@ -30,6 +30,7 @@
 # include <windows.h>
 #else /*!HAVE_W32_SYSTEM*/
 # include <unistd.h>
+# include <fcntl.h>
 # include <pwd.h>
 # include <grp.h>
 #endif /*!HAVE_W32_SYSTEM*/
@@ -45,6 +46,13 @@
 #define lstat(a,b) stat ((a), (b))
 #endif
 
+/* The size of the buffer used to copy the files.  Must be a multiple
+ * of RECORDSIZE.  */
+#define COPYBUFSIZE (1024 * 1024)
+
+/* The number of files opened ahead of the one being copied.  */
+#define READAHEAD_FILES 16
+
 
 /* Object to control the file scanning.  */
 struct scanctrl_s;
@@ -57,6 +65,17 @@ struct scanctrl_s
 };
 
 
+/* Object to open the next files while the current one is copied.  */
+struct readahead_s
+{
+  tar_header_t next;  /* The next header to look at.  */
+  tar_header_t hdr[READAHEAD_FILES];
+  estream_t fp[READAHEAD_FILES];
+  unsigned int head;
+  unsigned int count;
+};
+
+
 
 
 /* Given a fresh header object HDR with only the name field set, try
@@ -133,15 +152,28 @@ fillup_entry_w32 (tar_header_t hdr)
 
 
 /* Given a fresh header object HDR with only the name field set, try
-   to gather all available info.  This is the POSIX version.  */
+   to gather all available info.  This is the POSIX version.  If DFD
+   is not -1 it is the descriptor of the directory with the file
+   ENTRYNAME; this saves the lookup of the full name.  */
 #ifndef HAVE_W32_SYSTEM
 static gpg_error_t
-fillup_entry_posix (tar_header_t hdr)
+fillup_entry_posix (tar_header_t hdr, int dfd, const char *entryname)
 {
   gpg_error_t err;
   struct stat sbuf;
+  int rc;
 
-  if (lstat (hdr->name, &sbuf))
+#ifdef HAVE_FSTATAT
+  if (dfd != -1 && entryname)
+    rc = fstatat (dfd, entryname, &sbuf, AT_SYMLINK_NOFOLLOW);
+  else
+#endif
+    {
+      (void)dfd;
+      (void)entryname;
+      rc = lstat (hdr->name, &sbuf);
+    }
+  if (rc)
     {
       err = gpg_error_from_syserror ();
       log_error ("error stat-ing '%s': %s\n", hdr->name, gpg_strerror (err));
@@ -216,9 +248,11 @@ fillup_entry_posix (tar_header_t hdr)
 /* Add a new entry.  The name of a director entry is ENTRYNAME; if
    that is NULL, DNAME is the name of the directory itself.  Under
    Windows ENTRYNAME shall have backslashes replaced by standard
-   slashes.  */
+   slashes.  DFD is -1 or the descriptor of the open directory
+   DNAME.  */
 static gpg_error_t
-add_entry (const char *dname, const char *entryname, scanctrl_t scanctrl)
+add_entry (const char *dname, const char *entryname, int dfd,
+           scanctrl_t scanctrl)
 {
   gpg_error_t err;
   tar_header_t hdr;
@@ -245,9 +279,10 @@ add_entry (const char *dname, const char *entryname, scanctrl_t scanctrl)
         hdr->name[dnamelen-1] = 0;
     }
 #ifdef HAVE_DOSISH_SYSTEM
+  (void)dfd;
   err = fillup_entry_w32 (hdr);
 #else
-  err = fillup_entry_posix (hdr);
+  err = fillup_entry_posix (hdr, dfd, entryname);
 #endif
   if (err)
     xfree (hdr);
@@ -336,9 +371,9 @@ scan_directory (const char *dname, scanctrl_t scanctrl)
       if (!strcmp (fname, "." ) || !strcmp (fname, ".."))
         err = 0; /* Skip self and parent dir entry.  */
       else if (!strncmp (dname, "./", 2) && dname[2])
-        err = add_entry (dname+2, fname, scanctrl);
+        err = add_entry (dname+2, fname, -1, scanctrl);
       else
-        err = add_entry (dname, fname, scanctrl);
+        err = add_entry (dname, fname, -1, scanctrl);
       xfree (fname);
     }
   while (!err && FindNextFileW (hd, &fi));
@@ -360,6 +395,7 @@ scan_directory (const char *dname, scanctrl_t scanctrl)
 #else /*!HAVE_W32_SYSTEM*/
   DIR *dir;
   struct dirent *de;
+  int dfd;
 
   if (!*dname)
     return 0;  /* An empty directory name has no entries.  */
@@ -372,13 +408,16 @@ scan_directory (const char *dname, scanctrl_t scanctrl)
                  dname, gpg_strerror (err));
       return err;
     }
+  /* With a tree of many small files the time is spent in the
+   * syscalls; thus stat the entries relative to the directory.  */
+  dfd = dirfd (dir);
 
   while ((de = readdir (dir)))
     {
       if (!strcmp (de->d_name, "." ) || !strcmp (de->d_name, ".."))
         continue; /* Skip self and parent dir entry.  */
 
-      err = add_entry (dname, de->d_name, scanctrl);
+      err = add_entry (dname, de->d_name, dfd, scanctrl);
       if (err)
         goto leave;
      }
@@ -651,13 +690,110 @@ build_header (void *record, tar_header_t hdr)
 }
 
 
+/* Write the NBYTES of BUFFER, a multiple of RECORDSIZE, to STREAM.  */
 static gpg_error_t
-write_file (estream_t stream, tar_header_t hdr)
+write_records (estream_t stream, const void *buffer, size_t nbytes)
 {
   gpg_error_t err;
-  char record[RECORDSIZE];
+  size_t nwritten;
+
+  nwritten = es_fwrite (buffer, 1, nbytes, stream);
+  if (nwritten != nbytes)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error writing '%s': %s\n",
+                 es_fname_get (stream), gpg_strerror (err));
+    }
+  else
+    err = 0;
+
+  return err;
+}
+
+
+/* Open the file of HDR for reading.  */
+static estream_t
+open_input_file (tar_header_t hdr)
+{
   estream_t infp;
-  size_t nread, nbytes;
+
+  infp = es_fopen (hdr->name, "rb");
+  /* We read large blocks; there is no need to copy them through the
+   * stream's buffer.  */
+  if (infp)
+    es_setvbuf (infp, NULL, _IONBF, 0);
+  return infp;
+}
+
+
+/* Open the next regular files of the list at RA->NEXT so that the
+ * kernel can read them ahead while the current file is copied.  */
+static void
+readahead_fill (struct readahead_s *ra)
+{
+#ifdef HAVE_POSIX_FADVISE
+  tar_header_t hdr;
+  estream_t fp;
+  unsigned int idx;
+
+  while (ra->count < READAHEAD_FILES && (hdr = ra->next))
+    {
+      ra->next = hdr->next;
+      if (hdr->typeflag != TF_REGULAR || !hdr->size)
+        continue;
+      fp = open_input_file (hdr);
+      if (!fp)
+        continue;  /* write_file will try again and print the error.  */
+      posix_fadvise (es_fileno (fp), 0, 0, POSIX_FADV_WILLNEED);
+      idx = (ra->head + ra->count) % READAHEAD_FILES;
+      ra->hdr[idx] = hdr;
+      ra->fp[idx] = fp;
+      ra->count++;
+    }
+#else
+  (void)ra;
+#endif
+}
+
+
+/* Return the stream of HDR if it has already been opened by
+ * readahead_fill or NULL.  */
+static estream_t
+readahead_take (struct readahead_s *ra, tar_header_t hdr)
+{
+  estream_t fp;
+
+  if (!ra->count || ra->hdr[ra->head] != hdr)
+    return NULL;
+  fp = ra->fp[ra->head];
+  ra->head = (ra->head + 1) % READAHEAD_FILES;
+  ra->count--;
+  return fp;
+}
+
+
+/* Close all streams opened by readahead_fill.  */
+static void
+readahead_release (struct readahead_s *ra)
+{
+  for (; ra->count; ra->count--)
+    {
+      es_fclose (ra->fp[ra->head]);
+      ra->head = (ra->head + 1) % READAHEAD_FILES;
+    }
+}
+
+
+/* Write the entry HDR to STREAM.  INFP is NULL or the already opened
+ * file of HDR; it is closed by this function in any case.  BUFFER of
+ * COPYBUFSIZE is used to copy the file.  */
+static gpg_error_t
+write_file (estream_t stream, tar_header_t hdr, estream_t infp, char *buffer)
+{
+  gpg_error_t err;
+  char record[RECORDSIZE];
+  size_t nread, nbytes, nrecbytes;
+  unsigned long long remaining;
   int any;
 
   err = build_header (record, hdr);
@@ -668,12 +804,14 @@ write_file (estream_t stream, tar_header_t hdr)
           log_info ("skipping unsupported file '%s'\n", hdr->name);
           err = 0;
         }
+      es_fclose (infp);
       return err;
     }
 
   if (hdr->typeflag == TF_REGULAR)
     {
-      infp = es_fopen (hdr->name, "rb");
+      if (!infp)
+        infp = open_input_file (hdr);
       if (!infp)
         {
           err = gpg_error_from_syserror ();
@@ -683,7 +821,10 @@ write_file (estream_t stream, tar_header_t hdr)
         }
     }
   else
-    infp = NULL;
+    {
+      es_fclose (infp);
+      infp = NULL;
+    }
 
   err = write_record (stream, record);
   if (err)
@@ -692,13 +833,12 @@ write_file (estream_t stream, tar_header_t hdr)
   if (hdr->typeflag == TF_REGULAR)
     {
       hdr->nrecords = (hdr->size + RECORDSIZE-1)/RECORDSIZE;
+      remaining = hdr->size;
       any = 0;
-      while (hdr->nrecords--)
+      while (remaining)
         {
-          nbytes = hdr->nrecords? RECORDSIZE : (hdr->size % RECORDSIZE);
-          if (!nbytes)
-            nbytes = RECORDSIZE;
-          nread = es_fread (record, 1, nbytes, infp);
+          nbytes = remaining > COPYBUFSIZE? COPYBUFSIZE : remaining;
+          nread = es_fread (buffer, 1, nbytes, infp);
           if (nread != nbytes)
             {
               err = gpg_error_from_syserror ();
@@ -708,7 +848,11 @@ write_file (estream_t stream, tar_header_t hdr)
               goto leave;
             }
           any = 1;
-          err = write_record (stream, record);
+          remaining -= nbytes;
+          /* Pad the last record with zeroes.  */
+          nrecbytes = (nbytes + RECORDSIZE - 1) / RECORDSIZE * RECORDSIZE;
+          memset (buffer + nbytes, 0, nrecbytes - nbytes);
+          err = write_records (stream, buffer, nrecbytes);
           if (err)
             goto leave;
         }
@@ -742,6 +886,244 @@ write_eof_mark (estream_t stream)
 
 
 
+/* Return the arguments for gpg to encrypt and/or sign or NULL on
+ * error.  */
+static const char **
+build_gpg_argv (int encrypt, int sign)
+{
+  strlist_t arg;
+  ccparray_t ccp;
+
+  /* '--encrypt' may be combined with '--symmetric', but 'encrypt'
+     is set either way.  Clear it if no recipients are specified.
+     XXX: Fix command handling.  */
+  if (opt.symmetric && opt.recipients == NULL)
+    encrypt = 0;
+
+  ccparray_init (&ccp, 0);
+  if (encrypt)
+    ccparray_put (&ccp, "--encrypt");
+  if (sign)
+    ccparray_put (&ccp, "--sign");
+  if (opt.user)
+    {
+      ccparray_put (&ccp, "--local-user");
+      ccparray_put (&ccp, opt.user);
+    }
+  if (opt.symmetric)
+    ccparray_put (&ccp, "--symmetric");
+  for (arg = opt.recipients; arg; arg = arg->next)
+    {
+      ccparray_put (&ccp, "--recipient");
+      ccparray_put (&ccp, arg->d);
+    }
+  for (arg = opt.gpg_arguments; arg; arg = arg->next)
+    ccparray_put (&ccp, arg->d);
+
+  ccparray_put (&ccp, NULL);
+  return ccparray_get (&ccp, NULL);
+}
+
+
+/* Run gpg with ARGV on the memory stream PLAIN and append the result
+ * to CIPHER_STREAM.  The number of bytes written is stored at
+ * R_LENGTH.  BUFFER of COPYBUFSIZE is used for the copying.  */
+static gpg_error_t
+encrypt_segment (const char **argv, estream_t plain, estream_t cipher_stream,
+                 char *buffer, unsigned long long *r_length)
+{
+  gpg_error_t err;
+  estream_t segout;
+  size_t n;
+
+  *r_length = 0;
+  if (es_fseek (plain, 0, SEEK_SET))
+    return gpg_error_from_syserror ();
+
+  segout = es_fopenmem (0, "rwb");
+  if (!segout)
+    return gpg_error_from_syserror ();
+
+  /* We need to know the length of the message; thus we do not
+   * write it directly to CIPHER_STREAM which may be a pipe.  */
+  err = gnupg_exec_tool_stream (opt.gpg_program, argv,
+                                plain, NULL, segout, NULL, NULL);
+  if (err)
+    goto leave;
+  if (es_fseek (segout, 0, SEEK_SET))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  while ((n = es_fread (buffer, 1, COPYBUFSIZE, segout)))
+    {
+      if (es_fwrite (buffer, 1, n, cipher_stream) != n)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error writing '%s': %s\n",
+                     es_fname_get (cipher_stream), gpg_strerror (err));
+          goto leave;
+        }
+      *r_length += n;
+    }
+
+ leave:
+  es_fclose (segout);
+  return err;
+}
+
+
+/* Write the files FLIST as an indexed archive to CIPHER_STREAM; see
+ * gpgtar.h for the format.  A new segment is started after
+ * INDEX_SEGMENT_SIZE bytes of plaintext so that a member can be
+ * extracted by decrypting only its segment and the archive can be
+ * listed by decrypting only the index.  */
+static gpg_error_t
+write_indexed_archive (estream_t cipher_stream, tar_header_t flist,
+                       int encrypt, int sign, char *buffer,
+                       struct readahead_s *readahead)
+{
+  gpg_error_t err = 0;
+  const char **argv;
+  estream_t plain = NULL;
+  estream_t members = NULL;
+  estream_t index = NULL;
+  unsigned long long *seglist = NULL;
+  unsigned int nsegments = 0;
+  unsigned int nmembers = 0;
+  unsigned long long offset = 0;
+  unsigned long long length;
+  unsigned char buf[16];
+  char record[RECORDSIZE];
+  tar_header_t hdr;
+  size_t n;
+  void *tmp;
+
+  argv = build_gpg_argv (encrypt, sign);
+  members = es_fopenmem (0, "rwb");
+  if (!argv || !members)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  readahead->next = flist;
+  hdr = flist;
+  while (hdr)
+    {
+      plain = es_fopenmem (0, "rwb");
+      if (!plain)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      for (; hdr && es_ftello (plain) < INDEX_SEGMENT_SIZE; hdr = hdr->next)
+        {
+          /* Unsupported files are skipped by write_file.  */
+          if (!build_header (record, hdr))
+            {
+              ulongtobuf (buf, nsegments);
+              if (es_fwrite (buf, 1, 4, members) != 4
+                  || es_fwrite (record, 1, RECORDSIZE, members) != RECORDSIZE)
+                {
+                  err = gpg_error_from_syserror ();
+                  goto leave;
+                }
+              nmembers++;
+            }
+          readahead_fill (readahead);
+          err = write_file (plain, hdr, readahead_take (readahead, hdr),
+                            buffer);
+          if (err)
+            goto leave;
+        }
+      err = write_eof_mark (plain);
+      if (err)
+        goto leave;
+
+      err = encrypt_segment (argv, plain, cipher_stream, buffer, &length);
+      if (err)
+        goto leave;
+      es_fclose (plain);
+      plain = NULL;
+
+      tmp = xtryrealloc (seglist, (nsegments + 1) * 2 * sizeof *seglist);
+      if (!tmp)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      seglist = tmp;
+      seglist[2*nsegments] = offset;
+      seglist[2*nsegments+1] = length;
+      nsegments++;
+      offset += length;
+      if (opt.verbose)
+        log_info ("segment %u: %llu bytes\n", nsegments, length);
+    }
+
+  /* Build and write the index.  */
+  index = es_fopenmem (0, "rwb");
+  if (!index)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  memcpy (buf, INDEX_MAGIC, 8);
+  ulongtobuf (buf + 8, nsegments);
+  ulongtobuf (buf + 12, nmembers);
+  if (es_fwrite (buf, 1, 16, index) != 16)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (n=0; n < nsegments; n++)
+    {
+      u64tobuf (buf, seglist[2*n]);
+      u64tobuf (buf + 8, seglist[2*n+1]);
+      if (es_fwrite (buf, 1, 16, index) != 16)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+  if (es_fseek (members, 0, SEEK_SET))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  while ((n = es_fread (buffer, 1, COPYBUFSIZE, members)))
+    if (es_fwrite (buffer, 1, n, index) != n)
+      {
+        err = gpg_error_from_syserror ();
+        goto leave;
+      }
+
+  err = encrypt_segment (argv, index, cipher_stream, buffer, &length);
+  if (err)
+    goto leave;
+
+  memcpy (record, INDEX_TRAILER_MAGIC, 16);
+  u64tobuf (record + 16, offset);
+  u64tobuf (record + 24, length);
+  if (es_fwrite (record, 1, INDEX_TRAILER_SIZE, cipher_stream)
+      != INDEX_TRAILER_SIZE)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error writing '%s': %s\n",
+                 es_fname_get (cipher_stream), gpg_strerror (err));
+    }
+
+ leave:
+  es_fclose (index);
+  es_fclose (plain);
+  es_fclose (members);
+  xfree (seglist);
+  xfree (argv);
+  return err;
+}
+
+
 /* Create a new tarball using the names in the array INPATTERN.  If
    INPATTERN is NULL take the pattern as null terminated strings from
    stdin.  */
@@ -755,12 +1137,15 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
   estream_t outstream = NULL;
   estream_t cipher_stream = NULL;
   int eof_seen = 0;
+  char *buffer = NULL;
+  struct readahead_s readahead;
 
   if (!inpattern)
     es_set_binary (es_stdin);
 
   memset (scanctrl, 0, sizeof *scanctrl);
   scanctrl->flist_tail = &scanctrl->flist;
+  memset (&readahead, 0, sizeof readahead);
 
   if (opt.directory && gnupg_chdir (opt.directory))
     {
@@ -849,7 +1234,7 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
       start_tail = scanctrl->flist_tail;
       if (skip_this || !pattern_valid_p (pat))
         log_error ("skipping invalid name '%s'\n", pat);
-      else if (!add_entry (pat, NULL, scanctrl)
+      else if (!add_entry (pat, NULL, -1, scanctrl)
                && *start_tail && ((*start_tail)->typeflag & TF_DIRECTORY))
         scan_recursive (pat, scanctrl);
 
@@ -887,9 +1272,25 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
         }
     }
 
+  buffer = xtrymalloc (COPYBUFSIZE);
+  if (!buffer)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if ((encrypt || sign) && opt.index)
+    {
+      err = write_indexed_archive (cipher_stream, scanctrl->flist,
+                                   encrypt, sign, buffer, &readahead);
+      goto leave;
+    }
+
+  readahead.next = scanctrl->flist;
   for (hdr = scanctrl->flist; hdr; hdr = hdr->next)
     {
-      err = write_file (outstream, hdr);
+      readahead_fill (&readahead);
+      err = write_file (outstream, hdr, readahead_take (&readahead, hdr),
+                        buffer);
       if (err)
         goto leave;
     }
@@ -899,42 +1300,13 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
 
   if (encrypt || sign)
     {
-      strlist_t arg;
-      ccparray_t ccp;
       const char **argv;
 
       err = es_fseek (outstream, 0, SEEK_SET);
       if (err)
         goto leave;
 
-      /* '--encrypt' may be combined with '--symmetric', but 'encrypt'
-         is set either way.  Clear it if no recipients are specified.
-         XXX: Fix command handling.  */
-      if (opt.symmetric && opt.recipients == NULL)
-        encrypt = 0;
-
-      ccparray_init (&ccp, 0);
-      if (encrypt)
-        ccparray_put (&ccp, "--encrypt");
-      if (sign)
-        ccparray_put (&ccp, "--sign");
-      if (opt.user)
-        {
-          ccparray_put (&ccp, "--local-user");
-          ccparray_put (&ccp, opt.user);
-        }
-      if (opt.symmetric)
-        ccparray_put (&ccp, "--symmetric");
-      for (arg = opt.recipients; arg; arg = arg->next)
-        {
-          ccparray_put (&ccp, "--recipient");
-          ccparray_put (&ccp, arg->d);
-        }
-      for (arg = opt.gpg_arguments; arg; arg = arg->next)
-        ccparray_put (&ccp, arg->d);
-
-      ccparray_put (&ccp, NULL);
-      argv = ccparray_get (&ccp, NULL);
+      argv = build_gpg_argv (encrypt, sign);
       if (!argv)
         {
           err = gpg_error_from_syserror ();
@@ -976,6 +1348,8 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
       if (opt.outfile)
         gnupg_remove (opt.outfile);
     }
+  readahead_release (&readahead);
+  xfree (buffer);
   scanctrl->flist_tail = NULL;
   while ( (hdr = scanctrl->flist) )
     {
@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "../common/i18n.h"
 #include "../common/exectool.h"
@@ -34,13 +35,262 @@
 #include "gpgtar.h"
 
 
+/* The size of the buffer used to copy large files.  Must be a
+ * multiple of RECORDSIZE.  */
+#define COPYBUFSIZE (1024 * 1024)
+
+/* The number of threads writing the extracted files.  */
+#define WRITE_BEHIND_THREADS 4
+
+/* Files up to this size are written by the threads.  */
+#define WRITE_BEHIND_MAXFILESIZE COPYBUFSIZE
+
+/* The maximum number of bytes queued for the threads.  */
+#define WRITE_BEHIND_MAXQUEUED (64 * 1024 * 1024)
+
+
+/* A file to be written by a thread.  */
+struct wb_job_s
+{
+  struct wb_job_s *next;
+  char *fname;
+  size_t length;
+  char data[1];
+};
+typedef struct wb_job_s *wb_job_t;
+
+/* The queue of one thread.  The file names are distributed to the
+ * queues by a hash so that the same file is always written by the
+ * same thread and in the order of the archive.  */
+struct wb_queue_s
+{
+  npth_t thread;
+  wb_job_t jobs;
+  wb_job_t *jobs_tail;
+};
+
+/* The state of the write-behind threads.  */
+static struct
+{
+  int running;              /* The threads have been started.  */
+  int finish;               /* Ask the threads to terminate.  */
+  npth_mutex_t lock;        /* Protects this object.  */
+  npth_cond_t work_cond;    /* Signaled if a job has been queued.  */
+  npth_cond_t done_cond;    /* Signaled if a job has been done.  */
+  size_t queued;            /* Number of bytes queued.  */
+  int busy;                 /* Number of jobs being processed.  */
+  gpg_error_t err;          /* The first error of a thread.  */
+  struct wb_queue_s queue[WRITE_BEHIND_THREADS];
+} write_behind;
+
+/* The buffer to copy large files.  */
+static char *copybuf;
+
+
+/* Write the LENGTH bytes of DATA to the new file FNAME.  */
+static gpg_error_t
+write_file_data (const char *fname, const void *data, size_t length)
+{
+  gpg_error_t err = 0;
+  estream_t outfp;
+
+  if (opt.dry_run)
+    outfp = es_fopenmem (0, "wb");
+  else
+    outfp = es_fopen (fname, "wb");
+  if (!outfp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error creating '%s': %s\n", fname, gpg_strerror (err));
+      return err;
+    }
+  es_setvbuf (outfp, NULL, _IONBF, 0);
+
+  if (length && es_fwrite (data, 1, length, outfp) != length)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error writing '%s': %s\n", fname, gpg_strerror (err));
+    }
+  if (es_fclose (outfp) && !err)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error writing '%s': %s\n", fname, gpg_strerror (err));
+    }
+
+  if (err)
+    {
+      if (gnupg_remove (fname))
+        log_error ("error removing incomplete file '%s': %s\n",
+                   fname, gpg_strerror (gpg_error_from_syserror ()));
+    }
+  else if (opt.verbose)
+    log_info ("extracted '%s'\n", fname);
+  return err;
+}
+
+
+/* The thread to write the files of the queue ARG.  */
+static void *
+write_behind_thread (void *arg)
+{
+  struct wb_queue_s *queue = arg;
+  wb_job_t job;
+  gpg_error_t err;
+
+  npth_mutex_lock (&write_behind.lock);
+  for (;;)
+    {
+      while (!queue->jobs && !write_behind.finish)
+        npth_cond_wait (&write_behind.work_cond, &write_behind.lock);
+      job = queue->jobs;
+      if (!job)
+        break;  /* Finished.  */
+      queue->jobs = job->next;
+      if (!queue->jobs)
+        queue->jobs_tail = &queue->jobs;
+      write_behind.busy++;
+      npth_mutex_unlock (&write_behind.lock);
+
+      /* Note that the syscall clamp releases the nPth lock while the
+       * file is written.  */
+      err = write_file_data (job->fname, job->data, job->length);
+
+      npth_mutex_lock (&write_behind.lock);
+      write_behind.busy--;
+      write_behind.queued -= job->length;
+      if (err && !write_behind.err)
+        write_behind.err = err;
+      npth_cond_broadcast (&write_behind.done_cond);
+      xfree (job->fname);
+      xfree (job);
+    }
+  npth_mutex_unlock (&write_behind.lock);
+  return NULL;
+}
+
+
+/* Start the write-behind threads.  On error the files are written
+ * directly.  */
+static void
+start_write_behind (void)
+{
+  npth_attr_t tattr;
+  int i, ret;
+
+  if (npth_mutex_init (&write_behind.lock, NULL)
+      || npth_cond_init (&write_behind.work_cond, NULL)
+      || npth_cond_init (&write_behind.done_cond, NULL))
+    return;
+  if (npth_attr_init (&tattr))
+    return;
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+
+  for (i=0; i < WRITE_BEHIND_THREADS; i++)
+    {
+      write_behind.queue[i].jobs = NULL;
+      write_behind.queue[i].jobs_tail = &write_behind.queue[i].jobs;
+      ret = npth_create (&write_behind.queue[i].thread, &tattr,
+                         write_behind_thread, &write_behind.queue[i]);
+      if (ret)
+        {
+          log_error ("error spawning thread: %s\n", strerror (ret));
+          break;
+        }
+    }
+  npth_attr_destroy (&tattr);
+  write_behind.running = i;
+}
+
+
+/* Wait until all queued files have been written.  */
+static void
+drain_write_behind (void)
+{
+  if (!write_behind.running)
+    return;
+  npth_mutex_lock (&write_behind.lock);
+  while (write_behind.queued || write_behind.busy)
+    npth_cond_wait (&write_behind.done_cond, &write_behind.lock);
+  npth_mutex_unlock (&write_behind.lock);
+}
+
+
+/* Write all queued files and terminate the threads.  Returns the
+ * first error of the threads.  */
+static gpg_error_t
+stop_write_behind (void)
+{
+  int i;
+
+  if (!write_behind.running)
+    return 0;
+  npth_mutex_lock (&write_behind.lock);
+  write_behind.finish = 1;
+  npth_cond_broadcast (&write_behind.work_cond);
+  npth_mutex_unlock (&write_behind.lock);
+  for (i=0; i < write_behind.running; i++)
+    npth_join (write_behind.queue[i].thread, NULL);
+  write_behind.running = 0;
+  return write_behind.err;
+}
+
+
+/* Queue the file FNAME with the NRECORDS records read from STREAM of
+ * which LENGTH bytes are to be written.  FNAME is taken over.  */
+static gpg_error_t
+queue_write_behind (estream_t stream, char *fname,
+                    size_t length, unsigned long long nrecords)
+{
+  gpg_error_t err;
+  wb_job_t job;
+  struct wb_queue_s *queue;
+  unsigned int hash;
+  const char *s;
+
+  job = xtrymalloc (sizeof *job + nrecords * RECORDSIZE);
+  if (!job)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (fname);
+      return err;
+    }
+  err = read_records (stream, job->data, nrecords);
+  if (err)
+    {
+      xfree (job);
+      xfree (fname);
+      return err;
+    }
+  job->next = NULL;
+  job->fname = fname;
+  job->length = length;
+
+  for (hash = 0, s = fname; *s; s++)
+    hash = hash * 31 + *(const unsigned char *)s;
+  queue = &write_behind.queue[hash % write_behind.running];
+
+  npth_mutex_lock (&write_behind.lock);
+  while (write_behind.queued
+         && write_behind.queued + length > WRITE_BEHIND_MAXQUEUED)
+    npth_cond_wait (&write_behind.done_cond, &write_behind.lock);
+  write_behind.queued += length;
+  *queue->jobs_tail = job;
+  queue->jobs_tail = &job->next;
+  npth_cond_broadcast (&write_behind.work_cond);
+  err = write_behind.err;
+  npth_mutex_unlock (&write_behind.lock);
+
+  return err;
+}
+
+
 static gpg_error_t
 extract_regular (estream_t stream, const char *dirname,
                  tarinfo_t info, tar_header_t hdr)
 {
   gpg_error_t err;
-  char record[RECORDSIZE];
-  size_t n, nbytes, nwritten;
+  unsigned long long n, nrecs;
+  size_t nbytes, nwritten;
   char *fname;
   estream_t outfp = NULL;
 
@@ -54,6 +304,29 @@ extract_regular (estream_t stream, const char *dirname,
   else
     err = 0;
 
+  /* Small files are written by the threads so that creating and
+   * writing the files on a slow file system does not stall the
+   * extraction.  */
+  if (write_behind.running && hdr->size <= WRITE_BEHIND_MAXFILESIZE
+      && hdr->nrecords * RECORDSIZE >= hdr->size)
+    {
+      info->nblocks += hdr->nrecords;
+      return queue_write_behind (stream, fname, hdr->size, hdr->nrecords);
+    }
+
+  /* The file may have been queued before.  */
+  drain_write_behind ();
+
+  if (!copybuf)
+    {
+      copybuf = xtrymalloc (COPYBUFSIZE);
+      if (!copybuf)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+
   if (opt.dry_run)
     outfp = es_fopenmem (0, "wb");
   else
@@ -64,20 +337,23 @@ extract_regular (estream_t stream, const char *dirname,
       log_error ("error creating '%s': %s\n", fname, gpg_strerror (err));
       goto leave;
     }
+  es_setvbuf (outfp, NULL, _IONBF, 0);
 
-  for (n=0; n < hdr->nrecords;)
+  for (n=0; n < hdr->nrecords; n += nrecs)
     {
-      err = read_record (stream, record);
+      nrecs = hdr->nrecords - n;
+      if (nrecs > COPYBUFSIZE / RECORDSIZE)
+        nrecs = COPYBUFSIZE / RECORDSIZE;
+      err = read_records (stream, copybuf, nrecs);
       if (err)
         goto leave;
-      info->nblocks++;
-      n++;
-      if (n < hdr->nrecords || (hdr->size && !(hdr->size % RECORDSIZE)))
-        nbytes = RECORDSIZE;
-      else
-        nbytes = (hdr->size % RECORDSIZE);
+      info->nblocks += nrecs;
+      nbytes = nrecs * RECORDSIZE;
+      if (n + nrecs == hdr->nrecords
+          && (!hdr->size || (hdr->size % RECORDSIZE)))
+        nbytes -= RECORDSIZE - (hdr->size % RECORDSIZE);
 
-      nwritten = es_fwrite (record, 1, nbytes, outfp);
+      nwritten = es_fwrite (copybuf, 1, nbytes, outfp);
       if (nwritten != nbytes)
         {
           err = gpg_error_from_syserror ();
@@ -212,6 +488,82 @@ extract (estream_t stream, const char *dirname, tarinfo_t info,
 }
 
 
+/* Skip the data records of HDR in STREAM.  */
+static gpg_error_t
+skip_member (estream_t stream, tarinfo_t info, tar_header_t hdr)
+{
+  gpg_error_t err = 0;
+  char record[RECORDSIZE];
+  unsigned long long n;
+
+  for (n=0; !err && n < hdr->nrecords; n++)
+    {
+      err = read_record (stream, record);
+      if (!err)
+        info->nblocks++;
+    }
+  return err;
+}
+
+
+/* Extract the members selected by MEMBERS from the tarball STREAM
+ * into DIRNAME.  */
+static gpg_error_t
+extract_stream (estream_t stream, const char *dirname, tarinfo_t info,
+                char **members)
+{
+  gpg_error_t err;
+  tar_header_t header;
+
+  for (;;)
+    {
+      err = gpgtar_read_header (stream, info, &header);
+      if (err || header == NULL)
+        return err;
+
+      if (gpgtar_member_selected (members, header->name))
+        err = extract (stream, dirname, info, header);
+      else
+        err = skip_member (stream, info, header);
+      xfree (header);
+      if (err)
+        return err;
+    }
+}
+
+
+/* Extract the members selected by MEMBERS from the indexed archive FP
+ * into DIRNAME.  Only the segments with selected members are
+ * decrypted.  */
+static gpg_error_t
+extract_indexed (estream_t fp, gpgtar_index_t index, const char *dirname,
+                 tarinfo_t info, char **members)
+{
+  gpg_error_t err = 0;
+  estream_t plain;
+  tar_header_t hdr;
+  unsigned int seg;
+
+  for (seg=0; !err && seg < index->nsegments; seg++)
+    {
+      for (hdr = index->members; hdr; hdr = hdr->next)
+        if (hdr->segment == seg && gpgtar_member_selected (members, hdr->name))
+          break;
+      if (!hdr)
+        continue;  /* Nothing to extract from this segment.  */
+
+      err = gpgtar_decrypt_range (fp, index->segoff[seg], index->seglen[seg],
+                                  &plain);
+      if (err)
+        break;
+      err = extract_stream (plain, dirname, info, members);
+      es_fclose (plain);
+    }
+
+  return err;
+}
+
+
 /* Create a new directory to be used for extracting the tarball.
    Returns the name of the directory which must be freed by the
    caller.  In case of an error a diagnostic is printed and NULL
@@ -279,13 +631,15 @@ create_directory (const char *dirprefix)
 
 
 
+/* Extract the members selected by the NULL terminated array MEMBERS,
+ * or all members if MEMBERS is NULL, from the archive FILENAME.  */
 gpg_error_t
-gpgtar_extract (const char *filename, int decrypt)
+gpgtar_extract (const char *filename, int decrypt, char **members)
 {
   gpg_error_t err;
   estream_t stream;
   estream_t cipher_stream = NULL;
-  tar_header_t header = NULL;
+  gpgtar_index_t index = NULL;
   const char *dirprefix = NULL;
   char *dirname = NULL;
   struct tarinfo_s tarinfo_buffer;
@@ -312,7 +666,14 @@ gpgtar_extract (const char *filename, int decrypt)
   if (stream == es_stdin)
     es_set_binary (es_stdin);
 
-  if (decrypt)
+  if (decrypt && stream != es_stdin)
+    {
+      err = gpgtar_read_index (stream, &index);
+      if (err && gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+        goto leave;
+    }
+
+  if (decrypt && !index)
     {
       strlist_t arg;
       ccparray_t ccp;
@@ -386,22 +747,23 @@ gpgtar_extract (const char *filename, int decrypt)
   if (opt.verbose)
     log_info ("extracting to '%s/'\n", dirname);
 
-  for (;;)
-    {
-      err = gpgtar_read_header (stream, tarinfo, &header);
-      if (err || header == NULL)
-        goto leave;
-
-      err = extract (stream, dirname, tarinfo, header);
-      if (err)
-        goto leave;
-      xfree (header);
-      header = NULL;
-    }
+  if (!opt.dry_run)
+    start_write_behind ();
 
+  if (index)
+    err = extract_indexed (stream, index, dirname, tarinfo, members);
+  else
+    err = extract_stream (stream, dirname, tarinfo, members);
 
  leave:
-  xfree (header);
+  {
+    gpg_error_t err2 = stop_write_behind ();
+    if (!err)
+      err = err2;
+  }
+  xfree (copybuf);
+  copybuf = NULL;
+  gpgtar_release_index (index);
   xfree (dirname);
   if (stream != es_stdin)
     es_fclose (stream);
@@ -319,6 +319,24 @@ gpgtar_list (const char *filename, int decrypt)
   if (stream == es_stdin)
     es_set_binary (es_stdin);
 
+  if (decrypt && stream != es_stdin)
+    {
+      gpgtar_index_t index;
+
+      /* An indexed archive is listed without decrypting the data.  */
+      err = gpgtar_read_index (stream, &index);
+      if (!err)
+        {
+          for (header = index->members; header; header = header->next)
+            print_header (header, es_stdout);
+          header = NULL;
+          gpgtar_release_index (index);
+          goto leave;
+        }
+      else if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+        goto leave;
+    }
+
   if (decrypt)
     {
       strlist_t arg;
@@ -382,6 +400,117 @@ gpgtar_list (const char *filename, int decrypt)
   return err;
 }
 
+/* Release the INDEX.  */
+void
+gpgtar_release_index (gpgtar_index_t index)
+{
+  tar_header_t hdr;
+
+  if (!index)
+    return;
+  while ((hdr = index->members))
+    {
+      index->members = hdr->next;
+      xfree (hdr);
+    }
+  xfree (index->segoff);
+  xfree (index->seglen);
+  xfree (index);
+}
+
+
+/* Read the index of the archive FP and store it at R_INDEX.  Returns
+ * GPG_ERR_NOT_FOUND if FP is not an indexed archive.  */
+gpg_error_t
+gpgtar_read_index (estream_t fp, gpgtar_index_t *r_index)
+{
+  gpg_error_t err;
+  unsigned char trailer[INDEX_TRAILER_SIZE];
+  unsigned char buf[16];
+  char record[RECORDSIZE];
+  estream_t plain = NULL;
+  gpgtar_index_t index = NULL;
+  tar_header_t hdr, *tail;
+  struct tarinfo_s tarinfo;
+  unsigned int nmembers, i;
+
+  *r_index = NULL;
+  memset (&tarinfo, 0, sizeof tarinfo);
+
+  if (es_fseek (fp, -INDEX_TRAILER_SIZE, SEEK_END)
+      || es_fread (trailer, 1, sizeof trailer, fp) != sizeof trailer
+      || memcmp (trailer, INDEX_TRAILER_MAGIC, 16))
+    {
+      es_clearerr (fp);
+      es_fseek (fp, 0, SEEK_SET);
+      return gpg_error (GPG_ERR_NOT_FOUND);
+    }
+
+  err = gpgtar_decrypt_range (fp, buf64_to_u64 (trailer + 16),
+                              buf64_to_u64 (trailer + 24), &plain);
+  if (err)
+    goto leave;
+
+  if (es_fread (buf, 1, 16, plain) != 16 || memcmp (buf, INDEX_MAGIC, 8))
+    goto invalid;
+
+  index = xtrycalloc (1, sizeof *index);
+  if (!index)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  index->nsegments = buf32_to_uint (buf + 8);
+  nmembers = buf32_to_uint (buf + 12);
+  index->segoff = xtrycalloc (index->nsegments + 1, sizeof *index->segoff);
+  index->seglen = xtrycalloc (index->nsegments + 1, sizeof *index->seglen);
+  if (!index->segoff || !index->seglen)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (i=0; i < index->nsegments; i++)
+    {
+      if (es_fread (buf, 1, 16, plain) != 16)
+        goto invalid;
+      index->segoff[i] = buf64_to_u64 (buf);
+      index->seglen[i] = buf64_to_u64 (buf + 8);
+    }
+
+  tail = &index->members;
+  for (i=0; i < nmembers; i++)
+    {
+      if (es_fread (buf, 1, 4, plain) != 4
+          || es_fread (record, 1, RECORDSIZE, plain) != RECORDSIZE)
+        goto invalid;
+      hdr = parse_header (record, es_fname_get (fp), &tarinfo);
+      if (!hdr)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      *tail = hdr;
+      tail = &hdr->next;
+      hdr->segment = buf32_to_uint (buf);
+      if (hdr->segment >= index->nsegments)
+        goto invalid;
+    }
+
+  *r_index = index;
+  index = NULL;
+  goto leave;
+
+ invalid:
+  err = gpg_error (GPG_ERR_INV_DATA);
+  log_error ("%s: invalid index: %s\n", es_fname_get (fp), gpg_strerror (err));
+
+ leave:
+  gpgtar_release_index (index);
+  es_fclose (plain);
+  return err;
+}
+
+
 gpg_error_t
 gpgtar_read_header (estream_t stream, tarinfo_t info, tar_header_t *r_header)
 {
@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <npth.h>
 
 #define INCLUDED_BY_MAIN_MODULE 1
 #include "../common/util.h"
@@ -43,6 +44,8 @@
 #include "../common/openpgpdefs.h"
 #include "../common/init.h"
 #include "../common/strlist.h"
+#include "../common/exectool.h"
+#include "../common/ccparray.h"
 
 #include "gpgtar.h"
 
@@ -75,6 +78,7 @@ enum cmd_and_opt_values
     oCMS,
     oSetFilename,
     oNull,
+    oIndex,
 
     /* Compatibility with gpg-zip.  */
     oGpgArgs,
@@ -111,6 +115,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_s (oSetFilename, "set-filename", "@"),
   ARGPARSE_s_n (oOpenPGP, "openpgp", "@"),
   ARGPARSE_s_n (oCMS, "cms", "@"),
+  ARGPARSE_s_n (oIndex, "index", N_("create an indexed archive")),
 
   ARGPARSE_group (302, N_("@\nTar options:\n ")),
 
@@ -323,6 +328,7 @@ parse_arguments (gpgrt_argparse_t *pargs, gpgrt_opt_t *popts)
         case oNoVerbose: opt.verbose = 0; break;
         case oFilesFrom: files_from = pargs->r.ret_str; break;
         case oNull: null_names = 1; break;
+        case oIndex: opt.index = 1; break;
 
 	case aList:
         case aDecrypt:
@@ -433,6 +439,10 @@ main (int argc, char **argv)
 
   log_assert (sizeof (struct ustar_raw_header) == 512);
 
+  /* Init threading which is used to write the extracted files.  */
+  npth_init ();
+  gpgrt_set_syscall_clamp (npth_unprotect, npth_protect);
+
   /* Parse the command line. */
   pargs.argc  = &argc;
   pargs.argv  = &argv;
@@ -463,6 +473,7 @@ main (int argc, char **argv)
 
   if (opt.verbose > 1)
     opt.debug_level = 1024;
+  gnupg_exec_tool_set_debug (opt.debug_level);
 
   switch (cmd)
     {
@@ -496,14 +507,14 @@ main (int argc, char **argv)
       break;
 
     case aDecrypt:
-      if (argc != 1)
+      if (argc < 1)
         gpgrt_usage (1);
       if (opt.outfile)
         log_info ("note: ignoring option --output\n");
       if (files_from)
         log_info ("note: ignoring option --files-from\n");
       fname = argc ? *argv : NULL;
-      err = gpgtar_extract (fname, !skip_crypto);
+      err = gpgtar_extract (fname, !skip_crypto, argc > 1? argv+1 : NULL);
       if (err && log_get_errorcount (0) == 0)
         log_error ("extracting archive failed: %s\n", gpg_strerror (err));
       break;
@@ -547,6 +558,151 @@ read_record (estream_t stream, void *record)
 }
 
 
+/* Read NRECORDS records of size RECORDSIZE from STREAM into BUFFER.  */
+gpg_error_t
+read_records (estream_t stream, void *buffer, unsigned long long nrecords)
+{
+  gpg_error_t err;
+  size_t nread, nbytes;
+
+  nbytes = nrecords * RECORDSIZE;
+  nread = es_fread (buffer, 1, nbytes, stream);
+  if (nread != nbytes)
+    {
+      err = gpg_error_from_syserror ();
+      if (es_ferror (stream))
+        log_error ("error reading '%s': %s\n",
+                   es_fname_get (stream), gpg_strerror (err));
+      else
+        log_error ("error reading '%s': premature EOF "
+                   "(size of last record: %zu)\n",
+                   es_fname_get (stream), nread % RECORDSIZE);
+    }
+  else
+    err = 0;
+
+  return err;
+}
+
+
+/* Decrypt the LENGTH bytes at OFFSET of FP, which is one of the
+ * OpenPGP messages of an indexed archive.  On success a memory stream
+ * with the plaintext is stored at R_PLAIN.  */
+gpg_error_t
+gpgtar_decrypt_range (estream_t fp, unsigned long long offset,
+                      unsigned long long length, estream_t *r_plain)
+{
+  gpg_error_t err = 0;
+  estream_t cipher_stream;
+  estream_t plain = NULL;
+  strlist_t arg;
+  ccparray_t ccp;
+  const char **argv = NULL;
+  char buffer[4096];
+  size_t n;
+
+  *r_plain = NULL;
+
+  cipher_stream = es_fopenmem (0, "rwb");
+  if (!cipher_stream)
+    return gpg_error_from_syserror ();
+
+  if (es_fseeko (fp, offset, SEEK_SET))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error seeking in '%s': %s\n",
+                 es_fname_get (fp), gpg_strerror (err));
+      goto leave;
+    }
+  while (length)
+    {
+      n = length > sizeof buffer? sizeof buffer : length;
+      if (es_fread (buffer, 1, n, fp) != n)
+        {
+          err = es_ferror (fp)? gpg_error_from_syserror ()
+                              : gpg_error (GPG_ERR_TRUNCATED);
+          log_error ("error reading '%s': %s\n",
+                     es_fname_get (fp), gpg_strerror (err));
+          goto leave;
+        }
+      if (es_fwrite (buffer, 1, n, cipher_stream) != n)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      length -= n;
+    }
+  if (es_fseek (cipher_stream, 0, SEEK_SET))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  plain = es_fopenmem (0, "rwb");
+  if (!plain)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  ccparray_init (&ccp, 0);
+  ccparray_put (&ccp, "--decrypt");
+  for (arg = opt.gpg_arguments; arg; arg = arg->next)
+    ccparray_put (&ccp, arg->d);
+  ccparray_put (&ccp, NULL);
+  argv = ccparray_get (&ccp, NULL);
+  if (!argv)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  err = gnupg_exec_tool_stream (opt.gpg_program, argv,
+                                cipher_stream, NULL, plain, NULL, NULL);
+  if (err)
+    goto leave;
+
+  if (es_fseek (plain, 0, SEEK_SET))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  *r_plain = plain;
+  plain = NULL;
+
+ leave:
+  xfree (argv);
+  es_fclose (plain);
+  es_fclose (cipher_stream);
+  return err;
+}
+
+
+/* Return true if the member NAME is selected by the NULL terminated
+ * array of names MEMBERS.  A name selects the member of that name
+ * and, if it is a directory, everything below it.  If MEMBERS is NULL
+ * all members are selected.  */
+int
+gpgtar_member_selected (char **members, const char *name)
+{
+  size_t n;
+
+  if (!members)
+    return 1;
+
+  for (; *members; members++)
+    {
+      n = strlen (*members);
+      while (n > 1 && (*members)[n-1] == '/')
+        n--;
+      if (!strncmp (name, *members, n)
+          && (!name[n] || name[n] == '/'))
+        return 1;
+    }
+  return 0;
+}
+
+
 /* Write the RECORD of size RECORDSIZE to STREAM.  FILENAME is the
    name of the file used for diagnostics.  */
 gpg_error_t
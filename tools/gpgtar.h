@@ -22,6 +22,7 @@
 
 #include "../common/util.h"
 #include "../common/strlist.h"
+#include "../common/host2net.h"
 
 
 /* We keep all global options in the structure OPT.  */
@@ -40,6 +41,7 @@ struct
   int symmetric;
   const char *filename;
   const char *directory;
+  int index;
 } opt;
 
 
@@ -121,25 +123,78 @@ struct tar_header_s
 
   unsigned long long nrecords; /* Number of data records.  */
 
+  unsigned int segment;     /* The segment of an indexed archive.  */
+
   char name[1];             /* Filename (dynamically extended).  */
 };
 
 
+/* An indexed archive (see --index) consists of one OpenPGP message
+ * for each segment, each being a complete tarball with some of the
+ * members, followed by an OpenPGP message with the index and the
+ * trailer.  The trailer is INDEX_TRAILER_MAGIC followed by the offset
+ * and the length of the index message as 64 bit big endian values.
+ * The plaintext of the index is INDEX_MAGIC, the number of segments
+ * and the number of members as 32 bit values, the offset and length
+ * of each segment as 64 bit values, and for each member the segment
+ * number as a 32 bit value and its header record.  */
+#define INDEX_TRAILER_MAGIC "GnuPG-tar-index1"
+#define INDEX_TRAILER_SIZE  32
+#define INDEX_MAGIC         "GPGTARIX"
+
+/* The size of the plaintext after which a new segment is started.  */
+#define INDEX_SEGMENT_SIZE  (64 * 1024 * 1024)
+
+/* The parsed index of an archive.  */
+struct gpgtar_index_s
+{
+  unsigned int nsegments;
+  unsigned long long *segoff;   /* The offsets of the segments.  */
+  unsigned long long *seglen;   /* The lengths of the segments.  */
+  tar_header_t members;         /* The list of members.  */
+};
+typedef struct gpgtar_index_s *gpgtar_index_t;
+
+
+static inline void
+u64tobuf (void *buffer, unsigned long long val)
+{
+  ulongtobuf (buffer, (u32)(val >> 32));
+  ulongtobuf ((unsigned char *)buffer + 4, (u32)val);
+}
+
+static inline unsigned long long
+buf64_to_u64 (const void *buffer)
+{
+  return (((unsigned long long)buf32_to_u32 (buffer) << 32)
+          | buf32_to_u32 ((const unsigned char *)buffer + 4));
+}
+
+
 /*-- gpgtar.c --*/
 gpg_error_t read_record (estream_t stream, void *record);
+gpg_error_t read_records (estream_t stream, void *buffer,
+                          unsigned long long nrecords);
 gpg_error_t write_record (estream_t stream, const void *record);
+gpg_error_t gpgtar_decrypt_range (estream_t fp, unsigned long long offset,
+                                  unsigned long long length,
+                                  estream_t *r_plain);
+int gpgtar_member_selected (char **members, const char *name);
 
 /*-- gpgtar-create.c --*/
 gpg_error_t gpgtar_create (char **inpattern, int encrypt, int sign);
 
 /*-- gpgtar-extract.c --*/
-gpg_error_t gpgtar_extract (const char *filename, int decrypt);
+gpg_error_t gpgtar_extract (const char *filename, int decrypt,
+                            char **members);
 
 /*-- gpgtar-list.c --*/
 gpg_error_t gpgtar_list (const char *filename, int decrypt);
 gpg_error_t gpgtar_read_header (estream_t stream, tarinfo_t info,
                                 tar_header_t *r_header);
 void gpgtar_print_header (tar_header_t header, estream_t out);
+gpg_error_t gpgtar_read_index (estream_t fp, gpgtar_index_t *r_index);
+void gpgtar_release_index (gpgtar_index_t index);
 
 
 #endif /*GPGTAR_H*/
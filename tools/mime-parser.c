@@ -671,8 +671,132 @@ process_part_data (mime_parser_t ctx, char *line, size_t *length)
 }
 
 
+/* Process the LINE of LENGTH bytes using the RFC822 parser MSG.  LINE
+ * must be writable and Nul terminated at LINE[LENGTH]; it does not
+ * include the line ending.  */
+static gpg_error_t
+process_line (mime_parser_t ctx, rfc822parse_t msg, char *line, size_t length)
+{
+  gpg_error_t err;
+
+  ctx->err = 0;
+  if (rfc822parse_insert (msg, line, length))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("mail parser failed: %s", gpg_strerror (err));
+      return err;
+    }
+  if (ctx->err)
+    {
+      /* Error from a callback detected.  */
+      return ctx->err;
+    }
+
+
+  /* Debug output.  Note that the boundary is shown before n_skip
+   * is evaluated.  */
+  if (ctx->show.boundary)
+    {
+      if (ctx->debug)
+        log_debug ("# Boundary: %s\n", line);
+      ctx->show.boundary = 0;
+    }
+  if (ctx->show.n_skip)
+    ctx->show.n_skip--;
+  else if (ctx->show.data)
+    {
+      if (ctx->show.as_note)
+        {
+          if (ctx->verbose)
+            log_debug ("# Note: %s\n", line);
+          ctx->show.as_note = 0;
+        }
+      else if (ctx->debug)
+        log_debug ("# Data: %s\n", line);
+    }
+  else if (ctx->show.header && ctx->verbose)
+    log_debug ("# Header: %s\n", line);
+
+  if (ctx->pgpmime == PGPMIME_IN_ENCVERSION)
+    {
+      trim_trailing_spaces (line);
+      if (!*line)
+        ;  /* Skip empty lines.  */
+      else if (!strcmp (line, "Version: 1"))
+        ctx->pgpmime = PGPMIME_WAIT_ENCDATA;
+      else
+        {
+          log_error ("invalid PGP/MIME structure;"
+                     " garbage in pgp-encrypted part ('%s')\n", line);
+          ctx->pgpmime = PGPMIME_INVALID;
+        }
+    }
+  else if (ctx->pgpmime == PGPMIME_IN_ENCDATA)
+    {
+      if (ctx->collect_encrypted)
+        {
+          err = ctx->collect_encrypted (ctx->cookie, line);
+          if (!err)
+            err = ctx->collect_encrypted (ctx->cookie, "\r\n");
+          if (err)
+            return err;
+        }
+    }
+  else if (ctx->pgpmime == PGPMIME_GOT_ENCDATA)
+    {
+      ctx->pgpmime = PGPMIME_NONE;
+      if (ctx->collect_encrypted)
+        ctx->collect_encrypted (ctx->cookie, NULL);
+    }
+  else if (ctx->pgpmime == PGPMIME_IN_SIGNEDDATA)
+    {
+      /* If we are processing signed data, store the signed data.
+       * We need to delay the hashing of the CR/LF because the
+       * last line ending belongs to the next boundary.  This is
+       * the reason why we can't use the PGPMIME state as a
+       * condition.  */
+      if (ctx->debug)
+        log_debug ("# hashing %s'%s'\n",
+                   ctx->delay_hashing? "CR,LF+":"", line);
+      if (ctx->collect_signeddata)
+        {
+          if (ctx->delay_hashing)
+            ctx->collect_signeddata (ctx->cookie, "\r\n");
+          ctx->collect_signeddata (ctx->cookie, line);
+        }
+      ctx->delay_hashing = 1;
+
+      err = process_part_data (ctx, line, &length);
+      if (err)
+        return err;
+    }
+  else if (ctx->pgpmime == PGPMIME_IN_SIGNATURE)
+    {
+      if (ctx->collect_signeddata)
+        {
+          ctx->collect_signature (ctx->cookie, line);
+          ctx->collect_signature (ctx->cookie, "\r\n");
+        }
+    }
+  else if (ctx->pgpmime == PGPMIME_GOT_SIGNATURE)
+    {
+      ctx->pgpmime = PGPMIME_NONE;
+      if (ctx->collect_signeddata)
+        ctx->collect_signature (ctx->cookie, NULL);
+    }
+  else
+    {
+      err = process_part_data (ctx, line, &length);
+      if (err)
+        return err;
+    }
+
+  return 0;
+}
+
+
 /* Read and parse a message from FP and call the appropriate
- * callbacks.  */
+ * callbacks.  Only one line is held in memory at a time.  */
 gpg_error_t
 mime_parser_parse (mime_parser_t ctx, estream_t fp)
 {
@@ -709,118 +833,79 @@ mime_parser_parse (mime_parser_t ctx, estream_t fp)
       if (length && line[length - 1] == '\r')
 	line[--length] = 0;
 
-      ctx->err = 0;
-      if (rfc822parse_insert (msg, line, length))
-        {
-          err = gpg_error_from_syserror ();
-          log_error ("mail parser failed: %s", gpg_strerror (err));
-          goto leave;
-        }
-      if (ctx->err)
-        {
-          /* Error from a callback detected.  */
-          err = ctx->err;
-          goto leave;
-        }
+      err = process_line (ctx, msg, line, length);
+      if (err)
+        goto leave;
+    }
 
+  rfc822parse_close (msg);
+  msg = NULL;
+  err = 0;
 
-      /* Debug output.  Note that the boundary is shown before n_skip
-       * is evaluated.  */
-      if (ctx->show.boundary)
-        {
-          if (ctx->debug)
-            log_debug ("# Boundary: %s\n", line);
-          ctx->show.boundary = 0;
-        }
-      if (ctx->show.n_skip)
-        ctx->show.n_skip--;
-      else if (ctx->show.data)
-        {
-          if (ctx->show.as_note)
-            {
-              if (ctx->verbose)
-                log_debug ("# Note: %s\n", line);
-              ctx->show.as_note = 0;
-            }
-          else if (ctx->debug)
-            log_debug ("# Data: %s\n", line);
-        }
-      else if (ctx->show.header && ctx->verbose)
-        log_debug ("# Header: %s\n", line);
+ leave:
+  rfc822parse_cancel (msg);
+  return err;
+}
 
-      if (ctx->pgpmime == PGPMIME_IN_ENCVERSION)
-        {
-          trim_trailing_spaces (line);
-          if (!*line)
-            ;  /* Skip empty lines.  */
-          else if (!strcmp (line, "Version: 1"))
-            ctx->pgpmime = PGPMIME_WAIT_ENCDATA;
-          else
-            {
-              log_error ("invalid PGP/MIME structure;"
-                         " garbage in pgp-encrypted part ('%s')\n", line);
-              ctx->pgpmime = PGPMIME_INVALID;
-            }
-        }
-      else if (ctx->pgpmime == PGPMIME_IN_ENCDATA)
-        {
-          if (ctx->collect_encrypted)
-            {
-              err = ctx->collect_encrypted (ctx->cookie, line);
-              if (!err)
-                err = ctx->collect_encrypted (ctx->cookie, "\r\n");
-              if (err)
-                goto leave;
-            }
-        }
-      else if (ctx->pgpmime == PGPMIME_GOT_ENCDATA)
-        {
-          ctx->pgpmime = PGPMIME_NONE;
-          if (ctx->collect_encrypted)
-            ctx->collect_encrypted (ctx->cookie, NULL);
-        }
-      else if (ctx->pgpmime == PGPMIME_IN_SIGNEDDATA)
-        {
-          /* If we are processing signed data, store the signed data.
-           * We need to delay the hashing of the CR/LF because the
-           * last line ending belongs to the next boundary.  This is
-           * the reason why we can't use the PGPMIME state as a
-           * condition.  */
-          if (ctx->debug)
-            log_debug ("# hashing %s'%s'\n",
-                       ctx->delay_hashing? "CR,LF+":"", line);
-          if (ctx->collect_signeddata)
-            {
-              if (ctx->delay_hashing)
-                ctx->collect_signeddata (ctx->cookie, "\r\n");
-              ctx->collect_signeddata (ctx->cookie, line);
-            }
-          ctx->delay_hashing = 1;
 
-          err = process_part_data (ctx, line, &length);
-          if (err)
-            goto leave;
-        }
-      else if (ctx->pgpmime == PGPMIME_IN_SIGNATURE)
-        {
-          if (ctx->collect_signeddata)
-            {
-              ctx->collect_signature (ctx->cookie, line);
-              ctx->collect_signature (ctx->cookie, "\r\n");
-            }
-        }
-      else if (ctx->pgpmime == PGPMIME_GOT_SIGNATURE)
+/* Parse the message in BUFFER of LENGTH bytes and call the
+ * appropriate callbacks.  In contrast to mime_parser_parse no line
+ * is copied: the line endings are replaced by Nuls in place and the
+ * data passed to the callbacks points into BUFFER.  Decoded parts are
+ * also decoded in place; thus BUFFER is modified and should not be
+ * used after this call.  Only a last line without a LF is copied.  */
+gpg_error_t
+mime_parser_parse_mem (mime_parser_t ctx, char *buffer, size_t length)
+{
+  gpg_error_t err;
+  rfc822parse_t msg = NULL;
+  unsigned int lineno = 0;
+  char *line, *endp;
+  size_t linelen;
+
+  msg = rfc822parse_open (parse_message_cb, ctx);
+  if (!msg)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("can't open mail parser: %s", gpg_strerror (err));
+      goto leave;
+    }
+
+  while (length)
+    {
+      line = buffer;
+      endp = memchr (buffer, '\n', length);
+      if (endp)
         {
-          ctx->pgpmime = PGPMIME_NONE;
-          if (ctx->collect_signeddata)
-            ctx->collect_signature (ctx->cookie, NULL);
+          linelen = endp - line;
+          buffer = endp + 1;
+          length -= linelen + 1;
+          *endp = 0;
         }
       else
         {
-          err = process_part_data (ctx, line, &length);
-          if (err)
-            goto leave;
+          /* The last line has no LF and we can't terminate it in
+           * place.  */
+          linelen = length;
+          if (linelen >= sizeof ctx->line)
+            linelen = sizeof ctx->line - 1;
+          log_error ("mail parser detected too long or"
+                     " non terminated last line (lnr=%u)\n", lineno+1);
+          memcpy (ctx->line, line, linelen);
+          line = ctx->line;
+          line[linelen] = 0;
+          length = 0;
         }
+
+      lineno++;
+      if (lineno == 1 && linelen >= 5 && !strncmp (line, "From ", 5))
+        continue;  /* We better ignore a leading From line. */
+      if (linelen && line[linelen - 1] == '\r')
+        line[--linelen] = 0;
+
+      err = process_line (ctx, msg, line, linelen);
+      if (err)
+        goto leave;
     }
 
   rfc822parse_close (msg);
@@ -51,6 +51,8 @@ void mime_parser_set_collect_signature (mime_parser_t ctx,
                                                             const char *data));
 
 gpg_error_t mime_parser_parse (mime_parser_t ctx, estream_t fp);
+gpg_error_t mime_parser_parse_mem (mime_parser_t ctx,
+                                   char *buffer, size_t length);
 
 
 rfc822parse_t mime_parser_rfc822parser (mime_parser_t ctx);
@@ -418,6 +418,8 @@ wks_receive (estream_t fp,
   receive_ctx_t ctx;
   mime_parser_t parser;
   estream_t plaintext = NULL;
+  void *buffer;
+  size_t buflen;
   int c;
   unsigned int flags = 0;
 
@@ -465,7 +467,16 @@ wks_receive (estream_t fp,
         es_rewind (ctx->signeddata);
       if (ctx->signature)
         es_rewind (ctx->signature);
-      err = mime_parser_parse (parser, plaintext);
+      /* The plaintext is a memory stream; parse its buffer directly
+       * instead of copying it line by line.  */
+      if (es_fclose_snatch (plaintext, &buffer, &buflen))
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      plaintext = NULL;
+      err = mime_parser_parse_mem (parser, buffer, buflen);
+      es_free (buffer);
       if (err)
         return err;
     }